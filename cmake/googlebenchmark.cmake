@@ -0,0 +1,35 @@
+# Copyright (c)  2026  agent (agent@local)
+# See ../LICENSE for clarification regarding multiple authors
+
+function(download_googlebenchmark)
+  if(CMAKE_VERSION VERSION_LESS 3.11)
+    # FetchContent is available since 3.11,
+    # we've copied it to ${CMAKE_SOURCE_DIR}/cmake/Modules
+    # so that it can be used in lower CMake versions.
+    message(STATUS "Use FetchContent provided by k2")
+    list(APPEND CMAKE_MODULE_PATH ${CMAKE_SOURCE_DIR}/cmake/Modules)
+  endif()
+
+  include(FetchContent)
+
+  set(BENCHMARK_ENABLE_TESTING OFF CACHE BOOL "" FORCE)
+  set(BENCHMARK_ENABLE_GTEST_TESTS OFF CACHE BOOL "" FORCE)
+  set(BENCHMARK_ENABLE_INSTALL OFF CACHE BOOL "" FORCE)
+
+  FetchContent_Declare(googlebenchmark
+    GIT_REPOSITORY    https://github.com/google/benchmark.git
+    GIT_TAG           v1.5.2
+  )
+
+  FetchContent_GetProperties(googlebenchmark)
+  if(NOT googlebenchmark_POPULATED)
+    message(STATUS "Downloading googlebenchmark")
+    FetchContent_Populate(googlebenchmark)
+  endif()
+  message(STATUS "googlebenchmark is downloaded to ${googlebenchmark_SOURCE_DIR}")
+  message(STATUS "googlebenchmark's binary dir is ${googlebenchmark_BINARY_DIR}")
+
+  add_subdirectory(${googlebenchmark_SOURCE_DIR} ${googlebenchmark_BINARY_DIR} EXCLUDE_FROM_ALL)
+endfunction()
+
+download_googlebenchmark()
@@ -0,0 +1,96 @@
+/**
+ * @brief
+ * algorithms
+ *
+ * @copyright
+ * Copyright (c)  2026  agent (agent@local)
+ *
+ * @copyright
+ * See LICENSE for clarification regarding multiple authors
+ */
+
+#include "k2/csrc/algorithms.h"
+#include "k2/csrc/array_ops.h"
+
+namespace k2 {
+
+void Renumbering::Init(ContextPtr c, int32_t num_old_elems) {
+  K2_CHECK_GE(num_old_elems, 0);
+  c_ = c;
+  num_old_elems_ = num_old_elems;
+  num_new_elems_ = -1;
+  // The exclusive-sum of keep_ into old2new_, which has one more element, may
+  // read one element past the end of keep_, so make sure it's allocated.
+  Array1<char> keep(c, num_old_elems + 1);
+  keep_ = (num_old_elems == 0 ? Array1<char>(c, 0)
+                              : keep.Range(0, num_old_elems));
+  new2old_ = Array1<int32_t>();
+  old2new_ = Array1<int32_t>();
+}
+
+void Renumbering::ComputeOld2New() {
+  K2_CHECK(c_ != nullptr) << "Init() has not been called";
+  if (num_old_elems_ == 0) {
+    old2new_ = Array1<int32_t>(c_, 1, 0);
+    num_new_elems_ = 0;
+  } else {
+    old2new_ = Array1<int32_t>(c_, num_old_elems_ + 1);
+    num_new_elems_ = ExclusiveSumWithTotal(keep_, &old2new_);
+  }
+}
+
+void ComputeNumNewElems(const std::vector<Renumbering *> &renumberings) {
+  if (renumberings.empty()) return;
+  ContextPtr c = renumberings[0]->c_;
+  K2_CHECK(c != nullptr) << "Init() has not been called";
+  HostReadback<int32_t> readback(c);
+  std::vector<int32_t> indexes(renumberings.size(), -1);
+  for (std::size_t i = 0; i != renumberings.size(); ++i) {
+    Renumbering *r = renumberings[i];
+    K2_CHECK(r->c_ != nullptr) << "Init() has not been called";
+    K2_CHECK(r->c_->IsCompatible(*c));
+    if (r->num_new_elems_ >= 0) continue;
+    int32_t num_old_elems = r->num_old_elems_;
+    if (num_old_elems == 0) {
+      r->ComputeOld2New();
+      continue;
+    }
+    r->old2new_ = Array1<int32_t>(c, num_old_elems + 1);
+    ExclusiveSum(c, num_old_elems + 1, r->keep_.Data(), r->old2new_.Data());
+    indexes[i] = readback.Add(r->old2new_, num_old_elems);
+  }
+  readback.Fetch();
+  for (std::size_t i = 0; i != renumberings.size(); ++i)
+    if (indexes[i] >= 0) renumberings[i]->num_new_elems_ = readback[indexes[i]];
+}
+
+Array1<int32_t> Renumbering::Old2New(bool include_final_value /*= true*/) {
+  if (num_new_elems_ < 0) ComputeOld2New();
+  if (include_final_value) return old2new_;
+  if (num_old_elems_ == 0) return Array1<int32_t>(c_, 0);
+  return old2new_.Range(0, num_old_elems_);
+}
+
+Array1<int32_t> Renumbering::New2Old(bool include_final_value /*= true*/) {
+  if (num_new_elems_ < 0) ComputeOld2New();
+  if (new2old_.Dim() == 0) {
+    int32_t num_old_elems = num_old_elems_, num_new_elems = num_new_elems_;
+    new2old_ = Array1<int32_t>(c_, num_new_elems + 1);
+    const int32_t *old2new_data = old2new_.Data();
+    int32_t *new2old_data = new2old_.Data();
+    auto lambda_set_new2old = [=] __host__ __device__(int32_t i) -> void {
+      // 0 <= i <= num_old_elems; element i is kept if old2new increases
+      // after it.
+      if (i == num_old_elems)
+        new2old_data[num_new_elems] = num_old_elems;
+      else if (old2new_data[i + 1] > old2new_data[i])
+        new2old_data[old2new_data[i]] = i;
+    };
+    Eval(c_, num_old_elems + 1, lambda_set_new2old);
+  }
+  if (include_final_value) return new2old_;
+  if (num_new_elems_ == 0) return Array1<int32_t>(c_, 0);
+  return new2old_.Range(0, num_new_elems_);
+}
+
+}  // namespace k2
@@ -12,71 +12,111 @@
 #ifndef K2_CSRC_ALGORITHMS_H_
 #define K2_CSRC_ALGORITHMS_H_
 
+#include <vector>
+
 #include "k2/csrc/array.h"
+#include "k2/csrc/context.h"
 
 //  this really contains various utilities that are useful for k2 algorithms.
 namespace k2 {
 
+/*
+  Renumbering is for when we want to keep a subset of some elements (e.g. the
+  arcs of a lattice that survive pruning) and renumber them.  The user writes
+  to Keep() (1 for the elements to keep, 0 otherwise), or supplies a predicate
+  to the constructor, and then asks for the mappings between old and new
+  indexes.  These are computed on first use from a single exclusive-sum of
+  Keep(), which is also when we find (on the host) NumNewElems().
+ */
 class Renumbering {
  public:
   Renumbering() = default;
-  explicit Renumbering(int32_t num_old_elems) {
-    // TODO(haowen)
-    K2_LOG(FATAL) << "Not Implemeted";
-  }
+  Renumbering(ContextPtr c, int32_t num_old_elems) { Init(c, num_old_elems); }
+
+  /*
+    Creates a Renumbering with Keep()[i] = keep(i) for
+    0 <= i < num_old_elems.  `keep` must be a __host__ __device__ lambda (or
+    other callable) taking the old index and returning bool, e.g. to prune
+    arcs by score:
 
-  void Init(int32_t num_old_elems) {
-    // TODO(haowen)
-    K2_LOG(FATAL) << "Not Implemeted";
+       const float *scores_data = ...;
+       auto lambda_keep = [=] __host__ __device__(int32_t i) -> bool {
+         return scores_data[i] >= cutoff;
+       };
+       Renumbering renumbering(c, num_arcs, lambda_keep);
+   */
+  template <typename LambdaT>
+  Renumbering(ContextPtr c, int32_t num_old_elems, LambdaT &keep) {
+    Init(c, num_old_elems);
+    char *keep_data = keep_.Data();
+    auto lambda_set_keep = [=] __host__ __device__(int32_t i) -> void {
+      keep_data[i] = (keep(i) ? 1 : 0);
+    };
+    Eval(c, num_old_elems, lambda_set_keep);
   }
 
-  int32_t NumOldElems();
-  int32_t NumNewElems();
+  // Sets up *this for `num_old_elems` elements whose Keep() values are not
+  // yet set.  Any previously computed mappings are discarded.
+  void Init(ContextPtr c, int32_t num_old_elems);
 
-  Array1<char> &Keep();  // dim is NumOldElems().  0 if not kept, 1 if kept
-                         // (user will write to here).
+  int32_t NumOldElems() const { return num_old_elems_; }
+  // Requires Keep() to have been populated; may wait for the device the
+  // first time.
+  int32_t NumNewElems() {
+    if (num_new_elems_ < 0) ComputeOld2New();
+    return num_new_elems_;
+  }
+
+  Array1<char> &Keep() { return keep_; }  // dim is NumOldElems().  0 if not
+                                           // kept, 1 if kept (user will write
+                                           // to here).
 
   /* Return a mapping from new index to old index.  This is created on
      demand (must only be called after the Keep() array has been populated).
 
        @param include_final_value   If true the dimension of the result
-                        will be NumNewElems(), the number of new elements
-                        in the renumbering (the last element will be
-                        NumOldElems().  If false, the last element
+                        will be NumNewElems() + 1, and the last element will
+                        be NumOldElems().  If false, the last element
                         is omitted.
        @return    Returns an array mapping the new indexes to the old
                  (pre-renumbering) indexes.
   */
-  Array1<int32_t> New2Old(bool include_final_value = true) {
-    // TODO(haowen)
-    K2_LOG(FATAL) << "Not Implemeted";
-    return Array1<int32_t>();
-  }
+  Array1<int32_t> New2Old(bool include_final_value = true);
 
   /* Return a mapping from old index to new index (this is the exclusive-sum of
      `Keep()`).  This is created on demand (must only be called after the Keep()
      array has been populated).
 
        @param include_final_value   If true the dimension of the result
-                      will be NumNewElems(), the number of new elements
-                      in the renumbering (the last element will be
-                      NumOldElems().  If false, the last element
-                      is omitted.
-       @return    Returns an array mapping the new indexes to the old
-                 (pre-renumbering) indexes.
+                      will be NumOldElems() + 1, and the last element will be
+                      NumNewElems().  If false, the last element is omitted.
+       @return    Returns an array mapping the old indexes to the new
+                 (post-renumbering) indexes; old elements that are not kept
+                 map to the new index of the next kept element.
   */
-  Array1<int32_t> Old2New(bool include_final_value = true) {
-    // TODO(haowen)
-    K2_LOG(FATAL) << "Not Implemeted";
-    return Array1<int32_t>();
-  }
+  Array1<int32_t> Old2New(bool include_final_value = true);
 
  private:
+  friend void ComputeNumNewElems(
+      const std::vector<Renumbering *> &renumberings);
+  void ComputeOld2New();
+
+  ContextPtr c_;
+  int32_t num_old_elems_ = 0;
+  int32_t num_new_elems_ = -1;  // -1 if not yet known
   Array1<char> keep_;
-  Array1<int32_t> new2old_;
-  Array1<int32_t> old2new_;
+  Array1<int32_t> new2old_;  // with the final value; empty if not computed
+  Array1<int32_t> old2new_;  // with the final value; empty if not computed
 };
 
+/*
+  Does the same as calling NumNewElems() on each of `renumberings`, whose
+  Keep() arrays must have been populated, but waits for the device only once
+  (see HostReadback).  Use this when several renumberings are needed at the
+  same point, e.g. of the states and of the arcs of a lattice being pruned.
+ */
+void ComputeNumNewElems(const std::vector<Renumbering *> &renumberings);
+
 }  // namespace k2
 
 #endif  // K2_CSRC_ALGORITHMS_H_
@@ -0,0 +1,112 @@
+/**
+ * @brief
+ * algorithms_test
+ *
+ * @copyright
+ * Copyright (c)  2026  agent (agent@local)
+ *
+ * @copyright
+ * See LICENSE for clarification regarding multiple authors
+ */
+
+#include <gtest/gtest.h>
+
+#include <vector>
+
+#include "k2/csrc/algorithms.h"
+#include "k2/csrc/array.h"
+#include "k2/csrc/context.h"
+
+namespace k2 {
+
+static void CheckArray(const Array1<int32_t> &array,
+                       const std::vector<int32_t> &expected) {
+  Array1<int32_t> cpu_array = array.To(GetCpuContext());
+  ASSERT_EQ(cpu_array.Dim(), static_cast<int32_t>(expected.size()));
+  for (int32_t i = 0; i < cpu_array.Dim(); ++i)
+    EXPECT_EQ(cpu_array[i], expected[i]);
+}
+
+template <DeviceType d>
+void TestRenumbering() {
+  ContextPtr cpu = GetCpuContext();
+  ContextPtr context = (d == kCpu ? cpu : GetCudaContext());
+  {
+    // Keep() written by the user.
+    std::vector<char> keep_vec = {1, 0, 0, 1, 1, 0};
+    Renumbering renumbering(context, 6);
+    Array1<char> keep(context, keep_vec);
+    char *keep_data = renumbering.Keep().Data();
+    const char *src_data = keep.Data();
+    auto lambda_copy = [=] __host__ __device__(int32_t i) -> void {
+      keep_data[i] = src_data[i];
+    };
+    Eval(context, 6, lambda_copy);
+    EXPECT_EQ(renumbering.NumOldElems(), 6);
+    EXPECT_EQ(renumbering.NumNewElems(), 3);
+    CheckArray(renumbering.Old2New(), {0, 1, 1, 1, 2, 3, 3});
+    CheckArray(renumbering.Old2New(false), {0, 1, 1, 1, 2, 3});
+    CheckArray(renumbering.New2Old(), {0, 3, 4, 6});
+    CheckArray(renumbering.New2Old(false), {0, 3, 4});
+  }
+  {
+    // from a predicate: keep the multiples of 3.
+    auto lambda_keep = [=] __host__ __device__(int32_t i) -> bool {
+      return i % 3 == 0;
+    };
+    Renumbering renumbering(context, 10, lambda_keep);
+    EXPECT_EQ(renumbering.NumNewElems(), 4);
+    CheckArray(renumbering.New2Old(false), {0, 3, 6, 9});
+  }
+  {
+    // nothing kept, and no elements.
+    auto lambda_keep = [=] __host__ __device__(int32_t i) -> bool {
+      return false;
+    };
+    Renumbering renumbering(context, 5, lambda_keep);
+    EXPECT_EQ(renumbering.NumNewElems(), 0);
+    CheckArray(renumbering.New2Old(), {5});
+    CheckArray(renumbering.New2Old(false), {});
+
+    Renumbering empty(context, 0);
+    EXPECT_EQ(empty.NumNewElems(), 0);
+    CheckArray(empty.Old2New(), {0});
+    CheckArray(empty.New2Old(false), {});
+  }
+}
+
+TEST(Renumbering, Basic) {
+  TestRenumbering<kCpu>();
+  TestRenumbering<kCuda>();
+}
+
+template <DeviceType d>
+void TestComputeNumNewElems() {
+  ContextPtr cpu = GetCpuContext();
+  ContextPtr context = (d == kCpu ? cpu : GetCudaContext());
+  auto lambda_keep_even = [=] __host__ __device__(int32_t i) -> bool {
+    return i % 2 == 0;
+  };
+  auto lambda_keep_none = [=] __host__ __device__(int32_t i) -> bool {
+    return false;
+  };
+  Renumbering a(context, 7, lambda_keep_even),
+      b(context, 5, lambda_keep_none), empty(context, 0),
+      known(context, 4, lambda_keep_even);
+  EXPECT_EQ(known.NumNewElems(), 2);
+  ComputeNumNewElems({&a, &b, &empty, &known});
+  EXPECT_EQ(a.NumNewElems(), 4);
+  EXPECT_EQ(b.NumNewElems(), 0);
+  EXPECT_EQ(empty.NumNewElems(), 0);
+  EXPECT_EQ(known.NumNewElems(), 2);
+  CheckArray(a.Old2New(), {0, 1, 1, 2, 2, 3, 3, 4});
+  CheckArray(a.New2Old(), {0, 2, 4, 6, 7});
+  CheckArray(b.New2Old(false), {});
+}
+
+TEST(Renumbering, ComputeNumNewElems) {
+  TestComputeNumNewElems<kCpu>();
+  TestComputeNumNewElems<kCuda>();
+}
+
+}  // namespace k2
@@ -41,6 +41,7 @@ class Array1 {
   // Returns pointer to 1st elem.  Could be a GPU or CPU pointer,
   // depending on the context.
   T *Data() {
+    region_->MarkModified();
     return reinterpret_cast<T *>(reinterpret_cast<char *>(region_->data) +
                                  byte_offset_);
   }
@@ -55,6 +56,7 @@ class Array1 {
   // Called when creating Array2 using Array1, users should not call this for
   // now.
   RegionPtr &GetRegion() { return region_; }
+  const RegionPtr &GetRegion() const { return region_; }
 
   // generally Callable will be some kind of lambda or function object; it
   // should be possible to evaluate it on the CUDA device (if we're compiling
@@ -150,14 +152,15 @@ class Array1 {
   Array1 To(ContextPtr ctx) const {
     if (ctx->IsCompatible(*Context())) return *this;
 
-    Array1 ans(ctx, Dim());
+    Array1 ans(GetTransferContext(*Context(), ctx), Dim());
     if (dim_ == 0) return ans;
 
-    auto kind = GetMemoryCopyKind(*Context(), *ctx);
     T *dst = ans.Data();
     const T *src = Data();
-    MemoryCopy(static_cast<void *>(dst), static_cast<const void *>(src),
-               Dim() * ElementSize(), kind);
+    MemoryCopyAsync(static_cast<void *>(dst), static_cast<const void *>(src),
+                    Dim() * ElementSize(), *ans.Context(), *Context());
+    // The data needs to be available on the host when we return.
+    if (ctx->GetDeviceType() == kCpu) Context()->Sync();
     return ans;
   }
 
@@ -188,6 +191,55 @@ class Array1 {
     dim_ = new_size;
   }
 
+  /*
+    Returns the number of elements this array can grow to with Resize(),
+    PushBack() or Append() without reallocating.  This is more than Dim() only
+    if *this covers the highest used byte of its Region (see Resize()).
+  */
+  int32_t Capacity() const {
+    if (region_ == nullptr) return 0;
+    if (byte_offset_ + sizeof(T) * dim_ != region_->bytes_used) return dim_;
+    return static_cast<int32_t>((region_->num_bytes - byte_offset_) /
+                                sizeof(T));
+  }
+
+  /*
+    Makes sure Capacity() >= capacity, so that growing the array up to
+    `capacity` elements won't reallocate.  Has the same requirement as
+    Resize(), that *this covers the highest used byte of its Region.
+  */
+  void Reserve(int32_t capacity) {
+    if (capacity <= dim_) return;
+    K2_CHECK_EQ(byte_offset_ + sizeof(T) * dim_, region_->bytes_used);
+    region_->Reserve(byte_offset_ + sizeof(T) * capacity);
+  }
+
+  /*
+    Appends one element; only for arrays on the CPU.  The capacity (see
+    Capacity()) at least doubles whenever it has to grow, so the cost is
+    amortized constant.
+  */
+  void PushBack(const T &t) {
+    K2_CHECK_EQ(Context()->GetDeviceType(), kCpu);
+    Resize(dim_ + 1);
+    Data()[dim_ - 1] = t;
+  }
+
+  /*
+    Appends `n` elements from `src`, which must be in host memory.  This
+    works for arrays on any device, but is intended for building up arrays on
+    the CPU; see PushBack().
+  */
+  void Append(const T *src, int32_t n) {
+    K2_CHECK_GE(n, 0);
+    if (n == 0) return;
+    int32_t old_dim = dim_;
+    Resize(dim_ + n);
+    MemoryCopyAsync(static_cast<void *>(Data() + old_dim),
+                    static_cast<const void *>(src), sizeof(T) * n,
+                    *Context(), *GetCpuContext());
+  }
+
   ContextPtr &Context() const { return region_->context; }
 
   // Sets the context on this object (Caution: this is not something you'll
@@ -219,8 +271,11 @@ class Array1 {
     } else {
       K2_CHECK_EQ(type, kCuda);
       T ans;
-      MemoryCopy(static_cast<void *>(&ans), static_cast<const void *>(data),
-                 ElementSize(), MemcpyDeviceToHost);
+      ContextPtr cpu = GetCpuContext();
+      MemoryCopyAsync(static_cast<void *>(&ans),
+                      static_cast<const void *>(data), ElementSize(), *cpu,
+                      *Context());
+      Context()->Sync();
       return ans;
     }
   }
@@ -257,7 +312,9 @@ class Array1 {
     auto lambda_copy_elems = [=] __host__ __device__(int32_t i) -> void {
       ans_data[i] = this_data[indexes_data[i]];
     };
-    Eval(c, ans_dim, lambda_copy_elems);
+    // This is memory-bound, so it's faster for each thread to do more than one
+    // element.
+    Eval<LaunchPolicy<256, 4>>(c, ans_dim, lambda_copy_elems);
     return ans;
   }
 
@@ -265,9 +322,12 @@ class Array1 {
   Array1(ContextPtr ctx, const std::vector<T> &src) {
     Init(ctx, src.size());
     T *data = Data();
-    auto kind = GetMemoryCopyKind(*GetCpuContext(), *Context());
-    MemoryCopy(static_cast<void *>(data), static_cast<const void *>(src.data()),
-               src.size() * ElementSize(), kind);
+    // `src` is pageable memory, so it's safe to return before the copy has
+    // completed (see MemoryCopyAsync()).
+    ContextPtr cpu = GetCpuContext();
+    MemoryCopyAsync(static_cast<void *>(data),
+                    static_cast<const void *>(src.data()),
+                    src.size() * ElementSize(), *Context(), *cpu);
   }
 
   Array1(const Array1 &other) = default;
@@ -383,7 +443,8 @@ class Array2 {
                                                        int32_t j) -> void {
         data[i * dim1 + j] = this_data[i * elem_stride0 + j];
       };
-      Eval2(region_->context, dim0_, dim1_, lambda_copy_elems);
+      Eval2<LaunchPolicy<256, 4>>(region_->context, dim0_, dim1_,
+                                  lambda_copy_elems);
       return array;
     }
   }
@@ -453,24 +514,24 @@ class Array2 {
     This should work even for tensors with dim == 0.
 
     Note that the returned array is contiguous in case the required context
-    is not compatible with the current context.
+    is not compatible with the current context.  If *this is not contiguous
+    (elem_stride0_ > dim1_) its rows are copied directly with one strided
+    copy, with no intermediate contiguous copy.
   */
   Array2<T> To(ContextPtr ctx) const {
     if (ctx->IsCompatible(*Context())) return *this;
 
-    Array2<T> ans(ctx, dim0_, dim1_);
+    Array2<T> ans(GetTransferContext(*Context(), ctx), dim0_, dim1_);
 
-    if (elem_stride0_ == dim1_) {
-      // the current array is contiguous, use memcpy
-      auto kind = GetMemoryCopyKind(*Context(), *ctx);
-      T *dst = ans.Data();
-      const T *src = Data();
-      MemoryCopy(static_cast<void *>(dst), static_cast<const void *>(src),
-                 dim0_ * dim1_ * ElementSize(), kind);
-      return ans;
-    } else {
-      return ToContiguous(*this).To(ctx);
-    }
+    T *dst = ans.Data();
+    const T *src = Data();
+    MemoryCopy2DAsync(static_cast<void *>(dst), dim1_ * ElementSize(),
+                      static_cast<const void *>(src),
+                      elem_stride0_ * ElementSize(), dim1_ * ElementSize(),
+                      dim0_, *ans.Context(), *Context());
+    // The data needs to be available on the host when we return.
+    if (ctx->GetDeviceType() == kCpu) Context()->Sync();
+    return ans;
   }
 
   // Note that the returned Tensor is not const, the caller should be careful
@@ -490,6 +551,7 @@ class Array2 {
   }
 
   T *Data() {
+    region_->MarkModified();
     return reinterpret_cast<T *>(reinterpret_cast<char *>(region_->data) +
                                  byte_offset_);
   }
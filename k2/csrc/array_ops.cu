@@ -26,7 +26,7 @@ Array1<int32_t> SpliceRowSplits(int32_t num_arrays,
   ContextPtr c = src[0]->Context();
 
   std::vector<int32_t> row_splits_vec(num_arrays + 1);
-  int32_t sum = 0, max_dim = 0;
+  int32_t sum = 0;
   row_splits_vec[0] = sum;
 
   std::vector<const int32_t *> last_elem_ptrs_vec(num_arrays);
@@ -34,7 +34,6 @@ Array1<int32_t> SpliceRowSplits(int32_t num_arrays,
   for (int32_t i = 0; i < num_arrays; i++) {
     K2_CHECK_GE(src[i]->Dim(), 1);
     int32_t dim = src[i]->Dim() - (i + 1 < num_arrays ? 1 : 0);
-    if (dim > max_dim) max_dim = dim;
     sum += dim;
     row_splits_vec[i + 1] = sum;
     last_elem_ptrs_vec[i] = src[i]->Data() + dim;
@@ -44,8 +43,13 @@ Array1<int32_t> SpliceRowSplits(int32_t num_arrays,
   Array1<int32_t> ans(c, ans_size);
   int32_t *ans_data = ans.Data();
 
-  Array1<const int32_t *> last_elems_ptrs(c, last_elem_ptrs_vec);
-  Array1<int32_t> data_offsets(c, num_arrays);
+  // The temporaries below are allocated from `scratch`, which costs one
+  // allocation from `c` for all of them (the extra space is for the temporary
+  // storage of ExclusiveSumDeref()).
+  ContextPtr scratch = NewScratchContext(
+      c, num_arrays * (2 * sizeof(int32_t *) + 2 * sizeof(int32_t)) + 4096);
+  Array1<const int32_t *> last_elems_ptrs(scratch, last_elem_ptrs_vec);
+  Array1<int32_t> data_offsets(scratch, num_arrays);
   // note as data_offsets.Dim() == last_elem_ptrs.Dim(), so the last element of
   // last_elem_ptrs.Dim() will not be summed to data_offsets, it's OK as we
   // don't need that value since we would not drop the last element of the last
@@ -72,80 +76,38 @@ Array1<int32_t> SpliceRowSplits(int32_t num_arrays,
     }
   } else {
     K2_CHECK_EQ(c->GetDeviceType(), kCuda);
-    Array1<int32_t> row_splits(c, row_splits_vec);
-    const int32_t *row_splits_data = row_splits.Data();
     std::vector<const int32_t *> src_ptrs_vec(num_arrays);
     for (int32_t i = 0; i < num_arrays; i++) src_ptrs_vec[i] = src[i]->Data();
-    Array1<const int32_t *> src_ptrs(c, src_ptrs_vec);
-    const int32_t **src_ptrs_data = src_ptrs.Data();
-
-    int32_t avg_input_size = ans_size / num_arrays;
-    if (max_dim < 2 * avg_input_size + 512) {
-      // here, 2 is a heuristic factor. We're saying, "if the max length of any
-      // of the source arrays is not too much larger than the average length of
-      // the source arrays."  The `+ 512` is an additional heuristic factor, as
-      // we care less about launching too many GPU threads if the number of
-      // elements being processed is small. What we're saying is that the
-      // arrays' sizes are fairly balanced, so we launch with a simple
-      // rectangular kernel.
-      auto lambda_set_data = [=] __host__ __device__(int32_t i,
-                                                     int32_t j) -> void {
-        int32_t row_start = row_splits_data[i],
-                row_end = row_splits_data[i + 1];
-        const int32_t *src_ptr = src_ptrs_data[i];
-        // not we have dropped the last element of src[i] in row_splits_data,
-        // so here it will not be copied.
-        if (j < row_end - row_start) {
-          ans_data[row_start + j] = src_ptr[j] + data_offsets_data[i];
-        }
-      };
-      Eval2(c, num_arrays, max_dim, lambda_set_data);
-    } else {
-      int32_t block_dim = 256;
-      while (block_dim * 4 < avg_input_size && block_dim < 8192) block_dim *= 2;
-
-      // `index_map` will map from 'new index' to 'old index', with 0 <=
-      // old_index < num_arrays... we handle each source array with multiple
-      // blocks.
-      //  The elements of `index_map` will be of the form:
-      //    old_index + (block_of_this_array << 32).
-      // where `old_index` is an index into `src` and `block_of_this_array`
-      // tells us which block it is, as in 0, 1, 2, 3...
-      // there won't be very many blocks, so it's not a problem to enumerate
-      // them on CPU.
-      std::vector<uint64_t> index_map;
-      index_map.reserve((2 * ans_size) / block_dim);
-      for (int32_t i = 0; i < num_arrays; i++) {
-        int32_t this_array_size = src[i]->Dim();
-        int32_t this_num_blocks = NumBlocks(this_array_size, block_dim);
-        for (int32_t j = 0; j < this_num_blocks; j++) {
-          index_map.push_back((static_cast<uint64_t>(j) << 32) +
-                              static_cast<uint64_t>(i));
-        }
-      }
-      Array1<uint64_t> index_map_gpu(c, index_map);
-      const uint64_t *index_map_data = index_map_gpu.Data();
-
-      auto lambda_set_data_blocks = [=] __host__ __device__(int32_t i,
-                                                            int32_t j) {
-        uint64_t index = index_map_data[i];
-        uint32_t orig_i = static_cast<uint32_t>(index),
-                 block_index = static_cast<uint32_t>(index >> 32);
-        int32_t row_start = row_splits_data[orig_i],
-                row_end = row_splits_data[orig_i + 1],
-                orig_j = (block_index * block_dim) + j;
-        const int32_t *src_ptr = src_ptrs_data[orig_i];
-        if (orig_j < row_end - row_start) {
-          ans_data[row_start + orig_j] =
-              src_ptr[orig_j] + data_offsets_data[orig_i];
-        }
-      };
-      Eval2(c, index_map_gpu.Dim(), block_dim, lambda_set_data_blocks);
-    }
+    const int32_t *const *src_ptrs_data;
+    const int32_t *row_splits_data;
+    Array1<char> table = internal::UploadTable(
+        scratch, src_ptrs_vec, row_splits_vec, &src_ptrs_data,
+        &row_splits_data);
+    // note we have dropped the last element of all but the last src[i] in
+    // row_splits_data, so it will not be copied.
+    auto lambda_set_data = [=] __host__ __device__(int32_t i) -> void {
+      int32_t src_idx = FindRow(row_splits_data, num_arrays, i);
+      ans_data[i] = src_ptrs_data[src_idx][i - row_splits_data[src_idx]] +
+                    data_offsets_data[src_idx];
+    };
+    Eval(c, ans_size, lambda_set_data);
   }
   return ans;
 }
 
+Array1<int32_t> InvertPermutation(const Array1<int32_t> &src) {
+  ContextPtr c = src.Context();
+  int32_t dim = src.Dim();
+  Array1<int32_t> ans(c, dim);
+  const int32_t *src_data = src.Data();
+  int32_t *ans_data = ans.Data();
+  auto lambda_set_ans = [=] __host__ __device__(int32_t i) -> void {
+    ans_data[src_data[i]] = i;
+  };
+  Eval(c, dim, lambda_set_ans);
+  return ans;
+}
+
 bool ValidateRowIds(const Array1<int32_t> &row_ids,
                     Array1<int32_t> *temp /*=nullptr*/) {
   ContextPtr ctx = row_ids.Context();
@@ -44,6 +44,29 @@ namespace k2 {
 template <typename T>
 void Transpose(ContextPtr &c, const Array2<T> &src, Array2<T> *dest);
 
+/*
+  Transpose each of a stack of matrices, e.g. the scores of a batch of
+  utterances padded to the same length.  Matrix b of `src` is its rows
+  [b * R, (b + 1) * R), where R = src.Dim0() / num_matrices, and its
+  transpose is written to rows [b * C, (b + 1) * C) of `dest`, where
+  C = src.Dim1().
+
+     @param [in] c   Context to use, must satisfy
+                     `c.IsCompatible(src.Context())` and
+                     `c.IsCompatible(dest->Context())`.
+     @param [in] num_matrices  Number of matrices; must be > 0 and divide
+                     src.Dim0().  With num_matrices == 1 this is the same
+                     as Transpose().
+     @param [in] src  Source matrices to transpose
+     @param [out] dest  Destination array; must satisfy
+                        `dest->Dim1() == src.Dim0() / num_matrices` and
+                        `dest->Dim0() == src.Dim1() * num_matrices`.
+                        At exit, we'll have dest[b*C + i, j] == src[b*R + j, i].
+*/
+template <typename T>
+void TransposeBatched(ContextPtr &c, int32_t num_matrices,
+                      const Array2<T> &src, Array2<T> *dest);
+
 /*
   Sets 'dest' to exclusive prefix sum of 'src'.
     @param [in] src    Source data, to be summed.
@@ -82,6 +105,35 @@ Array1<T> ExclusiveSum(Array1<T> &src) {
   return ans;
 }
 
+/*  In-place version of ExclusiveSum: at exit,
+     src[i] = sum_{j=0}^{i-1} (the original value of src[j]).
+ */
+template <typename T>
+void ExclusiveSumInPlace(Array1<T> *src) {
+  ExclusiveSum(*src, src);
+}
+
+/*
+  As ExclusiveSum(src, dest), but also returns the last element of `dest` on
+  the host; if dest.Dim() == src.Dim() + 1 this is the sum of all elements of
+  `src`.  This saves a separate device-to-host copy to learn the total size
+  when computing row_splits from sizes.  Requires dest->Dim() >= 1.
+ */
+template <typename S, typename T>
+T ExclusiveSumWithTotal(Array1<S> &src, Array1<T> *dest) {
+  K2_CHECK(IsCompatible(src, *dest));
+  int32_t src_dim = src.Dim();
+  int32_t dest_dim = dest->Dim();
+  K2_CHECK(dest_dim == src_dim || dest_dim == src_dim + 1);
+  if (dest_dim == src_dim + 1) {
+    const RegionPtr &region = src.GetRegion();
+    int32_t byte_offset = src.ByteOffset();
+    K2_CHECK_GE(region->num_bytes - byte_offset, dest_dim * src.ElementSize());
+  }
+  return ExclusiveSumWithTotal(src.Context(), dest_dim, src.Data(),
+                               dest->Data());
+}
+
 /*
   Sets 'dest' to exclusive prefix sum of the result of dereferencing the
   elements of 'src'.
@@ -175,10 +227,25 @@ Array1<int32_t> SpliceRowSplits(int32_t src_size, const Array1<int32_t> **src);
                                 written. Must satisfy
                                 dst->Dim() == rows along the last axis in src,
                                 i.e. src.RowSplits(src.NumAxes() - 1).Dim() - 1.
+     @param [in] temp_storage   If not nullptr, the temporary storage that cub
+                                needs for long sub-lists on GPU is taken from
+                                here rather than allocated; it must have at
+                                least ApplyOpPerSublistTempBytes() bytes.
+                                This is for calls that are captured into a
+                                CudaGraph, which must not allocate.
 */
 
 template <typename T, typename Op>
-void ApplyOpPerSublist(Ragged<T> &src, T default_value, Array1<T> *dst);
+void ApplyOpPerSublist(Ragged<T> &src, T default_value, Array1<T> *dst,
+                       Array1<char> *temp_storage = nullptr);
+
+/*
+  Returns the number of bytes of temporary storage that
+  ApplyOpPerSublist<T, Op>(src, default_value, ...) needs, which is 0 on CPU
+  and if the sub-lists are short.  It only depends on the sizes of `src`.
+ */
+template <typename T, typename Op>
+std::size_t ApplyOpPerSublistTempBytes(Ragged<T> &src, T default_value);
 /*
   Output to an array `max_values` the maximum of each sub-list along the last
   axis of `src` i.e. the max taken over the last axis), or `default_value`,
@@ -194,10 +261,34 @@ void ApplyOpPerSublist(Ragged<T> &src, T default_value, Array1<T> *dst);
                                 max_values->Dim() == rows along the last axis in
                                 src, i.e.
                                 src.RowSplits(src.NumAxes() - 1).Dim() - 1.
+     @param [in] temp_storage   If not nullptr, the temporary storage to use;
+                                see ApplyOpPerSublist().
+ */
+template <typename T>
+void MaxPerSublist(Ragged<T> &src, T default_value, Array1<T> *max_values,
+                   Array1<char> *temp_storage = nullptr) {
+  ApplyOpPerSublist<T, MaxOp<T>>(src, default_value, max_values,
+                                 temp_storage);
+}
+
+/*
+  Output to an array `log_sums` the log of the sum of the exponentials of the
+  elements of each sub-list along the last axis of `src` and of
+  `default_value`, i.e. the result of reducing them with LogAddOp (addition in
+  the log semiring).  `default_value` would normally be -infinity.  The
+  reduction order only depends on the shape and the device, so results are
+  reproducible.
+
+     @param [in] src            Input ragged array; must have src.NumAxes()
+                                >= 2. src.values is allowed to be empty.
+     @param [in] default_value  Value to initialize the reduction with
+     @param [out] log_sums      Array to which the results will be written.
+                                Must satisfy log_sums->Dim() ==
+                                src.TotSize(src.NumAxes() - 2).
  */
 template <typename T>
-void MaxPerSublist(Ragged<T> &src, T default_value, Array1<T> *max_values) {
-  ApplyOpPerSublist<T, MaxOp<T>>(src, default_value, max_values);
+void LogSumPerSublist(Ragged<T> &src, T default_value, Array1<T> *log_sums) {
+  ApplyOpPerSublist<T, LogAddOp<T>>(src, default_value, log_sums);
 }
 
 /*
@@ -341,6 +432,17 @@ void RowSplitsToRowIds(const Array1<int32_t> &row_splits,
 void RowIdsToRowSplits(const Array1<int32_t> &row_ids,
                        Array1<int32_t> &row_splits);
 
+/*
+  Returns the inverse of a permutation, e.g. the old2new map corresponding to
+  a new2old map.
+
+     @param [in] src   A permutation, i.e. an array containing the numbers
+                       0 through src.Dim() - 1 in some order (not checked).
+     @return   Returns an array `ans` on the same device as `src`, with
+               ans[src[i]] == i.
+*/
+Array1<int32_t> InvertPermutation(const Array1<int32_t> &src);
+
 /*
    Validate a row_ids vector; this just makes sure its elements are nonnegative
    and non-decreasing.
@@ -389,6 +491,194 @@ bool ValidateRowSplitsAndIds(const Array1<int32_t> &row_splits,
 template <typename T>
 Array2<T> ToContiguous(const Array2<T> &src);
 
+/*
+  For kernels that output a variable number of elements per thread, e.g.
+  arcs that survive pruning: each thread appends its outputs with an atomic
+  add to a shared cursor, so no counting pass and exclusive-sum are needed.
+  The order of the outputs is not deterministic.  Usage:
+
+     AtomicAppender<Arc> appender(c, max_num_arcs);
+     AtomicAppender<Arc>::View view = appender.GetView();
+     auto lambda = [=] __host__ __device__(int32_t i) -> void {
+       if (...) view.Append(arc);
+     };
+     Eval(c, n, lambda);
+     Array1<Arc> arcs = appender.Finish();
+
+  If more than `capacity` elements are appended, the extra ones are dropped
+  and Finish() dies; use Overflowed() first if you can recover (e.g. by
+  retrying with a larger capacity).  This works on CPU too.
+ */
+template <typename T>
+class AtomicAppender {
+ public:
+  // The part that's used in kernels; copy it into the lambda.
+  struct View {
+    T *data;
+    int32_t *cursor;
+    int32_t capacity;
+
+    // Appends `t`; returns its index, which is >= capacity if it was
+    // dropped.
+    __host__ __device__ __forceinline__ int32_t Append(const T &t) const {
+      int32_t i = atomicAdd(cursor, 1);
+      if (i < capacity) data[i] = t;
+      return i;
+    }
+
+    // Reserves `n` consecutive elements and returns the index of the first;
+    // the caller writes the ones with index < capacity to `data`.
+    __host__ __device__ __forceinline__ int32_t Allocate(int32_t n) const {
+      return atomicAdd(cursor, n);
+    }
+  };
+
+  AtomicAppender(ContextPtr c, int32_t capacity)
+      : data_(c, capacity), cursor_(c, 1, 0) {}
+
+  View GetView() {
+    View ans;
+    ans.data = data_.Data();
+    ans.cursor = cursor_.Data();
+    ans.capacity = data_.Dim();
+    return ans;
+  }
+
+  // Returns the number of elements appended so far, including any that were
+  // dropped.  Waits for the device.
+  int32_t NumAppended() const { return cursor_[0]; }
+
+  bool Overflowed() const { return NumAppended() > data_.Dim(); }
+
+  // Returns the elements appended.  Waits for the device.
+  Array1<T> Finish() {
+    int32_t num_appended = NumAppended();
+    K2_CHECK_LE(num_appended, data_.Dim())
+        << "AtomicAppender overflowed; use a larger capacity.";
+    data_.Resize(num_appended);
+    return data_;
+  }
+
+ private:
+  Array1<T> data_;
+  Array1<int32_t> cursor_;
+};
+
+/*
+  Gather through a chain of index maps, without materializing the composed
+  map; this is for mapping e.g. arc weights through the arc_maps output by a
+  sequence of algorithms.  It computes
+
+      ans[i] = src[maps[0][maps[1][... maps[num_maps - 1][i] ...]]]
+
+  where, if any of the maps gives -1 along the way, ans[i] = default_value.
+
+     @param [in] src       Source array
+     @param [in] num_maps  Number of maps; must satisfy
+                           1 <= num_maps <= internal::kMaxIndexMapChain.
+     @param [in] maps      The index maps, in the order they were produced
+                           (i.e. maps[0] indexes `src`, and maps[k] indexes
+                           maps[k-1]).  Elements must be -1 or valid indexes.
+                           Must all be on the same device as `src`.
+     @param [in] default_value  Value for elements that map to -1
+     @return  Returns an array with Dim() == maps[num_maps - 1]->Dim().
+ */
+template <typename T>
+Array1<T> Gather(const Array1<T> &src, int32_t num_maps,
+                 const Array1<int32_t> **maps, T default_value = T(0));
+
+/*
+  The reverse of Gather(): this is for the backward pass, e.g. propagating
+  derivatives w.r.t. arc weights back through a chain of arc_maps.  It does
+
+      (*dest)[maps[0][maps[1][... maps[num_maps - 1][i] ...]]] += src[i]
+
+  for all i, skipping i for which any of the maps gives -1.  It uses atomic
+  adds, so for floating point types the result is not deterministic if
+  elements of `src` map to the same element of `dest`; see
+  ScatterAddDeterministic().
+
+     @param [in] src       Values to add; must satisfy
+                           src.Dim() == maps[num_maps - 1]->Dim().
+     @param [in] num_maps  Number of maps, see Gather().
+     @param [in] maps      The index maps, see Gather(); maps[0] indexes
+                           `dest`.
+     @param [in,out] dest  Array to add to; is not zeroed first.
+ */
+template <typename T>
+void ScatterAdd(const Array1<T> &src, int32_t num_maps,
+                const Array1<int32_t> **maps, Array1<T> *dest);
+
+/*
+  Like ScatterAdd(), but the result doesn't depend on thread scheduling:
+  the elements of `src` that go to each element of `dest` are summed in
+  order of their index in `src`.  On GPU this needs a sort of the composed
+  map, so it's slower than ScatterAdd(), and it allocates temporaries.
+  Args are as for ScatterAdd().
+ */
+template <typename T>
+void ScatterAddDeterministic(const Array1<T> &src, int32_t num_maps,
+                             const Array1<int32_t> **maps, Array1<T> *dest);
+
+/*
+  Reads several scalars in the memory of a context (e.g. the totals of a few
+  exclusive-sums, or the sizes of several outputs) on the host with one
+  transfer and one wait for the device, instead of one each as with
+  operator[] or Back() of Array1.  The scalars are gathered on the device into
+  one array, which is copied into pinned memory (if available, see
+  GetTransferContext()).  Usage:
+
+     HostReadback<int32_t> readback(c);
+     int32_t i = readback.Add(row_splits, num_rows),
+             j = readback.Add(other_row_splits.Data() + n);
+     readback.Fetch();
+     int32_t tot_size = readback[i], other_tot_size = readback[j];
+
+  T must be a trivially copyable type.
+ */
+template <typename T>
+class HostReadback {
+ public:
+  explicit HostReadback(ContextPtr c) : c_(c) {}
+
+  /* Adds the scalar at `src`, which must be memory of the context given to
+     the constructor, and returns its index for operator[].  The value is read
+     by the next call to Fetch(), so it must be valid until then. */
+  int32_t Add(const T *src) {
+    srcs_.push_back(src);
+    return static_cast<int32_t>(srcs_.size()) - 1;
+  }
+
+  // Adds element `i` of `src`, see Add() above.
+  int32_t Add(const Array1<T> &src, int32_t i) {
+    K2_CHECK(c_->IsCompatible(*src.Context()));
+    K2_CHECK_GE(i, 0);
+    K2_CHECK_LT(i, src.Dim());
+    return Add(src.Data() + i);
+  }
+
+  int32_t Size() const { return static_cast<int32_t>(srcs_.size()); }
+
+  /* Reads the values of all the scalars added so far; on GPU this is one
+     transfer and one wait for the stream of the context.  After this,
+     more scalars may be added and Fetch() called again (which will read all
+     of them again). */
+  void Fetch();
+
+  // Returns the value of the scalar with index i (as returned by Add()), as
+  // of the last call to Fetch(), which must have been after it was added.
+  T operator[](int32_t i) const {
+    K2_CHECK_GE(i, 0);
+    K2_CHECK_LT(i, static_cast<int32_t>(values_.size()));
+    return values_[i];
+  }
+
+ private:
+  ContextPtr c_;
+  std::vector<const T *> srcs_;
+  std::vector<T> values_;
+};
+
 }  // namespace k2
 
 #define IS_IN_K2_CSRC_ARRAY_OPS_H_
@@ -0,0 +1,130 @@
+/**
+ * @brief
+ * array_ops_benchmark
+ *
+ * @copyright
+ * Copyright (c)  2026  agent (agent@local)
+ *
+ * @copyright
+ * See LICENSE for clarification regarding multiple authors
+ */
+
+#include <algorithm>
+#include <vector>
+
+#include "k2/csrc/array.h"
+#include "k2/csrc/array_ops.h"
+#include "k2/csrc/benchmark.h"
+#include "k2/csrc/context.h"
+#include "k2/csrc/ragged.h"
+
+namespace k2 {
+
+// The rows of the ragged arrays of the benchmarks below have this many
+// elements on average.
+constexpr int32_t kBenchmarkRowLength = 8;
+
+// Returns random sizes of `num_rows` rows with kBenchmarkRowLength elements on
+// average, so that the work per row is not uniform.
+static Array1<int32_t> RandomRowSplits(ContextPtr &c, int32_t num_rows) {
+  ContextPtr cpu = GetCpuContext();
+  Array1<int32_t> row_splits = RandUniformArray1<int32_t>(
+      cpu, num_rows + 1, 0, 2 * kBenchmarkRowLength);
+  ExclusiveSumInPlace(&row_splits);
+  return row_splits.To(c);
+}
+
+static void BM_ExclusiveSum(benchmark::State &state) {
+  ContextPtr c = GetBenchmarkContext(state);
+  int32_t n = state.range(0);
+  Array1<int32_t> src = RandUniformArray1<int32_t>(c, n, 0, 100),
+                  dest(c, n);
+  for (auto _ : state) {
+    ExclusiveSum(src, &dest);
+    BenchmarkSync(c);
+  }
+  SetThroughput(state, n, 2 * n * sizeof(int32_t));
+}
+BENCHMARK(BM_ExclusiveSum)->Apply(SizesAndDevices);
+
+static void BM_RowSplitsToRowIds(benchmark::State &state) {
+  ContextPtr c = GetBenchmarkContext(state);
+  int32_t num_rows = state.range(0) / kBenchmarkRowLength;
+  Array1<int32_t> row_splits = RandomRowSplits(c, num_rows);
+  int32_t num_elems = row_splits.Back();
+  Array1<int32_t> row_ids(c, num_elems);
+  for (auto _ : state) {
+    RowSplitsToRowIds(row_splits, row_ids);
+    BenchmarkSync(c);
+  }
+  SetThroughput(state, num_elems,
+                (num_rows + 1 + num_elems) * sizeof(int32_t));
+}
+BENCHMARK(BM_RowSplitsToRowIds)->Apply(SizesAndDevices);
+
+static void BM_MaxPerSublist(benchmark::State &state) {
+  ContextPtr c = GetBenchmarkContext(state);
+  int32_t num_rows = state.range(0) / kBenchmarkRowLength;
+  Array1<int32_t> row_splits = RandomRowSplits(c, num_rows);
+  int32_t num_elems = row_splits.Back();
+  Ragged<float> src(RaggedShape2(&row_splits, nullptr, num_elems),
+                    RandUniformArray1<float>(c, num_elems, -10, 10));
+  Array1<float> max_values(c, num_rows);
+  for (auto _ : state) {
+    MaxPerSublist(src, -1.0e+10f, &max_values);
+    BenchmarkSync(c);
+  }
+  SetThroughput(state, num_elems,
+                num_elems * sizeof(float) + num_rows * sizeof(float));
+}
+BENCHMARK(BM_MaxPerSublist)->Apply(SizesAndDevices);
+
+// Appends 16 arrays with a total of state.range(0) elements.
+static void BM_Append(benchmark::State &state) {
+  ContextPtr c = GetBenchmarkContext(state);
+  constexpr int32_t kNumSrcs = 16;
+  int32_t n = state.range(0), src_dim = n / kNumSrcs;
+  std::vector<Array1<int32_t>> srcs;
+  std::vector<const Array1<int32_t> *> src_ptrs;
+  for (int32_t i = 0; i != kNumSrcs; ++i)
+    srcs.push_back(RandUniformArray1<int32_t>(c, src_dim, 0, 100));
+  for (const auto &src : srcs) src_ptrs.push_back(&src);
+  for (auto _ : state) {
+    Array1<int32_t> ans = Append(kNumSrcs, src_ptrs.data());
+    BenchmarkSync(c);
+  }
+  SetThroughput(state, n, 2 * n * sizeof(int32_t));
+}
+BENCHMARK(BM_Append)->Apply(SizesAndDevices);
+
+// Transposes a square matrix with state.range(0) elements.
+static void BM_Transpose(benchmark::State &state) {
+  ContextPtr c = GetBenchmarkContext(state);
+  int32_t dim = 1;
+  while (dim * dim < state.range(0)) dim *= 2;
+  Array2<int32_t> src(c, dim, dim, 1), dest(c, dim, dim);
+  for (auto _ : state) {
+    Transpose(c, src, &dest);
+    BenchmarkSync(c);
+  }
+  SetThroughput(state, dim * dim, 2 * dim * dim * sizeof(int32_t));
+}
+BENCHMARK(BM_Transpose)->Apply(SizesAndDevices);
+
+// Reads up to 1024 elements from the host with Array1::operator[]; for CUDA
+// this is dominated by the latency of a transfer per element.
+static void BM_Array1Index(benchmark::State &state) {
+  ContextPtr c = GetBenchmarkContext(state);
+  int32_t n = state.range(0),
+          num_reads = std::min<int32_t>(n, 1024), stride = n / num_reads;
+  Array1<int32_t> array = Range<int32_t>(c, n, 0);
+  int64_t sum = 0;
+  for (auto _ : state) {
+    for (int32_t i = 0; i != num_reads; ++i) sum += array[i * stride];
+  }
+  benchmark::DoNotOptimize(sum);
+  SetThroughput(state, num_reads, num_reads * sizeof(int32_t));
+}
+BENCHMARK(BM_Array1Index)->Apply(SizesAndDevices);
+
+}  // namespace k2
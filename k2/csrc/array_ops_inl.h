@@ -22,6 +22,7 @@
 
 #include <algorithm>
 #include <cassert>
+#include <cstring>
 #include <cub/cub.cuh>  // NOLINT
 #include <random>
 #include <type_traits>
@@ -55,36 +56,52 @@ struct PtrPtr {
 static constexpr int32_t kTransTileDim = 32;
 static constexpr int32_t kTransBlockRows = 8;
 
+// Transposes each of `num_matrices` matrices of `rows` by `cols`; matrix b
+// starts at `input + b * input_matrix_stride` and is written to
+// `output + b * output_matrix_stride`.  Each block handles 32x32 tiles, and
+// loops over tiles on axes y and z so the grid size can be limited.
 template <typename T>
-__global__ void TransposeKernel(int32_t rows, int32_t cols,
-                                int32_t input_elem_stride0,
-                                int32_t output_elem_stride0, const T *input,
+__global__ void TransposeKernel(int32_t num_matrices, int32_t rows,
+                                int32_t cols, int32_t input_elem_stride0,
+                                int32_t output_elem_stride0,
+                                int32_t input_matrix_stride,
+                                int32_t output_matrix_stride, const T *input,
                                 T *output) {
-  // TODO(haowen): here we need to handle different type of T to avoid bank
-  // conflicts, the size of cache now is fine for type size with 32bit (e.g.
-  // int32_t or float).
+  // The padding of one element per row means that threads reading a column
+  // of the tile hit different banks; this holds for elements of 1, 2, 4 or 8
+  // bytes (for 8 bytes, the accesses of each half-warp are conflict-free).
   __shared__ T cache[kTransTileDim][kTransTileDim + 1];
 
-  // input index, in a coalesced manner.
-  int32_t x = threadIdx.x + blockIdx.x * kTransTileDim;
-  int32_t y = threadIdx.y + blockIdx.y * kTransTileDim;
-
-  for (int32_t i = 0; i < kTransTileDim; i += kTransBlockRows) {
-    if (x < cols && (y + i) < rows) {
-      cache[threadIdx.y + i][threadIdx.x] =
-          input[(y + i) * input_elem_stride0 + x];
-    }
-  }
+  int32_t num_tile_rows = (rows + kTransTileDim - 1) / kTransTileDim;
+  for (int32_t b = blockIdx.z; b < num_matrices; b += gridDim.z) {
+    const T *this_input = input + b * input_matrix_stride;
+    T *this_output = output + b * output_matrix_stride;
+    for (int32_t tile_row = blockIdx.y; tile_row < num_tile_rows;
+         tile_row += gridDim.y) {
+      // input index, in a coalesced manner.
+      int32_t x = threadIdx.x + blockIdx.x * kTransTileDim;
+      int32_t y = threadIdx.y + tile_row * kTransTileDim;
+
+      for (int32_t i = 0; i < kTransTileDim; i += kTransBlockRows) {
+        if (x < cols && (y + i) < rows) {
+          cache[threadIdx.y + i][threadIdx.x] =
+              this_input[(y + i) * input_elem_stride0 + x];
+        }
+      }
 
-  __syncthreads();
+      __syncthreads();
 
-  // output index, in a coalesced manner
-  x = threadIdx.x + blockIdx.y * kTransTileDim;
-  y = threadIdx.y + blockIdx.x * kTransTileDim;
-  for (int32_t i = 0; i < kTransTileDim; i += kTransBlockRows) {
-    if (x < rows && (y + i) < cols) {
-      output[(y + i) * output_elem_stride0 + x] =
-          cache[threadIdx.x][threadIdx.y + i];
+      // output index, in a coalesced manner
+      x = threadIdx.x + tile_row * kTransTileDim;
+      y = threadIdx.y + blockIdx.x * kTransTileDim;
+      for (int32_t i = 0; i < kTransTileDim; i += kTransBlockRows) {
+        if (x < rows && (y + i) < cols) {
+          this_output[(y + i) * output_elem_stride0 + x] =
+              cache[threadIdx.x][threadIdx.y + i];
+        }
+      }
+      // Wait for the tile to be read before the next one is written to it.
+      __syncthreads();
     }
   }
 }
@@ -128,6 +145,103 @@ void RandArray1Internal(ContextPtr &c, int32_t dim, T min_value, T max_value,
   for (int32_t i = 0; i < dim; ++i) data[i] = dis(gen);
 }
 
+// Used in ApplyOpPerSublist: on GPU, sublists whose average length is less
+// than kMinWarpPerSublistSize are reduced by one thread each, those up to
+// kMaxWarpPerSublistSize by one warp each, and longer ones by cub's
+// DeviceSegmentedReduce (which uses one block per sublist).
+static constexpr int32_t kMinWarpPerSublistSize = 4;
+static constexpr int32_t kMaxWarpPerSublistSize = 256;
+static constexpr int32_t kWarpsPerBlock = 8;
+
+// Reduces the elements of sublist row_splits[i]..row_splits[i+1]-1 of
+// `values`, together with `default_value`, with Op, into output[i];
+// each warp handles one sublist.
+template <typename T, typename Op>
+__global__ void ApplyOpPerSublistWarpKernel(int32_t num_rows,
+                                            const int32_t *row_splits,
+                                            const T *values, T default_value,
+                                            T *output) {
+  using WarpReduce = cub::WarpReduce<T>;
+  __shared__ typename WarpReduce::TempStorage temp_storage[kWarpsPerBlock];
+  int32_t warp_id = threadIdx.x / 32, lane = threadIdx.x % 32,
+          row = blockIdx.x * kWarpsPerBlock + warp_id;
+  if (row >= num_rows) return;  // the whole warp returns.
+  int32_t begin = row_splits[row], len = row_splits[row + 1] - begin;
+  Op op;
+  // Lanes without any element don't take part in the reduction, so `op` needs
+  // no identity element.
+  T val = default_value;
+  if (lane < len) {
+    val = values[begin + lane];
+    for (int32_t j = lane + 32; j < len; j += 32)
+      val = op(values[begin + j], val);
+  }
+  int32_t num_valid = (len < 32 ? len : 32);
+  val = WarpReduce(temp_storage[warp_id]).Reduce(val, op, num_valid);
+  if (lane == 0) output[row] = (len == 0 ? val : op(val, default_value));
+}
+
+// Maximum number of index maps that Gather() and ScatterAdd() can compose.
+static constexpr int32_t kMaxIndexMapChain = 8;
+
+// A chain of index maps, see Gather().  It is passed to kernels by value, so
+// composing maps needs no device memory.
+struct IndexMapChain {
+  int32_t num_maps;
+  const int32_t *maps[kMaxIndexMapChain];
+
+  // Returns maps[0][maps[1][... maps[num_maps - 1][i] ...]], or -1 if any of
+  // the maps gives -1.
+  __host__ __device__ __forceinline__ int32_t Map(int32_t i) const {
+    for (int32_t k = num_maps - 1; k >= 0 && i != -1; --k) i = maps[k][i];
+    return i;
+  }
+};
+
+inline IndexMapChain GetIndexMapChain(const ContextPtr &c, int32_t num_maps,
+                                      const Array1<int32_t> **maps) {
+  K2_CHECK_GE(num_maps, 1);
+  K2_CHECK_LE(num_maps, kMaxIndexMapChain)
+      << "Too many index maps to compose; please do it in two steps.";
+  IndexMapChain ans;
+  ans.num_maps = num_maps;
+  for (int32_t k = 0; k < num_maps; ++k) {
+    K2_CHECK(c->IsCompatible(*maps[k]->Context()));
+    ans.maps[k] = maps[k]->Data();
+  }
+  return ans;
+}
+
+/*
+  Uploads a table of pointers followed by a table of int32_t's to `c` with a
+  single transfer; used by algorithms on many source arrays (e.g. Append())
+  to avoid one allocation and copy per table.
+
+     @param [in] c     Context to upload to
+     @param [in] ptrs  Pointers to upload (e.g. the Data() of each source)
+     @param [in] ints  Integers to upload (e.g. offsets); must be nonempty.
+     @param [out] ptrs_data  Will be set to the uploaded copy of `ptrs`
+     @param [out] ints_data  Will be set to the uploaded copy of `ints`
+     @return  Returns the array that owns the memory of `*ptrs_data` and
+              `*ints_data`; it must be kept alive while they are used.
+ */
+template <typename P>
+Array1<char> UploadTable(ContextPtr &c, const std::vector<P> &ptrs,
+                         const std::vector<int32_t> &ints,
+                         const P **ptrs_data, const int32_t **ints_data) {
+  K2_CHECK(!ints.empty());
+  std::size_t ptrs_bytes = ptrs.size() * sizeof(P),
+              ints_bytes = ints.size() * sizeof(int32_t);
+  // `P` is a pointer type so `ints` will start with the right alignment.
+  std::vector<char> buf(ptrs_bytes + ints_bytes);
+  if (ptrs_bytes != 0) memcpy(buf.data(), ptrs.data(), ptrs_bytes);
+  memcpy(buf.data() + ptrs_bytes, ints.data(), ints_bytes);
+  Array1<char> ans(c, buf);
+  *ptrs_data = reinterpret_cast<const P *>(ans.Data());
+  *ints_data = reinterpret_cast<const int32_t *>(ans.Data() + ptrs_bytes);
+  return ans;
+}
+
 }  // namespace internal
 }  // namespace k2
 
@@ -142,34 +256,53 @@ struct iterator_traits<k2::internal::PtrPtr<T>> {
 namespace k2 {
 template <typename T>
 void Transpose(ContextPtr &c, const Array2<T> &src, Array2<T> *dest) {
+  TransposeBatched(c, 1, src, dest);
+}
+
+template <typename T>
+void TransposeBatched(ContextPtr &c, int32_t num_matrices,
+                      const Array2<T> &src, Array2<T> *dest) {
   K2_CHECK(c->IsCompatible(*src.Context()));
   K2_CHECK(c->IsCompatible(*dest->Context()));
-  int32_t rows = src.Dim0();
+  K2_CHECK_GT(num_matrices, 0);
+  K2_CHECK_EQ(src.Dim0() % num_matrices, 0);
+  int32_t rows = src.Dim0() / num_matrices;
   int32_t cols = src.Dim1();
   // TODO(haowen): limit the number of elements?
   K2_CHECK_EQ(rows, dest->Dim1());
-  K2_CHECK_EQ(cols, dest->Dim0());
+  K2_CHECK_EQ(cols * num_matrices, dest->Dim0());
+  if (rows == 0 || cols == 0) return;
   int32_t src_elem_stride0 = src.ElemStride0();
   int32_t dest_elem_stride0 = dest->ElemStride0();
+  int32_t src_matrix_stride = rows * src_elem_stride0,
+          dest_matrix_stride = cols * dest_elem_stride0;
   const T *src_data = src.Data();
   T *dest_data = dest->Data();
   DeviceType d = c->GetDeviceType();
   if (d == kCpu) {
-    for (int32_t i = 0; i < cols; ++i) {
-      for (int32_t j = 0; j < rows; ++j) {
-        dest_data[i * dest_elem_stride0 + j] =
-            src_data[j * src_elem_stride0 + i];
+    for (int32_t b = 0; b < num_matrices; ++b) {
+      const T *this_src_data = src_data + b * src_matrix_stride;
+      T *this_dest_data = dest_data + b * dest_matrix_stride;
+      for (int32_t i = 0; i < cols; ++i) {
+        for (int32_t j = 0; j < rows; ++j) {
+          this_dest_data[i * dest_elem_stride0 + j] =
+              this_src_data[j * src_elem_stride0 + i];
+        }
       }
     }
   } else {
     K2_CHECK_EQ(d, kCuda);
     dim3 block_size(internal::kTransTileDim, internal::kTransBlockRows, 1);
+    // The kernel loops over tiles on axes y and z, whose grid dims are
+    // limited to 65535.
     dim3 grid_size(NumBlocks(cols, internal::kTransTileDim),
-                   NumBlocks(rows, internal::kTransTileDim));
-    internal::TransposeKernel<<<grid_size, block_size, 0, c->GetCudaStream()>>>(
-        rows, cols, src_elem_stride0, dest_elem_stride0, src_data, dest_data);
-    auto ret = cudaDeviceSynchronize();
-    K2_CHECK_CUDA_ERROR(ret);
+                   std::min(NumBlocks(rows, internal::kTransTileDim), 65535),
+                   std::min(num_matrices, 65535));
+    K2_CUDA_SAFE_CALL(
+        internal::TransposeKernel<<<grid_size, block_size, 0,
+                                    c->GetCudaStream()>>>(
+            num_matrices, rows, cols, src_elem_stride0, dest_elem_stride0,
+            src_matrix_stride, dest_matrix_stride, src_data, dest_data));
   }
 }
 
@@ -239,11 +372,10 @@ Array1<T> Append(int32_t num_arrays, const Array1<T> **src) {
   ContextPtr c = src[0]->Context();
 
   std::vector<int32_t> row_splits_vec(num_arrays + 1);
-  int32_t sum = 0, max_dim = 0;
+  int32_t sum = 0;
   row_splits_vec[0] = sum;
   for (int32_t i = 0; i < num_arrays; ++i) {
     int32_t dim = src[i]->Dim();
-    if (dim > max_dim) max_dim = dim;
     sum += dim;
     row_splits_vec[i + 1] = sum;
   }
@@ -265,72 +397,22 @@ Array1<T> Append(int32_t num_arrays, const Array1<T> **src) {
     }
   } else {
     K2_CHECK_EQ(c->GetDeviceType(), kCuda);
-    Array1<int32_t> row_splits(c, row_splits_vec);
-    const int32_t *row_splits_data = row_splits.Data();
+    if (ans_size == 0) return ans;
     std::vector<const T *> src_ptrs_vec(num_arrays);
     for (int32_t i = 0; i < num_arrays; ++i) src_ptrs_vec[i] = src[i]->Data();
-    Array1<const T *> src_ptrs(c, src_ptrs_vec);
-    const T **src_ptrs_data = src_ptrs.Data();
-    int32_t avg_input_size = ans_size / num_arrays;
-    if (max_dim < 2 * avg_input_size + 512) {
-      // here, 2 is a heuristic factor. We're saying, "if the max length of any
-      // of the source arrays is not too much larger than the average length of
-      // the source arrays."  The `+ 512` is an additional heuristic factor, as
-      // we care less about launching too many GPU threads if the number of
-      // elements being processed is small. What we're saying is that the
-      // arrays' sizes are fairly balanced, so we launch with a simple
-      // rectangular kernel.
-      auto lambda_set_data = [=] __host__ __device__(int32_t i,
-                                                     int32_t j) -> void {
-        int32_t row_start = row_splits_data[i],
-                row_end = row_splits_data[i + 1];
-        const T *src_ptr = src_ptrs_data[i];
-        if (j < row_end - row_start) {
-          ans_data[row_start + j] = src_ptr[j];
-        }
-      };
-      Eval2(c, num_arrays, max_dim, lambda_set_data);
-    } else {
-      int32_t block_dim = 256;
-      while (block_dim * 4 < avg_input_size && block_dim < 8192) block_dim *= 2;
-
-      // `index_map` will map from 'new index' to 'old index', with 0 <=
-      // old_index < num_arrays... we handle each source array with multiple
-      // blocks.
-      //  The elements of `index_map` will be of the form:
-      //    old_index + (block_of_this_array << 32).
-      // where `old_index` is an index into `src` and `block_of_this_array`
-      // tells us which block it is, as in 0, 1, 2, 3...
-      // there won't be very many blocks, so it's not a problem to enumerate
-      // them on CPU.
-      std::vector<uint64_t> index_map;
-      index_map.reserve((2 * ans_size) / block_dim);
-      for (int32_t i = 0; i < num_arrays; ++i) {
-        int32_t this_array_size = src[i]->Dim();
-        int32_t this_num_blocks = NumBlocks(this_array_size, block_dim);
-        for (int32_t j = 0; j < this_num_blocks; ++j) {
-          index_map.push_back((static_cast<uint64_t>(j) << 32) +
-                              static_cast<uint64_t>(i));
-        }
-      }
-      Array1<uint64_t> index_map_gpu(c, index_map);
-      const uint64_t *index_map_data = index_map_gpu.Data();
-
-      auto lambda_set_data_blocks = [=] __host__ __device__(int32_t i,
-                                                            int32_t j) {
-        uint64_t index = index_map_data[i];
-        uint32_t orig_i = static_cast<uint32_t>(index),
-                 block_index = static_cast<uint32_t>(index >> 32);
-        int32_t row_start = row_splits_data[orig_i],
-                row_end = row_splits_data[orig_i + 1],
-                orig_j = (block_index * block_dim) + j;
-        const T *src_ptr = src_ptrs_data[orig_i];
-        if (orig_j < row_end - row_start) {
-          ans_data[row_start + orig_j] = src_ptr[orig_j];
-        }
-      };
-      Eval2(c, index_map_gpu.Dim(), block_dim, lambda_set_data_blocks);
-    }
+    // The source pointers and row_splits go to the device in one transfer;
+    // then a single kernel copies everything, each thread finding its source
+    // array by binary search in `row_splits`, so the work is balanced however
+    // different the sizes of the arrays are.
+    const T *const *src_ptrs_data;
+    const int32_t *row_splits_data;
+    Array1<char> table = internal::UploadTable(
+        c, src_ptrs_vec, row_splits_vec, &src_ptrs_data, &row_splits_data);
+    auto lambda_set_data = [=] __host__ __device__(int32_t i) -> void {
+      int32_t src_idx = FindRow(row_splits_data, num_arrays, i);
+      ans_data[i] = src_ptrs_data[src_idx][i - row_splits_data[src_idx]];
+    };
+    Eval(c, ans_size, lambda_set_data);
   }
   return ans;
 }
@@ -345,7 +427,29 @@ Array1<T> Append(int32_t src_size, const Array1<T> *src) {
 }
 
 template <typename T, typename Op>
-void ApplyOpPerSublist(Ragged<T> &src, T default_value, Array1<T> *dst) {
+std::size_t ApplyOpPerSublistTempBytes(Ragged<T> &src, T default_value) {
+  K2_CHECK_GE(src.NumAxes(), 2);
+  ContextPtr c = src.Context();
+  const Array1<int32_t> &row_splits_array =
+      src.shape.RowSplits(src.NumAxes() - 1);
+  int32_t num_rows = row_splits_array.Dim() - 1,
+          num_elems = src.values.Dim();
+  // The same condition as for the cub branch of ApplyOpPerSublist().
+  if (c->GetDeviceType() != kCuda || num_rows == 0 ||
+      num_elems / num_rows <= internal::kMaxWarpPerSublistSize)
+    return 0;
+  const int32_t *row_splits = row_splits_array.Data();
+  std::size_t temp_storage_bytes = 0;
+  K2_CUDA_SAFE_CALL(cub::DeviceSegmentedReduce::Reduce(
+      nullptr, temp_storage_bytes, src.values.Data(),
+      static_cast<T *>(nullptr), num_rows, row_splits, row_splits + 1, Op(),
+      default_value, c->GetCudaStream()));
+  return temp_storage_bytes;
+}
+
+template <typename T, typename Op>
+void ApplyOpPerSublist(Ragged<T> &src, T default_value, Array1<T> *dst,
+                       Array1<char> *temp_storage /*= nullptr*/) {
   K2_CHECK_GE(src.NumAxes(), 2);
   K2_CHECK(IsCompatible(src.shape, *dst));
 
@@ -360,17 +464,49 @@ void ApplyOpPerSublist(Ragged<T> &src, T default_value, Array1<T> *dst) {
   T *output_data = dst->Data();
   Op op;
 
+  int32_t num_elems = src.values.Dim();
+  if (num_rows == 0) return;
+  int32_t avg_len = num_elems / num_rows;
+
   if (c->GetDeviceType() == kCpu) {
-    int32_t j = row_splits[0];
-    for (int32_t i = 0; i < num_rows; ++i) {
-      T val = default_value;
-      int32_t row_end = row_splits[i + 1];
-      for (; j < row_end; ++j) {
-        T elem = values_data[j];
-        val = op(elem, val);
+    auto reduce_rows = [=](int32_t begin, int32_t end) -> void {
+      for (int32_t i = begin; i < end; ++i) {
+        T val = default_value;
+        for (int32_t j = row_splits[i]; j < row_splits[i + 1]; ++j)
+          val = op(values_data[j], val);
+        output_data[i] = val;
       }
-      output_data[i] = val;
+    };
+    if (num_elems < kMinParallelEvalSize) {
+      reduce_rows(0, num_rows);
+    } else {
+      // each range should have at least kMinParallelEvalSize / 4 elements,
+      // on average.
+      int32_t min_rows = std::max<int32_t>(
+          1, kMinParallelEvalSize / 4 / std::max<int32_t>(1, avg_len));
+      ParallelFor(num_rows, min_rows, reduce_rows);
     }
+  } else if (avg_len < internal::kMinWarpPerSublistSize) {
+    K2_CHECK(c->GetDeviceType() == kCuda);
+    // Very short sublists: one thread per sublist.
+    auto lambda_reduce_row = [=] __host__ __device__(int32_t i) -> void {
+      T val = default_value;
+      for (int32_t j = row_splits[i]; j < row_splits[i + 1]; ++j)
+        val = op(values_data[j], val);
+      output_data[i] = val;
+    };
+    Eval(c, num_rows, lambda_reduce_row);
+  } else if (avg_len <= internal::kMaxWarpPerSublistSize) {
+    K2_CHECK(c->GetDeviceType() == kCuda);
+    // Short sublists: one warp per sublist.  cub would use a whole block per
+    // sublist, which would leave most of its threads idle.
+    int32_t grid_size = NumBlocks(num_rows, internal::kWarpsPerBlock);
+    DeviceGuard guard(*c);
+    internal::ApplyOpPerSublistWarpKernel<T, Op>
+        <<<grid_size, internal::kWarpsPerBlock * 32, 0, c->GetCudaStream()>>>(
+            num_rows, row_splits, values_data, default_value, output_data);
+    auto ret = cudaGetLastError();
+    K2_CHECK_CUDA_ERROR(ret);
   } else {
     K2_CHECK(c->GetDeviceType() == kCuda);
 
@@ -383,12 +519,20 @@ void ApplyOpPerSublist(Ragged<T> &src, T default_value, Array1<T> *dst) {
     K2_CUDA_SAFE_CALL(cub::DeviceSegmentedReduce::Reduce(
         d_temp_storage, temp_storage_bytes, values_data, output_data, num_rows,
         row_splits, row_splits + 1, op, default_value, c->GetCudaStream()));
-    void *deleter_context;
-    d_temp_storage = c->Allocate(temp_storage_bytes, &deleter_context);
+    void *deleter_context = nullptr;
+    if (temp_storage != nullptr) {
+      K2_CHECK(c->IsCompatible(*temp_storage->Context()));
+      K2_CHECK_GE(static_cast<std::size_t>(temp_storage->Dim()),
+                  temp_storage_bytes);
+      d_temp_storage = temp_storage->Data();
+    } else {
+      d_temp_storage = c->Allocate(temp_storage_bytes, &deleter_context);
+    }
     K2_CUDA_SAFE_CALL(cub::DeviceSegmentedReduce::Reduce(
         d_temp_storage, temp_storage_bytes, values_data, output_data, num_rows,
         row_splits, row_splits + 1, op, default_value, c->GetCudaStream()));
-    c->Deallocate(d_temp_storage, deleter_context);
+    if (temp_storage == nullptr)
+      c->Deallocate(d_temp_storage, deleter_context);
   }
 }
 
@@ -458,6 +602,100 @@ Array1<T> Range(ContextPtr &c, int32_t dim, T first_value, T inc /*=1*/) {
   return ans;
 }
 
+template <typename T>
+Array1<T> Gather(const Array1<T> &src, int32_t num_maps,
+                 const Array1<int32_t> **maps, T default_value /*= T(0)*/) {
+  ContextPtr c = src.Context();
+  internal::IndexMapChain chain = internal::GetIndexMapChain(c, num_maps, maps);
+  int32_t ans_dim = maps[num_maps - 1]->Dim();
+  Array1<T> ans(c, ans_dim);
+  const T *src_data = src.Data();
+  T *ans_data = ans.Data();
+  auto lambda_gather = [=] __host__ __device__(int32_t i) -> void {
+    int32_t j = chain.Map(i);
+    ans_data[i] = (j == -1 ? default_value : src_data[j]);
+  };
+  Eval<LaunchPolicy<256, 4>>(c, ans_dim, lambda_gather);
+  return ans;
+}
+
+template <typename T>
+void ScatterAdd(const Array1<T> &src, int32_t num_maps,
+                const Array1<int32_t> **maps, Array1<T> *dest) {
+  ContextPtr c = src.Context();
+  K2_CHECK(c->IsCompatible(*dest->Context()));
+  internal::IndexMapChain chain = internal::GetIndexMapChain(c, num_maps, maps);
+  int32_t src_dim = src.Dim();
+  K2_CHECK_EQ(src_dim, maps[num_maps - 1]->Dim());
+  const T *src_data = src.Data();
+  T *dest_data = dest->Data();
+  auto lambda_scatter_add = [=] __host__ __device__(int32_t i) -> void {
+    int32_t j = chain.Map(i);
+    if (j != -1) atomicAdd(dest_data + j, src_data[i]);
+  };
+  Eval<LaunchPolicy<256, 4>>(c, src_dim, lambda_scatter_add);
+}
+
+template <typename T>
+void ScatterAddDeterministic(const Array1<T> &src, int32_t num_maps,
+                             const Array1<int32_t> **maps, Array1<T> *dest) {
+  ContextPtr c = src.Context();
+  K2_CHECK(c->IsCompatible(*dest->Context()));
+  internal::IndexMapChain chain = internal::GetIndexMapChain(c, num_maps, maps);
+  int32_t src_dim = src.Dim(), dest_dim = dest->Dim();
+  K2_CHECK_EQ(src_dim, maps[num_maps - 1]->Dim());
+  const T *src_data = src.Data();
+  T *dest_data = dest->Data();
+  if (c->GetDeviceType() == kCpu) {
+    for (int32_t i = 0; i < src_dim; ++i) {
+      int32_t j = chain.Map(i);
+      if (j != -1) dest_data[j] += src_data[i];
+    }
+    return;
+  }
+  K2_CHECK_EQ(c->GetDeviceType(), kCuda);
+  if (src_dim == 0) return;
+  // Sort the elements of `src` by where they go, with -1 replaced by
+  // dest_dim so it sorts last; the sort is stable, so the elements going to
+  // each element of `dest` stay in order of their index in `src`.
+  Array1<int32_t> keys(c, src_dim), sorted_keys(c, src_dim),
+      order = Range<int32_t>(c, src_dim, 0), sorted_order(c, src_dim);
+  int32_t *keys_data = keys.Data();
+  auto lambda_set_keys = [=] __host__ __device__(int32_t i) -> void {
+    int32_t j = chain.Map(i);
+    keys_data[i] = (j == -1 ? dest_dim : j);
+  };
+  Eval(c, src_dim, lambda_set_keys);
+  int32_t end_bit = 1;
+  while (end_bit < 31 && (1 << end_bit) <= dest_dim) ++end_bit;
+  std::size_t temp_storage_bytes = 0;
+  K2_CUDA_SAFE_CALL(cub::DeviceRadixSort::SortPairs(
+      nullptr, temp_storage_bytes, keys_data, sorted_keys.Data(), order.Data(),
+      sorted_order.Data(), src_dim, 0, end_bit, c->GetCudaStream()));
+  void *deleter_context;
+  void *d_temp_storage = c->Allocate(temp_storage_bytes, &deleter_context);
+  K2_CUDA_SAFE_CALL(cub::DeviceRadixSort::SortPairs(
+      d_temp_storage, temp_storage_bytes, keys_data, sorted_keys.Data(),
+      order.Data(), sorted_order.Data(), src_dim, 0, end_bit,
+      c->GetCudaStream()));
+  c->Deallocate(d_temp_storage, deleter_context);
+
+  Array1<int32_t> row_splits(c, dest_dim + 2);
+  RowIdsToRowSplits(c, src_dim, sorted_keys.Data(), false, dest_dim + 1,
+                    row_splits.Data());
+  const int32_t *row_splits_data = row_splits.Data(),
+                *sorted_order_data = sorted_order.Data();
+  auto lambda_sum = [=] __host__ __device__(int32_t j) -> void {
+    int32_t begin = row_splits_data[j], end = row_splits_data[j + 1];
+    if (begin == end) return;
+    T sum = src_data[sorted_order_data[begin]];
+    for (int32_t k = begin + 1; k < end; ++k)
+      sum += src_data[sorted_order_data[k]];
+    dest_data[j] += sum;
+  };
+  Eval(c, dest_dim, lambda_sum);
+}
+
 template <typename T>
 Array2<T> ToContiguous(const Array2<T> &src) {
   int32_t dim0 = src.Dim0();
@@ -471,10 +709,61 @@ Array2<T> ToContiguous(const Array2<T> &src) {
                                                    int32_t j) -> void {
     out[i * dim1 + j] = in[i * elem_stride0 + j];
   };
-  Eval2(src.Context(), dim0, dim1, lambda_copy_elems);
+  // a simple copy, so let each thread do several rows.
+  Eval2<LaunchPolicy<256, 4>>(src.Context(), dim0, dim1, lambda_copy_elems);
   return ans;
 }
 
+namespace internal {
+static constexpr int32_t kMaxReadbackAddresses = 32;
+// The addresses of some of the scalars of a HostReadback, passed to the
+// gathering kernel by value so that they don't have to be copied to the
+// device first.
+template <typename T>
+struct ReadbackAddresses {
+  const T *addresses[kMaxReadbackAddresses];
+};
+}  // namespace internal
+
+template <typename T>
+void HostReadback<T>::Fetch() {
+  int32_t n = Size();
+  values_.resize(n);
+  if (n == 0) return;
+  if (c_->GetDeviceType() == kCpu) {
+    for (int32_t i = 0; i != n; ++i) values_[i] = *srcs_[i];
+    return;
+  }
+  ContextPtr pinned = GetTransferContext(*c_, GetCpuContext());
+  Array1<T> host_values(pinned, n);
+  if (n == 1) {
+    MemoryCopyAsync(static_cast<void *>(host_values.Data()),
+                    static_cast<const void *>(srcs_[0]), sizeof(T), *pinned,
+                    *c_);
+  } else {
+    Array1<T> values(c_, n);
+    T *values_data = values.Data();
+    for (int32_t begin = 0; begin < n;
+         begin += internal::kMaxReadbackAddresses) {
+      int32_t num_addresses =
+          std::min(n - begin, internal::kMaxReadbackAddresses);
+      internal::ReadbackAddresses<T> addresses;
+      std::copy(srcs_.begin() + begin, srcs_.begin() + begin + num_addresses,
+                addresses.addresses);
+      T *this_values_data = values_data + begin;
+      auto lambda_gather = [=] __host__ __device__(int32_t i) -> void {
+        this_values_data[i] = *addresses.addresses[i];
+      };
+      Eval(c_, num_addresses, lambda_gather);
+    }
+    MemoryCopyAsync(static_cast<void *>(host_values.Data()),
+                    static_cast<const void *>(values_data), n * sizeof(T),
+                    *pinned, *c_);
+  }
+  c_->Sync();
+  std::copy(host_values.Data(), host_values.Data() + n, values_.begin());
+}
+
 }  // namespace k2
 
 #endif  // K2_CSRC_ARRAY_OPS_INL_H_
@@ -12,10 +12,14 @@
 #include <gmock/gmock.h>
 #include <gtest/gtest.h>
 
+#include <algorithm>
+#include <cmath>
 #include <cstdio>
 #include <iostream>
+#include <limits>
 #include <numeric>
 #include <random>
+#include <tuple>
 #include <utility>
 #include <vector>
 
@@ -119,6 +123,60 @@ TEST(OpsTest, TransposeTest) {
     TestTranspose<int32_t, kCuda>(1000, 2000, 100, true);
     TestTranspose<float, kCuda>(1000, 2000, 100, true);
     TestTranspose<double, kCuda>(1000, 2000, 100, true);
+    // (T, num_symbols) scores of a 5000-symbol BPE model
+    TestTranspose<float, kCuda>(500, 5000, 100, true);
+  }
+}
+
+template <typename T, DeviceType d>
+void TestTransposeBatched(int32_t num_matrices, int32_t num_rows,
+                          int32_t num_cols) {
+  ContextPtr cpu = GetCpuContext();  // will use to copy data
+  ContextPtr context = nullptr;
+  if (d == kCpu) {
+    context = GetCpuContext();
+  } else {
+    K2_CHECK_EQ(d, kCuda);
+    context = GetCudaContext();
+  }
+
+  int32_t num_elements = num_rows * num_cols;
+  std::vector<T> host_src(num_matrices * num_elements);
+  std::iota(host_src.begin(), host_src.end(), 0);
+  std::vector<T> gold(num_matrices * num_elements);
+  for (int32_t b = 0; b != num_matrices; ++b)
+    MatrixTanspose<T>(num_rows, num_cols, host_src.data() + b * num_elements,
+                      gold.data() + b * num_elements);
+
+  // Not constructed from an Array1, because that requires nonzero dims.
+  int32_t num_bytes = num_matrices * num_elements * sizeof(T);
+  auto src_region = NewRegion(context, num_bytes);
+  Array2<T> src(num_matrices * num_rows, num_cols, num_cols, 0, src_region);
+  auto kind = GetMemoryCopyKind(*cpu, *src.Context());
+  MemoryCopy(static_cast<void *>(src.Data()),
+             static_cast<const void *>(host_src.data()), num_bytes, kind);
+  Array2<T> dest(context, num_matrices * num_cols, num_rows);
+  TransposeBatched<T>(context, num_matrices, src, &dest);
+
+  Array1<T> dest_array = dest.Flatten().To(cpu);
+  std::vector<T> host_dest(dest_array.Data(),
+                           dest_array.Data() + dest_array.Dim());
+  EXPECT_EQ(host_dest, gold);
+}
+
+TEST(OpsTest, TransposeBatchedTest) {
+  std::vector<std::tuple<int32_t, int32_t, int32_t>> shapes = {
+      {1, 0, 0}, {3, 1, 1}, {4, 5, 4}, {2, 100, 0}, {7, 15, 13}, {5, 115, 180},
+  };
+  for (int32_t i = 0; i != 3; ++i)
+    shapes.emplace_back(RandInt(1, 20), RandInt(0, 300), RandInt(0, 300));
+  for (const auto &v : shapes) {
+    TestTransposeBatched<int32_t, kCpu>(std::get<0>(v), std::get<1>(v),
+                                        std::get<2>(v));
+    TestTransposeBatched<int32_t, kCuda>(std::get<0>(v), std::get<1>(v),
+                                         std::get<2>(v));
+    TestTransposeBatched<double, kCuda>(std::get<0>(v), std::get<1>(v),
+                                        std::get<2>(v));
   }
 }
 
@@ -269,6 +327,40 @@ TEST(OpsTest, ExclusiveSumArray1Test) {
   TestExclusiveSumArray1<int32_t, int32_t, kCuda>(1000);
   TestExclusiveSumArray1<float, double, kCpu>(1000);
   TestExclusiveSumArray1<float, double, kCuda>(1000);
+  // large enough to use the parallel scan on CPU; the sums are too large to
+  // be exact in float, so the in-place floating-point case uses double.
+  TestExclusiveSumArray1<int32_t, int32_t, kCpu>(100000);
+  TestExclusiveSumArray1<int32_t, int32_t, kCuda>(100000);
+  TestExclusiveSumArray1<double, double, kCpu>(100000);
+}
+
+template <DeviceType d>
+void TestExclusiveSumWithTotal() {
+  ContextPtr context = (d == kCpu ? GetCpuContext() : GetCudaContext());
+  for (int32_t num_elem : {1, 10, 100000}) {
+    std::vector<int32_t> data(num_elem);
+    for (auto &x : data) x = RandInt(0, 10);
+    std::vector<int32_t> expected(num_elem + 1);
+    ComputeExclusiveSum(data, &expected);
+
+    // allocate one extra element, as ExclusiveSum() may read it.
+    std::vector<int32_t> padded_data(data);
+    padded_data.push_back(0);
+    Array1<int32_t> src =
+        Array1<int32_t>(context, padded_data).Range(0, num_elem);
+    Array1<int32_t> dest(context, num_elem + 1);
+    int32_t total = ExclusiveSumWithTotal(src, &dest);
+    EXPECT_EQ(total, expected.back());
+    CheckExclusiveSumArray1Result(data, dest);
+
+    ExclusiveSumInPlace(&src);
+    CheckExclusiveSumArray1Result(data, src);
+  }
+}
+
+TEST(OpsTest, ExclusiveSumWithTotal) {
+  TestExclusiveSumWithTotal<kCpu>();
+  TestExclusiveSumWithTotal<kCuda>();
 }
 
 template <typename T>
@@ -650,6 +742,108 @@ TEST(OpsTest, MaxPerSubListTest) {
   TestMaxPerSubListTest<int32_t, kCuda>();
 }
 
+// Checks the different code paths, which depend on the average sublist length
+// (and on CPU, on the total size).
+template <DeviceType d>
+void TestMaxPerSublistLengths() {
+  ContextPtr context = (d == kCpu ? GetCpuContext() : GetCudaContext());
+  for (int32_t max_len : {0, 2, 8, 60, 500, 5000}) {
+    int32_t num_rows = (max_len <= 8 ? 20000 : 200000 / max_len);
+    std::vector<int32_t> row_splits(num_rows + 1, 0);
+    for (int32_t i = 0; i != num_rows; ++i)
+      row_splits[i + 1] = row_splits[i] + RandInt(0, max_len);
+    int32_t num_elems = row_splits.back();
+    std::vector<int32_t> values(num_elems);
+    for (int32_t j = 0; j != num_elems; ++j) values[j] = RandInt(-1000, 1000);
+    int32_t default_value = 900;
+    std::vector<int32_t> expected(num_rows);
+    for (int32_t i = 0; i != num_rows; ++i) {
+      expected[i] = default_value;
+      for (int32_t j = row_splits[i]; j != row_splits[i + 1]; ++j)
+        expected[i] = std::max(expected[i], values[j]);
+    }
+
+    Array1<int32_t> row_splits_array(context, row_splits);
+    RaggedShape shape = RaggedShape2(&row_splits_array, nullptr, num_elems);
+    Ragged<int32_t> ragged(shape, Array1<int32_t>(context, values));
+    Array1<int32_t> max_values(context, num_rows);
+    MaxPerSublist(ragged, default_value, &max_values);
+    max_values = max_values.To(GetCpuContext());
+    std::vector<int32_t> cpu_data(max_values.Data(),
+                                  max_values.Data() + max_values.Dim());
+    EXPECT_EQ(cpu_data, expected);
+
+    // The same with preallocated temporary storage, as for a CudaGraph.
+    std::size_t temp_bytes =
+        ApplyOpPerSublistTempBytes<int32_t, MaxOp<int32_t>>(ragged,
+                                                            default_value);
+    if (d == kCpu || max_len <= 256) EXPECT_EQ(temp_bytes, 0);
+    Array1<char> temp_storage(context, static_cast<int32_t>(temp_bytes));
+    Array1<int32_t> max_values2(context, num_rows);
+    MaxPerSublist(ragged, default_value, &max_values2, &temp_storage);
+    max_values2 = max_values2.To(GetCpuContext());
+    EXPECT_EQ(std::vector<int32_t>(max_values2.Data(),
+                                   max_values2.Data() + max_values2.Dim()),
+              expected);
+  }
+}
+
+TEST(OpsTest, MaxPerSublistLengths) {
+  TestMaxPerSublistLengths<kCpu>();
+  TestMaxPerSublistLengths<kCuda>();
+}
+
+template <typename T, DeviceType d>
+void TestLogSumPerSublist() {
+  ContextPtr cpu = GetCpuContext();
+  ContextPtr context = (d == kCpu ? cpu : GetCudaContext());
+  T inf = std::numeric_limits<T>::infinity();
+  for (int32_t max_len : {0, 3, 40, 600}) {
+    int32_t num_rows = 300;
+    std::vector<int32_t> row_splits(num_rows + 1, 0);
+    for (int32_t i = 0; i != num_rows; ++i)
+      row_splits[i + 1] = row_splits[i] + RandInt(0, max_len);
+    int32_t num_elems = row_splits.back();
+    std::vector<T> values(num_elems);
+    for (int32_t j = 0; j != num_elems; ++j)
+      values[j] = (RandInt(0, 9) == 0 ? -inf : RandInt(-100, 100) / T(10));
+    std::vector<T> expected(num_rows);
+    for (int32_t i = 0; i != num_rows; ++i) {
+      double sum = 0;
+      for (int32_t j = row_splits[i]; j != row_splits[i + 1]; ++j)
+        sum += std::exp(static_cast<double>(values[j]));
+      expected[i] = static_cast<T>(std::log(sum));
+    }
+
+    Array1<int32_t> row_splits_array(context, row_splits);
+    RaggedShape shape = RaggedShape2(&row_splits_array, nullptr, num_elems);
+    Ragged<T> ragged(shape, Array1<T>(context, values));
+    Array1<T> log_sums(context, num_rows);
+    LogSumPerSublist(ragged, -inf, &log_sums);
+    log_sums = log_sums.To(cpu);
+    for (int32_t i = 0; i != num_rows; ++i) {
+      if (expected[i] == -inf)
+        EXPECT_EQ(log_sums[i], -inf);
+      else
+        EXPECT_NEAR(log_sums[i], expected[i], 1.0e-03);
+    }
+
+    // the results are the same when repeated.
+    Array1<T> log_sums2(context, num_rows);
+    LogSumPerSublist(ragged, -inf, &log_sums2);
+    log_sums2 = log_sums2.To(cpu);
+    for (int32_t i = 0; i != num_rows; ++i)
+      EXPECT_EQ(log_sums2[i], log_sums[i]);
+  }
+}
+
+TEST(OpsTest, LogSumPerSublistTest) {
+  TestLogSumPerSublist<float, kCpu>();
+  TestLogSumPerSublist<float, kCuda>();
+  TestLogSumPerSublist<double, kCpu>();
+  TestLogSumPerSublist<double, kCuda>();
+}
+
 template <typename T, DeviceType d>
 void TestAndOrPerSubListTest() {
   ContextPtr cpu = GetCpuContext();  // will use to copy data
@@ -1341,4 +1535,124 @@ TEST(OpsTest, ValidateRowSplitsAndIdsTest) {
   TestValidateRowSplitsAndIds<kCuda>();
 }
 
+template <typename T, DeviceType d>
+void TestGatherAndScatterAdd() {
+  ContextPtr cpu = GetCpuContext();  // will use to copy data
+  ContextPtr context = nullptr;
+  if (d == kCpu) {
+    context = GetCpuContext();
+  } else {
+    K2_CHECK_EQ(d, kCuda);
+    context = GetCudaContext();
+  }
+
+  for (int32_t iter = 0; iter != 5; ++iter) {
+    // a chain of random maps, each with some -1 entries, like the arc_maps
+    // from a sequence of algorithms.
+    int32_t num_maps = RandInt(1, 3), src_dim = RandInt(1, 1000);
+    std::vector<std::vector<int32_t>> maps_vec(num_maps);
+    int32_t prev_dim = src_dim;
+    for (int32_t k = 0; k != num_maps; ++k) {
+      int32_t dim = RandInt(1, 1000);
+      for (int32_t i = 0; i != dim; ++i)
+        maps_vec[k].push_back(RandInt(0, 9) == 0 ? -1
+                                                 : RandInt(0, prev_dim - 1));
+      prev_dim = dim;
+    }
+    std::vector<Array1<int32_t>> maps;
+    std::vector<const Array1<int32_t> *> map_ptrs;
+    for (const auto &v : maps_vec) maps.emplace_back(context, v);
+    for (const auto &m : maps) map_ptrs.push_back(&m);
+    int32_t ans_dim = maps.back().Dim();
+
+    // compose the maps on CPU
+    std::vector<int32_t> composed(ans_dim);
+    for (int32_t i = 0; i != ans_dim; ++i) {
+      int32_t j = i;
+      for (int32_t k = num_maps - 1; k >= 0 && j != -1; --k)
+        j = maps_vec[k][j];
+      composed[i] = j;
+    }
+
+    std::vector<T> src_vec(src_dim);
+    for (int32_t i = 0; i != src_dim; ++i) src_vec[i] = RandInt(-100, 100);
+    Array1<T> src(context, src_vec);
+    {
+      // Gather
+      Array1<T> ans = Gather(src, num_maps, map_ptrs.data(), T(-1000));
+      ans = ans.To(cpu);
+      ASSERT_EQ(ans.Dim(), ans_dim);
+      for (int32_t i = 0; i != ans_dim; ++i)
+        EXPECT_EQ(ans[i], composed[i] == -1 ? T(-1000) : src_vec[composed[i]]);
+    }
+    {
+      // ScatterAdd and ScatterAddDeterministic; the values are integers so
+      // the sums are exact whatever the order.
+      std::vector<T> values_vec(ans_dim);
+      for (int32_t i = 0; i != ans_dim; ++i) values_vec[i] = RandInt(-10, 10);
+      Array1<T> values(context, values_vec);
+      std::vector<T> expected(src_vec);
+      for (int32_t i = 0; i != ans_dim; ++i)
+        if (composed[i] != -1) expected[composed[i]] += values_vec[i];
+
+      Array1<T> dest(context, src_vec);
+      ScatterAdd(values, num_maps, map_ptrs.data(), &dest);
+      dest = dest.To(cpu);
+      std::vector<T> dest_vec(dest.Data(), dest.Data() + dest.Dim());
+      EXPECT_EQ(dest_vec, expected);
+
+      Array1<T> dest2(context, src_vec);
+      ScatterAddDeterministic(values, num_maps, map_ptrs.data(), &dest2);
+      dest2 = dest2.To(cpu);
+      std::vector<T> dest2_vec(dest2.Data(), dest2.Data() + dest2.Dim());
+      EXPECT_EQ(dest2_vec, expected);
+    }
+  }
+}
+
+template <typename T, DeviceType d>
+void TestHostReadback() {
+  ContextPtr cpu = GetCpuContext();
+  ContextPtr context = (d == kCpu ? cpu : GetCudaContext());
+  std::vector<T> src_vec(100);
+  std::iota(src_vec.begin(), src_vec.end(), 0);
+  Array1<T> src(context, src_vec);
+  for (int32_t n : {0, 1, 3, 70}) {
+    HostReadback<T> readback(context);
+    std::vector<int32_t> indexes, positions;
+    for (int32_t i = 0; i != n; ++i) {
+      int32_t pos = RandInt(0, 99);
+      positions.push_back(pos);
+      indexes.push_back(i % 2 == 0 ? readback.Add(src, pos)
+                                   : readback.Add(src.Data() + pos));
+    }
+    EXPECT_EQ(readback.Size(), n);
+    readback.Fetch();
+    for (int32_t i = 0; i != n; ++i) {
+      EXPECT_EQ(indexes[i], i);
+      EXPECT_EQ(readback[i], src_vec[positions[i]]);
+    }
+    // more can be added after a Fetch().
+    int32_t last = readback.Add(src, 99);
+    readback.Fetch();
+    EXPECT_EQ(readback[last], T(99));
+  }
+}
+
+TEST(OpsTest, HostReadbackTest) {
+  TestHostReadback<int32_t, kCpu>();
+  TestHostReadback<int32_t, kCuda>();
+  TestHostReadback<double, kCpu>();
+  TestHostReadback<double, kCuda>();
+}
+
+TEST(OpsTest, GatherAndScatterAddTest) {
+  TestGatherAndScatterAdd<int32_t, kCpu>();
+  TestGatherAndScatterAdd<int32_t, kCuda>();
+  TestGatherAndScatterAdd<float, kCpu>();
+  TestGatherAndScatterAdd<float, kCuda>();
+  TestGatherAndScatterAdd<double, kCpu>();
+  TestGatherAndScatterAdd<double, kCuda>();
+}
+
 }  // namespace k2
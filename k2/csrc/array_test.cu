@@ -338,6 +338,9 @@ void TestArray2() {
 
     auto cpu_array = array.To(cpu);
     auto cuda_array = array.To(GetCudaContext());
+    if (!context->IsCompatible(*cpu)) {
+      EXPECT_EQ(cpu_array.ElemStride0(), kDim1);
+    }
 
     auto k = 0;
     for (auto r = 0; r != kDim0; ++r)
@@ -689,6 +692,71 @@ TEST(ArrayTest, Array1Test) {
   TestArray1<double, kCuda>();
 }
 
+TEST(ArrayTest, Array1PushBack) {
+  ContextPtr cpu = GetCpuContext();
+  Array1<int32_t> array(cpu, 0);
+  array.Reserve(10);
+  EXPECT_GE(array.Capacity(), 10);
+  void *data = array.Data();
+  for (int32_t i = 0; i != 10; ++i) array.PushBack(i);
+  // no reallocation within the reserved capacity.
+  EXPECT_EQ(array.Data(), data);
+  for (int32_t i = 10; i != 1000; ++i) array.PushBack(i);
+  std::vector<int32_t> more(100);
+  std::iota(more.begin(), more.end(), 1000);
+  array.Append(more.data(), 100);
+  ASSERT_EQ(array.Dim(), 1100);
+  EXPECT_GE(array.Capacity(), 1100);
+  for (int32_t i = 0; i != 1100; ++i) EXPECT_EQ(array[i], i);
+
+  // an array that doesn't own the end of its region can't grow in place.
+  Array1<int32_t> part = array.Range(0, 10);
+  EXPECT_EQ(part.Capacity(), 10);
+
+  // Append() also works for arrays on GPU.
+  ContextPtr cuda = GetCudaContext();
+  Array1<int32_t> cuda_array(cuda, 0);
+  cuda_array.Append(more.data(), 100);
+  cuda_array.Append(more.data(), 100);
+  ASSERT_EQ(cuda_array.Dim(), 200);
+  for (int32_t i = 0; i != 200; ++i) EXPECT_EQ(cuda_array[i], more[i % 100]);
+}
+
+template <DeviceType d>
+void TestAtomicAppender() {
+  ContextPtr c = (d == kCpu ? GetCpuContext() : GetCudaContext());
+  // each i appends i % 3 copies of i.
+  int32_t n = 50000, num_expected = 0;
+  for (int32_t i = 0; i != n; ++i) num_expected += i % 3;
+  AtomicAppender<int32_t> appender(c, num_expected);
+  AtomicAppender<int32_t>::View view = appender.GetView();
+  auto lambda_append = [=] __host__ __device__(int32_t i) -> void {
+    for (int32_t j = 0; j < i % 3; ++j) view.Append(i);
+  };
+  Eval(c, n, lambda_append);
+  EXPECT_FALSE(appender.Overflowed());
+  Array1<int32_t> ans = appender.Finish().To(GetCpuContext());
+  ASSERT_EQ(ans.Dim(), num_expected);
+  std::vector<int32_t> sorted(ans.Data(), ans.Data() + ans.Dim());
+  std::sort(sorted.begin(), sorted.end());
+  for (int32_t i = 0, k = 0; i != n; ++i)
+    for (int32_t j = 0; j < i % 3; ++j) EXPECT_EQ(sorted[k++], i);
+
+  AtomicAppender<int32_t> small(c, 10);
+  AtomicAppender<int32_t>::View small_view = small.GetView();
+  auto lambda_append_small = [=] __host__ __device__(int32_t i) -> void {
+    small_view.Append(i);
+  };
+  Eval(c, 20, lambda_append_small);
+  EXPECT_TRUE(small.Overflowed());
+  EXPECT_EQ(small.NumAppended(), 20);
+}
+
+TEST(ArrayTest, AtomicAppender) {
+  TestAtomicAppender<kCpu>();
+  TestAtomicAppender<kCuda>();
+}
+
 TEST(ArrayTest, Array2Test) {
   TestArray2<int32_t, kCpu>();
   TestArray2<int32_t, kCuda>();
@@ -0,0 +1,206 @@
+/**
+ * @brief
+ * aux_labels
+ *
+ * @copyright
+ * Copyright (c)  2026  agent (agent@local)
+ *
+ * @copyright
+ * See LICENSE for clarification regarding multiple authors
+ */
+
+#include "k2/csrc/array_ops.h"
+#include "k2/csrc/aux_labels.h"
+#include "k2/csrc/context.h"
+
+namespace k2 {
+
+Ragged<int32_t> MapAuxLabels1(Ragged<int32_t> &aux_labels,
+                              const Array1<int32_t> &arc_map) {
+  K2_CHECK_EQ(aux_labels.NumAxes(), 2);
+  K2_CHECK(IsCompatible(aux_labels, arc_map));
+  return aux_labels.IndexMany(arc_map);
+}
+
+Ragged<int32_t> MapAuxLabels2(Ragged<int32_t> &aux_labels,
+                              Ragged<int32_t> &arc_map) {
+  K2_CHECK_EQ(aux_labels.NumAxes(), 2);
+  K2_CHECK_EQ(arc_map.NumAxes(), 2);
+  K2_CHECK(IsCompatible(aux_labels, arc_map));
+  // `labels` is indexed [arc_map.values index][label]; putting arc_map's
+  // shape on top of it and removing the middle axis concatenates the labels
+  // of the input arcs of each output arc.
+  Ragged<int32_t> labels = aux_labels.IndexMany(arc_map.values);
+  RaggedShape shape = ComposeRaggedShapes(arc_map.shape, labels.shape);
+  return Ragged<int32_t>(RemoveAxis(shape, 1), labels.values);
+}
+
+void Invert(FsaVec &src, Ragged<int32_t> &src_aux_labels, FsaVec *dest,
+            Ragged<int32_t> *dest_aux_labels,
+            Array1<int32_t> *arc_map /*= nullptr*/) {
+  K2_CHECK_EQ(src.NumAxes(), 3);
+  K2_CHECK_EQ(src_aux_labels.NumAxes(), 2);
+  K2_CHECK_NE(dest, nullptr);
+  K2_CHECK_NE(dest_aux_labels, nullptr);
+  K2_CHECK(IsCompatible(src, src_aux_labels));
+  ContextPtr &c = src.Context();
+  int32_t num_fsas = src.shape.Dim0(), num_states = src.shape.TotSize(1),
+          num_arcs = src.values.Dim();
+  K2_CHECK_EQ(src_aux_labels.shape.Dim0(), num_arcs);
+
+  const int32_t *row_splits1_data = src.shape.RowSplits(1).Data(),
+                *row_ids1_data = src.shape.RowIds(1).Data(),
+                *row_splits2_data = src.shape.RowSplits(2).Data(),
+                *row_ids2_data = src.shape.RowIds(2).Data(),
+                *aux_row_splits_data = src_aux_labels.shape.RowSplits(1).Data(),
+                *aux_data = src_aux_labels.values.Data();
+  const Arc *arcs_data = static_cast<const Array1<Arc> &>(src.values).Data();
+
+  // Row 0 of `counts` is the number of new states for each arc, row 1 is 1 if
+  // its symbol is not epsilon (i.e. it gives an output aux label), and row 2
+  // is 1 if it enters the final state without the aux labels [-1].  After
+  // the exclusive sum the last column has the totals, which is all we need
+  // to transfer.
+  Array2<int32_t> counts(c, 3, num_arcs + 1), sums(c, 3, num_arcs + 1);
+  int32_t *counts_data = counts.Data(), stride = counts.ElemStride0();
+  auto lambda_set_counts = [=] __host__ __device__(int32_t i) -> void {
+    int32_t num_extra = 0, non_eps = 0, bad = 0;
+    if (i < num_arcs) {
+      int32_t begin = aux_row_splits_data[i], end = aux_row_splits_data[i + 1],
+              fsa_idx0 = row_ids1_data[row_ids2_data[i]];
+      num_extra = (end - begin > 1 ? end - begin - 1 : 0);
+      const Arc &arc = arcs_data[i];
+      non_eps = (arc.symbol != 0 ? 1 : 0);
+      int32_t final_state = row_splits1_data[fsa_idx0 + 1] -
+                            row_splits1_data[fsa_idx0] - 1;
+      if (arc.dest_state == final_state &&
+          (end - begin != 1 || aux_data[begin] != -1))
+        bad = 1;
+    }
+    counts_data[i] = num_extra;
+    counts_data[stride + i] = non_eps;
+    counts_data[2 * stride + i] = bad;
+  };
+  Eval(c, num_arcs + 1, lambda_set_counts);
+  ExclusiveSum(counts, &sums);
+  const int32_t *sums_data = sums.Data();
+  int32_t sums_stride = sums.ElemStride0();
+  Array1<int32_t> totals(c, 3);
+  int32_t *totals_data = totals.Data();
+  auto lambda_get_totals = [=] __host__ __device__(int32_t i) -> void {
+    totals_data[i] = sums_data[i * sums_stride + num_arcs];
+  };
+  Eval(c, 3, lambda_get_totals);
+  Array1<int32_t> totals_cpu = totals.To(GetCpuContext());
+  int32_t tot_extra = totals_cpu[0], tot_labels = totals_cpu[1];
+  K2_CHECK_EQ(totals_cpu[2], 0)
+      << "Arcs entering the final state must have exactly one aux label, -1";
+
+  // extra_before[i] is the number of new states for arcs before arc i, and
+  // labels_before[i] the number of arcs before arc i with non-epsilon symbol.
+  // State s of `src` becomes state s + extra_before[row_splits2[s]] of
+  // `dest`, followed by the new states for its arcs; its arcs become the
+  // first arcs of their chains, followed by the rest of the chains in order.
+  const int32_t *extra_before = sums_data,
+                *labels_before = sums_data + sums_stride;
+  int32_t num_out_states = num_states + tot_extra,
+          num_out_arcs = num_arcs + tot_extra;
+  Array1<int32_t> out_row_splits1(c, num_fsas + 1),
+      out_row_ids1(c, num_out_states), out_row_splits2(c, num_out_states + 1),
+      out_row_ids2(c, num_out_arcs), out_arc_map(c, num_out_arcs),
+      out_aux_row_splits(c, num_out_arcs + 1);
+  Array1<Arc> out_arcs(c, num_out_arcs);
+  Array1<int32_t> out_aux(c, tot_labels);
+  int32_t *out_row_splits1_data = out_row_splits1.Data(),
+          *out_row_ids1_data = out_row_ids1.Data(),
+          *out_row_splits2_data = out_row_splits2.Data(),
+          *out_row_ids2_data = out_row_ids2.Data(),
+          *out_arc_map_data = out_arc_map.Data(),
+          *out_aux_row_splits_data = out_aux_row_splits.Data(),
+          *out_aux_data = out_aux.Data();
+  Arc *out_arcs_data = out_arcs.Data();
+
+  auto lambda_set_row_splits1 = [=] __host__ __device__(int32_t i) -> void {
+    int32_t state_idx0x = row_splits1_data[i];
+    out_row_splits1_data[i] =
+        state_idx0x + extra_before[row_splits2_data[state_idx0x]];
+  };
+  Eval(c, num_fsas + 1, lambda_set_row_splits1);
+
+  auto lambda_set_states = [=] __host__ __device__(int32_t i) -> void {
+    // i is a state of `src`; this also sets the last elements of the
+    // row_splits for i == num_states.
+    int32_t arc_begin = row_splits2_data[i],
+            out_state = i + extra_before[arc_begin],
+            out_arc_begin = arc_begin + extra_before[arc_begin];
+    out_row_splits2_data[out_state] = out_arc_begin;
+    if (i == num_states) {
+      out_aux_row_splits_data[num_out_arcs] = labels_before[num_arcs];
+      return;
+    }
+    out_row_ids1_data[out_state] = row_ids1_data[i];
+  };
+  Eval(c, num_states + 1, lambda_set_states);
+
+  auto lambda_set_arcs = [=] __host__ __device__(int32_t i) -> void {
+    int32_t state_idx01 = row_ids2_data[i],
+            fsa_idx0 = row_ids1_data[state_idx01],
+            state_idx0x = row_splits1_data[fsa_idx0],
+            out_state_idx0x = out_row_splits1_data[fsa_idx0],
+            arc_begin = row_splits2_data[state_idx01],
+            arc_end = row_splits2_data[state_idx01 + 1],
+            extra_begin = extra_before[arc_begin],
+            out_state = state_idx01 + extra_begin,
+            out_arc = i + extra_begin,
+            // the first new state, and the second arc, of this arc's chain
+            chain_state = out_state + 1 + extra_before[i] - extra_begin,
+            chain_arc = arc_end + extra_before[i],
+            num_extra = extra_before[i + 1] - extra_before[i];
+    const Arc &arc = arcs_data[i];
+    int32_t dest_state_idx01 = state_idx0x + arc.dest_state,
+            out_dest_state =
+                dest_state_idx01 +
+                extra_before[row_splits2_data[dest_state_idx01]] -
+                out_state_idx0x,
+            label_begin = aux_row_splits_data[i],
+            label_end = aux_row_splits_data[i + 1];
+
+    Arc out;
+    out.src_state = out_state - out_state_idx0x;
+    out.dest_state =
+        (num_extra > 0 ? chain_state - out_state_idx0x : out_dest_state);
+    out.symbol = (label_end > label_begin ? aux_data[label_begin] : 0);
+    out.score = arc.score;
+    out_arcs_data[out_arc] = out;
+    out_row_ids2_data[out_arc] = out_state;
+    out_arc_map_data[out_arc] = i;
+    out_aux_row_splits_data[out_arc] = labels_before[i];
+    if (arc.symbol != 0) out_aux_data[labels_before[i]] = arc.symbol;
+
+    for (int32_t k = 0; k < num_extra; ++k) {
+      int32_t this_state = chain_state + k, this_arc = chain_arc + k;
+      out.src_state = this_state - out_state_idx0x;
+      out.dest_state = (k + 1 < num_extra ? this_state + 1 - out_state_idx0x
+                                          : out_dest_state);
+      out.symbol = aux_data[label_begin + k + 1];
+      out.score = 0;
+      out_arcs_data[this_arc] = out;
+      out_row_ids1_data[this_state] = fsa_idx0;
+      out_row_splits2_data[this_state] = this_arc;
+      out_row_ids2_data[this_arc] = this_state;
+      out_arc_map_data[this_arc] = i;
+      out_aux_row_splits_data[this_arc] = labels_before[arc_end];
+    }
+  };
+  Eval(c, num_arcs, lambda_set_arcs);
+
+  RaggedShape out_shape =
+      RaggedShape3(&out_row_splits1, &out_row_ids1, num_out_states,
+                   &out_row_splits2, &out_row_ids2, num_out_arcs);
+  *dest = Ragged<Arc>(out_shape, out_arcs);
+  *dest_aux_labels = Ragged<int32_t>(
+      RaggedShape2(&out_aux_row_splits, nullptr, tot_labels), out_aux);
+  if (arc_map != nullptr) *arc_map = out_arc_map;
+}
+
+}  // namespace k2
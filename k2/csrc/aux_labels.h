@@ -0,0 +1,101 @@
+/**
+ * @brief
+ * aux_labels
+ *
+ * @copyright
+ * Copyright (c)  2026  agent (agent@local)
+ *
+ * @copyright
+ * See LICENSE for clarification regarding multiple authors
+ */
+
+#ifndef K2_CSRC_AUX_LABELS_H_
+#define K2_CSRC_AUX_LABELS_H_
+
+#include "k2/csrc/array.h"
+#include "k2/csrc/fsa.h"
+#include "k2/csrc/ragged.h"
+
+namespace k2 {
+
+/*
+  These are the device versions of AuxLabels1Mapper, AuxLabels2Mapper and
+  FstInverter in host/aux_labels.h; they work on all the FSAs of an FsaVec at
+  once.  The auxiliary labels of the arcs of an FsaVec (e.g. the output
+  symbols of a transducer) are a Ragged<int32_t> with 2 axes, indexed
+  [arc][label]: its Dim0() is the total number of arcs (fsas.values.Dim()),
+  and each arc may have any number of labels, including none.
+ */
+
+/*
+  Maps the aux labels of the arcs of an FsaVec to those of the arcs of the
+  output of an algorithm that gives one input arc per output arc (e.g.
+  ArcSort(), TopSort() or Intersect()).
+
+     @param [in] aux_labels  The aux labels of the input arcs, indexed
+                             [arc][label]
+     @param [in] arc_map     For each output arc, the index of the input arc
+                             it corresponds to; must satisfy
+                             0 <= arc_map[i] < aux_labels.Dim0().  Must be on
+                             the same device as `aux_labels`.
+     @return  Returns the aux labels of the output arcs, with
+              ans.Dim0() == arc_map.Dim() and ans[i] == aux_labels[arc_map[i]].
+ */
+Ragged<int32_t> MapAuxLabels1(Ragged<int32_t> &aux_labels,
+                              const Array1<int32_t> &arc_map);
+
+/*
+  As MapAuxLabels1(), but for algorithms where each output arc corresponds to
+  a sequence of input arcs (e.g. the arc_derivs output by
+  RemoveEpsilonsPrunedMax()); the aux labels of each output arc are those of
+  its input arcs, concatenated in order.
+
+     @param [in] aux_labels  The aux labels of the input arcs, indexed
+                             [arc][label]
+     @param [in] arc_map     Indexed [output arc][list]; gives the sequence of
+                             input arcs each output arc corresponds to.  Its
+                             values must satisfy
+                             0 <= arc_map.values[i] < aux_labels.Dim0().
+     @return  Returns the aux labels of the output arcs, with
+              ans.Dim0() == arc_map.Dim0().
+ */
+Ragged<int32_t> MapAuxLabels2(Ragged<int32_t> &aux_labels,
+                              Ragged<int32_t> &arc_map);
+
+/*
+  Inverts the FSAs of an FsaVec, swapping the symbols of the arcs with their
+  aux labels (e.g. swapping the input and output symbols of a transducer).
+  An arc with n > 1 aux labels becomes a chain of n arcs through n - 1 new
+  states; the first arc of the chain has its score and the others score 0.
+  An arc with no aux labels gets the symbol epsilon (0), and epsilons are
+  dropped from the aux labels of the output.
+
+  The states of each FSA keep their order, with the new states for the arcs
+  leaving state s numbered after it (and before state s + 1), so the output is
+  top-sorted if the input was.  (FstInverter numbers them before the
+  destination state instead, so its states may be numbered differently.)
+  All the work is done on the device of `src`, with one transfer to find the
+  sizes of the output.
+
+     @param [in] src  The FSAs to invert
+     @param [in] src_aux_labels  The aux labels of the arcs of `src`, indexed
+                          [arc][label]; src_aux_labels.Dim0() must equal
+                          src.values.Dim().  Arcs entering the final state
+                          must have exactly one aux label, -1.
+     @param [out] dest    The inverted FSAs; will have the same number of
+                          FSAs as `src`.
+     @param [out] dest_aux_labels  The aux labels of the arcs of `dest`: the
+                          symbol of the corresponding arc of `src` for the
+                          first arc of each chain if that is not epsilon,
+                          else none.
+     @param [out,optional] arc_map  If not nullptr, will be set to the index
+                          of the arc of `src` that each arc of `dest` comes
+                          from.
+ */
+void Invert(FsaVec &src, Ragged<int32_t> &src_aux_labels, FsaVec *dest,
+            Ragged<int32_t> *dest_aux_labels,
+            Array1<int32_t> *arc_map = nullptr);
+
+}  // namespace k2
+
+#endif  // K2_CSRC_AUX_LABELS_H_
@@ -0,0 +1,153 @@
+/**
+ * @brief
+ * aux_labels_test
+ *
+ * @copyright
+ * Copyright (c)  2026  agent (agent@local)
+ *
+ * @copyright
+ * See LICENSE for clarification regarding multiple authors
+ */
+
+#include <gtest/gtest.h>
+
+#include <vector>
+
+#include "k2/csrc/array.h"
+#include "k2/csrc/aux_labels.h"
+#include "k2/csrc/context.h"
+#include "k2/csrc/fsa.h"
+#include "k2/csrc/ragged.h"
+
+namespace k2 {
+
+static Ragged<int32_t> MakeRagged(ContextPtr &context,
+                                  const std::vector<int32_t> &row_splits,
+                                  const std::vector<int32_t> &values) {
+  Array1<int32_t> row_splits_array(context, row_splits);
+  RaggedShape shape = RaggedShape2(&row_splits_array, nullptr, -1);
+  return Ragged<int32_t>(shape, Array1<int32_t>(context, values));
+}
+
+static void CheckRagged(Ragged<int32_t> &ragged,
+                        const std::vector<int32_t> &row_splits,
+                        const std::vector<int32_t> &values) {
+  ContextPtr cpu = GetCpuContext();
+  ASSERT_EQ(ragged.NumAxes(), 2);
+  Array1<int32_t> row_splits_cpu = ragged.shape.RowSplits(1).To(cpu),
+                  values_cpu = ragged.values.To(cpu);
+  EXPECT_EQ(std::vector<int32_t>(row_splits_cpu.Data(),
+                                 row_splits_cpu.Data() + row_splits_cpu.Dim()),
+            row_splits);
+  EXPECT_EQ(std::vector<int32_t>(values_cpu.Data(),
+                                 values_cpu.Data() + values_cpu.Dim()),
+            values);
+}
+
+template <DeviceType d>
+void TestMapAuxLabels() {
+  ContextPtr cpu = GetCpuContext();
+  ContextPtr context = (d == kCpu ? cpu : GetCudaContext());
+  // [ [1 2] [] [3] [-1] ]
+  Ragged<int32_t> aux_labels =
+      MakeRagged(context, {0, 2, 2, 3, 4}, {1, 2, 3, -1});
+  {
+    Array1<int32_t> arc_map(context, std::vector<int32_t>{3, 0, 1, 0, 2});
+    Ragged<int32_t> ans = MapAuxLabels1(aux_labels, arc_map);
+    CheckRagged(ans, {0, 1, 3, 3, 5, 6}, {-1, 1, 2, 1, 2, 3});
+  }
+  {
+    Array1<int32_t> arc_map(context, 0);
+    Ragged<int32_t> ans = MapAuxLabels1(aux_labels, arc_map);
+    EXPECT_EQ(ans.shape.Dim0(), 0);
+    EXPECT_EQ(ans.values.Dim(), 0);
+  }
+  {
+    // [ [0 1 2] [] [3] [2 0] [1] ]
+    Ragged<int32_t> arc_map =
+        MakeRagged(context, {0, 3, 3, 4, 6, 7}, {0, 1, 2, 3, 2, 0, 1});
+    Ragged<int32_t> ans = MapAuxLabels2(aux_labels, arc_map);
+    CheckRagged(ans, {0, 3, 3, 4, 7, 7}, {1, 2, 3, -1, 3, 1, 2});
+  }
+}
+
+TEST(AuxLabels, MapAuxLabels) {
+  TestMapAuxLabels<kCpu>();
+  TestMapAuxLabels<kCuda>();
+}
+
+template <DeviceType d>
+void TestInvert() {
+  ContextPtr cpu = GetCpuContext();
+  ContextPtr context = (d == kCpu ? cpu : GetCudaContext());
+  // Three FSAs, the last one empty.  The first arc of the first FSA has three
+  // aux labels and the second none; the first arc of the second FSA has two.
+  std::vector<int32_t> row_splits1_vec = {0, 3, 6, 6},
+                       row_splits2_vec = {0, 2, 3, 3, 4, 5, 5};
+  std::vector<Arc> arcs_vec = {{0, 1, 1, 0.1}, {0, 1, 0, 0.2},
+                               {1, 2, -1, 0.3}, {0, 1, 2, 0.4},
+                               {1, 2, -1, 0.5}};
+  Array1<int32_t> row_splits1(context, row_splits1_vec),
+      row_splits2(context, row_splits2_vec);
+  RaggedShape shape =
+      RaggedShape3(&row_splits1, nullptr, -1, &row_splits2, nullptr, -1);
+  FsaVec fsas(shape, Array1<Arc>(context, arcs_vec));
+  Ragged<int32_t> aux_labels = MakeRagged(
+      context, {0, 3, 3, 4, 6, 7}, {10, 11, 12, -1, 20, 21, -1});
+
+  FsaVec inverted;
+  Ragged<int32_t> inverted_aux_labels;
+  Array1<int32_t> arc_map;
+  Invert(fsas, aux_labels, &inverted, &inverted_aux_labels, &arc_map);
+
+  ASSERT_EQ(inverted.NumAxes(), 3);
+  Array1<int32_t> out_row_splits1 = inverted.shape.RowSplits(1).To(cpu),
+                  out_row_splits2 = inverted.shape.RowSplits(2).To(cpu);
+  EXPECT_EQ(std::vector<int32_t>(out_row_splits1.Data(),
+                                 out_row_splits1.Data() + 4),
+            (std::vector<int32_t>{0, 5, 9, 9}));
+  ASSERT_EQ(out_row_splits2.Dim(), 10);
+  EXPECT_EQ(std::vector<int32_t>(out_row_splits2.Data(),
+                                 out_row_splits2.Data() + 10),
+            (std::vector<int32_t>{0, 2, 3, 4, 5, 5, 6, 7, 8, 8}));
+  std::vector<Arc> expected_arcs = {
+      {0, 1, 10, 0.1}, {0, 3, 0, 0.2}, {1, 2, 11, 0}, {2, 3, 12, 0},
+      {3, 4, -1, 0.3}, {0, 1, 20, 0.4}, {1, 2, 21, 0}, {2, 3, -1, 0.5}};
+  Array1<Arc> arcs = inverted.values.To(cpu);
+  ASSERT_EQ(arcs.Dim(), static_cast<int32_t>(expected_arcs.size()));
+  for (int32_t i = 0; i != arcs.Dim(); ++i) {
+    EXPECT_EQ(arcs[i].src_state, expected_arcs[i].src_state);
+    EXPECT_EQ(arcs[i].dest_state, expected_arcs[i].dest_state);
+    EXPECT_EQ(arcs[i].symbol, expected_arcs[i].symbol);
+    EXPECT_EQ(arcs[i].score, expected_arcs[i].score);
+  }
+  CheckRagged(inverted_aux_labels, {0, 1, 1, 1, 1, 2, 3, 3, 4},
+              {1, -1, 2, -1});
+  Array1<int32_t> arc_map_cpu = arc_map.To(cpu);
+  EXPECT_EQ(std::vector<int32_t>(arc_map_cpu.Data(),
+                                 arc_map_cpu.Data() + arc_map_cpu.Dim()),
+            (std::vector<int32_t>{0, 1, 0, 0, 2, 3, 3, 4}));
+
+  // Inverting back gives the symbols of `fsas`, with the chains kept.
+  FsaVec inverted2;
+  Ragged<int32_t> inverted2_aux_labels;
+  Invert(inverted, inverted_aux_labels, &inverted2, &inverted2_aux_labels);
+  EXPECT_EQ(inverted2.shape.TotSize(1), 9);
+  Array1<Arc> arcs2 = inverted2.values.To(cpu);
+  ASSERT_EQ(arcs2.Dim(), arcs.Dim());
+  std::vector<int32_t> expected_symbols = {1, 0, 0, 0, -1, 2, 0, -1};
+  for (int32_t i = 0; i != arcs2.Dim(); ++i) {
+    EXPECT_EQ(arcs2[i].src_state, arcs[i].src_state);
+    EXPECT_EQ(arcs2[i].dest_state, arcs[i].dest_state);
+    EXPECT_EQ(arcs2[i].symbol, expected_symbols[i]);
+  }
+  CheckRagged(inverted2_aux_labels, {0, 1, 1, 2, 3, 4, 5, 6, 7},
+              {10, 11, 12, -1, 20, 21, -1});
+}
+
+TEST(AuxLabels, Invert) {
+  TestInvert<kCpu>();
+  TestInvert<kCuda>();
+}
+
+}  // namespace k2
@@ -0,0 +1,72 @@
+/**
+ * @brief
+ * benchmark
+ *
+ * @note
+ * Utilities for the benchmarks in k2/csrc/*_benchmark.cu, which use Google
+ * Benchmark and are built into the `k2_benchmarks` binary if cmake is run with
+ * -DK2_ENABLE_BENCHMARK=ON.
+ *
+ * @copyright
+ * Copyright (c)  2026  agent (agent@local)
+ *
+ * @copyright
+ * See LICENSE for clarification regarding multiple authors
+ */
+
+#ifndef K2_CSRC_BENCHMARK_H_
+#define K2_CSRC_BENCHMARK_H_
+
+#include <benchmark/benchmark.h>
+
+#include <cstdint>
+
+#include "k2/csrc/context.h"
+
+namespace k2 {
+
+// The values of the second argument of the benchmarks, which says which
+// context they run on.
+enum BenchmarkDevice { kBenchmarkCpu = 0, kBenchmarkCuda = 1 };
+
+/*
+  Registers the arguments (size, device) of a benchmark: sizes from 2^10 to
+  2^24 (a multiple of 16) elements, on the CPU and on CUDA.  Use as
+     BENCHMARK(BM_Foo)->Apply(SizesAndDevices);
+  The benchmark reads the size with state.range(0) and gets its context with
+  GetBenchmarkContext(state).
+ */
+inline void SizesAndDevices(benchmark::internal::Benchmark *b) {
+  for (int32_t device : {kBenchmarkCpu, kBenchmarkCuda})
+    for (int64_t size = 1 << 10; size <= (1 << 24); size <<= 2)
+      b->Args({size, device});
+  b->ArgNames({"size", "device"});
+  // The time of CUDA benchmarks is only right with the work synchronized in
+  // each iteration (see BenchmarkSync()), so wall-clock time is measured.
+  b->UseRealTime();
+}
+
+// Returns the context selected by state.range(1).
+inline ContextPtr GetBenchmarkContext(const benchmark::State &state) {
+  return state.range(1) == kBenchmarkCuda ? GetCudaContext()
+                                          : GetCpuContext();
+}
+
+// To be called at the end of each iteration, so that the time of the work
+// queued on the stream of `c` is counted.
+inline void BenchmarkSync(const ContextPtr &c) { c->Sync(); }
+
+/*
+  Sets the counters of a benchmark that processed `items_per_iteration`
+  elements and read or wrote `bytes_per_iteration` bytes per iteration, which
+  makes Google Benchmark report elements/s and bytes/s (its "GB/s" is 2^30).
+ */
+inline void SetThroughput(benchmark::State &state, int64_t items_per_iteration,
+                          int64_t bytes_per_iteration) {
+  state.SetItemsProcessed(state.iterations() * items_per_iteration);
+  state.SetBytesProcessed(state.iterations() * bytes_per_iteration);
+}
+
+}  // namespace k2
+
+#endif  // K2_CSRC_BENCHMARK_H_
@@ -0,0 +1,155 @@
+/**
+ * @brief
+ * compact_row_splits
+ *
+ * @copyright
+ * Copyright (c)  2026  agent (agent@local)
+ *
+ * @copyright
+ * See LICENSE for clarification regarding multiple authors
+ */
+
+#include <cstdint>
+#include <limits>
+
+#include "k2/csrc/array_ops.h"
+#include "k2/csrc/compact_row_splits.h"
+
+namespace k2 {
+
+// Sets deltas[i] = row_splits[i] - (the base of the block of row i), for
+// 0 <= i <= num_rows.  The caller has checked that the values fit in T.
+template <typename T>
+static void EncodeDeltas(ContextPtr &c, const int32_t *row_splits_data,
+                         int32_t num_rows, Array1<T> *deltas) {
+  *deltas = Array1<T>(c, num_rows + 1);
+  T *deltas_data = deltas->Data();
+  const int32_t block_mask = kCompactRowSplitsBlockSize - 1;
+  auto lambda_set_deltas = [=] __host__ __device__(int32_t i) -> void {
+    deltas_data[i] =
+        static_cast<T>(row_splits_data[i] - row_splits_data[i & ~block_mask]);
+  };
+  Eval(c, num_rows + 1, lambda_set_deltas);
+}
+
+CompactRowSplits::CompactRowSplits(const Array1<int32_t> &row_splits)
+    : c_(row_splits.Context()), num_rows_(row_splits.Dim() - 1) {
+  K2_CHECK_GE(num_rows_, 0);
+  ContextPtr &c = c_;
+  const int32_t *row_splits_data = row_splits.Data();
+  int32_t num_rows = num_rows_,
+          num_blocks = (num_rows >> kCompactRowSplitsLogBlockSize) + 1;
+
+  // stats[b], for block b, is the largest row_splits of the block minus its
+  // base, and stats[num_blocks + b] is 1 if a row of the block has a different
+  // length from row 0, else 0.  results will contain the maxima of those two
+  // and row_splits[num_rows]; we transfer it to the CPU in one go.
+  Array1<int32_t> stats(c, 2 * num_blocks), results(c, 3);
+  int32_t *stats_data = stats.Data(), *results_data = results.Data();
+  auto lambda_get_stats = [=] __host__ __device__(int32_t b) -> void {
+    int32_t begin = b << kCompactRowSplitsLogBlockSize,
+            end = begin + kCompactRowSplitsBlockSize;
+    if (end > num_rows + 1) end = num_rows + 1;
+    int32_t row_end = (end < num_rows ? end : num_rows),
+            row0_length =
+                (num_rows > 0 ? row_splits_data[1] - row_splits_data[0] : 0),
+            irregular = 0;
+    for (int32_t i = begin; i < row_end; ++i)
+      if (row_splits_data[i + 1] - row_splits_data[i] != row0_length)
+        irregular = 1;
+    stats_data[b] = row_splits_data[end - 1] - row_splits_data[begin];
+    stats_data[num_blocks + b] = irregular;
+    if (b == 0) results_data[2] = row_splits_data[num_rows];
+  };
+  Eval(c, num_blocks, lambda_get_stats);
+  Array1<int32_t> spans = stats.Range(0, num_blocks),
+                  irregular = stats.Range(num_blocks, num_blocks),
+                  max_span = results.Range(0, 1),
+                  max_irregular = results.Range(1, 1);
+  Max(spans, 0, &max_span);
+  Max(irregular, 0, &max_irregular);
+  Array1<int32_t> results_cpu = results.To(GetCpuContext());
+  tot_size_ = results_cpu[2];
+
+  if (results_cpu[1] == 0) {
+    encoding_ = kRowSplitsRegular;
+    row_length_ = (num_rows > 0 ? tot_size_ / num_rows : 0);
+    return;
+  }
+  if (results_cpu[0] > std::numeric_limits<uint16_t>::max()) {
+    encoding_ = kRowSplitsInt32;
+    row_splits_ = row_splits;
+    return;
+  }
+  block_bases_ = Array1<int32_t>(c, num_blocks);
+  int32_t *block_bases_data = block_bases_.Data();
+  auto lambda_set_bases = [=] __host__ __device__(int32_t b) -> void {
+    block_bases_data[b] =
+        row_splits_data[b << kCompactRowSplitsLogBlockSize];
+  };
+  Eval(c, num_blocks, lambda_set_bases);
+  if (results_cpu[0] <= std::numeric_limits<uint8_t>::max()) {
+    encoding_ = kRowSplitsUint8;
+    EncodeDeltas(c, row_splits_data, num_rows, &deltas8_);
+  } else {
+    encoding_ = kRowSplitsUint16;
+    EncodeDeltas(c, row_splits_data, num_rows, &deltas16_);
+  }
+}
+
+CompactRowSplits::CompactRowSplits(ContextPtr c, int32_t num_rows,
+                                   int32_t row_length)
+    : c_(c), num_rows_(num_rows), row_length_(row_length) {
+  K2_CHECK_GE(num_rows, 0);
+  K2_CHECK_GE(row_length, 0);
+  int64_t tot_size = static_cast<int64_t>(num_rows) * row_length;
+  K2_CHECK_LE(tot_size, std::numeric_limits<int32_t>::max());
+  tot_size_ = static_cast<int32_t>(tot_size);
+}
+
+std::size_t CompactRowSplits::NumBytes() const {
+  std::size_t ans = block_bases_.Dim() * sizeof(int32_t) +
+                    deltas8_.Dim() * sizeof(uint8_t) +
+                    deltas16_.Dim() * sizeof(uint16_t);
+  if (encoding_ == kRowSplitsInt32) ans += row_splits_.Dim() * sizeof(int32_t);
+  return ans;
+}
+
+// Data() may not be called on default-constructed arrays.
+template <typename T>
+static const T *DataOrNull(const Array1<T> &array) {
+  return (array.Dim() == 0 ? nullptr : array.Data());
+}
+
+CompactRowSplitsAccessor CompactRowSplits::Accessor() const {
+  CompactRowSplitsAccessor ans;
+  ans.encoding = encoding_;
+  ans.num_rows = num_rows_;
+  ans.row_length = row_length_;
+  ans.data = DataOrNull(encoding_ == kRowSplitsInt32 ? row_splits_
+                                                    : block_bases_);
+  ans.deltas8 = DataOrNull(deltas8_);
+  ans.deltas16 = DataOrNull(deltas16_);
+  return ans;
+}
+
+Array1<int32_t> &CompactRowSplits::RowSplits() {
+  if (row_splits_.Dim() == 0) {
+    K2_CHECK(c_ != nullptr);
+    Array1<int32_t> row_splits(c_, num_rows_ + 1);
+    int32_t *row_splits_data = row_splits.Data();
+    CompactRowSplitsAccessor accessor = Accessor();
+    auto lambda_decode = [=] __host__ __device__(int32_t i) -> void {
+      row_splits_data[i] = accessor.RowSplit(i);
+    };
+    Eval(c_, num_rows_ + 1, lambda_decode);
+    row_splits_ = row_splits;
+  }
+  return row_splits_;
+}
+
+RaggedShape CompactRowSplits::ToRaggedShape() {
+  return RaggedShape2(&RowSplits(), nullptr, tot_size_);
+}
+
+}  // namespace k2
@@ -0,0 +1,159 @@
+/**
+ * @brief
+ * compact_row_splits
+ *
+ * @copyright
+ * Copyright (c)  2026  agent (agent@local)
+ *
+ * @copyright
+ * See LICENSE for clarification regarding multiple authors
+ */
+
+#ifndef K2_CSRC_COMPACT_ROW_SPLITS_H_
+#define K2_CSRC_COMPACT_ROW_SPLITS_H_
+
+#include <cstddef>
+#include <cstdint>
+
+#include "k2/csrc/array.h"
+#include "k2/csrc/context.h"
+#include "k2/csrc/ragged.h"
+
+namespace k2 {
+
+/*
+  Compact encodings of the row_splits of one axis of a ragged shape.  For
+  shapes whose rows are short and regular, e.g. the frames of a DenseFsaVec or
+  the states of linear FSAs, a full int32_t row_splits (and row_ids) is most of
+  the memory and memory traffic of the shape metadata.
+
+    kRowSplitsRegular  All rows have the same length; nothing is stored.
+    kRowSplitsUint8,   The rows are split into blocks of
+    kRowSplitsUint16   kCompactRowSplitsBlockSize rows; we store one int32_t
+                       base offset per block (the row_splits of its first row)
+                       and for each row, the uint8_t or uint16_t difference
+                       between its row_splits and the base of its block.
+    kRowSplitsInt32    The usual int32_t row_splits, for when the blocks are
+                       too long for the other encodings.
+ */
+enum RowSplitsEncoding {
+  kRowSplitsRegular,
+  kRowSplitsUint8,
+  kRowSplitsUint16,
+  kRowSplitsInt32,
+};
+
+constexpr int32_t kCompactRowSplitsLogBlockSize = 6;
+constexpr int32_t kCompactRowSplitsBlockSize =
+    1 << kCompactRowSplitsLogBlockSize;
+
+/*
+  This is for decoding CompactRowSplits inside kernels, e.g.:
+
+     CompactRowSplitsAccessor row_splits = compact.Accessor();
+     auto lambda_foo = [=] __host__ __device__(int32_t i) -> void {
+       int32_t begin = row_splits.RowSplit(i),
+               end = row_splits.RowSplit(i + 1);
+       ...
+     };
+     Eval(c, compact.NumRows(), lambda_foo);
+
+  It is only valid for as long as the CompactRowSplits it came from.
+ */
+struct CompactRowSplitsAccessor {
+  RowSplitsEncoding encoding;
+  int32_t num_rows;
+  int32_t row_length;    // Only for kRowSplitsRegular
+  const int32_t *data;   // The block bases, or for kRowSplitsInt32, the
+                         // row_splits
+  const uint8_t *deltas8;    // Only for kRowSplitsUint8
+  const uint16_t *deltas16;  // Only for kRowSplitsUint16
+
+  // Returns row_splits[i], for 0 <= i <= num_rows.
+  __host__ __device__ __forceinline__ int32_t RowSplit(int32_t i) const {
+    switch (encoding) {
+      case kRowSplitsRegular:
+        return i * row_length;
+      case kRowSplitsUint8:
+        return data[i >> kCompactRowSplitsLogBlockSize] + deltas8[i];
+      case kRowSplitsUint16:
+        return data[i >> kCompactRowSplitsLogBlockSize] + deltas16[i];
+      default:
+        return data[i];
+    }
+  }
+
+  // Returns row_ids[elem], i.e. the row that element `elem` is in, for
+  // 0 <= elem < row_splits[num_rows].  Is a binary search except for
+  // kRowSplitsRegular; see also FindRow().
+  __host__ __device__ __forceinline__ int32_t RowId(int32_t elem) const {
+    if (encoding == kRowSplitsRegular) return elem / row_length;
+    int32_t lo = 0, hi = num_rows - 1;
+    while (lo < hi) {
+      int32_t mid = (lo + hi + 1) >> 1;
+      if (RowSplit(mid) <= elem)
+        lo = mid;
+      else
+        hi = mid - 1;
+    }
+    return lo;
+  }
+};
+
+class CompactRowSplits {
+ public:
+  CompactRowSplits() = default;
+
+  /*
+    Encodes `row_splits` (which must be valid row_splits, i.e. start from 0 and
+    be non-decreasing) with the most compact of the encodings that can
+    represent it.  Involves one transfer to the CPU.
+   */
+  explicit CompactRowSplits(const Array1<int32_t> &row_splits);
+
+  /*
+    Creates kRowSplitsRegular row_splits of `num_rows` rows, each with
+    `row_length` elements.  No memory is allocated.
+   */
+  CompactRowSplits(ContextPtr c, int32_t num_rows, int32_t row_length);
+
+  ContextPtr &Context() const { return c_; }
+  RowSplitsEncoding Encoding() const { return encoding_; }
+  int32_t NumRows() const { return num_rows_; }
+  // The number of elements, i.e. row_splits[NumRows()]
+  int32_t TotSize() const { return tot_size_; }
+
+  // Returns the number of bytes used by the encoding, not counting the
+  // row_splits decoded by RowSplits().
+  std::size_t NumBytes() const;
+
+  CompactRowSplitsAccessor Accessor() const;
+
+  /*
+    Returns the full int32_t row_splits; for encodings other than
+    kRowSplitsInt32 they are decoded on the first call and then cached, so an
+    operation that needs them pays for them only when they are used.
+   */
+  Array1<int32_t> &RowSplits();
+
+  // Returns a RaggedShape with 2 axes that has these row_splits, decoding
+  // them if needed.  The row_ids are left to be created on demand.
+  RaggedShape ToRaggedShape();
+
+ private:
+  mutable ContextPtr c_;
+  RowSplitsEncoding encoding_ = kRowSplitsRegular;
+  int32_t num_rows_ = 0;
+  int32_t tot_size_ = 0;
+  int32_t row_length_ = 0;  // only for kRowSplitsRegular
+  Array1<int32_t> block_bases_;  // for kRowSplitsUint8 and kRowSplitsUint16
+  Array1<uint8_t> deltas8_;
+  Array1<uint16_t> deltas16_;
+  // The full row_splits; decoded lazily unless encoding_ == kRowSplitsInt32
+  // (Dim() == 0 if not yet decoded).
+  Array1<int32_t> row_splits_;
+};
+
+}  // namespace k2
+
+#endif  // K2_CSRC_COMPACT_ROW_SPLITS_H_
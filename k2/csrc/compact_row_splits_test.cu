@@ -0,0 +1,134 @@
+/**
+ * @brief
+ * compact_row_splits_test
+ *
+ * @copyright
+ * Copyright (c)  2026  agent (agent@local)
+ *
+ * @copyright
+ * See LICENSE for clarification regarding multiple authors
+ */
+
+#include <gtest/gtest.h>
+
+#include <vector>
+
+#include "k2/csrc/array.h"
+#include "k2/csrc/compact_row_splits.h"
+#include "k2/csrc/context.h"
+#include "k2/csrc/ragged.h"
+
+namespace k2 {
+
+// Returns row_splits for rows with the given lengths.
+static std::vector<int32_t> GetRowSplits(const std::vector<int32_t> &lengths) {
+  std::vector<int32_t> row_splits(1, 0);
+  for (int32_t length : lengths)
+    row_splits.push_back(row_splits.back() + length);
+  return row_splits;
+}
+
+// Checks RowSplit() and RowId() of the accessor and the decoded RowSplits()
+// against `row_splits_vec`.
+static void CheckDecoding(CompactRowSplits &compact,
+                          const std::vector<int32_t> &row_splits_vec) {
+  ContextPtr cpu = GetCpuContext();
+  ContextPtr &c = compact.Context();
+  int32_t num_rows = compact.NumRows(), tot_size = compact.TotSize();
+  ASSERT_EQ(num_rows + 1, static_cast<int32_t>(row_splits_vec.size()));
+  EXPECT_EQ(tot_size, row_splits_vec.back());
+
+  CompactRowSplitsAccessor accessor = compact.Accessor();
+  Array1<int32_t> row_splits(c, num_rows + 1), row_ids(c, tot_size);
+  int32_t *row_splits_data = row_splits.Data();
+  auto lambda_get_row_splits = [=] __host__ __device__(int32_t i) -> void {
+    row_splits_data[i] = accessor.RowSplit(i);
+  };
+  Eval(c, num_rows + 1, lambda_get_row_splits);
+  if (tot_size > 0) {
+    int32_t *row_ids_data = row_ids.Data();
+    auto lambda_get_row_ids = [=] __host__ __device__(int32_t i) -> void {
+      row_ids_data[i] = accessor.RowId(i);
+    };
+    Eval(c, tot_size, lambda_get_row_ids);
+  }
+
+  Array1<int32_t> row_splits_cpu = row_splits.To(cpu),
+                  decoded = compact.RowSplits().To(cpu);
+  for (int32_t i = 0; i <= num_rows; ++i) {
+    EXPECT_EQ(row_splits_cpu[i], row_splits_vec[i]);
+    EXPECT_EQ(decoded[i], row_splits_vec[i]);
+  }
+  if (tot_size > 0) {
+    Array1<int32_t> row_ids_cpu = row_ids.To(cpu);
+    for (int32_t row = 0; row < num_rows; ++row)
+      for (int32_t i = row_splits_vec[row]; i < row_splits_vec[row + 1]; ++i)
+        EXPECT_EQ(row_ids_cpu[i], row);
+  }
+
+  RaggedShape shape = compact.ToRaggedShape();
+  EXPECT_EQ(shape.Dim0(), num_rows);
+  EXPECT_EQ(shape.NumElements(), tot_size);
+}
+
+template <DeviceType d>
+void TestCompactRowSplits() {
+  ContextPtr context = (d == kCpu ? GetCpuContext() : GetCudaContext());
+  {
+    // regular, e.g. linear FSAs of the same length.
+    std::vector<int32_t> row_splits_vec = GetRowSplits(
+        std::vector<int32_t>(100, 3));
+    CompactRowSplits compact(Array1<int32_t>(context, row_splits_vec));
+    EXPECT_EQ(compact.Encoding(), kRowSplitsRegular);
+    EXPECT_EQ(compact.NumBytes(), 0u);
+    CheckDecoding(compact, row_splits_vec);
+
+    CompactRowSplits regular(context, 100, 3);
+    EXPECT_EQ(regular.Encoding(), kRowSplitsRegular);
+    CheckDecoding(regular, row_splits_vec);
+  }
+  {
+    // empty rows only, and no rows.
+    std::vector<int32_t> row_splits_vec(5, 0);
+    CompactRowSplits compact(Array1<int32_t>(context, row_splits_vec));
+    EXPECT_EQ(compact.Encoding(), kRowSplitsRegular);
+    CheckDecoding(compact, row_splits_vec);
+
+    CompactRowSplits no_rows(Array1<int32_t>(context, std::vector<int32_t>{0}));
+    EXPECT_EQ(no_rows.NumRows(), 0);
+    CheckDecoding(no_rows, std::vector<int32_t>{0});
+  }
+  {
+    // short rows of varying length, some empty.
+    std::vector<int32_t> lengths;
+    for (int32_t i = 0; i != 1000; ++i) lengths.push_back((i * 7) % 4);
+    std::vector<int32_t> row_splits_vec = GetRowSplits(lengths);
+    CompactRowSplits compact(Array1<int32_t>(context, row_splits_vec));
+    EXPECT_EQ(compact.Encoding(), kRowSplitsUint8);
+    EXPECT_LT(compact.NumBytes(), row_splits_vec.size() * sizeof(int32_t) / 2);
+    CheckDecoding(compact, row_splits_vec);
+  }
+  {
+    // rows that are a bit longer.
+    std::vector<int32_t> lengths;
+    for (int32_t i = 0; i != 500; ++i) lengths.push_back(100 + i % 300);
+    std::vector<int32_t> row_splits_vec = GetRowSplits(lengths);
+    CompactRowSplits compact(Array1<int32_t>(context, row_splits_vec));
+    EXPECT_EQ(compact.Encoding(), kRowSplitsUint16);
+    CheckDecoding(compact, row_splits_vec);
+  }
+  {
+    // too long for uint16_t deltas.
+    std::vector<int32_t> row_splits_vec = GetRowSplits({5, 70000, 1});
+    CompactRowSplits compact(Array1<int32_t>(context, row_splits_vec));
+    EXPECT_EQ(compact.Encoding(), kRowSplitsInt32);
+    CheckDecoding(compact, row_splits_vec);
+  }
+}
+
+TEST(CompactRowSplits, Encodings) {
+  TestCompactRowSplits<kCpu>();
+  TestCompactRowSplits<kCuda>();
+}
+
+}  // namespace k2
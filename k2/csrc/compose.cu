@@ -9,16 +9,207 @@
  * See LICENSE for clarification regarding multiple authors
  */
 
+#include <algorithm>
+#include <cmath>
 #include <limits>
+#include <memory>
+#include <numeric>
 #include <vector>
 
 #include "k2/csrc/array_ops.h"
 #include "k2/csrc/fsa_algo.h"
+#include "k2/csrc/fsa_utils.h"
+#include "k2/csrc/hash.h"
+#include "k2/csrc/profile.h"
 
 namespace k2 {
 
 // Caution: this is really a .cu file.  It contains mixed host and device code.
 
+namespace {
+// The number of bins per FSA of the histograms of scores that
+// MultiGraphDenseIntersect uses to enforce max_active and min_active.
+constexpr int32_t kNumHistogramBins = 64;
+
+// If the dense state map of MultiGraphDenseIntersect would be larger than
+// this many bytes, a hash table is used instead.
+constexpr int64_t kDenseStateMapMaxBytes = static_cast<int64_t>(1) << 30;
+
+// The beams used by IntersectDense(), large enough that nothing with a finite
+// score is pruned.
+constexpr float kNoPruningBeam = 1.0e+30;
+
+/*
+  Gives __host__ __device__ access to the map from (sequence, state in a_fsas)
+  to active state used by MultiGraphDenseIntersect, which is either a dense
+  array (if `dense_data` is not nullptr) or a Hash.  The key is
+  fsa_idx0 * stride + a_fsas_state_idx01.
+ */
+struct StateMapAccessor {
+  int32_t *dense_data;
+  Hash::Accessor hash;
+
+  // Returns the address of the value for `key`, inserting it if the map is a
+  // hash and it was not present.
+  __host__ __device__ __forceinline__ int32_t *Insert(uint64_t key) const {
+    return dense_data != nullptr ? dense_data + key : hash.Insert(key);
+  }
+  // Returns the value for `key`, or -1 if it is not present.
+  __host__ __device__ __forceinline__ int32_t Get(uint64_t key) const {
+    if (dense_data != nullptr) return dense_data[key];
+    const int32_t *value = hash.Find(key);
+    return value != nullptr ? *value : -1;
+  }
+};
+
+/*
+  Gives __host__ __device__ access to the scores of a DenseFsaVec, which may
+  be float, half (converted to float as they are read) or sparse (looked up
+  by binary search in their row; the entries that were not kept are
+  -infinity).  Exactly one of `data`, `half_data` and `sparse_cols` is not
+  nullptr.  See GetDenseScoresAccessor().
+ */
+struct DenseScoresAccessor {
+  const float *data;
+  const __half *half_data;
+  const int32_t *sparse_cols;
+  const float *sparse_scores;
+  int32_t stride;  // of data or half_data
+  int32_t sparse_width;
+  int32_t sparse_cols_stride;
+  int32_t sparse_scores_stride;
+  // -infinity; std::numeric_limits can't be used in device code.
+  float minus_inf;
+
+  // Returns the score on row `row` (an idx01 into the DenseFsaVec) and
+  // column `col` (symbol + 1).
+  __host__ __device__ __forceinline__ float Get(int32_t row,
+                                                int32_t col) const {
+    if (data != nullptr) return data[row * stride + col];
+    if (half_data != nullptr)
+      return __half2float(half_data[row * stride + col]);
+    const int32_t *row_cols = sparse_cols + row * sparse_cols_stride;
+    int32_t begin = 0, end = sparse_width;
+    while (begin < end) {
+      int32_t mid = (begin + end) / 2;
+      if (row_cols[mid] < col)
+        begin = mid + 1;
+      else
+        end = mid;
+    }
+    if (begin < sparse_width && row_cols[begin] == col)
+      return sparse_scores[row * sparse_scores_stride + begin];
+    return minus_inf;
+  }
+};
+
+DenseScoresAccessor GetDenseScoresAccessor(DenseFsaVec &b_fsas) {
+  DenseScoresAccessor ans = {nullptr, nullptr, nullptr, nullptr, 0, 0, 0, 0,
+                             -std::numeric_limits<float>::infinity()};
+  if (b_fsas.HasSparseScores()) {
+    SparseDenseScores &sparse = b_fsas.sparse_scores;
+    ans.sparse_cols = sparse.cols.Data();
+    ans.sparse_scores = sparse.scores.Data();
+    ans.sparse_width = sparse.cols.Dim1();
+    ans.sparse_cols_stride = sparse.cols.ElemStride0();
+    ans.sparse_scores_stride = sparse.scores.ElemStride0();
+  } else if (b_fsas.HasHalfScores()) {
+    ans.half_data = b_fsas.half_scores.Data();
+    ans.stride = b_fsas.half_scores.ElemStride0();
+  } else {
+    ans.data = b_fsas.scores.Data();
+    ans.stride = b_fsas.scores.ElemStride0();
+  }
+  return ans;
+}
+
+// Returns the first `size` elements of `src` (which, unlike Range(), may be
+// none of them).
+template <typename T>
+Array1<T> Prefix(Array1<T> &src, int32_t size) {
+  if (size == 0) return Array1<T>(src.Context(), 0);
+  return src.Range(0, size);
+}
+
+// Returns `src`, which must have 3 axes, with empty rows appended to make its
+// Dim0() equal to `dim0`.
+RaggedShape PadDim0(RaggedShape &src, int32_t dim0) {
+  K2_CHECK_EQ(src.NumAxes(), 3);
+  int32_t src_dim0 = src.Dim0();
+  K2_CHECK_LE(src_dim0, dim0);
+  if (src_dim0 == dim0) return src;
+  ContextPtr c = src.Context();
+  Array1<int32_t> row_splits1(c, dim0 + 1);
+  const int32_t *src_row_splits1_data = src.RowSplits(1).Data();
+  int32_t *row_splits1_data = row_splits1.Data();
+  auto lambda_pad = [=] __host__ __device__(int32_t i) -> void {
+    row_splits1_data[i] = src_row_splits1_data[i < src_dim0 ? i : src_dim0];
+  };
+  Eval(c, dim0 + 1, lambda_pad);
+  return RaggedShape3(&row_splits1, &src.RowIds(1), src.TotSize(1),
+                      &src.RowSplits(2), &src.RowIds(2), src.TotSize(2));
+}
+
+// The number of threads per block (i.e. per sequence) of the persistent
+// forward kernel of MultiGraphDenseIntersect; and the largest number of
+// frames it does per launch, which bounds the memory it needs.
+constexpr int32_t kPersistentBlockSize = 256;
+constexpr int32_t kMaxPersistentFrames = 64;
+
+// Waits for all the threads of the block when called on the device.  On the
+// CPU, the functions below are called with a single thread per "block", so
+// there is nothing to wait for.
+__host__ __device__ __forceinline__ void BlockBarrier() {
+#ifdef __CUDA_ARCH__
+  __syncthreads();
+#endif
+}
+
+/*
+  Computes the exclusive sum of data[0] .. data[n-1] in place, and sets
+  data[n] to the total, which is also returned.  Must be called by all the
+  `num_threads` threads of the block, with `tid` the index of the thread;
+  `scratch` is shared memory of at least num_threads elements.  Each thread
+  sums a contiguous range of the elements, and the partial sums are scanned
+  with a Hillis-Steele scan.
+ */
+__host__ __device__ __forceinline__ int32_t BlockExclusiveSum(
+    int32_t n, int32_t *data, int32_t tid, int32_t num_threads,
+    int32_t *scratch) {
+  int32_t range = (n + num_threads - 1) / num_threads,
+          begin = (tid * range < n ? tid * range : n),
+          end = (begin + range < n ? begin + range : n), sum = 0;
+  for (int32_t i = begin; i < end; i++) sum += data[i];
+  scratch[tid] = sum;
+  BlockBarrier();
+  for (int32_t offset = 1; offset < num_threads; offset *= 2) {
+    int32_t prev = (tid >= offset ? scratch[tid - offset] : 0);
+    BlockBarrier();
+    scratch[tid] += prev;
+    BlockBarrier();
+  }
+  int32_t total = scratch[num_threads - 1], prefix = scratch[tid] - sum;
+  for (int32_t i = begin; i < end; i++) {
+    int32_t value = data[i];
+    data[i] = prefix;
+    prefix += value;
+  }
+  if (tid == 0) data[n] = total;
+  // scratch may be reused, and data[] read by any thread, after this.
+  BlockBarrier();
+  return total;
+}
+
+// Runs params.Run() with one block per sequence; see
+// MultiGraphDenseIntersect::PersistentForward.
+template <typename Params>
+__global__ void __launch_bounds__(kPersistentBlockSize)
+    PersistentForwardKernel(Params params) {
+  __shared__ typename Params::Shared shared;
+  params.Run(blockIdx.x, threadIdx.x, blockDim.x, &shared);
+}
+}  // namespace
+
 /*
    Pruned intersection (a.k.a. composition) that corresponds to decoding for
    speech recognition-type tasks.  Can use either different decoding graphs (one
@@ -40,6 +231,9 @@ class MultiGraphDenseIntersect {
                            (in general) different length.
        @param [in] beam    "Default" decoding beam.  The actual beam is dynamic
                             and also depends on max_active and min_active.
+       @param [in] lattice_beam  Beam for the backward pruning: only the states
+                           and arcs on paths within this of the best path of
+                           the sequence are in the output.
        @param [in] max_active  Maximum number of FSA states that are allowed to
                            be active on any given frame for any given
                            intersection/composition task. This is advisory,
@@ -50,31 +244,167 @@ class MultiGraphDenseIntersect {
                            intersection/composition task. This is advisory,
                            in that it will try not to have fewer than this
                            number active.
+       @param [in] a_fsas_soa  If not nullptr, the arcs of a_fsas in SoA
+                           layout (e.g. from a DenseIntersectGraph), which
+                           saves converting them.
    */
   MultiGraphDenseIntersect(FsaVec &a_fsas, DenseFsaVec &b_fsas, float beam,
-                           int32_t max_active, int32_t min_active)
+                           float lattice_beam, int32_t max_active,
+                           int32_t min_active,
+                           const FsaSoA *a_fsas_soa = nullptr)
       : a_fsas_(a_fsas),
+        a_fsas_soa_(a_fsas_soa != nullptr ? *a_fsas_soa : FsaToSoA(a_fsas)),
         b_fsas_(b_fsas),
         beam_(beam),
+        lattice_beam_(lattice_beam),
+        max_active_(max_active),
+        min_active_(min_active) {
+    // The work is queued on the context of b_fsas, so that intersections on
+    // different streams (see IntersectDensePrunedPipeline) can share the
+    // graph.
+    c_ = GetContext(b_fsas.shape, a_fsas.shape);
+    Init(b_fsas.shape.Dim0());
+    SetNumSeqsWithRows();
+  }
+
+  /*
+    Constructor for streaming use, where the neural-net output is supplied in
+    chunks by AcceptChunk(), followed by Finalize().  See
+    OnlineIntersectDensePruned in fsa_algo.h for documentation.
+   */
+  MultiGraphDenseIntersect(FsaVec &a_fsas, int32_t num_seqs, float beam,
+                           float lattice_beam, int32_t max_active,
+                           int32_t min_active, int32_t persistent_capacity = 0)
+      : a_fsas_(a_fsas),
+        a_fsas_soa_(FsaToSoA(a_fsas)),
+        beam_(beam),
+        lattice_beam_(lattice_beam),
         max_active_(max_active),
         min_active_(min_active),
-        dynamic_beams_(a_fsas.Context(), b_fsas.shape.Dim0(), beam) {
-    c_ = GetContext(a_fsas.shape, b_fsas.shape);
-    K2_CHECK_GT(beam, 0);
-    K2_CHECK_GT(min_active, 0);
-    K2_CHECK_GT(max_active, min_active);
-    K2_CHECK(a_fsas.shape.Dim0() == b_fsas.shape.Dim0() ||
-             a_fsas.shape.Dim0() == 1);
-    K2_CHECK_GT(b_fsas.shape.Dim0(), 1);
-    if (a_fsas.shape.Dim0() == 1) {
-      a_fsas_stride_ = 0;
-      state_map_ =
-          Array2<int32_t>(c_, a_fsas.shape.TotSize(1), b_fsas.shape.Dim0(), -1);
-    } else {
-      K2_CHECK_EQ(a_fsas.shape.Dim0(), b_fsas.shape.Dim0());
-      a_fsas_stride_ = 1;
-      state_map_ = Array2<int32_t>(c_, a_fsas.shape.TotSize(1), 1, -1);
+        persistent_capacity_(persistent_capacity) {
+    c_ = a_fsas.Context();
+    Init(num_seqs);
+    K2_CHECK_GE(persistent_capacity, 0);
+    K2_CHECK(persistent_capacity == 0 || !use_hash_state_map_)
+        << "The persistent mode needs a dense state map, but the graph has "
+        << "too many states";
+  }
+
+  /*
+    Processes one chunk of neural-net output, doing the forward pass (but no
+    backward pruning) for its frames.  Must not be called after Finalize().
+   */
+  void AcceptChunk(DenseFsaVec &chunk) {
+    K2_CHECK(!finalized_);
+    K2_CHECK_EQ(chunk.shape.Dim0(), num_seqs_);
+    K2_CHECK(c_->IsCompatible(*chunk.shape.Context()));
+    if (frames_.empty()) frames_.push_back(InitialFrameInfo());
+    // Row 0 of the chunk is for the frame of the current frontier.
+    t_offset_ = static_cast<int32_t>(frames_.size()) - 1;
+    b_fsas_ = chunk;
+    SetNumSeqsWithRows();
+    // The last row of the longest sequences is their final row, which is
+    // deferred until Finalize() as they may continue in the next chunk.
+    ForwardFrames(chunk.shape.MaxSize(1) - 1);
+  }
+
+  /*
+    To be called after the last AcceptChunk(): processes the final row of the
+    last chunk and does the backward pruning; call FormatOutput() after this
+    (with arc_map_b == nullptr, as the frames come from different chunks).
+   */
+  void Finalize() {
+    K2_CHECK(!finalized_);
+    K2_CHECK(!frames_.empty()) << "AcceptChunk() was never called";
+    ForwardFrames(1);
+    Backward();
+  }
+
+  /*
+    Returns the best path so far of each sequence, or the best partial path
+    when streaming: an array with num_seqs rows and one column per frame that
+    has been processed (i.e. frames_.size() - 1), giving the index in
+    a_fsas_ of the arc on that frame.  The path is the one that ends in the
+    best state active on the latest frame; rows of sequences with no such
+    states (e.g. because they have ended) are all -1.  Must not be called
+    after the backward pass (Intersect() or Finalize()), which changes the
+    meaning of ArcInfo::u.
+
+    This runs two small kernels per frame, but does not wait for the device.
+   */
+  Array2<int32_t> BestPaths() {
+    K2_CHECK(!finalized_);
+    int32_t num_frames = static_cast<int32_t>(frames_.size()) - 1,
+            num_fsas = num_seqs_;
+    Array2<int32_t> ans(c_, num_fsas, std::max(num_frames, 0), -1);
+    if (num_frames <= 0) return ans;
+    int32_t *ans_data = ans.Data(), ans_stride = ans.ElemStride0();
+
+    // cur_state[fsa_idx0] is the state_idx01 on the frame we are at of the
+    // best path, or -1.
+    Array1<int32_t> cur_state(c_, num_fsas, -1);
+    int32_t *cur_state_data = cur_state.Data();
+    {
+      Ragged<StateInfo> &states = frames_.back()->states;
+      const StateInfo *states_data = states.values.Data();
+      int32_t num_states = states.values.Dim();
+      Array1<int32_t> forward(c_, num_states);
+      int32_t *forward_data = forward.Data();
+      auto lambda_get_forward = [=] __host__ __device__(int32_t i) -> void {
+        forward_data[i] = states_data[i].forward_loglike;
+      };
+      Eval(c_, num_states, lambda_get_forward);
+      Ragged<int32_t> forward_ragged(states.shape, forward);
+      Array1<int32_t> best_forward(c_, states.shape.Dim0());
+      MaxPerSublist(forward_ragged, std::numeric_limits<int32_t>::min(),
+                    &best_forward);
+      const int32_t *best_forward_data = best_forward.Data(),
+                    *states_row_ids1 = states.shape.RowIds(1).Data();
+      auto lambda_set_best_state =
+          [=] __host__ __device__(int32_t state_idx01) -> void {
+        int32_t fsa_idx0 = states_row_ids1[state_idx01];
+        // races are harmless: any of the best states will do.
+        if (forward_data[state_idx01] == best_forward_data[fsa_idx0])
+          cur_state_data[fsa_idx0] = state_idx01;
+      };
+      Eval(c_, num_states, lambda_set_best_state);
     }
+
+    Array1<int32_t> best_arc(c_, num_fsas);
+    int32_t *best_arc_data = best_arc.Data();
+    for (int32_t t = num_frames - 1; t >= 0; t--) {
+      Ragged<ArcInfo> &arcs = frames_[t]->arcs;
+      const ArcInfo *arcs_data = arcs.values.Data();
+      const StateInfo *next_states_data = frames_[t + 1]->states.values.Data();
+      RaggedShapeAccessor<3> arcs_shape = arcs.shape.Accessor<3>();
+      best_arc = -1;
+      // The best arc entering a state is one whose end_loglike is the forward
+      // log-like of the state, which is the max of those of its arcs.
+      auto lambda_find_best_arc =
+          [=] __host__ __device__(int32_t arc_idx012) -> void {
+        int32_t fsa_idx0 = arcs_shape.Idx<0>(arc_idx012),
+                dest_state_idx01 =
+                    arcs_data[arc_idx012].u.dest_info_state_idx01;
+        if (dest_state_idx01 == cur_state_data[fsa_idx0] &&
+            FloatToOrderedInt(arcs_data[arc_idx012].end_loglike) ==
+                next_states_data[dest_state_idx01].forward_loglike)
+          atomicMax(best_arc_data + fsa_idx0, arc_idx012);
+      };
+      Eval(c_, arcs.values.Dim(), lambda_find_best_arc);
+      auto lambda_step_back =
+          [=] __host__ __device__(int32_t fsa_idx0) -> void {
+        int32_t arc_idx012 = best_arc_data[fsa_idx0];
+        if (arc_idx012 == -1) {
+          cur_state_data[fsa_idx0] = -1;
+        } else {
+          ans_data[fsa_idx0 * ans_stride + t] =
+              arcs_data[arc_idx012].a_fsas_arc_idx012;
+          cur_state_data[fsa_idx0] = arcs_shape.Idx<1>(arc_idx012);
+        }
+      };
+      Eval(c_, num_fsas, lambda_step_back);
+    }
+    return ans;
   }
 
   /* Information associated with a state active on a particular frame..  */
@@ -135,7 +465,9 @@ class MultiGraphDenseIntersect {
     // States that are active at the beginning of this frame.  Indexed
     // [fsa_idx][state_idx], where fsa_idx indexes b_fsas_ (and a_fsas_, if
     // a_fsas_stride_ != 0); and state_idx just enumerates the active states
-    // on this frame.
+    // on this frame.  Sequences that can have no states on this frame are
+    // dropped from the end, so the Dim0() may be less than num_seqs_ (see
+    // num_seqs_with_rows_).
     Ragged<StateInfo> states;  // 2 axes: fsa, state
 
     // Indexed [fsa_idx][state_idx][arc_idx].. the first 2 indexes are
@@ -147,6 +479,245 @@ class MultiGraphDenseIntersect {
     // FSA had fewer frames than the max), and indexes [fsa_idx][state_idx] that
     // have no arcs due to pruning.
     Ragged<ArcInfo> arcs;  // 3 axes: fsa, state, arc
+
+    // Set up together with `states`, before this frame is propagated: the
+    // row_splits from each state in `states` to the arcs leaving it in
+    // a_fsas_ (before pruning; the arcs of sequences that have no more frames
+    // are not counted), and the total number of those arcs.
+    Array1<int32_t> unpruned_arc_row_splits;
+    int32_t num_unpruned_arcs;
+
+    // Set by ComputeArcPosteriors(): the occupation probability of each
+    // element of `arcs` (zero for the arcs that were pruned).
+    Array1<float> arc_posts;
+  };
+
+  /*
+    The persistent forward pass (see ForwardFramesPersistent()): Run() does
+    the work of PropagateForward() for `num_frames` frames of one sequence,
+    with the same results, as one block of threads that loops over the
+    frames and only synchronizes with BlockBarrier(), so that the frames
+    don't need anything from the host.  The sequences are independent, so
+    this needs no synchronization between blocks.
+
+    The buffers are indexed [frame][seq][i], where i < capacity; the arcs
+    leaving the states of a sequence beyond the first `capacity` on a frame
+    are dropped (so the states and kept arcs fit too), which is recorded in
+    overflowed[seq].
+   */
+  struct PersistentForward {
+    struct Shared {
+      int32_t scan[kPersistentBlockSize];
+      int32_t histogram[kNumHistogramBins];
+      int32_t max_end_loglike;  // bit-twiddled, as StateInfo::forward_loglike
+      float cutoff;
+    };
+
+    int32_t num_seqs;
+    int32_t num_frames;
+    int32_t t_local_begin;  // the row of b_fsas_ of frame 0 of this launch.
+    int32_t capacity;
+
+    const int32_t *a_fsas_row_splits1;
+    const int32_t *a_fsas_row_splits2;
+    const int32_t *a_fsas_dest_states;
+    const int32_t *a_fsas_symbols;
+    const float *a_fsas_scores;
+    int32_t a_fsas_stride;
+    const int32_t *b_fsas_row_splits1;
+    DenseScoresAccessor scores;
+
+    float beam;
+    int32_t max_active;
+    int32_t min_active;
+    float *dynamic_beams;
+    int32_t *state_map;  // dense, see state_map_.
+    uint64_t state_map_stride;
+    int32_t minus_inf;  // FloatToOrderedInt(-infinity)
+
+    // The states on frame 0 (which are set up on entry) to num_frames, and
+    // the number of states of each [frame][seq] (only those of frame 0 are
+    // set up on entry).
+    StateInfo *states;
+    int32_t *num_states;
+    // The arcs kept on each frame, with their dest-states as
+    // dest_info_state_idx1; with the index i of their source-states, and
+    // the number of them.
+    ArcInfo *arcs;
+    int32_t *arcs_src;
+    int32_t *num_arcs;
+    int32_t *overflowed;  // [seq]
+
+    // Scratch space indexed [seq][i]: capacity elements for the unpruned
+    // arcs, capacity + 1 for the others.
+    ArcInfo *unpruned_arcs;
+    int32_t *unpruned_arcs_src;
+    int32_t *arc_splits;
+    int32_t *keep_arcs;
+    int32_t *keep_states;
+
+    __host__ __device__ void Run(int32_t seq, int32_t tid, int32_t num_threads,
+                                 Shared *shared) const {
+      const int32_t num_bins = kNumHistogramBins,
+                    default_beam_bins = num_bins / 2;
+      float histogram_range = 2.0f * beam,
+            bin_width = histogram_range / num_bins;
+      int32_t row_begin = b_fsas_row_splits1[seq],
+              num_rows = b_fsas_row_splits1[seq + 1] - row_begin,
+              a_fsas_idx0x = a_fsas_row_splits1[seq * a_fsas_stride];
+      int32_t *this_state_map = state_map + seq * state_map_stride;
+      ArcInfo *this_unpruned = unpruned_arcs + seq * capacity;
+      int32_t *this_unpruned_src = unpruned_arcs_src + seq * capacity,
+              *this_arc_splits = arc_splits + seq * (capacity + 1),
+              *this_keep_arcs = keep_arcs + seq * (capacity + 1),
+              *this_keep_states = keep_states + seq * (capacity + 1);
+
+      for (int32_t f = 0; f < num_frames; f++) {
+        int32_t t_local = t_local_begin + f, cur = f * num_seqs + seq,
+                next = cur + num_seqs, num_cur_states = num_states[cur];
+        const StateInfo *cur_states = states + cur * capacity;
+        StateInfo *next_states = states + next * capacity;
+
+        // The unpruned arcs, as in GetUnprunedArcs().
+        for (int32_t i = tid; i < num_cur_states; i += num_threads) {
+          int32_t s = cur_states[i].a_fsas_state_idx01;
+          this_arc_splits[i] =
+              (t_local < num_rows
+                   ? a_fsas_row_splits2[s + 1] - a_fsas_row_splits2[s]
+                   : 0);
+        }
+        BlockBarrier();
+        int32_t num_unpruned =
+            BlockExclusiveSum(num_cur_states, this_arc_splits, tid,
+                              num_threads, shared->scan);
+        if (num_unpruned > capacity) {
+          if (tid == 0) overflowed[seq] = 1;
+          num_unpruned = capacity;
+        }
+        for (int32_t b = tid; b < num_bins; b += num_threads)
+          shared->histogram[b] = 0;
+        if (tid == 0) shared->max_end_loglike = minus_inf;
+        BlockBarrier();
+        for (int32_t j = tid; j < num_unpruned; j += num_threads) {
+          // The source-state is the last one whose arcs start at or before j.
+          int32_t begin = 0, end = num_cur_states - 1;
+          while (begin < end) {
+            int32_t mid = (begin + end + 1) / 2;
+            if (this_arc_splits[mid] <= j)
+              begin = mid;
+            else
+              end = mid - 1;
+          }
+          StateInfo sinfo = cur_states[begin];
+          int32_t a_fsas_arc_idx012 =
+              a_fsas_row_splits2[sinfo.a_fsas_state_idx01] + j -
+              this_arc_splits[begin];
+          float acoustic_score = scores.Get(
+              row_begin + t_local, a_fsas_symbols[a_fsas_arc_idx012] + 1);
+          ArcInfo ai;
+          ai.a_fsas_arc_idx012 = a_fsas_arc_idx012;
+          ai.arc_loglike = acoustic_score + a_fsas_scores[a_fsas_arc_idx012];
+          ai.end_loglike =
+              OrderedIntToFloat(sinfo.forward_loglike) + ai.arc_loglike;
+          ai.u.dest_a_fsas_state_idx01 =
+              a_fsas_idx0x + a_fsas_dest_states[a_fsas_arc_idx012];
+          this_unpruned[j] = ai;
+          this_unpruned_src[j] = begin;
+          atomicMax(&shared->max_end_loglike,
+                    FloatToOrderedInt(ai.end_loglike));
+        }
+        BlockBarrier();
+
+        // The cutoff, as in GetPruningCutoffs().
+        float max_end_loglike = OrderedIntToFloat(shared->max_end_loglike);
+        for (int32_t j = tid; j < num_unpruned; j += num_threads) {
+          float diff = max_end_loglike - this_unpruned[j].end_loglike;
+          if (diff < histogram_range) {
+            int32_t bin = static_cast<int32_t>(diff / bin_width);
+            if (bin >= num_bins) bin = num_bins - 1;
+            atomicAdd(shared->histogram + bin, 1);
+          }
+        }
+        BlockBarrier();
+        if (tid == 0) {
+          const int32_t *histogram = shared->histogram;
+          int32_t b = 0, count = 0;
+          for (; b < default_beam_bins; ++b) {
+            if (count + histogram[b] > max_active) break;
+            count += histogram[b];
+          }
+          int32_t beam_bins = (b == 0 ? 1 : b);
+          if (b == default_beam_bins) {
+            for (; beam_bins < num_bins && count < min_active; ++beam_bins)
+              count += histogram[beam_bins];
+          }
+          float this_beam =
+              (beam_bins == default_beam_bins ? beam : beam_bins * bin_width);
+          if (num_cur_states != 0) dynamic_beams[seq] = this_beam;
+          shared->cutoff = max_end_loglike - this_beam;
+        }
+        BlockBarrier();
+
+        // The pruning, as in PropagateForward().  The arc that numbers each
+        // dest-state is the last one, as on the CPU there.
+        float cutoff = shared->cutoff;
+        for (int32_t j = tid; j < num_unpruned; j += num_threads) {
+          if (this_unpruned[j].end_loglike > cutoff)
+            atomicMax(
+                this_state_map + this_unpruned[j].u.dest_a_fsas_state_idx01,
+                j);
+        }
+        BlockBarrier();
+        for (int32_t j = tid; j < num_unpruned; j += num_threads) {
+          int32_t k =
+              this_state_map[this_unpruned[j].u.dest_a_fsas_state_idx01];
+          this_keep_arcs[j] = (k != -1);
+          this_keep_states[j] = (k == j);
+        }
+        BlockBarrier();
+        int32_t num_kept_arcs = BlockExclusiveSum(
+                    num_unpruned, this_keep_arcs, tid, num_threads,
+                    shared->scan),
+                num_next_states = BlockExclusiveSum(
+                    num_unpruned, this_keep_states, tid, num_threads,
+                    shared->scan);
+        for (int32_t j = tid; j < num_unpruned; j += num_threads) {
+          int32_t state_idx1 = this_keep_states[j];
+          if (this_keep_states[j + 1] == state_idx1) continue;
+          int32_t dest_state_idx01 = this_unpruned[j].u.dest_a_fsas_state_idx01;
+          this_state_map[dest_state_idx01] = state_idx1;
+          StateInfo info;
+          info.a_fsas_state_idx01 = dest_state_idx01;
+          info.forward_loglike = minus_inf;
+          info.backward_loglike = minus_inf;
+          next_states[state_idx1] = info;
+        }
+        BlockBarrier();
+        ArcInfo *kept_arcs = arcs + cur * capacity;
+        int32_t *kept_arcs_src = arcs_src + cur * capacity;
+        for (int32_t j = tid; j < num_unpruned; j += num_threads) {
+          int32_t kept_idx = this_keep_arcs[j];
+          if (this_keep_arcs[j + 1] == kept_idx) continue;
+          ArcInfo info = this_unpruned[j];
+          int32_t state_idx1 = this_state_map[info.u.dest_a_fsas_state_idx01];
+          info.u.dest_info_state_idx1 = state_idx1;
+          kept_arcs[kept_idx] = info;
+          kept_arcs_src[kept_idx] = this_unpruned_src[j];
+          atomicMax(&(next_states[state_idx1].forward_loglike),
+                    FloatToOrderedInt(info.end_loglike));
+        }
+        BlockBarrier();
+        for (int32_t j = tid; j < num_unpruned; j += num_threads) {
+          if (this_keep_states[j + 1] != this_keep_states[j])
+            this_state_map[this_unpruned[j].u.dest_a_fsas_state_idx01] = -1;
+        }
+        if (tid == 0) {
+          num_states[next] = num_next_states;
+          num_arcs[cur] = num_kept_arcs;
+        }
+        BlockBarrier();
+      }
+    }
   };
 
   /* Does the main work of intersection/composition, but doesn't produce any
@@ -161,79 +732,783 @@ class MultiGraphDenseIntersect {
       1).  So the #states is 2 greater than the actual number of frames in the
       neural-net output.
     */
-    int32_t T = b_fsas_.shape.MaxSize(1), num_fsas = b_fsas_.shape.Dim0();
+    int32_t T = b_fsas_.shape.MaxSize(1);
 
     frames_.reserve(T + 1);
 
-    frames_.push_back(InitialFrameInfo());  // TODO: implement
-                                            // InitialFrameInfo().
-    for (int32_t t = 0; t < T; t++) {
-      frames_.push_back(PropagateForward(t, frames_.back()));
+    frames_.push_back(InitialFrameInfo());
+    t_offset_ = 0;
+    ForwardFrames(T);
+    Backward();
+  }
+
+  /*
+    Makes the forward pass write its per-frame statistics to `stats`, see
+    DenseIntersectStats; must be called before Intersect(), and `stats` must
+    outlive it.
+   */
+  void SetStatsOutput(DenseIntersectStats *stats) {
+    int32_t num_rows = b_fsas_.shape.NumElements();
+    stats->shape = b_fsas_.shape;
+    stats->counts = Array2<int32_t>(c_, num_rows, kNumIntersectCounts, 0);
+    stats->beams = Array1<float>(c_, num_rows, 0.0f);
+    stats_ = stats;
+  }
+
+  /*
+    Enables the blank-skipping mode; must be called before Intersect().  On
+    each row (frame) of b_fsas_ where the score of blank (symbol 0, assumed
+    to be a log-probability) is at least log(blank_threshold), i.e. on the
+    runs of frames that blank dominates, only the blank arcs leaving the
+    active states are expanded, in a single collapsed step per frame
+    (basically just staying in, or moving to, the states that emit blank),
+    instead of all their arcs.  With a CTC topology every state has a blank
+    arc, so no path is lost except those that would emit a non-blank symbol
+    on such a frame.  The final row of a sequence is never skipped.
+
+       @param [in] blank_threshold  0 < blank_threshold <= 1.
+       @return  Returns the number of rows that will be skipped; this waits
+                for the device.
+   */
+  int32_t SetBlankSkip(float blank_threshold) {
+    K2_CHECK(blank_threshold > 0 && blank_threshold <= 1);
+    K2_CHECK(frames_.empty());
+    K2_CHECK_GE(b_fsas_.NumCols(), 2);
+    // The blank arcs of each state of a_fsas_, as arc_idx012's.
+    const int32_t *a_fsas_symbols = a_fsas_soa_.symbols.Data();
+    auto lambda_is_blank = [=] __host__ __device__(int32_t i) -> bool {
+      return a_fsas_symbols[i] == 0;
+    };
+    int32_t num_a_arcs = a_fsas_.values.Dim();
+    Renumbering renumbering(c_, num_a_arcs, lambda_is_blank);
+    Ragged<int32_t> arc_indexes(RemoveAxis(a_fsas_.shape, 0),
+                                Range<int32_t>(c_, num_a_arcs, 0));
+    blank_arcs_ = SubsampleRagged(arc_indexes, renumbering);
+
+    DenseScoresAccessor scores = GetDenseScoresAccessor(b_fsas_);
+    float log_threshold = std::log(blank_threshold);
+    auto lambda_skip_row = [=] __host__ __device__(int32_t row) -> bool {
+      // the blank column is column 1, as column 0 is for the final symbol
+      // (-1); on final rows, the score of blank is -infinity.
+      return scores.Get(row, 1) >= log_threshold;
+    };
+    Renumbering skipped_rows(c_, b_fsas_.NumRows(), lambda_skip_row);
+    skip_rows_ = skipped_rows.Keep();
+    return skipped_rows.NumNewElems();
+  }
+
+  // Sets up the members that don't depend on the neural-net output; called by
+  // the constructors, after c_ is set.
+  void Init(int32_t num_seqs) {
+    K2_CHECK_EQ(a_fsas_.NumAxes(), 3);
+    K2_CHECK_GT(beam_, 0);
+    K2_CHECK_GT(lattice_beam_, 0);
+    K2_CHECK_GT(min_active_, 0);
+    K2_CHECK_GT(max_active_, min_active_);
+    K2_CHECK(a_fsas_.shape.Dim0() == num_seqs || a_fsas_.shape.Dim0() == 1);
+    K2_CHECK_GT(num_seqs, 0);
+    num_seqs_ = num_seqs;
+    dynamic_beams_ = Array1<float>(c_, num_seqs, beam_);
+    backward_graph_ = std::make_unique<CudaGraph>(c_);
+    int32_t tot_states = a_fsas_.shape.TotSize(1), state_map_rows;
+    if (a_fsas_.shape.Dim0() == 1) {
+      a_fsas_stride_ = 0;
+      state_map_rows = num_seqs;
+    } else {
+      a_fsas_stride_ = 1;
+      state_map_rows = 1;
+    }
+    int64_t dense_state_map_bytes = static_cast<int64_t>(state_map_rows) *
+                                    tot_states * sizeof(int32_t);
+    use_hash_state_map_ = (dense_state_map_bytes > kDenseStateMapMaxBytes);
+    if (!use_hash_state_map_)
+      state_map_ = Array2<int32_t>(c_, state_map_rows, tot_states, -1);
+  }
+
+  // Does the forward pass for the next `num_frames` frames (rows of b_fsas_,
+  // starting at row frames_.size() - 1 - t_offset_), appending to frames_.
+  // In the persistent mode (persistent_capacity_ > 0), this is done by
+  // ForwardFramesPersistent(), for up to kMaxPersistentFrames frames at a
+  // time; if the capacity is exceeded, the frames that are left are done by
+  // PropagateForward().
+  void ForwardFrames(int32_t num_frames) {
+    K2_PROFILE_SCOPE("IntersectDensePruned:Forward", c_);
+    int32_t i = 0;
+    if (persistent_capacity_ > 0) {
+      while (i < num_frames) {
+        int32_t n = std::min(num_frames - i, kMaxPersistentFrames);
+        if (!ForwardFramesPersistent(n)) break;
+        i += n;
+      }
+      if (i < num_frames) SetUnprunedArcRowSplits(frames_.back().get());
+    }
+    for (; i < num_frames; i++) {
+      int32_t t = static_cast<int32_t>(frames_.size()) - 1;
+      frames_.push_back(PropagateForward(t, frames_.back().get()));
     }
+  }
 
+  /*
+    Does the forward pass for the next `num_frames` frames in the persistent
+    mode, which gives the same result as PropagateForward() but is meant for
+    small numbers of sequences (e.g. streaming with a batch of 1 to 4), for
+    which the time of PropagateForward() is mostly the latency of its kernel
+    launches and of the transfer to the host on each frame.  Here, a single
+    kernel with one block of threads per sequence (see PersistentForward)
+    does all the frames, the sizes of its outputs are read back in one
+    transfer at the end, and then the FrameInfo's are set up from them.
+
+    The states and arcs of each sequence and frame are written to buffers
+    of persistent_capacity_ elements.  If the (unpruned) arcs of some
+    sequence and frame don't fit, this returns false without changing
+    frames_ (the caller then uses PropagateForward()); otherwise true.
+
+    The FrameInfo's that are appended don't have their unpruned arc
+    row-splits set up (see SetUnprunedArcRowSplits()).
+   */
+  bool ForwardFramesPersistent(int32_t num_frames) {
+    K2_CHECK_GT(num_frames, 0);
+    int32_t num_seqs = num_seqs_, capacity = persistent_capacity_,
+            t_local_begin =
+                static_cast<int32_t>(frames_.size()) - 1 - t_offset_,
+            frame_size = num_seqs * capacity;
+    Array1<StateInfo> states(c_, (num_frames + 1) * frame_size);
+    Array1<ArcInfo> arcs(c_, num_frames * frame_size),
+        unpruned_arcs(c_, frame_size);
+    Array1<int32_t> arcs_src(c_, num_frames * frame_size),
+        unpruned_arcs_src(c_, frame_size),
+        scratch(c_, 3 * num_seqs * (capacity + 1));
+    // The numbers of states, indexed [frame][seq] for frames 0 through
+    // num_frames; then the numbers of kept arcs, indexed [frame][seq]; then
+    // the overflow flags, indexed [seq].
+    Array1<int32_t> counts(c_, (2 * num_frames + 2) * num_seqs, 0);
+    int32_t *counts_data = counts.Data(),
+            *overflowed_data = counts_data + (2 * num_frames + 1) * num_seqs;
+    StateInfo *states_data = states.Data();
+
+    Ragged<StateInfo> &first_states = frames_.back()->states;
+    int32_t first_dim0 = first_states.shape.Dim0();
     {
-      // each of these have 3 axes.
+      const StateInfo *first_states_data = first_states.values.Data();
+      const int32_t *first_row_splits1 = first_states.shape.RowSplits(1).Data(),
+                    *first_row_ids1 = first_states.shape.RowIds(1).Data();
+      auto lambda_copy_states =
+          [=] __host__ __device__(int32_t state_idx01) -> void {
+        int32_t seq = first_row_ids1[state_idx01],
+                state_idx1 = state_idx01 - first_row_splits1[seq];
+        if (state_idx1 < capacity)
+          states_data[seq * capacity + state_idx1] =
+              first_states_data[state_idx01];
+      };
+      Eval(c_, first_states.values.Dim(), lambda_copy_states);
+      auto lambda_set_num_states =
+          [=] __host__ __device__(int32_t seq) -> void {
+        int32_t num_states =
+            first_row_splits1[seq + 1] - first_row_splits1[seq];
+        if (num_states > capacity) {
+          overflowed_data[seq] = 1;
+          num_states = capacity;
+        }
+        counts_data[seq] = num_states;
+      };
+      Eval(c_, first_dim0, lambda_set_num_states);
+    }
+
+    PersistentForward params;
+    params.num_seqs = num_seqs;
+    params.num_frames = num_frames;
+    params.t_local_begin = t_local_begin;
+    params.capacity = capacity;
+    params.a_fsas_row_splits1 = a_fsas_.shape.RowSplits(1).Data();
+    params.a_fsas_row_splits2 = a_fsas_.shape.RowSplits(2).Data();
+    params.a_fsas_dest_states = a_fsas_soa_.dest_states.Data();
+    params.a_fsas_symbols = a_fsas_soa_.symbols.Data();
+    params.a_fsas_scores = a_fsas_soa_.scores.Data();
+    params.a_fsas_stride = a_fsas_stride_;
+    params.b_fsas_row_splits1 = b_fsas_.shape.RowSplits(1).Data();
+    params.scores = GetDenseScoresAccessor(b_fsas_);
+    params.beam = beam_;
+    params.max_active = max_active_;
+    params.min_active = min_active_;
+    params.dynamic_beams = dynamic_beams_.Data();
+    params.state_map = state_map_.Data();
+    params.state_map_stride =
+        (a_fsas_stride_ == 0 ? a_fsas_.shape.TotSize(1) : 0);
+    params.minus_inf =
+        FloatToOrderedInt(-std::numeric_limits<float>::infinity());
+    params.states = states_data;
+    params.num_states = counts_data;
+    params.arcs = arcs.Data();
+    params.arcs_src = arcs_src.Data();
+    params.num_arcs = counts_data + (num_frames + 1) * num_seqs;
+    params.overflowed = overflowed_data;
+    params.unpruned_arcs = unpruned_arcs.Data();
+    params.unpruned_arcs_src = unpruned_arcs_src.Data();
+    params.arc_splits = scratch.Data();
+    params.keep_arcs = params.arc_splits + num_seqs * (capacity + 1);
+    params.keep_states = params.keep_arcs + num_seqs * (capacity + 1);
+    if (c_->GetDeviceType() == kCpu) {
+      PersistentForward::Shared shared;
+      for (int32_t seq = 0; seq < num_seqs; seq++)
+        params.Run(seq, 0, 1, &shared);
+    } else {
+      K2_CHECK_EQ(c_->GetDeviceType(), kCuda);
+      K2_CUDA_SAFE_CALL(
+          PersistentForwardKernel<<<num_seqs, kPersistentBlockSize, 0,
+                                    c_->GetCudaStream()>>>(params));
+    }
+
+    // This is the only transfer to the host.
+    Array1<int32_t> counts_cpu = counts.To(GetCpuContext());
+    const int32_t *num_states_cpu = counts_cpu.Data(),
+                  *num_arcs_cpu = num_states_cpu + (num_frames + 1) * num_seqs,
+                  *overflowed_cpu =
+                      num_states_cpu + (2 * num_frames + 1) * num_seqs;
+    for (int32_t seq = 0; seq < num_seqs; seq++)
+      if (overflowed_cpu[seq]) return false;
+
+    // The Dim0() of the states of each frame, as in PropagateForward() and
+    // EmptyNextFrame(); and, for each frame, the row_splits of its kept
+    // arcs by sequence and those of the states of the next frame, which are
+    // uploaded together.
+    std::vector<int32_t> dim0s(num_frames + 1), splits, splits_offsets;
+    dim0s[0] = first_dim0;
+    int32_t tot_states = first_states.values.Dim();
+    for (int32_t f = 0; f < num_frames; f++) {
+      int32_t next_dim0 =
+          (tot_states == 0
+               ? 0
+               : std::min(dim0s[f], NumSeqsWithRows(t_local_begin + f + 1)));
+      dim0s[f + 1] = next_dim0;
+      splits_offsets.push_back(static_cast<int32_t>(splits.size()));
+      splits.push_back(0);
+      for (int32_t seq = 0; seq < dim0s[f]; seq++)
+        splits.push_back(splits.back() + num_arcs_cpu[f * num_seqs + seq]);
+      splits_offsets.push_back(static_cast<int32_t>(splits.size()));
+      splits.push_back(0);
+      const int32_t *next_num_states = num_states_cpu + (f + 1) * num_seqs;
+      for (int32_t seq = 0; seq < next_dim0; seq++)
+        splits.push_back(splits.back() + next_num_states[seq]);
+      for (int32_t seq = next_dim0; seq < num_seqs; seq++)
+        K2_DCHECK_EQ(next_num_states[seq], 0);
+      tot_states = splits.back();
+    }
+    Array1<int32_t> splits_array(c_, splits);
+
+    const ArcInfo *arcs_data = arcs.Data();
+    const int32_t *arcs_src_data = arcs_src.Data();
+    for (int32_t f = 0; f < num_frames; f++) {
+      FrameInfo *cur_frame = frames_.back().get();
+      Ragged<StateInfo> &cur_states = cur_frame->states;
+      int32_t num_cur_states = cur_states.values.Dim(),
+              arcs_offset = splits_offsets[2 * f],
+              states_offset = splits_offsets[2 * f + 1],
+              num_kept_arcs = splits[arcs_offset + dim0s[f]],
+              num_next_states = splits[states_offset + dim0s[f + 1]];
+      Array1<int32_t> arcs_row_splits1 =
+                          splits_array.Range(arcs_offset, dim0s[f] + 1),
+                      next_row_splits1 = splits_array.Range(
+                          states_offset, dim0s[f + 1] + 1),
+                      arcs_row_ids1(c_, num_kept_arcs),
+                      next_row_ids1(c_, num_next_states);
+      RowSplitsToRowIds(arcs_row_splits1, arcs_row_ids1);
+      RowSplitsToRowIds(next_row_splits1, next_row_ids1);
+
+      Array1<StateInfo> next_states(c_, num_next_states);
+      StateInfo *next_states_data = next_states.Data();
+      const int32_t *next_row_splits1_data = next_row_splits1.Data(),
+                    *next_row_ids1_data = next_row_ids1.Data();
+      auto lambda_set_next_states =
+          [=] __host__ __device__(int32_t state_idx01) -> void {
+        int32_t seq = next_row_ids1_data[state_idx01],
+                state_idx1 = state_idx01 - next_row_splits1_data[seq];
+        next_states_data[state_idx01] =
+            states_data[((f + 1) * num_seqs + seq) * capacity + state_idx1];
+      };
+      Eval(c_, num_next_states, lambda_set_next_states);
+
+      // The kept arcs, with their dest-states as dest_info_state_idx01.
+      Array1<ArcInfo> kept_arcs(c_, num_kept_arcs);
+      Array1<int32_t> kept_row_splits2(c_, num_cur_states + 1),
+          kept_row_ids2(c_, num_kept_arcs);
+      ArcInfo *kept_arcs_data = kept_arcs.Data();
+      int32_t *kept_row_ids2_data = kept_row_ids2.Data();
+      const int32_t *arcs_row_splits1_data = arcs_row_splits1.Data(),
+                    *arcs_row_ids1_data = arcs_row_ids1.Data(),
+                    *cur_row_splits1_data =
+                        cur_states.shape.RowSplits(1).Data();
+      auto lambda_set_kept_arcs = [=] __host__ __device__(int32_t i) -> void {
+        int32_t seq = arcs_row_ids1_data[i],
+                j = (f * num_seqs + seq) * capacity + i -
+                    arcs_row_splits1_data[seq];
+        ArcInfo info = arcs_data[j];
+        info.u.dest_info_state_idx01 =
+            next_row_splits1_data[seq] + info.u.dest_info_state_idx1;
+        kept_arcs_data[i] = info;
+        kept_row_ids2_data[i] = cur_row_splits1_data[seq] + arcs_src_data[j];
+      };
+      Eval(c_, num_kept_arcs, lambda_set_kept_arcs);
+      RowIdsToRowSplits(kept_row_ids2, kept_row_splits2);
+
+      RaggedShape kept_shape = RaggedShape3(
+          &cur_states.shape.RowSplits(1), &cur_states.shape.RowIds(1),
+          num_cur_states, &kept_row_splits2, &kept_row_ids2, num_kept_arcs);
+      cur_frame->arcs = Ragged<ArcInfo>(kept_shape, kept_arcs);
+      cur_frame->unpruned_arc_row_splits = Array1<int32_t>();
+
+      std::unique_ptr<FrameInfo> next_frame = std::make_unique<FrameInfo>();
+      next_frame->states = Ragged<StateInfo>(
+          RaggedShape2(&next_row_splits1, &next_row_ids1, num_next_states),
+          next_states);
+      next_frame->num_unpruned_arcs = 0;
+      frames_.push_back(std::move(next_frame));
+    }
+    return true;
+  }
+
+  /*
+    Sets up the unpruned arc row-splits of `frame`, which must be
+    frames_.back(), if they are not set up (see ForwardFramesPersistent()),
+    as in PropagateForward().  Causes a transfer from the device.
+   */
+  void SetUnprunedArcRowSplits(FrameInfo *frame) {
+    if (frame->unpruned_arc_row_splits.Dim() != 0) return;
+    int32_t t_local = static_cast<int32_t>(frames_.size()) - 1 - t_offset_;
+    Ragged<StateInfo> &states = frame->states;
+    int32_t num_states = states.values.Dim();
+    const StateInfo *states_data = states.values.Data();
+    const int32_t *states_row_ids1 = states.shape.RowIds(1).Data(),
+                  *b_fsas_row_splits1 = b_fsas_.shape.RowSplits(1).Data(),
+                  *a_fsas_row_splits2 = a_fsas_.shape.RowSplits(2).Data();
+    Array1<int32_t> row_splits(c_, num_states + 1);
+    int32_t *row_splits_data = row_splits.Data();
+    auto lambda_set_num_arcs =
+        [=] __host__ __device__(int32_t state_idx01) -> void {
+      int32_t fsa_idx0 = states_row_ids1[state_idx01],
+              num_rows = b_fsas_row_splits1[fsa_idx0 + 1] -
+                         b_fsas_row_splits1[fsa_idx0],
+              a_fsas_state_idx01 = states_data[state_idx01].a_fsas_state_idx01;
+      row_splits_data[state_idx01] =
+          (t_local < num_rows ? a_fsas_row_splits2[a_fsas_state_idx01 + 1] -
+                                    a_fsas_row_splits2[a_fsas_state_idx01]
+                              : 0);
+    };
+    Eval(c_, num_states, lambda_set_num_arcs);
+    frame->num_unpruned_arcs = ExclusiveSumWithTotal(
+        c_, num_states + 1, row_splits_data, row_splits_data);
+    frame->unpruned_arc_row_splits = row_splits;
+  }
+
+  // Sets num_seqs_with_rows_ from the row counts of b_fsas_ (which causes a
+  // transfer from the device).
+  void SetNumSeqsWithRows() {
+    Array1<int32_t> row_splits1 =
+        b_fsas_.shape.RowSplits(1).To(GetCpuContext());
+    const int32_t *row_splits1_data = row_splits1.Data();
+    int32_t num_seqs = b_fsas_.shape.Dim0(), max_rows = 0;
+    for (int32_t i = 0; i < num_seqs; i++)
+      max_rows =
+          std::max(max_rows, row_splits1_data[i + 1] - row_splits1_data[i]);
+    num_seqs_with_rows_.assign(max_rows + 1, 0);
+    for (int32_t i = 0; i < num_seqs; i++)
+      num_seqs_with_rows_[row_splits1_data[i + 1] - row_splits1_data[i]] =
+          i + 1;
+    for (int32_t r = max_rows - 1; r >= 0; r--)
+      num_seqs_with_rows_[r] =
+          std::max(num_seqs_with_rows_[r], num_seqs_with_rows_[r + 1]);
+  }
+
+  // Returns 1 + the largest index of a sequence with at least `num_rows` rows
+  // in b_fsas_, or 0 if there is none.
+  int32_t NumSeqsWithRows(int32_t num_rows) const {
+    int32_t size = static_cast<int32_t>(num_seqs_with_rows_.size());
+    return (num_rows < size ? num_seqs_with_rows_[num_rows] : 0);
+  }
+
+  // Does the backward pass, after the forward pass for all frames; this
+  // decides which states and arcs are kept in the output.
+  void Backward() {
+    K2_PROFILE_SCOPE("IntersectDensePruned:Backward", c_);
+    finalized_ = true;
+    int32_t T = static_cast<int32_t>(frames_.size()) - 1;
+    {
+      // No arcs leave the states on the last frame (they can only be final
+      // states).
+      FrameInfo *last_frame = frames_.back().get();
+      int32_t num_states = last_frame->states.values.Dim();
+      Array1<int32_t> row_splits2(c_, num_states + 1, 0), row_ids2(c_, 0);
+      RaggedShape arcs_shape = RaggedShape3(
+          &last_frame->states.shape.RowSplits(1),
+          &last_frame->states.shape.RowIds(1), num_states, &row_splits2,
+          &row_ids2, 0);
+      last_frame->arcs = Ragged<ArcInfo>(arcs_shape, Array1<ArcInfo>(c_, 0));
+    }
+
+    {
+      // each of these have 3 axes; they are padded so they all have
+      // num_seqs_ rows.
+      std::vector<RaggedShape> padded_arcs_shapes(T + 1);
       std::vector<const RaggedShape *> arcs_shapes(T + 1);
-      for (int32_t t = 0; t <= T; t++)
-        arcs_shapes[t] = &(frames_[t]->arcs.shape);
+      for (int32_t t = 0; t <= T; t++) {
+        padded_arcs_shapes[t] = PadDim0(frames_[t]->arcs.shape, num_seqs_);
+        arcs_shapes[t] = &(padded_arcs_shapes[t]);
+      }
 
       // oshape_unpruned_ is a 4-axis ragged tensor which is indexed:
       //   oshape_unpruned_[fsa_index][t][state_idx][arc_idx]
-      // This is BEFORE BACKWARD PRUNING... oshape_pruned_ will
-      // be after backward pruning
+      // This is BEFORE BACKWARD PRUNING; renumber_output_states_ and
+      // renumber_output_arcs_ say what is kept after it.
       int32_t axis = 1;
       oshape_unpruned_ = Stack(axis, T + 1, &(arcs_shapes[0]));
     }
-    renumber_output_states_.Init(oshape_unpruned_.TotSize(2));
-    renumber_output_arcs_.Init(oshape_unpruned_.TotSize(3));
+    renumber_output_states_.Init(c_, oshape_unpruned_.TotSize(2));
+    renumber_output_arcs_.Init(c_, oshape_unpruned_.TotSize(3));
 
     for (int32_t t = T; t >= 0; t--) {
       // this writes to elements of renumber_output_states_.Keep() and
       // renumber_output_arcs_.Keep().
-      PropagateBackward(t, frames_[t], (t == T ? NULL : frames_[t + 1]));
+      PropagateBackward(t, frames_[t].get(),
+                        (t == T ? nullptr : frames_[t + 1].get()));
+    }
+  }
+
+  /*
+    Does forward-backward in the log semiring (log-add, not max) over the
+    lattice that FormatOutput() outputs, i.e. over the states and arcs that
+    were kept by Backward(); must be called after it.  Sets up the
+    `arc_posts` of frames_, which FormatOutput() outputs if asked.
+
+       @param [out] tot_scores  If not nullptr, will be set to an array with
+                      one element per sequence, the log of the sum of the
+                      probabilities of the paths through its lattice
+                      (-infinity if the lattice is empty).
+
+    The sums over the arcs leaving (resp. entering) each state are done with
+    LogSumPerSublist(); for the forward pass the arcs of each frame are first
+    sorted by destination state (a stable sort), so no atomics are used and
+    the results are the same on every run.
+   */
+  void ComputeArcPosteriors(Array1<float> *tot_scores) {
+    K2_PROFILE_SCOPE("IntersectDensePruned:ArcPosteriors", c_);
+    K2_CHECK(finalized_);
+    int32_t T = static_cast<int32_t>(frames_.size()) - 1,
+            num_fsas = num_seqs_;
+    const int32_t *a_fsas_row_splits1 = a_fsas_.shape.RowSplits(1).Data();
+    int32_t a_fsas_stride = a_fsas_stride_;
+    const int32_t *oshape_row_splits1 = oshape_unpruned_.RowSplits(1).Data(),
+                  *oshape_row_splits2 = oshape_unpruned_.RowSplits(2).Data(),
+                  *oshape_row_splits3 = oshape_unpruned_.RowSplits(3).Data();
+    const char *keep_arcs_data = renumber_output_arcs_.Keep().Data(),
+               *keep_states_data = renumber_output_states_.Keep().Data();
+    float float_minus_inf = -std::numeric_limits<float>::infinity();
+
+    // beta[t] is the log-sum backward score of each state on frame t
+    // (indexed by state_idx01 w.r.t. frames_[t]->states); -infinity for the
+    // states that were pruned.
+    std::vector<Array1<float>> beta(T + 1);
+    for (int32_t t = T; t >= 0; t--) {
+      FrameInfo *cur_frame = frames_[t].get();
+      int32_t num_states = cur_frame->states.values.Dim(),
+              num_arcs = cur_frame->arcs.values.Dim();
+      const StateInfo *states_data = cur_frame->states.values.Data();
+      const ArcInfo *arcs_data = cur_frame->arcs.values.Data();
+      const int32_t *arcs_rowids1 = cur_frame->arcs.shape.RowIds(1).Data(),
+                    *arcs_rowids2 = cur_frame->arcs.shape.RowIds(2).Data(),
+                    *arcs_row_splits1 =
+                        cur_frame->arcs.shape.RowSplits(1).Data(),
+                    *arcs_row_splits2 =
+                        cur_frame->arcs.shape.RowSplits(2).Data();
+      const int32_t *next_states_row_splits1 = nullptr;
+      const float *next_beta_data = nullptr;
+      if (t < T) {
+        next_states_row_splits1 =
+            frames_[t + 1]->states.shape.RowSplits(1).Data();
+        next_beta_data = beta[t + 1].Data();
+      }
+
+      Array1<float> arc_beta(c_, num_arcs);
+      float *arc_beta_data = arc_beta.Data();
+      auto lambda_set_arc_beta =
+          [=] __host__ __device__(int32_t arcs_idx012) -> void {
+        int32_t state_idx01 = arcs_rowids2[arcs_idx012],
+                fsa_idx0 = arcs_rowids1[state_idx01],
+                fsa_idx0xx = arcs_row_splits2[arcs_row_splits1[fsa_idx0]],
+                arcs_idxx12 = arcs_idx012 - fsa_idx0xx,
+                oshape_idx01x =
+                    oshape_row_splits2[oshape_row_splits1[fsa_idx0] + t],
+                oshape_idx0123 =
+                    oshape_row_splits3[oshape_idx01x] + arcs_idxx12;
+        const ArcInfo &arc = arcs_data[arcs_idx012];
+        if (keep_arcs_data[oshape_idx0123]) {
+          int32_t dest_state_idx01 = next_states_row_splits1[fsa_idx0] +
+                                     arc.u.dest_info_state_idx1;
+          arc_beta_data[arcs_idx012] =
+              arc.arc_loglike + next_beta_data[dest_state_idx01];
+        } else {
+          arc_beta_data[arcs_idx012] = float_minus_inf;
+        }
+      };
+      Eval(c_, num_arcs, lambda_set_arc_beta);
+
+      Ragged<float> arc_beta_per_state(RemoveAxis(cur_frame->arcs.shape, 0),
+                                       arc_beta);
+      beta[t] = Array1<float>(c_, num_states);
+      LogSumPerSublist(arc_beta_per_state, float_minus_inf, &beta[t]);
+      float *beta_data = beta[t].Data();
+      auto lambda_set_state_beta =
+          [=] __host__ __device__(int32_t state_idx01) -> void {
+        int32_t fsa_idx0 = arcs_rowids1[state_idx01],
+                states_idxx1 = state_idx01 - arcs_row_splits1[fsa_idx0],
+                oshape_idx012 =
+                    oshape_row_splits2[oshape_row_splits1[fsa_idx0] + t] +
+                    states_idxx1,
+                fsas_state_idx0x_next =
+                    a_fsas_row_splits1[fsa_idx0 * a_fsas_stride + 1];
+        if (!keep_states_data[oshape_idx012])
+          beta_data[state_idx01] = float_minus_inf;
+        else if (states_data[state_idx01].a_fsas_state_idx01 + 1 ==
+                 fsas_state_idx0x_next)
+          beta_data[state_idx01] = 0.0;  // the final state
+      };
+      Eval(c_, num_states, lambda_set_state_beta);
+    }
+
+    // Each FSA has at most one state on frame 0, its start state.
+    Array1<float> tot(c_, num_fsas, float_minus_inf);
+    {
+      float *tot_data = tot.Data();
+      const float *beta_data = beta[0].Data();
+      const int32_t *states_rowids1 = frames_[0]->states.shape.RowIds(1).Data();
+      auto lambda_set_tot = [=] __host__ __device__(int32_t state_idx01) {
+        tot_data[states_rowids1[state_idx01]] = beta_data[state_idx01];
+      };
+      Eval(c_, beta[0].Dim(), lambda_set_tot);
+    }
+    const float *tot_data = tot.Data();
+
+    // alpha is the log-sum forward score of each state on the current frame.
+    Array1<float> alpha(c_, frames_[0]->states.values.Dim());
+    {
+      float *alpha_data = alpha.Data();
+      const float *beta_data = beta[0].Data();
+      auto lambda_set_start_alpha =
+          [=] __host__ __device__(int32_t state_idx01) {
+        // beta is -infinity for the pruned states.
+        alpha_data[state_idx01] =
+            (beta_data[state_idx01] == float_minus_inf ? float_minus_inf
+                                                       : 0.0);
+      };
+      Eval(c_, alpha.Dim(), lambda_set_start_alpha);
+    }
+    for (int32_t t = 0; t <= T; t++) {
+      FrameInfo *cur_frame = frames_[t].get();
+      int32_t num_arcs = cur_frame->arcs.values.Dim();
+      cur_frame->arc_posts = Array1<float>(c_, num_arcs);
+      if (t == T) break;  // no arcs leave the states on the last frame.
+      FrameInfo *next_frame = frames_[t + 1].get();
+      int32_t num_next_states = next_frame->states.values.Dim();
+      const ArcInfo *arcs_data = cur_frame->arcs.values.Data();
+      const int32_t *arcs_rowids1 = cur_frame->arcs.shape.RowIds(1).Data(),
+                    *arcs_rowids2 = cur_frame->arcs.shape.RowIds(2).Data(),
+                    *arcs_row_splits1 =
+                        cur_frame->arcs.shape.RowSplits(1).Data(),
+                    *arcs_row_splits2 =
+                        cur_frame->arcs.shape.RowSplits(2).Data(),
+                    *next_states_row_splits1 =
+                        next_frame->states.shape.RowSplits(1).Data();
+      const float *alpha_data = alpha.Data(),
+                  *next_beta_data = beta[t + 1].Data();
+
+      // The posterior of each arc, its destination state (as state_idx01
+      // w.r.t. next_frame->states), and the forward score it contributes to
+      // that state.
+      Array1<int32_t> dest_states(c_, num_arcs);
+      Array1<float> arc_alpha(c_, num_arcs);
+      int32_t *dest_states_data = dest_states.Data();
+      float *arc_posts_data = cur_frame->arc_posts.Data(),
+            *arc_alpha_data = arc_alpha.Data();
+      auto lambda_set_arc_posts =
+          [=] __host__ __device__(int32_t arcs_idx012) -> void {
+        int32_t state_idx01 = arcs_rowids2[arcs_idx012],
+                fsa_idx0 = arcs_rowids1[state_idx01],
+                fsa_idx0xx = arcs_row_splits2[arcs_row_splits1[fsa_idx0]],
+                arcs_idxx12 = arcs_idx012 - fsa_idx0xx,
+                oshape_idx01x =
+                    oshape_row_splits2[oshape_row_splits1[fsa_idx0] + t],
+                oshape_idx0123 =
+                    oshape_row_splits3[oshape_idx01x] + arcs_idxx12;
+        const ArcInfo &arc = arcs_data[arcs_idx012];
+        int32_t dest_state_idx01 =
+            next_states_row_splits1[fsa_idx0] + arc.u.dest_info_state_idx1;
+        dest_states_data[arcs_idx012] = dest_state_idx01;
+        if (keep_arcs_data[oshape_idx0123]) {
+          float alpha = alpha_data[state_idx01] + arc.arc_loglike;
+          arc_alpha_data[arcs_idx012] = alpha;
+          arc_posts_data[arcs_idx012] = expf(
+              alpha + next_beta_data[dest_state_idx01] - tot_data[fsa_idx0]);
+        } else {
+          arc_alpha_data[arcs_idx012] = float_minus_inf;
+          arc_posts_data[arcs_idx012] = 0.0;
+        }
+      };
+      Eval(c_, num_arcs, lambda_set_arc_posts);
+
+      // Group the arcs by destination state to sum the forward scores they
+      // contribute to it.
+      Array1<int32_t> row_splits(c_, 2, 0), order(c_, num_arcs);
+      {
+        int32_t *row_splits_data = row_splits.Data();
+        auto lambda_set_num_arcs = [=] __host__ __device__(int32_t i) {
+          row_splits_data[1] = num_arcs;
+        };
+        Eval(c_, 1, lambda_set_num_arcs);
+      }
+      Ragged<int32_t> sorted_dests(
+          RaggedShape2(&row_splits, nullptr, num_arcs), dest_states);
+      SortSublists(&sorted_dests, &order);
+      Array1<int32_t> incoming_row_splits(c_, num_next_states + 1);
+      RowIdsToRowSplits(sorted_dests.values, incoming_row_splits);
+
+      Ragged<float> arc_alpha_per_state(
+          RaggedShape2(&incoming_row_splits, &sorted_dests.values, num_arcs),
+          arc_alpha[order]);
+      Array1<float> next_alpha(c_, num_next_states);
+      LogSumPerSublist(arc_alpha_per_state, float_minus_inf, &next_alpha);
+      alpha = next_alpha;
     }
-    // TODO(haowen): replace with SubsampleRaggedShape?
-    // oshape_pruned_ = RaggedShape4Subsampled(oshape_unpruned_, NULL, NULL,
-    //                                        &renumber_output_states_,
-    //                                        &renumber_output_arcs_);
+    have_arc_posts_ = true;
+    if (tot_scores != nullptr) *tot_scores = tot;
   }
 
-  FrameInfo *InitialFrameInfo() {
-    // TODO
-    K2_LOG(FATAL) << "Not Implemeted";
-    return nullptr;
+  /*
+    Returns the FrameInfo for frame 0, on which the start state of the FSA of
+    each sequence is active (none if that FSA is empty), with a forward
+    log-like of zero.
+   */
+  std::unique_ptr<FrameInfo> InitialFrameInfo() {
+    int32_t num_fsas = num_seqs_, a_fsas_stride = a_fsas_stride_;
+    const int32_t *a_fsas_row_splits1 = a_fsas_.shape.RowSplits(1).Data(),
+                  *a_fsas_row_splits2 = a_fsas_.shape.RowSplits(2).Data();
+
+    Array1<int32_t> row_splits1(c_, num_fsas + 1);
+    int32_t *row_splits1_data = row_splits1.Data();
+    auto lambda_set_num_states =
+        [=] __host__ __device__(int32_t fsa_idx0) -> void {
+      int32_t a_fsas_idx0 = fsa_idx0 * a_fsas_stride;
+      row_splits1_data[fsa_idx0] = (a_fsas_row_splits1[a_fsas_idx0 + 1] >
+                                            a_fsas_row_splits1[a_fsas_idx0]
+                                        ? 1
+                                        : 0);
+    };
+    Eval(c_, num_fsas, lambda_set_num_states);
+    int32_t num_states = ExclusiveSumWithTotal(c_, num_fsas + 1,
+                                               row_splits1_data,
+                                               row_splits1_data);
+    Array1<int32_t> row_ids1(c_, num_states);
+    RowSplitsToRowIds(row_splits1, row_ids1);
+
+    Array1<StateInfo> states(c_, num_states);
+    Array1<int32_t> arc_row_splits(c_, num_states + 1);
+    StateInfo *states_data = states.Data();
+    int32_t *arc_row_splits_data = arc_row_splits.Data();
+    const int32_t *row_ids1_data = row_ids1.Data();
+    float float_minus_inf = -std::numeric_limits<float>::infinity();
+    const int32_t zero = FloatToOrderedInt(0.0f),
+                  minus_inf = FloatToOrderedInt(float_minus_inf);
+    // See SetBlankSkip(); row 0 of each sequence is the first row of b_fsas_.
+    const char *skip_rows_data = nullptr;
+    const int32_t *b_fsas_row_splits1 = nullptr,
+                  *blank_arcs_row_splits = nullptr;
+    if (skip_rows_.Dim() != 0) {
+      skip_rows_data = skip_rows_.Data();
+      b_fsas_row_splits1 = b_fsas_.shape.RowSplits(1).Data();
+      blank_arcs_row_splits = blank_arcs_.shape.RowSplits(1).Data();
+    }
+    auto lambda_set_states =
+        [=] __host__ __device__(int32_t state_idx01) -> void {
+      int32_t fsa_idx0 = row_ids1_data[state_idx01],
+              a_fsas_state_idx01 = a_fsas_row_splits1[fsa_idx0 * a_fsas_stride];
+      StateInfo info;
+      info.a_fsas_state_idx01 = a_fsas_state_idx01;
+      info.forward_loglike = zero;
+      info.backward_loglike = minus_inf;
+      states_data[state_idx01] = info;
+      // Every sequence has at least one frame (the final one), so the arcs
+      // leaving the start state are all needed.
+      const int32_t *splits =
+          (skip_rows_data != nullptr &&
+                   skip_rows_data[b_fsas_row_splits1[fsa_idx0]]
+               ? blank_arcs_row_splits
+               : a_fsas_row_splits2);
+      arc_row_splits_data[state_idx01] =
+          splits[a_fsas_state_idx01 + 1] - splits[a_fsas_state_idx01];
+    };
+    Eval(c_, num_states, lambda_set_states);
+
+    std::unique_ptr<FrameInfo> ans = std::make_unique<FrameInfo>();
+    ans->num_unpruned_arcs = ExclusiveSumWithTotal(
+        c_, num_states + 1, arc_row_splits_data, arc_row_splits_data);
+    ans->unpruned_arc_row_splits = arc_row_splits;
+    ans->states = Ragged<StateInfo>(
+        RaggedShape2(&row_splits1, &row_ids1, num_states), states);
+    return ans;
   }
 
+  /*
+    Writes the pruned lattice to the output.  Must be called after
+    Intersect().
+
+       @param [out] ofsa  The output FsaVec, with one FSA per sequence of
+                      b_fsas_; the states of each FSA are ordered by frame,
+                      so state 0 is the start state and the last state is
+                      the final state.  FSAs for which no path survived the
+                      pruning are empty.
+       @param [out] arc_map_a  If not nullptr, will be set to the index in
+                      a_fsas_ of the arc that each output arc came from.
+       @param [out] arc_map_b  If not nullptr, will be set to the index into
+                      b_fsas_.scores.Data() (or half_scores.Data(); i.e. the
+                      arc-index in b_fsas_) of the score that each output
+                      arc used.
+       @param [out] arc_posts  If not nullptr, will be set to the occupation
+                      probability of each output arc; requires that
+                      ComputeArcPosteriors() has been called.
+   */
   void FormatOutput(FsaVec *ofsa, Array1<int32_t> *arc_map_a,
-                    Array1<int32_t> *arc_map_b) {
-    ContextPtr c_cpu = c_->GetCpuContext();
-    int32_t T = a_fsas_.shape.MaxSize(1);
-
-    int32_t *oshapeu_row_ids3 = oshape_unpruned_.RowIds(3).Data(),
-            *oshapeu_row_ids2 = oshape_unpruned_.RowIds(2).Data(),
-            *oshapeu_row_ids1 = oshape_unpruned_.RowIds(1).Data(),
-            *oshapeu_row_splits3 = oshape_unpruned_.RowSplits(3).Data(),
-            *oshapeu_row_splits2 = oshape_unpruned_.RowSplits(2).Data(),
-            *oshapeu_row_splits1 = oshape_unpruned_.RowSplits(1).Data();
-
-    int32_t *oshapep_row_ids3 = oshape_pruned_.RowIds(3).Data(),
-            *oshapep_row_ids2 = oshape_pruned_.RowIds(2).Data(),
-            *oshapep_row_ids1 = oshape_pruned_.RowIds(1).Data(),
-            *oshapep_row_splits3 = oshape_pruned_.RowSplits(3).Data(),
-            *oshapep_row_splits2 = oshape_pruned_.RowSplits(2).Data(),
-            *oshapep_row_splits1 = oshape_pruned_.RowSplits(1).Data();
-
+                    Array1<int32_t> *arc_map_b,
+                    Array1<float> *arc_posts = nullptr) {
+    K2_PROFILE_SCOPE("IntersectDensePruned:FormatOutput", c_);
+    K2_CHECK(arc_posts == nullptr || have_arc_posts_);
+    ContextPtr c_cpu = GetCpuContext();
+    int32_t T = static_cast<int32_t>(frames_.size()) - 1,
+            num_fsas = num_seqs_;
+
+    const int32_t *oshapeu_row_ids3 = oshape_unpruned_.RowIds(3).Data(),
+                  *oshapeu_row_ids2 = oshape_unpruned_.RowIds(2).Data(),
+                  *oshapeu_row_ids1 = oshape_unpruned_.RowIds(1).Data(),
+                  *oshapeu_row_splits3 = oshape_unpruned_.RowSplits(3).Data(),
+                  *oshapeu_row_splits2 = oshape_unpruned_.RowSplits(2).Data(),
+                  *oshapeu_row_splits1 = oshape_unpruned_.RowSplits(1).Data();
+
+    // Get both sizes with one wait for the device.
+    ComputeNumNewElems({&renumber_output_states_, &renumber_output_arcs_});
+    int32_t num_states_unpruned = oshape_unpruned_.TotSize(2),
+            num_states = renumber_output_states_.NumNewElems(),
+            num_arcs = renumber_output_arcs_.NumNewElems();
     // the 0123 and 012 express what type of indexes they are, see comment at
     // top of utils.h
-    int32_t *reverse_arc_map0123 = renumber_output_states_.New2Old().Data(),
-            *reverse_state_map012 = renumber_output_states_.New2Old().Data();
+    const int32_t *state_map012 = renumber_output_states_.Old2New().Data(),
+                  *arc_map0123 = renumber_output_arcs_.Old2New().Data(),
+                  *reverse_arc_map0123 = renumber_output_arcs_.New2Old().Data();
 
     Array1<ArcInfo *> arcs_data_ptrs(c_cpu, T + 1);
     Array1<int32_t *> arcs_row_splits1_ptrs(c_cpu, T + 1);
     Array1<int32_t *> arcs_row_splits2_ptrs(c_cpu, T + 1);
+    Array1<float *> arc_posts_ptrs(c_cpu, T + 1);
 
     for (int32_t t = 0; t <= T; t++) {
       arcs_data_ptrs.Data()[t] = frames_[t]->arcs.values.Data();
+      if (arc_posts != nullptr)
+        arc_posts_ptrs.Data()[t] = frames_[t]->arc_posts.Data();
       arcs_row_splits1_ptrs.Data()[t] =
           frames_[t]->arcs.shape.RowSplits(1).Data();
       arcs_row_splits2_ptrs.Data()[t] =
@@ -244,33 +1519,69 @@ class MultiGraphDenseIntersect {
     arcs_row_splits1_ptrs = arcs_row_splits1_ptrs.To(c_);
     arcs_row_splits2_ptrs = arcs_row_splits2_ptrs.To(c_);
     ArcInfo **arcs_data_ptrs_data = arcs_data_ptrs.Data();
+    float **arc_posts_ptrs_data = nullptr;
+    if (arc_posts != nullptr) {
+      arc_posts_ptrs = arc_posts_ptrs.To(c_);
+      arc_posts_ptrs_data = arc_posts_ptrs.Data();
+    }
     int32_t **arcs_row_splits1_ptrs_data = arcs_row_splits1_ptrs.Data(),
             **arcs_row_splits2_ptrs_data = arcs_row_splits2_ptrs.Data();
 
-    int32_t tot_arcs_pruned = oshape_pruned_.TotSize(3);
-    *arc_map_a = Array1<int32_t>(c_, tot_arcs_pruned);
-    *arc_map_b = Array1<int32_t>(c_, tot_arcs_pruned);
-    int32_t *arc_map_a_data = arc_map_a->Data(),
-            *arc_map_b_data = arc_map_b->Data();
-    Array1<Arc> arcs_out(c_, tot_arcs_pruned);
+    // The output shape gets rid of axis 1 of oshape_unpruned_ (which is the
+    // 't' index), so the states of each FSA are numbered in order of frame.
+    Array1<int32_t> row_splits1(c_, num_fsas + 1),
+        row_splits2(c_, num_states + 1), row_ids2(c_, num_arcs);
+    int32_t *row_splits1_data = row_splits1.Data(),
+            *row_splits2_data = row_splits2.Data(),
+            *row_ids2_data = row_ids2.Data();
+    auto lambda_set_row_splits1 =
+        [=] __host__ __device__(int32_t fsa_idx0) -> void {
+      row_splits1_data[fsa_idx0] =
+          state_map012[oshapeu_row_splits2[oshapeu_row_splits1[fsa_idx0]]];
+    };
+    Eval(c_, num_fsas + 1, lambda_set_row_splits1);
+
+    // Note: the source state of any arc that was kept was also kept, so the
+    // kept arcs of each kept state are contiguous.
+    auto lambda_set_row_splits2 =
+        [=] __host__ __device__(int32_t unpruned_idx012) -> void {
+      if (unpruned_idx012 == num_states_unpruned) {
+        row_splits2_data[num_states] = num_arcs;
+      } else if (state_map012[unpruned_idx012 + 1] >
+                 state_map012[unpruned_idx012]) {
+        row_splits2_data[state_map012[unpruned_idx012]] =
+            arc_map0123[oshapeu_row_splits3[unpruned_idx012]];
+      }
+    };
+    Eval(c_, num_states_unpruned + 1, lambda_set_row_splits2);
+
+    Array1<int32_t> arc_map_a_out(c_, num_arcs), arc_map_b_out(c_, num_arcs);
+    int32_t *arc_map_a_data = arc_map_a_out.Data(),
+            *arc_map_b_data = arc_map_b_out.Data();
+    Array1<float> arc_posts_out;
+    float *arc_posts_out_data = nullptr;
+    if (arc_posts != nullptr) {
+      arc_posts_out = Array1<float>(c_, num_arcs);
+      arc_posts_out_data = arc_posts_out.Data();
+    }
+    Array1<Arc> arcs_out(c_, num_arcs);
     Arc *arcs_out_data = arcs_out.Data();
-    const Arc *a_fsas_arcs = a_fsas_.values.Data();
-    int32_t b_fsas_num_cols = b_fsas_.scores.Dim1();
-    const int32_t *b_fsas_row_ids1 = b_fsas_.shape.RowIds(1).Data();
+    const int32_t *a_fsas_symbols = a_fsas_soa_.symbols.Data();
+    int32_t b_fsas_num_cols = b_fsas_.NumCols();
+    const int32_t *b_fsas_row_splits1 = b_fsas_.shape.RowSplits(1).Data();
 
     auto lambda_format_arc_data =
-        [=] __host__ __device__(int32_t pruned_idx0123) -> void {
-      int32_t unpruned_idx0123 = reverse_state_map012[pruned_idx0123];
+        [=] __host__ __device__(int32_t pruned_idx012) -> void {
+      int32_t unpruned_idx0123 = reverse_arc_map0123[pruned_idx012];
       int32_t unpruned_idx012 = oshapeu_row_ids3[unpruned_idx0123],
               unpruned_idx01 = oshapeu_row_ids2[unpruned_idx012],
               unpruned_idx01x = oshapeu_row_splits2[unpruned_idx01],
               unpruned_idx01xx = oshapeu_row_splits3[unpruned_idx01x],
               unpruned_idxxx23 = unpruned_idx0123 - unpruned_idx01xx,
               unpruned_idx0 = oshapeu_row_ids1[unpruned_idx01],  // fsa-id
-          // unpruned_idx0x = oshapeu_row_splits1[unpruned_idx0],
-          // unpruned_idx0xx = oshapeu_row_splits2[unpruned_idx0x],
-          unpruned_idx1 = unpruned_idx01 - unpruned_idx01,  // t
-          unpruned_idx01_next_t = unpruned_idx01 + 1,
+              unpruned_idx0x = oshapeu_row_splits1[unpruned_idx0],
+              unpruned_idx1 = unpruned_idx01 - unpruned_idx0x,  // t
+              unpruned_idx01_next_t = unpruned_idx01 + 1,
               unpruned_idx01x_next_t =
                   oshapeu_row_splits2[unpruned_idx01_next_t];
 
@@ -290,72 +1601,50 @@ class MultiGraphDenseIntersect {
       int32_t unpruned_dest_state_idx2 = arc_info.u.dest_info_state_idx1,
               unpruned_dest_state_idx012 =
                   unpruned_idx01x_next_t + unpruned_dest_state_idx2,
-              pruned_dest_state_idx012 =
-                  reverse_state_map012[unpruned_dest_state_idx012],
               pruned_dest_state_idx01 =
-                  oshapep_row_ids2[pruned_dest_state_idx012],
-              pruned_dest_state_idx0 =
-                  oshapep_row_ids1[pruned_dest_state_idx01],
-              pruned_dest_state_idx0x =
-                  oshapep_row_splits1[pruned_dest_state_idx0],
-              pruned_dest_state_idx0xx =
-                  oshapep_row_splits2[pruned_dest_state_idx0x],
-              pruned_dest_state_idxx12 =
-                  pruned_dest_state_idx012 - pruned_dest_state_idx0xx;
-
-      // note: the src-state and dest-state have the same ind0 which is the
-      // FSA-id.
-      int32_t pruned_src_state_idx012 = reverse_state_map012[unpruned_idx012],
-              pruned_src_state_idxx12 =
-                  pruned_src_state_idx012 - pruned_dest_state_idx0xx;
+                  state_map012[unpruned_dest_state_idx012],
+              pruned_src_state_idx01 = state_map012[unpruned_idx012],
+              pruned_idx0x = row_splits1_data[unpruned_idx0];
 
       Arc arc;
-      // The numbering for the dest-state in the output Arc is the numbering
+      // The numbering for the states in the output Arc is the numbering
       // *within the FSA*, and we ignore the time index (1) because that index
-      // will be removed as the FSA format has no notion of time; that's why we
-      // use the indx12.
-
-      arc_map_a_data[pruned_idx0123] = arc_info.a_fsas_arc_idx012;
-
-      arc.src_state = pruned_src_state_idxx12;
-      arc.dest_state = pruned_dest_state_idxx12;
-      arc.symbol = a_fsas_arcs[arc_info.a_fsas_arc_idx012].symbol;
-      int32_t fsa_id = unpruned_idx0, b_fsas_idx0x = b_fsas_row_ids1[fsa_id],
-              b_fsas_idx01 = b_fsas_idx0x + t, b_fsas_idxxx2 = (arc.symbol + 1),
-              b_fsas_arc_idx012 =
-                  b_fsas_idx01 * b_fsas_num_cols + b_fsas_idxxx2;
+      // is removed as the FSA format has no notion of time.
+      arc.src_state = pruned_src_state_idx01 - pruned_idx0x;
+      arc.dest_state = pruned_dest_state_idx01 - pruned_idx0x;
+      arc.symbol = a_fsas_symbols[arc_info.a_fsas_arc_idx012];
       arc.score = arc_info.arc_loglike;
-
-      arc_map_b_data[pruned_idx0123] = b_fsas_arc_idx012;
-      arcs_out_data[pruned_idx0123] = arc;
+      int32_t b_fsas_idx01 = b_fsas_row_splits1[unpruned_idx0] + t,
+              b_fsas_idxx2 = arc.symbol + 1;
+
+      arc_map_a_data[pruned_idx012] = arc_info.a_fsas_arc_idx012;
+      arc_map_b_data[pruned_idx012] =
+          b_fsas_idx01 * b_fsas_num_cols + b_fsas_idxx2;
+      row_ids2_data[pruned_idx012] = pruned_src_state_idx01;
+      arcs_out_data[pruned_idx012] = arc;
+      if (arc_posts_ptrs_data != nullptr)
+        arc_posts_out_data[pruned_idx012] =
+            arc_posts_ptrs_data[t][arcs_idx012];
     };
-    Eval(c_, tot_arcs_pruned, lambda_format_arc_data);
-
-    // The output shape will get rid of axis one of oshape_pruned_ (which is the
-    // 't' index).
-    Array1<int32_t> arcs_row_splits1_out = oshape_pruned_.RowSplits(
-                        2)[oshape_pruned_.RowSplits(1)],
-                    arcs_row_ids1_out =
-                        oshape_pruned_.RowIds(1)[oshape_pruned_.RowIds(2)];
-
-    auto lambda_set_row_splits1_out =
-        [=] __host__ __device__(int32_t i) -> void {
-      // TODO
-      K2_LOG(FATAL) << "Not Implemented";
-    };
-    Eval(c_, oshape_pruned_.RowSplits(1).Dim(), lambda_set_row_splits1_out);
-
-    RaggedShape output_fsas_shape = RaggedShape3(
-        &arcs_row_splits1_out, &arcs_row_ids1_out, -1,
-        &oshape_pruned_.RowSplits(3), &oshape_pruned_.RowIds(3), -1);
+    Eval(c_, num_arcs, lambda_format_arc_data);
 
+    RaggedShape output_fsas_shape =
+        RaggedShape3(&row_splits1, nullptr, num_states, &row_splits2,
+                     &row_ids2, num_arcs);
     *ofsa = FsaVec(output_fsas_shape, arcs_out);
+    // Each arc goes to a state of the next frame.
+    SetFsaVecKnownProperties(
+        *ofsa, kFsaPropertiesTopSorted | kFsaPropertiesTopSortedAndAcyclic);
+    if (arc_map_a != nullptr) *arc_map_a = arc_map_a_out;
+    if (arc_map_b != nullptr) *arc_map_b = arc_map_b_out;
+    if (arc_posts != nullptr) *arc_posts = arc_posts_out;
   }
 
   /*
     Computes pruning cutoffs for this frame: these are the cutoffs for the arc
-    "forward score", one per FSA.  This is a dynamic process involving
-    dynamic_beams_ which are updated on each frame (they start off at beam_).
+    "forward score", one per FSA.  The beam of each FSA is `beam_` unless the
+    max_active or min_active constraint applies, in which case it is chosen
+    from a histogram of the scores so that about that many arcs survive.
 
        @param [in] arc_end_scores  The "forward log-probs" (scores) at the
                     end of each arc, i.e. its contribution to the following
@@ -367,67 +1656,80 @@ class MultiGraphDenseIntersect {
        @return      Returns a vector of log-likelihood cutoffs, one per FSA (the
                     cutoff will be -infinity for FSAs that don't have any active
                     states).  The cutoffs will be of the form: the best score
-                    for any arc, minus the dynamic beam.  See the code for how
-                    the dynamic beam is adjusted; it will approach 'beam_'
-                    as long as the number of active states in each FSA is
-                    between min_active and max_active.
+                    for any arc, minus the beam for that FSA, which is also
+                    written to dynamic_beams_.
+
+    The histogram has kNumHistogramBins bins per FSA covering scores from the
+    best score down to 2 * beam_ below it, filled with atomic adds in one pass
+    over the arcs; the beam is then found by a thread per FSA that walks its
+    bins, so nothing is sorted.  The numbers of arcs are used in place of the
+    numbers of the states they lead to (which are not known until the
+    arcs have been pruned); since several arcs may enter the same state, this
+    errs on the side of pruning more when max_active applies.
   */
   Array1<float> GetPruningCutoffs(Ragged<float> &arc_end_scores) {
     int32_t num_fsas = arc_end_scores.shape.Dim0();
 
     // get the maximum score from each sub-list (i.e. each FSA, on this frame).
-    // Note: can probably do this with a cub Reduce operation using an operator
-    // that has side effects (that notices when it's operating across a
-    // boundary).
     // the max will be -infinity for any FSA-id that doesn't have any active
     // states (e.g. because that stream has finished).
-    // Casting to ragged2 just considers the top 2 indexes, ignoring the 3rd.
-    // i.e. it's indexed by [fsa_id][state].
     Ragged<float> end_scores_per_fsa = arc_end_scores.RemoveAxis(1);
-    Array1<float> max_per_fsa;
+    Array1<float> max_per_fsa(c_, num_fsas);
     MaxPerSublist(end_scores_per_fsa, -std::numeric_limits<float>::infinity(),
                   &max_per_fsa);
-    const int32_t *per_fsa_row_splits1_data =
-        end_scores_per_fsa.shape.RowSplits(1).Data();
-
     const float *max_per_fsa_data = max_per_fsa.Data();
-    float *dynamic_beams_data = dynamic_beams_.Data();
 
-    float default_beam = beam_, max_active = max_active_,
-          min_active = min_active_;
+    const int32_t num_bins = kNumHistogramBins;
+    float default_beam = beam_, histogram_range = 2.0f * beam_,
+          bin_width = histogram_range / num_bins;
+
+    const int32_t *end_scores_row_ids1 =
+        end_scores_per_fsa.shape.RowIds(1).Data();
+    const float *end_scores_data = end_scores_per_fsa.values.Data();
+    Array1<int32_t> histogram(c_, num_fsas * num_bins, 0);
+    int32_t *histogram_data = histogram.Data();
+    auto lambda_fill_histogram = [=] __host__ __device__(int32_t i) -> void {
+      int32_t fsa_idx0 = end_scores_row_ids1[i];
+      float diff = max_per_fsa_data[fsa_idx0] - end_scores_data[i];
+      // The comparison is false for NaN; -infinity scores (diff == infinity)
+      // are not counted.
+      if (diff < histogram_range) {
+        int32_t bin = static_cast<int32_t>(diff / bin_width);
+        if (bin >= num_bins) bin = num_bins - 1;  // in case of roundoff
+        atomicAdd(histogram_data + fsa_idx0 * num_bins + bin, 1);
+      }
+    };
+    Eval(c_, end_scores_per_fsa.values.Dim(), lambda_fill_histogram);
+
+    float *dynamic_beams_data = dynamic_beams_.Data();
+    int32_t max_active = max_active_, min_active = min_active_,
+            default_beam_bins = num_bins / 2;
 
     Array1<float> cutoffs(c_, num_fsas);
     float *cutoffs_data = cutoffs.Data();
 
     auto lambda_set_beam_and_cutoffs =
         [=] __host__ __device__(int32_t i) -> void {
-      float best_loglike = max_per_fsa_data[i],
-            dynamic_beam = dynamic_beams_data[i];
-      int32_t num_active =
-          per_fsa_row_splits1_data[i + 1] - per_fsa_row_splits1_data[i];
-      float new_dynamic_beam;
-      if (num_active <= max_active) {
-        // Not constrained by max_active...
-        if (num_active > min_active) {
-          // Neither the max_active nor min_active constraints
-          // apply.  Gradually approach 'beam'
-          new_dynamic_beam = 0.8 * dynamic_beam + 0.2 * default_beam;
-        } else {
-          // We violated the min_active constraint -> increase beam
-          if (new_dynamic_beam < default_beam) new_dynamic_beam = default_beam;
-          // gradually make the beam larger as long
-          // as we are below min_active
-          new_dynamic_beam *= 1.25;
-        }
-      } else {
-        // We violated the max_active constraint -> decrease beam
-        if (new_dynamic_beam > default_beam) new_dynamic_beam = default_beam;
-        // Decrease the beam as long as we have more than
-        // max_active active states.
-        new_dynamic_beam *= 0.85;
+      const int32_t *this_histogram = histogram_data + i * num_bins;
+      // count is the number of arcs in bins [0, b), i.e. within b * bin_width
+      // of the best score.
+      int32_t b = 0, count = 0;
+      for (; b < default_beam_bins; ++b) {
+        if (count + this_histogram[b] > max_active) break;
+        count += this_histogram[b];
+      }
+      // Keep at least the first bin, even if it has more than max_active arcs.
+      int32_t beam_bins = (b == 0 ? 1 : b);
+      if (b == default_beam_bins) {
+        // Not constrained by max_active; widen the beam while we have fewer
+        // than min_active arcs.
+        for (; beam_bins < num_bins && count < min_active; ++beam_bins)
+          count += this_histogram[beam_bins];
       }
-      dynamic_beams_data[i] = new_dynamic_beam;
-      cutoffs_data[i] = best_loglike - new_dynamic_beam;
+      float beam = (beam_bins == default_beam_bins ? default_beam
+                                                   : beam_bins * bin_width);
+      dynamic_beams_data[i] = beam;
+      cutoffs_data[i] = max_per_fsa_data[i] - beam;
     };
     Eval(c_, num_fsas, lambda_set_beam_and_cutoffs);
     return cutoffs;
@@ -441,40 +1743,27 @@ class MultiGraphDenseIntersect {
        @param [in] t       The time-index (on which to look up log-likes),
                            t >= 0
        @param [in] cur_frame   The FrameInfo for the current frame; only its
-                       'states' member is expected to be set up on entry.
+                       'states', 'unpruned_arc_row_splits' and
+                       'num_unpruned_arcs' members are expected to be set up
+                       on entry.
    */
   Ragged<ArcInfo> GetUnprunedArcs(int32_t t, FrameInfo *cur_frame) {
+    // the row of b_fsas_ for this frame, within each sequence.
+    int32_t t_local = t - t_offset_;
     Ragged<StateInfo> &states = cur_frame->states;
     const StateInfo *state_values = states.values.Data();
-
-    // in a_fsas_ (the decoding graphs), maps from state_idx01 to arc_idx01x.
-    const int32_t *fsa_arc_splits = a_fsas_.shape.RowSplits(2).Data();
-
-    // int32_t a_fsas_stride = a_fsas_stride_;
-
-    // frame_state_idx01 combines the FSA-index and state-index (into
-    // 'cur_frame->states')
-    Array1<int32_t> num_arcs(c_, states.values.Dim());
-    int32_t *num_arcs_data = num_arcs.Data();
-    auto num_arcs_lambda =
-        [=] __host__ __device__(int32_t state_idx01) -> void {
-      int32_t a_fsas_state_idx01 = state_values[state_idx01].a_fsas_state_idx01,
-              a_fsas_arc_idx01x = fsa_arc_splits[a_fsas_state_idx01],
-              a_fsas_arc_idx01x_next = fsa_arc_splits[a_fsas_state_idx01 + 1],
-              a_fsas_num_arcs_x1x = a_fsas_arc_idx01x - a_fsas_arc_idx01x_next;
-      num_arcs_data[state_idx01] = a_fsas_num_arcs_x1x;
-    };
-    // `num_arcs` gives the num-arcs for each state in `states`.
-    Eval(c_, num_arcs.Dim(), num_arcs_lambda);
+    int32_t num_states = states.values.Dim(),
+            num_arcs = cur_frame->num_unpruned_arcs;
 
     // initialize shape of array that will hold arcs leaving the active states.
     // Its shape is [fsa_index][state][arc]; the top two levels are shared with
     // `states`.  'ai' means ArcInfo.
-    // TODO(haowen): implement RaggedShapeFromSizes?
-    // RaggedShape ai_shape = RaggedShapeFromSizes(states.shape, num_arcs);
-    RaggedShape ai_shape;
-
-    // 'ai' means ArcInfo
+    Array1<int32_t> &ai_row_splits2_array = cur_frame->unpruned_arc_row_splits;
+    Array1<int32_t> ai_row_ids2_array(c_, num_arcs);
+    RowSplitsToRowIds(ai_row_splits2_array, ai_row_ids2_array);
+    RaggedShape ai_shape = RaggedShape3(
+        &states.shape.RowSplits(1), &states.shape.RowIds(1), num_states,
+        &ai_row_splits2_array, &ai_row_ids2_array, num_arcs);
 
     // from state_idx01 (into `states` or `ai_shape`) -> fsa_idx0
     const int32_t *ai_row_ids1 = ai_shape.RowIds(1).Data();
@@ -484,13 +1773,29 @@ class MultiGraphDenseIntersect {
     const int32_t *ai_row_splits2 = ai_shape.RowSplits(2).Data();
     // from state_idx01 (into a_fsas_) to arc_idx01x (into a_fsas_)
     const int32_t *a_fsas_row_splits2 = a_fsas_.shape.RowSplits(2).Data();
-
-    const Arc *arcs = a_fsas_.values.Data();
+    // from fsa_idx0 (into a_fsas_) to state_idx0x (into a_fsas_)
+    const int32_t *a_fsas_row_splits1 = a_fsas_.shape.RowSplits(1).Data();
+    int32_t a_fsas_stride = a_fsas_stride_;
+
+    // From the arcs we only need the dest_state, symbol and score.
+    const int32_t *a_fsas_dest_states = a_fsas_soa_.dest_states.Data(),
+                  *a_fsas_symbols = a_fsas_soa_.symbols.Data();
+    const float *a_fsas_scores = a_fsas_soa_.scores.Data();
     // fsa_idx0 to ind0x (into b_fsas_), which gives the 1st row for this
     // sequence.
-    const int32_t *b_fsas_row_ids1 = b_fsas_.shape.RowIds(1).Data();
-    const float *score_data = b_fsas_.scores.Data();
-    int32_t scores_num_cols = b_fsas_.scores.Dim1();
+    const int32_t *b_fsas_row_splits1 = b_fsas_.shape.RowSplits(1).Data();
+    DenseScoresAccessor scores = GetDenseScoresAccessor(b_fsas_);
+    int32_t scores_num_cols = b_fsas_.NumCols();
+    // If blank_arcs_data is not nullptr, on the rows of b_fsas_ for which
+    // skip_rows_data is set only the blank arcs are expanded (see
+    // SetBlankSkip()).
+    const char *skip_rows_data = nullptr;
+    const int32_t *blank_arcs_row_splits = nullptr, *blank_arcs_data = nullptr;
+    if (skip_rows_.Dim() != 0) {
+      skip_rows_data = skip_rows_.Data();
+      blank_arcs_row_splits = blank_arcs_.shape.RowSplits(1).Data();
+      blank_arcs_data = blank_arcs_.values.Data();
+    }
 
     Ragged<ArcInfo> ai(ai_shape);
     ArcInfo *ai_data = ai.values.Data();  // uninitialized
@@ -501,28 +1806,35 @@ class MultiGraphDenseIntersect {
               ai_arc_idx01x = ai_row_splits2[ai_state_idx01],
               ai_arc_idxxx2 = ai_arc_idx012 - ai_arc_idx01x;
       StateInfo sinfo = state_values[ai_state_idx01];
-      int32_t a_fsas_arc_idx01x = a_fsas_row_splits2[sinfo.a_fsas_state_idx01],
-              a_fsas_arc_idx012 = a_fsas_arc_idx01x + ai_arc_idxxx2;
-      Arc arc = arcs[a_fsas_arc_idx012];
-
-      int32_t scores_idx0x = b_fsas_row_ids1[ai_fsa_idx0],
-              scores_idx01 = scores_idx0x + t,  // t == ind1 into 'scores'
-          scores_idx2 = arc.symbol + 1,  // the +1 is so that -1 can be handled
-          scores_idx012 = (scores_idx01 * scores_num_cols) + scores_idx2;
+      int32_t scores_idx0x = b_fsas_row_splits1[ai_fsa_idx0],
+              scores_idx01 = scores_idx0x + t_local;  // == ind1 into 'scores'
+      int32_t a_fsas_arc_idx012;
+      if (blank_arcs_data != nullptr && skip_rows_data[scores_idx01]) {
+        a_fsas_arc_idx012 =
+            blank_arcs_data[blank_arcs_row_splits[sinfo.a_fsas_state_idx01] +
+                            ai_arc_idxxx2];
+      } else {
+        a_fsas_arc_idx012 =
+            a_fsas_row_splits2[sinfo.a_fsas_state_idx01] + ai_arc_idxxx2;
+      }
+      int32_t arc_symbol = a_fsas_symbols[a_fsas_arc_idx012];
+
+      // the +1 is so that -1 can be handled
+      int32_t scores_idx2 = arc_symbol + 1;
       assert(static_cast<uint32_t>(scores_idx2) <
              static_cast<uint32_t>(scores_num_cols));
-      float acoustic_score = score_data[scores_idx012];
+      float acoustic_score = scores.Get(scores_idx01, scores_idx2);
       ArcInfo ai;
       ai.a_fsas_arc_idx012 = a_fsas_arc_idx012;
-      ai.arc_loglike = acoustic_score + arc.score;
-      ai.end_loglike = sinfo.forward_loglike + ai.arc_loglike;
-      // at least currently, the ArcInfo object's src_state and dest_state are
-      // ind1's not idx01's, i.e. they don't contain the FSA-index, where as
-      // the ai element is an idx01, so we need to do this to conver to an
-      // idx01; this relies on the fact that sinfo.abs_state_id == arc.src_state
-      // + a_fsas_fsa_idx0x.
+      ai.arc_loglike = acoustic_score + a_fsas_scores[a_fsas_arc_idx012];
+      ai.end_loglike =
+          OrderedIntToFloat(sinfo.forward_loglike) + ai.arc_loglike;
+      // at least currently, the Arc's dest_state is an idx1 not an idx01,
+      // i.e. it doesn't contain the FSA-index, whereas the ai element is an
+      // idx01, so we need to add the idx0x of the FSA in a_fsas_.
+      int32_t a_fsas_idx0x = a_fsas_row_splits1[ai_fsa_idx0 * a_fsas_stride];
       ai.u.dest_a_fsas_state_idx01 =
-          sinfo.a_fsas_state_idx01 + arc.dest_state - arc.src_state;
+          a_fsas_idx0x + a_fsas_dest_states[a_fsas_arc_idx012];
       ai_data[ai_arc_idx012] = ai;
     };
     Eval(c_, ai.values.Dim(), ai_lambda);
@@ -530,172 +1842,220 @@ class MultiGraphDenseIntersect {
   }
 
   /*
-    Does the forward-propagation (basically: the decoding step) and
-    returns a newly allocated FrameInfo* object for the next frame.
+    Used by PropagateForward() when there are no states on `cur_frame` (all
+    the sequences have ended, or all their paths were pruned away): sets
+    `cur_frame->arcs` to empty and returns an empty next frame, without
+    launching any kernels to speak of.
    */
-  FrameInfo *PropagateForward(int32_t t, FrameInfo *cur_frame) {
-    // Ragged<StateInfo> &states = cur_frame->states;
+  std::unique_ptr<FrameInfo> EmptyNextFrame(FrameInfo *cur_frame) {
+    Ragged<StateInfo> &states = cur_frame->states;
+    Array1<int32_t> arcs_row_splits2(c_, 1, 0), arcs_row_ids2(c_, 0);
+    RaggedShape arcs_shape =
+        RaggedShape3(&states.shape.RowSplits(1), &states.shape.RowIds(1), 0,
+                     &arcs_row_splits2, &arcs_row_ids2, 0);
+    cur_frame->arcs = Ragged<ArcInfo>(arcs_shape, Array1<ArcInfo>(c_, 0));
+    cur_frame->unpruned_arc_row_splits = Array1<int32_t>();
+
+    std::unique_ptr<FrameInfo> ans = std::make_unique<FrameInfo>();
+    Array1<int32_t> row_splits1(c_, 1, 0);
+    ans->states = Ragged<StateInfo>(RaggedShape2(&row_splits1, nullptr, 0),
+                                    Array1<StateInfo>(c_, 0));
+    ans->unpruned_arc_row_splits = Array1<int32_t>(c_, 1, 0);
+    ans->num_unpruned_arcs = 0;
+    return ans;
+  }
+
+  /*
+    Does the forward-propagation (basically: the decoding step) of frame `t`:
+    sets `cur_frame->arcs` to the arcs that survive the pruning, and returns a
+    newly allocated FrameInfo object for the next frame, with its `states`
+    and unpruned arc row-splits set.
+
+    The sizes of the outputs are not known on the host until the end, so they
+    are allocated for the largest possible sizes (the number of unpruned arcs)
+    and the sizes are read back once, in a single transfer, at the end; that
+    is the only time this waits for the device.
+   */
+  std::unique_ptr<FrameInfo> PropagateForward(int32_t t, FrameInfo *cur_frame) {
+    K2_PROFILE_SCOPE("IntersectDensePruned:PropagateForward", c_);
+    // the row of b_fsas_ for this frame, within each sequence.
+    int32_t t_local = t - t_offset_;
+    if (cur_frame->states.values.Dim() == 0) return EmptyNextFrame(cur_frame);
     // ai has 3 axes: fsa_id, state, arc.
     Ragged<ArcInfo> arc_info = GetUnprunedArcs(t, cur_frame);
+    int32_t num_fsas = arc_info.shape.Dim0(),
+            num_states = cur_frame->states.values.Dim(),
+            num_arcs = arc_info.values.Dim();
+    // The sequences that are active on the next frame; the arcs on this frame
+    // all belong to them, as arcs only leave the states of sequences that
+    // have a row for this frame.
+    int32_t num_next_fsas = std::min(num_fsas, NumSeqsWithRows(t_local + 1));
     const ArcInfo *ai_data = arc_info.values.Data();
-    Array1<float> ai_data_array1(c_, arc_info.values.Dim());
+    Array1<float> ai_data_array1(c_, num_arcs);
     float *ai_data_array1_data = ai_data_array1.Data();
     auto lambda_set_ai_data = [=] __host__ __device__(int32_t i) -> void {
       ai_data_array1_data[i] = ai_data[i].end_loglike;
     };
-    Eval(c_, ai_data_array1.Dim(), lambda_set_ai_data);
+    Eval(c_, num_arcs, lambda_set_ai_data);
     Ragged<float> ai_loglikes(arc_info.shape, ai_data_array1);
 
     // `cutoffs` is of dimension num_fsas.
     Array1<float> cutoffs = GetPruningCutoffs(ai_loglikes);
-    int32_t num_fsas = cutoffs.Dim();
-
-    float *cutoffs_data = cutoffs.Data();
+    const float *cutoffs_data = cutoffs.Data();
 
-    // write certain indexes ( into ai.values) to state_map_.Data().  Keeps
+    // write certain indexes ( into ai.values) to the state map.  Keeps
     // track of the active states and will allow us to assign a numbering to
     // them.
-    int32_t *ai_row_ids1 = arc_info.shape.RowIds(1).Data(),
-            *ai_row_ids2 = arc_info.shape.RowIds(2).Data(),
-            *state_map_data = state_map_.Data();
+    const int32_t *ai_row_ids1 = arc_info.shape.RowIds(1).Data(),
+                  *ai_row_ids2 = arc_info.shape.RowIds(2).Data(),
+                  *ai_row_splits1 = arc_info.shape.RowSplits(1).Data(),
+                  *ai_row_splits2 = arc_info.shape.RowSplits(2).Data();
     // We use a separate state_map vector per FSA we're processing if a_fsas_
     // only has one FSA (in this case it means we're sharing the FSA among
     // potentially multiple streams).
-    int32_t state_map_stride =
-        (a_fsas_.shape.Dim0() > 1 ? 0 : state_map_.ElemStride0());
+    uint64_t state_map_stride =
+        (a_fsas_stride_ == 0 ? a_fsas_.shape.TotSize(1) : 0);
+    // The hash, if used, only needs to hold the states reached on this frame,
+    // of which there are at most num_arcs.
+    std::unique_ptr<Hash> state_hash;
+    StateMapAccessor state_map;
+    if (use_hash_state_map_) {
+      state_hash = std::make_unique<Hash>(c_, Hash::NumBucketsFor(num_arcs));
+      state_map.dense_data = nullptr;
+      state_map.hash = state_hash->GetAccessor();
+    } else {
+      state_map.dense_data = state_map_.Data();
+    }
     auto lambda_set_state_map =
         [=] __host__ __device__(int32_t arc_idx012) -> void {
       int32_t fsa_id = ai_row_ids1[ai_row_ids2[arc_idx012]];
-      int32_t dest_state_idx012 = ai_data[arc_idx012].a_fsas_arc_idx012;
+      int32_t dest_state_idx01 = ai_data[arc_idx012].u.dest_a_fsas_state_idx01;
       float end_loglike = ai_data[arc_idx012].end_loglike,
             cutoff = cutoffs_data[fsa_id];
       if (end_loglike > cutoff) {
         // The following is a race condition as multiple threads may write to
         // the same location, but it doesn't matter, the point is to assign
         // one of the indexes.
-        state_map_data[fsa_id * state_map_stride + dest_state_idx012] =
+        *state_map.Insert(fsa_id * state_map_stride + dest_state_idx01) =
             arc_idx012;
       }
     };
-    Eval(c_, arc_info.values.Dim(), lambda_set_state_map);
-
-    // renumber_arcs will be a renumbering that dictates which of the arcs
-    // in 'ai' we keep
-    Renumbering renumber_arcs(arc_info.values.Dim());
-
-    // renumber_states will be a renumbering that dictates which of the arcs in
-    // 'ai' correspond to unique states.  Only one arc for each dest-state is
-    // kept (it doesn't matter which one).
-    Renumbering renumber_states(arc_info.values.Dim());
+    Eval(c_, num_arcs, lambda_set_state_map);
 
+    // keep_arcs says which of the arcs in 'ai' we keep, and keep_states which
+    // of them correspond to unique states (only one arc for each dest-state
+    // is kept for that, it doesn't matter which one); the exclusive sums of
+    // these are the renumberings.  They have one extra element because the
+    // exclusive sums read it.
+    //
     // Note: we don't just keep arcs that were above the pruning threshold, we
     // keep all arcs whose destination-states survived pruning.  Later we'll
     // prune with the lattice beam, using both forward and backward scores.
-    char *keep_this_arc_data = renumber_arcs.Keep().Data(),
-         *keep_this_state_data = renumber_states.Keep().Data();
-    if (state_map_stride == 0) {
-      auto lambda_set_keep = [=] __host__ __device__(int32_t i) -> void {
-        int32_t dest_state = ai_data[i].u.dest_a_fsas_state_idx01;
-        int32_t j = state_map_data[dest_state];
-        if (j != -1) {  // the dest-state was kept..
-          keep_this_arc_data[i] = 1;
-          // caution: keep_this_state_data is indexed by *arc*
-          if (j == i)  // this arc 'won' the data race..
-            keep_this_state_data[i] = 1;
-        }
-      };
-      Eval(c_, arc_info.values.Dim(), lambda_set_keep);
-    } else {
-      auto lambda_set_keep =
-          [=] __host__ __device__(int32_t arc_idx012) -> void {
-        int32_t fsa_id = ai_row_ids1[ai_row_ids2[arc_idx012]],
-                dest_state = ai_data[arc_idx012].u.dest_a_fsas_state_idx01;
-        int j = state_map_data[dest_state + fsa_id * state_map_stride];
-        if (j != -1) {  // the dest-state was kept..
-          keep_this_arc_data[arc_idx012] = 1;
-          // caution: keep_this_state_data is indexed by *arc*
-          if (j == arc_idx012)  // this arc 'won' the data race..
-            keep_this_state_data[arc_idx012] = 1;
-        }
-      };
-      Eval(c_, arc_info.values.Dim(), lambda_set_keep);
-    }
-
-    int32_t num_arcs = renumber_arcs.NumNewElems(),
-            num_states = renumber_states.NumNewElems();
-
-    int32_t *arc_reorder_data = renumber_arcs.Old2New().Data(),
-            *state_reorder_data = renumber_states.Old2New().Data();
-
-    // state_to_fsa_id maps from an index into the next frame's
-    // FrameInfo::states.values() vector (i.e. a frame-state-index on the *next*
-    // frame) to the FSA-id associated with it.  It should be non-decreasing.
-    Array1<int32_t> state_to_fsa_id(c_, num_states);
-    {  // This block sets 'state_to_fsa_id'.
-      int32_t *state_to_fsa_id_data = state_to_fsa_id.Data();
-      auto lambda_state_to_fsa_id =
-          [=] __host__ __device__(int32_t arc_idx012) -> void {
-        int32_t fsa_id = ai_row_ids1[ai_row_ids2[arc_idx012]],
-                this_state_j = state_reorder_data[arc_idx012 + 1],
-                next_state_j = state_reorder_data[arc_idx012 + 1];
-        if (next_state_j > this_state_j) {
-          state_to_fsa_id_data[this_state_j] = fsa_id;
-        }
-      };
-      Eval(c_, arc_info.values.Dim(), lambda_state_to_fsa_id);
+    Array1<char> keep_arcs(c_, num_arcs + 1), keep_states(c_, num_arcs + 1);
+    char *keep_arcs_data = keep_arcs.Data(),
+         *keep_states_data = keep_states.Data();
+    auto lambda_set_keep = [=] __host__ __device__(int32_t arc_idx012) -> void {
+      int32_t fsa_id = ai_row_ids1[ai_row_ids2[arc_idx012]],
+              dest_state = ai_data[arc_idx012].u.dest_a_fsas_state_idx01;
+      int32_t j = state_map.Get(fsa_id * state_map_stride + dest_state);
+      // the dest-state was kept if j != -1; and this arc 'won' the data race
+      // if j == arc_idx012.  Caution: keep_states_data is indexed by *arc*
+      keep_arcs_data[arc_idx012] = (j != -1);
+      keep_states_data[arc_idx012] = (j == arc_idx012);
+    };
+    Eval(c_, num_arcs, lambda_set_keep);
+
+    Array1<int32_t> arc_reorder(c_, num_arcs + 1),
+        state_reorder(c_, num_arcs + 1);
+    int32_t *arc_reorder_data = arc_reorder.Data(),
+            *state_reorder_data = state_reorder.Data();
+    ExclusiveSum(c_, num_arcs + 1, keep_arcs_data, arc_reorder_data);
+    ExclusiveSum(c_, num_arcs + 1, keep_states_data, state_reorder_data);
+
+    std::unique_ptr<FrameInfo> ans = std::make_unique<FrameInfo>();
+    // The next frame's states, and its unpruned arc row-splits; as explained
+    // above, we allocate for the maximum size (num_arcs).
+    Array1<int32_t> next_row_splits1(c_, num_next_fsas + 1),
+        next_row_ids1(c_, num_arcs), next_arc_row_splits(c_, num_arcs + 1, 0);
+    Array1<StateInfo> next_states(c_, num_arcs);
+    int32_t *next_row_splits1_data = next_row_splits1.Data(),
+            *next_row_ids1_data = next_row_ids1.Data(),
+            *next_arc_row_splits_data = next_arc_row_splits.Data();
+    StateInfo *next_states_data = next_states.Data();
+
+    auto lambda_set_next_row_splits1 =
+        [=] __host__ __device__(int32_t fsa_idx0) -> void {
+      // ai_row_splits2[ai_row_splits1[fsa_idx0]] is the first arc of this FSA.
+      next_row_splits1_data[fsa_idx0] =
+          state_reorder_data[ai_row_splits2[ai_row_splits1[fsa_idx0]]];
+    };
+    Eval(c_, num_next_fsas + 1, lambda_set_next_row_splits1);
 
-      // TODO(haowen): implement it?
-      // assert(IsMonotonic(state_to_fsa_id));
+    // Modify the elements of `state_map` to refer to the indexes into
+    // the next frame's states, rather than the indexes into ai_data, and set
+    // up those states' info.
+    const int32_t *b_fsas_row_splits1 = b_fsas_.shape.RowSplits(1).Data(),
+                  *a_fsas_row_splits2 = a_fsas_.shape.RowSplits(2).Data();
+    const char *skip_rows_data = nullptr;
+    const int32_t *blank_arcs_row_splits = nullptr;
+    if (skip_rows_.Dim() != 0) {
+      skip_rows_data = skip_rows_.Data();
+      blank_arcs_row_splits = blank_arcs_.shape.RowSplits(1).Data();
     }
-    // The following creates a structure that contains a subset of the elements
-    // of `arc_info`, determined by the renumbering in `renumber_arcs`.
-    Array1<ArcInfo> curr_frame_arc_array1(c_, num_arcs);
-    RaggedShape curr_frame_arc_shape =
-        SubsampleRaggedShape(arc_info.shape, renumber_arcs);
-    cur_frame->arcs =
-        Ragged<ArcInfo>(curr_frame_arc_shape, curr_frame_arc_array1);
-
-    FrameInfo *ans = new FrameInfo();
-    // TODO(haowen): implement Ragged2FromRowIds?
-    // ans->states = Ragged2FromRowIds(num_fsas, state_to_fsa_id,
-    //                               Array1<ArcInfo>(c_, num_arcs));
-    StateInfo *ans_states_data = ans->states.values.Data();
     const int32_t minus_inf =
         FloatToOrderedInt(-std::numeric_limits<float>::infinity());
-    auto lambda_init_loglike = [=] __host__ __device__(int32_t i) -> void {
-      ans_states_data[i].forward_loglike = minus_inf;
-    };
-    Eval(c_, num_states, lambda_init_loglike);
-
-    // Modify the elements of `state_map` to refer to the indexes into
-    // `ans->states` / `kept_states_data`, rather than the indexes into ai_data.
-    // This will decrease some of the values in `state_map`, in general.
-    auto lambda_modify_state_map =
+    auto lambda_set_next_states =
         [=] __host__ __device__(int32_t arc_idx012) -> void {
-      int32_t fsa_id = ai_row_ids1[ai_row_ids2[arc_idx012]];
-      int32_t dest_state_idx = ai_data[arc_idx012].u.dest_a_fsas_state_idx01;
-      int32_t this_j = state_reorder_data[arc_idx012],
-              next_j = state_reorder_data[arc_idx012 + 1];
-      if (next_j > this_j) {
-        // this_j is the idx01 into ans->states
-        int32_t state_map_idx = dest_state_idx + fsa_id * state_map_stride;
-        K2_CHECK_EQ(state_map_data[state_map_idx], dest_state_idx);
-        state_map_data[state_map_idx] = this_j;
-        // Note: this_j is an idx01 into ans->states.
+      if (!keep_states_data[arc_idx012]) return;
+      int32_t fsa_id = ai_row_ids1[ai_row_ids2[arc_idx012]],
+              dest_state_idx01 = ai_data[arc_idx012].u.dest_a_fsas_state_idx01,
+              state_idx01 = state_reorder_data[arc_idx012];
+      // state_idx01 is the idx01 into the next frame's states.
+      *state_map.Insert(fsa_id * state_map_stride + dest_state_idx01) =
+          state_idx01;
+      StateInfo info;
+      info.a_fsas_state_idx01 = dest_state_idx01;
+      // the forward log-like is the max over the incoming arcs, see
+      // lambda_set_arcs_and_states.
+      info.forward_loglike = minus_inf;
+      info.backward_loglike = minus_inf;
+      next_states_data[state_idx01] = info;
+      next_row_ids1_data[state_idx01] = fsa_id;
+      // The arcs leaving this state on the next frame; there are none if
+      // this sequence has no more frames.  (When streaming, the last row of
+      // a chunk is not processed unless it is the final row, so this is
+      // right even if the sequence continues in the next chunk).
+      // On the rows where blank dominates, only the blank arcs are needed.
+      int32_t row_begin = b_fsas_row_splits1[fsa_id],
+              num_rows = b_fsas_row_splits1[fsa_id + 1] - row_begin;
+      if (t_local + 1 < num_rows) {
+        const int32_t *splits =
+            (skip_rows_data != nullptr &&
+                     skip_rows_data[row_begin + t_local + 1]
+                 ? blank_arcs_row_splits
+                 : a_fsas_row_splits2);
+        next_arc_row_splits_data[state_idx01] =
+            splits[dest_state_idx01 + 1] - splits[dest_state_idx01];
+      } else {
+        next_arc_row_splits_data[state_idx01] = 0;
       }
     };
-    Eval(c_, arc_info.values.Dim(), lambda_modify_state_map);
+    Eval(c_, num_arcs, lambda_set_next_states);
 
-    // We'll set up the data of the kept arcs and states below...
-    ArcInfo *kept_ai_data = cur_frame->arcs.values.Data();
-    StateInfo *kept_states_data = ans->states.values.Data();
+    // We'll set up the data of the kept arcs below...
+    Array1<ArcInfo> kept_arcs(c_, num_arcs);
+    Array1<int32_t> kept_row_splits2(c_, num_states + 1),
+        kept_row_ids2(c_, num_arcs);
+    ArcInfo *kept_ai_data = kept_arcs.Data();
+    int32_t *kept_row_splits2_data = kept_row_splits2.Data(),
+            *kept_row_ids2_data = kept_row_ids2.Data();
 
     auto lambda_set_arcs_and_states =
         [=] __host__ __device__(int32_t arc_idx012) -> void {
-      // arc_idx012 is the inde into the unpruned arcs, 'ai'
-      int32_t this_pruned_idx012 = arc_reorder_data[arc_idx012],
-              next_pruned_idx012 = arc_reorder_data[arc_idx012 + 1],
-              fsa_id = ai_row_ids1[ai_row_ids2[arc_idx012]];
+      // arc_idx012 is the index into the unpruned arcs, 'ai'
+      if (!keep_arcs_data[arc_idx012]) return;
+      int32_t fsa_id = ai_row_ids1[ai_row_ids2[arc_idx012]],
+              pruned_idx012 = arc_reorder_data[arc_idx012];
 
       // Note: I have a idea to reduce main-memory bandwidth by
       // caching writes in a fixed-size array in shared memory
@@ -703,45 +2063,113 @@ class MultiGraphDenseIntersect {
       // twice.
       // Would have to do this with a functor rather than a lambda,
       // as __shared__ won't work on CPU.
-      if (next_pruned_idx012 > this_pruned_idx012) {
-        // ... this was one of the arcs to keep.  Load the ArcInfo from the
-        // un-pruned array..
-        ArcInfo info = ai_data[arc_idx012];
-        int32_t state_map_idx =
-            info.u.dest_a_fsas_state_idx01 + fsa_id * state_map_stride;
-        // state_idx01 is the index into ans->states, of the destination state.
-        // Note: multiple arcs may enter this state, which is why we had to set
-        // that in a separate kernel (lambda_modify_state_map).
-        int32_t state_idx01 = state_map_data[state_map_idx];
-        // multiple threads may write the same value to the address written to
-        // in the next line.
-        kept_states_data[state_idx01].a_fsas_state_idx01 =
-            info.u.dest_a_fsas_state_idx01;
-        info.u.dest_info_state_idx01 = state_idx01;
-        kept_ai_data[this_pruned_idx012] = info;
-        int32_t end_loglike_int = FloatToOrderedInt(info.end_loglike);
-        // Set the forward log-like of the dest state to the largest of any of
-        // the incoming arcs.  Note: we initialized this in lambda_init_loglike
-        // above.
-        atomicMax(&(kept_states_data[state_idx01].forward_loglike),
-                  end_loglike_int);
-      }
+
+      // ... this was one of the arcs to keep.  Load the ArcInfo from the
+      // un-pruned array..
+      ArcInfo info = ai_data[arc_idx012];
+      // state_idx01 is the index into ans->states, of the destination state.
+      // Note: multiple arcs may enter this state, which is why we had to set
+      // that in a separate kernel (lambda_set_next_states).
+      int32_t state_idx01 = state_map.Get(fsa_id * state_map_stride +
+                                          info.u.dest_a_fsas_state_idx01);
+      info.u.dest_info_state_idx01 = state_idx01;
+      kept_ai_data[pruned_idx012] = info;
+      kept_row_ids2_data[pruned_idx012] = ai_row_ids2[arc_idx012];
+      int32_t end_loglike_int = FloatToOrderedInt(info.end_loglike);
+      // Set the forward log-like of the dest state to the largest of any of
+      // the incoming arcs.  Note: we initialized this in
+      // lambda_set_next_states above.
+      atomicMax(&(next_states_data[state_idx01].forward_loglike),
+                end_loglike_int);
     };
-    Eval(c_, arc_info.values.Dim(), lambda_set_arcs_and_states);
+    Eval(c_, num_arcs, lambda_set_arcs_and_states);
 
-    const int32_t *next_states_row_ids1 = ans->states.shape.RowIds(1).Data();
-    auto lambda_reset_state_map =
+    // The hash is discarded at the end of the frame; the dense map has to be
+    // reset.
+    if (!use_hash_state_map_) {
+      int32_t *state_map_data = state_map_.Data();
+      auto lambda_reset_state_map =
+          [=] __host__ __device__(int32_t arc_idx012) -> void {
+        if (!keep_states_data[arc_idx012]) return;
+        int32_t fsa_id = ai_row_ids1[ai_row_ids2[arc_idx012]],
+                dest_state_idx01 =
+                    ai_data[arc_idx012].u.dest_a_fsas_state_idx01;
+        state_map_data[fsa_id * state_map_stride + dest_state_idx01] = -1;
+      };
+      Eval(c_, num_arcs, lambda_reset_state_map);
+    }
+
+    auto lambda_set_kept_row_splits2 =
         [=] __host__ __device__(int32_t state_idx01) -> void {
-      int32_t a_fsas_state_idx01 =
-                  kept_states_data[state_idx01].a_fsas_state_idx01,
-              fsa_idx0 = next_states_row_ids1[state_idx01];
-      int32_t state_map_idx = a_fsas_state_idx01 + fsa_idx0 * state_map_stride;
-      K2_CHECK_EQ(state_map_data[state_map_idx], state_idx01);
-      state_map_data[state_map_idx] = -1;
+      kept_row_splits2_data[state_idx01] =
+          arc_reorder_data[ai_row_splits2[state_idx01]];
     };
+    Eval(c_, num_states + 1, lambda_set_kept_row_splits2);
+
+    if (stats_ != nullptr) {
+      Array2Accessor<int32_t> counts = stats_->counts.Accessor();
+      float *beams_data = stats_->beams.Data();
+      const float *dynamic_beams_data = dynamic_beams_.Data();
+      auto lambda_set_stats =
+          [=] __host__ __device__(int32_t fsa_idx0) -> void {
+        int32_t row_begin = b_fsas_row_splits1[fsa_idx0];
+        if (t_local >= b_fsas_row_splits1[fsa_idx0 + 1] - row_begin) return;
+        int32_t row = row_begin + t_local,
+                state_begin = ai_row_splits1[fsa_idx0],
+                state_end = ai_row_splits1[fsa_idx0 + 1],
+                arc_begin = ai_row_splits2[state_begin],
+                arc_end = ai_row_splits2[state_end];
+        counts(row, kIntersectActiveStates) = state_end - state_begin;
+        counts(row, kIntersectExpandedArcs) = arc_end - arc_begin;
+        counts(row, kIntersectKeptArcs) =
+            arc_reorder_data[arc_end] - arc_reorder_data[arc_begin];
+        // As documented, the frames without active states are all zeros,
+        // whatever the other sequences of the batch.
+        beams_data[row] =
+            (state_end > state_begin ? dynamic_beams_data[fsa_idx0] : 0.0f);
+      };
+      Eval(c_, num_fsas, lambda_set_stats);
+    }
 
-    Eval(c_, ans->states.values.Dim(), lambda_reset_state_map);
-
+    // The elements past the number of next states are zero, so this is right
+    // even though we don't know that number yet.
+    ExclusiveSum(c_, num_arcs + 1, next_arc_row_splits_data,
+                 next_arc_row_splits_data);
+
+    Array1<int32_t> totals(c_, 3);
+    int32_t *totals_data = totals.Data();
+    auto lambda_set_totals = [=] __host__ __device__(int32_t i) -> void {
+      int32_t num_kept_arcs = arc_reorder_data[num_arcs],
+              num_next_states = state_reorder_data[num_arcs];
+      totals_data[0] = num_kept_arcs;
+      totals_data[1] = num_next_states;
+      totals_data[2] = next_arc_row_splits_data[num_next_states];
+    };
+    Eval(c_, 1, lambda_set_totals);
+    // This is the only transfer to the host on each frame.
+    totals = totals.To(GetCpuContext());
+    int32_t num_kept_arcs = totals.Data()[0],
+            num_next_states = totals.Data()[1];
+    ans->num_unpruned_arcs = totals.Data()[2];
+
+    Array1<int32_t> kept_row_ids2_prefix = Prefix(kept_row_ids2, num_kept_arcs);
+    RaggedShape kept_shape = RaggedShape3(
+        &cur_frame->states.shape.RowSplits(1),
+        &cur_frame->states.shape.RowIds(1), num_states, &kept_row_splits2,
+        &kept_row_ids2_prefix, num_kept_arcs);
+    cur_frame->arcs =
+        Ragged<ArcInfo>(kept_shape, Prefix(kept_arcs, num_kept_arcs));
+    // Only the pruned arcs of past frames are kept.
+    cur_frame->unpruned_arc_row_splits = Array1<int32_t>();
+
+    Array1<int32_t> next_row_ids1_prefix =
+        Prefix(next_row_ids1, num_next_states);
+    ans->states = Ragged<StateInfo>(
+        RaggedShape2(&next_row_splits1, &next_row_ids1_prefix,
+                     num_next_states),
+        Prefix(next_states, num_next_states));
+    ans->unpruned_arc_row_splits =
+        next_arc_row_splits.Range(0, num_next_states + 1);
     return ans;
   }
 
@@ -753,6 +2181,11 @@ class MultiGraphDenseIntersect {
     non-positive).  To do this, for the final state we have to set the backward
     log-like to the negative of the forward log-like.
 
+    This also sets the elements of renumber_output_states_.Keep() and
+    renumber_output_arcs_.Keep() for this frame, keeping the states and arcs
+    that are on a path within `beam_` of the best path, and converts the
+    dest-states of the arcs of `cur_frame` to dest_info_state_idx1.
+
        @param [in] t       The time-index (on which to look up log-likes),
                            t >= 0
        @param [in]  cur_frame    The FrameInfo for the frame on which we want to
@@ -770,9 +2203,8 @@ class MultiGraphDenseIntersect {
     Ragged<StateInfo> &cur_states = cur_frame->states;  // 2 axes: fsa,state
     StateInfo *cur_states_data = cur_states.values.Data();
 
-    int32_t tot_states = a_fsas_.shape.TotSize(1);
-    int32_t *a_fsas_row_ids1 = a_fsas_.shape.RowIds(1).Data(),
-            *a_fsas_row_splits1 = a_fsas_.shape.RowSplits(1).Data();
+    const int32_t *a_fsas_row_splits1 = a_fsas_.shape.RowSplits(1).Data();
+    int32_t a_fsas_stride = a_fsas_stride_;
 
     const int32_t minus_inf =
         FloatToOrderedInt(-std::numeric_limits<float>::infinity());
@@ -787,108 +2219,96 @@ class MultiGraphDenseIntersect {
     int32_t *arc_backward_prob_data = arc_backward_prob.values.Data();
 
     ArcInfo *arcs_data = cur_frame->arcs.values.Data();
-    int32_t *arcs_rowids1 = cur_frame->arcs.shape.RowIds(2).Data(),
-            *arcs_rowids2 = cur_frame->arcs.shape.RowIds(2).Data(),
-            *arcs_row_splits1 = cur_frame->arcs.shape.RowSplits(1).Data(),
-            *arcs_row_splits2 = cur_frame->arcs.shape.RowSplits(2).Data();
-    float beam = beam_;
+    const int32_t *arcs_rowids1 = cur_frame->arcs.shape.RowIds(1).Data(),
+                  *arcs_rowids2 = cur_frame->arcs.shape.RowIds(2).Data(),
+                  *arcs_row_splits1 = cur_frame->arcs.shape.RowSplits(1).Data(),
+                  *arcs_row_splits2 = cur_frame->arcs.shape.RowSplits(2).Data();
+    float beam = lattice_beam_;
 
-    int32_t *oshape_row_splits1 = oshape_unpruned_.RowSplits(1).Data(),
-            *oshape_row_splits2 = oshape_unpruned_.RowSplits(2).Data(),
-            *oshape_row_splits3 = oshape_unpruned_.RowSplits(3).Data();
+    const int32_t *oshape_row_splits1 = oshape_unpruned_.RowSplits(1).Data(),
+                  *oshape_row_splits2 = oshape_unpruned_.RowSplits(2).Data(),
+                  *oshape_row_splits3 = oshape_unpruned_.RowSplits(3).Data();
 
     // these have the "output" formatting where we number things with
     // oshape_unpruned_, which is indexed [fsa][t][state][arc].
     char *keep_arcs_data = renumber_output_arcs_.Keep().Data(),
          *keep_states_data = renumber_output_states_.Keep().Data();
 
+    // next_states_row_splits1 maps from fsa_idx0 to state_idx01
+    const int32_t *next_states_row_splits1 = nullptr;
+    const StateInfo *next_states_data = nullptr;
     if (next_frame != NULL) {
-      // compute arc backward probs, and set elements of 'keep_arcs'
-
-      StateInfo *cur_states_data = cur_frame->states.values.Data();
-
-      // arc_row_ids maps from arc-idx to frame-state-idx, i.e. idx012 into
-      // `arcs` to idx01 into `arcs`.
-
-      // next_states_row_splits1 maps from fsa_idx0 to state_idx01
-      int32_t *next_states_row_splits1 =
-          next_frame->states.shape.RowSplits(1).Data();
-
-      StateInfo *next_states_data = next_frame->states.values.Data();
-      auto lambda_set_arc_backward_prob_and_keep =
-          [=] __host__ __device__(int32_t arcs_idx012) -> void {
-        ArcInfo *arc = arcs_data + arcs_idx012;
-        int32_t state_idx01 = arcs_rowids2[arcs_idx012],
-                fsa_idx0 = arcs_rowids1[state_idx01],
-                fsa_idx0x = arcs_row_splits1[fsa_idx0],
-                fsa_idx0xx = arcs_row_splits2[fsa_idx0x],
-                arcs_idxx12 = arcs_idx012 - fsa_idx0xx;
-
-        int32_t dest_state_idx01 = arc->u.dest_info_state_idx01,
-                next_state_idx0x = next_states_row_splits1[fsa_idx0],
-                dest_state_idx1 = dest_state_idx01 - next_state_idx0x;
-        arc->u.dest_info_state_idx1 = dest_state_idx1;
-
-        float arc_loglike = arc->arc_loglike;
-        int32_t dest_state_backward_loglike =
-            next_states_data[dest_state_idx01].backward_loglike;
-        // 'backward_loglike' is the loglike at the beginning of the arc
-        float backward_loglike =
-            arc_loglike + OrderedIntToFloat(dest_state_backward_loglike);
-        float src_state_forward_loglike = OrderedIntToFloat(
-            cur_states_data[arcs_rowids2[arcs_idx012]].forward_loglike);
-        char keep_this_arc =
-            (backward_loglike + src_state_forward_loglike >= -beam);
-        int32_t oshape_arc_idx0x = oshape_row_splits1[fsa_idx0],
-                oshape_arc_idx01 = oshape_arc_idx0x + t,
-                oshape_arc_idx01x = oshape_row_splits2[oshape_arc_idx01],
-                oshape_arc_idx01xx = oshape_row_splits3[oshape_arc_idx01x],
-                oshape_arc_idx0123 = oshape_arc_idx01xx + arcs_idxx12;
-        // note, for the previous line: indexes 1 and 2 of FrameInfo::arcs
-        // (==state,arc) become indexes 2 and 3 of oshape_unpruned_.
-
-        keep_arcs_data[oshape_arc_idx0123] = keep_this_arc;
-        arc_backward_prob_data[arcs_idx012] =
-            FloatToOrderedInt(backward_loglike);
-      };
-      Eval(c_, arc_backward_prob.values.Dim(),
-           lambda_set_arc_backward_prob_and_keep);
+      next_states_row_splits1 = next_frame->states.shape.RowSplits(1).Data();
+      next_states_data = next_frame->states.values.Data();
     } else {
-      assert(arc_backward_prob.values.Dim() == 0);
+      K2_CHECK_EQ(num_arcs, 0);
     }
-    // Eval(c_, cur_frame->arcs.values.Dim(), lambda_set_arc_backward_prob);
-
-    /* note, the elements of state_backward_prob that don't have arcs leaving
-       them will be set to the supplied default.  */
-    Array1<int32_t> state_backward_prob;
-    MaxPerSublist(arc_backward_prob,
-                  FloatToOrderedInt(-std::numeric_limits<float>::infinity()),
-                  &state_backward_prob);
+    // compute arc backward probs, and set elements of 'keep_arcs'
+    auto lambda_set_arc_backward_prob_and_keep =
+        [=] __host__ __device__(int32_t arcs_idx012) -> void {
+      ArcInfo *arc = arcs_data + arcs_idx012;
+      int32_t state_idx01 = arcs_rowids2[arcs_idx012],
+              fsa_idx0 = arcs_rowids1[state_idx01],
+              fsa_idx0x = arcs_row_splits1[fsa_idx0],
+              fsa_idx0xx = arcs_row_splits2[fsa_idx0x],
+              arcs_idxx12 = arcs_idx012 - fsa_idx0xx;
+
+      int32_t dest_state_idx01 = arc->u.dest_info_state_idx01,
+              next_state_idx0x = next_states_row_splits1[fsa_idx0],
+              dest_state_idx1 = dest_state_idx01 - next_state_idx0x;
+      arc->u.dest_info_state_idx1 = dest_state_idx1;
+
+      float arc_loglike = arc->arc_loglike;
+      int32_t dest_state_backward_loglike =
+          next_states_data[dest_state_idx01].backward_loglike;
+      // 'backward_loglike' is the loglike at the beginning of the arc
+      float backward_loglike =
+          arc_loglike + OrderedIntToFloat(dest_state_backward_loglike);
+      float src_state_forward_loglike =
+          OrderedIntToFloat(cur_states_data[state_idx01].forward_loglike);
+      char keep_this_arc =
+          (backward_loglike + src_state_forward_loglike >= -beam);
+      int32_t oshape_arc_idx0x = oshape_row_splits1[fsa_idx0],
+              oshape_arc_idx01 = oshape_arc_idx0x + t,
+              oshape_arc_idx01x = oshape_row_splits2[oshape_arc_idx01],
+              oshape_arc_idx01xx = oshape_row_splits3[oshape_arc_idx01x],
+              oshape_arc_idx0123 = oshape_arc_idx01xx + arcs_idxx12;
+      // note, for the previous line: indexes 1 and 2 of FrameInfo::arcs
+      // (==state,arc) become indexes 2 and 3 of oshape_unpruned_.
+
+      keep_arcs_data[oshape_arc_idx0123] = keep_this_arc;
+      arc_backward_prob_data[arcs_idx012] =
+          FloatToOrderedInt(backward_loglike);
+    };
+
+    Array1<int32_t> state_backward_prob(c_, num_states);
     const int32_t *state_backward_prob_data = state_backward_prob.Data();
 
-    int32_t num_fsas = a_fsas_.shape.Dim0();
-    assert(cur_frame->states.shape.Dim0() == num_fsas);
     float float_minus_inf = -std::numeric_limits<float>::infinity();
     auto lambda_set_state_backward_prob =
         [=] __host__ __device__(int32_t state_idx01) -> void {
       StateInfo *info = cur_states_data + state_idx01;
-      int32_t fsas_state_idx01 = info->a_fsas_state_idx01,
-              fsa_idx0 = a_fsas_row_ids1[fsas_state_idx01],
-              fsas_state_idx0x_next = a_fsas_row_splits1[fsa_idx0 + 1];
+      // we can use the arcs row-ids and row-splits because the structure of
+      // FrameInfo::states is the same as the top level structure of
+      // FrameInfo::arcs.
+      int32_t fsa_idx0 = arcs_rowids1[state_idx01],
+              fsas_state_idx01 = info->a_fsas_state_idx01,
+              fsas_state_idx0x_next =
+                  a_fsas_row_splits1[fsa_idx0 * a_fsas_stride + 1];
       float forward_loglike = OrderedIntToFloat(info->forward_loglike),
             backward_loglike;
-      int32_t is_final_state = (fsas_state_idx01 + 1 > fsas_state_idx0x_next);
+      // The final state; it can only be active on the frame after the last
+      // frame of the sequence, because the arcs entering it have symbol -1,
+      // whose score is -infinity on the other frames.
+      bool is_final_state = (fsas_state_idx01 + 1 == fsas_state_idx0x_next);
       if (is_final_state) {
-        backward_loglike = forward_loglike;
+        backward_loglike = -forward_loglike;
       } else {
         backward_loglike =
-            FloatToOrderedInt(state_backward_prob_data[state_idx01]);
+            OrderedIntToFloat(state_backward_prob_data[state_idx01]);
       }
       char keep_this_state = (backward_loglike + forward_loglike >= -beam);
 
-      // we can use the arcs row-splits because the structure of
-      // FrameInfo::states is the same as the top level structure of
-      // FrameInfo::arcs.
       int32_t states_idx0x = arcs_row_splits1[fsa_idx0],
               states_idxx1 = state_idx01 - states_idx0x;
 
@@ -897,7 +2317,7 @@ class MultiGraphDenseIntersect {
               oshape_idx01x = oshape_row_splits2[oshape_idx01],
               oshape_idx012 = oshape_idx01x + states_idxx1;
       // note: axis 1 of 'states' corresponds to axis 2 of 'oshape'; it's the
-      // state index.  Also,
+      // state index.
 
       keep_states_data[oshape_idx012] = keep_this_state;
       if (!keep_this_state) {
@@ -911,23 +2331,59 @@ class MultiGraphDenseIntersect {
       info->backward_loglike = FloatToOrderedInt(backward_loglike);
     };
 
-    Eval(c_, cur_frame->states.values.Dim(), lambda_set_state_backward_prob);
+    // The kernels below only depend on sizes that are known on the host, so on
+    // GPU they are launched as a single CUDA graph, which saves most of their
+    // launch overhead on each frame.  Nothing may be allocated while they are
+    // captured, so the temporary storage of MaxPerSublist() is allocated
+    // here.
+    Array1<char> max_temp_storage(
+        c_, static_cast<int32_t>(
+                ApplyOpPerSublistTempBytes<int32_t, MaxOp<int32_t>>(
+                    arc_backward_prob, minus_inf)));
+    backward_graph_->Run([&]() -> void {
+      Eval(c_, num_arcs, lambda_set_arc_backward_prob_and_keep);
+      /* note, the elements of state_backward_prob that don't have arcs leaving
+         them will be set to the supplied default.  */
+      MaxPerSublist(arc_backward_prob, minus_inf, &state_backward_prob,
+                    &max_temp_storage);
+      Eval(c_, num_states, lambda_set_state_backward_prob);
+    });
   }
 
   ContextPtr c_;
   FsaVec &a_fsas_;
+  // The arcs of a_fsas_ in structure-of-arrays layout; the kernels that read
+  // only some fields of the arcs use this.
+  FsaSoA a_fsas_soa_;
   int32_t a_fsas_stride_;  // 1 if we use a different FSA per sequence, 0 if the
                            // decoding graph is shared.
-  DenseFsaVec &b_fsas_;
+  // The neural-net output; when streaming, the latest chunk, whose row 0 is
+  // for frame t_offset_.
+  DenseFsaVec b_fsas_;
+  int32_t t_offset_ = 0;
+  int32_t num_seqs_;
+  // num_seqs_with_rows_[r] is 1 + the largest index of a sequence with at
+  // least r rows in b_fsas_ (0 if there is none).  Only the sequences with
+  // rows left can have states on later frames, so the frames only have rows
+  // for the sequences before that; if the sequences are sorted by decreasing
+  // length, the sequences that have ended drop out of the frames.
+  std::vector<int32_t> num_seqs_with_rows_;
+  bool finalized_ = false;  // true once the backward pass has been done.
+  bool have_arc_posts_ = false;  // true once ComputeArcPosteriors() has been
+                                 // called.
   float beam_;
+  float lattice_beam_;
   int32_t max_active_;
   int32_t min_active_;
-  Array1<float> dynamic_beams_;  // dynamic beams (initially just beam_ but
-                                 // change due to max_active/min_active
-                                 // constraints).
-  Array2<int32_t> state_map_;  // state_map_ is of size (total number of states
-                               // in a_fsas_ * (a_fsas_.Dim0() == 1 ?
-                               // b_fsas_.Dim0() : 1).
+  Array1<float> dynamic_beams_;  // the beams used on the latest frame
+  // If not nullptr, the forward pass writes its statistics here, see
+  // SetStatsOutput().
+  DenseIntersectStats *stats_ = nullptr;
+                                 // (initially just beam_ but change due to
+                                 // max_active/min_active constraints).
+  Array2<int32_t> state_map_;  // state_map_ is of size (a_fsas_.Dim0() == 1 ?
+                               // b_fsas_.Dim0() : 1) by (total number of
+                               // states in a_fsas_).
                                // (If all the streams share the same FSA in
                                // a_fsas_, we need separate maps for each).
                                // This map is used on
@@ -935,8 +2391,21 @@ class MultiGraphDenseIntersect {
                                // from active states to the position in the
                                // `states` array.  Between frames, all values
                                // have -1 in them.
-
-  std::vector<FrameInfo *> frames_;
+                               // Empty if use_hash_state_map_.
+  bool use_hash_state_map_;  // True if state_map_ would be too large (see
+                             // kDenseStateMapMaxBytes), in which case a Hash
+                             // with the same keys is used on each frame.
+  // If > 0, the forward pass is done by ForwardFramesPersistent(), with
+  // room for this many arcs per sequence and frame.
+  int32_t persistent_capacity_ = 0;
+
+  // Set by SetBlankSkip(): skip_rows_[i] is 1 if only the blank arcs are
+  // expanded on row i of b_fsas_ (empty if not in that mode); and the blank
+  // arcs of a_fsas_, indexed [a_fsas state_idx01][arc], as arc_idx012's.
+  Array1<char> skip_rows_;
+  Ragged<int32_t> blank_arcs_;
+
+  std::vector<std::unique_ptr<FrameInfo>> frames_;
 
   // This is a rearranged version of the info in 'frames', computed at the end
   // of the forward pass before pruning.  It is indexed [fsa_id][t][state][arc].
@@ -948,18 +2417,401 @@ class MultiGraphDenseIntersect {
   Renumbering renumber_output_states_;
   Renumbering renumber_output_arcs_;
 
-  // This is as oshape_unpruned_, but after the backward-pass pruning.
-  // It is indexed [fsa_id][t][state][arc].
-  RaggedShape oshape_pruned_;
+  // Used to launch the kernels of each frame of PropagateBackward() as a
+  // single CUDA graph.
+  std::unique_ptr<CudaGraph> backward_graph_;
 };
 
+std::vector<int64_t> EstimateIntersectDensePrunedBytes(
+    FsaVec &a_fsas, DenseFsaVec &b_fsas, int32_t max_active_states) {
+  K2_CHECK_EQ(a_fsas.NumAxes(), 3);
+  int32_t num_seqs = b_fsas.shape.Dim0(), num_graphs = a_fsas.shape.Dim0();
+  K2_CHECK(num_graphs == 1 || num_graphs == num_seqs);
+  ContextPtr cpu = GetCpuContext();
+  Array1<int32_t> a_row_splits1 = a_fsas.shape.RowSplits(1).To(cpu),
+                  a_row_splits2 = a_fsas.shape.RowSplits(2).To(cpu),
+                  b_row_splits1 = b_fsas.shape.RowSplits(1).To(cpu);
+  // Rough sizes of the state and arc structs of MultiGraphDenseIntersect,
+  // with their share of the temporaries.
+  const int64_t kStateBytes = 32, kArcBytes = 48;
+  std::vector<int64_t> ans(num_seqs);
+  for (int32_t n = 0; n != num_seqs; ++n) {
+    int32_t g = (num_graphs == 1 ? 0 : n),
+            state_begin = a_row_splits1[g], state_end = a_row_splits1[g + 1];
+    int64_t num_states = state_end - state_begin,
+            num_arcs = a_row_splits2[state_end] - a_row_splits2[state_begin],
+            num_rows = b_row_splits1[n + 1] - b_row_splits1[n],
+            active = std::min<int64_t>(max_active_states, num_states);
+    double arcs_per_state =
+        (num_states == 0 ? 0.0 : num_arcs / static_cast<double>(num_states));
+    ans[n] = num_rows * active *
+             (kStateBytes + static_cast<int64_t>(arcs_per_state * kArcBytes));
+  }
+  return ans;
+}
+
+// Does IntersectDensePruned() for one (sub-)batch, i.e. ignoring
+// opts.max_bytes and opts.batch_offsets.  If a_fsas_soa is not nullptr, it
+// is the arcs of a_fsas in SoA layout.
+static void IntersectDensePrunedBatch(
+    FsaVec &a_fsas, const FsaSoA *a_fsas_soa, DenseFsaVec &b_fsas, float beam,
+    int32_t max_active_states, int32_t min_active_states, FsaVec *out,
+    Array1<int32_t> *arc_map_a, Array1<int32_t> *arc_map_b,
+    const IntersectDensePrunedOptions &opts) {
+  float lattice_beam = (opts.lattice_beam < 0 ? beam : opts.lattice_beam);
+  MultiGraphDenseIntersect intersector(a_fsas, b_fsas, beam, lattice_beam,
+                                       max_active_states, min_active_states,
+                                       a_fsas_soa);
+  int32_t num_skipped = (opts.blank_threshold > 0
+                             ? intersector.SetBlankSkip(opts.blank_threshold)
+                             : 0);
+  if (opts.num_skipped_frames != nullptr)
+    *opts.num_skipped_frames = num_skipped;
+  if (opts.stats != nullptr) intersector.SetStatsOutput(opts.stats);
+  intersector.Intersect();
+  if (opts.tot_scores != nullptr || opts.arc_posts != nullptr)
+    intersector.ComputeArcPosteriors(opts.tot_scores);
+  intersector.FormatOutput(out, arc_map_a, arc_map_b, opts.arc_posts);
+}
+
+// Returns the sub-batches of the sequences of b_fsas for the memory budget
+// `max_bytes` (see IntersectDensePrunedOptions::max_bytes), as offsets; one
+// sub-batch if max_bytes <= 0.
+static std::vector<int32_t> GetIntersectBatchOffsets(
+    FsaVec &a_fsas, DenseFsaVec &b_fsas, int32_t max_active_states,
+    int64_t max_bytes) {
+  int32_t num_seqs = b_fsas.shape.Dim0();
+  std::vector<int32_t> offsets(1, 0);
+  if (max_bytes > 0) {
+    std::vector<int64_t> bytes =
+        EstimateIntersectDensePrunedBytes(a_fsas, b_fsas, max_active_states);
+    int64_t batch_bytes = 0;
+    for (int32_t n = 0; n != num_seqs; ++n) {
+      if (n != offsets.back() && batch_bytes + bytes[n] > max_bytes) {
+        offsets.push_back(n);
+        batch_bytes = 0;
+      }
+      batch_bytes += bytes[n];
+    }
+  }
+  offsets.push_back(num_seqs);
+  return offsets;
+}
+
+// Does IntersectDensePruned() in the sub-batches of sequences given by
+// `offsets` (see GetIntersectBatchOffsets()), one after the other, and
+// appends their outputs.  If a_fsas_soa is not nullptr, a_fsas must be shared
+// by all the sequences.
+static void IntersectDensePrunedInBatches(
+    FsaVec &a_fsas, const FsaSoA *a_fsas_soa, DenseFsaVec &b_fsas,
+    const std::vector<int32_t> &offsets, float beam,
+    int32_t max_active_states, int32_t min_active_states, FsaVec *out,
+    Array1<int32_t> *arc_map_a, Array1<int32_t> *arc_map_b,
+    const IntersectDensePrunedOptions &opts) {
+  int32_t num_batches = static_cast<int32_t>(offsets.size()) - 1;
+  if (num_batches <= 1) {
+    IntersectDensePrunedBatch(a_fsas, a_fsas_soa, b_fsas, beam,
+                              max_active_states, min_active_states, out,
+                              arc_map_a, arc_map_b, opts);
+    return;
+  }
+
+  K2_PROFILE_SCOPE("IntersectDensePrunedInBatches", b_fsas.shape.Context());
+  bool shared_graph = (a_fsas.shape.Dim0() == 1);
+  K2_CHECK(shared_graph || a_fsas_soa == nullptr);
+  std::vector<int32_t> arc_offsets, row_offsets;
+  std::vector<FsaVec> a_batches;
+  if (!shared_graph) a_batches = SplitFsaVec(a_fsas, offsets, &arc_offsets);
+  std::vector<DenseFsaVec> b_batches =
+      SplitDenseFsaVec(b_fsas, offsets, &row_offsets);
+  int32_t num_cols = b_fsas.NumCols();
+
+  std::vector<FsaVec> outs(num_batches);
+  std::vector<Array1<int32_t>> arc_maps_a(num_batches),
+      arc_maps_b(num_batches);
+  std::vector<Array1<float>> batch_tot_scores(num_batches),
+      batch_arc_posts(num_batches);
+  std::vector<int32_t> batch_num_skipped(num_batches, 0);
+  std::vector<DenseIntersectStats> batch_stats(num_batches);
+  for (int32_t i = 0; i != num_batches; ++i) {
+    IntersectDensePrunedOptions batch_opts = opts;
+    batch_opts.max_bytes = 0;
+    batch_opts.batch_offsets = nullptr;
+    if (opts.tot_scores != nullptr)
+      batch_opts.tot_scores = &batch_tot_scores[i];
+    if (opts.arc_posts != nullptr) batch_opts.arc_posts = &batch_arc_posts[i];
+    if (opts.num_skipped_frames != nullptr)
+      batch_opts.num_skipped_frames = &batch_num_skipped[i];
+    if (opts.stats != nullptr) batch_opts.stats = &batch_stats[i];
+    IntersectDensePrunedBatch(shared_graph ? a_fsas : a_batches[i],
+                              a_fsas_soa, b_batches[i], beam,
+                              max_active_states, min_active_states, &outs[i],
+                              &arc_maps_a[i], &arc_maps_b[i], batch_opts);
+    // Make the arc maps index the whole of a_fsas and b_fsas.
+    ContextPtr &c = arc_maps_a[i].Context();
+    int32_t num_arcs = arc_maps_a[i].Dim(),
+            a_offset = (shared_graph ? 0 : arc_offsets[i]),
+            b_offset = row_offsets[i] * num_cols;
+    int32_t *arc_map_a_data = arc_maps_a[i].Data(),
+            *arc_map_b_data = arc_maps_b[i].Data();
+    auto lambda_offset_maps = [=] __host__ __device__(int32_t j) -> void {
+      arc_map_a_data[j] += a_offset;
+      arc_map_b_data[j] += b_offset;
+    };
+    Eval(c, num_arcs, lambda_offset_maps);
+  }
+  std::vector<RaggedShape *> out_shapes(num_batches);
+  std::vector<Array1<Arc>> out_arcs(num_batches);
+  for (int32_t i = 0; i != num_batches; ++i) {
+    out_shapes[i] = &outs[i].shape;
+    out_arcs[i] = outs[i].values;
+  }
+  *out = FsaVec(Append(0, num_batches, out_shapes.data()),
+                Append(num_batches, out_arcs.data()));
+  if (arc_map_a != nullptr)
+    *arc_map_a = Append(num_batches, arc_maps_a.data());
+  if (arc_map_b != nullptr)
+    *arc_map_b = Append(num_batches, arc_maps_b.data());
+  if (opts.tot_scores != nullptr)
+    *opts.tot_scores = Append(num_batches, batch_tot_scores.data());
+  if (opts.arc_posts != nullptr)
+    *opts.arc_posts = Append(num_batches, batch_arc_posts.data());
+  if (opts.num_skipped_frames != nullptr)
+    *opts.num_skipped_frames = std::accumulate(batch_num_skipped.begin(),
+                                               batch_num_skipped.end(), 0);
+  if (opts.stats != nullptr) {
+    // The rows of the sub-batches are consecutive ranges of those of b_fsas.
+    std::vector<Array1<int32_t>> counts(num_batches);
+    std::vector<Array1<float>> beams(num_batches);
+    for (int32_t i = 0; i != num_batches; ++i) {
+      counts[i] = batch_stats[i].counts.Flatten();
+      beams[i] = batch_stats[i].beams;
+    }
+    Array1<int32_t> all_counts = Append(num_batches, counts.data());
+    DenseIntersectStats *stats = opts.stats;
+    stats->shape = b_fsas.shape;
+    stats->counts = Array2<int32_t>(all_counts, b_fsas.shape.NumElements(),
+                                    kNumIntersectCounts);
+    stats->beams = Append(num_batches, beams.data());
+  }
+}
+
 void IntersectDensePruned(FsaVec &a_fsas, DenseFsaVec &b_fsas, float beam,
-                          int32_t max_active_states, int32_t min_active_states,
-                          FsaVec *out, Array1<int32_t> *arc_map_a,
-                          Array1<int32_t> *arc_map_b) {
-  MultiGraphDenseIntersect intersector(a_fsas, b_fsas, beam, max_active_states,
-                                       min_active_states);
+                          int32_t max_active_states,
+                          int32_t min_active_states, FsaVec *out,
+                          Array1<int32_t> *arc_map_a,
+                          Array1<int32_t> *arc_map_b,
+                          const IntersectDensePrunedOptions &opts) {
+  K2_PROFILE_SCOPE("IntersectDensePruned", b_fsas.shape.Context());
+  std::vector<int32_t> offsets = GetIntersectBatchOffsets(
+      a_fsas, b_fsas, max_active_states, opts.max_bytes);
+  if (opts.batch_offsets != nullptr) *opts.batch_offsets = offsets;
+  IntersectDensePrunedInBatches(a_fsas, nullptr, b_fsas, offsets, beam,
+                                max_active_states, min_active_states, out,
+                                arc_map_a, arc_map_b, opts);
+}
+
+DenseIntersectGraph PrepareDenseIntersectGraph(FsaVec &a_fsas,
+                                               ContextPtr c /*= nullptr*/) {
+  K2_CHECK_EQ(a_fsas.NumAxes(), 3);
+  K2_PROFILE_SCOPE("PrepareDenseIntersectGraph",
+                   c != nullptr ? c : a_fsas.Context());
+  FsaVec src = (c != nullptr ? a_fsas.To(c) : a_fsas);
+  DenseIntersectGraph ans;
+  ArcSort(src, &ans.fsas, &ans.arc_map);
+  ans.soa = FsaToSoA(ans.fsas);
+  GetFsaVecBasicProperties(ans.fsas, &ans.properties, &ans.tot_properties);
+  ans.entering_arcs = GetEnteringArcs(ans.fsas);
+  // The intersections read the row_ids; if they were computed on first use,
+  // that would be a race when they run in several threads at once.
+  ans.fsas.shape.RowIds(1);
+  ans.fsas.shape.RowIds(2);
+  return ans;
+}
+
+// Returns a copy of `src` allocated from `c`, which must be compatible with
+// its context.  The copy is done by a kernel, as memory from `c` may be
+// mapped host memory (see NewHostMappedContext()).
+template <typename T>
+static Array1<T> CopyWithKernel(ContextPtr &c, const Array1<T> &src) {
+  int32_t dim = src.Dim();
+  Array1<T> ans(c, dim);
+  const T *src_data = src.Data();
+  T *ans_data = ans.Data();
+  auto lambda_copy = [=] __host__ __device__(int32_t i) -> void {
+    ans_data[i] = src_data[i];
+  };
+  Eval(c, dim, lambda_copy);
+  return ans;
+}
+
+static RaggedShape CopyWithKernel(ContextPtr &c, const RaggedShape &src) {
+  std::vector<RaggedShapeDim> axes = src.Axes();
+  for (RaggedShapeDim &axis : axes) {
+    axis.row_splits = CopyWithKernel(c, axis.row_splits);
+    if (axis.row_ids.GetRegion() != nullptr)
+      axis.row_ids = CopyWithKernel(c, axis.row_ids);
+  }
+  return RaggedShape(axes, false);
+}
+
+DenseIntersectGraph CopyDenseIntersectGraph(DenseIntersectGraph &graph,
+                                            ContextPtr c) {
+  K2_CHECK(c->IsCompatible(*graph.fsas.Context()));
+  K2_PROFILE_SCOPE("CopyDenseIntersectGraph", c);
+  DenseIntersectGraph ans;
+  ans.fsas = FsaVec(CopyWithKernel(c, graph.fsas.shape),
+                    CopyWithKernel(c, graph.fsas.values));
+  SetFsaVecKnownProperties(ans.fsas, GetFsaVecKnownProperties(graph.fsas));
+  ans.soa.shape = ans.fsas.shape;
+  ans.soa.src_states = CopyWithKernel(c, graph.soa.src_states);
+  ans.soa.dest_states = CopyWithKernel(c, graph.soa.dest_states);
+  ans.soa.symbols = CopyWithKernel(c, graph.soa.symbols);
+  ans.soa.scores = CopyWithKernel(c, graph.soa.scores);
+  ans.arc_map = CopyWithKernel(c, graph.arc_map);
+  ans.properties = graph.properties;
+  ans.tot_properties = graph.tot_properties;
+  ans.entering_arcs =
+      Ragged<int32_t>(CopyWithKernel(c, graph.entering_arcs.shape),
+                      CopyWithKernel(c, graph.entering_arcs.values));
+  return ans;
+}
+
+void IntersectDensePruned(DenseIntersectGraph &a_graph, DenseFsaVec &b_fsas,
+                          float beam, int32_t max_active_states,
+                          int32_t min_active_states, FsaVec *out,
+                          Array1<int32_t> *arc_map_a,
+                          Array1<int32_t> *arc_map_b,
+                          const IntersectDensePrunedOptions &opts) {
+  K2_PROFILE_SCOPE("IntersectDensePruned", b_fsas.shape.Context());
+  K2_CHECK_EQ(a_graph.soa.NumArcs(), a_graph.fsas.values.Dim());
+  std::vector<int32_t> offsets = GetIntersectBatchOffsets(
+      a_graph.fsas, b_fsas, max_active_states, opts.max_bytes);
+  // The prepared graph can't be split into the graphs of the sub-batches.
+  K2_CHECK(offsets.size() <= 2 || a_graph.fsas.shape.Dim0() == 1)
+      << "A memory budget needs the graph to be shared by all sequences";
+  if (opts.batch_offsets != nullptr) *opts.batch_offsets = offsets;
+  IntersectDensePrunedInBatches(a_graph.fsas, &a_graph.soa, b_fsas, offsets,
+                                beam, max_active_states, min_active_states,
+                                out, arc_map_a, arc_map_b, opts);
+  // Give the arc indexes in the graph that was prepared; this is done on the
+  // context of the output, like the rest of the work.
+  if (arc_map_a != nullptr) {
+    ContextPtr &c = arc_map_a->Context();
+    int32_t num_arcs = arc_map_a->Dim();
+    Array1<int32_t> graph_arc_map(c, num_arcs);
+    const int32_t *arc_map_a_data = arc_map_a->Data(),
+                  *prepared_arc_map_data = a_graph.arc_map.Data();
+    int32_t *graph_arc_map_data = graph_arc_map.Data();
+    auto lambda_map_arcs = [=] __host__ __device__(int32_t i) -> void {
+      graph_arc_map_data[i] = prepared_arc_map_data[arc_map_a_data[i]];
+    };
+    Eval(c, num_arcs, lambda_map_arcs);
+    *arc_map_a = graph_arc_map;
+  }
+}
+
+void IntersectDense(FsaVec &a_fsas, DenseFsaVec &b_fsas, FsaVec *out,
+                    Array1<int32_t> *arc_map_a, Array1<int32_t> *arc_map_b,
+                    Array1<float> *tot_scores, Array1<float> *arc_posts) {
+  // The beams are finite so that the arcs and states with -infinity scores
+  // are still pruned.
+  IntersectDensePrunedOptions opts;
+  opts.lattice_beam = kNoPruningBeam;
+  opts.tot_scores = tot_scores;
+  opts.arc_posts = arc_posts;
+  IntersectDensePruned(a_fsas, b_fsas, kNoPruningBeam,
+                       std::numeric_limits<int32_t>::max(), 1, out, arc_map_a,
+                       arc_map_b, opts);
+}
+
+Array1<int32_t> ArcMapBToNnetOutput(DenseFsaVec &b_fsas,
+                                    Array2<int32_t> &supervision_segments,
+                                    int32_t max_frames,
+                                    const Array1<int32_t> &arc_map_b) {
+  ContextPtr c = b_fsas.shape.Context();
+  K2_CHECK(c->IsCompatible(*arc_map_b.Context()));
+  int32_t num_seqs = b_fsas.shape.Dim0(), num_cols = b_fsas.NumCols(),
+          num_arcs = arc_map_b.Dim();
+  K2_CHECK_EQ(supervision_segments.Dim0(), num_seqs);
+  Array2<int32_t> segments = supervision_segments.To(c);
+  const int32_t *segments_data = segments.Data(),
+                *row_splits1_data = b_fsas.shape.RowSplits(1).Data(),
+                *row_ids1_data = b_fsas.shape.RowIds(1).Data(),
+                *arc_map_b_data = arc_map_b.Data();
+  int32_t segments_stride0 = segments.ElemStride0();
+  Array1<int32_t> ans(c, num_arcs);
+  int32_t *ans_data = ans.Data();
+  auto lambda_map_arcs = [=] __host__ __device__(int32_t i) -> void {
+    int32_t b_idx = arc_map_b_data[i], row = b_idx / num_cols,
+            col = b_idx % num_cols, seq = row_ids1_data[row],
+            t = row - row_splits1_data[seq];
+    // the last row of each sequence, and column 0, are for the final symbol.
+    if (col == 0 || row + 1 == row_splits1_data[seq + 1]) {
+      ans_data[i] = -1;
+      return;
+    }
+    int32_t frame = segments_data[seq * segments_stride0] + t;
+    ans_data[i] = (seq * max_frames + frame) * (num_cols - 1) + col - 1;
+  };
+  Eval(c, num_arcs, lambda_map_arcs);
+  return ans;
+}
+
+Array1<float> BackpropTotScores(const Array1<int32_t> &nnet_arc_map,
+                                const Array1<float> &arc_posts,
+                                const Array1<float> &tot_scores_grad,
+                                int32_t max_frames, int32_t num_symbols) {
+  ContextPtr c = nnet_arc_map.Context();
+  K2_CHECK(c->IsCompatible(*arc_posts.Context()));
+  K2_CHECK(c->IsCompatible(*tot_scores_grad.Context()));
+  int32_t num_arcs = nnet_arc_map.Dim(),
+          seq_size = max_frames * num_symbols;
+  K2_CHECK_EQ(arc_posts.Dim(), num_arcs);
+  Array1<float> ans(c, tot_scores_grad.Dim() * seq_size, 0.0f);
+  if (num_arcs == 0 || seq_size == 0) return ans;
+
+  // The derivative w.r.t. the score that each arc used; the sequence is
+  // found from the index in the neural-net output.
+  Array1<float> arc_derivs(c, num_arcs);
+  const int32_t *nnet_arc_map_data = nnet_arc_map.Data();
+  const float *arc_posts_data = arc_posts.Data(),
+              *tot_scores_grad_data = tot_scores_grad.Data();
+  float *arc_derivs_data = arc_derivs.Data();
+  auto lambda_set_arc_derivs = [=] __host__ __device__(int32_t i) -> void {
+    int32_t j = nnet_arc_map_data[i];
+    arc_derivs_data[i] =
+        (j == -1 ? 0.0f
+                 : arc_posts_data[i] * tot_scores_grad_data[j / seq_size]);
+  };
+  Eval(c, num_arcs, lambda_set_arc_derivs);
+  const Array1<int32_t> *maps[] = {&nnet_arc_map};
+  ScatterAddDeterministic(arc_derivs, 1, maps, &ans);
+  return ans;
+}
+
+OnlineIntersectDensePruned::OnlineIntersectDensePruned(
+    FsaVec &a_fsas, int32_t num_seqs, float beam, float lattice_beam,
+    int32_t max_active_states, int32_t min_active_states,
+    int32_t persistent_capacity)
+    : a_fsas_(a_fsas),
+      impl_(std::make_unique<MultiGraphDenseIntersect>(
+          a_fsas_, num_seqs, beam, lattice_beam, max_active_states,
+          min_active_states, persistent_capacity)) {}
+
+OnlineIntersectDensePruned::~OnlineIntersectDensePruned() = default;
+
+void OnlineIntersectDensePruned::AcceptChunk(DenseFsaVec &chunk) {
+  impl_->AcceptChunk(chunk);
+}
+
+Array2<int32_t> OnlineIntersectDensePruned::BestPaths() {
+  return impl_->BestPaths();
+}
 
-  intersector.FormatOutput(out, arc_map_a, arc_map_b);
+void OnlineIntersectDensePruned::Finalize(FsaVec *out,
+                                          Array1<int32_t> *arc_map_a) {
+  impl_->Finalize();
+  impl_->FormatOutput(out, arc_map_a, nullptr);
 }
 }  // namespace k2
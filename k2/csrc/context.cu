@@ -10,10 +10,694 @@
  * See LICENSE for clarification regarding multiple authors
  */
 
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
 #include "k2/csrc/context.h"
+#include "k2/csrc/profile.h"
 
 namespace k2 {
 
+namespace {
+
+/*
+  A fixed-size pool of threads that run tasks from a FIFO queue.  There is one
+  instance, see GetThreadPool(); its size bounds the number of background
+  tasks that run at the same time.
+ */
+class ThreadPool {
+ public:
+  explicit ThreadPool(int32_t num_threads) {
+    K2_CHECK_GT(num_threads, 0);
+    for (int32_t i = 0; i != num_threads; ++i)
+      threads_.emplace_back([this]() { this->Run(); });
+  }
+
+  void Enqueue(std::function<void()> task) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      tasks_.push_back(std::move(task));
+    }
+    cond_.notify_one();
+  }
+
+  int32_t NumThreads() const { return static_cast<int32_t>(threads_.size()); }
+
+  // Returns true if the calling thread is one of the threads of a pool.
+  static bool InPoolThread() { return in_pool_thread_; }
+
+ private:
+  void Run() {
+    in_pool_thread_ = true;
+    while (true) {
+      std::function<void()> task;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cond_.wait(lock, [this]() { return !tasks_.empty(); });
+        task = std::move(tasks_.front());
+        tasks_.pop_front();
+      }
+      task();
+    }
+  }
+
+  static thread_local bool in_pool_thread_;
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  std::deque<std::function<void()>> tasks_;
+  std::vector<std::thread> threads_;
+};
+
+thread_local bool ThreadPool::in_pool_thread_ = false;
+
+std::mutex g_thread_pool_mutex;
+int32_t g_num_background_threads = 0;  // 0 means: use the default.
+ThreadPool *g_thread_pool = nullptr;
+
+// Set by SetParallelForImpl(); nullptr means: use the pool.
+std::atomic<ParallelForImpl> g_parallel_for_impl{nullptr};
+
+// The pool is never destroyed; its threads are detached from any object
+// lifetime, as tasks may still be queued at exit.
+ThreadPool &GetThreadPool() {
+  std::lock_guard<std::mutex> lock(g_thread_pool_mutex);
+  if (g_thread_pool == nullptr) {
+    int32_t num_threads = g_num_background_threads;
+    if (num_threads == 0)
+      num_threads = std::max<int32_t>(std::thread::hardware_concurrency(), 1);
+    g_thread_pool = new ThreadPool(num_threads);
+  }
+  return *g_thread_pool;
+}
+
+}  // namespace
+
+void SetNumBackgroundThreads(int32_t num_threads) {
+  K2_CHECK_GT(num_threads, 0);
+  std::lock_guard<std::mutex> lock(g_thread_pool_mutex);
+  K2_CHECK(g_thread_pool == nullptr)
+      << "SetNumBackgroundThreads() must be called before the thread pool "
+         "is used";
+  g_num_background_threads = num_threads;
+}
+
+void SetParallelForImpl(ParallelForImpl impl) { g_parallel_for_impl = impl; }
+
+void ParallelFor(int32_t n, int32_t min_size,
+                 const std::function<void(int32_t, int32_t)> &f) {
+  if (n <= 0) return;
+  K2_CHECK_GT(min_size, 0);
+  ParallelForImpl impl = g_parallel_for_impl;
+  if (impl != nullptr) {
+    impl(n, min_size, f);
+    return;
+  }
+  int32_t num_chunks = 1;
+  if (!ThreadPool::InPoolThread()) {
+    // Use a few chunks per thread, so that some imbalance in the cost of
+    // chunks (or threads busy with other tasks) matters less.
+    int32_t max_chunks = GetThreadPool().NumThreads() * 4;
+    num_chunks = std::min<int32_t>(max_chunks, n / min_size);
+  }
+  if (num_chunks <= 1) {
+    f(0, n);
+    return;
+  }
+  BackgroundRunner br;
+  // The last chunk is run in this thread.
+  for (int32_t c = 0; c + 1 < num_chunks; ++c) {
+    int32_t begin = static_cast<int64_t>(n) * c / num_chunks,
+            end = static_cast<int64_t>(n) * (c + 1) / num_chunks;
+    br.Background([&f, begin, end]() { f(begin, end); });
+  }
+  f(static_cast<int64_t>(n) * (num_chunks - 1) / num_chunks, n);
+  br.Wait();
+}
+
+void BackgroundRunner::Background(const std::function<void()> &f) {
+  if (ThreadPool::InPoolThread()) {
+    // Run nested tasks directly, the pool's threads may all be busy waiting
+    // for them.
+    f();
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    ++num_pending_;
+  }
+  GetThreadPool().Enqueue([this, f]() {
+    f();
+    this->TaskFinished();
+  });
+}
+
+void BackgroundRunner::TaskFinished() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (--num_pending_ == 0) cond_.notify_all();
+}
+
+void BackgroundRunner::Wait() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  cond_.wait(lock, [this]() { return num_pending_ == 0; });
+}
+
+namespace {
+
+// Index 0 is for the CPU; index i + 1 for CUDA device i.
+constexpr int32_t kMaxNumCudaDevices = 64;
+
+struct AtomicMemoryStats {
+  std::atomic<int64_t> num_allocs;
+  std::atomic<int64_t> num_frees;
+  std::atomic<int64_t> bytes_allocated;
+  std::atomic<int64_t> bytes_live;
+  std::atomic<int64_t> max_bytes_live;
+  std::atomic<int64_t> num_copies[MemcpyUnknown];
+  std::atomic<int64_t> bytes_copied[MemcpyUnknown];
+  std::atomic<int64_t> num_syncs;
+};
+
+// Zero-initialized as it has static storage duration.
+AtomicMemoryStats g_memory_stats[kMaxNumCudaDevices + 1];
+
+AtomicMemoryStats &GetAtomicMemoryStats(DeviceType device_type,
+                                        int32_t device_id) {
+  if (device_type == kCpu) return g_memory_stats[0];
+  K2_CHECK_EQ(device_type, kCuda);
+  K2_CHECK_GE(device_id, 0);
+  K2_CHECK_LT(device_id, kMaxNumCudaDevices);
+  return g_memory_stats[device_id + 1];
+}
+
+AtomicMemoryStats &GetAtomicMemoryStats(const Context &c) {
+  return GetAtomicMemoryStats(c.GetDeviceType(), c.GetDeviceId());
+}
+
+void UpdateMax(std::atomic<int64_t> *max_value, int64_t value) {
+  int64_t old_value = max_value->load(std::memory_order_relaxed);
+  while (old_value < value &&
+         !max_value->compare_exchange_weak(old_value, value,
+                                           std::memory_order_relaxed)) {
+  }
+}
+
+}  // namespace
+
+std::ostream &operator<<(std::ostream &os, const MemoryStats &stats) {
+  static const char *kCopyNames[MemcpyUnknown] = {
+      "host_to_host", "host_to_device", "device_to_host", "device_to_device"};
+  os << "num_allocs=" << stats.num_allocs << " num_frees=" << stats.num_frees
+     << " bytes_allocated=" << stats.bytes_allocated
+     << " bytes_live=" << stats.bytes_live
+     << " max_bytes_live=" << stats.max_bytes_live;
+  for (int32_t i = 0; i < MemcpyUnknown; ++i)
+    os << " num_copies_" << kCopyNames[i] << "=" << stats.num_copies[i]
+       << " bytes_copied_" << kCopyNames[i] << "=" << stats.bytes_copied[i];
+  os << " num_syncs=" << stats.num_syncs;
+  return os;
+}
+
+MemoryStats GetMemoryStats(DeviceType device_type, int32_t device_id) {
+  const AtomicMemoryStats &s = GetAtomicMemoryStats(device_type, device_id);
+  MemoryStats ans;
+  ans.num_allocs = s.num_allocs.load();
+  ans.num_frees = s.num_frees.load();
+  ans.bytes_allocated = s.bytes_allocated.load();
+  ans.bytes_live = s.bytes_live.load();
+  ans.max_bytes_live = s.max_bytes_live.load();
+  for (int32_t i = 0; i < MemcpyUnknown; ++i) {
+    ans.num_copies[i] = s.num_copies[i].load();
+    ans.bytes_copied[i] = s.bytes_copied[i].load();
+  }
+  ans.num_syncs = s.num_syncs.load();
+  return ans;
+}
+
+void ResetMaxBytesLive(DeviceType device_type, int32_t device_id) {
+  AtomicMemoryStats &s = GetAtomicMemoryStats(device_type, device_id);
+  s.max_bytes_live.store(s.bytes_live.load());
+}
+
+MemoryStatsScope::MemoryStatsScope(DeviceType device_type, int32_t device_id)
+    : device_type_(device_type), device_id_(device_id) {
+  start_ = GetMemoryStats(device_type, device_id);
+  ResetMaxBytesLive(device_type, device_id);
+}
+
+MemoryStatsScope::~MemoryStatsScope() {
+  // Restore the high-water mark of any enclosing scope (or of the program).
+  AtomicMemoryStats &s = GetAtomicMemoryStats(device_type_, device_id_);
+  UpdateMax(&s.max_bytes_live, start_.max_bytes_live);
+}
+
+MemoryStats MemoryStatsScope::Get() const {
+  MemoryStats ans = GetMemoryStats(device_type_, device_id_);
+  ans.num_allocs -= start_.num_allocs;
+  ans.num_frees -= start_.num_frees;
+  ans.bytes_allocated -= start_.bytes_allocated;
+  for (int32_t i = 0; i < MemcpyUnknown; ++i) {
+    ans.num_copies[i] -= start_.num_copies[i];
+    ans.bytes_copied[i] -= start_.bytes_copied[i];
+  }
+  ans.num_syncs -= start_.num_syncs;
+  return ans;
+}
+
+namespace {
+// The innermost SyncAudit on the current thread, or nullptr.
+thread_local SyncAudit *innermost_sync_audit = nullptr;
+// Set by AuditShapeSync() for a CUDA context, to the name of the operation
+// whose Sync() is about to be audited.
+thread_local const char *pending_shape_sync = nullptr;
+}  // namespace
+
+SyncAudit::SyncAudit(SyncAuditMode mode /*= kSyncAuditCount*/)
+    : mode_(mode), enclosing_(innermost_sync_audit) {
+  innermost_sync_audit = this;
+}
+
+SyncAudit::~SyncAudit() {
+  K2_CHECK_EQ(innermost_sync_audit, this)
+      << "SyncAudit objects must be destroyed in reverse order of creation";
+  innermost_sync_audit = enclosing_;
+}
+
+namespace internal {
+
+void RecordAlloc(const Context &c, std::size_t num_bytes) {
+  AtomicMemoryStats &s = GetAtomicMemoryStats(c);
+  int64_t n = static_cast<int64_t>(num_bytes);
+  s.num_allocs.fetch_add(1, std::memory_order_relaxed);
+  s.bytes_allocated.fetch_add(n, std::memory_order_relaxed);
+  int64_t live = s.bytes_live.fetch_add(n, std::memory_order_relaxed) + n;
+  UpdateMax(&s.max_bytes_live, live);
+}
+
+void RecordFree(const Context &c, std::size_t num_bytes) {
+  AtomicMemoryStats &s = GetAtomicMemoryStats(c);
+  s.num_frees.fetch_add(1, std::memory_order_relaxed);
+  s.bytes_live.fetch_sub(static_cast<int64_t>(num_bytes),
+                         std::memory_order_relaxed);
+}
+
+void RecordExtend(const Context &c, std::size_t num_bytes,
+                  std::size_t new_num_bytes) {
+  AtomicMemoryStats &s = GetAtomicMemoryStats(c);
+  int64_t n = static_cast<int64_t>(new_num_bytes - num_bytes);
+  s.bytes_allocated.fetch_add(n, std::memory_order_relaxed);
+  int64_t live = s.bytes_live.fetch_add(n, std::memory_order_relaxed) + n;
+  UpdateMax(&s.max_bytes_live, live);
+}
+
+static void RecordCopy(AtomicMemoryStats &s, MemoryCopyKind kind,
+                       std::size_t num_bytes) {
+  K2_CHECK_LT(static_cast<int32_t>(kind), static_cast<int32_t>(MemcpyUnknown));
+  s.num_copies[kind].fetch_add(1, std::memory_order_relaxed);
+  s.bytes_copied[kind].fetch_add(static_cast<int64_t>(num_bytes),
+                                 std::memory_order_relaxed);
+}
+
+void RecordCopy(const Context &dst_context, const Context &src_context,
+                MemoryCopyKind kind, std::size_t num_bytes) {
+  const Context &c = (kind == MemcpyHostToDevice ? dst_context : src_context);
+  RecordCopy(GetAtomicMemoryStats(c), kind, num_bytes);
+}
+
+void RecordCopy(MemoryCopyKind kind, std::size_t num_bytes) {
+  if (kind == MemcpyHostToHost) {
+    RecordCopy(GetAtomicMemoryStats(kCpu, -1), kind, num_bytes);
+    return;
+  }
+  // Only MemoryCopy() calls this; it's a blocking cudaMemcpy().
+  AuditSync(kCuda, "MemoryCopy()");
+  int32_t device_id;
+  auto ret = cudaGetDevice(&device_id);
+  K2_CHECK_CUDA_ERROR(ret);
+  RecordCopy(GetAtomicMemoryStats(kCuda, device_id), kind, num_bytes);
+}
+
+void RecordSync(const Context &c) {
+  GetAtomicMemoryStats(c).num_syncs.fetch_add(1, std::memory_order_relaxed);
+  const char *what = "Context::Sync()";
+  if (pending_shape_sync != nullptr) {
+    what = pending_shape_sync;
+    pending_shape_sync = nullptr;
+  }
+  AuditSync(c.GetDeviceType(), what);
+}
+
+void AuditShapeSync(const Context &c, const char *caller) {
+  if (innermost_sync_audit == nullptr) return;
+  // On the GPU the operation reads the size with a Sync(), which is the sync
+  // point that we report, under the name of the operation.
+  if (c.GetDeviceType() == kCuda)
+    pending_shape_sync = caller;
+  else
+    AuditSync(c.GetDeviceType(), caller);
+}
+
+void AuditSync(DeviceType device_type, const char *what) {
+  if (innermost_sync_audit == nullptr) return;
+  SyncAuditMode mode = kSyncAuditCount;
+  for (SyncAudit *audit = innermost_sync_audit; audit != nullptr;
+       audit = audit->enclosing_) {
+    ++audit->num_syncs_;
+    mode = std::max(mode, audit->mode_);
+  }
+  if (mode == kSyncAuditCount) return;
+  std::string where = (device_type == kCuda ? " on the GPU" : " on the CPU"),
+              scopes = GetProfileScopeNames();
+  if (!scopes.empty()) where += " in " + scopes;
+  if (mode == kSyncAuditForbid)
+    K2_LOG(FATAL) << what << where << " while a SyncAudit forbids syncs";
+  K2_LOG(WARNING) << "Sync point: " << what << where;
+}
+
+void EnablePeerAccess(int32_t src_device, int32_t dst_device) {
+  static std::mutex mutex;
+  static std::set<std::pair<int32_t, int32_t>> done;
+  std::lock_guard<std::mutex> lock(mutex);
+  if (!done.insert(std::make_pair(src_device, dst_device)).second) return;
+  int32_t can_access = 0;
+  auto ret = cudaDeviceCanAccessPeer(&can_access, src_device, dst_device);
+  K2_CHECK_CUDA_ERROR(ret);
+  if (!can_access) return;  // cudaMemcpyPeerAsync() will still work.
+  DeviceGuard guard(src_device);
+  ret = cudaDeviceEnablePeerAccess(dst_device, 0);
+  if (ret == cudaErrorPeerAccessAlreadyEnabled) {
+    (void)cudaGetLastError();  // clear the error
+    return;
+  }
+  K2_CHECK_CUDA_ERROR(ret);
+}
+
+}  // namespace internal
+
+namespace {
+
+// Alignment of allocations from ScratchContext; this is the alignment that
+// cudaMalloc() guarantees.
+constexpr std::size_t kScratchAlignment = 256;
+
+/*
+  See NewScratchContext() for documentation.
+ */
+class ScratchContext : public Context {
+ public:
+  ScratchContext(ContextPtr base, std::size_t block_bytes)
+      : base_(std::move(base)), next_block_bytes_(RoundUp(block_bytes)) {
+    K2_CHECK(base_ != nullptr);
+  }
+
+  ContextPtr GetCpuContext() override { return base_->GetCpuContext(); }
+
+  ContextPtr GetPinnedContext() override { return base_->GetPinnedContext(); }
+
+  DeviceType GetDeviceType() const override { return base_->GetDeviceType(); }
+
+  int32_t GetDeviceId() const override { return base_->GetDeviceId(); }
+
+  cudaStream_t GetCudaStream() const override {
+    return base_->GetCudaStream();
+  }
+
+  void *Allocate(std::size_t bytes, void **deleter_context) override {
+    if (bytes == 0) {
+      *deleter_context = nullptr;
+      return nullptr;
+    }
+    bytes = RoundUp(bytes);
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (current_ == nullptr || current_->used + bytes > current_->size) {
+      // The current block is full; it will be freed when everything in it
+      // has been freed.
+      if (current_ != nullptr && current_->num_live == 0) FreeBlock(current_);
+      std::size_t block_bytes = std::max(next_block_bytes_, bytes);
+      current_ = new Block;
+      current_->data = base_->Allocate(block_bytes, &current_->deleter_context);
+      current_->size = block_bytes;
+      current_->used = 0;
+      current_->num_live = 0;
+      current_->stream_used = false;
+      next_block_bytes_ = 2 * block_bytes;
+    }
+    void *ans = static_cast<char *>(current_->data) + current_->used;
+    current_->used += bytes;
+    current_->num_live++;
+    *deleter_context = current_;
+    return ans;
+  }
+
+  bool IsCompatible(const Context &other) const override {
+    return base_->IsCompatible(other);
+  }
+
+  bool ExtendInPlace(void *data, void **deleter_context, std::size_t num_bytes,
+                     std::size_t new_num_bytes) override {
+    // We can do this if `data` is the most recent allocation from the
+    // current block and the block has room.
+    Block *block = static_cast<Block *>(*deleter_context);
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (block != current_ ||
+        static_cast<char *>(data) + RoundUp(num_bytes) !=
+            static_cast<char *>(block->data) + block->used)
+      return false;
+    std::size_t extra = RoundUp(new_num_bytes) - RoundUp(num_bytes);
+    if (block->used + extra > block->size) return false;
+    block->used += extra;
+    return true;
+  }
+
+  void RecordStream(const void *data,
+                    const Context &stream_context) const override {
+    base_->RecordStream(data, stream_context);
+    // The current block can't be reused from the start when it's empty, as
+    // the base context would then not know that work on the stream may still
+    // be using it; it will be freed instead.
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (current_ == nullptr) return;
+    const char *p = static_cast<const char *>(data),
+               *begin = static_cast<const char *>(current_->data);
+    if (p >= begin && p < begin + current_->size) current_->stream_used = true;
+  }
+
+  void Deallocate(void *data, void *deleter_context) override {
+    if (data == nullptr) return;
+    Block *block = static_cast<Block *>(deleter_context);
+    std::lock_guard<std::mutex> lock(mutex_);
+    K2_CHECK_GT(block->num_live, 0);
+    if (--block->num_live != 0) return;
+    if (block == current_ && !block->stream_used) {
+      block->used = 0;  // Start again from the beginning of the block.
+      return;
+    }
+    if (block == current_) current_ = nullptr;
+    FreeBlock(block);
+  }
+
+  void Sync() const override { base_->Sync(); }
+
+  ~ScratchContext() override {
+    // Anything allocated from us holds a reference to us, so only the current
+    // block can remain, and it's empty.
+    if (current_ != nullptr) FreeBlock(current_);
+  }
+
+ private:
+  struct Block {
+    void *data;
+    void *deleter_context;
+    std::size_t size;      // number of bytes in the block
+    std::size_t used;      // number of bytes handed out so far
+    int32_t num_live;      // number of allocations not yet freed
+    // true if RecordStream() was called for memory in the block
+    bool stream_used;
+  };
+
+  static std::size_t RoundUp(std::size_t bytes) {
+    return (bytes + kScratchAlignment - 1) / kScratchAlignment *
+           kScratchAlignment;
+  }
+
+  void FreeBlock(Block *block) {
+    base_->Deallocate(block->data, block->deleter_context);
+    delete block;
+  }
+
+  ContextPtr base_;
+  std::size_t next_block_bytes_;
+  mutable std::mutex mutex_;
+  Block *current_ = nullptr;
+};
+
+
+/*
+  See NewHostMappedContext() for documentation.
+ */
+class HostMappedContext : public Context {
+ public:
+  explicit HostMappedContext(ContextPtr base) : base_(std::move(base)) {
+    K2_CHECK(base_ != nullptr);
+    K2_CHECK_EQ(base_->GetDeviceType(), kCuda);
+  }
+
+  ContextPtr GetCpuContext() override { return base_->GetCpuContext(); }
+
+  ContextPtr GetPinnedContext() override { return base_->GetPinnedContext(); }
+
+  DeviceType GetDeviceType() const override { return kCuda; }
+
+  int32_t GetDeviceId() const override { return base_->GetDeviceId(); }
+
+  cudaStream_t GetCudaStream() const override {
+    return base_->GetCudaStream();
+  }
+
+  ContextPtr Child() override {
+    return std::make_shared<HostMappedContext>(base_->Child());
+  }
+
+  void *Allocate(std::size_t bytes, void **deleter_context) override {
+    if (deleter_context != nullptr) *deleter_context = nullptr;
+    if (bytes == 0) return nullptr;
+    DeviceGuard guard(*base_);
+    void *p = nullptr;
+    auto ret =
+        cudaHostAlloc(&p, bytes, cudaHostAllocPortable | cudaHostAllocMapped);
+    K2_CHECK_CUDA_ERROR(ret);
+    void *device_p = nullptr;
+    ret = cudaHostGetDevicePointer(&device_p, p, 0);
+    K2_CHECK_CUDA_ERROR(ret);
+    K2_CHECK_EQ(device_p, p) << "Mapped memory needs unified addressing";
+    return p;
+  }
+
+  bool IsCompatible(const Context &other) const override {
+    return base_->IsCompatible(other);
+  }
+
+  void Deallocate(void *data, void * /*deleter_context*/) override {
+    if (data == nullptr) return;
+    // The device may still be using it.
+    base_->Sync();
+    auto ret = cudaFreeHost(data);
+    K2_CHECK_CUDA_ERROR(ret);
+  }
+
+  void Sync() const override { base_->Sync(); }
+
+ private:
+  ContextPtr base_;
+};
+
+}  // namespace
+
+ContextPtr NewScratchContext(ContextPtr base, std::size_t block_bytes) {
+  return std::make_shared<ScratchContext>(std::move(base), block_bytes);
+}
+
+ContextPtr NewHostMappedContext(ContextPtr base) {
+  K2_CHECK(base != nullptr);
+  if (base->GetDeviceType() == kCpu) return base;
+  return std::make_shared<HostMappedContext>(std::move(base));
+}
+
+void CudaGraph::Run(const std::function<void()> &f) {
+  Capture(f);
+  Replay();
+}
+
+void CudaGraph::Capture(const std::function<void()> &f) {
+  cudaStream_t stream = c_->GetCudaStream();
+  // K2_CUDA_SAFE_CALL synchronizes in debug mode, which is not allowed while
+  // capturing.
+  bool use_graph = (stream != kCudaStreamInvalid && internal::kDisableDebug);
+  DeviceGuard guard(*c_);
+  if (use_graph) {
+    cudaStreamCaptureStatus status;
+    auto ret = cudaStreamIsCapturing(stream, &status);
+    K2_CHECK_CUDA_ERROR(ret);
+    // If someone else is capturing, just let `f` be part of their graph.
+    use_graph = (status == cudaStreamCaptureStatusNone);
+  }
+  if (!use_graph) {
+    DestroyExec();
+    f_ = f;
+    return;
+  }
+  f_ = nullptr;
+
+  // Relaxed mode, because the caching allocator may need to call cudaMalloc().
+  auto ret = cudaStreamBeginCapture(stream, cudaStreamCaptureModeRelaxed);
+  K2_CHECK_CUDA_ERROR(ret);
+  f();
+  cudaGraph_t graph;
+  ret = cudaStreamEndCapture(stream, &graph);
+  K2_CHECK_CUDA_ERROR(ret)
+      << "Capture failed; the captured code must not synchronize.";
+
+  if (exec_ != nullptr) {
+    // Try to update the existing executable graph, which is much cheaper than
+    // instantiating a new one; this fails if the structure of the work
+    // changed, e.g. a different number of kernels was launched.
+#if CUDART_VERSION >= 12000
+    cudaGraphExecUpdateResultInfo info;
+    ret = cudaGraphExecUpdate(exec_, graph, &info);
+#elif CUDART_VERSION >= 10020
+    cudaGraphNode_t error_node;
+    cudaGraphExecUpdateResult result;
+    ret = cudaGraphExecUpdate(exec_, graph, &error_node, &result);
+#else
+    ret = cudaErrorNotSupported;
+#endif
+    if (ret != cudaSuccess) {
+      (void)cudaGetLastError();  // clear the error
+      DestroyExec();
+    }
+  }
+  if (exec_ == nullptr) {
+#if CUDART_VERSION >= 12000
+    ret = cudaGraphInstantiate(&exec_, graph, 0);
+#else
+    ret = cudaGraphInstantiate(&exec_, graph, nullptr, nullptr, 0);
+#endif
+    K2_CHECK_CUDA_ERROR(ret);
+    ++num_instantiations_;
+  }
+  ret = cudaGraphDestroy(graph);
+  K2_CHECK_CUDA_ERROR(ret);
+}
+
+void CudaGraph::Replay() {
+  if (exec_ == nullptr) {
+    K2_CHECK(f_) << "Replay() called before Capture()";
+    f_();
+    return;
+  }
+  DeviceGuard guard(*c_);
+  auto ret = cudaGraphLaunch(exec_, c_->GetCudaStream());
+  K2_CHECK_CUDA_ERROR(ret);
+}
+
+void CudaGraph::DestroyExec() {
+  if (exec_ == nullptr) return;
+  DeviceGuard guard(*c_);
+  auto ret = cudaGraphExecDestroy(exec_);
+  K2_CHECK_CUDA_ERROR(ret);
+  exec_ = nullptr;
+}
+
+CudaGraph::~CudaGraph() { DestroyExec(); }
+
 RegionPtr NewRegion(ContextPtr &context, std::size_t num_bytes) {
   // .. fairly straightforward.  Sets bytes_used to num_bytes, caller can
   // overwrite if needed.
@@ -25,6 +709,7 @@ RegionPtr NewRegion(ContextPtr &context, std::size_t num_bytes) {
   ans->data = context->Allocate(num_bytes, &ans->deleter_context);
   ans->num_bytes = num_bytes;
   ans->bytes_used = num_bytes;
+  internal::RecordAlloc(*context, num_bytes);
   return ans;
 }
 
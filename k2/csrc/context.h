@@ -14,9 +14,14 @@
 #define K2_CSRC_CONTEXT_H_
 
 #include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <condition_variable>
+#include <cstring>
+#include <functional>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <ostream>
 #include <type_traits>
 #include <vector>
@@ -73,10 +78,10 @@ class Context : public std::enable_shared_from_this<Context> {
 
   // Returns a (CPU) context that will allocate pinned memory.  (This is CPU
   // memory that's pinned for faster GPU memory transfers).  May or may not
-  // return the same value as ::k2::GetCpuContext()... this is so, for instance,
-  // if you have a GPU PyTorch context you can get a CPU PyTorch context.
-  // NOTE: for now this won't do anything, we can do without pinned memory
-  // for the time being.
+  // return the same value as ::k2::GetPinnedContext()... this is so, for
+  // instance, if you have a GPU PyTorch context you can get a pinned context
+  // that uses PyTorch's allocator.  The returned context is compatible with
+  // CPU contexts (its GetDeviceType() is kCpu).
   virtual ContextPtr GetPinnedContext() = 0;
 
   // Returns kCuda if this device is a CUDA device, or kCpu if it's the CPU.
@@ -123,12 +128,68 @@ class Context : public std::enable_shared_from_this<Context> {
   */
   virtual void Deallocate(void *data, void *deleter_context) = 0;
 
+  /*
+    Tries to grow memory that was returned by Allocate() without moving it,
+    so that it can be extended without a copy (see Region::Extend()).  The
+    default implementation always fails; contexts override it when they can
+    do this cheaply, e.g. because they rounded up the size of the allocation
+    or can remap pages.
+
+           @param [in] data    Pointer returned by Allocate()
+           @param [in,out] deleter_context  The deleter_context that
+                              Allocate() output for `data`; it may be
+                              changed, and whatever it is on return should be
+                              supplied to Deallocate().
+           @param [in] num_bytes   The number of bytes requested when `data`
+                              was allocated (or last extended)
+           @param [in] new_num_bytes  The number of bytes needed; must be
+                              > num_bytes.
+           @return  Returns true if, on return, the memory starting at `data`
+                    is valid for `new_num_bytes` bytes (with its first
+                    `num_bytes` bytes unchanged); false if nothing was done.
+  */
+  virtual bool ExtendInPlace(void * /*data*/, void ** /*deleter_context*/,
+                             std::size_t /*num_bytes*/,
+                             std::size_t /*new_num_bytes*/) {
+    return false;
+  }
+
+  /*
+    Called when memory of this context is used by work queued on the CUDA
+    stream of `stream_context` that may still be running when the call
+    returns, e.g. an asynchronous copy to or from the device (see
+    MemoryCopyAsync()).  Contexts that cache host memory and hand it out
+    again after it is freed must not do so until that work has finished.  The
+    default implementation does nothing, which is right for device memory
+    (it is reused in stream order) and for pageable host memory (CUDA copies
+    it synchronously).
+
+           @param [in] data    Pointer to memory allocated from this context;
+                              it may point inside an allocation.
+           @param [in] stream_context  The CUDA context whose stream uses
+                              `data`.
+  */
+  virtual void RecordStream(const void * /*data*/,
+                            const Context & /*stream_context*/) const {}
+
   /*
     Return true if this is the same device as 'other' (essentially: that it
     lives in the same physical memory space).  Must always return true if this
     == &other.  */
   virtual bool IsCompatible(const Context &other) const = 0;
 
+  /*
+    Returns a context on the same device that may be used for work that should
+    run in parallel with work on this context, e.g. in a task run by
+    BackgroundRunner.  For CUDA contexts, the child has its own CUDA stream;
+    work queued on it will start after any work already queued on this
+    context's stream at the time Child() is called.  Memory allocated from the
+    child may be used by the parent after the child's work has finished
+    (e.g. after child->Sync()) and the child has been destroyed.  For CPU
+    contexts this just returns this context.
+   */
+  virtual ContextPtr Child() { return shared_from_this(); }
+
   /*
     For CPU contexts, does nothing.  For CUDA contexts, synchronizes the CUDA
     stream associated with the context.  This will ensure, for instance, that
@@ -146,9 +207,199 @@ enum MemoryCopyKind {
   MemcpyUnknown
 };
 
-// Note currently we just support single GPU device, but finally we may need to
-// handle different GPU devices on multiple machines, that's also the reason
-// that we pass `Context` instead of `DeviceType` as the input parameter here.
+/*
+  Counters of memory allocation and transfer activity, for one device (the CPU,
+  or one CUDA device).  These are kept for all contexts regardless of how they
+  allocate memory (native or PyTorch), and are updated with atomic operations
+  so they are safe to read from any thread.  See GetMemoryStats() and
+  MemoryStatsScope.
+ */
+struct MemoryStats {
+  // Number of memory regions allocated, including reallocations done by
+  // Region::Extend().
+  int64_t num_allocs = 0;
+  // Number of memory regions freed (reallocations also count as a free).
+  int64_t num_frees = 0;
+  // Total number of bytes allocated.
+  int64_t bytes_allocated = 0;
+  // Number of bytes currently allocated and not yet freed.
+  int64_t bytes_live = 0;
+  // High-water mark of `bytes_live`.
+  int64_t max_bytes_live = 0;
+  // Number of copies and number of bytes copied, indexed by MemoryCopyKind
+  // (MemcpyUnknown is not used).  Host-to-host copies are attributed to the
+  // CPU, and copies involving a CUDA device to that device (for
+  // device-to-device copies, the source device).
+  int64_t num_copies[MemcpyUnknown] = {0};
+  int64_t bytes_copied[MemcpyUnknown] = {0};
+  // Number of calls to Context::Sync() for CUDA contexts (on the CPU these
+  // are no-ops and are not counted).
+  int64_t num_syncs = 0;
+};
+
+std::ostream &operator<<(std::ostream &os, const MemoryStats &stats);
+
+/*
+  Returns the current memory statistics of the device given by `device_type`
+  and `device_id` (the device id is ignored for kCpu).  The counters are
+  cumulative since program start; use MemoryStatsScope to measure a part of
+  the program.
+ */
+MemoryStats GetMemoryStats(DeviceType device_type, int32_t device_id = 0);
+
+/*
+  Resets the high-water mark `max_bytes_live` of the given device to its
+  current `bytes_live`.
+ */
+void ResetMaxBytesLive(DeviceType device_type, int32_t device_id = 0);
+
+/*
+  Scoped snapshot of MemoryStats, e.g.:
+
+     MemoryStatsScope scope(kCuda, 0);
+     ... do some work ...
+     K2_LOG(INFO) << "Stats: " << scope.Get();
+
+  Get() returns the counters accumulated since the object was constructed,
+  except for `bytes_live`, which is the current value, and `max_bytes_live`,
+  which is the high-water mark of `bytes_live` since the object was constructed.
+  Scopes may be nested as long as they are destroyed in reverse order of
+  construction (the enclosing scope's high-water mark is restored when an inner
+  scope is destroyed).
+ */
+class MemoryStatsScope {
+ public:
+  explicit MemoryStatsScope(DeviceType device_type, int32_t device_id = 0);
+  ~MemoryStatsScope();
+
+  MemoryStats Get() const;
+
+ private:
+  DeviceType device_type_;
+  int32_t device_id_;
+  MemoryStats start_;
+};
+
+enum SyncAuditMode {
+  kSyncAuditCount,  // Only count the sync points.
+  kSyncAuditLog,    // Count them, and log each with K2_LOG(WARNING).
+  kSyncAuditForbid  // Each sync point is a fatal error.
+};
+
+namespace internal {
+// Counts a sync point (see SyncAudit) on `device_type`, if a SyncAudit is
+// active on this thread; `what` is the name of the operation.
+void AuditSync(DeviceType device_type, const char *what);
+}  // namespace internal
+
+/*
+  Opt-in auditing of the points where the host waits for a device, which
+  stall the pipeline of kernels on the GPU.  While an object of this class
+  exists, each such point reached on the current thread is counted in it (and
+  in the enclosing objects, which may be nested) and, depending on the mode,
+  logged or treated as a fatal error.  The sync points are:
+
+    - Context::Sync() on a CUDA context, as done e.g. by
+      Array1::To(GetCpuContext()) and Array1::operator[];
+    - synchronous MemoryCopy() that is not host-to-host;
+    - RaggedShape operations that have to read a size from the device (see
+      GetNumShapeSyncs() in ragged.h).  These are also audited for CPU shapes,
+      where they don't cost anything, so that the code paths that would sync
+      on the GPU can be found by running on the CPU.
+
+  The message says which operation it was and, as the call site, the
+  K2_PROFILE_SCOPE()s it happened in (see profile.h), e.g.
+  "RaggedShape::TotSize() on the GPU in IntersectDensePruned >
+  IntersectDensePruned:PropagateForward".  E.g., in a test:
+
+     SyncAudit audit;
+     ... do some work ...
+     EXPECT_EQ(audit.NumSyncs(), 0);
+ */
+class SyncAudit {
+ public:
+  explicit SyncAudit(SyncAuditMode mode = kSyncAuditCount);
+  ~SyncAudit();
+
+  // Returns the number of sync points reached since construction or Reset().
+  int64_t NumSyncs() const { return num_syncs_; }
+  void Reset() { num_syncs_ = 0; }
+
+  SyncAudit(const SyncAudit &) = delete;
+  SyncAudit &operator=(const SyncAudit &) = delete;
+
+ private:
+  friend void internal::AuditSync(DeviceType device_type, const char *what);
+
+  SyncAuditMode mode_;
+  int64_t num_syncs_ = 0;
+  SyncAudit *enclosing_;  // The enclosing object on this thread, if any.
+};
+
+namespace internal {
+// These are called by Region, NewRegion(), the memory copy functions and
+// CUDA contexts' Sync() to update the MemoryStats.
+void RecordAlloc(const Context &c, std::size_t num_bytes);
+void RecordFree(const Context &c, std::size_t num_bytes);
+// For allocations that have been grown without being moved.
+void RecordExtend(const Context &c, std::size_t num_bytes,
+                  std::size_t new_num_bytes);
+void RecordCopy(const Context &dst_context, const Context &src_context,
+                MemoryCopyKind kind, std::size_t num_bytes);
+// For when we don't know the contexts; the copy is attributed to the current
+// CUDA device unless it's host-to-host.
+void RecordCopy(MemoryCopyKind kind, std::size_t num_bytes);
+void RecordSync(const Context &c);
+// Called by RecordShapeSync() (see ragged.h); `caller` is the name of the
+// RaggedShape operation.
+void AuditShapeSync(const Context &c, const char *caller);
+
+// Enables peer-to-peer access from device `src_device` to `dst_device`, if
+// the hardware supports it, so that cudaMemcpyPeerAsync() doesn't need to go
+// through host memory.  Only the first call for a given pair does anything.
+void EnablePeerAccess(int32_t src_device, int32_t dst_device);
+}  // namespace internal
+
+/*
+  Makes `gpu_id` the current CUDA device for the lifetime of this object, and
+  restores the previous one in the destructor.  Kernels and CUDA API calls
+  that use a stream must be issued while the stream's device is current.
+  Does nothing if gpu_id < 0 (e.g. for CPU).
+ */
+class DeviceGuard {
+ public:
+  explicit DeviceGuard(int32_t gpu_id) : old_gpu_id_(-1), gpu_id_(gpu_id) {
+    if (gpu_id_ < 0) return;
+    auto ret = cudaGetDevice(&old_gpu_id_);
+    K2_CHECK_CUDA_ERROR(ret);
+    if (old_gpu_id_ != gpu_id_) {
+      ret = cudaSetDevice(gpu_id_);
+      K2_CHECK_CUDA_ERROR(ret);
+    }
+  }
+  // Makes the device of `c` current, if it's a CUDA context.
+  explicit DeviceGuard(const Context &c)
+      : DeviceGuard(c.GetDeviceType() == kCuda ? c.GetDeviceId() : -1) {}
+
+  ~DeviceGuard() {
+    if (gpu_id_ >= 0 && old_gpu_id_ != gpu_id_) {
+      auto ret = cudaSetDevice(old_gpu_id_);
+      K2_CHECK_CUDA_ERROR(ret);
+    }
+  }
+
+  DeviceGuard(const DeviceGuard &) = delete;
+  DeviceGuard &operator=(const DeviceGuard &) = delete;
+
+ private:
+  int32_t old_gpu_id_;
+  int32_t gpu_id_;
+};
+
+// Note: contexts of different CUDA devices both give MemcpyDeviceToDevice;
+// MemoryCopyAsync() does a peer-to-peer copy if their device ids differ.  We
+// pass `Context` instead of `DeviceType` so that, in future, we may handle
+// devices on multiple machines.
 inline MemoryCopyKind GetMemoryCopyKind(const Context &src,
                                         const Context &dst) {
   if (src.GetDeviceType() == kCpu && dst.GetDeviceType() == kCpu) {
@@ -165,24 +416,174 @@ inline MemoryCopyKind GetMemoryCopyKind(const Context &src,
   }
 }
 
+inline cudaMemcpyKind GetCudaMemcpyKind(MemoryCopyKind kind) {
+  switch (kind) {
+    case MemcpyHostToHost:
+      return cudaMemcpyHostToHost;
+    case MemcpyHostToDevice:
+      return cudaMemcpyHostToDevice;
+    case MemcpyDeviceToHost:
+      return cudaMemcpyDeviceToHost;
+    case MemcpyDeviceToDevice:
+      return cudaMemcpyDeviceToDevice;
+    default:
+      K2_LOG(FATAL) << "Unsupported MemoryCopyKind " << kind;
+      return cudaMemcpyDefault;  // unreachable code
+  }
+}
+
+/*
+  Synchronous copy (like memcpy()), using the default CUDA stream.  Prefer
+  MemoryCopyAsync() if you know the contexts of `dst` and `src`.
+ */
 inline void MemoryCopy(void *dst, const void *src, std::size_t count,
                        MemoryCopyKind kind) {
-  std::map<MemoryCopyKind, cudaMemcpyKind> copy_kind_mappings = {
-      {MemcpyHostToHost, cudaMemcpyHostToHost},
-      {MemcpyHostToDevice, cudaMemcpyHostToDevice},
-      {MemcpyDeviceToHost, cudaMemcpyDeviceToHost},
-      {MemcpyDeviceToDevice, cudaMemcpyDeviceToDevice}};
-  auto it = copy_kind_mappings.find(kind);
-  K2_CHECK(it != copy_kind_mappings.end());
-  auto ret = cudaMemcpy(dst, src, count, it->second);
+  auto ret = cudaMemcpy(dst, src, count, GetCudaMemcpyKind(kind));
   K2_CHECK_CUDA_ERROR(ret);
+  internal::RecordCopy(kind, count);
 }
 
 /*
-  NOTE: let's leave this for later, this won't be needed initially.
+  Copy `count` bytes from `src`, which is memory of `src_context`, to `dst`,
+  which is memory of `dst_context`.  Copies involving a CUDA device are queued
+  on the CUDA stream of the context that owns the device memory (for
+  device-to-device copies, that of `src_context`, and if the two contexts use
+  different streams they will be made to wait for each other), so this will
+  generally return before the copy has completed.
+
+  CAUTION: on return, the data in `dst` is only guaranteed to be available on
+  the host for host-to-host copies.  For device-to-host copies you must call
+  src_context.Sync() before reading `dst`; this is deferred to the caller so
+  that several copies can be issued before synchronizing once.  For copies
+  between host and device, the host memory is passed to RecordStream() of its
+  context, so that pinned memory freed before the copy has finished is not
+  reused until it has; the memory itself must not be written (or, for
+  host-to-device copies, read) by the host in the meantime.
+ */
+inline void MemoryCopyAsync(void *dst, const void *src, std::size_t count,
+                            const Context &dst_context,
+                            const Context &src_context) {
+  if (count == 0) return;
+  MemoryCopyKind kind = GetMemoryCopyKind(src_context, dst_context);
+  internal::RecordCopy(dst_context, src_context, kind, count);
+  if (kind == MemcpyHostToHost) {
+    memcpy(dst, src, count);
+    return;
+  }
+  cudaStream_t dst_stream = dst_context.GetCudaStream(),
+               src_stream = src_context.GetCudaStream();
+  if (kind == MemcpyHostToDevice) {
+    DeviceGuard guard(dst_context);
+    auto ret = cudaMemcpyAsync(dst, src, count, cudaMemcpyHostToDevice,
+                               dst_stream);
+    K2_CHECK_CUDA_ERROR(ret);
+    src_context.RecordStream(src, dst_context);
+    return;
+  }
+  DeviceGuard guard(src_context);
+  if (kind == MemcpyDeviceToHost) {
+    auto ret = cudaMemcpyAsync(dst, src, count, cudaMemcpyDeviceToHost,
+                               src_stream);
+    K2_CHECK_CUDA_ERROR(ret);
+    dst_context.RecordStream(dst, src_context);
+  } else if (src_stream == dst_stream) {
+    auto ret = cudaMemcpyAsync(dst, src, count, cudaMemcpyDeviceToDevice,
+                               src_stream);
+    K2_CHECK_CUDA_ERROR(ret);
+  } else {
+    // `dst` may have been in use by work on dst_stream and `src` is produced
+    // by work on src_stream, so the copy needs to wait for both; and work on
+    // dst_stream after this call needs to wait for the copy.  An event must
+    // be recorded while its stream's device is current, but a stream may wait
+    // for an event of another device.
+    int32_t src_device = src_context.GetDeviceId(),
+            dst_device = dst_context.GetDeviceId();
+    auto record_event = [](int32_t device, cudaStream_t stream,
+                           cudaStream_t waiting_stream) -> void {
+      DeviceGuard guard(device);
+      cudaEvent_t event;
+      auto ret = cudaEventCreateWithFlags(&event, cudaEventDisableTiming);
+      K2_CHECK_CUDA_ERROR(ret);
+      ret = cudaEventRecord(event, stream);
+      K2_CHECK_CUDA_ERROR(ret);
+      ret = cudaStreamWaitEvent(waiting_stream, event, 0);
+      K2_CHECK_CUDA_ERROR(ret);
+      // This is OK even though the event hasn't completed; its resources
+      // will be released when it does.
+      ret = cudaEventDestroy(event);
+      K2_CHECK_CUDA_ERROR(ret);
+    };
+    record_event(dst_device, dst_stream, src_stream);
+    if (src_device == dst_device) {
+      auto ret = cudaMemcpyAsync(dst, src, count, cudaMemcpyDeviceToDevice,
+                                 src_stream);
+      K2_CHECK_CUDA_ERROR(ret);
+    } else {
+      internal::EnablePeerAccess(src_device, dst_device);
+      auto ret = cudaMemcpyPeerAsync(dst, dst_device, src, src_device, count,
+                                     src_stream);
+      K2_CHECK_CUDA_ERROR(ret);
+    }
+    record_event(src_device, src_stream, dst_stream);
+  }
+}
 
+/*
+  Like MemoryCopyAsync(), but copies `height` rows of `width` bytes each, from
+  rows that start `src_pitch` bytes apart in `src` to rows that start
+  `dst_pitch` bytes apart in `dst` (like cudaMemcpy2DAsync()).  This lets us
+  transfer a matrix with padded rows, such as a slice of a padded nnet output,
+  without first making it contiguous.  The CAUTION for MemoryCopyAsync() about
+  when the data is available applies here too.
+ */
+inline void MemoryCopy2DAsync(void *dst, std::size_t dst_pitch,
+                              const void *src, std::size_t src_pitch,
+                              std::size_t width, std::size_t height,
+                              const Context &dst_context,
+                              const Context &src_context) {
+  if (width == 0 || height == 0) return;
+  if (height == 1 || (dst_pitch == width && src_pitch == width)) {
+    MemoryCopyAsync(dst, src, width * height, dst_context, src_context);
+    return;
+  }
+  K2_CHECK_GE(dst_pitch, width);
+  K2_CHECK_GE(src_pitch, width);
+  MemoryCopyKind kind = GetMemoryCopyKind(src_context, dst_context);
+  cudaStream_t dst_stream = dst_context.GetCudaStream(),
+               src_stream = src_context.GetCudaStream();
+  if (kind == MemcpyDeviceToDevice &&
+      (src_stream != dst_stream ||
+       src_context.GetDeviceId() != dst_context.GetDeviceId())) {
+    // This is rare, so we just let MemoryCopyAsync() order the streams for
+    // each row.
+    for (std::size_t i = 0; i != height; ++i)
+      MemoryCopyAsync(static_cast<char *>(dst) + i * dst_pitch,
+                      static_cast<const char *>(src) + i * src_pitch, width,
+                      dst_context, src_context);
+    return;
+  }
+  internal::RecordCopy(dst_context, src_context, kind, width * height);
+  if (kind == MemcpyHostToHost) {
+    for (std::size_t i = 0; i != height; ++i)
+      memcpy(static_cast<char *>(dst) + i * dst_pitch,
+             static_cast<const char *>(src) + i * src_pitch, width);
+    return;
+  }
+  bool to_device = (kind == MemcpyHostToDevice);
+  DeviceGuard guard(to_device ? dst_context : src_context);
+  auto ret = cudaMemcpy2DAsync(dst, dst_pitch, src, src_pitch, width, height,
+                               GetCudaMemcpyKind(kind),
+                               to_device ? dst_stream : src_stream);
+  K2_CHECK_CUDA_ERROR(ret);
+  if (to_device)
+    src_context.RecordStream(src, dst_context);
+  else if (kind == MemcpyDeviceToHost)
+    dst_context.RecordStream(dst, src_context);
+}
+
+/*
   Used to run a task "in the background" (with a thread pool), for parallelism.
-  This should generally be used together with the GetChild() of the context
+  This should generally be used together with the Child() of the context
   object so that in case we're using a GPU the GPU stream doesn't cause the
   tasks to be serialized.
 
@@ -191,36 +592,90 @@ inline void MemoryCopy(void *dst, const void *src, std::size_t count,
      BackgroundRunner br;
      for (int32_t i = 0; i < N; ++i) {
         std::function<void()> lambda = [=] () {
-        ContextPtr c_child = c.Child();
+           ContextPtr c_child = c->Child();
            // do something here, possibly with multiple steps...
-        }
+        };
         br.Background(lambda);
      }
      br.Wait();
 
   This is necessary because if you do something that isn't just a simple
   Eval() but requires, for instance, copying a number back to the CPU,
-  just parallelizing the GPU streams using c.Child() isn't enough because
+  just parallelizing the GPU streams using c->Child() isn't enough because
   it will synchronize in the loop.
+
+  The tasks are run by a process-wide pool of threads, so the number of threads
+  running background tasks at any one time is limited (by default, to the
+  number of hardware threads; see SetNumBackgroundThreads()).  Tasks launched
+  from within a background task are run directly in the calling thread, which
+  avoids deadlocks when all the pool's threads are waiting.
  */
 class BackgroundRunner {
  public:
+  BackgroundRunner() : num_pending_(0) {}
+
   // TODO: may at some point add in a "cost estimate" that can help the code
-  // decide whether the overhead of creating a thread is worth it.
-  // Also, there will be a global semaphore that limits the number of threads
-  // that can exist at any one time.
-  void Background(std::function<void()> &f);
+  // decide whether the overhead of using a thread is worth it.
+  void Background(const std::function<void()> &f);
 
   //  Waits for all (CPU) threads launched by Background() on this object since
   // the last call to Wait(), to terminate.
   void Wait();
 
+  // Calls Wait().
+  ~BackgroundRunner() { Wait(); }
+
  private:
-  // TODO:  My current thinking on this is for Background() to create threads
-  // that Wait() can wait on, and to have the number of threads limited by a
-  // global semaphore.
+  void TaskFinished();
+
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  int32_t num_pending_;  // number of tasks launched and not yet finished.
 };
 
+/*
+  Sets the number of threads in the pool used by BackgroundRunner (and by
+  ParallelFor(), hence by Eval() and Eval2() on CPU).  Must be called before
+  the pool is first used, will crash otherwise.  num_threads must be > 0;
+  with num_threads == 1, CPU code will effectively be single-threaded.
+ */
+void SetNumBackgroundThreads(int32_t num_threads);
+
+/*
+  On CPU, Eval() and Eval2() use multiple threads only if there are at least
+  this many elements; for fewer, the overhead of using threads would not be
+  worth it.
+ */
+constexpr int32_t kMinParallelEvalSize = 1 << 14;
+
+/*
+  Calls f(begin, end) for a set of non-overlapping ranges [begin, end) that
+  together cover [0, n), using the threads of BackgroundRunner's pool, and
+  returns once all calls have finished.  Each range will have at least
+  `min_size` elements (except if n < min_size).  If called from a thread of the
+  pool (e.g. inside a background task), everything runs in the calling thread.
+ */
+void ParallelFor(int32_t n, int32_t min_size,
+                 const std::function<void(int32_t, int32_t)> &f);
+
+// The type of the functions that can implement ParallelFor(); see
+// SetParallelForImpl().
+using ParallelForImpl =
+    void (*)(int32_t n, int32_t min_size,
+             const std::function<void(int32_t, int32_t)> &f);
+
+/*
+  Makes ParallelFor(), hence Eval() and Eval2() on CPU, call `impl` instead of
+  using the threads of BackgroundRunner's pool, e.g. so that k2 shares the
+  threads of an external toolkit rather than oversubscribing the cores; with
+  nullptr, the pool is used again.  The Python module uses TorchParallelFor()
+  (see pytorch_context.h), so the number of threads of k2's CPU code is the
+  one set with torch.set_num_threads().  `impl` must satisfy the contract of
+  ParallelFor().  It can be changed at any time; calls that have started are
+  not affected.
+ */
+void SetParallelForImpl(ParallelForImpl impl);
+
 template <typename T1, typename T2>
 bool IsCompatible(const T1 &t1, const T2 &t2) {
   // suppose both T1 and T2 have member method `Context`
@@ -268,6 +723,21 @@ struct Region : public std::enable_shared_from_this<Region> {
                       // points to this Region (this is relevant for things that
                       // behave like resizable vectors).
 
+  // Incremented whenever a non-const pointer to the data is handed out (by
+  // GetData(), and by the non-const Data() of Array1, Array2 and Tensor) or
+  // the region is reallocated, i.e. whenever the data may have been
+  // modified.  Results computed from the data may be cached as long as
+  // `version` is unchanged; see MarkModified().
+  std::atomic<int64_t> version{0};
+
+  // A result computed from the data and cached here, for the code that set
+  // it to interpret (currently the FSA properties computed by
+  // GetFsaVecBasicProperties()).  Only valid if `version` has not changed
+  // since; access with std::atomic_load() / std::atomic_store().
+  std::shared_ptr<void> cached_result;
+
+  void MarkModified() { version.fetch_add(1, std::memory_order_relaxed); }
+
   // You need template arg to invoke this, e.g. region->GetData<int32_t>();
   // You can also choose to template additionally on the device-type, like
   // region->GetData<int32_t,kCuda>(), to activate a check that it's on the
@@ -275,39 +745,69 @@ struct Region : public std::enable_shared_from_this<Region> {
   template <typename T = void, DeviceType d = kUnk>
   T *GetData() {
     if (d != kUnk) K2_CHECK_EQ(d, context->GetDeviceType());
+    MarkModified();
     return reinterpret_cast<T *>(data);
   }
 
-  /* Extends the region (this is like realloc; and in fact, in future, we might
-     decide to use realloc-type things inside the implementation).
+  /* Extends the region (this is like realloc).
         @param [in] new_bytes_used   New size of this region; if this is
                          <= bytes_used nothing is done.  At exit, the
                          bytes_used of this region will equal new_bytes_used.
                          if num_bytes < new_bytes_used this region will be
-                         reallocated according to some heuristic (e.g. the
-                         larger of double the current size, or
-                         the next power of 2 greater than `new_bytes_used`). */
+                         grown to the larger of double the current size, or
+                         the next power of 2 greater than `new_bytes_used`:
+                         in place if the context supports it (see
+                         Context::ExtendInPlace()), else by reallocating
+                         and copying. */
   void Extend(size_t new_bytes_used) {
     if (new_bytes_used <= bytes_used) return;
-    if (num_bytes < new_bytes_used) {  // reallocate and copy
+    if (num_bytes < new_bytes_used) {
       size_t new_size = std::max<size_t>(num_bytes * 2, new_bytes_used);
       size_t i = 4;
       while (i < new_size / 8) i <<= 3;
       while (i < new_size) i <<= 1;
       new_size = i;  // Round up `new_size` to a power of 2.
-      void *new_deleter_context;
-      void *new_data = context->Allocate(new_size, &new_deleter_context);
-      auto kind = GetMemoryCopyKind(*context, *context);
-      MemoryCopy(new_data, data, bytes_used, kind);
-      context->Deallocate(data, deleter_context);
-      data = new_data;
-      deleter_context = new_deleter_context;
-      num_bytes = new_size;
+      Reserve(new_size);
     }
     bytes_used = new_bytes_used;
   }
 
-  ~Region() { context->Deallocate(data, deleter_context); }
+  /* Makes sure the region has at least `new_num_bytes` bytes allocated,
+     without changing bytes_used; if it has to grow, it grows to exactly
+     `new_num_bytes`, in place if the context supports it (see
+     Context::ExtendInPlace()), else by reallocating and copying the first
+     bytes_used bytes. */
+  void Reserve(size_t new_num_bytes) {
+    if (new_num_bytes <= num_bytes) return;
+    if (data != nullptr &&
+        context->ExtendInPlace(data, &deleter_context, num_bytes,
+                               new_num_bytes)) {
+      internal::RecordExtend(*context, num_bytes, new_num_bytes);
+      num_bytes = new_num_bytes;
+      return;
+    }
+    // reallocate and copy
+    MarkModified();
+    void *new_deleter_context;
+    void *new_data = context->Allocate(new_num_bytes, &new_deleter_context);
+    // It's safe not to synchronize before the Deallocate() below: device
+    // memory is only reused in the order of the stream this copy is queued
+    // on, and host memory is copied synchronously (pinned memory that other
+    // streams may still be using is not reused before they are done with
+    // it; see Context::RecordStream()).
+    MemoryCopyAsync(new_data, data, bytes_used, *context, *context);
+    context->Deallocate(data, deleter_context);
+    internal::RecordFree(*context, num_bytes);
+    internal::RecordAlloc(*context, new_num_bytes);
+    data = new_data;
+    deleter_context = new_deleter_context;
+    num_bytes = new_num_bytes;
+  }
+
+  ~Region() {
+    context->Deallocate(data, deleter_context);
+    internal::RecordFree(*context, num_bytes);
+  }
 };
 
 using RegionPtr = std::shared_ptr<Region>;
@@ -324,9 +824,103 @@ ContextPtr GetCpuContext();
 // from PyTorch
 ContextPtr GetCudaContext(int32_t gpu_id = -1);
 
-// Returns a (CPU) context that will allocate pinned memory.
+// Returns a (CPU) context that will allocate pinned memory.  Pinned memory is
+// cached internally (see SetMaxCachedMemory()), so it's OK to allocate and
+// free it often.
 ContextPtr GetPinnedContext();
 
+/*
+  Returns a new "scratch" context that wraps `base`: it allocates memory by
+  bumping a pointer inside large blocks allocated from `base`, and deallocation
+  only decrements a counter; when everything allocated from a block has been
+  freed, the block is reused from the start.  This is intended for the many
+  short-lived temporaries created inside algorithms, e.g.:
+
+     ContextPtr c = src.Context();
+     ContextPtr scratch = NewScratchContext(c);
+     Array1<int32_t> temp1(scratch, n), temp2(scratch, m);
+     ...
+     Array1<int32_t> ans(c, k);  // the result should come from `c`.
+
+  so that the whole working set of a call costs one allocation and one free in
+  `base` (more if it outgrows `block_bytes`, in which case each new block is at
+  least twice as large as the previous one).  Memory that is still allocated
+  keeps the context alive, so it's not an error for an Array allocated with it
+  to outlive the function, but that would prevent the block from being reused.
+
+  The returned context has the same device, stream and compatibility as
+  `base`.  Reuse of device memory is ordered by `base`'s CUDA stream, so
+  arrays allocated from it should only be used on that stream (see Child()
+  for a way to get other streams).  It is thread-safe.
+
+     @param [in] base   The context to allocate the blocks from.
+     @param [in] block_bytes  Size of the first block to allocate; a good
+                        value is an estimate of the working set of the
+                        algorithm.
+ */
+ContextPtr NewScratchContext(ContextPtr base,
+                             std::size_t block_bytes = 1 << 20);
+
+/*
+  Returns a new context that allocates pinned host memory which is mapped
+  into the address space of the device of `base`, so that its kernels read
+  and write it directly over the bus ("zero-copy") without it taking any
+  device memory.  This is for large arrays of which each kernel only touches
+  a small part, e.g. a decoding graph too large for the device, of which
+  each frame of IntersectDensePruned() only reads the arcs leaving the active
+  states (see PrepareDenseIntersectGraph()).  Accesses are much slower than
+  to device memory, however.
+
+  The returned context has the same device, stream and compatibility as
+  `base`, so arrays allocated from it can be used wherever those of `base`
+  can.  It needs unified addressing, where the device pointer of mapped
+  memory is the same as the host pointer (as on all 64-bit platforms).  The
+  memory is not cached, so allocation is slow.  Copy to and from its arrays
+  with kernels (see CopyDenseIntersectGraph()), as MemoryCopy() would pass
+  the wrong direction to cudaMemcpy().  If `base` is a CPU context, it is
+  returned unchanged.
+ */
+ContextPtr NewHostMappedContext(ContextPtr base);
+
+/*
+  Returns the context from which to allocate the destination of a copy from
+  `src` to (a context compatible with) `dest`.  For copies from a CUDA device
+  to the CPU this will be src.GetPinnedContext(), if it's not NULL, because
+  transfers to pinned memory run at full bandwidth and can be asynchronous;
+  otherwise it returns `dest`.  The returned context is always compatible with
+  `dest`.  Note that the result of the copy stays in pinned memory for as long
+  as it exists; once freed, that memory is cached only up to a limit (see
+  SetMaxCachedMemory() and ReleaseCachedMemory()).
+ */
+inline ContextPtr GetTransferContext(Context &src, ContextPtr dest) {
+  if (src.GetDeviceType() == kCuda && dest->GetDeviceType() == kCpu) {
+    ContextPtr pinned = src.GetPinnedContext();
+    if (pinned != nullptr) return pinned;
+  }
+  return dest;
+}
+
+/*
+  Device memory freed by the native CUDA context (see GetCudaContext()) is not
+  returned to the driver immediately but kept in a cache, to avoid the cost and
+  the implicit device synchronization of cudaMalloc()/cudaFree(); the same
+  goes for the pinned memory of GetPinnedContext().  This function returns all
+  cached (i.e. currently unused) device memory on all devices, and all cached
+  pinned memory, to the driver.  With PyTorch contexts, this forwards to
+  PyTorch's caching allocators for device and pinned memory.
+ */
+void ReleaseCachedMemory();
+
+/*
+  Sets the maximum number of bytes of freed device memory that the native CUDA
+  context will keep cached, per device, and of freed pinned memory that
+  GetPinnedContext() will keep cached (by default 4 GB and 256 MB); memory
+  freed beyond this is returned to the driver.  If a cache currently holds
+  more than this, it is released.  Has no effect with PyTorch contexts, whose
+  allocators manage their own caches.
+ */
+void SetMaxCachedMemory(std::size_t max_bytes);
+
 /**
    Allocate a new Region.
 
@@ -358,31 +952,67 @@ inline DeviceType DeviceOf(const T &t) {
   return t.Context()->GetDeviceType();
 }
 
-template <typename LambdaT>
-__global__ void eval_lambda(int32_t n, LambdaT lambda) {
-  int32_t i = blockIdx.x * blockDim.x + threadIdx.x;
-  if (i < n) {
+/*
+  Launch policies, which may be given as the first template argument of Eval()
+  and Eval2(), e.g. `Eval<LaunchPolicy<128, 4>>(c, n, lambda)`, to choose how
+  the kernel is launched on GPU; they make no difference on CPU.  The kernels
+  use grid-stride loops, so any policy works for any number of elements.
+
+    LaunchPolicy<BlockSize, ItemsPerThread>   Launches blocks of BlockSize
+                 threads (a multiple of 32, at most 1024; the kernel is compiled
+                 for that block size), with enough blocks that each thread
+                 processes about ItemsPerThread elements.  For simple
+                 memory-bound lambdas such as copies, ItemsPerThread > 1
+                 reduces the number of blocks and tends to give better
+                 bandwidth.
+    OccupancyLaunchPolicy   Uses the block size that maximizes occupancy for
+                 the kernel, as given by cudaOccupancyMaxPotentialBlockSize(),
+                 and no more blocks than can be resident at one time.  This
+                 is good for heavy lambdas that use a lot of registers.  The
+                 result is cached per lambda type, so this assumes all devices
+                 are of the same type.
+
+  DefaultLaunchPolicy (one element per thread in blocks of 256) is used if no
+  policy is given.
+ */
+template <int32_t BlockSize = 256, int32_t ItemsPerThread = 1>
+struct LaunchPolicy {
+  static_assert(BlockSize > 0 && BlockSize <= 1024 && BlockSize % 32 == 0,
+                "BlockSize must be a multiple of 32 and at most 1024");
+  static_assert(ItemsPerThread > 0, "ItemsPerThread must be positive");
+  static constexpr int32_t kBlockSize = BlockSize;
+};
+
+struct OccupancyLaunchPolicy {
+  static constexpr int32_t kBlockSize = 1024;  // an upper bound.
+};
+
+using DefaultLaunchPolicy = LaunchPolicy<>;
+
+template <int32_t MaxBlockSize, typename LambdaT>
+__global__ void __launch_bounds__(MaxBlockSize)
+    eval_lambda(int32_t n, LambdaT lambda) {
+  int32_t stride = gridDim.x * blockDim.x;
+  for (int32_t i = blockIdx.x * blockDim.x + threadIdx.x; i < n; i += stride)
     lambda(i);
-  }
 }
 
-template <typename T, typename LambdaT>
-__global__ void eval_lambda(T *data, int32_t n, LambdaT lambda) {
-  int32_t i = blockIdx.x * blockDim.x + threadIdx.x;
-  if (i < n) {
+template <int32_t MaxBlockSize, typename T, typename LambdaT>
+__global__ void __launch_bounds__(MaxBlockSize)
+    eval_lambda(T *data, int32_t n, LambdaT lambda) {
+  int32_t stride = gridDim.x * blockDim.x;
+  for (int32_t i = blockIdx.x * blockDim.x + threadIdx.x; i < n; i += stride)
     data[i] = lambda(i);
-  }
 }
 
-template <typename LambdaT>
-__global__ void eval_lambda2(int32_t m, int32_t n, LambdaT lambda) {
-  // actually threadIdx.y will always be 1 for now so we could drop that part of
-  // setting i..
-  int32_t i = blockIdx.y * blockDim.y + threadIdx.y;
-  int32_t j = blockIdx.x * blockDim.x + threadIdx.x;
-  if (i < m && j < n) {
-    lambda(i, j);
-  }
+template <int32_t MaxBlockSize, typename LambdaT>
+__global__ void __launch_bounds__(MaxBlockSize)
+    eval_lambda2(int32_t m, int32_t n, LambdaT lambda) {
+  int32_t stride_i = gridDim.y * blockDim.y, stride_j = gridDim.x * blockDim.x;
+  for (int32_t i = blockIdx.y * blockDim.y + threadIdx.y; i < m; i += stride_i)
+    for (int32_t j = blockIdx.x * blockDim.x + threadIdx.x; j < n;
+         j += stride_j)
+      lambda(i, j);
 }
 
 __host__ __device__ __forceinline__ int32_t NumBlocks(int32_t size,
@@ -390,59 +1020,117 @@ __host__ __device__ __forceinline__ int32_t NumBlocks(int32_t size,
   return (size + block_size - 1) / block_size;
 }
 
+namespace internal {
+
+/* Sets *block_size, *items_per_thread and *max_blocks (0 if there is no limit)
+   for launching `kernel`, which was compiled for Policy::kBlockSize, with the
+   launch policy `Policy`.  */
+template <int32_t BlockSize, int32_t ItemsPerThread, typename KernelT>
+inline void GetLaunchSizes(LaunchPolicy<BlockSize, ItemsPerThread>, KernelT,
+                           int32_t *block_size, int32_t *items_per_thread,
+                           int32_t *max_blocks) {
+  *block_size = BlockSize;
+  *items_per_thread = ItemsPerThread;
+  *max_blocks = 0;
+}
+
+template <typename KernelT>
+void GetLaunchSizes(OccupancyLaunchPolicy, KernelT kernel, int32_t *block_size,
+                    int32_t *items_per_thread, int32_t *max_blocks) {
+  // Each kernel instantiation (i.e. each lambda type) has its own copy of
+  // these.  Races are harmless as the values computed are the same.
+  static std::atomic<int32_t> cached_block_size(0), cached_max_blocks(0);
+  int32_t b = cached_block_size.load(std::memory_order_relaxed);
+  if (b == 0) {
+    int min_grid_size, best_block_size;
+    auto ret = cudaOccupancyMaxPotentialBlockSize(&min_grid_size,
+                                                  &best_block_size, kernel);
+    K2_CHECK_CUDA_ERROR(ret);
+    cached_max_blocks.store(min_grid_size, std::memory_order_relaxed);
+    cached_block_size.store(best_block_size, std::memory_order_relaxed);
+    b = best_block_size;
+  }
+  *block_size = b;
+  *items_per_thread = 1;
+  *max_blocks = cached_max_blocks.load(std::memory_order_relaxed);
+}
+
+}  // namespace internal
+
 /* Eval() will evaluate lambda(i) for 0 <= i < n, on the appropriate
-   device (CPU or GPU). */
-template <typename LambdaT>
+   device (CPU or GPU). See LaunchPolicy for the meaning of `Policy`. */
+template <typename Policy = DefaultLaunchPolicy, typename LambdaT>
 void Eval(cudaStream_t stream, int32_t n, LambdaT &lambda) {
   if (n <= 0) return;  // actually it would be an error if n < 0.
   if (stream == kCudaStreamInvalid) {
-    // TODO: if n is very large, we'll eventually support running this with
-    // multiple threads.
-    for (int32_t i = 0; i < n; ++i) {
-      lambda(i);
+    if (n < kMinParallelEvalSize) {
+      for (int32_t i = 0; i < n; ++i) {
+        lambda(i);
+      }
+    } else {
+      ParallelFor(n, kMinParallelEvalSize / 4,
+                  [&lambda](int32_t begin, int32_t end) -> void {
+                    for (int32_t i = begin; i < end; ++i) lambda(i);
+                  });
     }
   } else {
-    int32_t block_size = 256;
-    int32_t grid_size = NumBlocks(n, block_size);
-    eval_lambda<LambdaT><<<grid_size, block_size, 0, stream>>>(n, lambda);
+    auto kernel = eval_lambda<Policy::kBlockSize, LambdaT>;
+    int32_t block_size, items_per_thread, max_blocks;
+    internal::GetLaunchSizes(Policy(), kernel, &block_size, &items_per_thread,
+                             &max_blocks);
+    int32_t grid_size = NumBlocks(NumBlocks(n, items_per_thread), block_size);
+    if (max_blocks > 0) grid_size = std::min(grid_size, max_blocks);
+    kernel<<<grid_size, block_size, 0, stream>>>(n, lambda);
     auto err = cudaGetLastError();
     K2_DCHECK_CUDA_ERROR(err);
   }
 }
 
-template <typename ContextPtrType,  // Context*  or ContextPtr ==
+template <typename Policy = DefaultLaunchPolicy,
+          typename ContextPtrType,  // Context*  or ContextPtr ==
                                     // std::shared_ptr<Context>
           typename LambdaT>
 void Eval(ContextPtrType c, int32_t n, LambdaT &lambda) {
-  Eval(c->GetCudaStream(), n, lambda);
+  DeviceGuard guard(*c);
+  Eval<Policy>(c->GetCudaStream(), n, lambda);
 }
 
 /* Eval() will do `data[i] = lambda(i)` for 0 <= i < n, on the appropriate
    device (CPU or GPU) */
-template <typename T, typename LambdaT>
+template <typename Policy = DefaultLaunchPolicy, typename T, typename LambdaT>
 void Eval(cudaStream_t stream, T *data, int32_t n, LambdaT &lambda) {
   if (n <= 0) return;  // actually it would be an error if n < 0.
   if (stream == kCudaStreamInvalid) {
-    // TODO: if n is very large, we'll eventually support running this with
-    // multiple threads.
-    for (int32_t i = 0; i < n; ++i) {
-      data[i] = lambda(i);
+    if (n < kMinParallelEvalSize) {
+      for (int32_t i = 0; i < n; ++i) {
+        data[i] = lambda(i);
+      }
+    } else {
+      ParallelFor(n, kMinParallelEvalSize / 4,
+                  [data, &lambda](int32_t begin, int32_t end) -> void {
+                    for (int32_t i = begin; i < end; ++i) data[i] = lambda(i);
+                  });
     }
   } else {
-    int32_t block_size = 256;
-    int32_t grid_size = NumBlocks(n, block_size);
-    eval_lambda<T, LambdaT>
-        <<<grid_size, block_size, 0, stream>>>(data, n, lambda);
+    auto kernel = eval_lambda<Policy::kBlockSize, T, LambdaT>;
+    int32_t block_size, items_per_thread, max_blocks;
+    internal::GetLaunchSizes(Policy(), kernel, &block_size, &items_per_thread,
+                             &max_blocks);
+    int32_t grid_size = NumBlocks(NumBlocks(n, items_per_thread), block_size);
+    if (max_blocks > 0) grid_size = std::min(grid_size, max_blocks);
+    kernel<<<grid_size, block_size, 0, stream>>>(data, n, lambda);
     auto err = cudaGetLastError();
     K2_DCHECK_CUDA_ERROR(err);
   }
 }
 
-template <typename ContextPtrType,  // Context*  or ContextPtr ==
+template <typename Policy = DefaultLaunchPolicy,
+          typename ContextPtrType,  // Context*  or ContextPtr ==
                                     // std::shared_ptr<Context>
           typename T, typename LambdaT>
 void Eval(ContextPtrType c, T *data, int32_t n, LambdaT &lambda) {
-  Eval(c->GetCudaStream(), data, n, lambda);
+  DeviceGuard guard(*c);
+  Eval<Policy>(c->GetCudaStream(), data, n, lambda);
 }
 
 /*
@@ -453,36 +1141,59 @@ void Eval(ContextPtrType c, T *data, int32_t n, LambdaT &lambda) {
   is supposed to be the faster-varying one, the index for which
   threads in the same warp will tend to have different values.
   (Of course this doesn't affect the semantics of the operation).
+  For Eval2(), ItemsPerThread in the launch policy applies to the first
+  index.
 */
-template <typename LambdaT>
+template <typename Policy = DefaultLaunchPolicy, typename LambdaT>
 void Eval2(cudaStream_t stream, int32_t m, int32_t n, LambdaT &lambda) {
   if (m <= 0 || n <= 0)
     return;  // actually it would be an error if m < 0 or n < 0.
   if (stream == kCudaStreamInvalid) {
-    // TODO: if n is very large, we'll eventually support running this with
-    // multiple threads.
-    for (int32_t i = 0; i < m; ++i) {
-      for (int32_t j = 0; j < n; ++j) {
-        lambda(i, j);
+    if (static_cast<int64_t>(m) * n < kMinParallelEvalSize) {
+      for (int32_t i = 0; i < m; ++i) {
+        for (int32_t j = 0; j < n; ++j) {
+          lambda(i, j);
+        }
       }
+    } else {
+      // Split on rows; each range has at least kMinParallelEvalSize / 4
+      // elements.
+      int32_t min_rows = std::max<int32_t>(1, kMinParallelEvalSize / 4 / n);
+      ParallelFor(m, min_rows,
+                  [n, &lambda](int32_t begin, int32_t end) -> void {
+                    for (int32_t i = begin; i < end; ++i)
+                      for (int32_t j = 0; j < n; ++j) lambda(i, j);
+                  });
     }
   } else {
-    // this way of choosing block and grid sizes is of course not very smart, we
-    // can look at this later on, possibly referring to Kaldi's
-    // GetBlockSizesForSimpleMatrixOperation().
-    dim3 block_size(16, 16, 1);
-    dim3 grid_size(NumBlocks(n, 16), NumBlocks(m, 16));
-    eval_lambda2<<<grid_size, block_size, 0, stream>>>(m, n, lambda);
+    auto kernel = eval_lambda2<Policy::kBlockSize, LambdaT>;
+    int32_t block_size, items_per_thread, max_blocks;
+    internal::GetLaunchSizes(Policy(), kernel, &block_size, &items_per_thread,
+                             &max_blocks);
+    // Blocks are as wide as the rows (rounded up to whole warps), up to the
+    // whole block; the rest of the block covers more rows.
+    int32_t block_x = std::min(block_size, NumBlocks(n, 32) * 32),
+            block_y = std::max(1, block_size / block_x);
+    int32_t grid_x = NumBlocks(n, block_x),
+            grid_y = NumBlocks(NumBlocks(m, items_per_thread), block_y);
+    if (max_blocks > 0)
+      grid_y = std::min(grid_y, std::max(1, max_blocks / grid_x));
+    // gridDim.y is limited to 65535; the grid-stride loop does the rest.
+    grid_y = std::min(grid_y, 65535);
+    dim3 block_dim(block_x, block_y, 1), grid_dim(grid_x, grid_y, 1);
+    kernel<<<grid_dim, block_dim, 0, stream>>>(m, n, lambda);
     auto err = cudaGetLastError();
     K2_DCHECK_CUDA_ERROR(err);
   }
 }
 
-template <typename ContextPtrType,  // Context*  or ContextPtr ==
+template <typename Policy = DefaultLaunchPolicy,
+          typename ContextPtrType,  // Context*  or ContextPtr ==
                                     // std::shared_ptr<Context>
           typename LambdaT>
 inline void Eval2(ContextPtrType c, int32_t m, int32_t n, LambdaT &lambda) {
-  Eval2(c->GetCudaStream(), m, n, lambda);
+  DeviceGuard guard(*c);
+  Eval2<Policy>(c->GetCudaStream(), m, n, lambda);
 }
 
 // This is for use by ParallelRunner and Context.  Users probably should not
@@ -565,6 +1276,82 @@ class ParallelRunner {
   // TODO: list of events to wait on, maybe CUDA streamss.
 };
 
+/*
+  Class CudaGraph records the work that a piece of code queues on a context's
+  CUDA stream (kernels launched by Eval(), Eval2() and friends, cub calls,
+  asynchronous copies) into a CUDA graph, which can then be launched with a
+  single call.  This removes most of the per-kernel launch overhead, which
+  dominates for sequences of many small kernels such as the per-frame steps
+  of pruned intersection. Usage would be:
+
+     CudaGraph graph(c);
+     for (int32_t t = 0; t < T; ++t) {
+       int32_t *data = ...;  // may differ per frame.
+       graph.Run([&]() -> void {
+         auto lambda = [=] __host__ __device__(int32_t i) -> void { ... };
+         Eval(c, n, lambda);
+         ...
+       });
+     }
+
+  Kernel arguments (including everything captured by the lambdas) are
+  recorded at capture time, so to run with different pointers or sizes the
+  work has to be recaptured, which is what Run() does each time; that is
+  cheap on the host, and the executable graph is updated in place
+  (cudaGraphExecUpdate()) rather than rebuilt whenever the structure of the
+  work is unchanged.  Replay() re-launches the last capture as it is.
+
+  While capturing, the work is not executed, so the code being captured must
+  not synchronize or read results back to the host (e.g. via Back() or
+  Array1::operator[] on the GPU, or a call to Sync()); all sizes must be known
+  on the host beforehand.  Memory allocated inside the captured code is
+  returned to the allocator when freed at capture time, so Replay() is only
+  safe if every array the captured work uses is owned outside it; Run()
+  launches immediately after capturing, which is always safe since
+  reallocation is ordered by the stream.
+
+  On CPU, and in debug mode (in which K2_CUDA_SAFE_CALL synchronizes), or if
+  the stream is already being captured by someone else, no graph is used and
+  Run() and Replay() just call the function.
+ */
+class CudaGraph {
+ public:
+  explicit CudaGraph(ContextPtr c) : c_(c) {}
+
+  // Equivalent to Capture(f) followed by Replay().
+  void Run(const std::function<void()> &f);
+
+  /* Records the work that `f` queues on the stream of the context, without
+     executing it, replacing any previous capture.  (With no graph in use,
+     as explained above, it just stores `f` so Replay() can call it.) */
+  void Capture(const std::function<void()> &f);
+
+  // Launches the work recorded by the last call to Capture() on the stream of
+  // the context.  Must not be called before Capture().
+  void Replay();
+
+  // Returns true if Replay() launches a CUDA graph rather than calling the
+  // function directly.
+  bool UsesGraph() const { return exec_ != nullptr; }
+
+  // Returns the number of times the executable graph has had to be built
+  // from scratch (rather than updated); for diagnostics and testing.
+  int32_t NumInstantiations() const { return num_instantiations_; }
+
+  ~CudaGraph();
+
+ private:
+  CudaGraph(const CudaGraph &) = delete;
+  CudaGraph &operator=(const CudaGraph &) = delete;
+
+  void DestroyExec();
+
+  ContextPtr c_;
+  std::function<void()> f_;         // used when no graph is used.
+  cudaGraphExec_t exec_ = nullptr;  // the executable graph, if any.
+  int32_t num_instantiations_ = 0;
+};
+
 // OK, want to do:
 // ContextPtr c = ...;  ///
 // auto d = Dependency({out_region1, out_region2},
@@ -0,0 +1,530 @@
+/**
+ * @brief
+ * context_test
+ *
+ * @copyright
+ * Copyright (c)  2026  agent (agent@local)
+ *
+ * @copyright
+ * See LICENSE for clarification regarding multiple authors
+ */
+
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <functional>
+#include <vector>
+
+#include "k2/csrc/array.h"
+#include "k2/csrc/array_ops.h"
+#include "k2/csrc/context.h"
+#include "k2/csrc/log.h"
+#include "k2/csrc/profile.h"
+#include "k2/csrc/ragged.h"
+
+namespace k2 {
+
+TEST(ContextTest, CudaAllocateAndDeallocate) {
+  ContextPtr c = GetCudaContext();
+  {
+    // zero bytes gives NULL
+    void *deleter_context;
+    void *p = c->Allocate(0, &deleter_context);
+    EXPECT_EQ(p, nullptr);
+    c->Deallocate(p, deleter_context);
+  }
+  {
+    std::vector<void *> ptrs;
+    std::vector<void *> deleter_contexts(10);
+    for (int32_t i = 0; i != 10; ++i) {
+      void *p = c->Allocate(1000 * (i + 1), &deleter_contexts[i]);
+      EXPECT_NE(p, nullptr);
+      ptrs.push_back(p);
+    }
+    for (int32_t i = 0; i != 10; ++i)
+      c->Deallocate(ptrs[i], deleter_contexts[i]);
+  }
+  {
+    // the memory should actually be usable.
+    std::vector<int32_t> data = {1, 2, 3, 4, 5};
+    for (int32_t i = 0; i != 3; ++i) {
+      Array1<int32_t> array(c, data);
+      Array1<int32_t> cpu_array = array.To(GetCpuContext());
+      std::vector<int32_t> cpu_data(cpu_array.Data(),
+                                    cpu_array.Data() + cpu_array.Dim());
+      EXPECT_EQ(cpu_data, data);
+    }
+  }
+  ReleaseCachedMemory();
+}
+
+TEST(ContextTest, PinnedContext) {
+  ContextPtr pinned = GetPinnedContext();
+  EXPECT_EQ(pinned->GetDeviceType(), kCpu);
+  EXPECT_TRUE(pinned->IsCompatible(*GetCpuContext()));
+  EXPECT_TRUE(GetCpuContext()->IsCompatible(*pinned));
+  EXPECT_FALSE(pinned->IsCompatible(*GetCudaContext()));
+
+  std::vector<int32_t> data = {1, 2, 3, 4, 5};
+  Array1<int32_t> pinned_array(pinned, data);
+  Array1<int32_t> cuda_array = pinned_array.To(GetCudaContext());
+  // transfers from GPU to CPU go to pinned memory.
+  Array1<int32_t> cpu_array = cuda_array.To(GetCpuContext());
+  EXPECT_TRUE(cpu_array.Context()->IsCompatible(*GetCpuContext()));
+  std::vector<int32_t> cpu_data(cpu_array.Data(),
+                                cpu_array.Data() + cpu_array.Dim());
+  EXPECT_EQ(cpu_data, data);
+}
+
+TEST(ContextTest, PinnedMemoryReuse) {
+  ContextPtr pinned = GetPinnedContext();
+  ContextPtr cuda = GetCudaContext();
+  void *deleter_context;
+  void *p = pinned->Allocate(1000, &deleter_context);
+  // e.g. a copy of part of the memory queued on the stream of `cuda`; the
+  // memory is reused once that has finished.
+  pinned->RecordStream(static_cast<char *>(p) + 100, *cuda);
+  pinned->Deallocate(p, deleter_context);
+  cuda->Sync();
+  void *p2 = pinned->Allocate(1000, &deleter_context);
+  EXPECT_EQ(p2, p);
+  pinned->Deallocate(p2, deleter_context);
+
+  // freed memory that may still be in use is returned to the driver, too.
+  p = pinned->Allocate(1000, &deleter_context);
+  pinned->RecordStream(p, *cuda);
+  pinned->Deallocate(p, deleter_context);
+  ReleaseCachedMemory();
+
+  // Scratch contexts pass it on to the memory they allocate from.
+  ContextPtr scratch = NewScratchContext(pinned, 4096);
+  Array1<int32_t> array(scratch, 10);
+  scratch->RecordStream(array.Data() + 5, *cuda);
+}
+
+TEST(ContextTest, MemoryCopyAsync) {
+  ContextPtr cpu = GetCpuContext();
+  ContextPtr cuda = GetCudaContext();
+  std::vector<int32_t> src = {1, 2, 3, 4, 5};
+  int32_t num_bytes = src.size() * sizeof(int32_t);
+  for (const ContextPtr &c : {cpu, cuda}) {
+    Array1<int32_t> a(c, src.size()), b(c, src.size());
+    MemoryCopyAsync(a.Data(), src.data(), num_bytes, *c, *cpu);
+    MemoryCopyAsync(b.Data(), a.Data(), num_bytes, *c, *c);
+    std::vector<int32_t> dst(src.size());
+    MemoryCopyAsync(dst.data(), b.Data(), num_bytes, *cpu, *c);
+    c->Sync();
+    EXPECT_EQ(dst, src);
+  }
+}
+
+TEST(ContextTest, BackgroundRunner) {
+  std::atomic<int32_t> count(0);
+  BackgroundRunner br;
+  for (int32_t i = 0; i != 100; ++i) {
+    br.Background([&count]() {
+      // nested tasks run in the calling thread.
+      BackgroundRunner nested;
+      nested.Background([&count]() { ++count; });
+      nested.Wait();
+      ++count;
+    });
+  }
+  br.Wait();
+  EXPECT_EQ(count, 200);
+}
+
+TEST(ContextTest, ParallelEvalOnCpu) {
+  ContextPtr cpu = GetCpuContext();
+  for (int32_t n : {10, kMinParallelEvalSize, 10 * kMinParallelEvalSize + 7}) {
+    std::vector<int32_t> data(n, -1);
+    int32_t *data_ptr = data.data();
+    auto lambda_set = [=] __host__ __device__(int32_t i) -> void {
+      data_ptr[i] = i;
+    };
+    Eval(cpu, n, lambda_set);
+    for (int32_t i = 0; i != n; ++i) ASSERT_EQ(data[i], i);
+
+    auto lambda_get = [] __host__ __device__(int32_t i) -> int32_t {
+      return 2 * i;
+    };
+    Eval(cpu, data_ptr, n, lambda_get);
+    for (int32_t i = 0; i != n; ++i) ASSERT_EQ(data[i], 2 * i);
+
+    int32_t num_cols = 3;
+    std::vector<int32_t> data2(n * num_cols, -1);
+    int32_t *data2_ptr = data2.data();
+    auto lambda_set2 = [=] __host__ __device__(int32_t i, int32_t j) -> void {
+      data2_ptr[i * num_cols + j] = i + j;
+    };
+    Eval2(cpu, n, num_cols, lambda_set2);
+    for (int32_t i = 0; i != n; ++i)
+      for (int32_t j = 0; j != num_cols; ++j)
+        ASSERT_EQ(data2[i * num_cols + j], i + j);
+  }
+}
+
+namespace {
+std::atomic<int32_t> g_num_impl_calls{0};
+
+// Runs f in two halves, in the calling thread.
+void ParallelForInTwo(int32_t n, int32_t min_size,
+                      const std::function<void(int32_t, int32_t)> &f) {
+  ++g_num_impl_calls;
+  f(0, n / 2);
+  f(n / 2, n);
+}
+}  // namespace
+
+TEST(ContextTest, SetParallelForImpl) {
+  ContextPtr cpu = GetCpuContext();
+  int32_t n = 2 * kMinParallelEvalSize;
+  std::vector<int32_t> data(n, -1);
+  int32_t *data_ptr = data.data();
+  auto lambda_set = [=] __host__ __device__(int32_t i) -> void {
+    data_ptr[i] = i;
+  };
+  SetParallelForImpl(ParallelForInTwo);
+  Eval(cpu, n, lambda_set);
+  // small sizes don't use ParallelFor().
+  Eval(cpu, 10, lambda_set);
+  EXPECT_EQ(g_num_impl_calls, 1);
+  for (int32_t i = 0; i != n; ++i) ASSERT_EQ(data[i], i);
+
+  SetParallelForImpl(nullptr);
+  Eval(cpu, n, lambda_set);
+  EXPECT_EQ(g_num_impl_calls, 1);
+}
+
+template <typename Policy>
+void TestEvalWithPolicy() {
+  ContextPtr c = GetCudaContext();
+  for (int32_t n : {1, 100, 1000, 100000}) {
+    Array1<int32_t> array(c, n, -1);
+    int32_t *data = array.Data();
+    auto lambda_set = [=] __host__ __device__(int32_t i) -> void {
+      data[i] = i;
+    };
+    Eval<Policy>(c, n, lambda_set);
+    Array1<int32_t> cpu_array = array.To(GetCpuContext());
+    for (int32_t i = 0; i != n; ++i) ASSERT_EQ(cpu_array[i], i);
+
+    auto lambda_get = [] __host__ __device__(int32_t i) -> int32_t {
+      return 2 * i;
+    };
+    Eval<Policy>(c, data, n, lambda_get);
+    cpu_array = array.To(GetCpuContext());
+    for (int32_t i = 0; i != n; ++i) ASSERT_EQ(cpu_array[i], 2 * i);
+
+    for (int32_t num_cols : {1, 3, 100}) {
+      int32_t num_rows = NumBlocks(n, num_cols);
+      Array1<int32_t> array2(c, num_rows * num_cols, -1);
+      int32_t *data2 = array2.Data();
+      auto lambda_set2 = [=] __host__ __device__(int32_t i,
+                                                 int32_t j) -> void {
+        data2[i * num_cols + j] = i + j;
+      };
+      Eval2<Policy>(c, num_rows, num_cols, lambda_set2);
+      Array1<int32_t> cpu_array2 = array2.To(GetCpuContext());
+      for (int32_t i = 0; i != num_rows; ++i)
+        for (int32_t j = 0; j != num_cols; ++j)
+          ASSERT_EQ(cpu_array2[i * num_cols + j], i + j);
+    }
+  }
+}
+
+TEST(ContextTest, EvalWithPolicy) {
+  TestEvalWithPolicy<DefaultLaunchPolicy>();
+  TestEvalWithPolicy<LaunchPolicy<32, 1>>();
+  TestEvalWithPolicy<LaunchPolicy<128, 8>>();
+  TestEvalWithPolicy<LaunchPolicy<1024, 3>>();
+  TestEvalWithPolicy<OccupancyLaunchPolicy>();
+}
+
+TEST(ContextTest, Child) {
+  ContextPtr cpu = GetCpuContext();
+  EXPECT_EQ(cpu->Child(), cpu);
+
+  ContextPtr c = GetCudaContext();
+  std::vector<int32_t> data = {1, 2, 3, 4, 5};
+  Array1<int32_t> src(c, data);
+  std::vector<Array1<int32_t>> results(10);
+  BackgroundRunner br;
+  for (int32_t i = 0; i != 10; ++i) {
+    br.Background([&, i]() {
+      ContextPtr child = c->Child();
+      EXPECT_TRUE(child->IsCompatible(*c));
+      EXPECT_NE(child->GetCudaStream(), c->GetCudaStream());
+      Array1<int32_t> ans(child, src.Dim());
+      const int32_t *src_data = src.Data();
+      int32_t *ans_data = ans.Data();
+      auto lambda_add = [=] __host__ __device__(int32_t j) -> void {
+        ans_data[j] = src_data[j] + i;
+      };
+      Eval(child, ans.Dim(), lambda_add);
+      child->Sync();
+      results[i] = ans;
+    });
+  }
+  br.Wait();
+  for (int32_t i = 0; i != 10; ++i) {
+    Array1<int32_t> cpu_array = results[i].To(cpu);
+    for (int32_t j = 0; j != cpu_array.Dim(); ++j)
+      EXPECT_EQ(cpu_array[j], data[j] + i);
+  }
+}
+
+TEST(ContextTest, MemoryStats) {
+  ContextPtr c = GetCudaContext();
+  int32_t gpu_id = c->GetDeviceId();
+  int64_t gpu_bytes_live = GetMemoryStats(kCuda, gpu_id).bytes_live;
+  MemoryStatsScope gpu_scope(kCuda, gpu_id);
+  MemoryStatsScope cpu_scope(kCpu);
+  {
+    std::vector<int32_t> data(100, 1);
+    Array1<int32_t> array(c, data);
+    Array1<int32_t> cpu_array = array.To(GetCpuContext());
+
+    MemoryStats stats = gpu_scope.Get();
+    EXPECT_EQ(stats.num_allocs, 1);
+    EXPECT_EQ(stats.num_frees, 0);
+    EXPECT_EQ(stats.bytes_allocated, 400);
+    EXPECT_EQ(stats.bytes_live, gpu_bytes_live + 400);
+    EXPECT_EQ(stats.num_copies[MemcpyHostToDevice], 1);
+    EXPECT_EQ(stats.bytes_copied[MemcpyHostToDevice], 400);
+    EXPECT_EQ(stats.num_copies[MemcpyDeviceToHost], 1);
+    EXPECT_EQ(stats.bytes_copied[MemcpyDeviceToHost], 400);
+    EXPECT_GE(stats.num_syncs, 1);
+
+    // the destination of the copy to CPU was allocated on the CPU.
+    MemoryStats cpu_stats = cpu_scope.Get();
+    EXPECT_EQ(cpu_stats.num_allocs, 1);
+    EXPECT_EQ(cpu_stats.num_copies[MemcpyHostToDevice], 0);
+  }
+  MemoryStats stats = gpu_scope.Get();
+  EXPECT_EQ(stats.num_frees, 1);
+  EXPECT_EQ(stats.bytes_live, gpu_bytes_live);
+  EXPECT_EQ(stats.max_bytes_live, gpu_bytes_live + 400);
+  {
+    // nested scopes: the outer high-water mark survives the inner scope.
+    MemoryStatsScope inner_scope(kCuda, gpu_id);
+    EXPECT_EQ(inner_scope.Get().max_bytes_live, gpu_bytes_live);
+  }
+  EXPECT_EQ(gpu_scope.Get().max_bytes_live, gpu_bytes_live + 400);
+}
+
+template <DeviceType d>
+void TestSyncAudit() {
+  ContextPtr c = (d == kCpu ? GetCpuContext() : GetCudaContext()),
+             cpu = GetCpuContext();
+  std::vector<int32_t> data = {0, 2, 3, 3, 6};
+  Array1<int32_t> row_splits1(c, data), row_splits2(c, data);
+  SyncAudit outer;
+  {
+    SyncAudit audit(kSyncAuditLog);
+    K2_PROFILE_SCOPE("TestSyncAudit");
+    Array1<int32_t> array = Range<int32_t>(c, 10, 0);
+    EXPECT_EQ(audit.NumSyncs(), 0);
+
+    // reading back to the CPU only syncs on the GPU.
+    Array1<int32_t> cpu_array = array.To(cpu);
+    EXPECT_EQ(audit.NumSyncs(), d == kCuda ? 1 : 0);
+    audit.Reset();
+
+    // the size of the last axis has to be read from the device; this is
+    // audited on the CPU too.
+    RaggedShape shape = RaggedShape2(&row_splits1, nullptr, -1);
+    EXPECT_EQ(shape.NumElements(), 6);
+    EXPECT_EQ(audit.NumSyncs(), 1);
+    EXPECT_EQ(shape.NumElements(), 6);  // now cached.
+    EXPECT_EQ(audit.NumSyncs(), 1);
+  }
+  EXPECT_EQ(outer.NumSyncs(), d == kCuda ? 2 : 1);
+
+  RaggedShape shape = RaggedShape2(&row_splits2, nullptr, -1);
+  SyncAudit forbid(kSyncAuditForbid);
+  ASSERT_DEATH(shape.NumElements(), "");
+}
+
+TEST(ContextTest, SyncAudit) {
+  TestSyncAudit<kCpu>();
+  TestSyncAudit<kCuda>();
+}
+
+template <DeviceType d>
+void TestScratchContext() {
+  ContextPtr base = (d == kCpu ? GetCpuContext() : GetCudaContext());
+  ContextPtr scratch = NewScratchContext(base, 4096);
+  EXPECT_EQ(scratch->GetDeviceType(), d);
+  EXPECT_TRUE(scratch->IsCompatible(*base));
+  EXPECT_TRUE(base->IsCompatible(*scratch));
+  EXPECT_EQ(scratch->GetCudaStream(), base->GetCudaStream());
+
+  void *deleter_context1, *deleter_context2, *deleter_context3;
+  char *p1 = static_cast<char *>(scratch->Allocate(100, &deleter_context1));
+  char *p2 = static_cast<char *>(scratch->Allocate(100, &deleter_context2));
+  // allocations are bump-allocated from the same block.
+  EXPECT_EQ(p2, p1 + 256);
+  scratch->Deallocate(p1, deleter_context1);
+  scratch->Deallocate(p2, deleter_context2);
+  // the block is reused from the start once everything has been freed.
+  p1 = static_cast<char *>(scratch->Allocate(100, &deleter_context1));
+  EXPECT_EQ(p1, p2 - 256);
+
+  // this doesn't fit in the first block, so we get a new one.
+  p2 = static_cast<char *>(scratch->Allocate(8192, &deleter_context2));
+  EXPECT_NE(p2, nullptr);
+  EXPECT_NE(deleter_context1, deleter_context2);
+  char *p3 = static_cast<char *>(scratch->Allocate(100, &deleter_context3));
+  // .. and nor does this, as the second block is full; the block size doubles.
+  EXPECT_NE(deleter_context3, deleter_context2);
+  scratch->Deallocate(p1, deleter_context1);
+  scratch->Deallocate(p3, deleter_context3);
+  scratch->Deallocate(p2, deleter_context2);
+
+  // the memory should actually be usable, and may outlive `scratch`.
+  std::vector<int32_t> data = {1, 2, 3, 4, 5};
+  Array1<int32_t> array(scratch, data);
+  scratch = nullptr;
+  Array1<int32_t> cpu_array = array.To(GetCpuContext());
+  std::vector<int32_t> cpu_data(cpu_array.Data(),
+                                cpu_array.Data() + cpu_array.Dim());
+  EXPECT_EQ(cpu_data, data);
+}
+
+TEST(ContextTest, ScratchContext) {
+  TestScratchContext<kCpu>();
+  TestScratchContext<kCuda>();
+}
+
+template <DeviceType d>
+void TestHostMappedContext() {
+  ContextPtr base = (d == kCpu ? GetCpuContext() : GetCudaContext());
+  ContextPtr mapped = NewHostMappedContext(base);
+  if (d == kCpu) {
+    EXPECT_EQ(mapped, base);
+    return;
+  }
+  EXPECT_NE(mapped, base);
+  EXPECT_EQ(mapped->GetDeviceType(), kCuda);
+  EXPECT_TRUE(mapped->IsCompatible(*base));
+  EXPECT_TRUE(base->IsCompatible(*mapped));
+  EXPECT_EQ(mapped->GetCudaStream(), base->GetCudaStream());
+
+  // Kernels read and write the memory directly.
+  Array1<int32_t> array(mapped, 5), device_array(base, 5);
+  int32_t *array_data = array.Data(), *device_array_data = device_array.Data();
+  auto lambda_set = [=] __host__ __device__(int32_t i) -> void {
+    array_data[i] = i * i;
+  };
+  Eval(base, 5, lambda_set);
+  auto lambda_copy = [=] __host__ __device__(int32_t i) -> void {
+    device_array_data[i] = array_data[i];
+  };
+  Eval(base, 5, lambda_copy);
+  Array1<int32_t> cpu_array = device_array.To(GetCpuContext());
+  for (int32_t i = 0; i != 5; ++i) EXPECT_EQ(cpu_array[i], i * i);
+}
+
+TEST(ContextTest, HostMappedContext) {
+  TestHostMappedContext<kCpu>();
+  TestHostMappedContext<kCuda>();
+}
+
+TEST(ContextTest, ExtendRegion) {
+  {
+    // for the scratch context, the most recent allocation can be extended in
+    // place.
+    ContextPtr scratch = NewScratchContext(GetCpuContext(), 4096);
+    RegionPtr region = NewRegion(scratch, 100);
+    void *data = region->data;
+    region->Extend(1000);
+    EXPECT_EQ(region->data, data);
+    EXPECT_EQ(region->bytes_used, 1000);
+    EXPECT_GE(region->num_bytes, 1000);
+    RegionPtr region2 = NewRegion(scratch, 100);
+    region->Extend(2048);  // can't be done in place, as region2 follows it.
+    EXPECT_NE(region->data, data);
+  }
+  {
+    // large CPU regions may be extended with mremap(); either way the data
+    // must be preserved.
+    ContextPtr cpu = GetCpuContext();
+    int32_t n = 1 << 20;
+    RegionPtr region = NewRegion(cpu, n * sizeof(int32_t));
+    int32_t *data = region->GetData<int32_t>();
+    for (int32_t i = 0; i != n; ++i) data[i] = i;
+    region->Extend(3 * n * sizeof(int32_t));
+    data = region->GetData<int32_t>();
+    for (int32_t i = 0; i != n; ++i) EXPECT_EQ(data[i], i);
+    data[3 * n - 1] = 1;  // the new memory is usable.
+  }
+#ifndef K2_USE_PYTORCH
+  {
+    // native CUDA allocations are rounded up, so small regions can grow in
+    // place.
+    ContextPtr c = GetCudaContext();
+    std::vector<int32_t> values = {1, 2, 3};
+    Array1<int32_t> array(c, values);
+    RegionPtr &region = array.GetRegion();
+    void *data = region->data;
+    region->Extend(300);
+    EXPECT_EQ(region->data, data);
+    Array1<int32_t> cpu_array = array.To(GetCpuContext());
+    std::vector<int32_t> cpu_data(cpu_array.Data(),
+                                  cpu_array.Data() + cpu_array.Dim());
+    EXPECT_EQ(cpu_data, values);
+  }
+#endif
+}
+
+TEST(ContextTest, CudaGraph) {
+  for (const ContextPtr &c : {GetCpuContext(), GetCudaContext()}) {
+    int32_t n = 100;
+    Array1<int32_t> array(c, n, 0);
+    int32_t *data = array.Data();
+    CudaGraph graph(c);
+    for (int32_t value = 1; value <= 3; ++value) {
+      // the lambda captures a different `value` each time, so the graph has to
+      // be updated.
+      auto lambda_add = [=] __host__ __device__(int32_t i) -> void {
+        data[i] += value;
+      };
+      graph.Run([&]() -> void { Eval(c, n, lambda_add); });
+    }
+    EXPECT_EQ(array[0], 6);
+    graph.Replay();  // adds 3 again.
+    EXPECT_EQ(array[n - 1], 9);
+    if (graph.UsesGraph()) EXPECT_EQ(graph.NumInstantiations(), 1);
+
+    // changing the size is fine, too.
+    auto lambda_set = [=] __host__ __device__(int32_t i) -> void {
+      data[i] = i;
+    };
+    graph.Run([&]() -> void { Eval(c, n / 2, lambda_set); });
+    EXPECT_EQ(array[n / 2 - 1], n / 2 - 1);
+    EXPECT_EQ(array[n / 2], 9);
+  }
+}
+
+#ifndef K2_USE_PYTORCH
+TEST(ContextTest, CudaCachingAllocator) {
+  ContextPtr c = GetCudaContext();
+  void *deleter_context;
+  void *p1 = c->Allocate(1000, &deleter_context);
+  c->Deallocate(p1, deleter_context);
+  // same size-class and same stream, so the freed block is reused.
+  void *p2 = c->Allocate(1001, &deleter_context);
+  EXPECT_EQ(p1, p2);
+  c->Deallocate(p2, deleter_context);
+
+  // With the cache disabled, freed memory is returned to the driver.
+  SetMaxCachedMemory(0);
+  void *p3 = c->Allocate(1000, &deleter_context);
+  c->Deallocate(p3, deleter_context);
+  SetMaxCachedMemory(static_cast<std::size_t>(1) << 32);
+  ReleaseCachedMemory();
+}
+#endif
+
+}  // namespace k2
@@ -0,0 +1,256 @@
+/**
+ * @brief
+ * decode_benchmark
+ *
+ * @note
+ * End-to-end benchmark of IntersectDensePruned() on random graphs and
+ * synthetic nnet output, e.g.
+ *    k2_benchmarks --benchmark_filter=Decode --benchmark_counters_tabular=true
+ *
+ * @copyright
+ * Copyright (c)  2026  agent (agent@local)
+ *
+ * @copyright
+ * See LICENSE for clarification regarding multiple authors
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <map>
+#include <random>
+#include <tuple>
+#include <vector>
+
+#include "k2/csrc/array.h"
+#include "k2/csrc/benchmark.h"
+#include "k2/csrc/context.h"
+#include "k2/csrc/fsa.h"
+#include "k2/csrc/fsa_algo.h"
+#include "k2/csrc/host/fsa_util.h"
+#include "k2/csrc/tensor.h"
+
+namespace k2 {
+
+namespace {
+
+// The arguments of BM_Decode, in the order of state.range().
+enum DecodeArg {
+  kBatchSize,
+  kBeam,
+  kMaxActive,
+  kNumStates,
+  kVocabSize,
+  kDevice
+};
+
+constexpr int32_t kNumFrames = 150;  // Frames of the longest sequence.
+constexpr int32_t kOutDegree = 4;    // Average number of arcs per state.
+constexpr float kOutDegreeSkew = 2;  // See RandFsaOptions.
+constexpr float kLatticeBeam = 8;
+constexpr int32_t kMinActive = 30;
+
+/*
+  Returns a random decoding graph with about `num_states` states, whose arcs
+  have symbols in [0, vocab_size - 1] and (negative) scores, and whose
+  out-degrees are skewed (a few states with many arcs); it is connected and
+  may have cycles.
+ */
+FsaVec RandomDecodingGraph(int32_t num_states, int32_t vocab_size) {
+  k2host::RandFsaOptions opts;
+  opts.num_syms = vocab_size;
+  opts.num_states = num_states;
+  opts.num_arcs = kOutDegree * num_states;
+  opts.allow_empty = false;
+  opts.acyclic = false;
+  opts.seed = 20201014;
+  opts.nonzero_weights = true;
+  opts.out_degree_skew = kOutDegreeSkew;
+  k2host::RandFsaGenerator generator(opts);
+  k2host::Array2Size<int32_t> fsa_size;
+  generator.GetSizes(&fsa_size);
+  k2host::FsaCreator fsa_creator(fsa_size);
+  k2host::Fsa &host_fsa = fsa_creator.GetFsa();
+  generator.GetOutput(&host_fsa);
+
+  ContextPtr cpu = GetCpuContext();
+  Array1<int32_t> row_splits(cpu, host_fsa.size1 + 1);
+  std::copy(host_fsa.indexes, host_fsa.indexes + host_fsa.size1 + 1,
+            row_splits.Data());
+  Array1<Arc> arcs(cpu, host_fsa.size2);
+  Arc *arcs_data = arcs.Data();
+  for (int32_t i = 0; i != host_fsa.size2; ++i) {
+    const k2host::Arc &arc = host_fsa.data[i];
+    arcs_data[i] = Arc(arc.src_state, arc.dest_state, arc.label, -arc.weight);
+  }
+  Fsa fsa(RaggedShape2(&row_splits, nullptr, host_fsa.size2), arcs);
+  return FsaVecFromFsa(fsa);
+}
+
+/*
+  Returns log-softmax output of shape (batch_size, kNumFrames, vocab_size)
+  that is "peaky" like that of CTC models: on each frame one symbol (blank,
+  i.e. 0, on 60% of the frames) has most of the probability mass.  Also sets
+  `segments` to sequences of decreasing length, from kNumFrames to about
+  kNumFrames / 2.
+ */
+Tensor PeakyNnetOutput(int32_t batch_size, int32_t vocab_size,
+                       Array2<int32_t> *segments) {
+  ContextPtr cpu = GetCpuContext();
+  Tensor ans(cpu, kFloatDtype,
+             std::vector<int32_t>{batch_size, kNumFrames, vocab_size});
+  float *data = ans.Data<float>();
+  std::mt19937 gen(batch_size * 1000 + vocab_size);
+  std::normal_distribution<float> noise(0, 1);
+  std::uniform_real_distribution<float> uniform(0, 1);
+  std::uniform_int_distribution<int32_t> symbol(1, vocab_size - 1);
+  for (int32_t row = 0; row != batch_size * kNumFrames; ++row) {
+    float *logits = data + row * vocab_size;
+    for (int32_t s = 0; s != vocab_size; ++s) logits[s] = noise(gen);
+    logits[uniform(gen) < 0.6 ? 0 : symbol(gen)] += 8;
+    float max_logit = *std::max_element(logits, logits + vocab_size),
+          sum = 0;
+    for (int32_t s = 0; s != vocab_size; ++s)
+      sum += std::exp(logits[s] - max_logit);
+    float log_sum = max_logit + std::log(sum);
+    for (int32_t s = 0; s != vocab_size; ++s) logits[s] -= log_sum;
+  }
+  *segments = Array2<int32_t>(cpu, batch_size, 2);
+  int32_t *segments_data = segments->Data();
+  for (int32_t i = 0; i != batch_size; ++i) {
+    segments_data[2 * i] = 0;
+    segments_data[2 * i + 1] = kNumFrames - (kNumFrames / 2) * i / batch_size;
+  }
+  return ans;
+}
+
+// The graphs and nnet outputs are cached, as Google Benchmark runs each
+// benchmark several times (to choose the number of iterations) and they are
+// slow to generate.
+DenseIntersectGraph &GetGraph(int32_t num_states, int32_t vocab_size,
+                              ContextPtr &c) {
+  static std::map<std::tuple<int32_t, int32_t, DeviceType>,
+                  DenseIntersectGraph> graphs;
+  auto key = std::make_tuple(num_states, vocab_size, c->GetDeviceType());
+  auto iter = graphs.find(key);
+  if (iter == graphs.end()) {
+    FsaVec fsas = RandomDecodingGraph(num_states, vocab_size);
+    iter = graphs.emplace(key, PrepareDenseIntersectGraph(fsas, c)).first;
+  }
+  return iter->second;
+}
+
+Tensor &GetNnetOutput(int32_t batch_size, int32_t vocab_size, ContextPtr &c,
+                      Array2<int32_t> *segments) {
+  static std::map<std::tuple<int32_t, int32_t, DeviceType>,
+                  std::pair<Tensor, Array2<int32_t>>> outputs;
+  auto key = std::make_tuple(batch_size, vocab_size, c->GetDeviceType());
+  auto iter = outputs.find(key);
+  if (iter == outputs.end()) {
+    Array2<int32_t> segments_cpu;
+    Tensor output = PeakyNnetOutput(batch_size, vocab_size, &segments_cpu);
+    iter = outputs.emplace(key, std::make_pair(output.To(c), segments_cpu))
+               .first;
+  }
+  *segments = iter->second.second;
+  return iter->second.first;
+}
+
+double ElapsedMs(std::chrono::steady_clock::time_point begin,
+                 std::chrono::steady_clock::time_point end) {
+  return std::chrono::duration<double, std::milli>(end - begin).count();
+}
+
+}  // namespace
+
+/*
+  Decodes a batch, and reports frames/s (over all the sequences), the number
+  of lattice states per frame (the active states that survived the lattice
+  pruning), the peak memory, and the time per iteration (in ms) of the
+  phases: building the DenseFsaVec, the search (IntersectDensePruned()) and
+  the readback of the lattice to the host.
+ */
+static void BM_Decode(benchmark::State &state) {
+  ContextPtr cpu = GetCpuContext(),
+             c = state.range(kDevice) == kBenchmarkCuda ? GetCudaContext()
+                                                        : cpu;
+  int32_t batch_size = state.range(kBatchSize),
+          max_active = state.range(kMaxActive),
+          num_states = state.range(kNumStates),
+          vocab_size = state.range(kVocabSize);
+  float beam = state.range(kBeam);
+  IntersectDensePrunedOptions opts;
+  opts.lattice_beam = kLatticeBeam;
+  DenseIntersectGraph &graph = GetGraph(num_states, vocab_size, c);
+  Array2<int32_t> segments;
+  Tensor &nnet_output = GetNnetOutput(batch_size, vocab_size, c, &segments);
+  int32_t num_frames = 0;
+  for (int32_t i = 0; i != batch_size; ++i)
+    num_frames += segments.Data()[2 * i + 1];
+
+  DeviceType device_type = c->GetDeviceType();
+  int32_t device_id = std::max(c->GetDeviceId(), 0);
+  ResetMaxBytesLive(device_type, device_id);
+  double dense_ms = 0, search_ms = 0, readback_ms = 0;
+  int64_t num_lattice_states = 0;
+  for (auto _ : state) {
+    auto t0 = std::chrono::steady_clock::now();
+    DenseFsaVec b_fsas(nnet_output, segments);
+    BenchmarkSync(c);
+    auto t1 = std::chrono::steady_clock::now();
+    FsaVec lattice;
+    Array1<int32_t> arc_map_a;
+    IntersectDensePruned(graph, b_fsas, beam, max_active, kMinActive, &lattice,
+                         &arc_map_a, nullptr, opts);
+    BenchmarkSync(c);
+    auto t2 = std::chrono::steady_clock::now();
+    FsaVec lattice_cpu = lattice.To(cpu);
+    auto t3 = std::chrono::steady_clock::now();
+    dense_ms += ElapsedMs(t0, t1);
+    search_ms += ElapsedMs(t1, t2);
+    readback_ms += ElapsedMs(t2, t3);
+    num_lattice_states = lattice_cpu.shape.TotSize(1);
+  }
+  using Counter = benchmark::Counter;
+  state.counters["frames/s"] = Counter(static_cast<double>(num_frames),
+                                       Counter::kIsIterationInvariantRate);
+  state.counters["states/frame"] =
+      static_cast<double>(num_lattice_states) / num_frames;
+  state.counters["peak_MB"] =
+      GetMemoryStats(device_type, device_id).max_bytes_live / 1.0e+06;
+  state.counters["dense_ms"] = Counter(dense_ms, Counter::kAvgIterations);
+  state.counters["search_ms"] = Counter(search_ms, Counter::kAvgIterations);
+  state.counters["readback_ms"] =
+      Counter(readback_ms, Counter::kAvgIterations);
+}
+
+// Each of the arguments is varied around the defaults in turn, on CUDA; the
+// defaults are also run on the CPU.
+static void DecodeArgs(benchmark::internal::Benchmark *b) {
+  const std::vector<int64_t> defaults = {16, 12, 1000, 2000, 500,
+                                         kBenchmarkCuda};
+  const std::vector<std::vector<int64_t>> values = {
+      {1, 4, 16, 64},             // batch
+      {8, 12, 16, 20},            // beam
+      {200, 1000, 5000},          // max_active
+      {500, 2000, 10000, 50000},  // states
+      {100, 500, 2000, 5000}};    // vocab
+  for (std::size_t arg = 0; arg != values.size(); ++arg) {
+    for (int64_t value : values[arg]) {
+      // The defaults themselves are only registered with the batch sizes.
+      if (arg != kBatchSize && value == defaults[arg]) continue;
+      std::vector<int64_t> args = defaults;
+      args[arg] = value;
+      b->Args(args);
+    }
+  }
+  std::vector<int64_t> args = defaults;
+  args[kDevice] = kBenchmarkCpu;
+  b->Args(args);
+  b->ArgNames({"batch", "beam", "max_active", "states", "vocab", "device"});
+  b->UseRealTime();
+  b->Unit(benchmark::kMillisecond);
+}
+BENCHMARK(BM_Decode)->Apply(DecodeArgs);
+
+}  // namespace k2
@@ -10,7 +10,19 @@
  * See LICENSE for clarification regarding multiple authors
  */
 
+#ifdef __linux__
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include <algorithm>
 #include <cstdlib>
+#include <list>
+#include <map>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 
 #include "k2/csrc/context.h"
 #include "k2/csrc/log.h"
@@ -19,16 +31,447 @@ namespace k2 {
 
 static constexpr std::size_t kAlignment = 64;
 
+// On Linux, CPU allocations of at least this many bytes are done with mmap()
+// so that they can be grown in place with mremap().
+static constexpr std::size_t kCpuMmapThreshold = 1 << 20;  // 1 MB
+
+// Allocations of up to this many bytes are rounded up to a multiple of
+// kSmallBlockSize; larger ones are rounded up to a multiple of kLargeBlockSize.
+// The rounded size is the size-class (bin) of the block.
+static constexpr std::size_t kSmallBlockSize = 512;
+static constexpr std::size_t kLargeBlockSize = 1 << 20;  // 1 MB
+static constexpr std::size_t kLargeAllocationThreshold = 1 << 20;
+
+// By default we cache at most this many bytes of freed device memory; see
+// SetMaxCachedMemory().
+static constexpr std::size_t kDefaultMaxCachedBytes =
+    static_cast<std::size_t>(1) << 32;  // 4 GB
+
+// By default we cache at most this many bytes of freed pinned host memory,
+// which can't be used by the rest of the system; see SetMaxCachedMemory().
+static constexpr std::size_t kDefaultMaxCachedPinnedBytes =
+    static_cast<std::size_t>(1) << 28;  // 256 MB
+
+/*
+  A stream-ordered caching allocator for device memory, used by CudaContext.
+  cudaFree() implicitly synchronizes the device, and cudaMalloc() is slow, so
+  instead of returning memory to the driver in Deallocate() we put it on a free
+  list and hand it out again to later Allocate() calls of the same size-class.
+
+  Free lists are kept per stream: a block freed on stream `s` may still be in
+  use by kernels queued on `s`, but any later work on `s` is ordered after them,
+  so it is safe to reuse the block for allocations made on the same stream
+  without synchronizing.  When a stream is destroyed (see ReleaseStream()), its
+  free blocks are moved to a list that any stream may take from.
+
+  There is one instance of this class per device; see GetCachingAllocator().
+  It is thread-safe.
+ */
+class CudaCachingAllocator {
+ public:
+  explicit CudaCachingAllocator(int32_t gpu_id)
+      : gpu_id_(gpu_id),
+        cached_bytes_(0),
+        max_cached_bytes_(kDefaultMaxCachedBytes) {}
+
+  void *Allocate(std::size_t bytes, cudaStream_t stream) {
+    if (bytes == 0) return nullptr;
+    std::size_t size = RoundSize(bytes);
+    std::lock_guard<std::mutex> lock(mutex_);
+    void *p = TakeFromFreeList(stream, size);
+    if (p == nullptr) p = TakeFromFreeList(kCudaStreamInvalid, size);
+    if (p == nullptr) {
+      DeviceGuard guard(gpu_id_);
+      auto ret = cudaMalloc(&p, size);
+      if (ret == cudaErrorMemoryAllocation) {
+        // Return everything we have cached to the driver and try again.
+        (void)cudaGetLastError();  // clear the error
+        ReleaseAllLocked();
+        ret = cudaMalloc(&p, size);
+      }
+      K2_CHECK_CUDA_ERROR(ret);
+    }
+    allocated_blocks_[p] = Block{size, stream};
+    return p;
+  }
+
+  void Deallocate(void *p) {
+    if (p == nullptr) return;
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto iter = allocated_blocks_.find(p);
+    K2_CHECK(iter != allocated_blocks_.end())
+        << "Freeing memory that was not allocated by this allocator";
+    Block block = iter->second;
+    allocated_blocks_.erase(iter);
+    if (cached_bytes_ + block.size > max_cached_bytes_) {
+      DeviceGuard guard(gpu_id_);
+      auto ret = cudaFree(p);
+      K2_CHECK_CUDA_ERROR(ret);
+      return;
+    }
+    free_blocks_[block.stream][block.size].push_back(p);
+    cached_bytes_ += block.size;
+  }
+
+  // Returns true if the block `p` (which must have been returned by Allocate()
+  // and not yet freed) is large enough for `new_bytes`; blocks are rounded up
+  // to their size-class so there is often some room.
+  bool ExtendInPlace(void *p, std::size_t new_bytes) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto iter = allocated_blocks_.find(p);
+    K2_CHECK(iter != allocated_blocks_.end());
+    return new_bytes <= iter->second.size;
+  }
+
+  // To be called after `stream` has been synchronized and just before it is
+  // destroyed; moves its free blocks to the list shared by all streams.
+  // Blocks allocated on `stream` that are still in use are taken to belong to
+  // `new_stream` from now on (e.g. the stream of the parent of a child
+  // context), so they'll be freed to its list.
+  void ReleaseStream(cudaStream_t stream, cudaStream_t new_stream) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto &p : allocated_blocks_)
+      if (p.second.stream == stream) p.second.stream = new_stream;
+    auto iter = free_blocks_.find(stream);
+    if (iter == free_blocks_.end()) return;
+    auto &shared_blocks = free_blocks_[kCudaStreamInvalid];
+    for (auto &p : iter->second) {
+      auto &dest = shared_blocks[p.first];
+      dest.insert(dest.end(), p.second.begin(), p.second.end());
+    }
+    free_blocks_.erase(iter);
+  }
+
+  // Returns all cached (free) blocks to the driver.
+  void ReleaseCachedMemory() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    ReleaseAllLocked();
+  }
+
+  void SetMaxCachedBytes(std::size_t max_bytes) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    max_cached_bytes_ = max_bytes;
+    if (cached_bytes_ > max_cached_bytes_) ReleaseAllLocked();
+  }
+
+ private:
+  struct Block {
+    std::size_t size;     // the rounded size, i.e. the size-class
+    cudaStream_t stream;  // the stream it was allocated on
+  };
+
+  static std::size_t RoundSize(std::size_t bytes) {
+    std::size_t n = (bytes < kLargeAllocationThreshold ? kSmallBlockSize
+                                                       : kLargeBlockSize);
+    return (bytes + n - 1) / n * n;
+  }
+
+  // Returns a free block of exactly `size` bytes that was freed on `stream`,
+  // or nullptr if there is none.  Requires mutex_ to be held.
+  void *TakeFromFreeList(cudaStream_t stream, std::size_t size) {
+    auto iter = free_blocks_.find(stream);
+    if (iter == free_blocks_.end()) return nullptr;
+    auto bin_iter = iter->second.find(size);
+    if (bin_iter == iter->second.end() || bin_iter->second.empty())
+      return nullptr;
+    void *p = bin_iter->second.back();
+    bin_iter->second.pop_back();
+    cached_bytes_ -= size;
+    return p;
+  }
+
+  // Requires mutex_ to be held.
+  void ReleaseAllLocked() {
+    if (free_blocks_.empty()) return;
+    DeviceGuard guard(gpu_id_);
+    // Blocks may still be in use by kernels queued before they were freed.
+    auto ret = cudaDeviceSynchronize();
+    K2_CHECK_CUDA_ERROR(ret);
+    for (auto &stream_blocks : free_blocks_) {
+      for (auto &bin : stream_blocks.second) {
+        for (void *p : bin.second) {
+          ret = cudaFree(p);
+          K2_CHECK_CUDA_ERROR(ret);
+        }
+      }
+    }
+    free_blocks_.clear();
+    cached_bytes_ = 0;
+  }
+
+  int32_t gpu_id_;
+  std::mutex mutex_;
+  std::size_t cached_bytes_;  // total size of blocks in free_blocks_
+  std::size_t max_cached_bytes_;
+  // maps the pointers handed out by Allocate() and not yet freed to their
+  // Block info.
+  std::unordered_map<void *, Block> allocated_blocks_;
+  // free_blocks_[stream][size] is a list of free blocks of size-class `size`
+  // that were last used on `stream`.
+  std::unordered_map<cudaStream_t,
+                     std::unordered_map<std::size_t, std::vector<void *>>>
+      free_blocks_;
+};
+
+// Returns the caching allocator for device `gpu_id`.  The allocators are never
+// destroyed, since Regions may outlive static destruction.
+static CudaCachingAllocator &GetCachingAllocator(int32_t gpu_id) {
+  static std::mutex mutex;
+  static std::unordered_map<int32_t, CudaCachingAllocator *> allocators;
+  std::lock_guard<std::mutex> lock(mutex);
+  CudaCachingAllocator *&ans = allocators[gpu_id];
+  if (ans == nullptr) ans = new CudaCachingAllocator(gpu_id);
+  return *ans;
+}
+
+// Returns all CUDA devices for which an allocator has been created.
+static std::vector<CudaCachingAllocator *> GetAllCachingAllocators() {
+  std::vector<CudaCachingAllocator *> ans;
+  int32_t num_devices = 0;
+  auto ret = cudaGetDeviceCount(&num_devices);
+  K2_CHECK_CUDA_ERROR(ret);
+  for (int32_t i = 0; i < num_devices; ++i)
+    ans.push_back(&GetCachingAllocator(i));
+  return ans;
+}
+
+/*
+  A cache of pinned (page-locked) host memory allocated with cudaHostAlloc(),
+  used by PinnedContext.  Allocating and freeing pinned memory is very
+  expensive (cudaFreeHost() synchronizes the device), so freed blocks are kept
+  in size-class bins and reused, up to a total of max_cached_bytes_.
+
+  Copies between pinned memory and the device are asynchronous, so a block may
+  still be in use by copies queued on CUDA streams when it is freed.  Like
+  PyTorch's CachingHostAllocator, we record an event on each stream that used
+  a block (see RecordStream()), and a freed block is only handed out again
+  once all of its events have completed.
+
+  There is only one instance of this class, see GetPinnedMemoryPool().  It is
+  thread-safe.
+ */
+class PinnedMemoryPool {
+ public:
+  PinnedMemoryPool()
+      : cached_bytes_(0), max_cached_bytes_(kDefaultMaxCachedPinnedBytes) {}
+
+  void *Allocate(std::size_t bytes) {
+    if (bytes == 0) return nullptr;
+    std::size_t size = RoundSize(bytes);
+    std::lock_guard<std::mutex> lock(mutex_);
+    ProcessPendingBlocks();
+    void *p = nullptr;
+    auto iter = free_blocks_.find(size);
+    if (iter != free_blocks_.end() && !iter->second.empty()) {
+      p = iter->second.back();
+      iter->second.pop_back();
+      cached_bytes_ -= size;
+    } else {
+      auto ret = cudaHostAlloc(&p, size, cudaHostAllocPortable);
+      if (ret == cudaErrorMemoryAllocation) {
+        (void)cudaGetLastError();  // clear the error
+        ReleaseAllLocked();
+        ret = cudaHostAlloc(&p, size, cudaHostAllocPortable);
+      }
+      K2_CHECK_CUDA_ERROR(ret);
+    }
+    allocated_blocks_[static_cast<char *>(p)].size = size;
+    return p;
+  }
+
+  void Deallocate(void *p) {
+    if (p == nullptr) return;
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto iter = allocated_blocks_.find(static_cast<char *>(p));
+    K2_CHECK(iter != allocated_blocks_.end())
+        << "Freeing memory that was not allocated from the pinned pool";
+    Block block = std::move(iter->second);
+    allocated_blocks_.erase(iter);
+    if (block.events.empty())
+      CacheBlock(p, block.size);
+    else
+      pending_blocks_.emplace_back(p, std::move(block));
+  }
+
+  // Returns true if the block `p` is large enough for `new_bytes` (see
+  // RoundSize()).
+  bool ExtendInPlace(void *p, std::size_t new_bytes) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto iter = allocated_blocks_.find(static_cast<char *>(p));
+    K2_CHECK(iter != allocated_blocks_.end());
+    return new_bytes <= iter->second.size;
+  }
+
+  // Records that the block containing `p` (which must be in a block returned
+  // by Allocate() and not yet freed) is used by work queued so far on the
+  // stream of `stream_context`.
+  void RecordStream(const void *p, const Context &stream_context) {
+    cudaStream_t stream = stream_context.GetCudaStream();
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto iter = allocated_blocks_.upper_bound(
+        const_cast<char *>(static_cast<const char *>(p)));
+    K2_CHECK(iter != allocated_blocks_.begin());
+    --iter;
+    K2_CHECK_LT(static_cast<const char *>(p), iter->first + iter->second.size)
+        << "Memory that was not allocated from the pinned pool";
+    std::vector<std::pair<cudaStream_t, cudaEvent_t>> &events =
+        iter->second.events;
+    // An event recorded later on the same stream supersedes the earlier one.
+    auto event_iter = std::find_if(
+        events.begin(), events.end(),
+        [stream](const std::pair<cudaStream_t, cudaEvent_t> &e) -> bool {
+          return e.first == stream;
+        });
+    DeviceGuard guard(stream_context);
+    if (event_iter == events.end()) {
+      cudaEvent_t event;
+      auto ret = cudaEventCreateWithFlags(&event, cudaEventDisableTiming);
+      K2_CHECK_CUDA_ERROR(ret);
+      events.emplace_back(stream, event);
+      event_iter = events.end() - 1;
+    }
+    auto ret = cudaEventRecord(event_iter->second, stream);
+    K2_CHECK_CUDA_ERROR(ret);
+  }
+
+  // Returns all cached (free) blocks, including those whose events have not
+  // completed yet, to the driver.
+  void ReleaseCachedMemory() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    ReleaseAllLocked();
+  }
+
+  void SetMaxCachedBytes(std::size_t max_bytes) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    max_cached_bytes_ = max_bytes;
+    if (cached_bytes_ > max_cached_bytes_) ReleaseAllLocked();
+  }
+
+ private:
+  struct Block {
+    std::size_t size = 0;  // the size-class
+    // An event for each stream that used the block, recorded after the last
+    // work on that stream that used it.
+    std::vector<std::pair<cudaStream_t, cudaEvent_t>> events;
+  };
+
+  static std::size_t RoundSize(std::size_t bytes) {
+    // round up to a power of 2, of at least kAlignment bytes; pinned buffers
+    // are mostly used for transfers of varying sizes, so we prefer fewer, more
+    // reusable size-classes here.  Large blocks are rounded up to a multiple
+    // of kLargeBlockSize instead, so as not to pin much more than needed.
+    if (bytes >= kLargeAllocationThreshold)
+      return (bytes + kLargeBlockSize - 1) / kLargeBlockSize * kLargeBlockSize;
+    std::size_t size = kAlignment;
+    while (size < bytes) size <<= 1;
+    return size;
+  }
+
+  // Puts a block that is no longer in use on the free list, or returns it to
+  // the driver if the cache is full.  Requires mutex_ to be held.
+  void CacheBlock(void *p, std::size_t size) {
+    if (cached_bytes_ + size > max_cached_bytes_) {
+      auto ret = cudaFreeHost(p);
+      K2_CHECK_CUDA_ERROR(ret);
+      return;
+    }
+    free_blocks_[size].push_back(p);
+    cached_bytes_ += size;
+  }
+
+  // Destroys the events of `block`, first waiting for them to complete if
+  // `wait` is true; if it is false, returns false (and does nothing) if any
+  // of them has not completed.
+  static bool FinishEvents(Block *block, bool wait) {
+    for (auto &e : block->events) {
+      auto ret = wait ? cudaEventSynchronize(e.second)
+                      : cudaEventQuery(e.second);
+      if (ret == cudaErrorNotReady) {
+        (void)cudaGetLastError();  // clear the error
+        return false;
+      }
+      K2_CHECK_CUDA_ERROR(ret);
+    }
+    for (auto &e : block->events) {
+      auto ret = cudaEventDestroy(e.second);
+      K2_CHECK_CUDA_ERROR(ret);
+    }
+    block->events.clear();
+    return true;
+  }
+
+  // Moves the freed blocks whose events have all completed to the free
+  // lists.  Requires mutex_ to be held.
+  void ProcessPendingBlocks() {
+    auto iter = pending_blocks_.begin();
+    while (iter != pending_blocks_.end()) {
+      if (FinishEvents(&iter->second, false)) {
+        CacheBlock(iter->first, iter->second.size);
+        iter = pending_blocks_.erase(iter);
+      } else {
+        ++iter;
+      }
+    }
+  }
+
+  // Requires mutex_ to be held.
+  void ReleaseAllLocked() {
+    for (auto &p : pending_blocks_) {
+      FinishEvents(&p.second, true);
+      auto ret = cudaFreeHost(p.first);
+      K2_CHECK_CUDA_ERROR(ret);
+    }
+    pending_blocks_.clear();
+    for (auto &bin : free_blocks_) {
+      for (void *p : bin.second) {
+        auto ret = cudaFreeHost(p);
+        K2_CHECK_CUDA_ERROR(ret);
+      }
+    }
+    free_blocks_.clear();
+    cached_bytes_ = 0;
+  }
+
+  std::mutex mutex_;
+  std::size_t cached_bytes_;  // total size of blocks in free_blocks_
+  std::size_t max_cached_bytes_;
+  // maps the pointers handed out and not yet freed to their Block info; it is
+  // ordered so that RecordStream() can find the block containing a pointer.
+  std::map<char *, Block> allocated_blocks_;
+  // blocks that have been freed but may still be in use by queued work.
+  std::list<std::pair<void *, Block>> pending_blocks_;
+  // free_blocks_[size] is a list of free blocks of size-class `size`.
+  std::unordered_map<std::size_t, std::vector<void *>> free_blocks_;
+};
+
+// The pool is never destroyed, since Regions may outlive static destruction.
+static PinnedMemoryPool &GetPinnedMemoryPool() {
+  static PinnedMemoryPool *pool = new PinnedMemoryPool();
+  return *pool;
+}
+
 // TODO(haowen): most of implementations below should be updated later.
 class CpuContext : public Context {
  public:
   CpuContext() = default;
   ContextPtr GetCpuContext() override { return shared_from_this(); }
-  ContextPtr GetPinnedContext() override { return nullptr; }
+  ContextPtr GetPinnedContext() override { return k2::GetPinnedContext(); }
   DeviceType GetDeviceType() const override { return kCpu; }
 
   void *Allocate(std::size_t bytes, void **deleter_context) override {
     void *p = nullptr;
+#ifdef __linux__
+    if (bytes >= kCpuMmapThreshold && deleter_context != nullptr) {
+      // Large allocations are mapped directly, so that ExtendInPlace() can
+      // grow them with mremap().  `deleter_context` holds the mapped size.
+      std::size_t mapped_bytes = RoundUpToPageSize(bytes);
+      p = mmap(nullptr, mapped_bytes, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      K2_CHECK_NE(p, MAP_FAILED) << "mmap failed for " << bytes << " bytes";
+      *deleter_context = new std::size_t(mapped_bytes);
+      return p;
+    }
+#endif
     if (bytes) {
       int32_t ret = posix_memalign(&p, kAlignment, bytes);
       K2_CHECK_EQ(ret, 0);
@@ -41,9 +484,84 @@ class CpuContext : public Context {
     return other.GetDeviceType() == kCpu;
   }
 
-  void Deallocate(void *data, void * /*deleter_context*/) override {
+  void Deallocate(void *data, void *deleter_context) override {
+#ifdef __linux__
+    if (deleter_context != nullptr) {
+      std::size_t *mapped_bytes = static_cast<std::size_t *>(deleter_context);
+      int32_t ret = munmap(data, *mapped_bytes);
+      K2_CHECK_EQ(ret, 0);
+      delete mapped_bytes;
+      return;
+    }
+#endif
     free(data);
   }
+
+  bool ExtendInPlace(void *data, void **deleter_context,
+                     std::size_t /*num_bytes*/,
+                     std::size_t new_num_bytes) override {
+#ifdef __linux__
+    if (*deleter_context == nullptr) return false;
+    std::size_t *mapped_bytes = static_cast<std::size_t *>(*deleter_context);
+    std::size_t new_mapped_bytes = RoundUpToPageSize(new_num_bytes);
+    if (new_mapped_bytes <= *mapped_bytes) return true;
+    // Without MREMAP_MAYMOVE this fails if the following address range is in
+    // use, in which case the caller falls back to allocating and copying.
+    void *p = mremap(data, *mapped_bytes, new_mapped_bytes, 0);
+    if (p == MAP_FAILED) return false;
+    K2_CHECK_EQ(p, data);
+    *mapped_bytes = new_mapped_bytes;
+    return true;
+#else
+    return false;
+#endif
+  }
+
+ private:
+#ifdef __linux__
+  static std::size_t RoundUpToPageSize(std::size_t bytes) {
+    static const std::size_t page_size = sysconf(_SC_PAGESIZE);
+    return (bytes + page_size - 1) / page_size * page_size;
+  }
+#endif
+};
+
+/*
+  A CPU context whose memory is pinned, i.e. page-locked, so that transfers
+  between it and the GPU can use DMA at full bandwidth and can be
+  asynchronous.  It is compatible with CpuContext.
+ */
+class PinnedContext : public Context {
+ public:
+  PinnedContext() = default;
+  ContextPtr GetCpuContext() override { return k2::GetCpuContext(); }
+  ContextPtr GetPinnedContext() override { return shared_from_this(); }
+  DeviceType GetDeviceType() const override { return kCpu; }
+
+  void *Allocate(std::size_t bytes, void **deleter_context) override {
+    void *p = GetPinnedMemoryPool().Allocate(bytes);
+    if (deleter_context != nullptr) *deleter_context = nullptr;
+    return p;
+  }
+
+  bool IsCompatible(const Context &other) const override {
+    return other.GetDeviceType() == kCpu;
+  }
+
+  void Deallocate(void *data, void * /*deleter_context*/) override {
+    GetPinnedMemoryPool().Deallocate(data);
+  }
+
+  bool ExtendInPlace(void *data, void ** /*deleter_context*/,
+                     std::size_t /*num_bytes*/,
+                     std::size_t new_num_bytes) override {
+    return GetPinnedMemoryPool().ExtendInPlace(data, new_num_bytes);
+  }
+
+  void RecordStream(const void *data,
+                    const Context &stream_context) const override {
+    GetPinnedMemoryPool().RecordStream(data, stream_context);
+  }
 };
 
 class CudaContext : public Context {
@@ -52,23 +570,49 @@ class CudaContext : public Context {
     if (gpu_id_ != -1) {
       auto ret = cudaSetDevice(gpu_id_);
       K2_CHECK_CUDA_ERROR(ret);
+    } else {
+      // TODO(haowen): choose one from available GPUs if gpu_id == -1?
+      // and handle GPU ids from multiple machines.
+      auto ret = cudaGetDevice(&gpu_id_);
+      K2_CHECK_CUDA_ERROR(ret);
     }
-    // TODO(haowen): choose one from available GPUs if gpu_id == -1?
-    // and handle GPU ids from multiple machines.
     auto ret = cudaStreamCreate(&stream_);
     K2_CHECK_CUDA_ERROR(ret);
+    allocator_ = &GetCachingAllocator(gpu_id_);
+    parent_stream_ = kCudaStreamInvalid;
+  }
+
+  // Creates a child of the context of device `gpu_id` that has stream
+  // `parent_stream`.
+  CudaContext(int32_t gpu_id, cudaStream_t parent_stream) : gpu_id_(gpu_id) {
+    DeviceGuard guard(gpu_id_);
+    auto ret = cudaStreamCreate(&stream_);
+    K2_CHECK_CUDA_ERROR(ret);
+    allocator_ = &GetCachingAllocator(gpu_id_);
+    parent_stream_ = parent_stream;
+    // Work on the child has to wait for work already queued on the parent.
+    cudaEvent_t event;
+    ret = cudaEventCreateWithFlags(&event, cudaEventDisableTiming);
+    K2_CHECK_CUDA_ERROR(ret);
+    ret = cudaEventRecord(event, parent_stream_);
+    K2_CHECK_CUDA_ERROR(ret);
+    ret = cudaStreamWaitEvent(stream_, event, 0);
+    K2_CHECK_CUDA_ERROR(ret);
+    ret = cudaEventDestroy(event);
+    K2_CHECK_CUDA_ERROR(ret);
   }
+
+  ContextPtr Child() override {
+    return std::make_shared<CudaContext>(gpu_id_, stream_);
+  }
+
   ContextPtr GetCpuContext() override { return k2::GetCpuContext(); }
-  ContextPtr GetPinnedContext() override { return nullptr; }
+  ContextPtr GetPinnedContext() override { return k2::GetPinnedContext(); }
   DeviceType GetDeviceType() const override { return kCuda; }
   int32_t GetDeviceId() const override { return gpu_id_; }
 
   void *Allocate(std::size_t bytes, void **deleter_context) override {
-    void *p = nullptr;
-    if (bytes) {
-      auto ret = cudaMalloc(&p, bytes);
-      K2_CHECK_CUDA_ERROR(ret);
-    }
+    void *p = allocator_->Allocate(bytes, stream_);
     if (deleter_context != nullptr) *deleter_context = nullptr;
     return p;
   }
@@ -78,8 +622,13 @@ class CudaContext : public Context {
   }
 
   void Deallocate(void *data, void * /*deleter_context*/) override {
-    auto ret = cudaFree(data);
-    K2_CHECK_CUDA_ERROR(ret);
+    allocator_->Deallocate(data);
+  }
+
+  bool ExtendInPlace(void *data, void ** /*deleter_context*/,
+                     std::size_t /*num_bytes*/,
+                     std::size_t new_num_bytes) override {
+    return allocator_->ExtendInPlace(data, new_num_bytes);
   }
 
   cudaStream_t GetCudaStream() const override { return stream_; }
@@ -87,22 +636,65 @@ class CudaContext : public Context {
   void Sync() const override {
     auto ret = cudaStreamSynchronize(stream_);
     K2_CHECK_CUDA_ERROR(ret);
+    internal::RecordSync(*this);
   }
 
   ~CudaContext() {
-    auto ret = cudaStreamDestroy(stream_);
+    // The blocks freed on stream_ may only be reused by other streams after
+    // the work queued on stream_ has finished.
+    auto ret = cudaStreamSynchronize(stream_);
+    K2_CHECK_CUDA_ERROR(ret);
+    allocator_->ReleaseStream(stream_, parent_stream_);
+    ret = cudaStreamDestroy(stream_);
     K2_CHECK_CUDA_ERROR(ret);
   }
 
  private:
   int32_t gpu_id_;
   cudaStream_t stream_;
+  // The stream of the context this was created from by Child(), or
+  // kCudaStreamInvalid.
+  cudaStream_t parent_stream_;
+  CudaCachingAllocator *allocator_;  // NOT owned here
 };
 
 ContextPtr GetCpuContext() { return std::make_shared<CpuContext>(); }
 
 ContextPtr GetCudaContext(int32_t gpu_id /*= -1*/) {
-  return std::make_shared<CudaContext>(gpu_id);
+  // We return the same context (and hence the same stream) for each device.
+  // Memory freed to the caching allocator is only reused on the stream it was
+  // allocated on, which would not be safe if kernels on other streams could
+  // still be using it; sharing the stream, like PyTorch's "current stream",
+  // avoids that.  The contexts are never destroyed, since Regions may outlive
+  // static destruction.
+  if (gpu_id < 0) {
+    auto ret = cudaGetDevice(&gpu_id);
+    K2_CHECK_CUDA_ERROR(ret);
+  } else {
+    auto ret = cudaSetDevice(gpu_id);
+    K2_CHECK_CUDA_ERROR(ret);
+  }
+  static std::mutex mutex;
+  static std::unordered_map<int32_t, ContextPtr *> contexts;
+  std::lock_guard<std::mutex> lock(mutex);
+  ContextPtr *&ans = contexts[gpu_id];
+  if (ans == nullptr)
+    ans = new ContextPtr(std::make_shared<CudaContext>(gpu_id));
+  return *ans;
+}
+
+ContextPtr GetPinnedContext() { return std::make_shared<PinnedContext>(); }
+
+void ReleaseCachedMemory() {
+  for (CudaCachingAllocator *allocator : GetAllCachingAllocators())
+    allocator->ReleaseCachedMemory();
+  GetPinnedMemoryPool().ReleaseCachedMemory();
+}
+
+void SetMaxCachedMemory(std::size_t max_bytes) {
+  for (CudaCachingAllocator *allocator : GetAllCachingAllocators())
+    allocator->SetMaxCachedBytes(max_bytes);
+  GetPinnedMemoryPool().SetMaxCachedBytes(max_bytes);
 }
 
 }  // namespace k2
@@ -17,6 +17,7 @@ const DtypeTraits g_dtype_traits_array[] = {
     {kFloatBase, 4, "float"}, {kFloatBase, 8, "double"}, {kIntBase, 1, "int8"},
     {kIntBase, 2, "int16"},   {kIntBase, 4, "int32"},    {kIntBase, 8, "int64"},
     {kUintBase, 4, "uint32"}, {kUintBase, 8, "uint64"},
+    {kFloatBase, 2, "half"},
 };
 
 const Dtype DtypeOf<float>::dtype;
@@ -27,4 +28,5 @@ const Dtype DtypeOf<int32_t>::dtype;
 const Dtype DtypeOf<int64_t>::dtype;
 const Dtype DtypeOf<uint32_t>::dtype;
 const Dtype DtypeOf<uint64_t>::dtype;
+const Dtype DtypeOf<__half>::dtype;
 }  // namespace k2
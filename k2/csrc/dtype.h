@@ -12,6 +12,8 @@
 #ifndef K2_CSRC_DTYPE_H_
 #define K2_CSRC_DTYPE_H_
 
+#include <cuda_fp16.h>
+
 #include <cstdint>
 
 #include "k2/csrc/log.h"
@@ -68,6 +70,10 @@ enum Dtype {
   kInt64Dtype,
   kUint32Dtype,
   kUint64Dtype,
+  // Half precision, e.g. nnet outputs from PyTorch.  It is not covered by
+  // FOR_ALL_DTYPES() since most operations don't support it; Cast() and
+  // CopyTensorElements() do.
+  kHalfDtype,
 };
 
 inline DtypeTraits TraitsOf(Dtype dtype) {
@@ -117,6 +123,11 @@ struct DtypeOf<uint64_t> {
   static const Dtype dtype = kUint64Dtype;
 };
 
+template <>
+struct DtypeOf<__half> {
+  static const Dtype dtype = kHalfDtype;
+};
+
 /*
   Evaluates Expr for TypeName being all dtypes.  E.g.
      FOR_ALL_DTYPES(t.GetDtype(), T, SomeFuncCall<T>(a,b,c..));
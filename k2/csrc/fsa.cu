@@ -6,10 +6,16 @@
 
 // See ../../LICENSE for // clarification regarding multiple authors
 
+#include <algorithm>
+#include <cstddef>
+#include <limits>
+#include <memory>
 #include <string>
+#include <vector>
 
 #include "k2/csrc/array_ops.h"
 #include "k2/csrc/fsa.h"
+#include "k2/csrc/profile.h"
 
 namespace {
 /* Will be used in FsaVecFromTensor to call ExclusiveSum (which calls
@@ -27,7 +33,7 @@ struct IsLastArcOfFsa {
   explicit IsLastArcOfFsa(int32_t num_arcs, const k2::Arc *arcs)
       : num_arcs(num_arcs), arcs(arcs) {}
   __host__ __device__ IsLastArcOfFsa(const IsLastArcOfFsa &other)
-      : num_arcs(num_arcs), arcs(other.arcs) {}
+      : num_arcs(other.num_arcs), arcs(other.arcs) {}
 
   // operator[] and operator+ are required by cub::DeviceScan::ExclusiveSum
   __host__ __device__ bool operator[](int32_t i) const {
@@ -36,6 +42,7 @@ struct IsLastArcOfFsa {
   __host__ __device__ IsLastArcOfFsa operator+(int32_t n) const {
     IsLastArcOfFsa tmp(*this);
     tmp.arcs += n;
+    tmp.num_arcs -= n;
     return tmp;
   }
 };
@@ -82,27 +89,119 @@ std::string FsaPropertiesAsString(int32_t properties) {
 }
 
 
+namespace {
+// The result of GetFsaVecBasicProperties(), cached in the Region of the arcs
+// (see Region::cached_result).  It holds the row_splits it was computed for,
+// so their data can't be freed and reused while it exists.
+struct FsaVecPropertiesCache {
+  int64_t arcs_version;
+  int32_t arcs_byte_offset;
+  int32_t num_arcs;
+  Array1<int32_t> row_splits1;
+  Array1<int32_t> row_splits2;
+  int64_t row_splits1_version;
+  int64_t row_splits2_version;
+  // If false, `properties` and `tot_properties` have not been computed, and
+  // there are only the known_properties (see SetFsaVecKnownProperties()).
+  bool has_properties;
+  Array1<int32_t> properties;
+  int32_t tot_properties;
+  // Properties that all the FSAs have; equals tot_properties if
+  // has_properties.
+  int32_t known_properties;
+
+  // Returns true if this was computed for `fsa_vec`, and none of its arcs
+  // and row_splits can have been modified since.
+  bool Matches(const FsaVec &fsa_vec) const {
+    const Array1<int32_t> &splits1 = fsa_vec.shape.RowSplits(1),
+                          &splits2 = fsa_vec.shape.RowSplits(2);
+    if (arcs_version != fsa_vec.values.GetRegion()->version.load() ||
+        arcs_byte_offset != fsa_vec.values.ByteOffset() ||
+        num_arcs != fsa_vec.values.Dim() ||
+        splits2.Dim() != row_splits2.Dim() ||
+        splits2.Data() != row_splits2.Data() ||
+        row_splits2_version != splits2.GetRegion()->version.load() ||
+        splits1.Dim() != row_splits1.Dim())
+      return false;
+    // With one FSA, row_splits1 can only be [ 0 num_states ], so it doesn't
+    // matter which array it is; this is the case of GetFsaBasicProperties(),
+    // which creates a new one each time.
+    return splits1.Dim() == 2 ||
+           (splits1.Data() == row_splits1.Data() &&
+            row_splits1_version == splits1.GetRegion()->version.load());
+  }
+};
+
+// Returns the cache of the properties of `fsa_vec`, or nullptr if there is
+// none that is valid for it.
+std::shared_ptr<FsaVecPropertiesCache> GetPropertiesCache(
+    const FsaVec &fsa_vec) {
+  auto cache = std::static_pointer_cast<FsaVecPropertiesCache>(
+      std::atomic_load(&fsa_vec.values.GetRegion()->cached_result));
+  if (cache != nullptr && cache->Matches(fsa_vec)) return cache;
+  return nullptr;
+}
+
+// Returns a new cache for `fsa_vec`, with nothing known.
+std::shared_ptr<FsaVecPropertiesCache> NewPropertiesCache(
+    const FsaVec &fsa_vec) {
+  const Array1<Arc> &arcs = fsa_vec.values;
+  const Array1<int32_t> &row_splits1 = fsa_vec.shape.RowSplits(1),
+                        &row_splits2 = fsa_vec.shape.RowSplits(2);
+  auto cache = std::make_shared<FsaVecPropertiesCache>();
+  cache->arcs_version = arcs.GetRegion()->version.load();
+  cache->arcs_byte_offset = arcs.ByteOffset();
+  cache->num_arcs = arcs.Dim();
+  cache->row_splits1 = row_splits1;
+  cache->row_splits2 = row_splits2;
+  cache->row_splits1_version = row_splits1.GetRegion()->version.load();
+  cache->row_splits2_version = row_splits2.GetRegion()->version.load();
+  cache->has_properties = false;
+  cache->tot_properties = 0;
+  cache->known_properties = 0;
+  return cache;
+}
+}  // namespace
+
 void GetFsaVecBasicProperties(FsaVec &fsa_vec,
                               Array1<int32_t> *properties_out,
                               int32_t *tot_properties_out) {
+  K2_PROFILE_SCOPE("GetFsaVecBasicProperties", fsa_vec.Context());
   if (fsa_vec.NumAxes() != 3) {
     K2_LOG(FATAL) << "Input has wrong num-axes " << fsa_vec.NumAxes()
                   << " vs. 3.";
   }
-  ContextPtr c = fsa_vec.Context();
-  const int32_t *row_ids1_data = fsa_vec.shape.RowIds(1).Data(),
-                *row_splits1_data = fsa_vec.shape.RowSplits(1).Data(),
-                *row_ids2_data = fsa_vec.shape.RowIds(2).Data(),
-                *row_splits2_data = fsa_vec.shape.RowSplits(2).Data();
-  Arc *arcs_data = fsa_vec.values.Data();
+  // Note: we only use const accessors of the arcs and row_splits below (the
+  // shape's Accessor() is one), so as not to change the versions of their
+  // regions.
+  const Array1<Arc> &arcs = fsa_vec.values;
+  RegionPtr arcs_region = arcs.GetRegion();
+  auto cache = GetPropertiesCache(fsa_vec);
+  if (cache != nullptr && cache->has_properties) {
+    *properties_out = cache->properties;
+    *tot_properties_out = cache->tot_properties;
+    return;
+  }
+  auto new_cache = NewPropertiesCache(fsa_vec);
 
-  int32_t num_arcs = fsa_vec.values.Dim();
+  ContextPtr c = fsa_vec.Context();
+  RaggedShapeAccessor<3> shape = fsa_vec.shape.Accessor<3>();
+  const Arc *arcs_data = arcs.Data();
 
-  // properties per arc; these will be and-ed over all arcs.
-  Array1<int32_t> properties(c, num_arcs);
-  int32_t num_states = fsa_vec.shape.RowIds(1).Dim(),
+  int32_t num_arcs = arcs.Dim(),
+          num_states = fsa_vec.shape.TotSize(1),
           num_fsas = fsa_vec.shape.Dim0();
 
+  // All the properties are reduced per FSA with one AndPerSublist() over
+  // `elem_properties`, which has, for each FSA, the properties of its arcs,
+  // then of its states (their reachability, see below), then of the FSA
+  // itself; `elem_row_splits` is the row_splits of that.
+  int32_t num_elems = num_arcs + num_states + num_fsas;
+  Array1<int32_t> elem_properties(c, num_elems),
+      elem_row_splits(c, num_fsas + 1);
+  int32_t *elem_properties_data = elem_properties.Data(),
+          *elem_row_splits_data = elem_row_splits.Data();
+
   // `reachable[idx01]` will be true if the state with index idx01 has an arc
   // entering it or is state 0 of its FSA, not counting self-loops; it's a
   // looser condition than being 'accessible' in FSA terminlogy, simply meaning
@@ -112,24 +211,19 @@ void GetFsaVecBasicProperties(FsaVec &fsa_vec,
   // the final-state of its FSA (i.e. last-numbered) or has at least one arc
   // leaving it, not counting self-loops. Again, it's a looser condition than
   // being 'co-accessible' in FSA terminology.
+  Array1<char> reachable(c, num_states * 2, static_cast<char>(0));
+  char *reachable_data = reachable.Data();
 
-  Array1<char> reachable_mem(c, num_states * 2 + num_fsas * 2, static_cast<char>(0));
-
-  Array1<char> reachable = reachable_mem.Range(0, num_states);
-  Array1<char> co_reachable = reachable_mem.Range(num_states, num_states);
-
-  int32_t *properties_data = properties.Data();
-  char *reachable_data = reachable.Data();  // access co_reachable via this.
-
-  auto lambda_get_properties = [=] __host__ __device__(int32_t idx012) -> void {
+  auto lambda_get_arc_properties =
+      [=] __host__ __device__(int32_t idx012) -> void {
     Arc arc = arcs_data[idx012];
     Arc prev_arc;
     if (idx012 > 0) prev_arc = arcs_data[idx012 - 1];
-    int32_t idx01 = row_ids2_data[idx012], idx01x = row_splits2_data[idx012],
-            idx2 = idx012 - idx01x, idx0 = row_ids1_data[idx01],
-            idx0x = row_splits1_data[idx0],
-            idx0x_next = row_splits1_data[idx0 + 1], idx1 = idx01 - idx0x,
-            idx0xx = row_splits2_data[idx0x];
+    int32_t idx01 = shape.Idx<1>(idx012), idx01x = shape.RowSplit<2>(idx01),
+            idx2 = idx012 - idx01x, idx0 = shape.Idx<0, 1>(idx01),
+            idx0x = shape.RowSplit<1>(idx0),
+            idx0x_next = shape.RowSplit<1>(idx0 + 1), idx1 = idx01 - idx0x,
+            idx0xx = shape.RowSplit<2>(idx0x);
     int32_t this_fsa_num_states = idx0x_next - idx0x;
 
     int32_t neg_property = 0;
@@ -171,72 +265,109 @@ void GetFsaVecBasicProperties(FsaVec &fsa_vec,
       // it.
       if (arc.dest_state != arc.src_state)
         reachable_data[num_states + idx01] = 1;
+    } else {
+      if (prev_arc.symbol >= arc.symbol) {
+        neg_property |= kFsaPropertiesArcSortedAndDeterministic;
+        if (prev_arc.symbol > arc.symbol)
+          neg_property |= kFsaPropertiesArcSorted;
+      }
     }
-    properties_data[idx012] = ~neg_property;
+    // The arcs of FSA idx0 start at position idx0xx + idx0x + idx0 of
+    // elem_properties.
+    elem_properties_data[idx012 + idx0x + idx0] = ~neg_property;
   };
-  Eval(c, num_arcs, lambda_get_properties);
-
-
-  // Figure out the properties per FSA.
-  RaggedShape fsa_to_arcs_shape = RemoveAxis(fsa_vec.shape, 1),
-      fsa_to_states_shape = RemoveAxis(fsa_vec.shape, 2);
-  Ragged<int32_t> properties_ragged(fsa_to_arcs_shape, properties);
-  Ragged<char> reachable_ragged(fsa_to_states_shape, reachable),
-      co_reachable_ragged(fsa_to_states_shape, co_reachable);
-
-
-  Array1<int32_t> properties_per_fsa_mem(c, num_fsas + 1),
-      properties_per_fsa = properties_per_fsa_mem.Range(0, num_fsas),
-      properties_total = properties_per_fsa_mem.Range(num_fsas, 1);
-
-
-  Array1<char> reachable_per_fsa = reachable_mem.Range(num_states * 2, num_fsas),
-      co_reachable_per_fsa = reachable_mem.Range(num_states * 2 + num_fsas, num_fsas);
-  {
-    ParallelRunner pr(c);
-    {
-      With(pr.NewStream());
-      AndPerSublist(properties_ragged, static_cast<int32_t>(kFsaAllProperties),
-                    &properties_per_fsa);
+  Eval(c, num_arcs, lambda_get_arc_properties);
+
+  auto lambda_get_state_properties =
+      [=] __host__ __device__(int32_t i) -> void {
+    if (i < num_states) {
+      // The states of FSA idx0 start after its arcs, at position
+      // idx0xx_next + idx0x + idx0.
+      int32_t idx01 = i, idx0 = shape.Idx<0, 1>(idx01),
+              idx0xx_next = shape.RowSplit<2>(shape.RowSplit<1>(idx0 + 1));
+      int32_t neg_property =
+          (!reachable_data[idx01] * kFsaPropertiesMaybeAccessible) |
+          (!reachable_data[num_states + idx01] *
+           kFsaPropertiesMaybeCoaccessible);
+      elem_properties_data[idx0xx_next + idx01 + idx0] = ~neg_property;
     }
-    {
-      With(pr.NewStream());
-      AndPerSublist(reachable_ragged, static_cast<char>(1), &reachable_per_fsa);
-    }
-    {
-      With(pr.NewStream());
-      AndPerSublist(co_reachable_ragged, static_cast<char>(1),
-                    &co_reachable_per_fsa);
+    if (i <= num_fsas) {
+      int32_t idx0x = shape.RowSplit<1>(i), idx0xx = shape.RowSplit<2>(idx0x);
+      elem_row_splits_data[i] = idx0xx + idx0x + i;
+      if (i < num_fsas) {
+        int32_t idx0x_next = shape.RowSplit<1>(i + 1),
+                idx0xx_next = shape.RowSplit<2>(idx0x_next);
+        // An FSA with no arcs can't be serialized, and isn't Nonempty.
+        int32_t neg_property =
+            (idx0xx == idx0xx_next
+                 ? (kFsaPropertiesSerializable | kFsaPropertiesNonempty)
+                 : 0);
+        elem_properties_data[idx0xx_next + idx0x_next + i] = ~neg_property;
+      }
     }
-  }
-
-  {
-    int32_t *properties_per_fsa_data = properties_per_fsa.Data();
-    char *reachable_per_fsa_data = reachable_per_fsa.Data(),
-        *co_reachable_per_fsa_data = co_reachable_per_fsa.Data();
-
-    auto lambda_finalize_properties = [=] __host__ __device__(int32_t i) -> void {
-      int32_t neg_properties = ~(properties_per_fsa_data[i]);
-      char reachable = reachable_per_fsa_data[i],
-          co_reachable = co_reachable_per_fsa_data[i];
-      int32_t fsa_has_no_arcs =
-          (row_splits2_data[row_splits1_data[i]] ==
-           row_splits2_data[row_splits1_data[i + 1]]);
-      neg_properties |=  (!reachable * kFsaPropertiesMaybeAccessible) |
-          (!co_reachable * kFsaPropertiesMaybeCoaccessible) |
-          (fsa_has_no_arcs * kFsaPropertiesSerializable);
-      properties_per_fsa_data[i] = ~neg_properties;
-    };
-    Eval(c, num_fsas, lambda_finalize_properties);
-
+  };
+  Eval(c, std::max(num_states, num_fsas + 1), lambda_get_state_properties);
+
+  RaggedShape elems_shape =
+      RaggedShape2(&elem_row_splits, nullptr, num_elems);
+  Ragged<int32_t> elem_properties_ragged(elems_shape, elem_properties);
+  Array1<int32_t> properties_per_fsa;
+  if (num_fsas == 0) {
+    properties_per_fsa = Array1<int32_t>(c, 0);
+    new_cache->tot_properties = kFsaAllProperties;
+  } else {
+    Array1<int32_t> properties_per_fsa_mem(c, num_fsas + 1),
+        properties_total = properties_per_fsa_mem.Range(num_fsas, 1);
+    properties_per_fsa = properties_per_fsa_mem.Range(0, num_fsas);
+    AndPerSublist(elem_properties_ragged,
+                  static_cast<int32_t>(kFsaAllProperties), &properties_per_fsa);
     And(properties_per_fsa, static_cast<int32_t>(kFsaAllProperties),
         &properties_total);
-    *tot_properties_out = properties_total[0];
-    *properties_out = properties_per_fsa;
+    new_cache->tot_properties = properties_total[0];
   }
+  new_cache->properties = properties_per_fsa;
+  new_cache->has_properties = true;
+  new_cache->known_properties = new_cache->tot_properties;
+  std::atomic_store(&arcs_region->cached_result,
+                    std::static_pointer_cast<void>(new_cache));
+  *tot_properties_out = new_cache->tot_properties;
+  *properties_out = properties_per_fsa;
+}
+
+void SetFsaVecKnownProperties(FsaVec &fsa_vec, int32_t properties) {
+  K2_CHECK_EQ(fsa_vec.NumAxes(), 3);
+  auto cache = GetPropertiesCache(fsa_vec);
+  if (cache != nullptr &&
+      (cache->known_properties & properties) == properties)
+    return;
+  // The cache may be in use by other threads, so it is replaced rather than
+  // modified.
+  auto new_cache = (cache != nullptr
+                        ? std::make_shared<FsaVecPropertiesCache>(*cache)
+                        : NewPropertiesCache(fsa_vec));
+  new_cache->known_properties |= properties;
+  std::atomic_store(&fsa_vec.values.GetRegion()->cached_result,
+                    std::static_pointer_cast<void>(new_cache));
 }
 
+int32_t GetFsaVecKnownProperties(FsaVec &fsa_vec) {
+  K2_CHECK_EQ(fsa_vec.NumAxes(), 3);
+  auto cache = GetPropertiesCache(fsa_vec);
+  return (cache != nullptr ? cache->known_properties : 0);
+}
 
+bool FsaVecHasProperties(FsaVec &fsa_vec, int32_t properties) {
+  K2_CHECK_EQ(fsa_vec.NumAxes(), 3);
+  auto cache = GetPropertiesCache(fsa_vec);
+  if (cache != nullptr &&
+      ((cache->known_properties & properties) == properties ||
+       cache->has_properties))
+    return (cache->known_properties & properties) == properties;
+  Array1<int32_t> properties_per_fsa;
+  int32_t tot_properties;
+  GetFsaVecBasicProperties(fsa_vec, &properties_per_fsa, &tot_properties);
+  return (tot_properties & properties) == properties;
+}
 
 FsaVec FsaVecFromFsa(const Fsa &fsa) {
   ContextPtr c = fsa.values.Context();
@@ -255,6 +386,209 @@ int32_t GetFsaBasicProperties(const Fsa &fsa) {
   return ans;
 }
 
+namespace {
+// The stride of the scores of an Array1<Arc>, in floats, and their offset
+// from the start of the arcs, in bytes.
+const int32_t kArcScoreStride = sizeof(Arc) / sizeof(float),
+              kArcScoreByteOffset = offsetof(Arc, score);
+}  // namespace
+
+Tensor WeightsOfArcsAsTensor(const Array1<Arc> &arcs) {
+  std::vector<int32_t> dims = {arcs.Dim()}, strides = {kArcScoreStride};
+  Shape shape(dims, strides);
+  return Tensor(kFloatDtype, shape, arcs.GetRegion(),
+                arcs.ByteOffset() + kArcScoreByteOffset);
+}
+
+Array2<float> WeightsOfArcsAsArray2(const Array1<Arc> &arcs) {
+  return Array2<float>(arcs.Dim(), 1, kArcScoreStride,
+                       arcs.ByteOffset() + kArcScoreByteOffset,
+                       arcs.GetRegion());
+}
+
+void SetWeightsOfArcs(const Tensor &weights, Array1<Arc> *arcs) {
+  K2_CHECK_EQ(weights.NumAxes(), 1);
+  K2_CHECK_EQ(weights.GetDtype(), kFloatDtype);
+  int32_t num_arcs = arcs->Dim();
+  K2_CHECK_EQ(weights.Dim(0), num_arcs);
+  ContextPtr c = arcs->Context();
+  K2_CHECK(c->IsCompatible(*weights.Context()));
+  if (num_arcs == 0) return;
+  int32_t stride = weights.Stride(0);
+  if (weights.GetRegion() == arcs->GetRegion() &&
+      weights.ByteOffset() == arcs->ByteOffset() + kArcScoreByteOffset &&
+      (stride == kArcScoreStride || num_arcs == 1))
+    return;  // `weights` is a view of the scores of `arcs`.
+
+  Arc *arcs_data = arcs->Data();
+  const float *weights_data = weights.Data<float>();
+  auto lambda_set_weights = [=] __host__ __device__(int32_t i) -> void {
+    arcs_data[i].score = weights_data[i * stride];
+  };
+  Eval(c, num_arcs, lambda_set_weights);
+}
+
+FsaSoA FsaToSoA(const Ragged<Arc> &fsas) {
+  K2_CHECK(fsas.NumAxes() == 2 || fsas.NumAxes() == 3);
+  ContextPtr &c = fsas.values.Context();
+  int32_t num_arcs = fsas.values.Dim();
+  FsaSoA ans;
+  ans.shape = fsas.shape;
+  if (num_arcs == 0) {
+    ans.src_states = ans.dest_states = ans.symbols = Array1<int32_t>(c, 0);
+    ans.scores = Array1<float>(c, 0);
+    return ans;
+  }
+  Array1<int32_t> fields(c, 4 * num_arcs);
+  ans.src_states = fields.Range(0, num_arcs);
+  ans.dest_states = fields.Range(num_arcs, num_arcs);
+  ans.symbols = fields.Range(2 * num_arcs, num_arcs);
+  ans.scores =
+      Array1<float>(num_arcs, fields.GetRegion(),
+                    fields.ByteOffset() + 3 * num_arcs * sizeof(int32_t));
+
+  const Arc *arcs_data = fsas.values.Data();
+  int32_t *src_states_data = ans.src_states.Data(),
+          *dest_states_data = ans.dest_states.Data(),
+          *symbols_data = ans.symbols.Data();
+  float *scores_data = ans.scores.Data();
+  auto lambda_split_arcs = [=] __host__ __device__(int32_t i) -> void {
+    Arc arc = arcs_data[i];
+    src_states_data[i] = arc.src_state;
+    dest_states_data[i] = arc.dest_state;
+    symbols_data[i] = arc.symbol;
+    scores_data[i] = arc.score;
+  };
+  Eval(c, num_arcs, lambda_split_arcs);
+  return ans;
+}
+
+Ragged<Arc> FsaFromSoA(const FsaSoA &soa) {
+  ContextPtr &c = soa.Context();
+  int32_t num_arcs = soa.NumArcs();
+  K2_CHECK_EQ(num_arcs, soa.shape.NumElements());
+  K2_CHECK_EQ(soa.dest_states.Dim(), num_arcs);
+  K2_CHECK_EQ(soa.symbols.Dim(), num_arcs);
+  K2_CHECK_EQ(soa.scores.Dim(), num_arcs);
+  Array1<Arc> arcs(c, num_arcs);
+  if (num_arcs == 0) return Ragged<Arc>(soa.shape, arcs);
+  Arc *arcs_data = arcs.Data();
+  const int32_t *src_states_data = soa.src_states.Data(),
+                *dest_states_data = soa.dest_states.Data(),
+                *symbols_data = soa.symbols.Data();
+  const float *scores_data = soa.scores.Data();
+  auto lambda_merge_arcs = [=] __host__ __device__(int32_t i) -> void {
+    Arc arc;
+    arc.src_state = src_states_data[i];
+    arc.dest_state = dest_states_data[i];
+    arc.symbol = symbols_data[i];
+    arc.score = scores_data[i];
+    arcs_data[i] = arc;
+  };
+  Eval(c, num_arcs, lambda_merge_arcs);
+  return Ragged<Arc>(soa.shape, arcs);
+}
+
+// Converts a float to the type of the scores of a DenseFsaVec.
+template <typename T>
+static __host__ __device__ __forceinline__ T ScoreFromFloat(float f) {
+  return f;
+}
+template <>
+__host__ __device__ __forceinline__ __half ScoreFromFloat<__half>(float f) {
+  return __float2half(f);
+}
+
+/*
+  Does the work of DenseFsaVec's constructor from a Tensor once the shape is
+  known: copies the scores from `nnet_output` (of type T) to `scores`, and
+  sets the extra column and the final rows.  `offsets_data[seq]` is as
+  meta_offsets in the constructor.
+ */
+template <typename T>
+static void SetDenseFsaVecScores(Tensor &nnet_output, RaggedShape &shape,
+                                 const int32_t *offsets_data,
+                                 Array2<T> *scores) {
+  ContextPtr c = nnet_output.Context();
+  int32_t tot_rows = shape.TotSize(1), num_cols = nnet_output.Dim(2) + 1,
+          stride1 = nnet_output.Stride(1), stride2 = nnet_output.Stride(2);
+  *scores = Array2<T>(c, tot_rows, num_cols);
+  T *scores_data = scores->Data();
+  const T *nnet_output_data = nnet_output.Data<T>();
+  const int32_t *row_splits_data = shape.RowSplits(1).Data(),
+                *row_ids_data = shape.RowIds(1).Data();
+  float float_minus_inf = -std::numeric_limits<float>::infinity();
+  auto lambda_set_scores = [=] __host__ __device__(int32_t row,
+                                                   int32_t col) -> void {
+    int32_t seq = row_ids_data[row];
+    bool is_final_row = (row + 1 == row_splits_data[seq + 1]);
+    T score;
+    if (is_final_row)
+      score = ScoreFromFloat<T>(col == 0 ? 0.0f : float_minus_inf);
+    else if (col == 0)
+      score = ScoreFromFloat<T>(float_minus_inf);
+    else
+      score = nnet_output_data[offsets_data[seq] + row * stride1 +
+                               (col - 1) * stride2];
+    scores_data[row * num_cols + col] = score;
+  };
+  Eval2(c, tot_rows, num_cols, lambda_set_scores);
+}
+
+DenseFsaVec::DenseFsaVec(Tensor &nnet_output,
+                         Array2<int32_t> &supervision_segments) {
+  K2_PROFILE_SCOPE("DenseFsaVec", nnet_output.Context());
+  K2_CHECK_EQ(nnet_output.NumAxes(), 3);
+  Dtype dtype = nnet_output.GetDtype();
+  K2_CHECK(dtype == kFloatDtype || dtype == kHalfDtype)
+      << "Unsupported dtype " << TraitsOf(dtype).Name();
+  K2_CHECK_EQ(supervision_segments.Dim1(), 2);
+  ContextPtr c = nnet_output.Context();
+  int32_t num_seqs = nnet_output.Dim(0), max_frames = nnet_output.Dim(1);
+  K2_CHECK_EQ(supervision_segments.Dim0(), num_seqs);
+  int32_t stride0 = nnet_output.Stride(0), stride1 = nnet_output.Stride(1);
+
+  // The segments are small, so we check them and work out the row_splits on
+  // the host; `meta` contains the row_splits (num_seqs + 1 elements),
+  // followed by, for each sequence, the offset of its first frame in
+  // `nnet_output` minus row_splits[seq] * stride1, so that row `row` of
+  // sequence `seq` starts at meta_offsets[seq] + row * stride1.  It is
+  // transferred in one go.
+  ContextPtr cpu = GetCpuContext();
+  Array2<int32_t> segments = supervision_segments.To(cpu);
+  const int32_t *segments_data = segments.Data();
+  int32_t segments_stride0 = segments.ElemStride0();
+  Array1<int32_t> meta(cpu, 2 * num_seqs + 1);
+  int32_t *meta_row_splits = meta.Data(),
+          *meta_offsets = meta_row_splits + num_seqs + 1;
+  meta_row_splits[0] = 0;
+  for (int32_t seq = 0; seq < num_seqs; ++seq) {
+    int32_t start_frame = segments_data[seq * segments_stride0],
+            num_frames = segments_data[seq * segments_stride0 + 1];
+    K2_CHECK_GE(start_frame, 0);
+    K2_CHECK_GE(num_frames, 0);
+    K2_CHECK_LE(start_frame + num_frames, max_frames)
+        << "Supervision segment " << seq << " exceeds the number of frames";
+    meta_row_splits[seq + 1] = meta_row_splits[seq] + num_frames + 1;
+    meta_offsets[seq] =
+        seq * stride0 + (start_frame - meta_row_splits[seq]) * stride1;
+  }
+  int32_t tot_rows = meta_row_splits[num_seqs];
+  meta = meta.To(c);
+
+  Array1<int32_t> row_splits = meta.Range(0, num_seqs + 1),
+                  row_ids(c, tot_rows);
+  RowSplitsToRowIds(row_splits, row_ids);
+  shape = RaggedShape2(&row_splits, &row_ids, tot_rows);
+
+  const int32_t *offsets_data = meta.Data() + num_seqs + 1;
+  if (dtype == kHalfDtype)
+    SetDenseFsaVecScores<__half>(nnet_output, shape, offsets_data,
+                                 &half_scores);
+  else
+    SetDenseFsaVecScores<float>(nnet_output, shape, offsets_data, &scores);
+}
+
 Fsa FsaFromArray1(Array1<Arc> &array, bool *error) {
   const Arc *arcs_data = array.Data();
   ContextPtr c = array.Context();
@@ -352,132 +686,172 @@ Fsa FsaFromTensor(Tensor &t, bool *error) {
   return FsaFromArray1(arc_array, error);
 }
 
-Fsa FsaVecFromArray1(Array1<Arc> &array, bool *error) {
-  const Arc *arcs_data = reinterpret_cast<const Arc *>(array.Data());
+namespace {
+
+/*
+  The part of FsaVecFromArray1() and FsaVecFromArcs() that works out the
+  states of the FSAs and validates the arcs, once the FSA of each arc is
+  known.
+
+     @param [in] array    The arcs; array.Dim() must be > 0.
+     @param [in] fsa_ids  Has array.Dim() + 1 elements: the FSA of each arc,
+                          non-decreasing, followed by the number of FSAs.
+     @param [in] max_num_fsas  An upper bound on the number of FSAs.
+     @param [out] error   As for FsaVecFromArray1().
+ */
+FsaVec FsaVecFromArcsAndIds(Array1<Arc> &array, Array1<int32_t> &fsa_ids,
+                            int32_t max_num_fsas, bool *error) {
   ContextPtr c = array.Context();
   const int32_t num_arcs = array.Dim();
-  Array1<int32_t> row_ids12(c, num_arcs + 1);  // maps arc->fsa_id, like
-                                               // row_ids1[row_ids2]
-  IsLastArcOfFsa fsa_tails(num_arcs, arcs_data);
-  ExclusiveSum(c, num_arcs + 1, fsa_tails, row_ids12.Data());
-  int32_t num_fsas = row_ids12[num_arcs];
-  row_ids12 = row_ids12.Range(0, num_arcs);
+  K2_CHECK_GT(num_arcs, 0);
+  K2_CHECK_EQ(fsa_ids.Dim(), num_arcs + 1);
+  const Arc *arcs_data = array.Data();
+  const int32_t *fsa_ids_data = fsa_ids.Data();
 
-  int32_t *fsa_ids_data = row_ids12.Data();
+  // Everything is done on the device; the only thing we read back is `info`,
+  // which will contain num_fsas, tot_num_states and an error flag that is
+  // set to 1 if the arcs are not a valid, serialized FsaVec.
+  Array1<int32_t> info(c, 3, 0);
+  int32_t *info_data = info.Data();
 
   // Get the num-states per FSA, including the final-state which must be
   // numbered last.  If the FSA has arcs entering the final state, that will
-  // tell us what the final-state id is.  (that goes in num_states_per_fsa).
-  // If there are no arcs entering the final-state, we let the final state be
-  // (highest numbered state that has arcs leaving it) + 1, so num_states
-  // (highest numbered state that has arcs leaving it) + 2.
-  //
-  // num_states_per_fsa[num_fsas] is an error flag that gets set to 0 on error.
-  Array1<int32_t> num_states_per_fsa(c, num_fsas + 1, -1);
-  int32_t *num_states_per_fsa_data = num_states_per_fsa.Data();
+  // tell us what the final-state id is.  If there are no arcs entering the
+  // final-state, we let the final state be (highest numbered state that has
+  // arcs leaving it) + 1, so num_states (highest numbered state that has arcs
+  // leaving it) + 2.  Zero means "not known yet"; the elements past the last
+  // FSA (and those of FSAs with no arcs) stay zero, so the exclusive sum
+  // below gives row_splits1.
+  Array1<int32_t> row_splits1(c, max_num_fsas + 1, 0);
+  int32_t *row_splits1_data = row_splits1.Data();
   auto lambda_get_num_states_a = [=] __host__ __device__(int32_t i) -> void {
-    if (arcs_data[i].symbol == -1) {
-      int32_t final_state = arcs_data[i].dest_state, fsa_id = fsa_ids_data[i];
-      num_states_per_fsa_data[fsa_id] = final_state + 1;
+    Arc arc = arcs_data[i];
+    if (arc.src_state < 0 || arc.symbol < -1) info_data[2] = 1;
+    if (arc.symbol == -1) {
+      if (arc.dest_state < 0)
+        info_data[2] = 1;
+      else
+        row_splits1_data[fsa_ids_data[i]] = arc.dest_state + 1;
     }
   };
   Eval(c, num_arcs, lambda_get_num_states_a);
 
-  Array1<int32_t> row_splits12(c, num_fsas + 1);
-  int32_t *row_splits12_data = row_splits12.Data();
-  RowIdsToRowSplits(c, num_arcs, row_ids12.Data(), true, num_fsas,
-                    row_splits12.Data());
   auto lambda_get_num_states_b = [=] __host__ __device__(int32_t i) -> void {
-    int32_t num_states_1 = num_states_per_fsa_data[i],
-            num_states_2 =
-                arcs_data[row_splits12_data[i + 1] - 1].src_state + 2;
-    if (num_states_2 <= 0 ||
-        (num_states_1 >= 0 && num_states_2 > num_states_1)) {
-      // Note: num_states_2 is a lower bound on the final-state, something is
-      // wrong if num_states_1 != -1 and num_states_2  is greater than
-      // num_states_1.
-      num_states_per_fsa_data[2 * num_fsas] = 0;  // Error
-    } else {
-      int32_t num_states = (num_states_1 < 0 ? num_states_2 : num_states_1);
-      num_states_per_fsa_data[i] = num_states;
-    }
+    int32_t fsa_id = fsa_ids_data[i];
+    // only the last arc of each FSA does this.
+    if (fsa_ids_data[i + 1] == fsa_id) return;
+    int32_t num_states_1 = row_splits1_data[fsa_id],
+            num_states_2 = arcs_data[i].src_state + 2;
+    // Note: num_states_2 is a lower bound on the num-states; something is
+    // wrong if num_states_1 is known and num_states_2 is greater than it.
+    if (num_states_1 != 0 && num_states_2 > num_states_1)
+      info_data[2] = 1;
+    else if (num_states_1 == 0)
+      row_splits1_data[fsa_id] = num_states_2;
   };
   Eval(c, num_arcs, lambda_get_num_states_b);
-  if (num_states_per_fsa[2 * num_fsas] == 0) {
-    K2_LOG(WARNING)
-        << "Could not convert tensor to FSAs, there was a problem "
-           "working out the num-states in the FSAs, num_states_per_fsa="
-        << num_states_per_fsa;
-    *error = true;
-    return Fsa();
-  }
-  num_states_per_fsa = num_states_per_fsa.Range(0, num_fsas + 1);
-  // row_splits1 is of size num_fsas + 1.
-  // TODO(dan): make this in-place?
-  Array1<int32_t> row_splits1 = ExclusiveSum(num_states_per_fsa);
-  int32_t tot_num_states = row_splits1[num_fsas];
-
-  const int32_t *row_splits1_data = row_splits1.Data();
+  ExclusiveSum(c, max_num_fsas + 1, row_splits1_data, row_splits1_data);
 
   // by `row_ids2` we mean row_ids for axis=2. This is the second
   // of two row_ids vectors. It maps from idx012 to idx01.
   Array1<int32_t> row_ids2(c, num_arcs);
   int32_t *row_ids2_data = row_ids2.Data();
   auto lambda_set_row_ids2 = [=] __host__ __device__(int32_t i) -> void {
-    int32_t src_state = arcs_data[i].src_state, fsa_id = fsa_ids_data[i];
-    row_ids2_data[i] = row_splits1_data[fsa_id] + src_state;
+    Arc arc = arcs_data[i];
+    int32_t fsa_id = fsa_ids_data[i], idx0x = row_splits1_data[fsa_id],
+            final_state = row_splits1_data[fsa_id + 1] - idx0x - 1;
+    if (arc.dest_state < 0 || arc.dest_state > final_state ||
+        (arc.symbol == -1) != (arc.dest_state == final_state) ||
+        (i > 0 && fsa_ids_data[i - 1] == fsa_id &&
+         arcs_data[i - 1].src_state > arc.src_state))
+      info_data[2] = 1;
+    row_ids2_data[i] = idx0x + arc.src_state;
+    if (i == 0) {
+      int32_t num_fsas = fsa_ids_data[num_arcs];
+      info_data[0] = num_fsas;
+      info_data[1] = row_splits1_data[num_fsas];
+    }
   };
   Eval(c, num_arcs, lambda_set_row_ids2);
 
-  if (!ValidateRowIds(row_ids2)) {
-    K2_LOG(WARNING) << "Could not convert tensor to FSA, "
-                       "src_states of arcs were out of order";
+  info = info.To(GetCpuContext());
+  int32_t num_fsas = info[0], tot_num_states = info[1];
+  if (info[2] != 0) {
+    K2_LOG(WARNING) << "Could not convert tensor to FSAs, the arcs were not "
+                       "a valid vector of FSAs";
     *error = true;
     return Fsa();
   }
+  row_splits1 = row_splits1.Range(0, num_fsas + 1);
 
+  // The src_states within each FSA are non-decreasing and less than its
+  // final-state, so row_ids2 is valid row_ids.
   Array1<int32_t> row_splits2(c, tot_num_states + 1);
   RowIdsToRowSplits(c, num_arcs, row_ids2_data, false, tot_num_states,
                     row_splits2.Data());
-#ifndef NDEBUG
-  if (!ValidateRowSplitsAndIds(
-          row_splits2, row_ids2,
-          &num_states_per_fsa)) {  // last arg is temp space
-    K2_LOG(FATAL) << "Failure validating row-splits/row-ids, likely code error";
-  }
-#endif
-
   // row_ids1 maps from idx01 to idx0.
-  // row_ids12 maps from idx012 to idx0.  row_splits2 maps from idx01 to idx012.
-  Array1<int32_t> row_ids1 = row_ids12[row_splits2];
-
+  Array1<int32_t> row_ids1(c, tot_num_states);
+  RowSplitsToRowIds(c, num_fsas, row_splits1_data, tot_num_states,
+                    row_ids1.Data());
 #ifndef NDEBUG
-  if (!ValidateRowSplitsAndIds(
-          row_splits1, row_ids1,
-          &num_states_per_fsa)) {  // last arg is temp space
+  if (!ValidateRowSplitsAndIds(row_splits2, row_ids2, nullptr) ||
+      !ValidateRowSplitsAndIds(row_splits1, row_ids1, nullptr)) {
     K2_LOG(FATAL) << "Failure validating row-splits/row-ids, likely code error";
   }
 #endif
 
   RaggedShape fsas_shape =
-      RaggedShape3(&row_splits1, &row_ids1, row_ids1.Dim(), &row_splits2,
-                   &row_ids2, row_ids2.Dim());
-  FsaVec ans = Ragged<Arc>(fsas_shape, array);
-  Array1<int32_t> properties;
-  int32_t tot_properties;
-  GetFsaVecBasicProperties(ans, &properties, &tot_properties);
-  // TODO: check properties, at least
-  int32_t required_props = (kFsaPropertiesValid | kFsaPropertiesNonempty |
-                            kFsaPropertiesSerializable);
-  if (tot_properties & required_props) {
-    K2_LOG(WARNING) << "Did not have expected properties "
-                    << FsaPropertiesAsString(tot_properties & required_props) << " vs. "
-                    << FsaPropertiesAsString(required_props)
-                    << ", all properties were: "
-                    << FsaPropertiesAsString(tot_properties);
+      RaggedShape3(&row_splits1, &row_ids1, tot_num_states, &row_splits2,
+                   &row_ids2, num_arcs);
+  return Ragged<Arc>(fsas_shape, array);
+}
+
+}  // namespace
+
+Fsa FsaVecFromArray1(Array1<Arc> &array, bool *error) {
+  ContextPtr c = array.Context();
+  const int32_t num_arcs = array.Dim();
+  *error = false;
+  if (num_arcs == 0) {
+    K2_LOG(WARNING) << "Could not convert tensor to FSAs, there were no arcs";
     *error = true;
+    return Fsa();
   }
-  return ans;
+  const Arc *arcs_data = array.Data();
+
+  // fsa_ids maps arc->fsa_id, like row_ids1[row_ids2]; fsa_ids[num_arcs] will
+  // be num_fsas.  Since num_fsas <= num_arcs, num_arcs is the bound on the
+  // number of FSAs.
+  Array1<int32_t> fsa_ids(c, num_arcs + 1);
+  IsLastArcOfFsa fsa_tails(num_arcs, arcs_data);
+  ExclusiveSum(c, num_arcs + 1, fsa_tails, fsa_ids.Data());
+  return FsaVecFromArcsAndIds(array, fsa_ids, num_arcs, error);
+}
+
+FsaVec FsaVecFromArcs(Array1<Arc> &arcs, Array1<int32_t> &arc_row_splits,
+                      bool *error) {
+  ContextPtr c = GetContext(arcs, arc_row_splits);
+  K2_CHECK_GE(arc_row_splits.Dim(), 1);
+  int32_t num_fsas = arc_row_splits.Dim() - 1, num_arcs = arcs.Dim();
+  *error = false;
+  if (num_arcs == 0) {
+    // All the FSAs are empty; we don't check that arc_row_splits is all
+    // zeros (which would need a transfer).
+    Array1<int32_t> row_splits1(c, num_fsas + 1, 0), row_splits2(c, 1, 0);
+    RaggedShape fsas_shape =
+        RaggedShape3(&row_splits1, nullptr, 0, &row_splits2, nullptr, 0);
+    return Ragged<Arc>(fsas_shape, arcs);
+  }
+  // fsa_ids[i] is the FSA of arc i, and fsa_ids[num_arcs] == num_fsas.
+  Array1<int32_t> fsa_ids(c, num_arcs + 1);
+  Array1<int32_t> row_ids = fsa_ids.Range(0, num_arcs);
+  RowSplitsToRowIds(arc_row_splits, row_ids);
+  int32_t *fsa_ids_data = fsa_ids.Data();
+  auto lambda_set_num_fsas = [=] __host__ __device__(int32_t) -> void {
+    fsa_ids_data[num_arcs] = num_fsas;
+  };
+  Eval(c, 1, lambda_set_num_fsas);
+  return FsaVecFromArcsAndIds(arcs, fsa_ids, num_fsas, error);
 }
 
 FsaVec FsaVecFromTensor(Tensor &t, bool *error) {
@@ -494,12 +868,409 @@ FsaVec FsaVecFromTensor(Tensor &t, bool *error) {
   if (t.NumAxes() != 2 || t.Dim(1) != 4) {
     K2_LOG(WARNING) << "Could not convert tensor to FSA, shape was "
                     << t.Dims();
+    *error = true;
+    return Fsa();
   }
   K2_CHECK_EQ(sizeof(Arc), sizeof(int32_t) * 4);
-  int32_t *tensor_data = t.Data<int32_t>();
 
   Array1<Arc> arc_array(t.Dim(0), t.GetRegion(), t.ByteOffset());
   return FsaVecFromArray1(arc_array, error);
 }
 
+/*
+  Returns the boundaries of `num_shards` contiguous ranges of the items whose
+  cumulative sizes are `cum_sizes[0] = 0 <= cum_sizes[1] <= .. <=
+  cum_sizes[num_items]`, chosen so that the sizes of the ranges are roughly
+  equal.  Shard i will contain items ans[i] <= j < ans[i+1].
+ */
+static std::vector<int32_t> GetShardOffsets(const int32_t *cum_sizes,
+                                            int32_t num_items,
+                                            int32_t num_shards) {
+  K2_CHECK_GT(num_shards, 0);
+  std::vector<int32_t> ans(num_shards + 1);
+  int64_t tot_size = cum_sizes[num_items];
+  ans[0] = 0;
+  for (int32_t i = 1; i < num_shards; ++i) {
+    int32_t target = static_cast<int32_t>(tot_size * i / num_shards);
+    if (tot_size == 0) {
+      // Divide by number of items instead.
+      ans[i] = static_cast<int32_t>(static_cast<int64_t>(num_items) * i /
+                                    num_shards);
+    } else {
+      ans[i] = static_cast<int32_t>(
+          std::lower_bound(cum_sizes, cum_sizes + num_items + 1, target) -
+          cum_sizes);
+    }
+    ans[i] = std::max(ans[i], ans[i - 1]);
+  }
+  ans[num_shards] = num_items;
+  return ans;
+}
+
+std::vector<FsaVec> ShardFsaVec(FsaVec &src,
+                                const std::vector<ContextPtr> &contexts,
+                                std::vector<int32_t> *fsa_offsets) {
+  K2_CHECK_EQ(src.NumAxes(), 3);
+  int32_t num_shards = static_cast<int32_t>(contexts.size()),
+          num_fsas = src.shape.Dim0();
+  ContextPtr cpu = GetCpuContext();
+  // arc_splits[i] is the index of the first arc of FSA i.
+  Array1<int32_t> row_splits1 = src.shape.RowSplits(1).To(cpu),
+                  row_splits2 = src.shape.RowSplits(2).To(cpu);
+  std::vector<int32_t> arc_splits(num_fsas + 1);
+  for (int32_t i = 0; i <= num_fsas; ++i)
+    arc_splits[i] = row_splits2.Data()[row_splits1.Data()[i]];
+  std::vector<int32_t> offsets =
+      GetShardOffsets(arc_splits.data(), num_fsas, num_shards);
+
+  std::vector<FsaVec> ans = SplitFsaVec(src, offsets);
+  for (int32_t i = 0; i < num_shards; ++i) ans[i] = ans[i].To(contexts[i]);
+  if (fsa_offsets != nullptr) *fsa_offsets = std::move(offsets);
+  return ans;
+}
+
+std::vector<FsaVec> SplitFsaVec(FsaVec &src,
+                                const std::vector<int32_t> &offsets,
+                                std::vector<int32_t> *arc_offsets) {
+  K2_CHECK_EQ(src.NumAxes(), 3);
+  std::vector<int32_t> arc_offsets_vec;
+  std::vector<RaggedShape> shapes =
+      Arange(src.shape, offsets, &arc_offsets_vec);
+  int32_t num_ranges = static_cast<int32_t>(shapes.size());
+  std::vector<FsaVec> ans;
+  ans.reserve(num_ranges);
+  for (int32_t i = 0; i < num_ranges; ++i) {
+    int32_t arc_begin = arc_offsets_vec[i],
+            num_arcs = arc_offsets_vec[i + 1] - arc_begin;
+    Array1<Arc> arcs = (num_arcs == 0 ? Array1<Arc>(src.Context(), 0)
+                                      : src.values.Range(arc_begin, num_arcs));
+    ans.emplace_back(shapes[i], arcs);
+  }
+  if (arc_offsets != nullptr) *arc_offsets = std::move(arc_offsets_vec);
+  return ans;
+}
+
+// Returns the rows [row_begin, row_begin + num_rows) of `src`, sharing its
+// memory.
+template <typename T>
+static Array2<T> RowRange(Array2<T> &src, int32_t row_begin,
+                          int32_t num_rows) {
+  return Array2<T>(num_rows, src.Dim1(), src.ElemStride0(),
+                   src.ByteOffset() + row_begin * src.ElemStride0() * sizeof(T),
+                   src.GetRegion());
+}
+
+// Returns a new array whose row i is row new2old[i] of `src`.
+template <typename T>
+static Array2<T> IndexRows(Array2<T> &src, const Array1<int32_t> &new2old) {
+  ContextPtr c = src.Context();
+  int32_t num_rows = new2old.Dim(), num_cols = src.Dim1();
+  Array2<T> ans(c, num_rows, num_cols);
+  const T *src_data = src.Data();
+  T *ans_data = ans.Data();
+  int32_t src_stride = src.ElemStride0(), ans_stride = ans.ElemStride0();
+  const int32_t *new2old_data = new2old.Data();
+  auto lambda_copy_rows = [=] __host__ __device__(int32_t i,
+                                                  int32_t j) -> void {
+    ans_data[i * ans_stride + j] = src_data[new2old_data[i] * src_stride + j];
+  };
+  Eval2(c, num_rows, num_cols, lambda_copy_rows);
+  return ans;
+}
+
+// Sets the scores of `dest` to the rows [row_begin, row_begin + num_rows) of
+// those of `src`, sharing their memory; whichever of scores, half_scores and
+// sparse_scores `src` uses is set.
+static void SetScoresRowRange(DenseFsaVec &src, int32_t row_begin,
+                              int32_t num_rows, DenseFsaVec *dest) {
+  if (src.HasSparseScores()) {
+    dest->sparse_scores.num_cols = src.sparse_scores.num_cols;
+    dest->sparse_scores.cols =
+        RowRange(src.sparse_scores.cols, row_begin, num_rows);
+    dest->sparse_scores.scores =
+        RowRange(src.sparse_scores.scores, row_begin, num_rows);
+  } else if (src.HasHalfScores()) {
+    dest->half_scores = RowRange(src.half_scores, row_begin, num_rows);
+  } else {
+    dest->scores = RowRange(src.scores, row_begin, num_rows);
+  }
+}
+
+// As SetScoresRowRange(), but sets row i of the scores of `dest` to row
+// new2old[i] of those of `src`, in newly allocated memory.
+static void SetScoresIndexRows(DenseFsaVec &src,
+                               const Array1<int32_t> &new2old,
+                               DenseFsaVec *dest) {
+  if (src.HasSparseScores()) {
+    dest->sparse_scores.num_cols = src.sparse_scores.num_cols;
+    dest->sparse_scores.cols = IndexRows(src.sparse_scores.cols, new2old);
+    dest->sparse_scores.scores = IndexRows(src.sparse_scores.scores, new2old);
+  } else if (src.HasHalfScores()) {
+    dest->half_scores = IndexRows(src.half_scores, new2old);
+  } else {
+    dest->scores = IndexRows(src.scores, new2old);
+  }
+}
+
+// Copies the scores of `dense` to context `c`.
+static void ScoresTo(ContextPtr c, DenseFsaVec *dense) {
+  SparseDenseScores &sparse = dense->sparse_scores;
+  if (sparse.cols.Dim0() != 0) {
+    sparse.cols = sparse.cols.To(c);
+    sparse.scores = sparse.scores.To(c);
+  }
+  if (dense->half_scores.Dim0() != 0)
+    dense->half_scores = dense->half_scores.To(c);
+  if (dense->scores.Dim0() != 0) dense->scores = dense->scores.To(c);
+}
+
+DenseFsaVec SparsifyDenseFsaVec(DenseFsaVec &src, int32_t k,
+                                const Array1<int32_t> *keep_symbols) {
+  K2_CHECK_EQ(src.shape.NumAxes(), 2);
+  K2_CHECK_GT(k, 0);
+  K2_CHECK(!src.HasSparseScores());
+  ContextPtr c = src.shape.Context();
+  K2_PROFILE_SCOPE("SparsifyDenseFsaVec", c);
+  int32_t num_rows = src.NumRows(), num_cols = src.NumCols();
+  k = std::min(k, num_cols);
+
+  // The columns of keep_symbols, sorted and without repeats.
+  std::vector<int32_t> keep_vec;
+  if (keep_symbols != nullptr) {
+    Array1<int32_t> keep_cpu = keep_symbols->To(GetCpuContext());
+    for (int32_t i = 0; i != keep_cpu.Dim(); ++i) {
+      int32_t col = keep_cpu[i] + 1;
+      K2_CHECK(col >= 0 && col < num_cols)
+          << "Symbol " << keep_cpu[i] << " out of range";
+      keep_vec.push_back(col);
+    }
+    std::sort(keep_vec.begin(), keep_vec.end());
+    keep_vec.erase(std::unique(keep_vec.begin(), keep_vec.end()),
+                   keep_vec.end());
+  }
+  int32_t num_keep = static_cast<int32_t>(keep_vec.size()),
+          width = std::min(k + num_keep, num_cols);
+  Array1<int32_t> keep(c, keep_vec);
+
+  // Copy the scores to a contiguous array with one sublist per row, and sort
+  // each row from best to worst.
+  bool half = src.HasHalfScores();
+  const float *score_data = (half ? nullptr : src.scores.Data());
+  const __half *half_score_data = (half ? src.half_scores.Data() : nullptr);
+  int32_t score_stride =
+      (half ? src.half_scores.ElemStride0() : src.scores.ElemStride0());
+  int32_t tot_size = num_rows * num_cols;
+  Array1<float> sorted(c, tot_size);
+  float *sorted_data = sorted.Data();
+  auto lambda_copy_scores = [=] __host__ __device__(int32_t row,
+                                                    int32_t col) -> void {
+    int32_t idx = row * score_stride + col;
+    sorted_data[row * num_cols + col] =
+        (score_data != nullptr ? score_data[idx]
+                               : __half2float(half_score_data[idx]));
+  };
+  Eval2(c, num_rows, num_cols, lambda_copy_scores);
+  Array1<int32_t> row_splits = Range<int32_t>(c, num_rows + 1, 0, num_cols);
+  Ragged<float> sorted_ragged(RaggedShape2(&row_splits, nullptr, tot_size),
+                              sorted);
+  Array1<int32_t> order(c, tot_size);
+  SortSublists<float, GreaterThan<float>>(&sorted_ragged, &order);
+
+  DenseFsaVec ans;
+  ans.shape = src.shape;
+  SparseDenseScores &sparse = ans.sparse_scores;
+  sparse.num_cols = num_cols;
+  sparse.cols = Array2<int32_t>(c, num_rows, width);
+  sparse.scores = Array2<float>(c, num_rows, width);
+  int32_t *cols_data = sparse.cols.Data(),
+          cols_stride = sparse.cols.ElemStride0();
+  float *sparse_scores_data = sparse.scores.Data();
+  int32_t sparse_scores_stride = sparse.scores.ElemStride0();
+  const int32_t *order_data = order.Data(), *keep_data = keep.Data();
+  float float_minus_inf = -std::numeric_limits<float>::infinity();
+  auto lambda_set_sparse = [=] __host__ __device__(int32_t row) -> void {
+    int32_t *this_cols = cols_data + row * cols_stride;
+    // The columns of the k best scores, sorted by insertion sort.
+    for (int32_t i = 0; i < k; ++i) {
+      int32_t col = order_data[row * num_cols + i] - row * num_cols, j = i;
+      for (; j > 0 && this_cols[j - 1] > col; --j)
+        this_cols[j] = this_cols[j - 1];
+      this_cols[j] = col;
+    }
+    // Merge in the columns of `keep`, from the end so it can be done in
+    // place; first find the number of columns in both.
+    int32_t num_common = 0;
+    for (int32_t i = 0, j = 0; i < k && j < num_keep;) {
+      if (this_cols[i] < keep_data[j]) {
+        ++i;
+      } else if (this_cols[i] > keep_data[j]) {
+        ++j;
+      } else {
+        ++num_common;
+        ++i;
+        ++j;
+      }
+    }
+    int32_t n = k + num_keep - num_common;
+    for (int32_t i = k - 1, j = num_keep - 1, w = n - 1; w >= 0; --w) {
+      if (j < 0 || (i >= 0 && this_cols[i] > keep_data[j])) {
+        this_cols[w] = this_cols[i--];
+      } else {
+        if (i >= 0 && this_cols[i] == keep_data[j]) --i;
+        this_cols[w] = keep_data[j--];
+      }
+    }
+    float *this_scores = sparse_scores_data + row * sparse_scores_stride;
+    for (int32_t i = 0; i < n; ++i) {
+      int32_t idx = row * score_stride + this_cols[i];
+      this_scores[i] = (score_data != nullptr
+                            ? score_data[idx]
+                            : __half2float(half_score_data[idx]));
+    }
+    for (int32_t i = n; i < width; ++i) {
+      this_cols[i] = num_cols;
+      this_scores[i] = float_minus_inf;
+    }
+  };
+  Eval(c, num_rows, lambda_set_sparse);
+  return ans;
+}
+
+std::vector<DenseFsaVec> ShardDenseFsaVec(
+    DenseFsaVec &src, const std::vector<ContextPtr> &contexts,
+    std::vector<int32_t> *fsa_offsets) {
+  K2_CHECK_EQ(src.shape.NumAxes(), 2);
+  int32_t num_shards = static_cast<int32_t>(contexts.size()),
+          num_seqs = src.shape.Dim0();
+  Array1<int32_t> row_splits1 = src.shape.RowSplits(1).To(GetCpuContext());
+  std::vector<int32_t> offsets =
+      GetShardOffsets(row_splits1.Data(), num_seqs, num_shards);
+
+  std::vector<DenseFsaVec> ans = SplitDenseFsaVec(src, offsets);
+  for (int32_t i = 0; i < num_shards; ++i) {
+    ans[i].shape = ans[i].shape.To(contexts[i]);
+    ScoresTo(contexts[i], &ans[i]);
+  }
+  if (fsa_offsets != nullptr) *fsa_offsets = std::move(offsets);
+  return ans;
+}
+
+std::vector<DenseFsaVec> SplitDenseFsaVec(
+    DenseFsaVec &src, const std::vector<int32_t> &offsets,
+    std::vector<int32_t> *row_offsets) {
+  K2_CHECK_EQ(src.shape.NumAxes(), 2);
+  std::vector<int32_t> row_offsets_vec;
+  std::vector<RaggedShape> shapes =
+      Arange(src.shape, offsets, &row_offsets_vec);
+  int32_t num_ranges = static_cast<int32_t>(shapes.size());
+  std::vector<DenseFsaVec> ans(num_ranges);
+  for (int32_t i = 0; i < num_ranges; ++i) {
+    int32_t row_begin = row_offsets_vec[i],
+            num_rows = row_offsets_vec[i + 1] - row_begin;
+    ans[i].shape = shapes[i];
+    SetScoresRowRange(src, row_begin, num_rows, &ans[i]);
+  }
+  if (row_offsets != nullptr) *row_offsets = std::move(row_offsets_vec);
+  return ans;
+}
+
+void SortAndBucketFsas(FsaVec &fsas, DenseFsaVec &dense_fsas,
+                       FsaLengthType length_type, int32_t max_bucket_size,
+                       std::vector<FsaVec> *fsa_buckets,
+                       std::vector<DenseFsaVec> *dense_fsa_buckets,
+                       Array1<int32_t> *new2old,
+                       std::vector<int32_t> *bucket_offsets) {
+  K2_CHECK_EQ(fsas.NumAxes(), 3);
+  K2_CHECK_EQ(dense_fsas.shape.NumAxes(), 2);
+  K2_CHECK_GT(max_bucket_size, 0);
+  ContextPtr c = fsas.Context();
+  K2_CHECK(c->IsCompatible(*dense_fsas.shape.Context()));
+  int32_t num_seqs = dense_fsas.shape.Dim0();
+  bool shared_fsa = (fsas.shape.Dim0() == 1 && num_seqs != 1);
+  K2_CHECK(shared_fsa || fsas.shape.Dim0() == num_seqs);
+  K2_CHECK(!shared_fsa || length_type == kFsaLengthFrames)
+      << "Sorting by arcs requires one FSA per sequence";
+
+  // Get the lengths and sort them from longest to shortest, all on the
+  // device; `lengths` will then contain the sorted lengths.
+  Array1<int32_t> lengths(c, num_seqs);
+  int32_t *lengths_data = lengths.Data();
+  if (length_type == kFsaLengthFrames) {
+    const int32_t *row_splits1_data = dense_fsas.shape.RowSplits(1).Data();
+    auto lambda_get_frames = [=] __host__ __device__(int32_t i) -> void {
+      lengths_data[i] = row_splits1_data[i + 1] - row_splits1_data[i];
+    };
+    Eval(c, num_seqs, lambda_get_frames);
+  } else {
+    K2_CHECK_EQ(length_type, kFsaLengthArcs);
+    const int32_t *row_splits1_data = fsas.shape.RowSplits(1).Data(),
+                  *row_splits2_data = fsas.shape.RowSplits(2).Data();
+    auto lambda_get_arcs = [=] __host__ __device__(int32_t i) -> void {
+      lengths_data[i] = row_splits2_data[row_splits1_data[i + 1]] -
+                        row_splits2_data[row_splits1_data[i]];
+    };
+    Eval(c, num_seqs, lambda_get_arcs);
+  }
+  Array1<int32_t> lengths_splits = Range<int32_t>(c, 2, 0, num_seqs);
+  Ragged<int32_t> lengths_ragged(
+      RaggedShape2(&lengths_splits, nullptr, num_seqs), lengths);
+  *new2old = Array1<int32_t>(c, num_seqs);
+  if (num_seqs != 0)
+    SortSublists<int32_t, GreaterThan<int32_t>>(&lengths_ragged, new2old);
+
+  // Split the sorted lengths into buckets; this is the only transfer to the
+  // host.
+  Array1<int32_t> sorted_lengths = lengths_ragged.values.To(GetCpuContext());
+  std::vector<int32_t> offsets(1, 0);
+  int32_t bucket_size = 0;
+  for (int32_t i = 0; i < num_seqs; ++i) {
+    int32_t length = sorted_lengths.Data()[i];
+    if (i > offsets.back() && bucket_size + length > max_bucket_size) {
+      offsets.push_back(i);
+      bucket_size = 0;
+    }
+    bucket_size += length;
+  }
+  if (num_seqs != 0) offsets.push_back(num_seqs);
+  int32_t num_buckets = static_cast<int32_t>(offsets.size()) - 1;
+
+  // Reorder the FSAs and the rows of the scores.
+  FsaVec sorted_fsas = (shared_fsa ? fsas : Renumber(fsas, *new2old));
+  Array1<int32_t> row_new2old;
+  RaggedShape sorted_dense_shape =
+      Renumber(dense_fsas.shape, *new2old, &row_new2old);
+  DenseFsaVec sorted_dense;
+  SetScoresIndexRows(dense_fsas, row_new2old, &sorted_dense);
+
+  // Split into the buckets, with one transfer per axis in total.
+  std::vector<int32_t> arc_offsets, row_offsets;
+  std::vector<RaggedShape> fsa_shapes;
+  if (!shared_fsa)
+    fsa_shapes = Arange(sorted_fsas.shape, offsets, &arc_offsets);
+  std::vector<RaggedShape> dense_shapes =
+      Arange(sorted_dense_shape, offsets, &row_offsets);
+  fsa_buckets->clear();
+  dense_fsa_buckets->clear();
+  fsa_buckets->reserve(num_buckets);
+  dense_fsa_buckets->resize(num_buckets);
+  for (int32_t b = 0; b < num_buckets; ++b) {
+    if (shared_fsa) {
+      fsa_buckets->push_back(fsas);
+    } else {
+      int32_t arc_begin = arc_offsets[b],
+              num_arcs = arc_offsets[b + 1] - arc_begin;
+      Array1<Arc> arcs =
+          (num_arcs == 0 ? Array1<Arc>(c, 0)
+                         : sorted_fsas.values.Range(arc_begin, num_arcs));
+      fsa_buckets->emplace_back(FsaVec(fsa_shapes[b], arcs));
+    }
+    DenseFsaVec &dense = (*dense_fsa_buckets)[b];
+    dense.shape = dense_shapes[b];
+    // The rows of the scores for this bucket.
+    SetScoresRowRange(sorted_dense, row_offsets[b],
+                      row_offsets[b + 1] - row_offsets[b], &dense);
+  }
+  if (bucket_offsets != nullptr) *bucket_offsets = std::move(offsets);
+}
+
 }  // namespace k2
@@ -14,6 +14,7 @@
 
 #include <ostream>
 #include <string>
+#include <vector>
 
 #include "k2/csrc/ragged.h"
 
@@ -93,6 +94,24 @@ using FsaVec = Ragged<Arc>;  // 3 axes: fsa,state,arc.  Note, the src_state
                              // and dest_state in the arc are *within the
                              // FSA*, i.e. they are idx1 not idx01.
 
+/*
+  Sparse version of the scores of a DenseFsaVec (see SparsifyDenseFsaVec()):
+  each row keeps only some of its entries, e.g. the best few symbols on that
+  frame plus the symbols in the decoding graph; the others are taken to be
+  -infinity.  With a large vocabulary this means reading a few entries per
+  row instead of num_symbols + 1.
+ */
+struct SparseDenseScores {
+  // The number of columns of the dense scores, i.e. num_symbols + 1.
+  int32_t num_cols = 0;
+  // cols(i, j) is the column (symbol + 1) of the j'th entry kept on row i;
+  // they are increasing in j, and rows with fewer entries than cols.Dim1()
+  // are padded with num_cols.
+  Array2<int32_t> cols;
+  // scores(i, j) is the score of entry cols(i, j); -infinity for padding.
+  Array2<float> scores;
+};
+
 /*
   Vector of FSAs that actually will come from neural net log-softmax outputs (or
   similar).
@@ -115,10 +134,33 @@ struct DenseFsaVec {
                       // the state-index (actually the state-index from which
                       // the arcs leave).
 
-  // TODO: construct from a regular matrix containing the nnet output, plus some
-  // meta-info saying where the supervisions are.
-
-  // The following variable was removed and can be obtained as scores.Dim1().
+  DenseFsaVec() = default;
+
+  /*
+    Constructs a DenseFsaVec directly from the padded neural-net output of a
+    minibatch, reading it in place (with its strides), so no per-sequence
+    copies are needed.  The shape and `scores`, including the extra final row
+    of each sequence, are filled in by one kernel.
+
+      @param [in] nnet_output  A Tensor of float or half with 3 axes,
+                          (N, T_max, C), where N is the number of sequences,
+                          T_max the (padded) number of frames and C the
+                          number of symbols; element [n, t, c] is the score
+                          of symbol c at frame t of sequence n.  May have any
+                          strides.  If it is half, the scores are kept in
+                          half precision, in `half_scores`.
+      @param [in] supervision_segments  An Array2 with dims (N, 2), where
+                          row n is (start_frame, num_frames) of sequence n;
+                          requires 0 <= start_frame and
+                          start_frame + num_frames <= T_max.  It is copied to
+                          the device of `nnet_output` if needed.
+
+    The result has shape.Dim0() == N, num_frames + 1 rows for sequence n, and
+    NumCols() == C + 1.
+   */
+  DenseFsaVec(Tensor &nnet_output, Array2<int32_t> &supervision_segments);
+
+  // The following variable was removed and can be obtained as NumCols().
   // int32_t num_cols;
 
   // `scores` is a contiguous matrix of dimension shape.TotSize1()
@@ -137,8 +179,39 @@ struct DenseFsaVec {
   // (It's the final-transition).
   Array2<float> scores;
 
-  // NOTE: our notion of "arc-index" / arc_idx is an index into scores.Data().
-  int32_t NumArcs() const { return scores.Dim0() * scores.Dim1(); }
+  // Alternatively the scores may be stored in half precision here, with the
+  // same layout, in which case `scores` is empty.  This halves the memory
+  // and bandwidth needed for the largest tensor of a typical pipeline; the
+  // intersection algorithms convert each score to float as they read it,
+  // and accumulate in float.  See also HasHalfScores().
+  Array2<__half> half_scores;
+
+  // Or they may be stored sparsely here (see SparsifyDenseFsaVec()), in
+  // which case `scores` and `half_scores` are empty.
+  SparseDenseScores sparse_scores;
+
+  // Returns true if the scores are in `half_scores` rather than `scores`.
+  bool HasHalfScores() const { return half_scores.Dim0() != 0; }
+
+  // Returns true if the scores are in `sparse_scores`.
+  bool HasSparseScores() const { return sparse_scores.cols.Dim0() != 0; }
+
+  // The number of columns of the scores, i.e. num_symbols + 1.
+  int32_t NumCols() const {
+    if (HasSparseScores()) return sparse_scores.num_cols;
+    return HasHalfScores() ? half_scores.Dim1() : scores.Dim1();
+  }
+
+  // The number of rows of the scores, i.e. shape.NumElements().
+  int32_t NumRows() const {
+    if (HasSparseScores()) return sparse_scores.cols.Dim0();
+    return HasHalfScores() ? half_scores.Dim0() : scores.Dim0();
+  }
+
+  // NOTE: our notion of "arc-index" / arc_idx is an index into scores.Data()
+  // (or half_scores.Data()), i.e. row_idx * NumCols() + symbol + 1; this is
+  // the same for sparse scores.
+  int32_t NumArcs() const { return NumRows() * NumCols(); }
 };
 
 /*
@@ -203,6 +276,10 @@ Tensor FsaVecToTensor(const Fsa &fsa);
   cannot appear here, as there is no way to indicate it in a flat
   series of arcs.
 
+  Everything, including finding the boundaries between FSAs and validating
+  the arcs, is done on the device of `t`; the only transfer to the host is
+  of the total numbers of FSAs and states, at the end.
+
     @param [in] t   Source tensor.  Must have dtype == kInt32Dtype and be of
                     shape (N > 0) by 4.  Caution: the returned FSA will share
                     memory with this tensor, so don't modify it afterward!
@@ -217,6 +294,28 @@ FsaVec FsaVecFromTensor(Tensor &t, bool *error);
 
 Fsa FsaVecFromArray1(Array1<Arc> &arc, bool *error);
 
+/*
+  Creates an FsaVec from the arcs of its FSAs, concatenated, and the number
+  of arcs of each, e.g. for a minibatch of FSAs given one at a time from
+  Python: nothing is done per FSA and the arcs are not copied.  Unlike
+  FsaVecFromArray1(), the boundaries between the FSAs are given, so empty
+  FSAs (with no arcs) are allowed.  The individual FSAs must be valid as for
+  FsaFromTensor(); as in FsaVecFromArray1(), everything is done on the
+  device and the only transfer to the host is at the end.
+
+    @param [in] arcs   The arcs of all the FSAs.  Caution: the returned
+                       FsaVec shares memory with it.
+    @param [in] arc_row_splits  The row_splits of the arcs per FSA, i.e. the
+                       arcs of FSA i are arcs[arc_row_splits[i]] through
+                       arcs[arc_row_splits[i + 1] - 1]; its Dim() is the
+                       number of FSAs plus one.  Must be on the device of
+                       `arcs`.
+    @param [out] error  Error flag, as for FsaVecFromTensor().
+    @return  The FsaVec, with arc_row_splits.Dim() - 1 FSAs.
+ */
+FsaVec FsaVecFromArcs(Array1<Arc> &arcs, Array1<int32_t> &arc_row_splits,
+                      bool *error);
+
 /*
   Return one Fsa in an FsaVec.  Note, this has to make copies of the
   row offsets and strides but can use a sub-array of the arcs array
@@ -230,6 +329,21 @@ Fsa FsaVecFromArray1(Array1<Arc> &arc, bool *error);
  */
 inline Fsa GetFsaVecElement(FsaVec &vec, int32_t i) { return vec.Index(0, i); }
 
+/*
+  Returns an FsaVec containing the FSAs of `vec` selected by `indexes`, in
+  one pass rather than one GetFsaVecElement() per FSA.
+
+     @param [in] vec      Input FsaVec to select from
+     @param [in] indexes  Indexes of the FSAs to select, on the same device as
+                          `vec`; may be in any order and contain repeats.
+     @param [out] arc_map  If not nullptr, will be set to the index in
+                          vec.values of each arc of the result.
+ */
+inline FsaVec GetFsaVecElements(FsaVec &vec, const Array1<int32_t> &indexes,
+                                Array1<int32_t> *arc_map = nullptr) {
+  return vec.IndexMany(indexes, arc_map);
+}
+
 /*
   Create an FsaVec from a list of Fsas.  Caution: Fsa and FsaVec are really
   the same type, just with different expectations on the number of axes!
@@ -254,36 +368,266 @@ int32_t GetFsaBasicProperties(const Fsa &fsa);
 
 /*
   Compute basic properties for an FsaVec, with their `and` in `properties_tot`.
+  All the properties are computed on the device with one reduction per FSA,
+  and the only transfer to the host is of `tot_properties_out`.
+
+  The result is cached in the Region of the arcs, and repeated calls for the
+  same FSAs are free as long as the arcs and the row_splits haven't been
+  modified since (the cache is invalidated when a non-const pointer to their
+  data is taken; see Region::version.  Note: writing through a pointer that
+  was obtained before the call bypasses this).
 
      @param [in] fsa_vec   FSAs to compute the properties of.  It is an
                    error if fsa_vec.NumAxes() != 3 (will crash).
      @param [out] properties_out  The properties per FSA will be written to
                    here, on the same device as `fsa_vec`.  This array
                    will be assigned to (does not have to be correctly sized at
-                   entry).
+                   entry).  Don't modify it, as it may be shared with the
+                   cache.
      @param [out] tot_properties_out  The `and` of all properties in `properties_out`
                    will be written to this host (i.e. CPU-memory) pointer.
 */
-void GetFsaVecBasicProperties(const FsaVec &fsa_vec,
+void GetFsaVecBasicProperties(FsaVec &fsa_vec,
                               Array1<int32_t> *properties_out,
                               int32_t *tot_properties_out);
 
+/*
+  Records that all the FSAs of `fsa_vec` have the properties `properties`
+  (see GetFsaVecBasicProperties()), for the algorithms that know some
+  properties of their output, e.g. ArcSort() gives arc-sorted FSAs; then
+  FsaVecHasProperties() doesn't need a pass over the arcs for them.  They are
+  cached with the result of GetFsaVecBasicProperties(), so are forgotten
+  when the arcs or row_splits of `fsa_vec` are modified.  The caller is
+  trusted: nothing is checked.
+ */
+void SetFsaVecKnownProperties(FsaVec &fsa_vec, int32_t properties);
+
+/*
+  Returns the properties that all the FSAs of `fsa_vec` are known to have
+  without computing anything, i.e. those recorded by SetFsaVecKnownProperties()
+  or the `and` of those computed by GetFsaVecBasicProperties(), if still
+  valid; else 0.  This is for algorithms passing on the properties of their
+  input that their output keeps.
+ */
+int32_t GetFsaVecKnownProperties(FsaVec &fsa_vec);
+
+/*
+  Returns true if all the FSAs of `fsa_vec` have all the properties
+  `properties`, e.g. kFsaPropertiesArcSorted | kFsaPropertiesEpsilonFree.
+  What the algorithms should use to check their input: it's free if they
+  are known (see SetFsaVecKnownProperties()) or have been computed,
+  else it calls GetFsaVecBasicProperties().
+ */
+bool FsaVecHasProperties(FsaVec &fsa_vec, int32_t properties);
+
 
-// Return weights of `arcs` as a Tensor that shares the same memory
-// location
+/*
+  Returns the weights (scores) of `arcs` as a Tensor with one axis that is a
+  view into `arcs`: it points to arcs[0].score and has stride 4 (in floats),
+  so nothing is copied, on CPU or GPU.  Writing to it modifies the scores in
+  `arcs`.
+*/
 Tensor WeightsOfArcsAsTensor(const Array1<Arc> &arcs);
 
+/*
+  As WeightsOfArcsAsTensor(), but returned as an Array2 with dims
+  (arcs.Dim(), 1) and ElemStride0() == 4, which is also a view into `arcs`.
+*/
+Array2<float> WeightsOfArcsAsArray2(const Array1<Arc> &arcs);
+
 // Return weights of `arcs` as an Array1<float>; this will not share the same
-// memory location because Array1 does not support a stride.  However
-// it would be possible to get it as an Array2.
+// memory location (unless arcs.Dim() <= 1) because Array1 does not support a
+// stride; use WeightsOfArcsAsTensor() or WeightsOfArcsAsArray2() for a view.
 inline Array1<float> WeightsOfArcsAsArray1(const Array1<Arc> &arcs) {
   return Array1<float>(WeightsOfArcsAsTensor(arcs));
 }
 
+/*
+  Writes `weights` into the scores of `arcs`, in place; the other fields of
+  the arcs are not touched.  This is the reverse of WeightsOfArcsAsArray1(),
+  e.g. for writing back scores that were updated by a training step.
+
+     @param [in] weights  A Tensor of float with one axis and dim
+                     arcs->Dim(), with any stride, on the same device as
+                     `arcs`.  If it is the view returned by
+                     WeightsOfArcsAsTensor(*arcs), nothing needs to be done.
+     @param [in,out] arcs  The arcs whose scores are to be set.
+*/
+void SetWeightsOfArcs(const Tensor &weights, Array1<Arc> *arcs);
+
+inline void SetWeightsOfArcs(Array1<float> &weights, Array1<Arc> *arcs) {
+  SetWeightsOfArcs(weights.ToTensor(), arcs);
+}
+
 inline Array1<float> WeightsOfFsaAsArray1(const Ragged<Arc> &fsa) {
   return Array1<float>(WeightsOfArcsAsTensor(fsa.values));
 }
 
+/*
+  The arcs of an Fsa or FsaVec in structure-of-arrays layout, i.e. with the
+  fields of the arcs in separate contiguous arrays.  This is for kernels that
+  only read some of the fields, e.g. only `symbol` or only `score`; with the
+  usual array of Arc they would load the whole 16 bytes of each arc.
+
+  The four arrays share one allocation; src_states, dest_states, symbols and
+  scores come one after the other in it, each with shape.NumElements()
+  elements.
+ */
+struct FsaSoA {
+  RaggedShape shape;  // The shape of the Fsa or FsaVec, with 2 or 3 axes.
+  Array1<int32_t> src_states;
+  Array1<int32_t> dest_states;
+  Array1<int32_t> symbols;
+  Array1<float> scores;
+
+  ContextPtr &Context() const { return shape.Context(); }
+  int32_t NumArcs() const { return src_states.Dim(); }
+};
+
+/*
+  Converts an Fsa or FsaVec to structure-of-arrays layout; is a single
+  kernel.
+
+     @param [in] fsas   The Fsa or FsaVec to convert
+     @return  Returns the arcs of `fsas` in SoA layout; its `shape` is shared
+              with `fsas`, the arrays are newly allocated.
+ */
+FsaSoA FsaToSoA(const Ragged<Arc> &fsas);
+
+/*
+  Converts back from structure-of-arrays layout, in a single kernel; this is
+  the inverse of FsaToSoA().  The returned Fsa or FsaVec shares its shape with
+  `soa`.
+ */
+Ragged<Arc> FsaFromSoA(const FsaSoA &soa);
+
+/*
+  Splits a batch of FSAs across devices, e.g. for decoding on several GPUs.
+  The FSAs are divided into contiguous ranges, one per element of `contexts`,
+  with roughly equal numbers of arcs in each, and each range is copied to the
+  corresponding context (this is a peer-to-peer copy if `src` is on a
+  different GPU).
+
+     @param [in] src      The FsaVec to split; must have 3 axes.
+     @param [in] contexts  The contexts to copy the shards to; must be
+                          nonempty.  May contain the same device more than
+                          once.
+     @param [out] fsa_offsets  If not NULL, will be set to a vector of size
+                          contexts.size() + 1, such that shard i contains
+                          FSAs fsa_offsets[i] <= j < fsa_offsets[i+1] of `src`.
+                          Shards may be empty if there are fewer FSAs than
+                          contexts.
+     @return  Returns the shards; ans[i] is on contexts[i].
+ */
+std::vector<FsaVec> ShardFsaVec(FsaVec &src,
+                                const std::vector<ContextPtr> &contexts,
+                                std::vector<int32_t> *fsa_offsets = nullptr);
+
+/*
+  Returns a version of `src` with sparse scores (see SparseDenseScores): on
+  each row, only the `k` best scores and the scores of `keep_symbols` are
+  kept, and the rest are treated as -infinity by the intersection
+  algorithms.  The dense scores are not kept in the output.  This is exact
+  for IntersectDensePruned() if keep_symbols contains all the symbols of
+  the decoding graph, and otherwise approximate; the final row of each
+  sequence is exact for any k >= 1.
+
+     @param [in] src   The input; must not have sparse scores.  Its scores
+                       may be float or half.
+     @param [in] k     The number of best scores to keep on each row; must
+                       be > 0.
+     @param [in] keep_symbols  If not nullptr, symbols (-1 <= symbol <
+                       src.NumCols() - 1, in any order and possibly with
+                       repeats) whose scores are kept on all rows, e.g. the
+                       symbols of the decoding graph.  Its values are read
+                       on the host, with one transfer.
+     @return  Returns the sparse DenseFsaVec, with the same shape as `src`;
+              each row has at most k + keep_symbols->Dim() entries.
+ */
+DenseFsaVec SparsifyDenseFsaVec(DenseFsaVec &src, int32_t k,
+                                const Array1<int32_t> *keep_symbols = nullptr);
+
+/*
+  As ShardFsaVec(), but for a DenseFsaVec; the sequences are divided so the
+  shards have roughly equal numbers of frames (rows of `scores`).
+ */
+std::vector<DenseFsaVec> ShardDenseFsaVec(
+    DenseFsaVec &src, const std::vector<ContextPtr> &contexts,
+    std::vector<int32_t> *fsa_offsets = nullptr);
+
+/*
+  Splits `src` into contiguous ranges of its FSAs, sharing its memory: ans[i]
+  contains FSAs offsets[i] <= j < offsets[i+1] of `src`.  There is one
+  transfer to the host per axis (see Arange()).
+     @param [in] src      The FsaVec to split; must have 3 axes.
+     @param [in] offsets  Nondecreasing, with offsets[0] == 0 and
+                          offsets.back() == src.shape.Dim0().
+     @param [out] arc_offsets  If not nullptr, will be set to the index in
+                          src.values of the first arc of each range (and of
+                          the end of the last one), of size offsets.size().
+ */
+std::vector<FsaVec> SplitFsaVec(FsaVec &src,
+                                const std::vector<int32_t> &offsets,
+                                std::vector<int32_t> *arc_offsets = nullptr);
+
+/*
+  As SplitFsaVec(), but for a DenseFsaVec; the scores of the results are
+  views of those of `src`.  If row_offsets is not nullptr, it will be set to
+  the index of the first row of the scores of each range, of size
+  offsets.size().
+ */
+std::vector<DenseFsaVec> SplitDenseFsaVec(
+    DenseFsaVec &src, const std::vector<int32_t> &offsets,
+    std::vector<int32_t> *row_offsets = nullptr);
+
+// What SortAndBucketFsas() sorts by.
+enum FsaLengthType {
+  kFsaLengthFrames,  // the number of frames of the DenseFsaVec
+  kFsaLengthArcs     // the number of arcs of the FsaVec
+};
+
+/*
+  Sorts a batch of FSAs and the matching sequences of a DenseFsaVec, e.g. the
+  decoding graphs and the neural-net output for a minibatch, from longest to
+  shortest, and splits them into buckets of similar length.  This reduces the
+  padding and the warp divergence when intersecting them bucket by bucket.
+
+     @param [in] fsas     The FSAs; must have 3 axes, and either one FSA per
+                          sequence of `dense_fsas`, or just one FSA that is
+                          shared by all of them (as in IntersectDensePruned()),
+                          in which case each bucket gets all of `fsas`.
+     @param [in] dense_fsas  The sequences; must be on the same device as
+                          `fsas`.
+     @param [in] length_type  What to sort by; kFsaLengthArcs requires one FSA
+                          per sequence.
+     @param [in] max_bucket_size  The largest total length (in frames or arcs,
+                          according to `length_type`) of a bucket; a single
+                          sequence that is longer than this gets a bucket
+                          of its own.  Must be > 0.
+     @param [out] fsa_buckets  Will be set to the FSAs of each bucket.  They
+                          refer to one reordered copy of `fsas`.
+     @param [out] dense_fsa_buckets  Will be set to the sequences of each
+                          bucket.  They refer to one reordered copy of
+                          `dense_fsas`.
+     @param [out] new2old  Will be set to the permutation, on the same device
+                          as `fsas`: the j'th sequence in the concatenation
+                          of the buckets is sequence (*new2old)[j] of
+                          `dense_fsas`.  To put the results of processing
+                          the buckets back in the original order, Append()
+                          them and Renumber() with
+                          InvertPermutation(*new2old).
+     @param [out] bucket_offsets  If not NULL, will be set to a vector of
+                          size fsa_buckets->size() + 1, such that bucket i
+                          has positions bucket_offsets[i] <= j <
+                          bucket_offsets[i+1] of *new2old.
+ */
+void SortAndBucketFsas(FsaVec &fsas, DenseFsaVec &dense_fsas,
+                       FsaLengthType length_type, int32_t max_bucket_size,
+                       std::vector<FsaVec> *fsa_buckets,
+                       std::vector<DenseFsaVec> *dense_fsa_buckets,
+                       Array1<int32_t> *new2old,
+                       std::vector<int32_t> *bucket_offsets = nullptr);
+
 }  // namespace k2
 
 #endif  // K2_CSRC_FSA_H_
@@ -9,18 +9,44 @@
  * See LICENSE for clarification regarding multiple authors
  */
 
+#include <algorithm>
+#include <limits>
+#include <memory>
+#include <utility>
 #include <vector>
 
+#include "k2/csrc/algorithms.h"
 #include "k2/csrc/array_ops.h"
 #include "k2/csrc/fsa_algo.h"
+#include "k2/csrc/fsa_utils.h"
+#include "k2/csrc/hash.h"
 #include "k2/csrc/host/connect.h"
+#include "k2/csrc/host/intersect.h"
 #include "k2/csrc/host_shim.h"
+#include "k2/csrc/profile.h"
+#include "k2/csrc/utils.h"
 
-// this contains a subset of the algorithms in fsa_algo.h; currently it just
-// contains one that are wrappings of the corresponding algorithms in
-// host/.
+// this contains a subset of the algorithms in fsa_algo.h.  ArcSort(),
+// TopSort(), IntersectPruned(), DeterminizePrunedMax(),
+// DeterminizePrunedLogSum(), RemoveEpsilonsPrunedMax(),
+// RemoveEpsilonsPrunedLogSum(), ShortestPath(), NBestPaths(),
+// ExpandBigramPruned(), PruneOnArcPost(), and Connect() for top-sorted input,
+// run on the device; the others are wrappings of the corresponding algorithms
+// in host/.
 namespace k2 {
 
+namespace {
+// The order that ArcSort() sorts the arcs leaving each state in: by symbol
+// and then by dest_state, as in k2host::ArcSorter.
+struct ArcLessThan {
+  __host__ __device__ __forceinline__ bool operator()(const Arc &a,
+                                                      const Arc &b) const {
+    return a.symbol < b.symbol ||
+           (a.symbol == b.symbol && a.dest_state < b.dest_state);
+  }
+};
+}  // namespace
+
 bool RecursionWrapper(bool (*f)(Fsa &, Fsa *, Array1<int32_t> *), Fsa &src,
                       Fsa *dest, Array1<int32_t> *arc_map) {
   // src is actually an FsaVec.  Just recurse for now.
@@ -46,6 +72,7 @@ bool ConnectFsa(Fsa &src, Fsa *dest, Array1<int32_t> *arc_map) {
     return RecursionWrapper(ConnectFsa, src, dest, arc_map);
   }
 
+  K2_PROFILE_SCOPE("k2host::Connection");
   k2host::Fsa host_fsa = FsaToHostFsa(src);
   k2host::Connection c(host_fsa);
   k2host::Array2Size<int32_t> size;
@@ -62,4 +89,3092 @@ bool ConnectFsa(Fsa &src, Fsa *dest, Array1<int32_t> *arc_map) {
   return ans;
 }
 
+namespace {
+// The output of IntersectDensePrunedCpu() for the sequences of one call of
+// the function given to ParallelFor(), one after the other.
+struct DenseIntersectCpuChunk {
+  // The arc-index (in `arcs`, relative to the first arc of its FSA) of the
+  // first arc leaving each state.
+  std::vector<int32_t> arc_indexes;
+  std::vector<Arc> arcs;
+  std::vector<int32_t> arc_map_a;
+  std::vector<int32_t> arc_map_b;
+};
+}  // namespace
+
+void IntersectDensePrunedCpu(FsaVec &a_fsas, DenseFsaVec &b_fsas, float beam,
+                             FsaVec *out, Array1<int32_t> *arc_map_a,
+                             Array1<int32_t> *arc_map_b) {
+  K2_CHECK_EQ(a_fsas.NumAxes(), 3);
+  K2_CHECK_EQ(a_fsas.Context()->GetDeviceType(), kCpu);
+  K2_CHECK_EQ(b_fsas.shape.Context()->GetDeviceType(), kCpu);
+  K2_CHECK(!b_fsas.HasHalfScores() && !b_fsas.HasSparseScores())
+      << "IntersectDensePrunedCpu() needs the scores as floats";
+  K2_CHECK_NE(out, nullptr);
+  ContextPtr c = GetCpuContext();
+  int32_t num_seqs = b_fsas.shape.Dim0(), num_graphs = a_fsas.shape.Dim0();
+  K2_CHECK(num_graphs == 1 || num_graphs == num_seqs);
+
+  K2_PROFILE_SCOPE("k2host::DensePrunedIntersection");
+  const int32_t *a_row_splits1 = a_fsas.shape.RowSplits(1).Data(),
+                *b_row_splits1 = b_fsas.shape.RowSplits(1).Data();
+  int32_t *a_row_splits2 = a_fsas.shape.RowSplits(2).Data();
+  k2host::Arc *a_arcs = reinterpret_cast<k2host::Arc *>(a_fsas.values.Data());
+  const float *scores = b_fsas.scores.Data();
+  int32_t num_cols = b_fsas.NumCols(),
+          row_stride = b_fsas.scores.ElemStride0();
+
+  // Indexed by the first sequence of the chunk.
+  std::vector<DenseIntersectCpuChunk> chunks(num_seqs);
+  // For each sequence: the first sequence of its chunk, the number of states
+  // and arcs of its output, and the position of them in its chunk.
+  std::vector<int32_t> seq_chunk(num_seqs), num_states(num_seqs),
+      num_arcs(num_seqs), chunk_state_offset(num_seqs),
+      chunk_arc_offset(num_seqs);
+  ParallelFor(num_seqs, 1, [&](int32_t begin, int32_t end) -> void {
+    k2host::DensePrunedIntersection intersection(beam);
+    DenseIntersectCpuChunk &chunk = chunks[begin];
+    for (int32_t n = begin; n != end; ++n) {
+      int32_t graph = (num_graphs == 1 ? 0 : n),
+              state_begin = a_row_splits1[graph],
+              state_end = a_row_splits1[graph + 1];
+      k2host::Fsa a(state_end - state_begin,
+                    a_row_splits2[state_end] - a_row_splits2[state_begin],
+                    a_row_splits2 + state_begin, a_arcs);
+      int32_t row_begin = b_row_splits1[n];
+      k2host::DenseScores b{b_row_splits1[n + 1] - row_begin, num_cols,
+                            row_stride, scores + row_begin * row_stride};
+      k2host::Array2Size<int32_t> size;
+      intersection.GetSizes(a, b, &size);
+
+      int32_t state_offset = static_cast<int32_t>(chunk.arc_indexes.size()),
+              arc_offset = static_cast<int32_t>(chunk.arcs.size());
+      seq_chunk[n] = begin;
+      num_states[n] = size.size1;
+      num_arcs[n] = size.size2;
+      chunk_state_offset[n] = state_offset;
+      chunk_arc_offset[n] = arc_offset;
+      // The last element of the arc_indexes of each FSA (its num-arcs) is not
+      // kept.
+      chunk.arc_indexes.resize(state_offset + size.size1 + 1);
+      chunk.arcs.resize(arc_offset + size.size2);
+      chunk.arc_map_a.resize(arc_offset + size.size2);
+      chunk.arc_map_b.resize(arc_offset + size.size2);
+      k2host::Fsa dest(size.size1, size.size2,
+                       chunk.arc_indexes.data() + state_offset,
+                       reinterpret_cast<k2host::Arc *>(chunk.arcs.data()) +
+                           arc_offset);
+      intersection.GetOutput(&dest, chunk.arc_map_a.data() + arc_offset,
+                             chunk.arc_map_b.data() + arc_offset);
+      chunk.arc_indexes.pop_back();
+      for (int32_t i = arc_offset; i != arc_offset + size.size2; ++i)
+        chunk.arc_map_b[i] += row_begin * row_stride;
+    }
+  });
+
+  Array1<int32_t> row_splits1(c, num_seqs + 1);
+  int32_t *row_splits1_data = row_splits1.Data();
+  std::vector<int32_t> arc_offsets(num_seqs + 1);
+  row_splits1_data[0] = 0;
+  arc_offsets[0] = 0;
+  for (int32_t n = 0; n != num_seqs; ++n) {
+    row_splits1_data[n + 1] = row_splits1_data[n] + num_states[n];
+    arc_offsets[n + 1] = arc_offsets[n] + num_arcs[n];
+  }
+  int32_t tot_states = row_splits1_data[num_seqs],
+          tot_arcs = arc_offsets[num_seqs];
+  Array1<int32_t> row_splits2(c, tot_states + 1);
+  Array1<Arc> arcs(c, tot_arcs);
+  if (arc_map_a != nullptr) *arc_map_a = Array1<int32_t>(c, tot_arcs);
+  if (arc_map_b != nullptr) *arc_map_b = Array1<int32_t>(c, tot_arcs);
+  int32_t *row_splits2_data = row_splits2.Data(),
+          *arc_map_a_data = nullptr, *arc_map_b_data = nullptr;
+  if (arc_map_a != nullptr) arc_map_a_data = arc_map_a->Data();
+  if (arc_map_b != nullptr) arc_map_b_data = arc_map_b->Data();
+  Arc *arcs_data = arcs.Data();
+  ParallelFor(num_seqs, 1, [&](int32_t begin, int32_t end) -> void {
+    for (int32_t n = begin; n != end; ++n) {
+      const DenseIntersectCpuChunk &chunk = chunks[seq_chunk[n]];
+      const int32_t *arc_indexes =
+          chunk.arc_indexes.data() + chunk_state_offset[n];
+      int32_t state_offset = row_splits1_data[n], arc_offset = arc_offsets[n],
+              src_offset = chunk_arc_offset[n];
+      for (int32_t s = 0; s != num_states[n]; ++s)
+        row_splits2_data[state_offset + s] = arc_offset + arc_indexes[s];
+      std::copy_n(chunk.arcs.begin() + src_offset, num_arcs[n],
+                  arcs_data + arc_offset);
+      if (arc_map_a_data != nullptr)
+        std::copy_n(chunk.arc_map_a.begin() + src_offset, num_arcs[n],
+                    arc_map_a_data + arc_offset);
+      if (arc_map_b_data != nullptr)
+        std::copy_n(chunk.arc_map_b.begin() + src_offset, num_arcs[n],
+                    arc_map_b_data + arc_offset);
+    }
+  });
+  row_splits2_data[tot_states] = tot_arcs;
+  RaggedShape shape = RaggedShape3(&row_splits1, nullptr, tot_states,
+                                   &row_splits2, nullptr, tot_arcs);
+  *out = FsaVec(shape, arcs);
+  // Each arc goes to a state of the next frame.
+  SetFsaVecKnownProperties(*out, kFsaPropertiesTopSorted |
+                                     kFsaPropertiesTopSortedAndAcyclic |
+                                     kFsaPropertiesMaybeAccessible |
+                                     kFsaPropertiesMaybeCoaccessible);
+}
+
+/*
+  Marks all the states that can be reached from the states in `frontier`; is
+  a breadth-first search over all FSAs at once, with one kernel and one
+  transfer to the host per level.
+
+     @param [in] c          Context of all the arrays
+     @param [in] row_splits  For state i, row_splits[i] to row_splits[i+1] are
+                          the positions in `targets` of its successors.
+     @param [in] targets    The successors (state idx01's) of the states.
+     @param [in,out] frontier  At entry, frontier[0..num_frontier-1] are the
+                          states to start from; is used as a buffer, so must
+                          have at least as many elements as there are states.
+     @param [in] num_frontier  The number of states to start from.
+     @param [in,out] reached   At entry, 1 for the states in `frontier` and
+                          0 for the others; at exit, 1 for all the states
+                          reached.
+ */
+static void MarkReachable(ContextPtr &c, const int32_t *row_splits,
+                          const int32_t *targets, Array1<int32_t> *frontier,
+                          int32_t num_frontier, int32_t *reached) {
+  Array1<int32_t> next_frontier(c, frontier->Dim());
+  // We alternate between counts[0] and counts[1] for the size of the next
+  // frontier, resetting the one for the level after next in the kernel, so
+  // that no extra kernel is needed to reset it.
+  Array1<int32_t> counts(c, 2, 0);
+  int32_t *counts_data = counts.Data();
+  ContextPtr cpu = GetCpuContext();
+  for (int32_t level = 0; num_frontier > 0; ++level) {
+    const int32_t *frontier_data = frontier->Data();
+    int32_t *next_frontier_data = next_frontier.Data(),
+            *count_data = counts_data + (level & 1),
+            *other_count_data = counts_data + ((level + 1) & 1);
+    auto lambda_expand = [=] __host__ __device__(int32_t i) -> void {
+      if (i == 0) *other_count_data = 0;
+      int32_t state = frontier_data[i];
+      for (int32_t j = row_splits[state]; j < row_splits[state + 1]; ++j) {
+        int32_t target = targets[j];
+        // atomicMax() returns the old value, so only one thread sees 0.
+        if (reached[target] == 0 && atomicMax(reached + target, 1) == 0)
+          next_frontier_data[atomicAdd(count_data, 1)] = target;
+      }
+    };
+    Eval(c, num_frontier, lambda_expand);
+    num_frontier = counts.To(cpu).Data()[level & 1];
+    std::swap(*frontier, next_frontier);
+  }
+}
+
+/*
+  Connect() for FsaVecs that are top-sorted (self-loops are allowed).  The
+  states and arcs that are kept keep their order, so the output is
+  top-sorted too.  (It is also correct for input that is not top-sorted, as
+  long as the final state of each FSA is its last state; IntersectPruned()
+  relies on that.)
+ */
+static void ConnectTopSorted(FsaVec &src, FsaVec *dest,
+                             Array1<int32_t> *arc_map) {
+  ContextPtr &c = src.Context();
+  int32_t num_fsas = src.shape.Dim0(), num_states = src.shape.TotSize(1),
+          num_arcs = src.shape.TotSize(2);
+  const int32_t *row_splits1_data = src.shape.RowSplits(1).Data(),
+                *row_ids1_data = src.shape.RowIds(1).Data(),
+                *row_splits2_data = src.shape.RowSplits(2).Data(),
+                *row_ids2_data = src.shape.RowIds(2).Data();
+  const Arc *arcs_data =
+      static_cast<const Array1<Arc> &>(src.values).Data();
+
+  // The successors of the states are the arcs' dest-states; for their
+  // predecessors we transpose the arcs, counting the arcs entering each state
+  // and then placing them.
+  Array1<int32_t> dest_states(c, num_arcs), src_states(c, num_arcs),
+      in_row_splits(c, num_states + 1, 0);
+  int32_t *dest_states_data = dest_states.Data(),
+          *src_states_data = src_states.Data(),
+          *in_row_splits_data = in_row_splits.Data();
+  auto lambda_count_entering = [=] __host__ __device__(int32_t i) -> void {
+    int32_t state_idx01 = row_ids2_data[i],
+            state_idx0x = row_splits1_data[row_ids1_data[state_idx01]],
+            dest_state_idx01 = state_idx0x + arcs_data[i].dest_state;
+    dest_states_data[i] = dest_state_idx01;
+    atomicAdd(in_row_splits_data + dest_state_idx01, 1);
+  };
+  Eval(c, num_arcs, lambda_count_entering);
+  ExclusiveSum(c, num_states + 1, in_row_splits_data, in_row_splits_data);
+  Array1<int32_t> in_pos(c, num_states);
+  int32_t *in_pos_data = in_pos.Data();
+  auto lambda_copy_splits = [=] __host__ __device__(int32_t i) -> void {
+    in_pos_data[i] = in_row_splits_data[i];
+  };
+  Eval(c, num_states, lambda_copy_splits);
+  auto lambda_place_entering = [=] __host__ __device__(int32_t i) -> void {
+    src_states_data[atomicAdd(in_pos_data + dest_states_data[i], 1)] =
+        row_ids2_data[i];
+  };
+  Eval(c, num_arcs, lambda_place_entering);
+
+  // reached[i] is for the start-states, reached[num_states + i] for the
+  // final-states, i.e. accessible and co-accessible respectively.  The
+  // searches start from the first and last state of each nonempty FSA.
+  Array1<int32_t> reached(c, 2 * num_states, 0),
+      forward_frontier(c, num_states), backward_frontier(c, num_states),
+      num_nonempty(c, 1, 0);
+  int32_t *reached_data = reached.Data(),
+          *forward_frontier_data = forward_frontier.Data(),
+          *backward_frontier_data = backward_frontier.Data(),
+          *num_nonempty_data = num_nonempty.Data();
+  auto lambda_set_frontiers = [=] __host__ __device__(int32_t i) -> void {
+    int32_t begin = row_splits1_data[i], end = row_splits1_data[i + 1];
+    if (begin == end) return;
+    int32_t n = atomicAdd(num_nonempty_data, 1);
+    forward_frontier_data[n] = begin;
+    backward_frontier_data[n] = end - 1;
+    reached_data[begin] = 1;
+    reached_data[num_states + end - 1] = 1;
+  };
+  Eval(c, num_fsas, lambda_set_frontiers);
+  int32_t num_frontier = num_nonempty.To(GetCpuContext())[0];
+  MarkReachable(c, row_splits2_data, dest_states_data, &forward_frontier,
+                num_frontier, reached_data);
+  MarkReachable(c, in_row_splits_data, src_states_data, &backward_frontier,
+                num_frontier, reached_data + num_states);
+
+  auto lambda_keep_state = [=] __host__ __device__(int32_t i) -> bool {
+    return reached_data[i] && reached_data[num_states + i];
+  };
+  Renumbering renumber_states(c, num_states, lambda_keep_state);
+  const char *keep_states_data = renumber_states.Keep().Data();
+  auto lambda_keep_arc = [=] __host__ __device__(int32_t i) -> bool {
+    return keep_states_data[row_ids2_data[i]] &&
+           keep_states_data[dest_states_data[i]];
+  };
+  Renumbering renumber_arcs(c, num_arcs, lambda_keep_arc);
+
+  int32_t num_new_states = renumber_states.NumNewElems(),
+          num_new_arcs = renumber_arcs.NumNewElems();
+  Array1<int32_t> states_old2new = renumber_states.Old2New(),
+                  states_new2old = renumber_states.New2Old(),
+                  arcs_old2new = renumber_arcs.Old2New(),
+                  arcs_new2old = renumber_arcs.New2Old(false);
+  const int32_t *states_old2new_data = states_old2new.Data(),
+                *states_new2old_data = states_new2old.Data(),
+                *arcs_old2new_data = arcs_old2new.Data(),
+                *arcs_new2old_data = arcs_new2old.Data();
+
+  Array1<int32_t> new_row_splits1(c, num_fsas + 1),
+      new_row_splits2(c, num_new_states + 1);
+  int32_t *new_row_splits1_data = new_row_splits1.Data(),
+          *new_row_splits2_data = new_row_splits2.Data();
+  auto lambda_set_row_splits1 = [=] __host__ __device__(int32_t i) -> void {
+    new_row_splits1_data[i] = states_old2new_data[row_splits1_data[i]];
+  };
+  Eval(c, num_fsas + 1, lambda_set_row_splits1);
+  // states_new2old[num_new_states] == num_states, so this sets the last
+  // element to num_new_arcs.
+  auto lambda_set_row_splits2 = [=] __host__ __device__(int32_t i) -> void {
+    new_row_splits2_data[i] =
+        arcs_old2new_data[row_splits2_data[states_new2old_data[i]]];
+  };
+  Eval(c, num_new_states + 1, lambda_set_row_splits2);
+
+  Array1<Arc> new_arcs(c, num_new_arcs);
+  Arc *new_arcs_data = new_arcs.Data();
+  auto lambda_set_arcs = [=] __host__ __device__(int32_t i) -> void {
+    int32_t old_arc_idx012 = arcs_new2old_data[i],
+            old_state_idx01 = row_ids2_data[old_arc_idx012],
+            new_state_idx01 = states_old2new_data[old_state_idx01],
+            new_state_idx0x =
+                new_row_splits1_data[row_ids1_data[old_state_idx01]];
+    Arc arc = arcs_data[old_arc_idx012];
+    arc.src_state = new_state_idx01 - new_state_idx0x;
+    arc.dest_state =
+        states_old2new_data[dest_states_data[old_arc_idx012]] -
+        new_state_idx0x;
+    new_arcs_data[i] = arc;
+  };
+  Eval(c, num_new_arcs, lambda_set_arcs);
+
+  RaggedShape shape = RaggedShape3(&new_row_splits1, nullptr, num_new_states,
+                                   &new_row_splits2, nullptr, num_new_arcs);
+  *dest = FsaVec(shape, new_arcs);
+  if (arc_map != nullptr) *arc_map = arcs_new2old;
+}
+
+bool Connect(Fsa &src, Fsa *dest, Array1<int32_t> *arc_map /*= nullptr*/) {
+  int32_t num_axes = src.NumAxes();
+  if (num_axes < 2 || num_axes > 3)
+    K2_LOG(FATAL) << "Input has bad num-axes " << num_axes;
+  FsaVec src_vec = (num_axes == 2 ? FsaVecFromFsa(src) : src);
+  if (FsaVecHasProperties(src_vec, kFsaPropertiesTopSorted)) {
+    int32_t src_properties = GetFsaVecKnownProperties(src_vec);
+    FsaVec dest_vec;
+    ConnectTopSorted(src_vec, &dest_vec, arc_map);
+    // The states and arcs that are kept keep their order.
+    SetFsaVecKnownProperties(
+        dest_vec, kFsaPropertiesMaybeAccessible |
+                      kFsaPropertiesMaybeCoaccessible |
+                      (src_properties &
+                       (kFsaPropertiesValid | kFsaPropertiesTopSorted |
+                        kFsaPropertiesTopSortedAndAcyclic |
+                        kFsaPropertiesArcSorted |
+                        kFsaPropertiesArcSortedAndDeterministic |
+                        kFsaPropertiesEpsilonFree)));
+    *dest = (num_axes == 2 ? dest_vec.RemoveAxis(0) : dest_vec);
+    return true;
+  }
+  // Otherwise the states need to be top-sorted too, which is done by the
+  // host code.
+  ContextPtr &c = src.Context();
+  if (c->GetDeviceType() == kCpu) return ConnectFsa(src, dest, arc_map);
+  ContextPtr cpu = GetCpuContext();
+  Fsa src_cpu = src.To(cpu), dest_cpu;
+  Array1<int32_t> arc_map_cpu;
+  bool ans = ConnectFsa(src_cpu, &dest_cpu,
+                        (arc_map != nullptr ? &arc_map_cpu : nullptr));
+  *dest = dest_cpu.To(c);
+  if (arc_map != nullptr) *arc_map = arc_map_cpu.To(c);
+  return ans;
+}
+
+void ArcSort(Fsa &src, Fsa *dest, Array1<int32_t> *arc_map /*= nullptr*/) {
+  int32_t num_axes = src.NumAxes();
+  if (num_axes < 2 || num_axes > 3)
+    K2_LOG(FATAL) << "Input has bad num-axes " << num_axes;
+  ContextPtr &c = src.Context();
+  int32_t num_arcs = src.values.Dim();
+  // `order` maps from the arcs of *dest to the arcs of src.
+  Array1<int32_t> order = Range(c, num_arcs, 0);
+  Ragged<Arc> ans(src.shape, Array1<Arc>(c, num_arcs));
+  const Arc *src_arcs = static_cast<const Array1<Arc> &>(src.values).Data();
+  Arc *ans_arcs = ans.values.Data();
+  auto lambda_copy_arcs = [=] __host__ __device__(int32_t i) -> void {
+    ans_arcs[i] = src_arcs[i];
+  };
+  Eval(c, num_arcs, lambda_copy_arcs);
+
+  if (num_arcs > 0) {
+    // FSAs whose arcs are strictly sorted by symbol are already sorted by
+    // (symbol, dest_state); we only sort the others.  The properties are
+    // usually cached, see GetFsaVecBasicProperties().
+    FsaVec src_vec = (num_axes == 2 ? FsaVecFromFsa(src) : src);
+    if (!FsaVecHasProperties(src_vec,
+                             kFsaPropertiesArcSortedAndDeterministic)) {
+      Array1<int32_t> properties;
+      int32_t tot_properties;
+      GetFsaVecBasicProperties(src_vec, &properties, &tot_properties);
+      int32_t num_fsas = src_vec.shape.Dim0();
+      const int32_t *properties_data = properties.Data();
+      auto lambda_is_unsorted = [=] __host__ __device__(int32_t i) -> bool {
+        return !(properties_data[i] & kFsaPropertiesArcSortedAndDeterministic);
+      };
+      Renumbering unsorted_fsas(c, num_fsas, lambda_is_unsorted);
+      if (unsorted_fsas.NumNewElems() == num_fsas) {
+        SortSublists<Arc, ArcLessThan>(&ans, &order);
+      } else {
+        // `sub_arc_map` maps from the arcs of `sub_fsas` to those of src; the
+        // arcs of each state are still contiguous and in the same order, so
+        // after sorting, arc sub_arc_map[i] of *dest is arc
+        // sub_arc_map[sub_order[i]] of src.
+        Array1<int32_t> sub_arc_map;
+        FsaVec sub_fsas = src_vec.IndexMany(unsorted_fsas.New2Old(false),
+                                            &sub_arc_map);
+        int32_t num_sub_arcs = sub_fsas.values.Dim();
+        Array1<int32_t> sub_order(c, num_sub_arcs);
+        SortSublists<Arc, ArcLessThan>(&sub_fsas, &sub_order);
+        const Arc *sub_arcs = sub_fsas.values.Data();
+        const int32_t *sub_arc_map_data = sub_arc_map.Data(),
+                      *sub_order_data = sub_order.Data();
+        int32_t *order_data = order.Data();
+        auto lambda_scatter_sorted =
+            [=] __host__ __device__(int32_t i) -> void {
+          int32_t arc_idx = sub_arc_map_data[i];
+          ans_arcs[arc_idx] = sub_arcs[i];
+          order_data[arc_idx] = sub_arc_map_data[sub_order_data[i]];
+        };
+        Eval(c, num_sub_arcs, lambda_scatter_sorted);
+      }
+    }
+    // Reordering the arcs leaving each state keeps the other properties.
+    FsaVec ans_vec = (num_axes == 2 ? FsaVecFromFsa(ans) : ans);
+    SetFsaVecKnownProperties(
+        ans_vec, GetFsaVecKnownProperties(src_vec) | kFsaPropertiesArcSorted);
+  }
+  *dest = ans;
+  if (arc_map != nullptr) *arc_map = order;
+}
+
+void ArcSort(Fsa *fsa) {
+  K2_CHECK_NE(fsa, nullptr);
+  Fsa dest;
+  ArcSort(*fsa, &dest);
+  *fsa = dest;
+}
+
+bool TopSort(FsaVec &src, FsaVec *dest, Array1<char> *is_cyclic /*= nullptr*/,
+             Array1<int32_t> *state_map /*= nullptr*/,
+             Array1<int32_t> *arc_map /*= nullptr*/) {
+  K2_CHECK_EQ(src.NumAxes(), 3);
+  ContextPtr &c = src.Context();
+  int32_t num_fsas = src.shape.Dim0(), num_states = src.shape.TotSize(1),
+          num_arcs = src.shape.TotSize(2);
+  Array1<int32_t> &row_splits1 = src.shape.RowSplits(1),
+                  &row_ids1 = src.shape.RowIds(1);
+  const int32_t *row_splits1_data = row_splits1.Data(),
+                *row_ids1_data = row_ids1.Data(),
+                *row_splits2_data = src.shape.RowSplits(2).Data(),
+                *row_ids2_data = src.shape.RowIds(2).Data();
+  const Arc *arcs_data =
+      static_cast<const Array1<Arc> &>(src.values).Data();
+
+  // in_degree[i] is the number of arcs entering state i, not counting
+  // self-loops, which don't matter for the order.
+  Array1<int32_t> dest_states(c, num_arcs), in_degree(c, num_states, 0);
+  int32_t *dest_states_data = dest_states.Data(),
+          *in_degree_data = in_degree.Data();
+  auto lambda_count_entering = [=] __host__ __device__(int32_t i) -> void {
+    int32_t state_idx01 = row_ids2_data[i],
+            state_idx0x = row_splits1_data[row_ids1_data[state_idx01]],
+            dest_state_idx01 = state_idx0x + arcs_data[i].dest_state;
+    dest_states_data[i] = dest_state_idx01;
+    if (dest_state_idx01 != state_idx01)
+      atomicAdd(in_degree_data + dest_state_idx01, 1);
+  };
+  Eval(c, num_arcs, lambda_count_entering);
+
+  // Kahn's algorithm, level-synchronously for all FSAs at once: the states of
+  // level 0 are those with no arcs entering them, and a state is on level l+1
+  // if the last of the arcs entering it that we remove is from level l.
+  // levels[i] stays -1 for the states that are on or after a cycle.
+  Array1<int32_t> levels(c, num_states, -1), frontier(c, num_states),
+      next_frontier(c, num_states), counts(c, 2, 0);
+  int32_t *levels_data = levels.Data(), *counts_data = counts.Data();
+  {
+    int32_t *frontier_data = frontier.Data();
+    auto lambda_set_frontier = [=] __host__ __device__(int32_t i) -> void {
+      if (in_degree_data[i] == 0) {
+        levels_data[i] = 0;
+        frontier_data[atomicAdd(counts_data, 1)] = i;
+      }
+    };
+    Eval(c, num_states, lambda_set_frontier);
+  }
+  ContextPtr cpu = GetCpuContext();
+  int32_t num_frontier = counts.To(cpu)[0], num_sorted = num_frontier;
+  // As in MarkReachable(), the counts for consecutive levels alternate
+  // between counts[1] and counts[0], and each kernel resets the other one.
+  for (int32_t level = 1; num_frontier > 0; ++level) {
+    const int32_t *frontier_data = frontier.Data();
+    int32_t *next_frontier_data = next_frontier.Data(),
+            *count_data = counts_data + (level & 1),
+            *other_count_data = counts_data + ((level + 1) & 1);
+    auto lambda_remove_arcs = [=] __host__ __device__(int32_t i) -> void {
+      if (i == 0) *other_count_data = 0;
+      int32_t state = frontier_data[i];
+      for (int32_t j = row_splits2_data[state];
+           j < row_splits2_data[state + 1]; ++j) {
+        int32_t dest_state = dest_states_data[j];
+        // atomicAdd() returns the old value, so only one thread sees 1.
+        if (dest_state != state &&
+            atomicAdd(in_degree_data + dest_state, -1) == 1) {
+          levels_data[dest_state] = level;
+          next_frontier_data[atomicAdd(count_data, 1)] = dest_state;
+        }
+      }
+    };
+    Eval(c, num_frontier, lambda_remove_arcs);
+    num_frontier = counts.To(cpu).Data()[level & 1];
+    num_sorted += num_frontier;
+    std::swap(frontier, next_frontier);
+  }
+
+  Array1<char> cyclic(c, num_fsas, static_cast<char>(0));
+  char *cyclic_data = cyclic.Data();
+  if (num_sorted != num_states) {
+    auto lambda_set_cyclic = [=] __host__ __device__(int32_t i) -> void {
+      if (levels_data[i] < 0) cyclic_data[row_ids1_data[i]] = 1;
+    };
+    Eval(c, num_states, lambda_set_cyclic);
+  }
+  // We sort the states of each FSA by level; the sort is stable, so the
+  // states of a level keep their order, and state 0 stays first as the only
+  // state of level 0 of a connected FSA.  The final state goes last.  The
+  // states of cyclic FSAs all get the same key so they keep their order.
+  const int32_t max_level = std::numeric_limits<int32_t>::max();
+  auto lambda_set_keys = [=] __host__ __device__(int32_t i) -> void {
+    int32_t fsa_idx0 = row_ids1_data[i];
+    if (cyclic_data[fsa_idx0])
+      levels_data[i] = 0;
+    else if (i + 1 == row_splits1_data[fsa_idx0 + 1])
+      levels_data[i] = max_level;
+  };
+  Eval(c, num_states, lambda_set_keys);
+  Ragged<int32_t> keys(RaggedShape2(&row_splits1, &row_ids1, num_states),
+                       levels);
+  // `order` maps from the new state_idx01 to the old one.
+  Array1<int32_t> order(c, num_states);
+  SortSublists(&keys, &order);
+
+  const int32_t *order_data = order.Data();
+  Array1<int32_t> old2new(c, num_states),
+      new_row_splits2(c, num_states + 1);
+  int32_t *old2new_data = old2new.Data(),
+          *new_row_splits2_data = new_row_splits2.Data();
+  auto lambda_set_num_arcs = [=] __host__ __device__(int32_t i) -> void {
+    int32_t old_state_idx01 = order_data[i];
+    old2new_data[old_state_idx01] = i;
+    new_row_splits2_data[i] = row_splits2_data[old_state_idx01 + 1] -
+                              row_splits2_data[old_state_idx01];
+  };
+  Eval(c, num_states, lambda_set_num_arcs);
+  ExclusiveSum(c, num_states + 1, new_row_splits2_data, new_row_splits2_data);
+  Array1<int32_t> new_row_ids2(c, num_arcs);
+  RowSplitsToRowIds(c, num_states, new_row_splits2_data, num_arcs,
+                    new_row_ids2.Data());
+
+  Array1<Arc> new_arcs(c, num_arcs);
+  Array1<int32_t> new_arc_map(c, num_arcs);
+  const int32_t *new_row_ids2_data = new_row_ids2.Data();
+  Arc *new_arcs_data = new_arcs.Data();
+  int32_t *new_arc_map_data = new_arc_map.Data();
+  auto lambda_set_arcs = [=] __host__ __device__(int32_t i) -> void {
+    int32_t new_state_idx01 = new_row_ids2_data[i],
+            old_state_idx01 = order_data[new_state_idx01],
+            old_arc_idx012 = row_splits2_data[old_state_idx01] + i -
+                             new_row_splits2_data[new_state_idx01],
+            state_idx0x = row_splits1_data[row_ids1_data[old_state_idx01]];
+    Arc arc = arcs_data[old_arc_idx012];
+    arc.src_state = new_state_idx01 - state_idx0x;
+    arc.dest_state = old2new_data[dest_states_data[old_arc_idx012]] -
+                     state_idx0x;
+    new_arcs_data[i] = arc;
+    new_arc_map_data[i] = old_arc_idx012;
+  };
+  Eval(c, num_arcs, lambda_set_arcs);
+
+  RaggedShape shape = RaggedShape3(&row_splits1, &row_ids1, num_states,
+                                   &new_row_splits2, &new_row_ids2, num_arcs);
+  *dest = FsaVec(shape, new_arcs);
+  if (is_cyclic != nullptr) *is_cyclic = cyclic;
+  if (state_map != nullptr) *state_map = order;
+  if (arc_map != nullptr) *arc_map = new_arc_map;
+  return num_sorted == num_states;
+}
+
+namespace {
+// Returns the first i in [begin, end) with arcs[i].symbol >= symbol, or `end`
+// if there is none; the arcs in that range must be sorted by symbol.
+__host__ __device__ __forceinline__ int32_t LowerBoundSymbol(const Arc *arcs,
+                                                             int32_t begin,
+                                                             int32_t end,
+                                                             int32_t symbol) {
+  while (begin < end) {
+    int32_t mid = begin + (end - begin) / 2;
+    if (arcs[mid].symbol < symbol)
+      begin = mid + 1;
+    else
+      end = mid;
+  }
+  return begin;
+}
+
+template <typename T>
+Array1<T> Prefix(Array1<T> &src, int32_t size) {
+  if (size == 0) return Array1<T>(src.Context(), 0);
+  return src.Range(0, size);
+}
+
+// Sorts `keys` in place with a stable sort and returns the order, i.e. the
+// new2old map.
+Array1<int32_t> StableSort(ContextPtr &c, Array1<int32_t> &keys) {
+  int32_t num_keys = keys.Dim();
+  Array1<int32_t> row_splits(c, std::vector<int32_t>{0, num_keys}),
+      order(c, num_keys);
+  Ragged<int32_t> ragged(RaggedShape2(&row_splits, nullptr, num_keys), keys);
+  SortSublists(&ragged, &order);
+  return order;
+}
+
+/*
+  Intersection of two FsaVecs on the device; see IntersectPruned() in
+  fsa_algo.h.  The states of the output are the pairs of states of the inputs
+  that are reached, found breadth-first for all the FSAs at once: each level
+  of the search expands the states first reached on the previous one.  A
+  Hash from the state pair to the output state tells which of the pairs
+  were already reached.
+ */
+class MultiFsaIntersect {
+ public:
+  MultiFsaIntersect(FsaVec &a_fsas, FsaVec &b_fsas, float beam)
+      : c_(GetContext(a_fsas.shape, b_fsas.shape)),
+        a_fsas_(a_fsas),
+        b_fsas_(b_fsas),
+        beam_(beam) {
+    K2_CHECK_EQ(a_fsas.NumAxes(), 3);
+    K2_CHECK_EQ(b_fsas.NumAxes(), 3);
+    K2_CHECK_GT(beam, 0);
+    int32_t a_dim0 = a_fsas.shape.Dim0(), b_dim0 = b_fsas.shape.Dim0();
+    num_fsas_ = std::max(a_dim0, b_dim0);
+    K2_CHECK(a_dim0 == num_fsas_ || a_dim0 == 1);
+    K2_CHECK(b_dim0 == num_fsas_ || b_dim0 == 1);
+    a_stride_ = (a_dim0 == num_fsas_ ? 1 : 0);
+    b_stride_ = (b_dim0 == num_fsas_ ? 1 : 0);
+    num_b_states_ = b_fsas.shape.TotSize(1);
+  }
+
+  // Does the search; the output is provided by FormatOutput().
+  void Intersect() {
+    InitialLevel();
+    while (levels_.back().a_states.Dim() > 0) ExpandLevel();
+  }
+
+  /*
+    Writes the output.  See IntersectPruned() for the meaning of the
+    arguments, which may be nullptr.
+   */
+  void FormatOutput(FsaVec *out, Array1<int32_t> *arc_map_a,
+                    Array1<int32_t> *arc_map_b) {
+    int32_t num_fsas = num_fsas_, num_states = num_states_,
+            a_stride = a_stride_, b_stride = b_stride_;
+    Array1<int32_t> fsa_idxs, a_states, b_states;
+    {
+      int32_t num_levels = static_cast<int32_t>(levels_.size());
+      std::vector<Array1<int32_t>> fsa_idxs_vec, a_states_vec, b_states_vec;
+      for (int32_t i = 0; i < num_levels; i++) {
+        fsa_idxs_vec.push_back(levels_[i].fsa_idxs);
+        a_states_vec.push_back(levels_[i].a_states);
+        b_states_vec.push_back(levels_[i].b_states);
+      }
+      fsa_idxs = Append(num_levels, fsa_idxs_vec.data());
+      a_states = Append(num_levels, a_states_vec.data());
+      b_states = Append(num_levels, b_states_vec.data());
+    }
+    Array1<Arc> arcs;
+    Array1<int32_t> a_arcs, b_arcs;
+    if (arcs_.empty()) {
+      arcs = Array1<Arc>(c_, 0);
+      a_arcs = Array1<int32_t>(c_, 0);
+      b_arcs = Array1<int32_t>(c_, 0);
+    } else {
+      int32_t n = static_cast<int32_t>(arcs_.size());
+      arcs = Append(n, arcs_.data());
+      a_arcs = Append(n, a_arc_maps_.data());
+      b_arcs = Append(n, b_arc_maps_.data());
+    }
+    int32_t num_arcs = arcs.Dim();
+
+    // The states of each FSA are in the order they were reached, except that
+    // the final state goes last; we sort them by fsa_idx0 * 2 + is_final.
+    const int32_t *a_row_splits1 = a_fsas_.shape.RowSplits(1).Data(),
+                  *b_row_splits1 = b_fsas_.shape.RowSplits(1).Data(),
+                  *fsa_idxs_data = fsa_idxs.Data(),
+                  *a_states_data = a_states.Data(),
+                  *b_states_data = b_states.Data();
+    Array1<int32_t> state_keys(c_, num_states);
+    int32_t *state_keys_data = state_keys.Data();
+    auto lambda_set_state_keys = [=] __host__ __device__(int32_t i) -> void {
+      int32_t fsa_idx0 = fsa_idxs_data[i];
+      bool is_final =
+          (a_states_data[i] + 1 == a_row_splits1[fsa_idx0 * a_stride + 1] &&
+           b_states_data[i] + 1 == b_row_splits1[fsa_idx0 * b_stride + 1]);
+      state_keys_data[i] = fsa_idx0 * 2 + (is_final ? 1 : 0);
+    };
+    Eval(c_, num_states, lambda_set_state_keys);
+    Array1<int32_t> states_new2old = StableSort(c_, state_keys),
+                    states_old2new = InvertPermutation(states_new2old);
+    const int32_t *states_old2new_data = states_old2new.Data();
+    Array1<int32_t> new_row_ids1(c_, num_states),
+        row_splits1(c_, num_fsas + 1);
+    int32_t *new_row_ids1_data = new_row_ids1.Data();
+    auto lambda_set_row_ids1 = [=] __host__ __device__(int32_t i) -> void {
+      new_row_ids1_data[i] = state_keys_data[i] / 2;
+    };
+    Eval(c_, num_states, lambda_set_row_ids1);
+    RowIdsToRowSplits(new_row_ids1, row_splits1);
+
+    // The arcs are sorted by the new numbering of their source states; the
+    // arcs of each state stay in the order they were generated.
+    const Arc *arcs_data = arcs.Data();
+    Array1<int32_t> row_ids2(c_, num_arcs), row_splits2(c_, num_states + 1);
+    int32_t *row_ids2_data = row_ids2.Data();
+    auto lambda_set_row_ids2 = [=] __host__ __device__(int32_t i) -> void {
+      row_ids2_data[i] = states_old2new_data[arcs_data[i].src_state];
+    };
+    Eval(c_, num_arcs, lambda_set_row_ids2);
+    Array1<int32_t> arcs_new2old = StableSort(c_, row_ids2);
+    RowIdsToRowSplits(row_ids2, row_splits2);
+
+    Array1<Arc> new_arcs(c_, num_arcs);
+    Arc *new_arcs_data = new_arcs.Data();
+    const int32_t *arcs_new2old_data = arcs_new2old.Data(),
+                  *row_splits1_data = row_splits1.Data();
+    auto lambda_set_arcs = [=] __host__ __device__(int32_t i) -> void {
+      Arc arc = arcs_data[arcs_new2old_data[i]];
+      int32_t state_idx0x = row_splits1_data[fsa_idxs_data[arc.src_state]];
+      arc.src_state = row_ids2_data[i] - state_idx0x;
+      arc.dest_state = states_old2new_data[arc.dest_state] - state_idx0x;
+      new_arcs_data[i] = arc;
+    };
+    Eval(c_, num_arcs, lambda_set_arcs);
+
+    RaggedShape shape = RaggedShape3(&row_splits1, &new_row_ids1, num_states,
+                                     &row_splits2, &row_ids2, num_arcs);
+    FsaVec unconnected(shape, new_arcs);
+    // This removes the states that can't reach the final state (e.g. where
+    // the symbols didn't match, or that were cut off by the pruning), keeping
+    // the order of those that remain; it does not need the input to be
+    // top-sorted for that.
+    Array1<int32_t> connect_arc_map;
+    ConnectTopSorted(unconnected, out, &connect_arc_map);
+    Array1<int32_t> arc_map = arcs_new2old[connect_arc_map];
+    if (arc_map_a != nullptr) *arc_map_a = a_arcs[arc_map];
+    if (arc_map_b != nullptr) *arc_map_b = b_arcs[arc_map];
+  }
+
+ private:
+  // An arc leaving a state on the frontier of the search, before pruning.
+  struct ArcCandidate {
+    int32_t src_state;     // the index of the state in the frontier
+    int32_t a_arc_idx012;  // the arc in a_fsas_, or -1 for epsilon arcs of b
+    int32_t b_arc_idx012;  // the arc in b_fsas_, or -1 for epsilon arcs of a
+    int32_t dest_a_state_idx01;
+    int32_t dest_b_state_idx01;
+    int32_t symbol;
+    float score;
+    float end_loglike;  // the forward log-like of the source state + score
+  };
+
+  // The states first reached on a level of the search.
+  struct LevelStates {
+    Array1<int32_t> fsa_idxs;  // the fsa_idx0 of each state
+    Array1<int32_t> a_states;  // the state_idx01 in a_fsas_ of each state
+    Array1<int32_t> b_states;  // the state_idx01 in b_fsas_ of each state
+    // Caution: these are really floats, bit-twiddled with FloatToOrderedInt
+    // so we can use atomic max.  The best score of any path to the state
+    // found by the search.
+    Array1<int32_t> forward_loglikes;
+    // From each state to the `items` of its expansion: the arcs leaving the
+    // state in a_fsas_, then those leaving the state in b_fsas_.
+    Array1<int32_t> item_row_splits;
+    int32_t num_items;
+  };
+
+  __host__ __device__ static uint64_t Key(uint64_t num_b_states,
+                                          int32_t a_state_idx01,
+                                          int32_t b_state_idx01) {
+    return static_cast<uint64_t>(a_state_idx01) * num_b_states +
+           b_state_idx01;
+  }
+
+  // Makes sure hash_ has room for `num_states` states, rebuilding it if not.
+  void ReserveStates(int32_t num_states) {
+    if (hash_ != nullptr && hash_->NumBuckets() >= 2 * num_states) return;
+    // Room for twice as many, so that the table is rebuilt only a
+    // logarithmic number of times.
+    hash_ = std::make_unique<Hash>(c_, Hash::NumBucketsFor(2 * num_states));
+    Hash::Accessor hash = hash_->GetAccessor();
+    uint64_t num_b_states = num_b_states_;
+    int32_t begin = 0;
+    for (LevelStates &level : levels_) {
+      const int32_t *a_states_data = level.a_states.Data(),
+                    *b_states_data = level.b_states.Data();
+      auto lambda_reinsert = [=] __host__ __device__(int32_t i) -> void {
+        *hash.Insert(Key(num_b_states, a_states_data[i], b_states_data[i])) =
+            begin + i;
+      };
+      Eval(c_, level.a_states.Dim(), lambda_reinsert);
+      begin += level.a_states.Dim();
+    }
+  }
+
+  // Sets up the first level, with the start state and the final state of each
+  // FSA (the final state is never expanded, but this way it exists whether
+  // or not it is reached, which keeps it last in FormatOutput()).
+  void InitialLevel() {
+    int32_t num_fsas = num_fsas_, a_stride = a_stride_, b_stride = b_stride_;
+    const int32_t *a_row_splits1 = a_fsas_.shape.RowSplits(1).Data(),
+                  *b_row_splits1 = b_fsas_.shape.RowSplits(1).Data(),
+                  *a_row_splits2 = a_fsas_.shape.RowSplits(2).Data(),
+                  *b_row_splits2 = b_fsas_.shape.RowSplits(2).Data();
+    Array1<int32_t> row_splits1(c_, num_fsas + 1);
+    int32_t *row_splits1_data = row_splits1.Data();
+    auto lambda_count_states = [=] __host__ __device__(int32_t i) -> void {
+      int32_t a_num_states = a_row_splits1[i * a_stride + 1] -
+                             a_row_splits1[i * a_stride],
+              b_num_states = b_row_splits1[i * b_stride + 1] -
+                             b_row_splits1[i * b_stride];
+      // If both FSAs have one state, the start state is the final state.
+      row_splits1_data[i] =
+          (a_num_states == 0 || b_num_states == 0
+               ? 0
+               : (a_num_states == 1 && b_num_states == 1 ? 1 : 2));
+    };
+    Eval(c_, num_fsas, lambda_count_states);
+    int32_t num_states = ExclusiveSumWithTotal(c_, num_fsas + 1,
+                                               row_splits1_data,
+                                               row_splits1_data);
+    LevelStates level;
+    level.fsa_idxs = Array1<int32_t>(c_, num_states);
+    level.a_states = Array1<int32_t>(c_, num_states);
+    level.b_states = Array1<int32_t>(c_, num_states);
+    level.forward_loglikes = Array1<int32_t>(c_, num_states);
+    level.item_row_splits = Array1<int32_t>(c_, num_states + 1);
+    int32_t *fsa_idxs_data = level.fsa_idxs.Data(),
+            *a_states_data = level.a_states.Data(),
+            *b_states_data = level.b_states.Data(),
+            *forward_data = level.forward_loglikes.Data(),
+            *item_row_splits_data = level.item_row_splits.Data();
+    ReserveStates(num_states);
+    Hash::Accessor hash = hash_->GetAccessor();
+    uint64_t num_b_states = num_b_states_;
+    const int32_t zero = FloatToOrderedInt(0.0f),
+                  minus_inf = FloatToOrderedInt(
+                      -std::numeric_limits<float>::infinity());
+    auto lambda_set_states = [=] __host__ __device__(int32_t i) -> void {
+      int32_t begin = row_splits1_data[i],
+              num = row_splits1_data[i + 1] - begin;
+      for (int32_t j = 0; j < num; j++) {
+        int32_t state_idx = begin + j,
+                a_state_idx01 = (j == 0 ? a_row_splits1[i * a_stride]
+                                        : a_row_splits1[i * a_stride + 1] - 1),
+                b_state_idx01 = (j == 0 ? b_row_splits1[i * b_stride]
+                                        : b_row_splits1[i * b_stride + 1] - 1);
+        fsa_idxs_data[state_idx] = i;
+        a_states_data[state_idx] = a_state_idx01;
+        b_states_data[state_idx] = b_state_idx01;
+        forward_data[state_idx] = (j == 0 ? zero : minus_inf);
+        item_row_splits_data[state_idx] =
+            a_row_splits2[a_state_idx01 + 1] - a_row_splits2[a_state_idx01] +
+            b_row_splits2[b_state_idx01 + 1] - b_row_splits2[b_state_idx01];
+        *hash.Insert(Key(num_b_states, a_state_idx01, b_state_idx01)) =
+            state_idx;
+      }
+    };
+    Eval(c_, num_fsas, lambda_set_states);
+    level.num_items = ExclusiveSumWithTotal(c_, num_states + 1,
+                                            item_row_splits_data,
+                                            item_row_splits_data);
+    levels_.push_back(level);
+    num_states_ = num_states;
+  }
+
+  /*
+    Expands the states of the last level: generates the arcs leaving them,
+    prunes them if beam_ is finite, and appends the states first reached by
+    the arcs that are kept as a new level.  Does two transfers to the host,
+    of the number of arcs generated and then of the sizes of what was kept.
+   */
+  void ExpandLevel() {
+    LevelStates &cur = levels_.back();
+    int32_t num_cur_states = cur.a_states.Dim(), num_items = cur.num_items,
+            num_states = num_states_,
+            cur_begin = num_states - num_cur_states, a_stride = a_stride_,
+            b_stride = b_stride_;
+    const int32_t *a_row_splits1 = a_fsas_.shape.RowSplits(1).Data(),
+                  *b_row_splits1 = b_fsas_.shape.RowSplits(1).Data(),
+                  *a_row_splits2 = a_fsas_.shape.RowSplits(2).Data(),
+                  *b_row_splits2 = b_fsas_.shape.RowSplits(2).Data(),
+                  *fsa_idxs_data = cur.fsa_idxs.Data(),
+                  *a_states_data = cur.a_states.Data(),
+                  *b_states_data = cur.b_states.Data(),
+                  *forward_data = cur.forward_loglikes.Data(),
+                  *item_row_splits_data = cur.item_row_splits.Data();
+    const Arc *a_arcs_data =
+                  static_cast<const Array1<Arc> &>(a_fsas_.values).Data(),
+              *b_arcs_data =
+                  static_cast<const Array1<Arc> &>(b_fsas_.values).Data();
+
+    // Count the arcs of each item: an epsilon arc of either FSA gives one arc
+    // that leaves the other one's state unchanged, and any other arc of
+    // a_fsas_ is matched with the arcs of b_fsas_ with the same symbol, found
+    // by binary search as both are sorted by symbol.
+    Array1<int32_t> item_row_ids(c_, num_items);
+    RowSplitsToRowIds(cur.item_row_splits, item_row_ids);
+    const int32_t *item_row_ids_data = item_row_ids.Data();
+    Array1<int32_t> cand_row_splits(c_, num_items + 1),
+        match_begin(c_, num_items);
+    int32_t *cand_row_splits_data = cand_row_splits.Data(),
+            *match_begin_data = match_begin.Data();
+    auto lambda_count_arcs = [=] __host__ __device__(int32_t item) -> void {
+      int32_t s = item_row_ids_data[item],
+              j = item - item_row_splits_data[s],
+              a_state_idx01 = a_states_data[s],
+              b_state_idx01 = b_states_data[s],
+              a_begin = a_row_splits2[a_state_idx01],
+              a_num_arcs = a_row_splits2[a_state_idx01 + 1] - a_begin,
+              b_begin = b_row_splits2[b_state_idx01],
+              b_end = b_row_splits2[b_state_idx01 + 1], num_arcs;
+      if (j < a_num_arcs) {
+        int32_t symbol = a_arcs_data[a_begin + j].symbol;
+        if (symbol == 0) {
+          num_arcs = 1;
+        } else {
+          int32_t lower = LowerBoundSymbol(b_arcs_data, b_begin, b_end,
+                                           symbol),
+                  upper = LowerBoundSymbol(b_arcs_data, lower, b_end,
+                                           symbol + 1);
+          match_begin_data[item] = lower;
+          num_arcs = upper - lower;
+        }
+      } else {
+        num_arcs = (b_arcs_data[b_begin + j - a_num_arcs].symbol == 0);
+      }
+      cand_row_splits_data[item] = num_arcs;
+    };
+    Eval(c_, num_items, lambda_count_arcs);
+    int32_t num_cands = ExclusiveSumWithTotal(
+        c_, num_items + 1, cand_row_splits_data, cand_row_splits_data);
+
+    Array1<int32_t> cand_row_ids(c_, num_cands);
+    RowSplitsToRowIds(cand_row_splits, cand_row_ids);
+    const int32_t *cand_row_ids_data = cand_row_ids.Data();
+    Array1<ArcCandidate> cands(c_, num_cands);
+    ArcCandidate *cands_data = cands.Data();
+    bool prune = (beam_ != std::numeric_limits<float>::infinity());
+    const int32_t minus_inf =
+        FloatToOrderedInt(-std::numeric_limits<float>::infinity());
+    // best_data[fsa_idx0] is the best end_loglike of the arcs of the FSA.
+    Array1<int32_t> best(c_, num_fsas_, minus_inf);
+    int32_t *best_data = best.Data();
+    auto lambda_set_cands = [=] __host__ __device__(int32_t i) -> void {
+      int32_t item = cand_row_ids_data[i],
+              within_item = i - cand_row_splits_data[item],
+              s = item_row_ids_data[item],
+              j = item - item_row_splits_data[s],
+              fsa_idx0 = fsa_idxs_data[s],
+              a_state_idx01 = a_states_data[s],
+              b_state_idx01 = b_states_data[s],
+              a_state_idx0x = a_row_splits1[fsa_idx0 * a_stride],
+              b_state_idx0x = b_row_splits1[fsa_idx0 * b_stride],
+              a_begin = a_row_splits2[a_state_idx01],
+              a_num_arcs = a_row_splits2[a_state_idx01 + 1] - a_begin;
+      ArcCandidate cand;
+      cand.src_state = s;
+      if (j < a_num_arcs) {
+        int32_t a_arc_idx012 = a_begin + j;
+        const Arc &a_arc = a_arcs_data[a_arc_idx012];
+        cand.a_arc_idx012 = a_arc_idx012;
+        cand.dest_a_state_idx01 = a_state_idx0x + a_arc.dest_state;
+        cand.symbol = a_arc.symbol;
+        if (a_arc.symbol == 0) {
+          cand.b_arc_idx012 = -1;
+          cand.dest_b_state_idx01 = b_state_idx01;
+          cand.score = a_arc.score;
+        } else {
+          int32_t b_arc_idx012 = match_begin_data[item] + within_item;
+          const Arc &b_arc = b_arcs_data[b_arc_idx012];
+          cand.b_arc_idx012 = b_arc_idx012;
+          cand.dest_b_state_idx01 = b_state_idx0x + b_arc.dest_state;
+          cand.score = a_arc.score + b_arc.score;
+        }
+      } else {
+        int32_t b_arc_idx012 =
+            b_row_splits2[b_state_idx01] + j - a_num_arcs;
+        const Arc &b_arc = b_arcs_data[b_arc_idx012];
+        cand.a_arc_idx012 = -1;
+        cand.b_arc_idx012 = b_arc_idx012;
+        cand.dest_a_state_idx01 = a_state_idx01;
+        cand.dest_b_state_idx01 = b_state_idx0x + b_arc.dest_state;
+        cand.symbol = 0;
+        cand.score = b_arc.score;
+      }
+      cand.end_loglike = OrderedIntToFloat(forward_data[s]) + cand.score;
+      cands_data[i] = cand;
+      if (prune)
+        atomicMax(best_data + fsa_idx0, FloatToOrderedInt(cand.end_loglike));
+    };
+    Eval(c_, num_cands, lambda_set_cands);
+
+    // The arcs that are within the beam claim their destination states if
+    // they are new, by writing -(arc index + 2) to the hash; any of them may
+    // win.  Existing states have values >= 0, and are not overwritten.
+    ReserveStates(num_states + num_cands);
+    Hash::Accessor hash = hash_->GetAccessor();
+    uint64_t num_b_states = num_b_states_;
+    float beam = beam_;
+    auto lambda_claim_states = [=] __host__ __device__(int32_t i) -> void {
+      const ArcCandidate &cand = cands_data[i];
+      if (prune) {
+        int32_t fsa_idx0 = fsa_idxs_data[cand.src_state];
+        if (cand.end_loglike < OrderedIntToFloat(best_data[fsa_idx0]) - beam)
+          return;
+      }
+      int32_t *value = hash.Insert(Key(num_b_states, cand.dest_a_state_idx01,
+                                       cand.dest_b_state_idx01));
+      if (*value < 0) *value = -(i + 2);
+    };
+    Eval(c_, num_cands, lambda_claim_states);
+
+    // We keep the arcs whose destination state exists or was claimed (so, as
+    // in IntersectDensePruned(), arcs outside the beam are kept if their
+    // destination states are kept).
+    Array1<char> keep_arcs(c_, num_cands + 1), keep_states(c_, num_cands + 1);
+    char *keep_arcs_data = keep_arcs.Data(),
+         *keep_states_data = keep_states.Data();
+    auto lambda_set_keep = [=] __host__ __device__(int32_t i) -> void {
+      const ArcCandidate &cand = cands_data[i];
+      const int32_t *value = hash.Find(Key(
+          num_b_states, cand.dest_a_state_idx01, cand.dest_b_state_idx01));
+      int32_t v = (value != nullptr ? *value : -1);
+      keep_arcs_data[i] = (v != -1);
+      keep_states_data[i] = (v == -(i + 2));
+    };
+    Eval(c_, num_cands, lambda_set_keep);
+    Array1<int32_t> arc_reorder(c_, num_cands + 1),
+        state_reorder(c_, num_cands + 1);
+    int32_t *arc_reorder_data = arc_reorder.Data(),
+            *state_reorder_data = state_reorder.Data();
+    ExclusiveSum(c_, num_cands + 1, keep_arcs_data, arc_reorder_data);
+    ExclusiveSum(c_, num_cands + 1, keep_states_data, state_reorder_data);
+
+    // The next level is allocated for the largest possible size, num_cands.
+    LevelStates next;
+    next.fsa_idxs = Array1<int32_t>(c_, num_cands);
+    next.a_states = Array1<int32_t>(c_, num_cands);
+    next.b_states = Array1<int32_t>(c_, num_cands);
+    next.forward_loglikes = Array1<int32_t>(c_, num_cands, minus_inf);
+    next.item_row_splits = Array1<int32_t>(c_, num_cands + 1, 0);
+    int32_t *next_fsa_idxs_data = next.fsa_idxs.Data(),
+            *next_a_states_data = next.a_states.Data(),
+            *next_b_states_data = next.b_states.Data(),
+            *next_forward_data = next.forward_loglikes.Data(),
+            *next_item_row_splits_data = next.item_row_splits.Data();
+    auto lambda_set_next_states =
+        [=] __host__ __device__(int32_t i) -> void {
+      if (!keep_states_data[i]) return;
+      const ArcCandidate &cand = cands_data[i];
+      int32_t next_idx = state_reorder_data[i],
+              a_state_idx01 = cand.dest_a_state_idx01,
+              b_state_idx01 = cand.dest_b_state_idx01;
+      *hash.Find(Key(num_b_states, a_state_idx01, b_state_idx01)) =
+          num_states + next_idx;
+      next_fsa_idxs_data[next_idx] = fsa_idxs_data[cand.src_state];
+      next_a_states_data[next_idx] = a_state_idx01;
+      next_b_states_data[next_idx] = b_state_idx01;
+      next_item_row_splits_data[next_idx] =
+          a_row_splits2[a_state_idx01 + 1] - a_row_splits2[a_state_idx01] +
+          b_row_splits2[b_state_idx01 + 1] - b_row_splits2[b_state_idx01];
+    };
+    Eval(c_, num_cands, lambda_set_next_states);
+
+    // The arcs, with src_state and dest_state numbered over all the states
+    // reached (in order of level).
+    Array1<Arc> arcs(c_, num_cands);
+    Array1<int32_t> a_arc_map(c_, num_cands), b_arc_map(c_, num_cands);
+    Arc *arcs_data = arcs.Data();
+    int32_t *a_arc_map_data = a_arc_map.Data(),
+            *b_arc_map_data = b_arc_map.Data();
+    auto lambda_set_arcs = [=] __host__ __device__(int32_t i) -> void {
+      if (!keep_arcs_data[i]) return;
+      const ArcCandidate &cand = cands_data[i];
+      int32_t arc_idx = arc_reorder_data[i],
+              dest_state = *hash.Find(Key(num_b_states,
+                                          cand.dest_a_state_idx01,
+                                          cand.dest_b_state_idx01));
+      Arc arc;
+      arc.src_state = cur_begin + cand.src_state;
+      arc.dest_state = dest_state;
+      arc.symbol = cand.symbol;
+      arc.score = cand.score;
+      arcs_data[arc_idx] = arc;
+      a_arc_map_data[arc_idx] = cand.a_arc_idx012;
+      b_arc_map_data[arc_idx] = cand.b_arc_idx012;
+      // The forward log-like of a new state is the best of its arcs on this
+      // level.
+      if (dest_state >= num_states)
+        atomicMax(next_forward_data + dest_state - num_states,
+                  FloatToOrderedInt(cand.end_loglike));
+    };
+    Eval(c_, num_cands, lambda_set_arcs);
+
+    // The elements past the number of next states are zero, so this is right
+    // even though we don't know that number yet.
+    ExclusiveSum(c_, num_cands + 1, next_item_row_splits_data,
+                 next_item_row_splits_data);
+    Array1<int32_t> totals(c_, 3);
+    int32_t *totals_data = totals.Data();
+    auto lambda_set_totals = [=] __host__ __device__(int32_t i) -> void {
+      int32_t num_next_states = state_reorder_data[num_cands];
+      totals_data[0] = arc_reorder_data[num_cands];
+      totals_data[1] = num_next_states;
+      totals_data[2] = next_item_row_splits_data[num_next_states];
+    };
+    Eval(c_, 1, lambda_set_totals);
+    totals = totals.To(GetCpuContext());
+    int32_t num_kept_arcs = totals.Data()[0],
+            num_next_states = totals.Data()[1];
+    next.num_items = totals.Data()[2];
+
+    if (num_kept_arcs > 0) {
+      arcs_.push_back(arcs.Range(0, num_kept_arcs));
+      a_arc_maps_.push_back(a_arc_map.Range(0, num_kept_arcs));
+      b_arc_maps_.push_back(b_arc_map.Range(0, num_kept_arcs));
+    }
+    next.fsa_idxs = Prefix(next.fsa_idxs, num_next_states);
+    next.a_states = Prefix(next.a_states, num_next_states);
+    next.b_states = Prefix(next.b_states, num_next_states);
+    next.forward_loglikes = Prefix(next.forward_loglikes, num_next_states);
+    next.item_row_splits = next.item_row_splits.Range(0, num_next_states + 1);
+    levels_.push_back(next);
+    num_states_ += num_next_states;
+  }
+
+  ContextPtr c_;
+  FsaVec &a_fsas_;
+  FsaVec &b_fsas_;
+  float beam_;
+  int32_t num_fsas_;
+  int32_t a_stride_;  // 1 if a_fsas_ has an FSA per output FSA, 0 if its one
+                      // FSA is shared.
+  int32_t b_stride_;  // Likewise for b_fsas_.
+  uint64_t num_b_states_;  // b_fsas_.TotSize(1), used in the keys of hash_.
+
+  std::vector<LevelStates> levels_;
+  int32_t num_states_ = 0;  // the total number of states in levels_.
+  // From the pair (state_idx01 in a_fsas_, state_idx01 in b_fsas_) to the
+  // index of the state (over all levels); see Key().
+  std::unique_ptr<Hash> hash_;
+
+  // The arcs kept on each level, see ExpandLevel(), and their arc maps.
+  std::vector<Array1<Arc>> arcs_;
+  std::vector<Array1<int32_t>> a_arc_maps_;
+  std::vector<Array1<int32_t>> b_arc_maps_;
+};
+
+/*
+  Determinization of an FsaVec on the device; see DeterminizePrunedMax() in
+  fsa_algo.h.  Each output state is a weighted subset of the input states
+  (its "state subset"): a list of elements (state_idx01, residual), sorted
+  by state, where the residual is the weight of the state relative to that
+  of the best one, which has residual 0.  As for MultiFsaIntersect, the
+  states are found breadth-first for all the FSAs at once; the subsets of the
+  states first reached on a level are stored as one ragged array.  To expand
+  a level, the arcs leaving the elements of each subset (the `items`) are
+  sorted by (symbol, dest_state): the items with the same symbol give an
+  output arc, and those that also have the same dest_state give an element
+  of its destination subset.
+
+  The states are identified by a 64-bit hash of their subsets, with the
+  residuals quantized to multiples of 1/1024 (so that, as in OpenFst,
+  subsets that differ only by rounding errors are the same); hash collisions
+  are not detected.
+ */
+class MultiFsaDeterminize {
+ public:
+  MultiFsaDeterminize(FsaVec &src, float beam, bool log_semiring)
+      : c_(src.Context()),
+        src_(src),
+        beam_(beam),
+        log_semiring_(log_semiring) {
+    K2_CHECK_EQ(src.NumAxes(), 3);
+    K2_CHECK_GT(beam, 0);
+  }
+
+  // Does the search; the output is provided by FormatOutput().
+  void Determinize() {
+    InitialLevel();
+    while (levels_.back().num_items > 0) ExpandLevel();
+  }
+
+  /*
+    Writes the output.  See DeterminizePrunedMax() for the meaning of the
+    arguments; `arc_derivs` and `arc_deriv_values` may be nullptr.
+   */
+  void FormatOutput(FsaVec *out, Ragged<int32_t> *arc_derivs,
+                    Array1<float> *arc_deriv_values) {
+    int32_t num_fsas = src_.shape.Dim0(), num_states = num_states_;
+    int32_t num_levels = static_cast<int32_t>(levels_.size());
+    std::vector<Array1<int32_t>> fsa_idxs_vec, best_elems_vec,
+        elem_states_vec, elem_prevs_vec, elem_arcs_vec;
+    std::vector<Array1<float>> elem_residuals_vec;
+    for (int32_t i = 0; i < num_levels; i++) {
+      fsa_idxs_vec.push_back(levels_[i].fsa_idxs);
+      best_elems_vec.push_back(levels_[i].best_elems);
+      elem_states_vec.push_back(levels_[i].elem_states);
+      elem_residuals_vec.push_back(levels_[i].elem_residuals);
+      elem_prevs_vec.push_back(levels_[i].elem_prevs);
+      elem_arcs_vec.push_back(levels_[i].elem_arcs);
+    }
+    Array1<int32_t> fsa_idxs = Append(num_levels, fsa_idxs_vec.data()),
+                    best_elems = Append(num_levels, best_elems_vec.data()),
+                    elem_states = Append(num_levels, elem_states_vec.data());
+    Array1<Arc> arcs;
+    Array1<int32_t> deriv_counts, deriv_elems, deriv_arcs;
+    if (arcs_.empty()) {
+      arcs = Array1<Arc>(c_, 0);
+      deriv_counts = Array1<int32_t>(c_, 0);
+      deriv_elems = Array1<int32_t>(c_, 0);
+      deriv_arcs = Array1<int32_t>(c_, 0);
+    } else {
+      int32_t n = static_cast<int32_t>(arcs_.size());
+      arcs = Append(n, arcs_.data());
+      deriv_counts = Append(n, deriv_counts_.data());
+      deriv_elems = Append(n, deriv_elems_.data());
+      deriv_arcs = Append(n, deriv_arcs_.data());
+    }
+    int32_t num_arcs = arcs.Dim();
+
+    // The states of each FSA are in the order they were reached, except that
+    // the final state goes last; we sort them by fsa_idx0 * 2 + is_final.
+    // The final state is the one with the subset {final-state of src}: any
+    // element of a subset reached by an arc with symbol -1 is a final state.
+    const int32_t *row_splits1_data = src_.shape.RowSplits(1).Data(),
+                  *fsa_idxs_data = fsa_idxs.Data(),
+                  *best_elems_data = best_elems.Data(),
+                  *elem_states_data = elem_states.Data();
+    Array1<int32_t> state_keys(c_, num_states);
+    int32_t *state_keys_data = state_keys.Data();
+    auto lambda_set_state_keys = [=] __host__ __device__(int32_t i) -> void {
+      int32_t fsa_idx0 = fsa_idxs_data[i];
+      bool is_final = (elem_states_data[best_elems_data[i]] + 1 ==
+                       row_splits1_data[fsa_idx0 + 1]);
+      state_keys_data[i] = fsa_idx0 * 2 + (is_final ? 1 : 0);
+    };
+    Eval(c_, num_states, lambda_set_state_keys);
+    Array1<int32_t> states_new2old = StableSort(c_, state_keys),
+                    states_old2new = InvertPermutation(states_new2old);
+    const int32_t *states_old2new_data = states_old2new.Data();
+    Array1<int32_t> new_row_ids1(c_, num_states),
+        new_row_splits1(c_, num_fsas + 1);
+    int32_t *new_row_ids1_data = new_row_ids1.Data();
+    auto lambda_set_row_ids1 = [=] __host__ __device__(int32_t i) -> void {
+      new_row_ids1_data[i] = state_keys_data[i] / 2;
+    };
+    Eval(c_, num_states, lambda_set_row_ids1);
+    RowIdsToRowSplits(new_row_ids1, new_row_splits1);
+
+    // The arcs are sorted by the new numbering of their source states; the
+    // arcs of each state stay in the order they were generated, which is by
+    // symbol.
+    const Arc *arcs_data = arcs.Data();
+    Array1<int32_t> row_ids2(c_, num_arcs), row_splits2(c_, num_states + 1);
+    int32_t *row_ids2_data = row_ids2.Data();
+    auto lambda_set_row_ids2 = [=] __host__ __device__(int32_t i) -> void {
+      row_ids2_data[i] = states_old2new_data[arcs_data[i].src_state];
+    };
+    Eval(c_, num_arcs, lambda_set_row_ids2);
+    Array1<int32_t> arcs_new2old = StableSort(c_, row_ids2);
+    RowIdsToRowSplits(row_ids2, row_splits2);
+
+    Array1<Arc> new_arcs(c_, num_arcs);
+    Arc *new_arcs_data = new_arcs.Data();
+    const int32_t *arcs_new2old_data = arcs_new2old.Data(),
+                  *new_row_splits1_data = new_row_splits1.Data();
+    auto lambda_set_arcs = [=] __host__ __device__(int32_t i) -> void {
+      Arc arc = arcs_data[arcs_new2old_data[i]];
+      int32_t state_idx0x = new_row_splits1_data[fsa_idxs_data[arc.src_state]];
+      arc.src_state = row_ids2_data[i] - state_idx0x;
+      arc.dest_state = states_old2new_data[arc.dest_state] - state_idx0x;
+      new_arcs_data[i] = arc;
+    };
+    Eval(c_, num_arcs, lambda_set_arcs);
+
+    RaggedShape shape = RaggedShape3(&new_row_splits1, &new_row_ids1,
+                                     num_states, &row_splits2, &row_ids2,
+                                     num_arcs);
+    FsaVec unconnected(shape, new_arcs);
+    // This removes the states that can't reach the final state, i.e. those
+    // cut off by the pruning.
+    Array1<int32_t> connect_arc_map;
+    ConnectTopSorted(unconnected, out, &connect_arc_map);
+    if (arc_derivs == nullptr && arc_deriv_values == nullptr) return;
+
+    // arc_map[i] is the arc in `arcs` of arc i of `out`.
+    Array1<int32_t> arc_map = arcs_new2old[connect_arc_map];
+    int32_t num_out_arcs = arc_map.Dim();
+    Array1<int32_t> old_deriv_splits(c_, num_arcs + 1);
+    int32_t *old_deriv_splits_ans_data = old_deriv_splits.Data();
+    const int32_t *deriv_counts_data = deriv_counts.Data();
+    auto lambda_copy_counts = [=] __host__ __device__(int32_t i) -> void {
+      old_deriv_splits_ans_data[i] = (i < num_arcs ? deriv_counts_data[i] : 0);
+    };
+    Eval(c_, num_arcs + 1, lambda_copy_counts);
+    ExclusiveSum(c_, num_arcs + 1, old_deriv_splits_ans_data,
+                 old_deriv_splits_ans_data);
+    Array1<int32_t> elem_prevs = Append(num_levels, elem_prevs_vec.data()),
+                    elem_arcs = Append(num_levels, elem_arcs_vec.data());
+    Array1<float> elem_residuals =
+        Append(num_levels, elem_residuals_vec.data());
+    const int32_t *arc_map_data = arc_map.Data(),
+                  *old_deriv_splits_data = old_deriv_splits.Data(),
+                  *deriv_elems_data = deriv_elems.Data(),
+                  *deriv_arcs_data = deriv_arcs.Data(),
+                  *elem_prevs_data = elem_prevs.Data(),
+                  *elem_arcs_data = elem_arcs.Data();
+    const float *elem_residuals_data = elem_residuals.Data();
+    const Arc *src_arcs_data =
+        static_cast<const Array1<Arc> &>(src_.values).Data();
+    bool log_semiring = log_semiring_;
+
+    // For the log semiring the derivatives of each arc are those recorded in
+    // ExpandLevel().  For max, the weight of an arc is that of the best path
+    // to the element it was recorded with plus the arc recorded, minus that
+    // of the best path to the best element of its source state (residual 0),
+    // so we trace both paths back until they meet.
+    Array1<int32_t> new_deriv_splits(c_, num_out_arcs + 1);
+    int32_t *new_deriv_splits_data = new_deriv_splits.Data();
+    auto lambda_count_derivs = [=] __host__ __device__(int32_t i) -> void {
+      int32_t arc_idx = arc_map_data[i], begin = old_deriv_splits_data[arc_idx];
+      if (log_semiring) {
+        new_deriv_splits_data[i] = old_deriv_splits_data[arc_idx + 1] - begin;
+        return;
+      }
+      int32_t e = deriv_elems_data[begin],
+              best_e = best_elems_data[arcs_data[arc_idx].src_state], n = 1;
+      for (; e != best_e;
+           e = elem_prevs_data[e], best_e = elem_prevs_data[best_e])
+        n += 2;
+      new_deriv_splits_data[i] = n;
+    };
+    Eval(c_, num_out_arcs, lambda_count_derivs);
+    int32_t num_derivs = ExclusiveSumWithTotal(
+        c_, num_out_arcs + 1, new_deriv_splits_data, new_deriv_splits_data);
+    Array1<int32_t> derivs(c_, num_derivs);
+    Array1<float> deriv_values(c_, num_derivs);
+    int32_t *derivs_data = derivs.Data();
+    float *deriv_values_data = deriv_values.Data();
+    auto lambda_set_derivs = [=] __host__ __device__(int32_t i) -> void {
+      int32_t arc_idx = arc_map_data[i], begin = old_deriv_splits_data[arc_idx],
+              pos = new_deriv_splits_data[i];
+      if (log_semiring) {
+        float score = arcs_data[arc_idx].score;
+        for (int32_t j = begin; j < old_deriv_splits_data[arc_idx + 1];
+             ++j, ++pos) {
+          int32_t src_arc = deriv_arcs_data[j];
+          derivs_data[pos] = src_arc;
+          deriv_values_data[pos] =
+              expf(elem_residuals_data[deriv_elems_data[j]] +
+                   src_arcs_data[src_arc].score - score);
+        }
+        return;
+      }
+      int32_t e = deriv_elems_data[begin],
+              best_e = best_elems_data[arcs_data[arc_idx].src_state];
+      derivs_data[pos] = deriv_arcs_data[begin];
+      deriv_values_data[pos++] = 1.0f;
+      for (; e != best_e;
+           e = elem_prevs_data[e], best_e = elem_prevs_data[best_e]) {
+        derivs_data[pos] = elem_arcs_data[e];
+        deriv_values_data[pos++] = 1.0f;
+        derivs_data[pos] = elem_arcs_data[best_e];
+        deriv_values_data[pos++] = -1.0f;
+      }
+    };
+    Eval(c_, num_out_arcs, lambda_set_derivs);
+    if (arc_derivs != nullptr)
+      *arc_derivs = Ragged<int32_t>(
+          RaggedShape2(&new_deriv_splits, nullptr, num_derivs), derivs);
+    if (arc_deriv_values != nullptr) *arc_deriv_values = deriv_values;
+  }
+
+ private:
+  // An arc leaving a state on the frontier of the search, with the subset of
+  // its destination state.
+  struct ArcCandidate {
+    int32_t src_state;  // the index of the state in the frontier
+    int32_t symbol;
+    float score;        // the best weight of the elements of the subset
+    float end_loglike;  // the forward log-like of the source state + score
+    // The elements of the subset are dest_elems [elem_begin, elem_end) of
+    // ExpandLevel(), of which num_elems are kept; best_elem has residual 0.
+    int32_t elem_begin;
+    int32_t elem_end;
+    int32_t best_elem;
+    int32_t num_elems;
+    uint64_t key;  // of the subset, see AddToKey()
+  };
+
+  // The states first reached on a level of the search.  The elements are
+  // ordered by state, and numbered over all levels for the traceback.
+  struct LevelStates {
+    Array1<int32_t> fsa_idxs;  // the fsa_idx0 of each state
+    Array1<uint64_t> keys;     // the key of the subset of each state
+    // Caution: these are really floats, bit-twiddled with FloatToOrderedInt
+    // so we can use atomic max.  The best score of any path to the state
+    // found by the search.
+    Array1<int32_t> forward_loglikes;
+    // From each state to its elements [elem_row_splits[i],
+    // elem_row_splits[i+1]) in the arrays below.
+    Array1<int32_t> elem_row_splits;
+    // The element with residual 0 of each state, in the numbering over all
+    // levels.
+    Array1<int32_t> best_elems;
+    Array1<int32_t> elem_states;  // the state_idx01 in src_ of each element
+    Array1<float> elem_residuals;
+    // The element (numbered over all levels) and arc of src_ of the best
+    // path to each element, or -1 on the first level.
+    Array1<int32_t> elem_prevs;
+    Array1<int32_t> elem_arcs;
+    // From each element to its items, the arcs leaving its state.
+    Array1<int32_t> item_row_splits;
+    int32_t num_items;
+  };
+
+  // Returns the key of a subset with elements (state_idx01, residual) added
+  // in order to `key`; the key of the empty subset is kEmptySubsetKey.
+  static constexpr uint64_t kEmptySubsetKey = 0xCBF29CE484222325ull;
+  __host__ __device__ static uint64_t AddToKey(uint64_t key,
+                                               int32_t state_idx01,
+                                               float residual) {
+    // The residuals are <= 0; very small ones are clamped so the quantized
+    // value fits in an int32_t.
+    int32_t q = static_cast<int32_t>(
+        floorf((residual > -1.0e6f ? residual : -1.0e6f) * 1024.0f + 0.5f));
+    uint64_t x = (static_cast<uint64_t>(static_cast<uint32_t>(state_idx01))
+                  << 32) |
+                 static_cast<uint32_t>(q);
+    x *= 0x9E3779B97F4A7C15ull;
+    key = (key ^ (x ^ (x >> 29))) * 0x100000001B3ull;
+    return key == Hash::kEmptyKey ? 0 : key;
+  }
+
+  // Makes sure hash_ has room for `num_states` states, rebuilding it if not.
+  void ReserveStates(int32_t num_states) {
+    if (hash_ != nullptr && hash_->NumBuckets() >= 2 * num_states) return;
+    // Room for twice as many, so that the table is rebuilt only a
+    // logarithmic number of times.
+    hash_ = std::make_unique<Hash>(c_, Hash::NumBucketsFor(2 * num_states));
+    Hash::Accessor hash = hash_->GetAccessor();
+    int32_t begin = 0;
+    for (LevelStates &level : levels_) {
+      const uint64_t *keys_data = level.keys.Data();
+      auto lambda_reinsert = [=] __host__ __device__(int32_t i) -> void {
+        *hash.Insert(keys_data[i]) = begin + i;
+      };
+      Eval(c_, level.keys.Dim(), lambda_reinsert);
+      begin += level.keys.Dim();
+    }
+  }
+
+  // Sets up the first level, with the subsets {start state} and {final
+  // state} of each FSA (the latter is never expanded, but this way it exists
+  // whether or not it is reached, which keeps it last in FormatOutput()).
+  void InitialLevel() {
+    int32_t num_fsas = src_.shape.Dim0();
+    const int32_t *row_splits1_data = src_.shape.RowSplits(1).Data(),
+                  *row_splits2_data = src_.shape.RowSplits(2).Data();
+    Array1<int32_t> row_splits1(c_, num_fsas + 1);
+    int32_t *row_splits1_ans_data = row_splits1.Data();
+    auto lambda_count_states = [=] __host__ __device__(int32_t i) -> void {
+      int32_t num_states = row_splits1_data[i + 1] - row_splits1_data[i];
+      // If the FSA has one state, the start state is the final state.
+      row_splits1_ans_data[i] = (num_states < 2 ? num_states : 2);
+    };
+    Eval(c_, num_fsas, lambda_count_states);
+    int32_t num_states = ExclusiveSumWithTotal(c_, num_fsas + 1,
+                                               row_splits1_ans_data,
+                                               row_splits1_ans_data);
+    LevelStates level;
+    level.fsa_idxs = Array1<int32_t>(c_, num_states);
+    level.keys = Array1<uint64_t>(c_, num_states);
+    level.forward_loglikes = Array1<int32_t>(c_, num_states);
+    level.elem_row_splits = Range(c_, num_states + 1, 0);
+    level.best_elems = Range(c_, num_states, 0);
+    level.elem_states = Array1<int32_t>(c_, num_states);
+    level.elem_residuals = Array1<float>(c_, num_states, 0.0f);
+    level.elem_prevs = Array1<int32_t>(c_, num_states, -1);
+    level.elem_arcs = Array1<int32_t>(c_, num_states, -1);
+    level.item_row_splits = Array1<int32_t>(c_, num_states + 1);
+    int32_t *fsa_idxs_data = level.fsa_idxs.Data(),
+            *forward_data = level.forward_loglikes.Data(),
+            *elem_states_data = level.elem_states.Data(),
+            *item_row_splits_data = level.item_row_splits.Data();
+    uint64_t *keys_data = level.keys.Data();
+    ReserveStates(num_states);
+    Hash::Accessor hash = hash_->GetAccessor();
+    const int32_t zero = FloatToOrderedInt(0.0f),
+                  minus_inf = FloatToOrderedInt(
+                      -std::numeric_limits<float>::infinity());
+    auto lambda_set_states = [=] __host__ __device__(int32_t i) -> void {
+      int32_t begin = row_splits1_ans_data[i],
+              num = row_splits1_ans_data[i + 1] - begin;
+      for (int32_t j = 0; j < num; j++) {
+        int32_t state_idx = begin + j,
+                state_idx01 = (j == 0 ? row_splits1_data[i]
+                                      : row_splits1_data[i + 1] - 1);
+        uint64_t key = AddToKey(kEmptySubsetKey, state_idx01, 0.0f);
+        fsa_idxs_data[state_idx] = i;
+        keys_data[state_idx] = key;
+        forward_data[state_idx] = (j == 0 ? zero : minus_inf);
+        elem_states_data[state_idx] = state_idx01;
+        item_row_splits_data[state_idx] =
+            row_splits2_data[state_idx01 + 1] - row_splits2_data[state_idx01];
+        *hash.Insert(key) = state_idx;
+      }
+    };
+    Eval(c_, num_fsas, lambda_set_states);
+    level.num_items = ExclusiveSumWithTotal(c_, num_states + 1,
+                                            item_row_splits_data,
+                                            item_row_splits_data);
+    levels_.push_back(level);
+    num_states_ = num_states;
+    num_elems_ = num_states;
+  }
+
+  /*
+    Expands the states of the last level: generates the arcs leaving them
+    with the subsets of their destination states, prunes them if beam_ is
+    finite, and appends the states with new subsets as a new level.  Does two
+    transfers to the host, of the numbers of arcs and elements generated and
+    then of the sizes of what was kept.
+   */
+  void ExpandLevel() {
+    LevelStates &cur = levels_.back();
+    int32_t num_cur_elems = cur.elem_states.Dim(), num_items = cur.num_items,
+            num_states = num_states_,
+            cur_begin = num_states - cur.fsa_idxs.Dim(),
+            num_elems = num_elems_, cur_elem_begin = num_elems - num_cur_elems;
+    const int32_t *row_splits1_data = src_.shape.RowSplits(1).Data(),
+                  *row_splits2_data = src_.shape.RowSplits(2).Data(),
+                  *fsa_idxs_data = cur.fsa_idxs.Data(),
+                  *forward_data = cur.forward_loglikes.Data(),
+                  *elem_row_splits_data = cur.elem_row_splits.Data(),
+                  *elem_states_data = cur.elem_states.Data(),
+                  *item_row_splits_data = cur.item_row_splits.Data();
+    const float *elem_residuals_data = cur.elem_residuals.Data();
+    const Arc *src_arcs_data =
+        static_cast<const Array1<Arc> &>(src_.values).Data();
+
+    // Sort the items of each state by (symbol, dest_state).
+    Array1<int32_t> elem_row_ids(c_, num_cur_elems),
+        item_row_ids(c_, num_items);
+    RowSplitsToRowIds(cur.elem_row_splits, elem_row_ids);
+    RowSplitsToRowIds(cur.item_row_splits, item_row_ids);
+    const int32_t *elem_row_ids_data = elem_row_ids.Data(),
+                  *item_row_ids_data = item_row_ids.Data();
+    Array1<int32_t> state_item_splits(c_, cur.fsa_idxs.Dim() + 1);
+    int32_t *state_item_splits_data = state_item_splits.Data();
+    auto lambda_set_state_item_splits =
+        [=] __host__ __device__(int32_t i) -> void {
+      state_item_splits_data[i] = item_row_splits_data[elem_row_splits_data[i]];
+    };
+    Eval(c_, state_item_splits.Dim(), lambda_set_state_item_splits);
+    Array1<Arc> sorted_arcs(c_, num_items);
+    Array1<int32_t> item_arcs(c_, num_items), order(c_, num_items);
+    Arc *sorted_arcs_data = sorted_arcs.Data();
+    int32_t *item_arcs_data = item_arcs.Data();
+    auto lambda_set_items = [=] __host__ __device__(int32_t i) -> void {
+      int32_t elem = item_row_ids_data[i],
+              arc_idx012 = row_splits2_data[elem_states_data[elem]] + i -
+                           item_row_splits_data[elem];
+      item_arcs_data[i] = arc_idx012;
+      sorted_arcs_data[i] = src_arcs_data[arc_idx012];
+    };
+    Eval(c_, num_items, lambda_set_items);
+    Ragged<Arc> sorted(RaggedShape2(&state_item_splits, nullptr, num_items),
+                       sorted_arcs);
+    SortSublists<Arc, ArcLessThan>(&sorted, &order);
+    const int32_t *order_data = order.Data(),
+                  *sorted_row_ids_data = sorted.shape.RowIds(1).Data();
+
+    // Number the groups of items with the same (state, symbol), which are the
+    // arc candidates, and those with the same (state, symbol, dest_state),
+    // which are the elements of their subsets.
+    Array1<char> cand_starts(c_, num_items + 1),
+        dest_elem_starts(c_, num_items + 1);
+    char *cand_starts_data = cand_starts.Data(),
+         *dest_elem_starts_data = dest_elem_starts.Data();
+    auto lambda_set_starts = [=] __host__ __device__(int32_t i) -> void {
+      bool cand_start = false, dest_elem_start = false;
+      if (i < num_items) {
+        const Arc &arc = sorted_arcs_data[i];
+        cand_start = (i == state_item_splits_data[sorted_row_ids_data[i]] ||
+                      sorted_arcs_data[i - 1].symbol != arc.symbol);
+        dest_elem_start =
+            (cand_start ||
+             sorted_arcs_data[i - 1].dest_state != arc.dest_state);
+      }
+      cand_starts_data[i] = cand_start;
+      dest_elem_starts_data[i] = dest_elem_start;
+    };
+    Eval(c_, num_items + 1, lambda_set_starts);
+    Array1<int32_t> cand_idxs(c_, num_items + 1),
+        dest_elem_idxs(c_, num_items + 1);
+    int32_t *cand_idxs_data = cand_idxs.Data(),
+            *dest_elem_idxs_data = dest_elem_idxs.Data();
+    ExclusiveSum(c_, num_items + 1, cand_starts_data, cand_idxs_data);
+    ExclusiveSum(c_, num_items + 1, dest_elem_starts_data,
+                 dest_elem_idxs_data);
+    Array1<int32_t> counts(c_, 2);
+    int32_t *counts_data = counts.Data();
+    auto lambda_set_counts = [=] __host__ __device__(int32_t i) -> void {
+      counts_data[0] = cand_idxs_data[num_items];
+      counts_data[1] = dest_elem_idxs_data[num_items];
+    };
+    Eval(c_, 1, lambda_set_counts);
+    counts = counts.To(GetCpuContext());
+    int32_t num_cands = counts.Data()[0], num_dest_elems = counts.Data()[1];
+
+    Array1<int32_t> cand_elem_splits(c_, num_cands + 1),
+        elem_item_splits(c_, num_dest_elems + 1);
+    int32_t *cand_elem_splits_data = cand_elem_splits.Data(),
+            *elem_item_splits_data = elem_item_splits.Data();
+    auto lambda_set_splits = [=] __host__ __device__(int32_t i) -> void {
+      if (i == num_items) {
+        cand_elem_splits_data[num_cands] = num_dest_elems;
+        elem_item_splits_data[num_dest_elems] = num_items;
+      } else if (dest_elem_starts_data[i]) {
+        elem_item_splits_data[dest_elem_idxs_data[i]] = i;
+        if (cand_starts_data[i])
+          cand_elem_splits_data[cand_idxs_data[i]] = dest_elem_idxs_data[i];
+      }
+    };
+    Eval(c_, num_items + 1, lambda_set_splits);
+
+    // The weight of each dest element is the max (or log-sum) over its items
+    // of the residual of the item's element plus the arc's score; we also
+    // find the best item, for the traceback.
+    bool log_semiring = log_semiring_;
+    const float minus_inf_float = -std::numeric_limits<float>::infinity();
+    Array1<float> dest_elem_weights(c_, num_dest_elems);
+    Array1<int32_t> dest_elem_states(c_, num_dest_elems),
+        dest_elem_best(c_, num_dest_elems);
+    float *dest_elem_weights_data = dest_elem_weights.Data();
+    int32_t *dest_elem_states_data = dest_elem_states.Data(),
+            *dest_elem_best_data = dest_elem_best.Data();
+    auto lambda_set_dest_elems = [=] __host__ __device__(int32_t i) -> void {
+      int32_t begin = elem_item_splits_data[i],
+              end = elem_item_splits_data[i + 1], best = begin;
+      float weight = minus_inf_float, best_weight = minus_inf_float;
+      for (int32_t j = begin; j < end; j++) {
+        float w = elem_residuals_data[item_row_ids_data[order_data[j]]] +
+                  sorted_arcs_data[j].score;
+        if (w > best_weight) {
+          best_weight = w;
+          best = j;
+        }
+        weight = (log_semiring ? LogAddOp<float>()(weight, w)
+                               : MaxOp<float>()(weight, w));
+      }
+      int32_t fsa_idx0 = fsa_idxs_data[sorted_row_ids_data[begin]];
+      dest_elem_weights_data[i] = weight;
+      dest_elem_states_data[i] =
+          row_splits1_data[fsa_idx0] + sorted_arcs_data[begin].dest_state;
+      dest_elem_best_data[i] = best;
+    };
+    Eval(c_, num_dest_elems, lambda_set_dest_elems);
+
+    // The score of each candidate is the best weight of its elements, whose
+    // residuals are relative to it; elements more than beam_ below it are
+    // dropped from the subset.
+    Array1<ArcCandidate> cands(c_, num_cands);
+    ArcCandidate *cands_data = cands.Data();
+    float beam = beam_;
+    bool prune = (beam != std::numeric_limits<float>::infinity());
+    const int32_t minus_inf = FloatToOrderedInt(minus_inf_float);
+    // best_data[fsa_idx0] is the best end_loglike of the arcs of the FSA.
+    Array1<int32_t> best(c_, src_.shape.Dim0(), minus_inf);
+    int32_t *best_data = best.Data();
+    auto lambda_set_cands = [=] __host__ __device__(int32_t i) -> void {
+      ArcCandidate cand;
+      cand.elem_begin = cand_elem_splits_data[i];
+      cand.elem_end = cand_elem_splits_data[i + 1];
+      int32_t item = elem_item_splits_data[cand.elem_begin];
+      cand.src_state = sorted_row_ids_data[item];
+      cand.symbol = sorted_arcs_data[item].symbol;
+      cand.score = minus_inf_float;
+      cand.best_elem = cand.elem_begin;
+      for (int32_t j = cand.elem_begin; j < cand.elem_end; j++) {
+        if (dest_elem_weights_data[j] > cand.score) {
+          cand.score = dest_elem_weights_data[j];
+          cand.best_elem = j;
+        }
+      }
+      cand.key = kEmptySubsetKey;
+      cand.num_elems = 0;
+      for (int32_t j = cand.elem_begin; j < cand.elem_end; j++) {
+        float residual = dest_elem_weights_data[j] - cand.score;
+        if (residual >= -beam && residual > minus_inf_float) {
+          cand.key = AddToKey(cand.key, dest_elem_states_data[j], residual);
+          ++cand.num_elems;
+        }
+      }
+      cand.end_loglike =
+          OrderedIntToFloat(forward_data[cand.src_state]) + cand.score;
+      cands_data[i] = cand;
+      if (prune)
+        atomicMax(best_data + fsa_idxs_data[cand.src_state],
+                  FloatToOrderedInt(cand.end_loglike));
+    };
+    Eval(c_, num_cands, lambda_set_cands);
+
+    // As in MultiFsaIntersect, the arcs that are within the beam claim their
+    // destination states if they are new, by writing -(arc index + 2) to the
+    // hash.  Arcs whose weight is -infinity are never kept.
+    ReserveStates(num_states + num_cands);
+    Hash::Accessor hash = hash_->GetAccessor();
+    auto lambda_claim_states = [=] __host__ __device__(int32_t i) -> void {
+      const ArcCandidate &cand = cands_data[i];
+      if (cand.num_elems == 0) return;
+      if (prune && cand.end_loglike <
+                       OrderedIntToFloat(
+                           best_data[fsa_idxs_data[cand.src_state]]) -
+                           beam)
+        return;
+      int32_t *value = hash.Insert(cand.key);
+      if (*value < 0) *value = -(i + 2);
+    };
+    Eval(c_, num_cands, lambda_claim_states);
+
+    // We keep the arcs whose destination state exists or was claimed.  Each
+    // one records the derivatives of its weight: for the log semiring the
+    // items of its best element, for max just the best of them (see
+    // FormatOutput()).
+    Array1<char> keep_arcs(c_, num_cands + 1), keep_states(c_, num_cands + 1);
+    Array1<int32_t> deriv_pos(c_, num_cands + 1);
+    char *keep_arcs_data = keep_arcs.Data(),
+         *keep_states_data = keep_states.Data();
+    int32_t *deriv_pos_data = deriv_pos.Data();
+    auto lambda_set_keep = [=] __host__ __device__(int32_t i) -> void {
+      const ArcCandidate &cand = cands_data[i];
+      const int32_t *value =
+          (cand.num_elems == 0 ? nullptr : hash.Find(cand.key));
+      int32_t v = (value != nullptr ? *value : -1);
+      keep_arcs_data[i] = (v != -1);
+      keep_states_data[i] = (v == -(i + 2));
+      deriv_pos_data[i] =
+          (v == -1 ? 0
+                   : (log_semiring
+                          ? elem_item_splits_data[cand.best_elem + 1] -
+                                elem_item_splits_data[cand.best_elem]
+                          : 1));
+    };
+    Eval(c_, num_cands, lambda_set_keep);
+    Array1<int32_t> arc_reorder(c_, num_cands + 1),
+        state_reorder(c_, num_cands + 1);
+    int32_t *arc_reorder_data = arc_reorder.Data(),
+            *state_reorder_data = state_reorder.Data();
+    ExclusiveSum(c_, num_cands + 1, keep_arcs_data, arc_reorder_data);
+    ExclusiveSum(c_, num_cands + 1, keep_states_data, state_reorder_data);
+    ExclusiveSum(c_, num_cands + 1, deriv_pos_data, deriv_pos_data);
+
+    // The next level is allocated for the largest possible size, num_cands
+    // states with num_dest_elems elements.
+    LevelStates next;
+    next.fsa_idxs = Array1<int32_t>(c_, num_cands);
+    next.keys = Array1<uint64_t>(c_, num_cands);
+    next.forward_loglikes = Array1<int32_t>(c_, num_cands, minus_inf);
+    next.elem_row_splits = Array1<int32_t>(c_, num_cands + 1, 0);
+    next.best_elems = Array1<int32_t>(c_, num_cands);
+    next.elem_states = Array1<int32_t>(c_, num_dest_elems);
+    next.elem_residuals = Array1<float>(c_, num_dest_elems);
+    next.elem_prevs = Array1<int32_t>(c_, num_dest_elems);
+    next.elem_arcs = Array1<int32_t>(c_, num_dest_elems);
+    next.item_row_splits = Array1<int32_t>(c_, num_dest_elems + 1, 0);
+    int32_t *next_fsa_idxs_data = next.fsa_idxs.Data(),
+            *next_forward_data = next.forward_loglikes.Data(),
+            *next_elem_row_splits_data = next.elem_row_splits.Data(),
+            *next_best_elems_data = next.best_elems.Data(),
+            *next_elem_states_data = next.elem_states.Data(),
+            *next_elem_prevs_data = next.elem_prevs.Data(),
+            *next_elem_arcs_data = next.elem_arcs.Data(),
+            *next_item_row_splits_data = next.item_row_splits.Data();
+    uint64_t *next_keys_data = next.keys.Data();
+    float *next_elem_residuals_data = next.elem_residuals.Data();
+    auto lambda_set_next_states =
+        [=] __host__ __device__(int32_t i) -> void {
+      if (!keep_states_data[i]) return;
+      const ArcCandidate &cand = cands_data[i];
+      int32_t next_idx = state_reorder_data[i];
+      *hash.Find(cand.key) = num_states + next_idx;
+      next_fsa_idxs_data[next_idx] = fsa_idxs_data[cand.src_state];
+      next_keys_data[next_idx] = cand.key;
+      next_elem_row_splits_data[next_idx] = cand.num_elems;
+    };
+    Eval(c_, num_cands, lambda_set_next_states);
+    // The elements past the number of next states are zero, so this is right
+    // even though we don't know that number yet.
+    ExclusiveSum(c_, num_cands + 1, next_elem_row_splits_data,
+                 next_elem_row_splits_data);
+
+    // The arcs, with src_state and dest_state numbered over all the states
+    // reached (in order of level), and the subsets of the new states.
+    Array1<Arc> arcs(c_, num_cands);
+    Array1<int32_t> deriv_counts(c_, num_cands), deriv_elems(c_, num_items),
+        deriv_arcs(c_, num_items);
+    Arc *arcs_data = arcs.Data();
+    int32_t *deriv_counts_data = deriv_counts.Data(),
+            *deriv_elems_data = deriv_elems.Data(),
+            *deriv_arcs_data = deriv_arcs.Data();
+    auto lambda_set_arcs = [=] __host__ __device__(int32_t i) -> void {
+      if (!keep_arcs_data[i]) return;
+      const ArcCandidate &cand = cands_data[i];
+      int32_t arc_idx = arc_reorder_data[i],
+              dest_state = *hash.Find(cand.key);
+      Arc arc;
+      arc.src_state = cur_begin + cand.src_state;
+      arc.dest_state = dest_state;
+      arc.symbol = cand.symbol;
+      arc.score = cand.score;
+      arcs_data[arc_idx] = arc;
+      // The forward log-like of a new state is the best of its arcs on this
+      // level.
+      if (dest_state >= num_states)
+        atomicMax(next_forward_data + dest_state - num_states,
+                  FloatToOrderedInt(cand.end_loglike));
+
+      int32_t deriv_begin = deriv_pos_data[i],
+              num_derivs = deriv_pos_data[i + 1] - deriv_begin,
+              j = (log_semiring ? elem_item_splits_data[cand.best_elem]
+                                : dest_elem_best_data[cand.best_elem]);
+      deriv_counts_data[arc_idx] = num_derivs;
+      for (int32_t k = 0; k < num_derivs; k++, j++) {
+        int32_t item = order_data[j];
+        deriv_elems_data[deriv_begin + k] =
+            cur_elem_begin + item_row_ids_data[item];
+        deriv_arcs_data[deriv_begin + k] = item_arcs_data[item];
+      }
+
+      if (!keep_states_data[i]) return;
+      int32_t next_idx = state_reorder_data[i],
+              e = next_elem_row_splits_data[next_idx];
+      for (j = cand.elem_begin; j < cand.elem_end; j++) {
+        float residual = dest_elem_weights_data[j] - cand.score;
+        if (!(residual >= -beam && residual > minus_inf_float)) continue;
+        int32_t item = order_data[dest_elem_best_data[j]],
+                state_idx01 = dest_elem_states_data[j];
+        if (j == cand.best_elem)
+          next_best_elems_data[next_idx] = num_elems + e;
+        next_elem_states_data[e] = state_idx01;
+        next_elem_residuals_data[e] = residual;
+        next_elem_prevs_data[e] = cur_elem_begin + item_row_ids_data[item];
+        next_elem_arcs_data[e] = item_arcs_data[item];
+        next_item_row_splits_data[e] = row_splits2_data[state_idx01 + 1] -
+                                       row_splits2_data[state_idx01];
+        ++e;
+      }
+    };
+    Eval(c_, num_cands, lambda_set_arcs);
+    ExclusiveSum(c_, num_dest_elems + 1, next_item_row_splits_data,
+                 next_item_row_splits_data);
+
+    Array1<int32_t> totals(c_, 5);
+    int32_t *totals_data = totals.Data();
+    auto lambda_set_totals = [=] __host__ __device__(int32_t i) -> void {
+      int32_t num_next_states = state_reorder_data[num_cands],
+              num_next_elems = next_elem_row_splits_data[num_next_states];
+      totals_data[0] = arc_reorder_data[num_cands];
+      totals_data[1] = num_next_states;
+      totals_data[2] = num_next_elems;
+      totals_data[3] = next_item_row_splits_data[num_next_elems];
+      totals_data[4] = deriv_pos_data[num_cands];
+    };
+    Eval(c_, 1, lambda_set_totals);
+    totals = totals.To(GetCpuContext());
+    int32_t num_kept_arcs = totals.Data()[0],
+            num_next_states = totals.Data()[1],
+            num_next_elems = totals.Data()[2],
+            num_kept_derivs = totals.Data()[4];
+    next.num_items = totals.Data()[3];
+
+    if (num_kept_arcs > 0) {
+      arcs_.push_back(arcs.Range(0, num_kept_arcs));
+      deriv_counts_.push_back(deriv_counts.Range(0, num_kept_arcs));
+      deriv_elems_.push_back(Prefix(deriv_elems, num_kept_derivs));
+      deriv_arcs_.push_back(Prefix(deriv_arcs, num_kept_derivs));
+    }
+    next.fsa_idxs = Prefix(next.fsa_idxs, num_next_states);
+    next.keys = Prefix(next.keys, num_next_states);
+    next.forward_loglikes = Prefix(next.forward_loglikes, num_next_states);
+    next.elem_row_splits = next.elem_row_splits.Range(0, num_next_states + 1);
+    next.best_elems = Prefix(next.best_elems, num_next_states);
+    next.elem_states = Prefix(next.elem_states, num_next_elems);
+    next.elem_residuals = Prefix(next.elem_residuals, num_next_elems);
+    next.elem_prevs = Prefix(next.elem_prevs, num_next_elems);
+    next.elem_arcs = Prefix(next.elem_arcs, num_next_elems);
+    next.item_row_splits = next.item_row_splits.Range(0, num_next_elems + 1);
+    levels_.push_back(next);
+    num_states_ += num_next_states;
+    num_elems_ += num_next_elems;
+  }
+
+  ContextPtr c_;
+  FsaVec &src_;
+  float beam_;
+  bool log_semiring_;
+
+  std::vector<LevelStates> levels_;
+  int32_t num_states_ = 0;  // the total number of states in levels_.
+  int32_t num_elems_ = 0;   // the total number of elements in levels_.
+  // From the key of the subset of a state to the index of the state (over
+  // all levels).
+  std::unique_ptr<Hash> hash_;
+
+  // The arcs kept on each level, see ExpandLevel(), and for each of them the
+  // number of the (element, arc of src_) pairs it records for the
+  // derivatives, which are in deriv_elems_ and deriv_arcs_.
+  std::vector<Array1<Arc>> arcs_;
+  std::vector<Array1<int32_t>> deriv_counts_;
+  std::vector<Array1<int32_t>> deriv_elems_;
+  std::vector<Array1<int32_t>> deriv_arcs_;
+};
+/*
+  Pruned epsilon removal for an FsaVec on the device; see
+  RemoveEpsilonsPrunedMax() in fsa_algo.h.  The input must be top-sorted and
+  acyclic.
+
+  The epsilon closure of each state s is the list of pairs (t, score) of the
+  states t that s reaches by epsilon arcs, with the best (max) or total (log)
+  score of those epsilon paths.  They are computed for all states (the
+  intermediate states are needed for the log-semiring derivatives), level by
+  level of the epsilon arcs and starting from the last level: the closure of
+  s is {(s, 0)} plus the closures of the dest-states of its epsilon arcs,
+  with the arcs' scores added, merged by state.
+
+  The output has the states of the input that are entered by non-epsilon
+  arcs, plus the start and final states, in the same order; each pair (t,
+  score) in the closure of such a state s and non-epsilon arc from t to u
+  gives an arc from s to u.  With a finite beam, the pairs and arcs are
+  pruned by the best forward and backward scores of the states.
+ */
+class MultiFsaRemoveEpsilons {
+ public:
+  MultiFsaRemoveEpsilons(FsaVec &src, float beam, bool log_semiring)
+      : c_(src.Context()),
+        src_(src),
+        beam_(beam),
+        log_semiring_(log_semiring),
+        prune_(beam < std::numeric_limits<float>::infinity()),
+        num_states_(src.shape.TotSize(1)),
+        num_arcs_(src.shape.TotSize(2)) {
+    K2_CHECK_EQ(src.NumAxes(), 3);
+    K2_CHECK_GT(beam, 0);
+  }
+
+  // Computes the epsilon closures; the output is provided by FormatOutput().
+  void RemoveEpsilons() {
+    dest_states_ = GetDestStates(src_);
+    is_eps_ = Array1<char>(c_, num_arcs_);
+    const Arc *arcs_data =
+        static_cast<const Array1<Arc> &>(src_.values).Data();
+    char *is_eps_data = is_eps_.Data();
+    auto lambda_set_is_eps = [=] __host__ __device__(int32_t i) -> void {
+      is_eps_data[i] = (arcs_data[i].symbol == 0 ? 1 : 0);
+    };
+    Eval(c_, num_arcs_, lambda_set_is_eps);
+    if (prune_) {
+      Ragged<int32_t> state_batches = GetStateBatches(src_),
+                      entering_arc_batches =
+                          GetEnteringArcBatches(src_, state_batches),
+                      leaving_arc_batches =
+                          GetLeavingArcBatches(src_, state_batches);
+      forward_ = GetForwardScores<float>(src_, state_batches,
+                                         entering_arc_batches, false);
+      backward_ = GetBackwardScores<float>(src_, state_batches,
+                                           leaving_arc_batches, false);
+    }
+    ComputeClosures();
+  }
+
+  /*
+    Writes the output.  See RemoveEpsilonsPrunedMax() for the meaning of the
+    arguments; `arc_derivs` and `arc_deriv_values` may be nullptr.
+   */
+  void FormatOutput(FsaVec *out, Ragged<int32_t> *arc_derivs,
+                    Array1<float> *arc_deriv_values) {
+    int32_t num_fsas = src_.shape.Dim0(), num_states = num_states_,
+            num_arcs = num_arcs_;
+    const int32_t *row_splits1_data = src_.shape.RowSplits(1).Data(),
+                  *row_ids1_data = src_.shape.RowIds(1).Data(),
+                  *row_splits2_data = src_.shape.RowSplits(2).Data(),
+                  *dest_states_data = dest_states_.Data(),
+                  *pair_begins_data = pair_begins_.Data(),
+                  *pair_ends_data = pair_ends_.Data();
+    const char *is_eps_data = is_eps_.Data();
+    const Arc *arcs_data =
+        static_cast<const Array1<Arc> &>(src_.values).Data();
+    const ClosurePair *pairs_data = pairs_.Data();
+
+    // The start and final states are kept, so that they stay first and last.
+    Array1<char> entered(c_, num_states, static_cast<char>(0));
+    char *entered_data = entered.Data();
+    auto lambda_set_entered = [=] __host__ __device__(int32_t i) -> void {
+      if (!is_eps_data[i]) entered_data[dest_states_data[i]] = 1;
+    };
+    Eval(c_, num_arcs, lambda_set_entered);
+    auto lambda_keep_state = [=] __host__ __device__(int32_t i) -> bool {
+      int32_t fsa_idx0 = row_ids1_data[i];
+      return entered_data[i] || i == row_splits1_data[fsa_idx0] ||
+             i + 1 == row_splits1_data[fsa_idx0 + 1];
+    };
+    Renumbering renumber_states(c_, num_states, lambda_keep_state);
+    int32_t num_new_states = renumber_states.NumNewElems();
+    Array1<int32_t> states_old2new = renumber_states.Old2New(),
+                    states_new2old = renumber_states.New2Old();
+    const int32_t *states_old2new_data = states_old2new.Data(),
+                  *states_new2old_data = states_new2old.Data();
+    Array1<int32_t> new_row_splits1(c_, num_fsas + 1),
+        new_row_ids1(c_, num_new_states);
+    int32_t *new_row_splits1_data = new_row_splits1.Data(),
+            *new_row_ids1_data = new_row_ids1.Data();
+    auto lambda_set_row_splits1 = [=] __host__ __device__(int32_t i) -> void {
+      new_row_splits1_data[i] = states_old2new_data[row_splits1_data[i]];
+    };
+    Eval(c_, num_fsas + 1, lambda_set_row_splits1);
+    auto lambda_set_row_ids1 = [=] __host__ __device__(int32_t i) -> void {
+      new_row_ids1_data[i] = row_ids1_data[states_new2old_data[i]];
+    };
+    Eval(c_, num_new_states, lambda_set_row_ids1);
+
+    // The pairs in the closures of the states that are kept, each with the
+    // arcs leaving its state as candidates for the output; the candidates
+    // with epsilons or out of the beam are dropped.
+    Array1<int32_t> pair_splits(c_, num_new_states + 1);
+    int32_t *pair_splits_data = pair_splits.Data();
+    auto lambda_count_pairs = [=] __host__ __device__(int32_t i) -> void {
+      int32_t state = states_new2old_data[i];
+      pair_splits_data[i] = pair_ends_data[state] - pair_begins_data[state];
+    };
+    Eval(c_, num_new_states, lambda_count_pairs);
+    int32_t num_pairs = ExclusiveSumWithTotal(
+        c_, num_new_states + 1, pair_splits_data, pair_splits_data);
+    Array1<int32_t> pair_row_ids(c_, num_pairs), pair_idxs(c_, num_pairs),
+        cand_splits(c_, num_pairs + 1);
+    int32_t *pair_row_ids_data = pair_row_ids.Data(),
+            *pair_idxs_data = pair_idxs.Data(),
+            *cand_splits_data = cand_splits.Data();
+    RowSplitsToRowIds(c_, num_new_states, pair_splits_data, num_pairs,
+                      pair_row_ids_data);
+    auto lambda_count_cands = [=] __host__ __device__(int32_t i) -> void {
+      int32_t new_state = pair_row_ids_data[i],
+              pair_idx = pair_begins_data[states_new2old_data[new_state]] + i -
+                         pair_splits_data[new_state],
+              state = pairs_data[pair_idx].state;
+      pair_idxs_data[i] = pair_idx;
+      cand_splits_data[i] = row_splits2_data[state + 1] -
+                            row_splits2_data[state];
+    };
+    Eval(c_, num_pairs, lambda_count_cands);
+    int32_t num_cands = ExclusiveSumWithTotal(c_, num_pairs + 1,
+                                              cand_splits_data,
+                                              cand_splits_data);
+    Array1<int32_t> cand_row_ids(c_, num_cands);
+    int32_t *cand_row_ids_data = cand_row_ids.Data();
+    RowSplitsToRowIds(c_, num_pairs, cand_splits_data, num_cands,
+                      cand_row_ids_data);
+    bool prune = prune_;
+    float beam = beam_;
+    const float *forward_data = prune ? forward_.Data() : nullptr,
+                *backward_data = prune ? backward_.Data() : nullptr;
+    auto lambda_keep_cand = [=] __host__ __device__(int32_t i) -> bool {
+      int32_t pair = cand_row_ids_data[i], pair_idx = pair_idxs_data[pair],
+              arc_idx012 =
+                  row_splits2_data[pairs_data[pair_idx].state] + i -
+                  cand_splits_data[pair];
+      if (is_eps_data[arc_idx012]) return false;
+      if (!prune) return true;
+      int32_t state = states_new2old_data[pair_row_ids_data[pair]],
+              final_state = row_splits1_data[row_ids1_data[state] + 1] - 1;
+      return forward_data[state] + pairs_data[pair_idx].score +
+                 arcs_data[arc_idx012].score +
+                 backward_data[dest_states_data[arc_idx012]] >=
+             forward_data[final_state] - beam;
+    };
+    Renumbering renumber_cands(c_, num_cands, lambda_keep_cand);
+    int32_t num_new_arcs = renumber_cands.NumNewElems();
+    Array1<int32_t> cands_new2old = renumber_cands.New2Old(false);
+    const int32_t *cands_new2old_data = cands_new2old.Data();
+
+    Array1<Arc> new_arcs(c_, num_new_arcs);
+    Array1<int32_t> new_row_ids2(c_, num_new_arcs),
+        new_row_splits2(c_, num_new_states + 1), arc_pairs(c_, num_new_arcs),
+        arc_arcs(c_, num_new_arcs);
+    Arc *new_arcs_data = new_arcs.Data();
+    int32_t *new_row_ids2_data = new_row_ids2.Data(),
+            *arc_pairs_data = arc_pairs.Data(),
+            *arc_arcs_data = arc_arcs.Data();
+    auto lambda_set_arcs = [=] __host__ __device__(int32_t i) -> void {
+      int32_t cand = cands_new2old_data[i], pair = cand_row_ids_data[cand],
+              pair_idx = pair_idxs_data[pair],
+              new_state = pair_row_ids_data[pair],
+              new_state_idx0x =
+                  new_row_splits1_data[new_row_ids1_data[new_state]],
+              arc_idx012 = row_splits2_data[pairs_data[pair_idx].state] +
+                           cand - cand_splits_data[pair];
+      Arc arc;
+      arc.src_state = new_state - new_state_idx0x;
+      arc.dest_state =
+          states_old2new_data[dest_states_data[arc_idx012]] - new_state_idx0x;
+      arc.symbol = arcs_data[arc_idx012].symbol;
+      arc.score = pairs_data[pair_idx].score + arcs_data[arc_idx012].score;
+      new_arcs_data[i] = arc;
+      new_row_ids2_data[i] = new_state;
+      arc_pairs_data[i] = pair_idx;
+      arc_arcs_data[i] = arc_idx012;
+    };
+    Eval(c_, num_new_arcs, lambda_set_arcs);
+    RowIdsToRowSplits(new_row_ids2, new_row_splits2);
+
+    RaggedShape shape = RaggedShape3(&new_row_splits1, &new_row_ids1,
+                                     num_new_states, &new_row_splits2,
+                                     &new_row_ids2, num_new_arcs);
+    FsaVec unconnected(shape, new_arcs);
+    // This removes the states that are no longer reached, or can't reach the
+    // final state, e.g. because of the pruning.
+    Array1<int32_t> arc_map;
+    ConnectTopSorted(unconnected, out, &arc_map);
+    if (arc_derivs == nullptr && arc_deriv_values == nullptr) return;
+
+    // The derivatives of each output arc are for the epsilon arcs from
+    // its source state to the source state t of its last arc, plus 1 for
+    // that arc.  For max, those are the epsilon arcs of the best path: 1 as
+    // well.  For log, each epsilon arc from state u to v has the posterior
+    // of the epsilon paths through it, i.e. its score plus those of the
+    // pairs (u, .) in the closure of the source state and (t, .) in the
+    // closure of v, minus the score of the pair (t, .).
+    int32_t num_out_arcs = arc_map.Dim();
+    const int32_t *arc_map_data = arc_map.Data();
+    bool log_semiring = log_semiring_;
+    Array1<int32_t> deriv_splits(c_, num_out_arcs + 1);
+    int32_t *deriv_splits_data = deriv_splits.Data();
+    auto lambda_count_derivs = [=] __host__ __device__(int32_t i) -> void {
+      int32_t arc = arc_map_data[i], pair_idx = arc_pairs_data[arc], n = 1;
+      if (!log_semiring) {
+        for (; pairs_data[pair_idx].arc >= 0;
+             pair_idx = pairs_data[pair_idx].next)
+          n++;
+      } else {
+        EnumeratePosteriors(pairs_data, pair_begins_data, pair_ends_data,
+                            row_splits2_data, dest_states_data, is_eps_data,
+                            arcs_data,
+                            states_new2old_data[new_row_ids2_data[arc]],
+                            pair_idx, nullptr, nullptr, &n);
+      }
+      deriv_splits_data[i] = n;
+    };
+    Eval(c_, num_out_arcs, lambda_count_derivs);
+    int32_t num_derivs = ExclusiveSumWithTotal(
+        c_, num_out_arcs + 1, deriv_splits_data, deriv_splits_data);
+    Array1<int32_t> derivs(c_, num_derivs);
+    Array1<float> deriv_values(c_, num_derivs);
+    int32_t *derivs_data = derivs.Data();
+    float *deriv_values_data = deriv_values.Data();
+    auto lambda_set_derivs = [=] __host__ __device__(int32_t i) -> void {
+      int32_t arc = arc_map_data[i], pair_idx = arc_pairs_data[arc],
+              pos = deriv_splits_data[i];
+      if (!log_semiring) {
+        for (; pairs_data[pair_idx].arc >= 0;
+             pair_idx = pairs_data[pair_idx].next, ++pos) {
+          derivs_data[pos] = pairs_data[pair_idx].arc;
+          deriv_values_data[pos] = 1.0f;
+        }
+      } else {
+        EnumeratePosteriors(pairs_data, pair_begins_data, pair_ends_data,
+                            row_splits2_data, dest_states_data, is_eps_data,
+                            arcs_data,
+                            states_new2old_data[new_row_ids2_data[arc]],
+                            pair_idx, derivs_data, deriv_values_data, &pos);
+      }
+      derivs_data[pos] = arc_arcs_data[arc];
+      deriv_values_data[pos] = 1.0f;
+    };
+    Eval(c_, num_out_arcs, lambda_set_derivs);
+    if (arc_derivs != nullptr)
+      *arc_derivs = Ragged<int32_t>(
+          RaggedShape2(&deriv_splits, nullptr, num_derivs), derivs);
+    if (arc_deriv_values != nullptr) *arc_deriv_values = deriv_values;
+  }
+
+ private:
+  // An element of the epsilon closure of a state.
+  struct ClosurePair {
+    int32_t state;  // the state_idx01 reached
+    float score;    // the best (max) or total (log) score of the paths
+    // For max, the first arc of the best path and the pair in the closure of
+    // its dest-state that the path continues with; -1 for the pair of the
+    // state itself.
+    int32_t arc;
+    int32_t next;
+  };
+
+  /*
+    For the log semiring: goes through the epsilon arcs from `state` to the
+    state of the pair `pair_idx` in its closure, in order of their source
+    states, and for each one writes its index and posterior to
+    derivs_data[*pos] and deriv_values_data[*pos] (if they are not nullptr)
+    and increments *pos.
+   */
+  __host__ __device__ static void EnumeratePosteriors(
+      const ClosurePair *pairs_data, const int32_t *pair_begins_data,
+      const int32_t *pair_ends_data, const int32_t *row_splits2_data,
+      const int32_t *dest_states_data, const char *is_eps_data,
+      const Arc *arcs_data, int32_t state, int32_t pair_idx,
+      int32_t *derivs_data, float *deriv_values_data, int32_t *pos) {
+    int32_t last_state = pairs_data[pair_idx].state;
+    float score = pairs_data[pair_idx].score;
+    for (int32_t p = pair_begins_data[state]; p < pair_ends_data[state];
+         ++p) {
+      int32_t u = pairs_data[p].state;
+      if (u >= last_state) break;  // the closure is sorted by state
+      for (int32_t j = row_splits2_data[u]; j < row_splits2_data[u + 1];
+           ++j) {
+        int32_t v = dest_states_data[j];
+        if (!is_eps_data[j] || v > last_state) continue;
+        // Binary search for last_state in the closure of v.
+        int32_t begin = pair_begins_data[v], end = pair_ends_data[v];
+        while (begin < end) {
+          int32_t mid = begin + (end - begin) / 2;
+          if (pairs_data[mid].state < last_state)
+            begin = mid + 1;
+          else
+            end = mid;
+        }
+        if (begin == pair_ends_data[v] ||
+            pairs_data[begin].state != last_state)
+          continue;
+        if (derivs_data != nullptr) {
+          derivs_data[*pos] = j;
+          deriv_values_data[*pos] =
+              expf(pairs_data[p].score + arcs_data[j].score +
+                   pairs_data[begin].score - score);
+        }
+        ++*pos;
+      }
+    }
+  }
+
+  /*
+    Computes the epsilon closures of all states, into pairs_, pair_begins_
+    and pair_ends_, processing the levels of the epsilon arcs from the last
+    one.  Does three transfers to the host per level.
+   */
+  void ComputeClosures() {
+    const int32_t *row_splits1_data = src_.shape.RowSplits(1).Data(),
+                  *row_ids1_data = src_.shape.RowIds(1).Data(),
+                  *row_splits2_data = src_.shape.RowSplits(2).Data(),
+                  *dest_states_data = dest_states_.Data();
+    const char *is_eps_data = is_eps_.Data();
+    const Arc *arcs_data =
+        static_cast<const Array1<Arc> &>(src_.values).Data();
+    Ragged<int32_t> state_batches = GetStateBatches(src_, &is_eps_);
+    const int32_t *states_data = state_batches.values.Data();
+    Array1<int32_t> level_splits =
+        state_batches.shape.RowSplits(1).To(GetCpuContext());
+    int32_t num_levels = state_batches.shape.Dim0();
+
+    pairs_ = Array1<ClosurePair>(c_, 0);
+    pairs_.Reserve(num_states_);
+    pair_begins_ = Array1<int32_t>(c_, num_states_, 0);
+    pair_ends_ = Array1<int32_t>(c_, num_states_, 0);
+    int32_t *pair_begins_data = pair_begins_.Data(),
+            *pair_ends_data = pair_ends_.Data();
+    bool prune = prune_, log_semiring = log_semiring_;
+    float beam = beam_;
+    const float *forward_data = prune ? forward_.Data() : nullptr,
+                *backward_data = prune ? backward_.Data() : nullptr;
+
+    for (int32_t l = num_levels - 1; l >= 0; --l) {
+      int32_t begin = level_splits[l], num_cur = level_splits[l + 1] - begin;
+      const ClosurePair *pairs_data = pairs_.Data();
+      // The candidates of each state: (state, 0), then the pairs of the
+      // closures of the dest-states of its epsilon arcs.
+      Array1<int32_t> cand_splits(c_, num_cur + 1);
+      int32_t *cand_splits_data = cand_splits.Data();
+      auto lambda_count_cands = [=] __host__ __device__(int32_t i) -> void {
+        int32_t state = states_data[begin + i], n = 1;
+        for (int32_t j = row_splits2_data[state];
+             j < row_splits2_data[state + 1]; ++j) {
+          if (!is_eps_data[j]) continue;
+          int32_t dest_state = dest_states_data[j];
+          n += pair_ends_data[dest_state] - pair_begins_data[dest_state];
+        }
+        cand_splits_data[i] = n;
+      };
+      Eval(c_, num_cur, lambda_count_cands);
+      int32_t num_cands = ExclusiveSumWithTotal(
+          c_, num_cur + 1, cand_splits_data, cand_splits_data);
+      Array1<int32_t> cand_row_ids(c_, num_cands), cand_keys(c_, num_cands);
+      Array1<ClosurePair> cands(c_, num_cands);
+      int32_t *cand_row_ids_data = cand_row_ids.Data(),
+              *cand_keys_data = cand_keys.Data();
+      ClosurePair *cands_data = cands.Data();
+      RowSplitsToRowIds(c_, num_cur, cand_splits_data, num_cands,
+                        cand_row_ids_data);
+      auto lambda_set_cands = [=] __host__ __device__(int32_t i) -> void {
+        int32_t row = cand_row_ids_data[i], state = states_data[begin + row],
+                k = i - cand_splits_data[row];
+        ClosurePair cand;
+        cand.state = state;
+        cand.score = 0.0f;
+        cand.arc = -1;
+        cand.next = -1;
+        for (int32_t j = row_splits2_data[state]; k > 0; ++j) {
+          if (!is_eps_data[j]) continue;
+          int32_t dest_state = dest_states_data[j],
+                  n = pair_ends_data[dest_state] -
+                      pair_begins_data[dest_state];
+          if (k <= n) {
+            int32_t pair_idx = pair_begins_data[dest_state] + k - 1;
+            cand.state = pairs_data[pair_idx].state;
+            cand.score = arcs_data[j].score + pairs_data[pair_idx].score;
+            cand.arc = j;
+            cand.next = pair_idx;
+          }
+          k -= n;
+        }
+        cands_data[i] = cand;
+        cand_keys_data[i] = cand.state;
+      };
+      Eval(c_, num_cands, lambda_set_cands);
+      Ragged<int32_t> keys(RaggedShape2(&cand_splits, &cand_row_ids,
+                                        num_cands),
+                           cand_keys);
+      Array1<int32_t> order(c_, num_cands);
+      SortSublists(&keys, &order);
+      const int32_t *order_data = order.Data();
+
+      // Each run of candidates of a state with the same key is merged into a
+      // pair, which is kept if it is within the beam.
+      auto lambda_is_first = [=] __host__ __device__(int32_t i) -> bool {
+        return i == 0 || cand_row_ids_data[i] != cand_row_ids_data[i - 1] ||
+               cand_keys_data[i] != cand_keys_data[i - 1];
+      };
+      Renumbering renumber_runs(c_, num_cands, lambda_is_first);
+      int32_t num_runs = renumber_runs.NumNewElems();
+      Array1<int32_t> run_starts = renumber_runs.New2Old();
+      const int32_t *run_starts_data = run_starts.Data();
+      Array1<ClosurePair> runs(c_, num_runs);
+      ClosurePair *runs_data = runs.Data();
+      auto lambda_merge_runs = [=] __host__ __device__(int32_t i) -> void {
+        int32_t run_begin = run_starts_data[i],
+                run_end = run_starts_data[i + 1];
+        ClosurePair pair = cands_data[order_data[run_begin]];
+        for (int32_t j = run_begin + 1; j < run_end; ++j) {
+          const ClosurePair &cand = cands_data[order_data[j]];
+          if (log_semiring)
+            pair.score = LogAddOp<float>()(pair.score, cand.score);
+          else if (cand.score > pair.score)
+            pair = cand;
+        }
+        runs_data[i] = pair;
+      };
+      Eval(c_, num_runs, lambda_merge_runs);
+      auto lambda_keep_run = [=] __host__ __device__(int32_t i) -> bool {
+        if (!prune) return true;
+        int32_t run_start = run_starts_data[i],
+                state = states_data[begin + cand_row_ids_data[run_start]],
+                final_state = row_splits1_data[row_ids1_data[state] + 1] - 1;
+        const ClosurePair &pair = runs_data[i];
+        return forward_data[state] + pair.score + backward_data[pair.state] >=
+               forward_data[final_state] - beam;
+      };
+      Renumbering renumber_pairs(c_, num_runs, lambda_keep_run);
+      int32_t num_new_pairs = renumber_pairs.NumNewElems();
+      Array1<int32_t> pairs_new2old = renumber_pairs.New2Old(false);
+      const int32_t *pairs_new2old_data = pairs_new2old.Data();
+
+      Array1<int32_t> pair_states(c_, num_new_pairs);
+      int32_t *pair_states_data = pair_states.Data();
+      auto lambda_set_pair_states = [=] __host__ __device__(int32_t i) -> void {
+        int32_t run_start = run_starts_data[pairs_new2old_data[i]];
+        pair_states_data[i] = states_data[begin + cand_row_ids_data[run_start]];
+      };
+      Eval(c_, num_new_pairs, lambda_set_pair_states);
+      int32_t pairs_begin = pairs_.Dim();
+      pairs_.Resize(pairs_begin + num_new_pairs);
+      ClosurePair *new_pairs_data = pairs_.Data() + pairs_begin;
+      auto lambda_append_pairs = [=] __host__ __device__(int32_t i) -> void {
+        int32_t state = pair_states_data[i];
+        new_pairs_data[i] = runs_data[pairs_new2old_data[i]];
+        if (i == 0 || pair_states_data[i - 1] != state)
+          pair_begins_data[state] = pairs_begin + i;
+        if (i + 1 == num_new_pairs || pair_states_data[i + 1] != state)
+          pair_ends_data[state] = pairs_begin + i + 1;
+      };
+      Eval(c_, num_new_pairs, lambda_append_pairs);
+    }
+  }
+
+  ContextPtr c_;
+  FsaVec &src_;
+  float beam_;
+  bool log_semiring_;
+  bool prune_;  // true if beam_ is finite
+  int32_t num_states_;
+  int32_t num_arcs_;
+
+  Array1<int32_t> dest_states_;  // the state_idx01 of each arc's dest-state
+  Array1<char> is_eps_;          // 1 for the arcs with symbol 0
+  // Only set if prune_: the best scores of the paths from the start state to
+  // each state, and from each state to the final state.
+  Array1<float> forward_;
+  Array1<float> backward_;
+  // The closure of state s is pairs_[pair_begins_[s]] up to
+  // pairs_[pair_ends_[s] - 1], sorted by state.
+  Array1<ClosurePair> pairs_;
+  Array1<int32_t> pair_begins_;
+  Array1<int32_t> pair_ends_;
+};
+
+}  // namespace
+
+bool IntersectPruned(FsaVec &a_fsas, FsaVec &b_fsas, float beam, FsaVec *out,
+                     Array1<int32_t> *arc_map_a /*= nullptr*/,
+                     Array1<int32_t> *arc_map_b /*= nullptr*/) {
+  K2_PROFILE_SCOPE("IntersectPruned", a_fsas.Context());
+  if (!FsaVecHasProperties(a_fsas, kFsaPropertiesArcSorted) ||
+      !FsaVecHasProperties(b_fsas, kFsaPropertiesArcSorted) ||
+      !(FsaVecHasProperties(a_fsas, kFsaPropertiesEpsilonFree) ||
+        FsaVecHasProperties(b_fsas, kFsaPropertiesEpsilonFree)))
+    return false;
+  MultiFsaIntersect intersector(a_fsas, b_fsas, beam);
+  intersector.Intersect();
+  intersector.FormatOutput(out, arc_map_a, arc_map_b);
+  return true;
+}
+
+static bool DeterminizePrunedInternal(FsaVec &src, float beam,
+                                      bool log_semiring, FsaVec *out,
+                                      Ragged<int32_t> *arc_derivs,
+                                      Array1<float> *arc_deriv_values) {
+  K2_PROFILE_SCOPE("DeterminizePruned", src.Context());
+  if (!FsaVecHasProperties(src, kFsaPropertiesEpsilonFree)) return false;
+  MultiFsaDeterminize determinizer(src, beam, log_semiring);
+  determinizer.Determinize();
+  determinizer.FormatOutput(out, arc_derivs, arc_deriv_values);
+  return true;
+}
+
+bool DeterminizePrunedMax(FsaVec &src, float beam, FsaVec *out,
+                          Ragged<int32_t> *arc_derivs /*= nullptr*/,
+                          Array1<float> *arc_deriv_values /*= nullptr*/) {
+  return DeterminizePrunedInternal(src, beam, false, out, arc_derivs,
+                                   arc_deriv_values);
+}
+
+bool DeterminizePrunedLogSum(FsaVec &src, float beam, FsaVec *out,
+                             Ragged<int32_t> *arc_derivs /*= nullptr*/,
+                             Array1<float> *arc_deriv_values /*= nullptr*/) {
+  return DeterminizePrunedInternal(src, beam, true, out, arc_derivs,
+                                   arc_deriv_values);
+}
+
+static bool RemoveEpsilonsPrunedInternal(FsaVec &src, float beam,
+                                         bool log_semiring, FsaVec *out,
+                                         Ragged<int32_t> *arc_derivs,
+                                         Array1<float> *arc_deriv_values) {
+  K2_PROFILE_SCOPE("RemoveEpsilonsPruned", src.Context());
+  if (!FsaVecHasProperties(src, kFsaPropertiesTopSortedAndAcyclic))
+    return false;
+  MultiFsaRemoveEpsilons remover(src, beam, log_semiring);
+  remover.RemoveEpsilons();
+  remover.FormatOutput(out, arc_derivs, arc_deriv_values);
+  return true;
+}
+
+bool RemoveEpsilonsPrunedMax(FsaVec &src, float beam, FsaVec *out,
+                             Ragged<int32_t> *arc_derivs /*= nullptr*/,
+                             Array1<float> *arc_deriv_values /*= nullptr*/) {
+  return RemoveEpsilonsPrunedInternal(src, beam, false, out, arc_derivs,
+                                      arc_deriv_values);
+}
+
+bool RemoveEpsilonsPrunedLogSum(FsaVec &src, float beam, FsaVec *out,
+                                Ragged<int32_t> *arc_derivs /*= nullptr*/,
+                                Array1<float> *arc_deriv_values /*= nullptr*/) {
+  return RemoveEpsilonsPrunedInternal(src, beam, true, out, arc_derivs,
+                                      arc_deriv_values);
+}
+
+void ShortestPath(FsaVec &src, FsaVec *out,
+                  Ragged<int32_t> *best_arcs /*= nullptr*/) {
+  K2_CHECK_EQ(src.NumAxes(), 3);
+  K2_CHECK_NE(out, nullptr);
+  ContextPtr &c = src.Context();
+  int32_t num_fsas = src.shape.Dim0(), num_states = src.shape.TotSize(1);
+  Ragged<int32_t> state_batches = GetStateBatches(src),
+                  entering_arc_batches =
+                      GetEnteringArcBatches(src, state_batches);
+  Array1<float> forward_scores = GetForwardScores<float>(
+      src, state_batches, entering_arc_batches, false);
+
+  // best_arc[s] is the arc_idx012 of the best arc entering state s, or -1 if
+  // there is none (start states, and states that can't be reached).
+  const int32_t *row_splits1_data = src.shape.RowSplits(1).Data(),
+                *row_ids1_data = src.shape.RowIds(1).Data(),
+                *states_data = state_batches.values.Data(),
+                *entering_row_splits_data =
+                    entering_arc_batches.shape.RowSplits(2).Data(),
+                *entering_arcs_data = entering_arc_batches.values.Data();
+  const Arc *arcs_data = static_cast<const Array1<Arc> &>(src.values).Data();
+  const float *forward_scores_data = forward_scores.Data();
+  const float minus_inf = -std::numeric_limits<float>::infinity();
+  Array1<int32_t> best_arc(c, num_states);
+  int32_t *best_arc_data = best_arc.Data();
+  auto lambda_set_best_arc = [=] __host__ __device__(int32_t i) -> void {
+    int32_t state_idx01 = states_data[i],
+            state_idx0x = row_splits1_data[row_ids1_data[state_idx01]],
+            best = -1;
+    float best_score = minus_inf;
+    for (int32_t j = entering_row_splits_data[i];
+         j < entering_row_splits_data[i + 1]; ++j) {
+      int32_t arc_idx012 = entering_arcs_data[j];
+      const Arc &arc = arcs_data[arc_idx012];
+      float score =
+          forward_scores_data[state_idx0x + arc.src_state] + arc.score;
+      // The entering arcs are in order of their indexes, so on ties the first
+      // one is kept.
+      if (score > best_score) {
+        best = arc_idx012;
+        best_score = score;
+      }
+    }
+    best_arc_data[state_idx01] = best;
+  };
+  Eval(c, num_states, lambda_set_best_arc);
+
+  // Row 0 of `counts` is the number of arcs on the best path of each FSA,
+  // and row 1 the number of states of its linear FSA; after the exclusive sum
+  // the last column has the totals.
+  Array2<int32_t> counts(c, 2, num_fsas + 1), sums(c, 2, num_fsas + 1);
+  int32_t *counts_data = counts.Data(), counts_stride = counts.ElemStride0();
+  auto lambda_count_arcs = [=] __host__ __device__(int32_t i) -> void {
+    int32_t num_path_arcs = 0;
+    if (i < num_fsas) {
+      int32_t start_state = row_splits1_data[i],
+              state = row_splits1_data[i + 1] - 1;
+      if (state > start_state && forward_scores_data[state] != minus_inf) {
+        while (state != start_state) {
+          state = start_state + arcs_data[best_arc_data[state]].src_state;
+          ++num_path_arcs;
+        }
+      }
+    }
+    counts_data[i] = num_path_arcs;
+    counts_data[counts_stride + i] =
+        (num_path_arcs > 0 ? num_path_arcs + 1 : 0);
+  };
+  Eval(c, num_fsas + 1, lambda_count_arcs);
+  ExclusiveSum(counts, &sums);
+  const int32_t *sums_data = sums.Data();
+  int32_t sums_stride = sums.ElemStride0();
+  Array1<int32_t> totals(c, 2);
+  int32_t *totals_data = totals.Data();
+  auto lambda_get_totals = [=] __host__ __device__(int32_t i) -> void {
+    totals_data[i] = sums_data[i * sums_stride + num_fsas];
+  };
+  Eval(c, 2, lambda_get_totals);
+  Array1<int32_t> totals_cpu = totals.To(GetCpuContext());
+  int32_t num_out_arcs = totals_cpu[0], num_out_states = totals_cpu[1];
+
+  Array1<int32_t> arc_row_splits = sums[0], out_row_splits1 = sums[1],
+                  out_row_ids1(c, num_out_states),
+                  out_row_splits2(c, num_out_states + 1),
+                  out_row_ids2(c, num_out_arcs), path_arcs(c, num_out_arcs);
+  Array1<Arc> out_arcs(c, num_out_arcs);
+  int32_t *out_row_ids1_data = out_row_ids1.Data(),
+          *out_row_splits2_data = out_row_splits2.Data(),
+          *out_row_ids2_data = out_row_ids2.Data(),
+          *path_arcs_data = path_arcs.Data();
+  Arc *out_arcs_data = out_arcs.Data();
+  const int32_t *arc_row_splits_data = arc_row_splits.Data(),
+                *out_row_splits1_data = out_row_splits1.Data();
+  auto lambda_trace_back = [=] __host__ __device__(int32_t i) -> void {
+    if (i == num_fsas) {
+      out_row_splits2_data[num_out_states] = num_out_arcs;
+      return;
+    }
+    int32_t arc_begin = arc_row_splits_data[i],
+            num_path_arcs = arc_row_splits_data[i + 1] - arc_begin,
+            out_state_begin = out_row_splits1_data[i];
+    if (num_path_arcs == 0) return;
+    int32_t start_state = row_splits1_data[i],
+            state = row_splits1_data[i + 1] - 1;
+    for (int32_t k = num_path_arcs - 1; k >= 0; --k) {
+      int32_t arc_idx012 = best_arc_data[state];
+      const Arc &arc = arcs_data[arc_idx012];
+      Arc out_arc;
+      out_arc.src_state = k;
+      out_arc.dest_state = k + 1;
+      out_arc.symbol = arc.symbol;
+      out_arc.score = arc.score;
+      out_arcs_data[arc_begin + k] = out_arc;
+      path_arcs_data[arc_begin + k] = arc_idx012;
+      out_row_ids2_data[arc_begin + k] = out_state_begin + k;
+      state = start_state + arc.src_state;
+    }
+    for (int32_t k = 0; k <= num_path_arcs; ++k) {
+      out_row_ids1_data[out_state_begin + k] = i;
+      out_row_splits2_data[out_state_begin + k] =
+          arc_begin + (k < num_path_arcs ? k : num_path_arcs);
+    }
+  };
+  Eval(c, num_fsas + 1, lambda_trace_back);
+
+  *out = FsaVec(RaggedShape3(&out_row_splits1, &out_row_ids1, num_out_states,
+                             &out_row_splits2, &out_row_ids2, num_out_arcs),
+                out_arcs);
+  if (best_arcs != nullptr)
+    *best_arcs = Ragged<int32_t>(
+        RaggedShape2(&arc_row_splits, nullptr, num_out_arcs), path_arcs);
+}
+
+void NBestPaths(FsaVec &src, int32_t n, Ragged<int32_t> *paths,
+                Array1<float> *path_scores /*= nullptr*/) {
+  K2_CHECK_EQ(src.NumAxes(), 3);
+  K2_CHECK_GE(n, 1);
+  K2_CHECK_NE(paths, nullptr);
+  ContextPtr &c = src.Context();
+  int32_t num_fsas = src.shape.Dim0(), num_states = src.shape.TotSize(1);
+  K2_CHECK_LE(static_cast<int64_t>(num_states) * n,
+              std::numeric_limits<int32_t>::max());
+  Ragged<int32_t> state_batches = GetStateBatches(src),
+                  entering_arc_batches =
+                      GetEnteringArcBatches(src, state_batches);
+
+  // The list of state s is at positions s * n to s * n + list_sizes[s] - 1
+  // of list_scores, list_arcs and list_prev: the score of each partial path,
+  // its last arc (-1 for the empty path at the start state), and the position
+  // of the rest of the path in the list of the arc's source state.
+  // `cursors` has, for each arc in entering_arc_batches, the position in the
+  // list of its source state of the next path to consider while merging.
+  Array1<float> list_scores(c, num_states * n);
+  Array1<int32_t> list_arcs(c, num_states * n), list_prev(c, num_states * n),
+      list_sizes(c, num_states),
+      cursors(c, entering_arc_batches.values.Dim());
+  float *list_scores_data = list_scores.Data();
+  int32_t *list_arcs_data = list_arcs.Data(),
+          *list_prev_data = list_prev.Data(),
+          *list_sizes_data = list_sizes.Data(),
+          *cursors_data = cursors.Data();
+  const int32_t *row_splits1_data = src.shape.RowSplits(1).Data(),
+                *row_ids1_data = src.shape.RowIds(1).Data(),
+                *states_data = state_batches.values.Data(),
+                *entering_row_splits_data =
+                    entering_arc_batches.shape.RowSplits(2).Data(),
+                *entering_arcs_data = entering_arc_batches.values.Data();
+  const Arc *arcs_data = static_cast<const Array1<Arc> &>(src.values).Data();
+  const float minus_inf = -std::numeric_limits<float>::infinity();
+
+  Array1<int32_t> batch_splits =
+      state_batches.shape.RowSplits(1).To(GetCpuContext());
+  int32_t num_batches = state_batches.shape.Dim0();
+  for (int32_t b = 0; b < num_batches; ++b) {
+    int32_t begin = batch_splits[b], size = batch_splits[b + 1] - begin;
+    auto lambda_merge_lists = [=] __host__ __device__(int32_t i) -> void {
+      int32_t pos = begin + i, state_idx01 = states_data[pos],
+              state_idx0x = row_splits1_data[row_ids1_data[state_idx01]],
+              arc_begin = entering_row_splits_data[pos],
+              arc_end = entering_row_splits_data[pos + 1],
+              list_begin = state_idx01 * n, k = 0;
+      for (int32_t j = arc_begin; j < arc_end; ++j) cursors_data[j] = 0;
+      bool empty_path_left = (state_idx01 == state_idx0x);
+      for (; k < n; ++k) {
+        // best == -1 is the empty path; the candidates are considered in
+        // order, and on ties the first one is taken.
+        int32_t best = (empty_path_left ? -1 : -2);
+        float best_score = (empty_path_left ? 0 : minus_inf);
+        for (int32_t j = arc_begin; j < arc_end; ++j) {
+          const Arc &arc = arcs_data[entering_arcs_data[j]];
+          int32_t src_state_idx01 = state_idx0x + arc.src_state;
+          if (cursors_data[j] == list_sizes_data[src_state_idx01]) continue;
+          float score = list_scores_data[src_state_idx01 * n +
+                                         cursors_data[j]] + arc.score;
+          if (score > best_score) {
+            best = j;
+            best_score = score;
+          }
+        }
+        if (best == -2) break;
+        list_scores_data[list_begin + k] = best_score;
+        if (best == -1) {
+          list_arcs_data[list_begin + k] = -1;
+          list_prev_data[list_begin + k] = -1;
+          empty_path_left = false;
+        } else {
+          list_arcs_data[list_begin + k] = entering_arcs_data[best];
+          list_prev_data[list_begin + k] = cursors_data[best]++;
+        }
+      }
+      list_sizes_data[state_idx01] = k;
+    };
+    Eval(c, size, lambda_merge_lists);
+  }
+
+  // The paths of each FSA are the list of its final state.
+  Array1<int32_t> path_row_splits1(c, num_fsas + 1);
+  int32_t *path_row_splits1_data = path_row_splits1.Data();
+  auto lambda_count_paths = [=] __host__ __device__(int32_t i) -> void {
+    if (i == num_fsas) {
+      path_row_splits1_data[i] = 0;
+      return;
+    }
+    int32_t begin = row_splits1_data[i], end = row_splits1_data[i + 1];
+    path_row_splits1_data[i] = (end - begin > 1 ? list_sizes_data[end - 1]
+                                                : 0);
+  };
+  Eval(c, num_fsas + 1, lambda_count_paths);
+  int32_t num_paths = ExclusiveSumWithTotal(c, num_fsas + 1,
+                                            path_row_splits1_data,
+                                            path_row_splits1_data);
+  RaggedShape paths_shape =
+      RaggedShape2(&path_row_splits1, nullptr, num_paths);
+  const int32_t *path_row_ids1_data = paths_shape.RowIds(1).Data();
+
+  // The paths are traced back twice, first to count their arcs and then to
+  // write them.
+  Array1<int32_t> path_row_splits2(c, num_paths + 1);
+  Array1<float> scores(c, num_paths);
+  int32_t *path_row_splits2_data = path_row_splits2.Data();
+  float *scores_data = scores.Data();
+  auto lambda_count_arcs = [=] __host__ __device__(int32_t i) -> void {
+    if (i == num_paths) {
+      path_row_splits2_data[i] = 0;
+      return;
+    }
+    int32_t fsa_idx0 = path_row_ids1_data[i],
+            state_idx0x = row_splits1_data[fsa_idx0],
+            list_pos = (row_splits1_data[fsa_idx0 + 1] - 1) * n + i -
+                       path_row_splits1_data[fsa_idx0],
+            num_arcs = 0;
+    scores_data[i] = list_scores_data[list_pos];
+    for (int32_t arc_idx012 = list_arcs_data[list_pos]; arc_idx012 != -1;
+         arc_idx012 = list_arcs_data[list_pos]) {
+      list_pos = (state_idx0x + arcs_data[arc_idx012].src_state) * n +
+                 list_prev_data[list_pos];
+      ++num_arcs;
+    }
+    path_row_splits2_data[i] = num_arcs;
+  };
+  Eval(c, num_paths + 1, lambda_count_arcs);
+  int32_t tot_arcs = ExclusiveSumWithTotal(c, num_paths + 1,
+                                           path_row_splits2_data,
+                                           path_row_splits2_data);
+  Array1<int32_t> path_arcs(c, tot_arcs);
+  int32_t *path_arcs_data = path_arcs.Data();
+  auto lambda_set_arcs = [=] __host__ __device__(int32_t i) -> void {
+    int32_t fsa_idx0 = path_row_ids1_data[i],
+            state_idx0x = row_splits1_data[fsa_idx0],
+            list_pos = (row_splits1_data[fsa_idx0 + 1] - 1) * n + i -
+                       path_row_splits1_data[fsa_idx0],
+            arc_pos = path_row_splits2_data[i + 1];
+    for (int32_t arc_idx012 = list_arcs_data[list_pos]; arc_idx012 != -1;
+         arc_idx012 = list_arcs_data[list_pos]) {
+      path_arcs_data[--arc_pos] = arc_idx012;
+      list_pos = (state_idx0x + arcs_data[arc_idx012].src_state) * n +
+                 list_prev_data[list_pos];
+    }
+  };
+  Eval(c, num_paths, lambda_set_arcs);
+
+  *paths = Ragged<int32_t>(
+      ComposeRaggedShapes(paths_shape,
+                          RaggedShape2(&path_row_splits2, nullptr, tot_arcs)),
+      path_arcs);
+  if (path_scores != nullptr) *path_scores = scores;
+}
+
+void ExpandBigramPruned(FsaVec &src, float beam, FsaVec *out,
+                        Array1<int32_t> *arc_map /*= nullptr*/,
+                        Array2<int32_t> *arc_pairs /*= nullptr*/) {
+  K2_CHECK_EQ(src.NumAxes(), 3);
+  K2_CHECK_GE(beam, 0);
+  K2_CHECK_NE(out, nullptr);
+  ContextPtr &c = src.Context();
+  int32_t num_fsas = src.shape.Dim0(), num_arcs = src.values.Dim();
+  Ragged<int32_t> state_batches = GetStateBatches(src),
+                  entering_arc_batches =
+                      GetEnteringArcBatches(src, state_batches),
+                  leaving_arc_batches =
+                      GetLeavingArcBatches(src, state_batches);
+  Array1<float> forward_scores = GetForwardScores<float>(
+                    src, state_batches, entering_arc_batches, false),
+                backward_scores = GetBackwardScores<float>(
+                    src, state_batches, leaving_arc_batches, false),
+                tot_scores = GetTotScores(src, forward_scores);
+  const int32_t *row_splits1_data = src.shape.RowSplits(1).Data(),
+                *row_ids1_data = src.shape.RowIds(1).Data(),
+                *row_splits2_data = src.shape.RowSplits(2).Data(),
+                *row_ids2_data = src.shape.RowIds(2).Data();
+  const Arc *arcs_data = static_cast<const Array1<Arc> &>(src.values).Data();
+  const float *forward_scores_data = forward_scores.Data(),
+              *backward_scores_data = backward_scores.Data(),
+              *tot_scores_data = tot_scores.Data();
+  const float minus_inf = -std::numeric_limits<float>::infinity();
+
+  // The contexts are the arcs within the beam that don't enter a final
+  // state; each gives a state of `out`.  (Requiring the score of the best
+  // path through the arc to be finite matters for beam == infinity: it drops
+  // the arcs not on any path.)
+  auto lambda_keep_context = [=] __host__ __device__(int32_t i) -> bool {
+    int32_t fsa_idx0 = row_ids1_data[row_ids2_data[i]],
+            state_idx0x = row_splits1_data[fsa_idx0];
+    const Arc &arc = arcs_data[i];
+    int32_t dest_state_idx01 = state_idx0x + arc.dest_state;
+    float score = forward_scores_data[state_idx0x + arc.src_state] +
+                  arc.score + backward_scores_data[dest_state_idx01];
+    return score != minus_inf && score >= tot_scores_data[fsa_idx0] - beam &&
+           dest_state_idx01 + 1 != row_splits1_data[fsa_idx0 + 1];
+  };
+  Renumbering contexts(c, num_arcs, lambda_keep_context);
+  Array1<int32_t> context_old2new = contexts.Old2New(true),
+                  context_new2old = contexts.New2Old(false);
+  int32_t num_contexts = contexts.NumNewElems();
+  const int32_t *context_old2new_data = context_old2new.Data(),
+                *context_new2old_data = context_new2old.Data();
+  const char *keep_context_data = contexts.Keep().Data();
+
+  // Each FSA of `out` has its start state, its contexts in order, and its
+  // final state, if it's not empty.
+  Array1<int32_t> out_row_splits1(c, num_fsas + 1);
+  int32_t *out_row_splits1_data = out_row_splits1.Data();
+  auto lambda_set_is_nonempty = [=] __host__ __device__(int32_t i) -> void {
+    out_row_splits1_data[i] =
+        (i < num_fsas && row_splits1_data[i + 1] - row_splits1_data[i] > 1 &&
+                 tot_scores_data[i] != minus_inf
+             ? 2
+             : 0);
+  };
+  Eval(c, num_fsas + 1, lambda_set_is_nonempty);
+  int32_t num_nonempty = ExclusiveSumWithTotal(
+      c, num_fsas + 1, out_row_splits1_data, out_row_splits1_data);
+  auto lambda_add_contexts = [=] __host__ __device__(int32_t i) -> void {
+    int32_t arc_idx0xx = row_splits2_data[row_splits1_data[i]];
+    out_row_splits1_data[i] += context_old2new_data[arc_idx0xx];
+  };
+  Eval(c, num_fsas + 1, lambda_add_contexts);
+  int32_t num_out_states = num_contexts + num_nonempty;
+
+  // For each state of `out`: its state in `src` and its context (the arc of
+  // `src` that enters it, or -1 for the start and final states).
+  Array1<int32_t> out_row_ids1(c, num_out_states),
+      out_src_states(c, num_out_states), out_prev_arcs(c, num_out_states);
+  int32_t *out_row_ids1_data = out_row_ids1.Data(),
+          *out_src_states_data = out_src_states.Data(),
+          *out_prev_arcs_data = out_prev_arcs.Data();
+  auto lambda_set_end_states = [=] __host__ __device__(int32_t i) -> void {
+    int32_t begin = out_row_splits1_data[i], end = out_row_splits1_data[i + 1];
+    if (begin == end) return;
+    out_row_ids1_data[begin] = i;
+    out_src_states_data[begin] = row_splits1_data[i];
+    out_prev_arcs_data[begin] = -1;
+    out_row_ids1_data[end - 1] = i;
+    out_src_states_data[end - 1] = row_splits1_data[i + 1] - 1;
+    out_prev_arcs_data[end - 1] = -1;
+  };
+  Eval(c, num_fsas, lambda_set_end_states);
+  auto lambda_set_context_states = [=] __host__ __device__(int32_t i) -> void {
+    int32_t arc_idx012 = context_new2old_data[i],
+            fsa_idx0 = row_ids1_data[row_ids2_data[arc_idx012]],
+            arc_idx0xx = row_splits2_data[row_splits1_data[fsa_idx0]],
+            out_state = out_row_splits1_data[fsa_idx0] + 1 + i -
+                        context_old2new_data[arc_idx0xx];
+    out_row_ids1_data[out_state] = fsa_idx0;
+    out_src_states_data[out_state] =
+        row_splits1_data[fsa_idx0] + arcs_data[arc_idx012].dest_state;
+    out_prev_arcs_data[out_state] = arc_idx012;
+  };
+  Eval(c, num_contexts, lambda_set_context_states);
+
+  // The candidate arcs of a state of `out` are the arcs leaving its state in
+  // `src` (none for the final state): one per pair (prev arc, arc).
+  Array1<int32_t> cand_row_splits(c, num_out_states + 1);
+  int32_t *cand_row_splits_data = cand_row_splits.Data();
+  auto lambda_count_cands = [=] __host__ __device__(int32_t i) -> void {
+    int32_t num_cands = 0;
+    if (i < num_out_states &&
+        i + 1 != out_row_splits1_data[out_row_ids1_data[i] + 1]) {
+      int32_t state_idx01 = out_src_states_data[i];
+      num_cands = row_splits2_data[state_idx01 + 1] -
+                  row_splits2_data[state_idx01];
+    }
+    cand_row_splits_data[i] = num_cands;
+  };
+  Eval(c, num_out_states + 1, lambda_count_cands);
+  int32_t num_cands = ExclusiveSumWithTotal(
+      c, num_out_states + 1, cand_row_splits_data, cand_row_splits_data);
+  Array1<int32_t> cand_row_ids(c, num_cands);
+  int32_t *cand_row_ids_data = cand_row_ids.Data();
+  RowSplitsToRowIds(c, num_out_states, cand_row_splits_data, num_cands,
+                    cand_row_ids_data);
+
+  // A pair is kept if the best path through both arcs is within the beam.
+  // The score is summed in the same order as that of the context of the
+  // second arc, which is never less, so its dest-state exists in `out`.
+  auto lambda_keep_cand = [=] __host__ __device__(int32_t i) -> bool {
+    int32_t out_state = cand_row_ids_data[i],
+            fsa_idx0 = out_row_ids1_data[out_state],
+            state_idx0x = row_splits1_data[fsa_idx0],
+            state_idx01 = out_src_states_data[out_state],
+            prev_arc_idx012 = out_prev_arcs_data[out_state],
+            arc_idx012 = row_splits2_data[state_idx01] + i -
+                         cand_row_splits_data[out_state];
+    const Arc &arc = arcs_data[arc_idx012];
+    int32_t dest_state_idx01 = state_idx0x + arc.dest_state;
+    float prefix_score;
+    if (prev_arc_idx012 == -1) {
+      prefix_score = forward_scores_data[state_idx01];
+    } else {
+      const Arc &prev_arc = arcs_data[prev_arc_idx012];
+      prefix_score = forward_scores_data[state_idx0x + prev_arc.src_state] +
+                     prev_arc.score;
+    }
+    float score =
+        prefix_score + arc.score + backward_scores_data[dest_state_idx01];
+    return score != minus_inf && score >= tot_scores_data[fsa_idx0] - beam &&
+           (dest_state_idx01 + 1 == row_splits1_data[fsa_idx0 + 1] ||
+            keep_context_data[arc_idx012]);
+  };
+  Renumbering cands(c, num_cands, lambda_keep_cand);
+  Array1<int32_t> cand_old2new = cands.Old2New(true),
+                  cand_new2old = cands.New2Old(false);
+  int32_t num_out_arcs = cands.NumNewElems();
+  const int32_t *cand_old2new_data = cand_old2new.Data(),
+                *cand_new2old_data = cand_new2old.Data();
+
+  Array1<int32_t> out_row_splits2(c, num_out_states + 1),
+      out_row_ids2(c, num_out_arcs), out_arc_map(c, num_out_arcs);
+  Array2<int32_t> out_arc_pairs(c, num_out_arcs, 2);
+  Array1<Arc> out_arcs(c, num_out_arcs);
+  int32_t *out_row_splits2_data = out_row_splits2.Data(),
+          *out_row_ids2_data = out_row_ids2.Data(),
+          *out_arc_map_data = out_arc_map.Data(),
+          *out_arc_pairs_data = out_arc_pairs.Data(),
+          pairs_stride = out_arc_pairs.ElemStride0();
+  Arc *out_arcs_data = out_arcs.Data();
+  auto lambda_set_row_splits2 = [=] __host__ __device__(int32_t i) -> void {
+    out_row_splits2_data[i] = cand_old2new_data[cand_row_splits_data[i]];
+  };
+  Eval(c, num_out_states + 1, lambda_set_row_splits2);
+  auto lambda_set_arcs = [=] __host__ __device__(int32_t i) -> void {
+    int32_t cand = cand_new2old_data[i], out_state = cand_row_ids_data[cand],
+            fsa_idx0 = out_row_ids1_data[out_state],
+            state_idx0x = row_splits1_data[fsa_idx0],
+            out_state_idx0x = out_row_splits1_data[fsa_idx0],
+            state_idx01 = out_src_states_data[out_state],
+            arc_idx012 = row_splits2_data[state_idx01] + cand -
+                         cand_row_splits_data[out_state];
+    const Arc &arc = arcs_data[arc_idx012];
+    int32_t dest_state_idx01 = state_idx0x + arc.dest_state, out_dest_state;
+    if (dest_state_idx01 + 1 == row_splits1_data[fsa_idx0 + 1]) {
+      out_dest_state = out_row_splits1_data[fsa_idx0 + 1] - 1;
+    } else {
+      int32_t arc_idx0xx = row_splits2_data[state_idx0x];
+      out_dest_state = out_state_idx0x + 1 + context_old2new_data[arc_idx012] -
+                       context_old2new_data[arc_idx0xx];
+    }
+    Arc out_arc;
+    out_arc.src_state = out_state - out_state_idx0x;
+    out_arc.dest_state = out_dest_state - out_state_idx0x;
+    out_arc.symbol = arc.symbol;
+    out_arc.score = arc.score;
+    out_arcs_data[i] = out_arc;
+    out_row_ids2_data[i] = out_state;
+    out_arc_map_data[i] = arc_idx012;
+    out_arc_pairs_data[i * pairs_stride] = arc_idx012;
+    out_arc_pairs_data[i * pairs_stride + 1] = out_prev_arcs_data[out_state];
+  };
+  Eval(c, num_out_arcs, lambda_set_arcs);
+
+  *out = FsaVec(RaggedShape3(&out_row_splits1, &out_row_ids1, num_out_states,
+                             &out_row_splits2, &out_row_ids2, num_out_arcs),
+                out_arcs);
+  if (arc_map != nullptr) *arc_map = out_arc_map;
+  if (arc_pairs != nullptr) *arc_pairs = out_arc_pairs;
+}
+
+void PruneOnArcPost(FsaVec &src, float beam, FsaVec *dest,
+                    Array1<int32_t> *arc_map /*= nullptr*/) {
+  K2_CHECK_EQ(src.NumAxes(), 3);
+  K2_CHECK_GE(beam, 0);
+  K2_CHECK_NE(dest, nullptr);
+  ContextPtr &c = src.Context();
+  int32_t num_fsas = src.shape.Dim0(), num_states = src.shape.TotSize(1),
+          num_arcs = src.values.Dim();
+  Ragged<int32_t> state_batches = GetStateBatches(src),
+                  entering_arc_batches =
+                      GetEnteringArcBatches(src, state_batches),
+                  leaving_arc_batches =
+                      GetLeavingArcBatches(src, state_batches);
+  Array1<float> forward_scores = GetForwardScores<float>(
+                    src, state_batches, entering_arc_batches, false),
+                backward_scores = GetBackwardScores<float>(
+                    src, state_batches, leaving_arc_batches, false),
+                tot_scores = GetTotScores(src, forward_scores);
+  const int32_t *row_splits1_data = src.shape.RowSplits(1).Data(),
+                *row_ids1_data = src.shape.RowIds(1).Data(),
+                *row_splits2_data = src.shape.RowSplits(2).Data(),
+                *row_ids2_data = src.shape.RowIds(2).Data();
+  const Arc *arcs_data = static_cast<const Array1<Arc> &>(src.values).Data();
+  const float *forward_scores_data = forward_scores.Data(),
+              *backward_scores_data = backward_scores.Data(),
+              *tot_scores_data = tot_scores.Data();
+  const float minus_inf = -std::numeric_limits<float>::infinity();
+
+  auto lambda_keep_state = [=] __host__ __device__(int32_t i) -> bool {
+    float score = forward_scores_data[i] + backward_scores_data[i];
+    return score != minus_inf &&
+           score >= tot_scores_data[row_ids1_data[i]] - beam;
+  };
+  Renumbering states(c, num_states, lambda_keep_state);
+  const char *keep_state_data = states.Keep().Data();
+  // The test on the states guards against rounding differences between the
+  // scores of a state and those of its arcs, so the arcs that are kept never
+  // leave or enter a state that isn't.
+  auto lambda_keep_arc = [=] __host__ __device__(int32_t i) -> bool {
+    int32_t fsa_idx0 = row_ids1_data[row_ids2_data[i]],
+            state_idx0x = row_splits1_data[fsa_idx0];
+    const Arc &arc = arcs_data[i];
+    int32_t src_state_idx01 = state_idx0x + arc.src_state,
+            dest_state_idx01 = state_idx0x + arc.dest_state;
+    float score = forward_scores_data[src_state_idx01] + arc.score +
+                  backward_scores_data[dest_state_idx01];
+    return score != minus_inf && score >= tot_scores_data[fsa_idx0] - beam &&
+           keep_state_data[src_state_idx01] &&
+           keep_state_data[dest_state_idx01];
+  };
+  Renumbering arcs(c, num_arcs, lambda_keep_arc);
+
+  Array1<int32_t> state_old2new = states.Old2New(true),
+                  state_new2old = states.New2Old(false),
+                  arc_old2new = arcs.Old2New(true),
+                  arc_new2old = arcs.New2Old(false);
+  int32_t num_out_states = states.NumNewElems(),
+          num_out_arcs = arcs.NumNewElems();
+  const int32_t *state_old2new_data = state_old2new.Data(),
+                *state_new2old_data = state_new2old.Data(),
+                *arc_old2new_data = arc_old2new.Data(),
+                *arc_new2old_data = arc_new2old.Data();
+  Array1<int32_t> out_row_splits1(c, num_fsas + 1),
+      out_row_splits2(c, num_out_states + 1), out_row_ids2(c, num_out_arcs);
+  Array1<Arc> out_arcs(c, num_out_arcs);
+  int32_t *out_row_splits1_data = out_row_splits1.Data(),
+          *out_row_splits2_data = out_row_splits2.Data(),
+          *out_row_ids2_data = out_row_ids2.Data();
+  Arc *out_arcs_data = out_arcs.Data();
+  auto lambda_set_row_splits1 = [=] __host__ __device__(int32_t i) -> void {
+    out_row_splits1_data[i] = state_old2new_data[row_splits1_data[i]];
+  };
+  Eval(c, num_fsas + 1, lambda_set_row_splits1);
+  auto lambda_set_row_splits2 = [=] __host__ __device__(int32_t i) -> void {
+    int32_t old_state = (i < num_out_states ? state_new2old_data[i]
+                                            : num_states);
+    out_row_splits2_data[i] = arc_old2new_data[row_splits2_data[old_state]];
+  };
+  Eval(c, num_out_states + 1, lambda_set_row_splits2);
+  auto lambda_set_arcs = [=] __host__ __device__(int32_t i) -> void {
+    int32_t old_arc = arc_new2old_data[i],
+            fsa_idx0 = row_ids1_data[row_ids2_data[old_arc]],
+            state_idx0x = row_splits1_data[fsa_idx0],
+            out_state_idx0x = out_row_splits1_data[fsa_idx0];
+    Arc arc = arcs_data[old_arc];
+    arc.src_state =
+        state_old2new_data[state_idx0x + arc.src_state] - out_state_idx0x;
+    arc.dest_state =
+        state_old2new_data[state_idx0x + arc.dest_state] - out_state_idx0x;
+    out_arcs_data[i] = arc;
+    out_row_ids2_data[i] = out_state_idx0x + arc.src_state;
+  };
+  Eval(c, num_out_arcs, lambda_set_arcs);
+
+  *dest = FsaVec(RaggedShape3(&out_row_splits1, nullptr, num_out_states,
+                              &out_row_splits2, &out_row_ids2, num_out_arcs),
+                 out_arcs);
+  if (arc_map != nullptr) *arc_map = arc_new2old;
+}
+
 }  // namespace k2
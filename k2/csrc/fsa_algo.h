@@ -12,13 +12,18 @@
 #ifndef K2_CSRC_FSA_ALGO_H_
 #define K2_CSRC_FSA_ALGO_H_
 
+#include <limits>
+#include <memory>
+#include <vector>
+
 #include "k2/csrc/array.h"
 #include "k2/csrc/fsa.h"
 
 namespace k2 {
 
 /*
-  This version of Connect() works for a single FSA.
+  Removes the states of an Fsa or FsaVec that are not accessible or not
+  co-accessible.
     @param [in] src  Source FSA
     @param [out] dest   Destination; at exit will be equivalent to `src`
                      but will have no states that are unreachable or which
@@ -30,13 +35,47 @@ namespace k2 {
             have cycles, so the algorithm could not succeed).  Success
             does not imply that `dest` is nonempty.
 
-   CAUTION: for now this only works for CPU.
+   If the input is top-sorted (kFsaPropertiesTopSorted), this runs on the
+   device for all FSAs at once: a breadth-first search forward from the start
+   states and one backward from the final states, then the states and arcs
+   that are kept are renumbered, keeping their order.  Otherwise the FSAs
+   are connected (and top-sorted) one by one by the host code; if `src` is
+   on GPU that involves copying it to the CPU and back.
 
    This works for both Fsa and FsaVec!
-
  */
 bool Connect(Fsa &src, Fsa *dest, Array1<int32_t> *arc_map = nullptr);
 
+/*
+  Topologically sorts the states of each FSA in an FsaVec, with Kahn's
+  algorithm run level-synchronously on all FSAs at once (one kernel and one
+  transfer to the host per level; on CPU the kernels are multi-threaded).
+  States are ordered by their level, i.e. the length of the longest path
+  from a state with no arcs entering it, except that the final state always
+  goes last; within a level, states keep their order.  Self-loops are
+  allowed.
+
+  As for k2host::TopSorter, the FSAs are expected to be connected,
+  e.g. by Connect(); otherwise state 0 may not remain the start state.
+
+    @param [in] src   Source FsaVec; must have 3 axes.
+    @param [out] dest  Destination; its FSAs have the same numbers of states
+                      and arcs as those of `src`.  FSAs that have cycles
+                      other than self-loops are output unchanged.
+    @param [out,optional] is_cyclic  If not nullptr, will be set to an array
+                      with dim src.Dim0() that is 1 for the FSAs that have
+                      cycles other than self-loops and 0 for the others.
+    @param [out,optional] state_map  If not nullptr, will be set to the
+                      state_idx01 in `src` of each state of `dest`.
+    @param [out,optional] arc_map  If not nullptr, will be set to the arc
+                      index in `src` of each arc of `dest`.
+    @return  Returns true if none of the FSAs had cycles (other than
+             self-loops).
+ */
+bool TopSort(FsaVec &src, FsaVec *dest, Array1<char> *is_cyclic = nullptr,
+             Array1<int32_t> *state_map = nullptr,
+             Array1<int32_t> *arc_map = nullptr);
+
 
 /*
   Sort arcs of an Fsa or FsaVec in-place (this version of the function does not
@@ -47,10 +86,382 @@ bool Connect(Fsa &src, Fsa *dest, Array1<int32_t> *arc_map = nullptr);
 */
 void ArcSort(Fsa *fsa);
 
+/*
+  Sort the arcs leaving each state of an Fsa or FsaVec by symbol and then by
+  dest_state (the sort is stable).  Runs on the device of `src`, as one
+  segmented sort over all states; FSAs that have
+  kFsaPropertiesArcSortedAndDeterministic are already sorted and are
+  skipped.
+
+          @param[in] src   FSA or FsaVec of which to sort the arcs.  Does not
+                         have to be non-empty.
+          @param[out] dest  At exit, the arc-sorted version of `src`; shares
+                         its shape with `src`.
+          @param[out,optional] arc_map  For each arc in `dest`, gives the
+                         index of the corresponding arc in `src`.
+*/
 void ArcSort(Fsa &src, Fsa *dest, Array1<int32_t> *arc_map = nullptr);
 
+/*
+  Intersection of two FsaVecs, for 'sparse' FSAs such as lattices or graphs
+  (cf. IntersectDensePruned() for neural-net output).  Runs on the device of
+  the inputs: the state pairs are found breadth-first for all the FSAs at
+  once, with the arcs of each pair of states matched by binary search, so it
+  needs the inputs to be arc-sorted.  The semantics of epsilons are those
+  of k2host::Intersection: an epsilon arc of either FSA is taken while the
+  other FSA stays in its state (so paths with epsilons interleaved
+  differently may all appear).
+
+         @param[in] a_fsas  The first input; must be arc-sorted.  Must
+                         have either one FSA or as many as b_fsas; a single
+                         FSA is intersected with each FSA of the other.
+         @param[in] b_fsas  The second input; must be arc-sorted.  Must
+                         have either one FSA or as many as a_fsas.
+         @param[in] beam  Beam for pruning, e.g. 10, or infinity for none.
+                         States first reached on the same step of the search
+                         are pruned against the best of them in the same FSA;
+                         for epsilon-free acyclic inputs such as lattices this
+                         is like frame-synchronous pruning.  Arcs into states
+                         that are kept are always kept.
+         @param[out] out  The output, with max(a_fsas.Dim0(), b_fsas.Dim0())
+                         FSAs, connected.  Its states are in the order they
+                         were reached (by the number of arcs from the start
+                         state), which for acyclic input is a topological
+                         order only if all paths to each state have the same
+                         number of arcs, as for lattices; use TopSort()
+                         otherwise.
+         @param[out,optional] arc_map_a  If not nullptr, will be set to the
+                         arc index in a_fsas of each arc of `out`, or -1 for
+                         epsilon arcs of b_fsas.
+         @param[out,optional] arc_map_b  If not nullptr, will be set to the
+                         arc index in b_fsas of each arc of `out`, or -1 for
+                         epsilon arcs of a_fsas.
+         @return  Returns true on success; false, with `out` not set, if
+                  either input is not arc-sorted or both have epsilons.
+ */
+bool IntersectPruned(FsaVec &a_fsas, FsaVec &b_fsas, float beam, FsaVec *out,
+                     Array1<int32_t> *arc_map_a = nullptr,
+                     Array1<int32_t> *arc_map_b = nullptr);
+
+/*
+  Version of IntersectPruned() that does no pruning.
+ */
+inline bool Intersect(FsaVec &a_fsas, FsaVec &b_fsas, FsaVec *out,
+                      Array1<int32_t> *arc_map_a = nullptr,
+                      Array1<int32_t> *arc_map_b = nullptr) {
+  return IntersectPruned(a_fsas, b_fsas,
+                         std::numeric_limits<float>::infinity(), out,
+                         arc_map_a, arc_map_b);
+}
+
+/*
+  Pruned determinization of an FsaVec, e.g. of lattices, with the max
+  (tropical) semiring; runs on the device of the input, for all the FSAs at
+  once.  The states of the output are weighted subsets of the input states,
+  found breadth-first, with subsets that differ only by rounding errors in
+  their weights (less than 1/1024) treated as the same.
+
+         @param[in] src   The input; must be epsilon-free (epsilons would
+                          otherwise be treated as normal symbols).  Need not
+                          be arc-sorted.
+         @param[in] beam  Beam for pruning, e.g. 10, or infinity for none.  As
+                          for IntersectPruned(), states first reached on the
+                          same step of the search are pruned against the best
+                          of them in the same FSA.  Also, input states more
+                          than `beam` below the best one are dropped from each
+                          subset, which makes sure the search ends for cyclic
+                          input that is not determinizable.  With an infinite
+                          beam, `src` must be determinizable, e.g. acyclic.
+         @param[out] out  The output, with the same number of FSAs, connected
+                          and deterministic, with the arcs leaving each state
+                          sorted by symbol.  For each symbol sequence the best
+                          weight in `out` is the best weight in `src`, except
+                          as affected by the pruning.
+         @param[out,optional] arc_derivs  If not nullptr, will be set to the
+                          list of arcs of `src` that each arc of `out`
+                          depends on, indexed [arc of out][list]; with
+                          `arc_deriv_values`, it gives the derivatives of the
+                          weights of the arcs of `out` w.r.t. those of `src`
+                          as a sparse matrix.  For max, the weight of an arc
+                          of `out` is that of the best input path of its
+                          symbol sequence minus that of its prefix that leads
+                          to the source state; its arc_derivs are the arcs
+                          of src where those paths differ.
+         @param[out,optional] arc_deriv_values  If not nullptr, will be set
+                          to the derivatives for `arc_derivs.values`: for max,
+                          1 for arcs on the path to the destination state and
+                          -1 for those on the path to the source state.
+         @return  Returns true on success; false, with `out` not set, if
+                  `src` has epsilons.
+ */
+bool DeterminizePrunedMax(FsaVec &src, float beam, FsaVec *out,
+                          Ragged<int32_t> *arc_derivs = nullptr,
+                          Array1<float> *arc_deriv_values = nullptr);
+
+/*
+  As DeterminizePrunedMax(), but with the log semiring: for each symbol
+  sequence the total weight (the log-sum over its paths) in `out` is that in
+  `src`, except as affected by the pruning.  The arc_derivs of each arc of
+  `out` are the input arcs that enter the best state of its destination
+  subset, and arc_deriv_values the derivatives of the arc's weight w.r.t.
+  their weights with the weights of the source subset held fixed, i.e. 0 <
+  value <= 1, and they add up to 1.
+ */
+bool DeterminizePrunedLogSum(FsaVec &src, float beam, FsaVec *out,
+                             Ragged<int32_t> *arc_derivs = nullptr,
+                             Array1<float> *arc_deriv_values = nullptr);
+
+/*
+  Pruned epsilon removal of an FsaVec, e.g. of lattices, with the max
+  (tropical) semiring; runs on the device of the input, for all the FSAs at
+  once.  Each path of `out` is a path of `src` with the epsilon arcs merged
+  into the next non-epsilon arc: the states of `out` are the start and final
+  states of `src` and those entered by non-epsilon arcs, in the same order,
+  and an arc of `out` from state s is the best sequence of epsilon arcs from
+  s to some state t followed by a non-epsilon arc leaving t, with their
+  weights summed.
+
+         @param[in] src   The input; must be top-sorted and acyclic (see
+                          kFsaPropertiesTopSortedAndAcyclic).  Need not be
+                          arc-sorted.
+         @param[in] beam  Beam for pruning, e.g. 10, or infinity for none.
+                          Sequences of epsilon arcs, and arcs of `out`, on no
+                          path of `src` within `beam` of the best path (by the
+                          best forward and backward weights of the states)
+                          are dropped.
+         @param[out] out  The output, with the same number of FSAs,
+                          connected, top-sorted and epsilon-free.  For each
+                          symbol sequence the best weight in `out` is that in
+                          `src`, except as affected by the pruning.
+         @param[out,optional] arc_derivs  If not nullptr, will be set to the
+                          list of arcs of `src` that each arc of `out`
+                          depends on, indexed [arc of out][list]: for max, the
+                          epsilon arcs it was formed from in order, then its
+                          non-epsilon arc.
+         @param[out,optional] arc_deriv_values  If not nullptr, will be set
+                          to the derivatives for `arc_derivs.values` of the
+                          weight of each arc of `out` w.r.t. those of `src`;
+                          for max they are all 1.
+         @return  Returns true on success; false, with `out` not set, if
+                  `src` is not top-sorted and acyclic.
+ */
+bool RemoveEpsilonsPrunedMax(FsaVec &src, float beam, FsaVec *out,
+                             Ragged<int32_t> *arc_derivs = nullptr,
+                             Array1<float> *arc_deriv_values = nullptr);
+
+/*
+  As RemoveEpsilonsPrunedMax(), but with the log semiring: the weight of an
+  arc of `out` from s through t is the log-sum over the sequences of epsilon
+  arcs from s to t, plus that of its non-epsilon arc.  Its arc_derivs are all
+  the epsilon arcs on those sequences, ordered by source state, with their
+  posteriors among the sequences as arc_deriv_values, then its non-epsilon
+  arc with value 1.
+ */
+bool RemoveEpsilonsPrunedLogSum(FsaVec &src, float beam, FsaVec *out,
+                                Ragged<int32_t> *arc_derivs = nullptr,
+                                Array1<float> *arc_deriv_values = nullptr);
+
+/*
+  Finds the best (Viterbi) path of each FSA of an FsaVec, e.g. the one-best
+  output of decoding lattices; runs on the device of the input, for all the
+  FSAs at once.  The forward scores are computed with the max semiring as in
+  GetForwardScores(), the best entering arc of each state is found from them,
+  and the paths are traced back from the final states, one thread per FSA.
+  There is one transfer to the host for the sizes of the output, apart from
+  those of GetStateBatches().
+
+         @param[in] src   The input; must be acyclic, but need not be
+                          top-sorted.
+         @param[out] out  The best paths, as linear FSAs: one per FSA of
+                          `src`, with the states 0, 1, ..., n and arc i from
+                          state i to i + 1 with the symbol and score of the
+                          i'th arc of the path.  FSAs of `src` whose final
+                          state can't be reached (or which have fewer than 2
+                          states) give empty FSAs.
+         @param[out,optional] best_arcs  If not nullptr, will be set to the
+                          arcs of the best paths, indexed [fsa][arc], as
+                          arc_idx012's of `src`; ties are broken in favour of
+                          the arc with the lowest index.  Its values are the
+                          arc_map from the arcs of `out` to those of `src`.
+ */
+void ShortestPath(FsaVec &src, FsaVec *out,
+                  Ragged<int32_t> *best_arcs = nullptr);
+
+/*
+  Finds the n best paths of each FSA of an FsaVec, e.g. of lattices for
+  rescoring; runs on the device of the input, for all the FSAs at once.  This
+  is exact k-best Viterbi: each state keeps a list of its up to n best partial
+  paths from the start state (score, last arc, and its position in the list
+  of the arc's source state), computed batch by batch from the lists of its
+  predecessors, with one thread per state merging them.  The paths are then
+  traced back from the lists of the final states, one thread per path.
+  The work is O(n * num_arcs) and the memory O(n * num_states); there are
+  two transfers to the host for the sizes of the output, plus one per state
+  batch.
+
+  The paths are distinct as sequences of arcs; different paths may have the
+  same symbol sequence.
+
+         @param[in] src   The input; must be acyclic, but need not be
+                          top-sorted.
+         @param[in] n     The number of paths wanted per FSA; n >= 1.
+         @param[out] paths  Will be set to the paths, indexed
+                          [fsa][path][arc], as arc_idx012's of `src`; each FSA
+                          has min(n, its number of paths) of them, in order
+                          of decreasing score (ties in no particular order).
+                          Paths with score -infinity are not included, and
+                          FSAs with fewer than 2 states have none.  For n == 1
+                          the paths are those from ShortestPath().
+         @param[out,optional] path_scores  If not nullptr, will be set to the
+                          total scores of the paths, indexed by path_idx01.
+ */
+void NBestPaths(FsaVec &src, int32_t n, Ragged<int32_t> *paths,
+                Array1<float> *path_scores = nullptr);
+
+/*
+  Expands the FSAs of an FsaVec, e.g. epsilon-free lattices, so that each
+  state has a unique left context, which is what is needed for biphone
+  context dependency (see stage (b) in notes/decoding.txt): the states of
+  `out` are the start and final states of `src`, and one state (s, e) for
+  each arc e entering a state s that is not final.  An arc f leaving s
+  becomes an arc from (s, e) to (dest(f), f) (or to the final state), so all
+  the arcs entering a state of `out` have the same symbol, and each arc of
+  `out` has a unique previous arc.  This is lattice-expand-ngram with n = 2
+  but keyed by the previous arc rather than its symbol, which is what the
+  dot products need when the vectors are per arc (e.g. per frame).
+
+  It's done with pruning, on the device of `src` for all the FSAs at once:
+  a state (s, e) is only created if the best path through e is within `beam`
+  of the best path of its FSA, and an arc for the pair (e, f) only if the
+  best path through e followed by f is (using the max forward and backward
+  scores).  The output is connected, and is top-sorted if `src` is.
+
+         @param[in] src   The input; must be acyclic, but need not be
+                          top-sorted.
+         @param[in] beam  Beam for pruning, e.g. 8; may be infinity, for no
+                          pruning.  Must be >= 0.
+         @param[out] out  The output, with the same number of FSAs as `src`;
+                          FSAs of `src` with fewer than 2 states or whose
+                          final state can't be reached give empty FSAs.
+                          Each arc has the symbol and score of the arc of
+                          `src` it comes from.
+         @param[out,optional] arc_map  If not nullptr, will be set to the arc
+                          of `src` that each arc of `out` comes from.
+         @param[out,optional] arc_pairs  If not nullptr, will be set to an
+                          array with dimension (out->values.Dim(), 2): for arc
+                          i of `out`, arc_pairs[i][0] is the arc of `src` it
+                          comes from, and arc_pairs[i][1] the arc of `src`
+                          before it on all its paths, or -1 if it leaves the
+                          start state.  These are the index pairs for the dot
+                          products.
+ */
+void ExpandBigramPruned(FsaVec &src, float beam, FsaVec *out,
+                        Array1<int32_t> *arc_map = nullptr,
+                        Array2<int32_t> *arc_pairs = nullptr);
+
+/*
+  Prunes the FSAs of an FsaVec, e.g. stored lattices, to the arcs and states
+  on paths within `beam` of the best path of their FSA: an arc is kept if the
+  forward score of its source state plus its score plus the backward score of
+  its dest-state (max semiring, i.e. the score of the best path through it)
+  is at least the best path's score minus `beam`, and a state likewise by its
+  forward plus backward score.  Runs on the device of `src` for all the FSAs
+  at once, in a few kernels after the forward and backward scores; the
+  states and arcs that are kept keep their order.
+
+         @param[in] src   The input; must be acyclic, but need not be
+                          top-sorted.
+         @param[in] beam  The beam, e.g. 8; must be >= 0.
+         @param[out] dest The pruned FSAs, with the same number of FSAs as
+                          `src`; connected, and top-sorted if `src` is.
+                          FSAs whose final state can't be reached give empty
+                          FSAs.
+         @param[out,optional] arc_map  If not nullptr, will be set to the arc
+                          of `src` that each arc of `dest` comes from.
+ */
+void PruneOnArcPost(FsaVec &src, float beam, FsaVec *dest,
+                    Array1<int32_t> *arc_map = nullptr);
+
+// The columns of DenseIntersectStats::counts.
+enum DenseIntersectCount {
+  kIntersectActiveStates = 0,  // States active at the start of the frame.
+  kIntersectExpandedArcs = 1,  // Arcs leaving them, i.e. that were scored.
+  kIntersectKeptArcs = 2,      // Those that survived the beam pruning.
+  kNumIntersectCounts = 3
+};
+
+/*
+  Per-frame statistics of the search of IntersectDensePruned(), e.g. for
+  tuning its beam, max_active and min_active.  There is an element for each
+  row of b_fsas: frame t of sequence n is element shape.RowSplits(1)[n] + t,
+  the last frame of a sequence being the one on which the final arcs are
+  taken.  The frames on which a sequence had no active states are all zeros.
+ */
+struct DenseIntersectStats {
+  RaggedShape shape;  // 2 axes: [seq][frame]; it is b_fsas.shape.
+  // Dims (shape.NumElements(), kNumIntersectCounts): the counts of each frame,
+  // indexed by DenseIntersectCount.  The arcs kept are those whose score is
+  // within the beam, and the other arcs entering the same states (the
+  // lattice_beam is applied later).
+  Array2<int32_t> counts;
+  // The beam used on each frame, i.e. `beam` as modified by
+  // {min,max}_active.
+  Array1<float> beams;
+};
+
+// The optional arguments of IntersectDensePruned().
+struct IntersectDensePrunedOptions {
+  // Beam for pruning the output, e.g. 6: after the decoding, only the states
+  // and arcs on paths whose score is within this of the best path of the
+  // sequence are kept (using the forward and backward scores).  Making this
+  // smaller than `beam` gives much smaller lattices.  If < 0, `beam` is used.
+  float lattice_beam = -1;
+
+  // If > 0 (it must be <= 1), enables a faster, approximate mode for
+  // CTC-like models: on the frames where the probability of blank (symbol 0;
+  // the scores of b_fsas are assumed to be log-probabilities) is at least
+  // this, e.g. 0.95, only the blank arcs leaving the active states are
+  // expanded, so the paths stay in (or move to) the states that emit blank.
+  // With a CTC topology every state has a blank arc, so this only drops the
+  // paths that would emit another symbol on such frames.
+  float blank_threshold = 0;
+
+  // If > 0, a memory budget in bytes for batches that may not fit in device
+  // memory, e.g. of long utterances: the sequences are intersected in
+  // sub-batches (contiguous ranges of them) whose estimated memory use (see
+  // EstimateIntersectDensePrunedBytes()) is at most this, one after the
+  // other, and their outputs are appended, so they are the same as for the
+  // whole batch.  A sequence whose own estimate is more than this has a
+  // sub-batch of its own.  With a prepared graph (DenseIntersectGraph), it
+  // requires one graph shared by all the sequences.
+  int64_t max_bytes = 0;
+
+  // If not nullptr, will be set to a vector of size out->Dim0() giving the
+  // total score of each output FSA in the log semiring, i.e. the log of the
+  // sum of the probabilities of its paths (-infinity if it is empty).
+  Array1<float> *tot_scores = nullptr;
 
+  // If not nullptr, will be set to a vector of size out->NumElements()
+  // giving the occupation probability of each output arc, i.e. the sum of
+  // the probabilities of the paths through it divided by that of all the
+  // paths of its FSA.
+  Array1<float> *arc_posts = nullptr;
 
+  // If not nullptr, will be set to the number of frames (rows of b_fsas,
+  // over all sequences) on which only the blank arcs were expanded; 0 if
+  // blank_threshold == 0.
+  int32_t *num_skipped_frames = nullptr;
+
+  // If not nullptr, will be set to the per-frame statistics of the search
+  // (on the context of b_fsas); they are written by a small kernel per
+  // frame, with no extra transfer.
+  DenseIntersectStats *stats = nullptr;
+
+  // If not nullptr, will be set to the sequences of the sub-batches of
+  // max_bytes: sub-batch i has sequences batch_offsets[i] <= n <
+  // batch_offsets[i+1] (one sub-batch with all of them if max_bytes == 0).
+  std::vector<int32_t> *batch_offsets = nullptr;
+};
 
 /*
   compose/intersect array of FSAs (multiple streams decoding or training in
@@ -64,7 +475,12 @@ void ArcSort(Fsa &src, Fsa *dest, Array1<int32_t> *arc_map = nullptr);
                          FSAs with the same size as b_fsas (a_fsas.Dim0() ==
                          b_fsas.Dim0()).
          @param[in] b_fsas   Input FSAs that correspond to neural network
-                         outputs (see documentation in fsa.h).
+                         outputs (see documentation in fsa.h).  Their scores
+                         may be in half precision (see
+                         DenseFsaVec::half_scores); they are converted to
+                         float as they are read.  Or they may be sparse
+                         (see SparsifyDenseFsaVec()), in which case the
+                         entries that were not kept count as -infinity.
          @param[in] beam   Decoding beam, e.g. 10.  Smaller is faster,
                          larger is more exact (less pruning).  This is the
                          default value; it may be modified by {min,max}_active.
@@ -73,18 +489,319 @@ void ArcSort(Fsa &src, Fsa *dest, Array1<int32_t> *arc_map = nullptr);
                          specific beam will be reduced if more than this number
   of states are active.
          @param[in] min_active  Minimum active states allowed per frame; beam
-                         will be decreased if the number of active states falls
-                         below this
+                         will be increased (up to twice `beam`) if the number
+                         of active states falls below this.
+                         Both limits are applied on each frame using a
+                         histogram of the scores of the arcs leaving the active
+                         states; the number of arcs stands in for the number of
+                         states they lead to.
          @param[out] out Output vector of composed, pruned FSAs, with same
   Dim0() as b_fsas.  Elements of it may be empty if the composition was empty,
-  either intrinsically or due to failure of pruned search.
-         @param[out] arc_map_a  Vector of
+  either intrinsically or due to failure of pruned search.  The states of
+  each output FSA are ordered by frame.
+         @param[out] arc_map_a  If not nullptr, will be set to a vector of
+                         size out->NumElements(), giving the index in a_fsas
+                         (i.e. into a_fsas.values) of the arc that each
+                         output arc came from.
+         @param[out] arc_map_b  If not nullptr, will be set to a vector of
+                         size out->NumElements(), giving the index into
+                         b_fsas.scores.Data() (or b_fsas.half_scores.Data(),
+                         i.e. the arc of b_fsas) whose score each output arc
+                         used.
+         @param[in] opts  The optional arguments, including the optional
+                         outputs; see IntersectDensePrunedOptions.
+
+  The forward pass runs the kernels of all the sequences together, one frame
+  at a time; apart from allocation, its only transfer to the host on each
+  frame is of the sizes of the pruned arcs and of the next frame's states.
+  If the sequences of b_fsas are sorted by decreasing length, those that have
+  ended are dropped from the rest of the forward pass, so the per-sequence
+  work on each frame is only for the sequences that are still active; the
+  forward pass also stops early if no states are left.
+*/
+void IntersectDensePruned(
+    FsaVec &a_fsas, DenseFsaVec &b_fsas, float beam,
+    int32_t max_active_states, int32_t min_active_states, FsaVec *out,
+    Array1<int32_t> *arc_map_a, Array1<int32_t> *arc_map_b,
+    const IntersectDensePrunedOptions &opts = IntersectDensePrunedOptions());
+
+/*
+  A decoding graph prepared by PrepareDenseIntersectGraph() for use in
+  IntersectDensePruned(), e.g. for decoding many batches with the same graph.
+  The arcs leaving each state are sorted by symbol, so the threads that expand
+  the arcs of a state on each frame read adjacent scores of the frame (and the
+  arcs leaving it are in the same cache lines), and the arcs are kept in SoA
+  layout, which is otherwise recomputed on each call.  The other structures
+  derived from the graph that are usually needed with it are computed once
+  too, so that nothing needs to be done per request.
+
+  Once prepared, nothing modifies it, so it may be shared (e.g. by non-const
+  reference, as the functions that take it require) by decoders running at
+  the same time in different threads or on different streams.
+ */
+struct DenseIntersectGraph {
+  FsaVec fsas;  // The graph, with the arcs of each state sorted by symbol
+                // and then by dest_state (as by ArcSort()).
+  FsaSoA soa;   // The arcs of `fsas` in SoA layout.
+  Array1<int32_t> arc_map;  // The index of each arc of `fsas` in the graph
+                            // it was prepared from.
+  // The properties of each FSA of `fsas`, and their `and` (see
+  // GetFsaVecBasicProperties()).
+  Array1<int32_t> properties;
+  int32_t tot_properties = 0;
+  // The arcs entering each state of `fsas`, indexed [state][arc] (see
+  // GetEnteringArcs()).
+  Ragged<int32_t> entering_arcs;
+};
+
+/*
+  Prepares a decoding graph for IntersectDensePruned(); is a segmented sort
+  and a few kernels, and waits for the device to compute the properties.  To
+  reuse a prepared graph in another process, write `ans.fsas` with
+  WriteFsaBinary() and prepare what ReadFsaBinary() returns: the FSAs whose
+  arcs are already sorted (and deterministic) are not sorted again, and
+  arc_map_a will then index the graph that was written.
+
+     @param [in] a_fsas  The decoding graphs, as for IntersectDensePruned();
+                        must have 3 axes.
+     @param [in] c      If not nullptr, the context for the prepared graph,
+                        to which a_fsas is copied if needed; else the
+                        context of a_fsas.
+     @return  Returns the prepared graph; it shares no memory with `a_fsas`.
+              Its row_ids are set up, so they are not computed (and
+              written) on first use.
+ */
+DenseIntersectGraph PrepareDenseIntersectGraph(FsaVec &a_fsas,
+                                               ContextPtr c = nullptr);
+
+/*
+  Returns a copy of a prepared graph whose arrays are allocated from `c`,
+  which must be compatible with the context of `graph`.  This is for
+  contexts that are compatible but allocate other memory, where To() would
+  not copy: mainly NewHostMappedContext(), for a graph that doesn't fit in
+  device memory with the search state of IntersectDensePruned().  The
+  intersection then reads the arcs of the active states of each frame from
+  host memory, which is slower but lets the graph be as large as the host's
+  memory; its own memory is still allocated on the context of b_fsas.
+
+     @param [in] graph  A graph from PrepareDenseIntersectGraph()
+     @param [in] c      The context to allocate the copy from; the copies
+                        are done by kernels on it.
+     @return  Returns the copy; `properties`, with one element per FSA, is
+              shared with `graph`.
+ */
+DenseIntersectGraph CopyDenseIntersectGraph(DenseIntersectGraph &graph,
+                                            ContextPtr c);
+
+/*
+  Version of IntersectDensePruned() for a prepared graph; the arguments are
+  as for the other version, and the result is the same except for the order
+  of the arcs leaving each state.  `arc_map_a` gives indexes into the graph
+  that `a_graph` was prepared from (not into a_graph.fsas).  The work is
+  queued on the context (the stream) of b_fsas, so the same prepared graph
+  may be used at the same time by intersections on different child contexts
+  of its context, as long as it was ready before they were created.
+ */
+void IntersectDensePruned(
+    DenseIntersectGraph &a_graph, DenseFsaVec &b_fsas, float beam,
+    int32_t max_active_states, int32_t min_active_states, FsaVec *out,
+    Array1<int32_t> *arc_map_a, Array1<int32_t> *arc_map_b,
+    const IntersectDensePrunedOptions &opts = IntersectDensePrunedOptions());
+
+/*
+  Returns a rough estimate of the peak device memory that
+  IntersectDensePruned() needs for each sequence of b_fsas, e.g. for choosing
+  batch sizes (see IntersectDensePrunedOptions::max_bytes).  It assumes that
+  max_active_states states are active on each frame (or all the states of the
+  graph, if it has fewer), with the arcs that leave them on average, since
+  the states and arcs of all the frames are kept until the output is
+  formatted.  The row_splits of a_fsas and b_fsas are copied to the host.
+
+     @param [in] a_fsas  The decoding graphs, as for IntersectDensePruned().
+     @param [in] b_fsas  The neural-net output.
+     @param [in] max_active_states  As for IntersectDensePruned().
+     @return  Returns the estimates in bytes, of size b_fsas.shape.Dim0().
+ */
+std::vector<int64_t> EstimateIntersectDensePrunedBytes(
+    FsaVec &a_fsas, DenseFsaVec &b_fsas, int32_t max_active_states);
+
+/*
+  Version of IntersectDensePruned() that does no pruning (other than of the
+  states and arcs that are not on any path with a finite score), e.g. for the
+  numerator graphs of training, which are small enough that the full
+  intersection can be afforded.  The arguments are as for
+  IntersectDensePruned(); `tot_scores` and `arc_posts` give the total
+  scores and the arc occupation probabilities needed for the objective
+  function and its derivatives.
 
+  The log-semiring sums are done with segmented reductions over the arcs
+  leaving and entering each state (see LogSumPerSublist()), not with atomics,
+  so the results are the same on every run.
 */
-void IntersectDensePruned(FsaVec &a_fsas, DenseFsaVec &b_fsas, float beam,
-                          int32_t max_active_states, int32_t min_active_states,
-                          FsaVec *out, Array1<int32_t> *arc_map_a,
-                          Array1<int32_t> *arc_map_b);
+void IntersectDense(FsaVec &a_fsas, DenseFsaVec &b_fsas, FsaVec *out,
+                    Array1<int32_t> *arc_map_a, Array1<int32_t> *arc_map_b,
+                    Array1<float> *tot_scores = nullptr,
+                    Array1<float> *arc_posts = nullptr);
+
+/*
+  Version of IntersectDensePruned() for the CPU that decodes the sequences in
+  parallel on the threads of BackgroundRunner's pool (see ParallelFor()), each
+  with a k2host::DensePrunedIntersection, frame-synchronous Viterbi beam
+  search.  Each thread reuses the memory of its search for all the sequences
+  it is given, and the results are written to one contiguous FsaVec.  This is
+  faster than IntersectDensePruned() on the CPU, which runs the steps of the
+  GPU algorithm (one frame of the whole batch at a time) serially.
+
+     @param [in] a_fsas  The decoding graphs on the CPU, with Dim0() == 1 (the
+                         same graph for all sequences) or b_fsas.Dim0().
+     @param [in] b_fsas  The neural-net output on the CPU; must have `scores`
+                         (not half or sparse ones).
+     @param [in] beam    Beam for pruning the states of each frame, against
+                         the best of them, e.g. 20.
+     @param [out] out    The output, as for IntersectDensePruned(); each
+                         FSA is connected, and is empty if no path survived.
+     @param [out] arc_map_a  If not nullptr, set to the index into a_fsas.values
+                         of the arc of each arc of `out`.
+     @param [out] arc_map_b  If not nullptr, set to the index into
+                         b_fsas.scores.Data() of the score of each arc of
+                         `out`.
+ */
+void IntersectDensePrunedCpu(FsaVec &a_fsas, DenseFsaVec &b_fsas, float beam,
+                             FsaVec *out, Array1<int32_t> *arc_map_a,
+                             Array1<int32_t> *arc_map_b);
+
+/*
+  For the output of IntersectDensePruned() or IntersectDense(), converts
+  `arc_map_b` from indexes into b_fsas.scores to indexes into the neural-net
+  output that b_fsas was constructed from (see the constructor of DenseFsaVec),
+  taken as a contiguous (N, T_max, C) array: the score of symbol c at row t of
+  sequence n has index (n * T_max + start_frame + t) * C + c.  The arcs with
+  the final symbol, whose scores don't come from the neural-net output, get
+  -1.  This is what BackpropTotScores() needs from the forward pass.
+
+     @param [in] b_fsas  The DenseFsaVec given to the intersection.
+     @param [in] supervision_segments  As given to the constructor of b_fsas.
+     @param [in] max_frames  T_max, i.e. nnet_output.Dim(1) in that
+                        constructor.
+     @param [in] arc_map_b  The arc_map_b output by the intersection.
+     @return  Returns an array with Dim() == arc_map_b.Dim(), on the context
+              of b_fsas.
+ */
+Array1<int32_t> ArcMapBToNnetOutput(DenseFsaVec &b_fsas,
+                                    Array2<int32_t> &supervision_segments,
+                                    int32_t max_frames,
+                                    const Array1<int32_t> &arc_map_b);
+
+/*
+  The backward pass of the total scores output by IntersectDensePruned() or
+  IntersectDense(): computes the derivatives of
+  sum_n tot_scores_grad[n] * tot_scores[n] w.r.t. the neural-net output, i.e.
+  for each score of it, the sum of the posteriors (times the derivative of
+  the total score of their sequence) of the output arcs that used it.  (With
+  pruning, these are the derivatives of the total scores of the pruned
+  lattices.)  The arcs are grouped by the score they used and each score's
+  derivative is a sum over its group (see ScatterAddDeterministic()), so the
+  result does not depend on thread scheduling and no per-sequence arrays are
+  created.
+
+     @param [in] nnet_arc_map  The output of ArcMapBToNnetOutput().
+     @param [in] arc_posts   The arc_posts output by the intersection.
+     @param [in] tot_scores_grad  The derivatives w.r.t. the total scores;
+                        its Dim() is N, the number of sequences.
+     @param [in] max_frames  T_max, as for ArcMapBToNnetOutput().
+     @param [in] num_symbols  C, the last dimension of the neural-net output.
+     @return  Returns the derivatives as a contiguous (N, T_max, C) array with
+              N * T_max * C elements, on the context of `nnet_arc_map`; the
+              scores that no arc used get 0.
+ */
+Array1<float> BackpropTotScores(const Array1<int32_t> &nnet_arc_map,
+                                const Array1<float> &arc_posts,
+                                const Array1<float> &tot_scores_grad,
+                                int32_t max_frames, int32_t num_symbols);
+
+class MultiGraphDenseIntersect;  // defined in compose.cu
+
+/*
+  Streaming version of IntersectDensePruned(), for when the neural-net output
+  arrives in chunks (e.g. in online recognition).  Each call to AcceptChunk()
+  does the forward pass (the decoding) of the chunk's frames, and only
+  the active states of the latest frame and the arcs that survived the
+  forward pruning of earlier frames are kept; the backward pruning is done
+  by Finalize().  Processing the whole output as one chunk gives the same
+  result as IntersectDensePruned().
+
+  Usage:
+
+     OnlineIntersectDensePruned decoder(a_fsas, num_seqs, 10, 6, 1000, 30);
+     for (...) {
+       DenseFsaVec chunk(nnet_output_chunk, segments);
+       decoder.AcceptChunk(chunk);
+       Array2<int32_t> partial = decoder.BestPaths();
+     }
+     FsaVec lattice;
+     decoder.Finalize(&lattice, &arc_map_a);
+ */
+class OnlineIntersectDensePruned {
+ public:
+  /*
+    Constructor.  See IntersectDensePruned() for the meaning of the
+    arguments; `num_seqs` is the Dim0() of the chunks.  A copy of `a_fsas`
+    (sharing its memory) is kept.
+
+       @param [in] persistent_capacity  If > 0, enables the persistent mode,
+                     meant for low-latency decoding of a few sequences
+                     (e.g. 1 to 4): the frames of each chunk (up to 64 at a
+                     time) are decoded by a single kernel with a block of
+                     threads per sequence, which does the expansion, the
+                     computation of the cutoffs and the pruning of every
+                     frame without going back to the host, so there is one
+                     transfer from the device per chunk instead of one per
+                     frame.  The result is the same.  Its buffers have room
+                     for this many unpruned arcs per sequence and frame
+                     (e.g. a few times max_active_states); if there are
+                     more, the rest of the chunk is decoded as usual.
+                     Requires the number of states of a_fsas, times
+                     num_seqs if a_fsas has only one FSA, to be at most
+                     2^28 (so that a dense map of them is used).
+   */
+  OnlineIntersectDensePruned(FsaVec &a_fsas, int32_t num_seqs, float beam,
+                             float lattice_beam, int32_t max_active_states,
+                             int32_t min_active_states,
+                             int32_t persistent_capacity = 0);
+  ~OnlineIntersectDensePruned();
+
+  /*
+    Processes a chunk of neural-net output, with the frames of each of the
+    num_seqs sequences that follow those of the previous chunk, e.g. as
+    constructed from a tensor of nnet output.  As usual the last row of each
+    sequence in `chunk` is the final row: it is only used if the sequence ends
+    in this chunk, which is the case for sequences with fewer frames than the
+    longest ones in the chunk (these should have no frames in later chunks),
+    and for all sequences in the last chunk.  Causes one transfer from the
+    device per frame, as for IntersectDensePruned(), or one per chunk in the
+    persistent mode.
+   */
+  void AcceptChunk(DenseFsaVec &chunk);
+
+  /*
+    Returns the best path so far of each sequence: an array with num_seqs
+    rows and a column per frame processed so far, giving the index in a_fsas
+    (into a_fsas.values) of the arc on the path on that frame.  This is the
+    path to the best state on the latest frame; rows of sequences that have no
+    active states there (e.g. because they have ended) are all -1.
+   */
+  Array2<int32_t> BestPaths();
+
+  /*
+    Finishes decoding, after the last chunk.  `out` and `arc_map_a` are as
+    for IntersectDensePruned(); no other calls may be made after this.
+   */
+  void Finalize(FsaVec *out, Array1<int32_t> *arc_map_a);
+
+ private:
+  FsaVec a_fsas_;
+  std::unique_ptr<MultiGraphDenseIntersect> impl_;
+};
 
 }  // namespace k2
 
@@ -0,0 +1,1876 @@
+/**
+ * @brief
+ * fsa_algo_test
+ *
+ * @copyright
+ * Copyright (c)  2026  agent (agent@local)
+ *
+ * @copyright
+ * See LICENSE for clarification regarding multiple authors
+ */
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "k2/csrc/array.h"
+#include "k2/csrc/context.h"
+#include "k2/csrc/fsa.h"
+#include "k2/csrc/fsa_algo.h"
+#include "k2/csrc/rand.h"
+#include "k2/csrc/tensor.h"
+#include "k2/csrc/tensor_ops.h"
+#include "k2/csrc/test_utils.h"
+
+namespace k2 {
+
+// Checks that the arcs of `fsa` are `expected_arcs` and that `arc_map` maps
+// them to arcs of `src_arcs` with the same symbol and score (the states may
+// have been renumbered).
+static void CheckArcs(const Fsa &fsa, const Array1<int32_t> &arc_map,
+                         const std::vector<Arc> &src_arcs,
+                         const std::vector<Arc> &expected_arcs) {
+  ContextPtr cpu = GetCpuContext();
+  Array1<Arc> arcs = fsa.values.To(cpu);
+  Array1<int32_t> arc_map_cpu = arc_map.To(cpu);
+  ASSERT_EQ(arcs.Dim(), static_cast<int32_t>(expected_arcs.size()));
+  ASSERT_EQ(arc_map_cpu.Dim(), arcs.Dim());
+  for (int32_t i = 0; i != arcs.Dim(); ++i) {
+    EXPECT_EQ(arcs[i].src_state, expected_arcs[i].src_state);
+    EXPECT_EQ(arcs[i].dest_state, expected_arcs[i].dest_state);
+    EXPECT_EQ(arcs[i].symbol, expected_arcs[i].symbol);
+    EXPECT_EQ(arcs[i].score, expected_arcs[i].score);
+    const Arc &src_arc = src_arcs[arc_map_cpu[i]];
+    EXPECT_EQ(arcs[i].symbol, src_arc.symbol);
+    EXPECT_EQ(arcs[i].score, src_arc.score);
+  }
+}
+
+template <DeviceType d>
+void TestArcSort() {
+  ContextPtr cpu = GetCpuContext();
+  ContextPtr context = (d == kCpu ? cpu : GetCudaContext());
+  // The first FSA is not arc-sorted, and has two arcs with the same symbol
+  // leaving state 0; the second one is already sorted.
+  std::vector<int32_t> row_splits1_vec = {0, 3, 6},
+                       row_splits2_vec = {0, 3, 4, 4, 6, 7, 7};
+  std::vector<Arc> arcs_vec = {{0, 2, 3, 0.1}, {0, 1, 1, 0.2}, {0, 1, 3, 0.3},
+                               {1, 2, -1, 0.4}, {0, 1, 1, 0.5}, {0, 2, 2, 0.6},
+                               {1, 2, -1, 0.7}};
+  std::vector<Arc> sorted_arcs_vec = {
+      {0, 1, 1, 0.2}, {0, 1, 3, 0.3}, {0, 2, 3, 0.1}, {1, 2, -1, 0.4},
+      {0, 1, 1, 0.5}, {0, 2, 2, 0.6}, {1, 2, -1, 0.7}};
+  Array1<int32_t> row_splits1(context, row_splits1_vec),
+      row_splits2(context, row_splits2_vec);
+  RaggedShape shape =
+      RaggedShape3(&row_splits1, nullptr, -1, &row_splits2, nullptr, -1);
+  FsaVec fsas(shape, Array1<Arc>(context, arcs_vec));
+
+  {
+    FsaVec sorted;
+    Array1<int32_t> arc_map;
+    ArcSort(fsas, &sorted, &arc_map);
+    EXPECT_EQ(sorted.NumAxes(), 3);
+    CheckArcs(sorted, arc_map, arcs_vec, sorted_arcs_vec);
+    EXPECT_EQ(arc_map.To(cpu)[2], 0);
+
+    // Sorting again changes nothing.
+    FsaVec sorted2;
+    ArcSort(sorted, &sorted2, &arc_map);
+    CheckArcs(sorted2, arc_map, sorted_arcs_vec, sorted_arcs_vec);
+  }
+  {
+    // a single Fsa that is not sorted.
+    Fsa fsa = fsas.Index(0, 0), sorted;
+    Array1<int32_t> arc_map;
+    ArcSort(fsa, &sorted, &arc_map);
+    EXPECT_EQ(sorted.NumAxes(), 2);
+    std::vector<Arc> src_arcs(arcs_vec.begin(), arcs_vec.begin() + 4),
+        expected_arcs(sorted_arcs_vec.begin(), sorted_arcs_vec.begin() + 4);
+    CheckArcs(sorted, arc_map, src_arcs, expected_arcs);
+
+    ArcSort(&fsa);
+    CheckArcs(fsa, arc_map, src_arcs, expected_arcs);
+  }
+  {
+    // a single Fsa that is already sorted; arc_map is the identity.
+    Fsa fsa = fsas.Index(0, 1), sorted;
+    Array1<int32_t> arc_map;
+    ArcSort(fsa, &sorted, &arc_map);
+    std::vector<Arc> src_arcs(arcs_vec.begin() + 4, arcs_vec.end());
+    CheckArcs(sorted, arc_map, src_arcs, src_arcs);
+    Array1<int32_t> arc_map_cpu = arc_map.To(cpu);
+    for (int32_t i = 0; i != arc_map_cpu.Dim(); ++i)
+      EXPECT_EQ(arc_map_cpu[i], i);
+  }
+  {
+    // an FSA with no arcs.
+    Array1<int32_t> row_splits(context, std::vector<int32_t>{0, 0});
+    Fsa fsa(RaggedShape2(&row_splits, nullptr, 0), Array1<Arc>(context, 0)),
+        sorted;
+    Array1<int32_t> arc_map;
+    ArcSort(fsa, &sorted, &arc_map);
+    EXPECT_EQ(sorted.shape.Dim0(), 1);
+    EXPECT_EQ(sorted.values.Dim(), 0);
+    EXPECT_EQ(arc_map.Dim(), 0);
+  }
+}
+
+TEST(FsaAlgo, ArcSort) {
+  TestArcSort<kCpu>();
+  TestArcSort<kCuda>();
+}
+
+template <DeviceType d>
+void TestConnect() {
+  ContextPtr cpu = GetCpuContext();
+  ContextPtr context = (d == kCpu ? cpu : GetCudaContext());
+  // In the first FSA, state 2 can't reach the final state (4) and state 3 has
+  // no arcs; in the second one, state 1 is not accessible, and state 2 has a
+  // self-loop.
+  std::vector<int32_t> row_splits1_vec = {0, 5, 9},
+                       row_splits2_vec = {0, 2, 3, 4, 4, 4, 5, 6, 8, 8};
+  std::vector<Arc> arcs_vec = {{0, 1, 1, 0.1}, {0, 2, 2, 0.2}, {1, 4, -1, 0.3},
+                               {2, 3, 3, 0.4}, {0, 2, 1, 0.5}, {1, 2, 2, 0.6},
+                               {2, 2, 5, 0.7}, {2, 3, -1, 0.8}};
+  Array1<int32_t> row_splits1(context, row_splits1_vec),
+      row_splits2(context, row_splits2_vec);
+  RaggedShape shape =
+      RaggedShape3(&row_splits1, nullptr, -1, &row_splits2, nullptr, -1);
+  FsaVec fsas(shape, Array1<Arc>(context, arcs_vec));
+
+  FsaVec connected;
+  Array1<int32_t> arc_map;
+  EXPECT_TRUE(Connect(fsas, &connected, &arc_map));
+  ASSERT_EQ(connected.NumAxes(), 3);
+  std::vector<int32_t> expected_row_splits1 = {0, 3, 6},
+                       expected_row_splits2 = {0, 1, 2, 2, 3, 5, 5};
+  Array1<int32_t> connected_row_splits1 =
+                      connected.shape.RowSplits(1).To(cpu),
+                  connected_row_splits2 =
+                      connected.shape.RowSplits(2).To(cpu);
+  ASSERT_EQ(connected_row_splits1.Dim(), 3);
+  ASSERT_EQ(connected_row_splits2.Dim(), 7);
+  for (int32_t i = 0; i != 3; ++i)
+    EXPECT_EQ(connected_row_splits1[i], expected_row_splits1[i]);
+  for (int32_t i = 0; i != 7; ++i)
+    EXPECT_EQ(connected_row_splits2[i], expected_row_splits2[i]);
+  std::vector<Arc> expected_arcs = {{0, 1, 1, 0.1}, {1, 2, -1, 0.3},
+                                    {0, 1, 1, 0.5}, {1, 1, 5, 0.7},
+                                    {1, 2, -1, 0.8}};
+  CheckArcs(connected, arc_map, arcs_vec, expected_arcs);
+  std::vector<int32_t> expected_arc_map = {0, 2, 4, 6, 7};
+  Array1<int32_t> arc_map_cpu = arc_map.To(cpu);
+  for (int32_t i = 0; i != 5; ++i)
+    EXPECT_EQ(arc_map_cpu[i], expected_arc_map[i]);
+
+  // A single Fsa.
+  Fsa fsa = fsas.Index(0, 1), connected_fsa;
+  EXPECT_TRUE(Connect(fsa, &connected_fsa, &arc_map));
+  EXPECT_EQ(connected_fsa.NumAxes(), 2);
+  EXPECT_EQ(connected_fsa.shape.Dim0(), 3);
+  std::vector<Arc> src_arcs(arcs_vec.begin() + 4, arcs_vec.end());
+  expected_arcs.erase(expected_arcs.begin(), expected_arcs.begin() + 2);
+  CheckArcs(connected_fsa, arc_map, src_arcs, expected_arcs);
+
+  // An FSA whose final state can't be reached becomes empty.
+  Array1<int32_t> row_splits(context, std::vector<int32_t>{0, 1, 1, 1});
+  Fsa dead_end(RaggedShape2(&row_splits, nullptr, 1),
+               Array1<Arc>(context, std::vector<Arc>{{0, 1, 1, 0.1}}));
+  EXPECT_TRUE(Connect(dead_end, &connected_fsa, &arc_map));
+  EXPECT_EQ(connected_fsa.shape.Dim0(), 0);
+  EXPECT_EQ(connected_fsa.values.Dim(), 0);
+  EXPECT_EQ(arc_map.Dim(), 0);
+}
+
+TEST(FsaAlgo, Connect) {
+  TestConnect<kCpu>();
+  TestConnect<kCuda>();
+}
+
+// Checks that the properties `fsas` is known to have are those it has.
+static void CheckKnownProperties(FsaVec &fsas) {
+  int32_t known_properties = GetFsaVecKnownProperties(fsas);
+  // A copy of the arcs has nothing cached.
+  ContextPtr &c = fsas.Context();
+  Array1<Arc> arcs(c, fsas.values.Dim());
+  const Arc *src_data = static_cast<const Array1<Arc> &>(fsas.values).Data();
+  Arc *arcs_data = arcs.Data();
+  auto lambda_copy = [=] __host__ __device__(int32_t i) -> void {
+    arcs_data[i] = src_data[i];
+  };
+  Eval(c, arcs.Dim(), lambda_copy);
+  FsaVec copy(fsas.shape, arcs);
+  Array1<int32_t> properties;
+  int32_t tot_properties;
+  GetFsaVecBasicProperties(copy, &properties, &tot_properties);
+  EXPECT_EQ(known_properties & tot_properties, known_properties);
+}
+
+template <DeviceType d>
+void TestKnownProperties() {
+  ContextPtr context = (d == kCpu ? GetCpuContext() : GetCudaContext());
+  RandFsaVecOptions opts;
+  opts.num_fsas = 10;
+  opts.max_num_states = 20;
+  opts.seed = 3;
+  FsaVec fsas = RandFsaVec(context, opts), sorted, connected;
+  ArcSort(fsas, &sorted);
+  CheckKnownProperties(sorted);
+  EXPECT_TRUE(GetFsaVecKnownProperties(sorted) & kFsaPropertiesArcSorted);
+  // The input was acyclic and top-sorted, so the output of Connect() is too,
+  // and it's still arc-sorted.
+  EXPECT_TRUE(Connect(sorted, &connected));
+  CheckKnownProperties(connected);
+  int32_t expected_properties =
+      kFsaPropertiesArcSorted | kFsaPropertiesTopSortedAndAcyclic |
+      kFsaPropertiesMaybeAccessible | kFsaPropertiesMaybeCoaccessible;
+  EXPECT_EQ(GetFsaVecKnownProperties(connected) & expected_properties,
+            expected_properties);
+
+  opts.acyclic = false;
+  fsas = RandFsaVec(context, opts);
+  ArcSort(fsas, &sorted);
+  CheckKnownProperties(sorted);
+  EXPECT_FALSE(GetFsaVecKnownProperties(sorted) &
+               kFsaPropertiesTopSortedAndAcyclic);
+}
+
+TEST(FsaAlgo, KnownProperties) {
+  TestKnownProperties<kCpu>();
+  TestKnownProperties<kCuda>();
+}
+
+template <DeviceType d>
+void TestTopSort() {
+  ContextPtr cpu = GetCpuContext();
+  ContextPtr context = (d == kCpu ? cpu : GetCudaContext());
+  // The first FSA is acyclic but not top-sorted (state 2 has to come before
+  // state 1); the second one has a cycle.
+  std::vector<int32_t> row_splits1_vec = {0, 4, 7},
+                       row_splits2_vec = {0, 2, 3, 4, 4, 5, 7, 7};
+  std::vector<Arc> arcs_vec = {{0, 2, 1, 0.1}, {0, 1, 3, 0.2}, {1, 3, -1, 0.3},
+                               {2, 1, 2, 0.4}, {0, 1, 1, 0.5}, {1, 0, 2, 0.6},
+                               {1, 2, -1, 0.7}};
+  Array1<int32_t> row_splits1(context, row_splits1_vec),
+      row_splits2(context, row_splits2_vec);
+  RaggedShape shape =
+      RaggedShape3(&row_splits1, nullptr, -1, &row_splits2, nullptr, -1);
+  FsaVec fsas(shape, Array1<Arc>(context, arcs_vec));
+
+  FsaVec sorted;
+  Array1<char> is_cyclic;
+  Array1<int32_t> state_map, arc_map;
+  EXPECT_FALSE(TopSort(fsas, &sorted, &is_cyclic, &state_map, &arc_map));
+  Array1<char> is_cyclic_cpu = is_cyclic.To(cpu);
+  ASSERT_EQ(is_cyclic_cpu.Dim(), 2);
+  EXPECT_EQ(is_cyclic_cpu[0], 0);
+  EXPECT_EQ(is_cyclic_cpu[1], 1);
+
+  std::vector<int32_t> expected_state_map = {0, 2, 1, 3, 4, 5, 6},
+                       expected_arc_map = {0, 1, 3, 2, 4, 5, 6};
+  Array1<int32_t> state_map_cpu = state_map.To(cpu);
+  ASSERT_EQ(state_map_cpu.Dim(), 7);
+  for (int32_t i = 0; i != 7; ++i)
+    EXPECT_EQ(state_map_cpu[i], expected_state_map[i]);
+  std::vector<Arc> expected_arcs = {{0, 1, 1, 0.1}, {0, 2, 3, 0.2},
+                                    {1, 2, 2, 0.4}, {2, 3, -1, 0.3},
+                                    {0, 1, 1, 0.5}, {1, 0, 2, 0.6},
+                                    {1, 2, -1, 0.7}};
+  CheckArcs(sorted, arc_map, arcs_vec, expected_arcs);
+  Array1<int32_t> arc_map_cpu = arc_map.To(cpu);
+  for (int32_t i = 0; i != 7; ++i)
+    EXPECT_EQ(arc_map_cpu[i], expected_arc_map[i]);
+  Array1<int32_t> sorted_row_splits2 = sorted.shape.RowSplits(2).To(cpu);
+  std::vector<int32_t> expected_row_splits2 = {0, 2, 3, 4, 4, 5, 7, 7};
+  for (int32_t i = 0; i != 8; ++i)
+    EXPECT_EQ(sorted_row_splits2[i], expected_row_splits2[i]);
+
+  // Self-loops are not cycles.
+  std::vector<Arc> self_loop_arcs = {{0, 0, 1, 0.1}, {0, 1, -1, 0.2}};
+  Array1<int32_t> self_loop_row_splits(context, std::vector<int32_t>{0, 2, 2});
+  Fsa fsa(RaggedShape2(&self_loop_row_splits, nullptr, 2),
+          Array1<Arc>(context, self_loop_arcs));
+  FsaVec fsa_vec = FsaVecFromFsa(fsa);
+  EXPECT_TRUE(TopSort(fsa_vec, &sorted, &is_cyclic, &state_map, &arc_map));
+  EXPECT_EQ(is_cyclic.To(cpu)[0], 0);
+  CheckArcs(sorted, arc_map, self_loop_arcs, self_loop_arcs);
+}
+
+TEST(FsaAlgo, TopSort) {
+  TestTopSort<kCpu>();
+  TestTopSort<kCuda>();
+}
+
+template <DeviceType d>
+void TestIntersectDensePruned() {
+  ContextPtr cpu = GetCpuContext();
+  ContextPtr context = (d == kCpu ? cpu : GetCudaContext());
+  // The decoding graph, shared by both sequences, and 2 sequences with up
+  // to 2 frames and 3 symbols (including symbol 0); sequence 0 has 2 frames
+  // and sequence 1 has 1 frame.
+  FsaVec a_fsas = MakeTestGraph(context);
+  Tensor nnet_output = MakeTestNnetOutput(context);
+  Array2<int32_t> segments = MakeTestSegments({0, 2, 0, 1});
+  DenseFsaVec b_fsas(nnet_output, segments);
+
+  FsaVec out;
+  Array1<int32_t> arc_map_a, arc_map_b;
+  IntersectDensePruned(a_fsas, b_fsas, 10, 10, 1, &out, &arc_map_a,
+                       &arc_map_b);
+  ASSERT_EQ(out.shape.Dim0(), 2);
+  // The path 0 -> 1 -> 1 can't reach the final state, and no path of
+  // sequence 1 can, so its FSA is empty.
+  std::vector<Arc> expected_arcs = {
+      {0, 1, 1, -0.5}, {0, 1, 2, -2}, {1, 2, 2, -1}, {2, 3, -1, 0}};
+  Array1<Arc> out_arcs = out.values.To(cpu);
+  ASSERT_EQ(out_arcs.Dim(), 4);
+  for (int32_t i = 0; i != 4; ++i) {
+    EXPECT_EQ(out_arcs[i].src_state, expected_arcs[i].src_state);
+    EXPECT_EQ(out_arcs[i].dest_state, expected_arcs[i].dest_state);
+    EXPECT_EQ(out_arcs[i].symbol, expected_arcs[i].symbol);
+    EXPECT_FLOAT_EQ(out_arcs[i].score, expected_arcs[i].score);
+  }
+  Array1<int32_t> out_row_splits1 = out.shape.RowSplits(1).To(cpu),
+                  out_row_splits2 = out.shape.RowSplits(2).To(cpu);
+  std::vector<int32_t> expected_row_splits1 = {0, 4, 4},
+                       expected_row_splits2 = {0, 2, 3, 4, 4};
+  ASSERT_EQ(out_row_splits1.Dim(), 3);
+  for (int32_t i = 0; i != 3; ++i)
+    EXPECT_EQ(out_row_splits1[i], expected_row_splits1[i]);
+  ASSERT_EQ(out_row_splits2.Dim(), 5);
+  for (int32_t i = 0; i != 5; ++i)
+    EXPECT_EQ(out_row_splits2[i], expected_row_splits2[i]);
+
+  // arc_map_b indexes b_fsas.scores, which has a column for symbol -1.
+  std::vector<int32_t> expected_arc_map_a = {0, 1, 3, 4},
+                       expected_arc_map_b = {2, 3, 7, 8};
+  Array1<int32_t> arc_map_a_cpu = arc_map_a.To(cpu),
+                  arc_map_b_cpu = arc_map_b.To(cpu);
+  ASSERT_EQ(arc_map_a_cpu.Dim(), 4);
+  ASSERT_EQ(arc_map_b_cpu.Dim(), 4);
+  for (int32_t i = 0; i != 4; ++i) {
+    EXPECT_EQ(arc_map_a_cpu[i], expected_arc_map_a[i]);
+    EXPECT_EQ(arc_map_b_cpu[i], expected_arc_map_b[i]);
+  }
+
+  {
+    // With a lattice beam of 1, the path that starts with symbol 2 (whose
+    // score is 1.5 worse than the best path) is pruned.
+    FsaVec out2;
+    IntersectDensePrunedOptions opts;
+    opts.lattice_beam = 1;
+    IntersectDensePruned(a_fsas, b_fsas, 10, 10, 1, &out2, &arc_map_a, nullptr,
+                         opts);
+    std::vector<Arc> expected_arcs2 = {
+        {0, 1, 1, -0.5}, {1, 2, 2, -1}, {2, 3, -1, 0}};
+    std::vector<int32_t> expected_arc_map_a2 = {0, 3, 4};
+    Array1<Arc> out2_arcs = out2.values.To(cpu);
+    arc_map_a_cpu = arc_map_a.To(cpu);
+    ASSERT_EQ(out2_arcs.Dim(), 3);
+    ASSERT_EQ(arc_map_a_cpu.Dim(), 3);
+    for (int32_t i = 0; i != 3; ++i) {
+      EXPECT_EQ(out2_arcs[i].src_state, expected_arcs2[i].src_state);
+      EXPECT_EQ(out2_arcs[i].dest_state, expected_arcs2[i].dest_state);
+      EXPECT_FLOAT_EQ(out2_arcs[i].score, expected_arcs2[i].score);
+      EXPECT_EQ(arc_map_a_cpu[i], expected_arc_map_a2[i]);
+    }
+  }
+  {
+    // one decoding graph per sequence gives the same result.
+    Fsa fsa = a_fsas.Index(0, 0);
+    const Fsa *fsas[2] = {&fsa, &fsa};
+    FsaVec a_fsas2 = CreateFsaVec(fsa, 2, fsas);
+    FsaVec out2;
+    IntersectDensePruned(a_fsas2, b_fsas, 10, 10, 1, &out2, nullptr,
+                         nullptr);
+    ASSERT_EQ(out2.shape.Dim0(), 2);
+    Array1<Arc> out2_arcs = out2.values.To(cpu);
+    ASSERT_EQ(out2_arcs.Dim(), 4);
+    for (int32_t i = 0; i != 4; ++i) {
+      EXPECT_EQ(out2_arcs[i].dest_state, expected_arcs[i].dest_state);
+      EXPECT_FLOAT_EQ(out2_arcs[i].score, expected_arcs[i].score);
+    }
+  }
+  {
+    // A prepared graph, from a version of the graph with the arcs of state 0
+    // in the other order, gives the same result; arc_map_a refers to the
+    // graph before preparation.
+    std::vector<Arc> arcs2_vec = {{0, 1, 2, 0}, {0, 1, 1, 0.5}, {1, 1, 1, 0},
+                                  {1, 2, 2, 0}, {2, 3, -1, 0}};
+    Array1<int32_t> row_splits1_2(context,
+                                  std::vector<int32_t>{0, 2, 4, 5, 5});
+    Fsa fsa2(RaggedShape2(&row_splits1_2, nullptr, -1),
+             Array1<Arc>(context, arcs2_vec));
+    FsaVec a_fsas2 = FsaVecFromFsa(fsa2);
+    DenseIntersectGraph a_graph = PrepareDenseIntersectGraph(a_fsas2);
+    FsaVec out2;
+    IntersectDensePruned(a_graph, b_fsas, 10, 10, 1, &out2, &arc_map_a,
+                         &arc_map_b);
+    Array1<Arc> out2_arcs = out2.values.To(cpu);
+    ASSERT_EQ(out2_arcs.Dim(), 4);
+    std::vector<int32_t> expected_arc_map_a2 = {1, 0, 3, 4};
+    arc_map_a_cpu = arc_map_a.To(cpu);
+    arc_map_b_cpu = arc_map_b.To(cpu);
+    for (int32_t i = 0; i != 4; ++i) {
+      EXPECT_EQ(out2_arcs[i].symbol, expected_arcs[i].symbol);
+      EXPECT_FLOAT_EQ(out2_arcs[i].score, expected_arcs[i].score);
+      EXPECT_EQ(arc_map_a_cpu[i], expected_arc_map_a2[i]);
+      EXPECT_EQ(arc_map_b_cpu[i], expected_arc_map_b[i]);
+    }
+
+    // The derived structures are set up, on the requested context.
+    EXPECT_TRUE(a_graph.tot_properties & kFsaPropertiesValid);
+    EXPECT_EQ(a_graph.properties.Dim(), 1);
+    Ragged<int32_t> entering_arcs = a_graph.entering_arcs.To(cpu);
+    std::vector<int32_t> expected_entering = {0, 1, 2, 3, 4};
+    ASSERT_EQ(entering_arcs.shape.Dim0(), 4);
+    ASSERT_EQ(entering_arcs.values.Dim(), 5);
+    for (int32_t i = 0; i != 5; ++i)
+      EXPECT_EQ(entering_arcs.values[i], expected_entering[i]);
+    std::vector<int32_t> expected_entering_row_splits = {0, 0, 3, 4, 5};
+    for (int32_t i = 0; i != 5; ++i)
+      EXPECT_EQ(entering_arcs.shape.RowSplits(1)[i],
+                expected_entering_row_splits[i]);
+    DenseIntersectGraph cpu_graph = PrepareDenseIntersectGraph(a_fsas2, cpu);
+    EXPECT_TRUE(cpu_graph.fsas.Context()->IsCompatible(*cpu));
+    EXPECT_EQ(cpu_graph.soa.NumArcs(), 5);
+  }
+  {
+    // With the shorter sequence first, the frames can't drop the sequence
+    // that has ended; the result is the same with the FSAs swapped.
+    Array2<int32_t> segments2 = MakeTestSegments({0, 1, 0, 2});
+    DenseFsaVec b_fsas2(nnet_output, segments2);
+    FsaVec out2;
+    IntersectDensePruned(a_fsas, b_fsas2, 10, 10, 1, &out2, &arc_map_a,
+                         &arc_map_b);
+    Array1<int32_t> out2_row_splits1 = out2.shape.RowSplits(1).To(cpu);
+    ASSERT_EQ(out2_row_splits1.Dim(), 3);
+    EXPECT_EQ(out2_row_splits1[1], 0);
+    EXPECT_EQ(out2_row_splits1[2], 4);
+    std::vector<int32_t> expected_arc_map_b2 = {10, 11, 15, 16};
+    arc_map_a_cpu = arc_map_a.To(cpu);
+    arc_map_b_cpu = arc_map_b.To(cpu);
+    ASSERT_EQ(arc_map_a_cpu.Dim(), 4);
+    for (int32_t i = 0; i != 4; ++i) {
+      EXPECT_EQ(arc_map_a_cpu[i], expected_arc_map_a[i]);
+      EXPECT_EQ(arc_map_b_cpu[i], expected_arc_map_b2[i]);
+    }
+  }
+}
+
+template <DeviceType d>
+void TestIntersectDensePrunedMaxActive() {
+  ContextPtr cpu = GetCpuContext();
+  ContextPtr context = (d == kCpu ? cpu : GetCudaContext());
+  // State 0 has arcs to 3 different states; on the one frame, their scores
+  // are 0, -1 and -5.
+  std::vector<int32_t> row_splits1_vec = {0, 3, 4, 5, 6, 6};
+  std::vector<Arc> arcs_vec = {{0, 1, 0, 0},  {0, 2, 1, 0},  {0, 3, 2, 0},
+                               {1, 4, -1, 0}, {2, 4, -1, 0}, {3, 4, -1, 0}};
+  Array1<int32_t> row_splits1(context, row_splits1_vec);
+  Fsa fsa(RaggedShape2(&row_splits1, nullptr, -1),
+          Array1<Arc>(context, arcs_vec));
+  FsaVec a_fsas = FsaVecFromFsa(fsa);
+
+  Tensor nnet_output(cpu, kFloatDtype, std::vector<int32_t>{1, 1, 3});
+  std::vector<float> nnet_output_vec = {0, -1, -5};
+  std::copy(nnet_output_vec.begin(), nnet_output_vec.end(),
+            nnet_output.Data<float>());
+  nnet_output = nnet_output.To(context);
+  Array2<int32_t> segments(cpu, 1, 2);
+  segments.Data()[0] = 0;
+  segments.Data()[1] = 1;
+  DenseFsaVec b_fsas(nnet_output, segments);
+
+  FsaVec out;
+  IntersectDensePruned(a_fsas, b_fsas, 10, 10, 1, &out, nullptr, nullptr);
+  EXPECT_EQ(out.values.Dim(), 6);
+
+  // With max_active == 2, the beam is reduced so the arc with score -5 is
+  // pruned on the first frame.
+  Array1<int32_t> arc_map_a;
+  IntersectDensePruned(a_fsas, b_fsas, 10, 2, 1, &out, &arc_map_a, nullptr);
+  std::vector<Arc> expected_arcs = {
+      {0, 1, 0, 0}, {0, 2, 1, -1}, {1, 3, -1, 0}, {2, 3, -1, 0}};
+  Array1<Arc> out_arcs = out.values.To(cpu);
+  ASSERT_EQ(out_arcs.Dim(), 4);
+  for (int32_t i = 0; i != 4; ++i) {
+    EXPECT_EQ(out_arcs[i].src_state, expected_arcs[i].src_state);
+    EXPECT_EQ(out_arcs[i].dest_state, expected_arcs[i].dest_state);
+    EXPECT_EQ(out_arcs[i].symbol, expected_arcs[i].symbol);
+    EXPECT_FLOAT_EQ(out_arcs[i].score, expected_arcs[i].score);
+  }
+  std::vector<int32_t> expected_arc_map_a = {0, 1, 3, 4};
+  Array1<int32_t> arc_map_a_cpu = arc_map_a.To(cpu);
+  ASSERT_EQ(arc_map_a_cpu.Dim(), 4);
+  for (int32_t i = 0; i != 4; ++i)
+    EXPECT_EQ(arc_map_a_cpu[i], expected_arc_map_a[i]);
+}
+
+template <DeviceType d>
+void TestIntersectDensePrunedHalf() {
+  ContextPtr cpu = GetCpuContext();
+  ContextPtr context = (d == kCpu ? cpu : GetCudaContext());
+  // The nnet output of TestIntersectDensePruned(), but in half precision;
+  // its values are exact in half, so the result is the same as with float.
+  FsaVec a_fsas = MakeTestGraph(context);
+  Tensor nnet_output = MakeTestNnetOutput(context),
+         half_output = Cast(nnet_output, kHalfDtype);
+  Array2<int32_t> segments = MakeTestSegments({0, 2, 0, 1});
+  DenseFsaVec b_fsas(nnet_output, segments),
+      half_b_fsas(half_output, segments);
+  ASSERT_TRUE(half_b_fsas.HasHalfScores());
+
+  FsaVec out, half_out;
+  Array1<int32_t> arc_map_a, arc_map_b, half_arc_map_a, half_arc_map_b;
+  IntersectDensePruned(a_fsas, b_fsas, 10, 10, 1, &out, &arc_map_a,
+                       &arc_map_b);
+  IntersectDensePruned(a_fsas, half_b_fsas, 10, 10, 1, &half_out,
+                       &half_arc_map_a, &half_arc_map_b);
+  Array1<Arc> arcs = out.values.To(cpu), half_arcs = half_out.values.To(cpu);
+  ASSERT_GT(arcs.Dim(), 0);
+  ASSERT_EQ(half_arcs.Dim(), arcs.Dim());
+  Array1<int32_t> arc_map_b_cpu = arc_map_b.To(cpu),
+                  half_arc_map_b_cpu = half_arc_map_b.To(cpu);
+  for (int32_t i = 0; i != arcs.Dim(); ++i) {
+    EXPECT_EQ(half_arcs[i].src_state, arcs[i].src_state);
+    EXPECT_EQ(half_arcs[i].dest_state, arcs[i].dest_state);
+    EXPECT_EQ(half_arcs[i].symbol, arcs[i].symbol);
+    EXPECT_EQ(half_arcs[i].score, arcs[i].score);
+    EXPECT_EQ(half_arc_map_b_cpu[i], arc_map_b_cpu[i]);
+  }
+}
+
+template <DeviceType d>
+void TestIntersectDensePrunedSparse() {
+  ContextPtr cpu = GetCpuContext();
+  ContextPtr context = (d == kCpu ? cpu : GetCudaContext());
+  // The graph of TestIntersectDensePruned(), with 5 symbols in the nnet
+  // output of which the graph only uses 1 and 2.  Keeping the scores of the
+  // graph's symbols gives the same result as the dense scores.
+  FsaVec a_fsas = MakeTestGraph(context);
+  Tensor nnet_output =
+      MakeTestNnetOutput(context, 2, 5,
+                         {0, -1, -2, 1, 2,     // seq 0, frame 0
+                          0, -3, -1, 3, -5,    // seq 0, frame 1
+                          0, -1, -2, -4, 1,    // seq 1, frame 0
+                          0, -3, -1, 2, 2});   // seq 1, frame 1
+  Array2<int32_t> segments = MakeTestSegments({0, 2, 0, 1});
+  DenseFsaVec b_fsas(nnet_output, segments);
+  Array1<int32_t> keep_symbols(context, std::vector<int32_t>{-1, 1, 2});
+  DenseFsaVec sparse_b_fsas = SparsifyDenseFsaVec(b_fsas, 1, &keep_symbols);
+  ASSERT_TRUE(sparse_b_fsas.HasSparseScores());
+  EXPECT_EQ(sparse_b_fsas.sparse_scores.cols.Dim1(), 4);
+
+  FsaVec out, sparse_out;
+  Array1<int32_t> arc_map_a, arc_map_b, sparse_arc_map_a, sparse_arc_map_b;
+  IntersectDensePruned(a_fsas, b_fsas, 10, 10, 1, &out, &arc_map_a,
+                       &arc_map_b);
+  IntersectDensePruned(a_fsas, sparse_b_fsas, 10, 10, 1, &sparse_out,
+                       &sparse_arc_map_a, &sparse_arc_map_b);
+  Array1<Arc> arcs = out.values.To(cpu),
+              sparse_arcs = sparse_out.values.To(cpu);
+  ASSERT_GT(arcs.Dim(), 0);
+  ASSERT_EQ(sparse_arcs.Dim(), arcs.Dim());
+  Array1<int32_t> arc_map_b_cpu = arc_map_b.To(cpu),
+                  sparse_arc_map_b_cpu = sparse_arc_map_b.To(cpu);
+  for (int32_t i = 0; i != arcs.Dim(); ++i) {
+    EXPECT_EQ(sparse_arcs[i].src_state, arcs[i].src_state);
+    EXPECT_EQ(sparse_arcs[i].dest_state, arcs[i].dest_state);
+    EXPECT_EQ(sparse_arcs[i].symbol, arcs[i].symbol);
+    EXPECT_EQ(sparse_arcs[i].score, arcs[i].score);
+    EXPECT_EQ(sparse_arc_map_b_cpu[i], arc_map_b_cpu[i]);
+  }
+}
+
+template <DeviceType d>
+void TestIntersectDensePrunedBlankSkip() {
+  ContextPtr cpu = GetCpuContext();
+  ContextPtr context = (d == kCpu ? cpu : GetCudaContext());
+  // A CTC topology for symbol 1, where state 0 is for blank and state 1 for
+  // symbol 1.
+  std::vector<int32_t> row_splits1_vec = {0, 3, 6, 6};
+  std::vector<Arc> arcs_vec = {{0, 2, -1, 0}, {0, 0, 0, 0}, {0, 1, 1, 0},
+                               {1, 2, -1, 0}, {1, 0, 0, 0}, {1, 1, 1, 0}};
+  Array1<int32_t> row_splits1(context, row_splits1_vec);
+  Fsa fsa(RaggedShape2(&row_splits1, nullptr, -1),
+          Array1<Arc>(context, arcs_vec));
+  FsaVec a_fsas = FsaVecFromFsa(fsa);
+
+  // 2 sequences with 4 and 2 frames; blank has probability at least 0.95
+  // on frames 2 and 3 of sequence 0 and on both frames of sequence 1.
+  std::vector<float> probs = {0.9,  0.1,  0.1,  0.9,  0.98, 0.02,
+                              0.97, 0.03, 0.99, 0.01, 0.99, 0.01,
+                              0.5,  0.5,  0.5,  0.5};
+  Tensor nnet_output(cpu, kFloatDtype, std::vector<int32_t>{2, 4, 2});
+  float *nnet_output_data = nnet_output.Data<float>();
+  for (int32_t i = 0; i != 16; ++i) nnet_output_data[i] = std::log(probs[i]);
+  nnet_output = nnet_output.To(context);
+  Array2<int32_t> segments(cpu, 2, 2);
+  std::vector<int32_t> segments_vec = {0, 4, 0, 2};
+  std::copy(segments_vec.begin(), segments_vec.end(), segments.Data());
+  DenseFsaVec b_fsas(nnet_output, segments);
+
+  FsaVec out, skip_out;
+  Array1<int32_t> arc_map_a, arc_map_b;
+  int32_t num_skipped_frames = -1;
+  IntersectDensePrunedOptions opts;
+  opts.num_skipped_frames = &num_skipped_frames;
+  IntersectDensePruned(a_fsas, b_fsas, 10, 10, 1, &out, nullptr, nullptr,
+                       opts);
+  EXPECT_EQ(num_skipped_frames, 0);
+  opts.blank_threshold = 0.95;
+  IntersectDensePruned(a_fsas, b_fsas, 10, 10, 1, &skip_out, &arc_map_a,
+                       &arc_map_b, opts);
+  EXPECT_EQ(num_skipped_frames, 4);
+  ASSERT_EQ(skip_out.shape.Dim0(), 2);
+  Array1<Arc> arcs = out.values.To(cpu), skip_arcs = skip_out.values.To(cpu);
+  EXPECT_LT(skip_arcs.Dim(), arcs.Dim());
+
+  // Only blank arcs (and the final arcs) are on the skipped rows, i.e. rows
+  // 2 and 3 of sequence 0 and all of sequence 1 but its final row; the row
+  // of an arc is arc_map_b / 3, as b_fsas has 3 columns.
+  Array1<int32_t> arc_map_b_cpu = arc_map_b.To(cpu);
+  ASSERT_EQ(arc_map_b_cpu.Dim(), skip_arcs.Dim());
+  for (int32_t i = 0; i != skip_arcs.Dim(); ++i) {
+    int32_t row = arc_map_b_cpu[i] / 3;
+    bool skipped = (row == 2 || row == 3 || row == 5 || row == 6);
+    if (skipped) EXPECT_EQ(skip_arcs[i].symbol, 0);
+  }
+  // The paths of both sequences survive.
+  Array1<int32_t> out_row_splits1 = skip_out.shape.RowSplits(1).To(cpu);
+  EXPECT_GT(out_row_splits1[1], 0);
+  EXPECT_GT(out_row_splits1[2], out_row_splits1[1]);
+}
+
+template <DeviceType d>
+void TestIntersectDensePrunedStats() {
+  ContextPtr cpu = GetCpuContext();
+  ContextPtr context = (d == kCpu ? cpu : GetCudaContext());
+  // The CTC topology of TestIntersectDensePrunedBlankSkip().
+  std::vector<int32_t> row_splits1_vec = {0, 3, 6, 6};
+  std::vector<Arc> arcs_vec = {{0, 2, -1, 0}, {0, 0, 0, 0}, {0, 1, 1, 0},
+                               {1, 2, -1, 0}, {1, 0, 0, 0}, {1, 1, 1, 0}};
+  Array1<int32_t> row_splits1(context, row_splits1_vec);
+  Fsa fsa(RaggedShape2(&row_splits1, nullptr, -1),
+          Array1<Arc>(context, arcs_vec));
+  FsaVec a_fsas = FsaVecFromFsa(fsa);
+
+  // 2 sequences with 4 and 2 frames, i.e. 5 and 3 rows of b_fsas.
+  Tensor nnet_output(cpu, kFloatDtype, std::vector<int32_t>{2, 4, 2});
+  float *nnet_output_data = nnet_output.Data<float>();
+  for (int32_t i = 0; i != 16; ++i) nnet_output_data[i] = std::log(0.5);
+  nnet_output = nnet_output.To(context);
+  Array2<int32_t> segments(cpu, 2, 2);
+  std::vector<int32_t> segments_vec = {0, 4, 0, 2};
+  std::copy(segments_vec.begin(), segments_vec.end(), segments.Data());
+  DenseFsaVec b_fsas(nnet_output, segments);
+
+  // On each frame the blank arc and the arc for symbol 1 of each active
+  // state are kept, and on the last frame the two final arcs.
+  std::vector<int32_t> expected_counts = {1, 3, 2,  2, 6, 4,  2, 6, 4,
+                                          2, 6, 4,  2, 6, 2,  1, 3, 2,
+                                          2, 6, 4,  2, 6, 2};
+  DenseIntersectGraph graph = PrepareDenseIntersectGraph(a_fsas);
+  for (bool prepared : {false, true}) {
+    FsaVec out;
+    DenseIntersectStats stats;
+    IntersectDensePrunedOptions opts;
+    opts.stats = &stats;
+    if (prepared)
+      IntersectDensePruned(graph, b_fsas, 10, 10, 1, &out, nullptr, nullptr,
+                           opts);
+    else
+      IntersectDensePruned(a_fsas, b_fsas, 10, 10, 1, &out, nullptr, nullptr,
+                           opts);
+    ASSERT_EQ(stats.shape.Dim0(), 2);
+    Array1<int32_t> stats_row_splits = stats.shape.RowSplits(1).To(cpu);
+    EXPECT_EQ(stats_row_splits[1], 5);
+    EXPECT_EQ(stats_row_splits[2], 8);
+    ASSERT_EQ(stats.counts.Dim0(), 8);
+    ASSERT_EQ(stats.counts.Dim1(), kNumIntersectCounts);
+    Array2<int32_t> counts = stats.counts.To(cpu);
+    const int32_t *counts_data = counts.Data();
+    for (int32_t i = 0; i != 8 * kNumIntersectCounts; ++i)
+      EXPECT_EQ(counts_data[i], expected_counts[i]) << "i = " << i;
+    Array1<float> beams = stats.beams.To(cpu);
+    for (int32_t i = 0; i != 8; ++i) EXPECT_EQ(beams[i], 10);
+  }
+}
+
+TEST(FsaAlgo, IntersectDensePruned) {
+  TestIntersectDensePruned<kCpu>();
+  TestIntersectDensePruned<kCuda>();
+  TestIntersectDensePrunedMaxActive<kCpu>();
+  TestIntersectDensePrunedMaxActive<kCuda>();
+  TestIntersectDensePrunedHalf<kCpu>();
+  TestIntersectDensePrunedHalf<kCuda>();
+  TestIntersectDensePrunedSparse<kCpu>();
+  TestIntersectDensePrunedSparse<kCuda>();
+  TestIntersectDensePrunedBlankSkip<kCpu>();
+  TestIntersectDensePrunedBlankSkip<kCuda>();
+  TestIntersectDensePrunedStats<kCpu>();
+  TestIntersectDensePrunedStats<kCuda>();
+}
+
+template <DeviceType d>
+void TestCopyDenseIntersectGraph() {
+  ContextPtr cpu = GetCpuContext();
+  ContextPtr context = (d == kCpu ? cpu : GetCudaContext());
+  RandFsaVecOptions graph_opts;
+  graph_opts.max_num_states = 50;
+  graph_opts.acyclic = false;
+  graph_opts.num_symbols = 5;
+  graph_opts.seed = 27;
+  FsaVec graph_fsas = RandFsaVec(context, graph_opts);
+  RandDenseFsaVecOptions dense_opts;
+  dense_opts.num_seqs = 4;
+  dense_opts.max_num_frames = 20;
+  dense_opts.num_symbols = 5;
+  dense_opts.seed = 28;
+  DenseFsaVec dense = RandDenseFsaVec(context, dense_opts);
+
+  DenseIntersectGraph graph = PrepareDenseIntersectGraph(graph_fsas);
+  ContextPtr mapped = NewHostMappedContext(context);
+  DenseIntersectGraph copy = CopyDenseIntersectGraph(graph, mapped);
+  EXPECT_NE(copy.fsas.values.Data(), graph.fsas.values.Data());
+  EXPECT_NE(copy.soa.scores.Data(), graph.soa.scores.Data());
+  EXPECT_NE(copy.entering_arcs.values.Data(),
+            graph.entering_arcs.values.Data());
+  EXPECT_EQ(copy.fsas.values.Context(), mapped);
+
+  // The same lattices from the copy.
+  FsaVec out, ref_out;
+  Array1<int32_t> arc_map_a, arc_map_b, ref_arc_map_a, ref_arc_map_b;
+  IntersectDensePrunedOptions opts;
+  opts.lattice_beam = 5;
+  IntersectDensePruned(graph, dense, 10, 100, 1, &ref_out, &ref_arc_map_a,
+                       &ref_arc_map_b, opts);
+  IntersectDensePruned(copy, dense, 10, 100, 1, &out, &arc_map_a, &arc_map_b,
+                       opts);
+  ASSERT_EQ(out.values.Dim(), ref_out.values.Dim());
+  EXPECT_GT(out.values.Dim(), 0);
+  Array1<int32_t> a = arc_map_a.To(cpu), ref_a = ref_arc_map_a.To(cpu),
+                  b = arc_map_b.To(cpu), ref_b = ref_arc_map_b.To(cpu);
+  for (int32_t i = 0; i != a.Dim(); ++i) {
+    EXPECT_EQ(a[i], ref_a[i]);
+    EXPECT_EQ(b[i], ref_b[i]);
+  }
+}
+
+TEST(FsaAlgo, CopyDenseIntersectGraph) {
+  TestCopyDenseIntersectGraph<kCpu>();
+  TestCopyDenseIntersectGraph<kCuda>();
+}
+
+template <DeviceType d>
+void TestIntersectDensePrunedMaxBytes() {
+  ContextPtr cpu = GetCpuContext();
+  ContextPtr context = (d == kCpu ? cpu : GetCudaContext());
+  RandFsaVecOptions graph_opts;
+  graph_opts.num_fsas = 20;
+  graph_opts.max_num_states = 20;
+  graph_opts.acyclic = false;
+  graph_opts.num_symbols = 5;
+  graph_opts.seed = 17;
+  RandDenseFsaVecOptions dense_opts;
+  dense_opts.num_seqs = 20;
+  dense_opts.max_num_frames = 30;
+  dense_opts.num_symbols = 5;
+  dense_opts.seed = 18;
+  DenseFsaVec dense = RandDenseFsaVec(context, dense_opts);
+  for (int32_t num_graphs : {1, 20}) {
+    graph_opts.num_fsas = num_graphs;
+    FsaVec graphs = RandFsaVec(context, graph_opts);
+    std::vector<int64_t> bytes =
+        EstimateIntersectDensePrunedBytes(graphs, dense, 1000);
+    ASSERT_EQ(bytes.size(), 20);
+    int64_t tot_bytes = 0;
+    for (int64_t b : bytes) {
+      EXPECT_GT(b, 0);
+      tot_bytes += b;
+    }
+
+    FsaVec ref_out;
+    Array1<int32_t> ref_arc_map_a, ref_arc_map_b;
+    Array1<float> ref_tot_scores, ref_arc_posts;
+    IntersectDensePrunedOptions ref_opts;
+    ref_opts.lattice_beam = 5;
+    ref_opts.tot_scores = &ref_tot_scores;
+    ref_opts.arc_posts = &ref_arc_posts;
+    DenseIntersectStats ref_stats;
+    ref_opts.stats = &ref_stats;
+    IntersectDensePruned(graphs, dense, 10, 1000, 1, &ref_out, &ref_arc_map_a,
+                         &ref_arc_map_b, ref_opts);
+    for (int64_t max_bytes : {tot_bytes, tot_bytes / 4, int64_t(1)}) {
+      FsaVec out;
+      Array1<int32_t> arc_map_a, arc_map_b;
+      Array1<float> tot_scores, arc_posts;
+      std::vector<int32_t> batch_offsets;
+      IntersectDensePrunedOptions opts;
+      opts.lattice_beam = 5;
+      opts.max_bytes = max_bytes;
+      opts.tot_scores = &tot_scores;
+      opts.arc_posts = &arc_posts;
+      opts.batch_offsets = &batch_offsets;
+      DenseIntersectStats stats;
+      opts.stats = &stats;
+      IntersectDensePruned(graphs, dense, 10, 1000, 1, &out, &arc_map_a,
+                           &arc_map_b, opts);
+      ASSERT_GE(batch_offsets.size(), 2);
+      EXPECT_EQ(batch_offsets.front(), 0);
+      EXPECT_EQ(batch_offsets.back(), 20);
+      if (max_bytes == tot_bytes) EXPECT_EQ(batch_offsets.size(), 2);
+      if (max_bytes == 1) EXPECT_EQ(batch_offsets.size(), 21);
+      // The same lattices as for the whole batch.
+      FsaVec out_cpu = out.To(cpu), ref_out_cpu = ref_out.To(cpu);
+      ASSERT_EQ(out_cpu.shape.NumElements(), ref_out_cpu.shape.NumElements());
+      for (int32_t axis = 1; axis != 3; ++axis) {
+        Array1<int32_t> row_splits = out_cpu.shape.RowSplits(axis),
+                        ref_row_splits = ref_out_cpu.shape.RowSplits(axis);
+        ASSERT_EQ(row_splits.Dim(), ref_row_splits.Dim());
+        for (int32_t i = 0; i != row_splits.Dim(); ++i)
+          EXPECT_EQ(row_splits[i], ref_row_splits[i]);
+      }
+      Array1<int32_t> a = arc_map_a.To(cpu), ref_a = ref_arc_map_a.To(cpu),
+                      b = arc_map_b.To(cpu), ref_b = ref_arc_map_b.To(cpu);
+      Array1<float> posts = arc_posts.To(cpu),
+                    ref_posts = ref_arc_posts.To(cpu);
+      ASSERT_EQ(posts.Dim(), a.Dim());
+      for (int32_t i = 0; i != a.Dim(); ++i) {
+        EXPECT_EQ(a[i], ref_a[i]);
+        EXPECT_EQ(b[i], ref_b[i]);
+        EXPECT_EQ(out_cpu.values[i].dest_state,
+                  ref_out_cpu.values[i].dest_state);
+        EXPECT_NEAR(posts[i], ref_posts[i], 1.0e-3);
+      }
+      Array1<float> t = tot_scores.To(cpu), ref_t = ref_tot_scores.To(cpu);
+      ASSERT_EQ(t.Dim(), 20);
+      for (int32_t n = 0; n != 20; ++n) {
+        if (std::isinf(ref_t[n]))
+          EXPECT_EQ(t[n], ref_t[n]);
+        else
+          EXPECT_NEAR(t[n], ref_t[n], 1.0e-3);
+      }
+      // And the same statistics of the search.
+      Array2<int32_t> counts = stats.counts.To(cpu),
+                      ref_counts = ref_stats.counts.To(cpu);
+      Array1<float> beams = stats.beams.To(cpu),
+                    ref_beams = ref_stats.beams.To(cpu);
+      ASSERT_EQ(counts.Dim0(), ref_counts.Dim0());
+      ASSERT_EQ(beams.Dim(), ref_beams.Dim());
+      for (int32_t r = 0; r != counts.Dim0(); ++r) {
+        for (int32_t k = 0; k != kNumIntersectCounts; ++k)
+          EXPECT_EQ(counts.Data()[r * counts.ElemStride0() + k],
+                    ref_counts.Data()[r * ref_counts.ElemStride0() + k]);
+        EXPECT_EQ(beams[r], ref_beams[r]);
+      }
+    }
+  }
+}
+
+TEST(FsaAlgo, IntersectDensePrunedMaxBytes) {
+  TestIntersectDensePrunedMaxBytes<kCpu>();
+  TestIntersectDensePrunedMaxBytes<kCuda>();
+}
+
+TEST(FsaAlgo, IntersectDensePrunedCpu) {
+  ContextPtr cpu = GetCpuContext();
+  // The graph and nnet output of TestIntersectDensePruned(); the result is
+  // the same.
+  FsaVec a_fsas = MakeTestGraph(cpu);
+  DenseFsaVec b_fsas = MakeTestDenseFsaVec(cpu);
+
+  FsaVec out;
+  Array1<int32_t> arc_map_a, arc_map_b;
+  IntersectDensePrunedCpu(a_fsas, b_fsas, 10, &out, &arc_map_a, &arc_map_b);
+  std::vector<Arc> expected_arcs = {
+      {0, 1, 1, -0.5}, {0, 1, 2, -2}, {1, 2, 2, -1}, {2, 3, -1, 0}};
+  ASSERT_EQ(out.values.Dim(), 4);
+  for (int32_t i = 0; i != 4; ++i) {
+    EXPECT_EQ(out.values[i].src_state, expected_arcs[i].src_state);
+    EXPECT_EQ(out.values[i].dest_state, expected_arcs[i].dest_state);
+    EXPECT_EQ(out.values[i].symbol, expected_arcs[i].symbol);
+    EXPECT_FLOAT_EQ(out.values[i].score, expected_arcs[i].score);
+  }
+  std::vector<int32_t> expected_row_splits1 = {0, 4, 4},
+                       expected_row_splits2 = {0, 2, 3, 4, 4},
+                       expected_arc_map_a = {0, 1, 3, 4},
+                       expected_arc_map_b = {2, 3, 7, 8};
+  ASSERT_EQ(out.shape.RowSplits(1).Dim(), 3);
+  for (int32_t i = 0; i != 3; ++i)
+    EXPECT_EQ(out.shape.RowSplits(1)[i], expected_row_splits1[i]);
+  ASSERT_EQ(out.shape.RowSplits(2).Dim(), 5);
+  for (int32_t i = 0; i != 5; ++i)
+    EXPECT_EQ(out.shape.RowSplits(2)[i], expected_row_splits2[i]);
+  for (int32_t i = 0; i != 4; ++i) {
+    EXPECT_EQ(arc_map_a[i], expected_arc_map_a[i]);
+    EXPECT_EQ(arc_map_b[i], expected_arc_map_b[i]);
+  }
+
+  // Without pruning, the same arcs as IntersectDensePruned() for a batch of
+  // random graphs (one per sequence) and sequences, up to their order.
+  RandFsaVecOptions graph_opts;
+  graph_opts.num_fsas = 30;
+  graph_opts.max_num_states = 20;
+  graph_opts.acyclic = false;
+  graph_opts.num_symbols = 5;
+  graph_opts.seed = 7;
+  FsaVec graphs = RandFsaVec(cpu, graph_opts);
+  RandDenseFsaVecOptions dense_opts;
+  dense_opts.num_seqs = 30;
+  dense_opts.max_num_frames = 30;
+  dense_opts.num_symbols = 5;
+  dense_opts.seed = 8;
+  DenseFsaVec dense = RandDenseFsaVec(cpu, dense_opts);
+  FsaVec ref_out;
+  Array1<int32_t> ref_arc_map_a, ref_arc_map_b;
+  IntersectDensePruned(graphs, dense, 1.0e4, 1000000, 1, &ref_out,
+                       &ref_arc_map_a, &ref_arc_map_b);
+  IntersectDensePrunedCpu(graphs, dense, 1.0e4, &out, &arc_map_a, &arc_map_b);
+  ASSERT_EQ(out.shape.Dim0(), 30);
+  ASSERT_EQ(out.values.Dim(), ref_out.values.Dim());
+  EXPECT_GT(out.values.Dim(), 0);
+  const int32_t *row_splits1_data = out.shape.RowSplits(1).Data(),
+                *row_splits2_data = out.shape.RowSplits(2).Data(),
+                *ref_row_splits1_data = ref_out.shape.RowSplits(1).Data(),
+                *ref_row_splits2_data = ref_out.shape.RowSplits(2).Data();
+  for (int32_t n = 0; n != 30; ++n) {
+    std::vector<std::pair<int32_t, int32_t>> arcs, ref_arcs;
+    for (int32_t i = row_splits2_data[row_splits1_data[n]];
+         i != row_splits2_data[row_splits1_data[n + 1]]; ++i)
+      arcs.emplace_back(arc_map_a[i], arc_map_b[i]);
+    for (int32_t i = ref_row_splits2_data[ref_row_splits1_data[n]];
+         i != ref_row_splits2_data[ref_row_splits1_data[n + 1]]; ++i)
+      ref_arcs.emplace_back(ref_arc_map_a[i], ref_arc_map_b[i]);
+    std::sort(arcs.begin(), arcs.end());
+    std::sort(ref_arcs.begin(), ref_arcs.end());
+    EXPECT_EQ(arcs, ref_arcs);
+  }
+}
+
+template <DeviceType d>
+void TestOnlineIntersectDensePruned() {
+  ContextPtr cpu = GetCpuContext();
+  ContextPtr context = (d == kCpu ? cpu : GetCudaContext());
+  // The same graph and nnet output as in TestIntersectDensePruned(), with
+  // one frame per chunk; sequence 1 ends in the second chunk.
+  FsaVec a_fsas = MakeTestGraph(context);
+
+  OnlineIntersectDensePruned decoder(a_fsas, 2, 10, 10, 10, 1);
+  std::vector<std::vector<float>> chunks_vec = {{0, -1, -2, 0, -1, -2},
+                                                {0, -3, -1, 0, -3, -1}};
+  std::vector<std::vector<int32_t>> segments_vec = {{0, 1, 0, 1},
+                                                    {0, 1, 0, 0}};
+  // after each chunk, the rows of BestPaths() (of all sequences) one after
+  // the other.
+  std::vector<std::vector<int32_t>> expected_paths = {{0, 0}, {0, 3, -1, -1}};
+  for (int32_t i = 0; i != 2; ++i) {
+    Tensor chunk_output(cpu, kFloatDtype, std::vector<int32_t>{2, 1, 3});
+    std::copy(chunks_vec[i].begin(), chunks_vec[i].end(),
+              chunk_output.Data<float>());
+    chunk_output = chunk_output.To(context);
+    Array2<int32_t> segments(cpu, 2, 2);
+    std::copy(segments_vec[i].begin(), segments_vec[i].end(),
+              segments.Data());
+    DenseFsaVec chunk(chunk_output, segments);
+    decoder.AcceptChunk(chunk);
+
+    Array2<int32_t> paths = decoder.BestPaths().To(cpu);
+    ASSERT_EQ(paths.Dim0(), 2);
+    ASSERT_EQ(paths.Dim1(), i + 1);
+    for (int32_t n = 0; n != 2; ++n) {
+      for (int32_t t = 0; t <= i; ++t)
+        EXPECT_EQ(paths.Data()[n * paths.ElemStride0() + t],
+                  expected_paths[i][n * (i + 1) + t]);
+    }
+  }
+
+  FsaVec out;
+  Array1<int32_t> arc_map_a;
+  decoder.Finalize(&out, &arc_map_a);
+  ASSERT_EQ(out.shape.Dim0(), 2);
+  std::vector<Arc> expected_arcs = {
+      {0, 1, 1, -0.5}, {0, 1, 2, -2}, {1, 2, 2, -1}, {2, 3, -1, 0}};
+  Array1<Arc> out_arcs = out.values.To(cpu);
+  ASSERT_EQ(out_arcs.Dim(), 4);
+  for (int32_t i = 0; i != 4; ++i) {
+    EXPECT_EQ(out_arcs[i].src_state, expected_arcs[i].src_state);
+    EXPECT_EQ(out_arcs[i].dest_state, expected_arcs[i].dest_state);
+    EXPECT_EQ(out_arcs[i].symbol, expected_arcs[i].symbol);
+    EXPECT_FLOAT_EQ(out_arcs[i].score, expected_arcs[i].score);
+  }
+  EXPECT_EQ(out.shape.RowSplits(1).To(cpu)[2], 4);
+  std::vector<int32_t> expected_arc_map_a = {0, 1, 3, 4};
+  Array1<int32_t> arc_map_a_cpu = arc_map_a.To(cpu);
+  ASSERT_EQ(arc_map_a_cpu.Dim(), 4);
+  for (int32_t i = 0; i != 4; ++i)
+    EXPECT_EQ(arc_map_a_cpu[i], expected_arc_map_a[i]);
+}
+
+template <DeviceType d>
+void TestOnlineIntersectDensePrunedPersistent() {
+  ContextPtr cpu = GetCpuContext();
+  ContextPtr context = (d == kCpu ? cpu : GetCudaContext());
+  std::vector<int32_t> row_splits1_vec = {0, 4, 7, 10, 10};
+  std::vector<Arc> arcs_vec = {
+      {0, 0, 1, 0.1}, {0, 1, 2, -0.2}, {0, 2, 1, 0},    {0, 1, 1, -0.5},
+      {1, 1, 1, 0},   {1, 2, 2, -0.1}, {1, 0, 2, 0.3},  {2, 2, 2, 0},
+      {2, 0, 1, -0.4}, {2, 3, -1, 0}};
+  Array1<int32_t> row_splits1(context, row_splits1_vec);
+  Fsa fsa(RaggedShape2(&row_splits1, nullptr, -1),
+          Array1<Arc>(context, arcs_vec));
+  FsaVec a_fsas = FsaVecFromFsa(fsa);
+
+  // The usual mode; the persistent mode with enough room; and with so little
+  // room that, after the first chunk, the frames are decoded as usual.
+  std::vector<int32_t> capacities = {0, 64, 6};
+  std::vector<std::unique_ptr<OnlineIntersectDensePruned>> decoders;
+  for (int32_t capacity : capacities)
+    decoders.push_back(std::make_unique<OnlineIntersectDensePruned>(
+        a_fsas, 3, 10, 10, 4, 2, capacity));
+
+  // The numbers of frames of the 3 sequences in each chunk; sequence 1 ends
+  // in the third chunk.
+  std::vector<std::vector<int32_t>> chunk_lengths = {
+      {1, 1, 1}, {3, 3, 3}, {3, 1, 3}, {2, 0, 2}};
+  for (size_t c = 0; c != chunk_lengths.size(); ++c) {
+    Tensor chunk_output(cpu, kFloatDtype, std::vector<int32_t>{3, 3, 3});
+    float *data = chunk_output.Data<float>();
+    for (int32_t i = 0; i != 27; ++i)
+      data[i] = -0.5f * ((i * 7 + static_cast<int32_t>(c) * 3) % 5);
+    chunk_output = chunk_output.To(context);
+    Array2<int32_t> segments(cpu, 3, 2);
+    for (int32_t n = 0; n != 3; ++n) {
+      segments.Data()[n * 2] = 0;
+      segments.Data()[n * 2 + 1] = chunk_lengths[c][n];
+    }
+    std::vector<Array2<int32_t>> paths;
+    for (auto &decoder : decoders) {
+      DenseFsaVec chunk(chunk_output, segments);
+      decoder->AcceptChunk(chunk);
+      paths.push_back(decoder->BestPaths().To(cpu));
+    }
+    for (size_t k = 1; k != decoders.size(); ++k) {
+      ASSERT_EQ(paths[k].Dim0(), paths[0].Dim0());
+      ASSERT_EQ(paths[k].Dim1(), paths[0].Dim1());
+      for (int32_t n = 0; n != paths[0].Dim0(); ++n) {
+        for (int32_t t = 0; t != paths[0].Dim1(); ++t)
+          EXPECT_EQ(paths[k].Data()[n * paths[k].ElemStride0() + t],
+                    paths[0].Data()[n * paths[0].ElemStride0() + t]);
+      }
+    }
+  }
+
+  std::vector<Array1<Arc>> arcs;
+  std::vector<Array1<int32_t>> arc_maps;
+  for (auto &decoder : decoders) {
+    FsaVec out;
+    Array1<int32_t> arc_map_a;
+    decoder->Finalize(&out, &arc_map_a);
+    ASSERT_EQ(out.shape.Dim0(), 3);
+    arcs.push_back(out.values.To(cpu));
+    arc_maps.push_back(arc_map_a.To(cpu));
+  }
+  ASSERT_GT(arcs[0].Dim(), 0);
+  for (size_t k = 1; k != decoders.size(); ++k) {
+    ASSERT_EQ(arcs[k].Dim(), arcs[0].Dim());
+    for (int32_t i = 0; i != arcs[0].Dim(); ++i) {
+      EXPECT_EQ(arcs[k][i].src_state, arcs[0][i].src_state);
+      EXPECT_EQ(arcs[k][i].dest_state, arcs[0][i].dest_state);
+      EXPECT_EQ(arcs[k][i].symbol, arcs[0][i].symbol);
+      EXPECT_EQ(arcs[k][i].score, arcs[0][i].score);
+      EXPECT_EQ(arc_maps[k][i], arc_maps[0][i]);
+    }
+  }
+}
+
+// The persistent mode must not sync on each frame.
+template <DeviceType d>
+void TestOnlineIntersectDensePrunedSyncs() {
+  ContextPtr cpu = GetCpuContext();
+  ContextPtr context = (d == kCpu ? cpu : GetCudaContext());
+  // The CTC topology of TestIntersectDensePrunedBlankSkip().
+  std::vector<int32_t> row_splits1_vec = {0, 3, 6, 6};
+  std::vector<Arc> arcs_vec = {{0, 2, -1, 0}, {0, 0, 0, 0}, {0, 1, 1, 0},
+                               {1, 2, -1, 0}, {1, 0, 0, 0}, {1, 1, 1, 0}};
+  Array1<int32_t> row_splits1(context, row_splits1_vec);
+  Fsa fsa(RaggedShape2(&row_splits1, nullptr, -1),
+          Array1<Arc>(context, arcs_vec));
+  FsaVec a_fsas = FsaVecFromFsa(fsa);
+
+  // For the usual and the persistent mode, the numbers of sync points in
+  // chunks of 2 and of 20 frames, after a first chunk.
+  std::vector<int32_t> capacities = {0, 64};
+  std::vector<std::vector<int64_t>> num_syncs;
+  for (int32_t capacity : capacities) {
+    OnlineIntersectDensePruned decoder(a_fsas, 2, 10, 10, 10, 1, capacity);
+    num_syncs.emplace_back();
+    for (int32_t num_frames : {1, 2, 20}) {
+      Tensor chunk_output(cpu, kFloatDtype,
+                          std::vector<int32_t>{2, num_frames, 2});
+      float *data = chunk_output.Data<float>();
+      for (int32_t i = 0; i != 4 * num_frames; ++i) data[i] = std::log(0.5);
+      chunk_output = chunk_output.To(context);
+      Array2<int32_t> segments(cpu, 2, 2);
+      std::vector<int32_t> segments_vec = {0, num_frames, 0, num_frames};
+      std::copy(segments_vec.begin(), segments_vec.end(), segments.Data());
+      DenseFsaVec chunk(chunk_output, segments);
+      SyncAudit audit;
+      decoder.AcceptChunk(chunk);
+      if (num_frames != 1) num_syncs.back().push_back(audit.NumSyncs());
+    }
+  }
+  EXPECT_EQ(num_syncs[1][1], num_syncs[1][0]);
+  if (d == kCuda) {
+    // The usual mode transfers the number of states on each frame.
+    EXPECT_GE(num_syncs[0][1] - num_syncs[0][0], 18);
+  } else {
+    // On the CPU only shape syncs are audited, and there are none.
+    EXPECT_EQ(num_syncs[0][1], 0);
+    EXPECT_EQ(num_syncs[1][1], 0);
+  }
+}
+
+TEST(FsaAlgo, OnlineIntersectDensePruned) {
+  TestOnlineIntersectDensePruned<kCpu>();
+  TestOnlineIntersectDensePruned<kCuda>();
+  TestOnlineIntersectDensePrunedPersistent<kCpu>();
+  TestOnlineIntersectDensePrunedPersistent<kCuda>();
+  TestOnlineIntersectDensePrunedSyncs<kCpu>();
+  TestOnlineIntersectDensePrunedSyncs<kCuda>();
+}
+
+
+template <DeviceType d>
+void TestIntersectDense() {
+  ContextPtr cpu = GetCpuContext();
+  ContextPtr context = (d == kCpu ? cpu : GetCudaContext());
+  // The same graph and nnet output as in TestIntersectDensePruned().
+  FsaVec a_fsas = MakeTestGraph(context);
+  DenseFsaVec b_fsas = MakeTestDenseFsaVec(context);
+
+  // Sequence 0 has two paths, with scores -1.5 and -3; sequence 1 has none.
+  FsaVec out;
+  Array1<int32_t> arc_map_a;
+  Array1<float> tot_scores, arc_posts;
+  IntersectDense(a_fsas, b_fsas, &out, &arc_map_a, nullptr, &tot_scores,
+                 &arc_posts);
+  std::vector<int32_t> expected_arc_map_a = {0, 1, 3, 4};
+  Array1<int32_t> arc_map_a_cpu = arc_map_a.To(cpu);
+  ASSERT_EQ(arc_map_a_cpu.Dim(), 4);
+  for (int32_t i = 0; i != 4; ++i)
+    EXPECT_EQ(arc_map_a_cpu[i], expected_arc_map_a[i]);
+
+  double tot = std::log(std::exp(-1.5) + std::exp(-3.0));
+  Array1<float> tot_scores_cpu = tot_scores.To(cpu);
+  ASSERT_EQ(tot_scores_cpu.Dim(), 2);
+  EXPECT_NEAR(tot_scores_cpu[0], tot, 1.0e-05);
+  EXPECT_EQ(tot_scores_cpu[1], -std::numeric_limits<float>::infinity());
+
+  std::vector<double> expected_arc_posts = {
+      std::exp(-1.5 - tot), std::exp(-3.0 - tot), 1.0, 1.0};
+  Array1<float> arc_posts_cpu = arc_posts.To(cpu);
+  ASSERT_EQ(arc_posts_cpu.Dim(), 4);
+  for (int32_t i = 0; i != 4; ++i)
+    EXPECT_NEAR(arc_posts_cpu[i], expected_arc_posts[i], 1.0e-05);
+
+  {
+    // The sums are over the pruned lattice, which with a lattice beam of 1
+    // only has the best path.
+    IntersectDensePrunedOptions opts;
+    opts.lattice_beam = 1;
+    opts.tot_scores = &tot_scores;
+    opts.arc_posts = &arc_posts;
+    IntersectDensePruned(a_fsas, b_fsas, 10, 10, 1, &out, nullptr, nullptr,
+                         opts);
+    tot_scores_cpu = tot_scores.To(cpu);
+    EXPECT_NEAR(tot_scores_cpu[0], -1.5, 1.0e-05);
+    arc_posts_cpu = arc_posts.To(cpu);
+    ASSERT_EQ(arc_posts_cpu.Dim(), 3);
+    for (int32_t i = 0; i != 3; ++i)
+      EXPECT_NEAR(arc_posts_cpu[i], 1.0, 1.0e-05);
+  }
+}
+
+TEST(FsaAlgo, IntersectDense) {
+  TestIntersectDense<kCpu>();
+  TestIntersectDense<kCuda>();
+}
+
+template <DeviceType d>
+void TestBackpropTotScores() {
+  ContextPtr cpu = GetCpuContext();
+  ContextPtr context = (d == kCpu ? cpu : GetCudaContext());
+  // The same graph as in TestIntersectDense(); both sequences have the nnet
+  // output of its sequence 0, sequence 0 starting at frame 1.
+  FsaVec a_fsas = MakeTestGraph(context);
+  Tensor nnet_output =
+      MakeTestNnetOutput(context, 3, 3,
+                         {-5, -5, -5, 0, -1, -2, 0, -3, -1,    // seq 0
+                          0, -1, -2, 0, -3, -1, -5, -5, -5});  // seq 1
+  Array2<int32_t> segments = MakeTestSegments({1, 2, 0, 2});
+  DenseFsaVec b_fsas(nnet_output, segments);
+
+  FsaVec out;
+  Array1<int32_t> arc_map_b;
+  Array1<float> tot_scores, arc_posts;
+  IntersectDense(a_fsas, b_fsas, &out, nullptr, &arc_map_b, &tot_scores,
+                 &arc_posts);
+  Array1<int32_t> nnet_arc_map =
+      ArcMapBToNnetOutput(b_fsas, segments, 3, arc_map_b);
+  // The arcs of each sequence use symbols 1 or 2 on the first frame, then 2
+  // and the final symbol.
+  std::vector<int32_t> expected_nnet_arc_map = {4, 5, 8, -1,
+                                                10, 11, 14, -1};
+  Array1<int32_t> nnet_arc_map_cpu = nnet_arc_map.To(cpu);
+  ASSERT_EQ(nnet_arc_map_cpu.Dim(), 8);
+  for (int32_t i = 0; i != 8; ++i)
+    EXPECT_EQ(nnet_arc_map_cpu[i], expected_nnet_arc_map[i]);
+
+  std::vector<float> tot_scores_grad_vec = {1, 2};
+  Array1<float> tot_scores_grad(context, tot_scores_grad_vec);
+  Array1<float> grad =
+      BackpropTotScores(nnet_arc_map, arc_posts, tot_scores_grad, 3, 3);
+  double tot = std::log(std::exp(-1.5) + std::exp(-3.0)),
+         p1 = std::exp(-1.5 - tot), p2 = std::exp(-3.0 - tot);
+  std::vector<double> expected_grad = {0, 0, 0, 0, p1, p2, 0, 0, 1,
+                                       0, 2 * p1, 2 * p2, 0, 0, 2, 0, 0, 0};
+  Array1<float> grad_cpu = grad.To(cpu);
+  ASSERT_EQ(grad_cpu.Dim(), 18);
+  for (int32_t i = 0; i != 18; ++i)
+    EXPECT_NEAR(grad_cpu[i], expected_grad[i], 1.0e-05);
+}
+
+TEST(FsaAlgo, BackpropTotScores) {
+  TestBackpropTotScores<kCpu>();
+  TestBackpropTotScores<kCuda>();
+}
+
+// Checks that the arcs of `fsas` are `expected_arcs`, and the arc maps of an
+// intersection.
+static void CheckIntersection(const FsaVec &fsas,
+                              const Array1<int32_t> &arc_map_a,
+                              const Array1<int32_t> &arc_map_b,
+                              const std::vector<Arc> &expected_arcs,
+                              const std::vector<int32_t> &expected_arc_map_a,
+                              const std::vector<int32_t> &expected_arc_map_b) {
+  ContextPtr cpu = GetCpuContext();
+  Array1<Arc> arcs = fsas.values.To(cpu);
+  Array1<int32_t> arc_map_a_cpu = arc_map_a.To(cpu),
+                  arc_map_b_cpu = arc_map_b.To(cpu);
+  ASSERT_EQ(arcs.Dim(), static_cast<int32_t>(expected_arcs.size()));
+  ASSERT_EQ(arc_map_a_cpu.Dim(), arcs.Dim());
+  ASSERT_EQ(arc_map_b_cpu.Dim(), arcs.Dim());
+  for (int32_t i = 0; i != arcs.Dim(); ++i) {
+    EXPECT_EQ(arcs[i].src_state, expected_arcs[i].src_state);
+    EXPECT_EQ(arcs[i].dest_state, expected_arcs[i].dest_state);
+    EXPECT_EQ(arcs[i].symbol, expected_arcs[i].symbol);
+    EXPECT_EQ(arcs[i].score, expected_arcs[i].score);
+    EXPECT_EQ(arc_map_a_cpu[i], expected_arc_map_a[i]);
+    EXPECT_EQ(arc_map_b_cpu[i], expected_arc_map_b[i]);
+  }
+}
+
+template <DeviceType d>
+void TestIntersect() {
+  ContextPtr cpu = GetCpuContext();
+  ContextPtr context = (d == kCpu ? cpu : GetCudaContext());
+  // a_fsas has one FSA, which is intersected with both FSAs of b_fsas.  The
+  // second FSA of b_fsas accepts any sequence of 1s and 2s.
+  std::vector<int32_t> a_row_splits1_vec = {0, 3},
+                       a_row_splits2_vec = {0, 2, 3, 3},
+                       b_row_splits1_vec = {0, 3, 5},
+                       b_row_splits2_vec = {0, 2, 3, 3, 6, 6};
+  std::vector<Arc> a_arcs_vec = {{0, 1, 1, 1}, {0, 1, 2, 2}, {1, 2, -1, 0}},
+                   b_arcs_vec = {{0, 1, 1, 10}, {0, 1, 3, 30}, {1, 2, -1, 0},
+                                 {0, 1, -1, 0},  {0, 0, 1, 0},  {0, 0, 2, 0}};
+  Array1<int32_t> a_row_splits1(context, a_row_splits1_vec),
+      a_row_splits2(context, a_row_splits2_vec),
+      b_row_splits1(context, b_row_splits1_vec),
+      b_row_splits2(context, b_row_splits2_vec);
+  FsaVec a_fsas(RaggedShape3(&a_row_splits1, nullptr, -1, &a_row_splits2,
+                             nullptr, -1),
+                Array1<Arc>(context, a_arcs_vec)),
+      b_fsas(RaggedShape3(&b_row_splits1, nullptr, -1, &b_row_splits2,
+                          nullptr, -1),
+             Array1<Arc>(context, b_arcs_vec));
+
+  FsaVec out;
+  Array1<int32_t> arc_map_a, arc_map_b;
+  EXPECT_TRUE(Intersect(a_fsas, b_fsas, &out, &arc_map_a, &arc_map_b));
+  std::vector<int32_t> expected_row_splits1 = {0, 3, 6},
+                       expected_arc_map_a = {0, 2, 0, 1, 2},
+                       expected_arc_map_b = {0, 2, 4, 5, 3};
+  std::vector<Arc> expected_arcs = {{0, 1, 1, 11}, {1, 2, -1, 0},
+                                    {0, 1, 1, 1},  {0, 1, 2, 2},
+                                    {1, 2, -1, 0}};
+  Array1<int32_t> out_row_splits1 = out.shape.RowSplits(1).To(cpu);
+  ASSERT_EQ(out_row_splits1.Dim(), 3);
+  for (int32_t i = 0; i != 3; ++i)
+    EXPECT_EQ(out_row_splits1[i], expected_row_splits1[i]);
+  CheckIntersection(out, arc_map_a, arc_map_b, expected_arcs,
+                    expected_arc_map_a, expected_arc_map_b);
+
+  {
+    // Epsilons in a_fsas: the arc from the epsilon has no arc in b_fsas.
+    Array1<int32_t> row_splits(context, std::vector<int32_t>{0, 1, 2, 3, 3});
+    Fsa fsa(RaggedShape2(&row_splits, nullptr, -1),
+            Array1<Arc>(context, std::vector<Arc>{{0, 1, 0, 1},
+                                                  {1, 2, 1, 0},
+                                                  {2, 3, -1, 0}}));
+    FsaVec eps_fsas = FsaVecFromFsa(fsa);
+    EXPECT_TRUE(Intersect(eps_fsas, b_fsas, &out, &arc_map_a, &arc_map_b));
+    expected_arcs = {{0, 1, 0, 1}, {1, 2, 1, 10}, {2, 3, -1, 0},
+                     {0, 1, 0, 1}, {1, 2, 1, 0},  {2, 3, -1, 0}};
+    expected_arc_map_a = {0, 1, 2, 0, 1, 2};
+    expected_arc_map_b = {-1, 0, 2, -1, 4, 3};
+    CheckIntersection(out, arc_map_a, arc_map_b, expected_arcs,
+                      expected_arc_map_a, expected_arc_map_b);
+  }
+
+  {
+    // With a beam of 10, the path with symbol 2 (score -20) is pruned.
+    Array1<int32_t> row_splits(context, std::vector<int32_t>{0, 2, 3, 4, 4});
+    Fsa fsa(RaggedShape2(&row_splits, nullptr, -1),
+            Array1<Arc>(context, std::vector<Arc>{{0, 1, 1, 0},
+                                                  {0, 2, 2, -20},
+                                                  {1, 3, -1, 0},
+                                                  {2, 3, -1, 0}}));
+    Fsa loop_fsa = b_fsas.Index(0, 1);
+    FsaVec pruned_fsas = FsaVecFromFsa(fsa),
+           loop_fsas = FsaVecFromFsa(loop_fsa);
+    EXPECT_TRUE(Intersect(pruned_fsas, loop_fsas, &out, &arc_map_a));
+    EXPECT_EQ(out.values.Dim(), 4);
+    EXPECT_TRUE(IntersectPruned(pruned_fsas, loop_fsas, 10, &out,
+                                &arc_map_a));
+    Array1<int32_t> arc_map_a_cpu = arc_map_a.To(cpu);
+    ASSERT_EQ(arc_map_a_cpu.Dim(), 2);
+    EXPECT_EQ(arc_map_a_cpu[0], 0);
+    EXPECT_EQ(arc_map_a_cpu[1], 2);
+  }
+
+  // Inputs that are not arc-sorted are rejected.
+  FsaVec unsorted = FsaVecFromFsa(a_fsas.Index(0, 0));
+  Array1<Arc> unsorted_arcs(context, std::vector<Arc>{{0, 1, 2, 2},
+                                                      {0, 1, 1, 1},
+                                                      {1, 2, -1, 0}});
+  unsorted.values = unsorted_arcs;
+  EXPECT_FALSE(Intersect(unsorted, b_fsas, &out));
+}
+
+TEST(FsaAlgo, Intersect) {
+  TestIntersect<kCpu>();
+  TestIntersect<kCuda>();
+}
+
+// Checks the arcs of the output of determinization or epsilon removal and
+// its arc_derivs.
+static void CheckDeterminized(
+    const FsaVec &fsas, Ragged<int32_t> &arc_derivs,
+    const Array1<float> &arc_deriv_values,
+    const std::vector<int32_t> &expected_row_splits1,
+    const std::vector<Arc> &expected_arcs,
+    const std::vector<std::vector<int32_t>> &expected_derivs,
+    const std::vector<std::vector<float>> &expected_deriv_values) {
+  ContextPtr cpu = GetCpuContext();
+  Array1<int32_t> row_splits1 = fsas.shape.RowSplits(1).To(cpu);
+  ASSERT_EQ(row_splits1.Dim(),
+            static_cast<int32_t>(expected_row_splits1.size()));
+  for (int32_t i = 0; i != row_splits1.Dim(); ++i)
+    EXPECT_EQ(row_splits1[i], expected_row_splits1[i]);
+  Array1<Arc> arcs = fsas.values.To(cpu);
+  ASSERT_EQ(arcs.Dim(), static_cast<int32_t>(expected_arcs.size()));
+  for (int32_t i = 0; i != arcs.Dim(); ++i) {
+    EXPECT_EQ(arcs[i].src_state, expected_arcs[i].src_state);
+    EXPECT_EQ(arcs[i].dest_state, expected_arcs[i].dest_state);
+    EXPECT_EQ(arcs[i].symbol, expected_arcs[i].symbol);
+    EXPECT_NEAR(arcs[i].score, expected_arcs[i].score, 1.0e-4);
+  }
+  Array1<int32_t> deriv_row_splits = arc_derivs.shape.RowSplits(1).To(cpu),
+                  derivs = arc_derivs.values.To(cpu);
+  Array1<float> deriv_values = arc_deriv_values.To(cpu);
+  ASSERT_EQ(deriv_row_splits.Dim(), arcs.Dim() + 1);
+  ASSERT_EQ(deriv_values.Dim(), derivs.Dim());
+  for (int32_t i = 0; i != arcs.Dim(); ++i) {
+    int32_t begin = deriv_row_splits[i], end = deriv_row_splits[i + 1];
+    ASSERT_EQ(end - begin, static_cast<int32_t>(expected_derivs[i].size()));
+    for (int32_t j = begin; j != end; ++j) {
+      EXPECT_EQ(derivs[j], expected_derivs[i][j - begin]);
+      EXPECT_NEAR(deriv_values[j], expected_deriv_values[i][j - begin],
+                  1.0e-4);
+    }
+  }
+}
+
+template <DeviceType d>
+void TestDeterminize() {
+  ContextPtr cpu = GetCpuContext();
+  ContextPtr context = (d == kCpu ? cpu : GetCudaContext());
+  // The first FSA has two paths with symbols (1, 2), the second one paths
+  // with symbols 3 and 4.
+  std::vector<int32_t> row_splits1_vec = {0, 5, 9},
+                       row_splits2_vec = {0, 2, 3, 4, 5, 5, 7, 8, 9, 9};
+  std::vector<Arc> arcs_vec = {{0, 1, 1, 1},   {0, 2, 1, 2},  {1, 3, 2, 5},
+                               {2, 3, 2, 1},   {3, 4, -1, 0}, {0, 1, 3, 0.5},
+                               {0, 2, 4, -20}, {1, 3, -1, 0}, {2, 3, -1, 0}};
+  Array1<int32_t> row_splits1(context, row_splits1_vec),
+      row_splits2(context, row_splits2_vec);
+  FsaVec fsas(RaggedShape3(&row_splits1, nullptr, -1, &row_splits2, nullptr,
+                           -1),
+              Array1<Arc>(context, arcs_vec));
+  float inf = std::numeric_limits<float>::infinity();
+
+  FsaVec out;
+  Ragged<int32_t> arc_derivs;
+  Array1<float> arc_deriv_values;
+  EXPECT_TRUE(DeterminizePrunedMax(fsas, inf, &out, &arc_derivs,
+                                   &arc_deriv_values));
+  // The best path with symbols (1, 2) has arcs 0 and 2, so the second arc's
+  // weight is 4, which is arcs 2 and 0 minus arc 1.
+  CheckDeterminized(out, arc_derivs, arc_deriv_values, {0, 4, 8},
+                    {{0, 1, 1, 2},
+                     {1, 2, 2, 4},
+                     {2, 3, -1, 0},
+                     {0, 1, 3, 0.5},
+                     {0, 2, 4, -20},
+                     {1, 3, -1, 0},
+                     {2, 3, -1, 0}},
+                    {{1}, {2, 0, 1}, {4}, {5}, {6}, {7}, {8}},
+                    {{1}, {1, 1, -1}, {1}, {1}, {1}, {1}, {1}});
+
+  // log(exp(4) + exp(1)), for the second arc, and the derivatives w.r.t. arcs
+  // 2 and 3.
+  float score = 4.0f + log1pf(expf(-3.0f)), deriv_2 = expf(4.0f - score),
+        deriv_3 = expf(1.0f - score);
+  EXPECT_TRUE(DeterminizePrunedLogSum(fsas, inf, &out, &arc_derivs,
+                                      &arc_deriv_values));
+  CheckDeterminized(out, arc_derivs, arc_deriv_values, {0, 4, 8},
+                    {{0, 1, 1, 2},
+                     {1, 2, 2, score},
+                     {2, 3, -1, 0},
+                     {0, 1, 3, 0.5},
+                     {0, 2, 4, -20},
+                     {1, 3, -1, 0},
+                     {2, 3, -1, 0}},
+                    {{1}, {2, 3}, {4}, {5}, {6}, {7}, {8}},
+                    {{1}, {deriv_2, deriv_3}, {1}, {1}, {1}, {1}, {1}});
+
+  // With a beam of 10, the path with symbol 4 is pruned.
+  EXPECT_TRUE(DeterminizePrunedMax(fsas, 10, &out, &arc_derivs,
+                                   &arc_deriv_values));
+  CheckDeterminized(out, arc_derivs, arc_deriv_values, {0, 4, 7},
+                    {{0, 1, 1, 2},
+                     {1, 2, 2, 4},
+                     {2, 3, -1, 0},
+                     {0, 1, 3, 0.5},
+                     {1, 2, -1, 0}},
+                    {{1}, {2, 0, 1}, {4}, {5}, {7}},
+                    {{1}, {1, 1, -1}, {1}, {1}, {1}});
+
+  // Inputs with epsilons are rejected.
+  Array1<int32_t> eps_row_splits(context, std::vector<int32_t>{0, 1, 2, 2});
+  Fsa eps_fsa(RaggedShape2(&eps_row_splits, nullptr, -1),
+              Array1<Arc>(context,
+                          std::vector<Arc>{{0, 1, 0, 1}, {1, 2, -1, 0}}));
+  FsaVec eps_fsas = FsaVecFromFsa(eps_fsa);
+  EXPECT_FALSE(DeterminizePrunedMax(eps_fsas, inf, &out));
+}
+
+TEST(FsaAlgo, Determinize) {
+  TestDeterminize<kCpu>();
+  TestDeterminize<kCuda>();
+}
+
+template <DeviceType d>
+void TestRemoveEpsilons() {
+  ContextPtr cpu = GetCpuContext();
+  ContextPtr context = (d == kCpu ? cpu : GetCudaContext());
+  // In the first FSA, states 1 and 2 are only entered by epsilon arcs; state
+  // 2 is reached from 0 directly (score 2) and through state 1 (1.5).  The
+  // second FSA has an epsilon arc into the state before the final one.
+  std::vector<int32_t> row_splits1_vec = {0, 5, 8},
+                       row_splits2_vec = {0, 2, 4, 5, 6, 6, 8, 9, 9};
+  std::vector<Arc> arcs_vec = {{0, 1, 0, 1},   {0, 2, 0, 2},   {1, 2, 0, 0.5},
+                               {1, 3, 5, 1},   {2, 3, 6, 3},   {3, 4, -1, 0},
+                               {0, 1, 0, 0.25}, {0, 1, 2, 1},  {1, 2, -1, 0}};
+  Array1<int32_t> row_splits1(context, row_splits1_vec),
+      row_splits2(context, row_splits2_vec);
+  FsaVec fsas(RaggedShape3(&row_splits1, nullptr, -1, &row_splits2, nullptr,
+                           -1),
+              Array1<Arc>(context, arcs_vec));
+  float inf = std::numeric_limits<float>::infinity();
+
+  FsaVec out;
+  Ragged<int32_t> arc_derivs;
+  Array1<float> arc_deriv_values;
+  EXPECT_TRUE(RemoveEpsilonsPrunedMax(fsas, inf, &out, &arc_derivs,
+                                      &arc_deriv_values));
+  CheckDeterminized(out, arc_derivs, arc_deriv_values, {0, 3, 6},
+                    {{0, 1, 5, 2},
+                     {0, 1, 6, 5},
+                     {1, 2, -1, 0},
+                     {0, 1, 2, 1},
+                     {0, 2, -1, 0.25},
+                     {1, 2, -1, 0}},
+                    {{0, 3}, {1, 4}, {5}, {7}, {6, 8}, {8}},
+                    {{1, 1}, {1, 1}, {1}, {1}, {1, 1}, {1}});
+
+  // log(exp(2) + exp(1.5)) for the epsilon paths from state 0 to 2, and the
+  // posteriors of arc 1 and of arcs 0 and 2.
+  float score = 2.0f + log1pf(expf(-0.5f)), post_1 = expf(2.0f - score),
+        post_0_2 = expf(1.5f - score);
+  EXPECT_TRUE(RemoveEpsilonsPrunedLogSum(fsas, inf, &out, &arc_derivs,
+                                         &arc_deriv_values));
+  CheckDeterminized(out, arc_derivs, arc_deriv_values, {0, 3, 6},
+                    {{0, 1, 5, 2},
+                     {0, 1, 6, score + 3},
+                     {1, 2, -1, 0},
+                     {0, 1, 2, 1},
+                     {0, 2, -1, 0.25},
+                     {1, 2, -1, 0}},
+                    {{0, 3}, {0, 1, 2, 4}, {5}, {7}, {6, 8}, {8}},
+                    {{1, 1}, {post_0_2, post_1, post_0_2, 1}, {1}, {1},
+                     {1, 1}, {1}});
+
+  // With a beam of 2, the path with symbol 5 (score 2, vs. 5) is pruned.
+  EXPECT_TRUE(RemoveEpsilonsPrunedMax(fsas, 2, &out, &arc_derivs,
+                                      &arc_deriv_values));
+  CheckDeterminized(out, arc_derivs, arc_deriv_values, {0, 3, 6},
+                    {{0, 1, 6, 5},
+                     {1, 2, -1, 0},
+                     {0, 1, 2, 1},
+                     {0, 2, -1, 0.25},
+                     {1, 2, -1, 0}},
+                    {{1, 4}, {5}, {7}, {6, 8}, {8}},
+                    {{1, 1}, {1}, {1}, {1, 1}, {1}});
+
+  // Inputs that are not top-sorted are rejected.
+  Array1<int32_t> cyclic_row_splits(context, std::vector<int32_t>{0, 1, 3, 3});
+  Fsa cyclic_fsa(RaggedShape2(&cyclic_row_splits, nullptr, -1),
+                 Array1<Arc>(context, std::vector<Arc>{{0, 1, 0, 1},
+                                                       {1, 0, 0, 1},
+                                                       {1, 2, -1, 0}}));
+  FsaVec cyclic_fsas = FsaVecFromFsa(cyclic_fsa);
+  EXPECT_FALSE(RemoveEpsilonsPrunedMax(cyclic_fsas, inf, &out));
+}
+
+TEST(FsaAlgo, RemoveEpsilons) {
+  TestRemoveEpsilons<kCpu>();
+  TestRemoveEpsilons<kCuda>();
+}
+
+template <DeviceType d>
+void TestShortestPath() {
+  ContextPtr cpu = GetCpuContext();
+  ContextPtr context = (d == kCpu ? cpu : GetCudaContext());
+  // The FSAs of TestRemoveEpsilons(), plus one whose final state can't be
+  // reached and an empty one.  The best path of the first FSA goes through
+  // state 2 directly (score 5, vs. 4.5 through state 1).
+  std::vector<int32_t> row_splits1_vec = {0, 5, 8, 11, 11},
+                       row_splits2_vec = {0, 2, 4, 5, 6, 6, 8, 9,
+                                          9, 10, 10, 10};
+  std::vector<Arc> arcs_vec = {{0, 1, 0, 1},   {0, 2, 0, 2},   {1, 2, 0, 0.5},
+                               {1, 3, 5, 1},   {2, 3, 6, 3},   {3, 4, -1, 0},
+                               {0, 1, 0, 0.25}, {0, 1, 2, 1},  {1, 2, -1, 0},
+                               {0, 1, 3, 1}};
+  Array1<int32_t> row_splits1(context, row_splits1_vec),
+      row_splits2(context, row_splits2_vec);
+  FsaVec fsas(RaggedShape3(&row_splits1, nullptr, -1, &row_splits2, nullptr,
+                           -1),
+              Array1<Arc>(context, arcs_vec));
+
+  FsaVec out;
+  Ragged<int32_t> best_arcs;
+  ShortestPath(fsas, &out, &best_arcs);
+  ASSERT_EQ(out.NumAxes(), 3);
+  ASSERT_EQ(out.shape.Dim0(), 4);
+  Array1<int32_t> out_row_splits1 = out.shape.RowSplits(1).To(cpu),
+                  out_row_splits2 = out.shape.RowSplits(2).To(cpu);
+  EXPECT_EQ(std::vector<int32_t>(out_row_splits1.Data(),
+                                 out_row_splits1.Data() + 5),
+            (std::vector<int32_t>{0, 4, 7, 7, 7}));
+  ASSERT_EQ(out_row_splits2.Dim(), 8);
+  EXPECT_EQ(std::vector<int32_t>(out_row_splits2.Data(),
+                                 out_row_splits2.Data() + 8),
+            (std::vector<int32_t>{0, 1, 2, 3, 3, 4, 5, 5}));
+  std::vector<Arc> expected_arcs = {{0, 1, 0, 2}, {1, 2, 6, 3}, {2, 3, -1, 0},
+                                    {0, 1, 2, 1}, {1, 2, -1, 0}};
+  Array1<Arc> arcs = out.values.To(cpu);
+  ASSERT_EQ(arcs.Dim(), static_cast<int32_t>(expected_arcs.size()));
+  for (int32_t i = 0; i != arcs.Dim(); ++i) {
+    EXPECT_EQ(arcs[i].src_state, expected_arcs[i].src_state);
+    EXPECT_EQ(arcs[i].dest_state, expected_arcs[i].dest_state);
+    EXPECT_EQ(arcs[i].symbol, expected_arcs[i].symbol);
+    EXPECT_EQ(arcs[i].score, expected_arcs[i].score);
+  }
+  ASSERT_EQ(best_arcs.shape.Dim0(), 4);
+  Array1<int32_t> best_row_splits = best_arcs.shape.RowSplits(1).To(cpu),
+                  best_values = best_arcs.values.To(cpu);
+  EXPECT_EQ(std::vector<int32_t>(best_row_splits.Data(),
+                                 best_row_splits.Data() + 5),
+            (std::vector<int32_t>{0, 3, 5, 5, 5}));
+  EXPECT_EQ(std::vector<int32_t>(best_values.Data(),
+                                 best_values.Data() + best_values.Dim()),
+            (std::vector<int32_t>{1, 4, 5, 7, 8}));
+
+  // The best path of a linear FSA is itself.
+  FsaVec out2;
+  Ragged<int32_t> best_arcs2;
+  ShortestPath(out, &out2, &best_arcs2);
+  Array1<int32_t> best_values2 = best_arcs2.values.To(cpu);
+  EXPECT_EQ(std::vector<int32_t>(best_values2.Data(),
+                                 best_values2.Data() + best_values2.Dim()),
+            (std::vector<int32_t>{0, 1, 2, 3, 4}));
+  EXPECT_EQ(out2.shape.TotSize(1), 7);
+}
+
+TEST(FsaAlgo, ShortestPath) {
+  TestShortestPath<kCpu>();
+  TestShortestPath<kCuda>();
+}
+
+template <DeviceType d>
+void TestNBestPaths() {
+  ContextPtr cpu = GetCpuContext();
+  ContextPtr context = (d == kCpu ? cpu : GetCudaContext());
+  // The FSAs of TestShortestPath().  The first FSA has three paths, with
+  // scores 5, 4.5 and 2, and the second two, with scores 1 and 0.25.
+  std::vector<int32_t> row_splits1_vec = {0, 5, 8, 11, 11},
+                       row_splits2_vec = {0, 2, 4, 5, 6, 6, 8, 9,
+                                          9, 10, 10, 10};
+  std::vector<Arc> arcs_vec = {{0, 1, 0, 1},   {0, 2, 0, 2},   {1, 2, 0, 0.5},
+                               {1, 3, 5, 1},   {2, 3, 6, 3},   {3, 4, -1, 0},
+                               {0, 1, 0, 0.25}, {0, 1, 2, 1},  {1, 2, -1, 0},
+                               {0, 1, 3, 1}};
+  Array1<int32_t> row_splits1(context, row_splits1_vec),
+      row_splits2(context, row_splits2_vec);
+  FsaVec fsas(RaggedShape3(&row_splits1, nullptr, -1, &row_splits2, nullptr,
+                           -1),
+              Array1<Arc>(context, arcs_vec));
+
+  struct Expected {
+    int32_t n;
+    std::vector<int32_t> row_splits1, row_splits2, arcs;
+    std::vector<float> scores;
+  };
+  std::vector<Expected> expected = {
+      {1, {0, 1, 2, 2, 2}, {0, 3, 5}, {1, 4, 5, 7, 8}, {5, 1}},
+      {2,
+       {0, 2, 4, 4, 4},
+       {0, 3, 7, 9, 11},
+       {1, 4, 5, 0, 2, 4, 5, 7, 8, 6, 8},
+       {5, 4.5, 1, 0.25}},
+      {10,
+       {0, 3, 5, 5, 5},
+       {0, 3, 7, 10, 12, 14},
+       {1, 4, 5, 0, 2, 4, 5, 0, 3, 5, 7, 8, 6, 8},
+       {5, 4.5, 2, 1, 0.25}}};
+  for (const Expected &e : expected) {
+    Ragged<int32_t> paths;
+    Array1<float> scores;
+    NBestPaths(fsas, e.n, &paths, &scores);
+    ASSERT_EQ(paths.NumAxes(), 3);
+    Array1<int32_t> paths_row_splits1 = paths.shape.RowSplits(1).To(cpu),
+                    paths_row_splits2 = paths.shape.RowSplits(2).To(cpu),
+                    arcs = paths.values.To(cpu);
+    Array1<float> scores_cpu = scores.To(cpu);
+    EXPECT_EQ(std::vector<int32_t>(
+                  paths_row_splits1.Data(),
+                  paths_row_splits1.Data() + paths_row_splits1.Dim()),
+              e.row_splits1);
+    EXPECT_EQ(std::vector<int32_t>(
+                  paths_row_splits2.Data(),
+                  paths_row_splits2.Data() + paths_row_splits2.Dim()),
+              e.row_splits2);
+    EXPECT_EQ(std::vector<int32_t>(arcs.Data(), arcs.Data() + arcs.Dim()),
+              e.arcs);
+    ASSERT_EQ(scores_cpu.Dim(), static_cast<int32_t>(e.scores.size()));
+    for (int32_t i = 0; i != scores_cpu.Dim(); ++i)
+      EXPECT_FLOAT_EQ(scores_cpu[i], e.scores[i]);
+  }
+}
+
+TEST(FsaAlgo, NBestPaths) {
+  TestNBestPaths<kCpu>();
+  TestNBestPaths<kCuda>();
+}
+
+template <DeviceType d>
+void TestExpandBigramPruned() {
+  ContextPtr cpu = GetCpuContext();
+  ContextPtr context = (d == kCpu ? cpu : GetCudaContext());
+  // In the first FSA the best path is arcs 0, 3, 5 (score 2); with arcs 1,
+  // 3, 5 it's 1.5, with 0, 4 it's 1 and with 2, 5 it's 0.  The final state of
+  // the second FSA can't be reached.
+  std::vector<int32_t> row_splits1_vec = {0, 4, 7},
+                       row_splits2_vec = {0, 3, 5, 6, 6, 7, 7, 7};
+  std::vector<Arc> arcs_vec = {{0, 1, 1, 1},  {0, 1, 2, 0.5}, {0, 2, 3, 0},
+                               {1, 2, 4, 1},  {1, 3, -1, 0},  {2, 3, -1, 0},
+                               {0, 1, 5, 1}};
+  Array1<int32_t> row_splits1(context, row_splits1_vec),
+      row_splits2(context, row_splits2_vec);
+  FsaVec fsas(RaggedShape3(&row_splits1, nullptr, -1, &row_splits2, nullptr,
+                           -1),
+              Array1<Arc>(context, arcs_vec));
+
+  struct Expected {
+    float beam;
+    std::vector<int32_t> row_splits1, row_splits2;
+    std::vector<Arc> arcs;
+    std::vector<int32_t> pairs;  // (arc, prev_arc) for each arc
+  };
+  float inf = std::numeric_limits<float>::infinity();
+  std::vector<Expected> expected = {
+      {inf,
+       {0, 6, 6},
+       {0, 3, 5, 7, 8, 9, 9},
+       {{0, 1, 1, 1},
+        {0, 2, 2, 0.5},
+        {0, 3, 3, 0},
+        {1, 4, 4, 1},
+        {1, 5, -1, 0},
+        {2, 4, 4, 1},
+        {2, 5, -1, 0},
+        {3, 5, -1, 0},
+        {4, 5, -1, 0}},
+       {0, -1, 1, -1, 2, -1, 3, 0, 4, 0, 3, 1, 4, 1, 5, 2, 5, 3}},
+      {0.6,
+       {0, 5, 5},
+       {0, 2, 3, 4, 5, 5},
+       {{0, 1, 1, 1},
+        {0, 2, 2, 0.5},
+        {1, 3, 4, 1},
+        {2, 3, 4, 1},
+        {3, 4, -1, 0}},
+       {0, -1, 1, -1, 3, 0, 3, 1, 5, 3}},
+      {0,
+       {0, 4, 4},
+       {0, 1, 2, 3, 3},
+       {{0, 1, 1, 1}, {1, 2, 4, 1}, {2, 3, -1, 0}},
+       {0, -1, 3, 0, 5, 3}}};
+  for (const Expected &e : expected) {
+    FsaVec out;
+    Array1<int32_t> arc_map;
+    Array2<int32_t> arc_pairs;
+    ExpandBigramPruned(fsas, e.beam, &out, &arc_map, &arc_pairs);
+    ASSERT_EQ(out.NumAxes(), 3);
+    Array1<int32_t> out_row_splits1 = out.shape.RowSplits(1).To(cpu),
+                    out_row_splits2 = out.shape.RowSplits(2).To(cpu),
+                    arc_map_cpu = arc_map.To(cpu);
+    EXPECT_EQ(std::vector<int32_t>(
+                  out_row_splits1.Data(),
+                  out_row_splits1.Data() + out_row_splits1.Dim()),
+              e.row_splits1);
+    EXPECT_EQ(std::vector<int32_t>(
+                  out_row_splits2.Data(),
+                  out_row_splits2.Data() + out_row_splits2.Dim()),
+              e.row_splits2);
+    Array1<Arc> arcs = out.values.To(cpu);
+    ASSERT_EQ(arcs.Dim(), static_cast<int32_t>(e.arcs.size()));
+    Array2<int32_t> pairs = arc_pairs.To(cpu);
+    ASSERT_EQ(pairs.Dim0(), arcs.Dim());
+    ASSERT_EQ(pairs.Dim1(), 2);
+    auto pairs_acc = pairs.Accessor();
+    for (int32_t i = 0; i != arcs.Dim(); ++i) {
+      EXPECT_EQ(arcs[i].src_state, e.arcs[i].src_state);
+      EXPECT_EQ(arcs[i].dest_state, e.arcs[i].dest_state);
+      EXPECT_EQ(arcs[i].symbol, e.arcs[i].symbol);
+      EXPECT_EQ(arcs[i].score, e.arcs[i].score);
+      EXPECT_EQ(pairs_acc(i, 0), e.pairs[2 * i]);
+      EXPECT_EQ(pairs_acc(i, 1), e.pairs[2 * i + 1]);
+      EXPECT_EQ(arc_map_cpu[i], e.pairs[2 * i]);
+    }
+  }
+}
+
+TEST(FsaAlgo, ExpandBigramPruned) {
+  TestExpandBigramPruned<kCpu>();
+  TestExpandBigramPruned<kCuda>();
+}
+
+template <DeviceType d>
+void TestPruneOnArcPost() {
+  ContextPtr cpu = GetCpuContext();
+  ContextPtr context = (d == kCpu ? cpu : GetCudaContext());
+  // The FSAs of TestExpandBigramPruned(), plus one with two states.  The
+  // best paths through arcs 0 to 5 have scores 2, 1.5, 0, 2, 1 and 2.
+  std::vector<int32_t> row_splits1_vec = {0, 4, 7, 9},
+                       row_splits2_vec = {0, 3, 5, 6, 6, 7, 7, 7, 8, 8};
+  std::vector<Arc> arcs_vec = {{0, 1, 1, 1},  {0, 1, 2, 0.5}, {0, 2, 3, 0},
+                               {1, 2, 4, 1},  {1, 3, -1, 0},  {2, 3, -1, 0},
+                               {0, 1, 5, 1},  {0, 1, -1, 3}};
+  Array1<int32_t> row_splits1(context, row_splits1_vec),
+      row_splits2(context, row_splits2_vec);
+  FsaVec fsas(RaggedShape3(&row_splits1, nullptr, -1, &row_splits2, nullptr,
+                           -1),
+              Array1<Arc>(context, arcs_vec));
+
+  struct Expected {
+    float beam;
+    std::vector<int32_t> row_splits1, row_splits2, arc_map;
+    std::vector<Arc> arcs;
+  };
+  std::vector<Expected> expected = {
+      {10,
+       {0, 4, 4, 6},
+       {0, 3, 5, 6, 6, 7, 7},
+       {0, 1, 2, 3, 4, 5, 7},
+       {{0, 1, 1, 1},
+        {0, 1, 2, 0.5},
+        {0, 2, 3, 0},
+        {1, 2, 4, 1},
+        {1, 3, -1, 0},
+        {2, 3, -1, 0},
+        {0, 1, -1, 3}}},
+      {0.6,
+       {0, 4, 4, 6},
+       {0, 2, 3, 4, 4, 5, 5},
+       {0, 1, 3, 5, 7},
+       {{0, 1, 1, 1},
+        {0, 1, 2, 0.5},
+        {1, 2, 4, 1},
+        {2, 3, -1, 0},
+        {0, 1, -1, 3}}}};
+  for (const Expected &e : expected) {
+    FsaVec out;
+    Array1<int32_t> arc_map;
+    PruneOnArcPost(fsas, e.beam, &out, &arc_map);
+    ASSERT_EQ(out.NumAxes(), 3);
+    Array1<int32_t> out_row_splits1 = out.shape.RowSplits(1).To(cpu),
+                    out_row_splits2 = out.shape.RowSplits(2).To(cpu),
+                    arc_map_cpu = arc_map.To(cpu);
+    EXPECT_EQ(std::vector<int32_t>(
+                  out_row_splits1.Data(),
+                  out_row_splits1.Data() + out_row_splits1.Dim()),
+              e.row_splits1);
+    EXPECT_EQ(std::vector<int32_t>(
+                  out_row_splits2.Data(),
+                  out_row_splits2.Data() + out_row_splits2.Dim()),
+              e.row_splits2);
+    EXPECT_EQ(std::vector<int32_t>(arc_map_cpu.Data(),
+                                   arc_map_cpu.Data() + arc_map_cpu.Dim()),
+              e.arc_map);
+    Array1<Arc> arcs = out.values.To(cpu);
+    ASSERT_EQ(arcs.Dim(), static_cast<int32_t>(e.arcs.size()));
+    for (int32_t i = 0; i != arcs.Dim(); ++i) {
+      EXPECT_EQ(arcs[i].src_state, e.arcs[i].src_state);
+      EXPECT_EQ(arcs[i].dest_state, e.arcs[i].dest_state);
+      EXPECT_EQ(arcs[i].symbol, e.arcs[i].symbol);
+      EXPECT_EQ(arcs[i].score, e.arcs[i].score);
+    }
+  }
+}
+
+TEST(FsaAlgo, PruneOnArcPost) {
+  TestPruneOnArcPost<kCpu>();
+  TestPruneOnArcPost<kCuda>();
+}
+
+}  // namespace k2
@@ -10,7 +10,13 @@
 
 #include <gtest/gtest.h>
 
+#include <algorithm>
+#include <limits>
+#include <vector>
+
+#include "k2/csrc/array_ops.h"
 #include "k2/csrc/fsa.h"
+#include "k2/csrc/tensor_ops.h"
 
 namespace k2 {
 
@@ -33,4 +39,696 @@ TEST(FsaPropertiesAsString, NonEmpty) {
       "\"Valid|TopSorted|Serializable\"");
 }
 
+template <DeviceType d>
+void TestShardFsaVec() {
+  ContextPtr cpu = GetCpuContext();
+  ContextPtr context = (d == kCpu ? cpu : GetCudaContext());
+  // 4 FSAs with 2, 1, 0 and 2 states, 3, 0, 0 and 3 arcs.
+  std::vector<int32_t> row_splits1_vec = {0, 2, 3, 3, 5},
+                       row_splits2_vec = {0, 2, 3, 3, 4, 6};
+  std::vector<Arc> arcs_vec = {{0, 1, 1, 0.1}, {0, 1, 2, 0.2}, {1, 2, -1, 0},
+                               {0, 1, 3, 0.3}, {0, 1, 4, 0.4}, {1, 2, -1, 0}};
+  Array1<int32_t> row_splits1(context, row_splits1_vec),
+      row_splits2(context, row_splits2_vec);
+  RaggedShape shape =
+      RaggedShape3(&row_splits1, nullptr, -1, &row_splits2, nullptr, -1);
+  FsaVec fsas(shape, Array1<Arc>(context, arcs_vec));
+
+  std::vector<ContextPtr> contexts = {context, context};
+  std::vector<int32_t> fsa_offsets;
+  std::vector<FsaVec> shards = ShardFsaVec(fsas, contexts, &fsa_offsets);
+  ASSERT_EQ(shards.size(), 2);
+  EXPECT_EQ(fsa_offsets, (std::vector<int32_t>{0, 1, 4}));
+  EXPECT_EQ(shards[0].shape.Dim0(), 1);
+  EXPECT_EQ(shards[0].values.Dim(), 3);
+  EXPECT_EQ(shards[1].shape.Dim0(), 3);
+
+  FsaVec shard1 = shards[1].To(cpu);
+  const int32_t *splits1 = shard1.shape.RowSplits(1).Data(),
+                *splits2 = shard1.shape.RowSplits(2).Data();
+  EXPECT_EQ(std::vector<int32_t>(splits1, splits1 + 4),
+            (std::vector<int32_t>{0, 1, 1, 3}));
+  EXPECT_EQ(std::vector<int32_t>(splits2, splits2 + 4),
+            (std::vector<int32_t>{0, 0, 1, 3}));
+  ASSERT_EQ(shard1.values.Dim(), 3);
+  for (int32_t i = 0; i != 3; ++i)
+    EXPECT_EQ(shard1.values.Data()[i].symbol, arcs_vec[i + 3].symbol);
+
+  // more shards than FSAs gives empty shards.
+  contexts.resize(6, context);
+  shards = ShardFsaVec(fsas, contexts, &fsa_offsets);
+  ASSERT_EQ(shards.size(), 6);
+  EXPECT_EQ(fsa_offsets.front(), 0);
+  EXPECT_EQ(fsa_offsets.back(), 4);
+  int32_t tot_arcs = 0;
+  for (auto &shard : shards) tot_arcs += shard.values.Dim();
+  EXPECT_EQ(tot_arcs, 6);
+}
+
+TEST(FsaVec, Shard) {
+  TestShardFsaVec<kCpu>();
+  TestShardFsaVec<kCuda>();
+}
+
+template <DeviceType d>
+void TestShardDenseFsaVec() {
+  ContextPtr cpu = GetCpuContext();
+  ContextPtr context = (d == kCpu ? cpu : GetCudaContext());
+  // 3 sequences with 4, 1 and 3 frames, and 2 columns.
+  std::vector<int32_t> row_splits1_vec = {0, 4, 5, 8};
+  Array1<int32_t> row_splits1(context, row_splits1_vec);
+  DenseFsaVec dense;
+  dense.shape = RaggedShape2(&row_splits1, nullptr, -1);
+  Array2<float> scores(cpu, 8, 2);
+  for (int32_t i = 0; i != 16; ++i) scores.Data()[i] = i;
+  dense.scores = scores.To(context);
+
+  std::vector<int32_t> fsa_offsets;
+  std::vector<DenseFsaVec> shards =
+      ShardDenseFsaVec(dense, {context, context}, &fsa_offsets);
+  ASSERT_EQ(shards.size(), 2);
+  EXPECT_EQ(fsa_offsets, (std::vector<int32_t>{0, 1, 3}));
+  EXPECT_EQ(shards[1].shape.Dim0(), 2);
+  Array2<float> shard1_scores = shards[1].scores.To(cpu);
+  ASSERT_EQ(shard1_scores.Dim0(), 4);
+  EXPECT_EQ(shard1_scores.Data()[0], 8);
+
+  // half-precision scores are sharded the same way.
+  DenseFsaVec half_dense;
+  half_dense.shape = dense.shape;
+  Array2<__half> half_scores(cpu, 8, 2);
+  for (int32_t i = 0; i != 16; ++i) half_scores.Data()[i] = __float2half(i);
+  half_dense.half_scores = half_scores.To(context);
+  shards = ShardDenseFsaVec(half_dense, {context, context});
+  ASSERT_EQ(shards.size(), 2);
+  ASSERT_TRUE(shards[1].HasHalfScores());
+  EXPECT_EQ(shards[1].NumCols(), 2);
+  Array2<__half> shard1_half_scores = shards[1].half_scores.To(cpu);
+  ASSERT_EQ(shard1_half_scores.Dim0(), 4);
+  EXPECT_EQ(__half2float(shard1_half_scores.Data()[0]), 8);
+}
+
+TEST(DenseFsaVec, Shard) {
+  TestShardDenseFsaVec<kCpu>();
+  TestShardDenseFsaVec<kCuda>();
+}
+
+template <DeviceType d>
+void TestSplitFsaVec() {
+  ContextPtr cpu = GetCpuContext();
+  ContextPtr context = (d == kCpu ? cpu : GetCudaContext());
+  // 4 FSAs with 2, 1, 0 and 2 states, 3, 0, 0 and 3 arcs.
+  std::vector<int32_t> row_splits1_vec = {0, 2, 3, 3, 5},
+                       row_splits2_vec = {0, 2, 3, 3, 4, 6};
+  std::vector<Arc> arcs_vec = {{0, 1, 1, 0.1}, {0, 1, 2, 0.2}, {1, 2, -1, 0},
+                               {0, 1, 3, 0.3}, {0, 1, 4, 0.4}, {1, 2, -1, 0}};
+  Array1<int32_t> row_splits1(context, row_splits1_vec),
+      row_splits2(context, row_splits2_vec);
+  RaggedShape shape =
+      RaggedShape3(&row_splits1, nullptr, -1, &row_splits2, nullptr, -1);
+  FsaVec fsas(shape, Array1<Arc>(context, arcs_vec));
+
+  std::vector<int32_t> arc_offsets;
+  std::vector<FsaVec> parts = SplitFsaVec(fsas, {0, 1, 1, 4}, &arc_offsets);
+  ASSERT_EQ(parts.size(), 3);
+  EXPECT_EQ(arc_offsets, (std::vector<int32_t>{0, 3, 3, 6}));
+  EXPECT_EQ(parts[0].shape.Dim0(), 1);
+  EXPECT_EQ(parts[1].shape.Dim0(), 0);
+  EXPECT_EQ(parts[2].shape.Dim0(), 3);
+  // The parts share the memory of `fsas`.
+  EXPECT_EQ(parts[2].values.Data(), fsas.values.Data() + 3);
+  FsaVec part2 = parts[2].To(cpu);
+  const int32_t *splits2 = part2.shape.RowSplits(2).Data();
+  EXPECT_EQ(std::vector<int32_t>(splits2, splits2 + 4),
+            (std::vector<int32_t>{0, 0, 1, 3}));
+
+  // 3 sequences with 4, 1 and 3 frames, and 2 columns.
+  std::vector<int32_t> dense_row_splits1_vec = {0, 4, 5, 8};
+  Array1<int32_t> dense_row_splits1(context, dense_row_splits1_vec);
+  DenseFsaVec dense;
+  dense.shape = RaggedShape2(&dense_row_splits1, nullptr, -1);
+  Array2<float> scores(cpu, 8, 2);
+  for (int32_t i = 0; i != 16; ++i) scores.Data()[i] = i;
+  dense.scores = scores.To(context);
+  std::vector<int32_t> row_offsets;
+  std::vector<DenseFsaVec> dense_parts =
+      SplitDenseFsaVec(dense, {0, 2, 3}, &row_offsets);
+  ASSERT_EQ(dense_parts.size(), 2);
+  EXPECT_EQ(row_offsets, (std::vector<int32_t>{0, 5, 8}));
+  EXPECT_EQ(dense_parts[0].shape.Dim0(), 2);
+  EXPECT_EQ(dense_parts[1].shape.Dim0(), 1);
+  EXPECT_EQ(dense_parts[1].NumRows(), 3);
+  Array2<float> part1_scores = dense_parts[1].scores.To(cpu);
+  ASSERT_EQ(part1_scores.Dim0(), 3);
+  EXPECT_EQ(part1_scores.Data()[0], 10);
+}
+
+TEST(FsaVec, Split) {
+  TestSplitFsaVec<kCpu>();
+  TestSplitFsaVec<kCuda>();
+}
+
+template <DeviceType d>
+void TestSortAndBucketFsas() {
+  ContextPtr cpu = GetCpuContext();
+  ContextPtr context = (d == kCpu ? cpu : GetCudaContext());
+  // 4 FSAs with 2, 1, 0 and 2 states, 3, 0, 0 and 3 arcs.
+  std::vector<int32_t> row_splits1_vec = {0, 2, 3, 3, 5},
+                       row_splits2_vec = {0, 2, 3, 3, 4, 6};
+  std::vector<Arc> arcs_vec = {{0, 1, 1, 0.1}, {0, 1, 2, 0.2}, {1, 2, -1, 0},
+                               {0, 1, 3, 0.3}, {0, 1, 4, 0.4}, {1, 2, -1, 0}};
+  Array1<int32_t> row_splits1(context, row_splits1_vec),
+      row_splits2(context, row_splits2_vec);
+  RaggedShape shape =
+      RaggedShape3(&row_splits1, nullptr, -1, &row_splits2, nullptr, -1);
+  FsaVec fsas(shape, Array1<Arc>(context, arcs_vec));
+
+  // 4 sequences with 2, 5, 1 and 3 frames, and 2 columns.
+  std::vector<int32_t> dense_row_splits1_vec = {0, 2, 7, 8, 11};
+  Array1<int32_t> dense_row_splits1(context, dense_row_splits1_vec);
+  DenseFsaVec dense;
+  dense.shape = RaggedShape2(&dense_row_splits1, nullptr, -1);
+  Array2<float> scores(cpu, 11, 2);
+  for (int32_t i = 0; i != 22; ++i) scores.Data()[i] = i;
+  dense.scores = scores.To(context);
+
+  std::vector<FsaVec> fsa_buckets;
+  std::vector<DenseFsaVec> dense_buckets;
+  Array1<int32_t> new2old;
+  std::vector<int32_t> offsets;
+  SortAndBucketFsas(fsas, dense, kFsaLengthFrames, 8, &fsa_buckets,
+                    &dense_buckets, &new2old, &offsets);
+  EXPECT_EQ(offsets, (std::vector<int32_t>{0, 2, 4}));
+  ASSERT_EQ(fsa_buckets.size(), 2);
+  ASSERT_EQ(dense_buckets.size(), 2);
+  Array1<int32_t> new2old_cpu = new2old.To(cpu);
+  EXPECT_EQ(std::vector<int32_t>(new2old_cpu.Data(), new2old_cpu.Data() + 4),
+            (std::vector<int32_t>{1, 3, 0, 2}));
+  Array1<int32_t> old2new = InvertPermutation(new2old).To(cpu);
+  EXPECT_EQ(std::vector<int32_t>(old2new.Data(), old2new.Data() + 4),
+            (std::vector<int32_t>{2, 0, 3, 1}));
+
+  FsaVec bucket0 = fsa_buckets[0].To(cpu);
+  const int32_t *splits1 = bucket0.shape.RowSplits(1).Data();
+  EXPECT_EQ(std::vector<int32_t>(splits1, splits1 + 3),
+            (std::vector<int32_t>{0, 1, 3}));
+  ASSERT_EQ(bucket0.values.Dim(), 3);
+  EXPECT_EQ(bucket0.values.Data()[0].symbol, 3);
+  EXPECT_EQ(fsa_buckets[1].values.Dim(), 3);
+
+  EXPECT_EQ(dense_buckets[0].shape.Dim0(), 2);
+  Array2<float> scores0 = dense_buckets[0].scores.To(cpu);
+  ASSERT_EQ(scores0.Dim0(), 8);
+  EXPECT_EQ(scores0.Data()[0], 4);  // row 2 of the original scores.
+  EXPECT_EQ(scores0.Data()[5 * scores0.ElemStride0()], 16);
+  Array2<float> scores1 = dense_buckets[1].scores.To(cpu);
+  ASSERT_EQ(scores1.Dim0(), 3);
+  EXPECT_EQ(scores1.Data()[0], 0);
+  EXPECT_EQ(scores1.Data()[2 * scores1.ElemStride0()], 14);
+
+  SortAndBucketFsas(fsas, dense, kFsaLengthArcs, 3, &fsa_buckets,
+                    &dense_buckets, &new2old, &offsets);
+  EXPECT_EQ(offsets, (std::vector<int32_t>{0, 1, 4}));
+  EXPECT_EQ(fsa_buckets[0].values.Dim(), 3);
+  EXPECT_EQ(fsa_buckets[1].values.Dim(), 3);
+}
+
+TEST(FsaVec, SortAndBucket) {
+  TestSortAndBucketFsas<kCpu>();
+  TestSortAndBucketFsas<kCuda>();
+}
+
+template <DeviceType d>
+void TestFsaVecFromArray1() {
+  ContextPtr cpu = GetCpuContext();
+  ContextPtr context = (d == kCpu ? cpu : GetCudaContext());
+  {
+    // 3 FSAs: with 3 states and 3 arcs; 3 states and 3 arcs, with no arcs
+    // entering the final state; and 2 states and 1 arc.
+    std::vector<Arc> arcs_vec = {{0, 1, 1, 0.1}, {0, 1, 2, 0.2},
+                                 {1, 2, -1, 0},  {0, 1, 3, 0.3},
+                                 {1, 1, 4, 0.4}, {1, 0, 5, 0.5},
+                                 {0, 1, -1, 0.6}};
+    Array1<Arc> arcs(context, arcs_vec);
+    bool error = true;
+    FsaVec fsas = FsaVecFromArray1(arcs, &error);
+    EXPECT_FALSE(error);
+    ASSERT_EQ(fsas.NumAxes(), 3);
+    EXPECT_EQ(fsas.shape.Dim0(), 3);
+    fsas = fsas.To(cpu);
+    const int32_t *splits1 = fsas.shape.RowSplits(1).Data(),
+                  *splits2 = fsas.shape.RowSplits(2).Data(),
+                  *ids1 = fsas.shape.RowIds(1).Data(),
+                  *ids2 = fsas.shape.RowIds(2).Data();
+    EXPECT_EQ(std::vector<int32_t>(splits1, splits1 + 4),
+              (std::vector<int32_t>{0, 3, 6, 8}));
+    EXPECT_EQ(std::vector<int32_t>(splits2, splits2 + 9),
+              (std::vector<int32_t>{0, 2, 3, 3, 4, 6, 6, 7, 7}));
+    EXPECT_EQ(std::vector<int32_t>(ids1, ids1 + 8),
+              (std::vector<int32_t>{0, 0, 0, 1, 1, 1, 2, 2}));
+    EXPECT_EQ(std::vector<int32_t>(ids2, ids2 + 7),
+              (std::vector<int32_t>{0, 0, 1, 3, 4, 4, 6}));
+    EXPECT_EQ(fsas.values.Dim(), 7);
+  }
+  {
+    // a final-arc that doesn't go to the last state.
+    std::vector<Arc> arcs_vec = {{0, 1, -1, 0}, {1, 2, -1, 0}};
+    Array1<Arc> arcs(context, arcs_vec);
+    bool error = false;
+    FsaVecFromArray1(arcs, &error);
+    EXPECT_TRUE(error);
+  }
+  {
+    // an arc that enters the final state without symbol -1.
+    std::vector<Arc> arcs_vec = {{0, 1, 1, 0}, {0, 2, 3, 0}, {1, 2, -1, 0}};
+    Array1<Arc> arcs(context, arcs_vec);
+    bool error = false;
+    FsaVecFromArray1(arcs, &error);
+    EXPECT_TRUE(error);
+  }
+}
+
+TEST(FsaVec, FromArray1) {
+  TestFsaVecFromArray1<kCpu>();
+  TestFsaVecFromArray1<kCuda>();
+}
+
+template <DeviceType d>
+void TestFsaVecFromArcs() {
+  ContextPtr cpu = GetCpuContext();
+  ContextPtr context = (d == kCpu ? cpu : GetCudaContext());
+  // 4 FSAs, the second of which is empty; the third starts with state 0
+  // like the last arc of the first, so FsaVecFromArray1() would not see
+  // where it starts.
+  std::vector<Arc> arcs_vec = {{0, 1, 1, 0.5}, {0, 2, -1, 0},
+                               {0, 1, -1, 1},  {0, 1, 2, 0},
+                               {0, 1, 3, 0},   {1, 2, -1, 0}};
+  std::vector<int32_t> arc_row_splits_vec = {0, 2, 2, 3, 6};
+  Array1<Arc> arcs(context, arcs_vec);
+  Array1<int32_t> arc_row_splits(context, arc_row_splits_vec);
+  bool error = true;
+  FsaVec fsas = FsaVecFromArcs(arcs, arc_row_splits, &error);
+  EXPECT_FALSE(error);
+  ASSERT_EQ(fsas.NumAxes(), 3);
+  EXPECT_EQ(fsas.shape.Dim0(), 4);
+  EXPECT_EQ(fsas.values.Data(), arcs.Data());
+  std::vector<int32_t> expected_row_splits1 = {0, 3, 3, 5, 8},
+                       expected_row_splits2 = {0, 2, 2, 2, 3, 3,
+                                               5, 6, 6};
+  Array1<int32_t> row_splits1 = fsas.shape.RowSplits(1).To(cpu),
+                  row_splits2 = fsas.shape.RowSplits(2).To(cpu);
+  ASSERT_EQ(row_splits1.Dim(), 5);
+  for (int32_t i = 0; i != 5; ++i)
+    EXPECT_EQ(row_splits1[i], expected_row_splits1[i]);
+  ASSERT_EQ(row_splits2.Dim(), 9);
+  for (int32_t i = 0; i != 9; ++i)
+    EXPECT_EQ(row_splits2[i], expected_row_splits2[i]);
+
+  {
+    // the src_states of an FSA must be non-decreasing.
+    std::vector<Arc> bad_arcs_vec = {{1, 2, -1, 0}, {0, 1, 1, 0}};
+    Array1<Arc> bad_arcs(context, bad_arcs_vec);
+    Array1<int32_t> bad_row_splits(context, std::vector<int32_t>{0, 2});
+    FsaVecFromArcs(bad_arcs, bad_row_splits, &error);
+    EXPECT_TRUE(error);
+  }
+  {
+    // no arcs: all the FSAs are empty.
+    Array1<Arc> no_arcs(context, 0);
+    Array1<int32_t> zeros(context, 3, 0);
+    fsas = FsaVecFromArcs(no_arcs, zeros, &error);
+    EXPECT_FALSE(error);
+    EXPECT_EQ(fsas.shape.Dim0(), 2);
+    EXPECT_EQ(fsas.shape.TotSize(1), 0);
+  }
+}
+
+TEST(FsaVec, FromArcs) {
+  TestFsaVecFromArcs<kCpu>();
+  TestFsaVecFromArcs<kCuda>();
+}
+
+template <DeviceType d>
+void TestGetFsaVecBasicProperties() {
+  ContextPtr cpu = GetCpuContext();
+  ContextPtr context = (d == kCpu ? cpu : GetCudaContext());
+  // 2 FSAs with 3 states each; the arcs of state 0 of the second one are not
+  // sorted.
+  std::vector<int32_t> row_splits1_vec = {0, 3, 6},
+                       row_splits2_vec = {0, 2, 3, 3, 5, 6, 6};
+  std::vector<Arc> arcs_vec = {{0, 1, 1, 0.1}, {0, 1, 2, 0.2}, {1, 2, -1, 0},
+                               {0, 1, 2, 0.3}, {0, 1, 1, 0.4}, {1, 2, -1, 0}};
+  Array1<int32_t> row_splits1(context, row_splits1_vec),
+      row_splits2(context, row_splits2_vec);
+  RaggedShape shape =
+      RaggedShape3(&row_splits1, nullptr, -1, &row_splits2, nullptr, -1);
+  FsaVec fsas(shape, Array1<Arc>(context, arcs_vec));
+
+  int32_t not_arc_sorted =
+      kFsaAllProperties &
+      ~(kFsaPropertiesArcSorted | kFsaPropertiesArcSortedAndDeterministic);
+  Array1<int32_t> properties;
+  int32_t tot_properties;
+  GetFsaVecBasicProperties(fsas, &properties, &tot_properties);
+  EXPECT_EQ(tot_properties, not_arc_sorted);
+  Array1<int32_t> properties_cpu = properties.To(cpu);
+  EXPECT_EQ(properties_cpu[0], kFsaAllProperties);
+  EXPECT_EQ(properties_cpu[1], not_arc_sorted);
+
+  // The second time the result comes from the cache.
+  Array1<int32_t> properties2;
+  GetFsaVecBasicProperties(fsas, &properties2, &tot_properties);
+  EXPECT_EQ(tot_properties, not_arc_sorted);
+  const Array1<int32_t> &p1 = properties, &p2 = properties2;
+  EXPECT_EQ(p1.Data(), p2.Data());
+
+  // Modifying the arcs invalidates the cache.
+  Arc *arcs_data = fsas.values.Data();
+  auto lambda_set_epsilon = [=] __host__ __device__(int32_t i) -> void {
+    arcs_data[i].symbol = 0;
+  };
+  Eval(context, 1, lambda_set_epsilon);
+  GetFsaVecBasicProperties(fsas, &properties, &tot_properties);
+  EXPECT_EQ(tot_properties, not_arc_sorted & ~kFsaPropertiesEpsilonFree);
+  properties_cpu = properties.To(cpu);
+  EXPECT_EQ(properties_cpu[0], kFsaAllProperties & ~kFsaPropertiesEpsilonFree);
+  EXPECT_EQ(properties_cpu[1], not_arc_sorted);
+
+  Fsa fsa = fsas.Index(0, 0);
+  EXPECT_EQ(GetFsaBasicProperties(fsa),
+            kFsaAllProperties & ~kFsaPropertiesEpsilonFree);
+
+  // An FSA with states but no arcs is not Nonempty or Serializable, and the
+  // states are not reachable.
+  row_splits1 = Array1<int32_t>(context, std::vector<int32_t>{0, 3, 5});
+  row_splits2 = Array1<int32_t>(context, std::vector<int32_t>{0, 2, 3, 3, 3, 3});
+  shape = RaggedShape3(&row_splits1, nullptr, -1, &row_splits2, nullptr, -1);
+  arcs_vec.resize(3);
+  FsaVec fsas2(shape, Array1<Arc>(context, arcs_vec));
+  GetFsaVecBasicProperties(fsas2, &properties, &tot_properties);
+  properties_cpu = properties.To(cpu);
+  EXPECT_EQ(properties_cpu[0], kFsaAllProperties);
+  EXPECT_EQ(properties_cpu[1],
+            kFsaAllProperties &
+                ~(kFsaPropertiesNonempty | kFsaPropertiesSerializable |
+                  kFsaPropertiesMaybeAccessible |
+                  kFsaPropertiesMaybeCoaccessible));
+}
+
+TEST(FsaVec, GetFsaVecBasicProperties) {
+  TestGetFsaVecBasicProperties<kCpu>();
+  TestGetFsaVecBasicProperties<kCuda>();
+}
+
+template <DeviceType d>
+void TestFsaVecKnownProperties() {
+  ContextPtr context = (d == kCpu ? GetCpuContext() : GetCudaContext());
+  // The FSAs of TestGetFsaVecBasicProperties(), with an epsilon arc.
+  std::vector<int32_t> row_splits1_vec = {0, 3, 6},
+                       row_splits2_vec = {0, 2, 3, 3, 5, 6, 6};
+  std::vector<Arc> arcs_vec = {{0, 1, 0, 0.1}, {0, 1, 2, 0.2}, {1, 2, -1, 0},
+                               {0, 1, 2, 0.3}, {0, 1, 1, 0.4}, {1, 2, -1, 0}};
+  Array1<int32_t> row_splits1(context, row_splits1_vec),
+      row_splits2(context, row_splits2_vec);
+  RaggedShape shape =
+      RaggedShape3(&row_splits1, nullptr, -1, &row_splits2, nullptr, -1);
+  FsaVec fsas(shape, Array1<Arc>(context, arcs_vec));
+  EXPECT_EQ(GetFsaVecKnownProperties(fsas), 0);
+
+  // The known properties are trusted, so the (false) epsilon-free property
+  // shows that nothing was computed.
+  SetFsaVecKnownProperties(fsas, kFsaPropertiesEpsilonFree);
+  SetFsaVecKnownProperties(fsas, kFsaPropertiesTopSorted);
+  EXPECT_EQ(GetFsaVecKnownProperties(fsas),
+            kFsaPropertiesEpsilonFree | kFsaPropertiesTopSorted);
+  EXPECT_TRUE(FsaVecHasProperties(
+      fsas, kFsaPropertiesEpsilonFree | kFsaPropertiesTopSorted));
+  // The others are computed; afterwards all are known.
+  EXPECT_FALSE(FsaVecHasProperties(fsas, kFsaPropertiesArcSorted));
+  int32_t tot_properties = kFsaAllProperties &
+                           ~(kFsaPropertiesArcSorted |
+                             kFsaPropertiesArcSortedAndDeterministic |
+                             kFsaPropertiesEpsilonFree);
+  EXPECT_EQ(GetFsaVecKnownProperties(fsas), tot_properties);
+  EXPECT_FALSE(FsaVecHasProperties(fsas, kFsaPropertiesEpsilonFree));
+  EXPECT_TRUE(FsaVecHasProperties(fsas, kFsaPropertiesValid));
+
+  // Modifying the arcs forgets them.
+  SetFsaVecKnownProperties(fsas, kFsaPropertiesArcSorted);
+  fsas.values.Data();
+  EXPECT_EQ(GetFsaVecKnownProperties(fsas), 0);
+  Fsa fsa = fsas.Index(0, 0);
+  FsaVec fsa_vec = FsaVecFromFsa(fsa);
+  SetFsaVecKnownProperties(fsa_vec, kFsaPropertiesArcSorted);
+  // With one FSA, they are kept for other FsaVecs with the same arcs.
+  FsaVec fsa_vec2 = FsaVecFromFsa(fsa);
+  EXPECT_EQ(GetFsaVecKnownProperties(fsa_vec2), kFsaPropertiesArcSorted);
+}
+
+TEST(FsaVec, KnownProperties) {
+  TestFsaVecKnownProperties<kCpu>();
+  TestFsaVecKnownProperties<kCuda>();
+}
+
+template <DeviceType d>
+void TestFsaSoA() {
+  ContextPtr cpu = GetCpuContext();
+  ContextPtr context = (d == kCpu ? cpu : GetCudaContext());
+  std::vector<int32_t> row_splits1_vec = {0, 3, 6},
+                       row_splits2_vec = {0, 2, 3, 3, 5, 6, 6};
+  std::vector<Arc> arcs_vec = {{0, 1, 1, 0.1}, {0, 1, 2, 0.2}, {1, 2, -1, 0},
+                               {0, 1, 2, 0.3}, {0, 2, 1, 0.4}, {1, 2, -1, 0.5}};
+  Array1<int32_t> row_splits1(context, row_splits1_vec),
+      row_splits2(context, row_splits2_vec);
+  RaggedShape shape =
+      RaggedShape3(&row_splits1, nullptr, -1, &row_splits2, nullptr, -1);
+  FsaVec fsas(shape, Array1<Arc>(context, arcs_vec));
+
+  FsaSoA soa = FsaToSoA(fsas);
+  ASSERT_EQ(soa.NumArcs(), 6);
+  Array1<int32_t> src_states = soa.src_states.To(cpu),
+                  dest_states = soa.dest_states.To(cpu),
+                  symbols = soa.symbols.To(cpu);
+  Array1<float> scores = soa.scores.To(cpu);
+  for (int32_t i = 0; i != 6; ++i) {
+    EXPECT_EQ(src_states[i], arcs_vec[i].src_state);
+    EXPECT_EQ(dest_states[i], arcs_vec[i].dest_state);
+    EXPECT_EQ(symbols[i], arcs_vec[i].symbol);
+    EXPECT_EQ(scores[i], arcs_vec[i].score);
+  }
+
+  FsaVec fsas2 = FsaFromSoA(soa);
+  EXPECT_EQ(fsas2.NumAxes(), 3);
+  EXPECT_EQ(fsas2.shape.RowSplits(2).Data(), fsas.shape.RowSplits(2).Data());
+  Array1<Arc> arcs = fsas2.values.To(cpu);
+  for (int32_t i = 0; i != 6; ++i) {
+    EXPECT_EQ(arcs[i].src_state, arcs_vec[i].src_state);
+    EXPECT_EQ(arcs[i].dest_state, arcs_vec[i].dest_state);
+    EXPECT_EQ(arcs[i].symbol, arcs_vec[i].symbol);
+    EXPECT_EQ(arcs[i].score, arcs_vec[i].score);
+  }
+
+  // An FSA with one state and no arcs.
+  Array1<int32_t> row_splits(context, std::vector<int32_t>{0, 0});
+  Fsa fsa(RaggedShape2(&row_splits, nullptr, 0), Array1<Arc>(context, 0));
+  soa = FsaToSoA(fsa);
+  EXPECT_EQ(soa.NumArcs(), 0);
+  EXPECT_EQ(soa.scores.Dim(), 0);
+  Fsa fsa2 = FsaFromSoA(soa);
+  EXPECT_EQ(fsa2.shape.Dim0(), 1);
+  EXPECT_EQ(fsa2.values.Dim(), 0);
+}
+
+TEST(FsaVec, SoA) {
+  TestFsaSoA<kCpu>();
+  TestFsaSoA<kCuda>();
+}
+
+template <DeviceType d>
+void TestWeightsOfArcs() {
+  ContextPtr cpu = GetCpuContext();
+  ContextPtr context = (d == kCpu ? cpu : GetCudaContext());
+  std::vector<Arc> arcs_vec = {
+      {0, 1, 1, 0.1}, {0, 2, 2, 0.2}, {1, 2, 3, 0.3}, {2, 3, -1, 0.4}};
+  Array1<Arc> arcs(context, arcs_vec);
+
+  // The Tensor and the Array2 are views into `arcs`.
+  Tensor weights = WeightsOfArcsAsTensor(arcs);
+  EXPECT_EQ(weights.NumAxes(), 1);
+  EXPECT_EQ(weights.Dim(0), 4);
+  EXPECT_EQ(weights.Stride(0), 4);
+  EXPECT_EQ(weights.GetRegion(), arcs.GetRegion());
+  EXPECT_EQ(weights.ByteOffset(), arcs.ByteOffset() + 3 * sizeof(int32_t));
+  Array2<float> weights2 = WeightsOfArcsAsArray2(arcs);
+  EXPECT_EQ(weights2.Dim0(), 4);
+  EXPECT_EQ(weights2.Dim1(), 1);
+  EXPECT_EQ(weights2.ElemStride0(), 4);
+  EXPECT_EQ(weights2.GetRegion(), arcs.GetRegion());
+
+  Array1<float> weights1 = WeightsOfArcsAsArray1(arcs).To(cpu);
+  for (int32_t i = 0; i != 4; ++i)
+    EXPECT_EQ(weights1.Data()[i], arcs_vec[i].score);
+
+  // Setting the weights from the view is a no-op.
+  SetWeightsOfArcs(weights, &arcs);
+  // Set them from a separate array.
+  Array1<float> new_weights(context, std::vector<float>{1, 2, 3, 4});
+  SetWeightsOfArcs(new_weights, &arcs);
+  Array1<Arc> arcs_cpu = arcs.To(cpu);
+  for (int32_t i = 0; i != 4; ++i) {
+    EXPECT_EQ(arcs_cpu[i].src_state, arcs_vec[i].src_state);
+    EXPECT_EQ(arcs_cpu[i].dest_state, arcs_vec[i].dest_state);
+    EXPECT_EQ(arcs_cpu[i].symbol, arcs_vec[i].symbol);
+    EXPECT_EQ(arcs_cpu[i].score, i + 1);
+  }
+}
+
+TEST(FsaVec, WeightsOfArcs) {
+  TestWeightsOfArcs<kCpu>();
+  TestWeightsOfArcs<kCuda>();
+}
+
+template <DeviceType d>
+void TestDenseFsaVecFromTensor() {
+  ContextPtr cpu = GetCpuContext();
+  ContextPtr context = (d == kCpu ? cpu : GetCudaContext());
+  // 2 sequences with up to 3 frames each and 2 symbols, stored time-major so
+  // the (N, T_max, C) view has non-contiguous strides.
+  int32_t num_seqs = 2, max_frames = 3, num_symbols = 2;
+  Array1<float> storage(cpu, max_frames * num_seqs * num_symbols);
+  for (int32_t t = 0; t != max_frames; ++t)
+    for (int32_t n = 0; n != num_seqs; ++n)
+      for (int32_t s = 0; s != num_symbols; ++s)
+        storage.Data()[(t * num_seqs + n) * num_symbols + s] =
+            100 * n + 10 * t + s;
+  storage = storage.To(context);
+  Shape shape({num_seqs, max_frames, num_symbols},
+              {num_symbols, num_seqs * num_symbols, 1});
+  Tensor nnet_output(kFloatDtype, shape, storage.GetRegion(), 0);
+
+  // Sequence 0 has frames 1 and 2, sequence 1 has frames 0, 1 and 2.
+  Array2<int32_t> segments(cpu, num_seqs, 2);
+  std::vector<int32_t> segments_vec = {1, 2, 0, 3};
+  std::copy(segments_vec.begin(), segments_vec.end(), segments.Data());
+
+  DenseFsaVec dense(nnet_output, segments);
+  ASSERT_EQ(dense.shape.Dim0(), 2);
+  EXPECT_EQ(dense.shape.NumElements(), 7);
+  Array1<int32_t> row_splits1 = dense.shape.RowSplits(1).To(cpu);
+  EXPECT_EQ(row_splits1.Data()[1], 3);
+  EXPECT_EQ(row_splits1.Data()[2], 7);
+
+  float inf = std::numeric_limits<float>::infinity();
+  std::vector<float> expected = {-inf, 10, 11,    // seq 0, frame 1
+                                 -inf, 20, 21,    // seq 0, frame 2
+                                 0, -inf, -inf,   // seq 0, final
+                                 -inf, 100, 101,  // seq 1, frame 0
+                                 -inf, 110, 111,  // seq 1, frame 1
+                                 -inf, 120, 121,  // seq 1, frame 2
+                                 0, -inf, -inf};  // seq 1, final
+  Array2<float> scores = dense.scores.To(cpu);
+  ASSERT_EQ(scores.Dim0(), 7);
+  ASSERT_EQ(scores.Dim1(), 3);
+  for (int32_t i = 0; i != 21; ++i) EXPECT_EQ(scores.Data()[i], expected[i]);
+  EXPECT_EQ(dense.NumArcs(), 21);
+  EXPECT_FALSE(dense.HasHalfScores());
+
+  // With half-precision nnet output the scores are kept as half.
+  Tensor half_output = Cast(ToContiguous(nnet_output), kHalfDtype);
+  DenseFsaVec half_dense(half_output, segments);
+  EXPECT_TRUE(half_dense.HasHalfScores());
+  EXPECT_EQ(half_dense.scores.Dim0(), 0);
+  EXPECT_EQ(half_dense.NumCols(), 3);
+  EXPECT_EQ(half_dense.NumArcs(), 21);
+  Array2<__half> half_scores = half_dense.half_scores.To(cpu);
+  ASSERT_EQ(half_scores.Dim0(), 7);
+  for (int32_t i = 0; i != 21; ++i)
+    EXPECT_EQ(__half2float(half_scores.Data()[i]), expected[i]);
+}
+
+TEST(DenseFsaVec, FromTensor) {
+  TestDenseFsaVecFromTensor<kCpu>();
+  TestDenseFsaVecFromTensor<kCuda>();
+}
+
+template <DeviceType d>
+void TestSparsifyDenseFsaVec() {
+  ContextPtr cpu = GetCpuContext();
+  ContextPtr context = (d == kCpu ? cpu : GetCudaContext());
+  float inf = std::numeric_limits<float>::infinity();
+  // 1 sequence with 2 frames and 4 symbols, plus the final row.
+  std::vector<int32_t> row_splits1_vec = {0, 3};
+  Array1<int32_t> row_splits1(context, row_splits1_vec);
+  DenseFsaVec dense;
+  dense.shape = RaggedShape2(&row_splits1, nullptr, -1);
+  std::vector<float> scores_vec = {-inf, 1,    5,    3,    4,      // frame 0
+                                   -inf, 6,    2,    7,    0,      // frame 1
+                                   0,    -inf, -inf, -inf, -inf};  // final
+  Array2<float> scores(cpu, 3, 5);
+  std::copy(scores_vec.begin(), scores_vec.end(), scores.Data());
+  dense.scores = scores.To(context);
+
+  {
+    // keep the 2 best entries of each row.
+    DenseFsaVec sparse = SparsifyDenseFsaVec(dense, 2);
+    ASSERT_TRUE(sparse.HasSparseScores());
+    EXPECT_EQ(sparse.scores.Dim0(), 0);
+    EXPECT_EQ(sparse.NumCols(), 5);
+    EXPECT_EQ(sparse.NumRows(), 3);
+    EXPECT_EQ(sparse.NumArcs(), 15);
+    Array2<int32_t> cols = sparse.sparse_scores.cols.To(cpu);
+    Array2<float> sparse_scores = sparse.sparse_scores.scores.To(cpu);
+    ASSERT_EQ(cols.Dim1(), 2);
+    std::vector<int32_t> expected_cols = {2, 4, 1, 3, 0, 1};
+    std::vector<float> expected_scores = {5, 4, 6, 7, 0, -inf};
+    for (int32_t i = 0; i != 6; ++i) {
+      EXPECT_EQ(cols.Data()[i], expected_cols[i]);
+      EXPECT_EQ(sparse_scores.Data()[i], expected_scores[i]);
+    }
+  }
+  {
+    // keep the best entry plus symbols 0 and 2 (columns 1 and 3), given
+    // with a repeat; rows with fewer entries are padded.
+    Array1<int32_t> keep_symbols(context, std::vector<int32_t>{2, 0, 2});
+    DenseFsaVec sparse = SparsifyDenseFsaVec(dense, 1, &keep_symbols);
+    Array2<int32_t> cols = sparse.sparse_scores.cols.To(cpu);
+    Array2<float> sparse_scores = sparse.sparse_scores.scores.To(cpu);
+    ASSERT_EQ(cols.Dim1(), 3);
+    std::vector<int32_t> expected_cols = {1, 2, 3, 1, 3, 5, 0, 1, 3};
+    std::vector<float> expected_scores = {1, 5, 3, 6, 7, -inf, 0, -inf, -inf};
+    for (int32_t i = 0; i != 9; ++i) {
+      EXPECT_EQ(cols.Data()[i], expected_cols[i]);
+      EXPECT_EQ(sparse_scores.Data()[i], expected_scores[i]);
+    }
+
+    // sparse scores are sharded like dense ones.
+    std::vector<DenseFsaVec> shards = ShardDenseFsaVec(sparse, {context});
+    ASSERT_EQ(shards.size(), 1);
+    ASSERT_TRUE(shards[0].HasSparseScores());
+    EXPECT_EQ(shards[0].NumCols(), 5);
+    EXPECT_EQ(shards[0].sparse_scores.cols.Dim0(), 3);
+  }
+  {
+    // half-precision input gives the same result.
+    DenseFsaVec half_dense;
+    half_dense.shape = dense.shape;
+    Array2<__half> half_scores(cpu, 3, 5);
+    for (int32_t i = 0; i != 15; ++i)
+      half_scores.Data()[i] = __float2half(scores_vec[i]);
+    half_dense.half_scores = half_scores.To(context);
+    DenseFsaVec sparse = SparsifyDenseFsaVec(half_dense, 2);
+    Array2<int32_t> cols = sparse.sparse_scores.cols.To(cpu);
+    Array2<float> sparse_scores = sparse.sparse_scores.scores.To(cpu);
+    EXPECT_EQ(cols.Data()[0], 2);
+    EXPECT_EQ(cols.Data()[1], 4);
+    EXPECT_EQ(sparse_scores.Data()[0], 5);
+    EXPECT_EQ(sparse_scores.Data()[1], 4);
+  }
+}
+
+TEST(DenseFsaVec, Sparsify) {
+  TestSparsifyDenseFsaVec<kCpu>();
+  TestSparsifyDenseFsaVec<kCuda>();
+}
+
 }  // namespace k2
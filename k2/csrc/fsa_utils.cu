@@ -1,7 +1,8 @@
 /**
  * @brief Utilities for creating FSAs.
  *
- * Note that serializations are done in Python.
+ * Note that serializations are done in Python, except for the binary
+ * format of WriteFsaBinary() / ReadFsaBinary().
  *
  * @copyright
  * Copyright (c)  2020  Mobvoi Inc.        (authors: Fangjun Kuang)
@@ -10,183 +11,242 @@
  * See LICENSE for clarification regarding multiple authors
  */
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <memory>
 #include <sstream>
+#include <string>
 #include <utility>
 #include <vector>
 
+#include "k2/csrc/array_ops.h"
 #include "k2/csrc/context.h"
 #include "k2/csrc/fsa_utils.h"
+#include "k2/csrc/ragged.h"
+#include "k2/csrc/utils.h"
 
 namespace k2 {
 
-// field separator within a line for a text form FSA
-static constexpr const char *kDelim = " \t";
-
-// Convert a string to an integer. Abort the program on failure.
-static int32_t StringToInt(const std::string &s) {
-  K2_CHECK(!s.empty());
-
-  bool ok = false;
-  char *p = nullptr;
-  // std::strtol requires a `long` type
-  long n = std::strtol(s.c_str(), &p, 10);  // NOLINT
-  if (*p == '\0') ok = true;
-
-  auto res = static_cast<int32_t>(n);
-  if (n != res) ok = false;  // out of range
+// The text form of an FSA is parsed in chunks of about this many bytes, in
+// parallel; chunks start and end at line boundaries.
+static constexpr int32_t kFsaTextChunkSize = 1 << 20;
 
-  K2_CHECK(ok) << "Failed to convert " << s << " to an integer";
+// The number of fields of a line for an arc of a transducer; acceptors have
+// one fewer.
+static constexpr int32_t kMaxFsaTextFields = 5;
 
-  return res;
+// Returns true if `c` separates the fields of a line of the text form.
+static bool IsFieldDelim(char c) {
+  return c != '\n' && std::isspace(static_cast<unsigned char>(c)) != 0;
 }
 
-// Convert a string to a float. Abort the program on failure.
-static float StringToFloat(const std::string &s) {
-  K2_CHECK(!s.empty());
-  char *p = nullptr;
-  float f = std::strtof(s.c_str(), &p);
-  if (*p != '\0') K2_LOG(FATAL) << "Failed to convert " << s << " to a float";
-  return f;
-}
+/* Finds the fields of the line that starts at `begin`; fields are separated by
+   spaces and tabs (among other whitespace), and the line ends at the next
+   '\n' or at `end`.
 
-// Trim leading and trailing spaces of a string.
-static void TrimString(std::string *s) {
-  K2_CHECK_NE(s, nullptr);
-  auto not_space = [](int32_t c) -> bool { return std::isspace(c) == 0; };
+   @param [in]  begin    Start of the line.
+   @param [in]  end      End of the text.
+   @param [out] fields   fields[2*i] and fields[2*i+1] are set to the begin
+                         and end of the i'th field, for
+                         i < min(ans, kMaxFsaTextFields).
+   @param [out] line_end Is set to the end of the line ('\n' or `end`).
 
-  s->erase(s->begin(), std::find_if(s->begin(), s->end(), not_space));
-  s->erase(std::find_if(s->rbegin(), s->rend(), not_space).base(), s->end());
+   @return Returns the number of fields of the line; may be more than
+           kMaxFsaTextFields.
+ */
+static int32_t SplitLine(const char *begin, const char *end,
+                         const char **fields, const char **line_end) {
+  int32_t num_fields = 0;
+  const char *p = begin;
+  while (p != end && *p != '\n') {
+    if (IsFieldDelim(*p)) {
+      ++p;
+      continue;
+    }
+    const char *field_begin = p;
+    while (p != end && *p != '\n' && !IsFieldDelim(*p)) ++p;
+    if (num_fields < kMaxFsaTextFields) {
+      fields[2 * num_fields] = field_begin;
+      fields[2 * num_fields + 1] = p;
+    }
+    ++num_fields;
+  }
+  *line_end = p;
+  return num_fields;
 }
 
-/* Split a string to a vector of strings using a set of delimiters.
-
-   Example usage:
-
-   @code
-    std::string in = "1 2 3";
-    const char *delim = " \t";
-    std::vector<std::string> out;
-    SplitStringToVector(in, delim, &out);
-   @endcode
-
-   @param [in]  in    The input string to be split.
-   @param [in]  delim A string of delimiters.
-   @param [out] out   It saves the split result.
-*/
-static void SplitStringToVector(const std::string &in, const char *delim,
-                                std::vector<std::string> *out) {
-  K2_CHECK_NE(delim, nullptr);
-  K2_CHECK_NE(out, nullptr);
-  out->clear();
-  std::size_t start = 0;
-  while (true) {
-    auto pos = in.find_first_of(delim, start);
-    if (pos == std::string::npos) break;
-
-    auto sub = in.substr(start, pos - start);
-    start = pos + 1;
-
-    TrimString(&sub);
-    if (!sub.empty()) out->emplace_back(std::move(sub));
+// Converts the field [begin, end) to an integer. Aborts the program on
+// failure.
+static int32_t ParseInt(const char *begin, const char *end) {
+  const char *p = begin;
+  bool negative = false, ok = (p != end);
+  if (ok && (*p == '-' || *p == '+')) {
+    negative = (*p == '-');
+    ok = (++p != end);
   }
-
-  if (start < in.size()) {
-    auto sub = in.substr(start);
-    TrimString(&sub);
-    if (!sub.empty()) out->emplace_back(std::move(sub));
+  int64_t n = 0;
+  for (; ok && p != end; ++p) {
+    if (*p < '0' || *p > '9' || n > std::numeric_limits<int32_t>::max())
+      ok = false;
+    else
+      n = n * 10 + (*p - '0');
   }
+  if (negative) n = -n;
+  if (n < std::numeric_limits<int32_t>::min() ||
+      n > std::numeric_limits<int32_t>::max())
+    ok = false;  // out of range
+  K2_CHECK(ok) << "Failed to convert " << std::string(begin, end)
+               << " to an integer";
+  return static_cast<int32_t>(n);
 }
 
-// Create an acceptor from a stream.
-static Fsa AcceptorFromStream(std::string first_line, std::istringstream &is,
-                              bool negate_scores) {
-  std::vector<Arc> arcs;
-  std::string line = std::move(first_line);
-  std::vector<std::string> splits;
-
-  float scale = 1;
-  if (negate_scores) scale = -1;
+// Converts the field [begin, end) to a float. Aborts the program on failure.
+// Requires the text to be null-terminated somewhere after `end`, which it
+// is as it is the contents of a std::string.
+static float ParseFloat(const char *begin, const char *end) {
+  char *p = nullptr;
+  float f = std::strtof(begin, &p);
+  if (p != end)
+    K2_LOG(FATAL) << "Failed to convert " << std::string(begin, end)
+                  << " to a float";
+  return f;
+}
 
-  do {
-    SplitStringToVector(line, kDelim,
-                        &splits);  // splits is cleared in the function
-    if (splits.empty()) continue;  // this is an empty line
-
-    auto num_fields = splits.size();
-
-    if (num_fields == 4u) {
-      //   0            1          2      3
-      // src_state  dest_state  symbol  score
-      int32_t src_state = StringToInt(splits[0]);
-      int32_t dest_state = StringToInt(splits[1]);
-      int32_t symbol = StringToInt(splits[2]);
-      float score = scale * StringToFloat(splits[3]);
-      arcs.emplace_back(src_state, dest_state, symbol, score);
-    } else if (num_fields == 1u) {
-      (void)StringToInt(splits[0]);  // this is a final state
-      break;                         // finish reading
-    } else {
-      K2_LOG(FATAL) << "Invalid line: " << line
-                    << "\nIt expects a line with 4 fields";
-    }
-  } while (std::getline(is, line));
+// Returns the start of chunk `b` of the text [begin, end), i.e. the start of
+// the first line that begins at or after byte b * kFsaTextChunkSize.
+static const char *FsaTextChunkBegin(const char *begin, const char *end,
+                                     int32_t b) {
+  if (b == 0) return begin;
+  int64_t offset = static_cast<int64_t>(b) * kFsaTextChunkSize - 1;
+  if (offset >= end - begin) return end;
+  const char *p = static_cast<const char *>(
+      std::memchr(begin + offset, '\n', end - begin - offset));
+  return (p == nullptr ? end : p + 1);
+}
 
-  K2_CHECK(is) << "Failed to read fsa from string";
+namespace {
+// Information about one chunk of the text form of an FSA, from the first
+// pass over it.
+struct FsaTextChunkInfo {
+  // The number of arc lines (i.e. non-empty lines that are not the line for
+  // the final state) before the first final-state line of the chunk, or in
+  // the whole chunk if it contains no final-state line.
+  int32_t num_arcs = 0;
+  // The line for the final state, if the chunk contains one (only the first
+  // one is recorded), else nullptr.
+  const char *final_line = nullptr;
+};
+}  // namespace
 
-  bool error = true;
-  Array1<Arc> array(GetCpuContext(), arcs);
-  auto fsa = FsaFromArray1(array, &error);
-  K2_CHECK_EQ(error, false);
+/*
+  Parses the text form of an acceptor (num_fields == 4) or transducer
+  (num_fields == 5), see FsaFromString().  The text is split into chunks at
+  line boundaries that are processed in parallel: a first pass counts the arcs
+  of each chunk, an exclusive sum of the counts gives the position of each
+  chunk's arcs, and a second pass parses them directly into the output
+  arrays.  As before, reading stops at the first line for the final state.
+ */
+static Fsa FsaFromText(const char *text, const char *text_end,
+                       int32_t num_fields, bool negate_scores,
+                       Array1<int32_t> *aux_labels) {
+  K2_CHECK(num_fields == kMaxFsaTextFields - 1 ||
+           num_fields == kMaxFsaTextFields);
+  int64_t num_bytes = text_end - text;
+  K2_CHECK_LT(num_bytes / kFsaTextChunkSize,
+              std::numeric_limits<int32_t>::max());
+  int32_t num_chunks = static_cast<int32_t>(num_bytes / kFsaTextChunkSize) + 1;
 
-  return fsa;
-}
+  std::vector<FsaTextChunkInfo> chunks(num_chunks);
+  ParallelFor(num_chunks, 1, [&](int32_t begin, int32_t end) -> void {
+    const char *fields[2 * kMaxFsaTextFields];
+    for (int32_t b = begin; b < end; ++b) {
+      FsaTextChunkInfo &info = chunks[b];
+      const char *p = FsaTextChunkBegin(text, text_end, b),
+                 *chunk_end = FsaTextChunkBegin(text, text_end, b + 1);
+      while (p < chunk_end) {
+        const char *line_end;
+        int32_t n = SplitLine(p, chunk_end, fields, &line_end);
+        if (n == 1) {
+          info.final_line = p;
+          break;
+        }
+        if (n != 0) ++info.num_arcs;
+        if (line_end == chunk_end) break;
+        p = line_end + 1;
+      }
+    }
+  });
 
-static Fsa TransducerFromStream(std::string first_line, std::istringstream &is,
-                                bool negate_scores,
-                                Array1<int32_t> *aux_labels) {
-  K2_CHECK(aux_labels != nullptr);
+  // Only the arcs before the first final-state line are read.
+  int32_t final_chunk = 0;
+  while (final_chunk < num_chunks && chunks[final_chunk].final_line == nullptr)
+    ++final_chunk;
+  K2_CHECK_LT(final_chunk, num_chunks) << "Failed to read fsa from string";
+  {
+    const char *fields[2 * kMaxFsaTextFields], *line_end;
+    SplitLine(chunks[final_chunk].final_line, text_end, fields, &line_end);
+    (void)ParseInt(fields[0], fields[1]);  // this is the final state
+  }
 
-  std::vector<int32_t> state_aux_labels;
-  std::vector<Arc> arcs;
-  std::string line = std::move(first_line);
-  std::vector<std::string> splits;
+  std::vector<int32_t> arc_offsets(final_chunk + 2, 0);
+  for (int32_t b = 0; b <= final_chunk; ++b)
+    arc_offsets[b] = chunks[b].num_arcs;
+  ContextPtr cpu = GetCpuContext();
+  ExclusiveSum(cpu, final_chunk + 2, arc_offsets.data(), arc_offsets.data());
+  int32_t num_arcs = arc_offsets.back();
 
-  float scale = 1;
-  if (negate_scores) scale = -1;
+  Array1<Arc> arcs(cpu, num_arcs);
+  Arc *arcs_data = arcs.Data();
+  int32_t *aux_labels_data = nullptr;
+  if (num_fields == kMaxFsaTextFields) {
+    K2_CHECK(aux_labels != nullptr);
+    *aux_labels = Array1<int32_t>(cpu, num_arcs);
+    aux_labels_data = aux_labels->Data();
+  }
+  float scale = (negate_scores ? -1 : 1);
 
-  do {
-    SplitStringToVector(line, kDelim,
-                        &splits);  // splits is cleared in the function
-    if (splits.empty()) continue;  // this is an empty line
-
-    auto num_fields = splits.size();
-    if (num_fields == 5u) {
-      //   0           1         2         3        4
-      // src_state  dest_state  symbol  aux_label score
-      int32_t src_state = StringToInt(splits[0]);
-      int32_t dest_state = StringToInt(splits[1]);
-      int32_t symbol = StringToInt(splits[2]);
-      int32_t aux_label = StringToInt(splits[3]);
-      float score = scale * StringToFloat(splits[4]);
-      arcs.emplace_back(src_state, dest_state, symbol, score);
-      state_aux_labels.push_back(aux_label);
-    } else if (num_fields == 1u) {
-      (void)StringToInt(splits[0]);
-      break;  // finish reading
-    } else {
-      K2_LOG(FATAL) << "Invalid line: " << line
-                    << "\nIt expects a line with 5 fields";
+  ParallelFor(final_chunk + 1, 1, [&](int32_t begin, int32_t end) -> void {
+    const char *fields[2 * kMaxFsaTextFields];
+    for (int32_t b = begin; b < end; ++b) {
+      const char *p = FsaTextChunkBegin(text, text_end, b),
+                 *chunk_end = FsaTextChunkBegin(text, text_end, b + 1);
+      for (int32_t arc_idx = arc_offsets[b], arc_end = arc_offsets[b + 1];
+           arc_idx < arc_end;) {
+        const char *line_end;
+        int32_t n = SplitLine(p, chunk_end, fields, &line_end);
+        if (n == num_fields) {
+          //   0           1         2        [3]       3 or 4
+          // src_state  dest_state  symbol [aux_label]  score
+          Arc &arc = arcs_data[arc_idx];
+          arc.src_state = ParseInt(fields[0], fields[1]);
+          arc.dest_state = ParseInt(fields[2], fields[3]);
+          arc.symbol = ParseInt(fields[4], fields[5]);
+          if (aux_labels_data != nullptr)
+            aux_labels_data[arc_idx] = ParseInt(fields[6], fields[7]);
+          arc.score = scale * ParseFloat(fields[2 * num_fields - 2],
+                                         fields[2 * num_fields - 1]);
+          ++arc_idx;
+        } else if (n != 0) {
+          K2_LOG(FATAL) << "Invalid line: " << std::string(p, line_end)
+                        << "\nIt expects a line with " << num_fields
+                        << " fields";
+        }
+        p = line_end + 1;
+      }
     }
-  } while (std::getline(is, line));
-
-  K2_CHECK(is) << "Failed to read fsa from string";
-
-  auto cpu_context = GetCpuContext();
-  *aux_labels = Array1<int32_t>(cpu_context, state_aux_labels);
-  Array1<Arc> array(cpu_context, arcs);
+  });
 
   bool error = true;
-  auto fsa = FsaFromArray1(array, &error);
+  auto fsa = FsaFromArray1(arcs, &error);
   K2_CHECK_EQ(error, false);
 
   return fsa;
@@ -194,22 +254,17 @@ static Fsa TransducerFromStream(std::string first_line, std::istringstream &is,
 
 Fsa FsaFromString(const std::string &s, bool negate_scores /*= false*/,
                   Array1<int32_t> *aux_labels /*= nullptr*/) {
-  std::istringstream is(s);
-  std::string line;
-  std::getline(is, line);
-  K2_CHECK(is);
-
-  std::vector<std::string> splits;
-  SplitStringToVector(line, kDelim, &splits);
-  auto num_fields = splits.size();
-  if (num_fields == 4u)
-    return AcceptorFromStream(std::move(line), is, negate_scores);
-  else if (num_fields == 5u)
-    return TransducerFromStream(std::move(line), is, negate_scores, aux_labels);
+  K2_CHECK(!s.empty());
+  const char *text = s.data(), *text_end = s.data() + s.size();
+
+  const char *fields[2 * kMaxFsaTextFields], *line_end;
+  int32_t num_fields = SplitLine(text, text_end, fields, &line_end);
+  if (num_fields == kMaxFsaTextFields - 1 || num_fields == kMaxFsaTextFields)
+    return FsaFromText(text, text_end, num_fields, negate_scores, aux_labels);
 
   K2_LOG(FATAL) << "Expected number of fields: 4 or 5."
                 << "Actual: " << num_fields << "\n"
-                << "First line is: " << line;
+                << "First line is: " << std::string(text, line_end);
 
   return Fsa();  // unreachable code
 }
@@ -245,4 +300,946 @@ std::string FsaToString(const Fsa &fsa, bool negate_scores /*= false*/,
   return os.str();
 }
 
+namespace {
+
+// "k2fsabin"
+constexpr char kFsaBinaryMagic[8] = {'k', '2', 'f', 's', 'a', 'b', 'i', 'n'};
+
+// Used to detect files written on a machine with a different byte order.
+constexpr uint32_t kFsaBinaryByteOrderMark = 0x01020304;
+
+// The header at the start of a file written by WriteFsaBinary().  The
+// offsets are from the start of the file and are multiples of
+// kFsaBinaryAlignment; an offset of 0 means the array is not present.
+struct FsaBinaryHeader {
+  char magic[8];
+  uint32_t byte_order_mark;
+  int32_t version;
+  int32_t num_axes;        // 2 for an Fsa, 3 for an FsaVec
+  int32_t properties;      // The `and` of the properties of the FSAs
+  int32_t num_fsas;        // only for FsaVec
+  int32_t num_states;
+  int32_t num_arcs;
+  int32_t has_aux_labels;  // 1 if there are aux_labels, else 0
+  int64_t row_splits1_offset;  // Of the rows of FSAs; only for FsaVec
+  int64_t row_splits2_offset;  // Of the rows of states
+  int64_t arcs_offset;
+  int64_t aux_labels_offset;
+  int64_t file_size;
+};
+
+int64_t RoundUp(int64_t n, int64_t alignment) {
+  return (n + alignment - 1) / alignment * alignment;
+}
+
+/*
+  The context of the Region of a memory-mapped range of a file: it unmaps it
+  when the Region is destroyed.  Arrays computed from arrays in that Region
+  will have this context too, so it allocates and frees other memory using the
+  CPU context.
+ */
+class MappedFileContext : public Context {
+ public:
+  MappedFileContext(void *addr, std::size_t num_bytes)
+      : cpu_(k2::GetCpuContext()), addr_(addr), num_bytes_(num_bytes) {}
+  ContextPtr GetCpuContext() override { return cpu_; }
+  ContextPtr GetPinnedContext() override { return cpu_->GetPinnedContext(); }
+  DeviceType GetDeviceType() const override { return kCpu; }
+
+  void *Allocate(std::size_t bytes, void **deleter_context) override {
+    return cpu_->Allocate(bytes, deleter_context);
+  }
+
+  bool ExtendInPlace(void *data, void **deleter_context, std::size_t num_bytes,
+                     std::size_t new_num_bytes) override {
+    if (data == addr_) return false;
+    return cpu_->ExtendInPlace(data, deleter_context, num_bytes,
+                               new_num_bytes);
+  }
+
+  bool IsCompatible(const Context &other) const override {
+    return other.GetDeviceType() == kCpu;
+  }
+
+  void Deallocate(void *data, void *deleter_context) override {
+    if (data == addr_) {
+      int32_t ret = munmap(addr_, num_bytes_);
+      K2_CHECK_EQ(ret, 0);
+      addr_ = nullptr;
+    } else {
+      cpu_->Deallocate(data, deleter_context);
+    }
+  }
+
+ private:
+  ContextPtr cpu_;
+  void *addr_;  // The mapping; NULL once it has been unmapped
+  std::size_t num_bytes_;
+};
+
+// Maps `num_bytes` bytes of file `fd` starting at `offset` (a multiple of
+// the page size) and returns a Region for them (with copy-on-write pages).
+RegionPtr MapFileRange(int fd, int64_t offset, std::size_t num_bytes) {
+  K2_CHECK_GT(num_bytes, 0);
+  void *addr = mmap(nullptr, num_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                    fd, static_cast<off_t>(offset));
+  K2_CHECK_NE(addr, MAP_FAILED) << "mmap failed: " << strerror(errno);
+  auto ans = std::make_shared<Region>();
+  ans->context = std::make_shared<MappedFileContext>(addr, num_bytes);
+  ans->data = addr;
+  ans->deleter_context = nullptr;
+  ans->num_bytes = num_bytes;
+  ans->bytes_used = num_bytes;
+  // The destructor of Region records a free.
+  internal::RecordAlloc(*ans->context, num_bytes);
+  return ans;
+}
+
+/*
+  Copies `num_bytes` bytes from host memory `src` (e.g. mapped pages of a
+  file) to `dst` on CUDA context `c`, through two pinned buffers so that
+  reading the source overlaps with the transfers.
+ */
+void StreamToDevice(const char *src, std::size_t num_bytes, ContextPtr &c,
+                    char *dst) {
+  constexpr std::size_t kChunkSize = 1 << 23;
+  ContextPtr pinned = c->GetPinnedContext();
+  DeviceGuard guard(*c);
+  char *buffers[2];
+  void *deleter_contexts[2];
+  cudaEvent_t events[2];
+  for (int32_t b = 0; b < 2; ++b) {
+    buffers[b] = static_cast<char *>(
+        pinned->Allocate(kChunkSize, &deleter_contexts[b]));
+    K2_CHECK_CUDA_ERROR(
+        cudaEventCreateWithFlags(&events[b], cudaEventDisableTiming));
+  }
+  for (std::size_t offset = 0, chunk = 0; offset < num_bytes;
+       offset += kChunkSize, ++chunk) {
+    int32_t b = chunk % 2;
+    std::size_t this_size = std::min(kChunkSize, num_bytes - offset);
+    // Wait for the transfer from this buffer two chunks ago.
+    if (chunk >= 2) K2_CHECK_CUDA_ERROR(cudaEventSynchronize(events[b]));
+    memcpy(buffers[b], src + offset, this_size);
+    MemoryCopyAsync(dst + offset, buffers[b], this_size, *c, *pinned);
+    K2_CHECK_CUDA_ERROR(cudaEventRecord(events[b], c->GetCudaStream()));
+  }
+  for (int32_t b = 0; b < 2; ++b) {
+    K2_CHECK_CUDA_ERROR(cudaEventSynchronize(events[b]));
+    K2_CHECK_CUDA_ERROR(cudaEventDestroy(events[b]));
+    pinned->Deallocate(buffers[b], deleter_contexts[b]);
+  }
+}
+
+// Writes `num_bytes` bytes of `data` at offset `offset`, which must not be
+// less than the current position, padding with zeros.
+void WriteAt(std::ofstream &os, int64_t offset, const void *data,
+             std::size_t num_bytes) {
+  int64_t pos = static_cast<int64_t>(os.tellp());
+  K2_CHECK_LE(pos, offset);
+  std::vector<char> padding(offset - pos, 0);
+  os.write(padding.data(), padding.size());
+  os.write(static_cast<const char *>(data), num_bytes);
+}
+
+}  // namespace
+
+void WriteFsaBinary(const std::string &filename, Fsa &fsa,
+                    const Array1<int32_t> *aux_labels /*= nullptr*/) {
+  int32_t num_axes = fsa.NumAxes();
+  K2_CHECK(num_axes == 2 || num_axes == 3);
+  ContextPtr cpu = GetCpuContext();
+  FsaBinaryHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, kFsaBinaryMagic, sizeof(header.magic));
+  header.byte_order_mark = kFsaBinaryByteOrderMark;
+  header.version = kFsaBinaryVersion;
+  header.num_axes = num_axes;
+  header.properties = (num_axes == 2 ? GetFsaBasicProperties(fsa) : 0);
+  if (num_axes == 3) {
+    Array1<int32_t> properties;
+    GetFsaVecBasicProperties(fsa, &properties, &header.properties);
+  }
+
+  Array1<int32_t> row_splits1, row_splits2;
+  if (num_axes == 3) {
+    row_splits1 = fsa.shape.RowSplits(1).To(cpu);
+    row_splits2 = fsa.shape.RowSplits(2).To(cpu);
+    header.num_fsas = fsa.shape.Dim0();
+  } else {
+    row_splits2 = fsa.shape.RowSplits(1).To(cpu);
+  }
+  Array1<Arc> arcs = fsa.values.To(cpu);
+  header.num_states = row_splits2.Dim() - 1;
+  header.num_arcs = arcs.Dim();
+
+  int64_t offset = RoundUp(sizeof(header), kFsaBinaryAlignment);
+  if (num_axes == 3) {
+    header.row_splits1_offset = offset;
+    offset = RoundUp(offset + row_splits1.Dim() * sizeof(int32_t),
+                     kFsaBinaryAlignment);
+  }
+  header.row_splits2_offset = offset;
+  offset = RoundUp(offset + row_splits2.Dim() * sizeof(int32_t),
+                   kFsaBinaryAlignment);
+  header.file_size = offset;
+  if (arcs.Dim() != 0) {
+    header.arcs_offset = offset;
+    header.file_size = offset + arcs.Dim() * sizeof(Arc);
+    offset = RoundUp(header.file_size, kFsaBinaryAlignment);
+  }
+  Array1<int32_t> aux_labels_cpu;
+  if (aux_labels != nullptr) {
+    K2_CHECK(IsCompatible(fsa, *aux_labels));
+    K2_CHECK_EQ(aux_labels->Dim(), arcs.Dim());
+    header.has_aux_labels = 1;
+    aux_labels_cpu = aux_labels->To(cpu);
+    if (arcs.Dim() != 0) {
+      header.aux_labels_offset = offset;
+      header.file_size = offset + arcs.Dim() * sizeof(int32_t);
+    }
+  }
+
+  std::ofstream os(filename, std::ios::binary);
+  K2_CHECK(os) << "Failed to open " << filename << " for writing";
+  os.write(reinterpret_cast<const char *>(&header), sizeof(header));
+  const Array1<int32_t> &splits1 = row_splits1, &splits2 = row_splits2;
+  if (num_axes == 3)
+    WriteAt(os, header.row_splits1_offset, splits1.Data(),
+            splits1.Dim() * sizeof(int32_t));
+  WriteAt(os, header.row_splits2_offset, splits2.Data(),
+          splits2.Dim() * sizeof(int32_t));
+  if (header.arcs_offset != 0) {
+    const Array1<Arc> &arcs_ref = arcs;
+    WriteAt(os, header.arcs_offset, arcs_ref.Data(),
+            arcs.Dim() * sizeof(Arc));
+  }
+  if (header.aux_labels_offset != 0) {
+    const Array1<int32_t> &aux_labels_ref = aux_labels_cpu;
+    WriteAt(os, header.aux_labels_offset, aux_labels_ref.Data(),
+            aux_labels_cpu.Dim() * sizeof(int32_t));
+  }
+  os.close();
+  K2_CHECK(os) << "Failed to write " << filename;
+}
+
+Fsa ReadFsaBinary(const std::string &filename, ContextPtr c /*= nullptr*/,
+                  Array1<int32_t> *aux_labels /*= nullptr*/,
+                  int32_t *properties /*= nullptr*/) {
+  if (c == nullptr) c = GetCpuContext();
+  int fd = open(filename.c_str(), O_RDONLY);
+  K2_CHECK_GE(fd, 0) << "Failed to open " << filename << ": "
+                     << strerror(errno);
+  struct stat st;
+  K2_CHECK_EQ(fstat(fd, &st), 0);
+  FsaBinaryHeader header;
+  K2_CHECK_GE(static_cast<int64_t>(st.st_size),
+              static_cast<int64_t>(sizeof(header)))
+      << filename << " is not an FSA in binary format";
+  K2_CHECK_EQ(pread(fd, &header, sizeof(header), 0),
+              static_cast<ssize_t>(sizeof(header)));
+  K2_CHECK(memcmp(header.magic, kFsaBinaryMagic, sizeof(header.magic)) == 0)
+      << filename << " is not an FSA in binary format";
+  K2_CHECK_EQ(header.byte_order_mark, kFsaBinaryByteOrderMark)
+      << filename << " was written with a different byte order";
+  K2_CHECK_EQ(header.version, kFsaBinaryVersion)
+      << "Unsupported version of the binary FSA format in " << filename;
+  K2_CHECK(header.num_axes == 2 || header.num_axes == 3);
+  K2_CHECK_EQ(header.file_size, static_cast<int64_t>(st.st_size))
+      << filename << " is truncated or corrupt";
+
+  // Returns the array of `dim` elements of type T at `offset`.
+  auto read_array = [&](int64_t offset, int32_t dim, auto *ans) -> void {
+    using T = typename std::remove_pointer<decltype(ans)>::type::ValueType;
+    K2_CHECK(dim == 0 || (offset % kFsaBinaryAlignment == 0 &&
+                          offset + dim * sizeof(T) <=
+                              static_cast<std::size_t>(header.file_size)))
+        << filename << " is corrupt";
+    if (dim == 0) {
+      *ans = Array1<T>(c, 0);
+      return;
+    }
+    std::size_t num_bytes = dim * sizeof(T);
+    RegionPtr region = MapFileRange(fd, offset, num_bytes);
+    Array1<T> mapped(dim, region, 0);
+    if (c->GetDeviceType() == kCpu) {
+      *ans = mapped;
+    } else {
+      madvise(region->data, num_bytes, MADV_SEQUENTIAL);
+      *ans = Array1<T>(c, dim);
+      const Array1<T> &src = mapped;
+      StreamToDevice(reinterpret_cast<const char *>(src.Data()), num_bytes,
+                     c, reinterpret_cast<char *>(ans->Data()));
+    }
+  };
+  Array1<int32_t> row_splits1, row_splits2;
+  Array1<Arc> arcs;
+  if (header.num_axes == 3)
+    read_array(header.row_splits1_offset, header.num_fsas + 1, &row_splits1);
+  read_array(header.row_splits2_offset, header.num_states + 1, &row_splits2);
+  read_array(header.arcs_offset, header.num_arcs, &arcs);
+  if (aux_labels != nullptr) {
+    *aux_labels = Array1<int32_t>(c, 0);
+    if (header.has_aux_labels)
+      read_array(header.aux_labels_offset, header.num_arcs, aux_labels);
+  }
+  close(fd);  // The mappings stay valid.
+  if (properties != nullptr) *properties = header.properties;
+
+  if (header.num_axes == 2) {
+    RaggedShape shape = RaggedShape2(&row_splits2, nullptr, header.num_arcs);
+    return Fsa(shape, arcs);
+  }
+  RaggedShape shape =
+      RaggedShape3(&row_splits1, nullptr, header.num_states, &row_splits2,
+                   nullptr, header.num_arcs);
+  return FsaVec(shape, arcs);
+}
+
+FsaVec LinearFsas(Ragged<int32_t> &symbols) {
+  K2_CHECK_EQ(symbols.NumAxes(), 2);
+  ContextPtr &c = symbols.Context();
+  int32_t num_fsas = symbols.shape.Dim0(), num_symbols = symbols.values.Dim(),
+          num_states = num_symbols + 2 * num_fsas,
+          num_arcs = num_symbols + num_fsas;
+  const int32_t *symbols_row_splits1_data = symbols.shape.RowSplits(1).Data(),
+                *symbols_row_ids1_data = symbols.shape.RowIds(1).Data(),
+                *symbols_data = symbols.values.Data();
+  // Every state but the final one has one arc, so the arcs of FSA i start
+  // at symbols_row_splits1[i] + i and those of state s at s - (its FSA).
+  Array1<int32_t> row_splits1(c, num_fsas + 1), row_ids2(c, num_arcs);
+  Array1<Arc> arcs(c, num_arcs);
+  int32_t *row_splits1_data = row_splits1.Data(),
+          *row_ids2_data = row_ids2.Data();
+  Arc *arcs_data = arcs.Data();
+  // Thread i < num_symbols does the arc of symbol i, and thread
+  // num_symbols + i the final arc of FSA i (and row_splits1[i + 1]).
+  auto lambda_set_arcs = [=] __host__ __device__(int32_t i) -> void {
+    if (i < num_symbols) {
+      int32_t fsa_idx0 = symbols_row_ids1_data[i],
+              state = i - symbols_row_splits1_data[fsa_idx0],
+              arc_idx012 = i + fsa_idx0;
+      arcs_data[arc_idx012] = Arc(state, state + 1, symbols_data[i], 0.0f);
+      row_ids2_data[arc_idx012] = i + 2 * fsa_idx0;
+      return;
+    }
+    int32_t fsa_idx0 = i - num_symbols,
+            begin = symbols_row_splits1_data[fsa_idx0],
+            end = symbols_row_splits1_data[fsa_idx0 + 1],
+            arc_idx012 = end + fsa_idx0;
+    arcs_data[arc_idx012] = Arc(end - begin, end - begin + 1, -1, 0.0f);
+    row_ids2_data[arc_idx012] = end + 2 * fsa_idx0;
+    row_splits1_data[fsa_idx0 + 1] = end + 2 * (fsa_idx0 + 1);
+    if (fsa_idx0 == 0) row_splits1_data[0] = 0;
+  };
+  Eval(c, num_arcs, lambda_set_arcs);
+  RaggedShape shape = RaggedShape3(&row_splits1, nullptr, num_states, nullptr,
+                                   &row_ids2, num_arcs);
+  return FsaVec(shape, arcs);
+}
+
+FsaVec CtcGraphs(Ragged<int32_t> &tokens, bool modified /*= false*/,
+                 Array1<int32_t> *aux_labels /*= nullptr*/) {
+  K2_CHECK_EQ(tokens.NumAxes(), 2);
+  ContextPtr &c = tokens.Context();
+  int32_t num_fsas = tokens.shape.Dim0(), num_tokens = tokens.values.Dim(),
+          num_states = 2 * num_tokens + 2 * num_fsas;
+  const int32_t *tokens_row_splits1_data = tokens.shape.RowSplits(1).Data(),
+                *tokens_data = tokens.values.Data();
+  // FSA i has 2 * L_i + 2 states, so row_splits1 is 2 * (tokens' row_splits
+  // + idx0).
+  Array1<int32_t> row_splits1(c, num_fsas + 1);
+  int32_t *row_splits1_data = row_splits1.Data();
+  auto lambda_set_row_splits1 = [=] __host__ __device__(int32_t i) -> void {
+    row_splits1_data[i] = 2 * (tokens_row_splits1_data[i] + i);
+  };
+  Eval(c, num_fsas + 1, lambda_set_row_splits1);
+  Array1<int32_t> row_ids1(c, num_states);
+  RowSplitsToRowIds(row_splits1, row_ids1);
+  const int32_t *row_ids1_data = row_ids1.Data();
+
+  // The number of arcs leaving each state; see the header for them.  The
+  // state with idx1 `state` of FSA `fsa_idx0` is the blank state before, or
+  // the token state of, the token with idx01 `token_idx01`.
+  Array1<int32_t> row_splits2(c, num_states + 1);
+  int32_t *row_splits2_data = row_splits2.Data();
+  auto lambda_count_arcs = [=] __host__ __device__(int32_t i) -> void {
+    int32_t fsa_idx0 = row_ids1_data[i],
+            state = i - row_splits1_data[fsa_idx0],
+            begin = tokens_row_splits1_data[fsa_idx0],
+            len = tokens_row_splits1_data[fsa_idx0 + 1] - begin,
+            token_idx01 = begin + state / 2;
+    int32_t num_arcs;
+    if (state == 2 * len + 1)
+      num_arcs = 0;  // the final state
+    else if (state % 2 == 0)
+      num_arcs = 2;
+    else if (state / 2 + 1 == len)
+      num_arcs = 3;  // the last token state, which has the final arc
+    else
+      num_arcs = (modified || tokens_data[token_idx01 + 1] !=
+                                  tokens_data[token_idx01]
+                      ? 3
+                      : 2);
+    row_splits2_data[i] = num_arcs;
+  };
+  Eval(c, num_states, lambda_count_arcs);
+  // The number of arcs is needed for the allocation, so this is the one
+  // transfer to the host.
+  int32_t num_arcs = ExclusiveSumWithTotal(row_splits2, &row_splits2);
+
+  Array1<Arc> arcs(c, num_arcs);
+  Array1<int32_t> row_ids2(c, num_arcs);
+  Arc *arcs_data = arcs.Data();
+  int32_t *row_ids2_data = row_ids2.Data(), *aux_labels_data = nullptr;
+  if (aux_labels != nullptr) {
+    *aux_labels = Array1<int32_t>(c, num_arcs);
+    aux_labels_data = aux_labels->Data();
+  }
+  auto lambda_set_arcs = [=] __host__ __device__(int32_t i) -> void {
+    int32_t fsa_idx0 = row_ids1_data[i],
+            state = i - row_splits1_data[fsa_idx0],
+            begin = tokens_row_splits1_data[fsa_idx0],
+            len = tokens_row_splits1_data[fsa_idx0 + 1] - begin,
+            token_idx01 = begin + state / 2,
+            arc_idx012 = row_splits2_data[i],
+            end = row_splits2_data[i + 1], final_state = 2 * len + 1;
+    if (arc_idx012 == end) return;  // the final state
+    Arc arcs_out[3];
+    int32_t labels[3];
+    if (state % 2 == 0) {
+      arcs_out[0] = Arc(state, state, 0, 0.0f);
+      labels[0] = 0;
+      if (state / 2 < len) {
+        int32_t token = tokens_data[token_idx01];
+        arcs_out[1] = Arc(state, state + 1, token, 0.0f);
+        labels[1] = token;
+      } else {
+        arcs_out[1] = Arc(state, final_state, -1, 0.0f);
+        labels[1] = -1;
+      }
+    } else {
+      int32_t token = tokens_data[token_idx01];
+      arcs_out[0] = Arc(state, state, token, 0.0f);
+      labels[0] = 0;
+      arcs_out[1] = Arc(state, state + 1, 0, 0.0f);
+      labels[1] = 0;
+      if (state / 2 + 1 == len) {
+        arcs_out[2] = Arc(state, final_state, -1, 0.0f);
+        labels[2] = -1;
+      } else {
+        int32_t next_token = tokens_data[token_idx01 + 1];
+        arcs_out[2] = Arc(state, state + 2, next_token, 0.0f);
+        labels[2] = next_token;
+      }
+    }
+    for (int32_t j = 0; arc_idx012 + j < end; ++j) {
+      arcs_data[arc_idx012 + j] = arcs_out[j];
+      row_ids2_data[arc_idx012 + j] = i;
+      if (aux_labels_data != nullptr)
+        aux_labels_data[arc_idx012 + j] = labels[j];
+    }
+  };
+  Eval(c, num_states, lambda_set_arcs);
+  RaggedShape shape = RaggedShape3(&row_splits1, &row_ids1, num_states,
+                                   &row_splits2, &row_ids2, num_arcs);
+  return FsaVec(shape, arcs);
+}
+
+Array1<int32_t> GetDestStates(FsaVec &fsas) {
+  K2_CHECK_EQ(fsas.NumAxes(), 3);
+  ContextPtr &c = fsas.Context();
+  int32_t num_arcs = fsas.values.Dim();
+  RaggedShapeAccessor<3> shape = fsas.shape.Accessor<3>();
+  const Arc *arcs_data = fsas.values.Data();
+  Array1<int32_t> ans(c, num_arcs);
+  int32_t *ans_data = ans.Data();
+  auto lambda_set_dest_states = [=] __host__ __device__(int32_t i) -> void {
+    int32_t state_idx0x = shape.RowSplit<1>(shape.Idx<0>(i));
+    ans_data[i] = state_idx0x + arcs_data[i].dest_state;
+  };
+  Eval(c, num_arcs, lambda_set_dest_states);
+  return ans;
+}
+
+Ragged<int32_t> GetEnteringArcs(FsaVec &fsas) {
+  K2_CHECK_EQ(fsas.NumAxes(), 3);
+  ContextPtr &c = fsas.Context();
+  int32_t num_states = fsas.shape.TotSize(1), num_arcs = fsas.values.Dim();
+  // The arcs, stably sorted by dest-state, are the answer; the sorted
+  // dest-states are its row_ids.
+  Array1<int32_t> dest_states = GetDestStates(fsas),
+                  sort_row_splits(c, std::vector<int32_t>{0, num_arcs}),
+                  order(c, num_arcs), row_splits(c, num_states + 1);
+  Ragged<int32_t> keys(RaggedShape2(&sort_row_splits, nullptr, num_arcs),
+                       dest_states);
+  SortSublists(&keys, &order);
+  RowIdsToRowSplits(keys.values, row_splits);
+  return Ragged<int32_t>(
+      RaggedShape2(&row_splits, &keys.values, num_arcs), order);
+}
+
+Ragged<int32_t> GetStateBatches(FsaVec &fsas,
+                                const Array1<char> *use_arcs /*= nullptr*/) {
+  K2_CHECK_EQ(fsas.NumAxes(), 3);
+  ContextPtr &c = fsas.Context();
+  int32_t num_states = fsas.shape.TotSize(1), num_arcs = fsas.values.Dim();
+  if (use_arcs != nullptr) K2_CHECK_EQ(use_arcs->Dim(), num_arcs);
+  Array1<int32_t> dest_states = GetDestStates(fsas);
+  const int32_t *row_splits2_data = fsas.shape.RowSplits(2).Data(),
+                *dest_states_data = dest_states.Data();
+  const char *use_arcs_data =
+      (use_arcs != nullptr && num_arcs != 0 ? use_arcs->Data() : nullptr);
+
+  Array1<int32_t> in_degree(c, num_states, 0);
+  int32_t *in_degree_data = in_degree.Data();
+  auto lambda_count_entering = [=] __host__ __device__(int32_t i) -> void {
+    if (use_arcs_data == nullptr || use_arcs_data[i])
+      atomicAdd(in_degree_data + dest_states_data[i], 1);
+  };
+  Eval(c, num_arcs, lambda_count_entering);
+
+  // This is Kahn's algorithm, as in TopSort(): the states of each batch are
+  // those whose last entering arc is removed when the previous batch is
+  // processed, and they are written right after it.  The counts for
+  // consecutive batches alternate between counts[1] and counts[0], and each
+  // kernel resets the other one.
+  Array1<int32_t> states(c, num_states), counts(c, 2, 0);
+  int32_t *states_data = states.Data(), *counts_data = counts.Data();
+  auto lambda_set_first_batch = [=] __host__ __device__(int32_t i) -> void {
+    if (in_degree_data[i] == 0) states_data[atomicAdd(counts_data, 1)] = i;
+  };
+  Eval(c, num_states, lambda_set_first_batch);
+  ContextPtr cpu = GetCpuContext();
+  std::vector<int32_t> batch_splits = {0, counts.To(cpu)[0]};
+  for (int32_t batch = 1;; ++batch) {
+    int32_t begin = batch_splits[batch - 1], end = batch_splits[batch];
+    if (begin == end) break;
+    int32_t *count_data = counts_data + (batch & 1),
+            *other_count_data = counts_data + ((batch + 1) & 1);
+    auto lambda_remove_arcs = [=] __host__ __device__(int32_t i) -> void {
+      if (i == 0) *other_count_data = 0;
+      int32_t state = states_data[begin + i];
+      for (int32_t j = row_splits2_data[state];
+           j < row_splits2_data[state + 1]; ++j) {
+        if (use_arcs_data != nullptr && !use_arcs_data[j]) continue;
+        int32_t dest_state = dest_states_data[j];
+        // atomicAdd() returns the old value, so only one thread sees 1.
+        if (atomicAdd(in_degree_data + dest_state, -1) == 1)
+          states_data[end + atomicAdd(count_data, 1)] = dest_state;
+      }
+    };
+    Eval(c, end - begin, lambda_remove_arcs);
+    batch_splits.push_back(end + counts.To(cpu)[batch & 1]);
+  }
+  batch_splits.pop_back();
+  // The states that are left are on cycles.
+  K2_CHECK_EQ(batch_splits.back(), num_states) << "The FSAs have cycles";
+  Array1<int32_t> row_splits(c, batch_splits);
+  return Ragged<int32_t>(RaggedShape2(&row_splits, nullptr, num_states),
+                         states);
+}
+
+// Returns the shape of an arc-batches array (see GetEnteringArcBatches()),
+// from that of `state_batches` and the number of arcs of each state.
+static RaggedShape ArcBatchesShape(Ragged<int32_t> &state_batches,
+                                   const Array1<int32_t> &num_state_arcs) {
+  ContextPtr &c = state_batches.Context();
+  int32_t num_states = state_batches.values.Dim();
+  const int32_t *states_data = state_batches.values.Data(),
+                *num_state_arcs_data = num_state_arcs.Data();
+  Array1<int32_t> row_splits2(c, num_states + 1);
+  int32_t *row_splits2_data = row_splits2.Data();
+  auto lambda_set_sizes = [=] __host__ __device__(int32_t i) -> void {
+    row_splits2_data[i] = num_state_arcs_data[states_data[i]];
+  };
+  Eval(c, num_states, lambda_set_sizes);
+  int32_t num_arcs = ExclusiveSumWithTotal(c, num_states + 1,
+                                           row_splits2_data, row_splits2_data);
+  Array1<int32_t> row_splits1 = state_batches.shape.RowSplits(1),
+                  row_ids1 = state_batches.shape.RowIds(1);
+  return RaggedShape3(&row_splits1, &row_ids1, num_states, &row_splits2,
+                      nullptr, num_arcs);
+}
+
+Ragged<int32_t> GetEnteringArcBatches(FsaVec &fsas,
+                                      Ragged<int32_t> &state_batches) {
+  K2_CHECK_EQ(fsas.NumAxes(), 3);
+  K2_CHECK_EQ(state_batches.values.Dim(), fsas.shape.TotSize(1));
+  ContextPtr &c = fsas.Context();
+  int32_t num_states = fsas.shape.TotSize(1), num_arcs = fsas.values.Dim();
+  // The arcs, stably sorted by dest-state, give the arcs entering each state
+  // in order.  (The counting doesn't need the dest-states in the original
+  // order.)
+  Array1<int32_t> dest_states = GetDestStates(fsas),
+                  sort_row_splits(c, std::vector<int32_t>{0, num_arcs}),
+                  order(c, num_arcs);
+  Ragged<int32_t> keys(RaggedShape2(&sort_row_splits, nullptr, num_arcs),
+                       dest_states);
+  SortSublists(&keys, &order);
+  Array1<int32_t> in_degree(c, num_states + 1, 0);
+  int32_t *in_degree_data = in_degree.Data();
+  const int32_t *dest_states_data = dest_states.Data();
+  auto lambda_count_entering = [=] __host__ __device__(int32_t i) -> void {
+    atomicAdd(in_degree_data + dest_states_data[i], 1);
+  };
+  Eval(c, num_arcs, lambda_count_entering);
+  RaggedShape shape = ArcBatchesShape(state_batches, in_degree);
+  // Now the row_splits of the arcs entering each state, in `order`.
+  ExclusiveSumInPlace(&in_degree);
+
+  const int32_t *states_data = state_batches.values.Data(),
+                *row_splits2_data = shape.RowSplits(2).Data(),
+                *row_ids2_data = shape.RowIds(2).Data(),
+                *order_data = order.Data();
+  int32_t num_entering = shape.NumElements();
+  Array1<int32_t> values(c, num_entering);
+  int32_t *values_data = values.Data();
+  auto lambda_set_arcs = [=] __host__ __device__(int32_t i) -> void {
+    int32_t idx01 = row_ids2_data[i];
+    values_data[i] = order_data[in_degree_data[states_data[idx01]] + i -
+                                row_splits2_data[idx01]];
+  };
+  Eval(c, num_entering, lambda_set_arcs);
+  return Ragged<int32_t>(shape, values);
+}
+
+Ragged<int32_t> GetLeavingArcBatches(FsaVec &fsas,
+                                     Ragged<int32_t> &state_batches) {
+  K2_CHECK_EQ(fsas.NumAxes(), 3);
+  K2_CHECK_EQ(state_batches.values.Dim(), fsas.shape.TotSize(1));
+  ContextPtr &c = fsas.Context();
+  int32_t num_states = fsas.shape.TotSize(1);
+  const int32_t *fsa_row_splits2_data = fsas.shape.RowSplits(2).Data();
+  Array1<int32_t> out_degree(c, num_states);
+  int32_t *out_degree_data = out_degree.Data();
+  auto lambda_count_leaving = [=] __host__ __device__(int32_t i) -> void {
+    out_degree_data[i] = fsa_row_splits2_data[i + 1] - fsa_row_splits2_data[i];
+  };
+  Eval(c, num_states, lambda_count_leaving);
+  RaggedShape shape = ArcBatchesShape(state_batches, out_degree);
+
+  const int32_t *states_data = state_batches.values.Data(),
+                *row_splits2_data = shape.RowSplits(2).Data(),
+                *row_ids2_data = shape.RowIds(2).Data();
+  int32_t num_leaving = shape.NumElements();
+  Array1<int32_t> values(c, num_leaving);
+  int32_t *values_data = values.Data();
+  auto lambda_set_arcs = [=] __host__ __device__(int32_t i) -> void {
+    int32_t idx01 = row_ids2_data[i];
+    values_data[i] = fsa_row_splits2_data[states_data[idx01]] + i -
+                     row_splits2_data[idx01];
+  };
+  Eval(c, num_leaving, lambda_set_arcs);
+  return Ragged<int32_t>(shape, values);
+}
+
+/*
+  Implementation of GetForwardScores() (if !backward) and GetBackwardScores():
+  `arc_batches` are the entering or leaving arcs.  The reduction for each
+  state is over one element for the state itself (0 for the start or final
+  state, else -infinity) and one for each of its arcs, so no state has an
+  empty list.  The scores are kept in the order of the states in
+  `state_batches` while they are computed, so the elements of each batch are
+  contiguous.  The reduction is Semiring::Plus(), see semiring.h.
+ */
+template <typename Semiring>
+static Array1<typename Semiring::Value> GetScores(
+    FsaVec &fsas, Ragged<int32_t> &state_batches,
+    Ragged<int32_t> &arc_batches, bool backward) {
+  using FloatType = typename Semiring::Value;
+  K2_CHECK_EQ(fsas.NumAxes(), 3);
+  K2_CHECK_EQ(state_batches.NumAxes(), 2);
+  K2_CHECK_EQ(arc_batches.NumAxes(), 3);
+  ContextPtr &c = fsas.Context();
+  int32_t num_states = fsas.shape.TotSize(1),
+          num_batches = state_batches.shape.Dim0();
+  K2_CHECK_EQ(state_batches.values.Dim(), num_states);
+  K2_CHECK_EQ(arc_batches.shape.TotSize(1), num_states);
+  if (num_states == 0) return Array1<FloatType>(c, 0);
+
+  const int32_t *row_splits1_data = fsas.shape.RowSplits(1).Data(),
+                *row_ids1_data = fsas.shape.RowIds(1).Data(),
+                *states_data = state_batches.values.Data(),
+                *batch_row_ids_data = state_batches.shape.RowIds(1).Data(),
+                *arc_row_splits_data = arc_batches.shape.RowSplits(2).Data(),
+                *arcs_idx_data = arc_batches.values.Data();
+  const Arc *arcs_data = fsas.values.Data();
+  Array1<int32_t> batch_splits = state_batches.shape.RowSplits(1);
+  const int32_t *batch_splits_data = batch_splits.Data();
+
+  // `elem_splits` are the row_splits of the lists to reduce: the arcs of each
+  // state plus one.  local_splits[i + b] is elem_splits[i] minus its value at
+  // the start of batch b, for i from the start to the end of batch b, so each
+  // batch has row_splits starting from 0.
+  Array1<int32_t> elem_splits(c, num_states + 1), pos_of_state(c, num_states),
+      local_splits(c, num_states + num_batches);
+  int32_t *elem_splits_data = elem_splits.Data(),
+          *pos_of_state_data = pos_of_state.Data(),
+          *local_splits_data = local_splits.Data();
+  auto lambda_set_elem_splits = [=] __host__ __device__(int32_t i) -> void {
+    elem_splits_data[i] = arc_row_splits_data[i] + i;
+    if (i < num_states) pos_of_state_data[states_data[i]] = i;
+  };
+  Eval(c, num_states + 1, lambda_set_elem_splits);
+  int32_t num_elems = arc_batches.values.Dim() + num_states;
+  auto lambda_set_local_splits = [=] __host__ __device__(int32_t i) -> void {
+    int32_t batch = batch_row_ids_data[i];
+    local_splits_data[i + batch] =
+        elem_splits_data[i] - elem_splits_data[batch_splits_data[batch]];
+  };
+  Eval(c, num_states, lambda_set_local_splits);
+  auto lambda_set_local_ends = [=] __host__ __device__(int32_t i) -> void {
+    int32_t end = batch_splits_data[i + 1];
+    local_splits_data[end + i] =
+        elem_splits_data[end] - elem_splits_data[batch_splits_data[i]];
+  };
+  Eval(c, num_batches, lambda_set_local_ends);
+  Array1<int32_t> elem_row_ids(c, num_elems);
+  int32_t *elem_row_ids_data = elem_row_ids.Data();
+  RowSplitsToRowIds(c, num_states, elem_splits_data, num_elems,
+                    elem_row_ids_data);
+  ContextPtr cpu = GetCpuContext();
+  Array1<int32_t> batch_splits_cpu = batch_splits.To(cpu),
+                  batch_elem_splits = elem_splits[batch_splits].To(cpu);
+
+  const FloatType zero = Semiring::Zero();
+  Array1<FloatType> elems(c, num_elems), pos_scores(c, num_states);
+  FloatType *elems_data = elems.Data();
+  const FloatType *pos_scores_data = pos_scores.Data();
+  for (int32_t i = 0; i < num_batches; ++i) {
+    int32_t batch = (backward ? num_batches - 1 - i : i),
+            begin = batch_splits_cpu[batch],
+            size = batch_splits_cpu[batch + 1] - begin,
+            elem_begin = batch_elem_splits[batch],
+            num_batch_elems = batch_elem_splits[batch + 1] - elem_begin;
+    auto lambda_set_elems = [=] __host__ __device__(int32_t j) -> void {
+      int32_t elem = elem_begin + j, pos = elem_row_ids_data[elem],
+              state = states_data[pos], fsa_idx0 = row_ids1_data[state],
+              k = elem - elem_splits_data[pos];
+      FloatType value;
+      if (k == 0) {
+        bool is_end = (backward ? state + 1 == row_splits1_data[fsa_idx0 + 1]
+                                : state == row_splits1_data[fsa_idx0]);
+        value = (is_end ? Semiring::One() : zero);
+      } else {
+        const Arc &arc = arcs_data[arcs_idx_data[arc_row_splits_data[pos] +
+                                                  k - 1]];
+        int32_t other_state = row_splits1_data[fsa_idx0] +
+                              (backward ? arc.dest_state : arc.src_state);
+        value = Semiring::Times(pos_scores_data[pos_of_state_data[other_state]],
+                                Semiring::FromScore(arc.score));
+      }
+      elems_data[elem] = value;
+    };
+    Eval(c, num_batch_elems, lambda_set_elems);
+    Array1<int32_t> row_splits = local_splits.Range(begin + batch, size + 1);
+    Ragged<FloatType> batch_elems(
+        RaggedShape2(&row_splits, nullptr, num_batch_elems),
+        elems.Range(elem_begin, num_batch_elems));
+    Array1<FloatType> batch_scores = pos_scores.Range(begin, size);
+    ApplyOpPerSublist<FloatType, typename Semiring::PlusOp>(
+        batch_elems, zero, &batch_scores);
+  }
+  return pos_scores[pos_of_state];
+}
+
+template <typename Semiring>
+Array1<typename Semiring::Value> GetForwardScores(
+    FsaVec &fsas, Ragged<int32_t> &state_batches,
+    Ragged<int32_t> &entering_arc_batches) {
+  return GetScores<Semiring>(fsas, state_batches, entering_arc_batches, false);
+}
+
+template <typename Semiring>
+Array1<typename Semiring::Value> GetBackwardScores(
+    FsaVec &fsas, Ragged<int32_t> &state_batches,
+    Ragged<int32_t> &leaving_arc_batches) {
+  return GetScores<Semiring>(fsas, state_batches, leaving_arc_batches, true);
+}
+
+template <typename FloatType>
+Array1<FloatType> GetForwardScores(FsaVec &fsas,
+                                   Ragged<int32_t> &state_batches,
+                                   Ragged<int32_t> &entering_arc_batches,
+                                   bool log_semiring) {
+  if (log_semiring)
+    return GetForwardScores<LogSemiring<FloatType>>(fsas, state_batches,
+                                                    entering_arc_batches);
+  return GetForwardScores<TropicalSemiring<FloatType>>(fsas, state_batches,
+                                                       entering_arc_batches);
+}
+
+template <typename FloatType>
+Array1<FloatType> GetBackwardScores(FsaVec &fsas,
+                                    Ragged<int32_t> &state_batches,
+                                    Ragged<int32_t> &leaving_arc_batches,
+                                    bool log_semiring) {
+  if (log_semiring)
+    return GetBackwardScores<LogSemiring<FloatType>>(fsas, state_batches,
+                                                     leaving_arc_batches);
+  return GetBackwardScores<TropicalSemiring<FloatType>>(fsas, state_batches,
+                                                        leaving_arc_batches);
+}
+
+template <typename FloatType>
+Array1<FloatType> GetTotScores(FsaVec &fsas,
+                               const Array1<FloatType> &forward_scores) {
+  K2_CHECK_EQ(fsas.NumAxes(), 3);
+  K2_CHECK_EQ(forward_scores.Dim(), fsas.shape.TotSize(1));
+  ContextPtr &c = fsas.Context();
+  int32_t num_fsas = fsas.shape.Dim0();
+  const int32_t *row_splits1_data = fsas.shape.RowSplits(1).Data();
+  const FloatType *forward_scores_data = forward_scores.Data();
+  const FloatType minus_inf = -std::numeric_limits<FloatType>::infinity();
+  Array1<FloatType> ans(c, num_fsas);
+  FloatType *ans_data = ans.Data();
+  auto lambda_set_tot_scores = [=] __host__ __device__(int32_t i) -> void {
+    int32_t begin = row_splits1_data[i], end = row_splits1_data[i + 1];
+    ans_data[i] = (begin == end ? minus_inf : forward_scores_data[end - 1]);
+  };
+  Eval(c, num_fsas, lambda_set_tot_scores);
+  return ans;
+}
+
+template <typename FloatType>
+Array1<FloatType> GetArcPost(FsaVec &fsas,
+                             const Array1<FloatType> &forward_scores,
+                             const Array1<FloatType> &backward_scores) {
+  K2_CHECK_EQ(fsas.NumAxes(), 3);
+  K2_CHECK_EQ(backward_scores.Dim(), fsas.shape.TotSize(1));
+  ContextPtr &c = fsas.Context();
+  int32_t num_arcs = fsas.values.Dim();
+  Array1<FloatType> tot_scores = GetTotScores(fsas, forward_scores),
+                    ans(c, num_arcs);
+  RaggedShapeAccessor<3> shape = fsas.shape.Accessor<3>();
+  const Arc *arcs_data = fsas.values.Data();
+  const FloatType *forward_scores_data = forward_scores.Data(),
+                  *backward_scores_data = backward_scores.Data(),
+                  *tot_scores_data = tot_scores.Data();
+  const FloatType minus_inf = -std::numeric_limits<FloatType>::infinity();
+  FloatType *ans_data = ans.Data();
+  auto lambda_set_arc_post = [=] __host__ __device__(int32_t i) -> void {
+    int32_t fsa_idx0 = shape.Idx<0>(i),
+            state_idx0x = shape.RowSplit<1>(fsa_idx0);
+    const Arc &arc = arcs_data[i];
+    FloatType tot_score = tot_scores_data[fsa_idx0];
+    // This avoids NaN's (-infinity minus -infinity) if the final state can't
+    // be reached.
+    ans_data[i] =
+        (tot_score == minus_inf
+             ? minus_inf
+             : forward_scores_data[state_idx0x + arc.src_state] + arc.score +
+                   backward_scores_data[state_idx0x + arc.dest_state] -
+                   tot_score);
+  };
+  Eval(c, num_arcs, lambda_set_arc_post);
+  return ans;
+}
+
+template <typename FloatType>
+ForwardBackwardTotals<FloatType> GetForwardBackwardTotals(
+    FsaVec &fsas, bool log_semiring, const Array1<int32_t> *arc_map,
+    int32_t num_classes, const AllReduceFunc &all_reduce /*= nullptr*/) {
+  K2_CHECK_EQ(fsas.NumAxes(), 3);
+  ContextPtr &c = fsas.Context();
+  int32_t num_fsas = fsas.shape.Dim0(), num_arcs = fsas.values.Dim();
+  if (arc_map != nullptr) {
+    K2_CHECK(c->IsCompatible(*arc_map->Context()));
+    K2_CHECK_EQ(arc_map->Dim(), num_arcs);
+  } else {
+    K2_CHECK_EQ(num_classes, num_arcs);
+  }
+  Ragged<int32_t> state_batches = GetStateBatches(fsas),
+                  entering_arc_batches =
+                      GetEnteringArcBatches(fsas, state_batches),
+                  leaving_arc_batches =
+                      GetLeavingArcBatches(fsas, state_batches);
+  Array1<FloatType> forward_scores = GetForwardScores<FloatType>(
+                        fsas, state_batches, entering_arc_batches,
+                        log_semiring),
+                    backward_scores = GetBackwardScores<FloatType>(
+                        fsas, state_batches, leaving_arc_batches,
+                        log_semiring),
+                    arc_post =
+                        GetArcPost(fsas, forward_scores, backward_scores);
+
+  ForwardBackwardTotals<FloatType> ans;
+  ans.tot_scores = GetTotScores(fsas, forward_scores);
+  ans.stats = Array1<FloatType>(c, num_classes + 2, FloatType(0));
+  ans.occupation = ans.stats.Range(2, num_classes);
+  const FloatType *tot_scores_data = ans.tot_scores.Data(),
+                  *arc_post_data = arc_post.Data();
+  const int32_t *arc_map_data =
+      (arc_map != nullptr ? arc_map->Data() : nullptr);
+  FloatType *stats_data = ans.stats.Data(),
+            *occupation_data = ans.occupation.Data();
+  const FloatType minus_inf = -std::numeric_limits<FloatType>::infinity();
+  auto lambda_sum_tot_scores = [=] __host__ __device__(int32_t i) -> void {
+    FloatType tot_score = tot_scores_data[i];
+    if (tot_score != minus_inf) {
+      atomicAdd(stats_data, tot_score);
+      atomicAdd(stats_data + 1, FloatType(1));
+    }
+  };
+  Eval(c, num_fsas, lambda_sum_tot_scores);
+  auto lambda_add_occupation = [=] __host__ __device__(int32_t i) -> void {
+    int32_t j = (arc_map_data != nullptr ? arc_map_data[i] : i);
+    K2_DCHECK_GE(j, -1);
+    K2_DCHECK_LT(j, num_classes);
+    // The exp() of -infinity is 0.
+    if (j != -1) atomicAdd(occupation_data + j, exp(arc_post_data[i]));
+  };
+  Eval(c, num_arcs, lambda_add_occupation);
+
+  if (all_reduce)
+    all_reduce(c, DtypeOf<FloatType>::dtype, ans.stats.Data(),
+               ans.stats.Dim());
+  return ans;
+}
+
+#define K2_INSTANTIATE_SEMIRING_SCORES(Semiring)                 \
+  template Array1<Semiring::Value> GetForwardScores<Semiring>(   \
+      FsaVec &fsas, Ragged<int32_t> &state_batches,              \
+      Ragged<int32_t> &entering_arc_batches);                    \
+  template Array1<Semiring::Value> GetBackwardScores<Semiring>(  \
+      FsaVec &fsas, Ragged<int32_t> &state_batches,              \
+      Ragged<int32_t> &leaving_arc_batches)
+K2_INSTANTIATE_SEMIRING_SCORES(TropicalSemiring<float>);
+K2_INSTANTIATE_SEMIRING_SCORES(TropicalSemiring<double>);
+K2_INSTANTIATE_SEMIRING_SCORES(LogSemiring<float>);
+K2_INSTANTIATE_SEMIRING_SCORES(LogSemiring<double>);
+K2_INSTANTIATE_SEMIRING_SCORES(LogCountSemiring<float>);
+K2_INSTANTIATE_SEMIRING_SCORES(LogCountSemiring<double>);
+#undef K2_INSTANTIATE_SEMIRING_SCORES
+
+template Array1<float> GetForwardScores<float>(
+    FsaVec &fsas, Ragged<int32_t> &state_batches,
+    Ragged<int32_t> &entering_arc_batches, bool log_semiring);
+template Array1<double> GetForwardScores<double>(
+    FsaVec &fsas, Ragged<int32_t> &state_batches,
+    Ragged<int32_t> &entering_arc_batches, bool log_semiring);
+template Array1<float> GetBackwardScores<float>(
+    FsaVec &fsas, Ragged<int32_t> &state_batches,
+    Ragged<int32_t> &leaving_arc_batches, bool log_semiring);
+template Array1<double> GetBackwardScores<double>(
+    FsaVec &fsas, Ragged<int32_t> &state_batches,
+    Ragged<int32_t> &leaving_arc_batches, bool log_semiring);
+template Array1<float> GetTotScores<float>(
+    FsaVec &fsas, const Array1<float> &forward_scores);
+template Array1<double> GetTotScores<double>(
+    FsaVec &fsas, const Array1<double> &forward_scores);
+template Array1<float> GetArcPost<float>(
+    FsaVec &fsas, const Array1<float> &forward_scores,
+    const Array1<float> &backward_scores);
+template Array1<double> GetArcPost<double>(
+    FsaVec &fsas, const Array1<double> &forward_scores,
+    const Array1<double> &backward_scores);
+template ForwardBackwardTotals<float> GetForwardBackwardTotals<float>(
+    FsaVec &fsas, bool log_semiring, const Array1<int32_t> *arc_map,
+    int32_t num_classes, const AllReduceFunc &all_reduce);
+template ForwardBackwardTotals<double> GetForwardBackwardTotals<double>(
+    FsaVec &fsas, bool log_semiring, const Array1<int32_t> *arc_map,
+    int32_t num_classes, const AllReduceFunc &all_reduce);
+
 }  // namespace k2
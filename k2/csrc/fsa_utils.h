@@ -1,7 +1,9 @@
 /**
- * @brief Utilities for creating FSAs.
+ * @brief Utilities for creating FSAs, and for computing the forward and
+ * backward scores of FsaVecs.
  *
- * Note that serializations are done in Python.
+ * Note that serializations are done in Python, except for the binary
+ * format of WriteFsaBinary() / ReadFsaBinary().
  *
  * @copyright
  * Copyright (c)  2020  Mobvoi Inc.        (authors: Fangjun Kuang)
@@ -13,10 +15,13 @@
 #ifndef K2_CSRC_FSA_UTILS_H_
 #define K2_CSRC_FSA_UTILS_H_
 
+#include <functional>
 #include <string>
 
 #include "k2/csrc/array.h"
+#include "k2/csrc/dtype.h"
 #include "k2/csrc/fsa.h"
+#include "k2/csrc/semiring.h"
 
 namespace k2 {
 
@@ -49,6 +54,9 @@ namespace k2 {
 
   CAUTION: The first column has to be in non-decreasing order.
 
+  Lines after the line for the final state are ignored.  Long strings are
+  parsed in parallel, in chunks of lines.
+
   @param [in]   s   The input string. See the above description for its format.
   @param [in]   negate_scores
                     If true, the string form has the weights as costs,
@@ -96,6 +104,322 @@ Fsa FsaFromString(const std::string &s, bool negate_scores = false,
  */
 std::string FsaToString(const Fsa &fsa, bool negate_scores = false,
                         const Array1<int32_t> *aux_labels = nullptr);
+
+// The version of the binary format written by WriteFsaBinary().
+constexpr int32_t kFsaBinaryVersion = 1;
+
+// Each array in the binary format starts at a multiple of this many bytes
+// from the start of the file, so it can be mapped by itself on any common
+// page size.
+constexpr int64_t kFsaBinaryAlignment = 65536;
+
+/*
+  Writes an Fsa or FsaVec to `filename` in a binary format that
+  ReadFsaBinary() can load without parsing: a header
+  (magic number, version, sizes, the `and` of the properties of the FSAs),
+  followed by the row_splits of each axis, the arcs and, optionally, the
+  aux_labels, each as it is in memory.
+
+    @param [in] filename    The file to write; dies on error.
+    @param [in] fsa         The Fsa (2 axes) or FsaVec (3 axes) to write;
+                            may be on any device.
+    @param [in] aux_labels  If not NULL, the aux_labels of the arcs, which
+                            will be written too; must have dimension
+                            fsa.NumElements().
+ */
+void WriteFsaBinary(const std::string &filename, Fsa &fsa,
+                    const Array1<int32_t> *aux_labels = nullptr);
+
+/*
+  Reads an Fsa or FsaVec written by WriteFsaBinary().  Dies if the file can't
+  be read or isn't in the expected format.
+
+  If `c` is a CPU context, the file is memory-mapped and the returned arrays
+  refer to the mapped pages (privately, so modifying them doesn't change the
+  file), with no copy and nothing read until it is used.  If `c` is a CUDA
+  context, the mapped pages are streamed to the device through pinned
+  buffers, overlapping the reads from the file with the transfers.
+
+    @param [in] filename    The file to read
+    @param [in] c           The context for the result; if NULL, the CPU.
+    @param [out] aux_labels  If not NULL, the aux_labels will be written to
+                            here, or an empty array if the file has none.
+    @param [out] properties  If not NULL, the properties written with the
+                            FSAs (the `and` of their FsaBasicProperties)
+                            will be written to here.
+    @return   Returns the Fsa (2 axes) or FsaVec (3 axes) that was written.
+ */
+Fsa ReadFsaBinary(const std::string &filename, ContextPtr c = nullptr,
+                  Array1<int32_t> *aux_labels = nullptr,
+                  int32_t *properties = nullptr);
+
+/*
+  Creates the linear acceptors of a list of symbol sequences, e.g. the
+  transcripts of a minibatch: FSA i has symbols.RowSplits(1)[i+1] -
+  symbols.RowSplits(1)[i] + 2 states, an arc from state j to j + 1 with the
+  j'th symbol of sequence i, and the final arc.  All the scores are 0.  It
+  is done on the context of `symbols` without any transfer to the host.
+
+    @param [in] symbols  The sequences; must have 2 axes and no element
+                         equal to -1.  Sequences may be empty.
+    @return  Returns an FsaVec with symbols.Dim0() FSAs, which are
+             top-sorted and arc-sorted.
+ */
+FsaVec LinearFsas(Ragged<int32_t> &symbols);
+
+/*
+  Creates the CTC graphs of a list of token sequences, e.g. the supervision
+  graphs of a minibatch for CTC training.  For a sequence of L tokens
+  t_0 ... t_{L-1}, state 2j (0 <= j <= L) is "blank before t_j" and state
+  2j + 1 (j < L) is "in t_j"; state 2L + 1 is final.  The arcs are:
+
+     2j -> 2j         blank (0), self-loop
+     2j -> 2j + 1     t_j, if j < L
+     2L -> 2L + 1     the final arc
+     2j+1 -> 2j+1     t_j, self-loop (the repeats of a token)
+     2j+1 -> 2j+2     blank
+     2j+1 -> 2j+3     t_{j+1}, if j + 1 < L and (modified or
+                      t_{j+1} != t_j), i.e. without a blank between them
+     2L-1 -> 2L + 1   the final arc
+
+  All the scores are 0.  The states are counted, and the arcs written, with
+  one kernel each on the context of `tokens`, with no transfer to the host.
+
+    @param [in] tokens   The token sequences; must have 2 axes, and the
+                         tokens must be > 0 (0 is blank).  Sequences may be
+                         empty, giving the FSA that accepts only blanks.
+    @param [in] modified  If true, consecutive identical tokens don't need
+                         a blank between them (the transition from t_j to
+                         t_{j+1} is there even if they are equal); this is
+                         the "modified" CTC topology.
+    @param [out] aux_labels  If not nullptr, will be set to the output
+                         label of each arc, which is the token of the arcs
+                         that enter a token state from another state, -1
+                         for the final arcs and 0 for the others, so that
+                         the graphs can be used as transducers from
+                         frames to tokens.
+    @return  Returns an FsaVec with tokens.Dim0() FSAs.
+ */
+FsaVec CtcGraphs(Ragged<int32_t> &tokens, bool modified = false,
+                 Array1<int32_t> *aux_labels = nullptr);
+
+/*
+  Returns the dest-states of the arcs of `fsas` as idx01's, i.e. indexes into
+  the states of all the FSAs.
+
+    @param [in] fsas  The FsaVec; must have 3 axes.
+    @return  Returns an array with dimension fsas.values.Dim().
+ */
+Array1<int32_t> GetDestStates(FsaVec &fsas);
+
+/*
+  Returns the arcs entering each state of `fsas` (as arc_idx012's), indexed
+  [state][arc] with the states as idx01's; the arcs entering each state are
+  in the order of their indexes.  Unlike GetEnteringArcBatches(), `fsas` may
+  be cyclic.
+
+    @param [in] fsas  The FsaVec; must have 3 axes.
+    @return  Returns a ragged array with TotSize(0) == fsas.shape.TotSize(1)
+             and fsas.values.Dim() elements.
+ */
+Ragged<int32_t> GetEnteringArcs(FsaVec &fsas);
+
+/*
+  Sorts the states of all the FSAs of `fsas` into batches ("levels") that can
+  be processed in parallel: a state is in batch b + 1 if the latest of the
+  states that have arcs entering it is in batch b, and in batch 0 if no arcs
+  enter it.  So for an arc, the batch of its dest-state is later than that of
+  its source state.  The first batch has the start states, and (for each FSA
+  with more than one state and the final state reachable) the final state is
+  in a later batch.
+
+    @param [in] fsas  The FsaVec; must be acyclic, but need not be top-sorted.
+    @param [in] use_arcs  If not nullptr, only the arcs i with
+                      (*use_arcs)[i] != 0 are considered (and only they need
+                      to be acyclic); e.g. the epsilon arcs, for epsilon
+                      closures.
+    @return  Returns a ragged array indexed [batch][state], whose elements are
+             the idx01's of the states.  Each state appears exactly once, so
+             ans.values is a permutation of the states.
+ */
+Ragged<int32_t> GetStateBatches(FsaVec &fsas,
+                                const Array1<char> *use_arcs = nullptr);
+
+/*
+  Returns the arcs entering each state of `state_batches` (as arc_idx012's),
+  indexed [batch][state][arc], i.e. with the same first two axes as
+  `state_batches`.  The arcs entering each state are in the order of their
+  indexes.
+ */
+Ragged<int32_t> GetEnteringArcBatches(FsaVec &fsas,
+                                      Ragged<int32_t> &state_batches);
+
+/*
+  Returns the arcs leaving each state of `state_batches` (as arc_idx012's),
+  indexed [batch][state][arc], i.e. with the same first two axes as
+  `state_batches`.
+ */
+Ragged<int32_t> GetLeavingArcBatches(FsaVec &fsas,
+                                     Ragged<int32_t> &state_batches);
+
+/*
+  Computes the forward scores of the states of an FsaVec on its device: the
+  best (max) or total (log-sum) score of the paths from the start state of its
+  FSA to each state.  This is the same as k2host::ComputeForwardMaxWeights()
+  and k2host::ComputeForwardLogSumWeights(), but for all the FSAs at once:
+  the batches of `state_batches` are processed one after the other, with the
+  scores of the arcs entering the states of a batch reduced per state.  There
+  is no transfer to the host except for the sizes of the batches.
+
+    @param [in] fsas  The FsaVec; must be acyclic.
+    @param [in] state_batches  Must be GetStateBatches(fsas).
+    @param [in] entering_arc_batches  Must be
+                      GetEnteringArcBatches(fsas, state_batches).
+    @param [in] log_semiring  If true, the log-sum is taken of the scores of
+                      the paths, else the max.
+    @return  Returns the forward scores, indexed by state_idx01: they are 0
+             for the start states, and -infinity for states that can't be
+             reached.  FloatType, float or double, is the type they are
+             accumulated in.
+ */
+template <typename FloatType>
+Array1<FloatType> GetForwardScores(FsaVec &fsas,
+                                   Ragged<int32_t> &state_batches,
+                                   Ragged<int32_t> &entering_arc_batches,
+                                   bool log_semiring);
+
+/*
+  As GetForwardScores() above, but in `Semiring`, e.g. TropicalSemiring<float>,
+  LogSemiring<double> or LogCountSemiring<float> (see semiring.h), which is a
+  template argument so that the kernels are specialized for it.  The scores
+  are Semiring::One() for the start states and Semiring::Zero() for states
+  that can't be reached.
+ */
+template <typename Semiring>
+Array1<typename Semiring::Value> GetForwardScores(
+    FsaVec &fsas, Ragged<int32_t> &state_batches,
+    Ragged<int32_t> &entering_arc_batches);
+
+/*
+  Computes the backward scores of the states of an FsaVec, from each state to
+  the final state of its FSA; as GetForwardScores() but processing the
+  batches in reverse order, with the arcs leaving the states.
+
+    @param [in] fsas  The FsaVec; must be acyclic.
+    @param [in] state_batches  Must be GetStateBatches(fsas).
+    @param [in] leaving_arc_batches  Must be
+                      GetLeavingArcBatches(fsas, state_batches).
+    @param [in] log_semiring  If true, the log-sum is taken of the scores of
+                      the paths, else the max.
+    @return  Returns the backward scores, indexed by state_idx01: 0 for the
+             final states, and -infinity for states that can't reach them.
+ */
+template <typename FloatType>
+Array1<FloatType> GetBackwardScores(FsaVec &fsas,
+                                    Ragged<int32_t> &state_batches,
+                                    Ragged<int32_t> &leaving_arc_batches,
+                                    bool log_semiring);
+
+// As GetBackwardScores() above, but in `Semiring`; see the GetForwardScores()
+// that takes a semiring.
+template <typename Semiring>
+Array1<typename Semiring::Value> GetBackwardScores(
+    FsaVec &fsas, Ragged<int32_t> &state_batches,
+    Ragged<int32_t> &leaving_arc_batches);
+
+/*
+  Returns the total score of each FSA of `fsas`, i.e. the forward score of
+  its final state, or -infinity if it has no states.
+
+    @param [in] fsas  The FsaVec
+    @param [in] forward_scores  The output of GetForwardScores() for `fsas`
+    @return  Returns an array with dimension fsas.Dim0().
+ */
+template <typename FloatType>
+Array1<FloatType> GetTotScores(FsaVec &fsas,
+                               const Array1<FloatType> &forward_scores);
+
+/*
+  Returns the log-posteriors of the arcs of `fsas`, i.e. for each arc, the
+  forward score of its source state plus its score plus the backward score of
+  its dest-state, minus the total score of its FSA.  With the log semiring,
+  exp() of these are the arcs' occupation probabilities; with max, they are 0
+  for the arcs on the best path and negative for the others.
+
+    @param [in] fsas  The FsaVec
+    @param [in] forward_scores  The output of GetForwardScores() for `fsas`
+    @param [in] backward_scores  The output of GetBackwardScores() for
+                      `fsas`, with the same semiring
+    @return  Returns an array with dimension fsas.values.Dim(); the arcs of
+             FSAs whose final state can't be reached get -infinity.
+ */
+template <typename FloatType>
+Array1<FloatType> GetArcPost(FsaVec &fsas,
+                             const Array1<FloatType> &forward_scores,
+                             const Array1<FloatType> &backward_scores);
+
+/*
+  A hook for data-parallel training that sums, in place and across all the
+  workers, the `dim` elements of `data`, which are of type `dtype`
+  (kFloatDtype or kDoubleDtype) and in the memory of `c`; e.g. a wrapper of
+  ncclAllReduce() with ncclSum.  For CUDA contexts it should enqueue its
+  work on c->GetCudaStream(), like the kernels that compute `data` and that
+  read it afterwards, so no synchronization with the host is needed.
+ */
+using AllReduceFunc =
+    std::function<void(ContextPtr &c, Dtype dtype, void *data, int32_t dim)>;
+
+// The output of GetForwardBackwardTotals().
+template <typename FloatType>
+struct ForwardBackwardTotals {
+  // The total score of each FSA, as from GetTotScores(); of dimension
+  // fsas.Dim0().  This is not reduced over the workers.
+  Array1<FloatType> tot_scores;
+  // The statistics that are summed over the workers, in one buffer so it
+  // needs only one call of the AllReduceFunc: stats[0] is the sum of the
+  // finite elements of tot_scores, stats[1] their number, and the rest is
+  // `occupation`.
+  Array1<FloatType> stats;
+  // stats.Range(2, num_classes): element j is the sum of the exp() of the
+  // GetArcPost() of the arcs that map to j.  With log_semiring these are
+  // occupation probabilities; without it, they are not probabilities but
+  // 1 for the arcs on the best path and exp(score of the best path through
+  // the arc - score of the best path) for the others, so each element is at
+  // most the number of arcs that map to it.
+  Array1<FloatType> occupation;
+};
+
+/*
+  Runs the forward-backward algorithm on `fsas` and returns the statistics
+  that training objectives (e.g. LF-MMI) need, in device arrays, optionally
+  summed over the workers of data-parallel training.  There is no transfer
+  to the host except for the sizes of the state batches.
+
+    @param [in] fsas  The FsaVec, e.g. the lattices from
+                      IntersectDensePruned(); must be acyclic.
+    @param [in] log_semiring  If true, the scores are the log-sums of the
+                      scores of the paths, else the max (then the arcs on
+                      the best path have occupation 1, and the others
+                      exp() of how much worse the best paths through them
+                      are; see ForwardBackwardTotals::occupation).
+    @param [in] arc_map  If not nullptr, maps each arc of `fsas` to the
+                      class in [0, num_classes) whose occupation it adds
+                      to, or -1 for none (checked only in debug builds),
+                      e.g. the arc_map_b from IntersectDensePruned() (with
+                      num_classes = b_fsas.NumArcs()) for the derivatives
+                      w.r.t. the nnet output.  If nullptr, each arc is its
+                      own class.
+    @param [in] num_classes  The dimension of the occupation; must be
+                      fsas.NumElements() if arc_map is nullptr.
+    @param [in] all_reduce  If not empty, is called on the `stats` buffer
+                      once they are computed.
+    @return  Returns the totals, on the device of `fsas`.
+ */
+template <typename FloatType>
+ForwardBackwardTotals<FloatType> GetForwardBackwardTotals(
+    FsaVec &fsas, bool log_semiring, const Array1<int32_t> *arc_map,
+    int32_t num_classes, const AllReduceFunc &all_reduce = nullptr);
+
 }  // namespace k2
 
 #endif  //  K2_CSRC_FSA_UTILS_H_
@@ -10,6 +10,12 @@
 
 #include <gtest/gtest.h>
 
+#include <cmath>
+#include <cstdio>
+#include <limits>
+#include <string>
+#include <vector>
+
 #include "k2/csrc/fsa_utils.h"
 
 namespace k2 {
@@ -143,6 +149,34 @@ TEST(FsaFromString, Transducer) {
   }
 }
 
+TEST(FsaFromString, LargeTransducer) {
+  // Long enough to be split into several chunks that are parsed in parallel;
+  // the lines after the final state are ignored.
+  const int32_t num_states = 100000;
+  std::string s;
+  for (int32_t i = 0; i + 1 < num_states; ++i) {
+    int32_t label = (i + 1 == num_states - 1 ? -1 : i % 100);
+    s += std::to_string(i) + "\t" + std::to_string(i + 1) + "  " +
+         std::to_string(label) + " " + std::to_string(i) + " " +
+         std::to_string(i % 8) + ".5\n";
+    if (i % 1000 == 0) s += "  \n";
+  }
+  s += std::to_string(num_states - 1) + "\n0 1 2 3 -4.5\n";
+
+  Array1<int32_t> aux_labels;
+  Fsa fsa = FsaFromString(s, true, &aux_labels);
+  ASSERT_EQ(fsa.shape.Dim0(), num_states);
+  ASSERT_EQ(fsa.shape.NumElements(), num_states - 1);
+  ASSERT_EQ(aux_labels.Dim(), num_states - 1);
+  const Arc *arcs = fsa.values.Data();
+  const int32_t *aux_labels_data = aux_labels.Data();
+  for (int32_t i = 0; i + 1 < num_states; ++i) {
+    int32_t label = (i + 1 == num_states - 1 ? -1 : i % 100);
+    EXPECT_EQ(arcs[i], (Arc{i, i + 1, label, -(i % 8 + 0.5f)}));
+    EXPECT_EQ(aux_labels_data[i], i);
+  }
+}
+
 // TODO(fangjun): write code to check the printed
 // strings matching expected ones.
 TEST(FsaToString, Acceptor) {
@@ -176,4 +210,387 @@ TEST(FsaToString, Transducer) {
   K2_LOG(INFO) << "\n---negating---\n" << str;
 }
 
+template <DeviceType d>
+void TestFsaBinary() {
+  ContextPtr cpu = GetCpuContext();
+  ContextPtr context = (d == kCpu ? cpu : GetCudaContext());
+  std::string filename = ::testing::TempDir() + "/k2_fsa_binary_test.bin";
+  // src_state dst_state label aux_label cost
+  std::string s = R"(0 1 2 22  -1.2
+    0 2  10 100 -2.2
+    1 3  3  33  -3.2
+    1 6 -1  16  -4.2
+    2 6 -1  26  -5.2
+    2 4  2  22  -6.2
+    3 6 -1  36  -7.2
+    5 0  1  50  -8.2
+    6
+  )";
+  Array1<int32_t> aux_labels;
+  Fsa fsa = FsaFromString(s, false, &aux_labels);
+  {
+    // an Fsa with aux_labels
+    WriteFsaBinary(filename, fsa, &aux_labels);
+    Array1<int32_t> aux_labels2;
+    int32_t properties = 0;
+    Fsa fsa2 = ReadFsaBinary(filename, context, &aux_labels2, &properties);
+    EXPECT_EQ(fsa2.Context()->GetDeviceType(), d);
+    EXPECT_EQ(properties, GetFsaBasicProperties(fsa));
+    ASSERT_EQ(fsa2.NumAxes(), 2);
+    fsa2 = fsa2.To(cpu);
+    aux_labels2 = aux_labels2.To(cpu);
+    EXPECT_EQ(fsa2.shape.Dim0(), 7);
+    ASSERT_EQ(fsa2.values.Dim(), 8);
+    for (int32_t i = 0; i != 8; ++i) {
+      EXPECT_EQ(fsa2.values[i], fsa.values[i]);
+      EXPECT_EQ(aux_labels2[i], aux_labels[i]);
+    }
+    for (int32_t i = 0; i <= 7; ++i)
+      EXPECT_EQ(fsa2.shape.RowSplits(1)[i], fsa.shape.RowSplits(1)[i]);
+  }
+  {
+    // an FsaVec without aux_labels
+    const Fsa *fsa_ptrs[2] = {&fsa, &fsa};
+    FsaVec fsas = Stack(0, 2, fsa_ptrs);
+    WriteFsaBinary(filename, fsas);
+    Array1<int32_t> aux_labels2;
+    FsaVec fsas2 = ReadFsaBinary(filename, context, &aux_labels2);
+    EXPECT_EQ(aux_labels2.Dim(), 0);
+    ASSERT_EQ(fsas2.NumAxes(), 3);
+    fsas2 = fsas2.To(cpu);
+    EXPECT_EQ(fsas2.shape.Dim0(), 2);
+    EXPECT_EQ(fsas2.shape.TotSize(1), 14);
+    ASSERT_EQ(fsas2.values.Dim(), 16);
+    for (int32_t i = 0; i != 16; ++i)
+      EXPECT_EQ(fsas2.values[i], fsa.values[i % 8]);
+    EXPECT_EQ(fsas2.shape.RowSplits(2)[7], 8);
+    EXPECT_EQ(fsas2.shape.RowSplits(2)[8], 10);
+  }
+  if (d == kCpu) {
+    // Modifying the mapped arcs doesn't change the file.
+    WriteFsaBinary(filename, fsa);
+    Fsa fsa2 = ReadFsaBinary(filename);
+    fsa2.values.Data()[0].symbol = 100;
+    Fsa fsa3 = ReadFsaBinary(filename);
+    EXPECT_EQ(fsa3.values[0], fsa.values[0]);
+  }
+  std::remove(filename.c_str());
+}
+
+TEST(FsaBinary, ReadWrite) {
+  TestFsaBinary<kCpu>();
+  TestFsaBinary<kCuda>();
+}
+
+// Returns a test FsaVec: the first FSA is top-sorted, the second acyclic but
+// not top-sorted, and state 1 of the third can't be reached.
+static FsaVec GetScoresTestFsas(ContextPtr &context) {
+  std::vector<int32_t> row_splits1_vec = {0, 4, 8, 11},
+                       row_splits2_vec = {0, 2, 3, 4, 4, 5, 6, 7, 7, 8, 9, 9};
+  std::vector<Arc> arcs_vec = {{0, 1, 1, 1},  {0, 2, 2, 2},  {1, 2, 3, 3},
+                               {2, 3, -1, 4}, {0, 2, 1, 1},  {1, 3, -1, 1},
+                               {2, 1, 2, 1},  {0, 2, -1, 1}, {1, 2, -1, 5}};
+  Array1<int32_t> row_splits1(context, row_splits1_vec),
+      row_splits2(context, row_splits2_vec);
+  return FsaVec(RaggedShape3(&row_splits1, nullptr, -1, &row_splits2,
+                             nullptr, -1),
+                Array1<Arc>(context, arcs_vec));
+}
+
+template <typename FloatType>
+static void CheckScores(const Array1<FloatType> &scores,
+                        const std::vector<double> &expected) {
+  Array1<FloatType> cpu_scores = scores.To(GetCpuContext());
+  ASSERT_EQ(cpu_scores.Dim(), static_cast<int32_t>(expected.size()));
+  for (int32_t i = 0; i != cpu_scores.Dim(); ++i) {
+    if (std::isinf(expected[i]))
+      EXPECT_EQ(cpu_scores[i], expected[i]);
+    else
+      EXPECT_NEAR(cpu_scores[i], expected[i], 1.0e-4);
+  }
+}
+
+template <DeviceType d>
+void TestStateBatches() {
+  ContextPtr cpu = GetCpuContext();
+  ContextPtr context = (d == kCpu ? cpu : GetCudaContext());
+  FsaVec fsas = GetScoresTestFsas(context);
+  Ragged<int32_t> state_batches = GetStateBatches(fsas).To(cpu);
+  ASSERT_EQ(state_batches.shape.Dim0(), 4);
+  std::vector<int32_t> batches(11, -1),
+      expected_batches = {0, 1, 2, 3, 0, 2, 1, 3, 0, 0, 1};
+  for (int32_t i = 0; i != 4; ++i) {
+    for (int32_t j = state_batches.shape.RowSplits(1)[i];
+         j != state_batches.shape.RowSplits(1)[i + 1]; ++j)
+      batches[state_batches.values[j]] = i;
+  }
+  EXPECT_EQ(batches, expected_batches);
+
+  // Only with the arcs with symbol 1, the states are in two batches.
+  Array1<char> use_arcs(context, std::vector<char>{1, 0, 0, 0, 1, 0, 0, 0, 0});
+  EXPECT_EQ(GetStateBatches(fsas, &use_arcs).shape.Dim0(), 2);
+
+  state_batches = state_batches.To(context);
+  Ragged<int32_t> entering = GetEnteringArcBatches(fsas, state_batches),
+                  leaving = GetLeavingArcBatches(fsas, state_batches);
+  entering = entering.To(cpu);
+  leaving = leaving.To(cpu);
+  state_batches = state_batches.To(cpu);
+  std::vector<std::vector<int32_t>> expected_entering = {
+      {}, {0}, {1, 2}, {3}, {}, {6}, {4}, {5}, {}, {}, {7, 8}},
+      expected_leaving = {{0, 1}, {2}, {3}, {}, {4}, {5}, {6}, {},
+                          {7},    {8}, {}};
+  ASSERT_EQ(entering.shape.TotSize(1), 11);
+  ASSERT_EQ(leaving.shape.TotSize(1), 11);
+  for (int32_t i = 0; i != 11; ++i) {
+    int32_t state = state_batches.values[i];
+    std::vector<int32_t> entering_arcs, leaving_arcs;
+    for (int32_t j = entering.shape.RowSplits(2)[i];
+         j != entering.shape.RowSplits(2)[i + 1]; ++j)
+      entering_arcs.push_back(entering.values[j]);
+    for (int32_t j = leaving.shape.RowSplits(2)[i];
+         j != leaving.shape.RowSplits(2)[i + 1]; ++j)
+      leaving_arcs.push_back(leaving.values[j]);
+    EXPECT_EQ(entering_arcs, expected_entering[state]);
+    EXPECT_EQ(leaving_arcs, expected_leaving[state]);
+  }
+}
+
+TEST(FsaUtils, StateBatches) {
+  TestStateBatches<kCpu>();
+  TestStateBatches<kCuda>();
+}
+
+// Checks that `entering`, indexed [state][arc], has the arcs in `expected`.
+static void CheckEnteringArcs(
+    Ragged<int32_t> &entering,
+    const std::vector<std::vector<int32_t>> &expected) {
+  Ragged<int32_t> cpu_entering = entering.To(GetCpuContext());
+  int32_t num_states = static_cast<int32_t>(expected.size());
+  ASSERT_EQ(cpu_entering.shape.Dim0(), num_states);
+  const int32_t *row_splits1 = cpu_entering.shape.RowSplits(1).Data();
+  for (int32_t i = 0; i != num_states; ++i) {
+    std::vector<int32_t> arcs(cpu_entering.values.Data() + row_splits1[i],
+                              cpu_entering.values.Data() + row_splits1[i + 1]);
+    EXPECT_EQ(arcs, expected[i]);
+  }
+}
+
+template <DeviceType d>
+void TestEnteringArcs() {
+  ContextPtr cpu = GetCpuContext();
+  ContextPtr context = (d == kCpu ? cpu : GetCudaContext());
+  FsaVec fsas = GetScoresTestFsas(context);
+  Ragged<int32_t> entering = GetEnteringArcs(fsas);
+  CheckEnteringArcs(entering, {{}, {0}, {1, 2}, {3}, {}, {6}, {4}, {5}, {},
+                               {}, {7, 8}});
+
+  // A cyclic FSA, with a self-loop on state 1.
+  std::vector<Arc> arcs_vec = {
+      {0, 1, 1, 0}, {1, 1, 2, 0}, {1, 0, 1, 0}, {1, 2, -1, 0}};
+  Array1<int32_t> row_splits1(context, std::vector<int32_t>{0, 3}),
+      row_splits2(context, std::vector<int32_t>{0, 1, 4, 4});
+  FsaVec cyclic(RaggedShape3(&row_splits1, nullptr, -1, &row_splits2,
+                             nullptr, -1),
+                Array1<Arc>(context, arcs_vec));
+  entering = GetEnteringArcs(cyclic);
+  CheckEnteringArcs(entering, {{2}, {0, 1}, {3}});
+}
+
+TEST(FsaUtils, EnteringArcs) {
+  TestEnteringArcs<kCpu>();
+  TestEnteringArcs<kCuda>();
+}
+
+template <DeviceType d, typename FloatType>
+void TestForwardBackwardScores() {
+  ContextPtr cpu = GetCpuContext();
+  ContextPtr context = (d == kCpu ? cpu : GetCudaContext());
+  FsaVec fsas = GetScoresTestFsas(context);
+  Ragged<int32_t> state_batches = GetStateBatches(fsas),
+                  entering = GetEnteringArcBatches(fsas, state_batches),
+                  leaving = GetLeavingArcBatches(fsas, state_batches);
+  double inf = std::numeric_limits<double>::infinity();
+
+  Array1<FloatType> forward = GetForwardScores<FloatType>(
+                        fsas, state_batches, entering, false),
+                    backward = GetBackwardScores<FloatType>(
+                        fsas, state_batches, leaving, false);
+  CheckScores(forward, {0, 1, 4, 8, 0, 2, 1, 3, 0, -inf, 1});
+  CheckScores(backward, {8, 7, 4, 0, 3, 1, 2, 0, 1, 5, 0});
+  CheckScores(GetTotScores(fsas, forward), {8, 3, 1});
+  CheckScores(GetArcPost(fsas, forward, backward),
+              {0, -2, 0, 0, 0, 0, 0, 0, -inf});
+
+  forward = GetForwardScores<FloatType>(fsas, state_batches, entering, true);
+  backward = GetBackwardScores<FloatType>(fsas, state_batches, leaving, true);
+  // The two paths of the first FSA have scores 8 and 6.
+  double log_sum_2 = std::log(std::exp(2.0) + std::exp(4.0)),
+         tot = log_sum_2 + 4;
+  CheckScores(forward, {0, 1, log_sum_2, tot, 0, 2, 1, 3, 0, -inf, 1});
+  CheckScores(backward, {tot, 7, 4, 0, 3, 1, 2, 0, 1, 5, 0});
+  double post_1 = 6 - tot, post_0 = 8 - tot;
+  CheckScores(GetArcPost(fsas, forward, backward),
+              {post_0, post_1, post_0, 0, 0, 0, 0, 0, -inf});
+
+  // With the semiring as a template argument.
+  CheckScores(GetForwardScores<TropicalSemiring<FloatType>>(
+                  fsas, state_batches, entering),
+              {0, 1, 4, 8, 0, 2, 1, 3, 0, -inf, 1});
+  CheckScores(GetBackwardScores<LogSemiring<FloatType>>(fsas, state_batches,
+                                                        leaving),
+              {tot, 7, 4, 0, 3, 1, 2, 0, 1, 5, 0});
+  // LogCountSemiring gives the log of the number of paths.
+  double log_2 = std::log(2.0);
+  CheckScores(GetForwardScores<LogCountSemiring<FloatType>>(
+                  fsas, state_batches, entering),
+              {0, 0, log_2, log_2, 0, 0, 0, 0, 0, -inf, 0});
+  CheckScores(GetBackwardScores<LogCountSemiring<FloatType>>(
+                  fsas, state_batches, leaving),
+              {log_2, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0});
+}
+
+TEST(FsaUtils, ForwardBackwardScores) {
+  TestForwardBackwardScores<kCpu, float>();
+  TestForwardBackwardScores<kCuda, float>();
+  TestForwardBackwardScores<kCpu, double>();
+  TestForwardBackwardScores<kCuda, double>();
+}
+
+// Stands in for an all-reduce over two workers with the same statistics.
+template <typename FloatType>
+static void DoubleForTest(ContextPtr &c, void *data, int32_t dim) {
+  FloatType *float_data = static_cast<FloatType *>(data);
+  auto lambda_double = [=] __host__ __device__(int32_t i) -> void {
+    float_data[i] *= 2;
+  };
+  Eval(c, dim, lambda_double);
+}
+
+template <DeviceType d, typename FloatType>
+void TestForwardBackwardTotals() {
+  ContextPtr cpu = GetCpuContext();
+  ContextPtr context = (d == kCpu ? cpu : GetCudaContext());
+  FsaVec fsas = GetScoresTestFsas(context);
+  double log_sum_2 = std::log(std::exp(2.0) + std::exp(4.0)),
+         tot = log_sum_2 + 4, post_0 = std::exp(8 - tot),
+         post_1 = std::exp(6 - tot);
+
+  ForwardBackwardTotals<FloatType> totals =
+      GetForwardBackwardTotals<FloatType>(fsas, true, nullptr, 9);
+  CheckScores(totals.tot_scores, {tot, 3, 1});
+  CheckScores(totals.stats, {tot + 4, 3, post_0, post_1, post_0, 1, 1, 1, 1,
+                             1, 0});
+  CheckScores(totals.occupation,
+              {post_0, post_1, post_0, 1, 1, 1, 1, 1, 0});
+  EXPECT_EQ(totals.occupation.Data(), totals.stats.Data() + 2);
+
+  totals = GetForwardBackwardTotals<FloatType>(fsas, false, nullptr, 9);
+  CheckScores(totals.tot_scores, {8, 3, 1});
+  CheckScores(totals.occupation,
+              {1, std::exp(-2.0), 1, 1, 1, 1, 1, 1, 0});
+
+  // The occupation of classes, then summed over (two identical) workers.
+  Array1<int32_t> arc_map(context,
+                          std::vector<int32_t>{0, 0, 1, 1, 1, 1, 1, 1, -1});
+  int32_t num_calls = 0;
+  AllReduceFunc all_reduce = [&num_calls](ContextPtr &c, Dtype dtype,
+                                          void *data, int32_t dim) -> void {
+    ++num_calls;
+    EXPECT_EQ(dtype, DtypeOf<FloatType>::dtype);
+    EXPECT_EQ(dim, 4);
+    DoubleForTest<FloatType>(c, data, dim);
+  };
+  totals = GetForwardBackwardTotals<FloatType>(fsas, true, &arc_map, 2,
+                                               all_reduce);
+  EXPECT_EQ(num_calls, 1);
+  CheckScores(totals.tot_scores, {tot, 3, 1});
+  CheckScores(totals.stats, {2 * (tot + 4), 6, 2, 2 * (post_0 + 5)});
+}
+
+TEST(FsaUtils, ForwardBackwardTotals) {
+  TestForwardBackwardTotals<kCpu, float>();
+  TestForwardBackwardTotals<kCuda, float>();
+  TestForwardBackwardTotals<kCpu, double>();
+  TestForwardBackwardTotals<kCuda, double>();
+}
+
+template <DeviceType d>
+void TestLinearFsasAndCtcGraphs() {
+  ContextPtr cpu = GetCpuContext();
+  ContextPtr context = (d == kCpu ? cpu : GetCudaContext());
+  std::vector<int32_t> row_splits_vec = {0, 3, 3, 4},
+                       symbols_vec = {1, 2, 2, 3};
+  Array1<int32_t> row_splits(context, row_splits_vec);
+  Ragged<int32_t> symbols(RaggedShape2(&row_splits, nullptr, -1),
+                          Array1<int32_t>(context, symbols_vec));
+  auto check_fsas = [&cpu](FsaVec &fsas,
+                           const std::vector<int32_t> &row_splits1,
+                           const std::vector<int32_t> &row_splits2,
+                           const std::vector<Arc> &arcs) -> void {
+    FsaVec fsas_cpu = fsas.To(cpu);
+    ASSERT_EQ(fsas_cpu.NumAxes(), 3);
+    Array1<int32_t> &splits1 = fsas_cpu.shape.RowSplits(1),
+                    &splits2 = fsas_cpu.shape.RowSplits(2);
+    EXPECT_EQ(std::vector<int32_t>(splits1.Data(),
+                                   splits1.Data() + splits1.Dim()),
+              row_splits1);
+    EXPECT_EQ(std::vector<int32_t>(splits2.Data(),
+                                   splits2.Data() + splits2.Dim()),
+              row_splits2);
+    ASSERT_EQ(fsas_cpu.values.Dim(), static_cast<int32_t>(arcs.size()));
+    for (int32_t i = 0; i != fsas_cpu.values.Dim(); ++i)
+      EXPECT_EQ(fsas_cpu.values[i], arcs[i]);
+  };
+
+  {
+    FsaVec fsas = LinearFsas(symbols);
+    check_fsas(fsas, {0, 5, 7, 10}, {0, 1, 2, 3, 4, 4, 5, 5, 6, 7, 7},
+               {{0, 1, 1, 0}, {1, 2, 2, 0}, {2, 3, 2, 0}, {3, 4, -1, 0},
+                {0, 1, -1, 0},
+                {0, 1, 3, 0}, {1, 2, -1, 0}});
+  }
+  {
+    Array1<int32_t> aux_labels;
+    FsaVec fsas = CtcGraphs(symbols, false, &aux_labels);
+    // clang-format off
+    check_fsas(fsas, {0, 8, 10, 14},
+               {0, 2, 5, 7, 9, 11, 14, 16, 16, 18, 18, 20, 23, 25, 25},
+               {{0, 0, 0, 0}, {0, 1, 1, 0},
+                {1, 1, 1, 0}, {1, 2, 0, 0}, {1, 3, 2, 0},
+                {2, 2, 0, 0}, {2, 3, 2, 0},
+                {3, 3, 2, 0}, {3, 4, 0, 0},  // no 3->5 as the tokens repeat
+                {4, 4, 0, 0}, {4, 5, 2, 0},
+                {5, 5, 2, 0}, {5, 6, 0, 0}, {5, 7, -1, 0},
+                {6, 6, 0, 0}, {6, 7, -1, 0},
+                {0, 0, 0, 0}, {0, 1, -1, 0},
+                {0, 0, 0, 0}, {0, 1, 3, 0},
+                {1, 1, 3, 0}, {1, 2, 0, 0}, {1, 3, -1, 0},
+                {2, 2, 0, 0}, {2, 3, -1, 0}});
+    // clang-format on
+    Array1<int32_t> aux_labels_cpu = aux_labels.To(cpu);
+    std::vector<int32_t> expected_aux_labels = {
+        0, 1, 0, 0, 2, 0, 2, 0, 0, 0, 2, 0, 0, -1, 0, -1,
+        0, -1, 0, 3, 0, 0, -1, 0, -1};
+    EXPECT_EQ(std::vector<int32_t>(
+                  aux_labels_cpu.Data(),
+                  aux_labels_cpu.Data() + aux_labels_cpu.Dim()),
+              expected_aux_labels);
+  }
+  {
+    // the modified topology has the arc 3->5.
+    FsaVec fsas = CtcGraphs(symbols, true);
+    FsaVec fsas_cpu = fsas.To(cpu);
+    ASSERT_EQ(fsas_cpu.values.Dim(), 26);
+    Arc expected(3, 5, 2, 0);
+    EXPECT_EQ(fsas_cpu.values[9], expected);
+    EXPECT_EQ(fsas_cpu.shape.RowSplits(2)[4], 10);
+  }
+}
+
+TEST(FsaUtils, LinearFsasAndCtcGraphs) {
+  TestLinearFsasAndCtcGraphs<kCpu>();
+  TestLinearFsasAndCtcGraphs<kCuda>();
+}
+
 }  // namespace k2
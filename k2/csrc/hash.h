@@ -0,0 +1,152 @@
+/**
+ * @brief
+ * hash
+ *
+ * @copyright
+ * Copyright (c)  2026  agent (agent@local)
+ *
+ * @copyright
+ * See LICENSE for clarification regarding multiple authors
+ */
+
+#ifndef K2_CSRC_HASH_H_
+#define K2_CSRC_HASH_H_
+
+#include <cstdint>
+
+#include "k2/csrc/array.h"
+#include "k2/csrc/context.h"
+#include "k2/csrc/log.h"
+#include "k2/csrc/utils.h"
+
+namespace k2 {
+
+/*
+  A fixed-size hash table from 64-bit keys to int32_t values, with open
+  addressing (linear probing), that can be used from __host__ __device__
+  lambdas; threads can insert concurrently.  Elements cannot be deleted; to
+  reuse the table for a new set of keys, call Clear().
+
+  It is used where a dense map would be too large, e.g. for the map from
+  (sequence, state) to active state in intersection with a large shared
+  decoding graph, where only a small fraction of the pairs is used on each
+  frame.
+
+  Example:
+
+     Hash hash(c, num_buckets);
+     Hash::Accessor acc = hash.GetAccessor();
+     auto lambda_insert = [=] __host__ __device__(int32_t i) -> void {
+       int32_t *value = acc.Insert(keys_data[i]);
+       *value = i;  // any thread with this key may win
+     };
+     Eval(c, n, lambda_insert);
+ */
+class Hash {
+ public:
+  // Denotes an empty bucket; this key cannot be used.
+  static constexpr uint64_t kEmptyKey = ~static_cast<uint64_t>(0);
+
+  /*
+    Constructor.
+       @param [in] c   Context to allocate the table on
+       @param [in] num_buckets  The number of buckets, must be a power of 2
+                       and should be comfortably more than the number of keys
+                       that will be inserted (e.g. twice as many): inserting
+                       more keys than that is an error (in device code, an
+                       assertion failure).
+       @param [in] default_value  The value of each element when it is
+                       inserted.
+   */
+  Hash(ContextPtr c, int32_t num_buckets, int32_t default_value = -1)
+      : keys_(c, num_buckets), values_(c, num_buckets),
+        default_value_(default_value) {
+    K2_CHECK_GT(num_buckets, 0);
+    K2_CHECK_EQ(num_buckets & (num_buckets - 1), 0);
+    Clear();
+  }
+
+  // Removes all elements.
+  void Clear() {
+    keys_ = kEmptyKey;
+    values_ = default_value_;
+  }
+
+  int32_t NumBuckets() const { return keys_.Dim(); }
+
+  // Returns the smallest power of 2 that is at least twice `num_keys`; a
+  // suitable number of buckets for that many keys.
+  static int32_t NumBucketsFor(int32_t num_keys) {
+    K2_CHECK_GE(num_keys, 0);
+    int32_t ans = 1;
+    while (ans < 2 * num_keys) ans *= 2;
+    return ans;
+  }
+
+  class Accessor {
+   public:
+    /*
+      Returns the address of the value for `key`, inserting it (with the
+      default value) if it was not present.  `key` must not be kEmptyKey.
+     */
+    __host__ __device__ __forceinline__ int32_t *Insert(uint64_t key) const {
+      uint32_t mask = static_cast<uint32_t>(num_buckets_ - 1),
+               bucket = HashKey(key) & mask;
+      for (uint32_t n = 0; n <= mask; ++n, bucket = (bucket + 1) & mask) {
+        unsigned long long old = atomicCAS(keys_ + bucket, kEmptyKey,  // NOLINT
+                                           key);
+        if (old == kEmptyKey || old == key) return values_ + bucket;
+      }
+      K2_CHECK(false) << "Hash table is full";
+      return nullptr;
+    }
+
+    /*
+      Returns the address of the value for `key`, or nullptr if it is not
+      present.  Must not be called at the same time as Insert() (e.g. in
+      the same kernel).
+     */
+    __host__ __device__ __forceinline__ int32_t *Find(uint64_t key) const {
+      uint32_t mask = static_cast<uint32_t>(num_buckets_ - 1),
+               bucket = HashKey(key) & mask;
+      for (uint32_t n = 0; n <= mask; ++n, bucket = (bucket + 1) & mask) {
+        uint64_t this_key = keys_[bucket];
+        if (this_key == key) return values_ + bucket;
+        if (this_key == kEmptyKey) return nullptr;
+      }
+      return nullptr;
+    }
+
+   private:
+    friend class Hash;
+    // the multiplier is from the "fibonacci hashing" method, and the high bits
+    // are mixed into the low ones since we use those.
+    __host__ __device__ __forceinline__ static uint32_t HashKey(uint64_t key) {
+      uint64_t h = key * 0x9E3779B97F4A7C15ull;
+      return static_cast<uint32_t>(h >> 32) ^ static_cast<uint32_t>(h);
+    }
+    unsigned long long *keys_;  // NOLINT
+    int32_t *values_;
+    int32_t num_buckets_;
+  };
+
+  Accessor GetAccessor() {
+    static_assert(sizeof(unsigned long long) == sizeof(uint64_t),  // NOLINT
+                  "");
+    Accessor ans;
+    ans.keys_ = reinterpret_cast<unsigned long long *>(  // NOLINT
+        keys_.Data());
+    ans.values_ = values_.Data();
+    ans.num_buckets_ = keys_.Dim();
+    return ans;
+  }
+
+ private:
+  Array1<uint64_t> keys_;
+  Array1<int32_t> values_;
+  int32_t default_value_;
+};
+
+}  // namespace k2
+
+#endif  // K2_CSRC_HASH_H_
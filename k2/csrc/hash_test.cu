@@ -0,0 +1,76 @@
+/**
+ * @brief
+ * hash_test
+ *
+ * @copyright
+ * Copyright (c)  2026  agent (agent@local)
+ *
+ * @copyright
+ * See LICENSE for clarification regarding multiple authors
+ */
+
+#include <gtest/gtest.h>
+
+#include <cstdint>
+#include <vector>
+
+#include "k2/csrc/array.h"
+#include "k2/csrc/context.h"
+#include "k2/csrc/hash.h"
+
+namespace k2 {
+
+template <DeviceType d>
+void TestHash() {
+  ContextPtr cpu = GetCpuContext();
+  ContextPtr context = (d == kCpu ? cpu : GetCudaContext());
+
+  EXPECT_EQ(Hash::NumBucketsFor(0), 1);
+  EXPECT_EQ(Hash::NumBucketsFor(3), 8);
+  EXPECT_EQ(Hash::NumBucketsFor(4), 8);
+
+  // Keys with duplicates, some of them larger than 32 bits.
+  std::vector<uint64_t> keys_vec = {5,  1ull << 40, 17, 5, (1ull << 40) + 17,
+                                    17, 0,          5,  3};
+  int32_t n = static_cast<int32_t>(keys_vec.size());
+  Array1<uint64_t> keys(context, keys_vec);
+  const uint64_t *keys_data = keys.Data();
+
+  Hash hash(context, Hash::NumBucketsFor(n));
+  Hash::Accessor acc = hash.GetAccessor();
+  // Each key gets the largest index at which it appears.
+  auto lambda_insert = [=] __host__ __device__(int32_t i) -> void {
+    atomicMax(acc.Insert(keys_data[i]), i);
+  };
+  Eval(context, n, lambda_insert);
+
+  std::vector<uint64_t> query_vec = {5, 1ull << 40, 17, (1ull << 40) + 17,
+                                     0, 3,          4,  1ull << 41};
+  std::vector<int32_t> expected = {7, 1, 5, 4, 6, 8, -1, -1};
+  int32_t num_queries = static_cast<int32_t>(query_vec.size());
+  Array1<uint64_t> queries(context, query_vec);
+  const uint64_t *queries_data = queries.Data();
+  Array1<int32_t> values(context, num_queries);
+  int32_t *values_data = values.Data();
+  auto lambda_find = [=] __host__ __device__(int32_t i) -> void {
+    const int32_t *value = acc.Find(queries_data[i]);
+    values_data[i] = (value != nullptr ? *value : -1);
+  };
+  Eval(context, num_queries, lambda_find);
+  Array1<int32_t> values_cpu = values.To(cpu);
+  for (int32_t i = 0; i != num_queries; ++i)
+    EXPECT_EQ(values_cpu[i], expected[i]);
+
+  // After Clear(), nothing is found.
+  hash.Clear();
+  Eval(context, num_queries, lambda_find);
+  values_cpu = values.To(cpu);
+  for (int32_t i = 0; i != num_queries; ++i) EXPECT_EQ(values_cpu[i], -1);
+}
+
+TEST(Hash, InsertAndFind) {
+  TestHash<kCpu>();
+  TestHash<kCuda>();
+}
+
+}  // namespace k2
@@ -14,9 +14,9 @@
 
 #include <algorithm>
 #include <cassert>
+#include <limits>
 #include <queue>
 #include <unordered_map>
-#include <unordered_set>
 #include <utility>
 #include <vector>
 
@@ -39,10 +39,13 @@ void Determinizer<TracebackState>::GetSizes(
   arc_derivs_.clear();
   if (IsEmpty(fsa_in_.fsa)) return;
 
+  // The pool must outlive the DetStates in the queue.
+  DetStatePool pool;
   DetStatePriorityQueue<TracebackState> queue;
   DetStateMap<TracebackState> map;
   using DS = DetState<TracebackState>;
-  std::shared_ptr<DS> start_state(new DS());
+  std::shared_ptr<DS> start_state =
+      std::allocate_shared<DS>(PoolAllocator<DS>(&pool), &pool);
 
   bool ans = map.GetOutputState(start_state.get(), fsa_in_.fsa);
   K2_CHECK(ans && start_state->state_id == 0);
@@ -119,51 +122,71 @@ LogSumTracebackLink::LogSumTracebackLink(
       arc_index(arc_index),
       forward_prob(arc_weight + src->forward_prob) {}
 
+// Sorts `states` and removes duplicates; the sets of TracebackStates are
+// small, so this is cheaper than a std::unordered_set.
+template <typename TracebackState>
+static void SortAndUniq(std::vector<TracebackState *> *states) {
+  std::sort(states->begin(), states->end());
+  states->erase(std::unique(states->begin(), states->end()), states->end());
+}
+
 int32_t GetMostRecentCommonAncestor(
-    std::unordered_set<LogSumTracebackState *> *cur_states) {
+    std::vector<LogSumTracebackState *> *cur_states) {
   int32_t ans = 0;
-  std::unordered_set<LogSumTracebackState *> prev_states;
+  std::vector<LogSumTracebackState *> prev_states;
   for (; cur_states->size() != 1; ans++) {
     K2_CHECK(!cur_states->empty());
+    prev_states.clear();
     for (LogSumTracebackState *s : *cur_states) {
       for (LogSumTracebackLink &l : s->prev_elements) {
-        prev_states.insert(l.prev_state.get());
+        prev_states.push_back(l.prev_state.get());
       }
     }
-    cur_states->clear();
+    SortAndUniq(&prev_states);
     cur_states->swap(prev_states);
   }
   return ans;
 }
 
 int32_t GetMostRecentCommonAncestor(
-    std::unordered_set<MaxTracebackState *> *cur_states) {
+    std::vector<MaxTracebackState *> *cur_states) {
   int32_t ans = 0;
-  std::unordered_set<MaxTracebackState *> prev_states;
+  std::vector<MaxTracebackState *> prev_states;
   for (; cur_states->size() != 1; ans++) {
     K2_CHECK(!cur_states->empty());
+    prev_states.clear();
     for (MaxTracebackState *s : *cur_states) {
-      prev_states.insert(s->prev_state.get());
+      prev_states.push_back(s->prev_state.get());
     }
-    cur_states->clear();
+    SortAndUniq(&prev_states);
     cur_states->swap(prev_states);
   }
   return ans;
 }
 
-void TraceBack(std::unordered_set<LogSumTracebackState *> *cur_states,
+void TraceBack(std::vector<LogSumTracebackState *> *cur_states,
                int32_t num_steps, const Arc *arcs_in, float *weight_out,
                std::vector<std::pair<int32_t, float>> *deriv_out) {
-  std::unordered_set<LogSumTracebackState *> prev_states;
+  std::vector<LogSumTracebackState *> prev_states;
   assert(cur_states->size() == 1);
   // In the standard forward-backward algorithm for HMMs this backward_prob
   // would, mathematically, be 0.0, but if we set it to the negative of the
   // forward prob we can avoid having to subtract the total log-prob
   // when we compute posterior/occupation probabilities for arcs.
-  double cur_forward_prob = (*(cur_states->begin()))->forward_prob;
-  (*(cur_states->begin()))->backward_prob = -cur_forward_prob;
+  double cur_forward_prob = (*cur_states)[0]->forward_prob;
+  (*cur_states)[0]->backward_prob = -cur_forward_prob;
   deriv_out->clear();
   for (int32_t i = 0; i < num_steps; i++) {
+    // The previous states are on an earlier step than the current ones, so
+    // we can reset their backward_probs before accumulating them.
+    prev_states.clear();
+    for (LogSumTracebackState *state_ptr : *cur_states) {
+      for (const auto &link : state_ptr->prev_elements) {
+        link.prev_state->backward_prob =
+            -std::numeric_limits<double>::infinity();
+        prev_states.push_back(link.prev_state.get());
+      }
+    }
     for (LogSumTracebackState *state_ptr : *cur_states) {
       double backward_prob = state_ptr->backward_prob;
       for (const auto &link : state_ptr->prev_elements) {
@@ -174,21 +197,17 @@ void TraceBack(std::unordered_set<LogSumTracebackState *> *cur_states,
         LogSumTracebackState *prev_state = link.prev_state.get();
         double new_backward_prob =
             backward_prob + arcs_in[link.arc_index].weight;
-        if (prev_states.insert(prev_state).second) {  // newly inserted
-          prev_state->backward_prob = new_backward_prob;
-        } else {
-          prev_state->backward_prob =
-              LogAdd(new_backward_prob, prev_state->backward_prob);
-        }
+        prev_state->backward_prob =
+            LogAdd(new_backward_prob, prev_state->backward_prob);
       }
     }
-    cur_states->clear();
+    SortAndUniq(&prev_states);
     cur_states->swap(prev_states);
   }
   // failure of the next assertion may indicate many kinds of bugs in the
   // algorithm.
   K2_CHECK_EQ(cur_states->size(), 1);
-  double prev_forward_prob = (*(cur_states->begin()))->forward_prob;
+  double prev_forward_prob = (*cur_states)[0]->forward_prob;
   *weight_out = static_cast<float>(cur_forward_prob - prev_forward_prob);
   // The following is mostly for ease of interpretability of the output;
   // conceptually the order makes no difference.
@@ -196,13 +215,13 @@ void TraceBack(std::unordered_set<LogSumTracebackState *> *cur_states,
   std::reverse(deriv_out->begin(), deriv_out->end());
 }
 
-void TraceBack(std::unordered_set<MaxTracebackState *> *cur_states,
+void TraceBack(std::vector<MaxTracebackState *> *cur_states,
                int32_t num_steps,
                const Arc *unused,  // arcs_in, unused.
                float *weight_out, std::vector<int32_t> *deriv_out) {
   (void)unused;
   K2_CHECK_EQ(cur_states->size(), 1);
-  MaxTracebackState *state = *(cur_states->begin());
+  MaxTracebackState *state = (*cur_states)[0];
   double cur_forward_prob = state->forward_prob;
   deriv_out->resize(num_steps);
   for (int32_t i = num_steps - 1; i >= 0; --i) {
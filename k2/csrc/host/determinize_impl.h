@@ -15,12 +15,12 @@
 
 #include <algorithm>
 #include <cassert>
+#include <cstddef>
 #include <iterator>
 #include <limits>
 #include <memory>
 #include <queue>
 #include <unordered_map>
-#include <unordered_set>
 #include <utility>
 #include <vector>
 
@@ -150,9 +150,117 @@ namespace k2host {
      - To save memory space, the process of hashing from `base_state,
   symbol_seq` to output state-id maps them to a fixed-size 128-bit value.  This
   could in principle generate collisions which would generate incorrect output,
-       but we consider that vanishingly improbable.
+       but we consider that vanishingly improbable.  The 128-bit values are
+       looked up in an open-addressing hash table (DetStateMap).
 
+     - The DetStates and TracebackStates, of which there are very many, are
+       allocated from a DetStatePool that lasts for one determinization.
+
+ */
+
+/*
+  A memory pool for the DetStates and TracebackStates of one determinization:
+  many small objects of a few sizes, freed in no particular order.  Freed
+  blocks are kept on a free list per size for reuse, and the memory is only
+  released when the pool is destroyed, so it must outlive everything
+  allocated from it.  It is used via PoolAllocator with
+  std::allocate_shared(), which puts the shared_ptr's control block in the
+  same block as the object.
  */
+class DetStatePool {
+ public:
+  DetStatePool() = default;
+  DetStatePool(const DetStatePool &) = delete;
+  DetStatePool &operator=(const DetStatePool &) = delete;
+  ~DetStatePool() {
+    for (char *chunk : chunks_) delete[] chunk;
+  }
+
+  void *Allocate(std::size_t num_bytes) {
+    std::size_t size = RoundUp(num_bytes);
+    FreeList &list = GetFreeList(size);
+    if (list.head != nullptr) {
+      Block *block = list.head;
+      list.head = block->next;
+      return block;
+    }
+    if (chunk_left_ < size) NewChunk(size);
+    void *ans = chunk_next_;
+    chunk_next_ += size;
+    chunk_left_ -= size;
+    return ans;
+  }
+
+  void Deallocate(void *p, std::size_t num_bytes) {
+    FreeList &list = GetFreeList(RoundUp(num_bytes));
+    Block *block = static_cast<Block *>(p);
+    block->next = list.head;
+    list.head = block;
+  }
+
+ private:
+  struct Block {
+    Block *next;
+  };
+  struct FreeList {
+    std::size_t size;
+    Block *head;
+  };
+
+  static std::size_t RoundUp(std::size_t num_bytes) {
+    const std::size_t align = alignof(std::max_align_t);
+    return (num_bytes + align - 1) / align * align;
+  }
+
+  FreeList &GetFreeList(std::size_t size) {
+    // There are only a few sizes, so a linear search is fastest.
+    for (FreeList &list : free_lists_)
+      if (list.size == size) return list;
+    free_lists_.push_back({size, nullptr});
+    return free_lists_.back();
+  }
+
+  void NewChunk(std::size_t size) {
+    const std::size_t chunk_size = 1 << 16;
+    std::size_t num_bytes = (size > chunk_size ? size : chunk_size);
+    // The memory from operator new[] is aligned for any type.
+    chunks_.push_back(new char[num_bytes]);
+    chunk_next_ = chunks_.back();
+    chunk_left_ = num_bytes;
+  }
+
+  std::vector<FreeList> free_lists_;
+  std::vector<char *> chunks_;
+  char *chunk_next_ = nullptr;  // the unused part of the last chunk
+  std::size_t chunk_left_ = 0;
+};
+
+// Allocator that gets its memory from a DetStatePool.
+template <typename T>
+struct PoolAllocator {
+  using value_type = T;
+
+  explicit PoolAllocator(DetStatePool *pool) : pool(pool) {}
+  template <typename U>
+  PoolAllocator(const PoolAllocator<U> &other)  // NOLINT
+      : pool(other.pool) {}
+
+  T *allocate(std::size_t n) {
+    return static_cast<T *>(pool->Allocate(n * sizeof(T)));
+  }
+  void deallocate(T *p, std::size_t n) { pool->Deallocate(p, n * sizeof(T)); }
+
+  DetStatePool *pool;
+};
+
+template <typename T, typename U>
+bool operator==(const PoolAllocator<T> &a, const PoolAllocator<U> &b) {
+  return a.pool == b.pool;
+}
+template <typename T, typename U>
+bool operator!=(const PoolAllocator<T> &a, const PoolAllocator<U> &b) {
+  return a.pool != b.pool;
+}
 
 struct MaxTracebackState {
   using DerivType = int32_t;
@@ -315,8 +423,8 @@ struct LogSumTracebackState {
   there (i.e. the length of symbol sequence).
 
     @param [in,out] cur_states   A set of TracebackStates that we'll
-                  trace back from.  Must be nonempty.  Equality
-                  here is simply pointer identity.
+                  trace back from, as a vector of distinct pointers.  Must be
+                  nonempty.  Equality here is simply pointer identity.
 
                   At exit it will contain a single member which will
                   be the most recent common ancestor.
@@ -325,12 +433,12 @@ struct LogSumTracebackState {
              `cur_states.size() == 1` this will be zero.
  */
 int32_t GetMostRecentCommonAncestor(
-    std::unordered_set<LogSumTracebackState *> *cur_states);
+    std::vector<LogSumTracebackState *> *cur_states);
 
 // Version of GetMostRecentCommonAncestor() for MaxTracebackState;
 // see documentation for the other version.
 int32_t GetMostRecentCommonAncestor(
-    std::unordered_set<MaxTracebackState *> *cur_states);
+    std::vector<MaxTracebackState *> *cur_states);
 
 /**
    A TraceBack() function exists for LogSumTracebackState and MaxTracebackState;
@@ -339,7 +447,8 @@ int32_t GetMostRecentCommonAncestor(
 
        @param [in] cur_states   (This is consumed destructively, i.e. don't
                        expect it to contain the same set on exit).
-                       A set of states; we'll iteratively trace back this
+                       A set of states, as a vector of distinct pointers;
+                       we'll iteratively trace back this
                        set one step at a time.    At entry it must have
                        size() == 1; it will also have size() == 1 at exit.
        @param [in] arcs_in    Array of arcs of the FSA that we're doing
@@ -363,13 +472,13 @@ int32_t GetMostRecentCommonAncestor(
    should be equal to `num_steps`.
 
  */
-void TraceBack(std::unordered_set<LogSumTracebackState *> *cur_states,
+void TraceBack(std::vector<LogSumTracebackState *> *cur_states,
                int32_t num_steps, const Arc *arcs_in, float *weight_out,
                std::vector<std::pair<int32_t, float>> *deriv_out);
 
 // The TraceBack function for MaxTracebackState.  See documentation of TraceBack
 // for LogSumTracebackState, above.  This version is simpler.
-void TraceBack(std::unordered_set<MaxTracebackState *> *cur_states,
+void TraceBack(std::vector<MaxTracebackState *> *cur_states,
                int32_t num_steps, const Arc *arcs_in, float *weight_out,
                std::vector<int32_t> *deriv_out);
 
@@ -417,11 +526,15 @@ class DetState {
   // DerivType == int32_t for MaxTracbackState, or
   // pair<int32_t, float> for LogSumTracebackState.
 
-  // Constructor for the initial state of the determinized FSA
-  DetState() : seq_len(0), normalized(true) {
+  // Constructor for the initial state of the determinized FSA; the
+  // TracebackStates of this DetState and those derived from it will be
+  // allocated from `pool`.
+  explicit DetState(DetStatePool *pool)
+      : seq_len(0), normalized(true), pool(pool) {
     // the constructor of TracebackState that takes no args gives us what we
     // need for the start-state.
-    elements[0] = std::make_shared<TracebackState>();
+    elements[0] = std::allocate_shared<TracebackState>(
+        PoolAllocator<TracebackState>(pool));
   }
 
   /*
@@ -432,10 +545,12 @@ class DetState {
                            one.  This seq_len may end up getting reduced
                            when Normalize() is called (reducing seq_len
                            implicitly advances the base_state).
+       @param [in] pool    The pool of the source det_state.
    */
-  explicit DetState(int32_t seq_len)
+  DetState(int32_t seq_len, DetStatePool *pool)
       : seq_len(seq_len),
-        normalized(false) {}  // .. and forward_backward_prob undefined
+        normalized(false),
+        pool(pool) {}  // .. and forward_backward_prob undefined
 
   /**
      Process incoming arc to this DetState.  See documentation for
@@ -453,11 +568,12 @@ class DetState {
    */
   void AcceptIncomingArc(int32_t state_id,
                          const std::shared_ptr<TracebackState> &src,
-                         int32_t incoming_arc_index, int32_t arc_weight) {
+                         int32_t incoming_arc_index, float arc_weight) {
     auto ret = elements.insert({state_id, nullptr});
     if (ret.second) {  // No such state existed in `elements`
-      ret.first->second = std::make_shared<TracebackState>(
-          state_id, src, incoming_arc_index, arc_weight);
+      ret.first->second = std::allocate_shared<TracebackState>(
+          PoolAllocator<TracebackState>(pool), state_id, src,
+          incoming_arc_index, arc_weight);
     } else {  // A state with this staste_id existed in `elements`.
       ret.first->second->Accept(src, incoming_arc_index, arc_weight);
     }
@@ -483,6 +599,10 @@ class DetState {
   // normalized will not yet have an `output_state`.
   bool normalized;
 
+  // The pool that this DetState, its successors and their TracebackStates
+  // are allocated from.
+  DetStatePool *pool;
+
   // `elements` can be thought of as weighted subsets of states in the input
   // FSA, that also stores some traceback information that lets us compute
   // derivatives.
@@ -564,7 +684,8 @@ int32_t DetState<TracebackState>::ProcessArcs(
     DetStatePriorityQueue<TracebackState> *queue) {
   int32_t num_steps = 0;
 
-  std::unordered_map<int32_t, DetState<TracebackState> *> label_to_state;
+  std::unordered_map<int32_t, std::shared_ptr<DetState<TracebackState>>>
+      label_to_state;
 
   // The following loop populates `label_to_state`, creating successor
   // DetStates (unnormalized).
@@ -583,9 +704,10 @@ int32_t DetState<TracebackState>::ProcessArcs(
       auto iter = ret.first;
       if (ret.second) {  // Inserted -> this label was not a key in this map.
                          // Allocate new DetState.
-        iter->second = new DetState<TracebackState>(seq_len + 1);
+        iter->second = std::allocate_shared<DetState<TracebackState>>(
+            PoolAllocator<DetState<TracebackState>>(pool), seq_len + 1, pool);
       }
-      DetState<TracebackState> *det_state = iter->second;
+      DetState<TracebackState> *det_state = iter->second.get();
       det_state->AcceptIncomingArc(arc.dest_state, state_ptr, curr_arc,
                                    arc.weight);
     }
@@ -596,10 +718,11 @@ int32_t DetState<TracebackState>::ProcessArcs(
                                    // FSA is connected.
 
   // The following loop normalizes successor det-states, outputs the arcs
-  // that lead to them, and adds them to the queue if necessary.
+  // that lead to them, and adds them to the queue if necessary; the others
+  // are freed with label_to_state.
   for (auto iter = label_to_state.begin(); iter != label_to_state.end();
        ++iter) {
-    DetState<TracebackState> *det_state = iter->second;
+    DetState<TracebackState> *det_state = iter->second.get();
 
     float arc_weight;
     std::vector<DerivType> deriv_info;
@@ -609,12 +732,7 @@ int32_t DetState<TracebackState>::ProcessArcs(
       arcs_out->push_back(
           {this->state_id, det_state->state_id, iter->first, arc_weight});
       derivs_per_arc->push_back(std::move(deriv_info));
-      if (is_new_state)
-        queue->push(std::unique_ptr<DetState<TracebackState>>(det_state));
-      else
-        delete det_state;
-    } else {
-      delete det_state;
+      if (is_new_state) queue->push(std::move(iter->second));
     }
   }
   return num_steps;
@@ -636,7 +754,8 @@ template <class TracebackState>
 void DetState<TracebackState>::Normalize(const WfsaWithFbWeights &wfsa_in,
                                          float *removed_weight,
                                          std::vector<DerivType> *deriv_info) {
-  std::unordered_set<TracebackState *> cur_states;
+  std::vector<TracebackState *> cur_states;
+  cur_states.reserve(elements.size());
 
   double fb_prob = -std::numeric_limits<double>::infinity();
   for (const auto &p : elements) {
@@ -644,7 +763,7 @@ void DetState<TracebackState>::Normalize(const WfsaWithFbWeights &wfsa_in,
     fb_prob = LogSumOrMax<TracebackState>(
         fb_prob,
         state->forward_prob + wfsa_in.BackwardStateWeights()[state->state_id]);
-    cur_states.insert(state);
+    cur_states.push_back(state);
   }
 
   int32_t new_seq_len = GetMostRecentCommonAncestor(&cur_states);
@@ -652,7 +771,7 @@ void DetState<TracebackState>::Normalize(const WfsaWithFbWeights &wfsa_in,
   K2_CHECK_EQ(cur_states.size(), 1);
   K2_CHECK_LE(new_seq_len, seq_len);
 
-  const TracebackState *base_state = *(cur_states.begin());
+  const TracebackState *base_state = cur_states[0];
   // The following statement is a correction term that we add to
   // forward_backward_prob, in which we replace the forward_prob in the DetState
   // (which will have been computed in a path-dependent way) with the
@@ -682,6 +801,9 @@ void DetState<TracebackState>::Normalize(const WfsaWithFbWeights &wfsa_in,
   in the determinized output.  Caution: it uses a randomized algorithm that
   could in principle produce collisions that would generate wrong output.
   We don't think this will ever happen though (128-bit representations).
+
+  The 128-bit values are kept in an open-addressing hash table with linear
+  probing, which is at most half full.
  */
 template <class TracebackState>
 class DetStateMap {
@@ -703,31 +825,59 @@ class DetStateMap {
   bool GetOutputState(DetState<TracebackState> *a, const Fsa &fsa) {
     std::pair<uint64_t, uint64_t> compact;
     DetStateToCompact(*a, fsa, &compact);
-    auto p = map_.insert({compact, cur_output_state_});
-    bool inserted = p.second;
-    if (inserted) {
-      a->state_id = cur_output_state_++;
-      return true;
+    if (2 * (static_cast<std::size_t>(cur_output_state_) + 1) >
+        values_.size())
+      Grow();
+    std::size_t mask = values_.size() - 1;
+    for (std::size_t i = HashKey(compact) & mask;; i = (i + 1) & mask) {
+      if (values_[i] < 0) {
+        keys_[i] = compact;
+        a->state_id = values_[i] = cur_output_state_++;
+        return true;
+      }
+      if (keys_[i] == compact) {
+        a->state_id = values_[i];
+        return false;
+      }
     }
-
-    a->state_id = p.first->second;
-    return false;
   }
 
   int32_t size() const { return cur_output_state_; }
 
  private:
-  // simple hashing function that just takes the first element of the pair.
-  struct PairHasher {
-    std::size_t operator()(const std::pair<uint64_t, uint64_t> &p) const {
-      return static_cast<std::size_t>(p.first);
+  // Mixes both halves of the key, as the low bits select the bucket.
+  static std::size_t HashKey(const std::pair<uint64_t, uint64_t> &p) {
+    uint64_t h = p.first * 0x9E3779B97F4A7C15ull;
+    h ^= p.second + 0x9E3779B97F4A7C15ull + (h << 6) + (h >> 2);
+    // the finalizer of splitmix64.
+    h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ull;
+    h = (h ^ (h >> 27)) * 0x94D049BB133111EBull;
+    return static_cast<std::size_t>(h ^ (h >> 31));
+  }
+
+  // Doubles the number of buckets (initially 16) and reinserts the keys.
+  void Grow() {
+    std::size_t num_buckets = (values_.empty() ? 16 : 2 * values_.size()),
+                mask = num_buckets - 1;
+    std::vector<std::pair<uint64_t, uint64_t>> keys(num_buckets);
+    std::vector<int32_t> values(num_buckets, -1);
+    for (std::size_t j = 0; j != values_.size(); ++j) {
+      if (values_[j] < 0) continue;
+      std::size_t i = HashKey(keys_[j]) & mask;
+      while (values[i] >= 0) i = (i + 1) & mask;
+      keys[i] = keys_[j];
+      values[i] = values_[j];
     }
-  };
+    keys_.swap(keys);
+    values_.swap(values);
+  }
 
   int32_t cur_output_state_{0};
-  /* maps from 128-bit key (stored as a pair of uint64_t's) to the int32_t
-   * state-id. */
-  std::unordered_map<std::pair<uint64_t, uint64_t>, uint32_t, PairHasher> map_;
+  /* The hash table from 128-bit key (stored as a pair of uint64_t's) to the
+     int32_t state-id; values_[i] is -1 if bucket i is empty.  The number of
+     buckets is a power of 2. */
+  std::vector<std::pair<uint64_t, uint64_t>> keys_;
+  std::vector<int32_t> values_;
 
   /* Turns DetState into a compact form of 128 bits.  Technically there
      could be collisions, which would be fatal for the algorithm, but this
@@ -786,12 +936,6 @@ class DetStateMap {
     vec->first = a;
     vec->second = b;
   }
-
-  struct DetStateHasher {
-    std::size_t operator()(const std::pair<uint64_t, uint64_t> &p) const {
-      return p.first;
-    }
-  };
 };
 
 }  // namespace k2host
@@ -12,6 +12,7 @@
 #include "k2/csrc/host/fsa_equivalent.h"
 
 #include <algorithm>
+#include <atomic>
 #include <queue>
 #include <random>
 #include <unordered_map>
@@ -98,26 +99,155 @@ static bool Intersect(const k2host::Fsa &a, const k2host::Fsa &b,
 }
 
 /*
-  Version of RandPath that writes the output path to an FsaCreator `path`;
-  see its documentation.
-  Usually user will call `path.GetFsa()` to get the output path after
-  the function call, the memory of the output path is managed by `path`
-  and will be released automatically if `path`is out of scope.
+  Generates random paths from an FSA as RandPath does, but for generating many
+  of them from the same FSA: the arcs each state may choose from are listed
+  once in the constructor, and Generate() takes the random generator to use,
+  so one object can be shared by several threads, each with its own
+  generator.  Unlike RandPath, with `no_eps_arc` it chooses among the
+  non-epsilon arcs directly instead of retrying.
  */
-static bool RandomPath(const k2host::Fsa &fsa_in, bool no_eps_arc,
-                       k2host::FsaCreator *path,
-                       std::vector<int32_t> *arc_map = nullptr) {
-  K2_CHECK_NE(path, nullptr);
-  k2host::RandPath rand_path(fsa_in, no_eps_arc);
-  k2host::Array2Size<int32_t> fsa_size;
-  rand_path.GetSizes(&fsa_size);
+class PathGenerator {
+ public:
+  // `fsa` must be valid, non-empty and connected.
+  PathGenerator(const k2host::Fsa &fsa, bool no_eps_arc) : fsa_(fsa) {
+    int32_t num_states = fsa.NumStates();
+    const auto arcs = fsa.data + fsa.indexes[0];
+    arc_indexes_.reserve(num_states + 1);
+    arc_indexes_.push_back(0);
+    for (int32_t state = 0; state != num_states; ++state) {
+      for (int32_t i = fsa.indexes[state] - fsa.indexes[0];
+           i != fsa.indexes[state + 1] - fsa.indexes[0]; ++i) {
+        if (!no_eps_arc || arcs[i].label != k2host::kEpsilon)
+          arcs_.push_back(i);
+      }
+      arc_indexes_.push_back(static_cast<int32_t>(arcs_.size()));
+    }
+  }
 
-  path->Init(fsa_size);
-  auto &path_fsa = path->GetFsa();
-  if (arc_map != nullptr) arc_map->resize(fsa_size.size2);
-  bool status = rand_path.GetOutput(
-      &path_fsa, arc_map == nullptr ? nullptr : arc_map->data());
-  return status;
+  /*
+    Outputs the labels of a random path from the start state to the final
+    state to `labels`; returns false if there is no such path with the
+    arcs allowed, i.e. if we reach a state with only epsilon arcs.
+   */
+  bool Generate(std::mt19937 *generator, std::vector<int32_t> *labels) const {
+    labels->clear();
+    const auto arcs = fsa_.data + fsa_.indexes[0];
+    int32_t final_state = fsa_.FinalState();
+    for (int32_t state = 0; state != final_state;) {
+      int32_t begin = arc_indexes_[state], end = arc_indexes_[state + 1];
+      if (begin == end) return false;
+      std::uniform_int_distribution<int32_t> distribution(begin, end - 1);
+      const auto &arc = arcs[arcs_[distribution(*generator)]];
+      labels->push_back(arc.label);
+      state = arc.dest_state;
+    }
+    return true;
+  }
+
+ private:
+  const k2host::Fsa &fsa_;
+  // arcs_[arc_indexes_[s]] .. arcs_[arc_indexes_[s+1] - 1] are the indexes of
+  // the arcs leaving state s that may be chosen.
+  std::vector<int32_t> arc_indexes_;
+  std::vector<int32_t> arcs_;
+};
+
+// Returns the range of arcs leaving `state` in the arc-sorted `fsa` with
+// label `label`.
+static std::pair<const k2host::Arc *, const k2host::Arc *> ArcsWithLabel(
+    const k2host::Fsa &fsa, int32_t state, int32_t label) {
+  const k2host::Arc arc(state, 0, label, 0);
+  return std::equal_range(fsa.data + fsa.indexes[state],
+                          fsa.data + fsa.indexes[state + 1], arc,
+                          [](const k2host::Arc &left,
+                             const k2host::Arc &right) {
+                            return left.label < right.label;
+                          });
+}
+
+/*
+  Returns true if the epsilon-free, arc-sorted `fsa` accepts the symbol
+  sequence `labels`, i.e. if the intersection of `fsa` with the path is not
+  empty after connecting.
+ */
+static bool IsAccepted(const k2host::Fsa &fsa,
+                       const std::vector<int32_t> &labels) {
+  std::vector<int32_t> states = {0}, next_states;
+  for (int32_t label : labels) {
+    next_states.clear();
+    for (int32_t state : states) {
+      auto range = ArcsWithLabel(fsa, state, label);
+      for (auto it = range.first; it != range.second; ++it)
+        next_states.push_back(it->dest_state);
+    }
+    std::sort(next_states.begin(), next_states.end());
+    next_states.erase(std::unique(next_states.begin(), next_states.end()),
+                      next_states.end());
+    states.swap(next_states);
+    if (states.empty()) return false;
+  }
+  return std::binary_search(states.begin(), states.end(), fsa.FinalState());
+}
+
+/*
+  Returns the total weight (max or log-sum) of the paths in `fsa` (arc-sorted
+  and top-sorted) with the symbol sequence `labels` (with no epsilons), i.e.
+  ShortestDistance<Type>() of the intersection of `fsa` with that path.
+ */
+template <k2host::FbWeightType Type>
+static double PathWeight(const k2host::Fsa &fsa,
+                         const std::vector<int32_t> &labels) {
+  std::vector<k2host::Arc> arcs;
+  arcs.reserve(labels.size());
+  for (std::size_t i = 0; i != labels.size(); ++i)
+    arcs.emplace_back(i, i + 1, labels[i], 0);
+  k2host::FsaCreator path_storage(arcs, static_cast<int32_t>(labels.size()));
+  k2host::FsaCreator fsa_compose_path_storage;
+  ::Intersect(fsa, path_storage.GetFsa(), &fsa_compose_path_storage);
+  return k2host::ShortestDistance<Type>(fsa_compose_path_storage.GetFsa());
+}
+
+/*
+  Calls `check(&generator)` until it has returned kAccepted `npath` times or
+  until it returns kRejected once (or, if `max_calls` > 0, until it has been
+  called that many times); returns false if it returned kRejected.  The calls
+  are made in rounds of the number of paths still needed, in parallel with up
+  to `num_threads` threads.  Each call gets a generator of its own, seeded
+  from one random seed and the index of the call, so the outcome doesn't
+  depend on the number of threads.
+ */
+enum PathStatus { kAccepted, kRejected, kSkipped };
+template <typename CheckFunc>
+static bool CheckRandomPaths(std::size_t npath, int32_t num_threads,
+                             std::size_t max_calls, CheckFunc check) {
+  std::random_device rd;
+  const uint32_t seed = rd();
+  std::atomic<bool> rejected(false);
+  std::atomic<std::size_t> num_accepted(0);
+  std::size_t num_calls = 0;
+  while (num_accepted < npath && !rejected &&
+         (max_calls == 0 || num_calls < max_calls)) {
+    std::size_t num_tasks = npath - num_accepted;
+    if (max_calls != 0) num_tasks = std::min(num_tasks, max_calls - num_calls);
+    std::size_t begin = num_calls;
+    k2host::ParallelFor(static_cast<int32_t>(num_tasks), num_threads,
+                        [&](int32_t task) {
+                          if (rejected) return;
+                          std::size_t i = begin + task;
+                          std::seed_seq seq{
+                              seed, static_cast<uint32_t>(i),
+                              static_cast<uint32_t>(
+                                  static_cast<uint64_t>(i) >> 32)};
+                          std::mt19937 generator(seq);
+                          PathStatus status = check(&generator);
+                          if (status == kAccepted)
+                            ++num_accepted;
+                          else if (status == kRejected)
+                            rejected = true;
+                        });
+    num_calls += num_tasks;
+  }
+  return !rejected;
 }
 
 // c = (a - b) + (b-a)
@@ -138,7 +268,8 @@ static void SetDifference(const std::unordered_set<int32_t> &a,
 
 namespace k2host {
 
-bool IsRandEquivalent(const Fsa &a, const Fsa &b, std::size_t npath /*=100*/) {
+bool IsRandEquivalent(const Fsa &a, const Fsa &b, std::size_t npath /*=100*/,
+                      int32_t num_threads /*=0*/) {
   // We will do `intersect` later which requires either `a` or `b` is
   // epsilon-free, considering they should hold same set of arc labels, so both
   // of them should be epsilon-free.
@@ -168,28 +299,25 @@ bool IsRandEquivalent(const Fsa &a, const Fsa &b, std::size_t npath /*=100*/) {
   const auto &valid_c = valid_c_storage.GetFsa();
   if (IsEmpty(valid_c)) return false;
 
-  std::random_device rd;
-  std::mt19937 gen(rd());
-  std::bernoulli_distribution coin(0.5);
-  for (auto i = 0; i != npath; ++i) {
-    const auto &fsa = coin(gen) ? valid_a : valid_b;
-    FsaCreator valid_path_storage;
-    if (!::RandomPath(fsa, false, &valid_path_storage)) continue;
-    // path is already connected
-    ArcSort(&valid_path_storage.GetFsa());
-    FsaCreator cpath_storage, valid_cpath_storage;
-    ::Intersect(valid_path_storage.GetFsa(), valid_c, &cpath_storage);
-    ::Connect(cpath_storage.GetFsa(), &valid_cpath_storage);
-    if (IsEmpty(valid_cpath_storage.GetFsa())) return false;
-  }
-
-  return true;
+  const PathGenerator generator_a(valid_a, false),
+      generator_b(valid_b, false);
+  auto check_path = [&](std::mt19937 *generator) -> PathStatus {
+    std::bernoulli_distribution coin(0.5);
+    const auto &path_generator = coin(*generator) ? generator_a : generator_b;
+    std::vector<int32_t> labels;
+    if (!path_generator.Generate(generator, &labels)) return kSkipped;
+    // `valid_c` is epsilon-free, as `a` and `b` are.
+    return IsAccepted(valid_c, labels) ? kAccepted : kRejected;
+  };
+  // Paths that can't be generated count as tries, as they did with RandPath.
+  return CheckRandomPaths(npath, num_threads, npath, check_path);
 }
 
 template <FbWeightType Type>
 bool IsRandEquivalent(const Fsa &a, const Fsa &b,
                       float beam /*=kFloatInfinity*/, float delta /*=1e-6*/,
-                      bool top_sorted /*=true*/, std::size_t npath /*= 100*/) {
+                      bool top_sorted /*=true*/, std::size_t npath /*= 100*/,
+                      int32_t num_threads /*= 0*/) {
   K2_CHECK_GT(beam, 0);
   FsaCreator connected_a_storage, connected_b_storage, valid_a_storage,
       valid_b_storage;
@@ -227,58 +355,44 @@ bool IsRandEquivalent(const Fsa &a, const Fsa &b,
     loglike_cutoff_b = kDoubleNegativeInfinity;
   }
 
-  std::random_device rd;
-  std::mt19937 gen(rd());
-  std::bernoulli_distribution coin(0.5);
-  std::size_t n = 0;
-  while (n < npath) {
-    const auto &fsa = coin(gen) ? valid_a : valid_b;
-    FsaCreator valid_path_storage;
-    // fail to generate a epsilon-free path (note that
-    // our current implementation of `Intersection` requires
-    // one of the two input FSAs must be epsilon-free).
-    if (!::RandomPath(fsa, true, &valid_path_storage)) continue;
-    // path is already connected so we will not call `::Connect` here
-    ArcSort(&valid_path_storage.GetFsa());
-    const auto &valid_path = valid_path_storage.GetFsa();
-
-    FsaCreator a_compose_path_storage, b_compose_path_storage;
-    std::vector<int32_t> arc_map_a_path, arc_map_b_path;
-    // note that `valid_path` is epsilon-free
-    ::Intersect(valid_a, valid_path, &a_compose_path_storage, &arc_map_a_path);
-    ::Intersect(valid_b, valid_path, &b_compose_path_storage, &arc_map_b_path);
-
-    // TODO(haowen): we may need to implement a version of `ShortestDistance`
-    // for non-top-sorted FSAs, but we prefer to decide this later as there's no
-    // such scenarios (input FSAs are not top-sorted) currently. If we finally
-    // find out that we don't need that version, we will remove flag
-    // `top_sorted` and add requirements as comments in the header file.
-    K2_CHECK(top_sorted);
-    double cost_a = ShortestDistance<Type>(a_compose_path_storage.GetFsa());
-    double cost_b = ShortestDistance<Type>(b_compose_path_storage.GetFsa());
-
-    if (cost_a < loglike_cutoff_a && cost_b < loglike_cutoff_b) continue;
-
-    if (!DoubleApproxEqual(cost_a, cost_b, delta)) return false;
-
-    ++n;
-  }
-  return true;
+  // TODO(haowen): we may need to implement a version of `ShortestDistance`
+  // for non-top-sorted FSAs, but we prefer to decide this later as there's no
+  // such scenarios (input FSAs are not top-sorted) currently. If we finally
+  // find out that we don't need that version, we will remove flag
+  // `top_sorted` and add requirements as comments in the header file.
+  K2_CHECK(top_sorted);
+  const PathGenerator generator_a(valid_a, true), generator_b(valid_b, true);
+  auto check_path = [&](std::mt19937 *generator) -> PathStatus {
+    std::bernoulli_distribution coin(0.5);
+    const auto &path_generator = coin(*generator) ? generator_a : generator_b;
+    std::vector<int32_t> labels;
+    // fail to generate a epsilon-free path.
+    if (!path_generator.Generate(generator, &labels)) return kSkipped;
+    double cost_a = PathWeight<Type>(valid_a, labels);
+    double cost_b = PathWeight<Type>(valid_b, labels);
+    if (cost_a < loglike_cutoff_a && cost_b < loglike_cutoff_b)
+      return kSkipped;
+    return DoubleApproxEqual(cost_a, cost_b, delta) ? kAccepted : kRejected;
+  };
+  return CheckRandomPaths(npath, num_threads, 0, check_path);
 }
 
 // explicit instantiation here
 template bool IsRandEquivalent<kMaxWeight>(const Fsa &a, const Fsa &b,
                                            float beam, float delta,
-                                           bool top_sorted, std::size_t npath);
+                                           bool top_sorted, std::size_t npath,
+                                           int32_t num_threads);
 template bool IsRandEquivalent<kLogSumWeight>(const Fsa &a, const Fsa &b,
                                               float beam, float delta,
                                               bool top_sorted,
-                                              std::size_t npath);
+                                              std::size_t npath,
+                                              int32_t num_threads);
 
 bool IsRandEquivalentAfterRmEpsPrunedLogSum(const Fsa &a, const Fsa &b,
                                             float beam,
                                             bool top_sorted /*= true*/,
-                                            std::size_t npath /*= 100*/) {
+                                            std::size_t npath /*= 100*/,
+                                            int32_t num_threads /*= 0*/) {
   K2_CHECK_GT(beam, 0);
   FsaCreator connected_a_storage, connected_b_storage, valid_a_storage,
       valid_b_storage;
@@ -309,51 +423,37 @@ bool IsRandEquivalentAfterRmEpsPrunedLogSum(const Fsa &a, const Fsa &b,
   double loglike_cutoff_a = ShortestDistance<kLogSumWeight>(valid_a) - beam;
   double loglike_cutoff_b = ShortestDistance<kLogSumWeight>(valid_b) - beam;
 
-  std::random_device rd;
-  std::mt19937 gen(rd());
-  std::bernoulli_distribution coin(0.5);
-  std::size_t n = 0;
-  while (n < npath) {
-    bool random_path_from_a = coin(gen);
-    const auto &fsa = random_path_from_a ? valid_a : valid_b;
-    FsaCreator valid_path_storage;
-    // fail to generate a epsilon-free path (note that
-    // our current implementation of `Intersection` requires
-    // one of the two input FSAs must be epsilon-free).
-    if (!::RandomPath(fsa, true, &valid_path_storage)) continue;
-    // path is already connected so we will not call `::Connect` here
-    ArcSort(&valid_path_storage.GetFsa());
-    const auto &valid_path = valid_path_storage.GetFsa();
-
-    FsaCreator a_compose_path_storage, b_compose_path_storage;
-    std::vector<int32_t> arc_map_a_path, arc_map_b_path;
-    // note that `valid_path` is epsilon-free
-    ::Intersect(valid_a, valid_path, &a_compose_path_storage, &arc_map_a_path);
-    ::Intersect(valid_b, valid_path, &b_compose_path_storage, &arc_map_b_path);
-
-    // TODO(haowen): we may need to implement a version of `ShortestDistance`
-    // for non-top-sorted FSAs, but we prefer to decide this later as there's no
-    // such scenarios (input FSAs are not top-sorted) currently.
-    K2_CHECK(top_sorted);
-    double cost_a =
-        ShortestDistance<kLogSumWeight>(a_compose_path_storage.GetFsa());
-    double cost_b =
-        ShortestDistance<kLogSumWeight>(b_compose_path_storage.GetFsa());
+  // TODO(haowen): we may need to implement a version of `ShortestDistance`
+  // for non-top-sorted FSAs, but we prefer to decide this later as there's no
+  // such scenarios (input FSAs are not top-sorted) currently.
+  K2_CHECK(top_sorted);
+  const PathGenerator generator_a(valid_a, true), generator_b(valid_b, true);
+  auto check_path = [&](std::mt19937 *generator) -> PathStatus {
+    std::bernoulli_distribution coin(0.5);
+    bool random_path_from_a = coin(*generator);
+    const auto &path_generator =
+        random_path_from_a ? generator_a : generator_b;
+    std::vector<int32_t> labels;
+    // fail to generate a epsilon-free path.
+    if (!path_generator.Generate(generator, &labels)) return kSkipped;
+    double cost_a = PathWeight<kLogSumWeight>(valid_a, labels);
+    double cost_b = PathWeight<kLogSumWeight>(valid_b, labels);
     if (random_path_from_a) {
-      if (cost_a < loglike_cutoff_a) continue;
+      if (cost_a < loglike_cutoff_a) return kSkipped;
       // there is no corresponding path in `b`
       // (cost_b == kDoubleNegativeInfinity < cost_a)
       // or it has weight less than its weight in `a`.
-      if (cost_a > cost_b) return false;
+      if (cost_a > cost_b) return kRejected;
     } else {
-      if (cost_b < loglike_cutoff_b) continue;
+      if (cost_b < loglike_cutoff_b) return kSkipped;
       // there's no corresponding path in `a` or it has weight greater than its
       // weights in `b`.
-      if (cost_a == kDoubleNegativeInfinity || cost_a > cost_b) return false;
+      if (cost_a == kDoubleNegativeInfinity || cost_a > cost_b)
+        return kRejected;
     }
-    ++n;
-  }
-  return true;
+    return kAccepted;
+  };
+  return CheckRandomPaths(npath, num_threads, 0, check_path);
 }
 
 void RandPath::GetSizes(Array2Size<int32_t> *fsa_size) {
@@ -25,9 +25,12 @@ namespace k2host {
 /*
   Returns true if the Fsa `a` is stochastically equivalent to `b` by randomly
   generating `npath` paths from one of them and then checking if the
-  paths exist in the other one.
+  paths exist in the other one.  The paths are generated and checked with up
+  to `num_threads` threads; num_threads <= 0 means the number of hardware
+  threads.
  */
-bool IsRandEquivalent(const Fsa &a, const Fsa &b, std::size_t npath = 100);
+bool IsRandEquivalent(const Fsa &a, const Fsa &b, std::size_t npath = 100,
+                      int32_t num_threads = 0);
 
 /*
   Returns true if the Fsa `a` is stochastically equivalent to `b` by randomly
@@ -57,11 +60,16 @@ bool IsRandEquivalent(const Fsa &a, const Fsa &b, std::size_t npath = 100);
                           Otherwise it must be set to false.
   @param [in]  npath      The number of paths will be generated to check the
                           equivalence of `a` and `b`
+  @param [in]  num_threads  The paths are generated and checked in parallel
+                          with up to this many threads; if num_threads <= 0,
+                          we use the number of hardware threads.  Each path
+                          gets its own random generator, so the result does
+                          not depend on it.
  */
 template <FbWeightType Type>
 bool IsRandEquivalent(const Fsa &a, const Fsa &b, float beam = kFloatInfinity,
                       float delta = 1e-6, bool top_sorted = true,
-                      std::size_t npath = 100);
+                      std::size_t npath = 100, int32_t num_threads = 0);
 
 /*
   This version of `IsRandEquivalent` will be used to check the equivalence
@@ -99,10 +107,12 @@ bool IsRandEquivalent(const Fsa &a, const Fsa &b, float beam = kFloatInfinity,
                           Otherwise it must be set to false.
   @param [in]  npath      The number of paths will be generated to check the
                           equivalence of `a` and `b`
+  @param [in]  num_threads  As for IsRandEquivalent() above.
  */
 bool IsRandEquivalentAfterRmEpsPrunedLogSum(const Fsa &a, const Fsa &b,
                                             float beam, bool top_sorted = true,
-                                            std::size_t npath = 100);
+                                            std::size_t npath = 100,
+                                            int32_t num_threads = 0);
 
 /*
   Gets a random path from the input FSA, returns true if we get one path
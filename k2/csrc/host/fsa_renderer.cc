@@ -12,9 +12,14 @@
 
 #include "k2/csrc/host/fsa_renderer.h"
 
+#include <algorithm>
 #include <iomanip>
 #include <sstream>
 #include <string>
+#include <vector>
+
+#include "k2/csrc/host/properties.h"
+#include "k2/csrc/log.h"
 
 namespace {
 
@@ -38,8 +43,12 @@ std::string GenerateEpilogue() { return "}"; }
 using k2host::Arc;
 using k2host::Fsa;
 
-std::string ProcessState(const Fsa &fsa, int32_t state) {
-  std::ostringstream os;
+/*
+  Writes `state` and its arcs to `os`; if `keep_arcs` is not nullptr, only
+  the arcs `i` with keep_arcs[i - fsa.indexes[0]] are written.
+ */
+void ProcessState(const Fsa &fsa, int32_t state, const char *keep_arcs,
+                  std::ostream &os) {
   os << "  " << state << " [label = \"" << state
      << "\", shape = circle, style = bold, fontsize = 14]"
      << "\n";
@@ -49,6 +58,7 @@ std::string ProcessState(const Fsa &fsa, int32_t state) {
   int32_t end = fsa.indexes[state + 1];
 
   for (; begin != end; ++begin) {
+    if (keep_arcs != nullptr && !keep_arcs[begin - arc_begin_index]) continue;
     const auto &arc = fsa.data[begin];
     int32_t src = arc.src_state;
     int32_t dest = arc.dest_state;
@@ -59,34 +69,156 @@ std::string ProcessState(const Fsa &fsa, int32_t state) {
     os << "\", fontsize = 14];"
        << "\n";
   }
+}
 
-  return os.str();
+// A path from the start state, see FsaRenderer::GetPart().
+struct PartialPath {
+  double weight;
+  int32_t arc;   // The index of its last arc, or -1 for the empty path.
+  int32_t prev;  // The index of the path without that arc in the best paths
+                 // to the arc's source state.
+  bool operator<(const PartialPath &other) const {
+    return weight > other.weight;  // best first
+  }
+};
+
+// Keeps the `n` best of `paths`; they are sorted if `sort` is true.
+void PrunePaths(int32_t n, bool sort, std::vector<PartialPath> *paths) {
+  if (static_cast<int32_t>(paths->size()) > n) {
+    std::nth_element(paths->begin(), paths->begin() + n, paths->end());
+    paths->resize(n);
+  }
+  if (sort) std::sort(paths->begin(), paths->end());
 }
 
 }  // namespace
 
 namespace k2host {
 
+void FsaRenderer::GetPart(std::vector<char> *keep_states,
+                          std::vector<char> *keep_arcs) const {
+  int32_t num_states = fsa_.NumStates(), arc_begin_index = fsa_.indexes[0],
+          num_arcs = fsa_.indexes[num_states] - arc_begin_index;
+  keep_states->assign(num_states, 0);
+  keep_arcs->assign(num_arcs, 0);
+  char *keep_states_data = keep_states->data(),
+       *keep_arcs_data = keep_arcs->data();
+
+  if (!opts_.states.empty()) {
+    K2_CHECK_GE(opts_.max_distance, 0);
+    // The search goes both ways, so we need the arcs entering each state.
+    std::vector<int32_t> entering_splits(num_states + 1, 0),
+        entering_arcs(num_arcs);
+    for (int32_t i = 0; i != num_arcs; ++i)
+      ++entering_splits[fsa_.data[arc_begin_index + i].dest_state + 1];
+    for (int32_t s = 0; s != num_states; ++s)
+      entering_splits[s + 1] += entering_splits[s];
+    std::vector<int32_t> next_pos(entering_splits.begin(),
+                                  entering_splits.end() - 1);
+    for (int32_t i = 0; i != num_arcs; ++i)
+      entering_arcs[next_pos[fsa_.data[arc_begin_index + i].dest_state]++] =
+          arc_begin_index + i;
+
+    // Breadth-first search from `opts_.states`.
+    std::vector<int32_t> distance(num_states, -1), queue;
+    for (int32_t s : opts_.states) {
+      K2_CHECK_GE(s, 0);
+      K2_CHECK_LT(s, num_states);
+      if (distance[s] < 0) {
+        distance[s] = 0;
+        queue.push_back(s);
+      }
+    }
+    for (std::size_t i = 0; i != queue.size(); ++i) {
+      int32_t s = queue[i], d = distance[s];
+      if (d == opts_.max_distance) continue;
+      auto visit = [&distance, &queue, d](int32_t t) {
+        if (distance[t] < 0) {
+          distance[t] = d + 1;
+          queue.push_back(t);
+        }
+      };
+      for (int32_t a = fsa_.indexes[s]; a != fsa_.indexes[s + 1]; ++a)
+        visit(fsa_.data[a].dest_state);
+      for (int32_t j = entering_splits[s]; j != entering_splits[s + 1]; ++j)
+        visit(fsa_.data[entering_arcs[j]].src_state);
+    }
+    for (int32_t s : queue) keep_states_data[s] = 1;
+    for (int32_t i = 0; i != num_arcs; ++i) {
+      const Arc &arc = fsa_.data[arc_begin_index + i];
+      if (distance[arc.src_state] >= 0 && distance[arc.dest_state] >= 0)
+        keep_arcs_data[i] = 1;
+    }
+  }
+
+  if (opts_.num_paths > 0) {
+    K2_CHECK(IsTopSortedAndAcyclic(fsa_))
+        << "Rendering the best paths needs a top-sorted, acyclic FSA";
+    int32_t n = opts_.num_paths;
+    // paths[s] are the best paths from the start state to s.  They are
+    // pruned to the best n, and sorted, before they are extended: as the FSA
+    // is top-sorted, all the arcs entering s have been processed by then.
+    // In the meantime, they are pruned when there are 2n of them.
+    std::vector<std::vector<PartialPath>> paths(num_states);
+    paths[0].push_back({0.0, -1, -1});
+    for (int32_t s = 0; s != num_states; ++s) {
+      PrunePaths(n, true, &paths[s]);
+      for (int32_t a = fsa_.indexes[s]; a != fsa_.indexes[s + 1]; ++a) {
+        const Arc &arc = fsa_.data[a];
+        std::vector<PartialPath> &dest_paths = paths[arc.dest_state];
+        for (std::size_t k = 0; k != paths[s].size(); ++k) {
+          dest_paths.push_back({paths[s][k].weight + arc.weight, a,
+                                static_cast<int32_t>(k)});
+          if (static_cast<int32_t>(dest_paths.size()) == 2 * n)
+            PrunePaths(n, false, &dest_paths);
+        }
+      }
+    }
+    for (const PartialPath &path : paths[num_states - 1]) {
+      const PartialPath *p = &path;
+      int32_t s = num_states - 1;
+      keep_states_data[s] = 1;
+      while (p->arc >= 0) {
+        keep_arcs_data[p->arc - arc_begin_index] = 1;
+        s = fsa_.data[p->arc].src_state;
+        keep_states_data[s] = 1;
+        p = &paths[s][p->prev];
+      }
+    }
+  }
+}
+
 std::string FsaRenderer::Render() const {
+  std::ostringstream os;
+  Render(os);
+  return os.str();
+}
+
+void FsaRenderer::Render(std::ostream &os) const {
   int32_t num_states = fsa_.NumStates();
-  if (num_states == 0) return "";
+  if (num_states == 0) return;
+
+  std::vector<char> keep_states, keep_arcs;
+  bool render_part = (!opts_.states.empty() || opts_.num_paths > 0);
+  if (render_part) GetPart(&keep_states, &keep_arcs);
 
-  std::ostringstream os;
   os << GeneratePrologue();
 
   int32_t final_state = fsa_.FinalState();
   for (int32_t i = 0; i != final_state; ++i) {
-    os << ProcessState(fsa_, i);
+    if (!render_part)
+      ProcessState(fsa_, i, nullptr, os);
+    else if (keep_states[i])
+      ProcessState(fsa_, i, keep_arcs.data(), os);
   }
 
   // now for the final state
-  os << "  " << final_state << " [label = \"" << final_state
-     << "\", shape = doublecircle, style = solid, fontsize = 14]"
-     << "\n";
+  if (!render_part || keep_states[final_state])
+    os << "  " << final_state << " [label = \"" << final_state
+       << "\", shape = doublecircle, style = solid, fontsize = 14]"
+       << "\n";
 
   os << GenerateEpilogue() << "\n";
-
-  return os.str();
 }
 
 }  // namespace k2host
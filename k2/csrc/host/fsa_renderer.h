@@ -9,7 +9,10 @@
  * See LICENSE for clarification regarding multiple authors
  */
 
+#include <cstdint>
+#include <ostream>
 #include <string>
+#include <vector>
 
 #include "k2/csrc/host/fsa.h"
 
@@ -18,16 +21,49 @@
 
 namespace k2host {
 
+/*
+  Options for rendering a part of a large FSA (e.g. a lattice with millions of
+  states) for debugging.  By default the whole FSA is rendered.  If both
+  `states` and `num_paths` are set, the union of the two parts is rendered.
+ */
+struct FsaRenderOptions {
+  // If not empty, the states within `max_distance` arcs (in either direction)
+  // of these states are rendered, with the arcs between them.
+  std::vector<int32_t> states;
+  int32_t max_distance = 2;
+  // If > 0, the states and arcs of the `num_paths` best paths (those with
+  // the largest total weight) from the start state to the final state are
+  // rendered.  The FSA must be top-sorted and acyclic.
+  int32_t num_paths = 0;
+};
+
 // Get a GraphViz representation of an fsa.
 class FsaRenderer {
  public:
   explicit FsaRenderer(const Fsa &fsa) : fsa_(fsa) {}
+  FsaRenderer(const Fsa &fsa, const FsaRenderOptions &opts)
+      : fsa_(fsa), opts_(opts) {}
 
   // Return a GraphViz representation of the fsa
   std::string Render() const;
 
+  /*
+    Writes the GraphViz representation of the fsa to `os`, state by state,
+    so that the whole text is never in memory; prefer this to Render() for
+    large FSAs.  The memory used is O(num_states) if part of the FSA is
+    rendered (O(num_states * num_paths) for the best paths), else O(1).
+   */
+  void Render(std::ostream &os) const;
+
  private:
+  /* Sets `keep_states` and `keep_arcs` (indexed by state and by arc index
+     minus fsa_.indexes[0]) to whether each state and arc is to be rendered,
+     according to opts_. */
+  void GetPart(std::vector<char> *keep_states,
+               std::vector<char> *keep_arcs) const;
+
   const Fsa &fsa_;
+  FsaRenderOptions opts_;
 };
 
 }  // namespace k2host
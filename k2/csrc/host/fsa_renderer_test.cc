@@ -14,6 +14,8 @@
 
 #include <gtest/gtest.h>
 
+#include <sstream>
+#include <string>
 #include <utility>
 #include <vector>
 
@@ -43,4 +45,72 @@ TEST(FsaRenderer, Render) {
   std::cerr << renderer.Render();
 }
 
+static bool HasArc(const std::string &dot, int32_t src, int32_t dest) {
+  return dot.find(" " + std::to_string(src) + " -> " + std::to_string(dest) +
+                  " ") != std::string::npos;
+}
+
+static bool HasState(const std::string &dot, int32_t state) {
+  return dot.find("  " + std::to_string(state) + " [label") !=
+         std::string::npos;
+}
+
+TEST(FsaRenderer, RenderPart) {
+  std::vector<Arc> arcs = {
+      {0, 1, 2, 1}, {0, 2, 1, 2}, {1, 2, 0, 3}, {1, 3, 5, 4}, {2, 3, 6, 5},
+  };
+  FsaCreator fsa_creator(arcs, 3);
+  const auto &fsa = fsa_creator.GetFsa();
+
+  // Streaming gives the same text.
+  std::ostringstream os;
+  FsaRenderer(fsa).Render(os);
+  EXPECT_EQ(os.str(), FsaRenderer(fsa).Render());
+
+  {
+    // The neighbourhood of state 1.
+    FsaRenderOptions opts;
+    opts.states = {1};
+    opts.max_distance = 0;
+    std::string dot = FsaRenderer(fsa, opts).Render();
+    EXPECT_TRUE(HasState(dot, 1));
+    EXPECT_FALSE(HasState(dot, 0));
+    EXPECT_FALSE(HasArc(dot, 1, 2));
+
+    opts.max_distance = 1;
+    dot = FsaRenderer(fsa, opts).Render();
+    for (int32_t s = 0; s != 4; ++s) EXPECT_TRUE(HasState(dot, s));
+    for (const Arc &arc : arcs)
+      EXPECT_TRUE(HasArc(dot, arc.src_state, arc.dest_state));
+
+    opts.states = {3};
+    dot = FsaRenderer(fsa, opts).Render();
+    EXPECT_FALSE(HasState(dot, 0));
+    EXPECT_TRUE(HasArc(dot, 1, 2));
+    EXPECT_TRUE(HasArc(dot, 2, 3));
+    EXPECT_FALSE(HasArc(dot, 0, 1));
+  }
+  {
+    // The paths 0->1->2->3, 0->2->3 and 0->1->3 have weights 9, 7 and 5.
+    FsaRenderOptions opts;
+    opts.num_paths = 1;
+    std::string dot = FsaRenderer(fsa, opts).Render();
+    EXPECT_TRUE(HasArc(dot, 0, 1));
+    EXPECT_TRUE(HasArc(dot, 1, 2));
+    EXPECT_TRUE(HasArc(dot, 2, 3));
+    EXPECT_FALSE(HasArc(dot, 0, 2));
+    EXPECT_FALSE(HasArc(dot, 1, 3));
+
+    opts.num_paths = 2;
+    dot = FsaRenderer(fsa, opts).Render();
+    EXPECT_TRUE(HasArc(dot, 0, 2));
+    EXPECT_FALSE(HasArc(dot, 1, 3));
+
+    opts.num_paths = 10;
+    dot = FsaRenderer(fsa, opts).Render();
+    for (const Arc &arc : arcs)
+      EXPECT_TRUE(HasArc(dot, arc.src_state, arc.dest_state));
+  }
+}
+
 }  // namespace k2host
@@ -14,6 +14,7 @@
 
 #include <algorithm>
 #include <cctype>
+#include <cmath>
 #include <cstdlib>
 #include <random>
 #include <sstream>
@@ -328,6 +329,7 @@ RandFsaOptions::RandFsaOptions() {
   acyclic = false;
   seed = 0;
   nonzero_weights = false;
+  out_degree_skew = 0;
 }
 
 void RandFsaGenerator::GetSizes(Array2Size<int32_t> *fsa_size) {
@@ -347,8 +349,20 @@ void RandFsaGenerator::GetSizes(Array2Size<int32_t> *fsa_size) {
   int32_t label;
   auto num_states = static_cast<int32_t>(opts_.num_states);
 
+  K2_CHECK_GE(opts_.out_degree_skew, 0);
+  // u^(1 + out_degree_skew), for u uniform in [0, 1), has the density of the
+  // source states documented in RandFsaOptions.
+  auto rand_src_state = [&rand, num_states, this]() -> int32_t {
+    if (opts_.out_degree_skew == 0) return rand(0, num_states - 2);
+    constexpr int32_t kMaxRand = 1 << 30;
+    double u = rand(0, kMaxRand - 1) / static_cast<double>(kMaxRand);
+    int32_t s = static_cast<int32_t>((num_states - 1) *
+                                     std::pow(u, 1 + opts_.out_degree_skew));
+    return std::min(s, num_states - 2);
+  };
+
   int32_t num_fails = -1;
-  int32_t max_loops = 100 * opts_.num_arcs;
+  int64_t max_loops = 100 * static_cast<int64_t>(opts_.num_arcs);
   do {
     ++num_fails;
     if (num_fails > 100)
@@ -356,11 +370,11 @@ void RandFsaGenerator::GetSizes(Array2Size<int32_t> *fsa_size) {
                        "and num_arcs";
 
     std::unordered_set<std::pair<int32_t, int32_t>, PairHash> seen;
-    int32_t tried = 0;
+    int64_t tried = 0;
     for (auto i = 0;
          i != static_cast<int32_t>(opts_.num_arcs) && tried < max_loops;
          ++tried) {
-      src_state = rand(0, num_states - 2);
+      src_state = rand_src_state();
       if (!opts_.acyclic)
         dest_state = rand(0, num_states - 1);
       else
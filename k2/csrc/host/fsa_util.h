@@ -290,6 +290,12 @@ struct RandFsaOptions {
   bool acyclic;  // generate a cyclic fsa in a best effort manner if it's false
   int32_t seed;  // for random generator. Set it to non-zero for reproducibility
   bool nonzero_weights;  // allow weights to be nonzero (default: fals)
+  // If > 0, the source states of the arcs are not uniformly distributed, but
+  // state s is chosen with a density proportional to (s / num_states) raised
+  // to the power (1 / (1 + out_degree_skew) - 1), so the low-numbered states
+  // have many more arcs than the others, as the hub states of real decoding
+  // graphs do (default: 0).
+  float out_degree_skew;
 
   RandFsaOptions();
 };
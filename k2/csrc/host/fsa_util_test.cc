@@ -190,6 +190,31 @@ TEST(FsaUtil, RandFsa) {
   EXPECT_FALSE(IsEmpty(fsa));
 }
 
+TEST(FsaUtil, RandFsaWithSkewedOutDegree) {
+  RandFsaOptions opts;
+  opts.num_syms = 20;
+  opts.num_states = 200;
+  opts.num_arcs = 2000;
+  opts.allow_empty = false;
+  opts.acyclic = false;
+  opts.seed = 20200517;
+  opts.out_degree_skew = 3;
+
+  RandFsaGenerator generator(opts);
+  Array2Size<int32_t> fsa_size;
+  generator.GetSizes(&fsa_size);
+  FsaCreator fsa_creator(fsa_size);
+  auto &fsa = fsa_creator.GetFsa();
+  generator.GetOutput(&fsa);
+  EXPECT_FALSE(IsEmpty(fsa));
+
+  // With u^4, about half of the arcs leave the first 1/16 of the states.
+  int32_t num_states = fsa.NumStates(), num_low_arcs = 0;
+  for (const auto &arc : fsa)
+    if (arc.src_state < num_states / 16) ++num_low_arcs;
+  EXPECT_GT(num_low_arcs, fsa.size2 / 4);
+}
+
 TEST(FsaUtil, ReorderArcs) {
   {
     // empty input arcs
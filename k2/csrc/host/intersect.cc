@@ -12,6 +12,9 @@
 #include "k2/csrc/host/intersect.h"
 
 #include <algorithm>
+#include <limits>
+#include <memory>
+#include <mutex>  // NOLINT
 #include <queue>
 #include <unordered_map>
 #include <utility>
@@ -37,6 +40,11 @@ static inline int32_t InsertIntersectionState(
   }
   return result.first->second;
 }
+
+static inline bool CompareLabel(const k2host::Arc &left,
+                                const k2host::Arc &right) {
+  return left.label < right.label;
+}
 }  // namespace
 
 namespace k2host {
@@ -186,4 +194,294 @@ bool Intersection::GetOutput(Fsa *c, int32_t *arc_map_a /*= nullptr*/,
   return true;
 }
 
+
+std::shared_ptr<const std::vector<Arc>> LazyFsaCache::GetArcs(int32_t state) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto iter = cache_.find(state);
+    if (iter != cache_.end()) {
+      lru_.splice(lru_.begin(), lru_, iter->second.second);
+      return iter->second.first;
+    }
+    ++num_expansions_;
+  }
+  // The expansion is done without the lock, so that threads that need
+  // different states don't wait for each other; if two threads expand the
+  // same state, the second result is the one that is kept.
+  std::shared_ptr<std::vector<Arc>> arcs = std::make_shared<std::vector<Arc>>();
+  fsa_->GetArcs(state, arcs.get());
+  K2_DCHECK(std::is_sorted(arcs->begin(), arcs->end(), CompareLabel));
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto iter = cache_.find(state);
+  if (iter != cache_.end()) {
+    lru_.splice(lru_.begin(), lru_, iter->second.second);
+    iter->second.first = arcs;
+  } else {
+    if (cache_.size() == max_states_) {
+      cache_.erase(lru_.back());
+      lru_.pop_back();
+    }
+    lru_.push_front(state);
+    cache_.insert({state, {arcs, lru_.begin()}});
+  }
+  return arcs;
+}
+
+std::size_t LazyFsaCache::NumCachedStates() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return cache_.size();
+}
+
+std::size_t LazyFsaCache::NumExpansions() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return num_expansions_;
+}
+
+void LazyIntersection::GetSizes(Array2Size<int32_t> *fsa_size) {
+  K2_CHECK_NE(fsa_size, nullptr);
+  fsa_size->size1 = fsa_size->size2 = 0;
+  status_ = true;
+  arc_indexes_.clear();
+  arcs_.clear();
+  arc_map_a_.clear();
+
+  if (IsEmpty(a_)) return;
+  status_ = IsArcSorted(a_) && IsEpsilonFree(a_);
+  if (!status_) return;
+
+  const int32_t final_state_c = -1;  // just as a placeholder
+  const int32_t arc_map_none = -1;
+  const auto arc_a_begin = a_.data;
+
+  // The arcs leaving the states of a step of the search, before pruning.
+  struct ArcCandidate {
+    StatePair dest_state;
+    int32_t label;
+    float weight;
+    float end_score;  // forward score of the source state + weight
+    int32_t arc_index_a;
+  };
+
+  // map state pair to unique id; only the states reached are in it.
+  std::unordered_map<StatePair, int32_t, PairHash> state_pair_map;
+  state_pair_map.insert({{0, 0}, 0});
+  state_pair_map.insert({{a_.FinalState(), b_->FinalState()}, final_state_c});
+  int32_t num_states_c = 1;
+  // The states of the current step, in order of index (which is consecutive),
+  // and their forward scores (the best score of the arcs that reached them).
+  std::vector<StatePair> cur_states = {{0, 0}}, next_states;
+  std::vector<float> cur_scores = {0}, next_scores;
+  std::vector<ArcCandidate> cands;
+  std::vector<int32_t> cand_indexes;  // the candidates of cur_states[i] are
+                                      // [cand_indexes[i], cand_indexes[i+1]).
+  while (!cur_states.empty()) {
+    cands.clear();
+    cand_indexes.clear();
+    float best_score = -std::numeric_limits<float>::infinity();
+    for (std::size_t i = 0; i != cur_states.size(); ++i) {
+      cand_indexes.push_back(static_cast<int32_t>(cands.size()));
+      int32_t state_a = cur_states[i].first, state_b = cur_states[i].second;
+      float score = cur_scores[i];
+      std::shared_ptr<const std::vector<Arc>> arcs_b = b_->GetArcs(state_b);
+      auto b_arc_iter_begin = arcs_b->begin(), b_arc_iter_end = arcs_b->end();
+      // the states of a language model may have many arcs, so we find the
+      // epsilons (e.g. for backoff) by binary search too.
+      Arc epsilon_arc(state_b, 0, kEpsilon, 0);
+      auto b_eps_range = std::equal_range(b_arc_iter_begin, b_arc_iter_end,
+                                          epsilon_arc, CompareLabel);
+      for (auto it_b = b_eps_range.first; it_b != b_eps_range.second; ++it_b)
+        cands.push_back({{state_a, it_b->dest_state}, kEpsilon, it_b->weight,
+                         score + it_b->weight, arc_map_none});
+      for (int32_t arc_index_a = a_.indexes[state_a];
+           arc_index_a != a_.indexes[state_a + 1]; ++arc_index_a) {
+        const Arc &arc_a = arc_a_begin[arc_index_a];
+        auto b_arc_range = std::equal_range(b_arc_iter_begin, b_arc_iter_end,
+                                            arc_a, CompareLabel);
+        for (auto it_b = b_arc_range.first; it_b != b_arc_range.second;
+             ++it_b) {
+          float weight = arc_a.weight + it_b->weight;
+          cands.push_back({{arc_a.dest_state, it_b->dest_state}, arc_a.label,
+                           weight, score + weight, arc_index_a});
+        }
+      }
+      for (std::size_t j = cand_indexes.back(); j != cands.size(); ++j)
+        best_score = std::max(best_score, cands[j].end_score);
+    }
+    cand_indexes.push_back(static_cast<int32_t>(cands.size()));
+
+    // The candidates within the beam add the states they reach, if new; then
+    // we keep all arcs into states that exist.
+    float cutoff = best_score - beam_;
+    next_states.clear();
+    next_scores.clear();
+    for (const ArcCandidate &cand : cands) {
+      if (cand.end_score < cutoff) continue;
+      auto result = state_pair_map.insert({cand.dest_state, num_states_c});
+      if (result.second) {
+        next_states.push_back(cand.dest_state);
+        next_scores.push_back(cand.end_score);
+        ++num_states_c;
+      }
+    }
+    int32_t next_begin =
+                num_states_c - static_cast<int32_t>(next_states.size()),
+            cur_begin = next_begin - static_cast<int32_t>(cur_states.size());
+    for (std::size_t i = 0; i != cur_states.size(); ++i) {
+      int32_t state_c = cur_begin + static_cast<int32_t>(i);
+      arc_indexes_.push_back(static_cast<int32_t>(arcs_.size()));
+      for (int32_t j = cand_indexes[i]; j != cand_indexes[i + 1]; ++j) {
+        const ArcCandidate &cand = cands[j];
+        auto iter = state_pair_map.find(cand.dest_state);
+        if (iter == state_pair_map.end()) continue;
+        int32_t dest_state_c = iter->second;
+        if (dest_state_c >= next_begin) {
+          float &next_score = next_scores[dest_state_c - next_begin];
+          next_score = std::max(next_score, cand.end_score);
+        }
+        arcs_.emplace_back(state_c, dest_state_c, cand.label, cand.weight);
+        arc_map_a_.push_back(cand.arc_index_a);
+      }
+    }
+    std::swap(cur_states, next_states);
+    std::swap(cur_scores, next_scores);
+  }
+
+  // push final state
+  arc_indexes_.push_back(static_cast<int32_t>(arcs_.size()));
+  int32_t state_index_c = num_states_c;
+  // then replace `final_state_c` with the real index of final state of `c`
+  for (auto &arc : arcs_) {
+    if (arc.dest_state == final_state_c) arc.dest_state = state_index_c;
+  }
+  // push a duplicate of final state
+  arc_indexes_.emplace_back(arc_indexes_.back());
+
+  K2_CHECK_EQ(state_index_c + 2, arc_indexes_.size());
+  fsa_size->size1 = state_index_c + 1;
+  fsa_size->size2 = arcs_.size();
+}
+
+bool LazyIntersection::GetOutput(Fsa *c, int32_t *arc_map_a /*= nullptr*/) {
+  if (IsEmpty(a_)) return true;
+  if (!status_) return false;
+
+  K2_CHECK_NE(c, nullptr);
+  K2_CHECK_EQ(arc_indexes_.size(), c->size1 + 1);
+  std::copy(arc_indexes_.begin(), arc_indexes_.end(), c->indexes);
+  K2_CHECK_EQ(arcs_.size(), c->size2);
+  std::copy(arcs_.begin(), arcs_.end(), c->data);
+  if (arc_map_a != nullptr)
+    std::copy(arc_map_a_.begin(), arc_map_a_.end(), arc_map_a);
+  return true;
+}
+
+void DensePrunedIntersection::GetSizes(const Fsa &a, const DenseScores &b,
+                                       Array2Size<int32_t> *fsa_size) {
+  K2_CHECK_NE(fsa_size, nullptr);
+  K2_CHECK_GT(b.num_rows, 0);
+  fsa_size->size1 = fsa_size->size2 = 0;
+  states_.clear();
+  frame_begin_.clear();
+  search_arcs_.clear();
+  arc_indexes_.clear();
+  arcs_.clear();
+  arc_map_a_.clear();
+  arc_map_b_.clear();
+  if (IsEmpty(a)) return;
+
+  const float neg_inf = -std::numeric_limits<float>::infinity();
+  // Only the elements for the states of the next frame are set, and they are
+  // reset to -1 at the end of each frame, so this doesn't cost a pass over
+  // the states of `a` per frame (or per sequence, once it's big enough).
+  if (state_map_.size() < static_cast<std::size_t>(a.size1))
+    state_map_.resize(a.size1, -1);
+  states_.push_back({0, 0});
+  frame_begin_.push_back(0);
+  for (int32_t t = 0; t != b.num_rows; ++t) {
+    int32_t begin = frame_begin_[t], end = static_cast<int32_t>(states_.size());
+    frame_begin_.push_back(end);
+    if (begin == end) break;
+    float best_score = neg_inf;
+    for (int32_t i = begin; i != end; ++i)
+      best_score = std::max(best_score, states_[i].score);
+    float cutoff = best_score - beam_;
+    const float *row = b.data + static_cast<std::ptrdiff_t>(t) * b.row_stride;
+    for (int32_t i = begin; i != end; ++i) {
+      // Copied, as states_ may be reallocated below.
+      StateInfo state = states_[i];
+      if (state.score < cutoff) continue;
+      for (int32_t arc_index_a = a.indexes[state.state_a];
+           arc_index_a != a.indexes[state.state_a + 1]; ++arc_index_a) {
+        const Arc &arc = a.data[arc_index_a];
+        int32_t col = arc.label + 1;
+        K2_DCHECK(col >= 0 && col < b.num_cols);
+        float weight = arc.weight + row[col], score = state.score + weight;
+        if (!(score > neg_inf)) continue;
+        int32_t &dest = state_map_[arc.dest_state];
+        if (dest == -1) {
+          dest = static_cast<int32_t>(states_.size());
+          states_.push_back({arc.dest_state, score});
+        } else if (score > states_[dest].score) {
+          states_[dest].score = score;
+        }
+        search_arcs_.push_back({i, dest, arc_index_a,
+                                t * b.row_stride + col, weight});
+      }
+    }
+    for (std::size_t i = end; i != states_.size(); ++i)
+      state_map_[states_[i].state_a] = -1;
+  }
+
+  // The states of the frame after the last row are those reached by final
+  // arcs, i.e. the final state of `a` if any path got there.
+  int32_t num_states = static_cast<int32_t>(states_.size());
+  if (static_cast<int32_t>(frame_begin_.size()) != b.num_rows + 1 ||
+      frame_begin_.back() == num_states)
+    return;
+  K2_CHECK_EQ(frame_begin_.back() + 1, num_states);
+
+  // Keep the coaccessible states; as the dest-state of an arc is on the frame
+  // after that of its src-state, one backward pass over the arcs finds them.
+  output_state_.assign(num_states, -1);
+  output_state_.back() = 0;
+  for (auto it = search_arcs_.rbegin(); it != search_arcs_.rend(); ++it)
+    if (output_state_[it->dest] != -1) output_state_[it->src] = 0;
+  int32_t num_states_c = 0;
+  for (int32_t &s : output_state_)
+    if (s != -1) s = num_states_c++;
+  int32_t cur_state = -1;
+  for (const ArcInfo &arc : search_arcs_) {
+    int32_t dest = output_state_[arc.dest];
+    if (dest == -1) continue;
+    int32_t src = output_state_[arc.src];
+    while (cur_state < src) {
+      arc_indexes_.push_back(static_cast<int32_t>(arcs_.size()));
+      ++cur_state;
+    }
+    arcs_.emplace_back(src, dest, a.data[arc.arc_index_a].label, arc.weight);
+    arc_map_a_.push_back(arc.arc_index_a);
+    arc_map_b_.push_back(arc.index_b);
+  }
+  // The (last) final state has no arcs.
+  for (; cur_state < num_states_c; ++cur_state)
+    arc_indexes_.push_back(static_cast<int32_t>(arcs_.size()));
+  fsa_size->size1 = num_states_c;
+  fsa_size->size2 = static_cast<int32_t>(arcs_.size());
+}
+
+void DensePrunedIntersection::GetOutput(
+    Fsa *c, int32_t *arc_map_a /*= nullptr*/,
+    int32_t *arc_map_b /*= nullptr*/) {
+  K2_CHECK_NE(c, nullptr);
+  if (arcs_.empty()) return;
+  K2_CHECK_EQ(arc_indexes_.size(), c->size1 + 1);
+  std::copy(arc_indexes_.begin(), arc_indexes_.end(), c->indexes);
+  K2_CHECK_EQ(arcs_.size(), c->size2);
+  std::copy(arcs_.begin(), arcs_.end(), c->data);
+  if (arc_map_a != nullptr)
+    std::copy(arc_map_a_.begin(), arc_map_a_.end(), arc_map_a);
+  if (arc_map_b != nullptr)
+    std::copy(arc_map_b_.begin(), arc_map_b_.end(), arc_map_b);
+}
+
 }  // namespace k2host
@@ -13,6 +13,12 @@
 #ifndef K2_CSRC_HOST_INTERSECT_H_
 #define K2_CSRC_HOST_INTERSECT_H_
 
+#include <cstddef>
+#include <list>
+#include <memory>
+#include <mutex>  // NOLINT
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
 #include "k2/csrc/host/fsa.h"
@@ -83,6 +89,242 @@ class Intersection {
   std::vector<int32_t> arc_map_b_;
 };
 
+/*
+  An FSA whose arcs are only generated when they are needed, e.g. a language
+  model that is too large to be composed with the decoding graph in advance.
+  The start state is 0, as for Fsa.
+ */
+class LazyFsa {
+ public:
+  virtual ~LazyFsa() = default;
+
+  // Returns the final state.
+  virtual int32_t FinalState() = 0;
+
+  /*
+    Outputs the arcs leaving `state`, which must be sorted by label (as for an
+    arc-sorted Fsa); the `src_state` of each is `state`.  May be called from
+    several threads at once if the LazyFsaCache that uses it is shared by
+    several threads.
+   */
+  virtual void GetArcs(int32_t state, std::vector<Arc> *arcs) = 0;
+};
+
+/*
+  LazyFsa that wraps an Fsa, e.g. for testing.
+ */
+class LazyFsaFromFsa : public LazyFsa {
+ public:
+  // Keeps a reference to `fsa`, which must be non-empty.
+  explicit LazyFsaFromFsa(const Fsa &fsa) : fsa_(fsa) {}
+
+  int32_t FinalState() override { return fsa_.FinalState(); }
+
+  void GetArcs(int32_t state, std::vector<Arc> *arcs) override {
+    arcs->assign(fsa_.data + fsa_.indexes[state],
+                 fsa_.data + fsa_.indexes[state + 1]);
+  }
+
+ private:
+  const Fsa &fsa_;
+};
+
+/*
+  A cache of the arcs of the states of a LazyFsa that have been expanded,
+  holding at most a given number of states (the least recently used ones are
+  dropped).  It is meant to be shared by the LazyIntersections of a batch, so
+  that each state is expanded once for all of them; it is thread-safe.
+ */
+class LazyFsaCache {
+ public:
+  /*
+     @param [in] fsa   The FSA to cache; is not owned, and must outlive this.
+     @param [in] max_states  The number of states to keep the arcs of, e.g.
+                       100000; must be > 0.
+   */
+  LazyFsaCache(LazyFsa *fsa, std::size_t max_states)
+      : fsa_(fsa), max_states_(max_states) {
+    K2_CHECK_GT(max_states, 0);
+    final_state_ = fsa->FinalState();
+  }
+
+  int32_t FinalState() const { return final_state_; }
+
+  /*
+    Returns the arcs leaving `state`, expanding it if it is not in the cache.
+    The result stays valid while it is held, even if the state is dropped
+    from the cache.
+   */
+  std::shared_ptr<const std::vector<Arc>> GetArcs(int32_t state);
+
+  // Returns the number of states whose arcs are in the cache.
+  std::size_t NumCachedStates();
+
+  // Returns the number of times a state was expanded, i.e. the number of
+  // calls to GetArcs() that missed the cache.
+  std::size_t NumExpansions();
+
+ private:
+  using ArcsPtr = std::shared_ptr<const std::vector<Arc>>;
+
+  LazyFsa *fsa_;
+  std::size_t max_states_;
+  int32_t final_state_;
+
+  std::mutex mutex_;
+  // The states in the cache, most recently used first.
+  std::list<int32_t> lru_;
+  std::unordered_map<int32_t, std::pair<ArcsPtr, std::list<int32_t>::iterator>>
+      cache_;
+  std::size_t num_expansions_ = 0;
+};
+
+/**
+   Pruned intersection of an Fsa with a LazyFsa, e.g. of a lattice or a
+   decoding graph with a large language model, such that the LazyFsa is only
+   expanded for the states that are reached by the search.  The memory used
+   is proportional to the number of states reached, rather than to the
+   product of the sizes of the inputs.
+
+   The states are found breadth-first; the beam is applied to the states
+   first reached on each step of the search, against the best of them (the
+   same as for k2::IntersectPruned()).  For epsilon-free acyclic `a`, such as
+   a lattice, this is like frame-synchronous pruning.  The output is not
+   connected (see k2host::Connection); its final state is the last state.
+ */
+class LazyIntersection {
+ public:
+  /* Lightweight constructor that just keeps references to the input
+     parameters.
+     @param [in] a    The FSA to be intersected.  Must satisfy
+                      CheckProperties(a, kArcSorted) and be epsilon-free
+                      (so that `b` may have epsilons, e.g. for backoff)
+     @param [in] b    The cache of the LazyFsa to be intersected with `a`;
+                      may be shared with other LazyIntersections.
+     @param [in] beam  Beam for pruning, e.g. 10, or infinity for none.
+   */
+  LazyIntersection(const Fsa &a, LazyFsaCache *b, float beam)
+      : a_(a), b_(b), beam_(beam) {}
+
+  /*
+    Does the search, and outputs the num-states and num-arcs of the output
+    FSA to `fsa_size`.
+  */
+  void GetSizes(Array2Size<int32_t> *fsa_size);
+
+  /*
+    Outputs the intersection to `c`, which must be initialized with the
+    sizes from GetSizes() (search for 'initialized definition' in class
+    Array2 in array.h); and if `arc_map_a` is not NULL, the arc in `a` of
+    each arc of `c` to it (of size c->size2), with -1 for epsilon arcs of
+    `b`.
+
+    @return false if `a` is not arc-sorted or not epsilon-free; true
+            otherwise.
+   */
+  bool GetOutput(Fsa *c, int32_t *arc_map_a = nullptr);
+
+ private:
+  const Fsa &a_;
+  LazyFsaCache *b_;
+  float beam_;
+
+  bool status_;
+  std::vector<int32_t> arc_indexes_;  // arc_index of fsa_out
+  std::vector<Arc> arcs_;             // arcs of fsa_out
+  std::vector<int32_t> arc_map_a_;
+};
+
+/*
+  The scores of one sequence of a k2::DenseFsaVec, i.e. a dense acceptor with
+  `num_rows - 1` frames: the score of symbol s on row t is
+  data[t * row_stride + s + 1], and that of the final symbol (kFinalSymbol)
+  is data[t * row_stride].  The final symbol only has a finite score on the
+  last row, on which the other symbols are -infinity.
+ */
+struct DenseScores {
+  int32_t num_rows;
+  int32_t num_cols;  // The number of symbols + 1.
+  int32_t row_stride;
+  const float *data;
+};
+
+/**
+   Frame-synchronous, beam-pruned intersection (Viterbi beam search) of an Fsa,
+   e.g. a decoding graph, with DenseScores (every arc of `a` consumes a row),
+   as k2::IntersectDensePruned() does on the device.  The beam is applied on
+   each frame to the forward scores of the states, against the best of them.
+   The output is connected, and its states are ordered by frame (state 0 is the
+   start state and the last state the final state); the scores of its arcs
+   are the sums of those of `a` and of `b`.
+
+   The memory used for the search is kept from one call of GetSizes() to the
+   next, so an object should be reused for many sequences, e.g. one per
+   thread when decoding a batch (see k2::IntersectDensePrunedCpu()).
+ */
+class DensePrunedIntersection {
+ public:
+  // `beam` is the beam for pruning, e.g. 10, or infinity for none.
+  explicit DensePrunedIntersection(float beam) : beam_(beam) {}
+
+  /*
+    Does the search, forgetting the result of any previous call, and outputs
+    the num-states and num-arcs of the output FSA to `fsa_size`.
+     @param [in] a   The FSA to be intersected; every arc consumes a row of
+                     `b`.  Its arcs with label kFinalSymbol must go to its
+                     final state.  Need not be arc-sorted.  Not used after
+                     return.
+     @param [in] b   The scores to intersect with; b.num_rows must be > 0.
+                     Not used after return.
+  */
+  void GetSizes(const Fsa &a, const DenseScores &b,
+                Array2Size<int32_t> *fsa_size);
+
+  /*
+    Outputs the intersection to `c`, which must be initialized with the sizes
+    from GetSizes() (search for 'initialized definition' in class Array2 in
+    array.h); and if non-NULL, to `arc_map_a` the index into a.data of the
+    arc of `a` of each arc of `c`, and to `arc_map_b` the index into b.data of
+    its score (both of size c->size2).  It is empty if no path survived the
+    pruning.
+  */
+  void GetOutput(Fsa *c, int32_t *arc_map_a = nullptr,
+                 int32_t *arc_map_b = nullptr);
+
+ private:
+  // A state of the search; `score` is its forward score.
+  struct StateInfo {
+    int32_t state_a;
+    float score;
+  };
+  // An arc between states of the search; src and dest index states_.
+  struct ArcInfo {
+    int32_t src;
+    int32_t dest;
+    int32_t arc_index_a;
+    int32_t index_b;
+    float weight;
+  };
+
+  float beam_;
+
+  // The states of the search, in order of frame; those of frame t are
+  // frame_begin_[t] <= i < frame_begin_[t + 1].
+  std::vector<StateInfo> states_;
+  std::vector<int32_t> frame_begin_;
+  std::vector<ArcInfo> search_arcs_;  // In order of `src`.
+  // Index in states_ of each state of `a` on the next frame, or -1.
+  std::vector<int32_t> state_map_;
+  // The index in the output of each element of states_, or -1 if it is not
+  // coaccessible.
+  std::vector<int32_t> output_state_;
+
+  std::vector<int32_t> arc_indexes_;  // arc_index of fsa_out
+  std::vector<Arc> arcs_;             // arcs of fsa_out
+  std::vector<int32_t> arc_map_a_;
+  std::vector<int32_t> arc_map_b_;
+};
+
 /**
    Intersection of two weighted FSA's: the same as Intersect(), but it prunes
    based on the sum of two costs.  Note: although these costs are provided per
@@ -22,6 +22,7 @@
 #include "k2/csrc/host/fsa.h"
 #include "k2/csrc/host/fsa_util.h"
 #include "k2/csrc/host/properties.h"
+#include "k2/csrc/host/weights.h"
 
 namespace k2host {
 
@@ -122,4 +123,189 @@ TEST(IntersectTest, Intersect) {
                 ::testing::ElementsAre(0, -1, 1, 2, 1, 1, 2, -1, -1, 3));
   }
 }
+TEST(IntersectTest, LazyIntersection) {
+  // Without pruning, the same as Intersection (the states are numbered in the
+  // same order here).
+  {
+    std::vector<Arc> arcs_a = {{0, 1, 1, 0}, {1, 2, 0, 0}, {1, 3, 1, 0},
+                               {1, 4, 2, 0}, {2, 2, 1, 0}, {2, 3, 1, 0},
+                               {2, 3, 2, 0}, {3, 3, 0, 0}, {3, 4, 1, 0}};
+    FsaCreator fsa_creator_a(arcs_a, 4);
+    const auto &a = fsa_creator_a.GetFsa();
+    std::vector<Arc> arcs_b = {{0, 1, 1, 0}, {1, 3, 1, 0}, {1, 2, 2, 0},
+                               {2, 4, -1, 0}, {2, 3, 1, 0}, {3, 4, -1, 0}};
+    FsaCreator fsa_creator_b(arcs_b, 4);
+    const auto &b = fsa_creator_b.GetFsa();
+
+    Intersection intersection(b, a);
+    Array2Size<int32_t> fsa_size;
+    intersection.GetSizes(&fsa_size);
+    FsaCreator fsa_creator_c(fsa_size);
+    auto &c = fsa_creator_c.GetFsa();
+    EXPECT_TRUE(intersection.GetOutput(&c));
+
+    // `a` has epsilons, so it is the lazy one.
+    LazyFsaFromFsa lazy_a(a);
+    LazyFsaCache cache(&lazy_a, 100);
+    LazyIntersection lazy_intersection(b, &cache, kFloatInfinity);
+    lazy_intersection.GetSizes(&fsa_size);
+    FsaCreator fsa_creator_lazy(fsa_size);
+    auto &lazy_c = fsa_creator_lazy.GetFsa();
+    EXPECT_TRUE(lazy_intersection.GetOutput(&lazy_c));
+    ASSERT_EQ(lazy_c.NumStates(), c.NumStates());
+    ASSERT_EQ(lazy_c.size2, c.size2);
+    for (int32_t i = 0; i <= c.NumStates(); ++i)
+      EXPECT_EQ(lazy_c.indexes[i], c.indexes[i]);
+    for (int32_t i = 0; i != c.size2; ++i) EXPECT_EQ(lazy_c.data[i], c.data[i]);
+
+    // the input that is not lazy must be epsilon-free.
+    LazyFsaFromFsa lazy_b(b);
+    LazyFsaCache cache_b(&lazy_b, 100);
+    LazyIntersection bad_intersection(a, &cache_b, kFloatInfinity);
+    bad_intersection.GetSizes(&fsa_size);
+    EXPECT_FALSE(bad_intersection.GetOutput(&c));
+  }
+
+  // Pruning: the path with label 2 is outside the beam.
+  {
+    std::vector<Arc> arcs_a = {
+        {0, 1, 1, 0}, {0, 2, 2, -20}, {1, 3, -1, 0}, {2, 3, -1, 0}};
+    FsaCreator fsa_creator_a(arcs_a, 3);
+    const auto &a = fsa_creator_a.GetFsa();
+    std::vector<Arc> arcs_b = {{0, 1, -1, 0}, {0, 0, 1, 0}, {0, 0, 2, 0}};
+    FsaCreator fsa_creator_b(arcs_b, 1);
+    LazyFsaFromFsa lazy_b(fsa_creator_b.GetFsa());
+    LazyFsaCache cache(&lazy_b, 100);
+
+    LazyIntersection intersection(a, &cache, kFloatInfinity);
+    Array2Size<int32_t> fsa_size;
+    intersection.GetSizes(&fsa_size);
+    EXPECT_EQ(fsa_size.size1, 4);
+    EXPECT_EQ(fsa_size.size2, 4);
+
+    LazyIntersection pruned_intersection(a, &cache, 10);
+    pruned_intersection.GetSizes(&fsa_size);
+    FsaCreator fsa_creator_c(fsa_size);
+    auto &c = fsa_creator_c.GetFsa();
+    std::vector<int32_t> arc_map_a(fsa_size.size2);
+    EXPECT_TRUE(pruned_intersection.GetOutput(&c, arc_map_a.data()));
+    std::vector<int32_t> arc_indexes(c.indexes, c.indexes + c.size1 + 1);
+    EXPECT_THAT(arc_indexes, ::testing::ElementsAre(0, 1, 2, 2));
+    std::vector<Arc> arcs(c.data, c.data + c.size2);
+    std::vector<Arc> arcs_c = {{0, 1, 1, 0}, {1, 2, -1, 0}};
+    ASSERT_EQ(arcs.size(), arcs_c.size());
+    for (std::size_t i = 0; i != arcs_c.size(); ++i)
+      EXPECT_EQ(arcs[i], arcs_c[i]);
+    EXPECT_THAT(arc_map_a, ::testing::ElementsAre(0, 2));
+    // b has one state with arcs, which was expanded once for both.
+    EXPECT_EQ(cache.NumExpansions(), 1);
+  }
+
+  // Epsilons (backoff) in the lazy FSA, with a cache of one state shared by
+  // two intersections.
+  {
+    std::vector<Arc> arcs_b = {
+        {0, 1, 0, -1}, {1, 2, -1, 0}, {1, 1, 5, -2}, {1, 1, 6, -3}};
+    FsaCreator fsa_creator_b(arcs_b, 2);
+    LazyFsaFromFsa lazy_b(fsa_creator_b.GetFsa());
+    LazyFsaCache cache(&lazy_b, 1);
+
+    std::vector<Arc> arcs_a = {{0, 1, 5, 0}, {1, 2, -1, 0}};
+    FsaCreator fsa_creator_a(arcs_a, 2);
+    const auto &a = fsa_creator_a.GetFsa();
+    LazyIntersection intersection(a, &cache, kFloatInfinity);
+    Array2Size<int32_t> fsa_size;
+    intersection.GetSizes(&fsa_size);
+    FsaCreator fsa_creator_c(fsa_size);
+    auto &c = fsa_creator_c.GetFsa();
+    std::vector<int32_t> arc_map_a(fsa_size.size2);
+    EXPECT_TRUE(intersection.GetOutput(&c, arc_map_a.data()));
+    std::vector<Arc> arcs(c.data, c.data + c.size2);
+    std::vector<Arc> arcs_c = {{0, 1, 0, -1}, {1, 2, 5, -2}, {2, 3, -1, 0}};
+    ASSERT_EQ(arcs.size(), arcs_c.size());
+    for (std::size_t i = 0; i != arcs_c.size(); ++i)
+      EXPECT_EQ(arcs[i], arcs_c[i]);
+    EXPECT_THAT(arc_map_a, ::testing::ElementsAre(-1, 0, 1));
+    EXPECT_EQ(cache.NumExpansions(), 2);
+    EXPECT_EQ(cache.NumCachedStates(), 1);
+
+    // state 0 of b was dropped from the cache, so both states are expanded
+    // again (state 1 only once, as it is reached twice in a row).
+    std::vector<Arc> arcs_a2 = {{0, 1, 6, 0}, {1, 2, -1, 0}};
+    FsaCreator fsa_creator_a2(arcs_a2, 2);
+    LazyIntersection intersection2(fsa_creator_a2.GetFsa(), &cache,
+                                   kFloatInfinity);
+    intersection2.GetSizes(&fsa_size);
+    EXPECT_EQ(fsa_size.size2, 3);
+    EXPECT_EQ(cache.NumExpansions(), 4);
+  }
+}
+
+TEST(IntersectTest, DensePrunedIntersection) {
+  const float neg_inf = -kFloatInfinity;
+  // One object for all the cases, as it's meant to be reused.
+  DensePrunedIntersection intersection(10);
+  {
+    // The path 0 -> 1 -> 1 can't reach the final state.
+    std::vector<Arc> arcs_a = {{0, 1, 1, 0.5}, {0, 1, 2, 0}, {1, 1, 1, 0},
+                               {1, 2, 2, 0}, {2, 3, -1, 0}};
+    FsaCreator fsa_creator_a(arcs_a, 3);
+    const auto &a = fsa_creator_a.GetFsa();
+    std::vector<float> scores = {neg_inf, 0,       -1,      -2,
+                                 neg_inf, 0,       -3,      -1,
+                                 0,       neg_inf, neg_inf, neg_inf};
+    DenseScores b{3, 4, 4, scores.data()};
+    Array2Size<int32_t> fsa_size;
+    intersection.GetSizes(a, b, &fsa_size);
+    FsaCreator fsa_creator_c(fsa_size);
+    auto &c = fsa_creator_c.GetFsa();
+    std::vector<int32_t> arc_map_a(fsa_size.size2), arc_map_b(fsa_size.size2);
+    intersection.GetOutput(&c, arc_map_a.data(), arc_map_b.data());
+    std::vector<int32_t> arc_indexes(c.indexes, c.indexes + c.size1 + 1);
+    EXPECT_THAT(arc_indexes, ::testing::ElementsAre(0, 2, 3, 4, 4));
+    std::vector<Arc> arcs(c.data, c.data + c.size2);
+    std::vector<Arc> arcs_c = {
+        {0, 1, 1, -0.5}, {0, 1, 2, -2}, {1, 2, 2, -1}, {2, 3, -1, 0}};
+    ASSERT_EQ(arcs.size(), arcs_c.size());
+    for (std::size_t i = 0; i != arcs_c.size(); ++i)
+      EXPECT_EQ(arcs[i], arcs_c[i]);
+    EXPECT_THAT(arc_map_a, ::testing::ElementsAre(0, 1, 3, 4));
+    EXPECT_THAT(arc_map_b, ::testing::ElementsAre(2, 3, 7, 8));
+  }
+
+  std::vector<Arc> arcs_a = {{0, 1, 1, 0}, {0, 2, 2, 0}, {1, 3, 1, 0},
+                             {2, 3, 1, 0}, {3, 4, -1, 0}};
+  FsaCreator fsa_creator_a(arcs_a, 4);
+  const auto &a = fsa_creator_a.GetFsa();
+  std::vector<float> scores = {neg_inf, 0,       0,       -2,
+                               neg_inf, 0,       0,       0,
+                               0,       neg_inf, neg_inf, neg_inf};
+  {
+    Array2Size<int32_t> fsa_size;
+    intersection.GetSizes(a, DenseScores{3, 4, 4, scores.data()}, &fsa_size);
+    EXPECT_EQ(fsa_size.size1, 5);
+    EXPECT_EQ(fsa_size.size2, 5);
+
+    // State 2 of `a` is outside the beam on frame 1.
+    DensePrunedIntersection pruned_intersection(1);
+    pruned_intersection.GetSizes(a, DenseScores{3, 4, 4, scores.data()},
+                                 &fsa_size);
+    FsaCreator fsa_creator_c(fsa_size);
+    auto &c = fsa_creator_c.GetFsa();
+    std::vector<int32_t> arc_map_a(fsa_size.size2);
+    pruned_intersection.GetOutput(&c, arc_map_a.data());
+    std::vector<int32_t> arc_indexes(c.indexes, c.indexes + c.size1 + 1);
+    EXPECT_THAT(arc_indexes, ::testing::ElementsAre(0, 1, 2, 3, 3));
+    EXPECT_THAT(arc_map_a, ::testing::ElementsAre(0, 2, 4));
+  }
+  {
+    // With one frame, no path reaches the final state.
+    std::vector<float> scores1 = {neg_inf, 0, 0, -2, 0, neg_inf, neg_inf,
+                                  neg_inf};
+    Array2Size<int32_t> fsa_size;
+    intersection.GetSizes(a, DenseScores{2, 4, 4, scores1.data()}, &fsa_size);
+    EXPECT_EQ(fsa_size.size1, 0);
+    EXPECT_EQ(fsa_size.size2, 0);
+  }
+}
 }  // namespace k2host
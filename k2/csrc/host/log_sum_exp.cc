@@ -0,0 +1,332 @@
+/**
+ * @brief
+ * log_sum_exp
+ *
+ * @copyright
+ * Copyright (c)  2026  agent (agent@local)
+ *
+ * @copyright
+ * See LICENSE for clarification regarding multiple authors
+ */
+
+#include "k2/csrc/host/log_sum_exp.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+// The vector code is compiled with target attributes, so the rest of the
+// library doesn't need -mavx2 etc., and is only run if the CPU has the
+// instructions.
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define K2_HOST_X86_SIMD 1
+#include <immintrin.h>
+#else
+#define K2_HOST_X86_SIMD 0
+#endif
+
+namespace k2host {
+
+namespace {
+
+// exp() of values below these is taken as 0; the terms are relative to the
+// max, i.e. exp(0) == 1, so they don't make a difference.
+constexpr double kMinExpArgDouble = -708.0;
+constexpr float kMinExpArgFloat = -87.0f;
+
+// The range reduction is exp(x) = 2^k * exp(r), with k = round(x / log(2)),
+// so |r| <= log(2) / 2, and log(2) split into a part with few bits and the
+// rest, so k * kLn2Hi is exact (as in Cephes).
+constexpr double kLog2e = 1.4426950408889634;
+constexpr double kLn2HiDouble = 0.693145751953125;
+constexpr double kLn2LoDouble = 1.42860682030941723212e-6;
+constexpr float kLn2HiFloat = 0.693359375f;
+constexpr float kLn2LoFloat = -2.12194440e-4f;
+
+// exp(r) for |r| <= log(2) / 2 is approximated by the Taylor series up to
+// r^12 for double (the remainder is below 2e-16 relative) and r^7 for float
+// (below 6e-9); the coefficients are 1 / i!, highest first.
+constexpr int32_t kNumCoeffsDouble = 13;
+const double kExpCoeffsDouble[kNumCoeffsDouble] = {
+    1.0 / 479001600, 1.0 / 39916800, 1.0 / 3628800, 1.0 / 362880,
+    1.0 / 40320,     1.0 / 5040,     1.0 / 720,     1.0 / 120,
+    1.0 / 24,        1.0 / 6,        0.5,           1.0,
+    1.0};
+constexpr int32_t kNumCoeffsFloat = 8;
+const float kExpCoeffsFloat[kNumCoeffsFloat] = {
+    1.0f / 5040, 1.0f / 720, 1.0f / 120, 1.0f / 24, 1.0f / 6, 0.5f, 1.0f,
+    1.0f};
+
+template <typename Real>
+Real ScalarLogSumExp(const Real *x, int32_t n) {
+  Real max_value = -std::numeric_limits<Real>::infinity();
+  for (int32_t i = 0; i != n; ++i) max_value = std::max(max_value, x[i]);
+  if (max_value == -std::numeric_limits<Real>::infinity()) return max_value;
+  Real sum = 0;
+  for (int32_t i = 0; i != n; ++i) sum += std::exp(x[i] - max_value);
+  return max_value + std::log(sum);
+}
+
+#if K2_HOST_X86_SIMD
+
+__attribute__((target("avx2,fma"))) __m256d Exp256(__m256d x) {
+  __m256d y = _mm256_max_pd(x, _mm256_set1_pd(kMinExpArgDouble)),
+          k = _mm256_round_pd(_mm256_mul_pd(y, _mm256_set1_pd(kLog2e)),
+                              _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC),
+          r = _mm256_fnmadd_pd(k, _mm256_set1_pd(kLn2HiDouble), y);
+  r = _mm256_fnmadd_pd(k, _mm256_set1_pd(kLn2LoDouble), r);
+  __m256d p = _mm256_set1_pd(kExpCoeffsDouble[0]);
+  for (int32_t i = 1; i != kNumCoeffsDouble; ++i)
+    p = _mm256_fmadd_pd(p, r, _mm256_set1_pd(kExpCoeffsDouble[i]));
+  // 2^k, by adding 2^52 + 2^51 so k ends up in the low bits of the mantissa,
+  // then moving it to the exponent.
+  const __m256d magic = _mm256_set1_pd(6755399441055744.0);
+  __m256i bits = _mm256_add_epi64(
+      _mm256_castpd_si256(_mm256_add_pd(k, magic)),
+      _mm256_set1_epi64x(1023 - 0x4338000000000000LL));
+  __m256d scale = _mm256_castsi256_pd(_mm256_slli_epi64(bits, 52));
+  __m256d keep = _mm256_cmp_pd(x, _mm256_set1_pd(kMinExpArgDouble),
+                               _CMP_GE_OQ);
+  return _mm256_and_pd(_mm256_mul_pd(p, scale), keep);
+}
+
+__attribute__((target("avx2,fma"))) __m256 Exp256(__m256 x) {
+  __m256 y = _mm256_max_ps(x, _mm256_set1_ps(kMinExpArgFloat)),
+         k = _mm256_round_ps(
+             _mm256_mul_ps(y, _mm256_set1_ps(static_cast<float>(kLog2e))),
+             _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC),
+         r = _mm256_fnmadd_ps(k, _mm256_set1_ps(kLn2HiFloat), y);
+  r = _mm256_fnmadd_ps(k, _mm256_set1_ps(kLn2LoFloat), r);
+  __m256 p = _mm256_set1_ps(kExpCoeffsFloat[0]);
+  for (int32_t i = 1; i != kNumCoeffsFloat; ++i)
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(kExpCoeffsFloat[i]));
+  __m256i bits =
+      _mm256_add_epi32(_mm256_cvtps_epi32(k), _mm256_set1_epi32(127));
+  __m256 scale = _mm256_castsi256_ps(_mm256_slli_epi32(bits, 23));
+  __m256 keep = _mm256_cmp_ps(x, _mm256_set1_ps(kMinExpArgFloat), _CMP_GE_OQ);
+  return _mm256_and_ps(_mm256_mul_ps(p, scale), keep);
+}
+
+// The vector functions below don't call std::exp() or std::log(), which are
+// left to VectorLogSumExp(): with the upper halves of the AVX registers set,
+// SSE code such as that in libm runs many times slower.  The compiler clears
+// them (with vzeroupper) when returning from these functions only when
+// optimizing (-O2), so VectorLogSumExp() calls ClearUpperHalves() after them.
+//
+// Avx2Max() returns the max of x[0..n-1]; Avx2SumExp() returns the sum of
+// exp(x[i] - max_value) for the first multiple of 4 (double) or 8 (float)
+// elements, i.e. without the last ones.
+__attribute__((target("avx"), noinline)) void ClearUpperHalves() {
+  _mm256_zeroupper();
+}
+
+__attribute__((target("avx2,fma"))) double Avx2Max(const double *x,
+                                                   int32_t n) {
+  int32_t num_blocks = n / 4;
+  __m256d max_values = _mm256_set1_pd(-std::numeric_limits<double>::infinity());
+  for (int32_t i = 0; i != num_blocks; ++i)
+    max_values = _mm256_max_pd(max_values, _mm256_loadu_pd(x + 4 * i));
+  double lanes[4];
+  _mm256_storeu_pd(lanes, max_values);
+  double max_value = std::max(std::max(lanes[0], lanes[1]),
+                              std::max(lanes[2], lanes[3]));
+  for (int32_t i = 4 * num_blocks; i != n; ++i)
+    max_value = std::max(max_value, x[i]);
+  return max_value;
+}
+
+__attribute__((target("avx2,fma"))) double Avx2SumExp(const double *x,
+                                                      int32_t n,
+                                                      double max_value) {
+  int32_t num_blocks = n / 4;
+  __m256d offset = _mm256_set1_pd(max_value), sums = _mm256_setzero_pd();
+  for (int32_t i = 0; i != num_blocks; ++i)
+    sums = _mm256_add_pd(
+        sums, Exp256(_mm256_sub_pd(_mm256_loadu_pd(x + 4 * i), offset)));
+  double lanes[4];
+  _mm256_storeu_pd(lanes, sums);
+  return (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+}
+
+__attribute__((target("avx2,fma"))) float Avx2Max(const float *x,
+                                                  int32_t n) {
+  int32_t num_blocks = n / 8;
+  __m256 max_values = _mm256_set1_ps(-std::numeric_limits<float>::infinity());
+  for (int32_t i = 0; i != num_blocks; ++i)
+    max_values = _mm256_max_ps(max_values, _mm256_loadu_ps(x + 8 * i));
+  float lanes[8];
+  _mm256_storeu_ps(lanes, max_values);
+  float max_value = *std::max_element(lanes, lanes + 8);
+  for (int32_t i = 8 * num_blocks; i != n; ++i)
+    max_value = std::max(max_value, x[i]);
+  return max_value;
+}
+
+__attribute__((target("avx2,fma"))) float Avx2SumExp(const float *x,
+                                                     int32_t n,
+                                                     float max_value) {
+  int32_t num_blocks = n / 8;
+  __m256 offset = _mm256_set1_ps(max_value), sums = _mm256_setzero_ps();
+  for (int32_t i = 0; i != num_blocks; ++i)
+    sums = _mm256_add_ps(
+        sums, Exp256(_mm256_sub_ps(_mm256_loadu_ps(x + 8 * i), offset)));
+  float lanes[8];
+  _mm256_storeu_ps(lanes, sums);
+  return ((lanes[0] + lanes[1]) + (lanes[2] + lanes[3])) +
+         ((lanes[4] + lanes[5]) + (lanes[6] + lanes[7]));
+}
+
+// With AVX-512, _mm512_scalef_pd() does the multiplication by 2^k.
+__attribute__((target("avx512f"))) __m512d Exp512(__m512d x) {
+  __m512d y = _mm512_max_pd(x, _mm512_set1_pd(kMinExpArgDouble)),
+          k = _mm512_roundscale_pd(
+              _mm512_mul_pd(y, _mm512_set1_pd(kLog2e)),
+              _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC),
+          r = _mm512_fnmadd_pd(k, _mm512_set1_pd(kLn2HiDouble), y);
+  r = _mm512_fnmadd_pd(k, _mm512_set1_pd(kLn2LoDouble), r);
+  __m512d p = _mm512_set1_pd(kExpCoeffsDouble[0]);
+  for (int32_t i = 1; i != kNumCoeffsDouble; ++i)
+    p = _mm512_fmadd_pd(p, r, _mm512_set1_pd(kExpCoeffsDouble[i]));
+  __mmask8 keep =
+      _mm512_cmp_pd_mask(x, _mm512_set1_pd(kMinExpArgDouble), _CMP_GE_OQ);
+  return _mm512_maskz_mov_pd(keep, _mm512_scalef_pd(p, k));
+}
+
+__attribute__((target("avx512f"))) __m512 Exp512(__m512 x) {
+  __m512 y = _mm512_max_ps(x, _mm512_set1_ps(kMinExpArgFloat)),
+         k = _mm512_roundscale_ps(
+             _mm512_mul_ps(y, _mm512_set1_ps(static_cast<float>(kLog2e))),
+             _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC),
+         r = _mm512_fnmadd_ps(k, _mm512_set1_ps(kLn2HiFloat), y);
+  r = _mm512_fnmadd_ps(k, _mm512_set1_ps(kLn2LoFloat), r);
+  __m512 p = _mm512_set1_ps(kExpCoeffsFloat[0]);
+  for (int32_t i = 1; i != kNumCoeffsFloat; ++i)
+    p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(kExpCoeffsFloat[i]));
+  __mmask16 keep =
+      _mm512_cmp_ps_mask(x, _mm512_set1_ps(kMinExpArgFloat), _CMP_GE_OQ);
+  return _mm512_maskz_mov_ps(keep, _mm512_scalef_ps(p, k));
+}
+
+// As Avx2Max() and Avx2SumExp(), but the last elements are handled with
+// masked loads, so Avx512SumExp() sums over all of x[0..n-1].
+__attribute__((target("avx512f"))) double Avx512Max(const double *x,
+                                                    int32_t n) {
+  const __m512d minus_inf =
+      _mm512_set1_pd(-std::numeric_limits<double>::infinity());
+  __m512d max_values = minus_inf;
+  for (int32_t i = 0; i < n; i += 8) {
+    __mmask8 mask = static_cast<__mmask8>(n - i >= 8 ? 0xff
+                                                     : (1u << (n - i)) - 1);
+    max_values =
+        _mm512_max_pd(max_values, _mm512_mask_loadu_pd(minus_inf, mask, x + i));
+  }
+  return _mm512_reduce_max_pd(max_values);
+}
+
+__attribute__((target("avx512f"))) double Avx512SumExp(const double *x,
+                                                       int32_t n,
+                                                       double max_value) {
+  const __m512d minus_inf =
+      _mm512_set1_pd(-std::numeric_limits<double>::infinity());
+  __m512d offset = _mm512_set1_pd(max_value), sums = _mm512_setzero_pd();
+  for (int32_t i = 0; i < n; i += 8) {
+    __mmask8 mask = static_cast<__mmask8>(n - i >= 8 ? 0xff
+                                                     : (1u << (n - i)) - 1);
+    __m512d values = _mm512_mask_loadu_pd(minus_inf, mask, x + i);
+    sums = _mm512_add_pd(sums, Exp512(_mm512_sub_pd(values, offset)));
+  }
+  return _mm512_reduce_add_pd(sums);
+}
+
+__attribute__((target("avx512f"))) float Avx512Max(const float *x,
+                                                   int32_t n) {
+  const __m512 minus_inf =
+      _mm512_set1_ps(-std::numeric_limits<float>::infinity());
+  __m512 max_values = minus_inf;
+  for (int32_t i = 0; i < n; i += 16) {
+    __mmask16 mask = static_cast<__mmask16>(
+        n - i >= 16 ? 0xffff : (1u << (n - i)) - 1);
+    max_values =
+        _mm512_max_ps(max_values, _mm512_mask_loadu_ps(minus_inf, mask, x + i));
+  }
+  return _mm512_reduce_max_ps(max_values);
+}
+
+__attribute__((target("avx512f"))) float Avx512SumExp(const float *x,
+                                                      int32_t n,
+                                                      float max_value) {
+  const __m512 minus_inf =
+      _mm512_set1_ps(-std::numeric_limits<float>::infinity());
+  __m512 offset = _mm512_set1_ps(max_value), sums = _mm512_setzero_ps();
+  for (int32_t i = 0; i < n; i += 16) {
+    __mmask16 mask = static_cast<__mmask16>(
+        n - i >= 16 ? 0xffff : (1u << (n - i)) - 1);
+    __m512 values = _mm512_mask_loadu_ps(minus_inf, mask, x + i);
+    sums = _mm512_add_ps(sums, Exp512(_mm512_sub_ps(values, offset)));
+  }
+  return _mm512_reduce_add_ps(sums);
+}
+
+#endif  // K2_HOST_X86_SIMD
+
+int32_t GetVectorBits() {
+#if K2_HOST_X86_SIMD
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f")) return 512;
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+    return 256;
+#endif
+  return 0;
+}
+
+// Below this many elements, the scalar code is faster.
+constexpr int32_t kMinVectorSize = 4;
+
+int32_t VectorBits() {
+  static const int32_t vector_bits = GetVectorBits();
+  return vector_bits;
+}
+
+template <typename Real>
+Real VectorLogSumExp(const Real *x, int32_t n) {
+  if (n == 1) return x[0];
+#if K2_HOST_X86_SIMD
+  int32_t vector_bits = VectorBits();
+  if (n >= kMinVectorSize && vector_bits != 0) {
+    Real max_value, sum = 0;
+    if (vector_bits == 512) {
+      max_value = Avx512Max(x, n);
+      if (max_value != -std::numeric_limits<Real>::infinity())
+        sum = Avx512SumExp(x, n, max_value);
+      ClearUpperHalves();
+      if (max_value == -std::numeric_limits<Real>::infinity())
+        return max_value;
+    } else {
+      max_value = Avx2Max(x, n);
+      if (max_value != -std::numeric_limits<Real>::infinity())
+        sum = Avx2SumExp(x, n, max_value);
+      ClearUpperHalves();
+      if (max_value == -std::numeric_limits<Real>::infinity())
+        return max_value;
+      // The elements after the last full vector.
+      int32_t num_lanes = 32 / sizeof(Real);
+      for (int32_t i = n - n % num_lanes; i != n; ++i)
+        sum += std::exp(x[i] - max_value);
+    }
+    return max_value + std::log(sum);
+  }
+#endif
+  return ScalarLogSumExp(x, n);
+}
+
+}  // namespace
+
+int32_t LogSumExpVectorBits() { return VectorBits(); }
+
+double LogSumExp(const double *x, int32_t n) {
+  return VectorLogSumExp(x, n);
+}
+
+float LogSumExp(const float *x, int32_t n) { return VectorLogSumExp(x, n); }
+
+}  // namespace k2host
@@ -0,0 +1,48 @@
+/**
+ * @brief
+ * log_sum_exp
+ *
+ * @copyright
+ * Copyright (c)  2026  agent (agent@local)
+ *
+ * @copyright
+ * See LICENSE for clarification regarding multiple authors
+ */
+
+#ifndef K2_CSRC_HOST_LOG_SUM_EXP_H_
+#define K2_CSRC_HOST_LOG_SUM_EXP_H_
+
+#include <cstdint>
+
+namespace k2host {
+
+/*
+  Returns log(exp(x[0]) + exp(x[1]) + ... + exp(x[n-1])), i.e. the sum of
+  x[0..n-1] in the log semiring, or -infinity if n == 0 or all of them are
+  -infinity.  It subtracts the max and sums the exponentials, so unlike
+  repeated LogAdd() it computes one log per call.
+
+  On x86-64 CPUs with AVX-512 or AVX2 (checked at run time) the exponentials
+  are computed with vector instructions, 8 doubles or 16 floats at a time
+  with AVX-512 (4 or 8 with AVX2), using a polynomial approximation of exp()
+  that is accurate to a few units in the last place.  Apart from the rounding
+  of the result itself, the result is within 5e-15 (double) or 5e-7 (float)
+  of the exact value, relative to 1 + |result|, as is that of the scalar code
+  used otherwise.
+
+    @param [in] x  The values to add; may contain -infinity but not NaN or
+                   +infinity.
+    @param [in] n  The number of values; n >= 0
+ */
+double LogSumExp(const double *x, int32_t n);
+float LogSumExp(const float *x, int32_t n);
+
+/*
+  Returns the width, in bits, of the vectors used by LogSumExp() on this CPU:
+  512 with AVX-512, 256 with AVX2, else 0 for the scalar code.  For tests.
+ */
+int32_t LogSumExpVectorBits();
+
+}  // namespace k2host
+
+#endif  // K2_CSRC_HOST_LOG_SUM_EXP_H_
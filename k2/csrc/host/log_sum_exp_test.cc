@@ -0,0 +1,70 @@
+/**
+ * @brief
+ * log_sum_exp_test
+ *
+ * @copyright
+ * Copyright (c)  2026  agent (agent@local)
+ *
+ * @copyright
+ * See LICENSE for clarification regarding multiple authors
+ */
+
+#include "k2/csrc/host/log_sum_exp.h"
+
+#include <gtest/gtest.h>
+
+#include <cmath>
+#include <limits>
+#include <random>
+#include <vector>
+
+namespace k2host {
+
+// Computes the log-sum in long double, as the reference.
+template <typename Real>
+static long double ReferenceLogSumExp(const std::vector<Real> &x) {
+  long double max_value = -std::numeric_limits<long double>::infinity();
+  for (Real v : x) max_value = std::max<long double>(max_value, v);
+  if (std::isinf(max_value)) return max_value;
+  long double sum = 0;
+  for (Real v : x) sum += std::exp(static_cast<long double>(v) - max_value);
+  return max_value + std::log(sum);
+}
+
+template <typename Real>
+static void TestLogSumExp(double tolerance) {
+  const Real inf = std::numeric_limits<Real>::infinity();
+  EXPECT_EQ(LogSumExp(static_cast<const Real *>(nullptr), 0), -inf);
+  std::vector<Real> all_inf(20, -inf);
+  EXPECT_EQ(LogSumExp(all_inf.data(), 20), -inf);
+
+  std::mt19937 rng(0);
+  std::uniform_real_distribution<Real> dist(-50, 50);
+  // Sizes around the vector widths, to test the last elements.
+  for (int32_t n : {1, 2, 3, 4, 5, 7, 8, 9, 15, 16, 17, 31, 33, 100, 1000}) {
+    for (int32_t iter = 0; iter != 20; ++iter) {
+      std::vector<Real> x(n);
+      for (Real &v : x) v = dist(rng);
+      // Some -infinity's, and values too small to make a difference.
+      if (n > 2) {
+        x[rng() % n] = -inf;
+        x[rng() % n] = -1000;
+      }
+      long double expected = ReferenceLogSumExp(x);
+      Real ans = LogSumExp(x.data(), n);
+      // The error bound is relative to the sum, i.e. absolute for the log.
+      EXPECT_NEAR(ans, expected, tolerance * (1 + std::fabs(expected)))
+          << "n = " << n;
+    }
+  }
+}
+
+TEST(LogSumExp, Double) {
+  int32_t vector_bits = LogSumExpVectorBits();
+  EXPECT_TRUE(vector_bits == 0 || vector_bits == 256 || vector_bits == 512);
+  TestLogSumExp<double>(5e-15);
+}
+
+TEST(LogSumExp, Float) { TestLogSumExp<float>(5e-7); }
+
+}  // namespace k2host
@@ -0,0 +1,165 @@
+/**
+ * @brief
+ * minimize
+ *
+ * @copyright
+ * Copyright (c)  2026  agent (agent@local)
+ *
+ * @copyright
+ * See LICENSE for clarification regarding multiple authors
+ */
+
+#include "k2/csrc/host/minimize.h"
+
+#include <algorithm>
+#include <unordered_map>
+#include <vector>
+
+#include "k2/csrc/host/fsa.h"
+#include "k2/csrc/host/properties.h"
+#include "k2/csrc/host/util.h"
+
+namespace k2host {
+
+namespace {
+
+// The signatures of the states are hashed in blocks of this many states, so
+// that ParallelFor() hands out tasks of a reasonable size.
+constexpr int32_t kHashBlockSize = 1024;
+
+}  // namespace
+
+int32_t MinimizeCore(const Fsa &fsa, int32_t num_threads,
+                     std::vector<int32_t> *state_class) {
+  K2_CHECK_NE(state_class, nullptr);
+  state_class->clear();
+  if (IsEmpty(fsa)) return 0;
+  K2_CHECK(IsDeterministic(fsa));
+  K2_CHECK(IsArcSorted(fsa));
+
+  int32_t num_states = fsa.NumStates();
+  const Arc *arcs = fsa.data;
+  const int32_t *indexes = fsa.indexes;
+  // the classes of the current round, and of the next one
+  std::vector<int32_t> &cur_class = *state_class;
+  std::vector<int32_t> next_class(num_states);
+  cur_class.assign(num_states, 0);
+  cur_class[fsa.FinalState()] = 1;
+  int32_t num_classes = (num_states > 1 ? 2 : 1);
+
+  std::vector<std::size_t> hashes(num_states);
+  int32_t num_blocks = (num_states + kHashBlockSize - 1) / kHashBlockSize;
+  auto state_hash = [&hashes](int32_t state) { return hashes[state]; };
+  // returns true if the two states have the same signature
+  auto state_equal = [&cur_class, arcs, indexes](int32_t a, int32_t b) {
+    if (cur_class[a] != cur_class[b]) return false;
+    int32_t a_begin = indexes[a], a_end = indexes[a + 1],
+            b_begin = indexes[b], b_end = indexes[b + 1];
+    if (a_end - a_begin != b_end - b_begin) return false;
+    for (; a_begin != a_end; ++a_begin, ++b_begin) {
+      const Arc &arc_a = arcs[a_begin], &arc_b = arcs[b_begin];
+      if (arc_a.label != arc_b.label || arc_a.weight != arc_b.weight ||
+          cur_class[arc_a.dest_state] != cur_class[arc_b.dest_state])
+        return false;
+    }
+    return true;
+  };
+  while (true) {
+    ParallelFor(num_blocks, num_threads, [&](int32_t block) {
+      int32_t begin = block * kHashBlockSize,
+              end = std::min(begin + kHashBlockSize, num_states);
+      for (int32_t state = begin; state != end; ++state) {
+        std::size_t hash = 0;
+        hash_combine(&hash, cur_class[state]);
+        for (int32_t a = indexes[state]; a != indexes[state + 1]; ++a) {
+          const Arc &arc = arcs[a];
+          hash_combine(&hash, arc.label);
+          hash_combine(&hash, arc.weight);
+          hash_combine(&hash, cur_class[arc.dest_state]);
+        }
+        hashes[state] = hash;
+      }
+    });
+
+    // Maps from the first state with each signature to the new class.
+    std::unordered_map<int32_t, int32_t, decltype(state_hash),
+                       decltype(state_equal)>
+        classes(num_states, state_hash, state_equal);
+    for (int32_t state = 0; state != num_states; ++state) {
+      auto ret = classes.emplace(state, static_cast<int32_t>(classes.size()));
+      next_class[state] = ret.first->second;
+    }
+    // The signature includes the current class, so the classes can only be
+    // split; if their number is unchanged, so is the partition.
+    int32_t new_num_classes = static_cast<int32_t>(classes.size());
+    cur_class.swap(next_class);
+    if (new_num_classes == num_classes) break;
+    num_classes = new_num_classes;
+  }
+  return num_classes;
+}
+
+void Minimizer::GetSizes(Array2Size<int32_t> *fsa_size) {
+  K2_CHECK_NE(fsa_size, nullptr);
+  fsa_size->size1 = fsa_size->size2 = 0;
+  arc_indexes_.clear();
+  arcs_.clear();
+  arc_map_.clear();
+
+  std::vector<int32_t> state_class;
+  int32_t num_classes = MinimizeCore(fsa_in_, num_threads_, &state_class);
+  if (num_classes == 0) return;
+
+  // Each class is represented by its largest state; ordering the classes by
+  // it keeps top-sorted input top-sorted (the largest state of the class an
+  // arc enters is greater than the state it leaves).  The class of the start
+  // state comes first in any case, and the final state is alone in the last
+  // class.
+  int32_t num_states = fsa_in_.NumStates();
+  std::vector<int32_t> class_state(num_classes);
+  for (int32_t state = 0; state != num_states; ++state)
+    class_state[state_class[state]] = state;
+  std::vector<int32_t> order(num_classes);
+  for (int32_t i = 0; i != num_classes; ++i) order[i] = i;
+  std::sort(order.begin() + 1, order.end(),
+            [&class_state](int32_t a, int32_t b) {
+              return class_state[a] < class_state[b];
+            });
+  std::vector<int32_t> class_to_out(num_classes);
+  for (int32_t i = 0; i != num_classes; ++i) class_to_out[order[i]] = i;
+
+  arc_indexes_.resize(num_classes + 1);
+  const int32_t arc_begin_index = fsa_in_.indexes[0];
+  for (int32_t i = 0; i != num_classes; ++i) {
+    int32_t state_in = class_state[order[i]];
+    arc_indexes_[i] = static_cast<int32_t>(arcs_.size());
+    for (int32_t a = fsa_in_.indexes[state_in];
+         a != fsa_in_.indexes[state_in + 1]; ++a) {
+      Arc arc = fsa_in_.data[a];
+      arc.src_state = i;
+      arc.dest_state = class_to_out[state_class[arc.dest_state]];
+      arcs_.push_back(arc);
+      arc_map_.push_back(a - arc_begin_index);
+    }
+  }
+  arc_indexes_[num_classes] = static_cast<int32_t>(arcs_.size());
+
+  fsa_size->size1 = num_classes;
+  fsa_size->size2 = static_cast<int32_t>(arcs_.size());
+}
+
+void Minimizer::GetOutput(Fsa *fsa_out, int32_t *arc_map /*= nullptr*/) {
+  if (arc_indexes_.empty()) return;
+
+  // output FSA
+  K2_CHECK_NE(fsa_out, nullptr);
+  K2_CHECK_EQ(arc_indexes_.size(), fsa_out->size1 + 1);
+  std::copy(arc_indexes_.begin(), arc_indexes_.end(), fsa_out->indexes);
+  K2_CHECK_EQ(arcs_.size(), fsa_out->size2);
+  std::copy(arcs_.begin(), arcs_.end(), fsa_out->data);
+
+  // output arc map
+  if (arc_map != nullptr) std::copy(arc_map_.begin(), arc_map_.end(), arc_map);
+}
+
+}  // namespace k2host
@@ -0,0 +1,107 @@
+/**
+ * @brief
+ * minimize
+ *
+ * @copyright
+ * Copyright (c)  2026  agent (agent@local)
+ *
+ * @copyright
+ * See LICENSE for clarification regarding multiple authors
+ */
+
+#ifndef K2_CSRC_HOST_MINIMIZE_H_
+#define K2_CSRC_HOST_MINIMIZE_H_
+
+#include <vector>
+
+#include "k2/csrc/host/fsa.h"
+
+namespace k2host {
+
+/*
+  Minimizes a deterministic acceptor, i.e. merges the states that accept the
+  same (weighted) suffixes.  This is done by partition refinement (Moore's
+  algorithm): we start from two classes, the final state and the rest, and
+  in each round split the classes by the signature of their states, i.e.
+  the class of the state and the label, weight and destination class of
+  each of its arcs, until the number of classes stops changing.  The
+  signatures are hashed in parallel; the number of rounds is at most the
+  length of the longest path for acyclic input.
+
+  Two states are only merged if their arcs have exactly the same weights,
+  so for weighted minimization the weights should be pushed first (see
+  PushWeights() in weights.h); otherwise only states whose suffixes have the
+  same weights arc by arc are merged.
+
+  Notes:
+    - The output is deterministic and arc-sorted.  If the input was
+      top-sorted, the output is top-sorted: the states of the output are
+      ordered by the largest input state of their class.
+    - The input should be connected; states that cannot reach the final
+      state would be kept (and merged with each other when possible).
+ */
+class Minimizer {
+ public:
+  /* Lightweight constructor that just keeps const references to the input
+     parameters.
+     @param [in] fsa_in       The input FSA.  Must be deterministic and
+                              arc-sorted (see IsDeterministic() and
+                              IsArcSorted() in properties.h).
+     @param [in] num_threads  The signatures of the states are hashed with
+                              up to this many threads; if num_threads <= 0,
+                              we use the number of hardware threads.  The
+                              result does not depend on it.
+  */
+  explicit Minimizer(const Fsa &fsa_in, int32_t num_threads = 0)
+      : fsa_in_(fsa_in), num_threads_(num_threads) {}
+
+  /*
+    Do enough work to know how much memory will be needed, and output
+    that information
+        @param [out] fsa_size   The num-states and num-arcs of the output FSA
+                                will be written to here
+  */
+  void GetSizes(Array2Size<int32_t> *fsa_size);
+
+  /*
+    Finish the operation and output the minimized FSA to `fsa_out` and
+    arc mapping information to `arc_map` (if provided).
+    @param [out] fsa_out   The output FSA; Must be initialized; search for
+                           'initialized definition' in class Array2 in
+                           array.h for meaning.
+    @param [out] arc_map   If non-NULL, will output a map from the arc-index
+                           in `fsa_out` to the corresponding arc-index in
+                           `fsa_in` (the arcs of each output state are those
+                           of one of the input states of its class).
+                           If non-NULL, at entry it must be allocated with
+                           size num-arcs of `fsa_out`, e.g. `fsa_out->size2`.
+   */
+  void GetOutput(Fsa *fsa_out, int32_t *arc_map = nullptr);
+
+ private:
+  const Fsa &fsa_in_;
+  const int32_t num_threads_;
+
+  std::vector<int32_t> arc_indexes_;  // arc_index of fsa_out
+  std::vector<Arc> arcs_;             // arcs of fsa_out
+  std::vector<int32_t> arc_map_;
+};
+
+/*
+  The core part of `Minimizer`, which computes the classes of equivalent
+  states of `fsa`.
+
+     @param [in]  fsa          The FSA to be minimized; as for Minimizer.
+     @param [in]  num_threads  As for Minimizer.
+     @param [out] state_class  Will be set to the class of each state of
+                               `fsa`, with fsa.NumStates() elements; the
+                               classes are numbered from 0 in order of
+                               their first state.
+     @return  Returns the number of classes.
+ */
+int32_t MinimizeCore(const Fsa &fsa, int32_t num_threads,
+                     std::vector<int32_t> *state_class);
+
+}  // namespace k2host
+
+#endif  // K2_CSRC_HOST_MINIMIZE_H_
@@ -0,0 +1,162 @@
+/**
+ * @brief
+ * minimize_test
+ *
+ * @copyright
+ * Copyright (c)  2026  agent (agent@local)
+ *
+ * @copyright
+ * See LICENSE for clarification regarding multiple authors
+ */
+
+#include "k2/csrc/host/minimize.h"
+
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+
+#include <vector>
+
+#include "k2/csrc/host/fsa.h"
+#include "k2/csrc/host/fsa_equivalent.h"
+#include "k2/csrc/host/fsa_util.h"
+#include "k2/csrc/host/properties.h"
+#include "k2/csrc/host/weights.h"
+
+namespace k2host {
+
+static void CheckArcs(const Fsa &fsa, const std::vector<Arc> &target_arcs) {
+  ASSERT_EQ(fsa.size2, static_cast<int32_t>(target_arcs.size()));
+  for (int32_t i = 0; i != fsa.size2; ++i) {
+    const Arc &arc = fsa.data[fsa.indexes[0] + i];
+    EXPECT_EQ(arc.src_state, target_arcs[i].src_state);
+    EXPECT_EQ(arc.dest_state, target_arcs[i].dest_state);
+    EXPECT_EQ(arc.label, target_arcs[i].label);
+    EXPECT_FLOAT_EQ(arc.weight, target_arcs[i].weight);
+  }
+}
+
+TEST(MinimizeTest, MinimizeCore) {
+  {
+    // an empty input fsa
+    FsaCreator fsa_creator;
+    const auto &fsa = fsa_creator.GetFsa();
+    std::vector<int32_t> state_class(10);
+    EXPECT_EQ(MinimizeCore(fsa, 1, &state_class), 0);
+    EXPECT_TRUE(state_class.empty());
+  }
+  {
+    // states 1 and 3 both have a single arc with label 4 to state 4
+    std::vector<Arc> arcs = {
+        {0, 1, 1, 0}, {0, 2, 2, 0}, {1, 4, 4, 0},
+        {2, 3, 3, 0}, {3, 4, 4, 0}, {4, 5, -1, 0},
+    };
+    FsaCreator fsa_creator(arcs, 5);
+    const auto &fsa = fsa_creator.GetFsa();
+    std::vector<int32_t> state_class;
+    EXPECT_EQ(MinimizeCore(fsa, 1, &state_class), 5);
+    EXPECT_THAT(state_class, ::testing::ElementsAre(0, 1, 2, 1, 3, 4));
+  }
+}
+
+TEST(MinimizeTest, Minimize) {
+  {
+    // an empty input fsa
+    FsaCreator fsa_creator;
+    const auto &fsa = fsa_creator.GetFsa();
+    Minimizer minimizer(fsa);
+    Array2Size<int32_t> fsa_size;
+    minimizer.GetSizes(&fsa_size);
+    EXPECT_EQ(fsa_size.size1, 0);
+    EXPECT_EQ(fsa_size.size2, 0);
+  }
+  {
+    // states 1 and 3 are merged; the output is ordered by the largest state
+    // of each class, so the merged state comes after state 2.
+    std::vector<Arc> arcs = {
+        {0, 1, 1, 0}, {0, 2, 2, 0}, {1, 4, 4, 0},
+        {2, 3, 3, 0}, {3, 4, 4, 0}, {4, 5, -1, 0},
+    };
+    FsaCreator fsa_creator(arcs, 5);
+    const auto &fsa = fsa_creator.GetFsa();
+
+    Minimizer minimizer(fsa, 2);
+    Array2Size<int32_t> fsa_size;
+    minimizer.GetSizes(&fsa_size);
+    FsaCreator fsa_creator_out(fsa_size);
+    auto &minimized_fsa = fsa_creator_out.GetFsa();
+    std::vector<int32_t> arc_map(fsa_size.size2);
+    minimizer.GetOutput(&minimized_fsa, arc_map.data());
+
+    ASSERT_EQ(minimized_fsa.size1, 5);
+    std::vector<int32_t> arc_indexes(
+        minimized_fsa.indexes, minimized_fsa.indexes + minimized_fsa.size1 + 1);
+    EXPECT_THAT(arc_indexes, ::testing::ElementsAre(0, 2, 3, 4, 5, 5));
+    CheckArcs(minimized_fsa, {{0, 2, 1, 0},
+                              {0, 1, 2, 0},
+                              {1, 2, 3, 0},
+                              {2, 3, 4, 0},
+                              {3, 4, -1, 0}});
+    EXPECT_THAT(arc_map, ::testing::ElementsAre(0, 1, 3, 4, 5));
+    EXPECT_TRUE(IsTopSorted(minimized_fsa));
+    EXPECT_TRUE(IsRandEquivalent(fsa, minimized_fsa));
+  }
+  {
+    // a cyclic fsa; states 1 and 2 are merged.
+    std::vector<Arc> arcs = {
+        {0, 1, 1, 0}, {0, 2, 2, 0}, {1, 3, -1, 0},
+        {1, 1, 1, 0}, {2, 3, -1, 0}, {2, 2, 1, 0},
+    };
+    FsaCreator fsa_creator(arcs, 3);
+    const auto &fsa = fsa_creator.GetFsa();
+
+    Minimizer minimizer(fsa);
+    Array2Size<int32_t> fsa_size;
+    minimizer.GetSizes(&fsa_size);
+    FsaCreator fsa_creator_out(fsa_size);
+    auto &minimized_fsa = fsa_creator_out.GetFsa();
+    minimizer.GetOutput(&minimized_fsa);
+
+    ASSERT_EQ(minimized_fsa.size1, 3);
+    CheckArcs(minimized_fsa,
+              {{0, 1, 1, 0}, {0, 1, 2, 0}, {1, 2, -1, 0}, {1, 1, 1, 0}});
+  }
+}
+
+TEST(MinimizeTest, MinimizeAfterPushWeights) {
+  // states 1 and 3 accept the same suffixes, but with different weights on
+  // their arcs, so they can only be merged after the weights are pushed.
+  std::vector<Arc> arcs = {
+      {0, 1, 1, 0}, {0, 2, 2, 0}, {1, 4, 4, 1},
+      {2, 3, 3, 0}, {3, 4, 4, 2}, {4, 5, -1, 0},
+  };
+  FsaCreator fsa_creator(arcs, 5);
+  auto &fsa = fsa_creator.GetFsa();
+  {
+    Minimizer minimizer(fsa);
+    Array2Size<int32_t> fsa_size;
+    minimizer.GetSizes(&fsa_size);
+    EXPECT_EQ(fsa_size.size1, 6);
+    EXPECT_EQ(fsa_size.size2, 6);
+  }
+
+  FsaCreator pushed_creator(arcs, 5);
+  auto &pushed_fsa = pushed_creator.GetFsa();
+  PushWeights<kMaxWeight>(&pushed_fsa);
+  Minimizer minimizer(pushed_fsa);
+  Array2Size<int32_t> fsa_size;
+  minimizer.GetSizes(&fsa_size);
+  FsaCreator fsa_creator_out(fsa_size);
+  auto &minimized_fsa = fsa_creator_out.GetFsa();
+  minimizer.GetOutput(&minimized_fsa);
+
+  ASSERT_EQ(minimized_fsa.size1, 5);
+  CheckArcs(minimized_fsa, {{0, 2, 1, 1},
+                            {0, 1, 2, 2},
+                            {1, 2, 3, 0},
+                            {2, 3, 4, 0},
+                            {3, 4, -1, 0}});
+  EXPECT_TRUE(IsRandEquivalent<kMaxWeight>(fsa, minimized_fsa));
+  EXPECT_TRUE(IsRandEquivalent<kLogSumWeight>(fsa, minimized_fsa));
+}
+
+}  // namespace k2host
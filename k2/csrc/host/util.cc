@@ -13,6 +13,11 @@
 
 #include <stdlib.h>
 
+#include <algorithm>
+#include <atomic>
+#include <thread>  // NOLINT
+#include <vector>
+
 #include "k2/csrc/log.h"
 
 namespace k2host {
@@ -40,4 +45,26 @@ void MemFree(void *ptr) {
 #endif
 }
 
+void ParallelFor(int32_t n, int32_t num_threads,
+                 const std::function<void(int32_t)> &fn) {
+  if (n <= 0) return;
+  if (num_threads <= 0)
+    num_threads = static_cast<int32_t>(std::thread::hardware_concurrency());
+  num_threads = std::max(1, std::min(num_threads, n));
+  if (num_threads == 1) {
+    for (int32_t i = 0; i != n; ++i) fn(i);
+    return;
+  }
+
+  std::atomic<int32_t> next(0);
+  auto worker = [&next, n, &fn]() {
+    for (int32_t i = next++; i < n; i = next++) fn(i);
+  };
+  std::vector<std::thread> threads;
+  threads.reserve(num_threads - 1);
+  for (int32_t t = 1; t != num_threads; ++t) threads.emplace_back(worker);
+  worker();
+  for (auto &thread : threads) thread.join();
+}
+
 }  // namespace k2host
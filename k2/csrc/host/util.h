@@ -16,6 +16,7 @@
 #include <algorithm>
 #include <cfloat>
 #include <cmath>
+#include <cstdint>
 #include <functional>
 #include <limits>
 #include <utility>
@@ -108,5 +109,20 @@ inline bool DoubleApproxEqual(double a, double b, double delta = 1e-6) {
 void *MemAlignedMalloc(size_t nbytes, size_t alignment);
 void MemFree(void *ptr);
 
+/*
+  Calls `fn(i)` for each i in [0, n), using up to `num_threads` threads
+  (including the calling thread). The tasks are handed out dynamically, so
+  `fn` may be called in any order and concurrently for different `i`; it
+  returns after all calls have finished.
+
+    @param [in] n            Number of tasks; nothing is done if n <= 0.
+    @param [in] num_threads  Maximum number of threads to use. If
+                             num_threads <= 0, we use the number of
+                             hardware threads.
+    @param [in] fn           The function to call for each task
+*/
+void ParallelFor(int32_t n, int32_t num_threads,
+                 const std::function<void(int32_t)> &fn);
+
 }  // namespace k2host
 #endif  // K2_CSRC_HOST_UTIL_H_
@@ -0,0 +1,36 @@
+/**
+ * @brief
+ * util_test
+ *
+ * @copyright
+ * Copyright (c)  2026  agent (agent@local)
+ *
+ * @copyright
+ * See LICENSE for clarification regarding multiple authors
+ */
+
+#include "k2/csrc/host/util.h"
+
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <vector>
+
+namespace k2host {
+
+TEST(ParallelFor, CallsEachTaskOnce) {
+  for (int32_t num_threads : {-1, 0, 1, 2, 7}) {
+    for (int32_t n : {0, 1, 3, 100}) {
+      std::vector<int32_t> counts(n, 0);
+      std::atomic<int32_t> total(0);
+      ParallelFor(n, num_threads, [&counts, &total](int32_t i) {
+        ++counts[i];
+        total += i;
+      });
+      for (int32_t i = 0; i != n; ++i) EXPECT_EQ(counts[i], 1);
+      EXPECT_EQ(total, n * (n - 1) / 2);
+    }
+  }
+}
+
+}  // namespace k2host
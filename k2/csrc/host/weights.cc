@@ -12,15 +12,114 @@
 #include "k2/csrc/host/weights.h"
 
 #include <algorithm>
+#include <limits>
 #include <queue>
 #include <vector>
 
 #include "k2/csrc/host/fsa.h"
+#include "k2/csrc/host/log_sum_exp.h"
 #include "k2/csrc/host/properties.h"
 #include "k2/csrc/host/util.h"
 
 namespace k2host {
 
+namespace {
+
+// The log-sums over the arcs entering or leaving each state are computed with
+// LogSumExp() on blocks of up to this many arcs' weights.
+constexpr int32_t kLogSumBlockSize = 64;
+
+// Implementation of ComputeForwardLogSumWeights().  The arcs are gathered per
+// state, so each state's weight is one log-sum instead of a LogAdd() per arc.
+// Only the weights of states >= begin_state are computed; those of the states
+// before are used as they are.
+template <typename Real>
+void ComputeForwardLogSumWeightsImpl(
+    const Fsa &fsa, const Array2<int32_t *, int32_t> &entering_arcs,
+    Real *state_weights, int32_t begin_state = 0) {
+  if (IsEmpty(fsa)) return;
+  K2_DCHECK(IsValid(fsa));  // TODO(dan): make this run only in paranoid mode.
+  K2_CHECK_NE(state_weights, nullptr);
+  K2_CHECK_EQ(entering_arcs.size1, fsa.size1);
+  K2_CHECK_EQ(entering_arcs.size2, fsa.size2);
+
+  int32_t num_states = fsa.NumStates();
+  const auto &arcs = fsa.data + fsa.indexes[0];
+  Real block[kLogSumBlockSize];
+  if (begin_state == 0) state_weights[0] = 0;
+  for (int32_t state = std::max(begin_state, 1); state < num_states; ++state) {
+    Real weight = -std::numeric_limits<Real>::infinity();
+    int32_t begin = entering_arcs.indexes[state],
+            end = entering_arcs.indexes[state + 1];
+    // Self-loops (which IsTopSorted() allows) are last, as their arc indexes
+    // are the largest; each is applied once, as by a LogAdd() per arc.
+    int32_t loops_begin = end;
+    while (loops_begin > begin &&
+           arcs[entering_arcs.data[loops_begin - 1]].src_state == state)
+      --loops_begin;
+    for (int32_t i = begin; i < loops_begin; i += kLogSumBlockSize) {
+      int32_t block_size = std::min(loops_begin - i, kLogSumBlockSize);
+      for (int32_t j = 0; j != block_size; ++j) {
+        const auto &arc = arcs[entering_arcs.data[i + j]];
+        K2_DCHECK_LT(arc.src_state, state);
+        block[j] = state_weights[arc.src_state] + arc.weight;
+      }
+      Real block_weight = LogSumExp(block, block_size);
+      weight = (i == begin ? block_weight : LogAdd(weight, block_weight));
+    }
+    for (int32_t i = loops_begin; i != end; ++i)
+      weight = LogAdd(weight, weight + arcs[entering_arcs.data[i]].weight);
+    state_weights[state] = weight;
+  }
+}
+
+// Implementation of ComputeBackwardLogSumWeights(); the arcs leaving each
+// state are contiguous.  Only the weights of states < end_state are computed.
+template <typename Real>
+void ComputeBackwardLogSumWeightsImpl(const Fsa &fsa, Real *state_weights,
+                                      int32_t end_state = -1) {
+  if (IsEmpty(fsa)) return;
+  K2_DCHECK(IsValid(fsa));  // TODO(dan): make this run only in paranoid mode.
+  K2_CHECK_NE(state_weights, nullptr);
+
+  int32_t final_state = fsa.FinalState();
+  if (end_state < 0 || end_state > final_state) {
+    state_weights[final_state] = 0;
+    end_state = final_state;
+  }
+  Real block[kLogSumBlockSize];
+  for (int32_t state = end_state - 1; state >= 0; --state) {
+    Real weight = -std::numeric_limits<Real>::infinity();
+    int32_t begin = fsa.indexes[state], end = fsa.indexes[state + 1];
+    int32_t block_size = 0;
+    bool has_self_loops = false;
+    for (int32_t i = begin; i != end; ++i) {
+      const auto &arc = fsa.data[i];
+      K2_DCHECK_GE(arc.dest_state, state);
+      if (arc.dest_state == state) {
+        has_self_loops = true;
+        continue;
+      }
+      block[block_size++] = state_weights[arc.dest_state] + arc.weight;
+      if (block_size == kLogSumBlockSize) {
+        weight = LogAdd(weight, LogSumExp(block, block_size));
+        block_size = 0;
+      }
+    }
+    if (block_size != 0) weight = LogAdd(weight, LogSumExp(block, block_size));
+    // The self-loops are applied after the other arcs, once each.
+    if (has_self_loops) {
+      for (int32_t i = begin; i != end; ++i) {
+        if (fsa.data[i].dest_state == state)
+          weight = LogAdd(weight, weight + fsa.data[i].weight);
+      }
+    }
+    state_weights[state] = weight;
+  }
+}
+
+}  // namespace
+
 void ComputeForwardMaxWeights(const Fsa &fsa, double *state_weights) {
   if (IsEmpty(fsa)) return;
   K2_DCHECK(IsValid(fsa));  // TODO(dan): make this run only in paranoid mode.
@@ -60,42 +159,57 @@ void ComputeBackwardMaxWeights(const Fsa &fsa, double *state_weights) {
 
 void ComputeForwardLogSumWeights(const Fsa &fsa, double *state_weights) {
   if (IsEmpty(fsa)) return;
-  K2_DCHECK(IsValid(fsa));  // TODO(dan): make this run only in paranoid mode.
-  K2_CHECK_NE(state_weights, nullptr);
+  Array2Storage<int32_t *, int32_t> entering_arcs({fsa.size1, fsa.size2}, 1);
+  GetEnteringArcs(fsa, &entering_arcs.GetArray2());
+  ComputeForwardLogSumWeightsImpl(fsa, entering_arcs.GetArray2(),
+                                  state_weights);
+}
 
-  int32_t num_states = fsa.NumStates();
-  std::fill_n(state_weights, num_states, kDoubleNegativeInfinity);
+void ComputeForwardLogSumWeights(
+    const Fsa &fsa, const Array2<int32_t *, int32_t> &entering_arcs,
+    double *state_weights) {
+  ComputeForwardLogSumWeightsImpl(fsa, entering_arcs, state_weights);
+}
 
-  const auto &arcs = fsa.data + fsa.indexes[0];
-  state_weights[0] = 0;
-  for (int32_t i = 0; i != fsa.size2; ++i) {
-    const auto &arc = arcs[i];
-    K2_DCHECK_GE(arc.dest_state, arc.src_state);
-    auto src_weight = state_weights[arc.src_state];
-    auto &dest_weight = state_weights[arc.dest_state];
-    dest_weight = LogAdd(dest_weight, src_weight + arc.weight);
-  }
+void ComputeForwardLogSumWeights(
+    const Fsa &fsa, const Array2<int32_t *, int32_t> &entering_arcs,
+    float *state_weights) {
+  ComputeForwardLogSumWeightsImpl(fsa, entering_arcs, state_weights);
 }
 
 void ComputeBackwardLogSumWeights(const Fsa &fsa, double *state_weights) {
-  if (IsEmpty(fsa)) return;
-  K2_DCHECK(IsValid(fsa));  // TODO(dan): make this run only in paranoid mode.
-  K2_CHECK_NE(state_weights, nullptr);
+  ComputeBackwardLogSumWeightsImpl(fsa, state_weights);
+}
 
-  int32_t num_states = fsa.NumStates();
-  std::fill_n(state_weights, num_states, kDoubleNegativeInfinity);
+void ComputeBackwardLogSumWeights(const Fsa &fsa, float *state_weights) {
+  ComputeBackwardLogSumWeightsImpl(fsa, state_weights);
+}
 
-  const auto &arcs = fsa.data + fsa.indexes[0];
-  state_weights[fsa.FinalState()] = 0;
-  for (int32_t i = fsa.size2 - 1; i >= 0; --i) {
-    const auto &arc = arcs[i];
-    K2_DCHECK_GE(arc.dest_state, arc.src_state);
-    auto &src_weight = state_weights[arc.src_state];
-    auto dest_weight = state_weights[arc.dest_state];
-    src_weight = LogAdd(src_weight, dest_weight + arc.weight);
+template <FbWeightType Type>
+void PushWeights(Fsa *fsa) {
+  K2_CHECK_NE(fsa, nullptr);
+  if (IsEmpty(*fsa)) return;
+  K2_CHECK(IsTopSorted(*fsa));
+
+  std::vector<double> backward_weights(fsa->NumStates());
+  ComputeBackwardWeights<Type>(*fsa, backward_weights.data());
+  Arc *arcs = fsa->data + fsa->indexes[0];
+  for (int32_t i = 0; i != fsa->size2; ++i) {
+    Arc &arc = arcs[i];
+    double weight = arc.weight + backward_weights[arc.dest_state];
+    if (arc.src_state != 0) {
+      double src_weight = backward_weights[arc.src_state];
+      if (src_weight == kDoubleNegativeInfinity) continue;
+      weight -= src_weight;
+    }
+    arc.weight = static_cast<float>(weight);
   }
 }
 
+// explicit instantiation here
+template void PushWeights<kMaxWeight>(Fsa *fsa);
+template void PushWeights<kLogSumWeight>(Fsa *fsa);
+
 WfsaWithFbWeights::WfsaWithFbWeights(const Fsa &fsa, FbWeightType t,
                                      double *forward_state_weights,
                                      double *backward_state_weights)
@@ -103,25 +217,59 @@ WfsaWithFbWeights::WfsaWithFbWeights(const Fsa &fsa, FbWeightType t,
       weight_type(t),
       forward_state_weights(forward_state_weights),
       backward_state_weights(backward_state_weights) {
+  Init();
+}
+
+WfsaWithFbWeights::WfsaWithFbWeights(const Fsa &fsa, FbWeightType t)
+    : fsa(fsa),
+      weight_type(t),
+      owned_forward_state_weights(fsa.NumStates()),
+      owned_backward_state_weights(fsa.NumStates()) {
+  forward_state_weights = owned_forward_state_weights.data();
+  backward_state_weights = owned_backward_state_weights.data();
+  Init();
+}
+
+void WfsaWithFbWeights::Init() {
   if (IsEmpty(fsa)) return;
   K2_DCHECK(IsValid(fsa));
-  ComputeForwardWeights();
-  ComputeBackardWeights();
+  if (weight_type == kLogSumWeight) {
+    entering_arcs.reset(
+        new Array2Storage<int32_t *, int32_t>({fsa.size1, fsa.size2}, 1));
+    GetEnteringArcs(fsa, &entering_arcs->GetArray2());
+  }
+  ComputeForwardWeights(0);
+  ComputeBackardWeights(fsa.NumStates());
+}
+
+void WfsaWithFbWeights::UpdateWeights(int32_t begin_state /*= 0*/,
+                                      int32_t end_state /*= -1*/) {
+  if (IsEmpty(fsa)) return;
+  int32_t num_states = fsa.NumStates();
+  if (end_state < 0) end_state = num_states;
+  K2_CHECK_GE(begin_state, 0);
+  K2_CHECK_LE(end_state, num_states);
+  if (begin_state >= end_state) return;
+  ComputeForwardWeights(begin_state);
+  ComputeBackardWeights(end_state);
 }
 
 // Mohri, M. 2002. Semiring framework and algorithms for shortest-distance
 // problems, Journal of Automata, Languages and Combinatorics 7(3): 321-350,
 // 2002.
-void WfsaWithFbWeights::ComputeForwardWeights() {
+void WfsaWithFbWeights::ComputeForwardWeights(int32_t begin_state) {
   auto num_states = fsa.NumStates();
-  std::fill_n(forward_state_weights, num_states, kDoubleNegativeInfinity);
+  std::fill(forward_state_weights + begin_state,
+            forward_state_weights + num_states, kDoubleNegativeInfinity);
 
   const auto &arcs = fsa.data + fsa.indexes[0];
-  forward_state_weights[0] = 0;
+  if (begin_state == 0) forward_state_weights[0] = 0;
   if (weight_type == kMaxWeight) {
+    // Arcs entering states >= begin_state may leave any state.
     for (auto i = 0; i != fsa.size2; ++i) {
       const auto &arc = arcs[i];
       K2_DCHECK_GE(arc.dest_state, arc.src_state);
+      if (arc.dest_state < begin_state) continue;
       auto src_weight = forward_state_weights[arc.src_state];
       auto &dest_weight = forward_state_weights[arc.dest_state];
 
@@ -129,28 +277,22 @@ void WfsaWithFbWeights::ComputeForwardWeights() {
       dest_weight = std::max(dest_weight, r);
     }
   } else if (weight_type == kLogSumWeight) {
-    for (std::size_t i = 0; i != fsa.size2; ++i) {
-      const auto &arc = arcs[i];
-      K2_DCHECK_GE(arc.dest_state, arc.src_state);
-      auto src_weight = forward_state_weights[arc.src_state];
-      auto &dest_weight = forward_state_weights[arc.dest_state];
-
-      double r = src_weight + arc.weight;
-      dest_weight = LogAdd(dest_weight, r);
-    }
+    ComputeForwardLogSumWeightsImpl(fsa, entering_arcs->GetArray2(),
+                                    forward_state_weights, begin_state);
   } else {
     K2_LOG(FATAL) << "Unreachable code is executed!";
   }
 }
 
-void WfsaWithFbWeights::ComputeBackardWeights() {
-  auto num_states = fsa.NumStates();
-  std::fill_n(backward_state_weights, num_states, kDoubleNegativeInfinity);
+void WfsaWithFbWeights::ComputeBackardWeights(int32_t end_state) {
+  std::fill_n(backward_state_weights, end_state, kDoubleNegativeInfinity);
 
   const auto &arcs = fsa.data + fsa.indexes[0];
-  backward_state_weights[fsa.FinalState()] = 0;
+  int32_t final_state = fsa.FinalState();
+  if (final_state < end_state) backward_state_weights[final_state] = 0;
   if (weight_type == kMaxWeight) {
-    for (auto i = fsa.size2 - 1; i >= 0; --i) {
+    // The arcs leaving states < end_state are the first ones.
+    for (auto i = fsa.indexes[end_state] - fsa.indexes[0] - 1; i >= 0; --i) {
       const auto &arc = arcs[i];
       K2_DCHECK_GE(arc.dest_state, arc.src_state);
       auto &src_weight = backward_state_weights[arc.src_state];
@@ -160,15 +302,7 @@ void WfsaWithFbWeights::ComputeBackardWeights() {
       src_weight = std::max(src_weight, r);
     }
   } else if (weight_type == kLogSumWeight) {
-    for (auto i = fsa.size2 - 1; i >= 0; --i) {
-      const auto &arc = arcs[i];
-      K2_DCHECK_GE(arc.dest_state, arc.src_state);
-      auto &src_weight = backward_state_weights[arc.src_state];
-      auto dest_weight = backward_state_weights[arc.dest_state];
-
-      double r = dest_weight + arc.weight;
-      src_weight = LogAdd(src_weight, r);
-    }
+    ComputeBackwardLogSumWeightsImpl(fsa, backward_state_weights, end_state);
   } else {
     K2_LOG(FATAL) << "Unreachable code is executed!";
   }
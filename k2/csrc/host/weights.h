@@ -101,6 +101,34 @@ void ComputeForwardLogSumWeights(const Fsa &fsa, double *state_weights);
  */
 void ComputeBackwardLogSumWeights(const Fsa &fsa, double *state_weights);
 
+/*
+  Versions of ComputeForwardLogSumWeights() that take the lists of arcs
+  entering each state, as computed by GetEnteringArcs(), so the caller can
+  compute them once for several FSAs with the same structure or several
+  passes; the version above computes them every time.  The weights of the
+  arcs entering each state are added up with LogSumExp() (which is
+  vectorized), in blocks of up to 64 arcs.  With `float` the weights are
+  accumulated in float, which is faster but less accurate for long FSAs.
+
+   @param [in]  fsa  The fsa we are doing the forward computation on.
+                Must satisfy IsValid(fsa) and IsTopSorted(fsa).
+   @param [in]  entering_arcs  The output of GetEnteringArcs(fsa).
+   @param [out] state_weights  As for ComputeForwardLogSumWeights().
+ */
+void ComputeForwardLogSumWeights(
+    const Fsa &fsa, const Array2<int32_t *, int32_t> &entering_arcs,
+    double *state_weights);
+void ComputeForwardLogSumWeights(
+    const Fsa &fsa, const Array2<int32_t *, int32_t> &entering_arcs,
+    float *state_weights);
+
+/*
+  Version of ComputeBackwardLogSumWeights() that accumulates the weights in
+  float.  Both versions add up the weights of the arcs leaving each state
+  with LogSumExp(), as for ComputeForwardLogSumWeights().
+ */
+void ComputeBackwardLogSumWeights(const Fsa &fsa, float *state_weights);
+
 enum FbWeightType { kMaxWeight, kLogSumWeight };
 
 // Version of `ComputeForwardWeights` as a template interface, see documentation
@@ -120,6 +148,27 @@ inline void ComputeForwardWeights<kLogSumWeight>(const Fsa &fsa,
   ComputeForwardLogSumWeights(fsa, state_weights);
 }
 
+// Version of `ComputeForwardWeights` with the entering arcs precomputed (see
+// GetEnteringArcs()); the max version doesn't need them.
+template <FbWeightType Type>
+void ComputeForwardWeights(const Fsa &fsa,
+                           const Array2<int32_t *, int32_t> &entering_arcs,
+                           double *state_weights);
+
+template <>
+inline void ComputeForwardWeights<kMaxWeight>(
+    const Fsa &fsa, const Array2<int32_t *, int32_t> &entering_arcs,
+    double *state_weights) {
+  ComputeForwardMaxWeights(fsa, state_weights);
+}
+
+template <>
+inline void ComputeForwardWeights<kLogSumWeight>(
+    const Fsa &fsa, const Array2<int32_t *, int32_t> &entering_arcs,
+    double *state_weights) {
+  ComputeForwardLogSumWeights(fsa, entering_arcs, state_weights);
+}
+
 // Version of `ComputeBackwardWeights` as a template interface, see
 // documentation of `ComputeBackwardMaxWeights` or
 // `ComputeBackwardLogSumWeights`
@@ -151,6 +200,37 @@ double ShortestDistance(const Fsa &fsa) {
   return state_weights[fsa.FinalState()];
 }
 
+/*
+  Pushes the weights of `fsa` towards its start state, in place: each arc
+  from state s to state d gets the weight w + V(d) - V(s), where V is the
+  backward weight (max or log-sum, as `Type`), and arcs leaving the start
+  state get w + V(d).  The weight of every path is unchanged (we have no
+  initial weight to move V(0) to, so it stays on the arcs leaving the start
+  state), and, for the other states, the max or log-sum of the weights of
+  their arcs becomes 0.
+
+  Weight pushing normalizes the weights, so that equivalent states of a
+  deterministic FSA have the same arcs; this is what lets Minimizer (see
+  minimize.h) merge them.  It is also useful before pruned algorithms, as
+  the weights carry the cost of the best (or all) continuation.
+
+   @param [in,out] fsa  The FSA whose weights are to be pushed.  Must
+                        satisfy IsValid(fsa) and IsTopSorted(fsa).  Arcs
+                        leaving states that cannot reach the final state
+                        (other than the start state) are left as they are;
+                        arcs entering such states get weight
+                        kFloatNegativeInfinity.
+ */
+template <FbWeightType Type>
+void PushWeights(Fsa *fsa);
+
+/*
+  An FSA with its forward and backward state weights.  Algorithms such as
+  Determinizer and EpsilonsRemover take it by const reference, so one object
+  can be constructed once and shared by several algorithms run on the same
+  FSA; if the weights of the arcs change later (but not the structure of the
+  FSA), UpdateWeights() recomputes only what is affected.
+ */
 struct WfsaWithFbWeights {
   const Fsa &fsa;
 
@@ -188,15 +268,49 @@ struct WfsaWithFbWeights {
                     double *forward_state_weights,
                     double *backward_state_weights);
 
+  /*
+    Constructor that allocates the forward and backward weights itself;
+    otherwise as the constructor above.
+   */
+  WfsaWithFbWeights(const Fsa &fsa, FbWeightType t);
+
+  // Not copyable, as the weights may be owned by this object.
+  WfsaWithFbWeights(const WfsaWithFbWeights &) = delete;
+  WfsaWithFbWeights &operator=(const WfsaWithFbWeights &) = delete;
+
   const double *ForwardStateWeights() const { return forward_state_weights; }
 
   const double *BackwardStateWeights() const { return backward_state_weights; }
 
+  /*
+    Recomputes the forward and backward weights after the weights of some
+    arcs of `fsa` were changed in place; the rest of `fsa` (states, labels,
+    the order of arcs) must be unchanged.  The arcs entering each state are
+    cached from the constructor, so this is cheaper than constructing a new
+    object.
+
+       @param [in] begin_state, end_state  The caller asserts that only the
+                        weights of arcs leaving states in
+                        [begin_state, end_state) changed, so only the forward
+                        weights of states >= begin_state and the backward
+                        weights of states < end_state are recomputed.
+                        end_state == -1 means fsa.NumStates().
+   */
+  void UpdateWeights(int32_t begin_state = 0, int32_t end_state = -1);
+
  private:
   double *forward_state_weights;
   double *backward_state_weights;
-  void ComputeForwardWeights();
-  void ComputeBackardWeights();
+  // Used by the second constructor.
+  std::vector<double> owned_forward_state_weights;
+  std::vector<double> owned_backward_state_weights;
+  // The arcs entering each state, see GetEnteringArcs(); only computed for
+  // kLogSumWeight.
+  std::unique_ptr<Array2Storage<int32_t *, int32_t>> entering_arcs;
+
+  void Init();
+  void ComputeForwardWeights(int32_t begin_state);
+  void ComputeBackardWeights(int32_t end_state);
 };
 
 }  // namespace k2host
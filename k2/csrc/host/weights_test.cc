@@ -19,6 +19,7 @@
 #include <vector>
 
 #include "k2/csrc/host/fsa.h"
+#include "k2/csrc/host/fsa_equivalent.h"
 #include "k2/csrc/host/fsa_renderer.h"
 #include "k2/csrc/host/fsa_util.h"
 #include "k2/csrc/host/util.h"
@@ -98,6 +99,23 @@ TEST_F(WeightsTest, ComputeForwardLogSumWeights) {
     ComputeForwardWeights<kLogSumWeight>(*fsa_, &state_weights[0]);
     EXPECT_DOUBLE_ARRAY_APPROX_EQ(state_weights, forward_logsum_weights_, 1e-3);
   }
+
+  // with precomputed entering arcs
+  {
+    Array2Storage<int32_t *, int32_t> entering_arcs(
+        {fsa_->size1, fsa_->size2}, 1);
+    GetEnteringArcs(*fsa_, &entering_arcs.GetArray2());
+    std::vector<double> state_weights(num_states_);
+    ComputeForwardWeights<kLogSumWeight>(*fsa_, entering_arcs.GetArray2(),
+                                         &state_weights[0]);
+    EXPECT_DOUBLE_ARRAY_APPROX_EQ(state_weights, forward_logsum_weights_, 1e-3);
+
+    std::vector<float> float_state_weights(num_states_);
+    ComputeForwardLogSumWeights(*fsa_, entering_arcs.GetArray2(),
+                                &float_state_weights[0]);
+    EXPECT_DOUBLE_ARRAY_APPROX_EQ(float_state_weights, forward_logsum_weights_,
+                                  1e-3);
+  }
 }
 
 TEST_F(WeightsTest, ComputeBackwardLogSumWeights) {
@@ -115,6 +133,14 @@ TEST_F(WeightsTest, ComputeBackwardLogSumWeights) {
     EXPECT_DOUBLE_ARRAY_APPROX_EQ(state_weights, backward_logsum_weights_,
                                   1e-3);
   }
+
+  // float version
+  {
+    std::vector<float> state_weights(num_states_);
+    ComputeBackwardLogSumWeights(*fsa_, &state_weights[0]);
+    EXPECT_DOUBLE_ARRAY_APPROX_EQ(state_weights, backward_logsum_weights_,
+                                  1e-3);
+  }
 }
 
 TEST_F(WeightsTest, ShortestDistance) {
@@ -150,4 +176,97 @@ TEST_F(WeightsTest, WfsaWithFbWeightsLogSum) {
                                 1e-3);
 }
 
+TEST_F(WeightsTest, WfsaWithFbWeightsOwnedWeights) {
+  for (FbWeightType type : {kMaxWeight, kLogSumWeight}) {
+    WfsaWithFbWeights wfsa(*fsa_, type);
+    std::vector<double> forward_weights(
+        wfsa.ForwardStateWeights(),
+        wfsa.ForwardStateWeights() + num_states_);
+    std::vector<double> backward_weights(
+        wfsa.BackwardStateWeights(),
+        wfsa.BackwardStateWeights() + num_states_);
+    if (type == kMaxWeight) {
+      EXPECT_DOUBLE_ARRAY_APPROX_EQ(forward_weights, forward_max_weights_,
+                                    1e-3);
+      EXPECT_DOUBLE_ARRAY_APPROX_EQ(backward_weights, backward_max_weights_,
+                                    1e-3);
+    } else {
+      EXPECT_DOUBLE_ARRAY_APPROX_EQ(forward_weights, forward_logsum_weights_,
+                                    1e-3);
+      EXPECT_DOUBLE_ARRAY_APPROX_EQ(backward_weights,
+                                    backward_logsum_weights_, 1e-3);
+    }
+  }
+}
+
+TEST_F(WeightsTest, WfsaWithFbWeightsUpdateWeights) {
+  Fsa &fsa = fsa_creator_->GetFsa();
+  // Checks `wfsa` against weights computed from scratch.
+  auto check = [&fsa, this](const WfsaWithFbWeights &wfsa) {
+    WfsaWithFbWeights expected(fsa, wfsa.weight_type);
+    const double *forward = wfsa.ForwardStateWeights(),
+                 *backward = wfsa.BackwardStateWeights(),
+                 *expected_forward = expected.ForwardStateWeights(),
+                 *expected_backward = expected.BackwardStateWeights();
+    EXPECT_DOUBLE_ARRAY_APPROX_EQ(
+        std::vector<double>(forward, forward + num_states_),
+        std::vector<double>(expected_forward, expected_forward + num_states_),
+        1e-6);
+    EXPECT_DOUBLE_ARRAY_APPROX_EQ(
+        std::vector<double>(backward, backward + num_states_),
+        std::vector<double>(expected_backward,
+                            expected_backward + num_states_),
+        1e-6);
+  };
+  for (FbWeightType type : {kMaxWeight, kLogSumWeight}) {
+    WfsaWithFbWeights wfsa(fsa, type);
+    double total_weight = wfsa.BackwardStateWeights()[0];
+    // change the weights of the arcs leaving states 3 and 4, i.e. arcs
+    // 5, 6 and 7; arc 5 is on the best path.
+    for (int32_t i = 5; i != 8; ++i) fsa.data[i].weight += 1.5;
+    wfsa.UpdateWeights(3, 5);
+    check(wfsa);
+    EXPECT_GT(wfsa.BackwardStateWeights()[0], total_weight + 1);
+
+    // and all weights
+    for (int32_t i = 0; i != fsa.size2; ++i) fsa.data[i].weight -= 1.0;
+    wfsa.UpdateWeights();
+    check(wfsa);
+  }
+}
+
+template <FbWeightType Type>
+void CheckPushWeights(const Fsa &fsa) {
+  std::vector<Arc> arcs(fsa.data, fsa.data + fsa.size2);
+  FsaCreator pushed_creator(arcs, fsa.FinalState());
+  Fsa &pushed = pushed_creator.GetFsa();
+  PushWeights<Type>(&pushed);
+
+  // the total weight is left on the start state and the other states are
+  // normalized.
+  std::vector<double> backward_weights(fsa.NumStates());
+  ComputeBackwardWeights<Type>(pushed, backward_weights.data());
+  EXPECT_NEAR(backward_weights[0], ShortestDistance<Type>(fsa), 1e-4);
+  for (int32_t i = 1; i != fsa.NumStates(); ++i)
+    EXPECT_NEAR(backward_weights[i], 0, 1e-4);
+  EXPECT_TRUE(IsRandEquivalent<Type>(fsa, pushed));
+}
+
+TEST_F(WeightsTest, PushWeights) {
+  CheckPushWeights<kMaxWeight>(*fsa_);
+  CheckPushWeights<kLogSumWeight>(*fsa_);
+
+  Fsa &fsa = fsa_creator_->GetFsa();
+  PushWeights<kMaxWeight>(&fsa);
+  // arc 0 is 0->4 with weight 1, and backward_max_weights_[4] is 9; arc 2
+  // is 1->2 with weight 2, and the backward weights of 1 and 2 are 13 and 9.
+  EXPECT_FLOAT_EQ(fsa.data[0].weight, 10);
+  EXPECT_FLOAT_EQ(fsa.data[2].weight, -2);
+  EXPECT_FLOAT_EQ(fsa.data[3].weight, 0);
+
+  // an empty FSA is left as it is
+  FsaCreator empty_creator;
+  PushWeights<kLogSumWeight>(&empty_creator.GetFsa());
+}
+
 }  // namespace k2host
@@ -0,0 +1,120 @@
+/**
+ * @brief
+ * intersect_pipeline
+ *
+ * @copyright
+ * Copyright (c)  2026  agent (agent@local)
+ *
+ * @copyright
+ * See LICENSE for clarification regarding multiple authors
+ */
+
+#include <chrono>
+#include <memory>
+
+#include "k2/csrc/intersect_pipeline.h"
+
+namespace k2 {
+
+namespace {
+
+// Returns true if `future` is ready.
+bool IsReady(const std::future<void> &future) {
+  return future.wait_for(std::chrono::seconds(0)) ==
+         std::future_status::ready;
+}
+
+}  // namespace
+
+IntersectDensePrunedPipeline::IntersectDensePrunedPipeline(
+    FsaVec &a_fsas, float beam, float lattice_beam, int32_t max_active_states,
+    int32_t min_active_states, int32_t max_batches_in_flight)
+    : c_(a_fsas.Context()),
+      graph_(PrepareDenseIntersectGraph(a_fsas)),
+      beam_(beam),
+      lattice_beam_(lattice_beam),
+      max_active_states_(max_active_states),
+      min_active_states_(min_active_states),
+      max_batches_in_flight_(max_batches_in_flight) {
+  K2_CHECK_GT(max_batches_in_flight, 0);
+}
+
+IntersectDensePrunedPipeline::~IntersectDensePrunedPipeline() {
+  runner_.Wait();
+}
+
+int32_t IntersectDensePrunedPipeline::NumFinished() const {
+  int32_t ans = 0;
+  for (const auto &batch : batches_) {
+    if (!IsReady(batch->finished)) break;
+    ++ans;
+  }
+  return ans;
+}
+
+void IntersectDensePrunedPipeline::WaitForSlot() {
+  while (true) {
+    Batch *oldest_running = nullptr;
+    int32_t num_running = 0;
+    for (const auto &batch : batches_) {
+      if (IsReady(batch->finished)) continue;
+      if (oldest_running == nullptr) oldest_running = batch.get();
+      ++num_running;
+    }
+    if (num_running < max_batches_in_flight_) return;
+    oldest_running->finished.wait();
+  }
+}
+
+void IntersectDensePrunedPipeline::Push(
+    Tensor &nnet_output, Array2<int32_t> &supervision_segments) {
+  WaitForSlot();
+  batches_.push_back(std::make_unique<Batch>());
+  Batch *batch = batches_.back().get();
+  batch->finished = batch->done.get_future();
+  // The child is created here rather than in the task, so that its work is
+  // ordered after the work queued on c_ by the caller so far (e.g. that
+  // writes nnet_output, if it is on the device).
+  ContextPtr child = c_->Child();
+  Tensor output = nnet_output;
+  Array2<int32_t> segments = supervision_segments;
+  DenseIntersectGraph *graph = &graph_;
+  float beam = beam_, lattice_beam = lattice_beam_;
+  int32_t max_active_states = max_active_states_,
+          min_active_states = min_active_states_;
+  runner_.Background([=]() mutable -> void {
+    ContextPtr cpu = GetCpuContext();
+    {
+      // The scores are uploaded on the child's stream (if needed), and the
+      // intersection runs there as it is on the context of b_fsas.
+      Tensor scores = output.To(child);
+      DenseFsaVec b_fsas(scores, segments);
+      FsaVec lattice;
+      Array1<int32_t> arc_map_a;
+      IntersectDensePrunedOptions opts;
+      opts.lattice_beam = lattice_beam;
+      IntersectDensePruned(*graph, b_fsas, beam, max_active_states,
+                           min_active_states, &lattice, &arc_map_a, nullptr,
+                           opts);
+      batch->out = lattice.To(cpu);
+      batch->arc_map_a = arc_map_a.To(cpu);
+    }
+    // All the work of the batch has to be finished before it is marked as
+    // done (the transfers to the CPU already waited for its stream).
+    child->Sync();
+    batch->done.set_value();
+  });
+}
+
+void IntersectDensePrunedPipeline::Pop(FsaVec *out,
+                                       Array1<int32_t> *arc_map_a) {
+  K2_CHECK(!batches_.empty());
+  K2_CHECK_NE(out, nullptr);
+  std::unique_ptr<Batch> batch = std::move(batches_.front());
+  batches_.pop_front();
+  batch->finished.wait();
+  *out = batch->out;
+  if (arc_map_a != nullptr) *arc_map_a = batch->arc_map_a;
+}
+
+}  // namespace k2
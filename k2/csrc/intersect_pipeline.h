@@ -0,0 +1,141 @@
+/**
+ * @brief
+ * intersect_pipeline
+ *
+ * @copyright
+ * Copyright (c)  2026  agent (agent@local)
+ *
+ * @copyright
+ * See LICENSE for clarification regarding multiple authors
+ */
+
+#ifndef K2_CSRC_INTERSECT_PIPELINE_H_
+#define K2_CSRC_INTERSECT_PIPELINE_H_
+
+#include <deque>
+#include <future>
+#include <memory>
+
+#include "k2/csrc/array.h"
+#include "k2/csrc/context.h"
+#include "k2/csrc/fsa.h"
+#include "k2/csrc/fsa_algo.h"
+#include "k2/csrc/tensor.h"
+
+namespace k2 {
+
+/*
+  Decodes a stream of batches of neural-net output with IntersectDensePruned()
+  and a shared graph, overlapping the work of consecutive batches.  Each batch
+  runs as a background task (see BackgroundRunner) on its own child context
+  (see Context::Child()), i.e. its own CUDA stream, and does the transfer of
+  its scores to the device, the intersection and the transfer of the lattice
+  to the host; so while one batch is being searched, the scores of the next
+  one can be uploaded and the lattice of the previous one read back, instead
+  of the device waiting for the host on every FormatOutput() and readback.
+
+  At most `max_batches_in_flight` batches are being processed at any time
+  (which bounds the device memory used); the results are returned in the order
+  the batches were pushed.  Usage:
+
+     IntersectDensePrunedPipeline pipeline(graph, 10, 6, 1000, 30);
+     for (...) {
+       pipeline.Push(nnet_output, segments);
+       FsaVec lattice;
+       Array1<int32_t> arc_map_a;
+       while (pipeline.NumFinished() > 0) {
+         pipeline.Pop(&lattice, &arc_map_a);
+         ...
+       }
+     }
+     while (pipeline.NumPending() > 0) pipeline.Pop(&lattice, &arc_map_a);
+
+  The member functions must be called from one thread.
+ */
+class IntersectDensePrunedPipeline {
+ public:
+  /*
+    Constructor.  See IntersectDensePruned() for the meaning of the
+    arguments.
+
+      @param [in] a_fsas   The decoding graph(s); it is prepared with
+                     PrepareDenseIntersectGraph() on its context, whose
+                     child contexts the batches run on.  If it has more than
+                     one FSA, every batch must have a_fsas.Dim0() sequences.
+      @param [in] max_batches_in_flight  The maximum number of batches that
+                     are processed at the same time; must be > 0.  E.g.
+                     3, for the upload of one batch, the search of another
+                     and the readback of a third.
+   */
+  IntersectDensePrunedPipeline(FsaVec &a_fsas, float beam, float lattice_beam,
+                               int32_t max_active_states,
+                               int32_t min_active_states,
+                               int32_t max_batches_in_flight = 3);
+
+  // Waits for the batches that are still being processed.
+  ~IntersectDensePrunedPipeline();
+
+  /*
+    Queues a batch for decoding.  Waits first if max_batches_in_flight
+    batches are being processed, until the oldest of them has finished (its
+    result is kept until Pop() is called).
+
+      @param [in] nnet_output  The neural-net output, as for the constructor
+                     of DenseFsaVec.  It may be on the CPU (it is copied
+                     asynchronously, which is fastest from pinned memory,
+                     see GetPinnedContext()), or on the device of the graph,
+                     in which case the work queued on the graph's context
+                     (stream) when this is called is waited for.  It is not
+                     modified, and a reference to its memory is kept until
+                     the batch has finished.
+      @param [in] supervision_segments  As for the constructor of
+                     DenseFsaVec.
+   */
+  void Push(Tensor &nnet_output, Array2<int32_t> &supervision_segments);
+
+  // Returns the number of batches that were pushed and not yet popped.
+  int32_t NumPending() const { return static_cast<int32_t>(batches_.size()); }
+
+  // Returns the number of batches at the front of the queue that have
+  // finished, i.e. how many calls to Pop() would not wait.
+  int32_t NumFinished() const;
+
+  /*
+    Returns the result of the oldest batch that has not been popped, waiting
+    for it to finish if needed.  Requires NumPending() > 0.
+
+      @param [out] out   The lattice, as from IntersectDensePruned(), on the
+                     CPU.
+      @param [out] arc_map_a  If not nullptr, will be set to the arc map
+                     into the graph, on the CPU.
+   */
+  void Pop(FsaVec *out, Array1<int32_t> *arc_map_a = nullptr);
+
+ private:
+  struct Batch {
+    // Set when the batch has finished.
+    std::promise<void> done;
+    std::future<void> finished;
+    FsaVec out;
+    Array1<int32_t> arc_map_a;
+  };
+
+  // Waits until fewer than max_batches_in_flight_ batches are running.
+  void WaitForSlot();
+
+  ContextPtr c_;  // The context of the graph.
+  DenseIntersectGraph graph_;
+  float beam_;
+  float lattice_beam_;
+  int32_t max_active_states_;
+  int32_t min_active_states_;
+  int32_t max_batches_in_flight_;
+
+  // The batches that were pushed and not popped, oldest first.
+  std::deque<std::unique_ptr<Batch>> batches_;
+  BackgroundRunner runner_;
+};
+
+}  // namespace k2
+
+#endif  // K2_CSRC_INTERSECT_PIPELINE_H_
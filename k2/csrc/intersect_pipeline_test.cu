@@ -0,0 +1,110 @@
+/**
+ * @brief
+ * intersect_pipeline_test
+ *
+ * @copyright
+ * Copyright (c)  2026  agent (agent@local)
+ *
+ * @copyright
+ * See LICENSE for clarification regarding multiple authors
+ */
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "k2/csrc/array.h"
+#include "k2/csrc/context.h"
+#include "k2/csrc/fsa.h"
+#include "k2/csrc/fsa_algo.h"
+#include "k2/csrc/intersect_pipeline.h"
+#include "k2/csrc/tensor.h"
+#include "k2/csrc/test_utils.h"
+
+namespace k2 {
+
+template <DeviceType d>
+void TestIntersectDensePrunedPipeline() {
+  ContextPtr cpu = GetCpuContext();
+  ContextPtr context = (d == kCpu ? cpu : GetCudaContext());
+  FsaVec a_fsas = MakeTestGraph(context);
+
+  // 5 batches of 2 sequences with up to 3 frames, each with different
+  // scores; the nnet output of the odd batches is on the CPU.
+  int32_t num_batches = 5;
+  std::vector<Tensor> nnet_outputs;
+  std::vector<Array2<int32_t>> segments;
+  for (int32_t b = 0; b != num_batches; ++b) {
+    Tensor nnet_output(cpu, kFloatDtype, std::vector<int32_t>{2, 3, 3});
+    float *data = nnet_output.Data<float>();
+    for (int32_t i = 0; i != 18; ++i) data[i] = -((i * 7 + b * 3) % 5);
+    if (b % 2 == 0) nnet_output = nnet_output.To(context);
+    nnet_outputs.push_back(nnet_output);
+    Array2<int32_t> batch_segments(cpu, 2, 2);
+    std::vector<int32_t> segments_vec = {0, 3, 0, 1 + b % 3};
+    std::copy(segments_vec.begin(), segments_vec.end(),
+              batch_segments.Data());
+    segments.push_back(batch_segments);
+  }
+
+  IntersectDensePrunedPipeline pipeline(a_fsas, 10, 10, 10, 1, 2);
+  std::vector<FsaVec> outs;
+  std::vector<Array1<int32_t>> arc_maps;
+  for (int32_t b = 0; b != num_batches; ++b) {
+    pipeline.Push(nnet_outputs[b], segments[b]);
+    EXPECT_LE(pipeline.NumFinished(), pipeline.NumPending());
+    if (b == 2) {
+      // results can be taken before the end.
+      FsaVec out;
+      Array1<int32_t> arc_map_a;
+      pipeline.Pop(&out, &arc_map_a);
+      outs.push_back(out);
+      arc_maps.push_back(arc_map_a);
+    }
+  }
+  EXPECT_EQ(pipeline.NumPending(), num_batches - 1);
+  while (pipeline.NumPending() > 0) {
+    FsaVec out;
+    Array1<int32_t> arc_map_a;
+    pipeline.Pop(&out, &arc_map_a);
+    outs.push_back(out);
+    arc_maps.push_back(arc_map_a);
+  }
+  ASSERT_EQ(static_cast<int32_t>(outs.size()), num_batches);
+
+  // Each result is the same as that of IntersectDensePruned() with the
+  // prepared graph.
+  DenseIntersectGraph graph = PrepareDenseIntersectGraph(a_fsas);
+  int32_t tot_arcs = 0;
+  for (int32_t b = 0; b != num_batches; ++b) {
+    Tensor nnet_output = nnet_outputs[b].To(context);
+    DenseFsaVec b_fsas(nnet_output, segments[b]);
+    FsaVec out;
+    Array1<int32_t> arc_map_a;
+    IntersectDensePruned(graph, b_fsas, 10, 10, 1, &out, &arc_map_a,
+                         nullptr);
+    Array1<Arc> arcs = out.values.To(cpu);
+    Array1<int32_t> arc_map_a_cpu = arc_map_a.To(cpu);
+    EXPECT_EQ(outs[b].Context()->GetDeviceType(), kCpu);
+    ASSERT_EQ(outs[b].values.Dim(), arcs.Dim());
+    ASSERT_EQ(arc_maps[b].Dim(), arcs.Dim());
+    tot_arcs += arcs.Dim();
+    for (int32_t i = 0; i != arcs.Dim(); ++i) {
+      const Arc &arc = outs[b].values[i];
+      EXPECT_EQ(arc.src_state, arcs[i].src_state);
+      EXPECT_EQ(arc.dest_state, arcs[i].dest_state);
+      EXPECT_EQ(arc.symbol, arcs[i].symbol);
+      EXPECT_EQ(arc.score, arcs[i].score);
+      EXPECT_EQ(arc_maps[b][i], arc_map_a_cpu[i]);
+    }
+  }
+  EXPECT_GT(tot_arcs, 0);
+}
+
+TEST(IntersectDensePrunedPipeline, Decode) {
+  TestIntersectDensePrunedPipeline<kCpu>();
+  TestIntersectDensePrunedPipeline<kCuda>();
+}
+
+}  // namespace k2
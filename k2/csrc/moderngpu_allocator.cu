@@ -9,6 +9,9 @@
  * See LICENSE for clarification regarding multiple authors
  */
 
+#include <memory>
+#include <mutex>
+#include <unordered_map>
 #include <utility>
 
 #include "k2/csrc/context.h"
@@ -20,24 +23,47 @@ namespace {
 class ModernGpuAllocator : public mgpu::standard_context_t {
  public:
   explicit ModernGpuAllocator(k2::ContextPtr context)
+      : ModernGpuAllocator(context.get()) {
+    owned_context_ = std::move(context);
+  }
+
+  // This version does not keep `context` alive; it is for the contexts cached
+  // by GetModernGpuContext().
+  explicit ModernGpuAllocator(k2::Context *context)
       : mgpu::standard_context_t(false, context->GetCudaStream()),
-        context_(std::move(context)) {}
+        context_(context) {}
 
   void *alloc(size_t size, mgpu::memory_space_t space) override {
     K2_DCHECK_EQ(space, mgpu::memory_space_device);
-    void *deleter_ = nullptr;
-    void *p = context_->Allocate(size, &deleter_);
-    K2_DCHECK(deleter_ == nullptr);
+    void *deleter_context = nullptr;
+    void *p = context_->Allocate(size, &deleter_context);
+    if (deleter_context != nullptr) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      deleter_contexts_[p] = deleter_context;
+    }
     return p;
   }
 
   void free(void *p, mgpu::memory_space_t space) override {
     K2_DCHECK_EQ(space, mgpu::memory_space_device);
-    context_->Deallocate(p, nullptr);
+    void *deleter_context = nullptr;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto iter = deleter_contexts_.find(p);
+      if (iter != deleter_contexts_.end()) {
+        deleter_context = iter->second;
+        deleter_contexts_.erase(iter);
+      }
+    }
+    context_->Deallocate(p, deleter_context);
   }
 
  private:
-  k2::ContextPtr context_;
+  k2::Context *context_;
+  k2::ContextPtr owned_context_;  // may be NULL
+  std::mutex mutex_;              // protects deleter_contexts_
+  // the deleter_context of allocations for which it was not NULL.
+  std::unordered_map<void *, void *> deleter_contexts_;
 };
 
 }  // namespace
@@ -49,4 +75,39 @@ std::unique_ptr<mgpu::context_t> GetModernGpuAllocator(
   return std::make_unique<ModernGpuAllocator>(GetCudaContext(device_id));
 }
 
+std::unique_ptr<mgpu::context_t> GetModernGpuAllocator(ContextPtr context) {
+  K2_CHECK_EQ(context->GetDeviceType(), kCuda);
+  return std::make_unique<ModernGpuAllocator>(std::move(context));
+}
+
+mgpu::context_t &GetModernGpuContext(const ContextPtr &context) {
+  K2_CHECK_EQ(context->GetDeviceType(), kCuda);
+  struct CacheEntry {
+    std::weak_ptr<Context> context;
+    std::unique_ptr<ModernGpuAllocator> allocator;
+  };
+  static std::mutex mutex;
+  static std::unordered_map<const Context *, CacheEntry> cache;
+  std::lock_guard<std::mutex> lock(mutex);
+  auto iter = cache.find(context.get());
+  // If the entry's context has expired, this is a new Context that happens
+  // to have the same address.
+  if (iter != cache.end() && !iter->second.context.expired())
+    return *iter->second.allocator;
+
+  // Drop the entries of contexts that no longer exist.
+  for (auto it = cache.begin(); it != cache.end();) {
+    if (it->second.context.expired())
+      it = cache.erase(it);
+    else
+      ++it;
+  }
+  // standard_context_t queries the properties of the current device.
+  DeviceGuard guard(*context);
+  CacheEntry &entry = cache[context.get()];
+  entry.context = context;
+  entry.allocator = std::make_unique<ModernGpuAllocator>(context.get());
+  return *entry.allocator;
+}
+
 }  // namespace k2
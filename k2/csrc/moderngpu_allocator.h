@@ -1,7 +1,7 @@
 /**
  * @brief This is an allocator for moderngpu only.
  *
- * Currently it is used by `SortSublists`.
+ * It is used by `SortSublists` and `RowSplitsToRowIds`.
  *
  * @copyright
  * Copyright (c)  2020  Mobvoi Inc.        (authors: Fangjun Kuang)
@@ -15,6 +15,7 @@
 
 #include <memory>
 
+#include "k2/csrc/context.h"
 #include "moderngpu/context.hxx"
 
 namespace k2 {
@@ -22,6 +23,16 @@ namespace k2 {
 // than mgpu::standard_context_t
 std::unique_ptr<mgpu::context_t> GetModernGpuAllocator(int32_t device_id = -1);
 
+// Return a context for moderngpu that allocates memory from `context`, which
+// must be a CUDA context, and runs kernels on its stream.
+std::unique_ptr<mgpu::context_t> GetModernGpuAllocator(ContextPtr context);
+
+// Like GetModernGpuAllocator(context), but the moderngpu context is created
+// only on the first call for a given Context object (this queries the device
+// properties, so is not free) and then reused.  The returned reference is
+// valid for as long as `context` is alive.
+mgpu::context_t &GetModernGpuContext(const ContextPtr &context);
+
 }  // namespace k2
 
 #endif  // K2_CSRC_MODERNGPU_ALLOCATOR_H_
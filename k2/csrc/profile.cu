@@ -0,0 +1,202 @@
+/**
+ * @brief
+ * profile
+ *
+ * @copyright
+ * Copyright (c)  2026  agent (agent@local)
+ *
+ * @copyright
+ * See LICENSE for clarification regarding multiple authors
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <iomanip>
+#include <mutex>
+#include <sstream>
+#include <utility>
+#include <vector>
+
+#ifdef K2_ENABLE_NVTX
+#include "nvToolsExt.h"
+#endif
+
+#include "k2/csrc/log.h"
+#include "k2/csrc/profile.h"
+
+namespace k2 {
+
+namespace {
+
+// A scope whose GPU time is not known yet, as its events may not have
+// completed.
+struct PendingScope {
+  const char *name;
+  int32_t gpu_id;
+  cudaEvent_t begin;
+  cudaEvent_t end;
+};
+
+struct Profile {
+  std::mutex mutex;
+  std::map<std::string, ProfileStats> stats;
+  std::vector<PendingScope> pending;
+};
+
+// The pending scopes are accounted for when there are this many, so that
+// their events are not kept forever.
+constexpr std::size_t kMaxPendingScopes = 1024;
+
+std::atomic<bool> g_profiling_enabled{false};
+
+// The names of the scopes that the current thread is in.
+thread_local std::vector<const char *> scope_names;
+
+Profile &GetProfile() {
+  // Never destroyed, as scopes may end during the static destruction.
+  static Profile *profile = new Profile;
+  return *profile;
+}
+
+/*
+  Adds the GPU time of the pending scopes to the stats and destroys their
+  events.  If `wait` is false, only those whose events have completed are
+  accounted for.  The mutex of `profile` must be held.
+ */
+void AccountPendingScopes(Profile *profile, bool wait) {
+  std::vector<PendingScope> still_pending;
+  for (const PendingScope &scope : profile->pending) {
+    DeviceGuard guard(scope.gpu_id);
+    if (wait) {
+      K2_CHECK_CUDA_ERROR(cudaEventSynchronize(scope.end));
+    } else if (cudaEventQuery(scope.end) != cudaSuccess) {
+      // cudaErrorNotReady is not an error of the stream; clear it.
+      cudaGetLastError();
+      still_pending.push_back(scope);
+      continue;
+    }
+    float ms;
+    K2_CHECK_CUDA_ERROR(cudaEventElapsedTime(&ms, scope.begin, scope.end));
+    ProfileStats &stats = profile->stats[scope.name];
+    stats.gpu_ms += ms;
+    ++stats.gpu_count;
+    K2_CHECK_CUDA_ERROR(cudaEventDestroy(scope.begin));
+    K2_CHECK_CUDA_ERROR(cudaEventDestroy(scope.end));
+  }
+  profile->pending = std::move(still_pending);
+}
+
+}  // namespace
+
+void EnableProfiling(bool enable) { g_profiling_enabled = enable; }
+
+bool ProfilingEnabled() { return g_profiling_enabled; }
+
+void ResetProfile() {
+  Profile &profile = GetProfile();
+  std::lock_guard<std::mutex> lock(profile.mutex);
+  profile.stats.clear();
+  for (const PendingScope &scope : profile.pending) {
+    DeviceGuard guard(scope.gpu_id);
+    K2_CHECK_CUDA_ERROR(cudaEventDestroy(scope.begin));
+    K2_CHECK_CUDA_ERROR(cudaEventDestroy(scope.end));
+  }
+  profile.pending.clear();
+}
+
+std::map<std::string, ProfileStats> GetProfileStats() {
+  Profile &profile = GetProfile();
+  std::lock_guard<std::mutex> lock(profile.mutex);
+  AccountPendingScopes(&profile, true);
+  return profile.stats;
+}
+
+std::string GetProfileReport() {
+  std::map<std::string, ProfileStats> stats = GetProfileStats();
+  std::vector<std::pair<std::string, ProfileStats>> rows(stats.begin(),
+                                                         stats.end());
+  std::sort(rows.begin(), rows.end(),
+            [](const std::pair<std::string, ProfileStats> &a,
+               const std::pair<std::string, ProfileStats> &b) {
+              return a.second.cpu_ms > b.second.cpu_ms;
+            });
+  std::size_t name_width = 4;  // strlen("name")
+  for (const auto &row : rows)
+    name_width = std::max(name_width, row.first.size());
+
+  std::ostringstream os;
+  os << std::left << std::setw(name_width) << "name" << std::right
+     << std::setw(10) << "count" << std::setw(14) << "cpu_ms"
+     << std::setw(14) << "gpu_ms" << "\n";
+  os << std::fixed << std::setprecision(3);
+  for (const auto &row : rows) {
+    const ProfileStats &s = row.second;
+    os << std::left << std::setw(name_width) << row.first << std::right
+       << std::setw(10) << s.count << std::setw(14) << s.cpu_ms;
+    if (s.gpu_count != 0)
+      os << std::setw(14) << s.gpu_ms;
+    else
+      os << std::setw(14) << "-";
+    os << "\n";
+  }
+  return os.str();
+}
+
+namespace internal {
+std::string GetProfileScopeNames() {
+  std::string ans;
+  for (const char *name : scope_names) {
+    if (!ans.empty()) ans += " > ";
+    ans += name;
+  }
+  return ans;
+}
+}  // namespace internal
+
+ProfileScope::ProfileScope(const char *name, ContextPtr c /*= nullptr*/)
+    : name_(name), context_(c), enabled_(ProfilingEnabled()) {
+  scope_names.push_back(name);
+#ifdef K2_ENABLE_NVTX
+  nvtxRangePushA(name);
+#endif
+  if (!enabled_) return;
+  if (context_ != nullptr && context_->GetDeviceType() == kCuda) {
+    DeviceGuard guard(*context_);
+    K2_CHECK_CUDA_ERROR(cudaEventCreate(&begin_event_));
+    K2_CHECK_CUDA_ERROR(
+        cudaEventRecord(begin_event_, context_->GetCudaStream()));
+  }
+  begin_ = std::chrono::steady_clock::now();
+}
+
+ProfileScope::~ProfileScope() {
+  if (enabled_) {
+    double cpu_ms = std::chrono::duration<double, std::milli>(
+                        std::chrono::steady_clock::now() - begin_)
+                        .count();
+    cudaEvent_t end_event = nullptr;
+    if (begin_event_ != nullptr) {
+      DeviceGuard guard(*context_);
+      K2_CHECK_CUDA_ERROR(cudaEventCreate(&end_event));
+      K2_CHECK_CUDA_ERROR(
+          cudaEventRecord(end_event, context_->GetCudaStream()));
+    }
+    Profile &profile = GetProfile();
+    std::lock_guard<std::mutex> lock(profile.mutex);
+    ProfileStats &stats = profile.stats[name_];
+    ++stats.count;
+    stats.cpu_ms += cpu_ms;
+    if (begin_event_ != nullptr) {
+      profile.pending.push_back(
+          {name_, context_->GetDeviceId(), begin_event_, end_event});
+      if (profile.pending.size() >= kMaxPendingScopes)
+        AccountPendingScopes(&profile, false);
+    }
+  }
+  scope_names.pop_back();
+#ifdef K2_ENABLE_NVTX
+  nvtxRangePop();
+#endif
+}
+
+}  // namespace k2
@@ -0,0 +1,111 @@
+/**
+ * @brief
+ * profile
+ *
+ * @note
+ * Scoped profiling of the phases of k2's algorithms.  Each K2_PROFILE_SCOPE()
+ * is an NVTX range (if k2 was built with NVTX), so the phases are named in the
+ * timelines of Nsight Systems, and, if profiling is enabled with
+ * EnableProfiling(true), its CPU time and the time of the work it queued on
+ * the stream of its context are added to the totals of its name, see
+ * GetProfileReport().
+ *
+ * @copyright
+ * Copyright (c)  2026  agent (agent@local)
+ *
+ * @copyright
+ * See LICENSE for clarification regarding multiple authors
+ */
+
+#ifndef K2_CSRC_PROFILE_H_
+#define K2_CSRC_PROFILE_H_
+
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <string>
+
+#include "k2/csrc/context.h"
+
+namespace k2 {
+
+// The totals of the K2_PROFILE_SCOPE()s of one name.
+struct ProfileStats {
+  int64_t count = 0;  // Number of times the scope was entered.
+  // Total wall-clock time, on the host, in milliseconds.
+  double cpu_ms = 0;
+  /* Total time, in milliseconds, between the start and the end of the scope
+     on the stream of its context, i.e. that of the work it queued and of any
+     work queued on that stream meanwhile.  Only the scopes with a CUDA
+     context contribute. */
+  double gpu_ms = 0;
+  int64_t gpu_count = 0;  // Number of scopes that contributed to gpu_ms.
+};
+
+/*
+  Enables or disables the accumulation of the times of the K2_PROFILE_SCOPE()s
+  (the NVTX ranges are emitted either way).  It's disabled by default, as with
+  a CUDA context each scope records two CUDA events.
+ */
+void EnableProfiling(bool enable);
+bool ProfilingEnabled();
+
+// Clears the totals.
+void ResetProfile();
+
+/*
+  Returns the totals of each name since program start or ResetProfile(),
+  while profiling was enabled.  Waits for the CUDA events of the scopes that
+  have not been accounted for yet.
+
+  The times are inclusive: those of nested scopes are also counted in their
+  enclosing scopes.
+ */
+std::map<std::string, ProfileStats> GetProfileStats();
+
+// Returns GetProfileStats() as a table sorted by decreasing CPU time.
+std::string GetProfileReport();
+
+namespace internal {
+// Returns the names of the K2_PROFILE_SCOPE()s that the current thread is in,
+// from the outermost, separated by " > " (empty if none).  They are tracked
+// whether or not profiling is enabled.
+std::string GetProfileScopeNames();
+}  // namespace internal
+
+/*
+  See K2_PROFILE_SCOPE().  `name` must outlive the object (e.g. be a string
+  literal); `c` is the context whose stream is timed, or nullptr for only the
+  CPU time.
+*/
+class ProfileScope {
+ public:
+  explicit ProfileScope(const char *name, ContextPtr c = nullptr);
+  ~ProfileScope();
+
+  ProfileScope(const ProfileScope &) = delete;
+  ProfileScope &operator=(const ProfileScope &) = delete;
+
+ private:
+  const char *name_;
+  ContextPtr context_;
+  bool enabled_;
+  std::chrono::steady_clock::time_point begin_;
+  cudaEvent_t begin_event_ = nullptr;
+};
+
+}  // namespace k2
+
+#define K2_PROFILE_CONCAT_IMPL(a, b) a##b
+#define K2_PROFILE_CONCAT(a, b) K2_PROFILE_CONCAT_IMPL(a, b)
+
+/*
+  Profiles the rest of the enclosing block, e.g.
+     K2_PROFILE_SCOPE("IntersectDensePruned", c);
+  where the optional second argument is the ContextPtr whose stream is timed.
+ */
+#define K2_PROFILE_SCOPE(...)                                      \
+  k2::ProfileScope K2_PROFILE_CONCAT(k2_profile_scope_, __LINE__)( \
+      __VA_ARGS__)
+
+#endif  // K2_CSRC_PROFILE_H_
@@ -0,0 +1,90 @@
+/**
+ * @brief
+ * profile_test
+ *
+ * @copyright
+ * Copyright (c)  2026  agent (agent@local)
+ *
+ * @copyright
+ * See LICENSE for clarification regarding multiple authors
+ */
+
+#include <gtest/gtest.h>
+
+#include <map>
+#include <string>
+
+#include "k2/csrc/array.h"
+#include "k2/csrc/array_ops.h"
+#include "k2/csrc/context.h"
+#include "k2/csrc/profile.h"
+#include "k2/csrc/timer.h"
+
+namespace k2 {
+
+template <DeviceType d>
+void TestProfileScope() {
+  ContextPtr c = (d == kCuda ? GetCudaContext() : GetCpuContext());
+  ResetProfile();
+  EnableProfiling(true);
+  Array1<int32_t> src = Range<int32_t>(c, 10000, 0), dest(c, 10000);
+  for (int32_t i = 0; i != 3; ++i) {
+    K2_PROFILE_SCOPE("TestOuter", c);
+    {
+      K2_PROFILE_SCOPE("TestInner", c);
+      ExclusiveSum(src, &dest);
+    }
+    K2_PROFILE_SCOPE("TestCpuOnly");
+  }
+  EnableProfiling(false);
+  {
+    K2_PROFILE_SCOPE("TestDisabled", c);
+  }
+
+  std::map<std::string, ProfileStats> stats = GetProfileStats();
+  EXPECT_EQ(stats.size(), 3);
+  EXPECT_EQ(stats.count("TestDisabled"), 0);
+  int64_t num_gpu_scopes = (d == kCuda ? 3 : 0);
+  for (const char *name : {"TestOuter", "TestInner"}) {
+    const ProfileStats &s = stats[name];
+    EXPECT_EQ(s.count, 3);
+    EXPECT_EQ(s.gpu_count, num_gpu_scopes);
+    EXPECT_GE(s.cpu_ms, 0);
+    EXPECT_GE(s.gpu_ms, 0);
+  }
+  // The times are inclusive.
+  EXPECT_GE(stats["TestOuter"].cpu_ms, stats["TestInner"].cpu_ms);
+  EXPECT_EQ(stats["TestCpuOnly"].count, 3);
+  EXPECT_EQ(stats["TestCpuOnly"].gpu_count, 0);
+
+  std::string report = GetProfileReport();
+  EXPECT_NE(report.find("TestOuter"), std::string::npos);
+  EXPECT_NE(report.find("TestCpuOnly"), std::string::npos);
+
+  ResetProfile();
+  EXPECT_TRUE(GetProfileStats().empty());
+}
+
+TEST(ProfileTest, ProfileScope) {
+  TestProfileScope<kCpu>();
+  TestProfileScope<kCuda>();
+}
+
+template <DeviceType d>
+void TestTimerWithContext() {
+  ContextPtr c = (d == kCuda ? GetCudaContext() : GetCpuContext());
+  Timer timer(c);
+  Array1<int32_t> src = Range<int32_t>(c, 10000, 0), dest(c, 10000);
+  ExclusiveSum(src, &dest);
+  double elapsed = timer.Elapsed();
+  EXPECT_GE(elapsed, 0);
+  timer.Reset();
+  EXPECT_GE(timer.Elapsed(), 0);
+}
+
+TEST(ProfileTest, TimerWithContext) {
+  TestTimerWithContext<kCpu>();
+  TestTimerWithContext<kCuda>();
+}
+
+}  // namespace k2
@@ -9,16 +9,60 @@
  * See LICENSE for clarification regarding multiple authors
  */
 
+#include <functional>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <utility>
 
+#include "ATen/Parallel.h"
+#include "ATen/cuda/CachingHostAllocator.h"
+#include "ATen/cuda/PinnedMemoryAllocator.h"
 #include "c10/cuda/CUDACachingAllocator.h"
 #include "c10/cuda/CUDAFunctions.h"
+#include "c10/cuda/CUDAGuard.h"
+#include "c10/cuda/CUDAStream.h"
 #include "k2/csrc/context.h"
 #include "k2/csrc/log.h"
 #include "k2/csrc/pytorch_context.h"
 
 namespace k2 {
 
+namespace {
+
+// Memory allocated by one of PyTorch's caching allocators, for a
+// PytorchCudaContext or a PytorchPinnedContext.
+class ManagedDataPtr : public ManagedMemory {
+ public:
+  explicit ManagedDataPtr(c10::DataPtr &&data_ptr)
+      : data_ptr_(std::move(data_ptr)) {}
+
+  const c10::DataPtr &GetDataPtr() const override { return data_ptr_; }
+
+ private:
+  c10::DataPtr data_ptr_;
+};
+
+/*
+  The allocations of PytorchPinnedContext that have not been freed yet, by
+  address, so that RecordStream() can find the allocation that a pointer is
+  in.  (PytorchPinnedContext objects are created by every call to
+  GetPinnedContext(), so this can't be a member.)  It is never destroyed,
+  since Regions may outlive static destruction.
+ */
+struct PinnedAllocations {
+  std::mutex mutex;
+  // maps the start of each allocation to its size and its memory.
+  std::map<const char *, std::pair<std::size_t, ManagedDataPtr *>> map;
+};
+
+PinnedAllocations &GetPinnedAllocations() {
+  static PinnedAllocations *allocations = new PinnedAllocations();
+  return *allocations;
+}
+
+}  // namespace
+
 class PytorchCpuContext : public Context {
  public:
   PytorchCpuContext() {
@@ -28,7 +72,7 @@ class PytorchCpuContext : public Context {
 
   ContextPtr GetCpuContext() override { return shared_from_this(); }
 
-  ContextPtr GetPinnedContext() override { return nullptr; }
+  ContextPtr GetPinnedContext() override { return k2::GetPinnedContext(); }
 
   DeviceType GetDeviceType() const override { return kCpu; }
 
@@ -42,7 +86,7 @@ class PytorchCpuContext : public Context {
     if (deleter_context != nullptr) {
       // a non-empty `deleter_context` indicates that
       // the memory is passed from a `torch::Tensor`
-      delete reinterpret_cast<ManagedTensor *>(deleter_context);
+      delete static_cast<ManagedMemory *>(deleter_context);
     } else {
       allocator_->raw_deallocate(data);
     }
@@ -56,6 +100,74 @@ class PytorchCpuContext : public Context {
   torch::Allocator *allocator_;  // NOT owned here
 };
 
+// Allocates pinned memory with PyTorch's caching host allocator.  Like
+// PyTorch's own copies, we record an event for each stream that uses the
+// memory asynchronously (see RecordStream()), so that the allocator does not
+// hand it out again while those copies may still be running.
+class PytorchPinnedContext : public Context {
+ public:
+  PytorchPinnedContext() {
+    allocator_ = at::cuda::getPinnedMemoryAllocator();
+    K2_CHECK(allocator_->raw_deleter() != nullptr);
+  }
+
+  ContextPtr GetCpuContext() override { return k2::GetCpuContext(); }
+
+  ContextPtr GetPinnedContext() override { return shared_from_this(); }
+
+  DeviceType GetDeviceType() const override { return kCpu; }
+
+  void *Allocate(std::size_t bytes, void **deleter_context) override {
+    auto *memory = new ManagedDataPtr(allocator_->allocate(bytes));
+    void *p = memory->GetDataPtr().get();
+    *deleter_context = static_cast<ManagedMemory *>(memory);
+    if (p != nullptr) {
+      PinnedAllocations &allocations = GetPinnedAllocations();
+      std::lock_guard<std::mutex> lock(allocations.mutex);
+      allocations.map[static_cast<const char *>(p)] =
+          std::make_pair(bytes, memory);
+    }
+    return p;
+  }
+
+  void Deallocate(void *data, void *deleter_context) override {
+    // Releasing the DataPtr gives the memory back to PyTorch's caching host
+    // allocator, which won't reuse it before the events recorded for it by
+    // RecordStream() have completed.
+    if (data != nullptr) {
+      PinnedAllocations &allocations = GetPinnedAllocations();
+      std::lock_guard<std::mutex> lock(allocations.mutex);
+      allocations.map.erase(static_cast<const char *>(data));
+    }
+    delete static_cast<ManagedMemory *>(deleter_context);
+  }
+
+  void RecordStream(const void *data,
+                    const Context &stream_context) const override {
+    const char *p = static_cast<const char *>(data);
+    PinnedAllocations &allocations = GetPinnedAllocations();
+    std::lock_guard<std::mutex> lock(allocations.mutex);
+    auto iter = allocations.map.upper_bound(p);
+    K2_CHECK(iter != allocations.map.begin());
+    --iter;
+    K2_CHECK_LT(p, iter->first + iter->second.first)
+        << "Memory that was not allocated from this context";
+    const c10::DataPtr &data_ptr = iter->second.second->GetDataPtr();
+    c10::cuda::CUDAStream stream = c10::cuda::getStreamFromExternal(
+        stream_context.GetCudaStream(), stream_context.GetDeviceId());
+    auto ret = at::cuda::CachingHostAllocator_recordEvent(data_ptr.get(),
+                                                          stream);
+    K2_CHECK_CUDA_ERROR(ret);
+  }
+
+  bool IsCompatible(const Context &other) const override {
+    return other.GetDeviceType() == kCpu;
+  }
+
+ private:
+  torch::Allocator *allocator_;  // NOT owned here
+};
+
 class PytorchCudaContext : public Context {
  public:
   explicit PytorchCudaContext(int32_t gpu_id) : gpu_id_(gpu_id) {
@@ -74,32 +186,60 @@ class PytorchCudaContext : public Context {
     K2_CHECK(allocator_->raw_deleter() != nullptr);
   }
 
+  // Creates a child context that uses a stream from PyTorch's stream pool;
+  // work on it will wait for work already queued on `parent_stream`.
+  PytorchCudaContext(int32_t gpu_id, cudaStream_t parent_stream)
+      : PytorchCudaContext(gpu_id) {
+    stream_ = c10::cuda::getStreamFromPool(false, gpu_id);
+    cudaEvent_t event;
+    auto ret = cudaEventCreateWithFlags(&event, cudaEventDisableTiming);
+    K2_CHECK_CUDA_ERROR(ret);
+    ret = cudaEventRecord(event, parent_stream);
+    K2_CHECK_CUDA_ERROR(ret);
+    ret = cudaStreamWaitEvent(stream_->stream(), event, 0);
+    K2_CHECK_CUDA_ERROR(ret);
+    ret = cudaEventDestroy(event);
+    K2_CHECK_CUDA_ERROR(ret);
+  }
+
+  ContextPtr Child() override {
+    return std::make_shared<PytorchCudaContext>(gpu_id_, GetCudaStream());
+  }
+
   ContextPtr GetCpuContext() override { return k2::GetCpuContext(); }
 
-  ContextPtr GetPinnedContext() override { return nullptr; }
+  ContextPtr GetPinnedContext() override { return k2::GetPinnedContext(); }
 
   DeviceType GetDeviceType() const override { return kCuda; }
 
   int32_t GetDeviceId() const override { return gpu_id_; }
 
-  cudaStream_t GetCudaStream() const override {
-    return c10::cuda::getCurrentCUDAStream(gpu_id_);
-  }
+  cudaStream_t GetCudaStream() const override { return GetStream().stream(); }
 
   void *Allocate(std::size_t bytes, void **deleter_context) override {
-    void *p = allocator_->raw_allocate(bytes);
-    if (deleter_context != nullptr) *deleter_context = nullptr;
+    // The caching allocator associates the memory with the current stream,
+    // i.e. the stream this context uses at the time of the call.
+    c10::cuda::CUDAStreamGuard guard(GetStream());
+    auto *memory = new ManagedDataPtr(allocator_->allocate(bytes));
+    void *p = memory->GetDataPtr().get();
+    *deleter_context = static_cast<ManagedMemory *>(memory);
     return p;
   }
 
-  void Deallocate(void *data, void *deleter_context) override {
-    if (deleter_context != nullptr) {
-      // a non-empty `deleter_context` indicates that
-      // the memory is passed from a `torch::Tensor`
-      delete reinterpret_cast<ManagedTensor *>(deleter_context);
-    } else {
-      allocator_->raw_deallocate(data);
-    }
+  void Deallocate(void * /*data*/, void *deleter_context) override {
+    // `deleter_context` is from Allocate() or, for memory passed from a
+    // `torch::Tensor`, from NewRegion().
+    auto *memory = static_cast<ManagedMemory *>(deleter_context);
+    const c10::DataPtr &data_ptr = memory->GetDataPtr();
+    // The memory may have been used on our stream while it is associated with
+    // another one (it is a tensor from PyTorch used by a child context, or
+    // PyTorch's current stream has changed since it was allocated); in that
+    // case the caching allocator must not reuse it until the work queued on
+    // our stream so far is done.  This is a no-op for the stream the memory
+    // was allocated on, and for memory not from the caching allocator.
+    if (data_ptr.get() != nullptr)
+      c10::cuda::CUDACachingAllocator::recordStream(data_ptr, GetStream());
+    delete memory;
   }
 
   bool IsCompatible(const Context &other) const override {
@@ -109,11 +249,24 @@ class PytorchCudaContext : public Context {
   void Sync() const override {
     auto ret = cudaStreamSynchronize(GetCudaStream());
     K2_CHECK_CUDA_ERROR(ret);
+    internal::RecordSync(*this);
   }
 
  private:
+  // Returns the stream of a child context, or else PyTorch's current stream
+  // at the time of the call, so that k2's work is ordered with the work that
+  // PyTorch queues on the same stream (e.g. inside a
+  // `with torch.cuda.stream(s):` block) without device-wide syncs.
+  c10::cuda::CUDAStream GetStream() const {
+    if (stream_.has_value()) return *stream_;
+    return c10::cuda::getCurrentCUDAStream(gpu_id_);
+  }
+
   torch::Allocator *allocator_;  // NOT owned here
   int32_t gpu_id_;
+  // Set only for contexts created by Child(); otherwise we use PyTorch's
+  // current stream.
+  c10::optional<c10::cuda::CUDAStream> stream_;
 };
 
 ContextPtr GetCpuContext() { return std::make_shared<PytorchCpuContext>(); }
@@ -123,6 +276,19 @@ ContextPtr GetCudaContext(int32_t gpu_id /*= -1*/) {
   return std::make_shared<PytorchCudaContext>(gpu_id);
 }
 
+ContextPtr GetPinnedContext() {
+  return std::make_shared<PytorchPinnedContext>();
+}
+
+void ReleaseCachedMemory() {
+  c10::cuda::CUDACachingAllocator::emptyCache();
+  at::cuda::CachingHostAllocator_emptyCache();
+}
+
+void SetMaxCachedMemory(std::size_t /*max_bytes*/) {
+  // PyTorch's caching allocator manages the size of its own cache.
+}
+
 RegionPtr NewRegion(torch::Tensor &tensor) {
   auto ans = std::make_shared<Region>();
   if (tensor.device().type() == torch::kCPU) {
@@ -140,10 +306,26 @@ RegionPtr NewRegion(torch::Tensor &tensor) {
   // It will be freed in `Context::Deallocate`.
   auto *managed_tensor = new ManagedTensor(tensor);
   ans->data = tensor.data_ptr();
-  ans->deleter_context = managed_tensor;
-  ans->num_bytes = tensor.nbytes();
+  ans->deleter_context = static_cast<ManagedMemory *>(managed_tensor);
+  // The memory spans from the first element to the end of the last one, which
+  // is more than tensor.nbytes() if the tensor is strided (e.g. a slice); the
+  // strides are assumed to be non-negative.
+  int64_t num_elements = tensor.numel() == 0 ? 0 : 1;
+  for (int64_t i = 0; num_elements != 0 && i < tensor.dim(); ++i)
+    num_elements += (tensor.size(i) - 1) * tensor.stride(i);
+  ans->num_bytes = num_elements * tensor.element_size();
   ans->bytes_used = ans->num_bytes;
+  // The destructor of Region records a free, so for the statistics this
+  // counts as an allocation even though the memory is owned by `tensor`.
+  internal::RecordAlloc(*ans->context, ans->num_bytes);
   return ans;
 }
 
+void TorchParallelFor(int32_t n, int32_t min_size,
+                      const std::function<void(int32_t, int32_t)> &f) {
+  at::parallel_for(0, n, min_size, [&f](int64_t begin, int64_t end) -> void {
+    f(static_cast<int32_t>(begin), static_cast<int32_t>(end));
+  });
+}
+
 }  // namespace k2
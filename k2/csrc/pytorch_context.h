@@ -13,6 +13,7 @@
 #ifndef K2_CSRC_PYTORCH_CONTEXT_H_
 #define K2_CSRC_PYTORCH_CONTEXT_H_
 
+#include <functional>
 #include <memory>
 
 #include "k2/csrc/context.h"
@@ -20,10 +21,25 @@
 
 namespace k2 {
 
-class ManagedTensor {
+// Memory owned by PyTorch that a Region refers to; the deleter_context of such
+// regions points to a ManagedMemory, and deleting it releases the memory.
+class ManagedMemory {
+ public:
+  virtual ~ManagedMemory() = default;
+
+  // Returns the DataPtr of the memory, e.g. for recordStream() of the CUDA
+  // caching allocator.
+  virtual const c10::DataPtr &GetDataPtr() const = 0;
+};
+
+class ManagedTensor : public ManagedMemory {
  public:
   explicit ManagedTensor(torch::Tensor &tensor) : handle_(tensor) {}
 
+  const c10::DataPtr &GetDataPtr() const override {
+    return handle_.storage().data_ptr();
+  }
+
  private:
   torch::Tensor handle_;  // retain a copy of the tensor passed from Python
 };
@@ -34,6 +50,16 @@ class ManagedTensor {
 // the given tensor.
 RegionPtr NewRegion(torch::Tensor &tensor);
 
+/*
+  An implementation of ParallelFor() with at::parallel_for(), i.e. with
+  PyTorch's intra-op thread pool, whose size is set with torch.set_num_threads()
+  (at::set_num_threads()); for use with SetParallelForImpl().  Like
+  at::parallel_for(), it runs in the calling thread if called from inside a
+  parallel region.
+ */
+void TorchParallelFor(int32_t n, int32_t min_size,
+                      const std::function<void(int32_t, int32_t)> &f);
+
 }  // namespace k2
 
 #endif  // K2_CSRC_PYTORCH_CONTEXT_H_
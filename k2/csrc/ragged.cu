@@ -10,11 +10,18 @@
  * See LICENSE for clarification regarding multiple authors
  */
 
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
 #include <cub/cub.cuh>
+#include <limits>
+#include <mutex>
+#include <numeric>
 #include <vector>
 
 #include "k2/csrc/array_ops.h"
 #include "k2/csrc/math.h"
+#include "k2/csrc/profile.h"
 #include "k2/csrc/ragged.h"
 namespace {
 
@@ -65,6 +72,28 @@ struct iterator_traits<::RowSplitsDiff> {
 
 namespace k2 {
 
+namespace {
+std::atomic<int64_t> num_shape_syncs(0);
+// Number of ForbidShapeSyncs objects that exist on the current thread.
+thread_local int32_t num_forbid_shape_syncs = 0;
+}  // namespace
+
+int64_t GetNumShapeSyncs() { return num_shape_syncs.load(); }
+
+ForbidShapeSyncs::ForbidShapeSyncs() { ++num_forbid_shape_syncs; }
+
+ForbidShapeSyncs::~ForbidShapeSyncs() { --num_forbid_shape_syncs; }
+
+namespace internal {
+void RecordShapeSync(const Context &c, const char *caller) {
+  num_shape_syncs.fetch_add(1, std::memory_order_relaxed);
+  AuditShapeSync(c, caller);
+  if (num_forbid_shape_syncs > 0)
+    K2_LOG(FATAL) << caller << " had to read a size from memory on "
+                  << c.GetDeviceType() << " while ForbidShapeSyncs is active";
+}
+}  // namespace internal
+
 RaggedShape RandomRaggedShape(bool set_row_ids, int32_t min_num_axes,
                               int32_t max_num_axes, int32_t min_num_elements,
                               int32_t max_num_elements) {
@@ -147,6 +176,17 @@ std::ostream &operator<<(std::ostream &stream, RaggedShape &shape) {
   }
 }
 
+/*
+  Returns the mutex that guards the creation of row_ids for the RaggedShape at
+  address `shape`.  We use a fixed pool of mutexes rather than one per shape,
+  as RaggedShape is copyable and creating row_ids is rare.
+ */
+static std::mutex &GetRowIdsMutex(const RaggedShape *shape) {
+  static std::mutex mutexes[64];
+  return mutexes[(reinterpret_cast<std::uintptr_t>(shape) /
+                  sizeof(RaggedShape)) % 64];
+}
+
 Array1<int32_t> &RaggedShape::RowIds(int32_t axis) {
   K2_CHECK_GT(axis, 0);
   K2_CHECK_LT(axis, NumAxes());
@@ -156,9 +196,14 @@ Array1<int32_t> &RaggedShape::RowIds(int32_t axis) {
   // there must be row_splits.Dim() >=1 according to the definition of
   // RaggedShapeDim.
   K2_CHECK_GE(row_splits.Dim(), 1);
-  if (row_splits.Dim() != 1 && row_ids.Dim() == 0) {
+  std::lock_guard<std::mutex> lock(GetRowIdsMutex(this));
+  if (row_splits.Dim() == 1 && row_ids.GetRegion() == nullptr) {
+    // There are no rows, so no elements; give row_ids a region anyway so that
+    // callers can take its Data().
+    row_ids = Array1<int32_t>(Context(), 0);
+  } else if (row_splits.Dim() != 1 && row_ids.Dim() == 0) {
     // create row_ids as it does not exist
-    row_ids = Array1<int32_t>(Context(), row_splits[row_splits.Dim() - 1]);
+    row_ids = Array1<int32_t>(Context(), TotSize(axis));
     const int32_t *row_splits_data = row_splits.Data();
     int32_t *row_ids_data = row_ids.Data();
     RowSplitsToRowIds(Context(), row_splits.Dim() - 1, row_splits_data,
@@ -169,6 +214,60 @@ Array1<int32_t> &RaggedShape::RowIds(int32_t axis) {
   return row_ids;
 }
 
+void RaggedShape::Prefetch(const std::vector<int32_t> &axes) {
+  ContextPtr c = Context();
+  std::lock_guard<std::mutex> lock(GetRowIdsMutex(this));
+  // The axes whose row_ids we need to create.
+  std::vector<int32_t> todo;
+  for (int32_t axis : axes) {
+    K2_CHECK_GT(axis, 0);
+    K2_CHECK_LT(axis, NumAxes());
+    const RaggedShapeDim &rsd = axes_[axis - 1];
+    if (rsd.row_ids.Dim() == 0 && TotSize(axis) != 0 &&
+        std::find(todo.begin(), todo.end(), axis) == todo.end())
+      todo.push_back(axis);
+  }
+  if (todo.empty()) return;
+  int32_t num_todo = static_cast<int32_t>(todo.size());
+
+  // The table has the row_splits of each axis to do, and `ints` has
+  // num_todo + 1 offsets into `mem` (the exclusive sum of the TotSize() of
+  // the axes) followed by num_todo numbers of rows.
+  std::vector<const int32_t *> row_splits_ptrs(num_todo);
+  std::vector<int32_t> ints(2 * num_todo + 1);
+  int32_t *offsets = ints.data(), *num_rows = offsets + num_todo + 1;
+  offsets[0] = 0;
+  for (int32_t k = 0; k < num_todo; ++k) {
+    const RaggedShapeDim &rsd = axes_[todo[k] - 1];
+    row_splits_ptrs[k] = rsd.row_splits.Data();
+    num_rows[k] = rsd.row_splits.Dim() - 1;
+    offsets[k + 1] = offsets[k] + TotSize(todo[k]);
+  }
+  int32_t tot_size = offsets[num_todo];
+
+  const int32_t *const *row_splits_ptrs_data;
+  const int32_t *ints_data;
+  Array1<char> table = internal::UploadTable(c, row_splits_ptrs, ints,
+                                             &row_splits_ptrs_data, &ints_data);
+  const int32_t *offsets_data = ints_data,
+                *num_rows_data = ints_data + num_todo + 1;
+  Array1<int32_t> mem(c, tot_size);
+  int32_t *mem_data = mem.Data();
+  auto lambda_set_row_ids = [=] __host__ __device__(int32_t i) -> void {
+    int32_t k = 0;
+    while (i >= offsets_data[k + 1]) ++k;
+    mem_data[i] = FindRow(row_splits_ptrs_data[k], num_rows_data[k],
+                          i - offsets_data[k]);
+  };
+  Eval(c, tot_size, lambda_set_row_ids);
+
+  for (int32_t k = 0; k < num_todo; ++k) {
+    RaggedShapeDim &rsd = axes_[todo[k] - 1];
+    rsd.row_ids = mem.Range(offsets[k], offsets[k + 1] - offsets[k]);
+    rsd.cached_tot_size = rsd.row_ids.Dim();
+  }
+}
+
 int32_t RaggedShape::MaxSize(int32_t axis) {
   K2_CHECK_GT(axis, 0);
   K2_CHECK_LT(axis, NumAxes());
@@ -207,6 +306,147 @@ int32_t RaggedShape::MaxSize(int32_t axis) {
   }
 }
 
+// Returns the bin of RaggedAxisStats::histogram that a row of length `size`
+// goes in.
+static __host__ __device__ __forceinline__ int32_t ShapeStatsBin(int32_t size) {
+  int32_t bin = 0;
+  while (size != 0 && bin < kShapeStatsNumBins - 1) {
+    size >>= 1;
+    ++bin;
+  }
+  return bin;
+}
+
+std::vector<RaggedAxisStats> ShapeStats(RaggedShape &shape) {
+  ContextPtr c = shape.Context();
+  int32_t num_axes = shape.NumAxes() - 1;
+  // For each chunk of rows, and in the end for each axis, we compute
+  // kNumFields numbers: the max and min length, the number of elements, and
+  // the histogram.
+  constexpr int32_t kNumFields = 3 + kShapeStatsNumBins;
+  std::vector<RaggedAxisStats> ans(num_axes);
+
+  // The rows of each axis are split into chunks of `chunk_size` rows; the
+  // first kernel reduces each chunk and the second one, the chunks of each
+  // axis.  chunk_size is chosen so that neither loops over too many items.
+  std::vector<const int32_t *> row_splits_ptrs(num_axes);
+  // `ints` has num_axes + 1 offsets of the first chunk of each axis,
+  // followed by num_axes numbers of rows.
+  std::vector<int32_t> ints(2 * num_axes + 1);
+  int32_t *chunk_offsets = ints.data(), *num_rows = chunk_offsets + num_axes + 1;
+  int32_t max_num_rows = 0;
+  for (int32_t k = 0; k < num_axes; ++k) {
+    const Array1<int32_t> &row_splits = shape.RowSplits(k + 1);
+    row_splits_ptrs[k] = row_splits.Data();
+    num_rows[k] = row_splits.Dim() - 1;
+    max_num_rows = std::max(max_num_rows, num_rows[k]);
+  }
+  int32_t chunk_size = std::max<int32_t>(256, max_num_rows / 1024 + 1);
+  chunk_offsets[0] = 0;
+  for (int32_t k = 0; k < num_axes; ++k)
+    chunk_offsets[k + 1] =
+        chunk_offsets[k] + (num_rows[k] + chunk_size - 1) / chunk_size;
+  int32_t num_chunks = chunk_offsets[num_axes];
+
+  const int32_t *const *row_splits_ptrs_data;
+  const int32_t *ints_data;
+  Array1<char> table = internal::UploadTable(c, row_splits_ptrs, ints,
+                                             &row_splits_ptrs_data, &ints_data);
+  const int32_t *chunk_offsets_data = ints_data,
+                *num_rows_data = ints_data + num_axes + 1;
+
+  const int32_t int32_max = std::numeric_limits<int32_t>::max();
+  // chunk_stats[chunk * kNumFields + field].
+  Array1<int32_t> chunk_stats(c, std::max<int32_t>(num_chunks, 1) * kNumFields);
+  int32_t *chunk_stats_data = chunk_stats.Data();
+  auto lambda_reduce_chunks = [=] __host__ __device__(int32_t chunk) -> void {
+    int32_t k = 0;
+    while (chunk >= chunk_offsets_data[k + 1]) ++k;
+    const int32_t *row_splits_data = row_splits_ptrs_data[k];
+    int32_t begin = (chunk - chunk_offsets_data[k]) * chunk_size,
+            end = begin + chunk_size;
+    if (end > num_rows_data[k]) end = num_rows_data[k];
+    int32_t *stats = chunk_stats_data + chunk * kNumFields;
+    int32_t max_size = 0, min_size = int32_max;
+    for (int32_t b = 0; b < kShapeStatsNumBins; ++b) stats[3 + b] = 0;
+    for (int32_t row = begin; row < end; ++row) {
+      int32_t size = row_splits_data[row + 1] - row_splits_data[row];
+      if (size > max_size) max_size = size;
+      if (size < min_size) min_size = size;
+      ++stats[3 + ShapeStatsBin(size)];
+    }
+    stats[0] = max_size;
+    stats[1] = min_size;
+    stats[2] = row_splits_data[end] - row_splits_data[begin];
+  };
+  if (num_chunks > 0) Eval(c, num_chunks, lambda_reduce_chunks);
+
+  Array1<int32_t> stats(c, num_axes * kNumFields);
+  int32_t *stats_data = stats.Data();
+  auto lambda_reduce_axes = [=] __host__ __device__(int32_t i) -> void {
+    int32_t k = i / kNumFields, field = i % kNumFields;
+    int32_t result = (field == 1 && num_rows_data[k] != 0 ? int32_max : 0);
+    for (int32_t chunk = chunk_offsets_data[k];
+         chunk < chunk_offsets_data[k + 1]; ++chunk) {
+      int32_t value = chunk_stats_data[chunk * kNumFields + field];
+      if (field == 0)
+        result = (value > result ? value : result);
+      else if (field == 1)
+        result = (value < result ? value : result);
+      else
+        result += value;
+    }
+    stats_data[i] = result;
+  };
+  Eval(c, num_axes * kNumFields, lambda_reduce_axes);
+
+  internal::RecordShapeSync(*c, "ShapeStats()");
+  Array1<int32_t> stats_cpu = stats.To(GetCpuContext());
+  const int32_t *stats_cpu_data = stats_cpu.Data();
+  for (int32_t k = 0; k < num_axes; ++k) {
+    const int32_t *this_stats = stats_cpu_data + k * kNumFields;
+    RaggedAxisStats &axis_stats = ans[k];
+    axis_stats.num_rows = num_rows[k];
+    axis_stats.max_size = this_stats[0];
+    axis_stats.min_size = this_stats[1];
+    axis_stats.tot_size = this_stats[2];
+    axis_stats.mean_size =
+        (num_rows[k] != 0 ? axis_stats.tot_size / static_cast<float>(num_rows[k])
+                          : 0.0f);
+    for (int32_t b = 0; b < kShapeStatsNumBins; ++b)
+      axis_stats.histogram[b] = this_stats[3 + b];
+  }
+  return ans;
+}
+
+/*
+  Sets *begin_out = row_splits[begin] and *end_out = row_splits[end], reading
+  both values back from the device with one transfer.  Used where a shape
+  operation needs to know, on the host, the range of a sub-shape on the next
+  axis.
+ */
+static void GetRange(const char *caller, const Array1<int32_t> &row_splits,
+                     int32_t begin, int32_t end, int32_t *begin_out,
+                     int32_t *end_out) {
+  ContextPtr &c = row_splits.Context();
+  internal::RecordShapeSync(*c, caller);
+  if (c->GetDeviceType() == kCpu) {
+    *begin_out = row_splits.Data()[begin];
+    *end_out = row_splits.Data()[end];
+    return;
+  }
+  Array1<int32_t> range(c, 2);
+  int32_t *range_data = range.Data();
+  const int32_t *row_splits_data = row_splits.Data();
+  auto lambda_get_range = [=] __host__ __device__(int32_t i) -> void {
+    range_data[i] = row_splits_data[i == 0 ? begin : end];
+  };
+  Eval(c, 2, lambda_get_range);
+  range = range.To(GetCpuContext());
+  *begin_out = range[0];
+  *end_out = range[1];
+}
+
 RaggedShape RaggedShape::Index(int32_t axis, int32_t i) {
   // only support `axis == 0` for now
   K2_CHECK_EQ(axis, 0);
@@ -216,39 +456,118 @@ RaggedShape RaggedShape::Index(int32_t axis, int32_t i) {
   const auto &src_axes = Axes();
   K2_CHECK_LT(i + 1, src_axes[0].row_splits.Dim());
 
-  int32_t idx = src_axes[0].row_splits[i];
-  int32_t idx_next = src_axes[0].row_splits[i + 1];
-  std::vector<RaggedShapeDim> axes(src_axes.size() - 1);
   ContextPtr c = Context();
+  int32_t idx, idx_next;
+  GetRange("RaggedShape::Index()", src_axes[0].row_splits, i, i + 1, &idx,
+           &idx_next);
+  std::vector<RaggedShapeDim> axes(src_axes.size() - 1);
   for (int32_t i = 2; i < num_axes; ++i) {
     const Array1<int32_t> &src_row_splits = src_axes[i - 1].row_splits;
     int32_t num_rows = idx_next - idx;
     int32_t offset = idx;
-    idx = src_row_splits[idx];
-    idx_next = src_row_splits[idx_next];
+    GetRange("RaggedShape::Index()", src_row_splits, idx, idx_next, &idx,
+             &idx_next);
     // allocate new memory here as we need to change the values,
     // i.e. subtracts the offset.
     axes[i - 2].row_splits = Array1<int32_t>(c, num_rows + 1);
     int32_t *data = axes[i - 2].row_splits.Data();
     const int32_t *src_data = src_row_splits.Data();
+    int32_t value_offset = idx;
     auto lambda_set_values = [=] __host__ __device__(int32_t i) -> void {
-      data[i] = src_data[i + offset] - idx;
+      data[i] = src_data[i + offset] - value_offset;
     };
     Eval(c, num_rows + 1, lambda_set_values);
-    // leave row_ids and cached_tot_size unset
-    axes[i - 2].cached_tot_size = -1;
+    // leave row_ids unset; we know the number of elements.
+    axes[i - 2].cached_tot_size = idx_next - idx;
   }
-  RaggedShape shape(axes, true);
-  return shape;
+  return RaggedShape(axes);
 }
 
-void RaggedShape::Populate() {
-  int32_t num_axes = NumAxes();
+RaggedShape Arange(RaggedShape &src, int32_t axis, int32_t begin, int32_t end,
+                   int32_t *value_offset /*= nullptr*/) {
+  K2_CHECK_EQ(axis, 0) << "Arange() with axis > 0 not yet supported";
+  K2_CHECK_GE(begin, 0);
+  K2_CHECK_LE(begin, end);
+  K2_CHECK_LE(end, src.Dim0());
+  int32_t num_axes = src.NumAxes();
+  ContextPtr c = src.Context();
+  std::vector<RaggedShapeDim> axes(num_axes - 1);
   for (int32_t i = 1; i < num_axes; ++i) {
-    // ignore return values of the following calls.
-    this->TotSize(i);
-    this->RowIds(i);
+    Array1<int32_t> &src_row_splits = src.RowSplits(i);
+    int32_t num_rows = end - begin;
+    axes[i - 1].row_splits = Array1<int32_t>(c, num_rows + 1);
+    int32_t *data = axes[i - 1].row_splits.Data();
+    const int32_t *src_data = src_row_splits.Data() + begin;
+    // the range on the next axis.
+    GetRange("Arange()", src_row_splits, begin, end, &begin, &end);
+    int32_t offset = begin;
+    auto lambda_set_values = [=] __host__ __device__(int32_t i) -> void {
+      data[i] = src_data[i] - offset;
+    };
+    Eval(c, num_rows + 1, lambda_set_values);
+    // leave row_ids unset
+    axes[i - 1].cached_tot_size = end - begin;
   }
+  if (value_offset != nullptr) *value_offset = begin;
+  return RaggedShape(axes, true);
+}
+
+std::vector<RaggedShape> Arange(RaggedShape &src,
+                                const std::vector<int32_t> &offsets,
+                                std::vector<int32_t> *value_offsets
+                                /*= nullptr*/) {
+  K2_CHECK(!offsets.empty());
+  int32_t num_pieces = static_cast<int32_t>(offsets.size()) - 1,
+          num_axes = src.NumAxes();
+  K2_CHECK_GE(offsets[0], 0);
+  for (int32_t i = 0; i < num_pieces; ++i)
+    K2_CHECK_LE(offsets[i], offsets[i + 1]);
+  K2_CHECK_LE(offsets.back(), src.Dim0());
+  ContextPtr c = src.Context();
+  // axes[p] will be the axes of piece p.
+  std::vector<std::vector<RaggedShapeDim>> axes(
+      num_pieces, std::vector<RaggedShapeDim>(num_axes - 1));
+  // The boundaries of the pieces on the current axis, then on the next one.
+  std::vector<int32_t> cur_offsets(offsets), next_offsets(offsets.size());
+  for (int32_t i = 1; i < num_axes; ++i) {
+    Array1<int32_t> &src_row_splits = src.RowSplits(i);
+    internal::RecordShapeSync(*c, "Arange()");
+    HostReadback<int32_t> readback(c);
+    for (int32_t offset : cur_offsets) readback.Add(src_row_splits, offset);
+    readback.Fetch();
+    for (std::size_t j = 0; j != cur_offsets.size(); ++j)
+      next_offsets[j] = readback[j];
+    for (int32_t p = 0; p < num_pieces; ++p) {
+      int32_t num_rows = cur_offsets[p + 1] - cur_offsets[p],
+              offset = next_offsets[p];
+      RaggedShapeDim &axis = axes[p][i - 1];
+      axis.row_splits = Array1<int32_t>(c, num_rows + 1);
+      int32_t *data = axis.row_splits.Data();
+      const int32_t *src_data = src_row_splits.Data() + cur_offsets[p];
+      auto lambda_set_values = [=] __host__ __device__(int32_t i) -> void {
+        data[i] = src_data[i] - offset;
+      };
+      Eval(c, num_rows + 1, lambda_set_values);
+      // leave row_ids unset
+      axis.cached_tot_size = next_offsets[p + 1] - offset;
+    }
+    std::swap(cur_offsets, next_offsets);
+  }
+  if (value_offsets != nullptr) *value_offsets = cur_offsets;
+  std::vector<RaggedShape> ans;
+  ans.reserve(num_pieces);
+  for (int32_t p = 0; p < num_pieces; ++p) ans.emplace_back(axes[p], true);
+  return ans;
+}
+
+void RaggedShape::Populate() {
+  int32_t num_axes = NumAxes();
+  std::vector<int32_t> axes(num_axes - 1);
+  std::iota(axes.begin(), axes.end(), 1);
+  Prefetch(axes);
+  // Prefetch() only sets cached_tot_size where it creates row_ids.
+  for (int32_t i = 1; i < num_axes; ++i)
+    axes_[i - 1].cached_tot_size = TotSize(i);
 }
 
 RaggedShape RaggedShape::To(ContextPtr ctx) const {
@@ -257,8 +576,9 @@ RaggedShape RaggedShape::To(ContextPtr ctx) const {
   int32_t num_axes = NumAxes();
   for (int32_t i = 1; i < num_axes; ++i) {
     axes[i - 1].row_splits = axes_[i - 1].row_splits.To(ctx);
-    // leave row_ids and cached_tot_size unset
-    axes[i - 1].cached_tot_size = -1;
+    // leave row_ids unset; the cached_tot_size is known on the host, so
+    // keep it.
+    axes[i - 1].cached_tot_size = axes_[i - 1].cached_tot_size;
   }
   return RaggedShape(axes);
 }
@@ -285,6 +605,10 @@ int32_t RaggedShape::TotSize(int32_t axis) const {
   K2_CHECK_LT(axis, NumAxes());
   if (axis == 0)
     return Dim0();
+  else if (axis + 1 < NumAxes())
+    // the number of rows on the next axis.  This is known on the host, so we
+    // don't need cached_tot_size here.
+    return axes_[axis].row_splits.Dim() - 1;
   else {
     const RaggedShapeDim &rsd = axes_[axis - 1];
     if (rsd.cached_tot_size >= 0) {
@@ -293,17 +617,32 @@ int32_t RaggedShape::TotSize(int32_t axis) const {
       // if we had row_ids set up, we should have set cached_tot_size.
       K2_CHECK_EQ(rsd.row_ids.Dim(), 0);
       K2_CHECK_GT(rsd.row_splits.Dim(), 0);
+      internal::RecordShapeSync(*Context(), "RaggedShape::TotSize()");
       const_cast<RaggedShapeDim &>(rsd).cached_tot_size = rsd.row_splits.Back();
       return rsd.cached_tot_size;
     }
   }
 }
 
+void RaggedShape::SetNumElements(int32_t num_elements) {
+  RaggedShapeDim &rsd = axes_.back();
+  if (rsd.cached_tot_size >= 0) {
+    K2_CHECK_EQ(rsd.cached_tot_size, num_elements);
+  } else {
+    K2_CHECK_EQ(rsd.row_ids.Dim(), 0);
+    // may be slow as it may copy memory from device to host
+    K2_DCHECK_EQ(rsd.row_splits.Back(), num_elements);
+    rsd.cached_tot_size = num_elements;
+  }
+}
+
 void RaggedShape::Check() {
   ContextPtr c = Context();
   int32_t num_axes = axes_.size();
   for (int32_t axis = 0; axis < num_axes; ++axis) {
-    RaggedShapeDim &rsd = axes_[axis];
+    // Const, as taking non-const pointers to the data would invalidate the
+    // results cached for it, e.g. FSA properties (see Region::version).
+    const RaggedShapeDim &rsd = axes_[axis];
     K2_CHECK_GE(rsd.row_splits.Dim(), 0);
     if (rsd.cached_tot_size >= 0) {
       K2_CHECK(rsd.row_splits.Dim() == 0 ||
@@ -408,10 +747,12 @@ RaggedShape RaggedShape2(Array1<int32_t> *row_splits, Array1<int32_t> *row_ids,
   ContextPtr ctx = ::GetContext(row_splits, row_ids);
   if (cached_tot_size != -1) {
     if (row_ids != nullptr) K2_CHECK_EQ(cached_tot_size, row_ids->Dim());
-    if (row_splits != nullptr) {
-      // may be slow as it may copy memory from device to host
-      K2_CHECK_EQ(cached_tot_size, row_splits->Back());
-    }
+    // may be slow as it may copy memory from device to host, so only check
+    // it in debug mode.
+    if (row_splits != nullptr)
+      K2_DCHECK_EQ(cached_tot_size, row_splits->Back());
+  } else if (row_ids != nullptr) {
+    cached_tot_size = row_ids->Dim();
   }
   std::vector<RaggedShapeDim> axes(1);
   if (row_splits != nullptr) {
@@ -420,6 +761,7 @@ RaggedShape RaggedShape2(Array1<int32_t> *row_splits, Array1<int32_t> *row_ids,
     // we need to work out row_splits as we always require row_splits is not
     // empty for RaggedShape. Note here we suppose the last element in row_ids
     // is num_rows - 1, i.e. there's no empty rows after row `row_ids[-1]`.
+    if (row_ids->Dim() != 0) internal::RecordShapeSync(*ctx, "RaggedShape2()");
     int32_t num_rows = row_ids->Dim() == 0 ? 0 : row_ids->Back() + 1;
     Array1<int32_t> row_splits_array(ctx, num_rows + 1);
     RowIdsToRowSplits(*row_ids, row_splits_array);
@@ -463,19 +805,21 @@ RaggedShape RaggedShape3(Array1<int32_t> *row_splits1,
   // check row_splits and row_ids of axis-1
   if (cached_tot_size1 != -1) {
     if (row_ids1 != nullptr) K2_CHECK_EQ(cached_tot_size1, row_ids1->Dim());
-    if (row_splits1 != nullptr) {
-      // may be slow as it may copy memory from device to host
-      K2_CHECK_EQ(cached_tot_size1, row_splits1->Back());
-    }
+    // may be slow as it may copy memory from device to host
+    if (row_splits1 != nullptr)
+      K2_DCHECK_EQ(cached_tot_size1, row_splits1->Back());
+  } else if (row_ids1 != nullptr) {
+    cached_tot_size1 = row_ids1->Dim();
   }
 
   // check row_splits and row_ids of axis-2
   if (cached_tot_size2 != -1) {
     if (row_ids2 != nullptr) K2_CHECK_EQ(cached_tot_size2, row_ids2->Dim());
-    if (row_splits2 != nullptr) {
-      // may be slow as it may copy memory from device to host
-      K2_CHECK_EQ(cached_tot_size2, row_splits2->Back());
-    }
+    // may be slow as it may copy memory from device to host
+    if (row_splits2 != nullptr)
+      K2_DCHECK_EQ(cached_tot_size2, row_splits2->Back());
+  } else if (row_ids2 != nullptr) {
+    cached_tot_size2 = row_ids2->Dim();
   }
 
   std::vector<RaggedShapeDim> axes(2);
@@ -484,6 +828,8 @@ RaggedShape RaggedShape3(Array1<int32_t> *row_splits1,
     axes[0].row_splits = *row_splits1;
   } else {
     // work out row_splits1, see code in RaggedShape2 above for the reason
+    if (row_ids1->Dim() != 0)
+      internal::RecordShapeSync(*ctx1, "RaggedShape3()");
     int32_t num_rows = row_ids1->Dim() == 0 ? 0 : row_ids1->Back() + 1;
     Array1<int32_t> row_splits_array(ctx1, num_rows + 1);
     RowIdsToRowSplits(*row_ids1, row_splits_array);
@@ -494,10 +840,18 @@ RaggedShape RaggedShape3(Array1<int32_t> *row_splits1,
 
   // set row_splits and row_ids for axis 2
   if (row_splits2 != nullptr) {
-    axes[1].row_splits = *row_splits1;
+    axes[1].row_splits = *row_splits2;
   } else {
-    // work out row_splits1, see code in RaggedShape2 above for the reason
-    int32_t num_rows = row_ids2->Dim() == 0 ? 0 : row_ids2->Back() + 1;
+    // work out row_splits2; the number of rows is the number of elements on
+    // axis 1 if we know it, else see code in RaggedShape2 above.
+    int32_t num_rows;
+    if (cached_tot_size1 >= 0) {
+      num_rows = cached_tot_size1;
+    } else {
+      if (row_ids2->Dim() != 0)
+        internal::RecordShapeSync(*ctx1, "RaggedShape3()");
+      num_rows = row_ids2->Dim() == 0 ? 0 : row_ids2->Back() + 1;
+    }
     Array1<int32_t> row_splits_array(ctx1, num_rows + 1);
     RowIdsToRowSplits(*row_ids2, row_splits_array);
     axes[1].row_splits = row_splits_array;
@@ -591,168 +945,256 @@ RaggedShape Unsqueeze(const RaggedShape &src, int32_t axis) {
     };
     Eval(c, mem.Dim(), lambda_set_mem2);
   }
-  axes_out[axis].row_splits = mem.Range(0, row_splits_dim);
-  axes_out[axis].row_ids = mem.Range(row_splits_dim, row_ids_dim);
-  for (int32_t i = 0; i < axis; ++i) axes_out[i] = axes_in[i];
+  // axes_out[i] maps from axis i to axis i + 1 of the output, so the new
+  // row_splits go between axes 0 and 1 if axis == 0, and between axes
+  // axis - 1 and axis otherwise.
+  int32_t new_dim = (axis == 0 ? 0 : axis - 1);
+  axes_out[new_dim].row_splits = mem.Range(0, row_splits_dim);
+  if (row_ids_dim > 0)
+    axes_out[new_dim].row_ids = mem.Range(row_splits_dim, row_ids_dim);
+  axes_out[new_dim].cached_tot_size = row_ids_dim;
+  for (int32_t i = 0; i < new_dim; ++i) axes_out[i] = axes_in[i];
   // Note: the returned array has `num_axes_in + 1` axes, so its
   // array of RaggedShapeDim is of length `num_axes_in`.
-  for (int32_t i = axis + 1; i < num_axes_in; ++i) axes_out[i] = axes_in[i - 1];
+  for (int32_t i = new_dim + 1; i < num_axes_in; ++i)
+    axes_out[i] = axes_in[i - 1];
   return RaggedShape(axes_out);
 }
 
-RaggedShape Renumber(RaggedShape &src, const Array1<int32_t> &new2old) {
-  ContextPtr c = src.Context();
-  K2_CHECK(IsCompatible(src, new2old));
-  int32_t num_axes = src.NumAxes(), dim0 = src.Dim0();
-  K2_CHECK_EQ(new2old.Dim(), dim0);
-  std::vector<int32_t> tot_sizes_out(num_axes);
-  for (int32_t axis = 0; axis < num_axes; axis++)
-    tot_sizes_out[axis] = src.TotSize(axis);
-  // the arrays in `ans` will be the same sizes as those in `src`.
-  RaggedShape ans = RaggedShapeFromTotSizes(c, num_axes, tot_sizes_out.data());
-
-  src.Populate();
-  Array2<int32_t> old_offsets(c, num_axes, dim0 + 1),
-      new_offsets(c, num_axes, dim0 + 1);
-  auto old_offsets_acc = old_offsets.Accessor(),
-       new_offsets_acc = new_offsets.Accessor();
-
-  Array1<int32_t *> row_splits_ptrs = GetRowSplitsPtr(src);
-  int32_t **row_splits_ptrs_data = row_splits_ptrs.Data();
-
-  // Set old_offsets
-  auto lambda_get_old_offsets = [=] __host__ __device__(int32_t i) {
+/*
+  Renumber() is done with a fixed number of kernels whatever the number of
+  axes; nothing is read back from the device (the sizes on each axis are the
+  same as in `src`):
+
+   - old_offsets(axis, i) is where the sub-tree of src[i] starts on axis
+     `axis`, found by following the row_splits down from axis 0;
+   - new_offsets is the exclusive sum of the sizes of the sub-trees in the
+     new order;
+   - one kernel writes the row_splits of all output axes: each position finds
+     its new sub-tree by binary search in new_offsets, and copies the
+     corresponding row_splits value of the old sub-tree, shifted by the
+     difference between the new and old offsets on the next axis.
+
+  The row_ids of the output are left to be created when needed.
+ */
+// Computes offsets[axis][i] = the position on axis `axis` where sub-tree i
+// of a shape (i.e. the part with idx0 == i) starts, for 0 <= i <= dim0.
+// `row_splits` is, on the device, the row_splits of axes 1 .. num_axes - 1.
+static void GetSubTreeOffsets(ContextPtr &c, int32_t num_axes, int32_t dim0,
+                              const int32_t *const *row_splits,
+                              Array2<int32_t> *offsets) {
+  *offsets = Array2<int32_t>(c, num_axes, dim0 + 1);
+  int32_t *offsets_data = offsets->Data(), stride = offsets->ElemStride0();
+  auto lambda_get_offsets = [=] __host__ __device__(int32_t i) -> void {
     // 0 <= i <= dim0
     int32_t cur_offset = i;
     for (int32_t axis = 0; axis < num_axes; axis++) {
-      old_offsets_acc(0, i) = cur_offset;
+      offsets_data[axis * stride + i] = cur_offset;
       if (axis + 1 == num_axes) return;
-      cur_offset = row_splits_ptrs_data[axis][cur_offset];
+      cur_offset = row_splits[axis][cur_offset];
     }
   };
-  Eval(c, dim0 + 1, lambda_get_old_offsets);
+  Eval(c, dim0 + 1, lambda_get_offsets);
+}
+
+Array2<int32_t> GetSubTreeOffsets(RaggedShape &src) {
+  ContextPtr c = src.Context();
+  int32_t num_axes = src.NumAxes();
+  std::vector<const int32_t *> src_row_splits(num_axes - 1);
+  for (int32_t axis = 1; axis < num_axes; ++axis)
+    src_row_splits[axis - 1] = src.RowSplits(axis).Data();
+  const int32_t *const *src_row_splits_data;
+  const int32_t *unused;
+  Array1<char> table = internal::UploadTable(
+      c, src_row_splits, std::vector<int32_t>(1, 0), &src_row_splits_data,
+      &unused);
+  Array2<int32_t> offsets;
+  GetSubTreeOffsets(c, num_axes, src.Dim0(), src_row_splits_data, &offsets);
+  return offsets.To(GetCpuContext());
+}
+
+// This is Renumber() if is_permutation == true, and RaggedShape::IndexMany()
+// otherwise; for a permutation we know the sizes of the output without
+// waiting for the device.
+static RaggedShape IndexAxis0(RaggedShape &src, const Array1<int32_t> &new2old,
+                              bool is_permutation,
+                              Array1<int32_t> *elem_new2old) {
+  ContextPtr c = src.Context();
+  K2_PROFILE_SCOPE("IndexAxis0", c);
+  K2_CHECK(IsCompatible(src, new2old));
+  int32_t num_axes = src.NumAxes(), dim0 = src.Dim0(),
+          new_dim0 = new2old.Dim();
+  if (is_permutation) K2_CHECK_EQ(new_dim0, dim0);
+  if (new_dim0 == 0) {
+    if (elem_new2old != nullptr) *elem_new2old = Array1<int32_t>(c, 0);
+    if (dim0 == 0) return src;
+    std::vector<RaggedShapeDim> axes(num_axes - 1);
+    Array1<int32_t> zeros(c, num_axes - 1, 0);
+    for (int32_t axis = 1; axis < num_axes; ++axis) {
+      axes[axis - 1].row_splits = zeros.Range(axis - 1, 1);
+      axes[axis - 1].cached_tot_size = 0;
+    }
+    return RaggedShape(axes);
+  }
+
+  // The table has pointers to the row_splits of `src`, and the start of each
+  // output row_splits in `ans_mem`.  If we don't know the sizes of the output
+  // yet, we upload the starts separately once we do.
+  std::vector<int32_t> tot_sizes(num_axes), segment_starts(num_axes);
+  std::vector<const int32_t *> src_row_splits(num_axes - 1);
+  for (int32_t axis = 1; axis < num_axes; ++axis)
+    src_row_splits[axis - 1] = src.RowSplits(axis).Data();
+  int32_t ans_mem_size = 0;
+  if (is_permutation) {
+    for (int32_t axis = 0; axis < num_axes; ++axis)
+      tot_sizes[axis] = src.TotSize(axis);
+    for (int32_t axis = 1; axis < num_axes; ++axis) {
+      segment_starts[axis - 1] = ans_mem_size;
+      ans_mem_size += tot_sizes[axis - 1] + 1;
+    }
+    segment_starts[num_axes - 1] = ans_mem_size;
+  }
+  const int32_t *const *src_row_splits_data;
+  const int32_t *segment_starts_data;
+  Array1<char> table =
+      internal::UploadTable(c, src_row_splits, segment_starts,
+                            &src_row_splits_data, &segment_starts_data);
+
+  Array2<int32_t> old_offsets;
+  GetSubTreeOffsets(c, num_axes, dim0, src_row_splits_data, &old_offsets);
+  Array2<int32_t> new_sizes(c, num_axes, new_dim0 + 1),
+      new_offsets(c, num_axes, new_dim0 + 1);
+  const int32_t *old_offsets_data = old_offsets.Data();
+  int32_t *new_sizes_data = new_sizes.Data(),
+          old_stride = old_offsets.ElemStride0(),
+          new_sizes_stride = new_sizes.ElemStride0();
   const int32_t *new2old_data = new2old.Data();
-  auto lambda_get_new_offsets = [=] __host__ __device__(int32_t axis,
-                                                        int32_t new_i) {
-    // 0 <= axis < num_axes;  0 <= new_i < dim0
-    int32_t old_i = new2old_data[new_i],
-            this_old_offset = old_offsets_acc(axis, old_i),
-            next_old_offset = old_offsets_acc(axis, old_i + 1),
-            size = next_old_offset - this_old_offset;
-    new_offsets_acc(axis, new_i) = size;
+  auto lambda_get_new_sizes = [=] __host__ __device__(int32_t axis,
+                                                      int32_t new_i) -> void {
+    // 0 <= axis < num_axes;  0 <= new_i <= new_dim0.  The last column is not
+    // used by the exclusive sum.
+    int32_t size = 0;
+    if (new_i < new_dim0) {
+      const int32_t *this_old_offsets = old_offsets_data + axis * old_stride;
+      int32_t old_i = new2old_data[new_i];
+      size = this_old_offsets[old_i + 1] - this_old_offsets[old_i];
+    }
+    new_sizes_data[axis * new_sizes_stride + new_i] = size;
   };
-  Eval2(c, num_axes, dim0, lambda_get_new_offsets);
-  ExclusiveSum(new_offsets, &new_offsets);
-  // Now new_offsets contains the offsets, not the sizes.
-
-  ParallelRunner pr(c);
-  std::vector<cudaStream_t> streams(num_axes);
-  int32_t num_jobs = dim0 * 2;  // note: this formula is not a heuristic; it's
-                                // how TaskRedirect works..
-  Array2<TaskRedirect> task_redirects(c, num_axes, num_jobs);
-  auto task_redirects_acc = task_redirects.Accessor();
-  for (int32_t axis = 0; axis < num_axes; axis++) {
-    streams[axis] = pr.NewStream();
-    With w(streams[axis]);
-    const int32_t *new_offsets_ptr = new_offsets_acc.Row(axis);
-    TaskRedirect *task_redirect_ptr = task_redirects_acc.Row(axis);
-    GetTaskRedirect(c, dim0, new_offsets_ptr, task_redirect_ptr);
+  Eval2(c, num_axes, new_dim0 + 1, lambda_get_new_sizes);
+  ExclusiveSum(new_sizes, &new_offsets);
+  const int32_t *new_offsets_data = new_offsets.Data();
+  int32_t new_stride = new_offsets.ElemStride0();
+
+  Array1<int32_t> segment_starts_array;
+  if (!is_permutation) {
+    // The last column of new_offsets has the tot-sizes of the output.
+    Array1<int32_t> last_column(c, num_axes);
+    int32_t *last_column_data = last_column.Data();
+    auto lambda_get_tot_sizes = [=] __host__ __device__(int32_t axis) -> void {
+      last_column_data[axis] = new_offsets_data[axis * new_stride + new_dim0];
+    };
+    Eval(c, num_axes, lambda_get_tot_sizes);
+    Array1<int32_t> last_column_cpu = last_column.To(GetCpuContext());
+    for (int32_t axis = 0; axis < num_axes; ++axis)
+      tot_sizes[axis] = last_column_cpu[axis];
+    for (int32_t axis = 1; axis < num_axes; ++axis) {
+      segment_starts[axis - 1] = ans_mem_size;
+      ans_mem_size += tot_sizes[axis - 1] + 1;
+    }
+    segment_starts[num_axes - 1] = ans_mem_size;
+    segment_starts_array = Array1<int32_t>(c, segment_starts);
+    segment_starts_data = segment_starts_array.Data();
   }
 
-  for (int32_t axis = 0; axis < num_axes - 1; axis++) {
-    {
-      int32_t *this_new_row_splits = ans.RowSplits(axis).Data();
-      const int32_t *this_old_row_splits = src.RowSplits(axis).Data();
-
-      auto lambda_set_row_splits = [=] __host__ __device__(
-                                       int32_t new_idx, int32_t num_threads,
-                                       int32_t thread_idx) -> void {
-        //  0 <= new_idx < dim0; and 0 <= thread_idx < num_threads,
-        //  num_threads may have any value > 0 as far as this code is concerned.
-        //
-        // Reminder of how row_splits work dimensionally: they are a map
-        // from, e.g. an idx0 to an idx01.   An offsets_acc(0,n) is
-        // dimensionally an idx0; an offsets_acc(1,n) an idx01, and so on.
-        // The locations in the row_splits array are as given by
-        // the `axis`'th row of `offsets`; the values in the array
-        // are related to those in the `axis+1`'th row.
-        int32_t old_idx = new2old_data[new_idx],
-                this_old_offset = old_offsets_acc(axis, old_idx),
-                next_old_offset = old_offsets_acc(axis, old_idx + 1),
-                this_new_offset = new_offsets_acc(axis, old_idx),
-                num_rows = next_old_offset - this_old_offset,
-                value_offset = new_offsets_acc(axis + 1, new_idx) -
-                               old_offsets_acc(axis + 1, old_idx);
-
-        // Using <= instead of < below causes threads for different src_idx to
-        // write a single overlapping value, but also ensures that the
-        // terminating value is written.  This only works because row_splits
-        // vectors always start with 0, which is not necessarily the case
-        // for row-ids.
-        for (; thread_idx <= num_rows; thread_idx += num_threads) {
-          this_new_row_splits[this_new_offset + thread_idx] =
-              value_offset + this_old_row_splits[thread_idx];
-        }
-      };
-      int32_t min_threads_per_job = 2, tot_work = tot_sizes_out[axis],
-              target_num_loops = (tot_work > 1000000 ? 4 : 2);
-      // bool include_final_task = false;
-      EvalWithRedirect(streams[axis], num_jobs, task_redirects_acc.Row(axis),
-                       min_threads_per_job, tot_work, target_num_loops,
-                       lambda_set_row_splits);
-    }
+  Array1<int32_t> ans_mem(c, ans_mem_size);
+  int32_t *ans_mem_data = ans_mem.Data();
+  auto lambda_set_row_splits = [=] __host__ __device__(int32_t i) -> void {
+    int32_t axis = 1;
+    while (i >= segment_starts_data[axis]) ++axis;
+    // Reminder of how row_splits work dimensionally: they are a map from,
+    // e.g. an idx0 to an idx01.  Position j is on axis `axis - 1`; the values
+    // are positions on axis `axis`.
+    int32_t j = i - segment_starts_data[axis - 1];
+    const int32_t *this_new_offsets =
+                      new_offsets_data + (axis - 1) * new_stride,
+                  *next_new_offsets = this_new_offsets + new_stride,
+                  *this_old_offsets =
+                      old_offsets_data + (axis - 1) * old_stride,
+                  *next_old_offsets = this_old_offsets + old_stride;
+    // For the last value (j == tot_sizes[axis - 1]), this gives the last
+    // sub-tree (or an empty one after it), which gives the right value.
+    int32_t new_i = FindRow(this_new_offsets, new_dim0, j),
+            old_i = new2old_data[new_i],
+            old_j = this_old_offsets[old_i] + j - this_new_offsets[new_i];
+    ans_mem_data[i] = src_row_splits_data[axis - 1][old_j] -
+                      next_old_offsets[old_i] + next_new_offsets[new_i];
+  };
+  Eval(c, ans_mem_size, lambda_set_row_splits);
+
+  if (elem_new2old != nullptr) {
+    // Same as above, for the positions on the last axis.
+    int32_t num_elems = tot_sizes[num_axes - 1];
+    *elem_new2old = Array1<int32_t>(c, num_elems);
+    int32_t *elem_new2old_data = elem_new2old->Data();
+    const int32_t *last_new_offsets =
+                      new_offsets_data + (num_axes - 1) * new_stride,
+                  *last_old_offsets =
+                      old_offsets_data + (num_axes - 1) * old_stride;
+    auto lambda_set_elem_new2old = [=] __host__ __device__(int32_t j) -> void {
+      int32_t new_i = FindRow(last_new_offsets, new_dim0, j),
+              old_i = new2old_data[new_i];
+      elem_new2old_data[j] = last_old_offsets[old_i] + j -
+                             last_new_offsets[new_i];
+    };
+    Eval(c, num_elems, lambda_set_elem_new2old);
+  }
 
-    {
-      int32_t *this_new_row_ids = ans.RowIds(axis).Data();
-      const int32_t *this_old_row_ids = src.RowIds(axis).Data();
-
-      auto lambda_set_row_ids = [=] __host__ __device__(
-                                    int32_t new_idx, int32_t num_threads,
-                                    int32_t thread_idx) -> void {
-        //  0 <= new_idx < dim0; and 0 <= thread_idx < num_threads,
-        //  num_threads may have any value > 0 as far as this code is concerned.
-        //
-        // Reminder of how row_ids work dimensionally: they are a map
-        // from, e.g. an idx01 to an idx0.   An offsets_acc(0,n) is
-        // dimensionally an idx0; an offsets_acc(1,n) an idx01, and so on.
-        // The locations in the row_ids array are as given by
-        // the `axis+1`'th row of `offsets`; the values in the array
-        // are related to those in the `axis`'th row.
-        int32_t old_idx = new2old_data[new_idx],
-                this_old_offset = old_offsets_acc(axis + 1, old_idx),
-                next_old_offset = old_offsets_acc(axis + 1, old_idx + 1),
-                this_new_offset = new_offsets_acc(axis + 1, old_idx),
-                num_rows = next_old_offset - this_old_offset,
-                value_offset = new_offsets_acc(axis, new_idx) -
-                               old_offsets_acc(axis, old_idx);
-
-        // Using <= instead of < below causes threads for different src_idx to
-        // write a single overlapping value, but also ensures that the
-        // terminating value is written.  This only works because row_splits
-        // vectors always start with 0, which is not necessarily the case
-        // for row-ids.
-        for (; thread_idx < num_rows; thread_idx += num_threads) {
-          this_new_row_ids[this_new_offset + thread_idx] =
-              value_offset + this_old_row_ids[thread_idx];
-        }
-        // TODO: maybe remove this if I decide last value is not needed.
-        if (new_idx == dim0 - 1 && thread_idx == num_rows) {
-          int32_t next_value_offset = new_offsets_acc(axis, new_idx + 1) -
-                                      old_offsets_acc(axis, old_idx + 1);
-          this_new_row_ids[this_new_offset + thread_idx] = next_value_offset;
-        }
-      };
-      int32_t min_threads_per_job = 2, tot_work = tot_sizes_out[axis],
-              target_num_loops = (tot_work > 1000000 ? 4 : 2);
-      EvalWithRedirect(streams[axis], num_jobs, task_redirects_acc.Row(axis),
-                       min_threads_per_job, tot_work, target_num_loops,
-                       lambda_set_row_ids);
-    }
+  std::vector<RaggedShapeDim> axes(num_axes - 1);
+  for (int32_t axis = 1; axis < num_axes; ++axis) {
+    RaggedShapeDim &rsd = axes[axis - 1];
+    rsd.row_splits =
+        ans_mem.Range(segment_starts[axis - 1], tot_sizes[axis - 1] + 1);
+    // leave row_ids unset; they'll be created if needed.
+    rsd.cached_tot_size = tot_sizes[axis];
   }
-#ifndef NDEBUG
-  ans.Check();
-#endif
-  return ans;
+  return RaggedShape(axes);
+}
+
+RaggedShape Renumber(RaggedShape &src, const Array1<int32_t> &new2old,
+                     Array1<int32_t> *elem_new2old /*= nullptr*/) {
+  return IndexAxis0(src, new2old, true, elem_new2old);
+}
+
+RaggedShape RaggedShape::IndexMany(const Array1<int32_t> &indexes,
+                                   Array1<int32_t> *elem_indexes /*= nullptr*/) {
+  K2_CHECK_GE(NumAxes(), 2);
+  return IndexAxis0(*this, indexes, false, elem_indexes);
+}
+
+RaggedShape SubsampleRaggedShape(RaggedShape &src, Renumbering &renumbering) {
+  ContextPtr c = src.Context();
+  int32_t num_axes = src.NumAxes();
+  K2_DCHECK_EQ(renumbering.NumOldElems(), src.NumElements());
+  Array1<int32_t> old2new = renumbering.Old2New(true);
+  const Array1<int32_t> &src_row_splits = src.RowSplits(num_axes - 1);
+  int32_t num_rows = src_row_splits.Dim() - 1;
+  Array1<int32_t> row_splits(c, num_rows + 1);
+  const int32_t *old2new_data = old2new.Data(),
+                *src_row_splits_data = src_row_splits.Data();
+  int32_t *row_splits_data = row_splits.Data();
+  auto lambda_set_row_splits = [=] __host__ __device__(int32_t i) -> void {
+    row_splits_data[i] = old2new_data[src_row_splits_data[i]];
+  };
+  Eval(c, num_rows + 1, lambda_set_row_splits);
+
+  std::vector<RaggedShapeDim> axes = src.Axes();
+  RaggedShapeDim &last_axis = axes.back();
+  last_axis.row_splits = row_splits;
+  // leave row_ids unset; they'll be created if needed.
+  last_axis.row_ids = Array1<int32_t>();
+  last_axis.cached_tot_size = renumbering.NumNewElems();
+  return RaggedShape(axes);
 }
 
 Array2<int32_t> GetOffsets(int32_t num_srcs, RaggedShape **src) {
@@ -848,6 +1290,7 @@ void GetRowInfoMulti(int32_t num_srcs, RaggedShape **src,
   int32_t stride0 = row_splits_ptrs.ElemStride0();
   K2_CHECK_EQ(stride0, row_ids_ptrs.ElemStride0());
 
+  for (int32_t i = 0; i != num_srcs; ++i) src[i]->Populate();
   for (int32_t axis = 0; axis != num_axes_in - 1; ++axis) {
     for (int32_t i = 0; i != num_srcs; ++i) {
       splits_ptr_data[axis * stride0 + i] = src[i]->RowSplits(axis + 1).Data();
@@ -858,130 +1301,162 @@ void GetRowInfoMulti(int32_t num_srcs, RaggedShape **src,
   *row_ids = row_ids_ptrs.To(ctx);
 }
 
-RaggedShape Append(int32_t axis, int32_t num_srcs, RaggedShape **src) {
-  K2_CHECK_EQ(axis, 0) << "Append() with axis > 0 not yet supported";
+/*
+  Implementation of Append() and Stack() on axis 0.  If `stack` is true, the
+  result has an extra leading axis with Dim0() == num_srcs, as for Stack().
+
+  The TotSize() of each source on each axis is obtained on the host from the
+  Dim() of its row_splits, which doesn't need a device read; so the only
+  synchronization is for sources whose number of elements is not known
+  (no cached_tot_size), which are all read back together.  The offsets and
+  the pointers to the source row_splits then go to the device as one table,
+  and a single kernel writes the row_splits of all output axes, renumbering
+  them by the offsets as it goes; each thread finds its source by binary
+  search in the offsets, so the work is balanced however different the sizes
+  of the sources are.
+ */
+static RaggedShape AppendAxis0(int32_t num_srcs, const RaggedShape **src,
+                               bool stack) {
   K2_CHECK_GT(num_srcs, 0);
   int32_t num_axes = src[0]->NumAxes();
   ContextPtr c = src[0]->Context();
+  K2_PROFILE_SCOPE("AppendAxis0", c);
 
   // Check if they have same num-axes and compatible context
   for (int32_t i = 1; i < num_srcs; ++i) {
     K2_CHECK_EQ(num_axes, src[i]->NumAxes());
-    K2_CHECK(IsCompatible(*src[0], *src[i]));
+    K2_CHECK(c->IsCompatible(*src[i]->Context()));
   }
 
-  // `offsets` will be on CPU for now.
-  Array2<int32_t> offsets = GetOffsets(num_srcs, src);
-  auto offsets_acc = offsets.Accessor();
+  // Get the number of elements on the last axis where it's not cached.
+  std::vector<int32_t> last_tot_sizes(num_srcs), unknown;
+  std::vector<const int32_t *> last_elem_ptrs;
+  for (int32_t i = 0; i < num_srcs; ++i) {
+    const RaggedShapeDim &rsd = src[i]->Axes().back();
+    if (rsd.cached_tot_size >= 0) {
+      last_tot_sizes[i] = rsd.cached_tot_size;
+    } else {
+      unknown.push_back(i);
+      last_elem_ptrs.push_back(rsd.row_splits.Data() + rsd.row_splits.Dim() -
+                               1);
+    }
+  }
+  if (!unknown.empty()) {
+    int32_t num_unknown = static_cast<int32_t>(unknown.size());
+    Array1<const int32_t *> ptrs(c, last_elem_ptrs);
+    Array1<int32_t> sizes(c, num_unknown);
+    const int32_t **ptrs_data = ptrs.Data();
+    int32_t *sizes_data = sizes.Data();
+    auto lambda_get_sizes = [=] __host__ __device__(int32_t i) -> void {
+      sizes_data[i] = *(ptrs_data[i]);
+    };
+    Eval(c, num_unknown, lambda_get_sizes);
+    sizes = sizes.To(GetCpuContext());
+    for (int32_t j = 0; j < num_unknown; ++j) {
+      int32_t i = unknown[j];
+      last_tot_sizes[i] = sizes.Data()[j];
+      // Cache it, as TotSize() would.
+      const_cast<RaggedShapeDim &>(src[i]->Axes().back()).cached_tot_size =
+          last_tot_sizes[i];
+    }
+  }
 
-  std::vector<int32_t> tot_sizes_out(num_axes);
+  // The table has three parts: pointers to the row_splits of each source on
+  // each axis, indexed [(axis - 1) * num_srcs + i]; the offsets, indexed
+  // [axis * offsets_stride + i], which are the exclusive sums over sources of
+  // their TotSize(axis); and the start of each output row_splits in `ans_mem`.
+  int32_t offsets_stride = num_srcs + 1,
+          ans_num_axes = num_axes + (stack ? 1 : 0);
+  std::vector<const int32_t *> src_row_splits((num_axes - 1) * num_srcs);
+  std::vector<int32_t> table_ints(num_axes * offsets_stride + ans_num_axes);
+  int32_t *offsets = table_ints.data(),
+          *segment_starts = offsets + num_axes * offsets_stride;
+  for (int32_t axis = 0; axis < num_axes; ++axis) {
+    int32_t sum = 0;
+    for (int32_t i = 0; i < num_srcs; ++i) {
+      offsets[axis * offsets_stride + i] = sum;
+      if (axis == 0)
+        sum += src[i]->Dim0();
+      else if (axis + 1 < num_axes)
+        sum += src[i]->RowSplits(axis + 1).Dim() - 1;
+      else
+        sum += last_tot_sizes[i];
+      if (axis > 0)
+        src_row_splits[(axis - 1) * num_srcs + i] =
+            src[i]->RowSplits(axis).Data();
+    }
+    offsets[axis * offsets_stride + num_srcs] = sum;
+  }
+  // Output axis `ans_axis` has row_splits of dim
+  // tot_sizes_out[ans_axis - 1] + 1.
+  std::vector<int32_t> tot_sizes_out(ans_num_axes);
+  if (stack) tot_sizes_out[0] = num_srcs;
   for (int32_t axis = 0; axis < num_axes; ++axis)
-    tot_sizes_out[axis] = offsets_acc(axis, num_srcs);
-
-  RaggedShape ans = RaggedShapeFromTotSizes(c, num_axes, tot_sizes_out.data());
-  Array1<int32_t *> dest_row_splits, dest_row_ids;
-  GetRowInfo(ans, &dest_row_splits, &dest_row_ids);
-
-  Array2<int32_t *> src_row_splits, src_row_ids;
-  GetRowInfoMulti(num_srcs, src, &src_row_splits, &src_row_ids);
-
-  if (c->GetDeviceType() != kCpu) offsets = offsets.To(c);
-
-  int32_t **dest_row_splits_data = dest_row_splits.Data(),
-          **dest_row_ids_data = dest_row_ids.Data();
-  auto src_row_splits_acc = src_row_splits.Accessor(),
-       src_row_ids_acc = src_row_ids.Accessor();
-  offsets_acc = offsets.Accessor();  // on GPU now (if we're using one)
-
-  ParallelRunner pr(c);
-  std::vector<cudaStream_t> streams(num_axes + 1);
-  int32_t num_jobs = num_srcs * 2;
-  // task_redirects is a device array (if using GPU).
-  // We have `num_axes - 1` different sets of row_splits/row_ids to
-  // populate but they have different sizes; the total number of distinct
-  // sizes is `num_axes`.
-  Array2<TaskRedirect> task_redirects(c, num_axes, num_jobs);
-  auto task_redirects_acc = task_redirects.Accessor();
-  // populate task_redirects (these allocate blocks of threads roughly
-  // proportionally to the amount of data to process from this source.
-  for (int32_t axis = 0; axis < num_axes; axis++) {
-    streams[axis] = pr.NewStream();
-    const int32_t *offsets = &(offsets_acc(axis, 0));
-    GetTaskRedirect(c, num_srcs, offsets, task_redirects_acc.Row(axis));
+    tot_sizes_out[axis + (stack ? 1 : 0)] =
+        offsets[axis * offsets_stride + num_srcs];
+  int32_t ans_mem_size = 0;
+  for (int32_t ans_axis = 1; ans_axis < ans_num_axes; ++ans_axis) {
+    segment_starts[ans_axis - 1] = ans_mem_size;
+    ans_mem_size += tot_sizes_out[ans_axis - 1] + 1;
   }
-
-  for (int32_t axis = 0; axis < num_axes - 1; axis++) {
-    // first set the row-splits.
-    TaskRedirect *tr = &(task_redirects_acc(axis, 0));
-
-    int32_t **this_src_row_splits = &(src_row_splits_acc(axis, 0)),
-            **this_src_row_ids = &(src_row_ids_acc(axis, 0));
-    int32_t *this_dest_row_splits = ans.RowSplits(axis + 1).Data(),
-            *this_dest_row_ids = ans.RowIds(axis + 1).Data();
-    const int32_t *offsets_this_axis = &(offsets_acc(axis, 0)),
-                  *offsets_next_axis = &(offsets_acc(axis + 1, 0));
-    auto lambda_set_row_splits = [=] __host__ __device__(
-                                     int32_t src_idx, int32_t num_threads,
-                                     int32_t thread_idx) -> void {
-      // Reminder of how row_splits work dimensionally: they are a map
-      // from, e.g. an idx0 to an idx01.   An offsets_acc(0,n) is
-      // dimensionally an idx0; an offsets_acc(1,n) an idx01, and so on.
-      int32_t this_offset = offsets_this_axis[src_idx],
-              next_offset = offsets_this_axis[src_idx + 1],
-              this_value_offset = offsets_next_axis[src_idx],
-              num_rows = next_offset - this_offset;
-      int32_t *src_row_splits_ptr = this_src_row_splits[src_idx];
-      // Using <= instead of < below causes threads for different src_idx to
-      // write a single overlapping value, but also ensures that the
-      // terminating value is written.  This only works because row_splits
-      // vectors always start with 0, which is not necessarily the case
-      // for row-ids.
-      for (; thread_idx <= num_rows; thread_idx += num_threads) {
-        this_dest_row_splits[this_offset + thread_idx] =
-            this_value_offset + src_row_splits_ptr[thread_idx];
+  segment_starts[ans_num_axes - 1] = ans_mem_size;
+
+  const int32_t *const *src_row_splits_data;
+  const int32_t *table_ints_data;
+  Array1<char> table = internal::UploadTable(c, src_row_splits, table_ints,
+                                             &src_row_splits_data,
+                                             &table_ints_data);
+  const int32_t *offsets_data = table_ints_data,
+                *segment_starts_data =
+                    table_ints_data + num_axes * offsets_stride;
+
+  Array1<int32_t> ans_mem(c, ans_mem_size);
+  int32_t *ans_mem_data = ans_mem.Data();
+  auto lambda_set_row_splits = [=] __host__ __device__(int32_t i) -> void {
+    int32_t ans_axis = 1;
+    while (i >= segment_starts_data[ans_axis]) ++ans_axis;
+    int32_t j = i - segment_starts_data[ans_axis - 1];
+    if (stack) {
+      if (ans_axis == 1) {
+        // The row_splits of the new axis: they are the offsets on axis 0.
+        ans_mem_data[i] = offsets_data[j];
+        return;
       }
-    };
-
-    int32_t min_threads_per_job = 2, tot_work = tot_sizes_out[axis],
-            target_num_loops = (tot_work > 1000000 ? 4 : 2);
-    EvalWithRedirect(streams[axis], num_jobs, task_redirects_acc.Row(axis),
-                     min_threads_per_job, tot_work, target_num_loops,
-                     lambda_set_row_splits);
-
-    {  // set the row-ids
-      auto lambda_set_row_ids = [=] __host__ __device__(
-                                    int32_t src_idx, int32_t num_threads,
-                                    int32_t thread_idx) -> void {
-        // Reminder of how row_ids work dimensionally: they are a map
-        // from, e.g. an idx01 to an idx0.   An offsets_acc(0,n) is
-        // dimensionally an idx0; an offsets_acc(1,n) an idx01, and so on.
-        int32_t this_offset = offsets_next_axis[src_idx],
-                next_offset = offsets_next_axis[src_idx + 1],
-                this_value_offset = offsets_this_axis[src_idx],
-                num_elems = next_offset - this_offset;
-        int32_t *src_row_ids_ptr = this_src_row_ids[src_idx];
-        // We need to write the very last value at the end of all the
-        // arrays; the last job (for src_idx == num_srcs - 1) does this
-        // by adding 1 to num_srcs.  We can't let them all write an
-        // extra value, because unlike row_splits, row_ids vectors may not
-        // start with 0 in general; so having 2 threads write that
-        // value (the 1st of each; one past the last of each) would cause
-        // indeterminacy.
-        if (src_idx == num_srcs - 1) num_elems++;
-        for (; thread_idx <= num_elems; thread_idx += num_threads) {
-          this_dest_row_ids[this_offset + thread_idx] =
-              this_value_offset + src_row_ids_ptr[thread_idx];
-        }
-      };
-      int32_t min_threads_per_job = 2, tot_work = tot_sizes_out[axis + 1],
-              target_num_loops = (tot_work > 1000000 ? 4 : 2);
-      // bool include_final_task = false;
-      EvalWithRedirect(streams[axis + 1], num_jobs,
-                       task_redirects_acc.Row(axis + 1), min_threads_per_job,
-                       tot_work, target_num_loops, lambda_set_row_ids);
+      --ans_axis;
     }
+    // Now `ans_axis` is the axis in the sources.  Reminder of how row_splits
+    // work dimensionally: they are a map from, e.g. an idx0 to an idx01.  The
+    // offsets on axis `ans_axis - 1` are dimensionally idx0's, and on
+    // `ans_axis` idx01's.
+    const int32_t *this_offsets = offsets_data + (ans_axis - 1) * offsets_stride,
+                  *next_offsets = this_offsets + offsets_stride;
+    // For the last row_splits value (j == this_offsets[num_srcs]), this gives
+    // num_srcs - 1, whose last row_splits value is the one we need.
+    int32_t src_idx = FindRow(this_offsets, num_srcs, j);
+    const int32_t *this_src_row_splits =
+        src_row_splits_data[(ans_axis - 1) * num_srcs + src_idx];
+    ans_mem_data[i] =
+        next_offsets[src_idx] + this_src_row_splits[j - this_offsets[src_idx]];
+  };
+  Eval(c, ans_mem_size, lambda_set_row_splits);
+
+  std::vector<RaggedShapeDim> axes(ans_num_axes - 1);
+  for (int32_t ans_axis = 1; ans_axis < ans_num_axes; ++ans_axis) {
+    RaggedShapeDim &rsd = axes[ans_axis - 1];
+    int32_t num_rows = tot_sizes_out[ans_axis - 1],
+            num_elems = tot_sizes_out[ans_axis];
+    rsd.row_splits =
+        ans_mem.Range(segment_starts[ans_axis - 1], num_rows + 1);
+    // leave row_ids unset; they'll be created if needed.
+    rsd.cached_tot_size = num_elems;
   }
-  return ans;
+  // Only check in debug mode, since Check() has to wait for the device.
+  return RaggedShape(axes, !internal::kDisableDebug);
+}
+
+RaggedShape Append(int32_t axis, int32_t num_srcs, RaggedShape **src) {
+  K2_CHECK_EQ(axis, 0) << "Append() with axis > 0 not yet supported";
+  return AppendAxis0(num_srcs, const_cast<const RaggedShape **>(src), false);
 }
 
 RaggedShape RemoveAxis(RaggedShape &src, int32_t axis) {
@@ -991,7 +1466,6 @@ RaggedShape RemoveAxis(RaggedShape &src, int32_t axis) {
   // note, `axes` is of dim src.NumAxes() - 1.
   // Also note: axes_in[i] pertains to the relationship between
   // axes i and i+1 in the source.
-  src.Populate();
 
   const std::vector<RaggedShapeDim> &axes_in = src.Axes();
 
@@ -1001,11 +1475,16 @@ RaggedShape RemoveAxis(RaggedShape &src, int32_t axis) {
   for (int32_t i = 0; i < axis - 1; ++i) axes_out[i] = axes_in[i];
 
   if (axis > 0 && axis + 1 < src.NumAxes()) {
-    axes_out[axis - 1].row_ids =
-        axes_in[axis - 1].row_ids[axes_in[axis].row_ids];
+    // The merged row_splits are one gather on the device.  We only compose
+    // the row_ids if both are already there; otherwise they'll be created
+    // from the row_splits if needed.
     axes_out[axis - 1].row_splits =
         axes_in[axis].row_splits[axes_in[axis - 1].row_splits];
-    axes_out[axis - 1].cached_tot_size = axes_in[axis].cached_tot_size;
+    if (axes_in[axis - 1].row_ids.Dim() != 0 &&
+        axes_in[axis].row_ids.Dim() != 0)
+      axes_out[axis - 1].row_ids =
+          axes_in[axis - 1].row_ids[axes_in[axis].row_ids];
+    axes_out[axis - 1].cached_tot_size = src.TotSize(axis + 1);
   }
   for (int32_t i = axis; i < axes_out_size; ++i) axes_out[i] = axes_in[i + 1];
   return RaggedShape(axes_out);
@@ -1014,20 +1493,34 @@ RaggedShape RemoveAxis(RaggedShape &src, int32_t axis) {
 // transpose axes 0 and 1.
 RaggedShape Transpose(RaggedShape &src) {
   K2_CHECK_GT(src.NumAxes(), 2);
+  K2_PROFILE_SCOPE("Transpose", src.Context());
   int32_t src_dim0 = src.Dim0(), src_tot_size1 = src.TotSize(1);
   K2_CHECK_EQ(src_tot_size1 % src_dim0, 0)
       << "Transpose(): all dims on axis 0 must be the same.";
   int32_t src_dim1 = src_tot_size1 / src_dim0;
+  ContextPtr c = src.Context();
+  if (!internal::kDisableDebug) {
+    // Check that the row_splits on axis 1 are equally spaced; this has to
+    // wait for the device, so only in debug mode.
+    Array1<int32_t> ok(c, 1, 1);
+    int32_t *ok_data = ok.Data();
+    const int32_t *row_splits1_data = src.RowSplits(1).Data();
+    auto lambda_check_row_splits = [=] __host__ __device__(int32_t i) -> void {
+      if (row_splits1_data[i] != i * src_dim1) *ok_data = 0;
+    };
+    Eval(c, src_dim0 + 1, lambda_check_row_splits);
+    K2_CHECK_EQ(ok[0], 1)
+        << "Transpose(): all dims on axis 0 must be the same.";
+  }
   RaggedShape src_no_axis0 = RemoveAxis(src, 0);
   K2_CHECK_EQ(src_no_axis0.Dim0(), src_tot_size1);
-  ContextPtr c = src.Context();
   // `renumbering` is a `new2old` map, that maps from the first index in
   // src_no_axis0_renumbered
   // to the first index into src_no_axis0.
   Array1<int32_t> renumbering(c, src_tot_size1);
   int32_t *renumbering_data = renumbering.Data();
   auto lambda_set_renumbering = [=] __host__ __device__(int32_t i) {
-    int32_t j = i % src_dim1, k = i / src_dim1, i_old = j * src_dim0 + k;
+    int32_t j = i % src_dim0, k = i / src_dim0, i_old = j * src_dim1 + k;
     renumbering_data[i] = i_old;
   };
   Eval(c, src_tot_size1, lambda_set_renumbering);
@@ -1054,7 +1547,8 @@ RaggedShape Transpose(RaggedShape &src) {
   };
   Eval(c, row_splits_dim + row_ids_dim, lambda_set_row_info);
   ans_axis0[0].row_splits = mem.Range(0, row_splits_dim);
-  ans_axis0[0].row_ids = mem.Range(row_splits_dim, row_ids_dim);
+  if (row_ids_dim > 0)
+    ans_axis0[0].row_ids = mem.Range(row_splits_dim, row_ids_dim);
   ans_axis0[0].cached_tot_size = row_ids_dim;
 
   RaggedShape temp(ans_axis0);
@@ -1064,31 +1558,7 @@ RaggedShape Transpose(RaggedShape &src) {
 RaggedShape Stack(int32_t axis, int32_t num_srcs, const RaggedShape **src) {
   K2_CHECK_GT(num_srcs, 0);
   K2_CHECK(axis >= 0 && axis <= 1);
-
-  ContextPtr c = src[0]->Context();
-  int32_t num_axes = src[0]->NumAxes();
-
-  // Check if they have the same num-axes and compatible context
-  for (int32_t i = 1; i < num_srcs; ++i) {
-    K2_CHECK_EQ(num_axes, src[i]->NumAxes());
-    K2_CHECK(c->IsCompatible(*src[i]->Context()));
-  }
-
-  std::vector<RaggedShape> unsqueezed(num_srcs);
-  std::vector<RaggedShape *> unsqueezed_ptrs(num_srcs);
-  {
-    ParallelRunner pr(c);
-    for (int32_t i = 0; i < num_srcs; i++) {
-      With w(pr.NewStream());
-      unsqueezed[i] = Unsqueeze(*src[i], 0);
-      unsqueezed_ptrs[i] = &unsqueezed[i];
-    }
-    // destructor will wait for work in those launched streams to finish.
-    // (well it won't actually wait, but it will force the current stream to
-    // wait.)
-  }
-
-  RaggedShape ans = Append(0, num_srcs, unsqueezed_ptrs.data());
+  RaggedShape ans = AppendAxis0(num_srcs, src, true);
   // Transpose will check if all src->Dim0() has the same value.
   if (axis == 1) ans = Transpose(ans);
   return ans;
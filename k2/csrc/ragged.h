@@ -45,6 +45,81 @@ struct RaggedShapeDim {
   int32_t cached_tot_size;
 };
 
+/*
+  For reading a RaggedShape with a number of axes known at compile time
+  inside kernels, instead of capturing its row_splits and row_ids pointers
+  one by one, e.g. for an FsaVec:
+
+     RaggedShapeAccessor<3> shape = fsas.shape.Accessor<3>();
+     auto lambda_foo = [=] __host__ __device__(int32_t arc_idx012) -> void {
+       int32_t state_idx01 = shape.Idx<1>(arc_idx012),
+               fsa_idx0 = shape.Idx<0, 1>(state_idx01),
+               state_idx0x = shape.RowSplit<1>(fsa_idx0);
+       ...
+     };
+     Eval(c, fsas.NumElements(), lambda_foo);
+
+  As the axes are template arguments, the pointers can be kept in registers
+  and the loops are unrolled; the reads go through the read-only cache (see
+  LoadReadOnly()).  It is only valid for as long as the shape it came from
+  is not changed or freed.
+ */
+template <int32_t NumAxes>
+struct RaggedShapeAccessor {
+  static_assert(NumAxes >= 2, "A RaggedShape has at least 2 axes");
+  int32_t dim0;
+  // row_splits[axis - 1] and row_ids[axis - 1] are the data of
+  // RowSplits(axis) and RowIds(axis), for 0 < axis < NumAxes; row_ids are
+  // nullptr if the accessor was created without them.
+  const int32_t *row_splits[NumAxes - 1];
+  const int32_t *row_ids[NumAxes - 1];
+
+  // Returns RowSplits(Axis)[i], for 0 < Axis < NumAxes.
+  template <int32_t Axis>
+  __host__ __device__ __forceinline__ int32_t RowSplit(int32_t i) const {
+    static_assert(Axis > 0 && Axis < NumAxes, "Invalid axis");
+    return LoadReadOnly(row_splits[Axis - 1] + i);
+  }
+
+  // Returns RowIds(Axis)[i], for 0 < Axis < NumAxes.
+  template <int32_t Axis>
+  __host__ __device__ __forceinline__ int32_t RowId(int32_t i) const {
+    static_assert(Axis > 0 && Axis < NumAxes, "Invalid axis");
+    return LoadReadOnly(row_ids[Axis - 1] + i);
+  }
+
+  // Returns the index on axis `Axis` of the element with index `idx` on axis
+  // `FromAxis` (by default the last), e.g. Idx<0>(idx012) is idx0 and
+  // Idx<1>(idx012) is idx01.  Only reads the row_ids of the axes in between.
+  template <int32_t Axis, int32_t FromAxis = NumAxes - 1>
+  __host__ __device__ __forceinline__ int32_t Idx(int32_t idx) const {
+    static_assert(Axis >= 0 && Axis <= FromAxis && FromAxis < NumAxes,
+                  "Invalid axes");
+#pragma unroll
+    for (int32_t axis = FromAxis; axis > Axis; --axis)
+      idx = LoadReadOnly(row_ids[axis - 1] + idx);
+    return idx;
+  }
+
+  // Sets idx[axis], for 0 <= axis < NumAxes, to the index on that axis of
+  // the element with index `idx_last` on the last axis, i.e. to its idx0,
+  // idx01, idx012 and so on.
+  __host__ __device__ __forceinline__ void Decode(
+      int32_t idx_last, int32_t (&idx)[NumAxes]) const {
+    idx[NumAxes - 1] = idx_last;
+#pragma unroll
+    for (int32_t axis = NumAxes - 1; axis > 0; --axis)
+      idx[axis - 1] = LoadReadOnly(row_ids[axis - 1] + idx[axis]);
+  }
+};
+
+// A RaggedShapeAccessor with the values of the ragged array; see
+// Ragged<T>::Accessor().
+template <typename T, int32_t NumAxes>
+struct RaggedAccessor : public RaggedShapeAccessor<NumAxes> {
+  T *values;
+};
+
 class RaggedShapeIndexIterator;
 
 class RaggedShape {
@@ -55,6 +130,9 @@ class RaggedShape {
   }
   /* Return the  total size on this axis.  Requires 0 <= axis < NumAxes() and
      for axis=0 the returned value is the same as Dim0().
+     This is known on the host for all but the last axis; for the last axis,
+     if cached_tot_size is not set it is read from the last element of the
+     row_splits, which for a GPU shape means a sync (see GetNumShapeSyncs()).
      Caution: we use const_cast inside this function as it may actually modify
      the cached_tot_size members of RaggedShapeDim if not set.
   */
@@ -73,6 +151,14 @@ class RaggedShape {
   // have.
   int32_t NumElements() const { return TotSize(NumAxes() - 1); }
 
+  /* For when the caller knows the number of elements on the host (e.g. from
+     the Dim() of the values of a ragged array): sets the cached_tot_size of
+     the last axis, so NumElements() won't have to read it from the device.
+     Checks that `num_elements` is right if cached_tot_size was already set,
+     else only in debug mode.
+  */
+  void SetNumElements(int32_t num_elements);
+
   /*
     Return the row-splits for axis `axis` with `0 < axis < NumAxes()`.
     The dimension is the (total) number of rows on this axis plus one,
@@ -96,9 +182,20 @@ class RaggedShape {
   /*
     Return the row-ids for axis `axis` with `0 < axis < NumAxes()`.
     The dimension is the number of elements on this axis == TotSize(axis).
+    The row-ids are only created when first needed, by this function or by
+    Prefetch(), and are then kept; it's safe to call this from several
+    threads at once on the same RaggedShape.
   */
   Array1<int32_t> &RowIds(int32_t axis);
 
+  /*
+    Creates the row-ids for each axis in `axes` (with 0 < axis < NumAxes())
+    that doesn't have them yet, all in one kernel.  Use this instead of
+    calling RowIds() for each axis when you know you'll need the row-ids of
+    several axes.
+  */
+  void Prefetch(const std::vector<int32_t> &axes);
+
   int32_t NumAxes() const { return static_cast<int32_t>(axes_.size()) + 1; }
 
   // Gives max size of any list on the provided axis,
@@ -120,6 +217,24 @@ class RaggedShape {
    */
   RaggedShape Index(int32_t axis, int32_t i);
 
+  /*
+    Returns a RaggedShape with the same number of axes, containing the
+    sub-trees of *this selected by `indexes`, i.e. ans[i,j,k] =
+    (*this)[indexes[i],j,k].  This is like calling Index(0, i) for each i and
+    appending the results, but all the work is done in a few kernels, with
+    one transfer to the CPU to find the sizes of the result.  Requires
+    NumAxes() >= 2.
+
+      @param [in] indexes  Indexes on axis 0 to select, on the same device as
+                          *this; 0 <= indexes[i] < Dim0().  May be in any
+                          order and contain repeats.
+      @param [out] elem_indexes  If not nullptr, will be set to a map from
+                          the elements (positions on the last axis) of the
+                          result to the elements of *this.
+   */
+  RaggedShape IndexMany(const Array1<int32_t> &indexes,
+                        Array1<int32_t> *elem_indexes = nullptr);
+
   /*
     Given a vector `indexes` of length NumAxes() which is a valid index
     for this RaggedShape, returns the integer offset for the element
@@ -130,8 +245,10 @@ class RaggedShape {
 
   RaggedShapeIndexIterator Iterator();
 
+  // Check() waits for the device, so by default it is only done in debug
+  // mode.
   explicit RaggedShape(const std::vector<RaggedShapeDim> &axes,
-                       bool check = true)
+                       bool check = !internal::kDisableDebug)
       : axes_(axes) {
     if (check) Check();
   }
@@ -141,7 +258,8 @@ class RaggedShape {
   RaggedShape() = default;
 
   // This makes sure that all of the row_splits, row_ids and cached_tot_size
-  // are populated
+  // are populated.  Only call this if you need the row_ids of all axes;
+  // otherwise use RowIds() or Prefetch() for the axes you need.
   void Populate();
 
   RaggedShape(const RaggedShape &other) = default;
@@ -157,6 +275,15 @@ class RaggedShape {
   // Convert to possibly different context.
   RaggedShape To(ContextPtr ctx) const;
 
+  /*
+    Returns an accessor for use in kernels (see RaggedShapeAccessor); must
+    have NumAxes() == N.  If with_row_ids is true, the row_ids of all the axes
+    that don't have them are created first (in one kernel, by Prefetch());
+    else only RowSplit() may be used.
+  */
+  template <int32_t N>
+  RaggedShapeAccessor<N> Accessor(bool with_row_ids = true);
+
  private:
   // TODO: could probably do away with the std::vector and have a max size and
   // a fixed length array (more efficient)
@@ -166,6 +293,41 @@ class RaggedShape {
   std::vector<RaggedShapeDim> axes_;
 };
 
+/*
+  Returns the number of times, since program start, that a RaggedShape
+  operation had to read a size from the shape's memory because it was not
+  known on the host: e.g. TotSize() on the last axis when cached_tot_size is
+  not set, or RaggedShape::Index().  For a GPU shape, each of these is a small
+  device-to-host copy and a stream sync.  (This is counted for CPU shapes too,
+  so the code paths that would sync on the GPU can be found on the CPU; the
+  validation done by RaggedShape::Check() is not counted).
+ */
+int64_t GetNumShapeSyncs();
+
+/*
+  While an object of this class exists, a RaggedShape operation on the current
+  thread that has to read a size back from the device (see GetNumShapeSyncs())
+  is a fatal error, with a message saying which operation it was.  Use this,
+  e.g. in tests, to make sure that a piece of code doesn't sync to learn
+  sizes; objects may be nested.  See also SyncAudit in context.h, which
+  covers the other host-device syncs too.
+ */
+class ForbidShapeSyncs {
+ public:
+  ForbidShapeSyncs();
+  ~ForbidShapeSyncs();
+
+ private:
+  ForbidShapeSyncs(const ForbidShapeSyncs &) = delete;
+  ForbidShapeSyncs &operator=(const ForbidShapeSyncs &) = delete;
+};
+
+namespace internal {
+// Called by RaggedShape operations when they have to read a size from memory on
+// the device of `c`; `caller` is the name of the operation.
+void RecordShapeSync(const Context &c, const char *caller);
+}  // namespace internal
+
 // prints a RaggedShape as e.g. [ [ 0 1 ] [ 2 ] [] ].  Note, the 'values'
 // are just the positions in the array, this is for readability.
 inline std::ostream &operator<<(std::ostream &stream,
@@ -232,6 +394,68 @@ class RaggedShapeIndexIterator {
   const int32_t num_elements_;
 };
 
+// The largest NumAxes() supported by ForEachElement().
+constexpr int32_t kMaxForEachAxes = 8;
+
+/*
+  Calls lambda(idx) once for each element of `shape`, in parallel, on the
+  device of `shape` (on CPU using several threads for large shapes; see
+  Eval()).  This is for bulk traversals in algorithm code; unlike
+  RaggedShapeIndexIterator it works on GPU and doesn't update an index on the
+  host element by element.
+
+     @param [in] shape   The shape to traverse; will create the row_ids of
+                         all axes that don't have them yet, in one kernel.
+                         Requires shape.NumAxes() <= kMaxForEachAxes.
+     @param [in] lambda  A __host__ __device__ lambda called as lambda(idx)
+                         with `const int32_t *idx`, where idx[0] is the idx0
+                         of the element, idx[1] its idx01, idx[2] its idx012
+                         and so on, so idx[shape.NumAxes() - 1] is its
+                         position in the values.  The order of the calls is
+                         unspecified, e.g.:
+
+        const int32_t *row_splits1_data = shape.RowSplits(1).Data();
+        auto lambda_set_idx1 = [=] __host__ __device__(const int32_t *idx)
+            -> void {
+          idx1_data[idx[2]] = idx[1] - row_splits1_data[idx[0]];
+        };
+        ForEachElement(shape, lambda_set_idx1);
+*/
+template <typename LambdaT>
+void ForEachElement(RaggedShape &shape, LambdaT &lambda);
+
+// The number of bins of RaggedAxisStats::histogram.
+constexpr int32_t kShapeStatsNumBins = 16;
+
+// Statistics of the row lengths of one axis of a RaggedShape; see
+// ShapeStats().
+struct RaggedAxisStats {
+  int32_t num_rows;  // The number of rows, == TotSize(axis - 1)
+  int32_t tot_size;  // The number of elements, == TotSize(axis)
+  int32_t min_size;  // The smallest row length, or 0 if there are no rows
+  int32_t max_size;  // The largest row length, == MaxSize(axis)
+  float mean_size;   // tot_size / num_rows, or 0 if there are no rows
+  // histogram[0] is the number of empty rows; histogram[b] for
+  // 0 < b < kShapeStatsNumBins - 1 is the number of rows with length in
+  // [2^(b-1), 2^b); the last bin is the number of rows with length
+  // >= 2^(kShapeStatsNumBins - 2).
+  int32_t histogram[kShapeStatsNumBins];
+};
+
+/*
+  Computes statistics of the row lengths of all the axes of `shape`, e.g. for
+  choosing kernel configurations (the largest number of arcs per state, of
+  frames per sequence, and how skewed they are).  Unlike calling MaxSize() for
+  each axis, this does all axes in the same kernels and needs only one
+  transfer to the host (it counts as one shape sync; see GetNumShapeSyncs()).
+
+    @param [in] shape   The shape to compute statistics of.
+    @return             Returns a vector of dimension shape.NumAxes() - 1
+                        whose element axis - 1 is the statistics of axis
+                        `axis`, for 0 < axis < shape.NumAxes().
+*/
+std::vector<RaggedAxisStats> ShapeStats(RaggedShape &shape);
+
 /*
   Stack a list of RaggedShape to create a RaggedShape with one more axis.
   Similar to TF/PyTorch's Stack. The result will have Dim0 == src_size.
@@ -292,6 +516,49 @@ RaggedShape Unsqueeze(const RaggedShape &src, int32_t axis);
 */
 RaggedShape RemoveAxis(RaggedShape &src, int32_t axis);
 
+/*
+  Returns the sub-shape of `src` consisting of the sub-lists with indexes
+  begin <= i < end on axis `axis`.  This is like Index(axis, i) but for a range
+  of indexes, and the axis is kept.
+
+     @param [in] src    Source shape (non-const because row_ids may be
+                        needed in future implementations).
+     @param [in] axis   Axis to take the range on; only axis == 0 is
+                        supported for now.
+     @param [in] begin  First index of the range; 0 <= begin <= end.
+     @param [in] end    One past the last index of the range;
+                        end <= src.Dim0().
+     @return  Returns a shape with ans.Dim0() == end - begin and
+              ans.NumAxes() == src.NumAxes(); its row_splits are newly
+              allocated (on src.Context()) as the values have to be shifted.
+              If `value_offset` is not NULL, it is set to the index into
+              src's elements (on the last axis) of the first element of the
+              range.
+ */
+RaggedShape Arange(RaggedShape &src, int32_t axis, int32_t begin, int32_t end,
+                   int32_t *value_offset = nullptr);
+
+/*
+  Does the same as calling Arange(src, 0, offsets[i], offsets[i + 1],
+  &(*value_offsets)[i]) for 0 <= i < offsets.size() - 1, i.e. splits `src`
+  into consecutive pieces on axis 0, but with one transfer from the device per
+  axis in total instead of one per axis per piece.
+
+     @param [in] src    Source shape
+     @param [in] offsets  The boundaries of the pieces on axis 0; must be
+                        non-decreasing, with offsets.back() <= src.Dim0().
+     @param [out] value_offsets  If not NULL, is set to a vector with
+                        offsets.size() elements, which are the indexes into
+                        src's elements (on the last axis) of the first element
+                        of each piece, followed by that of one past the last
+                        element of the last piece.
+     @return  Returns offsets.size() - 1 shapes; as for Arange(), their
+              row_splits are newly allocated.
+ */
+std::vector<RaggedShape> Arange(RaggedShape &src,
+                                const std::vector<int32_t> &offsets,
+                                std::vector<int32_t> *value_offsets = nullptr);
+
 /*
   Returns a CPU array of shape (src[0]->NumAxes() + 1) by (num_srcs + 1), where
   each row is the exclusive-sum of the TotSize() of the respective sources,
@@ -354,15 +621,37 @@ Array1<int32_t *> GetRowSplitsPtr(RaggedShape &src);
                           length src.Dim0(), on the same device as `src`;
                           must contain the numbers
                           0 through src.Dim0() - 1 in some order.
+     @param [out] elem_new2old  If not nullptr, will be set to the new2old
+                          map for the elements (i.e. the positions on the last
+                          axis), so that values of a ragged array with shape
+                          `src` can be reordered as values[*elem_new2old].
      @return              Returns the renumbered shape.  Will satisfy:
                           ret[i,j,k] = src[new2old[i],j,k].  (Note, this is
                           not actual C++ code, it represents a conceptual
                           indexing operator).
 */
-RaggedShape Renumber(RaggedShape &src, const Array1<int32_t> &new2old);
+RaggedShape Renumber(RaggedShape &src, const Array1<int32_t> &new2old,
+                     Array1<int32_t> *elem_new2old = nullptr);
+
+/*
+  Returns, on the CPU, where each sub-tree of `src` (i.e. each part with
+  a given idx0) starts on each axis, so that callers can work with the
+  sub-trees without copying them.  E.g. for an FsaVec, for FSA i the states
+  are ans[1][i] <= s < ans[1][i + 1] and the arcs are
+  ans[2][i] <= a < ans[2][i + 1], which can be used as
+  `fsas.values.Range(ans[2][i], ans[2][i + 1] - ans[2][i])`.
+
+     @param [in] src  The source shape, with src.NumAxes() >= 2
+     @return  Returns an array with NumAxes() rows and src.Dim0() + 1 columns,
+              where ans[axis][i] is the position on axis `axis` of the start
+              of sub-tree i; ans[0][i] == i.  Involves one transfer.
+*/
+Array2<int32_t> GetSubTreeOffsets(RaggedShape &src);
+
 
 /*
   Return a random RaggedShape, with a CPU context.  Intended for testing.
+  For large shapes, or shapes on the GPU, see RandRaggedShape() in rand.h.
 
      @param [in] set_row_ids    If false, row_ids in the returned RaggedShape
                                 will be empty; If true, row_ids would be filled.
@@ -388,7 +677,7 @@ struct Ragged {
   Ragged(const RaggedShape &shape, const Array1<T> &values)
       : shape(shape), values(values) {
     K2_CHECK(IsCompatible(shape, values));
-    K2_CHECK_EQ(shape.NumElements(), values.Dim());
+    this->shape.SetNumElements(values.Dim());
   }
 
   // Default constructor will not leave this a valid Ragged object, you
@@ -409,6 +698,16 @@ struct Ragged {
   ContextPtr &Context() const { return values.Context(); }
   int32_t NumAxes() const { return shape.NumAxes(); }
 
+  // Returns an accessor for use in kernels; see RaggedShape::Accessor().
+  template <int32_t N>
+  RaggedAccessor<T, N> Accessor(bool with_row_ids = true) {
+    RaggedAccessor<T, N> ans;
+    static_cast<RaggedShapeAccessor<N> &>(ans) =
+        shape.Accessor<N>(with_row_ids);
+    ans.values = values.Data();
+    return ans;
+  }
+
   /*
     It is an error to call this if this.shape.NumAxes() < 2.  This will return
     a Ragged<T> with one fewer axis, containing only the elements of
@@ -454,6 +753,23 @@ struct Ragged {
     return Ragged<T>(sub_shape, sub_values);
   }
 
+  /*
+    Returns a Ragged<T> containing the sub-arrays of *this selected by
+    `indexes` on axis 0, in one pass; see RaggedShape::IndexMany().
+
+      @param [in] indexes  Indexes on axis 0 to select, on the same device as
+                          *this; may be in any order and contain repeats.
+      @param [out] value_indexes  If not nullptr, will be set to a map from
+                          the values of the result to `values`.
+   */
+  Ragged<T> IndexMany(const Array1<int32_t> &indexes,
+                      Array1<int32_t> *value_indexes = nullptr) {
+    Array1<int32_t> temp;
+    if (value_indexes == nullptr) value_indexes = &temp;
+    RaggedShape ans_shape = shape.IndexMany(indexes, value_indexes);
+    return Ragged<T>(ans_shape, values[*value_indexes]);
+  }
+
   // Note *this is conceptually unchanged by this operation but non-const
   // because this->shape's row-ids may need to be generated.
   Ragged<T> RemoveAxis(int32_t axis) {
@@ -472,14 +788,62 @@ struct Ragged {
 template <typename T>
 std::ostream &operator<<(std::ostream &stream, const Ragged<T> &r);
 
+/*
+  Like src.To(ctx), but with a single transfer, for uploading e.g. a batch of
+  supervision graphs produced on the CPU.  The row_splits of every axis and the
+  values are packed into one buffer of pinned memory (from
+  ctx->GetPinnedContext()), which is copied with one MemoryCopyAsync() into one
+  allocation on `ctx`; the arrays of the result are parts of it.  As in To(),
+  the row_ids are not copied, but the cached_tot_size of every axis is set, so
+  the sizes of the result are known on the host.
+
+     @param [in] src   The array to copy; must be on the CPU.
+     @param [in] ctx   The context to copy it to, normally a CUDA context.
+                       If it is compatible with src.Context(), `src` is
+                       returned.
+     @param [out] staging  If not nullptr, this returns as soon as the copy is
+                       queued on the stream of `ctx` and *staging is set to the
+                       pinned buffer, which must be kept until the stream has
+                       finished the copy (e.g. until an event recorded on it
+                       after this call has completed); `src` may be freed or
+                       modified at once.  If nullptr, waits for the copy before
+                       returning.
+     @return  Returns the copy on `ctx`.
+ */
+template <typename T>
+Ragged<T> ToPacked(const Ragged<T> &src, ContextPtr ctx,
+                   RegionPtr *staging = nullptr);
+
 /*
   Return ragged shape with only a subset of the bottom-level elements
   kept.  Require renumbering.NumOldElems() == src.TotSize(src.NumAxes()-1).
   Note: all dimensions and tot-sizes preceding that will remain the
-  same, which might give rise to empty lists.
+  same, which might give rise to empty lists.  The row_ids of the last axis
+  are left to be created on demand.
  */
 RaggedShape SubsampleRaggedShape(RaggedShape &src, Renumbering &renumbering);
 
+/*
+  Like SubsampleRaggedShape(), but also keeps the corresponding values.  The
+  shape and values are done in one kernel, from the exclusive-sum in
+  `renumbering`, so pruning e.g. the arcs of a lattice by a score cutoff is:
+
+       Renumbering renumbering(c, lattice.values.Dim(), lambda_keep);
+       FsaVec pruned = SubsampleRagged(lattice, renumbering);
+
+  (though note that this doesn't renumber the states, so the result may not be
+  connected).
+
+     @param [in] src       The source ragged array
+     @param [in] renumbering  Says which values to keep; requires
+                           renumbering.NumOldElems() == src.values.Dim().
+                           renumbering.New2Old() gives the source index of
+                           each value of the result.
+     @return  Returns the subsampled array.
+ */
+template <typename T>
+Ragged<T> SubsampleRagged(Ragged<T> &src, Renumbering &renumbering);
+
 /*
   Stack a list of Ragged arrays to create a Ragged array with one more axis.
   Similar to TF/PyTorch's Stack.  The result will have Dim0 == num_srcs.  All
@@ -507,6 +871,21 @@ Ragged<T> Stack(int32_t axis, int32_t num_srcs, const Ragged<T> **src);
 template <typename T>
 Ragged<T> Stack(int32_t axis, int32_t num_srcs, const Ragged<T> *src);
 
+/*
+  Renumber(/Reorder) axis 0 of a ragged array; as Renumber() for a
+  RaggedShape, but also reorders the values.
+     @param [in] src      Ragged array to renumber
+     @param [in] new2old  Mapping from new to old numbering of axis 0; see
+                          Renumber() for RaggedShape.
+     @param [out] value_indexes  If not nullptr, will be set to the indexes
+                          of the values in `src`, so that
+                          ans.values == src.values[*value_indexes].
+     @return              Returns the renumbered array.
+*/
+template <typename T>
+Ragged<T> Renumber(Ragged<T> &src, const Array1<int32_t> &new2old,
+                   Array1<int32_t> *value_indexes = nullptr);
+
 /*
   Construct a RaggedShape with 2 axes.
      @param [in] row_splits   row_splits, or NULL (at least one of this and
@@ -626,6 +1005,10 @@ Ragged<T> RandomRagged(T min_value = static_cast<T>(0),
                       array to the input array. The caller
                       has to pre-allocate memory for it
                       on the same device as `src`.
+
+  The sort is stable.  On CUDA, integer types compared with LessThan or
+  GreaterThan use a segmented radix sort, anything else a segmented merge sort.
+  On CPU, the sublists are sorted in parallel if there are enough elements.
  */
 template <typename T, typename Op = LessThan<T>>
 void SortSublists(Ragged<T> *src, Array1<int32_t> *order);
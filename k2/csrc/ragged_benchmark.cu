@@ -0,0 +1,114 @@
+/**
+ * @brief
+ * ragged_benchmark
+ *
+ * @copyright
+ * Copyright (c)  2026  agent (agent@local)
+ *
+ * @copyright
+ * See LICENSE for clarification regarding multiple authors
+ */
+
+#include <algorithm>
+#include <vector>
+
+#include "k2/csrc/array.h"
+#include "k2/csrc/array_ops.h"
+#include "k2/csrc/benchmark.h"
+#include "k2/csrc/context.h"
+#include "k2/csrc/ragged.h"
+
+namespace k2 {
+
+// Returns a ragged array with 2 axes and `num_elems` random values, in rows
+// of 1 to 31 elements; the shape has its row_ids set.
+static Ragged<int32_t> RandomRagged2(ContextPtr &c, int32_t num_elems) {
+  ContextPtr cpu = GetCpuContext();
+  std::vector<int32_t> row_splits_vec(1, 0);
+  for (int32_t i = 0; row_splits_vec.back() < num_elems; ++i)
+    row_splits_vec.push_back(
+        std::min(num_elems, row_splits_vec.back() + 1 + (i * 7) % 31));
+  Array1<int32_t> row_splits(c, row_splits_vec);
+  RaggedShape shape = RaggedShape2(&row_splits, nullptr, num_elems);
+  shape.RowIds(1);
+  return Ragged<int32_t>(shape,
+                         RandUniformArray1<int32_t>(c, num_elems, 0, 10000));
+}
+
+// Sorts the sublists of a ragged array with state.range(0) elements; the
+// sort is in-place, so each iteration first restores the unsorted values
+// (which is included in the time).
+static void BM_SortSublists(benchmark::State &state) {
+  ContextPtr c = GetBenchmarkContext(state);
+  int32_t n = state.range(0);
+  Ragged<int32_t> src = RandomRagged2(c, n);
+  Ragged<int32_t> ragged(src.shape, Array1<int32_t>(c, n));
+  Array1<int32_t> order(c, n);
+  for (auto _ : state) {
+    MemoryCopyAsync(ragged.values.Data(), src.values.Data(),
+                    n * sizeof(int32_t), *c, *c);
+    SortSublists(&ragged, &order);
+    BenchmarkSync(c);
+  }
+  SetThroughput(state, n, 3 * n * sizeof(int32_t));
+}
+BENCHMARK(BM_SortSublists)->Apply(SizesAndDevices);
+
+// Stacks (on axis 0) and appends 16 ragged arrays with a total of
+// state.range(0) elements.
+static void BM_StackAndAppend(benchmark::State &state, bool stack) {
+  ContextPtr c = GetBenchmarkContext(state);
+  constexpr int32_t kNumSrcs = 16;
+  int32_t n = state.range(0);
+  std::vector<Ragged<int32_t>> srcs;
+  std::vector<RaggedShape *> shape_ptrs;
+  std::vector<const Ragged<int32_t> *> src_ptrs;
+  int32_t tot_rows = 0;
+  for (int32_t i = 0; i != kNumSrcs; ++i)
+    srcs.push_back(RandomRagged2(c, n / kNumSrcs));
+  for (auto &src : srcs) {
+    shape_ptrs.push_back(&src.shape);
+    src_ptrs.push_back(&src);
+    tot_rows += src.shape.Dim0();
+  }
+  for (auto _ : state) {
+    if (stack) {
+      Ragged<int32_t> ans = Stack(0, kNumSrcs, src_ptrs.data());
+    } else {
+      RaggedShape ans = Append(0, kNumSrcs, shape_ptrs.data());
+    }
+    BenchmarkSync(c);
+  }
+  // The row_splits are read and written, and for Stack() the values too.
+  int64_t bytes = 2 * (tot_rows + kNumSrcs) * sizeof(int32_t);
+  if (stack) bytes += 2 * n * sizeof(int32_t);
+  SetThroughput(state, n, bytes);
+}
+BENCHMARK_CAPTURE(BM_StackAndAppend, Stack, true)->Apply(SizesAndDevices);
+BENCHMARK_CAPTURE(BM_StackAndAppend, Append, false)->Apply(SizesAndDevices);
+
+// Transposes a ragged shape with 3 axes and state.range(0) elements, whose
+// first axis is regular (16 rows of the same number of sublists).
+static void BM_TransposeRaggedShape(benchmark::State &state) {
+  ContextPtr c = GetBenchmarkContext(state);
+  constexpr int32_t kDim0 = 16;
+  int32_t n = state.range(0);
+  RaggedShape bottom = RandomRagged2(c, n).shape;
+  // Cut the sublists so that their number is a multiple of kDim0.
+  int32_t dim1 = bottom.Dim0() / kDim0;
+  Array1<int32_t> bottom_row_splits =
+      bottom.RowSplits(1).Range(0, kDim0 * dim1 + 1);
+  int32_t num_elems = bottom_row_splits.Back();
+  Array1<int32_t> top_row_splits = Range<int32_t>(c, kDim0 + 1, 0, dim1);
+  RaggedShape src = RaggedShape3(&top_row_splits, nullptr, kDim0 * dim1,
+                                 &bottom_row_splits, nullptr, num_elems);
+  for (auto _ : state) {
+    RaggedShape ans = Transpose(src);
+    BenchmarkSync(c);
+  }
+  SetThroughput(state, num_elems,
+                2 * (kDim0 * dim1 + num_elems) * sizeof(int32_t));
+}
+BENCHMARK(BM_TransposeRaggedShape)->Apply(SizesAndDevices);
+
+}  // namespace k2
@@ -21,15 +21,42 @@
 #error "this file is supposed to be included only by ragged.h"
 #endif
 
+#include <algorithm>
+#include <cstring>
 #include <memory>
+#include <numeric>
+#include <type_traits>
 #include <vector>
 
+#include <cub/cub.cuh>  // NOLINT
+
 #include "k2/csrc/array_ops.h"
 #include "k2/csrc/moderngpu_allocator.h"
 #include "moderngpu/kernel_segsort.hxx"
 
 namespace k2 {
 
+template <int32_t N>
+RaggedShapeAccessor<N> RaggedShape::Accessor(bool with_row_ids /*= true*/) {
+  K2_CHECK_EQ(NumAxes(), N);
+  RaggedShapeAccessor<N> ans;
+  ans.dim0 = Dim0();
+  if (with_row_ids) {
+    std::vector<int32_t> axes(N - 1);
+    std::iota(axes.begin(), axes.end(), 1);
+    Prefetch(axes);
+  }
+  // Only the const Data() is used, so the versions of the regions (see
+  // Region::version) don't change.
+  const RaggedShape &const_this = *this;
+  for (int32_t axis = 1; axis < N; ++axis) {
+    ans.row_splits[axis - 1] = const_this.RowSplits(axis).Data();
+    const Array1<int32_t> *row_ids = (with_row_ids ? &RowIds(axis) : nullptr);
+    ans.row_ids[axis - 1] = (with_row_ids ? row_ids->Data() : nullptr);
+  }
+  return ans;
+}
+
 template <typename T>
 Ragged<T> Stack(int32_t axis, int32_t num_srcs, const Ragged<T> **src) {
   K2_CHECK_EQ(axis, 0);
@@ -56,6 +83,122 @@ Ragged<T> Stack(int32_t axis, int32_t num_srcs, const Ragged<T> *src) {
   return Stack(axis, num_srcs, temp.data());
 }
 
+template <typename T>
+Ragged<T> Renumber(Ragged<T> &src, const Array1<int32_t> &new2old,
+                   Array1<int32_t> *value_indexes /*= nullptr*/) {
+  Array1<int32_t> temp;
+  if (value_indexes == nullptr) value_indexes = &temp;
+  RaggedShape ans_shape = Renumber(src.shape, new2old, value_indexes);
+  return Ragged<T>(ans_shape, src.values[*value_indexes]);
+}
+
+template <typename T>
+Ragged<T> SubsampleRagged(Ragged<T> &src, Renumbering &renumbering) {
+  ContextPtr c = src.Context();
+  int32_t num_axes = src.NumAxes(), num_old = src.values.Dim();
+  K2_CHECK_EQ(renumbering.NumOldElems(), num_old);
+  Array1<int32_t> old2new = renumbering.Old2New(true);
+  int32_t num_new = renumbering.NumNewElems();
+  const Array1<int32_t> &src_row_splits = src.shape.RowSplits(num_axes - 1);
+  int32_t num_rows = src_row_splits.Dim() - 1;
+
+  Array1<int32_t> row_splits(c, num_rows + 1);
+  Array1<T> values(c, num_new);
+  const int32_t *old2new_data = old2new.Data(),
+                *src_row_splits_data = src_row_splits.Data();
+  const T *src_values_data = src.values.Data();
+  int32_t *row_splits_data = row_splits.Data();
+  T *values_data = values.Data();
+  auto lambda_subsample = [=] __host__ __device__(int32_t i) -> void {
+    if (i <= num_rows) row_splits_data[i] = old2new_data[src_row_splits_data[i]];
+    if (i < num_old && old2new_data[i + 1] > old2new_data[i])
+      values_data[old2new_data[i]] = src_values_data[i];
+  };
+  Eval(c, std::max(num_rows + 1, num_old), lambda_subsample);
+
+  std::vector<RaggedShapeDim> axes = src.shape.Axes();
+  RaggedShapeDim &last_axis = axes.back();
+  last_axis.row_splits = row_splits;
+  last_axis.row_ids = Array1<int32_t>();
+  last_axis.cached_tot_size = num_new;
+  return Ragged<T>(RaggedShape(axes), values);
+}
+
+namespace internal {
+// The row_ids pointers of a shape, to be captured by value in kernels.
+struct RowIdsPtrs {
+  const int32_t *data[kMaxForEachAxes - 1];
+};
+}  // namespace internal
+
+template <typename T>
+Ragged<T> ToPacked(const Ragged<T> &src, ContextPtr ctx,
+                   RegionPtr *staging /*= nullptr*/) {
+  ContextPtr src_c = src.Context();
+  if (ctx->IsCompatible(*src_c)) return src;
+  K2_CHECK_EQ(src_c->GetDeviceType(), kCpu);
+  // Each array starts at a multiple of this many bytes of the buffer, which
+  // is enough for vectorized loads of any of them.
+  constexpr std::size_t kPackedAlignment = 16;
+  std::vector<RaggedShapeDim> axes = src.shape.Axes();
+  int32_t num_arrays = static_cast<int32_t>(axes.size()) + 1;
+  std::vector<const void *> src_data(num_arrays);
+  std::vector<std::size_t> num_bytes(num_arrays), offsets(num_arrays + 1, 0);
+  for (int32_t i = 0; i != num_arrays; ++i) {
+    bool is_values = (i + 1 == num_arrays);
+    src_data[i] = is_values ? static_cast<const void *>(src.values.Data())
+                            : static_cast<const void *>(
+                                  axes[i].row_splits.Data());
+    num_bytes[i] = is_values ? src.values.Dim() * sizeof(T)
+                             : axes[i].row_splits.Dim() * sizeof(int32_t);
+    offsets[i + 1] = offsets[i] + (num_bytes[i] + kPackedAlignment - 1) /
+                                      kPackedAlignment * kPackedAlignment;
+  }
+  std::size_t tot_bytes = offsets[num_arrays];
+  ContextPtr pinned = ctx->GetPinnedContext();
+  RegionPtr staging_region = NewRegion(pinned, tot_bytes),
+            region = NewRegion(ctx, tot_bytes);
+  char *staging_data = staging_region->GetData<char>();
+  for (int32_t i = 0; i != num_arrays; ++i)
+    memcpy(staging_data + offsets[i], src_data[i], num_bytes[i]);
+  MemoryCopyAsync(region->GetData(), staging_data, tot_bytes, *ctx, *pinned);
+
+  for (int32_t i = 0; i + 1 != num_arrays; ++i) {
+    Array1<int32_t> &row_splits = axes[i].row_splits;
+    int32_t dim = row_splits.Dim();
+    // the last row_split, which is the total size of the next axis, is read
+    // from the source on the host.
+    axes[i].cached_tot_size = row_splits[dim - 1];
+    row_splits = Array1<int32_t>(dim, region, offsets[i]);
+    axes[i].row_ids = Array1<int32_t>();
+  }
+  Array1<T> values(src.values.Dim(), region, offsets[num_arrays - 1]);
+  if (staging != nullptr)
+    *staging = staging_region;
+  else
+    ctx->Sync();
+  return Ragged<T>(RaggedShape(axes, false), values);
+}
+
+template <typename LambdaT>
+void ForEachElement(RaggedShape &shape, LambdaT &lambda) {
+  int32_t num_axes = shape.NumAxes(), num_elems = shape.NumElements();
+  K2_CHECK_LE(num_axes, kMaxForEachAxes);
+  if (num_elems == 0) return;
+  shape.Populate();
+  internal::RowIdsPtrs row_ids;
+  for (int32_t axis = 1; axis < num_axes; ++axis)
+    row_ids.data[axis - 1] = shape.RowIds(axis).Data();
+  auto lambda_for_each = [=] __host__ __device__(int32_t i) -> void {
+    int32_t idx[kMaxForEachAxes];
+    idx[num_axes - 1] = i;
+    for (int32_t axis = num_axes - 1; axis > 0; --axis)
+      idx[axis - 1] = row_ids.data[axis - 1][idx[axis]];
+    lambda(idx);
+  };
+  Eval(shape.Context(), num_elems, lambda_for_each);
+}
+
 // Recursive function that prints (part of) a ragged shape.
 // 0 <=  begin_pos <= end_pos <= shape.TotSize(axis).
 template <typename T>
@@ -95,22 +238,74 @@ template <typename T>
 Ragged<T> RandomRagged(T min_value, T max_value, int32_t min_num_axes,
                        int32_t max_num_axes, int32_t min_num_elements,
                        int32_t max_num_elements) {
-  RaggedShape shape = RandomRaggedShape(min_num_axes, max_num_axes,
+  RaggedShape shape = RandomRaggedShape(false, min_num_axes, max_num_axes,
                                         min_num_elements, max_num_elements);
-  Array1<T> values = RandUniformArray1(GetCpuContext(), shape.NumElements(),
-                                       min_value, max_value);
+  ContextPtr c = GetCpuContext();
+  Array1<T> values =
+      RandUniformArray1(c, shape.NumElements(), min_value, max_value);
   return Ragged<T>(shape, values);
 }
 
-template <typename T, typename Op /* = LessThan<T> */>
-void SortSublists(Ragged<T> *src, Array1<int32_t> *order) {
-  K2_DCHECK(IsCompatible(src->values, *order));
-  K2_DCHECK_EQ(src->values.Dim(), order->Dim());
-  K2_DCHECK_EQ(src->Context()->GetDeviceType(), kCuda)
-      << "It supports only CUDA at present";
+namespace internal {
+// SortSublists() on CUDA uses a segmented radix sort if the keys are integers
+// compared with LessThan or GreaterThan, and moderngpu's segmented merge sort
+// otherwise.
+template <typename T, typename Op>
+struct UseRadixSort : std::false_type {};
+template <typename T>
+struct UseRadixSort<T, LessThan<T>> : std::is_integral<T> {};
+template <typename T>
+struct UseRadixSort<T, GreaterThan<T>> : std::is_integral<T> {};
+
+template <typename T, typename Op>
+void SortSublistsCuda(Ragged<T> *src, Array1<int32_t> *order,
+                      std::true_type /*use_radix_sort*/) {
+  ContextPtr &c = src->Context();
+  int32_t num_elems = src->values.Dim();
+  const Array1<int32_t> &row_splits =
+      src->shape.RowSplits(src->NumAxes() - 1);
+  int32_t num_rows = row_splits.Dim() - 1;
+  const int32_t *begin_offsets = row_splits.Data(),
+                *end_offsets = begin_offsets + 1;
+  // cub's radix sort is not in-place, so we sort from a copy of the values
+  // back into src->values.
+  Array1<T> keys(c, num_elems);
+  MemoryCopyAsync(keys.Data(), src->values.Data(), num_elems * sizeof(T), *c,
+                  *c);
+  Array1<int32_t> indexes(c, num_elems);
+  int32_t *indexes_data = indexes.Data();
+  auto lambda_set_indexes = [=] __host__ __device__(int32_t i) -> void {
+    indexes_data[i] = i;
+  };
+  Eval(c, num_elems, lambda_set_indexes);
+  bool descending = std::is_same<Op, GreaterThan<T>>::value;
+  int32_t end_bit = static_cast<int32_t>(sizeof(T) * 8);
+  auto sort_pairs = [&](void *d_temp_storage,
+                        std::size_t &temp_storage_bytes) -> cudaError_t {
+    if (descending)
+      return cub::DeviceSegmentedRadixSort::SortPairsDescending(
+          d_temp_storage, temp_storage_bytes, keys.Data(), src->values.Data(),
+          indexes.Data(), order->Data(), num_elems, num_rows, begin_offsets,
+          end_offsets, 0, end_bit, c->GetCudaStream());
+    else
+      return cub::DeviceSegmentedRadixSort::SortPairs(
+          d_temp_storage, temp_storage_bytes, keys.Data(), src->values.Data(),
+          indexes.Data(), order->Data(), num_elems, num_rows, begin_offsets,
+          end_offsets, 0, end_bit, c->GetCudaStream());
+  };
+  std::size_t temp_storage_bytes = 0;
+  // the first time is to determine temporary device storage requirements
+  K2_CUDA_SAFE_CALL(sort_pairs(nullptr, temp_storage_bytes));
+  void *deleter_context;
+  void *d_temp_storage = c->Allocate(temp_storage_bytes, &deleter_context);
+  K2_CUDA_SAFE_CALL(sort_pairs(d_temp_storage, temp_storage_bytes));
+  c->Deallocate(d_temp_storage, deleter_context);
+}
 
-  std::unique_ptr<mgpu::context_t> context =
-      GetModernGpuAllocator(src->Context()->GetDeviceId());
+template <typename T, typename Op>
+void SortSublistsCuda(Ragged<T> *src, Array1<int32_t> *order,
+                      std::false_type /*use_radix_sort*/) {
+  mgpu::context_t &context = GetModernGpuContext(src->Context());
 
   Array1<int32_t> &segment = src->shape.RowSplits(src->NumAxes() - 1);
   mgpu::segmented_sort_indices(src->values.Data(),  // keys
@@ -119,7 +314,7 @@ void SortSublists(Ragged<T> *src, Array1<int32_t> *order) {
                                segment.Data() + 1,  // segments
                                segment.Dim() - 1,   // num_segments
                                Op(),                // cmp
-                               *context);           // context
+                               context);            // context
   auto err = cudaGetLastError();
   (void)err;
   // TODO(fangjun): err is not cudaSuccess, but why was the data sorted
@@ -130,6 +325,56 @@ void SortSublists(Ragged<T> *src, Array1<int32_t> *order) {
   //
   // K2_DCHECK_CUDA_ERROR(err);
 }
+}  // namespace internal
+
+template <typename T, typename Op /* = LessThan<T> */>
+void SortSublists(Ragged<T> *src, Array1<int32_t> *order) {
+  K2_DCHECK(IsCompatible(src->values, *order));
+  K2_DCHECK_EQ(src->values.Dim(), order->Dim());
+  int32_t num_elems = src->values.Dim();
+  if (num_elems == 0) return;
+  if (src->Context()->GetDeviceType() == kCpu) {
+    // Sort the indexes of each sublist by the values, then reorder the values.
+    // The sort is stable, like those used on CUDA, so all devices give the
+    // same `order`.  Each range of sublists only touches its own elements, so
+    // ranges can be sorted in parallel.
+    const int32_t *row_splits =
+        src->shape.RowSplits(src->NumAxes() - 1).Data();
+    int32_t num_rows = src->shape.TotSize(src->NumAxes() - 2);
+    T *values = src->values.Data();
+    int32_t *order_data = order->Data();
+    auto sort_rows = [=](int32_t begin, int32_t end) -> void {
+      Op op;
+      int32_t elem_begin = row_splits[begin], elem_end = row_splits[end];
+      std::iota(order_data + elem_begin, order_data + elem_end, elem_begin);
+      for (int32_t i = begin; i < end; ++i)
+        std::stable_sort(order_data + row_splits[i],
+                         order_data + row_splits[i + 1],
+                         [values, &op](int32_t a, int32_t b) {
+                           return op(values[a], values[b]);
+                         });
+      std::vector<T> sorted(elem_end - elem_begin);
+      for (std::size_t i = 0; i < sorted.size(); ++i)
+        sorted[i] = values[order_data[elem_begin + i]];
+      std::copy(sorted.begin(), sorted.end(), values + elem_begin);
+    };
+    if (num_elems < kMinParallelEvalSize) {
+      sort_rows(0, num_rows);
+    } else {
+      // each range should have at least kMinParallelEvalSize / 4 elements,
+      // on average.
+      int32_t avg_len = std::max<int32_t>(1, num_elems / num_rows);
+      int32_t min_rows =
+          std::max<int32_t>(1, kMinParallelEvalSize / 4 / avg_len);
+      ParallelFor(num_rows, min_rows, sort_rows);
+    }
+    return;
+  }
+  K2_DCHECK_EQ(src->Context()->GetDeviceType(), kCuda);
+  internal::SortSublistsCuda<T, Op>(
+      src, order,
+      std::integral_constant<bool, internal::UseRadixSort<T, Op>::value>());
+}
 
 }  // namespace k2
 
@@ -14,11 +14,13 @@
 
 #include <algorithm>
 #include <numeric>
+#include <thread>
 #include <vector>
 
 #include "k2/csrc/context.h"
 #include "k2/csrc/dtype.h"
 #include "k2/csrc/log.h"
+#include "k2/csrc/math.h"
 #include "k2/csrc/ragged.h"
 #include "k2/csrc/tensor.h"
 
@@ -42,6 +44,13 @@ static void CheckRowSplitsOrIds(k2::RaggedShape &shape,
 }  // namespace
 
 namespace k2 {
+// Returns the contents of `array` (which may be on GPU) as a vector.
+static std::vector<int32_t> ToVector(const Array1<int32_t> &array) {
+  Array1<int32_t> cpu_array = array.To(GetCpuContext());
+  const int32_t *data = cpu_array.Data();
+  return std::vector<int32_t>(data, data + cpu_array.Dim());
+}
+
 template <DeviceType d>
 void TestShape() {
   ContextPtr cpu = GetCpuContext();  // will use to copy data
@@ -267,6 +276,193 @@ TEST(RaggedShapeTest, RaggedShape) {
   TestShape<kCuda>();
   TestShape<kCpu>();
 }
+template <DeviceType d>
+void TestLazyRowIds() {
+  ContextPtr context;
+  if (d == kCpu) {
+    context = GetCpuContext();
+  } else {
+    K2_CHECK_EQ(d, kCuda);
+    context = GetCudaContext();
+  }
+  const std::vector<int32_t> row_splits1 = {0, 2, 5, 6};
+  const std::vector<int32_t> row_splits2 = {0, 2, 3, 4, 6, 7, 10};
+  const std::vector<int32_t> row_splits3 = {0,  2,  3,  5,  8, 9,
+                                            12, 13, 15, 15, 16};
+  const std::vector<std::vector<int32_t>> row_splits_vec = {
+      row_splits1, row_splits2, row_splits3};
+  const std::vector<int32_t> row_ids1 = {0, 0, 1, 1, 1, 2};
+  const std::vector<int32_t> row_ids2 = {0, 0, 1, 2, 3, 3, 4, 5, 5, 5};
+  const std::vector<int32_t> row_ids3 = {0, 0, 1, 2, 2, 3, 3, 3,
+                                         4, 5, 5, 5, 6, 7, 7, 9};
+  const std::vector<std::vector<int32_t>> row_ids_vec = {row_ids1, row_ids2,
+                                                         row_ids3};
+  std::vector<RaggedShapeDim> axes;
+  for (const auto &row_splits : row_splits_vec)
+    axes.emplace_back(RaggedShapeDim{Array1<int32_t>(context, row_splits),
+                                     Array1<int32_t>(), -1});
+
+  {
+    RaggedShape shape(axes);
+    // Stack() doesn't need row_ids so doesn't create them.
+    const RaggedShape *srcs[] = {&shape, &shape};
+    RaggedShape stacked = Stack(0, 2, srcs);
+    for (const auto &rsd : stacked.Axes()) EXPECT_EQ(rsd.row_ids.Dim(), 0);
+  }
+  {
+    RaggedShape shape(axes);
+    shape.Prefetch({3, 1});
+    const auto &shape_axes = shape.Axes();
+    EXPECT_EQ(shape_axes[1].row_ids.Dim(), 0);
+    EXPECT_EQ(ToVector(shape_axes[0].row_ids), row_ids1);
+    EXPECT_EQ(ToVector(shape_axes[2].row_ids), row_ids3);
+    EXPECT_EQ(shape_axes[2].cached_tot_size, row_ids3.size());
+    // Already there, so this should return the same array.
+    const int32_t *row_ids1_data = shape_axes[0].row_ids.Data();
+    EXPECT_EQ(shape.RowIds(1).Data(), row_ids1_data);
+    shape.Prefetch({1, 2});
+    EXPECT_EQ(shape.RowIds(1).Data(), row_ids1_data);
+    EXPECT_EQ(ToVector(shape_axes[1].row_ids), row_ids2);
+  }
+  {
+    // Several threads asking for the same row_ids should all get the same
+    // array.
+    RaggedShape shape(axes);
+    const int32_t num_threads = 4;
+    std::vector<const int32_t *> data(num_threads);
+    std::vector<std::thread> threads;
+    for (int32_t i = 0; i < num_threads; ++i)
+      threads.emplace_back(
+          [&shape, &data, i]() { data[i] = shape.RowIds(2).Data(); });
+    for (auto &thread : threads) thread.join();
+    for (int32_t i = 1; i < num_threads; ++i) EXPECT_EQ(data[i], data[0]);
+    EXPECT_EQ(ToVector(shape.RowIds(2)), row_ids2);
+  }
+}
+
+TEST(RaggedShapeTest, LazyRowIds) {
+  TestLazyRowIds<kCpu>();
+  TestLazyRowIds<kCuda>();
+}
+
+template <DeviceType d>
+void TestShapeSyncs() {
+  ContextPtr context;
+  if (d == kCpu) {
+    context = GetCpuContext();
+  } else {
+    K2_CHECK_EQ(d, kCuda);
+    context = GetCudaContext();
+  }
+  // [ [ [ x x ] [ x ] ] [ [ x x x ] ] ]
+  const std::vector<int32_t> row_splits1 = {0, 2, 3};
+  const std::vector<int32_t> row_splits2 = {0, 2, 3, 6};
+  std::vector<RaggedShapeDim> axes;
+  axes.emplace_back(RaggedShapeDim{Array1<int32_t>(context, row_splits1),
+                                   Array1<int32_t>(), -1});
+  axes.emplace_back(RaggedShapeDim{Array1<int32_t>(context, row_splits2),
+                                   Array1<int32_t>(), -1});
+  RaggedShape shape(axes);
+  {
+    // These are known on the host.
+    ForbidShapeSyncs forbid;
+    EXPECT_EQ(shape.TotSize(0), 2);
+    EXPECT_EQ(shape.TotSize(1), 3);
+  }
+  // Only the first call needs to read the size from the device.
+  int64_t num_syncs = GetNumShapeSyncs();
+  EXPECT_EQ(shape.NumElements(), 6);
+  EXPECT_EQ(GetNumShapeSyncs(), num_syncs + 1);
+  EXPECT_EQ(shape.NumElements(), 6);
+  EXPECT_EQ(GetNumShapeSyncs(), num_syncs + 1);
+
+  {
+    // Shape operations propagate the sizes.
+    ForbidShapeSyncs forbid;
+    RaggedShape other = shape.To(GetCpuContext());
+    EXPECT_EQ(other.NumElements(), 6);
+    other = other.To(context);
+    EXPECT_EQ(other.NumElements(), 6);
+    for (int32_t axis = 0; axis <= 3; ++axis) {
+      RaggedShape unsqueezed = Unsqueeze(shape, axis);
+      EXPECT_EQ(unsqueezed.NumAxes(), 4);
+      EXPECT_EQ(unsqueezed.NumElements(), 6);
+      // all lists on the new axis have size 1.
+      EXPECT_EQ(unsqueezed.TotSize(axis),
+                axis == 0 ? 1 : shape.TotSize(axis - 1));
+    }
+    RaggedShape *srcs[] = {&shape, &other};
+    RaggedShape appended = Append(0, 2, srcs);
+    EXPECT_EQ(appended.NumElements(), 12);
+  }
+  {
+    // Index() has to read the range from the device, but the result knows its
+    // size.
+    RaggedShape sub_shape = shape.Index(0, 1);
+    ForbidShapeSyncs forbid;
+    EXPECT_EQ(sub_shape.NumElements(), 3);
+  }
+  {
+    // A ragged array gets the number of elements from its values.
+    RaggedShape unknown(axes);
+    Array1<int32_t> values(context, 6, 0);
+    Ragged<int32_t> ragged(unknown, values);
+    ForbidShapeSyncs forbid;
+    EXPECT_EQ(ragged.shape.NumElements(), 6);
+  }
+}
+
+TEST(RaggedShapeTest, ShapeSyncs) {
+  TestShapeSyncs<kCpu>();
+  TestShapeSyncs<kCuda>();
+}
+
+template <DeviceType d>
+void TestArangeMany() {
+  ContextPtr cpu = GetCpuContext();
+  ContextPtr context = (d == kCpu ? cpu : GetCudaContext());
+  for (int32_t iter = 0; iter != 10; ++iter) {
+    RaggedShape shape = RandomRaggedShape(false, 2, 4, 0, 1000).To(context);
+    int32_t dim0 = shape.Dim0(), num_axes = shape.NumAxes();
+    std::vector<int32_t> offsets = {0};
+    while (offsets.back() < dim0)
+      offsets.push_back(std::min(dim0, offsets.back() + RandInt(0, 5)));
+    std::vector<int32_t> value_offsets;
+    int64_t num_syncs = GetNumShapeSyncs();
+    std::vector<RaggedShape> pieces = Arange(shape, offsets, &value_offsets);
+    // one transfer per axis, whatever the number of pieces.
+    EXPECT_EQ(GetNumShapeSyncs(), num_syncs + num_axes - 1);
+    ASSERT_EQ(pieces.size() + 1, offsets.size());
+    ASSERT_EQ(value_offsets.size(), offsets.size());
+    EXPECT_EQ(value_offsets.back(), shape.NumElements());
+    for (std::size_t i = 0; i != pieces.size(); ++i) {
+      int32_t value_offset;
+      RaggedShape expected =
+          Arange(shape, 0, offsets[i], offsets[i + 1], &value_offset);
+      EXPECT_EQ(value_offsets[i], value_offset);
+      ASSERT_EQ(pieces[i].NumAxes(), num_axes);
+      EXPECT_EQ(pieces[i].Dim0(), offsets[i + 1] - offsets[i]);
+      for (int32_t axis = 1; axis < num_axes; ++axis) {
+        EXPECT_EQ(pieces[i].TotSize(axis), expected.TotSize(axis));
+        Array1<int32_t> row_splits = pieces[i].RowSplits(axis).To(cpu),
+                        expected_row_splits =
+                            expected.RowSplits(axis).To(cpu);
+        std::vector<int32_t> row_splits_vec(
+            row_splits.Data(), row_splits.Data() + row_splits.Dim()),
+            expected_vec(expected_row_splits.Data(),
+                         expected_row_splits.Data() +
+                             expected_row_splits.Dim());
+        EXPECT_EQ(row_splits_vec, expected_vec);
+      }
+    }
+  }
+}
+
+TEST(RaggedShapeTest, ArangeMany) {
+  TestArangeMany<kCpu>();
+  TestArangeMany<kCuda>();
+}
+
 TEST(RaggedShapeTest, RaggedShapeIterator) {
   // note RaggedShapeIndexIterator works only for CPU
   ContextPtr context = GetCpuContext();
@@ -304,6 +500,164 @@ TEST(RaggedShapeTest, RaggedShapeIterator) {
   EXPECT_EQ(index, row_splits3.back());
 }
 
+template <DeviceType d>
+void TestForEachElement() {
+  ContextPtr cpu = GetCpuContext();
+  ContextPtr context = (d == kCpu ? GetCpuContext() : GetCudaContext());
+  for (int32_t i = 0; i != 10; ++i) {
+    RaggedShape shape =
+        RandomRaggedShape(false, 2, 4, 0, 1000).To(context);
+    int32_t num_axes = shape.NumAxes(), num_elems = shape.NumElements();
+    // idxs[elem * num_axes + axis] will be the idx0..axis of element `elem`.
+    Array1<int32_t> idxs(context, num_elems * num_axes, -1);
+    int32_t *idxs_data = idxs.Data();
+    auto lambda_set_idxs = [=] __host__ __device__(const int32_t *idx)
+        -> void {
+      int32_t elem = idx[num_axes - 1];
+      for (int32_t axis = 0; axis < num_axes; ++axis)
+        idxs_data[elem * num_axes + axis] = idx[axis];
+    };
+    ForEachElement(shape, lambda_set_idxs);
+
+    idxs = idxs.To(cpu);
+    RaggedShape shape_cpu = shape.To(cpu);
+    int32_t elem = 0;
+    for (RaggedShapeIndexIterator iter = shape_cpu.Iterator(); !iter.Done();
+         iter.Next(), ++elem) {
+      const std::vector<int32_t> &vec = iter.Value();
+      int32_t idx = vec[0];
+      EXPECT_EQ(idxs[elem * num_axes], idx);
+      for (int32_t axis = 1; axis < num_axes; ++axis) {
+        idx = shape_cpu.RowSplits(axis)[idx] + vec[axis];
+        EXPECT_EQ(idxs[elem * num_axes + axis], idx);
+      }
+    }
+    EXPECT_EQ(elem, num_elems);
+  }
+}
+
+TEST(RaggedShapeTest, ForEachElement) {
+  TestForEachElement<kCpu>();
+  TestForEachElement<kCuda>();
+}
+
+template <DeviceType d>
+void TestShapeStats() {
+  ContextPtr cpu = GetCpuContext();
+  ContextPtr context = (d == kCpu ? GetCpuContext() : GetCudaContext());
+  for (int32_t i = 0; i != 10; ++i) {
+    RaggedShape shape =
+        RandomRaggedShape(false, 2, 4, 0, (i < 5 ? 1000 : 100000)).To(context);
+    int64_t num_syncs = GetNumShapeSyncs();
+    std::vector<RaggedAxisStats> stats = ShapeStats(shape);
+    EXPECT_EQ(GetNumShapeSyncs(), num_syncs + 1);
+    ASSERT_EQ(static_cast<int32_t>(stats.size()), shape.NumAxes() - 1);
+
+    RaggedShape shape_cpu = shape.To(cpu);
+    for (int32_t axis = 1; axis < shape.NumAxes(); ++axis) {
+      const RaggedAxisStats &axis_stats = stats[axis - 1];
+      const Array1<int32_t> &row_splits = shape_cpu.RowSplits(axis);
+      int32_t num_rows = row_splits.Dim() - 1;
+      std::vector<int32_t> histogram(kShapeStatsNumBins, 0);
+      int32_t max_size = 0, min_size = (num_rows > 0 ? row_splits[1] : 0);
+      for (int32_t row = 0; row < num_rows; ++row) {
+        int32_t size = row_splits[row + 1] - row_splits[row];
+        max_size = std::max(max_size, size);
+        min_size = std::min(min_size, size);
+        int32_t bin = 0;
+        while (bin < kShapeStatsNumBins - 1 && size >= (1 << bin)) ++bin;
+        ++histogram[bin];
+      }
+      EXPECT_EQ(axis_stats.num_rows, num_rows);
+      EXPECT_EQ(axis_stats.tot_size, row_splits[num_rows]);
+      EXPECT_EQ(axis_stats.max_size, max_size);
+      EXPECT_EQ(axis_stats.max_size, shape_cpu.MaxSize(axis));
+      EXPECT_EQ(axis_stats.min_size, min_size);
+      if (num_rows > 0)
+        EXPECT_FLOAT_EQ(axis_stats.mean_size,
+                        row_splits[num_rows] / static_cast<float>(num_rows));
+      else
+        EXPECT_EQ(axis_stats.mean_size, 0.0f);
+      for (int32_t b = 0; b < kShapeStatsNumBins; ++b)
+        EXPECT_EQ(axis_stats.histogram[b], histogram[b]);
+    }
+  }
+}
+
+TEST(RaggedShapeTest, ShapeStats) {
+  TestShapeStats<kCpu>();
+  TestShapeStats<kCuda>();
+}
+
+template <DeviceType d>
+void TestAccessor() {
+  ContextPtr cpu = GetCpuContext();
+  ContextPtr context = (d == kCpu ? GetCpuContext() : GetCudaContext());
+  for (int32_t i = 0; i != 10; ++i) {
+    Ragged<int32_t> ragged =
+        RandomRagged<int32_t>(0, 100, 4, 4, 0, 1000).To(context);
+    RaggedShape &shape = ragged.shape;
+    int32_t num_elems = shape.NumElements();
+    // idxs[elem * 4 + axis] will be the index on axis `axis` of element
+    // `elem`, from Decode(); others[elem * 4 + k] that from Idx<0>(),
+    // Idx<1>(), Idx<0, 1>(Idx<1>()) and the value.
+    Array1<int32_t> idxs(context, num_elems * 4, -1),
+        others(context, num_elems * 4, -1),
+        row_splits1(context, shape.Dim0() + 1, -1);
+    int32_t *idxs_data = idxs.Data(), *others_data = others.Data(),
+            *row_splits1_data = row_splits1.Data();
+    RaggedAccessor<int32_t, 4> acc = ragged.Accessor<4>();
+    EXPECT_EQ(acc.dim0, shape.Dim0());
+    EXPECT_EQ(acc.values, ragged.values.Data());
+    auto lambda_set_idxs = [=] __host__ __device__(int32_t elem) -> void {
+      int32_t idx[4];
+      acc.Decode(elem, idx);
+      for (int32_t axis = 0; axis < 4; ++axis)
+        idxs_data[elem * 4 + axis] = idx[axis];
+      int32_t idx01 = acc.Idx<1>(elem);
+      others_data[elem * 4] = acc.Idx<0>(elem);
+      others_data[elem * 4 + 1] = idx01;
+      others_data[elem * 4 + 2] = acc.Idx<0, 1>(idx01);
+      others_data[elem * 4 + 3] = acc.values[elem];
+    };
+    Eval(context, num_elems, lambda_set_idxs);
+    RaggedShapeAccessor<4> shape_acc = shape.Accessor<4>(false);
+    auto lambda_set_row_splits1 = [=] __host__ __device__(int32_t i) -> void {
+      row_splits1_data[i] = shape_acc.RowSplit<1>(i);
+    };
+    Eval(context, shape.Dim0() + 1, lambda_set_row_splits1);
+
+    idxs = idxs.To(cpu);
+    others = others.To(cpu);
+    Array1<int32_t> values = ragged.values.To(cpu);
+    RaggedShape shape_cpu = shape.To(cpu);
+    int32_t elem = 0;
+    for (RaggedShapeIndexIterator iter = shape_cpu.Iterator(); !iter.Done();
+         iter.Next(), ++elem) {
+      const std::vector<int32_t> &vec = iter.Value();
+      int32_t idx = vec[0];
+      EXPECT_EQ(idxs[elem * 4], idx);
+      EXPECT_EQ(others[elem * 4], idx);
+      EXPECT_EQ(others[elem * 4 + 2], idx);
+      for (int32_t axis = 1; axis < 4; ++axis) {
+        idx = shape_cpu.RowSplits(axis)[idx] + vec[axis];
+        EXPECT_EQ(idxs[elem * 4 + axis], idx);
+        if (axis == 1) EXPECT_EQ(others[elem * 4 + 1], idx);
+      }
+      EXPECT_EQ(others[elem * 4 + 3], values[elem]);
+    }
+    EXPECT_EQ(elem, num_elems);
+    row_splits1 = row_splits1.To(cpu);
+    for (int32_t i = 0; i <= shape_cpu.Dim0(); ++i)
+      EXPECT_EQ(row_splits1[i], shape_cpu.RowSplits(1)[i]);
+  }
+}
+
+TEST(RaggedShapeTest, Accessor) {
+  TestAccessor<kCpu>();
+  TestAccessor<kCuda>();
+}
+
 TEST(RaggedShapeTest, RandomRaggedShape) {
   {
     RaggedShape shape = RandomRaggedShape(false, 2, 4, 0, 0);
@@ -15,6 +15,7 @@
 
 #include <algorithm>
 #include <numeric>
+#include <random>
 #include <utility>
 #include <vector>
 
@@ -86,8 +87,24 @@ void TestTranspose() {
     context = GetCudaContext();
   }
 
+  {
+    // [ [ [ x x ] [ x x ] ] [ [ x x ] [ ] ] [ [ ] [ x ] ] ], whose transpose
+    // is [ [ [ x x ] [ x x ] [ ] ] [ [ x x ] [ ] [ x ] ] ].
+    Array1<int32_t> row_splits1(context, std::vector<int32_t>{0, 2, 4, 6}),
+        row_splits2(context, std::vector<int32_t>{0, 2, 4, 6, 6, 6, 7});
+    RaggedShape shape =
+        RaggedShape3(&row_splits1, nullptr, -1, &row_splits2, nullptr, -1);
+    RaggedShape ans = Transpose(shape).To(cpu);
+    ans.Check();
+    CheckRowSplits(ans, {{0, 3, 6}, {0, 2, 4, 4, 6, 6, 7}});
+  }
+
   RaggedShape to_transpose = RandomRaggedShapeToTranspose(context);
   RaggedShape transposed = Transpose(to_transpose);
+  EXPECT_EQ(transposed.NumAxes(), to_transpose.NumAxes());
+  EXPECT_EQ(transposed.Dim0(), to_transpose.TotSize(1) / to_transpose.Dim0());
+  for (int32_t axis = 1; axis < to_transpose.NumAxes(); ++axis)
+    EXPECT_EQ(transposed.TotSize(axis), to_transpose.TotSize(axis));
 
   if (d != kCpu) {
     ContextPtr c = GetCpuContext();
@@ -111,10 +128,171 @@ void TestTranspose() {
   }
 }
 TEST(RaggedTest, TestTranspose) {
-  // TODO(haowen): make it be a real test: add EXPECT_EQ, test related
-  // algorithms, etc.
-  // TestTranspose<kCpu>();
-  // TestTranspose<kCuda>();
+  for (int32_t i = 0; i < 5; ++i) {
+    TestTranspose<kCpu>();
+    TestTranspose<kCuda>();
+  }
+}
+
+template <DeviceType d>
+void TestRenumber() {
+  ContextPtr cpu = GetCpuContext();
+  ContextPtr context = nullptr;
+  if (d == kCpu) {
+    context = GetCpuContext();
+  } else {
+    K2_CHECK_EQ(d, kCuda);
+    context = GetCudaContext();
+  }
+
+  RaggedShape src = RandomRaggedShape(false, 3, 4, 0, 2000);
+  int32_t dim0 = src.Dim0();
+  std::vector<int32_t> new2old_vec(dim0);
+  std::iota(new2old_vec.begin(), new2old_vec.end(), 0);
+  std::random_device rd;
+  std::mt19937 g(rd());
+  std::shuffle(new2old_vec.begin(), new2old_vec.end(), g);
+  Array1<int32_t> new2old(context, new2old_vec);
+
+  RaggedShape src_on_device = src.To(context);
+  RaggedShape ans = Renumber(src_on_device, new2old).To(cpu);
+  ans.Check();
+  ASSERT_EQ(ans.NumAxes(), src.NumAxes());
+  ASSERT_EQ(ans.Dim0(), dim0);
+  for (int32_t axis = 1; axis < src.NumAxes(); ++axis)
+    EXPECT_EQ(ans.TotSize(axis), src.TotSize(axis));
+  // ans[i] should be src[new2old[i]].
+  for (int32_t new_i = 0; new_i < dim0; ++new_i) {
+    RaggedShape ans_part = ans.Index(0, new_i),
+                src_part = src.Index(0, new2old_vec[new_i]);
+    ASSERT_EQ(ans_part.NumAxes(), src_part.NumAxes());
+    for (int32_t axis = 1; axis < ans_part.NumAxes(); ++axis) {
+      const Array1<int32_t> &ans_row_splits = ans_part.RowSplits(axis),
+                            &src_row_splits = src_part.RowSplits(axis);
+      ASSERT_EQ(ans_row_splits.Dim(), src_row_splits.Dim());
+      for (int32_t j = 0; j < ans_row_splits.Dim(); ++j)
+        EXPECT_EQ(ans_row_splits.Data()[j], src_row_splits.Data()[j]);
+    }
+  }
+}
+
+TEST(RaggedTest, TestRenumber) {
+  for (int32_t i = 0; i < 5; ++i) {
+    TestRenumber<kCpu>();
+    TestRenumber<kCuda>();
+  }
+}
+
+template <DeviceType d>
+void TestIndexMany() {
+  ContextPtr cpu = GetCpuContext();
+  ContextPtr context = (d == kCpu ? cpu : GetCudaContext());
+
+  // With 2 axes the values are the elements; check them via a Ragged<int32_t>
+  // whose values are 0, 1, 2...
+  RaggedShape src = RandomRaggedShape(false, 2, 4, 0, 2000);
+  int32_t dim0 = src.Dim0(), num_indexes = RandInt(0, 2 * dim0);
+  std::vector<int32_t> indexes_vec(num_indexes);
+  for (int32_t &index : indexes_vec) index = RandInt(0, dim0 - 1);
+  Array1<int32_t> indexes(context, indexes_vec);
+  Ragged<int32_t> src_ragged(src.To(context),
+                             Range<int32_t>(context, src.NumElements(), 0));
+
+  Array1<int32_t> value_indexes;
+  Ragged<int32_t> ans = src_ragged.IndexMany(indexes, &value_indexes).To(cpu);
+  ans.shape.Check();
+  ASSERT_EQ(ans.NumAxes(), src.NumAxes());
+  ASSERT_EQ(ans.shape.Dim0(), num_indexes);
+  Array2<int32_t> src_offsets = GetSubTreeOffsets(src);
+  int32_t last_axis = src.NumAxes() - 1;
+  Array1<int32_t> value_indexes_cpu = value_indexes.To(cpu);
+  ASSERT_EQ(value_indexes_cpu.Dim(), ans.values.Dim());
+  // ans[i] should be src[indexes[i]].
+  int32_t value_index = 0;
+  for (int32_t i = 0; i < num_indexes; ++i) {
+    int32_t old_i = indexes_vec[i];
+    if (src.NumAxes() > 2) {
+      // Index() needs at least 3 axes.
+      RaggedShape ans_part = ans.shape.Index(0, i),
+                  src_part = src.Index(0, old_i);
+      ASSERT_EQ(ans_part.NumAxes(), src_part.NumAxes());
+      for (int32_t axis = 1; axis < ans_part.NumAxes(); ++axis) {
+        const Array1<int32_t> &ans_row_splits = ans_part.RowSplits(axis),
+                              &src_row_splits = src_part.RowSplits(axis);
+        ASSERT_EQ(ans_row_splits.Dim(), src_row_splits.Dim());
+        for (int32_t j = 0; j < ans_row_splits.Dim(); ++j)
+          EXPECT_EQ(ans_row_splits.Data()[j], src_row_splits.Data()[j]);
+      }
+    }
+    for (int32_t j = src_offsets[last_axis][old_i];
+         j < src_offsets[last_axis][old_i + 1]; ++j, ++value_index) {
+      EXPECT_EQ(ans.values[value_index], j);
+      EXPECT_EQ(value_indexes_cpu[value_index], j);
+    }
+  }
+  EXPECT_EQ(value_index, ans.values.Dim());
+}
+
+TEST(RaggedTest, TestIndexMany) {
+  for (int32_t i = 0; i < 5; ++i) {
+    TestIndexMany<kCpu>();
+    TestIndexMany<kCuda>();
+  }
+}
+
+TEST(RaggedTest, TestGetSubTreeOffsets) {
+  // [ [ [ 1 2 ] [ 4 ] ] [ [ 3 0 ] ] [ ] ]
+  std::vector<int32_t> row_splits1_vec = {0, 2, 3, 3},
+                       row_splits2_vec = {0, 2, 3, 5};
+  for (auto &context : {GetCpuContext(), GetCudaContext()}) {
+    Array1<int32_t> row_splits1(context, row_splits1_vec),
+        row_splits2(context, row_splits2_vec);
+    RaggedShape shape =
+        RaggedShape3(&row_splits1, nullptr, -1, &row_splits2, nullptr, -1);
+    Array2<int32_t> offsets = GetSubTreeOffsets(shape);
+    ASSERT_EQ(offsets.Dim0(), 3);
+    ASSERT_EQ(offsets.Dim1(), 4);
+    std::vector<std::vector<int32_t>> expected = {
+        {0, 1, 2, 3}, {0, 2, 3, 3}, {0, 3, 5, 5}};
+    for (int32_t axis = 0; axis < 3; ++axis)
+      for (int32_t i = 0; i < 4; ++i)
+        EXPECT_EQ(offsets[axis][i], expected[axis][i]);
+  }
+}
+
+template <DeviceType d>
+void TestSubsampleRagged() {
+  ContextPtr cpu = GetCpuContext();
+  ContextPtr context = (d == kCpu ? cpu : GetCudaContext());
+  // [ [ [ 1 2 ] [ 4 ] ] [ [ 3 0 ] [ 5 ] ] ]
+  std::vector<int32_t> row_splits1_vec = {0, 2, 4},
+                       row_splits2_vec = {0, 2, 3, 5, 6},
+                       values_vec = {1, 2, 4, 3, 0, 5};
+  Array1<int32_t> row_splits1(context, row_splits1_vec),
+      row_splits2(context, row_splits2_vec), values(context, values_vec);
+  Ragged<int32_t> src(
+      RaggedShape3(&row_splits1, nullptr, -1, &row_splits2, nullptr, -1),
+      values);
+
+  // keep values >= 2.
+  const int32_t *values_data = values.Data();
+  auto lambda_keep = [=] __host__ __device__(int32_t i) -> bool {
+    return values_data[i] >= 2;
+  };
+  Renumbering renumbering(context, values.Dim(), lambda_keep);
+  Ragged<int32_t> ans = SubsampleRagged(src, renumbering).To(cpu);
+  ans.shape.Check();
+  CheckRowSplits(ans.shape, {row_splits1_vec, {0, 1, 2, 3, 4}});
+  CheckArrayData<int32_t>(ans.values, std::vector<int32_t>{2, 4, 3, 5});
+
+  RaggedShape shape = SubsampleRaggedShape(src.shape, renumbering).To(cpu);
+  CheckRowSplits(shape, {row_splits1_vec, {0, 1, 2, 3, 4}});
+  EXPECT_EQ(shape.RowIds(2)[3], 3);
+}
+
+TEST(RaggedTest, TestSubsampleRagged) {
+  TestSubsampleRagged<kCpu>();
+  TestSubsampleRagged<kCuda>();
 }
 
 template <typename T, DeviceType d>
@@ -263,38 +441,46 @@ static void CpuSortSublists(const Array1<int32_t> &row_splits, Array1<T> *src) {
 }
 
 template <typename T, typename OP = LessThan<T>>
-static void TestSortSublists() {
+static void TestSortSublists(ContextPtr context,
+                             int32_t max_num_elements = 2000) {
   auto cpu_context = GetCpuContext();
-  auto cuda_context = GetCudaContext();
 
-  RaggedShape shape = RandomRaggedShape(false,  // set_row_ids
-                                        2,      // min_num_axes
-                                        4,      // max_num_axes
-                                        1,      // min_num_elements
-                                        2000);  // max_num_elements
+  RaggedShape shape = RandomRaggedShape(false,              // set_row_ids
+                                        2,                  // min_num_axes
+                                        4,                  // max_num_axes
+                                        1,                  // min_num_elements
+                                        max_num_elements);  // max_num_elements
 
   Array1<T> values =
       RandUniformArray1<T>(shape.Context(), shape.NumElements(), -2000, 2000);
-  Ragged<T> ragged(shape, values);
-  ragged = ragged.To(cuda_context);
-  values = values.To(cpu_context);  // to be sorted by cpu
-
-  // TODO(fangjun): add a `Clone` method to Array1<T>
-  Array1<T> unsorted = values.To(cuda_context).To(cpu_context);
+  // `unsorted` keeps the input, `values` is to be sorted by CpuSortSublists();
+  // both are copies, as on CPU `ragged` would share the memory of `values`.
+  std::vector<T> values_vec(values.Data(), values.Data() + values.Dim());
+  Array1<T> unsorted(cpu_context, values_vec);
+  Ragged<T> ragged = Ragged<T>(shape, values).To(context);
+  values = Array1<T>(cpu_context, values_vec);
 
   Array1<int32_t> order(ragged.Context(), ragged.values.Dim());
   SortSublists<T, OP>(&ragged, &order);
 
   Array1<int32_t> &segment = ragged.shape.RowSplits(ragged.NumAxes() - 1);
-  CpuSortSublists<T, OP>(segment, &values);
+  CpuSortSublists<T, OP>(segment.To(cpu_context), &values);
 
+  Array1<T> sorted = ragged.values.To(cpu_context);
+  Array1<int32_t> order_cpu = order.To(cpu_context);
   int32_t n = order.Dim();
   for (int i = 0; i != n; ++i) {
-    EXPECT_EQ(values[i], ragged.values[i]);
-    EXPECT_EQ(ragged.values[i], unsorted[order[i]]);
+    EXPECT_EQ(values[i], sorted[i]);
+    EXPECT_EQ(sorted[i], unsorted[order_cpu[i]]);
   }
 }
 
+template <typename T, typename OP = LessThan<T>>
+static void TestSortSublists() {
+  TestSortSublists<T, OP>(GetCudaContext());
+  TestSortSublists<T, OP>(GetCpuContext());
+}
+
 TEST(RaggedTest, Ragged) {
   TestRagged<int32_t, kCuda>();
   TestRagged<int32_t, kCpu>();
@@ -303,6 +489,114 @@ TEST(RaggedTest, Ragged) {
 
   TestSortSublists<int32_t>();
   TestSortSublists<double>();
+  TestSortSublists<int32_t, GreaterThan<int32_t>>();
+  TestSortSublists<double, GreaterThan<double>>();
+  TestSortSublists<int64_t>();
+  // large enough to sort in parallel on CPU.
+  TestSortSublists<int32_t>(GetCpuContext(), 100000);
+  TestSortSublists<int32_t>(GetCudaContext(), 100000);
+}
+
+template <DeviceType d>
+void TestAppendAndStack() {
+  ContextPtr cpu = GetCpuContext();  // will use to copy data
+  ContextPtr context = nullptr;
+  if (d == kCpu) {
+    context = GetCpuContext();
+  } else {
+    K2_CHECK_EQ(d, kCuda);
+    context = GetCudaContext();
+  }
+
+  for (int32_t i = 0; i != 8; ++i) {
+    int32_t num_axes = RandInt(2, 4), num_srcs = RandInt(1, 100);
+    std::vector<RaggedShape> srcs(num_srcs);
+    std::vector<RaggedShape *> src_ptrs(num_srcs);
+    for (int32_t j = 0; j != num_srcs; ++j) {
+      // some with row_ids and some without; some may be empty.
+      srcs[j] = RandomRaggedShape(j % 2 == 0, num_axes, num_axes, 0, 100)
+                    .To(context);
+      src_ptrs[j] = &srcs[j];
+    }
+    RaggedShape appended = Append(0, num_srcs, src_ptrs.data()),
+                stacked = Stack(
+                    0, num_srcs,
+                    const_cast<const RaggedShape **>(src_ptrs.data()));
+    appended.Check();
+    stacked.Check();
+    appended = appended.To(cpu);
+    stacked = stacked.To(cpu);
+    ASSERT_EQ(appended.NumAxes(), num_axes);
+    ASSERT_EQ(stacked.NumAxes(), num_axes + 1);
+    EXPECT_EQ(stacked.Dim0(), num_srcs);
+
+    int32_t dim0_offset = 0, elem_offset = 0;
+    for (int32_t j = 0; j != num_srcs; ++j) {
+      RaggedShape src = srcs[j].To(cpu);
+      for (auto iter = src.Iterator(); !iter.Done(); iter.Next()) {
+        std::vector<int32_t> index = iter.Value();
+        int32_t expected = elem_offset + src[index];
+        std::vector<int32_t> stacked_index(index);
+        stacked_index.insert(stacked_index.begin(), j);
+        EXPECT_EQ(stacked[stacked_index], expected);
+        index[0] += dim0_offset;
+        EXPECT_EQ(appended[index], expected);
+      }
+      dim0_offset += src.Dim0();
+      elem_offset += src.NumElements();
+    }
+    EXPECT_EQ(appended.Dim0(), dim0_offset);
+    EXPECT_EQ(appended.NumElements(), elem_offset);
+    EXPECT_EQ(stacked.NumElements(), elem_offset);
+  }
+}
+
+TEST(RaggedTest, AppendAndStack) {
+  TestAppendAndStack<kCpu>();
+  TestAppendAndStack<kCuda>();
+}
+
+template <DeviceType d>
+void TestToPacked() {
+  ContextPtr cpu = GetCpuContext();
+  ContextPtr context = (d == kCpu ? cpu : GetCudaContext());
+  for (int32_t i = 0; i != 5; ++i) {
+    Ragged<int32_t> src = RandomRagged<int32_t>(0, 100, 2, 4, 0, 100);
+    int32_t num_axes = src.NumAxes();
+    for (int32_t with_staging = 0; with_staging != 2; ++with_staging) {
+      RegionPtr staging;
+      Ragged<int32_t> ans =
+          ToPacked(src, context, with_staging ? &staging : nullptr);
+      EXPECT_TRUE(ans.Context()->IsCompatible(*context));
+      if (d == kCpu) {
+        EXPECT_EQ(ans.values.Data(), src.values.Data());
+        continue;
+      }
+      if (with_staging) {
+        EXPECT_NE(staging, nullptr);
+        context->Sync();
+      }
+      // one allocation holds all the arrays, and the sizes are known.
+      for (int32_t axis = 1; axis < num_axes; ++axis) {
+        EXPECT_EQ(ans.shape.RowSplits(axis).GetRegion(),
+                  ans.values.GetRegion());
+        EXPECT_EQ(ans.shape.Axes()[axis - 1].cached_tot_size,
+                  src.shape.TotSize(axis));
+      }
+      auto to_vec = [](const Array1<int32_t> &a) -> std::vector<int32_t> {
+        return std::vector<int32_t>(a.Data(), a.Data() + a.Dim());
+      };
+      for (int32_t axis = 1; axis < num_axes; ++axis)
+        CheckArrayData(ans.shape.RowSplits(axis),
+                       to_vec(src.shape.RowSplits(axis)));
+      CheckArrayData(ans.values, to_vec(src.values));
+    }
+  }
+}
+
+TEST(RaggedTest, ToPacked) {
+  TestToPacked<kCpu>();
+  TestToPacked<kCuda>();
 }
 
 // TODO(Haowen): add more tests for other algorithms
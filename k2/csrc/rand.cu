@@ -0,0 +1,294 @@
+/**
+ * @brief
+ * rand
+ *
+ * @copyright
+ * Copyright (c)  2026  agent (agent@local)
+ *
+ * @copyright
+ * See LICENSE for clarification regarding multiple authors
+ */
+
+#include <cmath>
+#include <vector>
+
+#include "k2/csrc/array_ops.h"
+#include "k2/csrc/rand.h"
+#include "k2/csrc/tensor.h"
+#include "k2/csrc/utils.h"
+
+namespace k2 {
+
+namespace {
+
+// The streams of random numbers used by the generators, so that the numbers
+// of different generators with the same seed are independent.
+enum RandStream : uint64_t {
+  kRandStreamArray1 = 1,
+  kRandStreamRowSizes = 2,  // plus the axis
+  kRandStreamNumStates = 100,
+  kRandStreamOutDegrees = 101,
+  kRandStreamArcs = 102,
+  kRandStreamNumFrames = 200,
+  kRandStreamLogits = 201  // the frames are numbered within
+};
+
+template <typename T>
+struct RandValue;
+
+template <>
+struct RandValue<int32_t> {
+  static __host__ __device__ __forceinline__ int32_t Get(
+      const uint32_t bits[4], int32_t min_value, int32_t max_value) {
+    return RandBitsToInt(bits[0], min_value, max_value);
+  }
+};
+
+template <>
+struct RandValue<float> {
+  static __host__ __device__ __forceinline__ float Get(const uint32_t bits[4],
+                                                       float min_value,
+                                                       float max_value) {
+    return min_value + (max_value - min_value) * RandBitsToFloat(bits[0]);
+  }
+};
+
+template <>
+struct RandValue<double> {
+  static __host__ __device__ __forceinline__ double Get(
+      const uint32_t bits[4], double min_value, double max_value) {
+    // 53 random bits.
+    uint64_t n = (static_cast<uint64_t>(bits[0]) << 21) ^ (bits[1] >> 11);
+    return min_value +
+           (max_value - min_value) * (n * (1.0 / 9007199254740992.0));
+  }
+};
+
+/*
+  Returns the row_splits of `num_rows` rows whose sizes are uniformly
+  distributed in [min_size, max_size], from the stream `stream`.
+ */
+Array1<int32_t> RandRowSplits(ContextPtr &c, int32_t num_rows,
+                              int32_t min_size, int32_t max_size,
+                              uint64_t seed, uint64_t stream) {
+  Array1<int32_t> row_splits(c, num_rows + 1);
+  int32_t *row_splits_data = row_splits.Data();
+  auto lambda_set_sizes = [=] __host__ __device__(int32_t i) -> void {
+    uint32_t bits[4];
+    RandBits(seed, stream, i, bits);
+    row_splits_data[i] =
+        (i == num_rows ? 0 : RandBitsToInt(bits[0], min_size, max_size));
+  };
+  Eval(c, num_rows + 1, lambda_set_sizes);
+  ExclusiveSum(c, num_rows + 1, row_splits_data, row_splits_data);
+  return row_splits;
+}
+
+Array1<int32_t> RowSplitsToRowIds(Array1<int32_t> &row_splits,
+                                  int32_t num_elems) {
+  ContextPtr &c = row_splits.Context();
+  Array1<int32_t> row_ids(c, num_elems);
+  RowSplitsToRowIds(c, row_splits.Dim() - 1, row_splits.Data(), num_elems,
+                    row_ids.Data());
+  return row_ids;
+}
+
+}  // namespace
+
+template <typename T>
+Array1<T> RandArray1(ContextPtr &c, int32_t dim, T min_value, T max_value,
+                     uint64_t seed) {
+  K2_CHECK_GE(dim, 0);
+  K2_CHECK_GE(max_value, min_value);
+  Array1<T> ans(c, dim);
+  T *ans_data = ans.Data();
+  auto lambda_set_values = [=] __host__ __device__(int32_t i) -> void {
+    uint32_t bits[4];
+    RandBits(seed, kRandStreamArray1, i, bits);
+    ans_data[i] = RandValue<T>::Get(bits, min_value, max_value);
+  };
+  Eval(c, dim, lambda_set_values);
+  return ans;
+}
+
+RaggedShape RandRaggedShape(ContextPtr &c, int32_t num_axes, int32_t dim0,
+                            int32_t min_size, int32_t max_size,
+                            uint64_t seed) {
+  K2_CHECK_GE(num_axes, 2);
+  K2_CHECK_GE(dim0, 0);
+  K2_CHECK(min_size >= 0 && max_size >= min_size);
+  std::vector<RaggedShapeDim> axes(num_axes - 1);
+  int32_t num_rows = dim0;
+  for (int32_t axis = 0; axis + 1 < num_axes; ++axis) {
+    RaggedShapeDim &rsd = axes[axis];
+    rsd.row_splits = RandRowSplits(c, num_rows, min_size, max_size, seed,
+                                   kRandStreamRowSizes + axis);
+    rsd.cached_tot_size = rsd.row_splits.Back();
+    rsd.row_ids = RowSplitsToRowIds(rsd.row_splits, rsd.cached_tot_size);
+    num_rows = rsd.cached_tot_size;
+  }
+  return RaggedShape(axes);
+}
+
+template <typename T>
+Ragged<T> RandRagged(ContextPtr &c, int32_t num_axes, int32_t dim0,
+                     int32_t min_size, int32_t max_size, T min_value,
+                     T max_value, uint64_t seed) {
+  RaggedShape shape =
+      RandRaggedShape(c, num_axes, dim0, min_size, max_size, seed);
+  Array1<T> values =
+      RandArray1<T>(c, shape.NumElements(), min_value, max_value, seed);
+  return Ragged<T>(shape, values);
+}
+
+FsaVec RandFsaVec(ContextPtr &c, const RandFsaVecOptions &opts) {
+  K2_CHECK_GE(opts.num_fsas, 0);
+  K2_CHECK(opts.min_num_states >= 2 &&
+           opts.max_num_states >= opts.min_num_states);
+  K2_CHECK(opts.min_out_degree >= 1 &&
+           opts.max_out_degree >= opts.min_out_degree);
+  K2_CHECK_GE(opts.out_degree_skew, 0);
+  K2_CHECK_GE(opts.num_symbols, 1);
+  uint64_t seed = opts.seed;
+
+  Array1<int32_t> row_splits1 =
+      RandRowSplits(c, opts.num_fsas, opts.min_num_states,
+                    opts.max_num_states, seed, kRandStreamNumStates);
+  int32_t num_states = row_splits1.Back();
+  Array1<int32_t> row_ids1 = RowSplitsToRowIds(row_splits1, num_states);
+  const int32_t *row_splits1_data = row_splits1.Data(),
+                *row_ids1_data = row_ids1.Data();
+
+  Array1<int32_t> row_splits2(c, num_states + 1);
+  int32_t *row_splits2_data = row_splits2.Data();
+  int32_t min_out_degree = opts.min_out_degree,
+          num_out_degrees = opts.max_out_degree - opts.min_out_degree + 1;
+  float exponent = 1 + opts.out_degree_skew;
+  auto lambda_set_out_degrees = [=] __host__ __device__(int32_t i) -> void {
+    int32_t degree = 0;
+    if (i != num_states && i + 1 != row_splits1_data[row_ids1_data[i] + 1]) {
+      uint32_t bits[4];
+      RandBits(seed, kRandStreamOutDegrees, i, bits);
+      float u = RandBitsToFloat(bits[0]);
+      int32_t extra =
+          static_cast<int32_t>(num_out_degrees * powf(u, exponent));
+      degree = min_out_degree +
+               (extra < num_out_degrees ? extra : num_out_degrees - 1);
+    }
+    row_splits2_data[i] = degree;
+  };
+  Eval(c, num_states + 1, lambda_set_out_degrees);
+  ExclusiveSum(c, num_states + 1, row_splits2_data, row_splits2_data);
+  int32_t num_arcs = row_splits2.Back();
+  Array1<int32_t> row_ids2 = RowSplitsToRowIds(row_splits2, num_arcs);
+  const int32_t *row_ids2_data = row_ids2.Data();
+
+  Array1<Arc> arcs(c, num_arcs);
+  Arc *arcs_data = arcs.Data();
+  bool acyclic = opts.acyclic;
+  int32_t num_symbols = opts.num_symbols;
+  float min_score = opts.min_score, score_range = opts.max_score - min_score;
+  auto lambda_set_arcs = [=] __host__ __device__(int32_t i) -> void {
+    int32_t state_idx01 = row_ids2_data[i],
+            fsa_idx0 = row_ids1_data[state_idx01],
+            state_idx0x = row_splits1_data[fsa_idx0],
+            src_state = state_idx01 - state_idx0x,
+            final_state = row_splits1_data[fsa_idx0 + 1] - state_idx0x - 1;
+    uint32_t bits[4];
+    RandBits(seed, kRandStreamArcs, i, bits);
+    int32_t dest_state;
+    if (i == row_splits2_data[state_idx01])
+      dest_state = src_state + 1;
+    else if (acyclic)
+      dest_state = RandBitsToInt(bits[0], src_state + 1, final_state);
+    else
+      dest_state = RandBitsToInt(bits[0], 0, final_state);
+    int32_t symbol = (dest_state == final_state
+                          ? -1
+                          : RandBitsToInt(bits[1], 0, num_symbols - 1));
+    arcs_data[i] = Arc(src_state, dest_state, symbol,
+                       min_score + score_range * RandBitsToFloat(bits[2]));
+  };
+  Eval(c, num_arcs, lambda_set_arcs);
+
+  return FsaVec(RaggedShape3(&row_splits1, &row_ids1, num_states,
+                             &row_splits2, &row_ids2, num_arcs),
+                arcs);
+}
+
+DenseFsaVec RandDenseFsaVec(ContextPtr &c,
+                            const RandDenseFsaVecOptions &opts) {
+  K2_CHECK(opts.min_num_frames >= 0 &&
+           opts.max_num_frames >= opts.min_num_frames);
+  K2_CHECK_GE(opts.num_symbols, 1);
+  int32_t num_seqs = opts.num_seqs, max_num_frames = opts.max_num_frames,
+          num_symbols = opts.num_symbols;
+  uint64_t seed = opts.seed;
+
+  Array2<int32_t> segments(c, num_seqs, 2);
+  auto segments_acc = segments.Accessor();
+  int32_t min_num_frames = opts.min_num_frames;
+  auto lambda_set_segments = [=] __host__ __device__(int32_t i) -> void {
+    uint32_t bits[4];
+    RandBits(seed, kRandStreamNumFrames, i, bits);
+    segments_acc(i, 0) = 0;
+    segments_acc(i, 1) = RandBitsToInt(bits[0], min_num_frames, max_num_frames);
+  };
+  Eval(c, num_seqs, lambda_set_segments);
+
+  Tensor nnet_output(c, kFloatDtype,
+                     std::vector<int32_t>{num_seqs, max_num_frames,
+                                          num_symbols});
+  float *output_data = nnet_output.Data<float>();
+  float peak = opts.peak;
+  auto lambda_set_output = [=] __host__ __device__(int32_t row) -> void {
+    float *logits = output_data + static_cast<int64_t>(row) * num_symbols;
+    uint32_t bits[4];
+    // The bits of element 0 of the row are for the peak.
+    RandBits(seed, kRandStreamLogits + row, 0, bits);
+    int32_t peak_symbol = RandBitsToInt(bits[0], 0, num_symbols - 1);
+    float max_logit = -INFINITY;
+    for (int32_t s = 0; s < num_symbols; ++s) {
+      if (s % 4 == 0) RandBits(seed, kRandStreamLogits + row, 1 + s / 4, bits);
+      float logit = 2.0f * RandBitsToFloat(bits[s % 4]) - 1.0f;
+      if (s == peak_symbol) logit += peak;
+      logits[s] = logit;
+      if (logit > max_logit) max_logit = logit;
+    }
+    float sum = 0;
+    for (int32_t s = 0; s < num_symbols; ++s)
+      sum += expf(logits[s] - max_logit);
+    float log_sum = max_logit + logf(sum);
+    for (int32_t s = 0; s < num_symbols; ++s) logits[s] -= log_sum;
+  };
+  Eval(c, num_seqs * max_num_frames, lambda_set_output);
+  return DenseFsaVec(nnet_output, segments);
+}
+
+template Array1<int32_t> RandArray1<int32_t>(ContextPtr &c, int32_t dim,
+                                             int32_t min_value,
+                                             int32_t max_value,
+                                             uint64_t seed);
+template Array1<float> RandArray1<float>(ContextPtr &c, int32_t dim,
+                                         float min_value, float max_value,
+                                         uint64_t seed);
+template Array1<double> RandArray1<double>(ContextPtr &c, int32_t dim,
+                                           double min_value,
+                                           double max_value, uint64_t seed);
+template Ragged<int32_t> RandRagged<int32_t>(ContextPtr &c, int32_t num_axes,
+                                             int32_t dim0, int32_t min_size,
+                                             int32_t max_size,
+                                             int32_t min_value,
+                                             int32_t max_value,
+                                             uint64_t seed);
+template Ragged<float> RandRagged<float>(ContextPtr &c, int32_t num_axes,
+                                         int32_t dim0, int32_t min_size,
+                                         int32_t max_size, float min_value,
+                                         float max_value, uint64_t seed);
+template Ragged<double> RandRagged<double>(ContextPtr &c, int32_t num_axes,
+                                           int32_t dim0, int32_t min_size,
+                                           int32_t max_size,
+                                           double min_value,
+                                           double max_value, uint64_t seed);
+
+}  // namespace k2
@@ -0,0 +1,163 @@
+/**
+ * @brief
+ * rand
+ *
+ * @note
+ * Generators of random test data (ragged arrays, FsaVecs and DenseFsaVecs)
+ * that run on the device of the context they are given.  Unlike
+ * RandomRaggedShape(), RandomRagged() and k2host::RandFsaGenerator, which work
+ * serially on the CPU, each element is computed independently from a
+ * counter-based random number generator (Philox4x32-10), so they are fast
+ * enough to create inputs with hundreds of millions of arcs, and they give the
+ * same result for a given seed on CPU and on GPU.
+ *
+ * @copyright
+ * Copyright (c)  2026  agent (agent@local)
+ *
+ * @copyright
+ * See LICENSE for clarification regarding multiple authors
+ */
+
+#ifndef K2_CSRC_RAND_H_
+#define K2_CSRC_RAND_H_
+
+#include <cstdint>
+
+#include "k2/csrc/array.h"
+#include "k2/csrc/context.h"
+#include "k2/csrc/fsa.h"
+#include "k2/csrc/ragged.h"
+
+namespace k2 {
+
+/*
+  Sets `out` to the Philox4x32-10 random bits (see "Parallel random numbers:
+  as easy as 1, 2, 3", Salmon et al., 2011) of element `i` of the stream
+  `stream`, for the key `seed`.  Different (seed, stream, i) give independent
+  random numbers, so each thread can just compute those of its own elements.
+ */
+__host__ __device__ __forceinline__ void RandBits(uint64_t seed,
+                                                  uint64_t stream, uint64_t i,
+                                                  uint32_t out[4]) {
+  uint32_t ctr[4] = {static_cast<uint32_t>(i), static_cast<uint32_t>(i >> 32),
+                     static_cast<uint32_t>(stream),
+                     static_cast<uint32_t>(stream >> 32)};
+  uint32_t key[2] = {static_cast<uint32_t>(seed),
+                     static_cast<uint32_t>(seed >> 32)};
+  for (int32_t round = 0; round != 10; ++round) {
+    uint64_t prod0 = static_cast<uint64_t>(0xD2511F53u) * ctr[0],
+             prod1 = static_cast<uint64_t>(0xCD9E8D57u) * ctr[2];
+    uint32_t hi0 = static_cast<uint32_t>(prod0 >> 32),
+             lo0 = static_cast<uint32_t>(prod0),
+             hi1 = static_cast<uint32_t>(prod1 >> 32),
+             lo1 = static_cast<uint32_t>(prod1);
+    ctr[0] = hi1 ^ ctr[1] ^ key[0];
+    ctr[1] = lo1;
+    ctr[2] = hi0 ^ ctr[3] ^ key[1];
+    ctr[3] = lo0;
+    key[0] += 0x9E3779B9u;
+    key[1] += 0xBB67AE85u;
+  }
+  for (int32_t k = 0; k != 4; ++k) out[k] = ctr[k];
+}
+
+// Returns a float in [0, 1) from the random bits `bits`.
+__host__ __device__ __forceinline__ float RandBitsToFloat(uint32_t bits) {
+  return (bits >> 8) * (1.0f / 16777216.0f);  // 2^-24
+}
+
+// Returns an integer in [min_value, max_value] from the random bits `bits`.
+__host__ __device__ __forceinline__ int32_t RandBitsToInt(uint32_t bits,
+                                                          int32_t min_value,
+                                                          int32_t max_value) {
+  uint64_t range = static_cast<uint64_t>(max_value - min_value) + 1;
+  return min_value + static_cast<int32_t>((range * bits) >> 32);
+}
+
+/*
+  Returns an array of `dim` numbers uniformly distributed in
+  [min_value, max_value] (for integer T) or [min_value, max_value) (for
+  floating-point T), generated on the device of `c`.  T may be int32_t, float
+  or double.
+ */
+template <typename T>
+Array1<T> RandArray1(ContextPtr &c, int32_t dim, T min_value, T max_value,
+                     uint64_t seed);
+
+/*
+  Returns a random RaggedShape with `num_axes` axes and `dim0` rows, generated
+  on the device of `c`.  The sizes of the sub-lists on each axis are uniformly
+  distributed in [min_size, max_size].  It has row_ids on all axes.  There is
+  one transfer to the host per axis, for its total size.
+ */
+RaggedShape RandRaggedShape(ContextPtr &c, int32_t num_axes, int32_t dim0,
+                            int32_t min_size, int32_t max_size,
+                            uint64_t seed);
+
+// Returns a ragged array with shape RandRaggedShape(c, num_axes, dim0,
+// min_size, max_size, seed) and values RandArray1(..., min_value, max_value).
+template <typename T>
+Ragged<T> RandRagged(ContextPtr &c, int32_t num_axes, int32_t dim0,
+                     int32_t min_size, int32_t max_size, T min_value,
+                     T max_value, uint64_t seed);
+
+struct RandFsaVecOptions {
+  int32_t num_fsas = 1;
+  // The number of states of each FSA is uniformly distributed in
+  // [min_num_states, max_num_states]; requires min_num_states >= 2.
+  int32_t min_num_states = 2;
+  int32_t max_num_states = 10;
+  // The number of arcs leaving each non-final state is in
+  // [min_out_degree, max_out_degree]; requires min_out_degree >= 1.  It is
+  // min_out_degree + (max_out_degree - min_out_degree + 1) * u^(1 +
+  // out_degree_skew), rounded down, where u is uniform in [0, 1), so with
+  // out_degree_skew = 0 it's uniformly distributed, and with larger values
+  // most states have few arcs and some (the hubs) have many.
+  int32_t min_out_degree = 1;
+  int32_t max_out_degree = 4;
+  float out_degree_skew = 0;
+  // If true, every arc goes to a higher-numbered state, so the FSAs are
+  // top-sorted and acyclic; else the dest-states are arbitrary.
+  bool acyclic = true;
+  // The labels are in [0, num_symbols - 1], except those of the arcs to the
+  // final state, which are -1.
+  int32_t num_symbols = 10;
+  // The scores are uniformly distributed in [min_score, max_score).
+  float min_score = -1;
+  float max_score = 0;
+  uint64_t seed = 0;
+};
+
+/*
+  Returns a random FsaVec generated on the device of `c`.  The first arc
+  leaving each non-final state s goes to state s + 1, so all the states are
+  accessible and coaccessible; the others go to random states (higher-numbered
+  ones if opts.acyclic).  There are two transfers to the host, for the total
+  numbers of states and arcs.
+ */
+FsaVec RandFsaVec(ContextPtr &c, const RandFsaVecOptions &opts);
+
+struct RandDenseFsaVecOptions {
+  int32_t num_seqs = 1;
+  // The number of frames of each sequence is uniformly distributed in
+  // [min_num_frames, max_num_frames].
+  int32_t min_num_frames = 1;
+  int32_t max_num_frames = 100;
+  int32_t num_symbols = 10;  // Including blank, i.e. symbol 0.
+  // On each frame one random symbol gets this much added to its logit (the
+  // others are uniform in [-1, 1)), to make the output "peaky" like that of
+  // real models; the scores are the log-softmax of the logits.
+  float peak = 5;
+  uint64_t seed = 0;
+};
+
+/*
+  Returns a DenseFsaVec with random log-probabilities, as from the output of a
+  neural network, generated on the device of `c`.
+ */
+DenseFsaVec RandDenseFsaVec(ContextPtr &c,
+                            const RandDenseFsaVecOptions &opts);
+
+}  // namespace k2
+
+#endif  // K2_CSRC_RAND_H_
@@ -0,0 +1,205 @@
+/**
+ * @brief
+ * rand_test
+ *
+ * @copyright
+ * Copyright (c)  2026  agent (agent@local)
+ *
+ * @copyright
+ * See LICENSE for clarification regarding multiple authors
+ */
+
+#include <gtest/gtest.h>
+
+#include <cmath>
+#include <vector>
+
+#include "k2/csrc/array.h"
+#include "k2/csrc/context.h"
+#include "k2/csrc/fsa.h"
+#include "k2/csrc/rand.h"
+#include "k2/csrc/ragged.h"
+
+namespace k2 {
+
+TEST(RandTest, RandBits) {
+  // Known-answer test of Philox4x32-10 from the Random123 library (kat_vectors:
+  // philox4x32 10 with counter and key all ones).
+  uint32_t bits[4];
+  RandBits(~static_cast<uint64_t>(0), ~static_cast<uint64_t>(0),
+           ~static_cast<uint64_t>(0), bits);
+  EXPECT_EQ(bits[0], 0x408f276du);
+  EXPECT_EQ(bits[1], 0x41c83b0eu);
+  EXPECT_EQ(bits[2], 0xa20bc7c6u);
+  EXPECT_EQ(bits[3], 0x6d5451fdu);
+
+  for (uint32_t b : {0u, 1u, 0x80000000u, 0xffffffffu}) {
+    float f = RandBitsToFloat(b);
+    EXPECT_GE(f, 0.0f);
+    EXPECT_LT(f, 1.0f);
+    int32_t i = RandBitsToInt(b, -3, 5);
+    EXPECT_GE(i, -3);
+    EXPECT_LE(i, 5);
+  }
+  EXPECT_EQ(RandBitsToInt(0xffffffffu, -3, 5), 5);
+}
+
+template <DeviceType d>
+void TestRandRagged() {
+  ContextPtr cpu = GetCpuContext();
+  ContextPtr c = (d == kCuda ? GetCudaContext() : cpu);
+  Ragged<int32_t> ragged =
+      RandRagged<int32_t>(c, 3, 100, 1, 4, -10, 10, 1234);
+  ragged.shape.Check();
+  EXPECT_EQ(ragged.shape.NumAxes(), 3);
+  EXPECT_EQ(ragged.shape.Dim0(), 100);
+  for (int32_t axis = 1; axis != 3; ++axis) {
+    Array1<int32_t> row_splits = ragged.shape.RowSplits(axis).To(cpu);
+    for (int32_t i = 0; i + 1 < row_splits.Dim(); ++i) {
+      int32_t size = row_splits[i + 1] - row_splits[i];
+      EXPECT_GE(size, 1);
+      EXPECT_LE(size, 4);
+    }
+  }
+  Array1<int32_t> values = ragged.values.To(cpu);
+  for (int32_t i = 0; i != values.Dim(); ++i) {
+    EXPECT_GE(values[i], -10);
+    EXPECT_LE(values[i], 10);
+  }
+
+  // The same seed gives the same result on each device, and another one
+  // something else.
+  Ragged<int32_t> ragged_cpu =
+      RandRagged<int32_t>(cpu, 3, 100, 1, 4, -10, 10, 1234);
+  Array1<int32_t> values_cpu = ragged_cpu.values;
+  ASSERT_EQ(values_cpu.Dim(), values.Dim());
+  for (int32_t i = 0; i != values.Dim(); ++i)
+    EXPECT_EQ(values_cpu[i], values[i]);
+  Array1<int32_t> other = RandArray1<int32_t>(cpu, 100, 0, 1000000, 4321),
+                  same = RandArray1<int32_t>(cpu, 100, 0, 1000000, 4321),
+                  different = RandArray1<int32_t>(cpu, 100, 0, 1000000, 1);
+  int32_t num_different = 0;
+  for (int32_t i = 0; i != 100; ++i) {
+    EXPECT_EQ(other[i], same[i]);
+    num_different += (other[i] != different[i]);
+  }
+  EXPECT_GT(num_different, 90);
+
+  Array1<double> doubles = RandArray1<double>(c, 1000, -1.0, 1.0, 5).To(cpu);
+  double sum = 0;
+  for (int32_t i = 0; i != doubles.Dim(); ++i) {
+    EXPECT_GE(doubles[i], -1.0);
+    EXPECT_LT(doubles[i], 1.0);
+    sum += doubles[i];
+  }
+  EXPECT_LT(std::abs(sum / 1000), 0.1);
+}
+
+TEST(RandTest, RandRagged) {
+  TestRandRagged<kCpu>();
+  TestRandRagged<kCuda>();
+}
+
+template <DeviceType d>
+void TestRandFsaVec() {
+  ContextPtr cpu = GetCpuContext();
+  ContextPtr c = (d == kCuda ? GetCudaContext() : cpu);
+  for (bool acyclic : {true, false}) {
+    RandFsaVecOptions opts;
+    opts.num_fsas = 20;
+    opts.min_num_states = 2;
+    opts.max_num_states = 50;
+    opts.min_out_degree = 1;
+    opts.max_out_degree = 8;
+    opts.out_degree_skew = 2;
+    opts.acyclic = acyclic;
+    opts.seed = 20201014;
+    FsaVec fsas = RandFsaVec(c, opts);
+    ASSERT_EQ(fsas.shape.Dim0(), 20);
+    Array1<int32_t> properties;
+    int32_t tot_properties;
+    GetFsaVecBasicProperties(fsas, &properties, &tot_properties);
+    EXPECT_TRUE(tot_properties & kFsaPropertiesValid);
+    EXPECT_TRUE(tot_properties & kFsaPropertiesMaybeAccessible);
+    EXPECT_TRUE(tot_properties & kFsaPropertiesMaybeCoaccessible);
+    if (acyclic)
+      EXPECT_EQ(tot_properties & kFsaPropertiesTopSortedAndAcyclic,
+                kFsaPropertiesTopSortedAndAcyclic);
+
+    FsaVec fsas_cpu = fsas.To(cpu);
+    Array1<int32_t> row_splits1 = fsas_cpu.shape.RowSplits(1),
+                    row_splits2 = fsas_cpu.shape.RowSplits(2);
+    int32_t num_low_degree = 0, num_nonfinal = 0;
+    for (int32_t f = 0; f != 20; ++f) {
+      int32_t num_states = row_splits1[f + 1] - row_splits1[f];
+      EXPECT_GE(num_states, 2);
+      EXPECT_LE(num_states, 50);
+      for (int32_t s = row_splits1[f]; s + 1 < row_splits1[f + 1]; ++s) {
+        int32_t degree = row_splits2[s + 1] - row_splits2[s];
+        EXPECT_GE(degree, 1);
+        EXPECT_LE(degree, 8);
+        num_low_degree += (degree <= 2);
+        ++num_nonfinal;
+      }
+      // The final state has no arcs.
+      int32_t final_state = row_splits1[f + 1] - 1;
+      EXPECT_EQ(row_splits2[final_state + 1], row_splits2[final_state]);
+    }
+    // With the skew, P(degree <= 2) = (2/8)^(1/3) = 0.63.
+    EXPECT_GT(num_low_degree, num_nonfinal / 2);
+
+    // The same on each device.
+    FsaVec fsas2 = RandFsaVec(cpu, opts);
+    ASSERT_EQ(fsas2.values.Dim(), fsas_cpu.values.Dim());
+    for (int32_t i = 0; i != fsas2.values.Dim(); ++i) {
+      const Arc &a = fsas2.values[i], &b = fsas_cpu.values[i];
+      EXPECT_EQ(a.src_state, b.src_state);
+      EXPECT_EQ(a.dest_state, b.dest_state);
+      EXPECT_EQ(a.symbol, b.symbol);
+      EXPECT_EQ(a.score, b.score);
+      EXPECT_LT(a.score, 0);
+      EXPECT_GE(a.score, -1);
+    }
+  }
+}
+
+TEST(RandTest, RandFsaVec) {
+  TestRandFsaVec<kCpu>();
+  TestRandFsaVec<kCuda>();
+}
+
+template <DeviceType d>
+void TestRandDenseFsaVec() {
+  ContextPtr cpu = GetCpuContext();
+  ContextPtr c = (d == kCuda ? GetCudaContext() : cpu);
+  RandDenseFsaVecOptions opts;
+  opts.num_seqs = 5;
+  opts.min_num_frames = 3;
+  opts.max_num_frames = 20;
+  opts.num_symbols = 7;
+  opts.seed = 11;
+  DenseFsaVec dense = RandDenseFsaVec(c, opts);
+  ASSERT_EQ(dense.shape.Dim0(), 5);
+  ASSERT_EQ(dense.NumCols(), 8);
+  Array1<int32_t> row_splits = dense.shape.RowSplits(1).To(cpu);
+  Array2<float> scores = dense.scores.To(cpu);
+  for (int32_t n = 0; n != 5; ++n) {
+    int32_t num_frames = row_splits[n + 1] - row_splits[n] - 1;
+    EXPECT_GE(num_frames, 3);
+    EXPECT_LE(num_frames, 20);
+    for (int32_t r = row_splits[n]; r + 1 < row_splits[n + 1]; ++r) {
+      // The scores of each frame are log-probabilities.
+      const float *row = scores.Data() + r * scores.ElemStride0();
+      double sum = 0;
+      for (int32_t s = 1; s != 8; ++s) sum += std::exp(row[s]);
+      EXPECT_NEAR(sum, 1.0, 1.0e-4);
+    }
+  }
+}
+
+TEST(RandTest, RandDenseFsaVec) {
+  TestRandDenseFsaVec<kCpu>();
+  TestRandDenseFsaVec<kCuda>();
+}
+
+}  // namespace k2
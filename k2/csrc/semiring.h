@@ -0,0 +1,97 @@
+/**
+ * @brief
+ * semiring
+ *
+ * @note
+ * Compile-time semirings for the algorithms on scores of paths, e.g.
+ * GetForwardScores<LogSemiring<float>>().  Each is a struct of static
+ * __host__ __device__ functions, so that the kernels instantiated with it have
+ * no runtime branch on the semiring, and adding one doesn't need a copy of the
+ * algorithms.
+ *
+ * @copyright
+ * Copyright (c)  2026  agent (agent@local)
+ *
+ * @copyright
+ * See LICENSE for clarification regarding multiple authors
+ */
+
+#ifndef K2_CSRC_SEMIRING_H_
+#define K2_CSRC_SEMIRING_H_
+
+#include <cmath>
+
+#include "k2/csrc/utils.h"
+
+namespace k2 {
+
+/*
+  The interface of the semirings is:
+
+     using Value = ...;        // The type of the elements.
+     using PlusOp = ...;       // Functor for Plus(), as used by reductions
+                               // like ApplyOpPerSublist().
+     static Value Zero();      // The identity of Plus().
+     static Value One();       // The identity of Times().
+     static Value Plus(Value a, Value b);
+     static Value Times(Value a, Value b);
+     // The element for an arc with score `score`.
+     static Value FromScore(float score);
+
+  The scores of paths are the Times() of the FromScore() of their arcs, and
+  those of sets of paths the Plus() of the scores of the paths.
+ */
+
+// The max-plus semiring: the score of a set of paths is that of the best one.
+template <typename T>
+struct TropicalSemiring {
+  using Value = T;
+  using PlusOp = MaxOp<T>;
+  static __host__ __device__ __forceinline__ T Zero() {
+    return -static_cast<T>(INFINITY);
+  }
+  static __host__ __device__ __forceinline__ T One() { return T(0); }
+  static __host__ __device__ __forceinline__ T Plus(T a, T b) {
+    return PlusOp()(a, b);
+  }
+  static __host__ __device__ __forceinline__ T Times(T a, T b) {
+    return a + b;
+  }
+  static __host__ __device__ __forceinline__ T FromScore(float score) {
+    return score;
+  }
+};
+
+// The log semiring: the score of a set of paths is the log of the sum of the
+// exp() of their scores.
+template <typename T>
+struct LogSemiring {
+  using Value = T;
+  using PlusOp = LogAddOp<T>;
+  static __host__ __device__ __forceinline__ T Zero() {
+    return -static_cast<T>(INFINITY);
+  }
+  static __host__ __device__ __forceinline__ T One() { return T(0); }
+  static __host__ __device__ __forceinline__ T Plus(T a, T b) {
+    return PlusOp()(a, b);
+  }
+  static __host__ __device__ __forceinline__ T Times(T a, T b) {
+    return a + b;
+  }
+  static __host__ __device__ __forceinline__ T FromScore(float score) {
+    return score;
+  }
+};
+
+// The log semiring with the scores of the arcs ignored: the score of a set of
+// paths is the log of their number.
+template <typename T>
+struct LogCountSemiring : public LogSemiring<T> {
+  static __host__ __device__ __forceinline__ T FromScore(float) {
+    return T(0);
+  }
+};
+
+}  // namespace k2
+
+#endif  // K2_CSRC_SEMIRING_H_
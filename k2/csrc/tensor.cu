@@ -23,15 +23,16 @@ namespace k2 {
 
 Shape::Shape(const std::vector<int32_t> &dims)
     : num_axes_(static_cast<int32_t>(dims.size())) {
-  K2_CHECK_LT(num_axes_, kMaxDim);
+  if (num_axes_ > kNumInlineAxes) heap_.resize(2 * num_axes_);
+  int32_t *this_dims = DimsData(), *this_strides = StridesData();
 
-  std::copy(dims.begin(), dims.end(), dims_);
+  std::copy(dims.begin(), dims.end(), this_dims);
 
-  // compute strides_
-  if (num_axes_ > 0) strides_[num_axes_ - 1] = 1;
+  // compute strides
+  if (num_axes_ > 0) this_strides[num_axes_ - 1] = 1;
 
   for (int32_t i = num_axes_ - 2; i >= 0; --i) {
-    strides_[i] = strides_[i + 1] * dims_[i + 1];
+    this_strides[i] = this_strides[i + 1] * this_dims[i + 1];
   }
 
   num_element_ = ComputeNumElement();
@@ -42,10 +43,10 @@ Shape::Shape(const std::vector<int32_t> &dims)
 Shape::Shape(const std::vector<int32_t> &dims,
              const std::vector<int32_t> strides)
     : num_axes_(static_cast<int32_t>(dims.size())) {
-  K2_CHECK_LT(num_axes_, kMaxDim);
   K2_CHECK_EQ(static_cast<int32_t>(strides.size()), num_axes_);
-  std::copy(dims.begin(), dims.end(), dims_);
-  std::copy(strides.begin(), strides.end(), strides_);
+  if (num_axes_ > kNumInlineAxes) heap_.resize(2 * num_axes_);
+  std::copy(dims.begin(), dims.end(), DimsData());
+  std::copy(strides.begin(), strides.end(), StridesData());
   num_element_ = ComputeNumElement();
   is_contiguous_ = ComputeIsContiguous();
   storage_size_ = ComputeStorageSize();
@@ -54,9 +55,10 @@ Shape::Shape(const std::vector<int32_t> &dims,
 int32_t Shape::ComputeNumElement() const {
   if (num_axes_ == 0) return 0;
 
+  const int32_t *dims = DimsData();
   int32_t elements = 1;
   for (int32_t i = 0; i < num_axes_; ++i) {
-    elements *= dims_[i];
+    elements *= dims[i];
   }
   return elements;
 }
@@ -64,20 +66,22 @@ int32_t Shape::ComputeNumElement() const {
 int32_t Shape::ComputeStorageSize() const {
   if (num_axes_ == 0) return 0;
 
+  const int32_t *dims = DimsData(), *strides = StridesData();
   int32_t size = 1;
   for (int32_t i = 0; i < num_axes_; ++i) {
-    size += (dims_[i] - 1) * strides_[i];
+    size += (dims[i] - 1) * strides[i];
   }
   return size;
 }
 
 bool Shape::ComputeIsContiguous() const {
+  const int32_t *dims = DimsData(), *strides = StridesData();
   int32_t z = 1;
   for (int32_t i = num_axes_ - 1; i >= 0; --i) {
-    K2_CHECK_GE(strides_[i], z);
-    if (dims_[i] != 1) {
-      if (strides_[i] != z) return false;
-      z *= dims_[i];
+    K2_CHECK_GE(strides[i], z);
+    if (dims[i] != 1) {
+      if (strides[i] != z) return false;
+      z *= dims[i];
     }
   }
   return true;
@@ -125,6 +129,20 @@ Tensor Tensor::Index(int32_t axis, int32_t index) const {
   return Tensor(impl_->dtype, shape, impl_->data, byte_offset);
 }
 
+Tensor Tensor::To(ContextPtr ctx) {
+  if (ctx->IsCompatible(*Context())) return *this;
+  Tensor src = ToContiguous(*this);
+  Tensor ans(GetTransferContext(*Context(), ctx), GetDtype(),
+             Dims());
+  int32_t num_bytes = Nelement() * ElementSize();
+  if (num_bytes == 0) return ans;
+  MemoryCopyAsync(ans.Data(), src.Data(), num_bytes, *ans.Context(),
+                  *src.Context());
+  // The data needs to be available on the host when we return.
+  if (ctx->GetDeviceType() == kCpu) src.Context()->Sync();
+  return ans;
+}
+
 void Tensor::Init(ContextPtr c) {
   int32_t storage_size = impl_->shape.StorageSize();
   int32_t element_size = TraitsOf(impl_->dtype).NumBytes();
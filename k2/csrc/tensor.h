@@ -28,24 +28,26 @@ class Shape {
   int32_t Dim(int32_t i) const {
     K2_CHECK_GE(i, 0);
     K2_CHECK_LT(i, num_axes_);
-    return dims_[i];
+    return DimsData()[i];
   }
 
   int32_t Stride(int32_t i) const {
     K2_CHECK_GE(i, 0);
     K2_CHECK_LT(i, num_axes_);
-    return strides_[i];
+    return StridesData()[i];
   }
 
   int32_t Nelement() const { return num_element_; }
   // storage size in elements
 
   std::vector<int32_t> Dims() const {
-    return std::vector<int32_t>(dims_, dims_ + num_axes_);
+    const int32_t *dims = DimsData();
+    return std::vector<int32_t>(dims, dims + num_axes_);
   }
 
   std::vector<int32_t> Strides() const {
-    return std::vector<int32_t>(strides_, strides_ + num_axes_);
+    const int32_t *strides = StridesData();
+    return std::vector<int32_t>(strides, strides + num_axes_);
   }
 
   int32_t StorageSize() const { return storage_size_; }
@@ -56,9 +58,9 @@ class Shape {
   // strides).
   bool SameDims(const Shape &other) const {
     if (num_axes_ != other.NumAxes()) return false;
-    const int32_t *other_dims = other.dims_;
+    const int32_t *dims = DimsData(), *other_dims = other.DimsData();
     for (int32_t i = 0; i != num_axes_; ++i) {
-      if (dims_[i] != other_dims[i]) return false;
+      if (dims[i] != other_dims[i]) return false;
     }
     return true;
   }
@@ -71,9 +73,12 @@ class Shape {
                  const std::vector<int32_t> strides);
 
   Shape(const Shape &other) = default;
+  Shape &operator=(const Shape &other) = default;
 
  private:
-  static const int32_t kMaxDim = 4;  // Will increase this as needed
+  // Shapes with up to this many axes keep their dims and strides inline;
+  // others (which are rare) keep them in heap_.
+  static const int32_t kNumInlineAxes = 4;
 
   int32_t num_axes_ = 0;  // Must be >= 0
   int32_t num_element_ = 0;
@@ -81,9 +86,25 @@ class Shape {
   bool is_contiguous_ = true;
 
   // elements of dims_ and strides_ >= num_axes_ are currently not set;
-  // in future we may change this.
-  int32_t dims_[kMaxDim];
-  int32_t strides_[kMaxDim];  // Strides in elements
+  // in future we may change this.  Only used if num_axes_ <= kNumInlineAxes.
+  int32_t dims_[kNumInlineAxes];
+  int32_t strides_[kNumInlineAxes];  // Strides in elements
+  // If num_axes_ > kNumInlineAxes: the dims followed by the strides; else
+  // empty.
+  std::vector<int32_t> heap_;
+
+  const int32_t *DimsData() const {
+    return num_axes_ <= kNumInlineAxes ? dims_ : heap_.data();
+  }
+  int32_t *DimsData() {
+    return num_axes_ <= kNumInlineAxes ? dims_ : heap_.data();
+  }
+  const int32_t *StridesData() const {
+    return num_axes_ <= kNumInlineAxes ? strides_ : heap_.data() + num_axes_;
+  }
+  int32_t *StridesData() {
+    return num_axes_ <= kNumInlineAxes ? strides_ : heap_.data() + num_axes_;
+  }
 
   // compute the number of elements
   int32_t ComputeNumElement() const;
@@ -136,6 +157,7 @@ class Tensor {
   template <typename T>
   T *Data() {
     K2_CHECK_EQ(impl_->dtype, DtypeOf<T>::dtype);
+    impl_->data->MarkModified();
     return reinterpret_cast<T *>(reinterpret_cast<char *>(impl_->data->data) +
                                  impl_->byte_offset);
   }
@@ -148,6 +170,7 @@ class Tensor {
   }
 
   void *Data() const {
+    impl_->data->MarkModified();
     return reinterpret_cast<char *>(impl_->data->data) + impl_->byte_offset;
   }
 
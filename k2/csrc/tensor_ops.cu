@@ -4,13 +4,100 @@
 
 // See ../../LICENSE for clarification regarding multiple authors
 
+#include <cstdint>
 #include <vector>
 
+#include "k2/csrc/array_ops.h"
 #include "k2/csrc/dtype.h"
 #include "k2/csrc/tensor_ops.h"
 
 namespace k2 {
 
+namespace {
+
+// Copying doesn't need to know the dtype, only the element size, so we copy
+// as one of these types; this also covers dtypes that FOR_ALL_DTYPES()
+// doesn't, like kHalfDtype.  The expression is variadic so it may contain
+// commas.
+#define FOR_ALL_ELEMENT_SIZES(NumBytes, TypeName, ...)               \
+  do {                                                               \
+    switch (NumBytes) {                                              \
+      case 1: {                                                      \
+        using TypeName = int8_t;                                     \
+        __VA_ARGS__;                                                 \
+        break;                                                       \
+      }                                                              \
+      case 2: {                                                      \
+        using TypeName = int16_t;                                    \
+        __VA_ARGS__;                                                 \
+        break;                                                       \
+      }                                                              \
+      case 4: {                                                      \
+        using TypeName = int32_t;                                    \
+        __VA_ARGS__;                                                 \
+        break;                                                       \
+      }                                                              \
+      case 8: {                                                      \
+        using TypeName = int64_t;                                    \
+        __VA_ARGS__;                                                 \
+        break;                                                       \
+      }                                                              \
+      default:                                                       \
+        K2_LOG(FATAL) << "Unsupported element size " << (NumBytes);  \
+        break;                                                       \
+    }                                                                \
+  } while (0)
+
+// Dims and strides of a copy with `NumAxes` axes; passed to kernels by value,
+// with the rank known at compile time so the index arithmetic is unrolled.
+template <int32_t NumAxes>
+struct StridedCopyLayout {
+  int32_t dims[NumAxes];
+  int32_t src_strides[NumAxes];
+  int32_t dest_strides[NumAxes];
+};
+
+/*
+  Gets the simplest set of axes that describes the copy from `src` to `dest`:
+  axes with dim 1 are removed, and successive axes are merged if they are
+  contiguous w.r.t. each other in both `src` and `dest`.  E.g. copying
+  between two contiguous tensors gives a single axis with stride 1.  Returns
+  false if there is nothing to copy (some dim is 0).
+*/
+bool GetCopyAxes(const Shape &src, const Shape &dest,
+                 std::vector<int32_t> *dims,
+                 std::vector<int32_t> *src_strides,
+                 std::vector<int32_t> *dest_strides) {
+  dims->clear();
+  src_strides->clear();
+  dest_strides->clear();
+  for (int32_t i = 0; i < src.NumAxes(); ++i) {
+    int32_t dim = src.Dim(i);
+    if (dim == 0) return false;
+    if (dim == 1) continue;
+    if (!dims->empty() &&
+        src_strides->back() == src.Stride(i) * dim &&
+        dest_strides->back() == dest.Stride(i) * dim) {
+      // merge with the previous axis.
+      dims->back() *= dim;
+      src_strides->back() = src.Stride(i);
+      dest_strides->back() = dest.Stride(i);
+    } else {
+      dims->push_back(dim);
+      src_strides->push_back(src.Stride(i));
+      dest_strides->push_back(dest.Stride(i));
+    }
+  }
+  if (dims->empty()) {  // a single element
+    dims->push_back(1);
+    src_strides->push_back(1);
+    dest_strides->push_back(1);
+  }
+  return true;
+}
+
+}  // namespace
+
 template <typename T>
 void CopyTensorElements2d(ContextPtr c, int32_t dim0, int32_t dim1,
                           const T *src_data, int32_t src_stride0,
@@ -25,6 +112,10 @@ void CopyTensorElements2d(ContextPtr c, int32_t dim0, int32_t dim1,
             src_data[i * src_stride0 + j * src_stride1];
       }
     }
+  } else if (dest_stride0 == 1 && dest_stride1 != 1) {
+    // Swap the axes so that consecutive threads write consecutive elements.
+    CopyTensorElements2d(c, dim1, dim0, src_data, src_stride1, src_stride0,
+                         dest_data, dest_stride1, dest_stride0);
   } else {
     auto lambda_set_elems = [=] __host__ __device__(int32_t i,
                                                     int32_t j) -> void {
@@ -40,7 +131,11 @@ void CopyTensorElements1d(ContextPtr c, int32_t dim, const T *src_data,
                           int32_t src_stride, T *dest_data,
                           int32_t dest_stride) {
   DeviceType d = c->GetDeviceType();
-  if (d == kCpu) {
+  if (src_stride == 1 && dest_stride == 1) {
+    MemoryCopyAsync(static_cast<void *>(dest_data),
+                    static_cast<const void *>(src_data), dim * sizeof(T), *c,
+                    *c);
+  } else if (d == kCpu) {
     // this is just an optimization, the other branch would work for CPU too.
     for (int32_t i = 0; i < dim; i++) {
       dest_data[i * dest_stride] = src_data[i * src_stride];
@@ -49,48 +144,122 @@ void CopyTensorElements1d(ContextPtr c, int32_t dim, const T *src_data,
     auto lambda_set_elems = [=] __host__ __device__(int32_t i) -> void {
       dest_data[i * dest_stride] = src_data[i * src_stride];
     };
-    Eval(c, dim, lambda_set_elems);
+    Eval<LaunchPolicy<256, 4>>(c, dim, lambda_set_elems);
   }
 }
 
-// TODO(dan): this is far from ideal in terms of efficiency.  There is no
-// attempt to discover the simplest pattern that covers the copy, or to be smart
-// about memory loads if it turns out to be a transposition.
+template <int32_t NumAxes, typename T>
+void CopyTensorElementsNd(ContextPtr c, const StridedCopyLayout<NumAxes> &layout,
+                          const T *src_data, T *dest_data) {
+  int32_t n = 1;
+  for (int32_t i = 0; i < NumAxes; ++i) n *= layout.dims[i];
+  auto lambda_set_elems = [=] __host__ __device__(int32_t i) -> void {
+    int32_t src_offset = 0, dest_offset = 0;
+#pragma unroll
+    for (int32_t axis = NumAxes - 1; axis >= 0; --axis) {
+      int32_t dim = layout.dims[axis], index = i % dim;
+      i /= dim;
+      src_offset += index * layout.src_strides[axis];
+      dest_offset += index * layout.dest_strides[axis];
+    }
+    dest_data[dest_offset] = src_data[src_offset];
+  };
+  Eval(c, n, lambda_set_elems);
+}
+
+template <int32_t NumAxes, typename T>
+void CopyTensorElementsNd(ContextPtr c, const std::vector<int32_t> &dims,
+                          const std::vector<int32_t> &src_strides,
+                          const std::vector<int32_t> &dest_strides,
+                          const T *src_data, T *dest_data) {
+  StridedCopyLayout<NumAxes> layout;
+  for (int32_t i = 0; i < NumAxes; ++i) {
+    layout.dims[i] = dims[i];
+    layout.src_strides[i] = src_strides[i];
+    layout.dest_strides[i] = dest_strides[i];
+  }
+  CopyTensorElementsNd<NumAxes, T>(c, layout, src_data, dest_data);
+}
+
+// For copies with more axes than we have instantiated
+// CopyTensorElementsNd() for: the layout is passed in an array instead.
+template <typename T>
+void CopyTensorElementsGeneric(ContextPtr c, const std::vector<int32_t> &dims,
+                               const std::vector<int32_t> &src_strides,
+                               const std::vector<int32_t> &dest_strides,
+                               const T *src_data, T *dest_data) {
+  int32_t num_axes = static_cast<int32_t>(dims.size()), n = 1;
+  std::vector<int32_t> layout_vec(dims);
+  layout_vec.insert(layout_vec.end(), src_strides.begin(), src_strides.end());
+  layout_vec.insert(layout_vec.end(), dest_strides.begin(),
+                    dest_strides.end());
+  for (int32_t dim : dims) n *= dim;
+  Array1<int32_t> layout(c, layout_vec);
+  const int32_t *layout_data = layout.Data();
+  auto lambda_set_elems = [=] __host__ __device__(int32_t i) -> void {
+    int32_t src_offset = 0, dest_offset = 0;
+    for (int32_t axis = num_axes - 1; axis >= 0; --axis) {
+      int32_t dim = layout_data[axis], index = i % dim;
+      i /= dim;
+      src_offset += index * layout_data[num_axes + axis];
+      dest_offset += index * layout_data[2 * num_axes + axis];
+    }
+    dest_data[dest_offset] = src_data[src_offset];
+  };
+  Eval(c, n, lambda_set_elems);
+}
+
 void CopyTensorElements(Tensor src, Tensor dest) {
   K2_CHECK(src.SameDim(dest));
   ContextPtr c = GetContext(src, dest);
-  int32_t num_axes = src.NumAxes();
-  if (num_axes > 2) {
-    // For now, only directly support copies of at most 2 dims.
-    int32_t leading_dim = src.Dim(0);
-    ParallelRunner pr(c);
-    for (int32_t i = 0; i < leading_dim; i++) {
-      With(pr.NewStream());
-      Tensor src_part = src.Index(0, i), dest_part = dest.Index(0, i);
-      CopyTensorElements(src_part, dest_part);
-    }
-  } else {
-    const Shape &src_shape = src.GetShape(), &dest_shape = dest.GetShape();
-    int32_t src_stride0 = (num_axes > 0 ? src_shape.Stride(0) : 0),
-            dest_stride0 = (num_axes > 0 ? dest_shape.Stride(0) : 0),
-            dim0 = (num_axes > 0 ? src_shape.Dim(0) : 1);
-    Dtype dtype = src.GetDtype();
-    K2_CHECK(dtype == dest.GetDtype());
-    int32_t num_axes = src.NumAxes();
-    if (num_axes == 2) {
-      int32_t src_stride1 = src_shape.Stride(1),
-              dest_stride1 = dest_shape.Stride(1), dim1 = src_shape.Dim(1);
-      FOR_ALL_DTYPES(dtype, T,
-                     CopyTensorElements2d<T>(
-                         c, dim0, dim1, src.Data<T>(), src_stride0, src_stride1,
-                         dest.Data<T>(), dest_stride0, dest_stride1));
-    } else {
-      FOR_ALL_DTYPES(
-          dtype, T,
-          CopyTensorElements1d<T>(c, dim0, src.Data<T>(), src_stride0,
-                                  dest.Data<T>(), dest_stride0));
-    }
-  }
+  Dtype dtype = src.GetDtype();
+  K2_CHECK(dtype == dest.GetDtype());
+  std::vector<int32_t> dims, src_strides, dest_strides;
+  if (!GetCopyAxes(src.GetShape(), dest.GetShape(), &dims, &src_strides,
+                   &dest_strides))
+    return;
+  int32_t num_axes = static_cast<int32_t>(dims.size());
+  FOR_ALL_ELEMENT_SIZES(
+      TraitsOf(dtype).NumBytes(), T,
+      {
+        const T *src_data = reinterpret_cast<const T *>(src.Data());
+        T *dest_data = reinterpret_cast<T *>(dest.Data());
+        switch (num_axes) {
+          case 1:
+            CopyTensorElements1d<T>(c, dims[0], src_data, src_strides[0],
+                                    dest_data, dest_strides[0]);
+            break;
+          case 2:
+            if (c->GetDeviceType() == kCuda && src_strides[0] == 1 &&
+                dest_strides[1] == 1 && src_strides[1] >= dims[0] &&
+                dest_strides[0] >= dims[1]) {
+              // `src` is the transpose of a matrix with contiguous rows, so
+              // use the tiled Transpose(), which is coalesced on both sides.
+              Array2<T> src_trans(dims[1], dims[0], src_strides[1],
+                                  src.ByteOffset(), src.GetRegion()),
+                  dest_array(dims[0], dims[1], dest_strides[0],
+                             dest.ByteOffset(), dest.GetRegion());
+              Transpose(c, src_trans, &dest_array);
+            } else {
+              CopyTensorElements2d<T>(c, dims[0], dims[1], src_data,
+                                      src_strides[0], src_strides[1],
+                                      dest_data, dest_strides[0],
+                                      dest_strides[1]);
+            }
+            break;
+          case 3:
+            CopyTensorElementsNd<3, T>(c, dims, src_strides, dest_strides,
+                                       src_data, dest_data);
+            break;
+          case 4:
+            CopyTensorElementsNd<4, T>(c, dims, src_strides, dest_strides,
+                                       src_data, dest_data);
+            break;
+          default:
+            CopyTensorElementsGeneric<T>(c, dims, src_strides, dest_strides,
+                                         src_data, dest_data);
+        }
+      });
 }
 
 Tensor ToContiguous(const Tensor &src) {
@@ -101,37 +270,117 @@ Tensor ToContiguous(const Tensor &src) {
   return ans;
 }
 
+// Casts one element; conversions to and from half go through float.
+template <typename T, typename U>
+struct CastElement {
+  __host__ __device__ __forceinline__ U operator()(T t) const {
+    return static_cast<U>(t);
+  }
+};
+
+template <typename U>
+struct CastElement<__half, U> {
+  __host__ __device__ __forceinline__ U operator()(__half t) const {
+    return static_cast<U>(__half2float(t));
+  }
+};
+
+template <typename T>
+struct CastElement<T, __half> {
+  __host__ __device__ __forceinline__ __half operator()(T t) const {
+    return __float2half(static_cast<float>(t));
+  }
+};
+
+template <>
+struct CastElement<__half, __half> {
+  __host__ __device__ __forceinline__ __half operator()(__half t) const {
+    return t;
+  }
+};
+
+// For vectorized loads and stores, e.g. of a float4.
+template <typename T, int32_t N>
+struct alignas(sizeof(T) * N) AlignedVector {
+  T val[N];
+};
+
 template <typename T, typename U>
 void CastTensorElements1dContiguous(ContextPtr c, int32_t dim,
                                     const T *src_data, U *dest_data) {
   DeviceType d = c->GetDeviceType();
+  CastElement<T, U> cast;
   if (d == kCpu) {
     // this is just an optimization, the other branch would work for CPU too.
     for (int32_t i = 0; i < dim; i++) {
-      dest_data[i] = static_cast<U>(src_data[i]);
+      dest_data[i] = cast(src_data[i]);
     }
-  } else {
+    return;
+  }
+  // Each thread converts kVec elements with one load and one store of up to
+  // 16 bytes (e.g. half -> float loads 4 halfs and stores a float4), if the
+  // pointers are aligned for that.
+  constexpr int32_t kMaxSize = (sizeof(T) > sizeof(U) ? sizeof(T) : sizeof(U)),
+                    kVec = 16 / kMaxSize;
+  using SrcVec = AlignedVector<T, kVec>;
+  using DestVec = AlignedVector<U, kVec>;
+  bool aligned = reinterpret_cast<uintptr_t>(src_data) % sizeof(SrcVec) == 0 &&
+                 reinterpret_cast<uintptr_t>(dest_data) % sizeof(DestVec) == 0;
+  if (kVec == 1 || !aligned) {
     auto lambda_cast_elems = [=] __host__ __device__(int32_t i) -> void {
-      dest_data[i] = static_cast<U>(src_data[i]);
+      dest_data[i] = cast(src_data[i]);
     };
     Eval(c, dim, lambda_cast_elems);
+    return;
   }
+  // threads [0, num_vecs) do a vector each, and the rest do the remaining
+  // elements one by one.
+  int32_t num_vecs = dim / kVec, num_left = dim - num_vecs * kVec;
+  const SrcVec *src_vecs = reinterpret_cast<const SrcVec *>(src_data);
+  DestVec *dest_vecs = reinterpret_cast<DestVec *>(dest_data);
+  auto lambda_cast_vecs = [=] __host__ __device__(int32_t i) -> void {
+    if (i < num_vecs) {
+      SrcVec src = src_vecs[i];
+      DestVec dest;
+#pragma unroll
+      for (int32_t k = 0; k < kVec; ++k) dest.val[k] = cast(src.val[k]);
+      dest_vecs[i] = dest;
+    } else {
+      int32_t j = num_vecs * kVec + (i - num_vecs);
+      dest_data[j] = cast(src_data[j]);
+    }
+  };
+  Eval(c, num_vecs + num_left, lambda_cast_vecs);
 }
 
+// Like FOR_ALL_DTYPES(), but also covers kHalfDtype.
+#define FOR_ALL_DTYPES_AND_HALF(DtypeValue, TypeName, Expr) \
+  do {                                                     \
+    if ((DtypeValue) == kHalfDtype) {                      \
+      using TypeName = __half;                             \
+      Expr;                                                \
+    } else {                                               \
+      FOR_ALL_DTYPES(DtypeValue, TypeName, Expr);          \
+    }                                                      \
+  } while (0)
+
 Tensor Cast(Tensor src, Dtype new_dtype) {
+  Dtype old_dtype = src.GetDtype();
+  if (old_dtype == new_dtype && src.IsContiguous()) return src;
   if (!src.IsContiguous()) src = ToContiguous(src);
+  if (old_dtype == new_dtype) return src;
 
   ContextPtr c = src.Context();
   Tensor ans(c, new_dtype, src.GetShape());
   K2_DCHECK(ans.IsContiguous());
 
-  Dtype old_dtype = src.GetDtype();
   int32_t dim = ans.Nelement();
 
-  FOR_ALL_DTYPES(old_dtype, T,
-                 FOR_ALL_DTYPES(new_dtype, U,
-                                (CastTensorElements1dContiguous<T, U>(
-                                    c, dim, src.Data<T>(), ans.Data<U>()))));
+  FOR_ALL_DTYPES_AND_HALF(
+      old_dtype, T,
+      FOR_ALL_DTYPES_AND_HALF(new_dtype, U,
+                              (CastTensorElements1dContiguous<T, U>(
+                                  c, dim, src.Data<T>(), ans.Data<U>()))));
   return ans;
 }
 
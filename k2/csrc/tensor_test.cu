@@ -15,8 +15,10 @@
 
 #include <algorithm>
 #include <numeric>
+#include <utility>
 #include <vector>
 
+#include "k2/csrc/array.h"
 #include "k2/csrc/context.h"
 #include "k2/csrc/tensor.h"
 #include "k2/csrc/tensor_ops.h"
@@ -96,6 +98,30 @@ TEST(TensorTest, Shape) {
     std::vector<int32_t> expected_strides(shape.Strides());
     EXPECT_EQ(expected_strides, strides);
   }
+
+  // shapes with more axes than are stored inline
+  {
+    std::vector<int32_t> dims = {2, 1, 3, 2, 2, 4};
+    Shape shape(dims);
+    EXPECT_EQ(shape.NumAxes(), 6);
+    EXPECT_EQ(shape.Nelement(), 96);
+    EXPECT_EQ(shape.StorageSize(), 96);
+    EXPECT_TRUE(shape.IsContiguous());
+    EXPECT_EQ(shape.Dims(), dims);
+    EXPECT_THAT(shape.Strides(), ::testing::ElementsAre(48, 48, 16, 8, 4, 1));
+
+    std::vector<int32_t> strides = {100, 48, 16, 8, 4, 1};
+    Shape shape2(dims, strides);
+    EXPECT_FALSE(shape2.IsContiguous());
+    EXPECT_EQ(shape2.StorageSize(), 148);
+    Shape shape3(shape2);
+    EXPECT_TRUE(shape3.SameDims(shape));
+    EXPECT_EQ(shape3.Strides(), strides);
+    shape3 = Shape({3, 2});
+    EXPECT_EQ(shape3.NumAxes(), 2);
+    EXPECT_THAT(shape3.Strides(), ::testing::ElementsAre(2, 1));
+    EXPECT_EQ(shape2.Stride(5), 1);
+  }
 }
 
 TEST(TensorTest, Tensor) {
@@ -287,4 +313,92 @@ TEST(TensorTest, Tensor) {
   }
 }
 
+template <DeviceType d>
+void TestCopyTensorElements() {
+  ContextPtr cpu = GetCpuContext();  // will use to copy data
+  ContextPtr context = nullptr;
+  if (d == kCpu) {
+    context = GetCpuContext();
+  } else {
+    K2_CHECK_EQ(d, kCuda);
+    context = GetCudaContext();
+  }
+  // pairs of (dims, strides); these cover the 1-d, 2-d (incl. transposed)
+  // and 3-, 4- and 6-d paths, and axes that get merged or dropped.
+  std::vector<std::pair<std::vector<int32_t>, std::vector<int32_t>>> layouts =
+      {{{7}, {3}},
+       {{2, 3, 2, 3, 2, 2}, {1, 2, 6, 12, 36, 72}},
+       {{4, 1, 6}, {6, 100, 1}},
+       {{3, 5}, {1, 3}},
+       {{40, 50}, {1, 41}},
+       {{3, 5}, {10, 2}},
+       {{2, 3, 4}, {24, 8, 2}},
+       {{2, 3, 4, 5}, {1, 2, 6, 24}},
+       {{2, 0, 3}, {3, 3, 1}}};
+  for (const auto &layout : layouts) {
+    Shape shape(layout.first, layout.second);
+    std::vector<int32_t> src_vec(std::max(shape.StorageSize(), 1));
+    std::iota(src_vec.begin(), src_vec.end(), 0);
+    Array1<int32_t> src_array(context, src_vec);
+    Tensor src(kInt32Dtype, shape, src_array.GetRegion(),
+               src_array.ByteOffset());
+    Tensor ans = ToContiguous(src).To(cpu);
+    ASSERT_TRUE(ans.IsContiguous());
+    ASSERT_EQ(ans.Nelement(), shape.Nelement());
+    const int32_t *ans_data = ans.Data<int32_t>();
+    int32_t num_axes = shape.NumAxes();
+    for (int32_t i = 0; i != shape.Nelement(); ++i) {
+      int32_t index = i, offset = 0;
+      for (int32_t axis = num_axes - 1; axis >= 0; --axis) {
+        offset += (index % shape.Dim(axis)) * shape.Stride(axis);
+        index /= shape.Dim(axis);
+      }
+      EXPECT_EQ(ans_data[i], src_vec[offset]);
+    }
+  }
+}
+
+template <DeviceType d>
+void TestCast() {
+  ContextPtr cpu = GetCpuContext();  // will use to copy data
+  ContextPtr context = nullptr;
+  if (d == kCpu) {
+    context = GetCpuContext();
+  } else {
+    K2_CHECK_EQ(d, kCuda);
+    context = GetCudaContext();
+  }
+  for (int32_t offset : {0, 1}) {  // offset 1 is not aligned for vectors.
+    for (int32_t n : {1, 4, 1003}) {
+      // small integers are exact in half precision.
+      std::vector<float> src_vec(n + offset);
+      for (int32_t i = 0; i != n + offset; ++i) src_vec[i] = i % 200 - 100;
+      Array1<float> src_array = Array1<float>(context, src_vec).Range(offset, n);
+      Tensor src(kFloatDtype, Shape({n}), src_array.GetRegion(),
+                 src_array.ByteOffset());
+
+      Tensor half_tensor = Cast(src, kHalfDtype);
+      EXPECT_EQ(half_tensor.GetDtype(), kHalfDtype);
+      Tensor back = Cast(half_tensor, kFloatDtype).To(cpu);
+      Tensor as_double = Cast(src, kDoubleDtype).To(cpu);
+      const float *back_data = back.Data<float>();
+      const double *double_data = as_double.Data<double>();
+      for (int32_t i = 0; i != n; ++i) {
+        EXPECT_EQ(back_data[i], src_vec[i + offset]);
+        EXPECT_EQ(double_data[i], src_vec[i + offset]);
+      }
+    }
+  }
+}
+
+TEST(TensorTest, CopyTensorElements) {
+  TestCopyTensorElements<kCpu>();
+  TestCopyTensorElements<kCuda>();
+}
+
+TEST(TensorTest, Cast) {
+  TestCast<kCpu>();
+  TestCast<kCuda>();
+}
+
 }  // namespace k2
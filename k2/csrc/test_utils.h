@@ -0,0 +1,94 @@
+/**
+ * @brief
+ * test_utils
+ *
+ * @copyright
+ * Copyright (c)  2026  agent (agent@local)
+ *
+ * @copyright
+ * See LICENSE for clarification regarding multiple authors
+ */
+
+#ifndef K2_CSRC_TEST_UTILS_H_
+#define K2_CSRC_TEST_UTILS_H_
+
+#include <algorithm>
+#include <vector>
+
+#include "k2/csrc/array.h"
+#include "k2/csrc/context.h"
+#include "k2/csrc/fsa.h"
+#include "k2/csrc/log.h"
+#include "k2/csrc/tensor.h"
+
+namespace k2 {
+
+/*
+  Returns the small decoding graph that the tests of the dense intersection
+  share, as an FsaVec with one Fsa on context `c`:
+
+      0 -> 1 (symbol 1, score 0.5), 0 -> 1 (symbol 2),
+      1 -> 1 (symbol 1), 1 -> 2 (symbol 2), 2 -> 3 (symbol -1).
+ */
+inline FsaVec MakeTestGraph(ContextPtr c) {
+  std::vector<int32_t> row_splits1_vec = {0, 2, 4, 5, 5};
+  std::vector<Arc> arcs_vec = {{0, 1, 1, 0.5}, {0, 1, 2, 0}, {1, 1, 1, 0},
+                               {1, 2, 2, 0}, {2, 3, -1, 0}};
+  Array1<int32_t> row_splits1(c, row_splits1_vec);
+  Fsa fsa(RaggedShape2(&row_splits1, nullptr, -1),
+          Array1<Arc>(c, arcs_vec));
+  return FsaVecFromFsa(fsa);
+}
+
+/*
+  Returns the float nnet output, on context `c`, of 2 sequences with
+  `num_frames` frames and `num_symbols` symbols (including symbol 0).
+  `scores` is the nnet output in row-major order; it must have
+  2 * num_frames * num_symbols elements.
+ */
+inline Tensor MakeTestNnetOutput(ContextPtr c, int32_t num_frames,
+                                 int32_t num_symbols,
+                                 const std::vector<float> &scores) {
+  K2_CHECK_EQ(static_cast<int32_t>(scores.size()),
+              2 * num_frames * num_symbols);
+  Tensor nnet_output(GetCpuContext(), kFloatDtype,
+                     std::vector<int32_t>{2, num_frames, num_symbols});
+  std::copy(scores.begin(), scores.end(), nnet_output.Data<float>());
+  return nnet_output.To(c);
+}
+
+/*
+  Returns the nnet output that the tests of the dense intersection share,
+  decoded with MakeTestGraph(): 2 sequences with 2 frames and 3 symbols.
+ */
+inline Tensor MakeTestNnetOutput(ContextPtr c) {
+  return MakeTestNnetOutput(c, 2, 3,
+                            {0, -1, -2, 0, -3, -1,    // seq 0
+                             0, -1, -2, 0, -3, -1});  // seq 1
+}
+
+/*
+  Returns the supervision segments, on the CPU, of 2 sequences, given as
+  {start0, duration0, start1, duration1}; the segment of sequence i is in
+  sequence i of the nnet output.
+ */
+inline Array2<int32_t> MakeTestSegments(const std::vector<int32_t> &segments) {
+  K2_CHECK_EQ(segments.size(), 4u);
+  Array2<int32_t> ans(GetCpuContext(), 2, 2);
+  std::copy(segments.begin(), segments.end(), ans.Data());
+  return ans;
+}
+
+/*
+  Returns the DenseFsaVec of MakeTestNnetOutput(c), where sequence 0 has
+  2 frames and sequence 1 has 1 frame.
+ */
+inline DenseFsaVec MakeTestDenseFsaVec(ContextPtr c) {
+  Tensor nnet_output = MakeTestNnetOutput(c);
+  Array2<int32_t> segments = MakeTestSegments({0, 2, 0, 1});
+  return DenseFsaVec(nnet_output, segments);
+}
+
+}  // namespace k2
+
+#endif  // K2_CSRC_TEST_UTILS_H_
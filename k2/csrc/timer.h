@@ -12,26 +12,59 @@
 #ifndef K2_CSRC_TIMER_H_
 #define K2_CSRC_TIMER_H_
 
+#include <chrono>
+
+#include "k2/csrc/context.h"
 #include "k2/csrc/log.h"
 
 namespace k2 {
 class Timer {
  public:
-  Timer() {
-    K2_CHECK_CUDA_ERROR(cudaEventCreate(&time_start_));
-    K2_CHECK_CUDA_ERROR(cudaEventCreate(&time_end_));
-    Reset();
+  // Times the work on the default stream (stream 0) of the current device.
+  Timer() : stream_(0) { Init(); }
+
+  /*
+    Times the work queued on the stream of `context` if it is a CUDA context;
+    for a CPU context it measures the wall-clock time.
+   */
+  explicit Timer(ContextPtr context) : context_(context) {
+    if (context_->GetDeviceType() == kCpu) {
+      Reset();
+      return;
+    }
+    stream_ = context_->GetCudaStream();
+    Init();
   }
 
   ~Timer() {
+    if (!UseEvents()) return;
+    DeviceGuard guard(GetDeviceId());
     K2_CHECK_CUDA_ERROR(cudaEventDestroy(time_start_));
     K2_CHECK_CUDA_ERROR(cudaEventDestroy(time_end_));
   }
 
-  void Reset() { K2_CHECK_CUDA_ERROR(cudaEventRecord(time_start_, 0)); }
+  Timer(const Timer &) = delete;
+  Timer &operator=(const Timer &) = delete;
+
+  void Reset() {
+    if (!UseEvents()) {
+      cpu_start_ = std::chrono::steady_clock::now();
+      return;
+    }
+    DeviceGuard guard(GetDeviceId());
+    K2_CHECK_CUDA_ERROR(cudaEventRecord(time_start_, stream_));
+  }
 
+  // Returns the seconds since the constructor or Reset(); waits for the work
+  // queued on the stream.
   double Elapsed() {
-    K2_CHECK_CUDA_ERROR(cudaEventRecord(time_end_, 0));
+    if (!UseEvents()) {
+      return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                           cpu_start_)
+          .count();
+    }
+    DeviceGuard guard(GetDeviceId());
+    K2_CHECK_CUDA_ERROR(cudaEventRecord(time_end_, stream_));
     K2_CHECK_CUDA_ERROR(cudaEventSynchronize(time_end_));
 
     float ms_elapsed;
@@ -41,8 +74,27 @@ class Timer {
   }
 
  private:
-  cudaEvent_t time_start_;
-  cudaEvent_t time_end_;
+  void Init() {
+    DeviceGuard guard(GetDeviceId());
+    K2_CHECK_CUDA_ERROR(cudaEventCreate(&time_start_));
+    K2_CHECK_CUDA_ERROR(cudaEventCreate(&time_end_));
+    Reset();
+  }
+
+  bool UseEvents() const {
+    return context_ == nullptr || context_->GetDeviceType() != kCpu;
+  }
+
+  // -1 (i.e. the current device) for the default constructor.
+  int32_t GetDeviceId() const {
+    return context_ == nullptr ? -1 : context_->GetDeviceId();
+  }
+
+  ContextPtr context_;  // nullptr for the default constructor.
+  cudaStream_t stream_ = 0;
+  cudaEvent_t time_start_ = nullptr;
+  cudaEvent_t time_end_ = nullptr;
+  std::chrono::steady_clock::time_point cpu_start_;
 };
 
 }  // namespace k2
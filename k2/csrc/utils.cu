@@ -11,6 +11,11 @@
 
 #include "k2/csrc/utils.h"
 
+#include <memory>
+
+#include "k2/csrc/moderngpu_allocator.h"
+#include "moderngpu/kernel_load_balance.hxx"
+
 namespace k2 {
 
 // See FillValues() where this is invoked.  It fills a region with
@@ -74,52 +79,10 @@ static int32_t RoundUpToNearestPowerOfTwo(int32_t n) {
   return n + 1;
 }
 
-/*
-
-  See declaration of RowSplitsToRowIds() in utils.h.  These are implementation
-  notes.
-
-    Suppose the range we need to fill with a
-    particular number (say, x) is from 1010 to 10000 inclusive (binary) The
-    first kernel writes x to positions 1010, 1100, 10000; the significance of
-    that sequence is we keep adding the smallest number we can add to get
-    another zero at the end of the binary representation, until we exceed the
-    range we're supposed to fill.  The second kernel: for a given index into x
-    that is must fill (say, 1111), it asks "is the index currently here already
-    the right one?", which it can test using the function is_valid_index()
-    below; if it's not already correct, it searches in a sequence of positions:
-    1110, 1100, 1000, 0000, like our sequence above but going downwards, again
-    getting more zeros at the end of the binary representation, until it finds
-    the correct value in the array at the searched position; then it copies the
-    discovered value the original position requested (here, 1111).
-
-
-    First kernel pseudocode: for each index 'i' into 't', it does:
-      for (int32_t n=0, j = t[i]; j < t[i+1]; n++) {
-         x[j] = i;
-         if (j & (1<<n))  j += (1 << n);
-      }
-    Second kernel pseudocode: for each element of x, it searches for the right
-  index.  Suppose we're given num_indexes == length(n) == length(t) - 1.  Define
-  is_valid_index as follows:
-       // returns true if j is the value that we should be putting at position
-  'i' in x:
-       // that is, if t[j] <= i < t[j+1].
-       bool is_valid_index(i, j) {
-          return (j >= 0 && j < num_indexes && t[j] <= i && i < t[j+1]);
-       }
-       // We suppose we are given i (the position into x that we're responsible
-  for
-       // setting:
-       orig_i = i;
-       for (int32_t n=0; !is_valid_index(i, x[i]); n++) {
-         if (i & (1<<n))  i -= (1 << n);
-       }
-       x[orig_i] = x[i];
-*/
+// See declaration of RowSplitsToRowIds() in utils.h.
 void RowSplitsToRowIds(ContextPtr &c, int32_t num_rows,
                        const int32_t *row_splits, int32_t num_elems,
-                       int32_t *row_ids) {
+                       int32_t *row_ids, RowIdsMethod method) {
   if (num_rows <= 0) return;
   DeviceType d = c->GetDeviceType();
   if (d == kCpu) {
@@ -133,10 +96,14 @@ void RowSplitsToRowIds(ContextPtr &c, int32_t num_rows,
     }
   } else {
     K2_CHECK_EQ(d, kCuda);
-    if (1) {
-      // TODO: compare this for speed with the other branch.  This is branch is
-      // much simpler, and will be considerably faster for "normal" cases ->
-      // probably preferred.
+    if (num_elems == 0) return;
+    if (method == RowIdsMethod::kAuto) {
+      // With at most one element per row on average, one thread per row is
+      // as balanced as it gets and avoids the search over the rows.
+      method = (num_rows >= num_elems ? RowIdsMethod::kThreadPerRow
+                                      : RowIdsMethod::kLoadBalance);
+    }
+    if (method == RowIdsMethod::kThreadPerRow) {
       int32_t avg_elems_per_row = (num_elems + num_rows - 1) / num_rows,
               threads_per_row = RoundUpToNearestPowerOfTwo(avg_elems_per_row),
               tot_threads = num_rows * threads_per_row;
@@ -147,63 +114,10 @@ void RowSplitsToRowIds(ContextPtr &c, int32_t num_rows,
                                                   c->GetCudaStream()>>>(
           num_rows, threads_per_row, row_splits, num_elems, row_ids));
     } else {
-      // TODO: Will probably just delete this branch at some point.
-
-      // The following algorithm isn't particularly adapted to GPU hardware in
-      // terms of coalesced reads and writes and so on, but it has reasonable
-      // asymptotic time complexity (assuming all kernels run in parallel),
-      // specifically: O(log(largest(row_splits[i+1]-row_splits[i])))
-
-      auto lambda_init_minus_one = [=] __host__ __device__(int32_t i) {
-        row_ids[i] = -1;
-      };
-      Eval(c, num_elems + 1, lambda_init_minus_one);
-
-      auto lambda_phase_one = [=] __host__ __device__(int32_t i) {
-        int32_t this_row_split = row_splits[i],
-                next_row_split =
-                    (i < num_rows ? row_splits[i + 1] : this_row_split + 1);
-        if (this_row_split < next_row_split) row_ids[this_row_split] = i;
-        // we have to fill in row_ids[this_row_split],
-        // row_ids[this_row_split+1]... row_ids[next_row_split-1] with the same
-        // value but that could be a long loop. Instead we write at
-        // this_row_split and all indexes this_row_split < i < next_row_split
-        // such that i is the result of rounding up this_row_split to
-        // (something)*2^n, for n = 1, 2, 3, ... this will take time logarithmic
-        // in (next_row_split - this_row_split). we can then fill in the gaps
-        // with a logarithmic-time loop, by looking for a value that's not (-1)
-        // by rounding the current index down to successively higher powers
-        // of 2.
-        for (int32_t power = 0, j = this_row_split;
-             j + (1 << power) < next_row_split; power++) {
-          if (j & (1 << power)) {
-            j += (1 << power);
-            // we know that j is now < next_row_split, because we checked "j +
-            // (1<<power) < next_row_split" in the loop condition.
-            // Note, we don't want a loop-within-a-loop because of how SIMT
-            // works...
-            row_ids[j] = i;
-          }
-        }
-      };
-      Eval(c, num_elems + 1, lambda_phase_one);
-
-      auto lambda_phase_two = [=] __host__ __device__(int32_t j) {
-        int32_t row_index = row_ids[j];
-        if (row_index != -1) return;
-        int32_t power = 0, j2 = j;
-        for (; row_index != -1; power++) {
-          if (j2 & (1 << power)) {
-            j2 -= (1 << power);
-            row_index = row_ids[j2];
-          }
-          assert(power < 31);
-        }
-        row_ids[j] = row_ids[j2];
-      };
-      // could do the next line for num_elems+1, but the element at `num_elems`
-      // will already be set.
-      Eval(c, num_elems, lambda_phase_two);
+      K2_CHECK(method == RowIdsMethod::kLoadBalance);
+      mgpu::context_t &mgpu_context = GetModernGpuContext(c);
+      K2_CUDA_SAFE_CALL(mgpu::load_balance_search(
+          num_elems, row_splits, num_rows, row_ids, mgpu_context));
     }
   }
 }
@@ -495,6 +409,27 @@ job_idx_this_task }; redirect_out[num_tasks + job_idx] = tr;
 }
 */
 
+/*
+  Returns the number of `darts` that land before position `x`, for
+  0 <= x <= num_items, if we throw `num_tasks` darts at positions
+  floor(k * num_items / num_tasks) for 0 <= k < num_tasks.  This is the
+  number of k such that floor(k * num_items / num_tasks) < x, which is
+  min(num_tasks, ceil(x * num_tasks / num_items)).  Requires num_items > 0.
+
+  The darts that land in [row_splits[i], row_splits[i+1]) (relative to
+  row_splits[0]) are the jobs in the second half of the TaskRedirect array
+  that get assigned to task i, so each task gets a number of extra jobs roughly
+  proportional to its amount of work, and the total number of darts is exactly
+  num_tasks.
+ */
+__host__ __device__ __forceinline__ int32_t NumDartsBefore(int32_t x,
+                                                           int32_t num_items,
+                                                           int32_t num_tasks) {
+  int64_t ans = (static_cast<int64_t>(x) * num_tasks + num_items - 1) /
+                num_items;
+  return ans < num_tasks ? static_cast<int32_t>(ans) : num_tasks;
+}
+
 /*
   This is a quite simple implementation of GetTaskRedirect... I had a more
   complicated one above that had better O(N) performance for hard cases, but
@@ -508,35 +443,24 @@ template <int32_t threads_per_task>
 __global__ void GetTaskRedirect(int32_t num_tasks, const int32_t *row_splits,
                                 TaskRedirect *redirect_out) {
   int32_t task_idx = (blockIdx.x * blockDim.x + threadIdx.x) / threads_per_task;
-  if (task_idx > num_tasks) return;
-  // `thread_idx` is which member we are of the group of the `threads_per_job`
-  // threads for this job.
+  if (task_idx >= num_tasks) return;
+  // `thread_idx` is which member we are of the group of the `threads_per_task`
+  // threads for this task.
   int32_t thread_idx =
       threadIdx.x %
-      threads_per_task;  // we assume blockDim.x % threads_per_job == 0
-  // `temp_idx` is which index in the temporary storage `temp` we are assigned
-  // (one per job).
+      threads_per_task;  // we assume blockDim.x % threads_per_task == 0
 
   int32_t row_splits0 = row_splits[0], row_splits_nt = row_splits[num_tasks],
           num_items = row_splits_nt - row_splits0;  // the 'num_items' is the
                                                     // total amount of work to
                                                     // do, that we want to
                                                     // distribute fairly evenly.
-
-  // The idea with `dart_separation` is this: Half of the jobs we allocate to
-  // the corresponding tasks.  The other half we allocate by throwing darts onto
-  // the interval [0, num_items - 1], evenly spaced starting from 0, and seeing
-  // which tasks they land in.  This is somewhat random but it ensures that if
-  // any task has a very large amount of work to do, it will get a roughly
-  // proportionate number of jobs.
-  int32_t dart_separation = num_items / num_tasks;
-
   if (num_items <= 0) {
     K2_DCHECK_EQ(num_items, 0);
     // This is a special case where there is no work to do; we give a trivial
     // assignment of tasks to jobs and return
     static_assert(threads_per_task >= 2, "threads per task must >= 2");
-    if (thread_idx < 2 && task_idx < num_tasks) {
+    if (thread_idx < 2) {
       TaskRedirect tr{task_idx, 2, static_cast<uint16_t>(thread_idx)};
       redirect_out[task_idx + thread_idx * num_tasks] = tr;
     }
@@ -545,63 +469,68 @@ __global__ void GetTaskRedirect(int32_t num_tasks, const int32_t *row_splits,
 
   // TODO(dan): IDK how well the hardware combines these memory requests; could
   // consider loading to shared memory first.
-  int32_t this_row_split = row_splits[task_idx],
-          next_row_split = row_splits[task_idx + 1];
+  int32_t this_darts = NumDartsBefore(row_splits[task_idx] - row_splits0,
+                                      num_items, num_tasks),
+          next_darts = NumDartsBefore(row_splits[task_idx + 1] - row_splits0,
+                                      num_items, num_tasks);
   // `num_jobs` below is the number of jobs that will be active for
   // this task.  (The "1 +".. is the job that we assign for each
   // task, one job per task, in the "first half" of the jobs).
-  // the job_idx we're working out below is the job_idx for the
-  // "second half" of
-  int32_t num_jobs_this_task =
-      1 + (next_row_split / dart_separation - this_row_split / dart_separation);
+  int32_t num_jobs_this_task = 1 + next_darts - this_darts;
   K2_CHECK_EQ(static_cast<int32_t>(static_cast<uint16_t>(num_jobs_this_task)),
               num_jobs_this_task);
   for (int32_t job_id_this_task = thread_idx;
        job_id_this_task < num_jobs_this_task;
        job_id_this_task += threads_per_task) {
-    int32_t job_idx = (job_id_this_task == 0 ? task_idx :  // 1st half
-                           num_tasks + (this_row_split / dart_separation) +
-                               job_id_this_task);  // 2nd half.
+    int32_t job_idx =
+        (job_id_this_task == 0 ? task_idx :  // 1st half
+             num_tasks + this_darts + job_id_this_task - 1);  // 2nd half.
     redirect_out[job_idx] =
         TaskRedirect{task_idx, static_cast<uint16_t>(num_jobs_this_task),
                      static_cast<uint16_t>(job_id_this_task)};
-    // `job` is the job-index within this task, i.e. the
   }
 }
 
 void GetTaskRedirect(cudaStream_t stream, int32_t num_tasks,
                      const int32_t *row_splits, TaskRedirect *redirect_out) {
+  if (num_tasks <= 0) return;
   if (stream == kCudaStreamInvalid) {
     // there's not much point in using this on CPU as there are better ways
     // to do things (sequentially), but this can be useful for debugging.
-
+    int32_t row_splits0 = row_splits[0],
+            row_splits_nt = row_splits[num_tasks],
+            num_items = row_splits_nt - row_splits0;
+    if (num_items <= 0) {
+      K2_CHECK_EQ(num_items, 0);
+      for (int32_t task = 0; task < num_tasks; task++) {
+        redirect_out[task] = TaskRedirect{task, 2, 0};
+        redirect_out[task + num_tasks] = TaskRedirect{task, 2, 1};
+      }
+      return;
+    }
     for (int32_t task = 0; task < num_tasks; task++) {
-      // The idea with `dart_separation` is this: Half of the jobs we allocate
-      // to the corresponding tasks.  The other half we allocate by throwing
-      // darts onto the interval [0, num_items - 1], evenly spaced starting from
-      // 0, and seeing which tasks they land in.  This is somewhat random but it
-      // ensures that if any task has a very large amount of work to do, it will
-      // get a roughly proportionate number of jobs.
-      int32_t row_splits0 = row_splits[0],
-              row_splits_nt = row_splits[num_tasks],
-              num_items = row_splits_nt - row_splits0,
-              dart_separation = num_items / num_tasks;
-      int32_t this_row_split = row_splits[task],
-              next_row_split = row_splits[task + 1];
-      int32_t num_jobs_this_task = 1 + (next_row_split / dart_separation -
-                                        this_row_split / dart_separation);
+      // Half of the jobs we allocate to the corresponding tasks.  The other
+      // half we allocate by throwing darts onto the interval [0, num_items -
+      // 1], evenly spaced starting from 0, and seeing which tasks they land
+      // in.  This is somewhat random but it ensures that if any task has a
+      // very large amount of work to do, it will get a roughly proportionate
+      // number of jobs.
+      int32_t this_darts = NumDartsBefore(row_splits[task] - row_splits0,
+                                          num_items, num_tasks),
+              next_darts = NumDartsBefore(row_splits[task + 1] - row_splits0,
+                                          num_items, num_tasks);
+      int32_t num_jobs_this_task = 1 + next_darts - this_darts;
       K2_CHECK_EQ(
           static_cast<int32_t>(static_cast<uint16_t>(num_jobs_this_task)),
           num_jobs_this_task);
       for (int32_t job_id_this_task = 0; job_id_this_task < num_jobs_this_task;
            job_id_this_task++) {
-        int32_t job_idx = (job_id_this_task == 0 ? task :  // 1st half
-                               num_tasks + (this_row_split / dart_separation) +
-                                   job_id_this_task);  // 2nd half.
+        int32_t job_idx =
+            (job_id_this_task == 0 ? task :  // 1st half
+                 num_tasks + this_darts + job_id_this_task - 1);  // 2nd half.
         redirect_out[job_idx] =
             TaskRedirect{task, static_cast<uint16_t>(num_jobs_this_task),
                          static_cast<uint16_t>(job_id_this_task)};
-        // `job` is the job-index within this task, i.e. the
       }
     }
   } else {
@@ -616,14 +545,33 @@ void GetTaskRedirect(cudaStream_t stream, int32_t num_tasks,
     int32_t grid_size = NumBlocks(tot_threads, block_size);
 
     K2_CUDA_SAFE_CALL(GetTaskRedirect<threads_per_task>
-                      <<<block_size, grid_size, 0, stream>>>(
+                      <<<grid_size, block_size, 0, stream>>>(
                           num_tasks, row_splits, redirect_out));
   }
 }
 
 void GetTaskRedirect(ContextPtr &c, int32_t num_tasks,
                      const int32_t *row_splits, TaskRedirect *redirect_out) {
-  // TODO
+  GetTaskRedirect(c->GetCudaStream(), num_tasks, row_splits, redirect_out);
+}
+
+int32_t GetThreadsPerJob(cudaStream_t stream, int32_t num_jobs,
+                         int32_t min_threads_per_job, int32_t tot_work,
+                         int32_t target_num_loops) {
+  K2_CHECK_GT(min_threads_per_job, 0);
+  K2_CHECK_GT(num_jobs, 0);
+  if (stream == kCudaStreamInvalid) return min_threads_per_job;
+  if (target_num_loops < 1) target_num_loops = 1;
+  // `target_threads` is how many threads we'd like in total.
+  int64_t target_threads =
+      (static_cast<int64_t>(tot_work) + target_num_loops - 1) /
+      target_num_loops;
+  int32_t max_threads_per_job = std::max(min_threads_per_job, 256);
+  int32_t threads_per_job = min_threads_per_job;
+  while (threads_per_job * 2 <= max_threads_per_job &&
+         static_cast<int64_t>(threads_per_job) * num_jobs < target_threads)
+    threads_per_job *= 2;
+  return threads_per_job;
 }
 
 }  // namespace k2
@@ -14,6 +14,8 @@
 #define K2_CSRC_UTILS_H_
 
 #include <algorithm>
+#include <cmath>
+#include <cstring>
 #include <vector>
 
 #include "k2/csrc/context.h"
@@ -192,10 +194,26 @@ namespace k2 {
   for each index i that is not a multiple of BLOCK_SIZE, add to it the value at
   the most recent multiple of BLOCK_SIZE, so the array would look like [ 0 1 3 6
   10 15 ].
+     - On CPU, arrays with at least kMinParallelEvalSize elements are scanned
+  with a blocked two-pass algorithm using the threads of ParallelFor(): the
+  sums of the blocks are computed in parallel, then scanned serially, then
+  each block is scanned in parallel starting from its offset.
+
+  `dest` may equal `src` (i.e. the scan may be done in place).
  */
 template <typename SrcPtr, typename DestPtr>
 void ExclusiveSum(ContextPtr &c, int32_t n, SrcPtr src, DestPtr dest);
 
+/*
+  Does the same as ExclusiveSum(), and returns dest[n-1] on the host, which
+  when `src` has n-1 elements is their total (e.g. the total size when
+  computing row_splits from sizes).  On GPU the copy of the total is queued
+  straight after the scan into pinned memory, if available, so this is
+  cheaper than reading the last element afterwards.  Requires n >= 1.
+ */
+template <typename SrcPtr, typename T>
+T ExclusiveSumWithTotal(ContextPtr &c, int32_t n, SrcPtr src, T *dest);
+
 /* Return the maximum value of the device array 't'.  Note: the sum will be
    initialized with T(0).
 
@@ -206,6 +224,20 @@ void ExclusiveSum(ContextPtr &c, int32_t n, SrcPtr src, DestPtr dest);
 template <typename T>
 T MaxValue(ContextPtr &c, int32_t nelems, const T *t);
 
+// The algorithms that RowSplitsToRowIds() can use on GPU.
+enum class RowIdsMethod {
+  kAuto,  // kThreadPerRow if num_rows >= num_elems, else kLoadBalance.
+  // For each row, a group of threads (as many as the average row length,
+  // rounded up to a power of 2) writes its elements.  Good for rows of
+  // similar lengths, but badly imbalanced if a few rows hold most of the
+  // elements.
+  kThreadPerRow,
+  // Each element finds its row by a merge-path search over `row_splits` (as
+  // in moderngpu's load_balance_search()), so the work per thread does not
+  // depend on the row lengths.
+  kLoadBalance
+};
+
 /*
   This is a rather special purpose function that is used in RaggedShape.
 
@@ -230,12 +262,18 @@ T MaxValue(ContextPtr &c, int32_t nelems, const T *t);
        @param [out] row_ids   Start of row_ids vector, we write the output to
                               here. Length is num_elems.
 
+       @param [in] method     The algorithm to use on GPU (ignored on CPU);
+                              this is only for testing and benchmarking, the
+                              default will choose automatically.  See
+                              RowIdsMethod.
+
    Note: there is another function of the same name using the Array1 interface,
    declared in array_ops.h, that may be more convenient.
 */
 void RowSplitsToRowIds(ContextPtr &c, int32_t num_rows,
                        const int32_t *row_splits, int32_t num_elems,
-                       int32_t *row_ids);
+                       int32_t *row_ids,
+                       RowIdsMethod method = RowIdsMethod::kAuto);
 
 /*
   This function works out the row_id of `this` index from row-splits, using
@@ -359,6 +397,19 @@ struct TaskRedirect {
 void GetTaskRedirect(ContextPtr &c, int32_t num_tasks,
                      const int32_t *row_splits, TaskRedirect *redirect_out);
 
+/*
+  Returns the number of threads per job that EvalWithRedirect() will use; this
+  is a power-of-2 multiple of `min_threads_per_job`, chosen so that each thread
+  does about `target_num_loops` work items (assuming the work is evenly
+  distributed over jobs).  On CPU (stream == kCudaStreamInvalid) there is no
+  benefit in having more than the minimum, so it returns min_threads_per_job.
+  It never returns more than max(min_threads_per_job, 256) (the block size
+  Eval() uses), so that the threads of a job never span more than one block.
+ */
+int32_t GetThreadsPerJob(cudaStream_t stream, int32_t num_jobs,
+                         int32_t min_threads_per_job, int32_t tot_work,
+                         int32_t target_num_loops);
+
 /*
   EvalWithRedirect() is like Eval() but for when the task have variable
   amounts of work to do (most naturally involving loops).  You would call
@@ -412,7 +463,85 @@ void EvalWithRedirect(cudaStream_t stream, int32_t num_jobs,
                       TaskRedirect *redirect, int32_t min_threads_per_job,
                       int32_t tot_work, int32_t target_num_loops,
                       LambdaT &lambda) {
-  // TODO:
+  if (num_jobs <= 0) return;
+  int32_t threads_per_job =
+      GetThreadsPerJob(stream, num_jobs, min_threads_per_job, tot_work,
+                       target_num_loops);
+  auto lambda_redirect = [=] __host__ __device__(int32_t i) -> void {
+    int32_t job_idx = i / threads_per_job,
+            thread_idx_this_job = i % threads_per_job;
+    TaskRedirect tr = redirect[job_idx];
+    lambda(tr.task_id, tr.num_jobs_this_task * threads_per_job,
+           tr.job_id_this_task * threads_per_job + thread_idx_this_job);
+  };
+  Eval(stream, num_jobs * threads_per_job, lambda_redirect);
+}
+
+/*
+  This is as the other template of EvalWithRedirect(), except that it takes an
+  extra lambda `lambda_one_off`, of type LambdaU, that will be run as
+  lambda_one_off() exactly once (on the device, if `stream` is a CUDA stream),
+  in the same kernel as `lambda`.  This is useful for things like writing the
+  final element of a row_splits or row_ids array without a separate kernel
+  launch.  No ordering is guaranteed between `lambda_one_off` and any of the
+  invocations of `lambda`.
+ */
+template <typename LambdaT, typename LambdaU>
+void EvalWithRedirect(cudaStream_t stream, int32_t num_jobs,
+                      TaskRedirect *redirect, int32_t min_threads_per_job,
+                      int32_t tot_work, int32_t target_num_loops,
+                      LambdaT &lambda, LambdaU &lambda_one_off) {
+  if (num_jobs <= 0) {
+    // Still honor the promise that `lambda_one_off` is called exactly once.
+    auto lambda_call_once = [=] __host__ __device__(int32_t) -> void {
+      lambda_one_off();
+    };
+    Eval(stream, 1, lambda_call_once);
+    return;
+  }
+  int32_t threads_per_job =
+      GetThreadsPerJob(stream, num_jobs, min_threads_per_job, tot_work,
+                       target_num_loops);
+  auto lambda_redirect = [=] __host__ __device__(int32_t i) -> void {
+    if (i == 0) lambda_one_off();
+    int32_t job_idx = i / threads_per_job,
+            thread_idx_this_job = i % threads_per_job;
+    TaskRedirect tr = redirect[job_idx];
+    lambda(tr.task_id, tr.num_jobs_this_task * threads_per_job,
+           tr.job_id_this_task * threads_per_job + thread_idx_this_job);
+  };
+  Eval(stream, num_jobs * threads_per_job, lambda_redirect);
+}
+
+template <typename ContextPtrType, typename LambdaT>
+void EvalWithRedirect(ContextPtrType c, int32_t num_jobs,
+                      TaskRedirect *redirect, int32_t min_threads_per_job,
+                      int32_t tot_work, int32_t target_num_loops,
+                      LambdaT &lambda) {
+  DeviceGuard guard(*c);
+  EvalWithRedirect(c->GetCudaStream(), num_jobs, redirect,
+                   min_threads_per_job, tot_work, target_num_loops, lambda);
+}
+
+/*
+  Returns the row that element `elem` belongs to, i.e. the largest `row` with
+  0 <= row < num_rows and row_splits[row] <= elem.  This is a binary search, so
+  it's suitable for small `row_splits` that are shared by many threads, e.g.
+  mapping output positions to source arrays in Append().  Requires
+  num_rows > 0; if elem == row_splits[num_rows], returns num_rows - 1.
+ */
+__host__ __device__ __forceinline__ int32_t FindRow(const int32_t *row_splits,
+                                                    int32_t num_rows,
+                                                    int32_t elem) {
+  int32_t lo = 0, hi = num_rows - 1;
+  while (lo < hi) {
+    int32_t mid = (lo + hi + 1) >> 1;
+    if (row_splits[mid] <= elem)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+  return lo;
 }
 
 __host__ __device__ __forceinline__ int32_t FloatAsInt(float f) {
@@ -450,13 +579,77 @@ __host__ __device__ __forceinline__ float OrderedIntToFloat(int32_t i) {
 /*
   Host version of Cuda's atomicMax function, marked __host__ (the default) for
   clarity.  So we can use this in lambdas that run on both host and device.
+  It is atomic, since on CPU Eval() may run lambdas in multiple threads.
  */
 __host__ __forceinline__ int32_t atomicMax(int32_t *address, int32_t val) {
-  int32_t old = *address;
-  if (old < val) *address = val;
+  int32_t old = __atomic_load_n(address, __ATOMIC_RELAXED);
+  while (old < val &&
+         !__atomic_compare_exchange_n(address, &old, val, true,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    // `old` was updated with the current value; try again.
+  }
   return old;
 }
 
+/*
+  Host versions of Cuda's atomicAdd, for the same reason as atomicMax() above.
+ */
+__host__ __forceinline__ int32_t atomicAdd(int32_t *address, int32_t val) {
+  return __atomic_fetch_add(address, val, __ATOMIC_RELAXED);
+}
+
+__host__ __forceinline__ float atomicAdd(float *address, float val) {
+  int32_t *address_as_int = reinterpret_cast<int32_t *>(address);
+  int32_t old = __atomic_load_n(address_as_int, __ATOMIC_RELAXED);
+  while (!__atomic_compare_exchange_n(address_as_int, &old,
+                                      FloatAsInt(IntAsFloat(old) + val), true,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    // `old` was updated with the current value; try again.
+  }
+  return IntAsFloat(old);
+}
+
+__host__ __forceinline__ double atomicAdd(double *address, double val) {
+  static_assert(sizeof(double) == sizeof(int64_t), "");
+  int64_t *address_as_int = reinterpret_cast<int64_t *>(address);
+  int64_t old = __atomic_load_n(address_as_int, __ATOMIC_RELAXED), sum;
+  double old_val;
+  do {
+    memcpy(&old_val, &old, sizeof(old));
+    old_val += val;
+    memcpy(&sum, &old_val, sizeof(sum));
+  } while (!__atomic_compare_exchange_n(address_as_int, &old, sum, true,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+  memcpy(&old_val, &old, sizeof(old));
+  return old_val;
+}
+
+/*
+  Host version of Cuda's atomicCAS, for the same reason as atomicMax() above:
+  if *address == compare, sets it to val.  Returns the old value.
+ */
+__host__ __forceinline__ unsigned long long atomicCAS(  // NOLINT
+    unsigned long long *address, unsigned long long compare,  // NOLINT
+    unsigned long long val) {  // NOLINT
+  __atomic_compare_exchange_n(address, &compare, val, false, __ATOMIC_RELAXED,
+                              __ATOMIC_RELAXED);
+  return compare;
+}
+
+/*
+  Returns *p, read on the device through the read-only data cache (__ldg()),
+  which is for data that the kernel doesn't write, such as row_splits and
+  row_ids.  T must be a type that __ldg() supports, e.g. int32_t or float.
+ */
+template <typename T>
+__host__ __device__ __forceinline__ T LoadReadOnly(const T *p) {
+#ifdef __CUDA_ARCH__
+  return __ldg(p);
+#else
+  return *p;
+#endif
+}
+
 // have to figure out if there's a better place to put this
 template <typename T>
 std::ostream &operator<<(std::ostream &os, const std::vector<T> &vec) {
@@ -474,6 +667,37 @@ struct MaxOp {
   }
 };
 
+/*
+  Returns log(exp(a) + exp(b)), i.e. addition in the log semiring; -infinity
+  is the identity.  The smaller one is ignored if it is so much smaller that it
+  would make no difference, as in k2host::LogAdd().
+ */
+template <typename T>
+struct LogAddOp;
+
+template <>
+struct LogAddOp<float> {
+  __host__ __device__ __forceinline__ float operator()(const float &a,
+                                                       const float &b) const {
+    float larger = (a > b ? a : b), diff = (a > b ? b - a : a - b);
+    // -15.942385 is log(FLT_EPSILON).  The comparison is false if
+    // both are -infinity, as diff is then NaN.
+    if (diff >= -15.942385f) return larger + log1pf(expf(diff));
+    return larger;
+  }
+};
+
+template <>
+struct LogAddOp<double> {
+  __host__ __device__ __forceinline__ double operator()(const double &a,
+                                                        const double &b) const {
+    double larger = (a > b ? a : b), diff = (a > b ? b - a : a - b);
+    // -36.043653389117154 is log(DBL_EPSILON).
+    if (diff >= -36.043653389117154) return larger + log1p(exp(diff));
+    return larger;
+  }
+};
+
 template <typename T>
 struct BitAndOp {
   __host__ __device__ __forceinline__ T operator()(const T &a,
@@ -498,6 +722,14 @@ struct LessThan {
   }
 };
 
+template <typename T>
+struct GreaterThan {
+  __host__ __device__ __forceinline__ bool operator()(const T &a,
+                                                      const T &b) const {
+    return a > b;
+  }
+};
+
 }  // namespace k2
 
 #include "k2/csrc/utils_inl.h"
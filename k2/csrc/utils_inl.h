@@ -17,9 +17,11 @@
 #ifndef K2_CSRC_UTILS_INL_H_
 #define K2_CSRC_UTILS_INL_H_
 
+#include <algorithm>
 #include <cassert>
 #include <cub/cub.cuh>  // NOLINT
 #include <type_traits>
+#include <vector>
 
 #include "k2/csrc/array.h"
 
@@ -30,12 +32,45 @@ void ExclusiveSum(ContextPtr &c, int32_t n, SrcPtr src, DestPtr dest) {
   DeviceType d = c->GetDeviceType();
   using SumType = typename std::decay<decltype(dest[0])>::type;
   if (d == kCpu) {
+    if (n < kMinParallelEvalSize) {
+      SumType sum = 0;
+      for (int32_t i = 0; i != n; ++i) {
+        auto prev = src[i];
+        dest[i] = sum;
+        sum += prev;
+      }
+      return;
+    }
+    const int32_t block_size = kMinParallelEvalSize / 4,
+                  num_blocks = NumBlocks(n, block_size);
+    // block_offsets[b] will be the sum of all elements before block b.
+    std::vector<SumType> block_offsets(num_blocks);
+    ParallelFor(num_blocks, 1, [&](int32_t begin, int32_t end) -> void {
+      for (int32_t b = begin; b < end; ++b) {
+        SumType sum = 0;
+        for (int32_t i = b * block_size, i_end = std::min(i + block_size, n);
+             i < i_end; ++i)
+          sum += src[i];
+        block_offsets[b] = sum;
+      }
+    });
     SumType sum = 0;
-    for (int32_t i = 0; i != n; ++i) {
-      auto prev = src[i];
-      dest[i] = sum;
-      sum += prev;
+    for (int32_t b = 0; b != num_blocks; ++b) {
+      SumType block_sum = block_offsets[b];
+      block_offsets[b] = sum;
+      sum += block_sum;
     }
+    ParallelFor(num_blocks, 1, [&](int32_t begin, int32_t end) -> void {
+      for (int32_t b = begin; b < end; ++b) {
+        SumType sum = block_offsets[b];
+        for (int32_t i = b * block_size, i_end = std::min(i + block_size, n);
+             i < i_end; ++i) {
+          auto prev = src[i];
+          dest[i] = sum;
+          sum += prev;
+        }
+      }
+    });
   } else {
     K2_CHECK_EQ(d, kCuda);
     // Determine temporary device storage requirements
@@ -52,6 +87,20 @@ void ExclusiveSum(ContextPtr &c, int32_t n, SrcPtr src, DestPtr dest) {
     c->Deallocate(d_temp_storage, deleter_context);
   }
 }
+
+template <typename SrcPtr, typename T>
+T ExclusiveSumWithTotal(ContextPtr &c, int32_t n, SrcPtr src, T *dest) {
+  K2_CHECK_GE(n, 1);
+  ExclusiveSum(c, n, src, dest);
+  if (c->GetDeviceType() == kCpu) return dest[n - 1];
+  Array1<T> total(GetTransferContext(*c, GetCpuContext()), 1);
+  MemoryCopyAsync(static_cast<void *>(total.Data()),
+                  static_cast<const void *>(dest + n - 1), sizeof(T),
+                  *total.Context(), *c);
+  c->Sync();
+  return total.Data()[0];
+}
+
 template <typename T>
 T MaxValue(ContextPtr &c, int32_t nelems, const T *t) {
   DeviceType d = c->GetDeviceType();
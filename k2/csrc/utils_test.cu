@@ -14,6 +14,7 @@
 #include <gtest/gtest.h>
 
 #include <algorithm>
+#include <cstdio>
 #include <numeric>
 #include <random>
 #include <vector>
@@ -21,6 +22,7 @@
 #include "k2/csrc/array.h"
 #include "k2/csrc/math.h"
 #include "k2/csrc/ragged.h"
+#include "k2/csrc/timer.h"
 #include "k2/csrc/utils.h"
 
 namespace k2 {
@@ -199,6 +201,63 @@ TEST(UtilsTest, RowSplitsToRowIds) {
   TestRowSplitsToRowIds<kCuda>();
 }
 
+// Checks that both GPU methods give the right answer, and prints their speed,
+// for shapes with uniform and with very skewed row lengths.
+TEST(UtilsTest, RowSplitsToRowIdsMethods) {
+  ContextPtr cpu = GetCpuContext();
+  ContextPtr context = GetCudaContext();
+  for (bool skewed : {false, true}) {
+    for (int32_t num_rows : {10, 1000, 100000}) {
+      // with `skewed`, the first few rows hold 90% of the elements.
+      int32_t num_elems = 2000000;
+      std::vector<int32_t> sizes(num_rows);
+      int32_t num_big_rows = std::max(1, num_rows / 100),
+              big_size = num_elems / 10 * 9 / num_big_rows,
+              rest = num_elems - big_size * num_big_rows;
+      for (int32_t i = 0; i != num_rows; ++i) {
+        if (!skewed)
+          sizes[i] = num_elems / num_rows;
+        else if (i < num_big_rows)
+          sizes[i] = big_size;
+        else
+          sizes[i] = rest / (num_rows - num_big_rows);
+      }
+      std::vector<int32_t> row_splits_vec(num_rows + 1, 0);
+      std::partial_sum(sizes.begin(), sizes.end(), row_splits_vec.begin() + 1);
+      num_elems = row_splits_vec.back();
+      std::vector<int32_t> expected(num_elems);
+      for (int32_t i = 0; i != num_rows; ++i)
+        std::fill(expected.begin() + row_splits_vec[i],
+                  expected.begin() + row_splits_vec[i + 1], i);
+
+      Array1<int32_t> row_splits(context, row_splits_vec);
+      for (RowIdsMethod method :
+           {RowIdsMethod::kThreadPerRow, RowIdsMethod::kLoadBalance}) {
+        Array1<int32_t> row_ids(context, num_elems);
+        // warm up, and check the result
+        RowSplitsToRowIds(context, num_rows, row_splits.Data(), num_elems,
+                          row_ids.Data(), method);
+        Array1<int32_t> cpu_array = row_ids.To(cpu);
+        std::vector<int32_t> cpu_data(cpu_array.Data(),
+                                      cpu_array.Data() + cpu_array.Dim());
+        EXPECT_EQ(cpu_data, expected);
+
+        int32_t num_reps = 10;
+        Timer t;
+        for (int32_t i = 0; i != num_reps; ++i)
+          RowSplitsToRowIds(context, num_rows, row_splits.Data(), num_elems,
+                            row_ids.Data(), method);
+        double elapsed = t.Elapsed();
+        printf("num_rows=%d, skewed=%d, %s: average time is %.6f s\n",
+               num_rows, static_cast<int32_t>(skewed),
+               (method == RowIdsMethod::kThreadPerRow ? "thread-per-row"
+                                                      : "load-balanced"),
+               elapsed / num_reps);
+      }
+    }
+  }
+}
+
 template <DeviceType d>
 void TestRowIdsToRowSplits() {
   ContextPtr cpu = GetCpuContext();  // will use to copy data
@@ -299,4 +358,129 @@ TEST(UtilsTest, RowIdsToRowSplits) {
   TestRowIdsToRowSplits<kCpu>();
   TestRowIdsToRowSplits<kCuda>();
 }
+
+template <DeviceType d>
+void TestGetTaskRedirect() {
+  ContextPtr cpu = GetCpuContext();  // will use to copy data
+  ContextPtr context = nullptr;
+  if (d == kCpu) {
+    context = GetCpuContext();
+  } else {
+    K2_CHECK_EQ(d, kCuda);
+    context = GetCudaContext();
+  }
+
+  for (int32_t i = 0; i < 4; ++i) {
+    std::vector<int32_t> row_splits_vec;
+    if (i == 0) {
+      row_splits_vec = {0, 0, 0};  // no work to do
+    } else if (i == 1) {
+      row_splits_vec = {0, 2, 3, 5, 8, 9, 12, 13, 15, 15, 16};
+    } else if (i == 2) {
+      row_splits_vec = {3, 3, 1000, 1001};  // very unbalanced, nonzero start
+    } else {
+      RaggedShape shape = RandomRaggedShape(true, 2, 2, 100, 5000);
+      const Array1<int32_t> &row_splits = shape.RowSplits(1);
+      row_splits_vec.assign(row_splits.Data(),
+                            row_splits.Data() + row_splits.Dim());
+    }
+    Array1<int32_t> row_splits(context, row_splits_vec);
+    int32_t num_tasks = row_splits.Dim() - 1, num_jobs = 2 * num_tasks;
+    Array1<TaskRedirect> redirect(context, num_jobs);
+    GetTaskRedirect(context, num_tasks, row_splits.Data(), redirect.Data());
+    Array1<TaskRedirect> cpu_redirect = redirect.To(cpu);
+
+    // Each task must have its jobs numbered 0 .. num_jobs_this_task - 1 with
+    // no gaps or repeats, and the job in the first half must be job 0.
+    std::vector<std::vector<int32_t>> jobs_of_task(num_tasks);
+    std::vector<int32_t> num_jobs_of_task(num_tasks, -1);
+    for (int32_t j = 0; j < num_jobs; ++j) {
+      const TaskRedirect &tr = cpu_redirect.Data()[j];
+      ASSERT_GE(tr.task_id, 0);
+      ASSERT_LT(tr.task_id, num_tasks);
+      if (j < num_tasks) {
+        EXPECT_EQ(tr.task_id, j);
+        EXPECT_EQ(tr.job_id_this_task, 0);
+      }
+      if (num_jobs_of_task[tr.task_id] == -1)
+        num_jobs_of_task[tr.task_id] = tr.num_jobs_this_task;
+      EXPECT_EQ(num_jobs_of_task[tr.task_id], tr.num_jobs_this_task);
+      jobs_of_task[tr.task_id].push_back(tr.job_id_this_task);
+    }
+    for (int32_t t = 0; t < num_tasks; ++t) {
+      std::vector<int32_t> &jobs = jobs_of_task[t];
+      std::sort(jobs.begin(), jobs.end());
+      std::vector<int32_t> expected(num_jobs_of_task[t]);
+      std::iota(expected.begin(), expected.end(), 0);
+      EXPECT_EQ(jobs, expected);
+    }
+    if (i == 2) {
+      // The big task should get almost all of the jobs in the second half.
+      EXPECT_GE(num_jobs_of_task[1], num_tasks);
+    }
+  }
+}
+
+TEST(UtilsTest, GetTaskRedirect) {
+  TestGetTaskRedirect<kCpu>();
+  TestGetTaskRedirect<kCuda>();
+}
+
+template <DeviceType d>
+void TestEvalWithRedirect() {
+  ContextPtr cpu = GetCpuContext();  // will use to copy data
+  ContextPtr context = nullptr;
+  if (d == kCpu) {
+    context = GetCpuContext();
+  } else {
+    K2_CHECK_EQ(d, kCuda);
+    context = GetCudaContext();
+  }
+
+  for (int32_t i = 0; i < 3; ++i) {
+    RaggedShape shape = RandomRaggedShape(true, 2, 2, 0, 20000);
+    Array1<int32_t> row_splits = shape.RowSplits(1).To(context);
+    int32_t num_tasks = row_splits.Dim() - 1, num_jobs = 2 * num_tasks,
+            tot_work = shape.NumElements();
+    Array1<TaskRedirect> redirect(context, num_jobs);
+    GetTaskRedirect(context, num_tasks, row_splits.Data(), redirect.Data());
+
+    // Each element is written by exactly one thread, so `values` should end up
+    // being 1, 2, 3 .. within each row.  The extra element at the end is
+    // written by the one-off lambda.
+    Array1<int32_t> values(context, tot_work + 1, 0);
+    int32_t *values_data = values.Data();
+    const int32_t *row_splits_data = row_splits.Data();
+    auto lambda_set_values = [=] __host__ __device__(
+                                 int32_t task_idx, int32_t num_threads,
+                                 int32_t thread_idx) -> void {
+      int32_t begin = row_splits_data[task_idx],
+              size = row_splits_data[task_idx + 1] - begin;
+      for (; thread_idx < size; thread_idx += num_threads)
+        values_data[begin + thread_idx] += thread_idx + 1;
+    };
+    auto lambda_one_off = [=] __host__ __device__() -> void {
+      values_data[tot_work] += -1;
+    };
+    int32_t min_threads_per_job = 2, target_num_loops = 2;
+    EvalWithRedirect(context->GetCudaStream(), num_jobs, redirect.Data(),
+                     min_threads_per_job, tot_work, target_num_loops,
+                     lambda_set_values, lambda_one_off);
+
+    Array1<int32_t> cpu_values = values.To(cpu);
+    const int32_t *cpu_values_data = cpu_values.Data();
+    const int32_t *cpu_row_splits_data = shape.RowSplits(1).Data();
+    for (int32_t t = 0; t < num_tasks; ++t) {
+      for (int32_t j = cpu_row_splits_data[t]; j < cpu_row_splits_data[t + 1];
+           ++j)
+        EXPECT_EQ(cpu_values_data[j], j - cpu_row_splits_data[t] + 1);
+    }
+    EXPECT_EQ(cpu_values_data[tot_work], -1);
+  }
+}
+
+TEST(UtilsTest, EvalWithRedirect) {
+  TestEvalWithRedirect<kCpu>();
+  TestEvalWithRedirect<kCuda>();
+}
 }  // namespace k2
@@ -12,16 +12,29 @@
 
 #if defined(K2_USE_PYTORCH)
 
+#include "k2/csrc/context.h"
+#include "k2/csrc/pytorch_context.h"
 #include "k2/python/csrc/torch/arc.h"
 #include "k2/python/csrc/torch/array.h"
+#include "k2/python/csrc/torch/async_handle.h"
 #include "k2/python/csrc/torch/fsa.h"
+#include "k2/python/csrc/torch/fsa_algo.h"
+#include "k2/python/csrc/torch/memory_stats.h"
+#include "k2/python/csrc/torch/profile.h"
 #include "k2/python/csrc/torch/ragged.h"
 
 void PybindTorch(py::module &m) {
+  // k2's CPU code runs on the threads of PyTorch, see SetParallelForImpl().
+  k2::SetParallelForImpl(k2::TorchParallelFor);
+
   PybindArc(m);
   PybindArray(m);
+  PybindAsyncHandle(m);
   PybindRagged(m);
   PybindFsa(m);
+  PybindFsaAlgo(m);
+  PybindMemoryStats(m);
+  PybindProfile(m);
 }
 
 #else
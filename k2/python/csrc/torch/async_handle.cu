@@ -0,0 +1,61 @@
+/**
+ * @brief python wrappers for asynchronous operations.
+ *
+ * @copyright
+ * Copyright (c)  2026  agent (agent@local)
+ *
+ * @copyright
+ * See LICENSE for clarification regarding multiple authors
+ */
+
+#include <memory>
+#include <utility>
+
+#include "k2/csrc/context.h"
+#include "k2/csrc/log.h"
+#include "k2/python/csrc/torch/async_handle.h"
+
+namespace k2 {
+
+AsyncHandle::AsyncHandle(ContextPtr c, std::shared_ptr<void> keep_alive)
+    : c_(std::move(c)), keep_alive_(std::move(keep_alive)) {
+  if (c_->GetDeviceType() != kCuda) return;
+  DeviceGuard guard(*c_);
+  auto ret = cudaEventCreateWithFlags(&event_, cudaEventDisableTiming);
+  K2_CHECK_CUDA_ERROR(ret);
+  ret = cudaEventRecord(event_, c_->GetCudaStream());
+  K2_CHECK_CUDA_ERROR(ret);
+}
+
+AsyncHandle::~AsyncHandle() {
+  if (event_ == nullptr) return;
+  Wait();
+  auto ret = cudaEventDestroy(event_);
+  K2_CHECK_CUDA_ERROR(ret);
+}
+
+bool AsyncHandle::Done() const {
+  if (event_ == nullptr) return true;
+  auto ret = cudaEventQuery(event_);
+  if (ret == cudaErrorNotReady) return false;
+  K2_CHECK_CUDA_ERROR(ret);
+  return true;
+}
+
+void AsyncHandle::Wait() const {
+  if (event_ == nullptr) return;
+  auto ret = cudaEventSynchronize(event_);
+  K2_CHECK_CUDA_ERROR(ret);
+}
+
+static void PybindAsyncHandleImpl(py::module &m) {
+  using PyClass = AsyncHandle;
+  py::class_<PyClass, std::unique_ptr<PyClass>> pyclass(m, "_AsyncHandle");
+  pyclass.def("done", &PyClass::Done);
+  pyclass.def("wait", &PyClass::Wait,
+              py::call_guard<py::gil_scoped_release>());
+}
+
+}  // namespace k2
+
+void PybindAsyncHandle(py::module &m) { k2::PybindAsyncHandleImpl(m); }
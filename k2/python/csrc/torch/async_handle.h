@@ -0,0 +1,62 @@
+/**
+ * @brief python wrappers for asynchronous operations.
+ *
+ * @copyright
+ * Copyright (c)  2026  agent (agent@local)
+ *
+ * @copyright
+ * See LICENSE for clarification regarding multiple authors
+ */
+
+#ifndef K2_PYTHON_CSRC_TORCH_ASYNC_HANDLE_H_
+#define K2_PYTHON_CSRC_TORCH_ASYNC_HANDLE_H_
+
+#include <memory>
+
+#include "k2/csrc/context.h"
+#include "k2/python/csrc/k2.h"
+
+namespace k2 {
+
+/*
+  The handle returned by the `*_async` bindings, which return as soon as their
+  work has been queued on the CUDA stream of a context.  It holds a CUDA event
+  recorded on that stream after the work, and references to the memory the
+  work reads and writes, so that the memory stays valid until it is done.
+ */
+class AsyncHandle {
+ public:
+  /*
+    Records an event on the stream of `c` (for CPU contexts there is nothing
+    to wait for and the handle is done at once).
+
+      @param [in] c          The context whose stream the work was queued on.
+      @param [in] keep_alive  Kept until the handle is destroyed, e.g. a
+                             std::shared_ptr to a copy of the source array.
+   */
+  AsyncHandle(ContextPtr c, std::shared_ptr<void> keep_alive);
+
+  // Waits for the work, as the memory it uses may be released when the handle
+  // is destroyed.
+  ~AsyncHandle();
+
+  AsyncHandle(const AsyncHandle &) = delete;
+  AsyncHandle &operator=(const AsyncHandle &) = delete;
+
+  // Returns true if the work has finished; does not wait.
+  bool Done() const;
+
+  // Waits for the work to finish.
+  void Wait() const;
+
+ private:
+  ContextPtr c_;
+  cudaEvent_t event_ = nullptr;
+  std::shared_ptr<void> keep_alive_;
+};
+
+}  // namespace k2
+
+void PybindAsyncHandle(py::module &m);
+
+#endif  // K2_PYTHON_CSRC_TORCH_ASYNC_HANDLE_H_
@@ -8,12 +8,16 @@
  * See LICENSE for clarification regarding multiple authors
  */
 
+#include <memory>
 #include <string>
 #include <utility>
+#include <vector>
 
 #include "k2/csrc/array.h"
 #include "k2/csrc/fsa.h"
 #include "k2/csrc/fsa_utils.h"
+#include "k2/csrc/ragged.h"
+#include "k2/csrc/tensor.h"
 #include "k2/python/csrc/torch/fsa.h"
 #include "k2/python/csrc/torch/torch_util.h"
 #include "torch/extension.h"
@@ -24,19 +28,136 @@ static void PybindDenseFsa(py::module &m) {
   using PyClass = DenseFsaVec;
   py::class_<PyClass> pyclass(m, "_DenseFsaVec");
 
+  // The nnet output, of shape (N, T, C), is read in place (it may be a
+  // slice); the only memory allocated is for the shape and the scores,
+  // which have an extra row per sequence and an extra column.  The second
+  // overload takes DLPack capsules, e.g. from torch.utils.dlpack.to_dlpack().
+  pyclass.def(py::init([](torch::Tensor nnet_output,
+                          torch::Tensor supervision_segments) {
+                Tensor output = FromTorchTensor(nnet_output);
+                Array2<int32_t> segments =
+                    FromTensor<int32_t>(supervision_segments, Array2Tag{});
+                return std::unique_ptr<PyClass>(new PyClass(output, segments));
+              }),
+              py::arg("nnet_output"), py::arg("supervision_segments"),
+              py::call_guard<py::gil_scoped_release>());
+  pyclass.def(py::init([](py::capsule nnet_output,
+                          py::capsule supervision_segments) {
+                torch::Tensor output_tensor = FromDlpack(nnet_output),
+                              segments_tensor =
+                                  FromDlpack(supervision_segments);
+                py::gil_scoped_release release;
+                Tensor output = FromTorchTensor(output_tensor);
+                Array2<int32_t> segments =
+                    FromTensor<int32_t>(segments_tensor, Array2Tag{});
+                return std::unique_ptr<PyClass>(new PyClass(output, segments));
+              }),
+              py::arg("nnet_output"), py::arg("supervision_segments"));
+
   pyclass.def_readwrite("shape", &PyClass::shape);
   pyclass.def_readwrite("scores", &PyClass::scores);
   pyclass.def("num_arcs", &PyClass::NumArcs);
 }
 
+// Returns the FsaVec whose FSAs have the arcs in `arcs` given by
+// `arc_row_splits` (see FsaVecFromArcs()); it is on the device of `arcs`.
+static FsaVec FsaVecFromArcsTensor(torch::Tensor arcs,
+                                   torch::Tensor arc_row_splits) {
+  arcs = arcs.contiguous();
+  arc_row_splits = arc_row_splits.to(arcs.device());
+  Array1<Arc> array = FromTensor<Arc>(arcs);
+  Array1<int32_t> row_splits = FromTensor<int32_t>(arc_row_splits);
+  bool error = true;
+  FsaVec fsas = FsaVecFromArcs(array, row_splits, &error);
+  K2_CHECK(!error);
+  return fsas;
+}
+
+// Returns the row_splits, on the device of `lengths`, of a ragged array whose
+// rows have the given lengths (a 1-D tensor of int32).
+static torch::Tensor RowSplitsFromLengths(torch::Tensor lengths) {
+  K2_CHECK_EQ(lengths.dim(), 1);
+  K2_CHECK_EQ(lengths.scalar_type(), torch::kInt);
+  return torch::cat({torch::zeros({1}, lengths.options()),
+                     lengths.cumsum(0, torch::kInt)});
+}
+
+// Returns the Ragged<int32_t> with the rows of `values` (a 1-D tensor of
+// int32) given by `lengths`, on the device of `values`.
+static Ragged<int32_t> RaggedFromLengths(torch::Tensor values,
+                                         torch::Tensor lengths) {
+  values = values.contiguous();
+  torch::Tensor row_splits_tensor =
+      RowSplitsFromLengths(lengths.to(values.device()));
+  Array1<int32_t> row_splits = FromTensor<int32_t>(row_splits_tensor);
+  RaggedShape shape = RaggedShape2(&row_splits, nullptr, values.numel());
+  return Ragged<int32_t>(shape, FromTensor<int32_t>(values));
+}
+
 static void PybindFsaUtil(py::module &m) {
-  m.def("_fsa_from_tensor", [](torch::Tensor tensor) -> Fsa {
-    Array1<Arc> array = FromTensor<Arc>(tensor);
-    bool error = true;
-    Fsa fsa = FsaFromArray1(array, &error);
-    K2_CHECK(!error);
-    return fsa;
-  });
+  // The GIL is released in the bindings below as they do not touch Python
+  // objects (the conversions of the arguments and return values are done with
+  // the GIL held).
+  m.def(
+      "_fsa_from_tensor",
+      [](torch::Tensor tensor) -> Fsa {
+        Array1<Arc> array = FromTensor<Arc>(tensor);
+        bool error = true;
+        Fsa fsa = FsaFromArray1(array, &error);
+        K2_CHECK(!error);
+        return fsa;
+      },
+      py::call_guard<py::gil_scoped_release>());
+
+  // Builds a minibatch FsaVec in one call from the arcs of its FSAs, as in
+  // `_fsa_from_tensor`: either all of them in one tensor plus the number of
+  // arcs of each FSA (a 1-D tensor of int32), or one tensor per FSA, which
+  // are concatenated by one torch.cat.  Nothing is done per FSA in C++.
+  m.def(
+      "_fsa_vec_from_arcs",
+      [](torch::Tensor arcs, torch::Tensor lengths) -> FsaVec {
+        return FsaVecFromArcsTensor(arcs, RowSplitsFromLengths(lengths));
+      },
+      py::arg("arcs"), py::arg("lengths"),
+      py::call_guard<py::gil_scoped_release>());
+  m.def(
+      "_fsa_vec_from_arcs",
+      [](const std::vector<torch::Tensor> &arcs) -> FsaVec {
+        K2_CHECK(!arcs.empty());
+        std::vector<int32_t> row_splits(arcs.size() + 1, 0);
+        for (std::size_t i = 0; i != arcs.size(); ++i)
+          row_splits[i + 1] =
+              row_splits[i] + static_cast<int32_t>(arcs[i].size(0));
+        torch::Tensor row_splits_tensor =
+            torch::tensor(row_splits, torch::dtype(torch::kInt));
+        return FsaVecFromArcsTensor(torch::cat(arcs), row_splits_tensor);
+      },
+      py::arg("arcs"), py::call_guard<py::gil_scoped_release>());
+
+  // The linear acceptors and the CTC graphs of a minibatch of symbol
+  // sequences, given as in `_fsa_vec_from_arcs`: all the symbols in one 1-D
+  // tensor of int32 plus the length of each sequence.  They are built on the
+  // device of `symbols`; see LinearFsas() and CtcGraphs().  `_ctc_graphs`
+  // returns a tuple (fsa_vec, aux_labels).
+  m.def(
+      "_linear_fsas",
+      [](torch::Tensor symbols, torch::Tensor lengths) -> FsaVec {
+        Ragged<int32_t> ragged = RaggedFromLengths(symbols, lengths);
+        return LinearFsas(ragged);
+      },
+      py::arg("symbols"), py::arg("lengths"),
+      py::call_guard<py::gil_scoped_release>());
+  m.def(
+      "_ctc_graphs",
+      [](torch::Tensor tokens, torch::Tensor lengths,
+         bool modified = false) -> std::pair<FsaVec, torch::Tensor> {
+        Ragged<int32_t> ragged = RaggedFromLengths(tokens, lengths);
+        Array1<int32_t> aux_labels;
+        FsaVec fsas = CtcGraphs(ragged, modified, &aux_labels);
+        return std::make_pair(fsas, ToTensor(aux_labels));
+      },
+      py::arg("tokens"), py::arg("lengths"), py::arg("modified") = false,
+      py::call_guard<py::gil_scoped_release>());
 
   m.def(
       "_fsa_to_str",
@@ -48,7 +169,8 @@ static void PybindFsaUtil(py::module &m) {
         return FsaToString(fsa, negate_scores, aux_labels ? &array : nullptr);
       },
       py::arg("fsa"), py::arg("negate_scores") = false,
-      py::arg("aux_labels") = py::none());
+      py::arg("aux_labels") = py::none(),
+      py::call_guard<py::gil_scoped_release>());
 
   m.def(
       "_fsa_from_str",
@@ -61,6 +183,7 @@ static void PybindFsaUtil(py::module &m) {
         return std::make_pair(fsa, tensor);
       },
       py::arg("s"), py::arg("negate_scores") = false,
+      py::call_guard<py::gil_scoped_release>(),
       "It returns a tuple with two elements. Element 0 is the FSA; element 1 "
       "is a 1-D tensor of dtype torch.int32 containing the aux_labels if the "
       "returned FSA is a transducer; element 1 is None if the "
@@ -0,0 +1,141 @@
+/**
+ * @brief python wrappers for FSA algorithms.
+ *
+ * @copyright
+ * Copyright (c)  2026  agent (agent@local)
+ *
+ * @copyright
+ * See LICENSE for clarification regarding multiple authors
+ */
+
+#include <tuple>
+#include <vector>
+
+#include "k2/csrc/array.h"
+#include "k2/csrc/fsa.h"
+#include "k2/csrc/fsa_algo.h"
+#include "k2/csrc/tensor.h"
+#include "k2/python/csrc/torch/fsa_algo.h"
+#include "k2/python/csrc/torch/torch_util.h"
+#include "torch/extension.h"
+
+namespace k2 {
+
+namespace {
+
+/*
+  IntersectDensePruned() followed by the total scores of the lattices, as an
+  autograd function of the neural-net output.  The backward pass is
+  BackpropTotScores(), with the arc posteriors and the indexes into the
+  neural-net output of the scores the arcs used being all that is kept from
+  the forward pass.
+ */
+class IntersectDensePrunedFunction
+    : public torch::autograd::Function<IntersectDensePrunedFunction> {
+ public:
+  /*
+    The arguments are as for IntersectDensePruned(), the neural-net output
+    and supervision segments being those given to the constructor of
+    DenseFsaVec.  `out` and `arc_map_a` are set to the lattices and the
+    arc map into `a_fsas`, and `stats`, if not nullptr, to the statistics of
+    the search.  Returns the total scores of the lattices.
+   */
+  static torch::Tensor forward(torch::autograd::AutogradContext *ctx,
+                               torch::Tensor nnet_output,
+                               torch::Tensor supervision_segments,
+                               FsaVec *a_fsas, float beam, float lattice_beam,
+                               int32_t max_active_states,
+                               int32_t min_active_states, FsaVec *out,
+                               Array1<int32_t> *arc_map_a,
+                               DenseIntersectStats *stats) {
+    K2_CHECK_EQ(nnet_output.dim(), 3);
+    Tensor output = FromTorchTensor(nnet_output);
+    Array2<int32_t> segments =
+        FromTensor<int32_t>(supervision_segments, Array2Tag{});
+    DenseFsaVec b_fsas(output, segments);
+    Array1<int32_t> arc_map_b;
+    Array1<float> tot_scores, arc_posts;
+    IntersectDensePrunedOptions opts;
+    opts.lattice_beam = lattice_beam;
+    opts.tot_scores = &tot_scores;
+    opts.arc_posts = &arc_posts;
+    opts.stats = stats;
+    IntersectDensePruned(*a_fsas, b_fsas, beam, max_active_states,
+                         min_active_states, out, arc_map_a, &arc_map_b, opts);
+    int32_t max_frames = static_cast<int32_t>(nnet_output.size(1));
+    Array1<int32_t> nnet_arc_map =
+        ArcMapBToNnetOutput(b_fsas, segments, max_frames, arc_map_b);
+
+    ctx->save_for_backward({ToTensor(nnet_arc_map), ToTensor(arc_posts)});
+    ctx->saved_data["sizes"] = nnet_output.sizes().vec();
+    ctx->saved_data["dtype"] =
+        static_cast<int64_t>(nnet_output.scalar_type());
+    return ToTensor(tot_scores);
+  }
+
+  static torch::autograd::variable_list backward(
+      torch::autograd::AutogradContext *ctx,
+      torch::autograd::variable_list grad_outputs) {
+    torch::autograd::variable_list saved = ctx->get_saved_variables();
+    std::vector<int64_t> sizes = ctx->saved_data["sizes"].toIntVector();
+    auto dtype =
+        static_cast<torch::ScalarType>(ctx->saved_data["dtype"].toInt());
+    torch::Tensor tot_scores_grad =
+        grad_outputs[0].to(torch::kFloat).contiguous();
+    Array1<int32_t> nnet_arc_map = FromTensor<int32_t>(saved[0]);
+    Array1<float> arc_posts = FromTensor<float>(saved[1]),
+                  tot_scores_grad_array = FromTensor<float>(tot_scores_grad);
+    Array1<float> grad = BackpropTotScores(
+        nnet_arc_map, arc_posts, tot_scores_grad_array,
+        static_cast<int32_t>(sizes[1]), static_cast<int32_t>(sizes[2]));
+    // One for each argument of forward(); only the neural-net output has a
+    // derivative.
+    torch::autograd::variable_list ans(10);
+    ans[0] = ToTensor(grad).view(sizes).to(dtype);
+    return ans;
+  }
+};
+
+}  // namespace
+
+static void PybindIntersectDensePruned(py::module &m) {
+  // The total scores returned participate in autograd, so e.g.
+  // `tot_scores.sum().backward()` sets the derivatives w.r.t. `nnet_output`.
+  m.def(
+      "_intersect_dense_pruned",
+      [](FsaVec &a_fsas, torch::Tensor nnet_output,
+         torch::Tensor supervision_segments, float beam, float lattice_beam,
+         int32_t max_active_states, int32_t min_active_states,
+         bool return_stats)
+          -> std::tuple<FsaVec, torch::Tensor, torch::Tensor,
+                        std::vector<torch::Tensor>> {
+        FsaVec fsas = (a_fsas.NumAxes() == 2 ? FsaVecFromFsa(a_fsas) : a_fsas);
+        FsaVec out;
+        Array1<int32_t> arc_map_a;
+        DenseIntersectStats stats;
+        torch::Tensor tot_scores = IntersectDensePrunedFunction::apply(
+            nnet_output, supervision_segments, &fsas, beam, lattice_beam,
+            max_active_states, min_active_states, &out, &arc_map_a,
+            return_stats ? &stats : nullptr);
+        std::vector<torch::Tensor> stats_tensors;
+        if (return_stats)
+          stats_tensors = {ToTensor(stats.shape.RowSplits(1)),
+                           ToTensor(stats.counts), ToTensor(stats.beams)};
+        return std::make_tuple(out, ToTensor(arc_map_a), tot_scores,
+                               stats_tensors);
+      },
+      py::arg("a_fsas"), py::arg("nnet_output"),
+      py::arg("supervision_segments"), py::arg("beam"),
+      py::arg("lattice_beam"), py::arg("max_active_states"),
+      py::arg("min_active_states"), py::arg("return_stats") = false,
+      py::call_guard<py::gil_scoped_release>(),
+      "It returns a tuple with four elements: the lattices, the arc map "
+      "into a_fsas, the total scores of the lattices, which are "
+      "differentiable w.r.t. nnet_output, and if return_stats is true the "
+      "per-frame statistics of the search as [row_splits, counts, beams] "
+      "(see DenseIntersectStats), else [].");
+}
+
+}  // namespace k2
+
+void PybindFsaAlgo(py::module &m) { k2::PybindIntersectDensePruned(m); }
@@ -0,0 +1,74 @@
+/**
+ * @brief python wrappers for MemoryStats.
+ *
+ * @copyright
+ * Copyright (c)  2026  agent (agent@local)
+ *
+ * @copyright
+ * See LICENSE for clarification regarding multiple authors
+ */
+
+#include <memory>
+#include <string>
+
+#include "k2/csrc/context.h"
+#include "k2/python/csrc/torch/memory_stats.h"
+#include "k2/python/csrc/torch/torch_util.h"
+#include "torch/extension.h"
+
+namespace k2 {
+
+static py::dict MemoryStatsToDict(const MemoryStats &stats) {
+  static const char *kCopyNames[MemcpyUnknown] = {
+      "host_to_host", "host_to_device", "device_to_host", "device_to_device"};
+  py::dict ans;
+  ans["num_allocs"] = stats.num_allocs;
+  ans["num_frees"] = stats.num_frees;
+  ans["bytes_allocated"] = stats.bytes_allocated;
+  ans["bytes_live"] = stats.bytes_live;
+  ans["max_bytes_live"] = stats.max_bytes_live;
+  for (int32_t i = 0; i < MemcpyUnknown; ++i) {
+    ans[py::str(std::string("num_copies_") + kCopyNames[i])] =
+        stats.num_copies[i];
+    ans[py::str(std::string("bytes_copied_") + kCopyNames[i])] =
+        stats.bytes_copied[i];
+  }
+  ans["num_syncs"] = stats.num_syncs;
+  return ans;
+}
+
+static void PybindMemoryStatsImpl(py::module &m) {
+  m.def(
+      "get_memory_stats",
+      [](torch::Device device) -> py::dict {
+        int32_t device_id = device.has_index() ? device.index() : 0;
+        return MemoryStatsToDict(
+            GetMemoryStats(FromTorchDeviceType(device.type()), device_id));
+      },
+      py::arg("device"));
+
+  m.def(
+      "reset_max_bytes_live",
+      [](torch::Device device) -> void {
+        int32_t device_id = device.has_index() ? device.index() : 0;
+        ResetMaxBytesLive(FromTorchDeviceType(device.type()), device_id);
+      },
+      py::arg("device"));
+
+  using PyClass = MemoryStatsScope;
+  py::class_<PyClass, std::unique_ptr<PyClass>> pyclass(m,
+                                                        "_MemoryStatsScope");
+  pyclass.def(py::init([](torch::Device device) {
+                int32_t device_id = device.has_index() ? device.index() : 0;
+                return std::unique_ptr<PyClass>(new PyClass(
+                    FromTorchDeviceType(device.type()), device_id));
+              }),
+              py::arg("device"));
+  pyclass.def("get", [](const PyClass &self) -> py::dict {
+    return MemoryStatsToDict(self.Get());
+  });
+}
+
+}  // namespace k2
+
+void PybindMemoryStats(py::module &m) { k2::PybindMemoryStatsImpl(m); }
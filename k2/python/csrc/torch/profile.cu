@@ -0,0 +1,41 @@
+/**
+ * @brief python wrappers for k2/csrc/profile.h.
+ *
+ * @copyright
+ * Copyright (c)  2026  agent (agent@local)
+ *
+ * @copyright
+ * See LICENSE for clarification regarding multiple authors
+ */
+
+#include <map>
+#include <string>
+
+#include "k2/csrc/profile.h"
+#include "k2/python/csrc/torch/profile.h"
+
+namespace k2 {
+
+static void PybindProfileImpl(py::module &m) {
+  m.def("enable_profiling", &EnableProfiling, py::arg("enable"));
+  m.def("profiling_enabled", &ProfilingEnabled);
+  m.def("reset_profile", &ResetProfile);
+  m.def("get_profile_stats", []() -> py::dict {
+    py::dict ans;
+    for (const auto &p : GetProfileStats()) {
+      const ProfileStats &stats = p.second;
+      py::dict d;
+      d["count"] = stats.count;
+      d["cpu_ms"] = stats.cpu_ms;
+      d["gpu_ms"] = stats.gpu_ms;
+      d["gpu_count"] = stats.gpu_count;
+      ans[py::str(p.first)] = d;
+    }
+    return ans;
+  });
+  m.def("get_profile_report", &GetProfileReport);
+}
+
+}  // namespace k2
+
+void PybindProfile(py::module &m) { k2::PybindProfileImpl(m); }
@@ -0,0 +1,18 @@
+/**
+ * @brief python wrappers for k2/csrc/profile.h.
+ *
+ * @copyright
+ * Copyright (c)  2026  agent (agent@local)
+ *
+ * @copyright
+ * See LICENSE for clarification regarding multiple authors
+ */
+
+#ifndef K2_PYTHON_CSRC_TORCH_PROFILE_H_
+#define K2_PYTHON_CSRC_TORCH_PROFILE_H_
+
+#include "k2/python/csrc/k2.h"
+
+void PybindProfile(py::module &m);
+
+#endif  // K2_PYTHON_CSRC_TORCH_PROFILE_H_
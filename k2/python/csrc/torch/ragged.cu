@@ -8,15 +8,66 @@
  * See LICENSE for clarification regarding multiple authors
  */
 
+#include <memory>
+#include <utility>
 #include <vector>
 
+#include "k2/csrc/context.h"
 #include "k2/csrc/ragged.h"
+#include "k2/python/csrc/torch/async_handle.h"
 #include "k2/python/csrc/torch/ragged.h"
 #include "k2/python/csrc/torch/torch_util.h"
 #include "torch/extension.h"
 
 namespace k2 {
 
+// Like Array1<T>::To(), but it does not wait for copies to the CPU; see
+// MemoryCopyAsync().
+template <typename T>
+static Array1<T> ToAsync(const Array1<T> &src, ContextPtr ctx) {
+  if (ctx->IsCompatible(*src.Context())) return src;
+  Array1<T> ans(GetTransferContext(*src.Context(), ctx), src.Dim());
+  MemoryCopyAsync(static_cast<void *>(ans.Data()),
+                  static_cast<const void *>(src.Data()),
+                  src.Dim() * src.ElementSize(), *ans.Context(),
+                  *src.Context());
+  return ans;
+}
+
+/*
+  Queues the copy of `src` to `ctx` and returns at once, with the copy in
+  `ans.first` and a handle to wait for it in `ans.second`.  The handle's event
+  is on the stream of the device context the copies are queued on: that of
+  `ctx` if it is a CUDA context, else that of `src`.
+ */
+template <typename T>
+static std::pair<Ragged<T>, std::unique_ptr<AsyncHandle>> RaggedToAsync(
+    const Ragged<T> &src, ContextPtr ctx) {
+  if (ctx->GetDeviceType() == kCuda &&
+      src.Context()->GetDeviceType() == kCpu) {
+    // Uploads are done with one transfer from a pinned buffer, see
+    // ToPacked(); only that buffer has to be kept until the copy is done.
+    RegionPtr staging;
+    Ragged<T> ans = ToPacked(src, ctx, &staging);
+    return std::make_pair(
+        ans, std::unique_ptr<AsyncHandle>(new AsyncHandle(
+                 ctx, std::make_shared<RegionPtr>(staging))));
+  }
+  std::vector<RaggedShapeDim> axes = src.shape.Axes();
+  for (auto &axis : axes) {
+    axis.row_splits = ToAsync(axis.row_splits, ctx);
+    // the row_ids are not copied; as in RaggedShape::To(), the
+    // cached_tot_size is kept.
+    axis.row_ids = Array1<int32_t>();
+  }
+  Ragged<T> ans(RaggedShape(axes, false), ToAsync(src.values, ctx));
+  ContextPtr c = ctx->GetDeviceType() == kCuda ? ctx : src.Context();
+  auto keep_alive =
+      std::make_shared<std::pair<Ragged<T>, Ragged<T>>>(src, ans);
+  return std::make_pair(
+      ans, std::unique_ptr<AsyncHandle>(new AsyncHandle(c, keep_alive)));
+}
+
 static void PybindRaggedShape(py::module &m) {
   using PyClass = RaggedShape;
   py::class_<PyClass> pyclass(m, "RaggedShape");
@@ -57,6 +108,32 @@ static void PybindRaggedShape(py::module &m) {
       [](PyClass &self, const std::vector<int32_t> &indexes) -> int32_t {
         return self[indexes];
       });
+
+  // The shape shares the memory of the tensors; see RaggedShapeFromTensors().
+  // The tensors can be converted to DLPack capsules and back with
+  // torch.utils.dlpack, and the second overload accepts the capsules
+  // directly.
+  m.def(
+      "_ragged_shape_from_tensors",
+      [](std::vector<torch::Tensor> &row_splits,
+         std::vector<torch::Tensor> &row_ids) -> PyClass {
+        return RaggedShapeFromTensors(row_splits, row_ids);
+      },
+      py::arg("row_splits"), py::arg("row_ids") = std::vector<torch::Tensor>(),
+      py::call_guard<py::gil_scoped_release>());
+  m.def(
+      "_ragged_shape_from_tensors",
+      [](const std::vector<py::capsule> &row_splits,
+         const std::vector<py::capsule> &row_ids) -> PyClass {
+        std::vector<torch::Tensor> row_splits_tensors, row_ids_tensors;
+        for (const auto &capsule : row_splits)
+          row_splits_tensors.push_back(FromDlpack(capsule));
+        for (const auto &capsule : row_ids)
+          row_ids_tensors.push_back(FromDlpack(capsule));
+        py::gil_scoped_release release;
+        return RaggedShapeFromTensors(row_splits_tensors, row_ids_tensors);
+      },
+      py::arg("row_splits"), py::arg("row_ids") = std::vector<py::capsule>());
 }
 
 template <typename T>
@@ -69,7 +146,8 @@ static void PybindRaggedTpl(py::module &m, const char *name) {
 
   pyclass.def("num_axes", &PyClass::NumAxes);
   pyclass.def("index", &PyClass::Index, py::arg("axis"), py::arg("i"));
-  pyclass.def("remove_axis", &PyClass::RemoveAxis, py::arg("axis"));
+  pyclass.def("remove_axis", &PyClass::RemoveAxis, py::arg("axis"),
+              py::call_guard<py::gil_scoped_release>());
 
   pyclass.def(
       "cuda",
@@ -77,15 +155,59 @@ static void PybindRaggedTpl(py::module &m, const char *name) {
         auto context = GetCudaContext(gpu_id);
         return self.To(context);
       },
-      py::arg("gpu_id") = -1);
+      py::arg("gpu_id") = -1, py::call_guard<py::gil_scoped_release>());
+
+  pyclass.def(
+      "cpu",
+      [](const PyClass &self) -> PyClass {
+        auto context = GetCpuContext();
+        return self.To(context);
+      },
+      py::call_guard<py::gil_scoped_release>());
+
+  // The `*_async` versions return a tuple (ragged, handle) as soon as the
+  // copy is queued; the result must not be read before handle.wait() has
+  // been called (or handle.done() returned True).
+  pyclass.def(
+      "cuda_async",
+      [](const PyClass &self, int32_t gpu_id = -1)
+          -> std::pair<PyClass, std::unique_ptr<AsyncHandle>> {
+        return RaggedToAsync(self, GetCudaContext(gpu_id));
+      },
+      py::arg("gpu_id") = -1, py::call_guard<py::gil_scoped_release>());
 
-  pyclass.def("cpu", [](const PyClass &self) -> PyClass {
-    auto context = GetCpuContext();
-    return self.To(context);
-  });
+  pyclass.def(
+      "cpu_async",
+      [](const PyClass &self)
+          -> std::pair<PyClass, std::unique_ptr<AsyncHandle>> {
+        return RaggedToAsync(self, GetCpuContext());
+      },
+      py::call_guard<py::gil_scoped_release>());
 }
 
-static void PybindRaggedImpl(py::module &m) { PybindRaggedTpl<Arc>(m, "_Fsa"); }
+static void PybindRaggedImpl(py::module &m) {
+  PybindRaggedTpl<Arc>(m, "_Fsa");
+
+  // Constructs an FsaVec (or an Fsa, if `shape` has 2 axes) sharing the memory
+  // of `shape` and `arcs`, as returned by `_Fsa.shape` and
+  // `_Fsa.values.tensor()`.  Unlike `_fsa_from_tensor`, the arcs are not
+  // validated.
+  m.def(
+      "_fsa_vec_from_tensors",
+      [](RaggedShape &shape, torch::Tensor arcs) -> Ragged<Arc> {
+        return Ragged<Arc>(shape, FromTensor<Arc>(arcs));
+      },
+      py::arg("shape"), py::arg("arcs"),
+      py::call_guard<py::gil_scoped_release>());
+  m.def(
+      "_fsa_vec_from_tensors",
+      [](RaggedShape &shape, py::capsule arcs) -> Ragged<Arc> {
+        torch::Tensor tensor = FromDlpack(arcs);
+        py::gil_scoped_release release;
+        return Ragged<Arc>(shape, FromTensor<Arc>(tensor));
+      },
+      py::arg("shape"), py::arg("arcs"));
+}
 
 }  // namespace k2
 
@@ -6,6 +6,10 @@
  * See LICENSE for clarification regarding multiple authors
  */
 
+#include <cstring>
+#include <vector>
+
+#include "ATen/DLConvertor.h"
 #include "k2/python/csrc/torch/torch_util.h"
 #include "torch/extension.h"
 
@@ -73,4 +77,60 @@ Array1<Arc> FromTensor<Arc>(torch::Tensor &tensor) {
   return ans;
 }
 
+Tensor FromTorchTensor(torch::Tensor &tensor) {
+  Dtype dtype = kFloatDtype;
+  switch (tensor.scalar_type()) {
+    case torch::kFloat:
+      break;
+    case torch::kHalf:
+      dtype = kHalfDtype;
+      break;
+    case torch::kInt:
+      dtype = kInt32Dtype;
+      break;
+    default:
+      K2_LOG(FATAL) << "Unsupported scalar type: " << tensor.scalar_type()
+                    << ". Only float32, float16 and int32 are supported";
+  }
+  std::vector<int32_t> dims(tensor.sizes().begin(), tensor.sizes().end()),
+      strides(tensor.strides().begin(), tensor.strides().end());
+  return Tensor(dtype, Shape(dims, strides), NewRegion(tensor), 0);
+}
+
+torch::Tensor FromDlpack(py::capsule capsule) {
+  // the same names as in torch.utils.dlpack
+  static const char *kDlpackName = "dltensor";
+  static const char *kUsedDlpackName = "used_dltensor";
+  K2_CHECK_EQ(strcmp(capsule.name(), kDlpackName), 0)
+      << "Expected capsule name: " << kDlpackName
+      << ". Given: " << capsule.name()
+      << "\nNote that DLTensor capsules can be consumed only once.";
+  torch::Tensor ans = at::fromDLPack(capsule.get_pointer<DLManagedTensor>());
+  // the tensor owns the DLManagedTensor now.
+  PyCapsule_SetName(capsule.ptr(), kUsedDlpackName);
+  return ans;
+}
+
+RaggedShape RaggedShapeFromTensors(std::vector<torch::Tensor> &row_splits,
+                                   std::vector<torch::Tensor> &row_ids) {
+  K2_CHECK(!row_splits.empty());
+  K2_CHECK(row_ids.empty() || row_ids.size() == row_splits.size());
+  std::vector<RaggedShapeDim> axes(row_splits.size());
+  for (std::size_t i = 0; i != axes.size(); ++i) {
+    axes[i].row_splits = FromTensor<int32_t>(row_splits[i]);
+    if (!row_ids.empty()) {
+      axes[i].row_ids = FromTensor<int32_t>(row_ids[i]);
+      axes[i].cached_tot_size = axes[i].row_ids.Dim();
+    } else if (i + 1 < axes.size()) {
+      // known on the host from the next axis.
+      axes[i].cached_tot_size = row_splits[i + 1].numel() - 1;
+    } else {
+      axes[i].cached_tot_size = -1;
+    }
+    K2_CHECK(axes[i].row_splits.Context()->IsCompatible(
+        *axes[0].row_splits.Context()));
+  }
+  return RaggedShape(axes);
+}
+
 }  // namespace k2
@@ -9,10 +9,14 @@
 #ifndef K2_PYTHON_CSRC_TORCH_TORCH_UTIL_H_
 #define K2_PYTHON_CSRC_TORCH_TORCH_UTIL_H_
 
+#include <vector>
+
 #include "k2/csrc/array.h"
 #include "k2/csrc/fsa.h"
 #include "k2/csrc/log.h"
 #include "k2/csrc/pytorch_context.h"
+#include "k2/csrc/ragged.h"
+#include "k2/csrc/tensor.h"
 #include "torch/extension.h"
 
 namespace k2 {
@@ -167,6 +171,38 @@ torch::Tensor ToTensor(Array2<T> &array) {
   return tensor;
 }
 
+/* Convert a torch::Tensor to a k2 Tensor, without copying.
+
+   @param [in] tensor  A tensor of dtype torch.float32, torch.float16 or
+                       torch.int32 (with any number of axes), whose strides
+                       are non-increasing (e.g. a contiguous tensor or a slice
+                       of one, such as a padded nnet output).
+
+   @return a Tensor sharing the underlying memory with the input tensor.
+ */
+Tensor FromTorchTensor(torch::Tensor &tensor);
+
+/* Convert a DLPack capsule (e.g. from torch.utils.dlpack.to_dlpack()) to
+   a torch::Tensor, without copying.  As in PyTorch, a capsule can be
+   consumed only once.
+ */
+torch::Tensor FromDlpack(py::capsule capsule);
+
+/* Construct a RaggedShape from the row_splits and (optionally) row_ids
+   of its axes, without copying them.
+
+   @param [in] row_splits  row_splits[i] is the row_splits of axis i + 1, as
+                           a 1-D contiguous tensor of dtype torch.int32; all
+                           on the same device, and there must be at least
+                           one.
+   @param [in] row_ids     Either empty, or row_ids[i] is the row_ids of axis
+                           i + 1 (with the same requirements as row_splits).
+
+   @return  The shape.  It is checked for consistency only in debug mode.
+ */
+RaggedShape RaggedShapeFromTensors(std::vector<torch::Tensor> &row_splits,
+                                   std::vector<torch::Tensor> &row_ids);
+
 }  // namespace k2
 
 #endif  // K2_PYTHON_CSRC_TORCH_TORCH_UTIL_H_
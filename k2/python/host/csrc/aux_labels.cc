@@ -14,8 +14,10 @@ void PyBindAuxLabels1Mapper(py::module &m) {
       .def(py::init<const k2host::AuxLabels &,
                     const k2host::Array1<int32_t *> &>(),
            py::arg("labels_in"), py::arg("arc_map"))
-      .def("get_sizes", &PyClass::GetSizes, py::arg("aux_size"))
-      .def("get_output", &PyClass::GetOutput, py::arg("labels_out"));
+      .def("get_sizes", &PyClass::GetSizes, py::arg("aux_size"),
+           py::call_guard<py::gil_scoped_release>())
+      .def("get_output", &PyClass::GetOutput, py::arg("labels_out"),
+           py::call_guard<py::gil_scoped_release>());
 }
 
 void PyBindAuxLabels2Mapper(py::module &m) {
@@ -24,8 +26,10 @@ void PyBindAuxLabels2Mapper(py::module &m) {
       .def(py::init<const k2host::AuxLabels &,
                     const k2host::Array2<int32_t *> &>(),
            py::arg("labels_in"), py::arg("arc_map"))
-      .def("get_sizes", &PyClass::GetSizes, py::arg("aux_size"))
-      .def("get_output", &PyClass::GetOutput, py::arg("labels_out"));
+      .def("get_sizes", &PyClass::GetSizes, py::arg("aux_size"),
+           py::call_guard<py::gil_scoped_release>())
+      .def("get_output", &PyClass::GetOutput, py::arg("labels_out"),
+           py::call_guard<py::gil_scoped_release>());
 }
 
 void PyBindFstInverter(py::module &m) {
@@ -34,9 +38,9 @@ void PyBindFstInverter(py::module &m) {
       .def(py::init<const k2host::Fsa &, const k2host::AuxLabels &>(),
            py::arg("fsa_in"), py::arg("labels_in"))
       .def("get_sizes", &PyClass::GetSizes, py::arg("fsa_size"),
-           py::arg("aux_size"))
+           py::arg("aux_size"), py::call_guard<py::gil_scoped_release>())
       .def("get_output", &PyClass::GetOutput, py::arg("fsa_out"),
-           py::arg("labels_out"));
+           py::arg("labels_out"), py::call_guard<py::gil_scoped_release>());
 }
 
 void PybindAuxLabels(py::module &m) {
@@ -8,6 +8,7 @@
 
 #include <memory>
 #include <utility>
+#include <vector>
 
 #include "k2/csrc/host/arcsort.h"
 #include "k2/csrc/host/array.h"
@@ -18,14 +19,17 @@
 #include "k2/csrc/host/intersect.h"
 #include "k2/csrc/host/rmepsilon.h"
 #include "k2/csrc/host/topsort.h"
+#include "k2/csrc/host/util.h"
 #include "k2/csrc/host/weights.h"
 #include "k2/python/host/csrc/array.h"
+#include "k2/python/host/csrc/tensor.h"
 
 void PyBindArcSort(py::module &m) {
   using PyClass = k2host::ArcSorter;
   py::class_<PyClass>(m, "_ArcSorter")
       .def(py::init<const k2host::Fsa &>(), py::arg("fsa_in"))
-      .def("get_sizes", &PyClass::GetSizes, py::arg("fsa_size"))
+      .def("get_sizes", &PyClass::GetSizes, py::arg("fsa_size"),
+           py::call_guard<py::gil_scoped_release>())
       .def(
           "get_output",
           [](PyClass &self, k2host::Fsa *fsa_out,
@@ -33,7 +37,8 @@ void PyBindArcSort(py::module &m) {
             return self.GetOutput(fsa_out,
                                   arc_map == nullptr ? nullptr : arc_map->data);
           },
-          py::arg("fsa_out"), py::arg("arc_map").none(true));
+          py::arg("fsa_out"), py::arg("arc_map").none(true),
+          py::call_guard<py::gil_scoped_release>());
 
   m.def(
       "_arc_sort",
@@ -42,14 +47,15 @@ void PyBindArcSort(py::module &m) {
                                arc_map == nullptr ? nullptr : arc_map->data);
       },
       "in-place version of ArcSorter", py::arg("fsa"),
-      py::arg("arc_map").none(true));
+      py::arg("arc_map").none(true), py::call_guard<py::gil_scoped_release>());
 }
 
 void PyBindTopSort(py::module &m) {
   using PyClass = k2host::TopSorter;
   py::class_<PyClass>(m, "_TopSorter")
       .def(py::init<const k2host::Fsa &>(), py::arg("fsa_in"))
-      .def("get_sizes", &PyClass::GetSizes, py::arg("fsa_size"))
+      .def("get_sizes", &PyClass::GetSizes, py::arg("fsa_size"),
+           py::call_guard<py::gil_scoped_release>())
       .def(
           "get_output",
           [](PyClass &self, k2host::Fsa *fsa_out,
@@ -57,14 +63,16 @@ void PyBindTopSort(py::module &m) {
             return self.GetOutput(
                 fsa_out, state_map == nullptr ? nullptr : state_map->data);
           },
-          py::arg("fsa_out"), py::arg("state_map").none(true));
+          py::arg("fsa_out"), py::arg("state_map").none(true),
+          py::call_guard<py::gil_scoped_release>());
 }
 
 void PyBindConnect(py::module &m) {
   using PyClass = k2host::Connection;
   py::class_<PyClass>(m, "_Connection")
       .def(py::init<const k2host::Fsa &>(), py::arg("fsa_in"))
-      .def("get_sizes", &PyClass::GetSizes, py::arg("fsa_size"))
+      .def("get_sizes", &PyClass::GetSizes, py::arg("fsa_size"),
+           py::call_guard<py::gil_scoped_release>())
       .def(
           "get_output",
           [](PyClass &self, k2host::Fsa *fsa_out,
@@ -72,7 +80,8 @@ void PyBindConnect(py::module &m) {
             return self.GetOutput(fsa_out,
                                   arc_map == nullptr ? nullptr : arc_map->data);
           },
-          py::arg("fsa_out"), py::arg("arc_map").none(true));
+          py::arg("fsa_out"), py::arg("arc_map").none(true),
+          py::call_guard<py::gil_scoped_release>());
 }
 
 void PyBindIntersect(py::module &m) {
@@ -80,7 +89,8 @@ void PyBindIntersect(py::module &m) {
   py::class_<PyClass>(m, "_Intersection")
       .def(py::init<const k2host::Fsa &, const k2host::Fsa &>(),
            py::arg("fsa_a"), py::arg("fsa_b"))
-      .def("get_sizes", &PyClass::GetSizes, py::arg("fsa_size"))
+      .def("get_sizes", &PyClass::GetSizes, py::arg("fsa_size"),
+           py::call_guard<py::gil_scoped_release>())
       .def(
           "get_output",
           [](PyClass &self, k2host::Fsa *fsa_out,
@@ -91,7 +101,8 @@ void PyBindIntersect(py::module &m) {
                 arc_map_b == nullptr ? nullptr : arc_map_b->data);
           },
           py::arg("fsa_out"), py::arg("arc_map_a").none(true),
-          py::arg("arc_map_b").none(true));
+          py::arg("arc_map_b").none(true),
+          py::call_guard<py::gil_scoped_release>());
 }
 
 template <typename TracebackState>
@@ -101,13 +112,15 @@ void PybindDeterminizerTpl(py::module &m, const char *name) {
       .def(py::init<const k2host::WfsaWithFbWeights &, float, int64_t>(),
            py::arg("fsa_in"), py::arg("beam"), py::arg("max_step"))
       .def("get_sizes", &PyClass::GetSizes, py::arg("fsa_size"),
-           py::arg("arc_derivs_size"))
+           py::arg("arc_derivs_size"),
+           py::call_guard<py::gil_scoped_release>())
       .def(
           "get_output",
           [](PyClass &self, k2host::Fsa *fsa_out,
              k2host::Array2<typename TracebackState::DerivType *> *arc_derivs)
               -> float { return self.GetOutput(fsa_out, arc_derivs); },
-          py::arg("fsa_out"), py::arg("arc_derivs"));
+          py::arg("fsa_out"), py::arg("arc_derivs"),
+          py::call_guard<py::gil_scoped_release>());
 }
 
 template <typename TracebackState>
@@ -117,15 +130,390 @@ void PybindEpsilonsRemoverTpl(py::module &m, const char *name) {
       .def(py::init<const k2host::WfsaWithFbWeights &, float>(),
            py::arg("fsa_in"), py::arg("beam"))
       .def("get_sizes", &PyClass::GetSizes, py::arg("fsa_size"),
-           py::arg("arc_derivs_size"))
+           py::arg("arc_derivs_size"),
+           py::call_guard<py::gil_scoped_release>())
       .def(
           "get_output",
           [](PyClass &self, k2host::Fsa *fsa_out,
              k2host::Array2<typename TracebackState::DerivType *> *arc_derivs)
               -> void { return self.GetOutput(fsa_out, arc_derivs); },
-          py::arg("fsa_out"), py::arg("arc_derivs"));
+          py::arg("fsa_out"), py::arg("arc_derivs"),
+          py::call_guard<py::gil_scoped_release>());
+}
+
+namespace {
+
+// A batch of k2host algorithm objects, one per input FSA (or pair of FSAs
+// for intersection). `GetSizes()` and `GetOutput()` of the objects are
+// called by k2host::ParallelFor() with the GIL released, so the bound
+// methods below must not touch Python objects.
+template <typename Algo>
+struct AlgoBatch {
+  std::vector<std::unique_ptr<Algo>> algos;
+  int32_t num_threads;
+
+  int32_t Size() const { return static_cast<int32_t>(algos.size()); }
+};
+
+// Returns the `i`-th map of `maps`, or nullptr if `maps` is empty,
+// which is how the batched bindings are told not to output maps.
+int32_t *GetMapData(const std::vector<k2host::Array1<int32_t *> *> &maps,
+                    int32_t i) {
+  return maps.empty() ? nullptr : maps[i]->data;
+}
+
+void CheckOutputSizes(int32_t batch_size, std::size_t num_fsas_out,
+                      std::size_t num_maps) {
+  K2_CHECK_EQ(static_cast<std::size_t>(batch_size), num_fsas_out);
+  K2_CHECK(num_maps == 0 || num_maps == num_fsas_out);
+}
+
+// Calls GetSizes() of every object in `self` (for algorithms that
+// output only an FSA and possibly a map).
+template <typename Algo>
+std::vector<k2host::Array2Size<int32_t>> GetFsaSizes(AlgoBatch<Algo> &self) {
+  std::vector<k2host::Array2Size<int32_t>> fsa_sizes(self.Size());
+  k2host::ParallelFor(self.Size(), self.num_threads, [&](int32_t i) {
+    self.algos[i]->GetSizes(&fsa_sizes[i]);
+  });
+  return fsa_sizes;
+}
+
+// Returns the size of the map output by `Algo` with an FSA of size `size`:
+// the arc map, except for TopSorter, whose map is indexed by state.
+template <typename Algo>
+int32_t MapSize(const k2host::Array2Size<int32_t> &size) {
+  return size.size2;
+}
+
+template <>
+int32_t MapSize<k2host::TopSorter>(const k2host::Array2Size<int32_t> &size) {
+  return size.size1;
+}
+
+// Returns the `i`-th element of `map`, or nullptr if it is empty.
+int32_t *GetMapData(const std::vector<int32_t *> &map, int32_t i) {
+  return map.empty() ? nullptr : map[i];
+}
+
+/*
+  Allocates the outputs of a batch as DLPack capsules (see NewDlpackCapsule()),
+  so that they don't have to be allocated (and wrapped) one by one in Python.
+  The indexes and arcs of the output FSAs are concatenated the same way as
+  in k2host.Fsa.create_fsas_with_sizes(), and so are the maps.
+
+     @param [in] sizes     The sizes of the output FSAs, from GetFsaSizes().
+     @param [in] num_maps  The number of maps `Algo` outputs with each FSA.
+     @param [in] with_maps  If false, no maps are allocated.
+     @param [out] fsas_out  Will be set to the output FSAs, which point into
+                           the memory of the capsules.
+     @param [out] maps     Will have `num_maps` elements; maps[m][i] is the
+                           m-th map of the i-th FSA, and maps[m] is empty if
+                           `with_maps` is false.
+
+     @return  The capsules of the indexes and arcs, followed by the capsule
+              of each map (None if `with_maps` is false).
+ */
+template <typename Algo>
+py::list NewBatchOutputs(const std::vector<k2host::Array2Size<int32_t>> &sizes,
+                         int32_t num_maps, bool with_maps,
+                         std::vector<k2host::Fsa> *fsas_out,
+                         std::vector<std::vector<int32_t *>> *maps) {
+  int64_t num_indexes = 0, num_arcs = 0, map_size = 0;
+  for (const auto &size : sizes) {
+    num_indexes += size.size1 + 1;
+    num_arcs += size.size2;
+    map_size += MapSize<Algo>(size);
+  }
+  py::list ans;
+  void *indexes_data = nullptr, *arcs_data = nullptr;
+  ans.append(NewDlpackCapsule(kInt32Type, {num_indexes}, &indexes_data));
+  ans.append(NewDlpackCapsule(kInt32Type, {num_arcs, 4}, &arcs_data));
+  auto *indexes = static_cast<int32_t *>(indexes_data);
+  auto *arcs = static_cast<k2host::Arc *>(arcs_data);
+  fsas_out->clear();
+  fsas_out->reserve(sizes.size());
+  for (const auto &size : sizes) {
+    fsas_out->emplace_back(size.size1, size.size2, indexes, arcs);
+    indexes += size.size1 + 1;
+    arcs += size.size2;
+  }
+
+  maps->assign(num_maps, std::vector<int32_t *>());
+  for (auto &map : *maps) {
+    if (!with_maps) {
+      ans.append(py::none());
+      continue;
+    }
+    void *map_data = nullptr;
+    ans.append(NewDlpackCapsule(kInt32Type, {map_size}, &map_data));
+    auto *data = static_cast<int32_t *>(map_data);
+    for (const auto &size : sizes) {
+      map.push_back(data);
+      data += MapSize<Algo>(size);
+    }
+  }
+  return ans;
+}
+
+// Binds the batched version of TopSorter or Connection; the bound
+// `get_output` returns the status of each output.
+template <typename Algo>
+void PybindSingleInputBatchTpl(py::module &m, const char *name) {
+  using PyClass = AlgoBatch<Algo>;
+  py::class_<PyClass>(m, name)
+      .def(py::init([](const std::vector<k2host::Fsa *> &fsas_in,
+                       int32_t num_threads) {
+             std::unique_ptr<PyClass> ans(new PyClass);
+             ans->num_threads = num_threads;
+             for (const k2host::Fsa *fsa : fsas_in)
+               ans->algos.emplace_back(new Algo(*fsa));
+             return ans;
+           }),
+           py::arg("fsas_in"), py::arg("num_threads"))
+      .def("get_sizes", &GetFsaSizes<Algo>,
+           py::call_guard<py::gil_scoped_release>())
+      .def(
+          "get_output",
+          [](PyClass &self, const std::vector<k2host::Fsa *> &fsas_out,
+             const std::vector<k2host::Array1<int32_t *> *> &maps)
+              -> std::vector<bool> {
+            CheckOutputSizes(self.Size(), fsas_out.size(), maps.size());
+            // std::vector<bool> can't be written concurrently.
+            std::vector<char> status(self.Size());
+            k2host::ParallelFor(self.Size(), self.num_threads, [&](int32_t i) {
+              status[i] =
+                  self.algos[i]->GetOutput(fsas_out[i], GetMapData(maps, i));
+            });
+            return std::vector<bool>(status.begin(), status.end());
+          },
+          py::arg("fsas_out"), py::arg("maps"),
+          py::call_guard<py::gil_scoped_release>())
+      .def(
+          "get_outputs",
+          [](PyClass &self, bool with_maps) -> py::tuple {
+            std::vector<k2host::Array2Size<int32_t>> sizes;
+            {
+              py::gil_scoped_release release;
+              sizes = GetFsaSizes(self);
+            }
+            std::vector<k2host::Fsa> fsas_out;
+            std::vector<std::vector<int32_t *>> maps;
+            py::list outputs =
+                NewBatchOutputs<Algo>(sizes, 1, with_maps, &fsas_out, &maps);
+            std::vector<char> status(self.Size());
+            {
+              py::gil_scoped_release release;
+              k2host::ParallelFor(
+                  self.Size(), self.num_threads, [&](int32_t i) {
+                    status[i] = self.algos[i]->GetOutput(
+                        &fsas_out[i], GetMapData(maps[0], i));
+                  });
+            }
+            return py::make_tuple(
+                sizes, outputs,
+                std::vector<bool>(status.begin(), status.end()));
+          },
+          py::arg("with_maps") = false);
+}
+
+void PyBindArcSortBatch(py::module &m) {
+  using PyClass = AlgoBatch<k2host::ArcSorter>;
+  py::class_<PyClass>(m, "_ArcSorterBatch")
+      .def(py::init([](const std::vector<k2host::Fsa *> &fsas_in,
+                       int32_t num_threads) {
+             std::unique_ptr<PyClass> ans(new PyClass);
+             ans->num_threads = num_threads;
+             for (const k2host::Fsa *fsa : fsas_in)
+               ans->algos.emplace_back(new k2host::ArcSorter(*fsa));
+             return ans;
+           }),
+           py::arg("fsas_in"), py::arg("num_threads"))
+      .def("get_sizes", &GetFsaSizes<k2host::ArcSorter>,
+           py::call_guard<py::gil_scoped_release>())
+      .def(
+          "get_output",
+          [](PyClass &self, const std::vector<k2host::Fsa *> &fsas_out,
+             const std::vector<k2host::Array1<int32_t *> *> &arc_maps) {
+            CheckOutputSizes(self.Size(), fsas_out.size(), arc_maps.size());
+            k2host::ParallelFor(self.Size(), self.num_threads, [&](int32_t i) {
+              self.algos[i]->GetOutput(fsas_out[i], GetMapData(arc_maps, i));
+            });
+          },
+          py::arg("fsas_out"), py::arg("arc_maps"),
+          py::call_guard<py::gil_scoped_release>())
+      .def(
+          "get_outputs",
+          [](PyClass &self, bool with_maps) -> py::tuple {
+            std::vector<k2host::Array2Size<int32_t>> sizes;
+            {
+              py::gil_scoped_release release;
+              sizes = GetFsaSizes(self);
+            }
+            std::vector<k2host::Fsa> fsas_out;
+            std::vector<std::vector<int32_t *>> arc_maps;
+            py::list outputs = NewBatchOutputs<k2host::ArcSorter>(
+                sizes, 1, with_maps, &fsas_out, &arc_maps);
+            {
+              py::gil_scoped_release release;
+              k2host::ParallelFor(
+                  self.Size(), self.num_threads, [&](int32_t i) {
+                    self.algos[i]->GetOutput(&fsas_out[i],
+                                             GetMapData(arc_maps[0], i));
+                  });
+            }
+            return py::make_tuple(sizes, outputs);
+          },
+          py::arg("with_maps") = false);
 }
 
+void PyBindIntersectBatch(py::module &m) {
+  using PyClass = AlgoBatch<k2host::Intersection>;
+  py::class_<PyClass>(m, "_IntersectionBatch")
+      .def(py::init([](const std::vector<k2host::Fsa *> &fsas_a,
+                       const std::vector<k2host::Fsa *> &fsas_b,
+                       int32_t num_threads) {
+             K2_CHECK_EQ(fsas_a.size(), fsas_b.size());
+             std::unique_ptr<PyClass> ans(new PyClass);
+             ans->num_threads = num_threads;
+             for (std::size_t i = 0; i != fsas_a.size(); ++i)
+               ans->algos.emplace_back(
+                   new k2host::Intersection(*fsas_a[i], *fsas_b[i]));
+             return ans;
+           }),
+           py::arg("fsas_a"), py::arg("fsas_b"), py::arg("num_threads"))
+      .def("get_sizes", &GetFsaSizes<k2host::Intersection>,
+           py::call_guard<py::gil_scoped_release>())
+      .def(
+          "get_output",
+          [](PyClass &self, const std::vector<k2host::Fsa *> &fsas_out,
+             const std::vector<k2host::Array1<int32_t *> *> &arc_maps_a,
+             const std::vector<k2host::Array1<int32_t *> *> &arc_maps_b)
+              -> std::vector<bool> {
+            CheckOutputSizes(self.Size(), fsas_out.size(), arc_maps_a.size());
+            CheckOutputSizes(self.Size(), fsas_out.size(), arc_maps_b.size());
+            std::vector<char> status(self.Size());
+            k2host::ParallelFor(self.Size(), self.num_threads, [&](int32_t i) {
+              status[i] = self.algos[i]->GetOutput(
+                  fsas_out[i], GetMapData(arc_maps_a, i),
+                  GetMapData(arc_maps_b, i));
+            });
+            return std::vector<bool>(status.begin(), status.end());
+          },
+          py::arg("fsas_out"), py::arg("arc_maps_a"), py::arg("arc_maps_b"),
+          py::call_guard<py::gil_scoped_release>())
+      .def(
+          "get_outputs",
+          [](PyClass &self, bool with_maps) -> py::tuple {
+            std::vector<k2host::Array2Size<int32_t>> sizes;
+            {
+              py::gil_scoped_release release;
+              sizes = GetFsaSizes(self);
+            }
+            std::vector<k2host::Fsa> fsas_out;
+            std::vector<std::vector<int32_t *>> arc_maps;
+            py::list outputs = NewBatchOutputs<k2host::Intersection>(
+                sizes, 2, with_maps, &fsas_out, &arc_maps);
+            std::vector<char> status(self.Size());
+            {
+              py::gil_scoped_release release;
+              k2host::ParallelFor(
+                  self.Size(), self.num_threads, [&](int32_t i) {
+                    status[i] = self.algos[i]->GetOutput(
+                        &fsas_out[i], GetMapData(arc_maps[0], i),
+                        GetMapData(arc_maps[1], i));
+                  });
+            }
+            return py::make_tuple(
+                sizes, outputs,
+                std::vector<bool>(status.begin(), status.end()));
+          },
+          py::arg("with_maps") = false);
+}
+
+// Calls GetSizes() of every Determinizer or EpsilonsRemover in `self`.
+template <typename Algo>
+std::pair<std::vector<k2host::Array2Size<int32_t>>,
+          std::vector<k2host::Array2Size<int32_t>>>
+GetFsaAndArcDerivsSizes(AlgoBatch<Algo> &self) {
+  std::vector<k2host::Array2Size<int32_t>> fsa_sizes(self.Size()),
+      arc_derivs_sizes(self.Size());
+  k2host::ParallelFor(self.Size(), self.num_threads, [&](int32_t i) {
+    self.algos[i]->GetSizes(&fsa_sizes[i], &arc_derivs_sizes[i]);
+  });
+  return std::make_pair(std::move(fsa_sizes), std::move(arc_derivs_sizes));
+}
+
+template <typename TracebackState>
+void PybindDeterminizerBatchTpl(py::module &m, const char *name) {
+  using Algo = k2host::Determinizer<TracebackState>;
+  using ArcDerivs = k2host::Array2<typename TracebackState::DerivType *>;
+  using PyClass = AlgoBatch<Algo>;
+  py::class_<PyClass>(m, name)
+      .def(py::init(
+               [](const std::vector<k2host::WfsaWithFbWeights *> &fsas_in,
+                  float beam, int64_t max_step, int32_t num_threads) {
+                 std::unique_ptr<PyClass> ans(new PyClass);
+                 ans->num_threads = num_threads;
+                 for (const k2host::WfsaWithFbWeights *fsa : fsas_in)
+                   ans->algos.emplace_back(new Algo(*fsa, beam, max_step));
+                 return ans;
+               }),
+           py::arg("fsas_in"), py::arg("beam"), py::arg("max_step"),
+           py::arg("num_threads"))
+      .def("get_sizes", &GetFsaAndArcDerivsSizes<Algo>,
+           py::call_guard<py::gil_scoped_release>())
+      .def(
+          "get_output",
+          [](PyClass &self, const std::vector<k2host::Fsa *> &fsas_out,
+             const std::vector<ArcDerivs *> &arc_derivs) -> std::vector<float> {
+            K2_CHECK_EQ(fsas_out.size(), self.algos.size());
+            K2_CHECK_EQ(arc_derivs.size(), self.algos.size());
+            std::vector<float> effective_beams(self.Size());
+            k2host::ParallelFor(self.Size(), self.num_threads, [&](int32_t i) {
+              effective_beams[i] =
+                  self.algos[i]->GetOutput(fsas_out[i], arc_derivs[i]);
+            });
+            return effective_beams;
+          },
+          py::arg("fsas_out"), py::arg("arc_derivs"),
+          py::call_guard<py::gil_scoped_release>());
+}
+
+template <typename TracebackState>
+void PybindEpsilonsRemoverBatchTpl(py::module &m, const char *name) {
+  using Algo = k2host::EpsilonsRemover<TracebackState>;
+  using ArcDerivs = k2host::Array2<typename TracebackState::DerivType *>;
+  using PyClass = AlgoBatch<Algo>;
+  py::class_<PyClass>(m, name)
+      .def(py::init(
+               [](const std::vector<k2host::WfsaWithFbWeights *> &fsas_in,
+                  float beam, int32_t num_threads) {
+                 std::unique_ptr<PyClass> ans(new PyClass);
+                 ans->num_threads = num_threads;
+                 for (const k2host::WfsaWithFbWeights *fsa : fsas_in)
+                   ans->algos.emplace_back(new Algo(*fsa, beam));
+                 return ans;
+               }),
+           py::arg("fsas_in"), py::arg("beam"), py::arg("num_threads"))
+      .def("get_sizes", &GetFsaAndArcDerivsSizes<Algo>,
+           py::call_guard<py::gil_scoped_release>())
+      .def(
+          "get_output",
+          [](PyClass &self, const std::vector<k2host::Fsa *> &fsas_out,
+             const std::vector<ArcDerivs *> &arc_derivs) {
+            K2_CHECK_EQ(fsas_out.size(), self.algos.size());
+            K2_CHECK_EQ(arc_derivs.size(), self.algos.size());
+            k2host::ParallelFor(self.Size(), self.num_threads, [&](int32_t i) {
+              self.algos[i]->GetOutput(fsas_out[i], arc_derivs[i]);
+            });
+          },
+          py::arg("fsas_out"), py::arg("arc_derivs"),
+          py::call_guard<py::gil_scoped_release>());
+}
+
+}  // namespace
+
 void PybindFsaAlgo(py::module &m) {
   PyBindArcSort(m);
   PyBindTopSort(m);
@@ -138,4 +526,19 @@ void PybindFsaAlgo(py::module &m) {
   PybindEpsilonsRemoverTpl<k2host::MaxTracebackState>(m, "_EpsilonsRemoverMax");
   PybindEpsilonsRemoverTpl<k2host::LogSumTracebackState>(
       m, "_EpsilonsRemoverLogSum");
+
+  PyBindArcSortBatch(m);
+  PybindSingleInputBatchTpl<k2host::TopSorter>(m, "_TopSorterBatch");
+  PybindSingleInputBatchTpl<k2host::Connection>(m, "_ConnectionBatch");
+  PyBindIntersectBatch(m);
+
+  PybindDeterminizerBatchTpl<k2host::MaxTracebackState>(
+      m, "_DeterminizerMaxBatch");
+  PybindDeterminizerBatchTpl<k2host::LogSumTracebackState>(
+      m, "_DeterminizerLogSumBatch");
+
+  PybindEpsilonsRemoverBatchTpl<k2host::MaxTracebackState>(
+      m, "_EpsilonsRemoverMaxBatch");
+  PybindEpsilonsRemoverBatchTpl<k2host::LogSumTracebackState>(
+      m, "_EpsilonsRemoverLogSumBatch");
 }
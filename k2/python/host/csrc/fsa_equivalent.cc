@@ -15,13 +15,15 @@ void PyBindIsRandEquivalentTpl(py::module &m, const char *name) {
       name,
       [](const k2host::Fsa &a, const k2host::Fsa &b,
          float beam = k2host::kFloatInfinity, float delta = 1e-6,
-         bool top_sorted = true, std::size_t npath = 100) -> bool {
+         bool top_sorted = true, std::size_t npath = 100,
+         int32_t num_threads = 0) -> bool {
         return k2host::IsRandEquivalent<Type>(a, b, beam, delta, top_sorted,
-                                              npath);
+                                              npath, num_threads);
       },
       py::arg("fsa_a"), py::arg("fsa_b"),
       py::arg("beam") = k2host::kFloatInfinity, py::arg("delta") = 1e-6,
-      py::arg("top_sorted") = true, py::arg("npath") = 100);
+      py::arg("top_sorted") = true, py::arg("npath") = 100,
+      py::arg("num_threads") = 0, py::call_guard<py::gil_scoped_release>());
 }
 
 void PyBindRandPath(py::module &m) {
@@ -29,7 +31,8 @@ void PyBindRandPath(py::module &m) {
   py::class_<PyClass>(m, "_RandPath")
       .def(py::init<const k2host::Fsa &, bool, int32_t>(), py::arg("fsa"),
            py::arg("no_eps_arc"), py::arg("eps_arc_tries") = 50)
-      .def("get_sizes", &PyClass::GetSizes, py::arg("fsa_size"))
+      .def("get_sizes", &PyClass::GetSizes, py::arg("fsa_size"),
+           py::call_guard<py::gil_scoped_release>())
       .def(
           "get_output",
           [](PyClass &self, k2host::Fsa *fsa_out,
@@ -37,14 +40,17 @@ void PyBindRandPath(py::module &m) {
             return self.GetOutput(fsa_out,
                                   arc_map == nullptr ? nullptr : arc_map->data);
           },
-          py::arg("fsa_out"), py::arg("arc_map").none(true));
+          py::arg("fsa_out"), py::arg("arc_map").none(true),
+          py::call_guard<py::gil_scoped_release>());
 }
 
 void PybindFsaEquivalent(py::module &m) {
   m.def("_is_rand_equivalent",
-        (bool (*)(const k2host::Fsa &, const k2host::Fsa &, std::size_t)) &
+        (bool (*)(const k2host::Fsa &, const k2host::Fsa &, std::size_t,
+                  int32_t)) &
             k2host::IsRandEquivalent,
-        py::arg("fsa_a"), py::arg("fsa_b"), py::arg("npath") = 100);
+        py::arg("fsa_a"), py::arg("fsa_b"), py::arg("npath") = 100,
+        py::arg("num_threads") = 0, py::call_guard<py::gil_scoped_release>());
 
   PyBindIsRandEquivalentTpl<k2host::kMaxWeight>(
       m, "_is_rand_equivalent_max_weight");
@@ -55,12 +61,14 @@ void PybindFsaEquivalent(py::module &m) {
   m.def(
       "_is_rand_equivalent_after_rmeps_pruned_logsum",
       [](const k2host::Fsa &a, const k2host::Fsa &b, float beam,
-         bool top_sorted = true, std::size_t npath = 100) -> bool {
+         bool top_sorted = true, std::size_t npath = 100,
+         int32_t num_threads = 0) -> bool {
         return k2host::IsRandEquivalentAfterRmEpsPrunedLogSum(
-            a, b, beam, top_sorted, npath);
+            a, b, beam, top_sorted, npath, num_threads);
       },
       py::arg("fsa_a"), py::arg("fsa_b"), py::arg("beam"),
-      py::arg("top_sorted") = true, py::arg("npath") = 100);
+      py::arg("top_sorted") = true, py::arg("npath") = 100,
+      py::arg("num_threads") = 0, py::call_guard<py::gil_scoped_release>());
 
   PyBindRandPath(m);
 }
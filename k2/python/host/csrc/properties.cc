@@ -22,13 +22,22 @@ static bool IsAcyclic(const k2host::Fsa &fsa) {
 }
 
 void PybindProperties(py::module &m) {
-  m.def("_is_valid", &k2host::IsValid, py::arg("fsa"));
-  m.def("_is_top_sorted", &k2host::IsTopSorted, py::arg("fsa"));
-  m.def("_is_arc_sorted", &k2host::IsArcSorted, py::arg("fsa"));
-  m.def("_has_self_loops", &k2host::HasSelfLoops, py::arg("fsa"));
-  m.def("_is_acyclic", &IsAcyclic, py::arg("fsa"));
-  m.def("_is_deterministic", &k2host::IsDeterministic, py::arg("fsa"));
-  m.def("_is_epsilon_free", &k2host::IsEpsilonFree, py::arg("fsa"));
-  m.def("_is_connected", &k2host::IsConnected, py::arg("fsa"));
-  m.def("_is_empty", &k2host::IsEmpty, py::arg("fsa"));
+  m.def("_is_valid", &k2host::IsValid, py::arg("fsa"),
+        py::call_guard<py::gil_scoped_release>());
+  m.def("_is_top_sorted", &k2host::IsTopSorted, py::arg("fsa"),
+        py::call_guard<py::gil_scoped_release>());
+  m.def("_is_arc_sorted", &k2host::IsArcSorted, py::arg("fsa"),
+        py::call_guard<py::gil_scoped_release>());
+  m.def("_has_self_loops", &k2host::HasSelfLoops, py::arg("fsa"),
+        py::call_guard<py::gil_scoped_release>());
+  m.def("_is_acyclic", &IsAcyclic, py::arg("fsa"),
+        py::call_guard<py::gil_scoped_release>());
+  m.def("_is_deterministic", &k2host::IsDeterministic, py::arg("fsa"),
+        py::call_guard<py::gil_scoped_release>());
+  m.def("_is_epsilon_free", &k2host::IsEpsilonFree, py::arg("fsa"),
+        py::call_guard<py::gil_scoped_release>());
+  m.def("_is_connected", &k2host::IsConnected, py::arg("fsa"),
+        py::call_guard<py::gil_scoped_release>());
+  m.def("_is_empty", &k2host::IsEmpty, py::arg("fsa"),
+        py::call_guard<py::gil_scoped_release>());
 }
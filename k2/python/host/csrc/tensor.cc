@@ -7,6 +7,8 @@
 
 #include "k2/python/host/csrc/tensor.h"
 
+#include <vector>
+
 namespace k2host {
 
 // refer to
@@ -44,6 +46,33 @@ static DeviceType DLDeviceTypeToK2DeviceType(DLDeviceType device_type) {
   }
 }
 
+namespace {
+
+// The memory of a tensor created by NewDlpackCapsule(); it is the
+// `manager_ctx` of its DLManagedTensor.
+struct DlpackStorage {
+  DLManagedTensor managed_tensor;
+  std::vector<int64_t> shape;
+  std::vector<int64_t> strides;
+  std::vector<char> data;
+};
+
+void DeleteDlpackStorage(DLManagedTensor *self) {
+  delete static_cast<DlpackStorage *>(self->manager_ctx);
+}
+
+// The destructor of the capsules returned by NewDlpackCapsule(); the tensor
+// is freed here only if the capsule has not been consumed (consumers rename
+// it to kDLPackUsedTensorName and call the deleter themselves).
+void DeleteUnusedDlpackCapsule(PyObject *capsule) {
+  if (!PyCapsule_IsValid(capsule, kDLPackTensorName)) return;
+  auto *managed_tensor = static_cast<DLManagedTensor *>(
+      PyCapsule_GetPointer(capsule, kDLPackTensorName));
+  managed_tensor->deleter(managed_tensor);
+}
+
+}  // namespace
+
 std::ostream &operator<<(std::ostream &os, DataType data_type) {
   os << static_cast<int32_t>(data_type);
   return os;
@@ -126,4 +155,48 @@ void Tensor::Check() const {
   K2_CHECK_EQ(device_type_, kCPU) << "We support only kCPU at present";
 }
 
+py::capsule NewDlpackCapsule(DataType dtype, const std::vector<int64_t> &shape,
+                             void **data) {
+  DLDataType dl_dtype;
+  switch (dtype) {
+    case kInt32Type:
+      dl_dtype = {kDLInt, 32, 1};
+      break;
+    case kFloatType:
+      dl_dtype = {kDLFloat, 32, 1};
+      break;
+    case kDoubleType:
+      dl_dtype = {kDLFloat, 64, 1};
+      break;
+    default:
+      K2_LOG(FATAL) << "Unsupported data type: " << dtype;
+      return py::capsule();  // unreachable code
+  }
+  auto *storage = new DlpackStorage;
+  storage->shape = shape;
+  storage->strides.resize(shape.size());
+  int64_t num_elements = 1;
+  for (std::size_t i = shape.size(); i != 0; --i) {
+    K2_CHECK_GE(shape[i - 1], 0);
+    storage->strides[i - 1] = num_elements;
+    num_elements *= shape[i - 1];
+  }
+  storage->data.resize(num_elements * dl_dtype.bits / 8);
+
+  DLTensor &dl_tensor = storage->managed_tensor.dl_tensor;
+  dl_tensor.data = storage->data.data();
+  dl_tensor.ctx = {kDLCPU, 0};
+  dl_tensor.ndim = static_cast<int>(shape.size());
+  dl_tensor.dtype = dl_dtype;
+  dl_tensor.shape = storage->shape.data();
+  dl_tensor.strides = storage->strides.data();
+  dl_tensor.byte_offset = 0;
+  storage->managed_tensor.manager_ctx = storage;
+  storage->managed_tensor.deleter = &DeleteDlpackStorage;
+
+  if (data != nullptr) *data = dl_tensor.data;
+  return py::capsule(&storage->managed_tensor, kDLPackTensorName,
+                     &DeleteUnusedDlpackCapsule);
+}
+
 }  // namespace k2host
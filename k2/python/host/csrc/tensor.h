@@ -7,6 +7,8 @@
 #ifndef K2_PYTHON_HOST_CSRC_TENSOR_H_
 #define K2_PYTHON_HOST_CSRC_TENSOR_H_
 
+#include <vector>
+
 #include "k2/python/host/csrc/dlpack.h"
 #include "k2/python/host/csrc/k2.h"
 
@@ -96,6 +98,22 @@ class Tensor {
   DeviceType device_type_ = kUnknownDevice;
 };
 
+/*
+  Allocates a zero-filled, contiguous CPU tensor and returns it as a DLPack
+  capsule named "dltensor", which can be consumed once, e.g. with
+  `torch.utils.dlpack.from_dlpack()` or by the constructor of Tensor above.
+  The memory is freed by the consumer, or with the capsule if it is never
+  consumed.  This is used to return outputs of the algorithms without
+  allocating them in Python first.
+
+     @param [in] dtype   kInt32Type, kFloatType or kDoubleType.
+     @param [in] shape   The dimensions of the tensor.
+     @param [out] data   If not nullptr, will be set to the address of the
+                         first element, valid while the tensor is alive.
+ */
+py::capsule NewDlpackCapsule(DataType dtype, const std::vector<int64_t> &shape,
+                             void **data);
+
 }  // namespace k2host
 
 #endif  // K2_PYTHON_HOST_CSRC_TENSOR_H_
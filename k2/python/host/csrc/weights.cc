@@ -20,13 +20,15 @@ void PybindFbWeightType(py::module &m) {
 void PybindWfsaWithFbWeights(py::module &m) {
   using PyClass = k2host::WfsaWithFbWeights;
   py::class_<PyClass>(m, "_WfsaWithFbWeights")
+      // The forward and backward weights are computed in the constructor.
       .def(py::init([](const k2host::Fsa &fsa, k2host::FbWeightType type,
                        k2host::Array1<double *> *forward_state_weights,
                        k2host::Array1<double *> *backward_state_weights) {
-        return std::unique_ptr<PyClass>(
-            new PyClass(fsa, type, forward_state_weights->data,
-                        backward_state_weights->data));
-      }))
+             return std::unique_ptr<PyClass>(
+                 new PyClass(fsa, type, forward_state_weights->data,
+                             backward_state_weights->data));
+           }),
+           py::call_guard<py::gil_scoped_release>())
       // We do not expose `self.fsa`,
       // `self.ForwardStateWeights` `self.BackwardStateWeights` here as they
       // are passed to the constructor of `WfsaWeightFbWeights` from Python
@@ -34,7 +36,12 @@ void PybindWfsaWithFbWeights(py::module &m) {
       // have at least the same lifetime with this WfsaWithFbWeights object.
       // Note those properties and methods will usually not be used in Python
       // code.
-      .def_readonly("weight_type", &PyClass::weight_type);
+      .def_readonly("weight_type", &PyClass::weight_type)
+      // After changing the weights of arcs of `self.fsa` in place, e.g. with
+      // `fsa.data.copy_()`.
+      .def("update_weights", &PyClass::UpdateWeights,
+           py::arg("begin_state") = 0, py::arg("end_state") = -1,
+           py::call_guard<py::gil_scoped_release>());
 }
 
 void PybindWeights(py::module &m) {
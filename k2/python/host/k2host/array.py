@@ -2,6 +2,8 @@
 
 # See ../../../LICENSE for clarification regarding multiple authors
 
+from typing import List
+
 import torch
 from torch.utils.dlpack import to_dlpack
 
@@ -32,6 +34,13 @@ class IntArray1(DLPackIntArray1):
         data = torch.zeros(size, dtype=torch.int32)
         return IntArray1(data)
 
+    @staticmethod
+    def create_arrays_with_sizes(sizes: List[int]) -> List['IntArray1']:
+        """Create one IntArray1 for each size in `sizes`; they are views
+        of one contiguous tensor."""
+        data = torch.zeros(sum(sizes), dtype=torch.int32)
+        return [IntArray1(d) for d in torch.split(data, sizes)]
+
 
 class StridedIntArray1(DLPackStridedIntArray1):
 
@@ -88,6 +97,22 @@ class IntArray2(DLPackIntArray2):
         data = torch.zeros(array_size.size2, dtype=torch.int32)
         return IntArray2(indexes, data)
 
+    @staticmethod
+    def create_arrays_with_sizes(array_sizes: List[IntArray2Size]
+                                ) -> List['IntArray2']:
+        """Create one IntArray2 for each size in `array_sizes`; they are
+        views of one contiguous `indexes` tensor and one contiguous `data`
+        tensor."""
+        indexes = torch.zeros(sum(s.size1 + 1 for s in array_sizes),
+                              dtype=torch.int32)
+        data = torch.zeros(sum(s.size2 for s in array_sizes),
+                           dtype=torch.int32)
+        return [
+            IntArray2(i, d) for i, d in zip(
+                torch.split(indexes, [s.size1 + 1 for s in array_sizes]),
+                torch.split(data, [s.size2 for s in array_sizes]))
+        ]
+
 
 class LogSumArcDerivs(DLPackLogSumArcDerivs):
 
@@ -105,3 +130,19 @@ class LogSumArcDerivs(DLPackLogSumArcDerivs):
         indexes = torch.zeros(array_size.size1 + 1, dtype=torch.int32)
         data = torch.zeros([array_size.size2, 2], dtype=torch.float32)
         return LogSumArcDerivs(indexes, data)
+
+    @staticmethod
+    def create_arc_derivs_with_sizes(array_sizes: List[IntArray2Size]
+                                    ) -> List['LogSumArcDerivs']:
+        """Create one LogSumArcDerivs for each size in `array_sizes`; they
+        are views of one contiguous `indexes` tensor and one contiguous
+        `data` tensor."""
+        indexes = torch.zeros(sum(s.size1 + 1 for s in array_sizes),
+                              dtype=torch.int32)
+        data = torch.zeros([sum(s.size2 for s in array_sizes), 2],
+                           dtype=torch.float32)
+        return [
+            LogSumArcDerivs(i, d) for i, d in zip(
+                torch.split(indexes, [s.size1 + 1 for s in array_sizes]),
+                torch.split(data, [s.size2 for s in array_sizes]))
+        ]
@@ -2,6 +2,8 @@
 
 # See ../../../LICENSE for clarification regarding multiple authors
 
+from typing import List
+
 import torch
 from torch.utils.dlpack import to_dlpack
 
@@ -54,3 +56,23 @@ class Fsa(DLPackFsa):
         indexes = torch.zeros(array_size.size1 + 1, dtype=torch.int32)
         data = torch.zeros([array_size.size2, 4], dtype=torch.int32)
         return Fsa(indexes, data)
+
+    @staticmethod
+    def create_fsas_with_sizes(array_sizes: List[IntArray2Size]
+                              ) -> List['Fsa']:
+        """Create one Fsa for each size in `array_sizes`.
+
+        All of them share one contiguous `indexes` tensor and one contiguous
+        `data` tensor, i.e. each returned Fsa holds views of its own part
+        of them; this is used to allocate the outputs of the batched
+        algorithms in one go.
+        """
+        indexes = torch.zeros(sum(s.size1 + 1 for s in array_sizes),
+                              dtype=torch.int32)
+        data = torch.zeros([sum(s.size2 for s in array_sizes), 4],
+                           dtype=torch.int32)
+        return [
+            Fsa(i, d) for i, d in zip(
+                torch.split(indexes, [s.size1 + 1 for s in array_sizes]),
+                torch.split(data, [s.size2 for s in array_sizes]))
+        ]
@@ -2,7 +2,12 @@
 
 # See ../../../LICENSE for clarification regarding multiple authors
 
+from typing import List
+from typing import Optional
+from typing import Tuple
+
 import torch
+from torch.utils.dlpack import from_dlpack
 from torch.utils.dlpack import to_dlpack
 
 from .fsa import Fsa
@@ -21,6 +26,14 @@ from _k2host import _DeterminizerMax
 from _k2host import _DeterminizerLogSum
 from _k2host import _EpsilonsRemoverMax
 from _k2host import _EpsilonsRemoverLogSum
+from _k2host import _ArcSorterBatch
+from _k2host import _TopSorterBatch
+from _k2host import _ConnectionBatch
+from _k2host import _IntersectionBatch
+from _k2host import _DeterminizerMaxBatch
+from _k2host import _DeterminizerLogSumBatch
+from _k2host import _EpsilonsRemoverMaxBatch
+from _k2host import _EpsilonsRemoverLogSumBatch
 
 
 class ArcSorter(_ArcSorter):
@@ -138,3 +151,230 @@ class EpsilonsRemoverLogSum(_EpsilonsRemoverLogSum):
 
     def get_output(self, fsa_out: Fsa, arc_derivs: LogSumArcDerivs) -> None:
         return super().get_output(fsa_out.get_base(), arc_derivs.get_base())
+
+
+# The batched versions of the classes above. Each of them runs the
+# algorithm on a list of FSAs: `get_sizes` and `get_output` process all
+# of them in parallel on up to `num_threads` threads (all hardware threads
+# if `num_threads` <= 0) with the GIL released. The outputs are usually
+# allocated with `Fsa.create_fsas_with_sizes` and friends, which put all of
+# them in one contiguous tensor for each of `indexes` and `data`. The input
+# FSAs must not be modified or freed while this object is in use.
+
+
+def _get_bases(arrays):
+    return [array.get_base() for array in arrays] if arrays is not None else []
+
+
+def _fsas_from_dlpack(sizes: List[IntArray2Size], indexes,
+                      data) -> List[Fsa]:
+    """Split the concatenated outputs returned as DLPack capsules by the
+    `get_outputs` of the batched algorithms into Fsas, without copying
+    (the layout is the same as in `Fsa.create_fsas_with_sizes`).
+    """
+    return [
+        Fsa(i, d) for i, d in zip(
+            torch.split(from_dlpack(indexes), [s.size1 + 1 for s in sizes]),
+            torch.split(from_dlpack(data), [s.size2 for s in sizes]))
+    ]
+
+
+def _maps_from_dlpack(map_sizes: List[int],
+                      capsule) -> Optional[List[IntArray1]]:
+    if capsule is None:
+        return None
+    return [IntArray1(d) for d in torch.split(from_dlpack(capsule), map_sizes)]
+
+
+class ArcSorterBatch(_ArcSorterBatch):
+
+    def __init__(self, fsas_in: List[Fsa], num_threads: int = 0):
+        self.fsas_in = fsas_in
+        super().__init__(_get_bases(fsas_in), num_threads)
+
+    def get_sizes(self) -> List[IntArray2Size]:
+        return super().get_sizes()
+
+    def get_output(self,
+                   fsas_out: List[Fsa],
+                   arc_maps: List[IntArray1] = None) -> None:
+        return super().get_output(_get_bases(fsas_out), _get_bases(arc_maps))
+
+    def get_outputs(self, with_maps: bool = False
+                   ) -> Tuple[List[Fsa], Optional[List[IntArray1]]]:
+        """Same as `get_sizes` followed by `get_output`, except that the
+        outputs are allocated by the C++ code in one go and shared with
+        torch via DLPack.
+
+        Returns:
+            The output Fsas and, if `with_maps` is True, the arc maps
+            (else None).
+        """
+        sizes, outputs = super().get_outputs(with_maps)
+        return (_fsas_from_dlpack(sizes, outputs[0], outputs[1]),
+                _maps_from_dlpack([s.size2 for s in sizes], outputs[2]))
+
+
+class TopSorterBatch(_TopSorterBatch):
+
+    def __init__(self, fsas_in: List[Fsa], num_threads: int = 0):
+        self.fsas_in = fsas_in
+        super().__init__(_get_bases(fsas_in), num_threads)
+
+    def get_sizes(self) -> List[IntArray2Size]:
+        return super().get_sizes()
+
+    def get_output(self,
+                   fsas_out: List[Fsa],
+                   state_maps: List[IntArray1] = None) -> List[bool]:
+        return super().get_output(_get_bases(fsas_out),
+                                  _get_bases(state_maps))
+
+    def get_outputs(self, with_maps: bool = False
+                   ) -> Tuple[List[Fsa], Optional[List[IntArray1]], List[bool]]:
+        """See `ArcSorterBatch.get_outputs`; the maps are the state maps.
+        Also returns the status of each output.
+        """
+        sizes, outputs, status = super().get_outputs(with_maps)
+        return (_fsas_from_dlpack(sizes, outputs[0], outputs[1]),
+                _maps_from_dlpack([s.size1 for s in sizes],
+                                  outputs[2]), status)
+
+
+class ConnectionBatch(_ConnectionBatch):
+
+    def __init__(self, fsas_in: List[Fsa], num_threads: int = 0):
+        self.fsas_in = fsas_in
+        super().__init__(_get_bases(fsas_in), num_threads)
+
+    def get_sizes(self) -> List[IntArray2Size]:
+        return super().get_sizes()
+
+    def get_output(self,
+                   fsas_out: List[Fsa],
+                   arc_maps: List[IntArray1] = None) -> List[bool]:
+        return super().get_output(_get_bases(fsas_out), _get_bases(arc_maps))
+
+    def get_outputs(self, with_maps: bool = False
+                   ) -> Tuple[List[Fsa], Optional[List[IntArray1]], List[bool]]:
+        """See `ArcSorterBatch.get_outputs`; also returns the status of each
+        output.
+        """
+        sizes, outputs, status = super().get_outputs(with_maps)
+        return (_fsas_from_dlpack(sizes, outputs[0], outputs[1]),
+                _maps_from_dlpack([s.size2 for s in sizes],
+                                  outputs[2]), status)
+
+
+class IntersectionBatch(_IntersectionBatch):
+
+    def __init__(self,
+                 fsas_a: List[Fsa],
+                 fsas_b: List[Fsa],
+                 num_threads: int = 0):
+        self.fsas_a = fsas_a
+        self.fsas_b = fsas_b
+        super().__init__(_get_bases(fsas_a), _get_bases(fsas_b), num_threads)
+
+    def get_sizes(self) -> List[IntArray2Size]:
+        return super().get_sizes()
+
+    def get_output(self,
+                   fsas_out: List[Fsa],
+                   arc_maps_a: List[IntArray1] = None,
+                   arc_maps_b: List[IntArray1] = None) -> List[bool]:
+        return super().get_output(_get_bases(fsas_out),
+                                  _get_bases(arc_maps_a),
+                                  _get_bases(arc_maps_b))
+
+    def get_outputs(
+        self,
+        with_maps: bool = False
+    ) -> Tuple[List[Fsa], Optional[List[IntArray1]],
+               Optional[List[IntArray1]], List[bool]]:
+        """See `ArcSorterBatch.get_outputs`; returns the output Fsas, the
+        arc maps into `fsas_a` and `fsas_b` and the status of each output.
+        """
+        sizes, outputs, status = super().get_outputs(with_maps)
+        map_sizes = [s.size2 for s in sizes]
+        return (_fsas_from_dlpack(sizes, outputs[0], outputs[1]),
+                _maps_from_dlpack(map_sizes, outputs[2]),
+                _maps_from_dlpack(map_sizes, outputs[3]), status)
+
+
+class DeterminizerMaxBatch(_DeterminizerMaxBatch):
+
+    def __init__(self,
+                 fsas_in: List[WfsaWithFbWeights],
+                 beam: float,
+                 max_step: int,
+                 num_threads: int = 0):
+        self.fsas_in = fsas_in
+        super().__init__(fsas_in, beam, max_step, num_threads)
+
+    def get_sizes(self
+                 ) -> Tuple[List[IntArray2Size], List[IntArray2Size]]:
+        return super().get_sizes()
+
+    def get_output(self, fsas_out: List[Fsa],
+                   arc_derivs: List[IntArray2]) -> List[float]:
+        return super().get_output(_get_bases(fsas_out),
+                                  _get_bases(arc_derivs))
+
+
+class DeterminizerLogSumBatch(_DeterminizerLogSumBatch):
+
+    def __init__(self,
+                 fsas_in: List[WfsaWithFbWeights],
+                 beam: float,
+                 max_step: int,
+                 num_threads: int = 0):
+        self.fsas_in = fsas_in
+        super().__init__(fsas_in, beam, max_step, num_threads)
+
+    def get_sizes(self
+                 ) -> Tuple[List[IntArray2Size], List[IntArray2Size]]:
+        return super().get_sizes()
+
+    def get_output(self, fsas_out: List[Fsa],
+                   arc_derivs: List[LogSumArcDerivs]) -> List[float]:
+        return super().get_output(_get_bases(fsas_out),
+                                  _get_bases(arc_derivs))
+
+
+class EpsilonsRemoverMaxBatch(_EpsilonsRemoverMaxBatch):
+
+    def __init__(self,
+                 fsas_in: List[WfsaWithFbWeights],
+                 beam: float,
+                 num_threads: int = 0):
+        self.fsas_in = fsas_in
+        super().__init__(fsas_in, beam, num_threads)
+
+    def get_sizes(self
+                 ) -> Tuple[List[IntArray2Size], List[IntArray2Size]]:
+        return super().get_sizes()
+
+    def get_output(self, fsas_out: List[Fsa],
+                   arc_derivs: List[IntArray2]) -> None:
+        return super().get_output(_get_bases(fsas_out),
+                                  _get_bases(arc_derivs))
+
+
+class EpsilonsRemoverLogSumBatch(_EpsilonsRemoverLogSumBatch):
+
+    def __init__(self,
+                 fsas_in: List[WfsaWithFbWeights],
+                 beam: float,
+                 num_threads: int = 0):
+        self.fsas_in = fsas_in
+        super().__init__(fsas_in, beam, num_threads)
+
+    def get_sizes(self
+                 ) -> Tuple[List[IntArray2Size], List[IntArray2Size]]:
+        return super().get_sizes()
+
+    def get_output(self, fsas_out: List[Fsa],
+                   arc_derivs: List[LogSumArcDerivs]) -> None:
+        return super().get_output(_get_bases(fsas_out),
+                                  _get_bases(arc_derivs))
@@ -30,8 +30,12 @@ class RandPath(_RandPath):
             arc_map.get_base() if arc_map is not None else None)
 
 
-def is_rand_equivalent(fsa_a: Fsa, fsa_b: Fsa, npath: int = 100) -> bool:
-    return _is_rand_equivalent(fsa_a.get_base(), fsa_b.get_base(), npath)
+def is_rand_equivalent(fsa_a: Fsa,
+                       fsa_b: Fsa,
+                       npath: int = 100,
+                       num_threads: int = 0) -> bool:
+    return _is_rand_equivalent(fsa_a.get_base(), fsa_b.get_base(), npath,
+                               num_threads)
 
 
 def is_rand_equivalent_max_weight(fsa_a: Fsa,
@@ -39,9 +43,11 @@ def is_rand_equivalent_max_weight(fsa_a: Fsa,
                                   beam: float = float('inf'),
                                   delta: float = 1e-6,
                                   top_sorted: bool = True,
-                                  npath: int = 100) -> bool:
+                                  npath: int = 100,
+                                  num_threads: int = 0) -> bool:
     return _is_rand_equivalent_max_weight(fsa_a.get_base(), fsa_b.get_base(),
-                                          beam, delta, top_sorted, npath)
+                                          beam, delta, top_sorted, npath,
+                                          num_threads)
 
 
 def is_rand_equivalent_logsum_weight(fsa_a: Fsa,
@@ -49,16 +55,20 @@ def is_rand_equivalent_logsum_weight(fsa_a: Fsa,
                                      beam: float = float('inf'),
                                      delta: float = 1e-6,
                                      top_sorted: bool = True,
-                                     npath: int = 100) -> bool:
+                                     npath: int = 100,
+                                     num_threads: int = 0) -> bool:
     return _is_rand_equivalent_logsum_weight(fsa_a.get_base(),
                                              fsa_b.get_base(), beam, delta,
-                                             top_sorted, npath)
+                                             top_sorted, npath, num_threads)
 
 
 def is_rand_equivalent_after_rmeps_pruned_logsum(fsa_a: Fsa,
                                                  fsa_b: Fsa,
                                                  beam: float,
                                                  top_sorted: bool = True,
-                                                 npath: int = 100) -> bool:
+                                                 npath: int = 100,
+                                                 num_threads: int = 0
+                                                ) -> bool:
     return _is_rand_equivalent_after_rmeps_pruned_logsum(
-        fsa_a.get_base(), fsa_b.get_base(), beam, top_sorted, npath)
+        fsa_a.get_base(), fsa_b.get_base(), beam, top_sorted, npath,
+        num_threads)
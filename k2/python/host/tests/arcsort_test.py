@@ -105,6 +105,69 @@ class TestArcSorter(unittest.TestCase):
         self.assertTrue(torch.equal(fsa_out.data, expected_arcs))
         self.assertTrue(torch.equal(arc_map.data, expected_arc_map))
 
+    def test_arc_sorter_batch(self):
+        s1 = r'''
+        0 1 2 1
+        0 4 0 2
+        0 2 0 3
+        1 2 1 4
+        1 3 0 5
+        2 1 0 6
+        4
+        '''
+        s2 = r'''
+        0 1 3 1
+        0 1 1 2
+        1 2 -1 3
+        2
+        '''
+        fsas = [k2host.str_to_fsa(s1), k2host.str_to_fsa(s2)]
+        sorter = k2host.ArcSorterBatch(fsas, num_threads=2)
+        array_sizes = sorter.get_sizes()
+        self.assertEqual([(a.size1, a.size2) for a in array_sizes],
+                         [(5, 6), (3, 3)])
+        fsas_out = k2host.Fsa.create_fsas_with_sizes(array_sizes)
+        arc_maps = k2host.IntArray1.create_arrays_with_sizes(
+            [a.size2 for a in array_sizes])
+        sorter.get_output(fsas_out, arc_maps)
+        self.assertTrue(
+            torch.equal(fsas_out[0].indexes,
+                        torch.IntTensor([0, 3, 5, 6, 6, 6])))
+        self.assertTrue(
+            torch.equal(arc_maps[0].data, torch.IntTensor([2, 1, 0, 4, 3,
+                                                           5])))
+        self.assertTrue(
+            torch.equal(fsas_out[1].indexes, torch.IntTensor([0, 2, 3, 3])))
+        expected_arcs = torch.IntTensor([[0, 1, 1, float_to_int(2)],
+                                         [0, 1, 3, float_to_int(1)],
+                                         [1, 2, -1, float_to_int(3)]])
+        self.assertTrue(torch.equal(fsas_out[1].data, expected_arcs))
+        self.assertTrue(
+            torch.equal(arc_maps[1].data, torch.IntTensor([1, 0, 2])))
+        # the outputs share one contiguous tensor
+        self.assertEqual(fsas_out[0].data.storage().data_ptr(),
+                         fsas_out[1].data.storage().data_ptr())
+
+        # test without arc_maps
+        fsas_out = k2host.Fsa.create_fsas_with_sizes(array_sizes)
+        sorter.get_output(fsas_out)
+        self.assertTrue(torch.equal(fsas_out[1].data, expected_arcs))
+
+        # the outputs allocated by the C++ code
+        fsas_out, arc_maps = sorter.get_outputs(with_maps=True)
+        self.assertTrue(
+            torch.equal(fsas_out[0].indexes,
+                        torch.IntTensor([0, 3, 5, 6, 6, 6])))
+        self.assertTrue(torch.equal(fsas_out[1].data, expected_arcs))
+        self.assertTrue(
+            torch.equal(arc_maps[0].data, torch.IntTensor([2, 1, 0, 4, 3,
+                                                           5])))
+        self.assertTrue(
+            torch.equal(arc_maps[1].data, torch.IntTensor([1, 0, 2])))
+        fsas_out, arc_maps = sorter.get_outputs()
+        self.assertIsNone(arc_maps)
+        self.assertTrue(torch.equal(fsas_out[1].data, expected_arcs))
+
 
 if __name__ == '__main__':
     unittest.main()
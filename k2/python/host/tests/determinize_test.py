@@ -100,6 +100,36 @@ class TestDeterminize(unittest.TestCase):
         # `std::unordered_map` in implementation of determinize
         # self.assertEqual(arc_ids.get_data(1), 9)
 
+    def test_max_weight_batch(self):
+        wfsas = []
+        for _ in range(3):
+            forward_max_weights = k2host.DoubleArray1.create_array_with_size(
+                self.num_states)
+            backward_max_weights = k2host.DoubleArray1.create_array_with_size(
+                self.num_states)
+            wfsas.append(
+                k2host.WfsaWithFbWeights(self.fsa,
+                                         k2host.FbWeightType.kMaxWeight,
+                                         forward_max_weights,
+                                         backward_max_weights))
+        beam = 10.0
+        determinizer = k2host.DeterminizerMaxBatch(wfsas, beam, 100)
+        fsa_sizes, arc_derivs_sizes = determinizer.get_sizes()
+        self.assertEqual(len(fsa_sizes), 3)
+        fsas_out = k2host.Fsa.create_fsas_with_sizes(fsa_sizes)
+        arc_derivs = k2host.IntArray2.create_arrays_with_sizes(
+            arc_derivs_sizes)
+        effective_beams = determinizer.get_output(fsas_out, arc_derivs)
+        self.assertEqual(len(effective_beams), 3)
+        for fsa_out, derivs in zip(fsas_out, arc_derivs):
+            self.assertTrue(k2host.is_deterministic(fsa_out))
+            self.assertEqual(fsa_out.size1, 7)
+            self.assertEqual(fsa_out.size2, 9)
+            self.assertEqual(derivs.size1, 9)
+            self.assertEqual(derivs.size2, 12)
+            self.assertTrue(
+                k2host.is_rand_equivalent_max_weight(self.fsa, fsa_out, beam))
+
 
 if __name__ == '__main__':
     unittest.main()
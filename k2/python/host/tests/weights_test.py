@@ -81,6 +81,51 @@ class TestWfsa(unittest.TestCase):
             torch.allclose(backward_logsum_weights.data,
                            expected_backward_logsum_weights))
 
+    def test_update_weights(self):
+        forward_logsum_weights = k2host.DoubleArray1.create_array_with_size(
+            self.num_states)
+        backward_logsum_weights = k2host.DoubleArray1.create_array_with_size(
+            self.num_states)
+        wfsa = k2host.WfsaWithFbWeights(self.fsa,
+                                        k2host.FbWeightType.kLogSumWeight,
+                                        forward_logsum_weights,
+                                        backward_logsum_weights)
+        # The same FSA with the weights of some arcs leaving states 1, 3
+        # and 4 changed.
+        s = r'''
+        0 4 1 1
+        0 1 1 1
+        1 2 1 2
+        1 3 1 6
+        2 7 1 4
+        3 7 1 0
+        4 6 1 0
+        4 8 1 0
+        5 9 -1 4
+        6 9 -1 3
+        7 9 -1 5
+        8 9 -1 6
+        9
+        '''
+        self.fsa.data.copy_(k2host.str_to_fsa(s).data)
+        wfsa.update_weights(1, 5)
+        expected_forward_weights = k2host.DoubleArray1.create_array_with_size(
+            self.num_states)
+        expected_backward_weights = k2host.DoubleArray1.create_array_with_size(
+            self.num_states)
+        k2host.WfsaWithFbWeights(self.fsa, k2host.FbWeightType.kLogSumWeight,
+                                 expected_forward_weights,
+                                 expected_backward_weights)
+        self.assertTrue(
+            torch.allclose(forward_logsum_weights.data,
+                           expected_forward_weights.data))
+        self.assertTrue(
+            torch.allclose(backward_logsum_weights.data,
+                           expected_backward_weights.data))
+        self.assertFalse(
+            torch.allclose(backward_logsum_weights.data[0],
+                           torch.tensor(14.143222, dtype=torch.double)))
+
 
 if __name__ == '__main__':
     unittest.main()
@@ -1,5 +1,14 @@
 from .array import Array
 from .fsa import Fsa
+from .fsa_algo import intersect_dense_pruned
+from .memory_stats import MemoryStatsScope
+from .memory_stats import get_memory_stats
+from .memory_stats import reset_max_bytes_live
+from .profile import enable_profiling
+from .profile import get_profile_report
+from .profile import get_profile_stats
+from .profile import profiling_enabled
+from .profile import reset_profile
 from _k2 import Arc
 
 # please keep the list sorted
@@ -7,4 +16,13 @@ __all__ = [
     'Arc',
     'Array',
     'Fsa',
+    'MemoryStatsScope',
+    'enable_profiling',
+    'get_memory_stats',
+    'get_profile_report',
+    'get_profile_stats',
+    'intersect_dense_pruned',
+    'profiling_enabled',
+    'reset_max_bytes_live',
+    'reset_profile',
 ]
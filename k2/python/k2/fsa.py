@@ -2,16 +2,24 @@
 #
 # See ../../../LICENSE for clarification regarding multiple authors
 
+from typing import List
 from typing import Optional
+from typing import Tuple
 from typing import Union
 
 import torch
 
+from _k2 import _AsyncHandle
 from _k2 import _Fsa
 from _k2 import _as_float
+from _k2 import _ctc_graphs
 from _k2 import _fsa_from_str
 from _k2 import _fsa_from_tensor
 from _k2 import _fsa_to_str
+from _k2 import _fsa_vec_from_arcs
+from _k2 import _fsa_vec_from_tensors
+from _k2 import _linear_fsas
+from _k2 import _ragged_shape_from_tensors
 from graphviz import Digraph
 
 
@@ -106,6 +114,117 @@ class Fsa(object):
         ans._aux_labels = aux_labels
         return ans
 
+    @classmethod
+    def vec_from_tensors(
+            cls,
+            tensors: Union[List[torch.Tensor], torch.Tensor],
+            lengths: Optional[torch.Tensor] = None,
+            aux_labels: Optional[Union[List[torch.Tensor], torch.Tensor]] = None
+    ) -> 'Fsa':
+        '''Build an FsaVec, e.g. a minibatch, from the arcs of its Fsas.
+
+        It is done in one call, without creating an Fsa for each of them.
+
+        Args:
+          tensors:
+            Either a list with the arcs of each Fsa, in the format of
+            `from_tensor`, or a single tensor with the arcs of all of them.
+          lengths:
+            Required if `tensors` is a single tensor, else it must be None.
+            A 1-D tensor of dtype `torch.int32` with the number of arcs of
+            each Fsa; it may contain zeros (for empty Fsas).
+          aux_labels:
+            Optional. The aux_labels of the arcs, in the same form as
+            `tensors`.
+
+        Returns:
+          An instance of Fsa that holds an FsaVec.
+        '''
+        if isinstance(tensors, torch.Tensor):
+            assert lengths is not None
+            fsa_vec = _fsa_vec_from_arcs(tensors, lengths)
+        else:
+            assert lengths is None
+            fsa_vec = _fsa_vec_from_arcs(tensors)
+        if isinstance(aux_labels, list):
+            aux_labels = torch.cat(aux_labels)
+        return cls._create(fsa_vec, aux_labels)
+
+    @classmethod
+    def linear_vec(cls,
+                   symbols: Union[List[List[int]], torch.Tensor],
+                   lengths: Optional[torch.Tensor] = None) -> 'Fsa':
+        '''Build the linear acceptors of a minibatch of symbol sequences,
+        e.g. the transcripts of the utterances, in one call.
+
+        Args:
+          symbols:
+            Either a list with the symbols of each sequence, or a 1-D
+            tensor of dtype `torch.int32` with the symbols of all of them,
+            in which case the Fsas are built on its device.
+          lengths:
+            Required if `symbols` is a tensor, else it must be None. A 1-D
+            tensor of dtype `torch.int32` with the length of each sequence.
+
+        Returns:
+          An instance of Fsa that holds an FsaVec with one Fsa per sequence.
+        '''
+        symbols, lengths = _symbols_and_lengths(symbols, lengths)
+        return cls._create(_linear_fsas(symbols, lengths))
+
+    @classmethod
+    def ctc_vec(cls,
+                tokens: Union[List[List[int]], torch.Tensor],
+                lengths: Optional[torch.Tensor] = None,
+                modified: bool = False) -> 'Fsa':
+        '''Build the CTC graphs of a minibatch of token sequences, e.g. the
+        supervision graphs for CTC training, in one call.
+
+        Each graph accepts the token sequence with blanks (0) allowed
+        before and after every token, and every token repeated, and
+        has the tokens as aux_labels on the arcs that start a token.
+
+        Args:
+          tokens:
+            As `symbols` of `linear_vec`; the tokens must be positive.
+          lengths:
+            As for `linear_vec`.
+          modified:
+            If True, two identical consecutive tokens do not need a blank
+            between them.
+
+        Returns:
+          An instance of Fsa that holds an FsaVec with one Fsa per sequence.
+        '''
+        tokens, lengths = _symbols_and_lengths(tokens, lengths)
+        fsa_vec, aux_labels = _ctc_graphs(tokens, lengths, modified)
+        return cls._create(fsa_vec, aux_labels)
+
+    def __getstate__(self) -> dict:
+        '''Support for pickle and torch.save.
+
+        The state holds the arrays of the binary format of
+        WriteFsaBinary() (the row_splits of each axis, the arcs and the
+        aux_labels) as tensors that share memory with the Fsa, so nothing
+        is converted to text.  With torch.multiprocessing, e.g. from
+        DataLoader workers, the tensors are passed in shared memory, so a
+        batch reaches the trainer without being serialized or copied
+        again.
+        '''
+        shape = self._fsa.shape
+        return {
+            'row_splits':
+            [shape.row_splits(axis) for axis in range(1, shape.num_axes())],
+            'arcs': self._fsa.values.tensor(),
+            'aux_labels': self._aux_labels
+        }
+
+    def __setstate__(self, state: dict) -> None:
+        # The Fsa is built on the tensors themselves, without a copy.
+        shape = _ragged_shape_from_tensors(state['row_splits'])
+        self._fsa = _fsa_vec_from_tensors(shape, state['arcs'])
+        self._aux_labels = state['aux_labels']
+
     def to_str(self, negate_scores: bool = False) -> str:
         '''Convert an Fsa to a string.
 
@@ -146,6 +265,20 @@ class Fsa(object):
         '''
         return _as_float(self._fsa.values.tensor()[:, -1])
 
+    @weights.setter
+    def weights(self, weights: torch.Tensor) -> None:
+        '''Set the weights of arcs in the Fsa.
+
+        The weights are written in place into the arcs; the arcs are not
+        copied.
+
+        Args:
+          weights:
+            A 1-D tensor of dtype `torch.float32` with as many rows as
+            `arcs`, on the same device as the Fsa.
+        '''
+        self.weights.copy_(weights)
+
     @property
     def aux_labels(self) -> Union[torch.Tensor, None]:
         '''Return the aux_labels associated with `arcs`, if any.
@@ -184,6 +317,46 @@ class Fsa(object):
             aux_labels = None
         return Fsa._create(fsa, aux_labels)
 
+    def to_async(self, device: Union[str, torch.device]
+                ) -> Tuple['Fsa', _AsyncHandle]:
+        '''Like `to()`, but it returns as soon as the copy of the arcs is
+        queued on the CUDA stream of the device involved.
+
+        From the CPU to CUDA, the row_splits and arcs (e.g. of a
+        minibatch built in a DataLoader worker) are packed into one
+        pinned buffer and uploaded with a single transfer, and `self`
+        may be modified or freed at once.
+
+        Caution:
+          The arcs of the returned Fsa must not be accessed before
+          `handle.wait()` has been called or `handle.done()` has
+          returned True. The aux_labels (if any) are copied with
+          `torch.Tensor.to()`.
+
+        Args:
+          device:
+            A torch device. Currently it supports only CUDA and CPU devices.
+
+        Returns:
+          A tuple (fsa, handle), where `fsa` is a new Fsa on the given
+          device and `handle` is used to wait for the copy.
+        '''
+        if isinstance(device, str):
+            device = torch.device(device)
+        assert device.type in ['cpu', 'cuda']
+
+        if device.type == 'cuda':
+            fsa, handle = self._fsa.cuda_async(
+                device.index if device.index else -1)
+        else:
+            fsa, handle = self._fsa.cpu_async()
+
+        if self._aux_labels is not None:
+            aux_labels = self._aux_labels.to(device)
+        else:
+            aux_labels = None
+        return Fsa._create(fsa, aux_labels), handle
+
     def to_dot(self) -> Digraph:
         if self._aux_labels is not None:
             name = 'WFST'
@@ -243,3 +416,15 @@ class Fsa(object):
                      dst_state,
                      label=f'{label}{aux_label}/{weight:.2f}')
         return dot
+
+
+def _symbols_and_lengths(
+        symbols: Union[List[List[int]], torch.Tensor],
+        lengths: Optional[torch.Tensor]) -> Tuple[torch.Tensor, torch.Tensor]:
+    if isinstance(symbols, torch.Tensor):
+        assert lengths is not None
+        return symbols, lengths
+    assert lengths is None
+    lengths = torch.tensor([len(s) for s in symbols], dtype=torch.int32)
+    symbols = torch.tensor([i for s in symbols for i in s], dtype=torch.int32)
+    return symbols, lengths
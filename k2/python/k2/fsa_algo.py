@@ -0,0 +1,75 @@
+# Copyright (c)  2026  agent (agent@local)
+#
+# See ../../../LICENSE for clarification regarding multiple authors
+
+from typing import Dict
+from typing import Tuple
+from typing import Union
+
+import torch
+
+from .fsa import Fsa
+from _k2 import _intersect_dense_pruned
+
+
+def intersect_dense_pruned(a_fsas: Fsa, nnet_output: torch.Tensor,
+                           supervision_segments: torch.Tensor, beam: float,
+                           lattice_beam: float, max_active_states: int,
+                           min_active_states: int, return_stats: bool = False
+                          ) -> Union[Tuple[Fsa, torch.Tensor],
+                                     Tuple[Fsa, torch.Tensor,
+                                           Dict[str, torch.Tensor]]]:
+    '''Intersect a decoding graph with the neural-net output of a minibatch,
+    with pruning, and compute the total scores of the resulting lattices.
+
+    The total scores are differentiable w.r.t. `nnet_output`: their backward
+    pass adds up the posteriors of the lattice arcs that used each score of
+    `nnet_output`, without going through Python.
+
+    Args:
+      a_fsas:
+        The decoding graph(s): one Fsa, or an FsaVec with one Fsa per
+        sequence.
+      nnet_output:
+        A tensor of dtype `torch.float` or `torch.half` with shape (N, T, C),
+        e.g. the log-softmax output of the network.
+      supervision_segments:
+        A tensor of dtype `torch.int32` with shape (N, 2); row n is
+        (start_frame, num_frames) of sequence n.
+      beam, lattice_beam, max_active_states, min_active_states:
+        The pruning parameters, see IntersectDensePruned() in
+        k2/csrc/fsa_algo.h.
+      return_stats:
+        If True, also return the per-frame statistics of the search.
+
+    Returns:
+      A tuple (lattices, tot_scores), where `lattices` is an FsaVec with one
+      Fsa per sequence (with the aux_labels of `a_fsas`, if any) and
+      `tot_scores` is a 1-D tensor of dtype `torch.float` with N elements.
+      If `return_stats` is True, the tuple has a third element, a dict of
+      tensors on the device of `nnet_output` with one element per frame
+      (including the frame of the final arcs) of each sequence, frame t of
+      sequence n being at index `row_splits[n] + t`: `row_splits`
+      (N + 1 elements), `active_states`, `expanded_arcs` and `kept_arcs`
+      (the number of states active at the start of the frame, of the arcs
+      leaving them and of those that survived the pruning) and `beams` (the
+      beam used on the frame, after applying max_active_states and
+      min_active_states). See DenseIntersectStats in k2/csrc/fsa_algo.h.
+    '''
+    out, arc_map_a, tot_scores, stats = _intersect_dense_pruned(
+        a_fsas._fsa, nnet_output, supervision_segments, beam, lattice_beam,
+        max_active_states, min_active_states, return_stats)
+    aux_labels = a_fsas.aux_labels
+    if aux_labels is not None:
+        aux_labels = aux_labels[arc_map_a.long()]
+    lattices = Fsa._create(out, aux_labels)
+    if not return_stats:
+        return lattices, tot_scores
+    row_splits, counts, beams = stats
+    return lattices, tot_scores, {
+        'row_splits': row_splits,
+        'active_states': counts[:, 0],
+        'expanded_arcs': counts[:, 1],
+        'kept_arcs': counts[:, 2],
+        'beams': beams
+    }
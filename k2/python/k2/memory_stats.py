@@ -0,0 +1,78 @@
+# Copyright (c)  2026  agent (agent@local)
+#
+# See ../../../LICENSE for clarification regarding multiple authors
+
+from typing import Dict
+from typing import Optional
+from typing import Union
+
+import torch
+
+from _k2 import _MemoryStatsScope
+from _k2 import get_memory_stats as _get_memory_stats
+from _k2 import reset_max_bytes_live as _reset_max_bytes_live
+
+
+def _to_device(device: Union[str, torch.device]) -> torch.device:
+    device = torch.device(device)
+    if device.type == 'cuda' and device.index is None:
+        device = torch.device('cuda', torch.cuda.current_device())
+    return device
+
+
+def get_memory_stats(
+        device: Union[str, torch.device] = 'cpu') -> Dict[str, int]:
+    '''Return the memory allocation and transfer counters of k2 for a device.
+
+    The counters are cumulative since program start; see `MemoryStatsScope`
+    for measuring part of a program. Keys are `num_allocs`, `num_frees`,
+    `bytes_allocated`, `bytes_live`, `max_bytes_live`, `num_syncs`, and
+    `num_copies_<kind>`/`bytes_copied_<kind>` for each kind of copy in
+    `host_to_host`, `host_to_device`, `device_to_host` and
+    `device_to_device`.
+    '''
+    return _get_memory_stats(_to_device(device))
+
+
+def reset_max_bytes_live(device: Union[str, torch.device] = 'cpu') -> None:
+    '''Reset the high-water mark `max_bytes_live` of a device to its
+    current `bytes_live`.
+    '''
+    _reset_max_bytes_live(_to_device(device))
+
+
+class MemoryStatsScope(object):
+    '''A context manager measuring what k2 allocates and copies within it.
+
+    Usage::
+
+        with k2.MemoryStatsScope('cuda:0') as scope:
+            ...
+        print(scope.stats)
+
+    `stats` contains the counters accumulated inside the `with` block,
+    except `bytes_live`, which is the value at exit, and `max_bytes_live`,
+    which is the high-water mark of `bytes_live` inside the block.
+    '''
+
+    def __init__(self, device: Union[str, torch.device] = 'cpu') -> None:
+        self.device = _to_device(device)
+        self.stats: Optional[Dict[str, int]] = None
+        self._scope: Optional[_MemoryStatsScope] = None
+
+    def __enter__(self) -> 'MemoryStatsScope':
+        self._scope = _MemoryStatsScope(self.device)
+        return self
+
+    def __exit__(self, exc_type, exc_value, traceback) -> None:
+        assert self._scope is not None
+        self.stats = self._scope.get()
+        # Destroy it now so that nested scopes are destroyed in order.
+        self._scope = None
+
+    def get(self) -> Dict[str, int]:
+        '''Return the counters so far (may be called inside the block).'''
+        if self._scope is not None:
+            return self._scope.get()
+        assert self.stats is not None
+        return self.stats
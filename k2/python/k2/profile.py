@@ -0,0 +1,48 @@
+# Copyright (c)  2026  agent (agent@local)
+#
+# See ../../../LICENSE for clarification regarding multiple authors
+
+from typing import Dict
+from typing import Union
+
+import _k2
+
+
+def enable_profiling(enable: bool = True) -> None:
+    '''Enable or disable the accumulation of the times of k2's profiled
+    phases (`K2_PROFILE_SCOPE()` in the C++ code).
+
+    It is disabled by default, as on CUDA each phase then records two CUDA
+    events. The phases are NVTX ranges, visible in Nsight Systems, whether
+    or not it is enabled.
+    '''
+    _k2.enable_profiling(enable)
+
+
+def profiling_enabled() -> bool:
+    '''Return True if profiling is enabled, see `enable_profiling`.'''
+    return _k2.profiling_enabled()
+
+
+def reset_profile() -> None:
+    '''Clear the totals returned by `get_profile_stats`.'''
+    _k2.reset_profile()
+
+
+def get_profile_stats() -> Dict[str, Dict[str, Union[int, float]]]:
+    '''Return the totals of each profiled phase since program start or
+    `reset_profile`, while profiling was enabled.
+
+    The keys are phase names, e.g. `IntersectDensePruned:Forward`; the values
+    have keys `count` (number of calls), `cpu_ms` (wall-clock time on the
+    host), `gpu_ms` (time on the CUDA stream) and `gpu_count` (number of
+    calls that ran on CUDA). The times of nested phases are also counted in
+    the enclosing ones. This waits for the CUDA work of the phases.
+    '''
+    return _k2.get_profile_stats()
+
+
+def get_profile_report() -> str:
+    '''Return `get_profile_stats` formatted as a table, sorted by decreasing
+    CPU time.'''
+    return _k2.get_profile_report()
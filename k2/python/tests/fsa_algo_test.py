@@ -0,0 +1,78 @@
+#!/usr/bin/env python3
+#
+# Copyright (c)  2026  agent (agent@local)
+#
+# See ../../../LICENSE for clarification regarding multiple authors
+
+# To run this single test, use
+#
+#  ctest --verbose -R fsa_algo_test_py -E host
+
+import math
+import unittest
+
+import k2
+import torch
+
+
+class TestIntersectDensePruned(unittest.TestCase):
+
+    def test_backward(self):
+        s = '''0 1 1 0.5
+        0 1 2 0
+        1 1 1 0
+        1 2 2 0
+        2 3 -1 0
+        3'''
+        fsa = k2.Fsa('\n'.join(line.strip() for line in s.split('\n')))
+        # Both sequences have the same scores, sequence 0 starting at
+        # frame 1; each has two paths, with scores -1.5 and -3.
+        nnet_output = torch.tensor(
+            [[[-5, -5, -5], [0, -1, -2], [0, -3, -1]],
+             [[0, -1, -2], [0, -3, -1], [-5, -5, -5]]],
+            dtype=torch.float,
+            requires_grad=True)
+        supervision_segments = torch.tensor([[1, 2], [0, 2]],
+                                            dtype=torch.int32)
+        lattices, tot_scores = k2.intersect_dense_pruned(
+            fsa, nnet_output, supervision_segments, 10, 10, 1000, 1)
+        tot = math.log(math.exp(-1.5) + math.exp(-3.0))
+        self.assertTrue(
+            torch.allclose(tot_scores, torch.tensor([tot, tot])))
+        self.assertEqual(lattices.arcs.shape[0], 8)
+
+        (tot_scores * torch.tensor([1.0, 2.0])).sum().backward()
+        p1 = math.exp(-1.5 - tot)
+        p2 = math.exp(-3.0 - tot)
+        expected_grad = torch.tensor(
+            [[[0, 0, 0], [0, p1, p2], [0, 0, 1]],
+             [[0, 2 * p1, 2 * p2], [0, 0, 2], [0, 0, 0]]])
+        self.assertTrue(torch.allclose(nnet_output.grad, expected_grad))
+
+    def test_stats(self):
+        s = '''0 1 1 0.5
+        0 1 2 0
+        1 1 1 0
+        1 2 2 0
+        2 3 -1 0
+        3'''
+        fsa = k2.Fsa('\n'.join(line.strip() for line in s.split('\n')))
+        nnet_output = torch.tensor(
+            [[[-5, -5, -5], [0, -1, -2], [0, -3, -1]],
+             [[0, -1, -2], [0, -3, -1], [-5, -5, -5]]],
+            dtype=torch.float)
+        supervision_segments = torch.tensor([[1, 2], [0, 2]],
+                                            dtype=torch.int32)
+        lattices, tot_scores, stats = k2.intersect_dense_pruned(
+            fsa, nnet_output, supervision_segments, 10, 10, 1000, 1,
+            return_stats=True)
+        # 2 frames and the frame of the final arcs per sequence.
+        self.assertEqual(stats['row_splits'].tolist(), [0, 3, 6])
+        self.assertEqual(stats['active_states'].tolist(), [1, 1, 2] * 2)
+        self.assertEqual(stats['expanded_arcs'].tolist(), [2, 2, 3] * 2)
+        self.assertEqual(stats['kept_arcs'].tolist(), [2, 2, 1] * 2)
+        self.assertTrue(torch.all(stats['beams'] == 10))
+
+
+if __name__ == '__main__':
+    unittest.main()
@@ -8,6 +8,7 @@
 #
 #  ctest --verbose -R fsa_test_py -E host
 
+import pickle
 import unittest
 
 import k2
@@ -137,6 +138,130 @@ class TestFsa(unittest.TestCase):
         assert _remove_leading_spaces(expected_str) == _remove_leading_spaces(
             fsa.to_str(negate_scores=True))
 
+    def test_set_weights(self):
+        s = '''
+            0 1 2 -1.2
+            0 2 10 -2.2
+            1 2 -1 -3.2
+            2
+        '''
+        fsa = k2.Fsa(_remove_leading_spaces(s))
+        arcs = fsa.arcs.clone()
+        weights = fsa.weights
+        fsa.weights = torch.tensor([1, 2, 3], dtype=torch.float32)
+        # the weights are written in place, so `weights` sees them too
+        assert torch.allclose(
+            weights, torch.tensor([1, 2, 3], dtype=torch.float32))
+        assert torch.allclose(fsa.weights, weights)
+        assert torch.all(torch.eq(fsa.arcs, arcs))
+
+    def test_to_async(self):
+        s = '''
+            0 1 2 22 -1.2
+            0 2 10 100 -2.2
+            1 2 -1 16 -3.2
+            2
+        '''
+        fsa = k2.Fsa(_remove_leading_spaces(s))
+        cuda_fsa, handle = fsa.to_async('cuda')
+        handle.wait()
+        assert handle.done()
+        assert cuda_fsa.arcs.device.type == 'cuda'
+        assert cuda_fsa.aux_labels.device.type == 'cuda'
+
+        cpu_fsa, handle = cuda_fsa.to_async('cpu')
+        handle.wait()
+        assert cpu_fsa.arcs.device.type == 'cpu'
+        assert torch.all(torch.eq(cpu_fsa.arcs, fsa.arcs))
+        assert torch.allclose(cpu_fsa.weights, fsa.weights)
+        assert cpu_fsa.to_str() == fsa.to_str()
+
+        # nothing to wait for if the Fsa is already on the device
+        _, handle = cpu_fsa.to_async('cpu')
+        assert handle.done()
+
+    def test_vec_from_tensors(self):
+        s1 = '''
+            0 1 1 0.5
+            0 2 -1 1
+            1 2 -1 1.5
+            2
+        '''
+        s2 = '''
+            0 1 -1 2
+            1
+        '''
+        arcs1 = k2.Fsa(_remove_leading_spaces(s1))._fsa.values.tensor()
+        arcs2 = k2.Fsa(_remove_leading_spaces(s2))._fsa.values.tensor()
+        fsa_vec = k2.Fsa.vec_from_tensors([arcs1, arcs2])
+        assert fsa_vec._fsa.num_axes() == 3
+        assert fsa_vec._fsa.shape.dim0() == 2
+        assert torch.all(
+            torch.eq(fsa_vec._fsa.shape.row_splits(1),
+                     torch.tensor([0, 3, 5], dtype=torch.int32)))
+
+        arcs = torch.cat([arcs1, arcs2])
+        lengths = torch.tensor([3, 0, 1], dtype=torch.int32)
+        fsa_vec = k2.Fsa.vec_from_tensors(arcs, lengths)
+        assert fsa_vec._fsa.shape.dim0() == 3
+        assert torch.all(
+            torch.eq(fsa_vec._fsa.shape.row_splits(1),
+                     torch.tensor([0, 3, 3, 5], dtype=torch.int32)))
+        # the arcs are not copied
+        assert fsa_vec._fsa.values.tensor().data_ptr() == arcs.data_ptr()
+
+    def test_linear_and_ctc_vec(self):
+        fsa_vec = k2.Fsa.linear_vec([[1, 2, 2], [], [3]])
+        assert fsa_vec._fsa.shape.dim0() == 3
+        assert torch.all(
+            torch.eq(fsa_vec._fsa.shape.row_splits(1),
+                     torch.tensor([0, 5, 7, 10], dtype=torch.int32)))
+        arcs = fsa_vec._fsa.values.tensor()
+        assert torch.all(
+            torch.eq(arcs[:, 2],
+                     torch.tensor([1, 2, 2, -1, -1, 3, -1],
+                                  dtype=torch.int32)))
+
+        tokens = torch.tensor([1, 2, 2, 3], dtype=torch.int32)
+        lengths = torch.tensor([3, 0, 1], dtype=torch.int32)
+        ctc = k2.Fsa.ctc_vec(tokens, lengths)
+        assert torch.all(
+            torch.eq(ctc._fsa.shape.row_splits(1),
+                     torch.tensor([0, 8, 10, 14], dtype=torch.int32)))
+        assert ctc._fsa.values.tensor().shape[0] == 25
+        assert ctc.aux_labels.shape[0] == 25
+        # the modified topology has one more arc, between the two 2s.
+        ctc = k2.Fsa.ctc_vec(tokens, lengths, modified=True)
+        assert ctc._fsa.values.tensor().shape[0] == 26
+
+    def test_pickle(self):
+        s = '''
+            0 1 2 22 -1.2
+            0 2 10 100 -2.2
+            1 2 -1 16 -3.2
+            2
+        '''
+        fsa = k2.Fsa(_remove_leading_spaces(s))
+        copy = pickle.loads(pickle.dumps(fsa))
+        assert copy.to_str() == fsa.to_str()
+        assert torch.all(torch.eq(copy.aux_labels, fsa.aux_labels))
+
+        arcs = fsa._fsa.values.tensor()
+        fsa_vec = k2.Fsa.vec_from_tensors(
+            arcs, torch.tensor([3, 0], dtype=torch.int32))
+        copy = pickle.loads(pickle.dumps(fsa_vec))
+        assert copy._fsa.num_axes() == 3
+        assert copy._fsa.shape.dim0() == 2
+        assert torch.all(torch.eq(copy.arcs, fsa_vec.arcs))
+        assert copy.aux_labels is None
+
+        # the unpickled Fsa uses the memory of the unpickled tensors
+        state = fsa_vec.__getstate__()
+        copy = k2.Fsa.__new__(k2.Fsa)
+        copy.__setstate__(state)
+        assert copy._fsa.values.tensor().data_ptr() == \
+            state['arcs'].data_ptr()
+
 
 if __name__ == '__main__':
     unittest.main()
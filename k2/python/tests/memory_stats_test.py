@@ -0,0 +1,52 @@
+#!/usr/bin/env python3
+#
+# Copyright (c)  2026  agent (agent@local)
+#
+# See ../../../LICENSE for clarification regarding multiple authors
+
+# To run this single test, use
+#
+#  ctest --verbose -R memory_stats_test_py
+
+import unittest
+
+import torch
+
+import k2
+
+
+class TestMemoryStats(unittest.TestCase):
+
+    def test_get_memory_stats(self):
+        stats = k2.get_memory_stats('cpu')
+        for key in ('num_allocs', 'num_frees', 'bytes_allocated',
+                    'bytes_live', 'max_bytes_live', 'num_syncs',
+                    'num_copies_host_to_device',
+                    'bytes_copied_device_to_host'):
+            assert key in stats
+        assert stats['max_bytes_live'] >= stats['bytes_live']
+
+    def test_scope(self):
+        with k2.MemoryStatsScope('cpu') as scope:
+            tensor = torch.arange(10, dtype=torch.int32)
+            array = k2.Array(tensor)
+            del array
+        stats = scope.stats
+        assert stats['num_allocs'] >= 1
+        assert stats['num_allocs'] == stats['num_frees']
+        assert stats['bytes_allocated'] >= tensor.numel() * 4
+        assert stats['max_bytes_live'] - stats['bytes_live'] >= 40
+
+    def test_nested_scope(self):
+        with k2.MemoryStatsScope('cpu') as outer:
+            array = k2.Array(torch.zeros(100, dtype=torch.float32))
+            del array
+            with k2.MemoryStatsScope('cpu') as inner:
+                pass
+            assert inner.stats['num_allocs'] == 0
+        assert outer.stats['num_allocs'] >= 1
+        assert outer.stats['max_bytes_live'] - outer.stats['bytes_live'] >= 400
+
+
+if __name__ == '__main__':
+    unittest.main()
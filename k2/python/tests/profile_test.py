@@ -0,0 +1,52 @@
+#!/usr/bin/env python3
+#
+# Copyright (c)  2026  agent (agent@local)
+#
+# See ../../../LICENSE for clarification regarding multiple authors
+
+# To run this single test, use
+#
+#  ctest --verbose -R profile_test_py
+
+import unittest
+
+import torch
+
+import k2
+
+
+class TestProfile(unittest.TestCase):
+
+    def test_profile(self):
+        s = '''0 1 1 0.5
+        0 1 2 0
+        1 1 1 0
+        1 2 2 0
+        2 3 -1 0
+        3'''
+        fsa = k2.Fsa('\n'.join(line.strip() for line in s.split('\n')))
+        nnet_output = torch.tensor(
+            [[[0, -1, -2], [0, -3, -1], [-5, -5, -5]]], dtype=torch.float)
+        supervision_segments = torch.tensor([[0, 2]], dtype=torch.int32)
+
+        k2.reset_profile()
+        k2.enable_profiling()
+        assert k2.profiling_enabled()
+        k2.intersect_dense_pruned(fsa, nnet_output, supervision_segments, 10,
+                                  10, 1000, 1)
+        k2.enable_profiling(False)
+
+        stats = k2.get_profile_stats()
+        assert stats['IntersectDensePruned']['count'] == 1
+        assert stats['IntersectDensePruned:Forward']['count'] == 1
+        assert stats['IntersectDensePruned']['gpu_count'] == 0
+        assert (stats['IntersectDensePruned']['cpu_ms'] >=
+                stats['IntersectDensePruned:Forward']['cpu_ms'])
+        assert 'IntersectDensePruned:Forward' in k2.get_profile_report()
+
+        k2.reset_profile()
+        assert k2.get_profile_stats() == {}
+
+
+if __name__ == '__main__':
+    unittest.main()
@@ -0,0 +1,82 @@
+#!/usr/bin/env python3
+#
+# Copyright (c)  2026  agent (agent@local)
+#
+# See ../../../LICENSE for clarification regarding multiple authors
+
+# To run this single test, use
+#
+#  ctest --verbose -R ragged_test_py -E host
+
+import unittest
+
+import k2
+import torch
+from torch.utils.dlpack import to_dlpack
+
+import _k2  # for test only, users should not import it.
+
+
+class TestRagged(unittest.TestCase):
+
+    def test_ragged_shape_from_tensors(self):
+        row_splits1 = torch.tensor([0, 2, 3], dtype=torch.int32)
+        row_splits2 = torch.tensor([0, 1, 3, 6], dtype=torch.int32)
+        shape = _k2._ragged_shape_from_tensors([row_splits1, row_splits2])
+        assert shape.num_axes() == 3
+        assert shape.dim0() == 2
+        assert shape.total_size(1) == 3
+        assert shape.total_size(2) == 6
+        # the memory is shared
+        row_splits2[3] = 7
+        assert shape.row_splits(2)[3] == 7
+        row_splits2[3] = 6
+        assert torch.all(
+            torch.eq(shape.row_ids(2),
+                     torch.tensor([0, 1, 1, 2, 2, 2], dtype=torch.int32)))
+
+        shape = _k2._ragged_shape_from_tensors(
+            [to_dlpack(row_splits1), to_dlpack(row_splits2)])
+        assert shape.total_size(2) == 6
+        assert shape.row_splits(1).data_ptr() == row_splits1.data_ptr()
+
+    def test_fsa_vec_from_tensors(self):
+        s = '''0 1 1 0.5
+        0 1 2 1.5
+        1 2 -1 2.5
+        2'''
+        fsa = k2.Fsa('\n'.join(line.strip() for line in s.split('\n')))._fsa
+        assert fsa.num_axes() == 2
+        arcs = fsa.values.tensor()
+        shape = _k2._ragged_shape_from_tensors([fsa.shape.row_splits(1)])
+        copy = _k2._fsa_vec_from_tensors(shape, arcs)
+        assert _k2._fsa_to_str(copy) == _k2._fsa_to_str(fsa)
+        assert copy.values.tensor().data_ptr() == arcs.data_ptr()
+
+        copy = _k2._fsa_vec_from_tensors(shape, to_dlpack(arcs))
+        assert _k2._fsa_to_str(copy) == _k2._fsa_to_str(fsa)
+
+    def test_dense_fsa_vec_from_tensors(self):
+        # 2 sequences of up to 3 frames and 2 symbols; the scores are a
+        # slice of a bigger tensor.
+        nnet_output = torch.arange(24, dtype=torch.float32).reshape(2, 3, 4)
+        nnet_output = nnet_output[:, :, 1:3]
+        segments = torch.tensor([[0, 3], [1, 2]], dtype=torch.int32)
+        dense_fsa_vec = _k2._DenseFsaVec(nnet_output, segments)
+        assert dense_fsa_vec.shape.dim0() == 2
+        assert torch.all(
+            torch.eq(dense_fsa_vec.shape.row_splits(1),
+                     torch.tensor([0, 4, 7], dtype=torch.int32)))
+        scores = dense_fsa_vec.scores.tensor()
+        assert scores.shape == (7, 3)
+        assert torch.allclose(scores[0, 1:], nnet_output[0, 0])
+        assert torch.allclose(scores[4, 1:], nnet_output[1, 1])
+        assert scores[3, 0] == 0
+
+        dense_fsa_vec = _k2._DenseFsaVec(to_dlpack(nnet_output),
+                                         to_dlpack(segments))
+        assert torch.allclose(dense_fsa_vec.scores.tensor(), scores)
+
+
+if __name__ == '__main__':
+    unittest.main()